@@ -16,6 +16,10 @@ PubSubClient::PubSubClient() {
     this->stream = NULL;
     setCallback(NULL);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -26,6 +30,10 @@ PubSubClient::PubSubClient(Client& client) {
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -37,6 +45,10 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -47,6 +59,10 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -58,6 +74,10 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -69,6 +89,10 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -80,6 +104,10 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client) {
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -90,6 +118,10 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& s
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -101,6 +133,10 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -112,6 +148,10 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -123,6 +163,10 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client) {
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -133,6 +177,10 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, St
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -144,6 +192,10 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
     setClient(client);
     this->stream = NULL;
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -155,6 +207,10 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
     setClient(client);
     setStream(stream);
     this->bufferSize = 0;
+    this->version = MQTT_VERSION;
+    this->aliasMaximum = 0;
+    this->aliasCount = 0;
+    this->ackCallback = NULL;
     setBufferSize(MQTT_MAX_PACKET_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
@@ -191,6 +247,21 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 }
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const uint8_t* willPayload, unsigned int plength, boolean cleanSession) {
+    if (connected()) {
+        return true;
+    }
+    if (!startConnect(id,user,pass,willTopic,willQos,willRetain,willPayload,plength,cleanSession)) {
+        return false;
+    }
+    while (pollConnect() == MQTT_CONNECTING) {
+    }
+    return _state == MQTT_CONNECTED;
+}
+
+// Sends the CONNECT packet without waiting for the CONNACK; pollConnect()
+// then completes the handshake.  The TCP connect itself still blocks for up
+// to the client's connection timeout unless the client is already connected.
+boolean PubSubClient::startConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const uint8_t* willPayload, unsigned int plength, boolean cleanSession) {
     if (!connected()) {
         int result = 0;
 
@@ -211,16 +282,20 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
             uint16_t length = MQTT_MAX_HEADER_SIZE;
             unsigned int j;
 
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
+            if (this->version == MQTT_VERSION_3_1) {
+                uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION_3_1};
+                for (j = 0;j<sizeof(d);j++) {
+                    this->buffer[length++] = d[j];
+                }
+            } else {
+                uint8_t d[7] = {0x00,0x04,'M','Q','T','T',this->version};
+                for (j = 0;j<sizeof(d);j++) {
+                    this->buffer[length++] = d[j];
+                }
             }
+            // Aliases only last the connection
+            this->aliasMaximum = 0;
+            this->aliasCount = 0;
 
             uint8_t v;
             if (willTopic) {
@@ -243,10 +318,20 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 
             this->buffer[length++] = ((this->keepAlive) >> 8);
             this->buffer[length++] = ((this->keepAlive) & 0xFF);
+            if (this->version == MQTT_VERSION_5) {
+                this->buffer[length++] = 0; // No properties
+            }
 
             CHECK_STRING_LENGTH(length,id)
             length = writeString(id,this->buffer,length);
             if (willTopic) {
+                if (this->version == MQTT_VERSION_5) {
+                    if (length+1 > this->bufferSize) {
+                        _client->stop();
+                        return false;
+                    }
+                    this->buffer[length++] = 0; // No will properties
+                }
                 CHECK_STRING_LENGTH(length,willTopic)
                 length = writeString(willTopic,this->buffer,length);
                 if (length+2+plength > this->bufferSize) {
@@ -270,37 +355,166 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
                 }
             }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+            if (!write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE)) {
+                _state = MQTT_CONNECT_FAILED;
+                _client->stop();
+                return false;
+            }
 
             lastInActivity = lastOutActivity = millis();
+            _state = MQTT_CONNECTING;
+            return true;
+        } else {
+            _state = MQTT_CONNECT_FAILED;
+        }
+        return false;
+    }
+    return true;
+}
 
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
-
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
-            }
+// Checks for the CONNACK after startConnect().  Returns MQTT_CONNECTING while
+// it is still awaited, otherwise the resulting state.
+int PubSubClient::pollConnect() {
+    if (_state != MQTT_CONNECTING) {
+        return _state;
+    }
+    if (!_client->available()) {
+        if (!_client->connected()) {
+            _state = MQTT_CONNECTION_LOST;
+            _client->stop();
+        } else if (millis()-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+            _state = MQTT_CONNECTION_TIMEOUT;
             _client->stop();
+        }
+        return _state;
+    }
+    uint8_t llen;
+    uint32_t len = readPacket(&llen);
+
+    if (this->version == MQTT_VERSION_5 && len > 4) {
+        if (readConnack(llen, len)) {
+            lastInActivity = millis();
+            pingOutstanding = false;
+            _state = MQTT_CONNECTED;
+            return _state;
+        }
+    } else if (len == 4) {
+        if (buffer[3] == 0) {
+            lastInActivity = millis();
+            pingOutstanding = false;
+            _state = MQTT_CONNECTED;
+            return _state;
         } else {
-            _state = MQTT_CONNECT_FAILED;
+            _state = buffer[3];
+            if (this->version == MQTT_VERSION_5 && _state == MQTT_CONNECT_BAD_PROTOCOL) {
+                // A 3.1.1 server's refusal of the protocol level
+                this->version = MQTT_VERSION_3_1_1;
+            }
+        }
+    } else {
+        _state = MQTT_CONNECT_FAILED;
+    }
+    _client->stop();
+    return _state;
+}
+
+// Reads the variable byte integer at buf into value, no further than end.
+// Returns the bytes it took, 0 if it is malformed or runs past end.
+static uint32_t readVarint(const uint8_t* buf, const uint8_t* end, uint32_t* value) {
+    uint32_t n = 0;
+    *value = 0;
+    while (n < 4 && buf + n < end) {
+        *value |= (uint32_t)(buf[n] & 127) << (7 * n);
+        if ((buf[n++] & 128) == 0) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+// Bytes taken by the value of MQTT 5 property id at buf, no further than end;
+// 0 if it's unknown or runs past end.
+static uint32_t propertyLength(uint8_t id, const uint8_t* buf, const uint8_t* end) {
+    uint32_t length;
+    uint32_t value;
+    switch (id) {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        length = 1;
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        length = 2;
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        length = 4;
+        break;
+    case 0x0B:
+        length = readVarint(buf, end, &value);
+        break;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        length = end - buf >= 2 ? 2 + ((buf[0] << 8) | buf[1]) : 0;
+        break;
+    case 0x26: // User property: a pair of strings
+        length = end - buf >= 2 ? 2 + ((buf[0] << 8) | buf[1]) : 0;
+        if (length != 0) {
+            length = end - buf >= length + 2 ? length + 2 + ((buf[length] << 8) | buf[length + 1]) : 0;
         }
+        break;
+    default:
+        return 0;
+    }
+    return (uint32_t)(end - buf) >= length ? length : 0;
+}
+
+// Reads an MQTT 5 CONNACK of len bytes: the reason code, mapped onto the 3.1.1
+// return codes, and the Topic Alias Maximum. Returns true if it accepted the
+// connection.
+boolean PubSubClient::readConnack(uint8_t llen, uint32_t len) {
+    const uint8_t* end = this->buffer + len;
+    uint8_t reason = this->buffer[llen+2];
+    switch (reason) {
+    case 0x00:
+        break;
+    case 0x84: // Unsupported Protocol Version
+        this->version = MQTT_VERSION_3_1_1;
+        _state = MQTT_CONNECT_BAD_PROTOCOL;
+        return false;
+    case 0x85:
+        _state = MQTT_CONNECT_BAD_CLIENT_ID;
+        return false;
+    case 0x86: case 0x8C:
+        _state = MQTT_CONNECT_BAD_CREDENTIALS;
+        return false;
+    case 0x87:
+        _state = MQTT_CONNECT_UNAUTHORIZED;
+        return false;
+    case 0x88: case 0x89:
+        _state = MQTT_CONNECT_UNAVAILABLE;
+        return false;
+    default:
+        _state = MQTT_CONNECT_FAILED;
+        return false;
+    }
+    const uint8_t* p = this->buffer + llen + 3;
+    uint32_t propertiesLength;
+    uint32_t n = readVarint(p, end, &propertiesLength);
+    if (n == 0 || (uint32_t)(end - p - n) < propertiesLength) {
+        _state = MQTT_CONNECT_FAILED;
         return false;
     }
+    p += n;
+    end = p + propertiesLength;
+    while (p < end) {
+        uint8_t id = *p++;
+        uint32_t length = propertyLength(id, p, end);
+        if (length == 0) {
+            break;
+        }
+        if (id == 0x22) {
+            uint16_t maximum = (p[0] << 8) | p[1];
+            this->aliasMaximum = maximum < MQTT_TOPIC_ALIASES ? maximum : MQTT_TOPIC_ALIASES;
+        }
+        p += length;
+    }
     return true;
 }
 
@@ -418,11 +632,22 @@ boolean PubSubClient::loop() {
                         memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
                         this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
                         char *topic = (char*) this->buffer+llen+2;
+                        // MQTT 5 properties follow the topic and msgId; none are used
+                        uint16_t properties = 0;
+                        if (this->version == MQTT_VERSION_5) {
+                            uint16_t pos = llen+3+tl+((this->buffer[0]&0x06) == MQTTQOS1 ? 2 : 0);
+                            uint32_t propertiesLength;
+                            uint32_t n = readVarint(this->buffer+pos, this->buffer+len, &propertiesLength);
+                            if (n == 0 || pos+n+propertiesLength > len) {
+                                return true;
+                            }
+                            properties = n+propertiesLength;
+                        }
                         // msgId only present for QOS>0
                         if ((this->buffer[0]&0x06) == MQTTQOS1) {
                             msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
+                            payload = this->buffer+llen+3+tl+2+properties;
+                            callback(topic,payload,len-llen-3-tl-2-properties);
 
                             this->buffer[0] = MQTTPUBACK;
                             this->buffer[1] = 2;
@@ -432,10 +657,21 @@ boolean PubSubClient::loop() {
                             lastOutActivity = t;
 
                         } else {
-                            payload = this->buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
+                            payload = this->buffer+llen+3+tl+properties;
+                            callback(topic,payload,len-llen-3-tl-properties);
                         }
                     }
+                } else if (type == MQTTPUBACK) {
+                    // An MQTT 5 PUBACK may add a reason code and properties
+                    if (ackCallback && len >= llen+3) {
+                        msgId = (this->buffer[llen+1]<<8)+this->buffer[llen+2];
+                        ackCallback(this, msgId);
+                    }
+                } else if (type == MQTTDISCONNECT) {
+                    // MQTT 5 servers say why they're closing the connection
+                    _state = MQTT_CONNECTION_LOST;
+                    _client->stop();
+                    return false;
                 } else if (type == MQTTPINGREQ) {
                     this->buffer[0] = MQTTPINGRESP;
                     this->buffer[1] = 0;
@@ -467,14 +703,15 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
     if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+(strlen (topic) < this->bufferSize ? strlen (topic) : this->bufferSize) + plength) {
+        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+(strlen (topic) < this->bufferSize ? strlen (topic) : this->bufferSize) + plength +
+                               (this->version == MQTT_VERSION_5 ? MQTT_PUBLISH_PROPERTIES_SIZE : 0)) {
             
             // Too long
             return false;
         }
         // Leave room in the buffer for header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
+        length = writeTopic(topic,this->buffer,length);
 
         // Add payload
         uint16_t i;
@@ -497,41 +734,19 @@ boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean
 }
 
 boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
     unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
     unsigned int i;
-    uint8_t header;
-    unsigned int len;
-    unsigned int expectedLength;
 
     if (!connected()) {
         return false;
     }
-
-    tlen = (strlen (topic) < this->bufferSize ? strlen (topic) : this->bufferSize);
-
-    header = MQTTPUBLISH;
-    if (retained) {
-        header |= 1;
+    if (this->bufferSize < MQTT_PUBLISH_HEADER_SIZE(strlen (topic))) {
+        // Too long
+        return false;
     }
-    this->buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
-        digit = len  & 127; //digit = len %128
-        len >>= 7; //len = len / 128
-        if (len > 0) {
-            digit |= 0x80;
-        }
-        this->buffer[pos++] = digit;
-        llen++;
-    } while(len>0);
-
-    pos = writeString(topic,this->buffer,pos);
 
-    rc += _client->write(this->buffer,pos);
+    size_t hlen = publishHeader(this->buffer, topic, plength, retained);
+    rc += _client->write(this->buffer,hlen);
 
     for (i=0;i<plength;i++) {
         rc += _client->write((char)pgm_read_byte_near(payload + i));
@@ -539,16 +754,14 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
 
     lastOutActivity = millis();
 
-    expectedLength = 1 + llen + 2 + tlen + plength;
-
-    return (rc == expectedLength);
+    return (rc == hlen + plength);
 }
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
     if (connected()) {
         // Send the header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
+        length = writeTopic(topic,this->buffer,length);
         uint8_t header = MQTTPUBLISH;
         if (retained) {
             header |= 1;
@@ -565,6 +778,81 @@ int PubSubClient::endPublish() {
  return 1;
 }
 
+size_t PubSubClient::publishHeader(uint8_t* buf, const char* topic, size_t plength, boolean retained,
+                                   uint8_t qos, uint16_t packetId, boolean dup) {
+    // The topic and properties first, after room for the longest fixed header
+    uint16_t end = writeTopic(topic,buf,MQTT_MAX_HEADER_SIZE,qos > 0 ? packetId : 0);
+    size_t remaining = end - MQTT_MAX_HEADER_SIZE + plength;
+    uint8_t lenBuf[4];
+    uint8_t llen = 0;
+    do {
+        uint8_t digit = remaining & 127;
+        remaining >>= 7;
+        lenBuf[llen++] = remaining > 0 ? digit | 0x80 : digit;
+    } while (remaining > 0 && llen < sizeof(lenBuf));
+    buf[0] = MQTTPUBLISH | (qos > 0 ? MQTTQOS1 : MQTTQOS0) | (dup ? 8 : 0) | (retained ? 1 : 0);
+    memcpy(buf+1, lenBuf, llen);
+    memmove(buf+1+llen, buf+MQTT_MAX_HEADER_SIZE, end-MQTT_MAX_HEADER_SIZE);
+    return 1 + llen + end - MQTT_MAX_HEADER_SIZE;
+}
+
+uint16_t PubSubClient::nextPacketId() {
+    nextMsgId++;
+    if (nextMsgId == 0) {
+        nextMsgId = 1;
+    }
+    return nextMsgId;
+}
+
+// The alias of topic on this connection, 0 if it has none: known is set if the
+// server has been given it already. A topic without one is given the next free
+// alias, if the server allows any more.
+uint16_t PubSubClient::topicAlias(const char* topic, boolean* known) {
+    *known = false;
+    if (strlen(topic) >= MQTT_TOPIC_ALIAS_SIZE) {
+        return 0;
+    }
+    for (uint16_t i = 0; i < this->aliasCount; i++) {
+        if (strcmp(this->aliasTopics[i], topic) == 0) {
+            *known = true;
+            return i + 1;
+        }
+    }
+    if (this->aliasCount >= this->aliasMaximum) {
+        return 0;
+    }
+    strcpy(this->aliasTopics[this->aliasCount], topic);
+    return ++this->aliasCount;
+}
+
+// Writes the topic of a PUBLISH; on an MQTT 5 connection followed by its
+// properties, with the topic's alias, and the topic itself left empty once the
+// server knows the alias. A packetId other than 0 goes between the two.
+uint16_t PubSubClient::writeTopic(const char* topic, uint8_t* buf, uint16_t pos, uint16_t packetId) {
+    boolean known = false;
+    uint16_t alias = 0;
+    if (this->version == MQTT_VERSION_5) {
+        alias = topicAlias(topic, &known);
+    }
+    pos = writeString(known ? "" : topic,buf,pos);
+    if (packetId != 0) {
+        buf[pos++] = (packetId >> 8);
+        buf[pos++] = (packetId & 0xFF);
+    }
+    if (this->version != MQTT_VERSION_5) {
+        return pos;
+    }
+    if (alias != 0) {
+        buf[pos++] = 3;
+        buf[pos++] = 0x23; // Topic Alias
+        buf[pos++] = (alias >> 8);
+        buf[pos++] = (alias & 0xFF);
+    } else {
+        buf[pos++] = 0;
+    }
+    return pos;
+}
+
 size_t PubSubClient::write(uint8_t data) {
     lastOutActivity = millis();
     return _client->write(data);
@@ -642,12 +930,12 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
     if (connected()) {
         // Leave room in the buffer for header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->buffer[length++] = (msgId >> 8);
+        this->buffer[length++] = (msgId & 0xFF);
+        if (this->version == MQTT_VERSION_5) {
+            this->buffer[length++] = 0; // No properties
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
         length = writeString((char*)topic, this->buffer,length);
         this->buffer[length++] = qos;
         return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
@@ -666,12 +954,12 @@ boolean PubSubClient::unsubscribe(const char* topic) {
     }
     if (connected()) {
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+        uint16_t msgId = nextPacketId();
+        this->buffer[length++] = (msgId >> 8);
+        this->buffer[length++] = (msgId & 0xFF);
+        if (this->version == MQTT_VERSION_5) {
+            this->buffer[length++] = 0; // No properties
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
         length = writeString(topic, this->buffer,length);
         return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
     }
@@ -744,6 +1032,11 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::setAckCallback(MQTT_ACK_CALLBACK_SIGNATURE) {
+    this->ackCallback = ackCallback;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
     return *this;
@@ -788,3 +1081,10 @@ PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
     this->socketTimeout = timeout;
     return *this;
 }
+PubSubClient& PubSubClient::setProtocolVersion(uint8_t version) {
+    this->version = version;
+    return *this;
+}
+uint8_t PubSubClient::protocolVersion() {
+    return this->version;
+}
@@ -14,13 +14,26 @@
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
-// MQTT_VERSION : Pick the version
+// MQTT_VERSION : Pick the version. Override with setProtocolVersion()
 //#define MQTT_VERSION MQTT_VERSION_3_1
 #ifndef MQTT_VERSION
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
+// MQTT_TOPIC_ALIASES : Topics given an alias on an MQTT 5 connection, up to the
+//  server's Topic Alias Maximum. A topic's first publish sends the topic and its
+//  alias, later ones the alias only.
+#ifndef MQTT_TOPIC_ALIASES
+#define MQTT_TOPIC_ALIASES 8
+#endif
+
+// MQTT_TOPIC_ALIAS_SIZE : Longest topic given an alias, terminator included
+#ifndef MQTT_TOPIC_ALIAS_SIZE
+#define MQTT_TOPIC_ALIAS_SIZE 64
+#endif
+
 // MQTT_MAX_PACKET_SIZE : Maximum packet size. Override with setBufferSize().
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 256
@@ -42,6 +55,7 @@
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -76,6 +90,12 @@
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
 
+// MQTT 5 PUBLISH properties: their length and a Topic Alias
+#define MQTT_PUBLISH_PROPERTIES_SIZE 4
+// Largest PUBLISH fixed header, remaining length, topic, packet identifier and
+// properties
+#define MQTT_PUBLISH_HEADER_SIZE(topicLength) (MQTT_MAX_HEADER_SIZE + 2 + (topicLength) + 2 + MQTT_PUBLISH_PROPERTIES_SIZE)
+
 #if defined(ESP8266) || defined(ESP32)
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
@@ -83,6 +103,11 @@
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
 #endif
 
+// Called with the packet identifier of each PUBACK received
+#define MQTT_ACK_CALLBACK_SIGNATURE void (*ackCallback)(PubSubClient*, uint16_t)
+
+class PubSubClient;
+
 #define CHECK_STRING_LENGTH(l,s) if (l+2+(strlen (s) < this->bufferSize ? strlen (s) : this->bufferSize) > this->bufferSize) {_client->stop();return false;}
 
 class PubSubClient : public Print {
@@ -97,6 +122,7 @@ private:
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
+   MQTT_ACK_CALLBACK_SIGNATURE;
    uint32_t readPacket(uint8_t*);
    boolean readByte(uint8_t * result);
    boolean readByte(uint8_t * result, uint16_t * index);
@@ -112,6 +138,13 @@ private:
    uint16_t port;
    Stream* stream;
    int _state;
+   uint8_t version;
+   uint16_t aliasMaximum;
+   uint16_t aliasCount;
+   char aliasTopics[MQTT_TOPIC_ALIASES][MQTT_TOPIC_ALIAS_SIZE];
+   uint16_t topicAlias(const char* topic, boolean* known);
+   uint16_t writeTopic(const char* topic, uint8_t* buf, uint16_t pos, uint16_t packetId = 0);
+   boolean readConnack(uint8_t llen, uint32_t len);
 public:
    PubSubClient();
    PubSubClient(Client& client);
@@ -138,6 +171,10 @@ public:
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
+   // MQTT_VERSION_3_1_1 or MQTT_VERSION_5, from the next connect. A server
+   // refusing MQTT 5 leaves the client on 3.1.1 for the attempts after.
+   PubSubClient& setProtocolVersion(uint8_t version);
+   uint8_t protocolVersion();
 
    boolean setBufferSize(uint16_t size);
    uint16_t getBufferSize();
@@ -149,6 +186,8 @@ public:
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const uint8_t* willPayload, unsigned int plength, boolean cleanSession);
+   boolean startConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const uint8_t* willPayload, unsigned int plength, boolean cleanSession);
+   int pollConnect();
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
@@ -168,6 +207,19 @@ public:
    // Finish off this publish message (started with beginPublish)
    // Returns 1 if the packet was sent successfully, 0 if there was an error
    int endPublish();
+   // Build the fixed header, remaining length, topic and properties of a
+   // PUBLISH of plength payload bytes into buf, which must hold
+   // MQTT_PUBLISH_HEADER_SIZE(strlen(topic)) bytes, for a caller writing the
+   // packet itself. Gives the topic an alias if it can, so only call it for a
+   // publish that is then sent. A QoS 1 publish takes a packetId from
+   // nextPacketId(), and dup once it may have been sent before. Returns the
+   // header's length.
+   size_t publishHeader(uint8_t* buf, const char* topic, size_t plength, boolean retained,
+                        uint8_t qos = 0, uint16_t packetId = 0, boolean dup = false);
+   // The next packet identifier for a QoS 1 publish, never 0
+   uint16_t nextPacketId();
+   // Set the function called with each PUBACK's packet identifier
+   PubSubClient& setAckCallback(MQTT_ACK_CALLBACK_SIGNATURE);
    // Write a single byte of payload (only to be used with beginPublish/endPublish)
    virtual size_t write(uint8_t);
    // Write size bytes from buffer into the payload (only to be used with beginPublish/endPublish)
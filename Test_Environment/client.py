@@ -24,6 +24,12 @@ import threading
 import sys
 import random
 import csv
+import struct
+import zlib
+import hashlib
+import atexit
+import collections
+import shutil
 
 import paho.mqtt.client as mqtt
 from sparkplug_b import *
@@ -33,20 +39,42 @@ APP_VERSION             = '1.0'
 COMMS_VERSION           = 2
 COMMS_VERSION_METRIC    = 'Properties/Communications Version'
 BIRTH_DEATH_SEQ_METRIC  = 'bdSeq'
+DEFINITIONS_HASH_METRIC = 'Properties/Definitions Hash'
+KNOWN_DEFINITIONS_METRIC = 'Node Control/Known Definitions'
+COMPRESSED_UUID         = 'SPBV1.0_COMPRESSED'
 NODE_ID                 = 'THERMISTOR'
 NUM_MODULES             = 6
 NUM_THERMISTORS         = 32
+NUM_VIRTUAL_CHANNELS    = 8     # MAX_VIRTUAL_CHANNELS
 DEFAULT_BROKER_URL      = 'localhost'
 DEFAULT_BROKER_PORT     = 1883
 DEFAULT_MODULE_ID       = 0
 SHOW_OPTIONS            = [ 'none', 'errors', 'topic', 'changed', 'all' ]
-CAL_OPTIONS             = [ 'temp1', 'temp2', 'status', 'clear' ]
+CAL_OPTIONS             = [ 'temp1', 'temp2', 'status', 'clear', 'upload', 'fleet' ]
+CAL_UPLOAD_FORMS        = [ 'points', 'linear', 'sh' ]    # In CalUploadForm order
+FLEET_CAL_TIMEOUT_S     = 660   # A node gives up on a calibration point after 600 s
+FIRMWARE_CHUNK_SIZE     = 1024  # OTA_CHUNK_MAX_DATA
+FIRMWARE_STALL_S        = 10    # Resend a chunk the node hasn't answered in this long
+FIRMWARE_RETRIES        = 5     # Give up on a node after this many resends in a row
+FIRMWARE_REBOOT_S       = 120   # The copy and reboot take at most this long
+LOG_BATCH_ROWS          = 256   # In fast mode, log rows are written this many at a time
+LOG_BATCH_S             = 1.0   # or at least this often
+LIVE_HISTORY            = 1000  # Readings of each thermistor kept for the live view
+LIVE_REDRAW_S           = 1.0   # The live view is redrawn this often
+LIVE_LEVELS             = ' ▁▂▃▄▅▆▇█'
+FRAME_GAPS_KEPT         = 1000  # Gaps in the frame numbers remembered, for replays to fill
 
 module_is_alive      = False
+device_control       = set()    # Aliases of the bank Device Control metrics
 compatible_version   = False
+definitions          = {}       # Alias to name map of each NBIRTH definitions hash seen
 gui_controls_created = False
 message_seq          = 0
 cal_started = False
+fleet_nodes          = {}       # Module ID to FleetNode of the fleet calibration in progress
+fleet_report         = []       # Lines of the last fleet calibration's report
+rollout_nodes        = {}       # Module ID to RolloutNode of the firmware rollout in progress
+rollout_report       = []       # Lines of the last firmware rollout's report
 
 date_string = datetime.datetime.now().strftime( '%Y-%m-%d' )
 LOG_FILENAME = f'thermistorMux_test_log_{date_string}.csv'
@@ -73,12 +101,27 @@ class MetricSpec:
         self.value = None
         self.value_str = f'{self.value}'
         self.timestamp = timestamp_str( None )
+        # A quantized thermistor's Scale, Offset and Encoding properties, from NBIRTH
+        self.scale = None
+        self.offset = 0.0
+        self.encoding = None
+        # Last value's timestamp in ms, and the line through the last two
+        # published values, for Predictive Deadband
+        self.time_ms = None
+        self.basis_value = None
+        self.basis_time = None
+        self.slope = 0.0
 
 Metrics = (
     [ MetricSpec( None, f'Inputs/THERMISTOR{thermistor + 1}',       'strip to /', True  ) for thermistor in range( NUM_THERMISTORS ) ] +
+    [ MetricSpec( None, 'Inputs/THERMISTORS',                       'strip to /', False ) ] +
+    [ MetricSpec( None, f'Inputs/VIRTUAL{virtual + 1}',             'strip to /', True  ) for virtual in range( NUM_VIRTUAL_CHANNELS ) ] +
     [ MetricSpec( None, 'Inputs/ADC Internal Temperature',          'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Inputs/Frame Number',                      'strip to /', True  ) ] +
     [ MetricSpec( None, 'Properties/Units',                         'strip to /', True  ) ] +
     [ MetricSpec( None, 'Properties/Firmware Version',              'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Properties/Reset Cause',                   'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Properties/Boot Timeline',                 'strip to /', False ) ] +
     [ MetricSpec( None, 'Properties/Communications Version',        'strip to /', False ) ] +
     [ MetricSpec( None, 'bdSeq',                                    'strip to /', False ) ] +
     [ MetricSpec( None, 'Node Control/Reboot',                      'strip to /', False ) ] +
@@ -88,17 +131,258 @@ Metrics = (
     [ MetricSpec( None, 'Node Control/Calibration Temperature 2',   'strip to /', False ) ] +
     [ MetricSpec( None, 'Properties/Calibration Status',            'strip to /', False ) ] +
     [ MetricSpec( None, 'Node Control/Calibration INW',             'strip to /', False ) ] +
-    [ MetricSpec( None, 'Node Control/Clear Cal Data',              'strip to /', False ) ]
+    [ MetricSpec( None, 'Node Control/Clear Cal Data',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Deadband',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Deadband Percent',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Predictive Deadband',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Heartbeat Interval',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Batch Frames',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Batch Interval',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Outbound Queue Depth',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Outbound Drops',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Outbound Retransmits',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Socket Writes Per Publish',     'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Socket Write Size',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Network Sockets',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Socket Buffer Size',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Network Stack Heap',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Crypto Self Test',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Crypto Record Time',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Broker List',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Broker Fan Out',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Active Broker',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Raw Stream Target',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Burst Capture',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Burst Channels',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Burst Oversampling',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Burst Duration',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Settling Sweep',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Settling Times',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Self Test',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Self Test/Conversion Rates',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Self Test/SPI Read Time',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Self Test/Kernel Cycles',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Self Test/Encode Time',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Self Test/Broker Round Trip',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Scan List',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Averaging Passes',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Frame Period',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/ADC Oversampling',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Channel Mask',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Faulted Channels',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Quiet Channel Interval',      'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Target Noise',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Kalman Process Noise',        'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Kalman Measurement Noise',    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Drift Capture',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Drift Compensation',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Upload',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Stability',       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Calibration Ready',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Firmware Update',             'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Node Control/Firmware Chunk',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Publish Estimate Variance',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Inputs/Estimate Variance',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Sample Schedule',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Dwell Samples',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Frame Banks',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Acquisition Profile',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Spike Filter',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/ADC Temperature Interval',    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/ADC Reference Interval',      'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Sensor Models',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Channel Sensors',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Configuration',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Configuration Hash',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/Definitions Hash',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Known Definitions',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Statistics Window',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Log Level',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Log Binary Trace',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Statistics/Min',                           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Statistics/Max',                           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Statistics/Mean',                          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Statistics/Std Dev',                       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Statistics/Samples',                       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Alarm High Limits',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Alarm Low Limits',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Alarm Rate Limits',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Alarms/High',                              'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Alarms/Low',                               'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Alarms/Rate',                              'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Node Control/Compression Threshold',       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/SD Logging',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/SD Log File',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Properties/SD Log Dropped Frames',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Report Diagnostics',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Acquisition',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Conversion',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Calibration',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Log',                          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Encode',                       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Publish',                      'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frame Rate',                        'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Conversion Rate',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Invalid ADC Data',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/ADC Register Mismatches',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/ADC CRC Errors',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Publish Failures',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Broker Connects',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/bdSeq Increments',                  'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Sample Overruns',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frame Overruns',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Missed ADC Interrupts',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Late ADC Interrupts',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Duplicate ADC Interrupts',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/ADC Recoveries',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Watchdog Recoveries',               'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Link Losses',                       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Commands Busy',                     'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frames Lost',                       'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frames Replayed',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frames Resent',                     'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Max Interrupt Latency',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Frame Phase Error',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Seconds Since Time Sync',           'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/History Fill',                      'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/CPU Utilization',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Stack Free',                   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Heap Used',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Heap Peak',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Diagnostics/Heap Free',                    'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Capture Scan Trace',          'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Dump Scan Trace',             'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 3',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 4',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 5',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 6',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 7',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Calibration Temperature 8',   'strip to /', False ) ] +
+    [ MetricSpec( None, 'Health/Calibration Noise',                 'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Rollup Query',                'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Snapshot Since',              'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Virtual Channels',            'strip to /', False ) ] +
+    [ MetricSpec( None, 'Node Control/Last Value Interval',         'strip to /', False ) ] +
+    [ MetricSpec( None, 'Alarms/Virtual High',                      'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Alarms/Virtual Low',                       'strip to /', True  ) ] +
+    [ MetricSpec( None, 'Alarms/Virtual Rate',                      'strip to /', True  ) ]
     )
 
+# The Metrics by device and name, and by device and the alias each birth gave
+# them, so decoding a message only looks up the metrics it carries
+metric_names   = { ( metric.device, metric.name ): metric for metric in Metrics }
+metric_aliases = {}
+thermistor_metrics = [ metric_names[ ( None, f'Inputs/THERMISTOR{thermistor + 1}' ) ] for thermistor in range( NUM_THERMISTORS ) ]
+frame_number_metric = metric_names[ ( None, 'Inputs/Frame Number' ) ]
+predictive_deadband_metric = metric_names[ ( None, 'Node Control/Predictive Deadband' ) ]
+# The values the module predicts under Predictive Deadband
+predicted_metrics = thermistor_metrics + [ metric for metric in Metrics if metric.name.startswith( 'Inputs/VIRTUAL' ) ] + [
+    metric_names[ ( None, 'Inputs/ADC Internal Temperature' ) ] ]
+
+# The latest readings of each thermistor, °C (None for null), for the live view
+live_history = [ collections.deque( maxlen = LIVE_HISTORY ) for thermistor in range( NUM_THERMISTORS ) ]
+live_channels = { metric: thermistor for thermistor, metric in enumerate( thermistor_metrics ) }
+live_lock = threading.Lock()
+live_started = False
+
+# Accounting of the module's frame numbers (Inputs/Frame Number), which count
+# every frame taken and, unlike seq, don't restart with each NBIRTH.  Live
+# frames should arrive in order; a jump is a gap of missing frames, which a
+# replay of the history after an outage may fill.  Under a deadband, frames
+# with nothing to report leave gaps too.
+class FrameAccounting:
+    def __init__( self ):
+        self.reset()
+
+    def reset( self ):
+        self.last = None        # Highest frame number seen
+        self.gaps = []          # [ first, last ] frame numbers missing, oldest first
+        self.received = 0       # Live frames
+        self.missing = 0        # Live frames skipped over and not replayed since
+        self.duplicates = 0     # Live frames at or before one already seen
+        self.replayed = 0       # Historical frames not seen before
+        self.resent = 0         # Historical frames already held (snapshots)
+        self.restarts = 0       # Times the numbers went back to the start (a cold boot)
+        self.birth = False
+
+    # Take the frame number of one live or historical frame
+    def add( self, number, historical ):
+        if historical and ( self.last == None or number > self.last ):
+            # Replayed before any live frame newer than it
+            self.replayed += 1
+            self.add_gap( number )
+            self.last = number
+            return
+        if historical:
+            for i, gap in enumerate( self.gaps ):
+                if gap[ 0 ] <= number <= gap[ 1 ]:
+                    self.replayed += 1
+                    self.missing -= 1
+                    if gap[ 0 ] == gap[ 1 ]:
+                        del self.gaps[ i ]
+                    elif number == gap[ 0 ]:
+                        gap[ 0 ] += 1
+                    elif number == gap[ 1 ]:
+                        gap[ 1 ] -= 1
+                    else:
+                        self.gaps.insert( i + 1, [ number + 1, gap[ 1 ] ] )
+                        gap[ 1 ] = number - 1
+                    return
+            self.resent += 1
+            return
+        if self.last != None and number <= self.last and self.birth:
+            # A cold boot numbers its frames from 1 again
+            self.restarts += 1
+            self.gaps = []
+            self.last = None
+        self.birth = False
+        self.received += 1
+        if self.last != None and number <= self.last:
+            self.duplicates += 1
+            report( f'Frame {number} received again (last was {self.last})', error = True )
+            return
+        self.add_gap( number )
+        self.last = number
+
+    # Note the frames skipped over to get to number
+    def add_gap( self, number ):
+        if self.last != None and number > self.last + 1:
+            self.missing += number - self.last - 1
+            self.gaps.append( [ self.last + 1, number - 1 ] )
+            if len( self.gaps ) > FRAME_GAPS_KEPT:
+                del self.gaps[ 0 ]
+            report( f'Frames {self.last + 1} to {number - 1} missing' )
+
+    def summary( self ):
+        return ( f'Frames: {self.received} live, last {self.last}, {self.missing} missing ({len( self.gaps )} gaps a replay could fill), '
+                 f'{self.duplicates} duplicates, {self.replayed} replayed, {self.resent} resent, {self.restarts} restarts' )
+
+frame_accounting = FrameAccounting()
+
+# Account for the frame numbers of a data message's frames
+def check_frame_numbers( payload ):
+    for metric in payload.metrics:
+        if metric.name == frame_number_metric.name or ( not metric.name and metric.alias == frame_number_metric.alias ):
+            frame_accounting.add( metric.long_value, metric.is_historical )
+
 # Reset the aliases and/or values for all the metrics of the specified device
 def reset_metrics( device, reset_alias = True ):
+    if reset_alias:
+        for key in [ key for key in metric_aliases if key[ 0 ] == device ]:
+            del metric_aliases[ key ]
     for metric in Metrics:
         if metric.device == device:
             if reset_alias:
                 metric.alias = None
+                metric.scale = None
+                metric.offset = 0.0
+                metric.encoding = None
             metric.value = None
             metric.timestamp = None
+            metric.time_ms = None
+            metric.basis_value = None
+            metric.basis_time = None
+            metric.slope = 0.0
 
 # Reset the aliases and values for all known metrics
 def reset_all_metrics():
@@ -107,27 +391,85 @@ def reset_all_metrics():
 # Find the matching metric in the Metrics list, matching by name if specified,
 # otherwise by alias
 def find_metric( device, name = None, alias = None ):
-    for metric in Metrics:
-        if metric.device == device:
-            if name != None and name != "":
-                if metric.name == name:
-                    return metric
-            elif alias != None and metric.alias == alias:
-                return metric
-    raise ValueError
-
-# Update the values of the metrics in the Metrics list from the payload metrics
+    if name != None and name != "":
+        metric = metric_names.get( ( device, name ) )
+    elif alias != None:
+        metric = metric_aliases.get( ( device, alias ) )
+    else:
+        metric = None
+    if metric == None:
+        raise ValueError
+    return metric
+
+# Take the Scale, Offset and Encoding properties of a birth metric that has them
+def set_metric_properties( metric_spec, metric ):
+    for key, value in zip( metric.properties.keys, metric.properties.values ):
+        if key == 'Scale':
+            metric_spec.scale = value.double_value
+        elif key == 'Offset':
+            metric_spec.offset = value.double_value
+        elif key == 'Encoding':
+            metric_spec.encoding = value.string_value
+
+# Values packed as the zigzag varints of each one's difference from the one before
+def unpack_zigzag_deltas( data ):
+    values = []
+    last = 0
+    shift = 0
+    zigzag = 0
+    for byte in data:
+        zigzag |= ( byte & 0x7F ) << shift
+        shift += 7
+        if byte < 0x80:
+            last += ( zigzag >> 1 ) ^ -( zigzag & 1 )
+            values.append( last )
+            shift = 0
+            zigzag = 0
+    return values
+
+# A quantized value in °C; None stays None and INT16_MIN is null
+def scale_value( metric_spec, value ):
+    if metric_spec.scale is None or value is None:
+        return value
+    if value == -32768:
+        return None
+    return round( value * metric_spec.scale + metric_spec.offset, 4 )
+
+# Update the values of the metrics in the Metrics list from the payload metrics.
+# Returns the metrics updated.
 def update_metrics( device, payload, set_alias = False ):
+    updated = []
     for metric in payload.metrics:
+        # Frames replayed after an outage are older than the values we hold
+        if metric.is_historical:
+            continue
+        # A bank's Device Control metrics are commands, not data
+        if metric.name.startswith( 'Device Control/' ) or ( not metric.name and metric.alias in device_control ):
+            if set_alias:
+                device_control.add( metric.alias )
+            continue
+        # The channel template definition only describes the instances
+        if metric.datatype == MetricDataType.Template and metric.template_value.is_definition:
+            continue
         try:
             if set_alias:
                 metric_spec = find_metric( device, metric.name )
                 metric_spec.alias = metric.alias
+                metric_aliases[ ( device, metric.alias ) ] = metric_spec
+                set_metric_properties( metric_spec, metric )
             else:
                 metric_spec = find_metric( device, metric.name, metric.alias )
 
             if metric.datatype == MetricDataType.Boolean:
                 metric_spec.value = metric.boolean_value
+            elif metric.datatype == MetricDataType.Int16:
+                # The low 16 bits are the two's complement
+                value = metric.int_value & 0xFFFF
+                value = None if metric.is_null else value - ( 1 << 16 ) if value >= ( 1 << 15 ) else value
+                metric_spec.value = scale_value( metric_spec, value )
+            elif metric.datatype == MetricDataType.Int32:
+                # Sent as the two's complement in an unsigned field
+                metric_spec.value = metric.int_value - ( 1 << 32 ) if metric.int_value >= ( 1 << 31 ) else metric.int_value
             elif metric.datatype == MetricDataType.Int64:
                 metric_spec.value = metric.long_value
             elif metric.datatype == MetricDataType.UInt64:
@@ -136,18 +478,78 @@ def update_metrics( device, payload, set_alias = False ):
                 metric_spec.value = metric.float_value
             elif metric.datatype == MetricDataType.String:
                 metric_spec.value = metric.string_value
+            elif metric.datatype == MetricDataType.Bytes and metric_spec.encoding == 'zigzag-varint-delta':
+                metric_spec.value = [ scale_value( metric_spec, value ) for value in unpack_zigzag_deltas( metric.bytes_value ) ]
+            elif metric.datatype == MetricDataType.Bytes:
+                metric_spec.value = bytes( metric.bytes_value )
+            elif metric.datatype == MetricDataType.FloatArray:
+                metric_spec.value = list( struct.unpack( f'<{len( metric.bytes_value ) // 4}f', metric.bytes_value ) )
+            elif metric.datatype == MetricDataType.Int32Array:
+                metric_spec.value = list( struct.unpack( f'<{len( metric.bytes_value ) // 4}i', metric.bytes_value ) )
+            elif metric.datatype == MetricDataType.Template:
+                # A ThermistorChannel instance; NDATA only carries the members that changed
+                for member in metric.template_value.metrics:
+                    if member.name == 'Value':
+                        if member.is_null:
+                            metric_spec.value = None
+                        elif member.datatype == MetricDataType.Int32:
+                            metric_spec.value = member.int_value - ( 1 << 32 ) if member.int_value >= ( 1 << 31 ) else member.int_value
+                        else:
+                            metric_spec.value = member.float_value
             else:
                 report( f'Unexpected data type {metric.datatype} for {metric_spec.name}', error = True )
                 continue
 
             metric_spec.timestamp = timestamp_str( metric.timestamp )
+            metric_spec.time_ms = metric.timestamp
+            updated.append( metric_spec )
+
+            # The array profile sends all the thermistors in one metric; spread
+            # it over the per-channel metrics so they display and log as usual
+            if metric_spec.name == 'Inputs/THERMISTORS':
+                for channel_spec, value in zip( thermistor_metrics, metric_spec.value ):
+                    channel_spec.value = value
+                    channel_spec.timestamp = metric_spec.timestamp
+                    channel_spec.time_ms = metric.timestamp
+                updated += thermistor_metrics[ : len( metric_spec.value ) ]
         except ValueError:
             report( f'Unrecognized metric: device={device}, name="{metric.name}", alias={metric.alias}', error = True )
+    return updated
+
+# Under Predictive Deadband the module only publishes a channel when it leaves
+# the line through its last two published values by more than the deadband.
+# Follow the same lines, and fill in the values of the channels left out of an
+# NDATA from them, so they show and log as measured, to within the deadband.
+# The lines start over with each NBIRTH, and when Predictive Deadband changes.
+def predict_values( payload, updated ):
+    if predictive_deadband_metric in updated:
+        for metric in predicted_metrics:
+            metric.basis_value = None
+            metric.basis_time = None
+            metric.slope = 0.0
+    if not predictive_deadband_metric.value:
+        return
+    # The frame's time, which whatever is published carries
+    now = frame_number_metric.time_ms if frame_number_metric in updated else payload.timestamp
+    for metric in predicted_metrics:
+        if metric in updated:
+            if ( metric.basis_time != None and metric.time_ms > metric.basis_time and
+                 metric.value != None and metric.basis_value != None ):
+                metric.slope = ( metric.value - metric.basis_value ) / ( metric.time_ms - metric.basis_time )
+            else:
+                metric.slope = 0.0
+            metric.basis_value = metric.value
+            metric.basis_time = metric.time_ms
+        elif metric.basis_time != None and metric.basis_value != None:
+            metric.value = metric.basis_value + metric.slope * ( now - metric.basis_time )
+            metric.timestamp = timestamp_str( now )
+            metric.time_ms = now
+            updated.append( metric )
 
 # Display how this program should be called, then exit
 def show_usage():
     print( f'Thermistor Mux Client v{APP_VERSION}' )
-    print( f'Usage: {sys.argv[ 0 ]} [no_gui] [broker=[BROKER_IP][=BROKER_PORT]] [module=MODULE_ID] [reboot] [show=SHOW_WHAT] [log] [exit]' )
+    print( f'Usage: {sys.argv[ 0 ]} [no_gui] [broker=[BROKER_IP][=BROKER_PORT]] [module=MODULE_ID] [reboot] [show=SHOW_WHAT] [log] [live] [fast] [exit]' )
     print( f'where no_gui = run the command-line interface instead of the GUI' )
     print( f'      BROKER_IP = hostname or IP address of MQTT broker (default {DEFAULT_BROKER_URL})' )
     print( f'      BROKER_PORT = port number of MQTT broker (default {DEFAULT_BROKER_PORT})' )
@@ -160,6 +562,8 @@ def show_usage():
     print( f'          changed = display the message topic and only those metrics it contains (the default)' )
     print( f'          all = display the message topic and all the metrics from this module' )
     print( f'      log = log inbound data messages to a CSV file with filename thermistorMux_test_log_DATE.csv' )
+    print( f'      live = show a live view of every thermistor\'s recent readings, redrawn every {LIVE_REDRAW_S:g} s, instead of each message\'s metrics' )
+    print( f'      fast = high-rate mode: only format the metrics each message updates, and write the log in batches from a thread of its own' )
     print( f'      exit = exit as soon as command-line commands are issued' )
     sys.exit()
 
@@ -171,8 +575,9 @@ def report( msg, error = False, always = False ):
             if option_show == 'none':
                 # Don't display any messages
                 return
-            if option_show == 'errors' and not error:
-                # Don't display any non-error messages
+            if ( option_show == 'errors' or option_live ) and not error:
+                # Don't display any non-error messages; the live view has
+                # the screen
                 return
         if error:
             msg = '*** ' + msg + ' ***'
@@ -194,16 +599,38 @@ def set_module_topics( new_module_id ):
     NODE_DATA_TOPIC  = node_topic( new_module_id, 'NDATA' )
     global NODE_CMD_TOPIC
     NODE_CMD_TOPIC   = node_topic( new_module_id, 'NCMD' )
+    # The retained last value, outside the Sparkplug namespace
+    global NODE_LAST_VALUE_TOPIC
+    NODE_LAST_VALUE_TOPIC = f'VI/LAST_VALUE/{NODE_ID}{new_module_id}'
+    # Firmware built with USE_DEVICE_BANKS publishes the thermistors as one
+    # device per bank, spBv1.0/VI/DDATA/THERMISTORn/Bank1 onwards
+    global DEVICE_TOPICS
+    DEVICE_TOPICS    = [ node_topic( new_module_id, message_type ) + '/+' for message_type in [ 'DBIRTH', 'DDEATH', 'DDATA' ] ]
+
+# The message type of a device topic ('DBIRTH', 'DDEATH' or 'DDATA') and its
+# device ID, or None if it isn't one of this module's device topics
+def device_message( topic ):
+    for device_topic in DEVICE_TOPICS:
+        prefix = device_topic[ :-1 ]
+        if topic.startswith( prefix ) and '/' not in topic[ len( prefix ): ]:
+            return topic.split( '/' )[ 2 ], topic[ len( prefix ): ]
+    return None
 
 def subscribe_data( client ):
     client.subscribe( NODE_BIRTH_TOPIC )
     client.subscribe( NODE_DEATH_TOPIC )
     client.subscribe( NODE_DATA_TOPIC )
+    client.subscribe( NODE_LAST_VALUE_TOPIC )
+    for topic in DEVICE_TOPICS:
+        client.subscribe( topic )
 
 def unsubscribe_data( client ):
     client.unsubscribe( NODE_BIRTH_TOPIC )
     client.unsubscribe( NODE_DEATH_TOPIC )
     client.unsubscribe( NODE_DATA_TOPIC )
+    client.unsubscribe( NODE_LAST_VALUE_TOPIC )
+    for topic in DEVICE_TOPICS:
+        client.unsubscribe( topic )
 
 
 # Switch to a different module
@@ -227,6 +654,12 @@ def change_module( module_id, client ):
     # Set the topics for the new module
     set_module_topics( module_id )
 
+    # The live view and the frame accounting start again with the new module's readings
+    with live_lock:
+        for history in live_history:
+            history.clear()
+    frame_accounting.reset()
+
     # Connect to the new module
     connect_to_module( client )
 
@@ -260,8 +693,11 @@ def connect_to_module( client ):
 
 def client_loop():
     while not close_thread:
-        time.sleep( 0.1 )
-        client.loop()
+        # Waits up to 0.1 s for a message rather than sleeping, so a busy
+        # module's messages are taken as fast as they come
+        client.loop( timeout = 0.1 )
+        check_fleet_timeouts()
+        check_rollout_stalls()
 
 def on_connect( client, userdata, flags, rc ):
     if rc == 0:
@@ -292,12 +728,30 @@ def on_message( client, userdata, msg ):
     except:
         report( f'Could not parse "{msg.topic}" message', error = True, always = False )
         return
+    if payload.uuid == COMPRESSED_UUID:
+        try:
+            payload = decompress_payload( payload )
+        except ( zlib.error, ValueError ):
+            report( f'Could not decompress "{msg.topic}" message', error = True, always = False )
+            return
+    for_fleet = fleet_message( msg.topic, payload )
+    for_rollout = rollout_message( msg.topic, payload )
+    if for_fleet or for_rollout:
+        return
 
     if option_no_GUI and option_show == 'all':
         report( f'   timestamp = {timestamp_str( payload.timestamp )}' )
         report( f'   seq = {payload.seq}' )
         report( f'   num_metrics = {len( payload.metrics )}' )
 
+    # The retained last value shows the module straight away, until its next
+    # birth; it has names and the birth's aliases, but no seq
+    if msg.topic == NODE_LAST_VALUE_TOPIC:
+        if not module_is_alive:
+            updated = update_metrics( None, payload, set_alias = True )
+            display_metrics( msg.topic, payload, False, updated )
+        return
+
     # Check the message seq number
     check_message_sequence( msg.topic, payload )
 
@@ -308,6 +762,13 @@ def on_message( client, userdata, msg ):
         # Reset the aliases and values for all the known metrics
         reset_all_metrics()
 
+        # A birth without names needs the definitions of an earlier one
+        definitions_hash = name_birth_metrics( payload )
+        if definitions_hash == None:
+            report( 'NBIRTH without names has unknown definitions, requesting a rebirth', error = True )
+            request_rebirth()
+            return
+
         # Check that the module is using a compatible communications interface
         if not check_comms_version( payload ):
             return
@@ -316,8 +777,12 @@ def on_message( client, userdata, msg ):
         check_birth_death_sequence( payload, is_expected = True, must_match = False )
 
         # Update the values of the node metrics
-        update_metrics( None, payload, set_alias = True )
-        display_metrics( msg.topic, payload, option_log )
+        updated = update_metrics( None, payload, set_alias = True )
+        display_metrics( msg.topic, payload, option_log, updated )
+        frame_accounting.birth = True
+
+        # Let the module leave the names out of its births from now on
+        confirm_definitions( definitions_hash )
     elif not module_is_alive:
         report( 'Module is dead, message ignored', error = True )
         return
@@ -329,20 +794,66 @@ def on_message( client, userdata, msg ):
         check_birth_death_sequence( payload, is_expected = False, must_match = False )
 
         # Update the values of the node metrics
-        update_metrics( None, payload, set_alias = False )
-        display_metrics( msg.topic, payload, option_log )
+        updated = update_metrics( None, payload, set_alias = False )
+        predict_values( payload, updated )
+        display_metrics( msg.topic, payload, option_log, updated )
+        check_frame_numbers( payload )
     elif msg.topic == NODE_DEATH_TOPIC:
         # Report if Birth/Death Sequence number doesn't match the last NBIRTH
         check_birth_death_sequence( payload, is_expected = True, must_match = True )
 
         # Update the values of any node metrics in the NDEATH payload
-        update_metrics( None, payload, set_alias = False )
-        display_metrics( msg.topic, payload, option_log )
+        updated = update_metrics( None, payload, set_alias = False )
+        display_metrics( msg.topic, payload, option_log, updated )
 
         module_is_alive = False
+    elif device_message( msg.topic ):
+        # A bank's thermistors keep their node-wide names and aliases, so they
+        # update the same metrics as in NDATA
+        message_type, device = device_message( msg.topic )
+        if message_type == 'DDEATH':
+            report( f'{device} is offline' )
+            return
+        check_birth_death_sequence( payload, is_expected = False, must_match = False )
+        updated = update_metrics( None, payload, set_alias = ( message_type == 'DBIRTH' ) )
+        if message_type == 'DDATA':
+            predict_values( payload, updated )
+        display_metrics( msg.topic, payload, option_log, updated )
     else:
         report( f'Unknown message received: {msg.topic}, with {len( payload.metrics )} metrics', error = True )
 
+# Fill in the names of an NBIRTH sent alias-only, from the definitions of an
+# earlier NBIRTH with the same definitions hash, and remember the definitions
+# of one with names.  Returns the definitions hash, 0 if the module doesn't send
+# one, or None for a birth without names whose definitions we don't have.
+def name_birth_metrics( payload ):
+    definitions_hash = 0
+    for metric in payload.metrics:
+        if metric.name == DEFINITIONS_HASH_METRIC:
+            definitions_hash = metric.long_value
+    if all( metric.name for metric in payload.metrics ):
+        if definitions_hash:
+            definitions[ definitions_hash ] = { metric.alias: metric.name for metric in payload.metrics }
+        return definitions_hash
+    names = definitions.get( definitions_hash )
+    if names == None or any( not metric.name and metric.alias not in names for metric in payload.metrics ):
+        return None
+    for metric in payload.metrics:
+        if not metric.name:
+            metric.name = names[ metric.alias ]
+    return definitions_hash
+
+# Tell the module we hold the definitions with this hash, unless it knows
+def confirm_definitions( definitions_hash ):
+    try:
+        if not definitions_hash or find_metric( None, KNOWN_DEFINITIONS_METRIC ).value == definitions_hash:
+            return
+        payload = get_cmd_payload()
+        add_metric_as_alias( payload, None, KNOWN_DEFINITIONS_METRIC, MetricDataType.Int64, definitions_hash )
+        client.publish( NODE_CMD_TOPIC, bytearray( payload.SerializeToString() ), 0, False )
+    except ValueError:
+        pass
+
 # Check the communications version in the received payload and return True if
 # it's compatible with this program, or False if it isn't
 def check_comms_version( payload ):
@@ -445,8 +956,9 @@ def check_birth_death_sequence( payload, is_expected, must_match ):
     # Birth/Death Sequence number is as expected
     return True
 
-# Display and/or log the values of the metrics
-def display_metrics( topic, payload, save_to_log ):
+# Display and/or log the values of the metrics.  In fast mode only the updated
+# metrics are formatted again, except after a birth.
+def display_metrics( topic, payload, save_to_log, updated ):
     # Get the measurement units value
     units = '?'
     try:
@@ -457,22 +969,32 @@ def display_metrics( topic, payload, save_to_log ):
         pass
 
     # Set the value string for each metric
-    for metric in Metrics:
+    for metric in updated if option_fast and topic != NODE_BIRTH_TOPIC else Metrics:
         if metric.value == None:
             metric.value_str = f'{metric.value}'
+        elif isinstance( metric.value, list ):
+            metric.value_str = f'{len( metric.value )} values'
+        elif isinstance( metric.value, bytes ):
+            metric.value_str = metric.value.hex()
+        elif metric.name in [ 'Properties/Configuration Hash', DEFINITIONS_HASH_METRIC, KNOWN_DEFINITIONS_METRIC ]:
+            metric.value_str = f'{metric.value:08x}'
         elif metric.name.startswith( 'Inputs/THERMISTOR' ):
+            # Milli-degree firmware sends whole m°C
+            value = metric.value / 1000 if units == 'm°C' else metric.value
+            metric.value_str = f'{value:.3f} °C'
+        elif metric.name.startswith( 'Inputs/VIRTUAL' ):
             metric.value_str = f'{metric.value:.3f} °C'
         elif metric.name == 'Inputs/ADC Internal Temperature':
             metric.value_str = f'{metric.value:.2f} °C'
-        elif metric.name == 'Node Control/Calibration Temperature 1':
-            metric.value_str = f'{metric.value:.2f}'
-        elif metric.name == 'Node Control/Calibration Temperature 2':
+        elif metric.name.startswith( 'Node Control/Calibration Temperature' ):
             metric.value_str = f'{metric.value:.2f}'
         else:
             metric.value_str = f'{metric.value}'
 
     if option_no_GUI:
-        if option_show in [ 'changed', 'all' ]:
+        if option_live:
+            add_to_live_view( updated, units )
+        elif option_show in [ 'changed', 'all' ]:
             show_data_on_command_line( payload )
     else:
         show_data_on_GUI()
@@ -502,6 +1024,71 @@ def show_data_on_command_line( payload ):
         print( f'{metric.display_name} at {metric.timestamp} = {metric.value_str}' )
         
 
+# Add the thermistor readings just updated to their live view histories
+def add_to_live_view( updated, units ):
+    with live_lock:
+        for metric in updated:
+            thermistor = live_channels.get( metric )
+            if thermistor != None:
+                value = metric.value / 1000 if metric.value != None and units == 'm°C' else metric.value
+                live_history[ thermistor ].append( value )
+
+# One character per column of a thermistor's history, each standing for the
+# readings that fall in it.  A column shows whichever of its min and max is
+# further from the mean, scaled from the lowest to the highest reading, so a
+# spike shows however many readings are squeezed into the column.
+def live_line( values, width ):
+    readings = [ value for value in values if value != None ]
+    if not readings:
+        return ' ' * width, None, None
+    low = min( readings )
+    high = max( readings )
+    mean = sum( readings ) / len( readings )
+    span = high - low
+    line = ''
+    for column in range( width ):
+        start = column * len( values ) // width
+        end = max( start + 1, ( column + 1 ) * len( values ) // width )
+        in_column = [ value for value in values[ start : end ] if value != None ] if start < len( values ) else []
+        if not in_column:
+            line += ' '
+            continue
+        low_point = min( in_column )
+        high_point = max( in_column )
+        value = high_point if high_point - mean >= mean - low_point else low_point
+        level = 1 + round( ( value - low ) / span * ( len( LIVE_LEVELS ) - 2 ) ) if span > 0 else len( LIVE_LEVELS ) // 2
+        line += LIVE_LEVELS[ level ]
+    return line, low, high
+
+# Redraw the live view of every thermistor, every LIVE_REDRAW_S, whatever the
+# message rate
+def live_view_loop():
+    while not close_thread:
+        time.sleep( LIVE_REDRAW_S )
+        if not option_live:
+            continue
+        with live_lock:
+            histories = [ list( history ) for history in live_history ]
+        columns = shutil.get_terminal_size().columns
+        width = max( 10, columns - 40 )
+        lines = [ f'{NODE_DATA_TOPIC.split( "/" )[ -1 ]}, last {LIVE_HISTORY} readings of each thermistor (°C)' ]
+        for thermistor, values in enumerate( histories ):
+            line, low, high = live_line( values, width )
+            last = next( ( value for value in reversed( values ) if value != None ), None )
+            numbers = f'{last:9.3f} [{low:.3f}, {high:.3f}]' if last != None else f'{"null":>9}'
+            lines.append( f'{thermistor + 1:2} {line} {numbers}' )
+        # Home the cursor and clear the screen before drawing
+        print( '\x1b[H\x1b[2J' + '\n'.join( lines ), flush = True )
+
+# Turn the live view on or off
+def set_live_view( live ):
+    global option_live
+    global live_started
+    option_live = live
+    if live and not live_started:
+        live_started = True
+        threading.Thread( target = live_view_loop, daemon = True ).start()
+
 LJUST_DIST = 50
 
 # Display current metric values on the GUI
@@ -527,7 +1114,49 @@ def show_data_on_GUI():
             values += f'{metric.value_str}\n'
 
 
+# Buffers log rows and writes them in batches from a thread of its own, so
+# logging doesn't hold up the MQTT thread at high frame rates
+class BatchLog:
+    def __init__( self, filename ):
+        self.filename = filename
+        self.field_names = None
+        self.rows = []
+        self.ready = threading.Condition()
+        threading.Thread( target = self.run, daemon = True ).start()
+        atexit.register( self.flush )
+
+    def add( self, field_names, row_values ):
+        with self.ready:
+            self.field_names = field_names
+            self.rows.append( row_values )
+            if len( self.rows ) >= LOG_BATCH_ROWS:
+                self.ready.notify()
+
+    def run( self ):
+        while True:
+            with self.ready:
+                self.ready.wait( LOG_BATCH_S )
+            self.flush()
+
+    # Write the rows buffered so far
+    def flush( self ):
+        with self.ready:
+            field_names, rows, self.rows = self.field_names, self.rows, []
+        if not rows:
+            return
+        try:
+            with open( self.filename, mode = 'a+', newline = '' ) as log_file:
+                log_writer = csv.writer( log_file, delimiter = ',', quotechar = '"', quoting = csv.QUOTE_MINIMAL )
+                if log_file.tell() == 0:
+                    log_writer.writerow( field_names )
+                log_writer.writerows( rows )
+        except Exception as e:
+            report( f'CSV Log: error occurred: {e}', error = True, always = True )
+
+batch_log = None
+
 def log_data_to_CSV( timestamp, topic ):
+    global batch_log
     field_names = []
     row_values = []
     field_names.append( 'TIMESTAMP' )
@@ -539,6 +1168,11 @@ def log_data_to_CSV( timestamp, topic ):
         if metric.log_data:
             field_names.append( metric.display_name )
             row_values.append( metric.value_str )
+    if option_fast:
+        if batch_log == None:
+            batch_log = BatchLog( LOG_FILENAME )
+        batch_log.add( field_names, row_values )
+        return
     try:
         with open( LOG_FILENAME, mode = 'a+', newline = '' ) as log_file:
             log_writer = csv.writer( log_file, delimiter = ',', quotechar = '"', quoting = csv.QUOTE_MINIMAL )
@@ -636,7 +1270,379 @@ def send_cal_command(temp1, temp2, clear):
             report( 'Module calibration status requested', always = True )
 
     
-             
+
+# Build a calibration upload (see thermistorMux_calupload.cpp) from a text file:
+# the form (points, linear or sh) on the first line, for points the reference
+# temperatures and for sh the low and high temperatures on the second, then one
+# line per thermistor of comma separated values, "-" for one left uncalibrated.
+def make_cal_upload( path ):
+    with open( path ) as file:
+        lines = [ line.strip() for line in file if line.strip() and not line.startswith( '#' ) ]
+    form = lines[ 0 ].lower()
+    if form not in CAL_UPLOAD_FORMS:
+        raise ValueError( f'form must be one of {CAL_UPLOAD_FORMS}' )
+    lead = []
+    if form != 'linear':
+        lead = [ float( value ) for value in lines[ 1 ].split( ',' ) ]
+    rows = lines[ 1 if form == 'linear' else 2: ]
+    if len( rows ) != NUM_THERMISTORS:
+        raise ValueError( f'{len( rows )} thermistors given, must be {NUM_THERMISTORS}' )
+    points = { 'points': len( lead ), 'linear': 2, 'sh': 8 }[ form ]
+    width = { 'points': points, 'linear': 2, 'sh': 3 }[ form ]
+    values = []
+    for row in rows:
+        row_values = [ float( 'nan' ) ] * width if row == '-' else [ float( value ) for value in row.split( ',' ) ]
+        if len( row_values ) != width:
+            raise ValueError( f'"{row}" must have {width} values' )
+        values += row_values
+    blob = struct.pack( '<HBBBBH', 0x5543, 1, CAL_UPLOAD_FORMS.index( form ), NUM_THERMISTORS, points, 0 )
+    blob += struct.pack( f'<{len( lead ) + len( values )}f', *( lead + values ) )
+    return blob + struct.pack( '<I', zlib.crc32( blob ) )
+
+def send_cal_upload( path ):
+    try:
+        blob = make_cal_upload( path )
+    except ( OSError, ValueError, IndexError ) as error:
+        report( f'Invalid calibration file: {error}', error = True, always = True )
+        return False
+    payload = get_cmd_payload()
+    add_metric_as_alias( payload, None, 'Node Control/Calibration Upload', MetricDataType.Bytes, bytes( blob ) )
+    client.publish( NODE_CMD_TOPIC, bytearray( payload.SerializeToString() ), 0, False )
+    report( f'Calibration upload of {len( blob )} bytes sent', always = True )
+    return True
+
+# A module taking part in a fleet calibration.  Only the calibration metrics
+# are followed, by name from its NBIRTH and by alias from then on.
+class FleetNode:
+    def __init__( self, module_id, point, ref_temp ):
+        self.module_id = module_id
+        self.point = point
+        self.ref_temp = ref_temp
+        self.names = {}         # Alias to name, from the NBIRTH
+        self.values = {}        # Name to value of the calibration metrics
+        self.subscribed = False
+        self.state = 'waiting for NBIRTH'
+        self.created = time.time()
+        self.sent = None        # time.time() the calibration command went out
+        self.finished = None
+        self.result = None
+
+    def topic( self, message_type ):
+        return node_topic( self.module_id, message_type )
+
+    def update( self, payload ):
+        for metric in payload.metrics:
+            name = metric.name if metric.name else self.names.get( metric.alias )
+            if metric.name:
+                self.names[ metric.alias ] = metric.name
+            if name in FLEET_CAL_METRICS:
+                self.values[ name ] = metric.boolean_value if metric.datatype == MetricDataType.Boolean else metric.float_value
+
+FLEET_CAL_METRICS = [ 'Node Control/Calibration INW', 'Properties/Calibration Status', 'Health/Calibration Noise' ] + \
+                    [ f'Node Control/Calibration Temperature {point + 1}' for point in range( 8 ) ]
+
+# Send an NCMD with one metric, by name, to a fleet node
+def send_fleet_command( node, metric_name, metric_type, value ):
+    payload = get_cmd_payload()
+    addMetric( payload, metric_name, None, metric_type, value )
+    client.publish( node.topic( 'NCMD' ), bytearray( payload.SerializeToString() ), 0, False )
+
+# Start calibration point POINT at the bath temperature REF_TEMP on every one
+# of the modules at once.  Each is asked for an NBIRTH first, and its capture is
+# started as soon as it answers, so the captures run side by side.
+def start_fleet_calibration( point, ref_temp, module_ids ):
+    global fleet_report
+    if fleet_nodes:
+        report( 'A fleet calibration is already running', error = True, always = True )
+        return False
+    fleet_report = []
+    current = int( NODE_CMD_TOPIC.split( '/' )[ -1 ][ len( NODE_ID ): ] )
+    for module_id in module_ids:
+        node = FleetNode( module_id, point, ref_temp )
+        fleet_nodes[ module_id ] = node
+        # The module being displayed is already subscribed to
+        if module_id != current:
+            for message_type in [ 'NBIRTH', 'NDEATH', 'NDATA' ]:
+                client.subscribe( node.topic( message_type ) )
+            node.subscribed = True
+        send_fleet_command( node, 'Node Control/Rebirth', MetricDataType.Boolean, True )
+    report( f'Fleet calibration point {point} at {ref_temp} C started on modules {module_ids}', always = True )
+    return True
+
+# Note that a fleet node is done with result, and report the fleet once every
+# node is
+def finish_fleet_node( node, result ):
+    node.state = 'done'
+    node.result = result
+    node.finished = time.time()
+    report( f'Module {node.module_id}: {result}', always = True )
+    if any( other.state != 'done' for other in fleet_nodes.values() ):
+        return
+    sent = [ other.sent for other in fleet_nodes.values() if other.sent ]
+    fleet_report.append( f'Fleet calibration point {node.point} at {node.ref_temp} C' )
+    fleet_report.append( f'{"Module":>6}  {"Calibrated":>10}  {"Noise (C)":>9}  {"Time (s)":>8}  Result' )
+    for other in sorted( fleet_nodes.values(), key = lambda other: other.module_id ):
+        noise = other.values.get( 'Health/Calibration Noise' )
+        elapsed = f'{other.finished - other.sent:8.1f}' if other.sent else f'{"-":>8}'
+        fleet_report.append( f'{other.module_id:>6}  {str( other.values.get( "Properties/Calibration Status" ) ):>10}  '
+                             f'{noise if noise is not None else float( "nan" ):9.4f}  {elapsed}  {other.result}' )
+    if sent:
+        fleet_report.append( f'Captures spanned {max( other.finished for other in fleet_nodes.values() ) - min( sent ):.1f} s' )
+    for other in fleet_nodes.values():
+        if other.subscribed:
+            for message_type in [ 'NBIRTH', 'NDEATH', 'NDATA' ]:
+                client.unsubscribe( other.topic( message_type ) )
+    fleet_nodes.clear()
+    print( '\n'.join( fleet_report ) )
+
+# Follow a fleet node's calibration from one of its messages
+def update_fleet_node( node, message_type, payload ):
+    if node.state == 'done':
+        return
+    if message_type == 'NDEATH':
+        finish_fleet_node( node, 'went offline' )
+        return
+    if message_type == 'NBIRTH':
+        if name_birth_metrics( payload ) is None:
+            send_fleet_command( node, 'Node Control/Rebirth', MetricDataType.Boolean, True )
+            return
+        node.names = {}
+    elif not node.names:
+        # Its aliases aren't known until the NBIRTH
+        return
+    node.update( payload )
+    inw = node.values.get( 'Node Control/Calibration INW' )
+    if node.state == 'waiting for NBIRTH' and message_type == 'NBIRTH':
+        if inw:
+            finish_fleet_node( node, 'busy with another calibration' )
+            return
+        send_fleet_command( node, f'Node Control/Calibration Temperature {node.point}', MetricDataType.Float, node.ref_temp )
+        node.sent = time.time()
+        node.state = 'queued'
+    elif node.state == 'queued' and inw:
+        node.state = 'capturing'
+    elif node.state == 'capturing' and inw == False:
+        # The node's noise is NaN for a point whose readings never settled
+        noise = node.values.get( 'Health/Calibration Noise' )
+        finish_fleet_node( node, 'failed, readings never settled' if noise is None or noise != noise else 'point taken' )
+
+# Hand a message from a fleet node to its calibration.  Returns True if it is
+# only for the fleet, not from the module being displayed.
+def fleet_message( topic, payload ):
+    parts = topic.split( '/' )
+    if len( parts ) != 4 or not parts[ 3 ].startswith( NODE_ID ):
+        return False
+    try:
+        node = fleet_nodes.get( int( parts[ 3 ][ len( NODE_ID ): ] ) )
+    except ValueError:
+        return False
+    if node is None:
+        return False
+    update_fleet_node( node, parts[ 2 ], payload )
+    return node.subscribed
+
+# Give up on fleet nodes that haven't finished in time
+def check_fleet_timeouts():
+    for node in list( fleet_nodes.values() ):
+        if node.state != 'done' and time.time() - ( node.sent or node.created ) > FLEET_CAL_TIMEOUT_S:
+            finish_fleet_node( node, f'timed out ({node.state})' )
+
+def show_fleet_status():
+    if not fleet_nodes:
+        print( '\n'.join( fleet_report ) if fleet_report else 'No fleet calibration has run' )
+        return
+    for node in sorted( fleet_nodes.values(), key = lambda node: node.module_id ):
+        print( f'Module {node.module_id}: {node.state if node.state != "done" else node.result}' )
+
+# A module taking part in a firmware rollout.  Only the firmware metrics are
+# followed, by name from its NBIRTH and by alias from then on.
+class RolloutNode:
+    def __init__( self, module_id ):
+        self.module_id = module_id
+        self.names = {}         # Alias to name, from the NBIRTH
+        self.subscribed = False
+        self.state = 'waiting'
+        self.offset = 0         # Next byte the node takes
+        self.last_sent = 0      # time.time() of the last command
+        self.retries = 0
+        self.started = None
+        self.finished = None
+        self.version = None
+        self.result = None
+
+    def topic( self, message_type ):
+        return node_topic( self.module_id, message_type )
+
+    def values( self, payload ):
+        found = {}
+        for metric in payload.metrics:
+            name = metric.name if metric.name else self.names.get( metric.alias )
+            if metric.name:
+                self.names[ metric.alias ] = metric.name
+            if name in [ 'Node Control/Firmware Update', 'Properties/Firmware Version' ]:
+                found[ name ] = metric.string_value
+        return found
+
+rollout_image = b''
+rollout_batch = 0
+
+def send_rollout_command( node, metric_name, metric_type, value ):
+    payload = get_cmd_payload()
+    addMetric( payload, metric_name, None, metric_type, value )
+    client.publish( node.topic( 'NCMD' ), bytearray( payload.SerializeToString() ), 0, False )
+    node.last_sent = time.time()
+
+# Send the chunk of the image at the node's offset (see thermistorMux_ota.h)
+def send_firmware_chunk( node ):
+    data = rollout_image[ node.offset : node.offset + FIRMWARE_CHUNK_SIZE ]
+    chunk = struct.pack( '<HBBI', 0x5746, 1, 0, node.offset ) + data
+    send_rollout_command( node, 'Node Control/Firmware Chunk', MetricDataType.Bytes,
+                          bytes( chunk + struct.pack( '<I', zlib.crc32( chunk ) ) ) )
+
+# Start the next waiting nodes, keeping at most rollout_batch updating at once
+def start_rollout_nodes():
+    busy = sum( 1 for node in rollout_nodes.values() if node.state not in [ 'waiting', 'done' ] )
+    for node in sorted( rollout_nodes.values(), key = lambda node: node.module_id ):
+        if busy >= rollout_batch:
+            break
+        if node.state != 'waiting':
+            continue
+        if node.module_id != int( NODE_CMD_TOPIC.split( '/' )[ -1 ][ len( NODE_ID ): ] ):
+            for message_type in [ 'NBIRTH', 'NDEATH', 'NDATA' ]:
+                client.subscribe( node.topic( message_type ) )
+            node.subscribed = True
+        node.state = 'waiting for NBIRTH'
+        node.started = time.time()
+        send_rollout_command( node, 'Node Control/Rebirth', MetricDataType.Boolean, True )
+        busy += 1
+
+# Stream the image at FILE to the modules, BATCH of them at a time.  Each node
+# stages the image while it goes on publishing, so the nodes of a batch only
+# stop for their reboots.
+def start_firmware_rollout( path, module_ids, batch ):
+    global rollout_image, rollout_batch, rollout_report
+    if rollout_nodes:
+        report( 'A firmware rollout is already running', error = True, always = True )
+        return False
+    try:
+        with open( path, 'rb' ) as file:
+            rollout_image = file.read()
+    except OSError as error:
+        report( f'Could not read the firmware image: {error}', error = True, always = True )
+        return False
+    rollout_batch = batch
+    rollout_report = []
+    for module_id in module_ids:
+        rollout_nodes[ module_id ] = RolloutNode( module_id )
+    start_rollout_nodes()
+    report( f'Firmware rollout of {len( rollout_image )} bytes started on modules {module_ids}, {batch} at a time', always = True )
+    return True
+
+def finish_rollout_node( node, result ):
+    node.state = 'done'
+    node.result = result
+    node.finished = time.time()
+    report( f'Module {node.module_id}: {result}', always = True )
+    if node.subscribed:
+        for message_type in [ 'NBIRTH', 'NDEATH', 'NDATA' ]:
+            client.unsubscribe( node.topic( message_type ) )
+        node.subscribed = False
+    start_rollout_nodes()
+    if any( other.state != 'done' for other in rollout_nodes.values() ):
+        return
+    rollout_report.append( f'Firmware rollout of {len( rollout_image )} bytes' )
+    rollout_report.append( f'{"Module":>6}  {"Time (s)":>8}  Result' )
+    for other in sorted( rollout_nodes.values(), key = lambda other: other.module_id ):
+        elapsed = f'{other.finished - other.started:8.1f}' if other.started else f'{"-":>8}'
+        rollout_report.append( f'{other.module_id:>6}  {elapsed}  {other.result}' )
+    rollout_nodes.clear()
+    print( '\n'.join( rollout_report ) )
+
+# Follow a rollout node's update from one of its messages.  Each status the
+# node publishes answers the last command, so the next chunk goes out then.
+def update_rollout_node( node, message_type, payload ):
+    if node.state in [ 'waiting', 'done' ]:
+        return
+    if message_type == 'NDEATH':
+        if node.state != 'rebooting':
+            finish_rollout_node( node, 'went offline' )
+        return
+    if message_type == 'NBIRTH':
+        if name_birth_metrics( payload ) is None:
+            send_rollout_command( node, 'Node Control/Rebirth', MetricDataType.Boolean, True )
+            return
+        node.names = {}
+    elif not node.names:
+        # Its aliases aren't known until the NBIRTH
+        return
+    values = node.values( payload )
+    if message_type == 'NBIRTH':
+        if node.state == 'rebooting':
+            finish_rollout_node( node, f'updated, running {values.get( "Properties/Firmware Version" )}' )
+        elif node.state == 'waiting for NBIRTH':
+            node.version = values.get( 'Properties/Firmware Version' )
+            node.state = 'starting'
+            send_rollout_command( node, 'Node Control/Firmware Update', MetricDataType.String,
+                                  f'begin {len( rollout_image )} {hashlib.sha256( rollout_image ).hexdigest()}' )
+        return
+    status = values.get( 'Node Control/Firmware Update' )
+    if status is None or node.state == 'rebooting':
+        return
+    node.retries = 0
+    if status.startswith( 'receiving ' ):
+        node.offset = int( status.split()[ 1 ].split( '/' )[ 0 ] )
+        node.state = 'sending'
+        send_firmware_chunk( node )
+    elif status.startswith( 'verified' ):
+        node.state = 'rebooting'
+        send_rollout_command( node, 'Node Control/Firmware Update', MetricDataType.String, 'apply' )
+    elif status.startswith( 'failed' ):
+        finish_rollout_node( node, status )
+    elif status == 'idle' and node.state == 'starting':
+        finish_rollout_node( node, 'refused the image (too large?)' )
+
+# Hand a message from a rollout node to its update.  Returns True if it is only
+# for the rollout, not from the module being displayed.
+def rollout_message( topic, payload ):
+    parts = topic.split( '/' )
+    if len( parts ) != 4 or not parts[ 3 ].startswith( NODE_ID ):
+        return False
+    try:
+        node = rollout_nodes.get( int( parts[ 3 ][ len( NODE_ID ): ] ) )
+    except ValueError:
+        return False
+    if node is None:
+        return False
+    update_rollout_node( node, parts[ 2 ], payload )
+    return node.subscribed
+
+# Resend what a rollout node hasn't answered, and give up on nodes that never
+# come back from their reboot
+def check_rollout_stalls():
+    for node in list( rollout_nodes.values() ):
+        if node.state in [ 'waiting', 'done' ]:
+            continue
+        if node.state == 'rebooting':
+            if time.time() - node.last_sent > FIRMWARE_REBOOT_S:
+                finish_rollout_node( node, 'never came back from its reboot' )
+        elif time.time() - node.last_sent > FIRMWARE_STALL_S:
+            node.retries += 1
+            if node.retries > FIRMWARE_RETRIES:
+                finish_rollout_node( node, f'stopped answering ({node.state} at {node.offset})' )
+            elif node.state == 'sending':
+                send_firmware_chunk( node )
+            else:
+                send_rollout_command( node, 'Node Control/Rebirth', MetricDataType.Boolean, True )
+                node.state = 'waiting for NBIRTH'
+
+def show_rollout_status():
+    if not rollout_nodes:
+        print( '\n'.join( rollout_report ) if rollout_report else 'No firmware rollout has run' )
+        return
+    for node in sorted( rollout_nodes.values(), key = lambda node: node.module_id ):
+        progress = f' {node.offset}/{len( rollout_image )}' if node.state == 'sending' else ''
+        print( f'Module {node.module_id}: {node.state + progress if node.state != "done" else node.result}' )
+
 # Main program starts here
 
 # Set the default option values
@@ -648,6 +1654,8 @@ option_do_reboot = False
 option_show = 'changed'
 option_do_exit = False
 option_log = False
+option_fast = False
+option_live = False
 
 # Parse the command-line options
 for arg in sys.argv[ 1: ]:
@@ -677,6 +1685,10 @@ for arg in sys.argv[ 1: ]:
             show_usage()
     elif lower_arg == 'log':
         option_log = True
+    elif lower_arg == 'fast':
+        option_fast = True
+    elif lower_arg == 'live':
+        option_live = True
     elif lower_arg == 'exit':
         option_do_exit = True
     elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
@@ -701,6 +1713,7 @@ except ConnectionRefusedError:
 
 close_thread = False
 threading.Thread( target = client_loop ).start()
+set_live_view( option_live )
 
 # Short delay to allow connect callback to occur
 time.sleep( 0.5 )
@@ -721,7 +1734,10 @@ if option_no_GUI:
     while True:
         # Get the next command
         try:
-            command = input( 'Enter command (? for help, Ctrl-D to quit): ' ).lower().split()
+            line = input( 'Enter command (? for help, Ctrl-D to quit): ' )
+            # File names keep their case
+            arguments = line.split()
+            command = line.lower().split()
         except EOFError:
             # No more commands
             close_thread = True
@@ -747,6 +1763,12 @@ if option_no_GUI:
                 continue
             option_show = param
             report( f'Showing {option_show}', always = True )
+        elif command[ 0 ] == 'live':
+            set_live_view( not option_live )
+            if not option_live:
+                report( 'Live view is off', always = True )
+        elif command[ 0 ] == 'frames':
+            report( frame_accounting.summary(), always = True )
         elif command[ 0 ] == 'log':
             option_log = not option_log
             if option_log:
@@ -757,8 +1779,9 @@ if option_no_GUI:
             close_thread = True
             sys.exit()
         elif command[ 0 ] == 'calibrate':
-            if len( command ) != 2:
-                report( 'Invalid use, must be of the form "calibrate CAL"', error = True, always = True )
+            lengths = { 'upload': [ 3 ], 'fleet': [ 3, 4, 5 ] }.get( command[ 1 ] if len( command ) > 1 else None, [ 2 ] )
+            if len( command ) not in lengths:
+                report( 'Invalid use, must be of the form "calibrate CAL", "calibrate upload FILE" or "calibrate fleet POINT TEMP [MODULES]"', error = True, always = True )
                 continue
             if command[ 1 ] not in CAL_OPTIONS:
                 report( f'Invalid use, CAL must be one of {CAL_OPTIONS}', error = True, always = True )
@@ -770,6 +1793,22 @@ if option_no_GUI:
                 send_cal_command(False, True, False)
             elif command [ 1 ] == 'clear':
                 send_cal_command(False, False, True)
+            elif command [ 1 ] == 'upload':
+                send_cal_upload( arguments[ 2 ] )
+            elif command [ 1 ] == 'fleet' and command[ 2 ] == 'status':
+                show_fleet_status()
+            elif command [ 1 ] == 'fleet':
+                try:
+                    point = int( command[ 2 ] )
+                    ref_temp = float( command[ 3 ] )
+                    module_ids = [ int( module_id ) for module_id in command[ 4 ].split( ',' ) ] if len( command ) == 5 else list( range( NUM_MODULES ) )
+                except ( ValueError, IndexError ):
+                    report( 'Invalid use, must be of the form "calibrate fleet POINT TEMP [MODULE,MODULE...]"', error = True, always = True )
+                    continue
+                if point < 1 or point > 8 or any( module_id < 0 or module_id >= NUM_MODULES for module_id in module_ids ):
+                    report( f'POINT must be 1 to 8 and each MODULE 0 to {NUM_MODULES - 1}', error = True, always = True )
+                    continue
+                start_fleet_calibration( point, ref_temp, module_ids )
             else:
                 metric = find_metric(None, 'Properties/Calibration Status')
                 metric.value_str = f'{metric.value}'
@@ -782,6 +1821,23 @@ if option_no_GUI:
                             
 
 
+        elif command[ 0 ] == 'firmware':
+            if len( command ) == 2 and command[ 1 ] == 'status':
+                show_rollout_status()
+                continue
+            if len( command ) not in [ 3, 4, 5 ] or command[ 1 ] != 'update':
+                report( 'Invalid use, must be of the form "firmware update FILE [MODULES [BATCH]]" or "firmware status"', error = True, always = True )
+                continue
+            try:
+                module_ids = [ int( module_id ) for module_id in command[ 3 ].split( ',' ) ] if len( command ) >= 4 else list( range( NUM_MODULES ) )
+                batch = int( command[ 4 ] ) if len( command ) == 5 else len( module_ids )
+            except ValueError:
+                report( 'Invalid use, must be of the form "firmware update FILE [MODULE,MODULE... [BATCH]]"', error = True, always = True )
+                continue
+            if batch < 1 or any( module_id < 0 or module_id >= NUM_MODULES for module_id in module_ids ):
+                report( f'BATCH must be at least 1 and each MODULE 0 to {NUM_MODULES - 1}', error = True, always = True )
+                continue
+            start_firmware_rollout( arguments[ 2 ], module_ids, batch )
         elif command[ 0 ] == 'help' or command[ 0 ] == 'h' or command[ 0 ] == '?':
             print( f'Thermistor Mux Client v{APP_VERSION} connected to Module {option_module_id}' )
             print( f'Commands:' )
@@ -798,6 +1854,13 @@ if option_no_GUI:
             print( f'        temp2 = runs calibration routine for second temperature extreme.')
             print( f'        status = Displays thermistor mux calibration status.')
             print( f'        clear = Permanently deletes stored calibration data. (Temperature displayed will be then be raw values)')
+            print( f'        upload FILE = replaces the calibration with the coefficients in FILE (format in make_cal_upload())')
+            print( f'        fleet POINT TEMP [MODULES] = takes calibration point POINT (1-8) at bath temperature TEMP on all the modules, or the comma separated MODULES, at once')
+            print( f'        fleet status = shows how a fleet calibration is going, or the report of the last one')
+            print( f'    firmware update FILE [MODULES [BATCH]] = streams the firmware image FILE (a .bin) to all the modules, or the comma separated MODULES, BATCH at a time, and boots it' )
+            print( f'    firmware status = shows how a firmware rollout is going, or the report of the last one' )
+            print( f'    live = toggle the live view of every thermistor on or off' )
+            print( f'    frames = show the frames received, missing, duplicated and replayed, from the module\'s frame numbers' )
             print( f'    log = toggle logging data messages to CSV on or off' )
             print( f'    quit, exit, <Ctrl-D> = stop this program' )
             print( f'    help, h, ? = display this list of commands' )
@@ -0,0 +1,391 @@
+"""
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+Author: Nestor Garcia (Nestor212@email.arizona.edu)
+Brief: Fault injection proxy for measuring how a Thermistor Mux module recovers
+from network faults.  Sits between the module and Mosquitto as a TCP proxy,
+injects a script of faults (broker restarts, link stalls, packet loss, added
+latency), and watches the module through the broker: the time from each fault
+clearing to the module's next connection and its first live NDATA, its births,
+and the frames it lost and replayed, by Inputs/Frame Number.  Writes a JSON
+report for comparing firmware versions.  The module's broker address must point
+at the proxy, and its deadband must be off, so every frame number is published.
+"""
+
+import time
+import datetime
+import threading
+import socket
+import select
+import random
+import sys
+import json
+
+import paho.mqtt.client as mqtt
+from sparkplug_b import *
+
+# Application constants
+APP_VERSION             = '1.0'
+FRAME_NUMBER_METRIC     = 'Inputs/Frame Number'
+COMPRESSED_UUID         = 'SPBV1.0_COMPRESSED'
+NODE_ID                 = 'THERMISTOR'
+GROUP_ID                = 'VI'
+NUM_MODULES             = 32
+DEFAULT_BROKER_URL      = 'localhost'
+DEFAULT_BROKER_PORT     = 1883
+DEFAULT_LISTEN_PORT     = 1884
+DEFAULT_SETTLE          = 30
+RTO_SECONDS             = 0.2       # What a lost segment costs, as in the native build's simulated link
+CHUNK_BYTES             = 1460      # Forwarded a TCP segment at a time
+FAULT_KINDS             = [ 'restart', 'stall', 'loss', 'delay' ]
+
+date_string = datetime.datetime.now().strftime( '%Y-%m-%d_%H%M%S' )
+REPORT_FILENAME = f'thermistorMux_fault_report_{date_string}.json'
+
+lock = threading.Lock()
+
+
+# One scripted fault and what the module did about it
+class Fault:
+    def __init__( self, kind, at, duration, value ):
+        self.kind = kind
+        self.at = at
+        self.duration = duration
+        self.value = value              # loss: chance per segment; delay: ms
+        self.started = None             # time.time() when it started and cleared
+        self.cleared = None
+        self.last_live_frame = None     # Before it started
+        self.first_live_frame = None    # After it cleared
+        self.reconnect = None           # Seconds from clearing
+        self.first_data = None
+        self.births = 0                 # From the start until the next fault starts
+        self.until = float( 'inf' )     # Seconds into the run when the next one starts
+
+    def report( self, historical ):
+        gap = []
+        if self.last_live_frame is not None and self.first_live_frame is not None:
+            gap = range( self.last_live_frame + 1, self.first_live_frame )
+        replayed = sum( 1 for frame in gap if frame in historical )
+        live = sum( 1 for frame in gap if frame in live_frames )
+        return {
+            'kind':             self.kind,
+            'at_s':             self.at,
+            'for_s':            self.duration,
+            'value':            self.value,
+            'reconnect_s':      None if self.reconnect is None else round( self.reconnect, 3 ),
+            'first_ndata_s':    None if self.first_data is None else round( self.first_data, 3 ),
+            'births':           self.births,
+            'frames_in_gap':    len( gap ),
+            'frames_live':      live,
+            'frames_replayed':  replayed,
+            'frames_lost':      len( gap ) - live - replayed
+        }
+
+# Return the topic for a particular node message
+def node_topic( module_id, message_type ):
+    return f'spBv1.0/{GROUP_ID}/{message_type}/{NODE_ID}{module_id}'
+
+# Display how this program should be called, then exit
+def show_usage():
+    print( f'Thermistor Mux Fault Proxy v{APP_VERSION}' )
+    print( f'Usage: {sys.argv[ 0 ]} [broker=[BROKER_IP][=BROKER_PORT]] [listen=PORT] [module=MODULE] faults=SCRIPT [settle=SECONDS] [report=FILE] [verbose]' )
+    print( f'where BROKER_IP = hostname or IP address of the MQTT broker (default {DEFAULT_BROKER_URL})' )
+    print( f'      BROKER_PORT = port number of the MQTT broker (default {DEFAULT_BROKER_PORT})' )
+    print( f'      PORT = port the module connects to instead of the broker (default {DEFAULT_LISTEN_PORT})' )
+    print( f'      MODULE = module to watch, 0-{NUM_MODULES - 1} (default 0)' )
+    print( f'      SCRIPT = comma-separated faults KIND@AT+FOR[:VALUE], AT and FOR in seconds, e.g.' )
+    print( f'               restart@30+5,stall@90+20,loss@150+30:0.05,delay@210+30:500' )
+    print( f'               restart: connections dropped and refused; stall: nothing forwarded' )
+    print( f'               (a link flap); loss: each segment lost with chance VALUE, costing' )
+    print( f'               {RTO_SECONDS:g} s; delay: VALUE ms added each way' )
+    print( f'      SECONDS = how long to keep watching after the last fault clears (default {DEFAULT_SETTLE})' )
+    print( f'      FILE = where to write the JSON report (default thermistorMux_fault_report_DATE_TIME.json)' )
+    print( f'      verbose = display each fault and connection as it happens' )
+    sys.exit()
+
+# Display a diagnostic message if verbose
+def report( msg ):
+    if option_verbose:
+        print( f'*** {msg} ***' )
+
+# Parse a fault script such as "restart@30+5,loss@60+20:0.05"
+def parse_faults( arg ):
+    faults = []
+    for part in arg.split( ',' ):
+        kind, rest = part.split( '@', 1 )
+        if kind not in FAULT_KINDS:
+            raise ValueError
+        value = None
+        if ':' in rest:
+            rest, value = rest.split( ':', 1 )
+            value = float( value )
+        at, duration = rest.split( '+', 1 )
+        if kind == 'loss' and ( value is None or not 0 <= value <= 1 ):
+            raise ValueError
+        if kind == 'delay' and ( value is None or value < 0 ):
+            raise ValueError
+        faults.append( Fault( kind, float( at ), float( duration ), value ) )
+    return sorted( faults, key = lambda fault: fault.at )
+
+
+# The proxy.  Each connection from the module gets one to the broker and a
+# thread forwarding each way a segment at a time, held back as the fault in
+# force says.
+
+connections = []
+
+# The fault in force, or None
+def active_fault():
+    now = time.time()
+    for fault in faults:
+        if fault.started is not None and fault.cleared is None and fault.started <= now:
+            return fault
+    return None
+
+# Close both ends of a connection
+def close_connection( pair ):
+    for end in pair:
+        try:
+            end.close()
+        except OSError:
+            pass
+    with lock:
+        if pair in connections:
+            connections.remove( pair )
+
+# Forward one direction of a connection until either end closes.  A stall
+# holds what arrives until it clears, as a dead link would while TCP
+# retransmits, so the stream is never cut mid-packet.
+def forward( source, sink, pair ):
+    try:
+        while True:
+            ready, _, _ = select.select( [ source ], [], [], 0.1 )
+            if not ready:
+                if source.fileno() < 0:
+                    break
+                continue
+            data = source.recv( CHUNK_BYTES )
+            if not data:
+                break
+            while True:
+                fault = active_fault()
+                if fault is None or fault.kind != 'stall':
+                    break
+                time.sleep( 0.01 )
+            if fault is not None and fault.kind == 'loss' and random.random() < fault.value:
+                time.sleep( RTO_SECONDS )
+            if fault is not None and fault.kind == 'delay':
+                time.sleep( fault.value / 1000 )
+            sink.sendall( data )
+    except OSError:
+        pass
+    close_connection( pair )
+
+# Take the module's connections, refusing them during a broker restart
+def accept_connections( server ):
+    while True:
+        module, address = server.accept()
+        fault = active_fault()
+        if fault is not None and fault.kind == 'restart':
+            report( f'Refused connection from {address[ 0 ]}' )
+            module.close()
+            continue
+        try:
+            broker = socket.create_connection( ( option_broker_URL, option_broker_port ) )
+        except OSError:
+            report( f'Could not connect to the broker for {address[ 0 ]}' )
+            module.close()
+            continue
+        pair = ( module, broker )
+        with lock:
+            connections.append( pair )
+            for fault in faults:
+                if fault.cleared is not None and fault.reconnect is None:
+                    fault.reconnect = time.time() - fault.cleared
+        report( f'Connection from {address[ 0 ]}' )
+        threading.Thread( target = forward, args = ( module, broker, pair ), daemon = True ).start()
+        threading.Thread( target = forward, args = ( broker, module, pair ), daemon = True ).start()
+
+
+# The monitor: the module's messages, straight from the broker
+
+frame_alias = None
+live_frames = set()
+historical_frames = set()
+last_live_frame = None
+
+def on_connect( client, userdata, flags, rc ):
+    if rc != 0:
+        print( f'*** Failed to connect with result code {rc} ***' )
+        sys.exit()
+    for message_type in [ 'NBIRTH', 'NDATA' ]:
+        client.subscribe( node_topic( option_module, message_type ) )
+
+# Callback called when an MQTT message is received
+def on_message( client, userdata, msg ):
+    global frame_alias, last_live_frame
+    payload = sparkplug_b_pb2.Payload()
+    try:
+        payload.ParseFromString( msg.payload )
+        if payload.uuid == COMPRESSED_UUID:
+            payload = decompress_payload( payload )
+    except Exception:
+        report( f'Could not parse "{msg.topic}" message' )
+        return
+
+    now = time.time()
+    with lock:
+        if msg.topic.endswith( '/NBIRTH/' + NODE_ID + str( option_module ) ):
+            for metric in payload.metrics:
+                if metric.name == FRAME_NUMBER_METRIC:
+                    frame_alias = metric.alias
+            for fault in faults:
+                if fault.started is not None and now - start < fault.until:
+                    fault.births += 1
+            return
+        live = False
+        for metric in payload.metrics:
+            if metric.name != FRAME_NUMBER_METRIC and ( frame_alias is None or metric.alias != frame_alias ):
+                continue
+            if metric.is_historical:
+                historical_frames.add( metric.long_value )
+            else:
+                live_frames.add( metric.long_value )
+                last_live_frame = metric.long_value
+                live = True
+        if not live:
+            return
+        for fault in faults:
+            if fault.cleared is not None and fault.first_data is None:
+                fault.first_data = now - fault.cleared
+                fault.first_live_frame = last_live_frame
+
+
+# Main program starts here
+
+# Set the default option values
+option_broker_URL = DEFAULT_BROKER_URL
+option_broker_port = DEFAULT_BROKER_PORT
+option_listen_port = DEFAULT_LISTEN_PORT
+option_module = 0
+option_settle = DEFAULT_SETTLE
+option_report = REPORT_FILENAME
+option_verbose = False
+faults = []
+
+# Parse the command-line options
+for arg in sys.argv[ 1: ]:
+    lower_arg = arg.lower()
+    try:
+        if lower_arg.startswith( 'broker=' ):
+            split_arg = arg.split( '=', 2 )
+            if split_arg[ 1 ] != '':
+                option_broker_URL = split_arg[ 1 ]
+            if len( split_arg ) == 3:
+                option_broker_port = int( split_arg[ 2 ] )
+        elif lower_arg.startswith( 'listen=' ):
+            option_listen_port = int( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'module=' ):
+            option_module = int( arg.split( '=', 1 )[ 1 ] )
+            if not 0 <= option_module < NUM_MODULES:
+                raise ValueError
+        elif lower_arg.startswith( 'faults=' ):
+            faults = parse_faults( lower_arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'settle=' ):
+            option_settle = float( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'report=' ):
+            option_report = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg == 'verbose':
+            option_verbose = True
+        elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
+            show_usage()
+        else:
+            print( f'*** Unrecognized command: "{arg}" ***' )
+            show_usage()
+    except ValueError:
+        print( f'*** Invalid value: "{arg}" ***' )
+        show_usage()
+if len( faults ) == 0:
+    show_usage()
+
+# A fault's births count until the next one starts
+for position in range( len( faults ) - 1 ):
+    faults[ position ].until = faults[ position + 1 ].at
+
+# Set up the monitor, then the proxy
+client = mqtt.Client()
+client.on_connect = on_connect
+client.on_message = on_message
+try:
+    client.connect( option_broker_URL, option_broker_port, 60 )
+except ConnectionRefusedError:
+    print( f'*** Failed to connect to MQTT broker at {option_broker_URL}:{option_broker_port} ***' )
+    sys.exit()
+client.loop_start()
+
+server = socket.socket( socket.AF_INET, socket.SOCK_STREAM )
+server.setsockopt( socket.SOL_SOCKET, socket.SO_REUSEADDR, 1 )
+server.bind( ( '', option_listen_port ) )
+server.listen( 4 )
+threading.Thread( target = accept_connections, args = ( server, ), daemon = True ).start()
+
+print( f'Thermistor Mux Fault Proxy v{APP_VERSION}: module {option_module} through port {option_listen_port} '
+       f'to {option_broker_URL}:{option_broker_port}, {len( faults )} faults' )
+started = datetime.datetime.now()
+start = time.time()
+
+# Start and clear the faults as they fall due.  A restart drops every
+# connection, as the broker going down would.
+end = max( fault.at + fault.duration for fault in faults ) + option_settle
+while time.time() - start < end:
+    time.sleep( 0.01 )
+    elapsed = time.time() - start
+    for fault in faults:
+        if fault.started is None and elapsed >= fault.at:
+            with lock:
+                fault.last_live_frame = last_live_frame
+                fault.started = time.time()
+                dropped = list( connections ) if fault.kind == 'restart' else []
+            report( f'{fault.kind} fault started' )
+            for pair in dropped:
+                close_connection( pair )
+        if fault.started is not None and fault.cleared is None and elapsed >= fault.at + fault.duration:
+            with lock:
+                fault.cleared = time.time()
+            report( f'{fault.kind} fault cleared' )
+client.loop_stop()
+client.disconnect()
+
+# Write the report
+with lock:
+    fault_reports = [ fault.report( historical_frames ) for fault in faults ]
+fault_report = {
+    'app_version': APP_VERSION,
+    'started':     started.isoformat( ' ', timespec = 'seconds' ),
+    'seconds':     round( time.time() - start, 1 ),
+    'broker':      f'{option_broker_URL}:{option_broker_port}',
+    'node':        f'{NODE_ID}{option_module}',
+    'faults':      fault_reports
+}
+with open( option_report, 'w' ) as report_file:
+    json.dump( fault_report, report_file, indent = 2 )
+
+# Print a summary
+def seconds_text( value ):
+    return '-' if value is None else f'{value:.3f}'
+print( f'{"Fault":10} {"at s":>7} {"for s":>7} {"reconnect s":>12} {"NDATA s":>9} {"births":>7} {"gap":>6} {"lost":>6} {"replayed":>9}' )
+for r in fault_reports:
+    print( f'{r[ "kind" ]:10} {r[ "at_s" ]:7g} {r[ "for_s" ]:7g} {seconds_text( r[ "reconnect_s" ] ):>12} '
+           f'{seconds_text( r[ "first_ndata_s" ] ):>9} {r[ "births" ]:7} {r[ "frames_in_gap" ]:6} {r[ "frames_lost" ]:6} '
+           f'{r[ "frames_replayed" ]:9}' )
+print( f'Report written to {option_report}' )
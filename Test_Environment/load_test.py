@@ -0,0 +1,403 @@
+"""
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+Author: Nestor Garcia (Nestor212@email.arizona.edu)
+Brief: Throughput and latency harness for Thermistor Mux modules.  Subscribes
+to one or many THERMISTORx nodes for a set time, measures sample-to-host
+latency from the metric timestamps, counts seq gaps and frames per second, times
+Rebirth NCMD round trips, and writes a JSON report for comparing firmware
+versions.
+"""
+
+import time
+import datetime
+import threading
+import sys
+import json
+import math
+import zlib
+
+import paho.mqtt.client as mqtt
+from sparkplug_b import *
+
+# Application constants
+APP_VERSION             = '1.0'
+BIRTH_DEATH_SEQ_METRIC  = 'bdSeq'
+COMPRESSED_UUID         = 'SPBV1.0_COMPRESSED'
+FIRMWARE_VERSION_METRIC = 'Properties/Firmware Version'
+THERMISTOR_PREFIX       = 'Inputs/THERMISTOR'
+NODE_ID                 = 'THERMISTOR'
+GROUP_ID                = 'VI'
+NUM_MODULES             = 32
+DEFAULT_BROKER_URL      = 'localhost'
+DEFAULT_BROKER_PORT     = 1883
+DEFAULT_SECONDS         = 60
+DEFAULT_RTT_INTERVAL    = 10
+
+date_string = datetime.datetime.now().strftime( '%Y-%m-%d_%H%M%S' )
+REPORT_FILENAME = f'thermistorMux_load_report_{date_string}.json'
+
+lock = threading.Lock()
+
+
+# Current time in milliseconds, the same units as Sparkplug timestamps
+def now_millis():
+    return time.time() * 1000
+
+# Summary statistics of a list of values, for the report
+def summarize( values ):
+    if len( values ) == 0:
+        return { 'count': 0 }
+    ordered = sorted( values )
+    def percentile( p ):
+        return ordered[ min( len( ordered ) - 1, int( math.ceil( p / 100 * len( ordered ) ) ) - 1 ) ]
+    return {
+        'count': len( ordered ),
+        'min':   round( ordered[ 0 ], 3 ),
+        'mean':  round( sum( ordered ) / len( ordered ), 3 ),
+        'p50':   round( percentile( 50 ), 3 ),
+        'p95':   round( percentile( 95 ), 3 ),
+        'p99':   round( percentile( 99 ), 3 ),
+        'max':   round( ordered[ -1 ], 3 )
+    }
+
+# Everything measured for one node
+class NodeStats:
+    def __init__( self, module_id ):
+        self.node_id = f'{NODE_ID}{module_id}'
+        self.birth_topic = node_topic( module_id, 'NBIRTH' )
+        self.death_topic = node_topic( module_id, 'NDEATH' )
+        self.data_topic  = node_topic( module_id, 'NDATA' )
+        self.cmd_topic   = node_topic( module_id, 'NCMD' )
+        self.alive = False
+        self.message_seq = 0
+        self.thermistor_aliases = set()
+        self.rebirth_alias = None
+        self.firmware_version = None
+        self.bdseq = None
+        self.births = 0
+        self.deaths = 0
+        self.data_messages = 0
+        self.payload_bytes = 0
+        self.seq_errors = 0
+        self.messages_lost = 0
+        self.frames = 0
+        self.historical_frames = 0
+        self.first_frame = None
+        self.last_frame = None
+        self.latencies = []
+        self.rebirth_sent = None
+        self.rtts = []
+        self.rtt_timeouts = 0
+
+    def report( self, seconds ):
+        fps = 0.0
+        if self.frames > 1 and self.last_frame > self.first_frame:
+            fps = ( self.frames - 1 ) / ( ( self.last_frame - self.first_frame ) / 1000 )
+        return {
+            'firmware_version':  self.firmware_version,
+            'bdSeq':             self.bdseq,
+            'births':            self.births,
+            'deaths':            self.deaths,
+            'data_messages':     self.data_messages,
+            'payload_bytes':     self.payload_bytes,
+            'bytes_per_second':  round( self.payload_bytes / seconds, 1 ),
+            'frames':            self.frames,
+            'historical_frames': self.historical_frames,
+            'frames_per_second': round( fps, 3 ),
+            'seq_errors':        self.seq_errors,
+            'messages_lost':     self.messages_lost,
+            'latency_ms':        summarize( self.latencies ),
+            'ncmd_rtt_ms':       summarize( self.rtts ),
+            'ncmd_timeouts':     self.rtt_timeouts
+        }
+
+# Return the topic for a particular node message
+def node_topic( module_id, message_type ):
+    return f'spBv1.0/{GROUP_ID}/{message_type}/{NODE_ID}{module_id}'
+
+# Display how this program should be called, then exit
+def show_usage():
+    print( f'Thermistor Mux Load Test v{APP_VERSION}' )
+    print( f'Usage: {sys.argv[ 0 ]} [broker=[BROKER_IP][=BROKER_PORT]] [modules=MODULE_LIST] [seconds=SECONDS] [rtt=INTERVAL] [report=FILE] [verbose]' )
+    print( f'where BROKER_IP = hostname or IP address of MQTT broker (default {DEFAULT_BROKER_URL})' )
+    print( f'      BROKER_PORT = port number of MQTT broker (default {DEFAULT_BROKER_PORT})' )
+    print( f'      MODULE_LIST = modules to measure, e.g. 3 or 0-5 or 0,2,7 (default 0-{NUM_MODULES - 1})' )
+    print( f'      SECONDS = how long to measure for (default {DEFAULT_SECONDS})' )
+    print( f'      INTERVAL = seconds between Rebirth round trips to each module, 0 for none (default {DEFAULT_RTT_INTERVAL})' )
+    print( f'      FILE = where to write the JSON report (default thermistorMux_load_report_DATE_TIME.json)' )
+    print( f'      verbose = display each seq error and timeout as it happens' )
+    sys.exit()
+
+# Display a diagnostic message if verbose
+def report( msg ):
+    if option_verbose:
+        print( f'*** {msg} ***' )
+
+# Parse a module list such as "0-5,9"
+def parse_modules( arg ):
+    modules = []
+    for part in arg.split( ',' ):
+        bounds = part.split( '-', 1 )
+        first = int( bounds[ 0 ] )
+        last = int( bounds[ -1 ] )
+        if first < 0 or last >= NUM_MODULES or first > last:
+            raise ValueError
+        modules.extend( range( first, last + 1 ) )
+    return sorted( set( modules ) )
+
+# Count a message whose seq number isn't as expected, with the same rules as
+# check_message_sequence() in client.py: NDEATH has no seq, NBIRTH has seq 0,
+# and every other message has the previous seq plus one, wrapping at 255.
+def check_message_sequence( node, topic, payload ):
+    if topic == node.death_topic:
+        if payload.seq != 0:
+            node.seq_errors += 1
+            report( f'{node.node_id}: unexpected seq (= {payload.seq}) in NDEATH message' )
+            return False
+        return True
+
+    prev_seq = node.message_seq
+    node.message_seq = payload.seq
+
+    if topic == node.birth_topic:
+        if payload.seq != 0:
+            node.seq_errors += 1
+            report( f'{node.node_id}: seq (= {payload.seq}) in NBIRTH message should be 0' )
+            return False
+    else:
+        next_seq = ( prev_seq + 1 ) % 256
+        if payload.seq != next_seq:
+            node.seq_errors += 1
+            node.messages_lost += ( payload.seq - next_seq ) % 256
+            report( f'{node.node_id}: seq (= {payload.seq}) in message should be {next_seq} (previous = {prev_seq})' )
+            return False
+    return True
+
+# Learn the node's aliases and properties from its NBIRTH
+def process_birth( node, payload ):
+    node.thermistor_aliases = set()
+    node.rebirth_alias = None
+    for metric in payload.metrics:
+        if metric.name.startswith( THERMISTOR_PREFIX ):
+            node.thermistor_aliases.add( metric.alias )
+        elif metric.name == 'Node Control/Rebirth':
+            node.rebirth_alias = metric.alias
+        elif metric.name == FIRMWARE_VERSION_METRIC:
+            node.firmware_version = metric.string_value
+        elif metric.name == BIRTH_DEATH_SEQ_METRIC:
+            node.bdseq = metric.long_value
+
+# Count the frames in a payload and the latency of the current one.  Each
+# distinct thermistor timestamp is a frame; historical ones are replayed after
+# an outage, so they count as frames but not towards latency.
+def process_frames( node, payload, received ):
+    live = set()
+    historical = set()
+    for metric in payload.metrics:
+        if metric.alias not in node.thermistor_aliases and not metric.name.startswith( THERMISTOR_PREFIX ):
+            continue
+        if not metric.HasField( 'timestamp' ):
+            continue
+        if metric.is_historical:
+            historical.add( metric.timestamp )
+        else:
+            live.add( metric.timestamp )
+    node.historical_frames += len( historical )
+    for timestamp in sorted( live ):
+        node.frames += 1
+        node.latencies.append( received - timestamp )
+        if node.first_frame is None:
+            node.first_frame = timestamp
+        node.last_frame = timestamp
+
+# Ask the node for a rebirth, timing how long its NBIRTH takes to arrive
+def send_rebirth( client, node ):
+    payload = sparkplug_b_pb2.Payload()
+    payload.timestamp = int( round( time.time() * 1000 ) )
+    if node.rebirth_alias is not None:
+        addMetric( payload, None, node.rebirth_alias, MetricDataType.Boolean, True )
+    else:
+        addMetric( payload, 'Node Control/Rebirth', None, MetricDataType.Boolean, True )
+    node.rebirth_sent = now_millis()
+    client.publish( node.cmd_topic, bytearray( payload.SerializeToString() ), 0, False )
+
+def on_connect( client, userdata, flags, rc ):
+    if rc != 0:
+        print( f'*** Failed to connect with result code {rc} ***' )
+        sys.exit()
+    for node in nodes.values():
+        client.subscribe( node.birth_topic )
+        client.subscribe( node.death_topic )
+        client.subscribe( node.data_topic )
+
+# Callback called when an MQTT message is received
+def on_message( client, userdata, msg ):
+    received = now_millis()
+    node = topics.get( msg.topic )
+    if node is None:
+        return
+
+    payload = sparkplug_b_pb2.Payload()
+    try:
+        payload.ParseFromString( msg.payload )
+    except:
+        report( f'Could not parse "{msg.topic}" message' )
+        return
+    if payload.uuid == COMPRESSED_UUID:
+        try:
+            payload = decompress_payload( payload )
+        except ( zlib.error, ValueError ):
+            report( f'Could not decompress "{msg.topic}" message' )
+            return
+
+    with lock:
+        check_message_sequence( node, msg.topic, payload )
+        if msg.topic == node.birth_topic:
+            node.births += 1
+            node.alive = True
+            process_birth( node, payload )
+            if node.rebirth_sent is not None:
+                node.rtts.append( received - node.rebirth_sent )
+                node.rebirth_sent = None
+        elif msg.topic == node.death_topic:
+            node.deaths += 1
+            node.alive = False
+        elif node.alive:
+            node.data_messages += 1
+            node.payload_bytes += len( msg.payload )
+            process_frames( node, payload, received )
+
+
+# Main program starts here
+
+# Set the default option values
+option_broker_URL = DEFAULT_BROKER_URL
+option_broker_port = DEFAULT_BROKER_PORT
+option_modules = list( range( NUM_MODULES ) )
+option_seconds = DEFAULT_SECONDS
+option_rtt_interval = DEFAULT_RTT_INTERVAL
+option_report = REPORT_FILENAME
+option_verbose = False
+
+# Parse the command-line options
+for arg in sys.argv[ 1: ]:
+    lower_arg = arg.lower()
+    try:
+        if lower_arg.startswith( 'broker=' ):
+            split_arg = arg.split( '=', 2 )
+            if split_arg[ 1 ] != '':
+                option_broker_URL = split_arg[ 1 ]
+            if len( split_arg ) == 3:
+                option_broker_port = int( split_arg[ 2 ] )
+        elif lower_arg.startswith( 'modules=' ):
+            option_modules = parse_modules( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'seconds=' ):
+            option_seconds = float( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'rtt=' ):
+            option_rtt_interval = float( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'report=' ):
+            option_report = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg == 'verbose':
+            option_verbose = True
+        elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
+            show_usage()
+        else:
+            print( f'*** Unrecognized command: "{arg}" ***' )
+            show_usage()
+    except ValueError:
+        print( f'*** Invalid value: "{arg}" ***' )
+        show_usage()
+
+nodes = { module_id: NodeStats( module_id ) for module_id in option_modules }
+topics = {}
+for node in nodes.values():
+    for topic in [ node.birth_topic, node.death_topic, node.data_topic ]:
+        topics[ topic ] = node
+
+# Set up the MQTT client connection
+client = mqtt.Client()
+client.on_connect = on_connect
+client.on_message = on_message
+try:
+    client.connect( option_broker_URL, option_broker_port, 60 )
+except ConnectionRefusedError:
+    print( f'*** Failed to connect to MQTT broker at {option_broker_URL}:{option_broker_port} ***' )
+    sys.exit()
+client.loop_start()
+
+print( f'Thermistor Mux Load Test v{APP_VERSION}: {len( nodes )} modules for {option_seconds:g} s' )
+started = datetime.datetime.now()
+start = time.time()
+
+# Ask every node for a birth so aliases are known, then time a round trip to
+# each one every rtt interval, staggered so they don't all rebirth at once
+next_rtt = {}
+with lock:
+    for position, node in enumerate( nodes.values() ):
+        send_rebirth( client, node )
+        if option_rtt_interval > 0:
+            next_rtt[ node ] = start + option_rtt_interval * ( 1 + position / len( nodes ) )
+while time.time() - start < option_seconds:
+    time.sleep( 0.1 )
+    now = time.time()
+    with lock:
+        for node, due in next_rtt.items():
+            if now < due:
+                continue
+            if node.rebirth_sent is not None:
+                node.rtt_timeouts += 1
+                report( f'{node.node_id}: no NBIRTH within {option_rtt_interval:g} s of Rebirth' )
+            send_rebirth( client, node )
+            next_rtt[ node ] = due + option_rtt_interval
+client.loop_stop()
+client.disconnect()
+
+# Write the report
+seconds = time.time() - start
+with lock:
+    node_reports = { node.node_id: node.report( seconds ) for node in nodes.values() }
+    all_latencies = [ latency for node in nodes.values() for latency in node.latencies ]
+    all_rtts = [ rtt for node in nodes.values() for rtt in node.rtts ]
+versions = sorted( set( r[ 'firmware_version' ] for r in node_reports.values() if r[ 'firmware_version' ] ) )
+load_report = {
+    'app_version': APP_VERSION,
+    'started':     started.isoformat( ' ', timespec = 'seconds' ),
+    'seconds':     round( seconds, 1 ),
+    'broker':      f'{option_broker_URL}:{option_broker_port}',
+    'firmware_versions': versions,
+    'totals': {
+        'nodes_heard':       sum( 1 for r in node_reports.values() if r[ 'births' ] > 0 ),
+        'data_messages':     sum( r[ 'data_messages' ] for r in node_reports.values() ),
+        'frames':            sum( r[ 'frames' ] for r in node_reports.values() ),
+        'frames_per_second': round( sum( r[ 'frames_per_second' ] for r in node_reports.values() ), 3 ),
+        'seq_errors':        sum( r[ 'seq_errors' ] for r in node_reports.values() ),
+        'messages_lost':     sum( r[ 'messages_lost' ] for r in node_reports.values() ),
+        'latency_ms':        summarize( all_latencies ),
+        'ncmd_rtt_ms':       summarize( all_rtts )
+    },
+    'nodes': node_reports
+}
+with open( option_report, 'w' ) as report_file:
+    json.dump( load_report, report_file, indent = 2 )
+
+# Print a summary
+print( f'{"Node":14} {"frames":>8} {"fps":>8} {"seq err":>8} {"lost":>6} {"p50 ms":>8} {"p99 ms":>8} {"rtt ms":>8}' )
+for node_id, r in node_reports.items():
+    if r[ 'births' ] == 0 and r[ 'data_messages' ] == 0:
+        continue
+    latency = r[ 'latency_ms' ]
+    rtt = r[ 'ncmd_rtt_ms' ]
+    print( f'{node_id:14} {r[ "frames" ]:8} {r[ "frames_per_second" ]:8.2f} {r[ "seq_errors" ]:8} {r[ "messages_lost" ]:6} '
+           f'{latency.get( "p50", float( "nan" ) ):8.1f} {latency.get( "p99", float( "nan" ) ):8.1f} {rtt.get( "p50", float( "nan" ) ):8.1f}' )
+print( f'{load_report[ "totals" ][ "nodes_heard" ]} of {len( nodes )} modules heard; report written to {option_report}' )
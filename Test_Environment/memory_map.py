@@ -0,0 +1,216 @@
+"""
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+Author: Nestor Garcia (Nestor212@email.arizona.edu)
+Brief: Memory placement report for the Teensy 4.1 firmware, from the linker map
+written by the teensy41 environments (.pio/build/teensy41/firmware.map).  Prints
+how much of ITCM, DTCM, RAM2, flash and PSRAM is used, the FlexRAM banks ITCM
+takes from DTCM, and where each of the interrupt and per-frame hot path symbols
+ended up.  Exits with status 1 if a hot symbol is outside its expected region.
+"""
+
+import re
+import sys
+
+APP_VERSION         = '1.0'
+FLEXRAM_BANK        = 32 * 1024
+FLEXRAM_SIZE        = 512 * 1024
+
+# Teensy 4.1 memory regions: name, start, size
+REGIONS = [
+    ( 'ITCM',   0x00000000,  512 * 1024 ),
+    ( 'DTCM',   0x20000000,  512 * 1024 ),
+    ( 'RAM2',   0x20200000,  512 * 1024 ),
+    ( 'FLASH',  0x60000000,  8 * 1024 * 1024 ),
+    ( 'PSRAM',  0x70000000,  16 * 1024 * 1024 ),
+]
+
+# Hot path symbols and the region each belongs in.  Names are matched within the
+# (possibly mangled) symbol and input section names of the map; file-scope
+# statics only appear there while they have their own section.
+HOT_SYMBOLS = [
+    # Data-ready, settling and frame timer and DMA interrupt chain (FASTRUN)
+    ( 'acquisition_isr',                 'ITCM' ),
+    ( 'acquisition_store',               'ITCM' ),
+    ( 'settle_done',                     'ITCM' ),
+    ( 'start_settled_conversion',        'ITCM' ),
+    ( 'acquisition_fire_passes',         'ITCM' ),
+    ( 'Mcp3561::read_raw',               'ITCM' ),
+    ( 'Mcp3561::start_dma',              'ITCM' ),
+    ( 'Mcp3561::dma_complete',           'ITCM' ),
+    ( 'Mcp3561::read_async',             'ITCM' ),
+    ( 'Mcp3561::set_conversion',         'ITCM' ),
+    ( 'Mcp3561::write_registers',        'ITCM' ),
+    ( 'crc16_ansi',                      'ITCM' ),
+    # Per-frame conversions (FASTRUN)
+    ( 'convert_ADCDATA',                 'ITCM' ),
+    ( 'convert_internal_block',          'ITCM' ),
+    ( 'convert_thermistor_block',        'ITCM' ),
+    ( 'classify_thermistor_code',        'ITCM' ),
+    ( 'convert_internal_temp',           'ITCM' ),
+    ( 'convert_thermistor_temp',         'ITCM' ),
+    # Per-frame data
+    ( 'm_engine',                        'DTCM' ),
+    ( 'm_samples',                       'DTCM' ),
+    ( 'calSegments',                     'DTCM' ),
+    ( 'm_THERMISTOR',                    'DTCM' ),
+    ( 'm_metricArena',                   'DTCM' ),
+    ( 'encode_buffer',                   'DTCM' ),
+    ( 'crc16_table',                     'DTCM' ),
+    # DMA transfer buffers, cache line aligned (DMAMEM)
+    ( 'adcdata_tx_buff',                 'RAM2' ),
+    ( 'adcdata_rx_buff',                 'RAM2' ),
+]
+
+# Output sections that aren't loaded into memory
+UNALLOCATED = ( '.debug', '.comment', '.ARM.attributes', '.stab', '.gnu.attributes' )
+
+OUTPUT_SECTION = re.compile( r'^(\.\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+))?' )
+INPUT_SECTION = re.compile( r'^ (\.\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+))?' )
+ADDRESS_SIZE = re.compile( r'^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)(?:\s+(\S+))?\s*$' )
+SYMBOL = re.compile( r'^\s+0x([0-9a-f]+)\s+([^\s=].*?)\s*$' )
+
+
+# The name of the region holding address, or None
+def region_of( address ):
+    for name, start, size in REGIONS:
+        if start <= address < start + size:
+            return name
+    return None
+
+# The memory map section of a linker map file, as lists of output sections
+# (name, address, size) and of symbols and input sections (name, address, size,
+# object file); symbols have no size
+def read_map( filename ):
+    outputs = []
+    names = []
+    pending_output = None
+    pending_input = None
+    in_map = False
+    for line in open( filename, errors='replace' ):
+        line = line.rstrip( '\n' )
+        if not in_map:
+            in_map = line.startswith( 'Linker script and memory map' )
+            continue
+        if pending_output or pending_input:
+            # Long section names wrap their address and size onto the next line
+            match = ADDRESS_SIZE.match( line )
+            if match:
+                address, size = int( match.group( 1 ), 16 ), int( match.group( 2 ), 16 )
+                if pending_output:
+                    outputs.append( ( pending_output, address, size ) )
+                else:
+                    names.append( ( pending_input, address, size, match.group( 3 ) ) )
+                pending_output = pending_input = None
+                continue
+            pending_output = pending_input = None
+        match = OUTPUT_SECTION.match( line )
+        if match:
+            if match.group( 2 ) is None:
+                pending_output = match.group( 1 )
+            else:
+                outputs.append( ( match.group( 1 ), int( match.group( 2 ), 16 ), int( match.group( 3 ), 16 ) ) )
+            continue
+        match = INPUT_SECTION.match( line )
+        if match:
+            if match.group( 2 ) is None:
+                pending_input = match.group( 1 )
+            else:
+                names.append( ( match.group( 1 ), int( match.group( 2 ), 16 ), int( match.group( 3 ), 16 ),
+                                match.group( 4 ) ) )
+            continue
+        match = SYMBOL.match( line )
+        if match and ' = ' not in match.group( 2 ) and not match.group( 2 ).startswith( ( '*', '.', 'PROVIDE', 'ASSERT' ) ):
+            names.append( ( match.group( 2 ), int( match.group( 1 ), 16 ), None, None ) )
+    return outputs, names
+
+# Display how this program should be called, then exit
+def show_usage():
+    print( f'Thermistor Mux Memory Map Report v{APP_VERSION}' )
+    print( f'Usage: {sys.argv[ 0 ]} MAP_FILE [top=N]' )
+    print( f'where MAP_FILE = the linker map of a teensy41 build, e.g. .pio/build/teensy41/firmware.map' )
+    print( f'      N = also list the N largest input sections of each region' )
+    sys.exit()
+
+option_file = None
+option_top = 0
+
+# Parse the command-line options
+for arg in sys.argv[ 1: ]:
+    lower_arg = arg.lower()
+    try:
+        if lower_arg.startswith( 'top=' ):
+            option_top = int( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
+            show_usage()
+        elif option_file is None:
+            option_file = arg
+        else:
+            print( f'*** Unrecognized command: "{arg}" ***' )
+            show_usage()
+    except ValueError:
+        print( f'*** Invalid value: "{arg}" ***' )
+        show_usage()
+if option_file is None:
+    show_usage()
+
+try:
+    outputs, names = read_map( option_file )
+except OSError as error:
+    print( f'*** {error} ***' )
+    sys.exit( 1 )
+if not outputs:
+    print( f'*** {option_file} has no memory map ***' )
+    sys.exit( 1 )
+
+# Region totals, from the allocated output sections
+used = { name: 0 for name, _, _ in REGIONS }
+for name, address, size in outputs:
+    region = region_of( address )
+    if size and region and not name.startswith( UNALLOCATED ):
+        used[ region ] += size
+print( f'{option_file}:' )
+for name, start, size in REGIONS:
+    print( f'  {name:6} {used[ name ]:9} bytes used of {size:9}  ({100.0 * used[ name ] / size:5.1f}%)' )
+itcm_banks = ( used[ 'ITCM' ] + FLEXRAM_BANK - 1 ) // FLEXRAM_BANK
+dtcm_size = FLEXRAM_SIZE - itcm_banks * FLEXRAM_BANK
+print( f'  FlexRAM: {itcm_banks} banks of ITCM, leaving {dtcm_size} bytes of DTCM, '
+       f'{dtcm_size - used[ "DTCM" ]} of them for the stack' )
+
+if option_top:
+    for region, _, _ in REGIONS:
+        sections = sorted( [ entry for entry in names if entry[ 2 ] and region_of( entry[ 1 ] ) == region
+                             and not entry[ 0 ].startswith( UNALLOCATED ) ],
+                           key=lambda entry: entry[ 2 ], reverse=True )[ :option_top ]
+        if sections:
+            print( f'Largest in {region}:' )
+            for name, address, size, source in sections:
+                print( f'  0x{address:08x} {size:8}  {name}  {source.rsplit( "/", 1 )[ -1 ]}' )
+
+# Where the hot path ended up
+misplaced = 0
+print( 'Hot path:' )
+for symbol, expected in HOT_SYMBOLS:
+    # Mangled names spell each identifier with its length in front
+    parts = symbol.split( '::' )
+    mangled = ''.join( f'{len( part )}{part}' for part in parts ) if len( parts ) > 1 else symbol
+    found = [ entry for entry in names if symbol in entry[ 0 ] or mangled in entry[ 0 ] ]
+    if not found:
+        print( f'  {symbol:32} not in map' )
+        continue
+    regions = sorted( set( region_of( entry[ 1 ] ) or '?' for entry in found ) )
+    flag = '' if regions == [ expected ] else f'  *** expected {expected} ***'
+    if flag:
+        misplaced += 1
+    print( f'  {symbol:32} {",".join( regions ):6} 0x{found[ 0 ][ 1 ]:08x}{flag}' )
+sys.exit( 1 if misplaced else 0 )
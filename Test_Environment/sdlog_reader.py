@@ -0,0 +1,238 @@
+"""
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+Author: Nestor Garcia (Nestor212@email.arizona.edu)
+Brief: Reader for the Thermistor Mux SD card frame logs (TMXnnnnn.BIN, see
+src/thermistorMux_sdlog.h).  Memory-maps the file, finds the data segments in a
+time range from the index segments, checks their CRCs, and prints a summary or
+writes the raw codes out as CSV.  Files cut short by a power loss are read up to
+the last complete segment.  Files written by the ingest tool (ingest/) hold
+temperatures in milli-degrees instead, which are written out in degrees.
+"""
+
+import sys
+import mmap
+import struct
+import zlib
+
+# Log format constants, as in thermistorMux_sdlog.h
+APP_VERSION         = '1.0'
+SDLOG_VERSION       = 2
+# Version 1 logs, with uncoded columns, are still read
+SDLOG_VERSIONS      = ( 1, 2 )
+HEADER_SIZE         = 32
+INDEX_ENTRY_SIZE    = 24
+LOCAL_TIME          = 1 << 63
+MAGIC_HEADER        = b'TMXH'
+MAGIC_DATA          = b'TMXD'
+MAGIC_INDEX         = b'TMXI'
+# What the columns hold, byte 41 of the file header
+COLUMNS_CODES       = 0
+COLUMNS_MDEG        = 1
+NO_VALUE            = -0x80000000
+SEGMENT_HEADER      = struct.Struct( '<4sIHBBIQQ' )
+INDEX_ENTRY         = struct.Struct( '<IHHQQ' )
+
+
+# A frame time as text: UTC seconds, or seconds since boot marked with a 'b'
+def format_time( time ):
+    if time & LOCAL_TIME:
+        return f'b{( time & ~LOCAL_TIME ) / 1e6:.6f}'
+    return f'{time / 1e6:.6f}'
+
+# One log file, memory-mapped read-only
+class SdLog:
+    def __init__( self, filename ):
+        self.file = open( filename, 'rb' )
+        self.map = mmap.mmap( self.file.fileno(), 0, access=mmap.ACCESS_READ )
+        self.view = memoryview( self.map )
+        magic, _, _, self.columns, self.version, _, _, _ = SEGMENT_HEADER.unpack_from( self.map, 0 )
+        if magic != MAGIC_HEADER or self.version not in SDLOG_VERSIONS:
+            raise ValueError( f'{filename} is not a version {SDLOG_VERSION} Thermistor Mux log' )
+        ( self.segment_size, self.frames_per_segment, self.index_interval,
+          self.node, self.kind ) = struct.unpack_from( '<IHHBB', self.map, HEADER_SIZE )
+        if self.kind not in ( COLUMNS_CODES, COLUMNS_MDEG ):
+            raise ValueError( f'{filename} has columns of unknown kind {self.kind}' )
+        self.firmware = bytes( self.view[ 48:80 ] ).split( b'\0' )[ 0 ].decode()
+        self.segments = len( self.map ) // self.segment_size
+        self.bad_segments = 0
+
+    def close( self ):
+        self.view.release()
+        self.map.close()
+        self.file.close()
+
+    # The header fields of segment n if it is complete and intact, otherwise None
+    def segment( self, n ):
+        if n >= self.segments:
+            return None
+        start = n * self.segment_size
+        fields = SEGMENT_HEADER.unpack_from( self.map, start )
+        if fields[ 1 ] != n or fields[ 0 ] not in ( MAGIC_HEADER, MAGIC_DATA, MAGIC_INDEX ):
+            return None
+        crc = zlib.crc32( self.view[ start:start + 12 ] )
+        crc = zlib.crc32( b'\0\0\0\0', crc )
+        crc = zlib.crc32( self.view[ start + 16:start + self.segment_size ], crc )
+        if crc != fields[ 5 ]:
+            self.bad_segments += 1
+            return None
+        return fields
+
+    # The data segments holding frames between first and last (frame times, None
+    # for no limit), as (segment, frames) from the index segments, then by
+    # scanning the segments after the last index
+    def data_segments( self, first=None, last=None ):
+        def wanted( start, end ):
+            return ( first is None or end >= first ) and ( last is None or start <= last )
+        n = self.index_interval
+        while True:
+            fields = self.segment( n )
+            if fields is None or fields[ 0 ] != MAGIC_INDEX:
+                break
+            if wanted( fields[ 6 ], fields[ 7 ] ):
+                base = n * self.segment_size + HEADER_SIZE
+                for i in range( fields[ 2 ] ):
+                    segment, frames, _, start, end = INDEX_ENTRY.unpack_from( self.map, base + i * INDEX_ENTRY_SIZE )
+                    if wanted( start, end ) and self.segment( segment ) is not None:
+                        yield segment, frames
+            n += self.index_interval
+        # The last group has no index yet
+        for segment in range( n - self.index_interval + 1, n ):
+            fields = self.segment( segment )
+            if fields is None:
+                return
+            if wanted( fields[ 6 ], fields[ 7 ] ):
+                yield segment, fields[ 2 ]
+
+    # The frames of one data segment, as (time, codes) tuples
+    def frames( self, segment, count ):
+        if self.version == 1:
+            yield from self.column_frames( segment, count )
+        else:
+            yield from self.delta_frames( segment, count )
+
+    # Version 1 frames, read column by column
+    def column_frames( self, segment, count ):
+        base = segment * self.segment_size + HEADER_SIZE
+        times = self.view[ base:base + 8 * count ].cast( 'Q' )
+        codes_base = base + 8 * self.frames_per_segment
+        columns = [ self.view[ codes_base + 4 * self.frames_per_segment * slot:
+                               codes_base + 4 * ( self.frames_per_segment * slot + count ) ].cast( 'I' )
+                    for slot in range( self.columns ) ]
+        for frame in range( count ):
+            yield times[ frame ], [ column[ frame ] for column in columns ]
+
+    # Version 2 frames, delta coded from the segment's first time (see
+    # src/thermistorMux_delta.h). Differences wrap, as on the node.
+    def delta_frames( self, segment, count ):
+        start = segment * self.segment_size
+        data = self.map[ start:start + self.segment_size ]
+        pos = HEADER_SIZE
+        def varint():
+            nonlocal pos
+            value = shift = 0
+            while True:
+                byte = data[ pos ]
+                pos += 1
+                value |= ( byte & 0x7F ) << shift
+                shift += 7
+                if byte < 0x80:
+                    return ( value >> 1 ) ^ -( value & 1 )
+        time = SEGMENT_HEADER.unpack_from( data, 0 )[ 6 ]
+        step = 0
+        codes = [ 0 ] * self.columns
+        for _ in range( count ):
+            step = ( step + varint() ) & 0xFFFFFFFFFFFFFFFF
+            time = ( time + step ) & 0xFFFFFFFFFFFFFFFF
+            for slot in range( self.columns ):
+                codes[ slot ] = ( codes[ slot ] + varint() ) & 0xFFFFFFFF
+            yield time, list( codes )
+
+    # A column value as CSV text: the code, or a milli-degree value in degrees
+    def format_value( self, value ):
+        if self.kind == COLUMNS_CODES:
+            return str( value )
+        value = value - ( 1 << 32 ) if value & 0x80000000 else value
+        return '' if value == NO_VALUE else f'{value / 1000:.3f}'
+
+# Display how this program should be called, then exit
+def show_usage():
+    print( f'Thermistor Mux SD Log Reader v{APP_VERSION}' )
+    print( f'Usage: {sys.argv[ 0 ]} LOG_FILE [from=TIME] [to=TIME] [csv=FILE]' )
+    print( f'where LOG_FILE = a TMXnnnnn.BIN file copied off the SD card, or one the ingest tool wrote' )
+    print( f'      TIME = UTC seconds since 1970, limiting the frames read' )
+    print( f'      FILE = where to write the frames as CSV, one code or temperature column per scan slot' )
+    print( f'Without csv= the file is summarized.' )
+    sys.exit()
+
+option_file = None
+option_first = None
+option_last = None
+option_csv = None
+
+# Parse the command-line options
+for arg in sys.argv[ 1: ]:
+    lower_arg = arg.lower()
+    try:
+        if lower_arg.startswith( 'from=' ):
+            option_first = int( float( arg.split( '=', 1 )[ 1 ] ) * 1e6 )
+        elif lower_arg.startswith( 'to=' ):
+            option_last = int( float( arg.split( '=', 1 )[ 1 ] ) * 1e6 )
+        elif lower_arg.startswith( 'csv=' ):
+            option_csv = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
+            show_usage()
+        elif option_file is None:
+            option_file = arg
+        else:
+            print( f'*** Unrecognized command: "{arg}" ***' )
+            show_usage()
+    except ValueError:
+        print( f'*** Invalid value: "{arg}" ***' )
+        show_usage()
+if option_file is None:
+    show_usage()
+
+try:
+    log = SdLog( option_file )
+except ( OSError, ValueError, struct.error ) as error:
+    print( f'*** {error} ***' )
+    sys.exit( 1 )
+
+frames = 0
+first_time = None
+last_time = None
+output = open( option_csv, 'w' ) if option_csv else None
+if output:
+    name = 'code' if log.kind == COLUMNS_CODES else 'temp'
+    output.write( 'time,' + ','.join( [ f'{name}{slot}' for slot in range( log.columns ) ] ) + '\n' )
+for segment, count in log.data_segments( option_first, option_last ):
+    for time, codes in log.frames( segment, count ):
+        if ( option_first is not None and time < option_first ) or ( option_last is not None and time > option_last ):
+            continue
+        frames += 1
+        if first_time is None:
+            first_time = time
+        last_time = time
+        if output:
+            output.write( format_time( time ) + ',' + ','.join( map( log.format_value, codes ) ) + '\n' )
+if output:
+    output.close()
+
+print( f'{option_file}: node {log.node}, firmware {log.firmware}, {log.columns} ' +
+       ( 'code' if log.kind == COLUMNS_CODES else 'temperature' ) + ' columns, ' +
+       ( f'{log.frames_per_segment} frames per segment' if log.version == 1 else 'delta coded' ) )
+print( f'{frames} frames read' + ( f', {format_time( first_time )} to {format_time( last_time )}' if frames else '' ) )
+if log.bad_segments:
+    print( f'{log.bad_segments} segments failed their CRC check' )
+log.close()
@@ -0,0 +1,600 @@
+"""
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+Author: Nestor Garcia (Nestor212@email.arizona.edu)
+Brief: Soak test harness for Thermistor Mux modules, for runs of days.  Watches
+one or many THERMISTORx nodes, real or the fleet simulator it starts itself,
+and every window samples each node into a CSV time series: the host-measured
+frame rate, sample-to-host latency percentiles and Rebirth NCMD round trip, and
+the node's own Health and Diagnostics metrics (heap peak and free, stack free,
+frame rate, outbound queue depth, time since sync, phase error).  A least
+squares trend of each series over the run is checked against a limit per day,
+so slow leaks and creeping latency are flagged without reading the plots.
+"""
+
+import time
+import datetime
+import threading
+import subprocess
+import shlex
+import sys
+import json
+import math
+import zlib
+
+import paho.mqtt.client as mqtt
+from sparkplug_b import *
+
+# Application constants
+APP_VERSION             = '1.0'
+COMPRESSED_UUID         = 'SPBV1.0_COMPRESSED'
+FIRMWARE_VERSION_METRIC = 'Properties/Firmware Version'
+THERMISTOR_PREFIX       = 'Inputs/THERMISTOR'
+NODE_ID                 = 'THERMISTOR'
+GROUP_ID                = 'VI'
+NUM_MODULES             = 32
+DEFAULT_BROKER_URL      = 'localhost'
+DEFAULT_BROKER_PORT     = 1883
+DEFAULT_HOURS           = 72
+DEFAULT_WINDOW          = 600
+DEFAULT_RTT_INTERVAL    = 300
+MIN_TREND_WINDOWS       = 12        # Windows a node needs before its trends are judged
+MAX_SECONDS_SINCE_SYNC  = 3600      # Flagged when a node goes longer than this without a time sync
+SIM_RESTART_DELAY       = 5         # Seconds before a simulator that exited is started again
+
+# The node's metrics sampled each window, by CSV column: the last value seen,
+# or the largest for those that move between Health refreshes
+NODE_SERIES = [
+    ( 'heap_peak',       'Diagnostics/Heap Peak',            'last' ),
+    ( 'heap_free',       'Diagnostics/Heap Free',            'last' ),
+    ( 'stack_free',      'Diagnostics/Stack Free',           'last' ),
+    ( 'node_fps',        'Health/Frame Rate',                'last' ),
+    ( 'cpu_percent',     'Health/CPU Utilization',           'last' ),
+    ( 'queue_depth',     'Properties/Outbound Queue Depth',  'max' ),
+    ( 'since_sync_s',    'Health/Seconds Since Time Sync',   'max' ),
+    ( 'phase_error_us',  'Health/Frame Phase Error',         'max' ),
+    ( 'publish_failures','Health/Publish Failures',          'last' ),
+    ( 'frames_lost',     'Health/Frames Lost',               'last' )
+]
+# Measured here each window
+HOST_SERIES = [ 'births', 'deaths', 'frames', 'fps', 'seq_errors', 'messages_lost',
+                'latency_p50', 'latency_p95', 'latency_p99', 'latency_max', 'rtt_ms' ]
+
+# Trends flagged: the series, which way is worse (+1 rising, -1 falling), and
+# the limit on its change per day, the larger of a fraction of its mean and a
+# floor in its own units
+TRENDS = [
+    ( 'heap_peak',       +1, 0.0,  1024 ),
+    ( 'heap_free',       -1, 0.0,  1024 ),
+    ( 'stack_free',      -1, 0.0,  256 ),
+    ( 'node_fps',        -1, 0.01, 0.01 ),
+    ( 'fps',             -1, 0.01, 0.01 ),
+    ( 'cpu_percent',     +1, 0.0,  1.0 ),
+    ( 'queue_depth',     +1, 0.0,  1.0 ),
+    ( 'phase_error_us',  +1, 0.1,  10.0 ),
+    ( 'latency_p50',     +1, 0.1,  1.0 ),
+    ( 'latency_p99',     +1, 0.1,  5.0 ),
+    ( 'rtt_ms',          +1, 0.1,  5.0 )
+]
+
+date_string = datetime.datetime.now().strftime( '%Y-%m-%d_%H%M%S' )
+SERIES_FILENAME = f'thermistorMux_soak_{date_string}.csv'
+REPORT_FILENAME = f'thermistorMux_soak_report_{date_string}.json'
+
+lock = threading.Lock()
+
+
+# Current time in milliseconds, the same units as Sparkplug timestamps
+def now_millis():
+    return time.time() * 1000
+
+# The p'th percentile of an ordered list, None for an empty one
+def percentile( ordered, p ):
+    if len( ordered ) == 0:
+        return None
+    return ordered[ min( len( ordered ) - 1, int( math.ceil( p / 100 * len( ordered ) ) ) - 1 ) ]
+
+# Round a value for the series, leaving None alone
+def rounded( value, digits = 3 ):
+    return None if value is None else round( value, digits )
+
+# Least squares slope of the (x, y) points with a y, None with fewer than two
+def slope( points ):
+    points = [ ( x, y ) for x, y in points if y is not None and not math.isnan( y ) ]
+    if len( points ) < 2:
+        return None
+    mean_x = sum( x for x, _ in points ) / len( points )
+    mean_y = sum( y for _, y in points ) / len( points )
+    sxx = sum( ( x - mean_x ) ** 2 for x, _ in points )
+    if sxx == 0:
+        return None
+    return sum( ( x - mean_x ) * ( y - mean_y ) for x, y in points ) / sxx
+
+# Everything measured for one node: the current window, and a sample of each
+# window so far
+class NodeSoak:
+    def __init__( self, module_id ):
+        self.node_id = f'{NODE_ID}{module_id}'
+        self.birth_topic = node_topic( module_id, 'NBIRTH' )
+        self.death_topic = node_topic( module_id, 'NDEATH' )
+        self.data_topic  = node_topic( module_id, 'NDATA' )
+        self.cmd_topic   = node_topic( module_id, 'NCMD' )
+        self.alive = False
+        self.message_seq = 0
+        self.names = {}                 # Alias to name, from the NBIRTH
+        self.thermistor_aliases = set()
+        self.rebirth_alias = None
+        self.firmware_version = None
+        self.rebirth_sent = None
+        self.rtt_timeouts = 0
+        self.history = []               # One dict per window
+        self.values = {}                # Node series, last value seen
+        self.new_window()
+
+    def new_window( self ):
+        self.births = 0
+        self.deaths = 0
+        self.frames = 0
+        self.first_frame = None
+        self.last_frame = None
+        self.seq_errors = 0
+        self.messages_lost = 0
+        self.latencies = []
+        self.rtts = []
+        # The peak ones start again from their current value
+        self.peaks = { column: self.values.get( column ) for column, _, how in NODE_SERIES if how == 'max' }
+
+    # Record a node metric's value
+    def note( self, name, value ):
+        for column, metric_name, how in NODE_SERIES:
+            if metric_name != name:
+                continue
+            self.values[ column ] = value
+            if how == 'max' and value is not None:
+                peak = self.peaks.get( column )
+                if peak is None or value > peak:
+                    self.peaks[ column ] = value
+
+    # Close the window at hours into the run, returning its sample
+    def sample( self, hours ):
+        ordered = sorted( self.latencies )
+        fps = None
+        if self.frames > 1 and self.last_frame > self.first_frame:
+            fps = ( self.frames - 1 ) / ( ( self.last_frame - self.first_frame ) / 1000 )
+        row = {
+            'hours':         round( hours, 4 ),
+            'births':        self.births,
+            'deaths':        self.deaths,
+            'frames':        self.frames,
+            'fps':           rounded( fps ),
+            'seq_errors':    self.seq_errors,
+            'messages_lost': self.messages_lost,
+            'latency_p50':   rounded( percentile( ordered, 50 ) ),
+            'latency_p95':   rounded( percentile( ordered, 95 ) ),
+            'latency_p99':   rounded( percentile( ordered, 99 ) ),
+            'latency_max':   rounded( ordered[ -1 ] if ordered else None ),
+            'rtt_ms':        rounded( percentile( sorted( self.rtts ), 50 ) )
+        }
+        heard = self.frames > 0 or self.births > 0
+        for column, _, how in NODE_SERIES:
+            value = self.peaks.get( column ) if how == 'max' else self.values.get( column )
+            row[ column ] = rounded( value ) if heard else None
+        self.history.append( row )
+        self.new_window()
+        return row
+
+    # The trend of each series over the run, per day, and whether it's past its limit
+    def trends( self ):
+        results = {}
+        for column, direction, relative, floor in TRENDS:
+            points = [ ( row[ 'hours' ] / 24, row[ column ] ) for row in self.history ]
+            values = [ y for _, y in points if y is not None and not math.isnan( y ) ]
+            per_day = slope( points )
+            if per_day is None:
+                continue
+            limit = max( relative * abs( sum( values ) / len( values ) ), floor )
+            results[ column ] = {
+                'per_day': round( per_day, 3 ),
+                'limit':   round( limit, 3 ),
+                'flagged': len( values ) >= MIN_TREND_WINDOWS and direction * per_day > limit
+            }
+        since_sync = [ row[ 'since_sync_s' ] for row in self.history if row[ 'since_sync_s' ] is not None ]
+        if since_sync:
+            results[ 'since_sync_s' ] = {
+                'max':     max( since_sync ),
+                'limit':   MAX_SECONDS_SINCE_SYNC,
+                'flagged': max( since_sync ) > MAX_SECONDS_SINCE_SYNC
+            }
+        return results
+
+    def report( self ):
+        return {
+            'firmware_version': self.firmware_version,
+            'windows':          len( self.history ),
+            'frames':           sum( row[ 'frames' ] for row in self.history ),
+            'births':           sum( row[ 'births' ] for row in self.history ),
+            'deaths':           sum( row[ 'deaths' ] for row in self.history ),
+            'seq_errors':       sum( row[ 'seq_errors' ] for row in self.history ),
+            'messages_lost':    sum( row[ 'messages_lost' ] for row in self.history ),
+            'ncmd_timeouts':    self.rtt_timeouts,
+            'trends':           self.trends()
+        }
+
+# Return the topic for a particular node message
+def node_topic( module_id, message_type ):
+    return f'spBv1.0/{GROUP_ID}/{message_type}/{NODE_ID}{module_id}'
+
+# Display how this program should be called, then exit
+def show_usage():
+    print( f'Thermistor Mux Soak Test v{APP_VERSION}' )
+    print( f'Usage: {sys.argv[ 0 ]} [broker=[BROKER_IP][=BROKER_PORT]] [modules=MODULE_LIST] [hours=HOURS] [window=SECONDS] [rtt=INTERVAL] [run=COMMAND] [series=FILE] [report=FILE] [verbose]' )
+    print( f'where BROKER_IP = hostname or IP address of MQTT broker (default {DEFAULT_BROKER_URL})' )
+    print( f'      BROKER_PORT = port number of MQTT broker (default {DEFAULT_BROKER_PORT})' )
+    print( f'      MODULE_LIST = modules to watch, e.g. 3 or 0-5 or 0,2,7 (default 0-{NUM_MODULES - 1})' )
+    print( f'      HOURS = how long to run for, 0 until stopped with Ctrl-C (default {DEFAULT_HOURS})' )
+    print( f'      SECONDS = length of each sample window (default {DEFAULT_WINDOW})' )
+    print( f'      INTERVAL = seconds between Rebirth round trips to each module, 0 for none (default {DEFAULT_RTT_INTERVAL})' )
+    print( f'      COMMAND = simulator to run for the nodes, restarted if it exits, e.g.' )
+    print( f'                run=".pio/build/native_fleet/program --nodes 4 --frame-period 100"' )
+    print( f'      FILE = where to write the CSV series (default thermistorMux_soak_DATE_TIME.csv)' )
+    print( f'             or the JSON report, rewritten every window (default thermistorMux_soak_report_DATE_TIME.json)' )
+    print( f'      verbose = display each seq error, timeout and simulator restart as it happens' )
+    sys.exit()
+
+# Display a diagnostic message if verbose
+def report( msg ):
+    if option_verbose:
+        print( f'*** {msg} ***' )
+
+# Parse a module list such as "0-5,9"
+def parse_modules( arg ):
+    modules = []
+    for part in arg.split( ',' ):
+        bounds = part.split( '-', 1 )
+        first = int( bounds[ 0 ] )
+        last = int( bounds[ -1 ] )
+        if first < 0 or last >= NUM_MODULES or first > last:
+            raise ValueError
+        modules.extend( range( first, last + 1 ) )
+    return sorted( set( modules ) )
+
+# Count a message whose seq number isn't as expected, with the same rules as
+# check_message_sequence() in client.py: NDEATH has no seq, NBIRTH has seq 0,
+# and every other message has the previous seq plus one, wrapping at 255.
+def check_message_sequence( node, topic, payload ):
+    if topic == node.death_topic:
+        return True
+
+    prev_seq = node.message_seq
+    node.message_seq = payload.seq
+
+    if topic == node.birth_topic:
+        if payload.seq != 0:
+            node.seq_errors += 1
+            report( f'{node.node_id}: seq (= {payload.seq}) in NBIRTH message should be 0' )
+            return False
+    else:
+        next_seq = ( prev_seq + 1 ) % 256
+        if payload.seq != next_seq:
+            node.seq_errors += 1
+            node.messages_lost += ( payload.seq - next_seq ) % 256
+            report( f'{node.node_id}: seq (= {payload.seq}) in message should be {next_seq} (previous = {prev_seq})' )
+            return False
+    return True
+
+# A scalar metric's value, None for a null, a NaN or a type not sampled.  Int64s
+# come in an unsigned field; the node's "never" values are -1, so negative is None.
+def metric_value( metric ):
+    if metric.is_null:
+        return None
+    if metric.datatype in [ MetricDataType.Float, MetricDataType.Double ]:
+        value = metric.float_value if metric.datatype == MetricDataType.Float else metric.double_value
+        return None if math.isnan( value ) else value
+    if metric.datatype in [ MetricDataType.Int64, MetricDataType.UInt64 ]:
+        value = metric.long_value
+        return None if value >= ( 1 << 63 ) else value
+    if metric.datatype in [ MetricDataType.Int32, MetricDataType.UInt32 ]:
+        return metric.int_value
+    return None
+
+# Learn the node's aliases and properties from its NBIRTH
+def process_birth( node, payload ):
+    node.names = {}
+    node.thermistor_aliases = set()
+    node.rebirth_alias = None
+    for metric in payload.metrics:
+        node.names[ metric.alias ] = metric.name
+        if metric.name.startswith( THERMISTOR_PREFIX ):
+            node.thermistor_aliases.add( metric.alias )
+        elif metric.name == 'Node Control/Rebirth':
+            node.rebirth_alias = metric.alias
+        elif metric.name == FIRMWARE_VERSION_METRIC:
+            node.firmware_version = metric.string_value
+    process_metrics( node, payload )
+
+# Record the sampled node metrics in a payload, by name or by their NBIRTH alias
+def process_metrics( node, payload ):
+    for metric in payload.metrics:
+        if metric.is_historical:
+            continue
+        name = metric.name if metric.name else node.names.get( metric.alias )
+        if name is not None:
+            node.note( name, metric_value( metric ) )
+
+# Count the frames in a payload and the latency of the current one, as
+# load_test.py does; replayed frames don't count towards latency.
+def process_frames( node, payload, received ):
+    live = set()
+    for metric in payload.metrics:
+        if metric.alias not in node.thermistor_aliases and not metric.name.startswith( THERMISTOR_PREFIX ):
+            continue
+        if metric.HasField( 'timestamp' ) and not metric.is_historical:
+            live.add( metric.timestamp )
+    for timestamp in sorted( live ):
+        node.frames += 1
+        node.latencies.append( received - timestamp )
+        if node.first_frame is None:
+            node.first_frame = timestamp
+        node.last_frame = timestamp
+
+# Ask the node for a rebirth, timing how long its NBIRTH takes to arrive
+def send_rebirth( client, node ):
+    payload = sparkplug_b_pb2.Payload()
+    payload.timestamp = int( round( time.time() * 1000 ) )
+    if node.rebirth_alias is not None:
+        addMetric( payload, None, node.rebirth_alias, MetricDataType.Boolean, True )
+    else:
+        addMetric( payload, 'Node Control/Rebirth', None, MetricDataType.Boolean, True )
+    node.rebirth_sent = now_millis()
+    client.publish( node.cmd_topic, bytearray( payload.SerializeToString() ), 0, False )
+
+def on_connect( client, userdata, flags, rc ):
+    if rc != 0:
+        print( f'*** Failed to connect with result code {rc} ***' )
+        return
+    for node in nodes.values():
+        client.subscribe( node.birth_topic )
+        client.subscribe( node.death_topic )
+        client.subscribe( node.data_topic )
+
+# Callback called when an MQTT message is received
+def on_message( client, userdata, msg ):
+    received = now_millis()
+    node = topics.get( msg.topic )
+    if node is None:
+        return
+
+    payload = sparkplug_b_pb2.Payload()
+    try:
+        payload.ParseFromString( msg.payload )
+    except:
+        report( f'Could not parse "{msg.topic}" message' )
+        return
+    if payload.uuid == COMPRESSED_UUID:
+        try:
+            payload = decompress_payload( payload )
+        except ( zlib.error, ValueError ):
+            report( f'Could not decompress "{msg.topic}" message' )
+            return
+
+    with lock:
+        check_message_sequence( node, msg.topic, payload )
+        if msg.topic == node.birth_topic:
+            node.births += 1
+            node.alive = True
+            process_birth( node, payload )
+            if node.rebirth_sent is not None:
+                node.rtts.append( received - node.rebirth_sent )
+                node.rebirth_sent = None
+        elif msg.topic == node.death_topic:
+            node.deaths += 1
+            node.alive = False
+        elif node.alive:
+            process_metrics( node, payload )
+            process_frames( node, payload, received )
+
+# Keep the simulator running, starting it again SIM_RESTART_DELAY after it exits
+class Simulator:
+    def __init__( self, command ):
+        self.command = shlex.split( command )
+        self.process = None
+        self.restarts = 0
+        self.exited = None
+
+    def poll( self ):
+        if self.process is not None and self.process.poll() is None:
+            return
+        if self.process is not None and self.exited is None:
+            self.exited = time.time()
+            report( f'Simulator exited with status {self.process.returncode}' )
+        if self.exited is not None and time.time() - self.exited < SIM_RESTART_DELAY:
+            return
+        if self.process is not None:
+            self.restarts += 1
+        self.process = subprocess.Popen( self.command, stdout = subprocess.DEVNULL )
+        self.exited = None
+
+    def stop( self ):
+        if self.process is not None and self.process.poll() is None:
+            self.process.terminate()
+            self.process.wait()
+
+# Write the report as it stands, so a run that dies still leaves one
+def write_report( seconds ):
+    node_reports = { node.node_id: node.report() for node in nodes.values() }
+    flags = [ f'{node_id} {column}' for node_id, r in node_reports.items()
+              for column, trend in r[ 'trends' ].items() if trend[ 'flagged' ] ]
+    soak_report = {
+        'app_version':       APP_VERSION,
+        'started':           started.isoformat( ' ', timespec = 'seconds' ),
+        'hours':             round( seconds / 3600, 3 ),
+        'window_s':          option_window,
+        'broker':            f'{option_broker_URL}:{option_broker_port}',
+        'firmware_versions': sorted( set( r[ 'firmware_version' ] for r in node_reports.values() if r[ 'firmware_version' ] ) ),
+        'simulator_restarts': None if simulator is None else simulator.restarts,
+        'flags':             flags,
+        'nodes':             node_reports
+    }
+    with open( option_report, 'w' ) as report_file:
+        json.dump( soak_report, report_file, indent = 2 )
+    return flags
+
+
+# Main program starts here
+
+# Set the default option values
+option_broker_URL = DEFAULT_BROKER_URL
+option_broker_port = DEFAULT_BROKER_PORT
+option_modules = list( range( NUM_MODULES ) )
+option_hours = DEFAULT_HOURS
+option_window = DEFAULT_WINDOW
+option_rtt_interval = DEFAULT_RTT_INTERVAL
+option_run = None
+option_series = SERIES_FILENAME
+option_report = REPORT_FILENAME
+option_verbose = False
+
+# Parse the command-line options
+for arg in sys.argv[ 1: ]:
+    lower_arg = arg.lower()
+    try:
+        if lower_arg.startswith( 'broker=' ):
+            split_arg = arg.split( '=', 2 )
+            if split_arg[ 1 ] != '':
+                option_broker_URL = split_arg[ 1 ]
+            if len( split_arg ) == 3:
+                option_broker_port = int( split_arg[ 2 ] )
+        elif lower_arg.startswith( 'modules=' ):
+            option_modules = parse_modules( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'hours=' ):
+            option_hours = float( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'window=' ):
+            option_window = float( arg.split( '=', 1 )[ 1 ] )
+            if option_window <= 0:
+                raise ValueError
+        elif lower_arg.startswith( 'rtt=' ):
+            option_rtt_interval = float( arg.split( '=', 1 )[ 1 ] )
+        elif lower_arg.startswith( 'run=' ):
+            option_run = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg.startswith( 'series=' ):
+            option_series = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg.startswith( 'report=' ):
+            option_report = arg.split( '=', 1 )[ 1 ]
+        elif lower_arg == 'verbose':
+            option_verbose = True
+        elif lower_arg == 'help' or lower_arg == '-help' or lower_arg == '--help' or lower_arg == 'h' or lower_arg == '-h':
+            show_usage()
+        else:
+            print( f'*** Unrecognized command: "{arg}" ***' )
+            show_usage()
+    except ValueError:
+        print( f'*** Invalid value: "{arg}" ***' )
+        show_usage()
+
+nodes = { module_id: NodeSoak( module_id ) for module_id in option_modules }
+topics = {}
+for node in nodes.values():
+    for topic in [ node.birth_topic, node.death_topic, node.data_topic ]:
+        topics[ topic ] = node
+
+simulator = None
+if option_run is not None:
+    simulator = Simulator( option_run )
+    simulator.poll()
+
+# Set up the MQTT client connection; paho reconnects by itself after a broker outage
+client = mqtt.Client()
+client.on_connect = on_connect
+client.on_message = on_message
+try:
+    client.connect( option_broker_URL, option_broker_port, 60 )
+except ConnectionRefusedError:
+    print( f'*** Failed to connect to MQTT broker at {option_broker_URL}:{option_broker_port} ***' )
+    if simulator is not None:
+        simulator.stop()
+    sys.exit()
+client.loop_start()
+
+run_for = 'until stopped' if option_hours == 0 else f'for {option_hours:g} h'
+print( f'Thermistor Mux Soak Test v{APP_VERSION}: {len( nodes )} modules {run_for}, {option_window:g} s windows' )
+started = datetime.datetime.now()
+start = time.time()
+
+series_file = open( option_series, 'w' )
+series_file.write( ','.join( [ 'time', 'node', 'hours' ] + HOST_SERIES + [ column for column, _, _ in NODE_SERIES ] ) + '\n' )
+
+# Ask every node for a birth so aliases are known, then time a round trip to
+# each one every rtt interval, staggered so they don't all rebirth at once
+next_rtt = {}
+with lock:
+    for position, node in enumerate( nodes.values() ):
+        send_rebirth( client, node )
+        if option_rtt_interval > 0:
+            next_rtt[ node ] = start + option_rtt_interval * ( 1 + position / len( nodes ) )
+next_window = start + option_window
+flags = []
+try:
+    while option_hours == 0 or time.time() - start < option_hours * 3600:
+        time.sleep( 0.1 )
+        now = time.time()
+        if simulator is not None:
+            simulator.poll()
+        with lock:
+            for node, due in next_rtt.items():
+                if now < due:
+                    continue
+                if node.rebirth_sent is not None:
+                    node.rtt_timeouts += 1
+                    report( f'{node.node_id}: no NBIRTH within {option_rtt_interval:g} s of Rebirth' )
+                send_rebirth( client, node )
+                next_rtt[ node ] = due + option_rtt_interval
+        if now < next_window:
+            continue
+        next_window += option_window
+
+        # Close the window: a row per node, the report rewritten and a line of summary
+        stamp = datetime.datetime.now().isoformat( ' ', timespec = 'seconds' )
+        with lock:
+            rows = { node.node_id: node.sample( ( now - start ) / 3600 ) for node in nodes.values() }
+            flags = write_report( now - start )
+        for node_id, row in rows.items():
+            values = [ row[ column ] for column in HOST_SERIES + [ column for column, _, _ in NODE_SERIES ] ]
+            series_file.write( ','.join( [ stamp, node_id, str( row[ 'hours' ] ) ] +
+                                         [ '' if value is None else str( value ) for value in values ] ) + '\n' )
+        series_file.flush()
+        heard = [ row for row in rows.values() if row[ 'frames' ] > 0 ]
+        p99 = max( ( row[ 'latency_p99' ] for row in heard ), default = None )
+        peak = max( ( row[ 'heap_peak' ] for row in heard if row[ 'heap_peak' ] is not None ), default = None )
+        print( f'{stamp}  {len( heard )}/{len( nodes )} nodes  {sum( row[ "frames" ] for row in heard )} frames  '
+               f'p99 {"-" if p99 is None else f"{p99:.1f}"} ms  heap peak {"-" if peak is None else int( peak )} B  '
+               f'{len( flags )} flagged' )
+except KeyboardInterrupt:
+    pass
+client.loop_stop()
+client.disconnect()
+if simulator is not None:
+    simulator.stop()
+series_file.close()
+
+# Write the final report
+with lock:
+    flags = write_report( time.time() - start )
+    node_reports = { node.node_id: node.report() for node in nodes.values() }
+print( f'{"Node":14} {"windows":>8} {"frames":>10} {"seq err":>8} {"lost":>6}  flagged trends' )
+for node_id, r in node_reports.items():
+    if r[ 'frames' ] == 0 and r[ 'births' ] == 0:
+        continue
+    flagged = [ f'{column} {trend.get( "per_day", trend.get( "max" ) )}' for column, trend in r[ 'trends' ].items() if trend[ 'flagged' ] ]
+    print( f'{node_id:14} {r[ "windows" ]:8} {r[ "frames" ]:10} {r[ "seq_errors" ]:8} {r[ "messages_lost" ]:6}  {", ".join( flagged ) if flagged else "-"}' )
+print( f'Series written to {option_series}, report to {option_report}' )
+sys.exit( 1 if flags else 0 )
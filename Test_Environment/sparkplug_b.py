@@ -12,6 +12,7 @@
 # ********************************************************************************/
 import sparkplug_b_pb2
 import time
+import zlib
 from sparkplug_b_pb2 import Payload
 
 seqNum = 0
@@ -55,6 +56,9 @@ class MetricDataType:
     Bytes = 17
     File = 18
     Template = 19
+    # Sparkplug 3.0 array types, sent as packed little-endian bytes_value
+    Int32Array = 24
+    FloatArray = 30
 
 class ParameterDataType:
     Unknown = 0
@@ -328,3 +332,26 @@ def getBdSeqNum():
         bdSeq = 0
     return retVal
 ######################################################################
+
+######################################################################
+# Unwrap a compressed payload (one with a body and an algorithm metric).
+# The node sends the seq on the envelope only, so it's copied to the
+# payload inside.
+######################################################################
+def decompress_payload(envelope):
+    algorithm = 'DEFLATE'
+    for metric in envelope.metrics:
+        if metric.name == 'algorithm':
+            algorithm = metric.string_value.upper()
+    if algorithm == 'GZIP':
+        body = zlib.decompress(envelope.body, 16 + zlib.MAX_WBITS)
+    elif algorithm == 'DEFLATE':
+        body = zlib.decompress(envelope.body)
+    else:
+        raise ValueError('Unknown compression algorithm ' + algorithm)
+    payload = sparkplug_b_pb2.Payload()
+    payload.ParseFromString(body)
+    if envelope.HasField('seq') and not payload.HasField('seq'):
+        payload.seq = envelope.seq
+    return payload
+######################################################################
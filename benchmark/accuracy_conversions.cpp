@@ -0,0 +1,315 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file accuracy_conversions.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Host accuracy harness of the fast thermistor conversions. Every code
+ * (or every --step'th) is converted by the exact equation in double precision,
+ * the golden model, and by each fast path: the legacy scalar
+ * convert_thermistor_temp(), the lookup table of convert_thermistor_block(),
+ * and the table with a linear, a piecewise-linear and, with
+ * USE_MILLIDEGREE_NDATA, a fixed point calibration. The max and RMS errors in C
+ * over -40 to 125 C are printed per sensor model and calibration, against the
+ * model's error budget; the exit status is 1 if a budget is exceeded.
+ *
+ *     pio run -e native_accuracy && .pio/build/native_accuracy/program [--step N]
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "command_ADC.h"
+#include "thermistorMux_global.h"
+
+// The range the budgets hold over, C
+#define ACCURACY_MIN_C  -40.0
+#define ACCURACY_MAX_C  125.0
+
+#define ACCURACY_MODEL_SLOT  1      // Sensor model slot the swept models are put in
+
+// Budget of the build's thermistor, as the other model of its kind
+#ifdef thermistor_10K
+#define BUILD_BUDGET_C  0.01
+#else
+#define BUILD_BUDGET_C  0.1
+#endif
+
+// A sensor model to sweep, and the largest error its conversions may have
+struct AccuracyModel {
+    const char *name;
+    SensorModel sensor;
+    double budget_c;
+};
+
+// How a fast path converts a run of codes, and how the golden model calibrates
+enum AccuracyPath {
+    PATH_SCALAR,            // convert_thermistor_temp(), the build's model only
+    PATH_TABLE,             // convert_thermistor_block()
+    PATH_LINEAR,            // convert_thermistor_block_calibrated()
+    PATH_PIECEWISE,         // convert_thermistor_block_piecewise()
+#ifdef USE_MILLIDEGREE_NDATA
+    PATH_MDEG,              // convert_thermistor_block_mdeg()
+#endif
+    NUM_PATHS
+};
+
+static const char *const PathNames[NUM_PATHS] = {
+    "scalar",
+    "table",
+    "table, linear cal",
+    "table, piecewise cal",
+#ifdef USE_MILLIDEGREE_NDATA
+    "table, fixed point cal",
+#endif
+};
+
+struct AccuracyResult {
+    unsigned long codes;
+    double max_error;
+    double max_at;          // Golden temperature of the largest error
+    double sum_squares;
+};
+
+static AccuracyModel m_models[] = {
+    {"Build's thermistor",  {},                                                                        BUILD_BUDGET_C},
+    {"Beta 10K 3977 K",     {SENSOR_BETA, 10000, 3977, 0, 0, 0, 10000, 2.33f, 2.33f},                  0.01},
+    {"Beta 2K2 3930 K",     {SENSOR_BETA, 2200, 3930, 0, 0, 0, 10000, 2.33f, 2.33f},                   0.1},
+    {"Steinhart-Hart 10K",  {SENSOR_STEINHART_HART, 10000, 0, 1.129148e-3f, 2.34125e-4f, 8.76741e-8f,
+                             10000, 2.33f, 2.33f},                                                      0.01},
+};
+
+// Calibrations, the same on every channel: linear, and a continuous three point
+// piecewise-linear one as a sweep produces
+static float m_gain[NUMBER_OF_THERMISTORS];
+static float m_offset[NUMBER_OF_THERMISTORS];
+static CalSegments m_cal[NUMBER_OF_THERMISTORS];
+#ifdef USE_MILLIDEGREE_NDATA
+static CalSegmentsFixed m_cal_fixed[NUMBER_OF_THERMISTORS];
+#endif
+
+#define LINEAR_GAIN    1.002f
+#define LINEAR_OFFSET  -0.15f
+
+
+/*
+The golden model: the exact equation of sensor in double precision, C.
+*/
+static double golden_temp(const SensorModel &sensor, int32_t code) {
+    double a = sensor.a, b = sensor.b, c = sensor.c;
+    if (sensor.equation == SENSOR_BETA) {
+        a = (1 / 298.15) - (log((double)sensor.nominal_ohms) / sensor.beta);
+        b = 1.0 / sensor.beta;
+        c = 0;
+    }
+    double voltage = ((double)sensor.vref / 8388608.0) * code;
+    double ohms = (voltage * sensor.divider_ohms) / ((double)sensor.supply - voltage);
+    double ln_r = log(ohms);
+    return (1 / (a + (b * ln_r) + (c * ln_r * ln_r * ln_r))) - 273.15;
+}
+
+
+static double golden_piecewise(const CalSegments &cal, double temp) {
+    int s = 0;
+    while (s < CAL_SEGMENTS - 1 && temp >= cal.start[s + 1]) {
+        s++;
+    }
+    return (cal.gain[s] * temp) + cal.offset[s];
+}
+
+
+static double golden_calibrated(AccuracyPath path, double temp) {
+    switch (path) {
+    case PATH_LINEAR:
+        return (LINEAR_GAIN * temp) + LINEAR_OFFSET;
+    case PATH_PIECEWISE:
+#ifdef USE_MILLIDEGREE_NDATA
+    case PATH_MDEG:
+#endif
+        return golden_piecewise(m_cal[0], temp);
+    default:
+        return temp;
+    }
+}
+
+
+static void set_up_calibrations() {
+    // Points (0 C, -0.1), (40 C, +0.05), (80 C, +0.3), extended past the ends
+    CalSegments cal;
+    for (int s = 0; s < CAL_SEGMENTS; s++) {
+        cal.start[s] = INFINITY;
+        cal.gain[s] = 1.0f;
+        cal.offset[s] = 0.0f;
+    }
+    cal.start[0] = -INFINITY;
+    cal.gain[0] = 1.0f + (0.15f / 40);
+    cal.offset[0] = -0.1f;
+    cal.start[1] = 40.0f;
+    cal.gain[1] = 1.0f + (0.25f / 40);
+    cal.offset[1] = 0.05f - (40 * (0.25f / 40));
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        m_gain[i] = LINEAR_GAIN;
+        m_offset[i] = LINEAR_OFFSET;
+        m_cal[i] = cal;
+#ifdef USE_MILLIDEGREE_NDATA
+        fix_cal_segments(&m_cal[i], &m_cal_fixed[i]);
+#endif
+    }
+}
+
+
+/*
+Converts n codes, one per channel, by path, C.
+*/
+static void fast_convert(AccuracyPath path, const uint32_t *codes, double *out, size_t n) {
+    float temps[NUMBER_OF_THERMISTORS];
+    switch (path) {
+    case PATH_SCALAR:
+        for (size_t i = 0; i < n; i++) {
+            temps[i] = convert_thermistor_temp(codes[i]);
+        }
+        break;
+    case PATH_TABLE:
+        convert_thermistor_block(codes, temps, n);
+        break;
+    case PATH_LINEAR:
+        convert_thermistor_block_calibrated(codes, m_gain, m_offset, temps, n);
+        break;
+    case PATH_PIECEWISE:
+        convert_thermistor_block_piecewise(codes, m_cal, temps, n);
+        break;
+#ifdef USE_MILLIDEGREE_NDATA
+    case PATH_MDEG: {
+        int32_t mdeg[NUMBER_OF_THERMISTORS];
+        convert_thermistor_block_mdeg(codes, m_cal_fixed, mdeg, n);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = mdeg[i] / 1000.0;
+        }
+        return;
+    }
+#endif
+    default:
+        break;
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[i] = temps[i];
+    }
+}
+
+
+/*
+Converts n codes by path and adds their errors against golden to result.
+*/
+static void score(AccuracyPath path, const uint32_t *codes, const double *golden, size_t n, AccuracyResult *result) {
+    double fast[NUMBER_OF_THERMISTORS];
+    fast_convert(path, codes, fast, n);
+    for (size_t i = 0; i < n; i++) {
+        double error = fabs(fast[i] - golden[i]);
+        if (!(error <= result->max_error)) {
+            result->max_error = error;
+            result->max_at = golden[i];
+        }
+        result->sum_squares += error * error;
+    }
+    result->codes += n;
+}
+
+
+/*
+Sweeps the positive codes, every step'th, whose golden temperature is within
+the range, through path with every channel on sensor.
+*/
+static AccuracyResult sweep(const SensorModel &sensor, AccuracyPath path, uint32_t step) {
+    AccuracyResult result = {0, 0, 0, 0};
+    uint32_t codes[NUMBER_OF_THERMISTORS];
+    double golden[NUMBER_OF_THERMISTORS];
+    size_t n = 0;
+    for (uint32_t code = 1; code < 0x007FFFFF; code += step) {
+        double temp = golden_temp(sensor, (int32_t)code);
+        if (!(temp >= ACCURACY_MIN_C && temp <= ACCURACY_MAX_C)) {
+            continue;
+        }
+        codes[n] = code;
+        golden[n] = golden_calibrated(path, temp);
+        if (++n == NUMBER_OF_THERMISTORS) {
+            score(path, codes, golden, n, &result);
+            n = 0;
+        }
+    }
+    score(path, codes, golden, n, &result);
+    return result;
+}
+
+
+static void usage() {
+    printf("Usage: program [--step N]\n"
+           "  --step N   Sweep every N'th code (default 1, every code)\n");
+}
+
+
+int main(int argc, char **argv) {
+    uint32_t step = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            step = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (step == 0) {
+        usage();
+        return 2;
+    }
+
+    m_models[0].sensor = *default_sensor_model();
+    set_up_calibrations();
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        set_channel_sensor(i, ACCURACY_MODEL_SLOT);
+    }
+
+    printf("Thermistor Mux %s conversion accuracy, %.0f to %.0f C, every %lu code(s)\n", THERMISTOR_MUX_VERSION,
+           ACCURACY_MIN_C, ACCURACY_MAX_C, (unsigned long)step);
+    printf("%-20s %-24s %9s %10s %9s %10s %8s\n", "Model", "Conversion", "codes", "max C", "at C", "RMS C", "budget");
+    bool within = true;
+    for (unsigned int m = 0; m < sizeof(m_models) / sizeof(m_models[0]); m++) {
+        const AccuracyModel *model = &m_models[m];
+        if (!set_sensor_model(ACCURACY_MODEL_SLOT, &model->sensor)) {
+            printf("%-20s invalid model\n", model->name);
+            within = false;
+            continue;
+        }
+        for (int p = 0; p < NUM_PATHS; p++) {
+            // The scalar conversion has the build's model built in
+            if (p == PATH_SCALAR && m > 0) {
+                continue;
+            }
+            AccuracyResult result = sweep(model->sensor, (AccuracyPath)p, step);
+            bool ok = result.codes > 0 && result.max_error <= model->budget_c;
+            within = within && ok;
+            printf("%-20s %-24s %9lu %10.5f %9.2f %10.5f %8.3f%s\n", model->name, PathNames[p], result.codes,
+                   result.max_error, result.max_at, sqrt(result.sum_squares / (result.codes ? result.codes : 1)),
+                   model->budget_c, ok ? "" : "  OVER");
+        }
+    }
+    set_sensor_model(ACCURACY_MODEL_SLOT, NULL);
+    return within ? 0 : 1;
+}
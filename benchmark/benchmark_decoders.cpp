@@ -0,0 +1,295 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file benchmark_decoders.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Host benchmark of the Sparkplug B decoders we have: cf_sparkplug's
+ * decode_command_payload() and decode_data_payload(), the vendored
+ * sparkplugb_arduino_decoder (nanopb 0.4 with PB_ENABLE_MALLOC), and the
+ * test_tahu_static-master decoder (see tahu_static.c).  Each decodes NBIRTH,
+ * NDATA and NCMD payloads built by our own encoder; the benchmark prints the
+ * nanoseconds per payload and the heap allocations per payload, counted by
+ * wrapping malloc() at link time, and the bytes left allocated after the
+ * decoder's own free.
+ *
+ *     pio run -e native_decode_benchmark && .pio/build/native_decode_benchmark/program
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "cf_sparkplug.h"
+#include "native_sim.h"
+#include "sparkplugb_arduino.hpp"
+#include "thermistorMux_global.h"
+
+#define BENCH_BATCHES    5      // Best batch is reported
+#define BENCH_CALLS      2000   // Decodes per batch
+#define BENCH_BUF_SIZE   4096   // Encoded payload buffer
+
+extern "C" bool tahu_static_decode(const uint8_t *buffer, size_t len, size_t *metrics);
+
+// Bench metrics mirror the node's: a few control metrics and a float per
+// thermistor, as in benchmark_hot_paths.cpp.  Aliases are the array indices.
+enum BenchAlias {
+    BMA_Rebirth,
+    BMA_Deadband,
+    BMA_HeartbeatInterval,
+    BMA_FirmwareVersion,
+    BMA_THERMISTOR1,
+    BMA_End = BMA_THERMISTOR1 + NUMBER_OF_THERMISTORS
+};
+
+// A payload to decode, encoded once by set_up_payloads()
+struct BenchPayload {
+    const char *name;
+    uint8_t data[BENCH_BUF_SIZE];
+    size_t len;
+    size_t metrics;
+};
+
+// A decoder: decodes len bytes of buffer and frees whatever it allocated,
+// storing the metrics it decoded.  Returns false if the payload didn't decode.
+struct BenchDecoder {
+    const char *name;
+    bool (*decode)(const uint8_t *buffer, size_t len, size_t *metrics);
+};
+
+static bool m_rebirth = false;
+static float m_deadband = 0.05;
+static uint64_t m_heartbeat_interval = 1000;
+static const char *m_firmware_version = THERMISTOR_MUX_VERSION;
+static float m_temps[NUMBER_OF_THERMISTORS];
+static char m_names[NUMBER_OF_THERMISTORS][24];
+static MetricSpec m_metrics[BMA_End];
+
+enum {
+    BP_NBIRTH,
+    BP_NDATA,
+    BP_NDATA_DEADBAND,
+    BP_NCMD,
+    BP_End
+};
+static BenchPayload m_payloads[BP_End] = {
+    {"NBIRTH", {0}, 0, 0},
+    {"NDATA, all channels", {0}, 0, 0},
+    {"NDATA, 4 channels", {0}, 0, 0},
+    {"NCMD", {0}, 0, 0},
+};
+
+static CommandPayload m_command;
+static DataPayload m_data;
+static sparkplugb_arduino_decoder m_arduino_decoder;
+static volatile size_t m_sink;
+
+// Heap use counted by the --wrap'd allocator below
+static unsigned long m_allocs = 0;
+static unsigned long m_frees = 0;
+static long long m_live_bytes = 0;
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void __real_free(void *pointer);
+
+void *__wrap_malloc(size_t size) {
+    void *pointer = __real_malloc(size);
+    if (pointer != NULL) {
+        m_allocs++;
+        m_live_bytes += malloc_usable_size(pointer);
+    }
+    return pointer;
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    void *pointer = __real_calloc(count, size);
+    if (pointer != NULL) {
+        m_allocs++;
+        m_live_bytes += malloc_usable_size(pointer);
+    }
+    return pointer;
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    size_t old_size = pointer != NULL ? malloc_usable_size(pointer) : 0;
+    void *moved = __real_realloc(pointer, size);
+    if (moved != NULL || size == 0) {
+        m_allocs++;
+        m_live_bytes += (moved != NULL ? malloc_usable_size(moved) : 0) - (long long)old_size;
+    }
+    return moved;
+}
+
+void __wrap_free(void *pointer) {
+    if (pointer != NULL) {
+        m_frees++;
+        m_live_bytes -= malloc_usable_size(pointer);
+    }
+    __real_free(pointer);
+}
+}
+
+
+static unsigned long long bench_timestamp(void) {
+    return 1654000000000ULL;
+}
+
+
+static void set_up_metrics() {
+    m_metrics[BMA_Rebirth] = metric_spec("Node Control/Rebirth", BMA_Rebirth, true, METRIC_DATA_TYPE_BOOLEAN, &m_rebirth);
+    m_metrics[BMA_Deadband] = metric_spec("Node Control/Deadband", BMA_Deadband, true, METRIC_DATA_TYPE_FLOAT, &m_deadband);
+    m_metrics[BMA_HeartbeatInterval] = metric_spec("Node Control/Heartbeat Interval", BMA_HeartbeatInterval, true,
+                                                   METRIC_DATA_TYPE_INT64, &m_heartbeat_interval);
+    m_metrics[BMA_FirmwareVersion] = metric_spec("Properties/Firmware Version", BMA_FirmwareVersion, false,
+                                                 METRIC_DATA_TYPE_STRING, &m_firmware_version);
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        snprintf(m_names[i], sizeof(m_names[i]), "Inputs/THERMISTOR%d", i + 1);
+        m_metrics[BMA_THERMISTOR1 + i] = metric_spec(m_names[i], (unsigned int)(BMA_THERMISTOR1 + i), false,
+                                                     METRIC_DATA_TYPE_FLOAT, &m_temps[i]);
+        m_temps[i] = 20.0f + i * 0.37f;
+    }
+
+    set_gettimestamp_callback(bench_timestamp);
+    set_max_metrics(BMA_End);
+    if (!check_metrics(m_metrics, BMA_End, BMA_End)) {
+        printf("check_metrics failed: %s\n", sparkplug_error_text());
+    }
+}
+
+
+static void encode_into(BenchPayload *payload, size_t metrics) {
+    payload->len = encode_payload(payload->data, sizeof(payload->data));
+    payload->metrics = metrics;
+}
+
+
+/*
+Encodes the payloads as the node builds them: the birth with every metric by
+name, a frame of every channel and one of the few that moved past the deadband,
+by alias, and the host's Rebirth and Deadband command by name.
+*/
+static void set_up_payloads() {
+    set_up_nbirth_payload();
+    add_metrics(true, m_metrics, BMA_End);
+    encode_into(&m_payloads[BP_NBIRTH], BMA_End);
+
+    set_up_next_payload();
+    update_metric_range(m_metrics, BMA_End, BMA_THERMISTOR1, NUMBER_OF_THERMISTORS, 0);
+    add_metrics(false, m_metrics, BMA_End);
+    encode_into(&m_payloads[BP_NDATA], NUMBER_OF_THERMISTORS);
+
+    set_up_next_payload();
+    update_metric_range(m_metrics, BMA_End, BMA_THERMISTOR1, 4, 0);
+    add_metrics(false, m_metrics, BMA_End);
+    encode_into(&m_payloads[BP_NDATA_DEADBAND], 4);
+
+    set_up_next_payload();
+    add_metric(true, m_metrics, BMA_End, NULL, BMA_Rebirth);
+    add_metric(true, m_metrics, BMA_End, NULL, BMA_Deadband);
+    encode_into(&m_payloads[BP_NCMD], 2);
+}
+
+
+static bool decode_command(const uint8_t *buffer, size_t len, size_t *metrics) {
+    bool decoded = decode_command_payload(buffer, len, &m_command);
+    *metrics = m_command.metrics_count;
+    return decoded;
+}
+
+
+static bool decode_data(const uint8_t *buffer, size_t len, size_t *metrics) {
+    bool decoded = decode_data_payload(buffer, len, &m_data);
+    *metrics = m_data.metrics_count;
+    return decoded;
+}
+
+
+static bool decode_arduino(const uint8_t *buffer, size_t len, size_t *metrics) {
+    bool decoded = m_arduino_decoder.decode(buffer, len);
+    *metrics = m_arduino_decoder.payload.metrics_count;
+    m_arduino_decoder.free_payload();
+    return decoded;
+}
+
+
+static const BenchDecoder m_decoders[] = {
+    {"decode_command_payload",     decode_command},
+    {"decode_data_payload",        decode_data},
+    {"sparkplugb_arduino_decoder", decode_arduino},
+    {"tahu static",                tahu_static_decode},
+};
+
+
+/*
+Decodes the payload BENCH_CALLS times in each of BENCH_BATCHES batches and
+returns the nanoseconds per decode of the fastest batch.
+*/
+static double time_decoder(const BenchDecoder *decoder, const BenchPayload *payload) {
+    uint64_t best = UINT64_MAX;
+    for (int batch = 0; batch < BENCH_BATCHES; batch++) {
+        size_t metrics = 0;
+        uint64_t start = sim_now_ns();
+        for (int call = 0; call < BENCH_CALLS; call++) {
+            decoder->decode(payload->data, payload->len, &metrics);
+        }
+        uint64_t elapsed = sim_now_ns() - start;
+        m_sink = metrics;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return (double)best / BENCH_CALLS;
+}
+
+
+int main() {
+    set_up_metrics();
+    set_up_payloads();
+
+    printf("Thermistor Mux %s decoder benchmarks, %d thermistors\n", THERMISTOR_MUX_VERSION, NUMBER_OF_THERMISTORS);
+    printf("%-20s %6s  %-27s %10s %7s %7s %9s\n", "Payload", "bytes", "Decoder", "ns/decode", "allocs", "frees",
+           "unfreed");
+    for (int p = 0; p < BP_End; p++) {
+        const BenchPayload *payload = &m_payloads[p];
+        for (unsigned int d = 0; d < sizeof(m_decoders) / sizeof(m_decoders[0]); d++) {
+            const BenchDecoder *decoder = &m_decoders[d];
+
+            // One decode, counted, which also warms the caches
+            unsigned long allocs = m_allocs;
+            unsigned long frees = m_frees;
+            long long live_bytes = m_live_bytes;
+            size_t metrics = 0;
+            bool decoded = decoder->decode(payload->data, payload->len, &metrics);
+            allocs = m_allocs - allocs;
+            frees = m_frees - frees;
+            live_bytes = m_live_bytes - live_bytes;
+            if (!decoded || metrics != payload->metrics) {
+                printf("%-20s %6u  %-27s %10s\n", payload->name, (unsigned int)payload->len, decoder->name,
+                       decoded ? "wrong" : "fails");
+                continue;
+            }
+
+            double ns = time_decoder(decoder, payload);
+            printf("%-20s %6u  %-27s %10.0f %7lu %7lu %9lld\n", payload->name, (unsigned int)payload->len,
+                   decoder->name, ns, allocs, frees, live_bytes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file benchmark_hot_paths.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Micro-benchmarks of the per-frame hot paths: code conversion, calibration,
+ * metric updates, Sparkplug payload building and encoding, and NCMD decoding,
+ * and of the block conversion host tools run on published raw codes.
+ * Prints cycles per operation and payload sizes over serial, then stops.
+ *
+ *     pio run -e teensy41_benchmark -t upload && pio device monitor
+ *     pio run -e native_benchmark && .pio/build/native_benchmark/program
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <math.h>
+#include "command_ADC.h"
+#include "cf_sparkplug.h"
+#include "thermistorMux_global.h"
+
+#define CYCLES_PER_US    (F_CPU_ACTUAL / 1000000)
+#define BENCH_BATCHES    5      // Best batch is reported
+#define BENCH_CALLS      200    // Calls of the case function per batch
+#define BENCH_BUF_SIZE   4096   // Encoded payload buffer
+#define BENCH_RAW_CODES  1024   // Raw codes converted per call
+
+// A benchmark case: prepare() runs once, untimed, then run() is timed and
+// counts as ops operations.
+struct BenchCase {
+    const char *name;
+    void (*prepare)(void);
+    void (*run)(void);
+    unsigned int ops;
+};
+
+// Bench metrics mirror the node's NDATA: a few control metrics and a float per
+// thermistor.  Aliases are the array indices.
+enum BenchAlias {
+    BMA_Rebirth,
+    BMA_Deadband,
+    BMA_HeartbeatInterval,
+    BMA_FirmwareVersion,
+    BMA_THERMISTOR1,
+    BMA_End = BMA_THERMISTOR1 + NUMBER_OF_THERMISTORS
+};
+
+static bool m_rebirth = false;
+static float m_deadband = 0.05;
+static uint64_t m_heartbeat_interval = 1000;
+static const char *m_firmware_version = THERMISTOR_MUX_VERSION;
+static float m_temps[NUMBER_OF_THERMISTORS];
+static char m_names[NUMBER_OF_THERMISTORS][24];
+static MetricSpec m_metrics[BMA_End];
+
+static uint32_t m_codes[NUMBER_OF_THERMISTORS];
+static float m_gain[NUMBER_OF_THERMISTORS];
+static float m_offset[NUMBER_OF_THERMISTORS];
+
+static int32_t m_raw_codes[BENCH_RAW_CODES];
+static float m_raw_temps[BENCH_RAW_CODES];
+static ThermistorConversion m_conversion;
+
+static uint8_t m_buffer[BENCH_BUF_SIZE];
+static size_t m_encoded_len = 0;
+static uint8_t m_ncmd[256];
+static size_t m_ncmd_len = 0;
+static CommandPayload m_command;
+
+// Results are summed in here so the compiler can't drop the work
+static volatile float m_sink;
+
+
+static unsigned long long bench_timestamp(void) {
+    return 1654000000000ULL;
+}
+
+
+static void set_up_metrics() {
+    m_metrics[BMA_Rebirth] = metric_spec("Node Control/Rebirth", BMA_Rebirth, true, METRIC_DATA_TYPE_BOOLEAN, &m_rebirth);
+    m_metrics[BMA_Deadband] = metric_spec("Node Control/Deadband", BMA_Deadband, true, METRIC_DATA_TYPE_FLOAT, &m_deadband);
+    m_metrics[BMA_HeartbeatInterval] = metric_spec("Node Control/Heartbeat Interval", BMA_HeartbeatInterval, true,
+                                                   METRIC_DATA_TYPE_INT64, &m_heartbeat_interval);
+    m_metrics[BMA_FirmwareVersion] = metric_spec("Properties/Firmware Version", BMA_FirmwareVersion, false,
+                                                 METRIC_DATA_TYPE_STRING, &m_firmware_version);
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        snprintf(m_names[i], sizeof(m_names[i]), "Inputs/THERMISTOR%d", i + 1);
+        m_metrics[BMA_THERMISTOR1 + i] = metric_spec(m_names[i], (unsigned int)(BMA_THERMISTOR1 + i), false,
+                                                     METRIC_DATA_TYPE_FLOAT, &m_temps[i]);
+    }
+
+    set_gettimestamp_callback(bench_timestamp);
+    set_max_metrics(BMA_End);
+    if (!check_metrics(m_metrics, BMA_End, BMA_End)) {
+        Serial.printf("check_metrics failed: %s\n", sparkplug_error_text());
+    }
+}
+
+
+/*
+Codes spread over the working range of the divider, about 5 to 45 C, with a
+calibration close to what a sweep produces.
+*/
+static void set_up_frame() {
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        m_codes[i] = 0x00280000 + i * 0x00010000;
+        m_gain[i] = 1.0f + i * 0.0001f;
+        m_offset[i] = -0.05f + i * 0.002f;
+        m_temps[i] = convert_thermistor_temp(m_codes[i]);
+    }
+}
+
+
+static void bench_thermistor_temp() {
+    float sum = 0;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        sum += convert_thermistor_temp(m_codes[i]);
+    }
+    m_sink = sum;
+}
+
+
+static void bench_internal_temp() {
+    float sum = 0;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        sum += convert_internal_temp(m_codes[i]);
+    }
+    m_sink = sum;
+}
+
+
+static void bench_frame_uncalibrated() {
+    convert_thermistor_block(m_codes, m_temps, NUMBER_OF_THERMISTORS);
+    m_sink = m_temps[0];
+}
+
+
+static void bench_frame_calibrated() {
+    convert_thermistor_block_calibrated(m_codes, m_gain, m_offset, m_temps, NUMBER_OF_THERMISTORS);
+    m_sink = m_temps[0];
+}
+
+
+/*
+A block of raw codes as a host gets them from Inputs/Raw Codes, over the same
+range, converted with the default sensor model's table.
+*/
+static void prepare_raw_codes() {
+    make_thermistor_conversion(DEFAULT_SENSOR_MODEL, m_conversion);
+    for (int i = 0; i < BENCH_RAW_CODES; i++) {
+        m_raw_codes[i] = 0x00280000 + i * 0x00001000;
+    }
+}
+
+
+static void bench_raw_codes() {
+    convert_code_block(&m_conversion, m_raw_codes, m_raw_temps, BENCH_RAW_CODES);
+    m_sink = m_raw_temps[0];
+}
+
+
+static void bench_update_metric() {
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        update_metric(m_metrics, BMA_End, &m_temps[i]);
+    }
+}
+
+
+static void bench_update_metric_range() {
+    update_metric_range(m_metrics, BMA_End, BMA_THERMISTOR1, NUMBER_OF_THERMISTORS, 0);
+}
+
+
+/*
+An NDATA frame as the network module builds it: the thermistor block marked
+updated and collected into the payload.
+*/
+static void bench_build_ndata() {
+    set_up_next_payload();
+    update_metric_range(m_metrics, BMA_End, BMA_THERMISTOR1, NUMBER_OF_THERMISTORS, 0);
+    add_metrics(false, m_metrics, BMA_End);
+}
+
+
+static void bench_build_nbirth() {
+    set_up_nbirth_payload();
+    add_metrics(true, m_metrics, BMA_End);
+}
+
+
+static void bench_encode() {
+    m_encoded_len = encode_payload(m_buffer, sizeof(m_buffer));
+}
+
+
+/*
+An NCMD the host would send: Rebirth and a new deadband, by name, encoded with
+the node's own encoder.
+*/
+static void prepare_ncmd() {
+    set_up_next_payload();
+    add_metric(true, m_metrics, BMA_End, NULL, BMA_Rebirth);
+    add_metric(true, m_metrics, BMA_End, NULL, BMA_Deadband);
+    m_ncmd_len = encode_payload(m_ncmd, sizeof(m_ncmd));
+}
+
+
+static void bench_decode_ncmd() {
+    decode_command_payload(m_ncmd, m_ncmd_len, &m_command);
+    m_sink = m_command.metrics_count;
+}
+
+
+static const BenchCase m_cases[] = {
+    {"convert_thermistor_temp",    NULL,               bench_thermistor_temp,      NUMBER_OF_THERMISTORS},
+    {"convert_internal_temp",      NULL,               bench_internal_temp,        NUMBER_OF_THERMISTORS},
+    {"Frame, uncalibrated",        NULL,               bench_frame_uncalibrated,   1},
+    {"Frame, calibrated",          NULL,               bench_frame_calibrated,     1},
+    {"convert_code_block",         prepare_raw_codes,  bench_raw_codes,            BENCH_RAW_CODES},
+    {"update_metric",              NULL,               bench_update_metric,        NUMBER_OF_THERMISTORS},
+    {"update_metric_range",        NULL,               bench_update_metric_range,  1},
+    {"NDATA add_metrics",          NULL,               bench_build_ndata,          1},
+    {"NDATA encode",               bench_build_ndata,  bench_encode,               1},
+    {"NBIRTH add_metrics",         NULL,               bench_build_nbirth,         1},
+    {"NBIRTH encode",              bench_build_nbirth, bench_encode,               1},
+    {"NCMD decode",                prepare_ncmd,       bench_decode_ncmd,          1},
+};
+
+
+/*
+Times a case in BENCH_BATCHES batches of BENCH_CALLS calls and returns the
+cycles per operation of the fastest batch, which has the fewest interrupts and
+cache misses in it.
+*/
+static float run_case(const BenchCase *bench) {
+    if (bench->prepare != NULL) {
+        bench->prepare();
+    }
+    bench->run();   // Warm the caches
+    uint32_t best = UINT32_MAX;
+    for (int batch = 0; batch < BENCH_BATCHES; batch++) {
+        uint32_t start = ARM_DWT_CYCCNT;
+        for (int call = 0; call < BENCH_CALLS; call++) {
+            bench->run();
+        }
+        uint32_t cycles = ARM_DWT_CYCCNT - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    return (float)best / ((float)BENCH_CALLS * bench->ops);
+}
+
+
+void setup() {
+    Serial.begin(115200);
+    while (!Serial && millis() < 3000) {
+    }
+
+    set_up_frame();
+    set_up_metrics();
+
+    Serial.printf("Thermistor Mux %s hot path benchmarks, %lu MHz, %d thermistors\n", THERMISTOR_MUX_VERSION,
+                  (unsigned long)(F_CPU_ACTUAL / 1000000), NUMBER_OF_THERMISTORS);
+    Serial.printf("%-26s %8s %12s %8s\n", "Case", "ops/call", "cycles/op", "bytes");
+    for (unsigned int i = 0; i < sizeof(m_cases) / sizeof(m_cases[0]); i++) {
+        const BenchCase *bench = &m_cases[i];
+        m_encoded_len = 0;
+        float cycles = run_case(bench);
+        if (bench->run == bench_encode) {
+            Serial.printf("%-26s %8u %12.1f %8u\n", bench->name, bench->ops, cycles, (unsigned int)m_encoded_len);
+        } else if (bench->run == bench_decode_ncmd) {
+            Serial.printf("%-26s %8u %12.1f %8u\n", bench->name, bench->ops, cycles, (unsigned int)m_ncmd_len);
+        } else {
+            Serial.printf("%-26s %8u %12.1f %8s\n", bench->name, bench->ops, cycles, "-");
+        }
+    }
+    Serial.printf("%lu cycles = 1 us\n", (unsigned long)CYCLES_PER_US);
+}
+
+
+void loop() {
+}
+
+
+#ifdef NATIVE_BUILD
+int main() {
+    setup();
+    return 0;
+}
+#endif
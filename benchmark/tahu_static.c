@@ -0,0 +1,92 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file tahu_static.c
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief The test_tahu_static-master decoder (nanopb 0.3 without
+ * PB_ENABLE_MALLOC, and tahu's own decode_payload()) built as one unit, for
+ * benchmark_decoders.cpp.  The two vendored copies of nanopb and tahu export
+ * many of the same names, so this copy's are renamed here; only
+ * tahu_static_decode() is called from outside.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+// Host time and no TimeLib (see tahu.h)
+#define __TEST_CLIENT__
+
+// The names sparkplugb_arduino-master exports too
+
+#define add_metadata_to_metric      tahu_static_add_metadata_to_metric
+#define add_metric_to_payload       tahu_static_add_metric_to_payload
+#define add_property_to_set         tahu_static_add_property_to_set
+#define add_propertyset_to_metric   tahu_static_add_propertyset_to_metric
+#define add_simple_metric           tahu_static_add_simple_metric
+#define decode_metric               tahu_static_decode_metric
+#define decode_payload              tahu_static_decode_payload
+#define encode_payload              tahu_static_encode_payload
+#define free_payload                tahu_static_free_payload
+#define get_current_timestamp       tahu_static_get_current_timestamp
+#define get_next_payload            tahu_static_get_next_payload
+#define init_dataset                tahu_static_init_dataset
+#define init_metric                 tahu_static_init_metric
+#define print_payload               tahu_static_print_payload
+#define pb_close_string_substream   tahu_static_pb_close_string_substream
+#define pb_decode                   tahu_static_pb_decode
+#define pb_decode_fixed32           tahu_static_pb_decode_fixed32
+#define pb_decode_fixed64           tahu_static_pb_decode_fixed64
+#define pb_decode_svarint           tahu_static_pb_decode_svarint
+#define pb_decode_tag               tahu_static_pb_decode_tag
+#define pb_decode_varint            tahu_static_pb_decode_varint
+#define pb_encode                   tahu_static_pb_encode
+#define pb_encode_fixed32           tahu_static_pb_encode_fixed32
+#define pb_encode_fixed64           tahu_static_pb_encode_fixed64
+#define pb_encode_string            tahu_static_pb_encode_string
+#define pb_encode_submessage        tahu_static_pb_encode_submessage
+#define pb_encode_svarint           tahu_static_pb_encode_svarint
+#define pb_encode_tag               tahu_static_pb_encode_tag
+#define pb_encode_tag_for_field     tahu_static_pb_encode_tag_for_field
+#define pb_encode_varint            tahu_static_pb_encode_varint
+#define pb_field_iter_begin         tahu_static_pb_field_iter_begin
+#define pb_field_iter_find          tahu_static_pb_field_iter_find
+#define pb_field_iter_next          tahu_static_pb_field_iter_next
+#define pb_get_encoded_size         tahu_static_pb_get_encoded_size
+#define pb_istream_from_buffer      tahu_static_pb_istream_from_buffer
+#define pb_make_string_substream    tahu_static_pb_make_string_substream
+#define pb_ostream_from_buffer      tahu_static_pb_ostream_from_buffer
+#define pb_read                     tahu_static_pb_read
+#define pb_skip_field               tahu_static_pb_skip_field
+#define pb_write                    tahu_static_pb_write
+
+#include "../Dependencies/libdeps/teensy41/test_tahu_static-master/pb_common.c"
+#include "../Dependencies/libdeps/teensy41/test_tahu_static-master/pb_decode.c"
+#include "../Dependencies/libdeps/teensy41/test_tahu_static-master/pb_encode.c"
+#include "../Dependencies/libdeps/teensy41/test_tahu_static-master/tahu.pb.c"
+#include "../Dependencies/libdeps/teensy41/test_tahu_static-master/tahu.c"
+
+
+/*
+Decodes a payload of len bytes and frees it again, as a host following a node
+would: metrics stores the metrics decoded. Returns false if it didn't decode.
+*/
+bool tahu_static_decode(const uint8_t *buffer, size_t len, size_t *metrics) {
+    org_eclipse_tahu_protobuf_Payload payload = org_eclipse_tahu_protobuf_Payload_init_zero;
+    bool decoded = decode_payload(&payload, buffer, (int)len);
+    *metrics = payload.metrics_count;
+    free_payload(&payload);
+    return decoded;
+}
@@ -0,0 +1,507 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file fleet_sim.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Fleet simulator: emulates N Thermistor Mux nodes against a real MQTT
+ * broker, for measuring broker and primary host capacity without the boards.
+ * Each node is a process of its own running cf_sparkplug, the firmware's
+ * encoder, whose payload state is per process.  Nodes publish NBIRTH with
+ * bdSeq, NDATA frames at the set period, and answer Rebirth, Reboot, Frame
+ * Period and Deadband NCMDs; dropped links and reboots leave an NDEATH will.
+ *
+ *     .pio/build/native_fleet/program --broker 192.168.1.10 --nodes 32 --frame-period 100
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "cf_sparkplug.h"
+#include "native_sim.h"
+#include "posix_client.h"
+#include "thermistorMux_global.h"
+
+#define GROUP_ID              "VI"              // As in thermistorMux_network.cpp
+#define NODE_ID_PREFIX        "THERMISTOR"
+#define TOPIC_SIZE            64
+#define BOOT_MS               2000              // Time a rebooted node stays off the network
+#define RECONNECT_MIN_MS      500
+#define RECONNECT_MAX_MS      16000
+#define ADC_TEMP_FRAMES       10                // Frames between ADC temperature updates
+
+// Fleet settings, from the command line
+static int m_nodes = NUM_MODULES;
+static int m_first_id = 0;
+static char m_host[128] = "localhost";
+static uint16_t m_port = 1883;
+static double m_seconds = 60;                   // 0 runs until interrupted
+static uint64_t m_frame_period_ms = 1000;
+static float m_deadband = 0;
+static double m_drop_s = 0;                     // Mean time between link drops, 0 for none
+static unsigned int m_ncmd_delay_ms = 0;
+static unsigned int m_seed = 1;
+
+// What a node did, passed back to the parent through a pipe
+struct NodeStats {
+    unsigned long connects;
+    unsigned long connect_failures;
+    unsigned long births;
+    unsigned long data;
+    unsigned long publish_failures;
+    unsigned long commands;
+    unsigned long drops;
+    unsigned long reboots;
+};
+
+static volatile sig_atomic_t m_stop = 0;
+
+/*
+Node state.  A node is the only thing running in its process, so, as in the
+firmware, it lives in file-scope variables.
+*/
+enum FleetAlias {
+    FMA_bdSeq = 0,
+    FMA_Reboot,
+    FMA_Rebirth,
+    FMA_CommsVersion,
+    FMA_FirmwareVersion,
+    FMA_Units,
+    FMA_Deadband,
+    FMA_FramePeriod,
+    FMA_THERMISTOR1,
+    FMA_ADC_Temperature = FMA_THERMISTOR1 + NUMBER_OF_THERMISTORS,
+    FMA_End
+};
+
+static char m_node_id[16];
+static char m_birth_topic[TOPIC_SIZE];
+static char m_death_topic[TOPIC_SIZE];
+static char m_data_topic[TOPIC_SIZE];
+static char m_cmd_topic[TOPIC_SIZE];
+
+static uint64_t m_bdSeq = (uint64_t)-1;
+static bool m_reboot = false;
+static bool m_rebirth = false;
+static uint64_t m_comms_version = COMMS_VERSION;
+static const char *m_firmware_version = THERMISTOR_MUX_VERSION " (fleet)";
+static const char *m_units = "C";
+static float m_temps[NUMBER_OF_THERMISTORS];
+static float m_sent_temps[NUMBER_OF_THERMISTORS];
+static float m_ADC_temperature = 30;
+static char m_names[NUMBER_OF_THERMISTORS][24];
+
+static MetricSpec m_bdseq_metrics[] = {
+    metric_spec("bdSeq", FMA_bdSeq, false, METRIC_DATA_TYPE_INT64, &m_bdSeq),
+};
+static MetricSpec m_node_metrics[FMA_End - 1];
+
+static PosixClient m_client;
+static PubSubClient m_broker;
+static NodeStats m_stats;
+static uint32_t m_random;
+static uint32_t m_rebirth_due = 0;              // 0 when none is pending
+static uint32_t m_reboot_due = 0;
+
+
+static uint32_t next_random() {
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random;
+}
+
+
+static float uniform() {
+    return (next_random() >> 8) / 16777216.0f;
+}
+
+
+/*
+Milliseconds until the next link drop, exponentially distributed.
+*/
+static uint32_t drop_interval_ms() {
+    return (uint32_t)(-log(1.0f - uniform()) * m_drop_s * 1000);
+}
+
+
+static unsigned long long wall_millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static void set_up_node(int id) {
+    snprintf(m_node_id, sizeof(m_node_id), NODE_ID_PREFIX "%d", id);
+    snprintf(m_birth_topic, sizeof(m_birth_topic), NODE_TOPIC(NBIRTH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_death_topic, sizeof(m_death_topic), NODE_TOPIC(NDEATH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_data_topic, sizeof(m_data_topic), NODE_TOPIC(NDATA_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_cmd_topic, sizeof(m_cmd_topic), NODE_TOPIC(NCMD_MESSAGE_TYPE, "%s"), m_node_id);
+    m_random = (m_seed * 2654435761u) ^ (id + 1) * 40503u;
+    if (m_random == 0) {
+        m_random = 1;
+    }
+
+    MetricSpec controls[] = {
+        metric_spec("Node Control/Reboot",               FMA_Reboot,          true,  METRIC_DATA_TYPE_BOOLEAN, &m_reboot),
+        metric_spec("Node Control/Rebirth",              FMA_Rebirth,         true,  METRIC_DATA_TYPE_BOOLEAN, &m_rebirth),
+        metric_spec("Properties/Communications Version", FMA_CommsVersion,    false, METRIC_DATA_TYPE_INT64,   &m_comms_version),
+        metric_spec("Properties/Firmware Version",       FMA_FirmwareVersion, false, METRIC_DATA_TYPE_STRING,  &m_firmware_version),
+        metric_spec("Properties/Units",                  FMA_Units,           false, METRIC_DATA_TYPE_STRING,  &m_units),
+        metric_spec("Node Control/Deadband",             FMA_Deadband,        true,  METRIC_DATA_TYPE_FLOAT,   &m_deadband),
+        metric_spec("Node Control/Frame Period",         FMA_FramePeriod,     true,  METRIC_DATA_TYPE_INT64,   &m_frame_period_ms),
+    };
+    memcpy(m_node_metrics, controls, sizeof(controls));
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        snprintf(m_names[i], sizeof(m_names[i]), "Inputs/THERMISTOR%d", i + 1);
+        m_node_metrics[FMA_THERMISTOR1 - 1 + i] = metric_spec(m_names[i], (unsigned int)(FMA_THERMISTOR1 + i), false,
+                                                              METRIC_DATA_TYPE_FLOAT, &m_temps[i]);
+        m_temps[i] = 20 + 0.25f * i + uniform();
+        m_sent_temps[i] = NAN;
+    }
+    m_node_metrics[FMA_ADC_Temperature - 1] = metric_spec("Inputs/ADC Internal Temperature", FMA_ADC_Temperature, false,
+                                                          METRIC_DATA_TYPE_FLOAT, &m_ADC_temperature);
+
+    set_gettimestamp_callback(wall_millis);
+    set_max_metrics(NUM_ELEM(m_bdseq_metrics) + NUM_ELEM(m_node_metrics));
+    if (!check_metrics(ARRAY_AND_SIZE(m_bdseq_metrics), FMA_bdSeq + 1) ||
+        !check_metrics(ARRAY_AND_SIZE(m_node_metrics), FMA_End)) {
+        fprintf(stderr, "%s: %s\n", m_node_id, sparkplug_error_text());
+        exit(1);
+    }
+}
+
+
+/*
+Connects with an NDEATH carrying the next bdSeq as the will, as
+start_broker_connect() in the firmware does.
+*/
+static bool connect_node() {
+    m_bdSeq++;
+    update_metric(ARRAY_AND_SIZE(m_bdseq_metrics), &m_bdSeq);
+    set_up_ndeath_payload();
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) || !connect(&m_broker, m_node_id, m_death_topic)) {
+        m_bdSeq--;
+        return false;
+    }
+    if (!m_broker.subscribe(m_cmd_topic)) {
+        m_client.drop();
+        return false;
+    }
+    return true;
+}
+
+
+static void publish_births() {
+    set_up_nbirth_payload();
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) ||
+        !publish_metrics(&m_broker, 1, m_birth_topic, true, ARRAY_AND_SIZE(m_node_metrics))) {
+        m_stats.publish_failures++;
+        return;
+    }
+    memcpy(m_sent_temps, m_temps, sizeof(m_temps));
+    m_stats.births++;
+}
+
+
+/*
+One frame: every thermistor wanders a little, and those that moved by the
+deadband since they were last sent go out in the NDATA.
+*/
+static void publish_frame(unsigned long frame) {
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        m_temps[i] += (uniform() - 0.5f) * 0.02f + (20 + 0.25f * i - m_temps[i]) * 0.001f;
+        if (!(fabsf(m_temps[i] - m_sent_temps[i]) < m_deadband)) {
+            update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_temps[i]);
+            m_sent_temps[i] = m_temps[i];
+        }
+    }
+    if (frame % ADC_TEMP_FRAMES == 0) {
+        m_ADC_temperature = 30 + uniform();
+        update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_ADC_temperature);
+    }
+    set_up_next_payload();
+    if (!add_metrics(false, ARRAY_AND_SIZE(m_node_metrics)) ||
+        !publish_payload(&m_broker, 1, m_data_topic)) {
+        if (sparkplug_error() != SPARKPLUG_NO_METRICS) {
+            m_stats.publish_failures++;
+        }
+        return;
+    }
+    m_stats.data++;
+}
+
+
+static void command_received(char *topic, byte *payload, unsigned int len) {
+    if (strcmp(topic, m_cmd_topic) != 0) {
+        return;
+    }
+    static CommandPayload command;
+    if (!decode_command_payload(payload, len, &command)) {
+        return;
+    }
+    m_stats.commands++;
+    uint32_t due = millis() + m_ncmd_delay_ms;
+    if (due == 0) {
+        due = 1;
+    }
+    for (unsigned int i = 0; i < command.metrics_count; i++) {
+        Metric *metric = &command.metrics[i];
+        MetricSpec *spec = find_received_metric(ARRAY_AND_SIZE(m_node_metrics), metric);
+        if (spec == NULL) {
+            continue;
+        }
+        switch (spec->alias) {
+        case FMA_Rebirth:
+            if (metric->value.boolean_value) {
+                m_rebirth_due = due;
+            }
+            break;
+        case FMA_Reboot:
+            if (metric->value.boolean_value) {
+                m_reboot_due = due;
+            }
+            break;
+        case FMA_FramePeriod:
+            if (metric->value.long_value > 0) {
+                m_frame_period_ms = metric->value.long_value;
+                update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_frame_period_ms);
+            }
+            break;
+        case FMA_Deadband:
+            if (metric->value.float_value >= 0) {
+                m_deadband = metric->value.float_value;
+                update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_deadband);
+            }
+            break;
+        }
+    }
+}
+
+
+static void stop_requested(int signum) {
+    (void)signum;
+    m_stop = 1;
+}
+
+
+static bool reached(uint32_t now, uint32_t at) {
+    return (int32_t)(now - at) >= 0;
+}
+
+
+static bool due(uint32_t now, uint32_t pending) {
+    return pending != 0 && reached(now, pending);
+}
+
+
+static void run_node(int id, int stats_fd) {
+    signal(SIGINT, stop_requested);
+    signal(SIGTERM, stop_requested);
+    set_up_node(id);
+    m_broker.setClient(m_client);
+    m_broker.setServer(m_host, m_port);
+    m_broker.setCallback(command_received);
+    m_broker.setBufferSize(MQTT_BUF_SIZE);
+
+    uint32_t start = millis();
+    uint32_t next_connect = start;
+    uint32_t backoff_ms = RECONNECT_MIN_MS;
+    uint32_t next_frame = 0;
+    uint32_t next_drop = 0;
+    unsigned long frame = 0;
+    while (!m_stop && (m_seconds == 0 || millis() - start < m_seconds * 1000)) {
+        uint32_t now = millis();
+        if (!m_broker.connected()) {
+            if (!reached(now, next_connect)) {
+                usleep(1000);
+                continue;
+            }
+            if (!connect_node()) {
+                m_stats.connect_failures++;
+                next_connect = now + backoff_ms;
+                backoff_ms = min(backoff_ms * 2, (uint32_t)RECONNECT_MAX_MS);
+                continue;
+            }
+            m_stats.connects++;
+            backoff_ms = RECONNECT_MIN_MS;
+            m_rebirth_due = 0;
+            publish_births();
+            next_frame = millis();
+            next_drop = next_frame + drop_interval_ms();
+        }
+
+        m_broker.loop();
+        now = millis();
+        if (due(now, m_reboot_due)) {
+            // Off the network for the boot, then back with bdSeq from 0
+            m_reboot_due = 0;
+            m_client.drop();
+            m_bdSeq = (uint64_t)-1;
+            m_stats.reboots++;
+            next_connect = now + BOOT_MS;
+            continue;
+        }
+        if (m_drop_s > 0 && reached(now, next_drop)) {
+            m_client.drop();
+            m_stats.drops++;
+            next_connect = now + RECONNECT_MIN_MS;
+            continue;
+        }
+        if (due(now, m_rebirth_due)) {
+            m_rebirth_due = 0;
+            publish_births();
+        }
+        if (reached(now, next_frame)) {
+            publish_frame(frame++);
+            next_frame += m_frame_period_ms;
+            if ((int32_t)(now - next_frame) > (int32_t)m_frame_period_ms) {
+                // Fell more than a frame behind; don't try to catch up
+                next_frame = now + m_frame_period_ms;
+            }
+        }
+        usleep(500);
+    }
+
+    // A clean shutdown publishes the NDEATH itself before disconnecting
+    if (m_broker.connected()) {
+        set_up_ndeath_payload();
+        add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics));
+        disconnect(&m_broker, m_death_topic);
+    }
+    if (write(stats_fd, &m_stats, sizeof(m_stats)) != sizeof(m_stats)) {
+        perror("write");
+    }
+    close(stats_fd);
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --broker HOST[:PORT]  MQTT broker (default localhost:1883)\n"
+            "  --nodes N             Nodes to emulate (default %d)\n"
+            "  --first-id N          Module ID of the first node (default 0)\n"
+            "  --seconds S           Run for S seconds, 0 until Ctrl-C (default 60)\n"
+            "  --frame-period MS     NDATA period (default 1000); NCMD Node Control/Frame Period changes it\n"
+            "  --deadband C          Only send channels that moved by C since last sent (default 0)\n"
+            "  --drop S              Mean seconds between dropped links, each leaving an NDEATH (default never)\n"
+            "  --ncmd-delay MS       Time a node takes to act on Rebirth and Reboot (default 0)\n"
+            "  --seed N              Seed for the temperatures and link drops (default 1)\n",
+            program, NUM_MODULES);
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--broker") == 0) {
+            unsigned int port = m_port;
+            if (sscanf(value, "%127[^:]:%u", m_host, &port) < 1 || port == 0 || port > 65535) {
+                return false;
+            }
+            m_port = port;
+        } else if (strcmp(arg, "--nodes") == 0) {
+            m_nodes = atoi(value);
+        } else if (strcmp(arg, "--first-id") == 0) {
+            m_first_id = atoi(value);
+        } else if (strcmp(arg, "--seconds") == 0) {
+            m_seconds = atof(value);
+        } else if (strcmp(arg, "--frame-period") == 0) {
+            m_frame_period_ms = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--deadband") == 0) {
+            m_deadband = atof(value);
+        } else if (strcmp(arg, "--drop") == 0) {
+            m_drop_s = atof(value);
+        } else if (strcmp(arg, "--ncmd-delay") == 0) {
+            m_ncmd_delay_ms = strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--seed") == 0) {
+            m_seed = strtoul(value, NULL, 10);
+        } else {
+            return false;
+        }
+    }
+    return m_nodes > 0 && m_first_id >= 0 && m_frame_period_ms > 0 && m_deadband >= 0 && m_seconds >= 0;
+}
+
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    sim_serial_quiet(true);
+    signal(SIGINT, SIG_IGN);   // Each node winds down on Ctrl-C itself
+
+    pid_t *pids = new pid_t[m_nodes];
+    int *fds = new int[m_nodes];
+    for (int n = 0; n < m_nodes; n++) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        pids[n] = fork();
+        if (pids[n] == 0) {
+            close(pipe_fds[0]);
+            run_node(m_first_id + n, pipe_fds[1]);
+            _exit(0);
+        }
+        close(pipe_fds[1]);
+        fds[n] = pipe_fds[0];
+        // Spread the nodes over a frame period, as boards powered up together
+        // still boot at slightly different times
+        usleep(m_frame_period_ms * 1000 / m_nodes);
+    }
+
+    NodeStats total = {};
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Node", "connects", "failed", "births", "data",
+            "pub fail", "commands", "drops", "reboots");
+    for (int n = 0; n < m_nodes; n++) {
+        NodeStats stats = {};
+        if (read(fds[n], &stats, sizeof(stats)) != sizeof(stats)) {
+            fprintf(stderr, NODE_ID_PREFIX "%d: no statistics\n", m_first_id + n);
+        }
+        close(fds[n]);
+        waitpid(pids[n], NULL, 0);
+        fprintf(stderr, NODE_ID_PREFIX "%-4d %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", m_first_id + n,
+                stats.connects, stats.connect_failures, stats.births, stats.data, stats.publish_failures,
+                stats.commands, stats.drops, stats.reboots);
+        total.connects += stats.connects;
+        total.connect_failures += stats.connect_failures;
+        total.births += stats.births;
+        total.data += stats.data;
+        total.publish_failures += stats.publish_failures;
+        total.commands += stats.commands;
+        total.drops += stats.drops;
+        total.reboots += stats.reboots;
+    }
+    fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", "Total", total.connects,
+            total.connect_failures, total.births, total.data, total.publish_failures, total.commands, total.drops,
+            total.reboots);
+    delete[] pids;
+    delete[] fds;
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file posix_client.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Arduino Client over a host TCP socket.  Reads never block and are
+ * served from a receive buffer; writes block until the kernel takes the whole
+ * buffer, as EthernetClient does.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "posix_client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+int PosixClient::connect(IPAddress ip, uint16_t port) {
+    char host[16];
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    return connect(host, port);
+}
+
+
+int PosixClient::connect(const char *host, uint16_t port) {
+    close_socket();
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) {
+        return 0;
+    }
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            // MQTT packets are small and latency matters more than packing
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            m_fd = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addresses);
+    return m_fd >= 0 ? 1 : 0;
+}
+
+
+size_t PosixClient::write(const uint8_t *buf, size_t size) {
+    size_t written = 0;
+    while (m_fd >= 0 && written < size) {
+        ssize_t n = send(m_fd, buf + written, size - written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close_socket();
+            break;
+        }
+        written += n;
+    }
+    return written;
+}
+
+
+/*
+Receives what the socket has into the buffer if it's empty. Returns false if
+nothing is buffered.
+*/
+bool PosixClient::fill() {
+    if (m_start < m_end) {
+        return true;
+    }
+    if (m_fd < 0) {
+        return false;
+    }
+    ssize_t n = recv(m_fd, m_buffer, sizeof(m_buffer), MSG_DONTWAIT);
+    if (n == 0) {
+        close_socket();
+    }
+    if (n <= 0) {
+        return false;
+    }
+    m_start = 0;
+    m_end = n;
+    return true;
+}
+
+
+int PosixClient::available() {
+    if (m_fd < 0) {
+        return 0;
+    }
+    int n = 0;
+    if (ioctl(m_fd, FIONREAD, &n) < 0) {
+        n = 0;
+    }
+    return n + (m_end - m_start);
+}
+
+
+int PosixClient::read() {
+    return fill() ? m_buffer[m_start++] : -1;
+}
+
+
+int PosixClient::read(uint8_t *buf, size_t size) {
+    if (size == 0 || !fill()) {
+        return -1;
+    }
+    size_t used = m_end - m_start < size ? m_end - m_start : size;
+    memcpy(buf, &m_buffer[m_start], used);
+    m_start += used;
+    return (int)used;
+}
+
+
+int PosixClient::peek() {
+    return fill() ? m_buffer[m_start] : -1;
+}
+
+
+/*
+Closes the connection once the broker has read everything sent on it. Closing
+with a reply, such as a SUBACK, still on its way makes the kernel reset the
+connection, and the broker then loses what it hadn't read yet: a node that
+publishes quickly and disconnects would lose its last messages. So the socket
+is shut for writing, and what comes back is read until the broker closes its
+side or stays quiet for POSIX_CLIENT_LINGER_MS.
+*/
+void PosixClient::stop() {
+    if (m_fd >= 0 && shutdown(m_fd, SHUT_WR) == 0) {
+        struct pollfd waiting = {m_fd, POLLIN, 0};
+        while (poll(&waiting, 1, POSIX_CLIENT_LINGER_MS) > 0 && recv(m_fd, m_buffer, sizeof(m_buffer), 0) > 0) {
+        }
+    }
+    close_socket();
+}
+
+
+/*
+Closes the socket at once, whatever is still in flight.
+*/
+void PosixClient::drop() {
+    close_socket();
+}
+
+
+void PosixClient::close_socket() {
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    m_start = m_end = 0;
+}
+
+uint8_t PosixClient::connected() {
+    if (m_fd < 0) {
+        return 0;
+    }
+    if (m_start < m_end) {
+        // Still has data to read, whether or not the peer has closed
+        return 1;
+    }
+    // A closed connection reads as end of file
+    char b;
+    ssize_t n = recv(m_fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        close_socket();
+        return 0;
+    }
+    return 1;
+}
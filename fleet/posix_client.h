@@ -0,0 +1,70 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file posix_client.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Arduino Client over a host TCP socket, so the fleet simulator's nodes
+ * and the ingest tool can reach a real MQTT broker.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef POSIX_CLIENT_H
+#define POSIX_CLIENT_H
+
+#include <Client.h>
+
+// Bytes received ahead of the reader. PubSubClient reads a byte at a time, so
+// without it every byte of a message would be a system call.
+#define POSIX_CLIENT_BUFFER_SIZE 4096
+
+// Longest stop() waits on a quiet broker to close its side
+#define POSIX_CLIENT_LINGER_MS 1000
+
+class PosixClient : public Client {
+public:
+    PosixClient() : m_fd(-1), m_start(0), m_end(0) {}
+    virtual ~PosixClient() { stop(); }
+
+    virtual int connect(IPAddress ip, uint16_t port);
+    virtual int connect(const char *host, uint16_t port);
+    virtual size_t write(uint8_t b) { return write(&b, 1); }
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush() {}
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool() { return m_fd >= 0; }
+
+    // Close the socket without an MQTT DISCONNECT, as a node losing its link
+    // or rebooting does, so the broker publishes its will.
+    void drop();
+
+private:
+    bool fill();
+    void close_socket();
+
+    int m_fd;
+    uint8_t m_buffer[POSIX_CLIENT_BUFFER_SIZE];
+    size_t m_start;     // Next unread byte of m_buffer
+    size_t m_end;       // End of the bytes received into m_buffer
+};
+
+#endif
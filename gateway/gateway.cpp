@@ -0,0 +1,933 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file gateway.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Aggregation gateway: follows the NBIRTH, NDATA and NDEATH of every
+ * node in the group and republishes them as one Sparkplug edge node whose
+ * devices are furnaces, each a range of modules.  Every --period it publishes
+ * a furnace's DDATA with a Temperatures DataSet of one row per module: the
+ * node's frame as of the period's start, so the rows line up in time however
+ * the nodes' frames fall, and NaN for what isn't known.  A host parses one
+ * payload per furnace and period instead of one per node and frame.  Messages
+ * are decoded by cf_sparkplug's decoder into one static DataPayload and each
+ * module is a fixed-size slot, as in the ingest tool; the gateway's own births
+ * and data go out through cf_sparkplug as a node's do.
+ *
+ *     .pio/build/native_gateway/program --broker 192.168.1.10 --furnace A=0-15 --furnace B=16-31
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "cf_sparkplug.h"
+#include "native_sim.h"
+#include "../fleet/posix_client.h"
+#include "thermistorMux_global.h"
+
+#define GROUP_ID              "VI"              // As in thermistorMux_network.cpp
+#define NODE_ID_PREFIX        "THERMISTOR"
+#define NODE_ID_SIZE          32
+#define FURNACE_NAME_SIZE     24
+#define TOPIC_SIZE            96
+#define MQTT_RECEIVE_SIZE     32768             // Largest message taken, an uncompressed NBIRTH with room over
+#define RECONNECT_MIN_MS      500
+#define RECONNECT_MAX_MS      16000
+#define REBIRTH_INTERVAL_MS   10000             // Least time between Rebirth requests to a node
+#define MAX_FURNACES          16
+#define MAX_ROWS              1024              // Modules over all the furnaces
+#define FRAME_RING            8                 // Recent frames kept per module to align from
+
+// Metric names the columns are mapped from, as in thermistorMux_network.cpp
+#define CHANNEL_METRIC_PREFIX "Inputs/THERMISTOR"
+#define ARRAY_METRIC_NAME     "Inputs/THERMISTORS"
+#define ADC_METRIC_NAME       "Inputs/ADC Internal Temperature"
+#define BDSEQ_METRIC_NAME     "bdSeq"
+#define REBIRTH_METRIC_NAME   "Node Control/Rebirth"
+
+// Temperature columns of a row: the thermistors, then the ADC temperature
+#define TEMP_COLUMNS          (NUMBER_OF_THERMISTORS + 1)
+#define ADC_COLUMN            NUMBER_OF_THERMISTORS
+// Node, Online and Timestamp come first
+#define ROW_COLUMNS           (3 + TEMP_COLUMNS)
+
+// Gateway settings, from the command line
+static char m_host[128] = "localhost";
+static uint16_t m_port = 1883;
+static char m_node_id[NODE_ID_SIZE] = "THERMISTOR_GATEWAY";
+static uint64_t m_period_ms = 1000;
+static uint64_t m_lag_ms = 250;                 // How long after a period starts its frames are waited for
+static size_t m_compress = 0;                   // Payload compression threshold, 0 for none
+static bool m_request_rebirths = true;
+
+// What happened to a node, for the summary on exit
+struct NodeStats {
+    unsigned long births;
+    unsigned long data;
+    unsigned long deaths;
+    unsigned long stale_deaths;                 // NDEATHs of an earlier session, ignored
+    unsigned long seq_gaps;
+    unsigned long rebirths;                     // Rebirths requested
+    unsigned long unknown;                      // NDATA before a birth that named the metrics
+    unsigned long bad;                          // Payloads that didn't decode
+};
+
+// A frame of a module, °C; NaN for a channel not known
+struct GatewayFrame {
+    uint64_t ms;                                // The NDATA's timestamp
+    float values[TEMP_COLUMNS];
+};
+
+/*
+A module's slot: how its node's aliases map onto the columns, its latest
+values and the frames the rows are aligned from.
+*/
+struct GatewayNode {
+    char id[NODE_ID_SIZE];
+    bool seen;
+    bool mapped;                                // A birth has named the metrics
+    bool born;                                  // Online since its last birth
+    uint64_t alias[TEMP_COLUMNS];
+    bool has_alias[TEMP_COLUMNS];
+    uint64_t array_alias;                       // USE_ARRAY_NDATA nodes' Inputs/THERMISTORS
+    bool has_array;
+    uint32_t array_datatype;
+    bool has_bdseq;
+    uint64_t bdseq;                             // Of the birth, to match its NDEATH against
+    bool has_seq;
+    uint64_t seq;
+    uint32_t rebirth_ms;                        // When a Rebirth was last requested, 0 never
+    float values[TEMP_COLUMNS];
+    GatewayFrame frames[FRAME_RING];
+    uint32_t frame_count;                       // Frames ever added since the birth
+
+    NodeStats stats;
+};
+
+/*
+A furnace: a device of the gateway holding modules first to last, one row each.
+*/
+struct Furnace {
+    char name[FURNACE_NAME_SIZE];
+    int first;
+    int last;
+    GatewayNode *nodes;                         // last - first + 1 of them
+    bool born;                                  // Its DBIRTH is out
+    char topics[3][TOPIC_SIZE];                 // DBIRTH, DDATA and DDEATH
+    unsigned long births;
+    unsigned long data;
+
+    DataSet dataset;
+    DataSetRow *rows;
+    DataSetValue *cells;
+    uint64_t online;
+    MetricSpec metrics[2];
+};
+
+enum GatewayAlias {
+    GMA_bdSeq = 0,
+    GMA_Rebirth,
+    GMA_Period,
+    GMA_Furnaces,
+    GMA_End                                     // Each furnace's Temperatures and Nodes Online follow
+};
+
+static uint64_t m_bdSeq = (uint64_t)-1;
+static bool m_rebirth = false;
+static uint64_t m_furnace_count = 0;
+static MetricSpec m_bdseq_metrics[] = {
+    metric_spec("bdSeq", GMA_bdSeq, false, METRIC_DATA_TYPE_INT64, &m_bdSeq),
+};
+static MetricSpec m_node_metrics[] = {
+    metric_spec(REBIRTH_METRIC_NAME,  GMA_Rebirth,  true,  METRIC_DATA_TYPE_BOOLEAN, &m_rebirth),
+    metric_spec("Properties/Period",   GMA_Period,   false, METRIC_DATA_TYPE_INT64,   &m_period_ms),
+    metric_spec("Properties/Furnaces", GMA_Furnaces, false, METRIC_DATA_TYPE_INT64,   &m_furnace_count),
+};
+
+static Furnace m_furnaces[MAX_FURNACES];
+static int m_num_furnaces = 0;
+static int m_num_rows = 0;
+static char m_birth_topic[TOPIC_SIZE];
+static char m_death_topic[TOPIC_SIZE];
+static char m_cmd_topic[TOPIC_SIZE];
+static const char *m_columns[ROW_COLUMNS];
+static uint32_t m_types[ROW_COLUMNS];
+static char m_column_names[TEMP_COLUMNS][32];
+
+static unsigned long m_ignored = 0;             // Messages from nodes in no furnace
+static unsigned long m_messages_in = 0;
+static unsigned long long m_bytes_in = 0;
+static unsigned long m_publish_failures = 0;
+static DataPayload m_payload;
+static PosixClient m_client;
+static PubSubClient m_broker;
+static volatile sig_atomic_t m_stop = 0;
+
+
+static unsigned long long wall_millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+The module of a node ID, NODE_ID_PREFIX and its decimal number, or -1 for an
+ID of another form (the gateway's own among them).
+*/
+static int node_module(const char *id) {
+    size_t prefix = strlen(NODE_ID_PREFIX);
+    if (strncmp(id, NODE_ID_PREFIX, prefix) != 0 || id[prefix] == '\0') {
+        return -1;
+    }
+    for (const char *c = &id[prefix]; *c != '\0'; c++) {
+        if (!isdigit((unsigned char)*c)) {
+            return -1;
+        }
+    }
+    return atoi(&id[prefix]);
+}
+
+
+static GatewayNode *find_node(int module) {
+    for (int f = 0; f < m_num_furnaces; f++) {
+        Furnace *furnace = &m_furnaces[f];
+        if (module >= furnace->first && module <= furnace->last) {
+            return &furnace->nodes[module - furnace->first];
+        }
+    }
+    return NULL;
+}
+
+
+static void clear_values(GatewayNode *node) {
+    for (int column = 0; column < TEMP_COLUMNS; column++) {
+        node->values[column] = NAN;
+    }
+    node->frame_count = 0;
+}
+
+
+static void put_varint(uint8_t **out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        *(*out)++ = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+}
+
+
+/*
+Asks a node for a birth with its metric names, limited to one request per
+REBIRTH_INTERVAL_MS, as the ingest tool does. The NCMD is written by hand, as
+cf_sparkplug's payload is the gateway's own.
+*/
+static void request_rebirth(GatewayNode *node) {
+    uint32_t now = millis();
+    if (!m_request_rebirths || (node->rebirth_ms != 0 && now - node->rebirth_ms < REBIRTH_INTERVAL_MS)) {
+        return;
+    }
+    node->rebirth_ms = now != 0 ? now : 1;
+    uint8_t metric[64];
+    uint8_t *pos = metric;
+    *pos++ = (org_eclipse_tahu_protobuf_Payload_Metric_name_tag << 3) | 2;
+    put_varint(&pos, strlen(REBIRTH_METRIC_NAME));
+    memcpy(pos, REBIRTH_METRIC_NAME, strlen(REBIRTH_METRIC_NAME));
+    pos += strlen(REBIRTH_METRIC_NAME);
+    *pos++ = org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag << 3;
+    put_varint(&pos, METRIC_DATA_TYPE_BOOLEAN);
+    *pos++ = org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag << 3;
+    *pos++ = 1;
+    uint8_t payload[96];
+    uint8_t *out = payload;
+    *out++ = org_eclipse_tahu_protobuf_Payload_timestamp_tag << 3;
+    put_varint(&out, wall_millis());
+    *out++ = (org_eclipse_tahu_protobuf_Payload_metrics_tag << 3) | 2;
+    put_varint(&out, pos - metric);
+    memcpy(out, metric, pos - metric);
+    out += pos - metric;
+
+    char topic[TOPIC_SIZE];
+    snprintf(topic, sizeof(topic), NODE_TOPIC(NCMD_MESSAGE_TYPE, "%s"), node->id);
+    if (m_broker.publish(topic, payload, out - payload)) {
+        node->stats.rebirths++;
+    }
+}
+
+
+/*
+Converts a scalar metric's value to °C, NaN if it has none.
+*/
+static float metric_celsius(const Metric *metric) {
+    if (metric->is_null) {
+        return NAN;
+    }
+    switch (metric->which_value) {
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+        return metric->value.float_value;
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+        // USE_MILLIDEGREE_NDATA nodes send milli-degrees
+        return (int32_t)metric->value.int_value / 1000.0f;
+    default:
+        return NAN;
+    }
+}
+
+
+/*
+Applies a live metric to the node's values, returning false if it isn't one of
+the columns.
+*/
+static bool apply_metric(GatewayNode *node, const Metric *metric) {
+    if (!metric->has_alias) {
+        return false;
+    }
+    if (node->has_array && metric->alias == node->array_alias) {
+        if (metric->is_null || metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag) {
+            return true;
+        }
+        // Arrays are packed little-endian, as is the host
+        const pb_bytes_array_t *bytes = metric->value.bytes_value;
+        for (size_t i = 0; i < bytes->size / 4 && i < NUMBER_OF_THERMISTORS; i++) {
+            if (node->array_datatype == METRIC_DATA_TYPE_INT32_ARRAY) {
+                int32_t value;
+                memcpy(&value, &bytes->bytes[4 * i], 4);
+                node->values[i] = (value == INT32_MIN) ? NAN : value / 1000.0f;
+            } else {
+                memcpy(&node->values[i], &bytes->bytes[4 * i], 4);
+            }
+        }
+        return true;
+    }
+    for (int column = 0; column < TEMP_COLUMNS; column++) {
+        if (node->has_alias[column] && node->alias[column] == metric->alias) {
+            node->values[column] = metric_celsius(metric);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+Applies the payload's live metrics and adds the result to the node's frames.
+Historical metrics, stored while the node was disconnected, are too late for
+the periods they belong to and are left to the ingest tool.
+*/
+static void add_frame(GatewayNode *node, const DataPayload *payload) {
+    bool changed = false;
+    uint64_t ms = payload->has_timestamp ? payload->timestamp : wall_millis();
+    for (unsigned int i = 0; i < payload->metrics_count; i++) {
+        const Metric *metric = &payload->metrics[i];
+        if (!metric->is_historical && apply_metric(node, metric)) {
+            changed = true;
+            if (metric->has_timestamp) {
+                ms = metric->timestamp;
+            }
+        }
+    }
+    if (!changed) {
+        return;
+    }
+    GatewayFrame *frame = &node->frames[node->frame_count % FRAME_RING];
+    frame->ms = ms;
+    memcpy(frame->values, node->values, sizeof(frame->values));
+    node->frame_count++;
+}
+
+
+/*
+The node's newest frame stamped at or before ms, NULL if there's none.
+*/
+static const GatewayFrame *frame_at(const GatewayNode *node, uint64_t ms) {
+    uint32_t held = (node->frame_count < FRAME_RING) ? node->frame_count : FRAME_RING;
+    const GatewayFrame *best = NULL;
+    for (uint32_t i = node->frame_count - held; i != node->frame_count; i++) {
+        const GatewayFrame *frame = &node->frames[i % FRAME_RING];
+        if (frame->ms <= ms && (best == NULL || frame->ms >= best->ms)) {
+            best = frame;
+        }
+    }
+    return best;
+}
+
+
+/*
+Maps the columns from the birth's metric names. A birth without names keeps
+the map the node had; if there's none yet, the node is asked for a named birth.
+*/
+static void birth_received(GatewayNode *node, const DataPayload *payload) {
+    node->stats.births++;
+    bool named = false;
+    for (unsigned int i = 0; i < payload->metrics_count && !named; i++) {
+        named = payload->metrics[i].name != NULL;
+    }
+    node->has_bdseq = false;
+    for (unsigned int i = 0; i < payload->metrics_count; i++) {
+        const Metric *metric = &payload->metrics[i];
+        // bdSeq is named even in an alias-only birth
+        if (metric->name != NULL && strcmp(metric->name, BDSEQ_METRIC_NAME) == 0 &&
+            metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag) {
+            node->has_bdseq = true;
+            node->bdseq = metric->value.long_value;
+        }
+    }
+    if (named) {
+        memset(node->has_alias, 0, sizeof(node->has_alias));
+        node->has_array = false;
+        for (unsigned int i = 0; i < payload->metrics_count; i++) {
+            const Metric *metric = &payload->metrics[i];
+            if (metric->name == NULL || !metric->has_alias) {
+                continue;
+            }
+            const char *name = metric->name;
+            if (strncmp(name, CHANNEL_METRIC_PREFIX, strlen(CHANNEL_METRIC_PREFIX)) == 0 &&
+                isdigit((unsigned char)name[strlen(CHANNEL_METRIC_PREFIX)])) {
+                int channel = atoi(&name[strlen(CHANNEL_METRIC_PREFIX)]);
+                if (channel >= 1 && channel <= NUMBER_OF_THERMISTORS) {
+                    node->alias[channel - 1] = metric->alias;
+                    node->has_alias[channel - 1] = true;
+                }
+            } else if (strcmp(name, ARRAY_METRIC_NAME) == 0) {
+                node->array_alias = metric->alias;
+                node->array_datatype = metric->datatype;
+                node->has_array = true;
+            } else if (strcmp(name, ADC_METRIC_NAME) == 0) {
+                node->alias[ADC_COLUMN] = metric->alias;
+                node->has_alias[ADC_COLUMN] = true;
+            }
+        }
+        node->mapped = true;
+    } else if (!node->mapped) {
+        node->born = false;
+        request_rebirth(node);
+        return;
+    }
+    node->born = true;
+    node->has_seq = payload->has_seq;
+    node->seq = payload->seq;
+    clear_values(node);
+    add_frame(node, payload);
+}
+
+
+static void data_received(GatewayNode *node, const DataPayload *payload) {
+    node->stats.data++;
+    if (!node->born) {
+        node->stats.unknown++;
+        request_rebirth(node);
+        return;
+    }
+    if (payload->has_seq) {
+        if (node->has_seq && payload->seq != (node->seq + 1) % 256) {
+            node->stats.seq_gaps++;
+        }
+        node->has_seq = true;
+        node->seq = payload->seq;
+    }
+    add_frame(node, payload);
+}
+
+
+/*
+Takes the node offline, unless the NDEATH is the will of a session before its
+current birth: a node reconnecting quickly can be born again before the broker
+gets round to its old will.
+*/
+static void death_received(GatewayNode *node, const DataPayload *payload) {
+    for (unsigned int i = 0; i < payload->metrics_count; i++) {
+        const Metric *metric = &payload->metrics[i];
+        if (metric->name != NULL && strcmp(metric->name, BDSEQ_METRIC_NAME) == 0 && node->has_bdseq &&
+            metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag &&
+            metric->value.long_value != node->bdseq) {
+            node->stats.stale_deaths++;
+            return;
+        }
+    }
+    node->stats.deaths++;
+    node->born = false;
+    clear_values(node);
+}
+
+
+static void command_received(const uint8_t *message, unsigned int len) {
+    static CommandPayload command;
+    if (!decode_command_payload(message, len, &command)) {
+        return;
+    }
+    for (unsigned int i = 0; i < command.metrics_count; i++) {
+        MetricSpec *spec = find_received_metric(ARRAY_AND_SIZE(m_node_metrics), &command.metrics[i]);
+        if (spec != NULL && spec->alias == GMA_Rebirth && command.metrics[i].value.boolean_value) {
+            m_rebirth = true;
+        }
+    }
+}
+
+
+static void message_received(char *topic, byte *message, unsigned int len) {
+    m_messages_in++;
+    m_bytes_in += len;
+    if (strcmp(topic, m_cmd_topic) == 0) {
+        command_received(message, len);
+        return;
+    }
+    // spBv1.0/<group>/<type>/<node>
+    static const char prefix[] = SPARKPLUG_VERSION "/" GROUP_ID "/";
+    if (strncmp(topic, prefix, sizeof(prefix) - 1) != 0) {
+        return;
+    }
+    const char *type = topic + sizeof(prefix) - 1;
+    const char *id = strchr(type, '/');
+    if (id == NULL || strchr(id + 1, '/') != NULL) {
+        return;
+    }
+    size_t type_len = id - type;
+    id++;
+    int module = node_module(id);
+    GatewayNode *node = (module >= 0) ? find_node(module) : NULL;
+    if (node == NULL) {
+        if (strcmp(id, m_node_id) != 0) {
+            m_ignored++;
+        }
+        return;
+    }
+    if (!node->seen) {
+        node->seen = true;
+        snprintf(node->id, sizeof(node->id), "%s", id);
+    }
+    bool birth = type_len == strlen(NBIRTH_MESSAGE_TYPE) && strncmp(type, NBIRTH_MESSAGE_TYPE, type_len) == 0;
+    bool data = type_len == strlen(NDATA_MESSAGE_TYPE) && strncmp(type, NDATA_MESSAGE_TYPE, type_len) == 0;
+    bool death = type_len == strlen(NDEATH_MESSAGE_TYPE) && strncmp(type, NDEATH_MESSAGE_TYPE, type_len) == 0;
+    if (!birth && !data && !death) {
+        return;
+    }
+    if (!decode_data_payload(message, len, &m_payload)) {
+        node->stats.bad++;
+        fprintf(stderr, "%s: %s\n", topic, sparkplug_error_text());
+        return;
+    }
+    if (birth) {
+        birth_received(node, &m_payload);
+    } else if (data) {
+        data_received(node, &m_payload);
+    } else {
+        death_received(node, &m_payload);
+    }
+}
+
+
+/*
+Fills the furnace's rows as of ms: each online module's newest frame at or
+before then. Returns the modules online.
+*/
+static uint64_t fill_rows(Furnace *furnace, uint64_t ms) {
+    uint64_t online = 0;
+    for (int row = 0; row <= furnace->last - furnace->first; row++) {
+        const GatewayNode *node = &furnace->nodes[row];
+        DataSetValue *cells = furnace->rows[row].elements;
+        const GatewayFrame *frame = node->born ? frame_at(node, ms) : NULL;
+        online += node->born ? 1 : 0;
+        cells[1].value.boolean_value = node->born;
+        cells[2].value.long_value = (frame != NULL) ? frame->ms : 0;
+        for (int column = 0; column < TEMP_COLUMNS; column++) {
+            cells[3 + column].value.float_value = (frame != NULL) ? frame->values[column] : NAN;
+        }
+    }
+    return online;
+}
+
+
+/*
+Publishes the furnace as of the period starting at ms: a DBIRTH if it isn't
+born, a DDATA if it is, or a DDEATH once none of its modules are online.
+*/
+static void publish_furnace(Furnace *furnace, uint64_t ms) {
+    furnace->online = fill_rows(furnace, ms);
+    if (furnace->online == 0) {
+        if (furnace->born) {
+            furnace->born = false;
+            if (!publish_device_death(&m_broker, 1, furnace->topics[2])) {
+                m_publish_failures++;
+            }
+        }
+        return;
+    }
+    update_metric_range(ARRAY_AND_SIZE(furnace->metrics), furnace->metrics[0].alias, NUM_ELEM(furnace->metrics),
+                        ms);
+    set_up_next_payload();
+    bool full = !furnace->born;
+    if (!publish_metrics(&m_broker, 1, furnace->topics[full ? 0 : 1], full, ARRAY_AND_SIZE(furnace->metrics))) {
+        m_publish_failures++;
+        return;
+    }
+    furnace->born = true;
+    if (full) {
+        furnace->births++;
+    } else {
+        furnace->data++;
+    }
+}
+
+
+/*
+The NBIRTH, and the DBIRTH of every furnace with a module online.
+*/
+static void publish_births(uint64_t ms) {
+    set_up_nbirth_payload();
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) ||
+        !publish_metrics(&m_broker, 1, m_birth_topic, true, ARRAY_AND_SIZE(m_node_metrics))) {
+        m_publish_failures++;
+        return;
+    }
+    for (int f = 0; f < m_num_furnaces; f++) {
+        m_furnaces[f].born = false;
+        publish_furnace(&m_furnaces[f], ms);
+    }
+}
+
+
+/*
+Connects with an NDEATH carrying the next bdSeq as the will, as the firmware
+does, and subscribes to the nodes and to the gateway's own NCMD.
+*/
+static bool connect_broker() {
+    m_bdSeq++;
+    update_metric(ARRAY_AND_SIZE(m_bdseq_metrics), &m_bdSeq);
+    set_up_ndeath_payload();
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) || !connect(&m_broker, m_node_id, m_death_topic)) {
+        m_bdSeq--;
+        return false;
+    }
+    const char *types[] = {NBIRTH_MESSAGE_TYPE, NDATA_MESSAGE_TYPE, NDEATH_MESSAGE_TYPE};
+    for (const char *type : types) {
+        char topic[TOPIC_SIZE];
+        snprintf(topic, sizeof(topic), NODE_TOPIC("%s", "+"), type);
+        if (!m_broker.subscribe(topic)) {
+            m_client.drop();
+            return false;
+        }
+    }
+    if (!m_broker.subscribe(m_cmd_topic)) {
+        m_client.drop();
+        return false;
+    }
+    return true;
+}
+
+
+/*
+Lays out a furnace's DataSet over storage of its own, with the cells of each
+row typed once; fill_rows() only changes the values.
+*/
+static void set_up_furnace(Furnace *furnace, unsigned int alias) {
+    int rows = furnace->last - furnace->first + 1;
+    furnace->nodes = new GatewayNode[rows];
+    furnace->rows = new DataSetRow[rows];
+    furnace->cells = new DataSetValue[rows * ROW_COLUMNS];
+    memset(furnace->nodes, 0, rows * sizeof(GatewayNode));
+    memset(furnace->rows, 0, rows * sizeof(DataSetRow));
+    memset(furnace->cells, 0, rows * ROW_COLUMNS * sizeof(DataSetValue));
+    for (int row = 0; row < rows; row++) {
+        GatewayNode *node = &furnace->nodes[row];
+        snprintf(node->id, sizeof(node->id), NODE_ID_PREFIX "%d", furnace->first + row);
+        clear_values(node);
+        DataSetValue *cells = &furnace->cells[row * ROW_COLUMNS];
+        furnace->rows[row].elements_count = ROW_COLUMNS;
+        furnace->rows[row].elements = cells;
+        cells[0].which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_string_value_tag;
+        cells[0].value.string_value = node->id;
+        cells[1].which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_boolean_value_tag;
+        cells[2].which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_long_value_tag;
+        for (int column = 3; column < ROW_COLUMNS; column++) {
+            cells[column].which_value = org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue_float_value_tag;
+        }
+    }
+    DataSet *dataset = &furnace->dataset;
+    memset(dataset, 0, sizeof(*dataset));
+    dataset->has_num_of_columns = true;
+    dataset->num_of_columns = ROW_COLUMNS;
+    dataset->columns_count = ROW_COLUMNS;
+    dataset->columns = (char **)m_columns;
+    dataset->types_count = ROW_COLUMNS;
+    dataset->types = m_types;
+    dataset->rows_count = rows;
+    dataset->rows = furnace->rows;
+
+    MetricSpec metrics[] = {
+        metric_spec("Temperatures", alias,     false, METRIC_DATA_TYPE_DATASET, &furnace->dataset),
+        metric_spec("Nodes Online", alias + 1, false, METRIC_DATA_TYPE_INT64,   &furnace->online),
+    };
+    memcpy(furnace->metrics, metrics, sizeof(metrics));
+    snprintf(furnace->topics[0], TOPIC_SIZE, DEVICE_TOPIC(DBIRTH_MESSAGE_TYPE, "%s", "%s"), m_node_id,
+             furnace->name);
+    snprintf(furnace->topics[1], TOPIC_SIZE, DEVICE_TOPIC(DDATA_MESSAGE_TYPE, "%s", "%s"), m_node_id,
+             furnace->name);
+    snprintf(furnace->topics[2], TOPIC_SIZE, DEVICE_TOPIC(DDEATH_MESSAGE_TYPE, "%s", "%s"), m_node_id,
+             furnace->name);
+}
+
+
+static bool set_up_gateway() {
+    m_columns[0] = "Node";
+    m_types[0] = DATA_SET_DATA_TYPE_STRING;
+    m_columns[1] = "Online";
+    m_types[1] = DATA_SET_DATA_TYPE_BOOLEAN;
+    m_columns[2] = "Timestamp";
+    m_types[2] = DATA_SET_DATA_TYPE_DATETIME;
+    for (int column = 0; column < TEMP_COLUMNS; column++) {
+        if (column == ADC_COLUMN) {
+            snprintf(m_column_names[column], sizeof(m_column_names[column]), "ADC Internal Temperature");
+        } else {
+            snprintf(m_column_names[column], sizeof(m_column_names[column]), "THERMISTOR%d", column + 1);
+        }
+        m_columns[3 + column] = m_column_names[column];
+        m_types[3 + column] = DATA_SET_DATA_TYPE_FLOAT;
+    }
+
+    if (m_num_furnaces == 0) {
+        snprintf(m_furnaces[0].name, FURNACE_NAME_SIZE, "FURNACE");
+        m_furnaces[0].first = 0;
+        m_furnaces[0].last = NUM_MODULES - 1;
+        m_num_furnaces = 1;
+        m_num_rows = NUM_MODULES;
+    }
+    m_furnace_count = m_num_furnaces;
+    for (int f = 0; f < m_num_furnaces; f++) {
+        set_up_furnace(&m_furnaces[f], GMA_End + 2 * f);
+    }
+    snprintf(m_birth_topic, sizeof(m_birth_topic), NODE_TOPIC(NBIRTH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_death_topic, sizeof(m_death_topic), NODE_TOPIC(NDEATH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_cmd_topic, sizeof(m_cmd_topic), NODE_TOPIC(NCMD_MESSAGE_TYPE, "%s"), m_node_id);
+
+    set_gettimestamp_callback(wall_millis);
+    set_max_metrics(NUM_ELEM(m_bdseq_metrics) + NUM_ELEM(m_node_metrics));
+    set_payload_compression(m_compress);
+    if (!check_metrics(ARRAY_AND_SIZE(m_bdseq_metrics), GMA_bdSeq + 1) ||
+        !check_metrics(ARRAY_AND_SIZE(m_node_metrics), GMA_End)) {
+        fprintf(stderr, "%s\n", sparkplug_error_text());
+        return false;
+    }
+    for (int f = 0; f < m_num_furnaces; f++) {
+        if (!check_metrics(ARRAY_AND_SIZE(m_furnaces[f].metrics), GMA_End + 2 * f + 2)) {
+            fprintf(stderr, "%s: %s\n", m_furnaces[f].name, sparkplug_error_text());
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+--furnace NAME=FIRST-LAST, modules FIRST to LAST. Furnaces mustn't overlap.
+*/
+static bool parse_furnace(const char *value) {
+    if (m_num_furnaces == MAX_FURNACES) {
+        return false;
+    }
+    Furnace *furnace = &m_furnaces[m_num_furnaces];
+    char name[FURNACE_NAME_SIZE];
+    int first, last;
+    if (sscanf(value, "%23[^=]=%d-%d", name, &first, &last) != 3 || first < 0 || last < first ||
+        m_num_rows + (last - first + 1) > MAX_ROWS || strchr(name, '/') != NULL) {
+        return false;
+    }
+    for (int f = 0; f < m_num_furnaces; f++) {
+        if (first <= m_furnaces[f].last && last >= m_furnaces[f].first) {
+            return false;
+        }
+    }
+    snprintf(furnace->name, sizeof(furnace->name), "%s", name);
+    furnace->first = first;
+    furnace->last = last;
+    m_num_rows += last - first + 1;
+    m_num_furnaces++;
+    return true;
+}
+
+
+static void stop_requested(int signum) {
+    (void)signum;
+    m_stop = 1;
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --broker HOST[:PORT]  MQTT broker (default localhost:1883)\n"
+            "  --node-id ID          The gateway's edge node ID (default THERMISTOR_GATEWAY)\n"
+            "  --furnace NAME=A-B    A furnace of modules A to B; repeat for more (default FURNACE=0-%d)\n"
+            "  --period MS           Time between a furnace's DDATA (default 1000)\n"
+            "  --lag MS              Wait for a period's frames this long after it starts (default 250)\n"
+            "  --compress BYTES      Compress payloads of at least BYTES (default never)\n"
+            "  --no-rebirth          Never ask a node for a birth with its metric names\n",
+            program, NUM_MODULES - 1);
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--no-rebirth") == 0) {
+            m_request_rebirths = false;
+            continue;
+        }
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--broker") == 0) {
+            unsigned int port = m_port;
+            if (sscanf(value, "%127[^:]:%u", m_host, &port) < 1 || port == 0 || port > 65535) {
+                return false;
+            }
+            m_port = port;
+        } else if (strcmp(arg, "--node-id") == 0) {
+            if (strlen(value) >= sizeof(m_node_id) || strchr(value, '/') != NULL || node_module(value) >= 0) {
+                return false;
+            }
+            strcpy(m_node_id, value);
+        } else if (strcmp(arg, "--furnace") == 0) {
+            if (!parse_furnace(value)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--period") == 0) {
+            m_period_ms = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--lag") == 0) {
+            m_lag_ms = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--compress") == 0) {
+            m_compress = strtoul(value, NULL, 10);
+        } else {
+            return false;
+        }
+    }
+    return m_period_ms > 0 && m_lag_ms < m_period_ms;
+}
+
+
+static void print_summary() {
+    NodeStats total = {};
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Node", "births", "data", "deaths", "stale",
+            "seq gaps", "rebirths", "unknown", "bad");
+    for (int f = 0; f < m_num_furnaces; f++) {
+        Furnace *furnace = &m_furnaces[f];
+        for (int row = 0; row <= furnace->last - furnace->first; row++) {
+            const GatewayNode *node = &furnace->nodes[row];
+            if (!node->seen) {
+                continue;
+            }
+            const NodeStats &stats = node->stats;
+            fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", node->id, stats.births, stats.data,
+                    stats.deaths, stats.stale_deaths, stats.seq_gaps, stats.rebirths, stats.unknown, stats.bad);
+            total.births += stats.births;
+            total.data += stats.data;
+            total.deaths += stats.deaths;
+            total.stale_deaths += stats.stale_deaths;
+            total.seq_gaps += stats.seq_gaps;
+            total.rebirths += stats.rebirths;
+            total.unknown += stats.unknown;
+            total.bad += stats.bad;
+        }
+    }
+    fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", "Total", total.births, total.data,
+            total.deaths, total.stale_deaths, total.seq_gaps, total.rebirths, total.unknown, total.bad);
+    for (int f = 0; f < m_num_furnaces; f++) {
+        fprintf(stderr, "Furnace %s (modules %d-%d): %lu births, %lu data\n", m_furnaces[f].name,
+                m_furnaces[f].first, m_furnaces[f].last, m_furnaces[f].births, m_furnaces[f].data);
+    }
+    SocketWriteStats writes;
+    socket_write_stats(&writes);
+    fprintf(stderr, "In: %lu messages, %llu bytes. Out: %lu messages, %llu bytes, %lu publish failures\n",
+            m_messages_in, m_bytes_in, writes.publishes, writes.bytes, m_publish_failures);
+    if (m_ignored > 0) {
+        fprintf(stderr, "%lu messages from nodes in no furnace ignored\n", m_ignored);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!set_up_gateway()) {
+        return 1;
+    }
+    sim_serial_quiet(true);
+    signal(SIGINT, stop_requested);
+    signal(SIGTERM, stop_requested);
+
+    m_broker.setClient(m_client);
+    m_broker.setServer(m_host, m_port);
+    m_broker.setCallback(message_received);
+    m_broker.setBufferSize(MQTT_RECEIVE_SIZE);
+
+    uint32_t next_connect = millis();
+    uint32_t backoff_ms = RECONNECT_MIN_MS;
+    // The period whose rows go out next, once its lag has passed
+    uint64_t next_period = wall_millis() / m_period_ms * m_period_ms;
+    while (!m_stop) {
+        uint32_t now = millis();
+        if (!m_broker.connected()) {
+            if ((int32_t)(now - next_connect) < 0) {
+                usleep(1000);
+                continue;
+            }
+            if (!connect_broker()) {
+                fprintf(stderr, "Can't connect to %s:%u\n", m_host, m_port);
+                next_connect = now + backoff_ms;
+                backoff_ms = min(backoff_ms * 2, (uint32_t)RECONNECT_MAX_MS);
+                continue;
+            }
+            backoff_ms = RECONNECT_MIN_MS;
+            m_rebirth = false;
+            publish_births(next_period - m_period_ms);
+        }
+        // Take everything waiting before publishing
+        while (m_broker.loop() && m_client.available() > 0) {
+        }
+        if (m_rebirth) {
+            m_rebirth = false;
+            publish_births(next_period - m_period_ms);
+        }
+        uint64_t wall = wall_millis();
+        if (wall >= next_period + m_lag_ms) {
+            for (int f = 0; f < m_num_furnaces; f++) {
+                publish_furnace(&m_furnaces[f], next_period);
+            }
+            next_period += m_period_ms;
+            if (wall >= next_period + m_period_ms) {
+                // Fell more than a period behind; don't try to catch up
+                next_period = wall / m_period_ms * m_period_ms;
+            }
+        }
+        usleep(500);
+    }
+
+    // A clean shutdown publishes the NDEATH itself before disconnecting
+    if (m_broker.connected()) {
+        set_up_ndeath_payload();
+        add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics));
+        disconnect(&m_broker, m_death_topic);
+    }
+    print_summary();
+    return 0;
+}
@@ -0,0 +1,1212 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file ingest.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Ingest tool: subscribes to the NBIRTH, NDATA and NDEATH of every node
+ * in the group and writes each node's temperatures to files in the SD log
+ * format (see thermistorMux_sdlog.h), with the columns in milli-degrees.
+ *
+ * The nodes are sharded by ID over --shards pipelines, so a node's messages
+ * stay in order and shards share nothing but the broker connection.  The main
+ * thread receives, copying each message into one of its shard's message
+ * buffers; the shard's decode thread decodes it into the shard's DataPayload
+ * with cf_sparkplug's decoder and converts its metrics into rows; the shard's
+ * write thread delta codes the rows into segments and files.  The stages hand
+ * over through single producer, single consumer queues without locks, and the
+ * buffers go back to the receiver through another, so a shard's memory is
+ * fixed and a busy shard holds the receiver up rather than growing.  Each
+ * node's state is a fixed-size slot holding its alias map, last values and the
+ * segment being filled, so memory is bounded by --max-nodes and --shards
+ * however much the fleet sends.  Each NDATA is a row of every column at its timestamp, the
+ * channels it doesn't carry holding their last values; historical metrics go
+ * in rows at their own timestamps.  A node publishing raw codes in place of
+ * temperatures has them converted with thermistorMux_conversion.h and the
+ * build's default sensor model, uncalibrated.  Test_Environment/sdlog_reader.py
+ * reads the files.
+ *
+ *     .pio/build/native_ingest/program --broker 192.168.1.10 --out /data/thermistors
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <atomic>
+#include <thread>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cf_sparkplug.h"
+#include "native_sim.h"
+#include "../fleet/posix_client.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_delta.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_conversion.h"
+#include "thermistorMux_sdlog.h"
+
+#define GROUP_ID              "VI"              // As in thermistorMux_network.cpp
+#define CLIENT_ID             "THERMISTOR_INGEST"
+#define NODE_ID_PREFIX        "THERMISTOR"
+#define NODE_ID_SIZE          32
+#define TOPIC_SIZE            64
+#define PATH_SIZE             256
+#define MQTT_RECEIVE_SIZE     32768             // Largest message taken, an uncompressed NBIRTH with room over
+#define RECONNECT_MIN_MS      500
+#define RECONNECT_MAX_MS      16000
+#define REBIRTH_INTERVAL_MS   10000             // Least time between Rebirth requests to a node
+#define FILE_FORMAT           "%s/%s_%05u.BIN"
+#define MAX_FILES             99999
+#define MAX_SHARDS            64
+#define SHARD_MESSAGES        32                // Message buffers of a shard, a power of 2
+#define SHARD_ROWS            1024              // Rows queued to a shard's writer, a power of 2
+#define SHARD_REBIRTHS        64                // Rebirth requests queued to the receiver, a power of 2
+#define IDLE_WAIT_US          200               // Sleep of a stage with nothing to do
+
+// Metric names the columns are mapped from, as in thermistorMux_network.cpp
+#define CHANNEL_METRIC_PREFIX "Inputs/THERMISTOR"
+#define ARRAY_METRIC_NAME     "Inputs/THERMISTORS"
+#define ADC_METRIC_NAME       "Inputs/ADC Internal Temperature"
+#define FRAME_METRIC_NAME     "Inputs/Frame Number"
+#define FIRMWARE_METRIC_NAME  "Properties/Firmware Version"
+#define REBIRTH_METRIC_NAME   "Node Control/Rebirth"
+#define RAW_CODES_METRIC_NAME "Inputs/Raw Codes"
+#define RAW_MODE_METRIC_NAME  "Node Control/Raw Codes"
+#define RAW_CODES_INSTEAD     2                 // As RawCodesMode in thermistorMux_network.h
+#define ADC_COLUMN            NUMBER_OF_THERMISTORS
+
+// Ingest settings, from the command line
+static int m_max_nodes = 256;
+static char m_host[128] = "localhost";
+static uint16_t m_port = 1883;
+static char m_out[PATH_SIZE] = ".";
+static double m_flush_s = 60;                   // Oldest a part-filled segment gets before it's written
+static bool m_request_rebirths = true;
+static int m_shards = 0;                        // 0 for one per two cores
+static double m_stats_s = 0;                    // Queue depth report interval, 0 none
+
+// What happened to a node, for the summary on exit
+struct NodeStats {
+    unsigned long births;
+    unsigned long data;
+    unsigned long deaths;
+    unsigned long rows;
+    unsigned long seq_gaps;
+    unsigned long lost;                         // Frame numbers skipped over and not replayed since
+    unsigned long replayed;                     // Historical frames
+    unsigned long repeated;                     // Live frames numbered at or before one already seen
+    unsigned long rebirths;                     // Rebirths requested
+    unsigned long unknown;                      // NDATA before a birth that named the metrics
+    unsigned long bad;                          // Payloads that didn't decode
+};
+
+struct Shard;
+
+/*
+A node's state: how its aliases map onto the columns, the last value of each
+column, and the file and segment its rows are going into. Its shard's decode
+thread owns the map and values, the write thread the file and segment, and the
+receiver the rebirth requests.
+*/
+struct IngestNode {
+    char id[NODE_ID_SIZE];
+    uint8_t module;                             // From the node ID, for the file header
+    Shard *shard;
+    bool mapped;                                // A birth has named the metrics
+    bool born;                                  // Online since its last birth
+    uint64_t alias[SLOTS_PER_PASS];
+    bool has_alias[SLOTS_PER_PASS];
+    uint64_t array_alias;                       // USE_ARRAY_NDATA nodes' Inputs/THERMISTORS
+    bool has_array;
+    uint32_t array_datatype;
+    uint64_t raw_alias;                         // Inputs/Raw Codes
+    bool has_raw;
+    uint64_t raw_mode_alias;                    // Node Control/Raw Codes
+    bool has_raw_mode;
+    uint64_t raw_mode;                          // Its last value; RAW_CODES_INSTEAD to convert the codes
+    int32_t values[SLOTS_PER_PASS];             // Milli-degrees, SDLOG_NO_VALUE if unknown
+    bool has_seq;
+    uint64_t seq;
+    uint64_t frame_alias;                       // Inputs/Frame Number
+    bool has_frame_alias;
+    uint64_t last_frame;                        // Highest frame number seen, 0 none
+    bool frame_restart;                         // Born since; lower numbers mean a cold boot
+    uint32_t rebirth_ms;                        // When a Rebirth was last requested, 0 never
+
+    // The write thread's
+    char firmware[32];                          // Of the file being written
+    bool listed;                                // In the shard's written nodes
+    FILE *file;
+    uint32_t segment;                           // Next segment of the file
+    uint16_t frames;                            // Frames in data
+    uint16_t used;                              // Bytes of data filled, header included
+    uint64_t first;
+    uint64_t last;
+    uint32_t segment_ms;                        // When its first frame went in
+    DeltaCoder coder;
+    uint8_t data[SDLOG_SEGMENT_SIZE];
+    uint8_t index[SDLOG_SEGMENT_SIZE];
+    unsigned int index_entries;
+
+    NodeStats stats;
+};
+
+/*
+A queue from one thread to one other without locks: the producer only moves
+the tail and the consumer only the head, each publishing its entries with a
+release the other acquires. Entries are filled and read in place.
+*/
+template <typename T, uint32_t N> struct SpscQueue {
+    static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of 2");
+    alignas(64) std::atomic<uint32_t> head{0};  // Next entry to take
+    alignas(64) std::atomic<uint32_t> tail{0};  // Next entry to fill
+    uint32_t peak = 0;                          // Highest depth seen, by the producer
+    T entries[N];
+
+    // The entry to fill, or NULL if the queue is full; push() queues it
+    T *back() {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        return t - head.load(std::memory_order_acquire) == N ? NULL : &entries[t % N];
+    }
+    void push() {
+        uint32_t t = tail.load(std::memory_order_relaxed) + 1;
+        tail.store(t, std::memory_order_release);
+        uint32_t depth = t - head.load(std::memory_order_relaxed);
+        if (depth > peak) {
+            peak = depth;
+        }
+    }
+    // The oldest entry, or NULL if the queue is empty; pop() frees it
+    T *front() {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        return h == tail.load(std::memory_order_acquire) ? NULL : &entries[h % N];
+    }
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    uint32_t depth() const {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed);
+    }
+};
+
+enum MessageType {
+    MESSAGE_BIRTH,
+    MESSAGE_DATA,
+    MESSAGE_DEATH
+};
+
+// A received message, waiting for its shard's decode thread
+struct Message {
+    uint8_t type;                               // MessageType
+    char id[NODE_ID_SIZE + 1];                  // Longer IDs are cut, and dropped as too long
+    char topic[TOPIC_SIZE];
+    unsigned int len;
+    uint8_t bytes[MQTT_RECEIVE_SIZE];
+};
+
+enum RowType {
+    ROW_VALUES,                                 // A row of every column
+    ROW_FIRMWARE,                               // A named birth; new firmware starts a new file
+    ROW_FLUSH                                   // A death: write out the segment
+};
+
+// What the decode thread hands the write thread
+struct Row {
+    uint8_t type;                               // RowType
+    IngestNode *node;
+    uint64_t time;                              // UTC microseconds
+    union {
+        int32_t values[SLOTS_PER_PASS];
+        char firmware[32];
+    };
+};
+
+/*
+One pipeline of the nodes whose IDs hash to it. The receiver takes a message
+buffer off free, fills it and queues it on messages; the decode thread queues
+its rows on rows and the buffer back on free.
+*/
+struct Shard {
+    SpscQueue<uint8_t, SHARD_MESSAGES> free;    // Buffers for the receiver
+    SpscQueue<uint8_t, SHARD_MESSAGES> messages;
+    SpscQueue<Row, SHARD_ROWS> rows;
+    SpscQueue<IngestNode *, SHARD_REBIRTHS> rebirths;
+    Message buffers[SHARD_MESSAGES];
+    DataPayload payload;                        // The decode thread's
+    IngestNode **nodes;                         // Found by the decode thread
+    int num_nodes;
+    IngestNode **written;                       // Written by the write thread
+    int num_written;
+    std::atomic<bool> decoded{false};           // The decode thread has finished
+    std::thread decoder;
+    std::thread writer;
+    unsigned long received;                     // Messages, by the receiver
+    unsigned long stalls;                       // Times the receiver waited for a buffer
+    unsigned long row_stalls;                   // Times the decode thread waited to queue a row
+};
+
+static IngestNode *m_nodes;
+static std::atomic<int> m_num_nodes{0};
+static std::atomic<unsigned long> m_dropped_nodes{0};   // Messages from nodes over --max-nodes
+static Shard *m_shard[MAX_SHARDS];
+static ThermistorConversion m_conversion;       // The default sensor model's, for raw codes
+static PosixClient m_client;
+static PubSubClient m_broker;
+static volatile sig_atomic_t m_stop = 0;
+static std::atomic<bool> m_receiving{true};     // Cleared once the receiver queues no more
+
+
+static unsigned long long wall_micros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+// Milliseconds of a steady clock, for the stage threads (millis() is the receiver's)
+static uint32_t steady_millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+
+/*
+Stamps a segment's header and CRC, as the node's SD logger does.
+*/
+static void seal_segment(IngestNode *node, uint8_t *segment, const char *magic, uint16_t count, uint64_t first,
+                         uint64_t last) {
+    const uint32_t zero = 0;
+    memcpy(&segment[0], magic, 4);
+    memcpy(&segment[4], &node->segment, 4);
+    memcpy(&segment[8], &count, 2);
+    segment[10] = SLOTS_PER_PASS;
+    segment[11] = SDLOG_VERSION;
+    memcpy(&segment[12], &zero, 4);
+    memcpy(&segment[16], &first, 8);
+    memcpy(&segment[24], &last, 8);
+    uint32_t crc = crc32(segment, SDLOG_SEGMENT_SIZE);
+    memcpy(&segment[12], &crc, 4);
+}
+
+
+static bool write_segment(IngestNode *node, const uint8_t *segment) {
+    if (fwrite(segment, SDLOG_SEGMENT_SIZE, 1, node->file) != 1) {
+        fprintf(stderr, "%s: write failed: %s\n", node->id, strerror(errno));
+        return false;
+    }
+    node->segment++;
+    return true;
+}
+
+
+static void close_file(IngestNode *node) {
+    if (node->file != NULL) {
+        fclose(node->file);
+        node->file = NULL;
+    }
+}
+
+
+/*
+Opens the node's next unused file in the output directory and writes its
+header segment.
+*/
+static bool open_file(IngestNode *node) {
+    char path[PATH_SIZE + NODE_ID_SIZE + 16];
+    unsigned int number = 0;
+    do {
+        if (++number > MAX_FILES) {
+            fprintf(stderr, "%s: no unused file name left\n", node->id);
+            return false;
+        }
+        snprintf(path, sizeof(path), FILE_FORMAT, m_out, node->id, number);
+    } while (access(path, F_OK) == 0);
+    node->file = fopen(path, "wb");
+    if (node->file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    node->segment = 0;
+    node->index_entries = 0;
+
+    uint8_t *header = node->index;
+    memset(header, 0, SDLOG_SEGMENT_SIZE);
+    const uint32_t segment_size = SDLOG_SEGMENT_SIZE;
+    const uint16_t interval = SDLOG_INDEX_INTERVAL;
+    const uint32_t file_segments = SDLOG_FILE_SEGMENTS;
+    memcpy(&header[32], &segment_size, 4);
+    memcpy(&header[38], &interval, 2);
+    header[40] = node->module;
+    header[41] = SDLOG_COLUMNS_MDEG;
+    memcpy(&header[48], node->firmware, sizeof(node->firmware));
+    memcpy(&header[80], &file_segments, 4);
+    seal_segment(node, header, "TMXH", 0, 0, 0);
+    if (!write_segment(node, header)) {
+        close_file(node);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+Writes out the node's part- or wholly-filled segment, with an index segment
+first on each SDLOG_INDEX_INTERVAL boundary and a new file when this one is
+full.
+*/
+static void write_data_segment(IngestNode *node) {
+    if (node->frames == 0) {
+        return;
+    }
+    if (node->file != NULL && node->segment >= SDLOG_FILE_SEGMENTS) {
+        close_file(node);
+    }
+    if (node->file == NULL && !open_file(node)) {
+        node->frames = 0;
+        return;
+    }
+    if (node->segment % SDLOG_INDEX_INTERVAL == 0) {
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if (node->index_entries > 0) {
+            memcpy(&first, &node->index[SDLOG_HEADER_SIZE + 8], 8);
+            memcpy(&last, &node->index[SDLOG_HEADER_SIZE + (node->index_entries - 1) * SDLOG_INDEX_ENTRY_SIZE + 16],
+                   8);
+        }
+        seal_segment(node, node->index, "TMXI", node->index_entries, first, last);
+        node->index_entries = 0;
+        if (!write_segment(node, node->index)) {
+            close_file(node);
+            node->frames = 0;
+            return;
+        }
+    }
+    if (node->index_entries == 0) {
+        memset(node->index, 0, SDLOG_SEGMENT_SIZE);
+    }
+    uint8_t *entry = &node->index[SDLOG_HEADER_SIZE + node->index_entries * SDLOG_INDEX_ENTRY_SIZE];
+    memcpy(&entry[0], &node->segment, 4);
+    memcpy(&entry[4], &node->frames, 2);
+    memcpy(&entry[8], &node->first, 8);
+    memcpy(&entry[16], &node->last, 8);
+    seal_segment(node, node->data, "TMXD", node->frames, node->first, node->last);
+    if (write_segment(node, node->data)) {
+        node->index_entries++;
+    } else {
+        close_file(node);
+    }
+    node->frames = 0;
+}
+
+
+/*
+Adds a row of every column at time (UTC microseconds), delta coded as the
+node's SD logger codes its frames. The write thread's.
+*/
+static void add_row(IngestNode *node, uint64_t time, const int32_t *values) {
+    if (node->frames == 0) {
+        memset(node->data, 0, SDLOG_SEGMENT_SIZE);
+        node->first = time;
+        node->used = SDLOG_HEADER_SIZE;
+        node->segment_ms = steady_millis();
+        delta_reset(&node->coder, time);
+    }
+    node->last = time;
+    uint8_t *out = &node->data[node->used];
+    size_t n = delta_put_time(&node->coder, out, time);
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        n += delta_put_code(&node->coder, &out[n], slot, (uint32_t)values[slot]);
+    }
+    node->used += n;
+    node->stats.rows++;
+    if (++node->frames == UINT16_MAX || SDLOG_SEGMENT_SIZE - node->used < SDLOG_MAX_FRAME_SIZE) {
+        write_data_segment(node);
+    }
+}
+
+
+/*
+Queues a row to the shard's write thread, waiting while its queue is full.
+*/
+static Row *queue_row(IngestNode *node, uint8_t type) {
+    Shard *shard = node->shard;
+    Row *row;
+    if ((row = shard->rows.back()) == NULL) {
+        shard->row_stalls++;
+        while ((row = shard->rows.back()) == NULL) {
+            usleep(IDLE_WAIT_US);
+        }
+    }
+    row->type = type;
+    row->node = node;
+    return row;
+}
+
+
+// queue_row() of a row of every column at time (UTC microseconds)
+static void queue_values(IngestNode *node, uint64_t time, const int32_t *values) {
+    Row *row = queue_row(node, ROW_VALUES);
+    row->time = time;
+    memcpy(row->values, values, sizeof(row->values));
+    node->shard->rows.push();
+}
+
+
+/*
+The shard's node with the ID, taking a free slot of the --max-nodes for a new
+one. The decode thread's.
+*/
+static IngestNode *find_node(Shard *shard, const char *id) {
+    for (int n = 0; n < shard->num_nodes; n++) {
+        if (strcmp(shard->nodes[n]->id, id) == 0) {
+            return shard->nodes[n];
+        }
+    }
+    int slot = m_num_nodes.load();
+    do {
+        if (slot == m_max_nodes || strlen(id) >= NODE_ID_SIZE) {
+            m_dropped_nodes++;
+            return NULL;
+        }
+    } while (!m_num_nodes.compare_exchange_weak(slot, slot + 1));
+    IngestNode *node = &m_nodes[slot];
+    memset(node, 0, sizeof(*node));
+    strcpy(node->id, id);
+    node->shard = shard;
+    shard->nodes[shard->num_nodes++] = node;
+    if (strncmp(id, NODE_ID_PREFIX, strlen(NODE_ID_PREFIX)) == 0) {
+        node->module = atoi(&id[strlen(NODE_ID_PREFIX)]);
+    }
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        node->values[slot] = SDLOG_NO_VALUE;
+    }
+    return node;
+}
+
+
+static void put_varint(uint8_t **out, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        *(*out)++ = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+}
+
+
+/*
+Asks the receiver to request a birth of the node. A request that doesn't fit
+is dropped; the node's next message asks again.
+*/
+static void want_rebirth(IngestNode *node) {
+    IngestNode **entry = node->shard->rebirths.back();
+    if (entry != NULL) {
+        *entry = node;
+        node->shard->rebirths.push();
+    }
+}
+
+
+/*
+Asks a node for a birth with its metric names, limited to one request per
+REBIRTH_INTERVAL_MS. The NCMD is small enough to encode here: a timestamp and
+a named, true Boolean. The receiver's.
+*/
+static void request_rebirth(IngestNode *node) {
+    uint32_t now = millis();
+    if (!m_request_rebirths || (node->rebirth_ms != 0 && now - node->rebirth_ms < REBIRTH_INTERVAL_MS)) {
+        return;
+    }
+    node->rebirth_ms = now != 0 ? now : 1;
+    uint8_t metric[64];
+    uint8_t *pos = metric;
+    *pos++ = (org_eclipse_tahu_protobuf_Payload_Metric_name_tag << 3) | 2;
+    put_varint(&pos, strlen(REBIRTH_METRIC_NAME));
+    memcpy(pos, REBIRTH_METRIC_NAME, strlen(REBIRTH_METRIC_NAME));
+    pos += strlen(REBIRTH_METRIC_NAME);
+    *pos++ = org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag << 3;
+    put_varint(&pos, METRIC_DATA_TYPE_BOOLEAN);
+    *pos++ = org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag << 3;
+    *pos++ = 1;
+    uint8_t payload[96];
+    uint8_t *out = payload;
+    *out++ = org_eclipse_tahu_protobuf_Payload_timestamp_tag << 3;
+    put_varint(&out, wall_micros() / 1000);
+    *out++ = (org_eclipse_tahu_protobuf_Payload_metrics_tag << 3) | 2;
+    put_varint(&out, pos - metric);
+    memcpy(out, metric, pos - metric);
+    out += pos - metric;
+
+    char topic[TOPIC_SIZE];
+    snprintf(topic, sizeof(topic), NODE_TOPIC(NCMD_MESSAGE_TYPE, "%s"), node->id);
+    if (m_broker.publish(topic, payload, out - payload)) {
+        node->stats.rebirths++;
+    }
+}
+
+
+/*
+Converts a scalar metric's value to milli-degrees.
+*/
+static int32_t metric_mdeg(const Metric *metric) {
+    if (metric->is_null) {
+        return SDLOG_NO_VALUE;
+    }
+    switch (metric->which_value) {
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+        if (!isfinite(metric->value.float_value) || fabsf(metric->value.float_value) >= INT32_MAX / 1000) {
+            return SDLOG_NO_VALUE;
+        }
+        return (int32_t)lrintf(metric->value.float_value * 1000);
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+        // USE_MILLIDEGREE_NDATA nodes send milli-degrees already
+        return (int32_t)metric->value.int_value;
+    default:
+        return SDLOG_NO_VALUE;
+    }
+}
+
+
+/*
+Applies a metric to the columns of values, returning false if it isn't one of
+theirs.
+*/
+static bool apply_metric(IngestNode *node, const Metric *metric, int32_t *values) {
+    if (!metric->has_alias) {
+        return false;
+    }
+    if (node->has_array && metric->alias == node->array_alias) {
+        if (metric->is_null || metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag) {
+            return true;
+        }
+        // Arrays are packed little-endian, as is the host
+        const pb_bytes_array_t *bytes = metric->value.bytes_value;
+        for (size_t i = 0; i < bytes->size / 4 && i < NUMBER_OF_THERMISTORS; i++) {
+            if (node->array_datatype == METRIC_DATA_TYPE_INT32_ARRAY) {
+                memcpy(&values[i], &bytes->bytes[4 * i], 4);
+            } else {
+                float value;
+                memcpy(&value, &bytes->bytes[4 * i], 4);
+                values[i] = isfinite(value) && fabsf(value) < INT32_MAX / 1000 ? (int32_t)lrintf(value * 1000)
+                                                                              : SDLOG_NO_VALUE;
+            }
+        }
+        return true;
+    }
+    if (node->has_raw && metric->alias == node->raw_alias) {
+        // Alongside the temperatures the codes are only passed through
+        if (node->raw_mode != RAW_CODES_INSTEAD || metric->is_null ||
+            metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag) {
+            return false;
+        }
+        int32_t codes[NUMBER_OF_THERMISTORS];
+        float temps[NUMBER_OF_THERMISTORS];
+        const pb_bytes_array_t *bytes = metric->value.bytes_value;
+        size_t n = min((size_t)(bytes->size / 4), (size_t)NUMBER_OF_THERMISTORS);
+        memcpy(codes, bytes->bytes, 4 * n);
+        convert_code_block(&m_conversion, codes, temps, n);
+        for (size_t i = 0; i < n; i++) {
+            values[i] = isfinite(temps[i]) && fabsf(temps[i]) < INT32_MAX / 1000 ? (int32_t)lrintf(temps[i] * 1000)
+                                                                                : SDLOG_NO_VALUE;
+        }
+        return true;
+    }
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        if (node->has_alias[slot] && node->alias[slot] == metric->alias) {
+            values[slot] = metric_mdeg(metric);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+Accounts for a frame number. Numbers the node skipped over count as lost until
+historical frames (replayed from the node's history after an outage) make them
+up; a live frame numbered at or before the highest seen is a repeat. Under a
+deadband a frame with nothing outside it isn't sent, so gaps are expected.
+*/
+static void note_frame(IngestNode *node, const Metric *metric) {
+    if (metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag) {
+        return;
+    }
+    uint64_t frame = metric->value.long_value;
+    if (!metric->is_historical && node->frame_restart && frame <= node->last_frame) {
+        node->last_frame = 0;
+    }
+    if (!metric->is_historical) {
+        node->frame_restart = false;
+    }
+    if (frame > node->last_frame) {
+        if (node->last_frame != 0) {
+            node->stats.lost += frame - node->last_frame - 1;
+        }
+        node->last_frame = frame;
+    } else if (!metric->is_historical) {
+        node->stats.repeated++;
+    } else if (node->stats.lost > 0) {
+        node->stats.lost--;
+    }
+    if (metric->is_historical) {
+        node->stats.replayed++;
+    }
+}
+
+
+/*
+Queues the payload's metrics as rows: the live ones in a row at their
+timestamp, and the historical ones in rows at theirs, carried from the held
+values without changing them.
+*/
+static void add_payload_rows(IngestNode *node, const DataPayload *payload) {
+    uint64_t payload_ms = payload->has_timestamp ? payload->timestamp : wall_micros() / 1000;
+    int32_t history[SLOTS_PER_PASS];
+    memcpy(history, node->values, sizeof(history));
+    bool history_pending = false;
+    uint64_t history_ms = 0;
+    bool live = false;
+    uint64_t live_ms = payload_ms;
+    for (unsigned int i = 0; i < payload->metrics_count; i++) {
+        const Metric *metric = &payload->metrics[i];
+        uint64_t ms = metric->has_timestamp ? metric->timestamp : payload_ms;
+        if (node->has_frame_alias && metric->has_alias && metric->alias == node->frame_alias) {
+            note_frame(node, metric);
+        } else if (node->has_raw_mode && metric->has_alias && metric->alias == node->raw_mode_alias) {
+            if (metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag) {
+                node->raw_mode = metric->value.long_value;
+            }
+        } else if (metric->is_historical) {
+            if (history_pending && ms != history_ms) {
+                queue_values(node, history_ms * 1000, history);
+                history_pending = false;
+            }
+            if (apply_metric(node, metric, history)) {
+                history_pending = true;
+                history_ms = ms;
+            }
+        } else if (apply_metric(node, metric, node->values)) {
+            live = true;
+            live_ms = ms;
+        }
+    }
+    if (history_pending) {
+        queue_values(node, history_ms * 1000, history);
+    }
+    if (live) {
+        queue_values(node, live_ms * 1000, node->values);
+    }
+}
+
+
+/*
+Maps the columns from the birth's metric names. A birth without names, sent
+once a host has confirmed the node's definitions, keeps the map the node had;
+if there's none yet, the node is asked for a named birth.
+*/
+static void birth_received(IngestNode *node, const DataPayload *payload) {
+    node->stats.births++;
+    bool named = false;
+    for (unsigned int i = 0; i < payload->metrics_count && !named; i++) {
+        named = payload->metrics[i].name != NULL;
+    }
+    if (named) {
+        char firmware[sizeof(Row::firmware)] = "";
+        memset(node->has_alias, 0, sizeof(node->has_alias));
+        node->has_array = false;
+        node->has_raw = false;
+        node->has_raw_mode = false;
+        node->has_frame_alias = false;
+        for (unsigned int i = 0; i < payload->metrics_count; i++) {
+            const Metric *metric = &payload->metrics[i];
+            if (metric->name == NULL || !metric->has_alias) {
+                continue;
+            }
+            const char *name = metric->name;
+            if (strncmp(name, CHANNEL_METRIC_PREFIX, strlen(CHANNEL_METRIC_PREFIX)) == 0 &&
+                isdigit((unsigned char)name[strlen(CHANNEL_METRIC_PREFIX)])) {
+                int channel = atoi(&name[strlen(CHANNEL_METRIC_PREFIX)]);
+                if (channel >= 1 && channel <= NUMBER_OF_THERMISTORS) {
+                    node->alias[channel - 1] = metric->alias;
+                    node->has_alias[channel - 1] = true;
+                }
+            } else if (strcmp(name, ARRAY_METRIC_NAME) == 0) {
+                node->array_alias = metric->alias;
+                node->array_datatype = metric->datatype;
+                node->has_array = true;
+            } else if (strcmp(name, RAW_CODES_METRIC_NAME) == 0) {
+                node->raw_alias = metric->alias;
+                node->has_raw = true;
+            } else if (strcmp(name, RAW_MODE_METRIC_NAME) == 0) {
+                node->raw_mode_alias = metric->alias;
+                node->has_raw_mode = true;
+            } else if (strcmp(name, ADC_METRIC_NAME) == 0) {
+                node->alias[ADC_COLUMN] = metric->alias;
+                node->has_alias[ADC_COLUMN] = true;
+            } else if (strcmp(name, FRAME_METRIC_NAME) == 0) {
+                node->frame_alias = metric->alias;
+                node->has_frame_alias = true;
+            } else if (strcmp(name, FIRMWARE_METRIC_NAME) == 0 &&
+                       metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag) {
+                strncpy(firmware, metric->value.string_value, sizeof(firmware) - 1);
+            }
+        }
+        // A file holds one firmware's data
+        Row *row = queue_row(node, ROW_FIRMWARE);
+        memcpy(row->firmware, firmware, sizeof(row->firmware));
+        node->shard->rows.push();
+        node->mapped = true;
+    } else if (!node->mapped) {
+        want_rebirth(node);
+        return;
+    }
+    node->born = true;
+    node->has_seq = payload->has_seq;
+    node->seq = payload->seq;
+    node->frame_restart = true;
+    node->raw_mode = 0;
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        node->values[slot] = SDLOG_NO_VALUE;
+    }
+    add_payload_rows(node, payload);
+}
+
+
+static void data_received(IngestNode *node, const DataPayload *payload) {
+    node->stats.data++;
+    if (!node->born) {
+        node->stats.unknown++;
+        want_rebirth(node);
+        return;
+    }
+    if (payload->has_seq) {
+        if (node->has_seq && payload->seq != (node->seq + 1) % 256) {
+            node->stats.seq_gaps++;
+        }
+        node->has_seq = true;
+        node->seq = payload->seq;
+    }
+    add_payload_rows(node, payload);
+}
+
+
+static void death_received(IngestNode *node) {
+    node->stats.deaths++;
+    node->born = false;
+    queue_row(node, ROW_FLUSH);
+    node->shard->rows.push();
+}
+
+
+/*
+Decodes one message and queues its rows. The decode thread's.
+*/
+static void decode_message(Shard *shard, const Message *message) {
+    IngestNode *node = find_node(shard, message->id);
+    if (node == NULL) {
+        return;
+    }
+    if (message->type == MESSAGE_DEATH) {
+        death_received(node);
+        return;
+    }
+    if (!decode_data_payload(message->bytes, message->len, &shard->payload)) {
+        node->stats.bad++;
+        fprintf(stderr, "%s: %s\n", message->topic, sparkplug_error_text());
+        return;
+    }
+    if (message->type == MESSAGE_BIRTH) {
+        birth_received(node, &shard->payload);
+    } else {
+        data_received(node, &shard->payload);
+    }
+}
+
+
+static void decode_thread(Shard *shard) {
+    for (;;) {
+        uint8_t *buffer = shard->messages.front();
+        if (buffer == NULL) {
+            if (!m_receiving.load(std::memory_order_acquire) && shard->messages.depth() == 0) {
+                break;
+            }
+            usleep(IDLE_WAIT_US);
+            continue;
+        }
+        uint8_t index = *buffer;
+        shard->messages.pop();
+        decode_message(shard, &shard->buffers[index]);
+        // Every buffer fits in free, so there's always room
+        *shard->free.back() = index;
+        shard->free.push();
+    }
+    shard->decoded.store(true, std::memory_order_release);
+}
+
+
+/*
+Applies one row to its node's segment and file. The write thread's.
+*/
+static void write_row(Shard *shard, const Row *row) {
+    IngestNode *node = row->node;
+    if (!node->listed) {
+        node->listed = true;
+        shard->written[shard->num_written++] = node;
+    }
+    switch (row->type) {
+    case ROW_VALUES:
+        add_row(node, row->time, row->values);
+        break;
+    case ROW_FIRMWARE:
+        if (strncmp(row->firmware, node->firmware, sizeof(node->firmware)) != 0) {
+            write_data_segment(node);
+            close_file(node);
+            memcpy(node->firmware, row->firmware, sizeof(node->firmware));
+        }
+        break;
+    case ROW_FLUSH:
+        write_data_segment(node);
+        if (node->file != NULL) {
+            fflush(node->file);
+        }
+        break;
+    }
+}
+
+
+/*
+Writes out the segments that have been filling for longer than --flush, so the
+files don't lag the nodes by more than that.
+*/
+static void flush_idle_segments(Shard *shard) {
+    uint32_t now = steady_millis();
+    for (int n = 0; n < shard->num_written; n++) {
+        IngestNode *node = shard->written[n];
+        if (node->frames > 0 && now - node->segment_ms >= m_flush_s * 1000) {
+            write_data_segment(node);
+            if (node->file != NULL) {
+                fflush(node->file);
+            }
+        }
+    }
+}
+
+
+static void write_thread(Shard *shard) {
+    uint32_t next_flush = steady_millis() + 1000;
+    for (;;) {
+        Row *row = shard->rows.front();
+        if (row != NULL) {
+            write_row(shard, row);
+            shard->rows.pop();
+        } else if (shard->decoded.load(std::memory_order_acquire) && shard->rows.depth() == 0) {
+            break;
+        } else {
+            usleep(IDLE_WAIT_US);
+        }
+        uint32_t now = steady_millis();
+        if ((int32_t)(now - next_flush) >= 0) {
+            flush_idle_segments(shard);
+            next_flush = now + 1000;
+        }
+    }
+    for (int n = 0; n < shard->num_written; n++) {
+        write_data_segment(shard->written[n]);
+        close_file(shard->written[n]);
+    }
+}
+
+
+// FNV-1a of a node ID, which picks its shard
+static uint32_t id_hash(const char *id, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)id[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+static void message_received(char *topic, byte *message, unsigned int len) {
+    // spBv1.0/<group>/<type>/<node>
+    static const char prefix[] = SPARKPLUG_VERSION "/" GROUP_ID "/";
+    if (strncmp(topic, prefix, sizeof(prefix) - 1) != 0) {
+        return;
+    }
+    const char *type = topic + sizeof(prefix) - 1;
+    const char *id = strchr(type, '/');
+    if (id == NULL || strchr(id + 1, '/') != NULL) {
+        return;
+    }
+    size_t type_len = id - type;
+    id++;
+    uint8_t message_type;
+    if (type_len == strlen(NDEATH_MESSAGE_TYPE) && strncmp(type, NDEATH_MESSAGE_TYPE, type_len) == 0) {
+        message_type = MESSAGE_DEATH;
+    } else if (type_len == strlen(NBIRTH_MESSAGE_TYPE) && strncmp(type, NBIRTH_MESSAGE_TYPE, type_len) == 0) {
+        message_type = MESSAGE_BIRTH;
+    } else if (type_len == strlen(NDATA_MESSAGE_TYPE) && strncmp(type, NDATA_MESSAGE_TYPE, type_len) == 0) {
+        message_type = MESSAGE_DATA;
+    } else {
+        return;
+    }
+    size_t id_len = strlen(id);
+    Shard *shard = m_shard[id_hash(id, id_len) % m_shards];
+    uint8_t *buffer = shard->free.front();
+    if (buffer == NULL) {
+        shard->stalls++;
+        while ((buffer = shard->free.front()) == NULL) {
+            usleep(IDLE_WAIT_US);
+        }
+    }
+    uint8_t index = *buffer;
+    shard->free.pop();
+    Message *queued = &shard->buffers[index];
+    queued->type = message_type;
+    snprintf(queued->id, sizeof(queued->id), "%s", id);
+    snprintf(queued->topic, sizeof(queued->topic), "%s", topic);
+    queued->len = min(len, (unsigned int)sizeof(queued->bytes));
+    memcpy(queued->bytes, message, queued->len);
+    *shard->messages.back() = index;
+    shard->messages.push();
+    shard->received++;
+}
+
+
+// Sends the Rebirth requests the decode threads have queued
+static void send_rebirths() {
+    for (int s = 0; s < m_shards; s++) {
+        IngestNode **entry;
+        while ((entry = m_shard[s]->rebirths.front()) != NULL) {
+            request_rebirth(*entry);
+            m_shard[s]->rebirths.pop();
+        }
+    }
+}
+
+
+// Prints each shard's queue depths, now and at their highest
+static void print_queue_depths(const char *when) {
+    fprintf(stderr, "Queue depths %s (messages of %d, rows of %d; now/peak):", when, SHARD_MESSAGES, SHARD_ROWS);
+    for (int s = 0; s < m_shards; s++) {
+        const Shard *shard = m_shard[s];
+        fprintf(stderr, " [%d] %u/%u %u/%u", s, shard->messages.depth(), shard->messages.peak, shard->rows.depth(),
+                shard->rows.peak);
+    }
+    fprintf(stderr, "\n");
+}
+
+
+static bool connect_broker() {
+    if (!m_broker.connect(CLIENT_ID)) {
+        return false;
+    }
+    const char *types[] = {NBIRTH_MESSAGE_TYPE, NDATA_MESSAGE_TYPE, NDEATH_MESSAGE_TYPE};
+    for (const char *type : types) {
+        char topic[TOPIC_SIZE];
+        snprintf(topic, sizeof(topic), NODE_TOPIC("%s", "+"), type);
+        if (!m_broker.subscribe(topic)) {
+            m_client.stop();
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void stop_requested(int signum) {
+    (void)signum;
+    m_stop = 1;
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --broker HOST[:PORT]  MQTT broker (default localhost:1883)\n"
+            "  --out DIR             Directory the node files go in (default .)\n"
+            "  --max-nodes N         Most nodes followed; others are ignored (default 256)\n"
+            "  --flush S             Write out part-filled segments after S seconds (default 60)\n"
+            "  --shards N            Decode and write pipelines, the nodes shared out by ID\n"
+            "                        (default one per two cores, up to %d)\n"
+            "  --stats S             Print the queue depths every S seconds\n"
+            "  --no-rebirth          Never ask a node for a birth with its metric names\n",
+            program, MAX_SHARDS);
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--no-rebirth") == 0) {
+            m_request_rebirths = false;
+            continue;
+        }
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--broker") == 0) {
+            unsigned int port = m_port;
+            if (sscanf(value, "%127[^:]:%u", m_host, &port) < 1 || port == 0 || port > 65535) {
+                return false;
+            }
+            m_port = port;
+        } else if (strcmp(arg, "--out") == 0) {
+            snprintf(m_out, sizeof(m_out), "%s", value);
+        } else if (strcmp(arg, "--max-nodes") == 0) {
+            m_max_nodes = atoi(value);
+        } else if (strcmp(arg, "--flush") == 0) {
+            m_flush_s = atof(value);
+        } else if (strcmp(arg, "--shards") == 0) {
+            m_shards = atoi(value);
+            if (m_shards <= 0 || m_shards > MAX_SHARDS) {
+                return false;
+            }
+        } else if (strcmp(arg, "--stats") == 0) {
+            m_stats_s = atof(value);
+        } else {
+            return false;
+        }
+    }
+    return m_max_nodes > 0 && m_flush_s > 0 && m_stats_s >= 0;
+}
+
+
+// Starts a shard's decode and write threads, its buffers all free
+static Shard *start_shard() {
+    Shard *shard = new Shard();
+    shard->nodes = new IngestNode *[m_max_nodes];
+    shard->written = new IngestNode *[m_max_nodes];
+    for (int i = 0; i < SHARD_MESSAGES; i++) {
+        *shard->free.back() = i;
+        shard->free.push();
+    }
+    shard->decoder = std::thread(decode_thread, shard);
+    shard->writer = std::thread(write_thread, shard);
+    return shard;
+}
+
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    struct stat out;
+    if (stat(m_out, &out) != 0 || !S_ISDIR(out.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", m_out);
+        return 1;
+    }
+    sim_serial_quiet(true);
+    make_thermistor_conversion(DEFAULT_SENSOR_MODEL, m_conversion);
+    signal(SIGINT, stop_requested);
+    signal(SIGTERM, stop_requested);
+
+    m_nodes = new IngestNode[m_max_nodes];
+    if (m_shards == 0) {
+        m_shards = constrain((int)std::thread::hardware_concurrency() / 2, 1, MAX_SHARDS);
+    }
+    for (int s = 0; s < m_shards; s++) {
+        m_shard[s] = start_shard();
+    }
+    m_broker.setClient(m_client);
+    m_broker.setServer(m_host, m_port);
+    m_broker.setCallback(message_received);
+    m_broker.setBufferSize(MQTT_RECEIVE_SIZE);
+
+    uint32_t next_connect = millis();
+    uint32_t backoff_ms = RECONNECT_MIN_MS;
+    uint32_t next_stats = millis() + m_stats_s * 1000;
+    while (!m_stop) {
+        uint32_t now = millis();
+        if (!m_broker.connected()) {
+            if ((int32_t)(now - next_connect) < 0) {
+                usleep(1000);
+                continue;
+            }
+            if (!connect_broker()) {
+                fprintf(stderr, "Can't connect to %s:%u\n", m_host, m_port);
+                next_connect = now + backoff_ms;
+                backoff_ms = min(backoff_ms * 2, (uint32_t)RECONNECT_MAX_MS);
+                continue;
+            }
+            backoff_ms = RECONNECT_MIN_MS;
+        }
+        // Take everything waiting before sleeping
+        while (m_broker.loop() && m_client.available() > 0) {
+        }
+        send_rebirths();
+        if (m_stats_s > 0 && (int32_t)(now - next_stats) >= 0) {
+            print_queue_depths("now");
+            next_stats = now + m_stats_s * 1000;
+        }
+        usleep(500);
+    }
+    if (m_broker.connected()) {
+        m_broker.disconnect();
+    }
+    // The shards finish what's queued, and write everything out
+    m_receiving.store(false, std::memory_order_release);
+    for (int s = 0; s < m_shards; s++) {
+        m_shard[s]->decoder.join();
+        m_shard[s]->writer.join();
+    }
+
+    NodeStats total = {};
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "Node", "births", "data", "deaths",
+            "rows", "seq gaps", "lost", "replayed", "repeated", "rebirths", "unknown", "bad");
+    for (int n = 0; n < m_num_nodes; n++) {
+        IngestNode *node = &m_nodes[n];
+        const NodeStats &stats = node->stats;
+        fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", node->id, stats.births,
+                stats.data, stats.deaths, stats.rows, stats.seq_gaps, stats.lost, stats.replayed, stats.repeated,
+                stats.rebirths, stats.unknown, stats.bad);
+        total.births += stats.births;
+        total.data += stats.data;
+        total.deaths += stats.deaths;
+        total.rows += stats.rows;
+        total.seq_gaps += stats.seq_gaps;
+        total.lost += stats.lost;
+        total.replayed += stats.replayed;
+        total.repeated += stats.repeated;
+        total.rebirths += stats.rebirths;
+        total.unknown += stats.unknown;
+        total.bad += stats.bad;
+    }
+    fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", "Total", total.births,
+            total.data, total.deaths, total.rows, total.seq_gaps, total.lost, total.replayed, total.repeated,
+            total.rebirths, total.unknown, total.bad);
+    if (m_dropped_nodes > 0) {
+        fprintf(stderr, "%lu messages from nodes over --max-nodes ignored\n", m_dropped_nodes.load());
+    }
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s\n", "Shard", "messages", "stalls", "msg peak", "row peak",
+            "row wait");
+    for (int s = 0; s < m_shards; s++) {
+        Shard *shard = m_shard[s];
+        fprintf(stderr, "%-14d %8lu %8lu %8u %8u %8lu\n", s, shard->received, shard->stalls, shard->messages.peak,
+                shard->rows.peak, shard->row_stalls);
+        delete[] shard->nodes;
+        delete[] shard->written;
+        delete shard;
+    }
+    delete[] m_nodes;
+    return 0;
+}
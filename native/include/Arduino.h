@@ -0,0 +1,140 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file Arduino.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Host-native stand-in for the Teensyduino core: pins, interrupts, timing and
+ * the USB serial port, backed by the simulator in native/src.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW  0
+
+#define INPUT         0
+#define OUTPUT        1
+#define INPUT_PULLUP  2
+#define INPUT_PULLDOWN 3
+
+#define LOW_LEVEL 0
+#define CHANGE    4
+#define RISING    3
+#define FALLING   2
+
+#define F_CPU        600000000
+#define F_CPU_ACTUAL 600000000
+
+// No separate memories on the host
+#define FASTRUN
+#define FLASHMEM
+#define PROGMEM
+#define DMAMEM
+#define EXTMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr)      (*(const uint8_t *)(addr))
+#define pgm_read_byte_near(addr) pgm_read_byte(addr)
+
+#define CORE_NUM_DIGITAL 55
+
+#include "imxrt.h"
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+#include "IntervalTimer.h"
+
+// Cycle counter, derived from the virtual clock
+uint32_t native_cycle_count();
+#define ARM_DWT_CYCCNT (native_cycle_count())
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+uint8_t digitalRead(uint8_t pin);
+void digitalToggle(uint8_t pin);
+#define digitalPinToInterrupt(p) (p)
+// No fast GPIO port on the host: the scan engine falls back to digitalWrite()
+volatile uint32_t *portOutputRegister(uint8_t pin);
+uint32_t digitalPinToBitMask(uint8_t pin);
+// The pad's mux register, which only holds what is written to it
+volatile uint32_t *portConfigRegister(uint8_t pin);
+
+void attachInterrupt(uint8_t pin, void (*function)(void), int mode);
+void detachInterrupt(uint8_t pin);
+void noInterrupts();
+void interrupts();
+#define __disable_irq() noInterrupts()
+#define __enable_irq()  interrupts()
+// WFI: sleeps until the next interrupt is due, or the next 1 ms SysTick
+void native_wait_for_interrupt();
+#define __WFI() native_wait_for_interrupt()
+#define sei() interrupts()
+#define cli() noInterrupts()
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(uint32_t seed);
+
+#ifdef __cplusplus
+#include <type_traits>
+template<class A, class B> constexpr typename std::common_type<A, B>::type min(A a, B b) { return a < b ? a : b; }
+template<class A, class B> constexpr typename std::common_type<A, B>::type max(A a, B b) { return a > b ? a : b; }
+template<class T, class L, class H> constexpr T constrain(T x, L low, H high) {
+    return x < low ? low : (x > high ? high : x);
+}
+#endif
+
+// USB serial, written to stdout
+class usb_serial_class : public Stream {
+public:
+    void begin(long baud) { (void)baud; }
+    void end() {}
+    virtual size_t write(uint8_t b);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    virtual int availableForWrite() { return 4096; }
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush();
+    operator bool() { return true; }
+};
+extern usb_serial_class Serial;
+
+void setup();
+void loop();
+
+#endif
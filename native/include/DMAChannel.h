@@ -0,0 +1,49 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file DMAChannel.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief DMAChannel for the host-native build. The channels are set up but never
+ * move data; the firmware only uses them for the FlexIO, which the simulator
+ * doesn't have.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef DMAChannel_h
+#define DMAChannel_h
+
+#include <stdint.h>
+
+class DMAChannel {
+public:
+    DMAChannel() : channel(0) {}
+    void begin(bool force = false) { (void)force; }
+    void source(volatile const uint32_t &) {}
+    void destination(volatile uint32_t &) {}
+    void sourceBuffer(volatile const uint32_t p[], unsigned int len) { (void)p; (void)len; }
+    void destinationBuffer(volatile uint32_t p[], unsigned int len) { (void)p; (void)len; }
+    void triggerAtHwReq(uint8_t source) { (void)source; }
+    void disableOnCompletion() {}
+    void interruptAtCompletion() {}
+    void attachInterrupt(void (*isr)(void), uint8_t priority) { (void)isr; (void)priority; }
+    void clearInterrupt() {}
+    void enable() {}
+    void disable() {}
+    uint8_t channel;
+};
+
+#endif
@@ -0,0 +1,62 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file EEPROM.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief EEPROM for the host-native build: the Teensy 4.1's 4284 bytes held in
+ * memory, optionally persisted to a file (see sim_eeprom_file()).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include <stdint.h>
+#include <string.h>
+
+#define E2END 0x10BB
+
+class EEPROMClass {
+public:
+    uint8_t read(int index);
+    void write(int index, uint8_t value);
+    void update(int index, uint8_t value) {
+        if (read(index) != value) {
+            write(index, value);
+        }
+    }
+    template<class T> T &get(int index, T &t) {
+        uint8_t *p = (uint8_t *)&t;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            p[i] = read(index + i);
+        }
+        return t;
+    }
+    template<class T> const T &put(int index, const T &t) {
+        const uint8_t *p = (const uint8_t *)&t;
+        for (size_t i = 0; i < sizeof(T); i++) {
+            update(index + i, p[i]);
+        }
+        return t;
+    }
+    uint16_t length() { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,65 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file EventResponder.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief EventResponder for the host-native build. Only immediate responders are
+ * used by the firmware; the others are run straight away as well.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef EventResponder_h
+#define EventResponder_h
+
+#include <stddef.h>
+
+class EventResponder;
+typedef EventResponder &EventResponderRef;
+typedef void (*EventResponderFunction)(EventResponderRef);
+
+class EventResponder {
+public:
+    EventResponder() : m_function(NULL), m_status(0), m_data(NULL), m_context(NULL), m_triggered(false) {}
+    void attachImmediate(EventResponderFunction function) { m_function = function; }
+    void attachInterrupt(EventResponderFunction function) { m_function = function; }
+    void attach(EventResponderFunction function) { m_function = function; }
+    void detach() { m_function = NULL; }
+    void triggerEvent(int status = 0, void *data = NULL) {
+        m_status = status;
+        m_data = data;
+        m_triggered = true;
+        if (m_function != NULL) {
+            m_function(*this);
+        }
+    }
+    void clearEvent() { m_triggered = false; }
+    int getStatus() { return m_status; }
+    void *getData() { return m_data; }
+    void setContext(void *context) { m_context = context; }
+    void *getContext() { return m_context; }
+    operator bool() { return m_triggered; }
+
+private:
+    EventResponderFunction m_function;
+    int m_status;
+    void *m_data;
+    void *m_context;
+    bool m_triggered;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file IPAddress.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Arduino IPAddress for the host-native build.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <string.h>
+#include "Print.h"
+
+class IPAddress : public Printable {
+public:
+    IPAddress() { memset(m_address, 0, sizeof(m_address)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+        m_address[0] = a;
+        m_address[1] = b;
+        m_address[2] = c;
+        m_address[3] = d;
+    }
+    IPAddress(uint32_t address) { memcpy(m_address, &address, sizeof(m_address)); }
+    IPAddress(const uint8_t *address) { memcpy(m_address, address, sizeof(m_address)); }
+
+    operator uint32_t() const {
+        uint32_t address;
+        memcpy(&address, m_address, sizeof(address));
+        return address;
+    }
+    bool operator==(const IPAddress &other) const { return memcmp(m_address, other.m_address, sizeof(m_address)) == 0; }
+    bool operator!=(const IPAddress &other) const { return !(*this == other); }
+    uint8_t operator[](int index) const { return m_address[index]; }
+    uint8_t &operator[](int index) { return m_address[index]; }
+
+    virtual size_t printTo(Print &p) const {
+        size_t n = 0;
+        for (int i = 0; i < 4; i++) {
+            n += p.print(m_address[i], DEC);
+            if (i < 3) {
+                n += p.print('.');
+            }
+        }
+        return n;
+    }
+
+private:
+    uint8_t m_address[4];
+};
+
+#endif
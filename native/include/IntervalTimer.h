@@ -0,0 +1,50 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file IntervalTimer.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief IntervalTimer for the host-native build: a periodic event on the
+ * simulator's virtual clock.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef IntervalTimer_h
+#define IntervalTimer_h
+
+#include <stdint.h>
+
+class IntervalTimer {
+public:
+    IntervalTimer() : m_function(0), m_period_ns(0), m_event(0) {}
+    ~IntervalTimer() { end(); }
+    bool begin(void (*function)(), unsigned int microseconds);
+    bool begin(void (*function)(), int microseconds) { return begin(function, (unsigned int)microseconds); }
+    bool begin(void (*function)(), float microseconds) { return begin(function, (unsigned int)microseconds); }
+    void update(unsigned int microseconds);
+    void end();
+    void priority(uint8_t n) { (void)n; }
+
+private:
+    static void tick(void *context);
+
+    void (*m_function)();
+    uint64_t m_period_ns;
+    uint32_t m_event;
+};
+
+#endif
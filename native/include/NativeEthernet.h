@@ -0,0 +1,125 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file NativeEthernet.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief NativeEthernet for the host-native build. TCP connections go to the
+ * simulator's in-process MQTT broker and UDP to its datagram sink and SNTP
+ * responder (see native_sim.h). An EthernetServer accepts the connections the
+ * simulator's scraper makes (sim_http_get()).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef NativeEthernet_h
+#define NativeEthernet_h
+
+#include "Arduino.h"
+#include "Client.h"
+#include "Udp.h"
+
+enum EthernetLinkStatus {
+    Unknown,
+    LinkON,
+    LinkOFF
+};
+
+enum EthernetHardwareStatus {
+    EthernetNoHardware,
+    EthernetW5100,
+    EthernetW5200,
+    EthernetW5500
+};
+
+class EthernetClass {
+public:
+    void begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
+    EthernetLinkStatus linkStatus();
+    EthernetHardwareStatus hardwareStatus() { return EthernetW5500; }
+    IPAddress localIP() { return m_ip; }
+    int maintain() { return 0; }
+    void setSocketNum(uint8_t n) { (void)n; }
+    void setSocketSize(size_t size) { (void)size; }
+    void setStackHeap(size_t size) { (void)size; }
+
+private:
+    IPAddress m_ip;
+};
+
+extern EthernetClass Ethernet;
+
+class EthernetClient : public Client {
+public:
+    EthernetClient() : m_socket(-1), m_timeout_ms(1000) {}
+    explicit EthernetClient(int socket) : m_socket(socket), m_timeout_ms(1000) {}
+    virtual int connect(IPAddress ip, uint16_t port);
+    virtual int connect(const char *host, uint16_t port);
+    virtual size_t write(uint8_t b) { return write(&b, 1); }
+    virtual size_t write(const uint8_t *buf, size_t size);
+    using Print::write;
+    virtual int availableForWrite();
+    virtual int available();
+    virtual int read();
+    virtual int read(uint8_t *buf, size_t size);
+    virtual int peek();
+    virtual void flush();
+    virtual void stop();
+    virtual uint8_t connected();
+    virtual operator bool() { return m_socket >= 0; }
+    void setConnectionTimeout(uint16_t timeout_ms) { m_timeout_ms = timeout_ms; }
+
+private:
+    int m_socket;
+    uint16_t m_timeout_ms;
+};
+
+class EthernetServer {
+public:
+    explicit EthernetServer(uint16_t port) : m_port(port) {}
+    void begin();
+    EthernetClient accept();
+
+private:
+    uint16_t m_port;
+};
+
+class EthernetUDP : public UDP {
+public:
+    EthernetUDP() : m_socket(-1) {}
+    virtual uint8_t begin(uint16_t port);
+    uint8_t beginMulticast(IPAddress ip, uint16_t port) { (void)ip; return begin(port); }
+    virtual void stop();
+    virtual int beginPacket(IPAddress ip, uint16_t port);
+    virtual int endPacket();
+    virtual size_t write(uint8_t b) { return write(&b, 1); }
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    virtual int parsePacket();
+    virtual int available();
+    virtual int read();
+    virtual int read(unsigned char *buffer, size_t len);
+    virtual int read(char *buffer, size_t len) { return read((unsigned char *)buffer, len); }
+    virtual int peek();
+    virtual void flush() {}
+    virtual IPAddress remoteIP();
+    virtual uint16_t remotePort();
+
+private:
+    int m_socket;
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file SPI.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief SPI for the host-native build. Transfers are exchanged with the simulated
+ * MCP3561 whose chip select is low.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include "Arduino.h"
+#include "EventResponder.h"
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+class SPISettings {
+public:
+    SPISettings(uint32_t clock, uint8_t bit_order, uint8_t data_mode) : m_clock(clock) { (void)bit_order; (void)data_mode; }
+    SPISettings() : m_clock(4000000) {}
+    uint32_t clock() const { return m_clock; }
+
+private:
+    uint32_t m_clock;
+};
+
+class SPIClass {
+public:
+    void begin() {}
+    void end() {}
+    void beginTransaction(SPISettings settings) { m_clock = settings.clock(); }
+    void endTransaction() {}
+    void usingInterrupt(uint8_t n) { (void)n; }
+    void setMOSI(uint8_t pin) { (void)pin; }
+    void setMISO(uint8_t pin) { (void)pin; }
+    void setSCK(uint8_t pin) { (void)pin; }
+
+    uint8_t transfer(uint8_t data);
+    uint16_t transfer16(uint16_t data);
+    uint32_t transfer32(uint32_t data);
+    void transfer(void *buf, size_t count) { transfer(buf, buf, count); }
+    void transfer(const void *tx, void *rx, size_t count);
+    bool transfer(const void *tx, void *rx, size_t count, EventResponderRef event);
+
+    uint32_t clock() const { return m_clock; }
+
+private:
+    uint32_t m_clock = 4000000;
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,57 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file WString.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Minimal Arduino String for the host-native build.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef NATIVE_WSTRING_H
+#define NATIVE_WSTRING_H
+
+#include <string.h>
+#include <stdlib.h>
+
+class String {
+public:
+    String(const char *s = "") : m_buffer(strdup(s ? s : "")) {}
+    String(const String &other) : m_buffer(strdup(other.m_buffer)) {}
+    ~String() { free(m_buffer); }
+    String &operator=(const String &other) {
+        if (this != &other) {
+            free(m_buffer);
+            m_buffer = strdup(other.m_buffer);
+        }
+        return *this;
+    }
+    const char *c_str() const { return m_buffer; }
+    unsigned int length() const { return strlen(m_buffer); }
+    void replace(char find, char with) {
+        for (char *c = m_buffer; *c; c++) {
+            if (*c == find) {
+                *c = with;
+            }
+        }
+    }
+
+private:
+    char *m_buffer;
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file imxrt.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief The i.MX RT1062 register definitions the firmware refers to, for the
+ * host-native build. Addresses are only compared, never dereferenced, except for
+ * SCB_AIRCR, which the simulator watches for the restart request, the SNVS real
+ * time counter, which follows the virtual clock, and the program flash, an array
+ * written through the core's eepromemu_flash_*() routines. The simulated
+ * interrupts share one priority, so setting NVIC priorities does nothing.
+ * The watchdog's registers only hold what is written to them; it never times
+ * out, and the reset status reads as a power-on reset.
+ * Writing the DCP's channel 0 semaphore runs its packets there and then
+ * (native/src/sim_dcp.cpp). There is no FlexIO2, so the ADCs are read on the
+ * simulated LPSPI4 only.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef NATIVE_IMXRT_H
+#define NATIVE_IMXRT_H
+
+#include <stdint.h>
+
+#define IMXRT_GPIO6_ADDRESS 0x42000000
+#define IMXRT_GPIO7_ADDRESS 0x42004000
+#define IMXRT_GPIO8_ADDRESS 0x42008000
+#define IMXRT_GPIO9_ADDRESS 0x4200C000
+
+// The interrupt numbers the firmware sets priorities on
+enum IRQ_NUMBER_t {
+    IRQ_DMA_CH0 = 0,
+    IRQ_FLEXIO2 = 91,
+    IRQ_WDOG1 = 92,
+    IRQ_ENET = 114,
+    IRQ_PIT = 122,
+    IRQ_GPIO6789 = 157,
+};
+#define NVIC_SET_PRIORITY(irqnum, priority) ((void)(irqnum), (void)(priority))
+#define NVIC_ENABLE_IRQ(irqnum) ((void)(irqnum))
+#define NVIC_SET_PENDING(irqnum) ((void)(irqnum))
+static inline void attachInterruptVector(IRQ_NUMBER_t irq, void (*function)(void)) { (void)irq; (void)function; }
+
+extern volatile uint32_t native_scb_aircr;
+#define SCB_AIRCR    native_scb_aircr
+#define RESTART_ADDR ((uintptr_t)&native_scb_aircr)
+
+// Program flash, mapped at 0x60000000 on the Teensy: 8 MB holding a stand-in
+// running image of native_flash_image_length bytes
+#define NATIVE_FLASH_SIZE    (8 * 1024 * 1024)
+#define NATIVE_FLASH_SECTOR  4096
+extern uint8_t native_program_flash[NATIVE_FLASH_SIZE];
+extern const uint32_t native_flash_image_length;
+#define FLASH_BASE_ADDRESS   ((uintptr_t)native_program_flash)
+#define FLASH_IMAGE_LENGTH   native_flash_image_length
+
+// SNVS real time counter at 32768 Hz, derived from the virtual clock
+uint32_t native_snvs_hprtcmr();
+uint32_t native_snvs_hprtclr();
+#define SNVS_HPRTCMR (native_snvs_hprtcmr())
+#define SNVS_HPRTCLR (native_snvs_hprtclr())
+
+// Clock gates; the DCP's is the only one the firmware sets
+extern volatile uint32_t native_ccm_ccgr0;
+#define CCM_CCGR0           native_ccm_ccgr0
+#define CCM_CCGR_ON         3
+#define CCM_CCGR0_DCP(n)    ((uint32_t)(((n) & 0x03) << 10))
+extern volatile uint32_t native_ccm_ccgr3;
+#define CCM_CCGR3           native_ccm_ccgr3
+#define CCM_CCGR3_WDOG1(n)  ((uint32_t)(((n) & 0x03) << 16))
+// Clock root selects and dividers
+extern volatile uint32_t native_ccm_cscmr2;
+extern volatile uint32_t native_ccm_cs1cdr;
+#define CCM_CSCMR2          native_ccm_cscmr2
+#define CCM_CS1CDR          native_ccm_cs1cdr
+
+// FlexIO2. There is none: PARAM reads 0, so the lockstep engine stays unused.
+extern volatile uint32_t native_flexio2[0x600 / 4];
+#define FLEXIO2_PARAM        native_flexio2[0x004 / 4]
+#define FLEXIO2_CTRL         native_flexio2[0x008 / 4]
+#define FLEXIO2_SHIFTSDEN    native_flexio2[0x030 / 4]
+#define FLEXIO2_SHIFTCTL0    native_flexio2[0x080 / 4]
+#define FLEXIO2_SHIFTCTL2    native_flexio2[0x088 / 4]
+#define FLEXIO2_SHIFTCFG0    native_flexio2[0x100 / 4]
+#define FLEXIO2_SHIFTCFG2    native_flexio2[0x108 / 4]
+#define FLEXIO2_SHIFTBUF2    native_flexio2[0x208 / 4]
+#define FLEXIO2_SHIFTBUFBBS0 native_flexio2[0x300 / 4]
+#define FLEXIO2_TIMCTL0      native_flexio2[0x400 / 4]
+#define FLEXIO2_TIMCFG0      native_flexio2[0x480 / 4]
+#define FLEXIO2_TIMCMP0      native_flexio2[0x500 / 4]
+#define DMAMUX_SOURCE_FLEXIO2_REQUEST0  1
+#define DMAMUX_SOURCE_FLEXIO2_REQUEST2  65
+
+// Reset controller status, the causes of the last reset; write 1s to clear
+extern volatile uint32_t native_src_srsr;
+#define SRC_SRSR                    native_src_srsr
+#define SRC_SRSR_IPP_RESET_B        ((uint32_t)(1 << 0))
+#define SRC_SRSR_LOCKUP_SYSRESETREQ ((uint32_t)(1 << 1))
+#define SRC_SRSR_WDOG_RST_B         ((uint32_t)(1 << 4))
+#define SRC_SRSR_JTAG_RST_B         ((uint32_t)(1 << 5))
+#define SRC_SRSR_JTAG_SW_RST        ((uint32_t)(1 << 6))
+#define SRC_SRSR_TEMPSENSE_RST_B    ((uint32_t)(1 << 8))
+
+// Watchdog 1
+extern volatile uint16_t native_wdog1_wcr;
+extern volatile uint16_t native_wdog1_wsr;
+extern volatile uint16_t native_wdog1_wicr;
+extern volatile uint16_t native_wdog1_wmcr;
+#define WDOG1_WCR           native_wdog1_wcr
+#define WDOG1_WSR           native_wdog1_wsr
+#define WDOG1_WICR          native_wdog1_wicr
+#define WDOG1_WMCR          native_wdog1_wmcr
+#define WDOG_WCR_WT(n)      ((uint16_t)(((n) & 0xFF) << 8))
+#define WDOG_WCR_WDA        ((uint16_t)(1 << 5))
+#define WDOG_WCR_SRS        ((uint16_t)(1 << 4))
+#define WDOG_WCR_WDT        ((uint16_t)(1 << 3))
+#define WDOG_WCR_WDE        ((uint16_t)(1 << 2))
+#define WDOG_WICR_WIE       ((uint16_t)(1 << 15))
+#define WDOG_WICR_WTIS      ((uint16_t)(1 << 14))
+#define WDOG_WICR_WICT(n)   ((uint16_t)((n) & 0xFF))
+
+// DCP, channel 0 only. Writing DCP_CH0SEMA runs the packets at DCP_CH0CMDPTR.
+struct NativeDcpSemaphore {
+    NativeDcpSemaphore &operator=(uint32_t increment);
+    operator uint32_t() const;
+};
+extern volatile uint32_t native_dcp_ctrl;
+extern volatile uintptr_t native_dcp_context;
+extern volatile uint32_t native_dcp_channelctrl;
+extern volatile uintptr_t native_dcp_ch0cmdptr;
+extern volatile uint32_t native_dcp_ch0stat;
+extern NativeDcpSemaphore native_dcp_ch0sema;
+#define DCP_CTRL            native_dcp_ctrl
+#define DCP_CONTEXT         native_dcp_context
+#define DCP_CHANNELCTRL     native_dcp_channelctrl
+#define DCP_CH0CMDPTR       native_dcp_ch0cmdptr
+#define DCP_CH0STAT         native_dcp_ch0stat
+#define DCP_CH0SEMA         native_dcp_ch0sema
+
+// No data cache on the host
+static inline void arm_dcache_flush(void *addr, uint32_t size) { (void)addr; (void)size; }
+static inline void arm_dcache_delete(void *addr, uint32_t size) { (void)addr; (void)size; }
+static inline void arm_dcache_flush_delete(void *addr, uint32_t size) { (void)addr; (void)size; }
+
+#endif
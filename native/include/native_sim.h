@@ -0,0 +1,158 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file native_sim.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Control and inspection interface of the host-native simulator: the virtual
+ * clock and interrupt dispatch behind the Arduino HAL, the simulated MCP3561
+ * inputs and the mock broker. Only the native/ sources use it.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef NATIVE_SIM_H
+#define NATIVE_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Virtual clock. It runs with the host's monotonic clock, so code costs the time
+it takes on the workstation, and jumps ahead over delay(), blocking SPI
+transfers and full socket buffers. micros(), millis() and ARM_DWT_CYCCNT (at
+F_CPU_ACTUAL) are all read from it.
+*/
+uint64_t sim_now_ns();
+void sim_advance_ns(uint64_t ns);      // Waits ns, running the interrupts that fall due
+void sim_consume_ns(uint64_t ns);      // Charges ns without running anything
+
+/*
+Interrupts. Data-ready edges, DMA completions and IntervalTimer ticks are queued
+events, run one at a time (they share one priority on the Teensy too) whenever
+the firmware calls into the HAL with interrupts enabled.
+*/
+typedef void (*SimEventHandler)(void *context);
+uint32_t sim_schedule(uint64_t at_ns, SimEventHandler handler, void *context);
+void sim_cancel(uint32_t event);
+void sim_poll();
+bool sim_in_interrupt();
+
+/*
+Pins. Outputs are as the firmware drives them; inputs read the level set here,
+or the pull-up if none has been. A watcher sees every change of an output.
+*/
+typedef void (*SimPinWatcher)(uint8_t pin, uint8_t level, void *context);
+void sim_watch_pin(uint8_t pin, SimPinWatcher watcher, void *context);
+void sim_set_input(uint8_t pin, int level);     // -1 releases it to its pull
+int sim_pin_level(uint8_t pin);
+uint64_t sim_pin_changed_ns(uint8_t pin);
+
+// Simulated thermistor or internal temperature signal, in °C
+enum SimShape {
+    SIM_CONSTANT,   // level
+    SIM_SINE,       // level + amplitude * sin(2 pi t / period)
+    SIM_RAMP,       // Sawtooth from level - amplitude to level + amplitude each period
+    SIM_SQUARE,     // level + amplitude for the first half of each period, level - amplitude after
+    SIM_STEP,       // level until period, then level + amplitude
+    SIM_OPEN,       // Thermistor disconnected
+    SIM_SHORT       // Thermistor shorted
+};
+
+struct SimSignal {
+    SimShape shape;
+    double level_c;
+    double amplitude_c;
+    double period_s;
+    double noise_lsb;   // RMS Gaussian noise added to each code
+};
+
+#define SIM_ADC_TEMP  (-1)  // sim_adc_set_signal() channel of the ADC internal temperatures
+
+// Called by main() before setup()
+void sim_adc_init();
+void sim_adc_set_signal(int channel, const SimSignal *signal);
+void sim_adc_set_settling(double tau_us);       // Input time constant after a MOSFET switch
+void sim_adc_set_max_sck(uint32_t hz);          // Faster SPI clocks corrupt read-back
+void sim_adc_set_spi_error_rate(double rate);   // Chance of each byte read back being corrupted
+void sim_adc_set_irq_drop_rate(double rate);    // Chance of each data-ready edge never reaching its pin
+void sim_adc_set_error(double offset_codes, double gain_ppm);   // Converter offset and gain error
+void sim_adc_brownout(int adc);                 // Power-on reset of one ADC
+void sim_adc_upset(int adc);                    // One configuration bit of one ADC flipped
+
+struct SimADCStats {
+    uint64_t conversions;
+    uint64_t overruns;      // Conversions whose data was never read
+    uint64_t data_reads;
+    uint64_t spi_bytes;
+    uint64_t spi_frames;    // Chip select assertions
+    uint64_t dma_reads;
+};
+void sim_adc_stats(int adc, SimADCStats *stats);
+
+/*
+Network. One in-process MQTT 3.1.1 and 5 broker takes every TCP connection; it
+routes publishes to matching subscriptions and keeps retained messages, and
+gives MQTT 5 clients topic aliases unless set to refuse MQTT 5. UDP to port 123
+gets an SNTP reply from the host's clock; other datagrams are only counted.
+With the cable unplugged the PHY reports the link off and nothing gets through.
+With a loss rate, each TCP write and broker packet is lost with that chance and
+costs a retransmission timeout, and each datagram is lost outright.
+*/
+void sim_network_set_link(double mbps, uint32_t latency_us);
+void sim_network_set_cable(bool plugged);
+void sim_network_set_loss(double rate);
+void sim_broker_set_up(bool up);
+void sim_ntp_set_up(bool up);           // Down, SNTP requests go unanswered
+void sim_broker_set_mqtt5(bool accept);
+void sim_broker_publish(const char *topic, const uint8_t *payload, size_t length, bool retain);
+
+/*
+Scraper. Connects to a port the firmware listens on and sends GET path; the
+response is kept once the firmware closes the connection. Returns false if
+nothing listens there.
+*/
+bool sim_http_get(uint16_t port, const char *path);
+const char *sim_http_response();        // Last response, head and body, "" for none
+
+struct SimNetworkStats {
+    uint64_t connects;
+    uint64_t publishes;
+    uint64_t aliased;       // Publishes with an MQTT 5 topic alias in place of the topic
+    uint64_t publish_bytes;
+    uint64_t births;        // NBIRTH and DBIRTH
+    uint64_t data;          // NDATA and DDATA
+    uint64_t deaths;        // NDEATH and DDEATH, wills included
+    uint64_t retained;      // Publishes the broker keeps for new subscribers
+    size_t largest_payload;
+    uint64_t datagrams;
+    uint64_t datagram_bytes;
+    uint64_t ntp_replies;
+    uint64_t http_requests;
+    uint64_t http_responses;
+};
+void sim_network_stats(SimNetworkStats *stats);
+
+// Discards the firmware's serial output
+void sim_serial_quiet(bool quiet);
+
+// Persists the EEPROM contents in a file, loading it first if it exists
+bool sim_eeprom_file(const char *path);
+
+// Set once the firmware has written the restart request to SCB_AIRCR
+bool sim_restart_requested();
+
+#endif
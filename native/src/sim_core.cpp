@@ -0,0 +1,682 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file sim_core.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Virtual clock, interrupt dispatch, pins, serial, EEPROM, program flash
+ * and the other Teensyduino core services of the host-native build.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <time.h>
+#include "native_sim.h"
+
+#define MAX_EVENTS   64
+#define NUM_PINS     CORE_NUM_DIGITAL
+#define EEPROM_SIZE  (E2END + 1)
+
+// Queued interrupt
+struct SimEvent {
+    uint64_t at_ns;
+    SimEventHandler handler;
+    void *context;
+    uint32_t id;            // 0 while the slot is free
+};
+
+// One header pin
+struct SimPin {
+    uint8_t mode;
+    uint8_t output;
+    int input;              // External level, -1 to leave it to the pull
+    uint64_t changed_ns;    // Last change of the output
+    SimPinWatcher watcher;
+    void *watcher_context;
+    void (*isr)(void);
+    int isr_mode;
+    uint32_t mux;           // Pad mux mode, only held
+};
+
+usb_serial_class Serial;
+EEPROMClass EEPROM;
+volatile uint32_t native_scb_aircr = 0;
+volatile uint32_t native_ccm_ccgr3 = 0;
+volatile uint32_t native_ccm_cscmr2 = 0;
+volatile uint32_t native_ccm_cs1cdr = 0;
+volatile uint32_t native_flexio2[0x600 / 4];
+volatile uint32_t native_src_srsr = SRC_SRSR_IPP_RESET_B;
+volatile uint16_t native_wdog1_wcr = 0;
+volatile uint16_t native_wdog1_wsr = 0;
+volatile uint16_t native_wdog1_wicr = 0;
+volatile uint16_t native_wdog1_wmcr = 0;
+uint8_t native_program_flash[NATIVE_FLASH_SIZE] __attribute__((aligned(NATIVE_FLASH_SECTOR)));
+const uint32_t native_flash_image_length = 192 * 1024;
+
+static uint64_t m_host_start_ns = 0;
+static uint64_t m_offset_ns = 0;        // Time skipped ahead of the host clock
+static uint64_t m_last_ns = 0;
+static SimEvent m_events[MAX_EVENTS];
+static uint32_t m_next_event_id = 1;
+static bool m_masked = false;           // noInterrupts()
+static bool m_in_isr = false;
+static SimPin m_pins[NUM_PINS];
+static bool m_pins_ready = false;
+static uint8_t m_eeprom[EEPROM_SIZE];
+static bool m_eeprom_loaded = false;
+static FILE *m_eeprom_file = NULL;
+static uint32_t m_random_state = 1;
+static bool m_serial_quiet = false;
+
+
+static uint64_t host_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+uint64_t sim_now_ns() {
+    if (m_host_start_ns == 0) {
+        m_host_start_ns = host_ns();
+    }
+    uint64_t now = host_ns() - m_host_start_ns + m_offset_ns;
+    if (now < m_last_ns) {
+        now = m_last_ns;
+    }
+    m_last_ns = now;
+    return now;
+}
+
+
+/*
+Jumps the clock to at_ns, if it isn't there already.
+*/
+static void jump_to(uint64_t at_ns) {
+    uint64_t now = sim_now_ns();
+    if (at_ns > now) {
+        m_offset_ns += at_ns - now;
+        m_last_ns = at_ns;
+    }
+}
+
+
+void sim_consume_ns(uint64_t ns) {
+    jump_to(sim_now_ns() + ns);
+}
+
+
+/*
+Earliest queued event, NULL if there is none.
+*/
+static SimEvent *next_event() {
+    SimEvent *next = NULL;
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        if (m_events[i].id != 0 && (next == NULL || m_events[i].at_ns < next->at_ns)) {
+            next = &m_events[i];
+        }
+    }
+    return next;
+}
+
+
+/*
+Runs the earliest event if it is due by at_ns. Returns false if none was.
+*/
+static bool run_next(uint64_t at_ns) {
+    SimEvent *event = next_event();
+    if (event == NULL || event->at_ns > at_ns) {
+        return false;
+    }
+    SimEventHandler handler = event->handler;
+    void *context = event->context;
+    event->id = 0;
+    m_in_isr = true;
+    handler(context);
+    m_in_isr = false;
+    return true;
+}
+
+
+void sim_poll() {
+    if (m_masked || m_in_isr) {
+        return;
+    }
+    while (run_next(sim_now_ns())) {
+    }
+}
+
+
+void sim_advance_ns(uint64_t ns) {
+    uint64_t target = sim_now_ns() + ns;
+    if (!m_masked && !m_in_isr) {
+        SimEvent *event;
+        while ((event = next_event()) != NULL && event->at_ns <= target) {
+            jump_to(event->at_ns);
+            run_next(event->at_ns);
+        }
+    }
+    jump_to(target);
+}
+
+
+uint32_t sim_schedule(uint64_t at_ns, SimEventHandler handler, void *context) {
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        if (m_events[i].id == 0) {
+            if (++m_next_event_id == 0) {
+                m_next_event_id = 1;
+            }
+            m_events[i] = SimEvent{at_ns, handler, context, m_next_event_id};
+            return m_next_event_id;
+        }
+    }
+    fprintf(stderr, "sim: event queue full\n");
+    abort();
+}
+
+
+void sim_cancel(uint32_t event) {
+    if (event == 0) {
+        return;
+    }
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        if (m_events[i].id == event) {
+            m_events[i].id = 0;
+        }
+    }
+}
+
+
+bool sim_in_interrupt() {
+    return m_in_isr;
+}
+
+
+bool sim_restart_requested() {
+    return native_scb_aircr == 0x05FA0004;
+}
+
+
+uint32_t native_cycle_count() {
+    sim_poll();
+    return (uint32_t)(sim_now_ns() * (F_CPU_ACTUAL / 1000000) / 1000);
+}
+
+
+static uint64_t snvs_ticks() {
+    sim_poll();
+    return sim_now_ns() * 32768 / 1000000000;
+}
+
+
+uint32_t native_snvs_hprtcmr() {
+    return (uint32_t)(snvs_ticks() >> 32) & 0x7FFF;
+}
+
+
+uint32_t native_snvs_hprtclr() {
+    return (uint32_t)snvs_ticks();
+}
+
+
+uint32_t millis() {
+    sim_poll();
+    return (uint32_t)(sim_now_ns() / 1000000);
+}
+
+
+uint32_t micros() {
+    sim_poll();
+    return (uint32_t)(sim_now_ns() / 1000);
+}
+
+
+void delay(uint32_t ms) {
+    sim_advance_ns((uint64_t)ms * 1000000);
+}
+
+
+void delayMicroseconds(uint32_t us) {
+    sim_advance_ns((uint64_t)us * 1000);
+}
+
+
+void yield() {
+    sim_poll();
+}
+
+
+/*
+Jumps the clock to the next queued interrupt, or to the next SysTick if that comes
+first. As on the Teensy the interrupt wakes the core even while they're masked,
+and runs once they aren't.
+*/
+void native_wait_for_interrupt() {
+    uint64_t now = sim_now_ns();
+    uint64_t wake = (now / 1000000 + 1) * 1000000;
+    SimEvent *event = next_event();
+    if (event != NULL && event->at_ns < wake) {
+        wake = event->at_ns;
+    }
+    if (m_masked || m_in_isr) {
+        jump_to(wake);
+    } else {
+        sim_advance_ns(wake > now ? wake - now : 0);
+    }
+}
+
+
+void noInterrupts() {
+    m_masked = true;
+}
+
+
+void interrupts() {
+    m_masked = false;
+    sim_poll();
+}
+
+
+/*
+Pins
+*/
+static SimPin *pin_state(uint8_t pin) {
+    if (pin >= NUM_PINS) {
+        fprintf(stderr, "sim: pin %u out of range\n", pin);
+        abort();
+    }
+    if (!m_pins_ready) {
+        for (int i = 0; i < NUM_PINS; i++) {
+            m_pins[i].input = -1;
+        }
+        m_pins_ready = true;
+    }
+    return &m_pins[pin];
+}
+
+
+static uint8_t input_level(const SimPin *state) {
+    if (state->input >= 0) {
+        return state->input ? HIGH : LOW;
+    }
+    return state->mode == INPUT_PULLUP ? HIGH : LOW;
+}
+
+
+static void run_isr(void *context) {
+    SimPin *state = (SimPin *)context;
+    if (state->isr != NULL) {
+        state->isr();
+    }
+}
+
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    pin_state(pin)->mode = mode;
+}
+
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    SimPin *state = pin_state(pin);
+    uint8_t level = val ? HIGH : LOW;
+    if (state->mode != OUTPUT || state->output == level) {
+        state->output = level;
+        return;
+    }
+    state->output = level;
+    state->changed_ns = sim_now_ns();
+    if (state->watcher != NULL) {
+        state->watcher(pin, level, state->watcher_context);
+    }
+}
+
+
+uint8_t digitalRead(uint8_t pin) {
+    sim_poll();
+    SimPin *state = pin_state(pin);
+    return state->mode == OUTPUT ? state->output : input_level(state);
+}
+
+
+void digitalToggle(uint8_t pin) {
+    digitalWrite(pin, !pin_state(pin)->output);
+}
+
+
+volatile uint32_t *portOutputRegister(uint8_t pin) {
+    (void)pin;
+    return NULL;
+}
+
+
+uint32_t digitalPinToBitMask(uint8_t pin) {
+    return 1UL << (pin & 31);
+}
+
+
+volatile uint32_t *portConfigRegister(uint8_t pin) {
+    return &pin_state(pin)->mux;
+}
+
+
+void attachInterrupt(uint8_t pin, void (*function)(void), int mode) {
+    SimPin *state = pin_state(pin);
+    state->isr = function;
+    state->isr_mode = mode;
+}
+
+
+void detachInterrupt(uint8_t pin) {
+    pin_state(pin)->isr = NULL;
+}
+
+
+void sim_watch_pin(uint8_t pin, SimPinWatcher watcher, void *context) {
+    SimPin *state = pin_state(pin);
+    state->watcher = watcher;
+    state->watcher_context = context;
+}
+
+
+/*
+Drives an input from outside, raising its interrupt on a matching edge.
+*/
+void sim_set_input(uint8_t pin, int level) {
+    SimPin *state = pin_state(pin);
+    uint8_t before = input_level(state);
+    state->input = level < 0 ? -1 : (level ? HIGH : LOW);
+    uint8_t after = input_level(state);
+    if (state->isr == NULL || state->mode == OUTPUT || before == after) {
+        return;
+    }
+    if (state->isr_mode == CHANGE ||
+        (state->isr_mode == FALLING && after == LOW) ||
+        (state->isr_mode == RISING && after == HIGH)) {
+        sim_schedule(sim_now_ns(), run_isr, state);
+    }
+}
+
+
+int sim_pin_level(uint8_t pin) {
+    SimPin *state = pin_state(pin);
+    return state->mode == OUTPUT ? state->output : input_level(state);
+}
+
+
+uint64_t sim_pin_changed_ns(uint8_t pin) {
+    return pin_state(pin)->changed_ns;
+}
+
+
+/*
+IntervalTimer
+*/
+bool IntervalTimer::begin(void (*function)(), unsigned int microseconds) {
+    end();
+    if (function == NULL || microseconds == 0) {
+        return false;
+    }
+    m_function = function;
+    m_period_ns = (uint64_t)microseconds * 1000;
+    m_event = sim_schedule(sim_now_ns() + m_period_ns, tick, this);
+    return true;
+}
+
+
+void IntervalTimer::update(unsigned int microseconds) {
+    m_period_ns = (uint64_t)microseconds * 1000;
+}
+
+
+void IntervalTimer::end() {
+    sim_cancel(m_event);
+    m_event = 0;
+}
+
+
+void IntervalTimer::tick(void *context) {
+    IntervalTimer *timer = (IntervalTimer *)context;
+    // Rescheduled first, as the hardware timer keeps running; the handler may end() it
+    timer->m_event = sim_schedule(sim_now_ns() + timer->m_period_ns, tick, timer);
+    timer->m_function();
+}
+
+
+/*
+Serial
+*/
+void sim_serial_quiet(bool quiet) {
+    m_serial_quiet = quiet;
+}
+
+
+size_t usb_serial_class::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+
+size_t usb_serial_class::write(const uint8_t *buffer, size_t size) {
+    return m_serial_quiet ? size : fwrite(buffer, 1, size, stdout);
+}
+
+
+void usb_serial_class::flush() {
+    fflush(stdout);
+}
+
+
+/*
+Print
+*/
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t count = 0;
+    while (size--) {
+        count += write(*buffer++);
+    }
+    return count;
+}
+
+
+static size_t print_unsigned(Print *p, unsigned long long n, int base) {
+    char buf[66];
+    char *str = &buf[sizeof(buf) - 1];
+    *str = '\0';
+    if (base < 2) {
+        base = 10;
+    }
+    do {
+        unsigned digit = n % base;
+        n /= base;
+        *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while (n);
+    return p->write(str);
+}
+
+
+size_t Print::print(long n, int base) {
+    return print((long long)n, base);
+}
+
+
+size_t Print::print(unsigned long n, int base) {
+    return print_unsigned(this, n, base);
+}
+
+
+size_t Print::print(long long n, int base) {
+    if (n < 0 && base == DEC) {
+        return write((uint8_t)'-') + print_unsigned(this, -(unsigned long long)n, base);
+    }
+    return print_unsigned(this, (unsigned long long)n, base);
+}
+
+
+size_t Print::print(unsigned long long n, int base) {
+    return print_unsigned(this, n, base);
+}
+
+
+size_t Print::print(double n, int digits) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+}
+
+
+int Print::printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+}
+
+
+int Print::vprintf(const char *format, va_list args) {
+    char buf[512];
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    if (n < 0) {
+        return n;
+    }
+    return write((const uint8_t *)buf, (size_t)n < sizeof(buf) ? n : sizeof(buf) - 1);
+}
+
+
+/*
+random(), xorshift32 like the Teensyduino core's
+*/
+void randomSeed(uint32_t seed) {
+    m_random_state = seed ? seed : 1;
+}
+
+
+long random(long howbig) {
+    if (howbig <= 0) {
+        return 0;
+    }
+    uint32_t x = m_random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    m_random_state = x;
+    return x % howbig;
+}
+
+
+long random(long howsmall, long howbig) {
+    if (howsmall >= howbig) {
+        return howsmall;
+    }
+    return random(howbig - howsmall) + howsmall;
+}
+
+
+/*
+EEPROM, erased (0xFF) until written
+*/
+static void eeprom_load() {
+    if (!m_eeprom_loaded) {
+        memset(m_eeprom, 0xFF, sizeof(m_eeprom));
+        m_eeprom_loaded = true;
+    }
+}
+
+
+bool sim_eeprom_file(const char *path) {
+    eeprom_load();
+    FILE *file = fopen(path, "r+b");
+    if (file != NULL) {
+        if (fread(m_eeprom, 1, sizeof(m_eeprom), file) != sizeof(m_eeprom)) {
+            memset(m_eeprom, 0xFF, sizeof(m_eeprom));
+        }
+    } else if ((file = fopen(path, "w+b")) == NULL) {
+        return false;
+    }
+    m_eeprom_file = file;
+    fseek(m_eeprom_file, 0, SEEK_SET);
+    fwrite(m_eeprom, 1, sizeof(m_eeprom), m_eeprom_file);
+    fflush(m_eeprom_file);
+    return true;
+}
+
+
+uint8_t EEPROMClass::read(int index) {
+    eeprom_load();
+    if (index < 0 || index >= EEPROM_SIZE) {
+        return 0xFF;
+    }
+    return m_eeprom[index];
+}
+
+
+void EEPROMClass::write(int index, uint8_t value) {
+    eeprom_load();
+    if (index < 0 || index >= EEPROM_SIZE) {
+        return;
+    }
+    m_eeprom[index] = value;
+    if (m_eeprom_file != NULL) {
+        fseek(m_eeprom_file, index, SEEK_SET);
+        fputc(value, m_eeprom_file);
+        fflush(m_eeprom_file);
+    }
+}
+
+
+/*
+Program flash: a stand-in image of native_flash_image_length bytes, erased
+(0xFF) after it. Programming only clears bits, as on the part, so writing a page
+that wasn't erased shows up as a read-back mismatch.
+*/
+static bool m_flash_loaded = false;
+
+static void flash_load() {
+    if (!m_flash_loaded) {
+        memset(native_program_flash, 0xFF, NATIVE_FLASH_SIZE);
+        for (uint32_t i = 0; i < native_flash_image_length; i++) {
+            native_program_flash[i] = (uint8_t)(i * 7);
+        }
+        uint32_t magic = 0x42464346, ivt = 0x402000D1;      // "FCFB", and the IVT header 4 KB in
+        memcpy(&native_program_flash[0], &magic, sizeof(magic));
+        memcpy(&native_program_flash[0x1000], &ivt, sizeof(ivt));
+        m_flash_loaded = true;
+    }
+}
+
+
+extern "C" void eepromemu_flash_erase_sector(void *addr) {
+    flash_load();
+    uintptr_t offset = ((uintptr_t)addr - (uintptr_t)native_program_flash) & ~(uintptr_t)(NATIVE_FLASH_SECTOR - 1);
+    if (offset < NATIVE_FLASH_SIZE) {
+        memset(&native_program_flash[offset], 0xFF, NATIVE_FLASH_SECTOR);
+        sim_consume_ns(30000000);       // Typical 4 KB erase
+    }
+}
+
+
+extern "C" void eepromemu_flash_write(void *addr, const void *data, uint32_t len) {
+    flash_load();
+    uintptr_t offset = (uintptr_t)addr - (uintptr_t)native_program_flash;
+    if (offset >= NATIVE_FLASH_SIZE || len > NATIVE_FLASH_SIZE - offset) {
+        return;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        native_program_flash[offset + i] &= ((const uint8_t *)data)[i];
+    }
+    sim_consume_ns(500000);             // Typical page program
+}
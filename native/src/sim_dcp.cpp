@@ -0,0 +1,346 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file sim_dcp.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Simulated DCP channel 0: the AES-128 ECB/CBC and SHA-256 packets
+ * thermistorMux_dcp.cpp builds, run in software as soon as the semaphore is
+ * written, at the host's speed. A hash carries over from one packet to the next
+ * as it would through the context buffer, and the digest is left byte reversed
+ * as the DCP leaves it.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <string.h>
+#include "thermistorMux_dcp.h"
+
+#define CONTROL0_ENABLE_CIPHER   (1u << 5)
+#define CONTROL0_ENABLE_HASH     (1u << 6)
+#define CONTROL0_CIPHER_ENCRYPT  (1u << 8)
+#define CONTROL0_CIPHER_INIT     (1u << 9)
+#define CONTROL0_PAYLOAD_KEY     (1u << 11)
+#define CONTROL0_HASH_INIT       (1u << 12)
+#define CONTROL0_HASH_TERM       (1u << 13)
+#define CONTROL1_CIPHER_MODE(c)  (((c) >> 4) & 0x0F)   // 0 ECB, 1 CBC
+#define CONTROL1_HASH_SELECT(c)  (((c) >> 16) & 0x0F)  // 2 SHA-256
+#define STATUS_COMPLETE          (1u << 0)
+#define STATUS_ERROR_SETUP       (1u << 2)
+
+volatile uint32_t native_ccm_ccgr0 = 0;
+volatile uint32_t native_dcp_ctrl = 0;
+volatile uintptr_t native_dcp_context = 0;
+volatile uint32_t native_dcp_channelctrl = 0;
+volatile uintptr_t native_dcp_ch0cmdptr = 0;
+volatile uint32_t native_dcp_ch0stat = 0;
+NativeDcpSemaphore native_dcp_ch0sema;
+
+
+// AES-128 (FIPS 197), a byte at a time
+
+static const uint8_t SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16};
+
+static uint8_t m_inverse_sbox[256];
+
+static uint8_t xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+static uint8_t multiply(uint8_t a, uint8_t b) {
+    uint8_t product = 0;
+    while (b) {
+        if (b & 1) {
+            product ^= a;
+        }
+        a = xtime(a);
+        b >>= 1;
+    }
+    return product;
+}
+
+static void expand_key(const uint8_t *key, uint8_t round_keys[176]) {
+    memcpy(round_keys, key, 16);
+    uint8_t rcon = 1;
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t t[4];
+        memcpy(t, &round_keys[i - 4], 4);
+        if (i % 16 == 0) {
+            uint8_t first = t[0];
+            t[0] = SBOX[t[1]] ^ rcon;
+            t[1] = SBOX[t[2]];
+            t[2] = SBOX[t[3]];
+            t[3] = SBOX[first];
+            rcon = xtime(rcon);
+        }
+        for (int j = 0; j < 4; j++) {
+            round_keys[i + j] = round_keys[i - 16 + j] ^ t[j];
+        }
+    }
+}
+
+static void encrypt_block(const uint8_t round_keys[176], uint8_t *s) {
+    for (int i = 0; i < 16; i++) {
+        s[i] ^= round_keys[i];
+    }
+    for (int round = 1; round <= 10; round++) {
+        uint8_t t[16];
+        for (int i = 0; i < 16; i++) {
+            t[i] = SBOX[s[(i + 4 * (i % 4)) % 16]];     // SubBytes and ShiftRows
+        }
+        for (int c = 0; c < 4 && round < 10; c++) {
+            uint8_t *col = &t[4 * c];
+            uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+            col[0] = xtime(a0) ^ xtime(a1) ^ a1 ^ a2 ^ a3;
+            col[1] = a0 ^ xtime(a1) ^ xtime(a2) ^ a2 ^ a3;
+            col[2] = a0 ^ a1 ^ xtime(a2) ^ xtime(a3) ^ a3;
+            col[3] = xtime(a0) ^ a0 ^ a1 ^ a2 ^ xtime(a3);
+        }
+        for (int i = 0; i < 16; i++) {
+            s[i] = t[i] ^ round_keys[16 * round + i];
+        }
+    }
+}
+
+static void decrypt_block(const uint8_t round_keys[176], uint8_t *s) {
+    for (int round = 10; round >= 1; round--) {
+        uint8_t t[16];
+        for (int i = 0; i < 16; i++) {
+            t[i] = s[i] ^ round_keys[16 * round + i];
+        }
+        for (int c = 0; c < 4 && round < 10; c++) {
+            uint8_t *col = &t[4 * c];
+            uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+            col[0] = multiply(a0, 14) ^ multiply(a1, 11) ^ multiply(a2, 13) ^ multiply(a3, 9);
+            col[1] = multiply(a0, 9) ^ multiply(a1, 14) ^ multiply(a2, 11) ^ multiply(a3, 13);
+            col[2] = multiply(a0, 13) ^ multiply(a1, 9) ^ multiply(a2, 14) ^ multiply(a3, 11);
+            col[3] = multiply(a0, 11) ^ multiply(a1, 13) ^ multiply(a2, 9) ^ multiply(a3, 14);
+        }
+        for (int i = 0; i < 16; i++) {
+            s[(i + 4 * (i % 4)) % 16] = m_inverse_sbox[t[i]];   // Inverse ShiftRows and SubBytes
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        s[i] ^= round_keys[i];
+    }
+}
+
+
+// SHA-256 (FIPS 180-4)
+
+struct Sha256 {
+    uint32_t h[8];
+    uint8_t block[64];
+    size_t used;
+    uint64_t bytes;
+};
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static Sha256 m_hash;   // Channel 0's, kept between packets as the context buffer would
+
+static uint32_t rotate(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void hash_block(Sha256 *hash) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        const uint8_t *p = &hash->block[4 * i];
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, hash->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotate(v[4], 6) ^ rotate(v[4], 11) ^ rotate(v[4], 25);
+        uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + choice + K[i] + w[i];
+        uint32_t s0 = rotate(v[0], 2) ^ rotate(v[0], 13) ^ rotate(v[0], 22);
+        uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        memmove(&v[1], &v[0], 7 * sizeof(v[0]));
+        v[4] += t1;
+        v[0] = t1 + s0 + majority;
+    }
+    for (int i = 0; i < 8; i++) {
+        hash->h[i] += v[i];
+    }
+}
+
+static void hash_init(Sha256 *hash) {
+    static const uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(hash->h, H0, sizeof(H0));
+    hash->used = 0;
+    hash->bytes = 0;
+}
+
+static void hash_update(Sha256 *hash, const uint8_t *data, size_t len) {
+    hash->bytes += len;
+    while (len > 0) {
+        size_t chunk = 64 - hash->used < len ? 64 - hash->used : len;
+        memcpy(&hash->block[hash->used], data, chunk);
+        hash->used += chunk;
+        data += chunk;
+        len -= chunk;
+        if (hash->used == 64) {
+            hash_block(hash);
+            hash->used = 0;
+        }
+    }
+}
+
+static void hash_final(Sha256 *hash, uint8_t digest[32]) {
+    uint64_t bits = hash->bytes * 8;
+    uint8_t pad = 0x80;
+    hash_update(hash, &pad, 1);
+    pad = 0;
+    while (hash->used != 56) {
+        hash_update(hash, &pad, 1);
+    }
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    hash_update(hash, length, 8);
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[4 * i + j] = (uint8_t)(hash->h[i] >> (24 - 8 * j));
+        }
+    }
+}
+
+
+static uint32_t run_packet(DcpPacket *packet) {
+    const uint8_t *source = (const uint8_t *)packet->source;
+    uint8_t *destination = (uint8_t *)packet->destination;
+    uint8_t *payload = (uint8_t *)packet->payload;
+
+    if (packet->control0 & CONTROL0_ENABLE_HASH) {
+        if (CONTROL1_HASH_SELECT(packet->control1) != 2) {
+            return STATUS_ERROR_SETUP;
+        }
+        if (packet->control0 & CONTROL0_HASH_INIT) {
+            hash_init(&m_hash);
+        }
+        hash_update(&m_hash, source, packet->size);
+        if (packet->control0 & CONTROL0_HASH_TERM) {
+            uint8_t digest[32];
+            hash_final(&m_hash, digest);
+            for (int i = 0; i < 32; i++) {
+                payload[i] = digest[31 - i];
+            }
+        }
+    }
+
+    if (packet->control0 & CONTROL0_ENABLE_CIPHER) {
+        // Only payload keys; the IV follows the key when CIPHER_INIT is set
+        unsigned int mode = CONTROL1_CIPHER_MODE(packet->control1);
+        if (!(packet->control0 & CONTROL0_PAYLOAD_KEY) || mode > 1 || packet->size % 16 != 0) {
+            return STATUS_ERROR_SETUP;
+        }
+        if (m_inverse_sbox[SBOX[1]] != 1) {
+            for (int i = 0; i < 256; i++) {
+                m_inverse_sbox[SBOX[i]] = (uint8_t)i;
+            }
+        }
+        uint8_t round_keys[176];
+        expand_key(payload, round_keys);
+        uint8_t chain[16] = {0};
+        if (packet->control0 & CONTROL0_CIPHER_INIT) {
+            memcpy(chain, &payload[16], 16);
+        }
+        bool encrypt = (packet->control0 & CONTROL0_CIPHER_ENCRYPT) != 0;
+        for (uint32_t pos = 0; pos < packet->size; pos += 16) {
+            uint8_t block[16];
+            memcpy(block, &source[pos], 16);
+            if (encrypt) {
+                for (int i = 0; i < 16 && mode == 1; i++) {
+                    block[i] ^= chain[i];
+                }
+                encrypt_block(round_keys, block);
+                memcpy(chain, block, 16);
+            } else {
+                uint8_t ciphertext[16];
+                memcpy(ciphertext, block, 16);
+                decrypt_block(round_keys, block);
+                for (int i = 0; i < 16 && mode == 1; i++) {
+                    block[i] ^= chain[i];
+                }
+                memcpy(chain, ciphertext, 16);
+            }
+            memcpy(&destination[pos], block, 16);
+        }
+    }
+    return STATUS_COMPLETE;
+}
+
+
+/*
+Runs the chain of packets at DCP_CH0CMDPTR, increment of them; the semaphore
+reads back 0 once it returns.
+*/
+NativeDcpSemaphore &NativeDcpSemaphore::operator=(uint32_t increment) {
+    DcpPacket *packet = (DcpPacket *)native_dcp_ch0cmdptr;
+    for (uint32_t i = 0; i < (increment & 0xFF) && packet != NULL; i++) {
+        if (!(native_ccm_ccgr0 & CCM_CCGR0_DCP(CCM_CCGR_ON)) || !(native_dcp_channelctrl & 1)) {
+            native_dcp_ch0stat = STATUS_ERROR_SETUP;
+            break;
+        }
+        uint32_t status = run_packet(packet);
+        packet->status = status;
+        if (status != STATUS_COMPLETE) {
+            native_dcp_ch0stat = status;
+            break;
+        }
+        packet = (DcpPacket *)packet->next;
+    }
+    return *this;
+}
+
+
+NativeDcpSemaphore::operator uint32_t() const {
+    return 0;
+}
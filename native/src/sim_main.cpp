@@ -0,0 +1,666 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file sim_main.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Entry point of the host-native build: runs setup() and loop() against the
+ * simulated board for a set time and prints the throughput and phase timings.
+ *
+ *     .pio/build/native/program --seconds 60 --signal 3=step:20,5,10 --quiet
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include "native_sim.h"
+#include "cf_sparkplug.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_http.h"
+#include "thermistorMux_history.h"
+#include "thermistorMux_profile.h"
+#include "thermistorMux_scheduler.h"
+
+#define NATIVE_STACK_BYTES (256 * 1024)
+#define STRINGIFY(x) #x
+#define TOSTRING(x)  STRINGIFY(x)
+
+/*
+The firmware runs on a stack of its own between _ebss and _estack, as on the
+Teensy, so the stack painting of thermistorMux_memory.cpp measures it. The heap
+is the host's: __brkval is left at _heap_end, so only the free blocks of the
+malloc arena count as free heap.
+*/
+extern "C" {
+__attribute__((aligned(4096))) unsigned char native_stack[NATIVE_STACK_BYTES];
+char native_heap_top;
+}
+char *__brkval = &native_heap_top;
+__asm__(".globl _ebss\n\t.set _ebss, native_stack\n\t"
+        ".globl _estack\n\t.set _estack, native_stack + " TOSTRING(NATIVE_STACK_BYTES) "\n\t"
+        ".globl _heap_start\n\t.set _heap_start, native_heap_top\n\t"
+        ".globl _heap_end\n\t.set _heap_end, native_heap_top\n");
+
+static volatile sig_atomic_t m_interrupted = 0;
+static double m_seconds = 0;        // 0 runs until interrupted
+static unsigned long m_loops = 0;
+static double m_cpu_seconds = 0;
+static double m_scrape_s = 0;       // 0 never scrapes /metrics
+static double m_unplug_at_s = -1;   // <0 never pulls the Ethernet cable
+static double m_unplug_for_s = 0;
+static int m_board_id = 0;
+#ifdef USE_FRAME_SYNC
+static double m_sync_ms = 0;        // 0 drives no edges on the frame sync line
+static double m_sync_drops = 0;     // Chance of each edge never coming
+static unsigned long m_sync_edges = 0;
+static unsigned long m_sync_dropped = 0;
+#define SYNC_PULSE_NS 10000
+#endif
+static double m_flood_at_s = -1;    // <0 never floods the node with Rebirth NCMDs
+static double m_self_test_at_s = -1; // <0 never asks the node for a self test
+static double m_brownout_at_s = -1; // <0 never resets an ADC
+static int m_brownout_adc = 0;
+static double m_upset_at_s = -1;    // <0 never flips an ADC register bit
+static int m_upset_adc = 0;
+static unsigned int m_flood_count = 0;
+
+/*
+Scripted network faults, from --fault, and what the node did about each: from
+the fault clearing, how long it took to have a broker session again and to get
+an NDATA through, and from the fault starting until the next one does (or the
+run ends), its births and the frames it lost and replayed.
+*/
+#define MAX_FAULTS 16
+
+enum FaultKind {
+    FAULT_BROKER,       // Broker restart: every session ends, connections refused meanwhile
+    FAULT_LINK,         // Link flap: the Ethernet cable pulled
+    FAULT_LOSS,         // Packet loss at a rate
+    FAULT_NTP,          // NTP server outage
+    NUM_FAULT_KINDS
+};
+
+static const char *const FAULT_NAMES[NUM_FAULT_KINDS] = {"broker", "link", "loss", "ntp"};
+
+struct Fault {
+    FaultKind kind;
+    double at_s;
+    double for_s;
+    double rate;            // FAULT_LOSS
+    bool started;
+    bool cleared;
+    bool closed;            // Its figures are final
+    uint64_t clear_ns;
+    uint64_t connects;      // Broker sessions and data messages when it cleared
+    uint64_t data;
+    double reconnect_s;     // <0 for none yet
+    double first_data_s;
+    uint64_t births;        // At the start, then since
+    uint64_t lost;
+    uint64_t replayed;
+};
+
+static Fault m_faults[MAX_FAULTS];
+static int m_num_faults = 0;
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --seconds S          Run for S seconds of virtual time (default: until Ctrl-C)\n"
+            "  --board-id N         Jumper the hardware ID pins for board N\n"
+            "  --signal CH=SHAPE:LEVEL[,AMPLITUDE[,PERIOD[,NOISE]]]\n"
+            "                       Thermistor CH (0-%d, 'all' or 'temp' for the ADC temperatures):\n"
+            "                       constant, sine, ramp, square, step, open or short, in C,\n"
+            "                       seconds and RMS LSB\n"
+            "  --settle-us TAU      Input time constant after a MOSFET switch\n"
+            "  --max-sck HZ         Fastest SPI clock the ADCs read back at (default 20000000)\n"
+            "  --spi-errors P       Corrupt each byte the ADCs read back with chance P\n"
+            "  --irq-drops P        Lose each ADC data-ready edge with chance P\n"
+            "  --adc-error O[,G]    Converter offset of O codes and gain error of G ppm\n"
+            "  --adc-brownout AT[,N] Power-on reset ADC N (default 0) AT seconds in\n"
+            "  --adc-upset AT[,N]   Flip a configuration bit of ADC N (default 0) AT seconds in\n"
+            "  --link MBPS,LAT_US   Network bandwidth and one-way latency (default 100,200)\n"
+            "  --no-broker          Refuse every broker connection\n"
+            "  --unplug AT,FOR      Pull the Ethernet cable AT seconds in and plug it back FOR seconds later\n"
+            "  --mqtt311            Refuse MQTT 5 connections, as a 3.1.1 broker would\n"
+            "  --rebirth-flood AT,N Send the node N Rebirth NCMDs back to back AT seconds in\n"
+            "  --self-test AT       Send the node a Self Test NCMD AT seconds in\n"
+            "  --fault KIND:AT,FOR[,RATE]\n"
+            "                       Inject a network fault AT seconds in for FOR seconds and measure the\n"
+            "                       recovery: broker (restart), link (cable flap), loss (packets lost\n"
+            "                       with chance RATE) or ntp (outage); may be given up to %d times\n"
+#ifdef USE_FRAME_SYNC
+            "  --sync-edges MS[,P]  Drive the frame sync line as another board would, a pulse every MS\n"
+            "                       milliseconds from 1 s in, each missing with chance P\n"
+#endif
+            "  --eeprom FILE        Keep the EEPROM contents in FILE\n"
+            "  --scrape S           GET /metrics every S seconds and print the last response\n"
+            "  --quiet              Discard the serial output\n",
+            program, NUMBER_OF_THERMISTORS - 1, MAX_FAULTS);
+}
+
+
+static bool parse_signal(const char *arg) {
+    static const struct {
+        const char *name;
+        SimShape shape;
+    } shapes[] = {{"constant", SIM_CONSTANT}, {"sine", SIM_SINE}, {"ramp", SIM_RAMP}, {"square", SIM_SQUARE},
+                  {"step", SIM_STEP}, {"open", SIM_OPEN}, {"short", SIM_SHORT}};
+    char channel[16];
+    char shape[16];
+    SimSignal signal = {SIM_CONSTANT, 25.0, 0, 0, 0};
+    int fields = sscanf(arg, "%15[^=]=%15[^:]:%lf,%lf,%lf,%lf", channel, shape, &signal.level_c,
+                        &signal.amplitude_c, &signal.period_s, &signal.noise_lsb);
+    if (fields < 2) {
+        return false;
+    }
+    unsigned int n;
+    for (n = 0; n < sizeof(shapes) / sizeof(shapes[0]); n++) {
+        if (strcmp(shape, shapes[n].name) == 0) {
+            signal.shape = shapes[n].shape;
+            break;
+        }
+    }
+    if (n == sizeof(shapes) / sizeof(shapes[0])) {
+        return false;
+    }
+    if (strcmp(channel, "temp") == 0) {
+        sim_adc_set_signal(SIM_ADC_TEMP, &signal);
+    } else if (strcmp(channel, "all") == 0) {
+        for (int c = 0; c < NUMBER_OF_THERMISTORS; c++) {
+            sim_adc_set_signal(c, &signal);
+        }
+    } else {
+        char *end;
+        long c = strtol(channel, &end, 10);
+        if (*end != '\0' || c < 0 || c >= NUMBER_OF_THERMISTORS) {
+            return false;
+        }
+        sim_adc_set_signal(c, &signal);
+    }
+    return true;
+}
+
+
+static bool parse_fault(const char *arg) {
+    char kind[16];
+    Fault fault = {};
+    fault.rate = 0.01;
+    if (m_num_faults == MAX_FAULTS ||
+        sscanf(arg, "%15[^:]:%lf,%lf,%lf", kind, &fault.at_s, &fault.for_s, &fault.rate) < 3 ||
+        fault.at_s < 0 || fault.for_s < 0 || fault.rate < 0 || fault.rate > 1) {
+        return false;
+    }
+    int k;
+    for (k = 0; k < NUM_FAULT_KINDS && strcmp(kind, FAULT_NAMES[k]) != 0; k++) {
+    }
+    if (k == NUM_FAULT_KINDS) {
+        return false;
+    }
+    fault.kind = (FaultKind)k;
+    fault.reconnect_s = -1;
+    fault.first_data_s = -1;
+    // Kept in order of their start
+    int pos = m_num_faults++;
+    while (pos > 0 && m_faults[pos - 1].at_s > fault.at_s) {
+        m_faults[pos] = m_faults[pos - 1];
+        pos--;
+    }
+    m_faults[pos] = fault;
+    return true;
+}
+
+
+/*
+Sets the ID pins as the jumpers for board id would: a fitted jumper pulls its
+pin low.
+*/
+static void set_board_id(int id) {
+    m_board_id = id;
+    static const uint8_t id_pins[] = {ID_PIN_0, ID_PIN_1, ID_PIN_2, ID_PIN_3, ID_PIN_4};
+    for (unsigned int bit = 0; bit < sizeof(id_pins); bit++) {
+        sim_set_input(id_pins[bit], (id >> bit) & 1 ? LOW : -1);
+    }
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--quiet") == 0) {
+            sim_serial_quiet(true);
+            continue;
+        }
+        if (strcmp(arg, "--no-broker") == 0) {
+            sim_broker_set_up(false);
+            continue;
+        }
+        if (strcmp(arg, "--mqtt311") == 0) {
+            sim_broker_set_mqtt5(false);
+            continue;
+        }
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--seconds") == 0) {
+            m_seconds = atof(value);
+        } else if (strcmp(arg, "--board-id") == 0) {
+            set_board_id(atoi(value));
+        } else if (strcmp(arg, "--signal") == 0) {
+            if (!parse_signal(value)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--settle-us") == 0) {
+            sim_adc_set_settling(atof(value));
+        } else if (strcmp(arg, "--max-sck") == 0) {
+            sim_adc_set_max_sck(strtoul(value, NULL, 10));
+        } else if (strcmp(arg, "--spi-errors") == 0) {
+            sim_adc_set_spi_error_rate(atof(value));
+        } else if (strcmp(arg, "--irq-drops") == 0) {
+            sim_adc_set_irq_drop_rate(atof(value));
+        } else if (strcmp(arg, "--adc-error") == 0) {
+            double offset = 0, gain_ppm = 0;
+            if (sscanf(value, "%lf,%lf", &offset, &gain_ppm) < 1) {
+                return false;
+            }
+            sim_adc_set_error(offset, gain_ppm);
+        } else if (strcmp(arg, "--adc-brownout") == 0) {
+            if (sscanf(value, "%lf,%d", &m_brownout_at_s, &m_brownout_adc) < 1 || m_brownout_at_s < 0) {
+                return false;
+            }
+        } else if (strcmp(arg, "--adc-upset") == 0) {
+            if (sscanf(value, "%lf,%d", &m_upset_at_s, &m_upset_adc) < 1 || m_upset_at_s < 0) {
+                return false;
+            }
+        } else if (strcmp(arg, "--link") == 0) {
+            double mbps = 100;
+            unsigned int latency_us = 200;
+            if (sscanf(value, "%lf,%u", &mbps, &latency_us) < 1 || mbps <= 0) {
+                return false;
+            }
+            sim_network_set_link(mbps, latency_us);
+        } else if (strcmp(arg, "--unplug") == 0) {
+            if (sscanf(value, "%lf,%lf", &m_unplug_at_s, &m_unplug_for_s) != 2 || m_unplug_at_s < 0 ||
+                m_unplug_for_s < 0) {
+                return false;
+            }
+        } else if (strcmp(arg, "--rebirth-flood") == 0) {
+            if (sscanf(value, "%lf,%u", &m_flood_at_s, &m_flood_count) != 2 || m_flood_at_s < 0) {
+                return false;
+            }
+        } else if (strcmp(arg, "--self-test") == 0) {
+            m_self_test_at_s = atof(value);
+        } else if (strcmp(arg, "--fault") == 0) {
+            if (!parse_fault(value)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--scrape") == 0) {
+            m_scrape_s = atof(value);
+#ifdef USE_FRAME_SYNC
+        } else if (strcmp(arg, "--sync-edges") == 0) {
+            if (sscanf(value, "%lf,%lf", &m_sync_ms, &m_sync_drops) < 1 || m_sync_ms <= 0 || m_sync_drops < 0 ||
+                m_sync_drops > 1) {
+                return false;
+            }
+#endif
+        } else if (strcmp(arg, "--eeprom") == 0) {
+            if (!sim_eeprom_file(value)) {
+                fprintf(stderr, "Can't open %s\n", value);
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void interrupted(int signum) {
+    (void)signum;
+    m_interrupted = 1;
+}
+
+
+static double thread_cpu_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/*
+Publishes count NCMDs setting the named boolean metric true to the node at once,
+e.g. as a runaway host would Rebirths.
+*/
+static void send_boolean_ncmds(const char *name, unsigned int count) {
+    // A Payload of one Metric: name, datatype Boolean and boolean_value true
+    size_t name_len = strlen(name);
+    uint8_t payload[64];
+    size_t metric_len = 2 + name_len + 4;
+    size_t n = 0;
+    payload[n++] = 0x12;
+    payload[n++] = (uint8_t)metric_len;
+    payload[n++] = 0x0a;
+    payload[n++] = (uint8_t)name_len;
+    memcpy(payload + n, name, name_len);
+    n += name_len;
+    payload[n++] = 0x20;
+    payload[n++] = METRIC_DATA_TYPE_BOOLEAN;
+    payload[n++] = 0x70;
+    payload[n++] = 1;
+    char topic[64];
+    // The group and node IDs of thermistorMux_network.cpp
+    snprintf(topic, sizeof(topic), SPARKPLUG_VERSION "/VI/NCMD/THERMISTOR%d", m_board_id);
+    for (unsigned int i = 0; i < count; i++) {
+        sim_broker_publish(topic, payload, n, false);
+    }
+}
+
+
+static uint64_t frames_lost() {
+    return health_counter(HEALTH_FRAMES_LOST) + history_dropped();
+}
+
+
+static void apply_fault(const Fault *fault, bool on) {
+    switch (fault->kind) {
+        case FAULT_BROKER:
+            sim_broker_set_up(!on);
+            break;
+        case FAULT_LINK:
+            sim_network_set_cable(!on);
+            break;
+        case FAULT_LOSS:
+            sim_network_set_loss(on ? fault->rate : 0);
+            break;
+        case FAULT_NTP:
+            sim_ntp_set_up(!on);
+            break;
+        default:
+            break;
+    }
+}
+
+
+// Finish a fault's figures from its start until now
+static void close_fault(Fault *fault, const SimNetworkStats *net) {
+    fault->births = net->births - fault->births;
+    fault->lost = frames_lost() - fault->lost;
+    fault->replayed = health_counter(HEALTH_FRAMES_REPLAYED) - fault->replayed;
+    fault->closed = true;
+}
+
+
+/*
+Starts and clears the scripted faults as they fall due, and times the node's
+recovery from each. Called every loop() pass.
+*/
+static void run_faults() {
+    if (m_num_faults == 0) {
+        return;
+    }
+    uint64_t now = sim_now_ns();
+    SimNetworkStats net;
+    sim_network_stats(&net);
+    for (int i = 0; i < m_num_faults; i++) {
+        Fault *fault = &m_faults[i];
+        if (!fault->started && now >= (uint64_t)(fault->at_s * 1e9)) {
+            for (int j = 0; j < i; j++) {
+                if (!m_faults[j].closed) {
+                    close_fault(&m_faults[j], &net);
+                }
+            }
+            apply_fault(fault, true);
+            fault->started = true;
+            fault->births = net.births;
+            fault->lost = frames_lost();
+            fault->replayed = health_counter(HEALTH_FRAMES_REPLAYED);
+        }
+        if (fault->started && !fault->cleared && now >= (uint64_t)((fault->at_s + fault->for_s) * 1e9)) {
+            apply_fault(fault, false);
+            fault->cleared = true;
+            fault->clear_ns = now;
+            fault->connects = net.connects;
+            fault->data = net.data;
+        }
+        if (fault->cleared && fault->reconnect_s < 0 && net.connects > fault->connects) {
+            fault->reconnect_s = (now - fault->clear_ns) * 1e-9;
+        }
+        if (fault->cleared && fault->first_data_s < 0 && net.data > fault->data) {
+            fault->first_data_s = (now - fault->clear_ns) * 1e-9;
+        }
+    }
+}
+
+
+static void print_seconds(double seconds) {
+    if (seconds < 0) {
+        fprintf(stderr, " %15s", "-");
+    } else {
+        fprintf(stderr, " %15.3f", seconds);
+    }
+}
+
+
+static void report_faults() {
+    if (m_num_faults == 0) {
+        return;
+    }
+    SimNetworkStats net;
+    sim_network_stats(&net);
+    fprintf(stderr, "%-12s %8s %8s %15s %15s %7s %12s %9s\n", "Fault", "at (s)", "for (s)", "reconnect (s)",
+            "first NDATA (s)", "births", "frames lost", "replayed");
+    for (int i = 0; i < m_num_faults; i++) {
+        Fault *fault = &m_faults[i];
+        if (!fault->started) {
+            continue;
+        }
+        if (!fault->closed) {
+            close_fault(fault, &net);
+        }
+        char name[24];
+        if (fault->kind == FAULT_LOSS) {
+            snprintf(name, sizeof(name), "loss %g%%", fault->rate * 100);
+        } else {
+            snprintf(name, sizeof(name), "%s", FAULT_NAMES[fault->kind]);
+        }
+        fprintf(stderr, "%-12s %8.1f %8.1f", name, fault->at_s, fault->for_s);
+        print_seconds(fault->reconnect_s);
+        print_seconds(fault->first_data_s);
+        fprintf(stderr, " %7llu %12llu %9llu\n", (unsigned long long)fault->births, (unsigned long long)fault->lost,
+                (unsigned long long)fault->replayed);
+    }
+}
+
+
+#ifdef USE_FRAME_SYNC
+static void sync_edge_end(void *context) {
+    (void)context;
+    sim_set_input(FRAME_SYNC_PIN, -1);
+}
+
+
+/*
+A pulse on the frame sync line from the driver, every m_sync_ms. The follower
+pulls the line down, so releasing it ends the pulse.
+*/
+static void sync_edge(void *context) {
+    (void)context;
+    m_sync_edges++;
+    // Its own generator, so the drops leave the firmware's random() as it was
+    static uint32_t state = 0x2545F491;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    if (m_sync_drops > 0 && (double)state / 4294967296.0 < m_sync_drops) {
+        m_sync_dropped++;
+    } else {
+        sim_set_input(FRAME_SYNC_PIN, HIGH);
+        sim_schedule(sim_now_ns() + SYNC_PULSE_NS, sync_edge_end, NULL);
+    }
+    sim_schedule(sim_now_ns() + (uint64_t)(m_sync_ms * 1e6), sync_edge, NULL);
+}
+#endif
+
+
+static void *run_firmware(void *arg) {
+    (void)arg;
+    uint64_t end_ns = (uint64_t)(m_seconds * 1e9);
+    uint64_t scrape_ns = (uint64_t)(m_scrape_s * 1e9);
+    uint64_t next_scrape_ns = scrape_ns;
+    uint64_t unplug_ns = m_unplug_at_s >= 0 ? (uint64_t)(m_unplug_at_s * 1e9) : UINT64_MAX;
+    uint64_t replug_ns = m_unplug_at_s >= 0 ? unplug_ns + (uint64_t)(m_unplug_for_s * 1e9) : UINT64_MAX;
+    uint64_t flood_ns = m_flood_at_s >= 0 ? (uint64_t)(m_flood_at_s * 1e9) : UINT64_MAX;
+    uint64_t self_test_ns = m_self_test_at_s >= 0 ? (uint64_t)(m_self_test_at_s * 1e9) : UINT64_MAX;
+    uint64_t brownout_ns = m_brownout_at_s >= 0 ? (uint64_t)(m_brownout_at_s * 1e9) : UINT64_MAX;
+    uint64_t upset_ns = m_upset_at_s >= 0 ? (uint64_t)(m_upset_at_s * 1e9) : UINT64_MAX;
+    setup();
+#ifdef USE_FRAME_SYNC
+    if (m_sync_ms > 0) {
+        sim_schedule(1000000000ULL, sync_edge, NULL);
+    }
+#endif
+    while (!m_interrupted && !sim_restart_requested() && (end_ns == 0 || sim_now_ns() < end_ns)) {
+        if (sim_now_ns() >= unplug_ns) {
+            sim_network_set_cable(false);
+            unplug_ns = UINT64_MAX;
+        }
+        if (sim_now_ns() >= replug_ns) {
+            sim_network_set_cable(true);
+            replug_ns = UINT64_MAX;
+        }
+        if (sim_now_ns() >= flood_ns) {
+            send_boolean_ncmds("Node Control/Rebirth", m_flood_count);
+            flood_ns = UINT64_MAX;
+        }
+        if (sim_now_ns() >= self_test_ns) {
+            send_boolean_ncmds("Node Control/Self Test", 1);
+            self_test_ns = UINT64_MAX;
+        }
+        if (sim_now_ns() >= brownout_ns) {
+            sim_adc_brownout(m_brownout_adc);
+            brownout_ns = UINT64_MAX;
+        }
+        if (sim_now_ns() >= upset_ns) {
+            sim_adc_upset(m_upset_adc);
+            upset_ns = UINT64_MAX;
+        }
+        run_faults();
+        if (scrape_ns > 0 && sim_now_ns() >= next_scrape_ns) {
+            sim_http_get(HTTP_METRICS_PORT, "/metrics");
+            next_scrape_ns += scrape_ns;
+        }
+        loop();
+        sim_poll();
+        m_loops++;
+    }
+    m_cpu_seconds = thread_cpu_seconds();
+    return NULL;
+}
+
+
+static void report() {
+    double seconds = sim_now_ns() * 1e-9;
+    fflush(stdout);
+    fprintf(stderr, "\n--- %.1f s simulated, %.1f s host CPU, %lu loop() passes%s\n", seconds, m_cpu_seconds, m_loops,
+            sim_restart_requested() ? ", stopped by a restart request" : "");
+    for (int n = 0; n < NUM_ADCS; n++) {
+        SimADCStats adc;
+        sim_adc_stats(n, &adc);
+        fprintf(stderr, "ADC %d: %llu conversions (%.1f/s), %llu read, %llu overrun, %llu DMA reads, %llu SPI bytes in %llu frames\n",
+                n, (unsigned long long)adc.conversions, adc.conversions / seconds, (unsigned long long)adc.data_reads,
+                (unsigned long long)adc.overruns, (unsigned long long)adc.dma_reads, (unsigned long long)adc.spi_bytes,
+                (unsigned long long)adc.spi_frames);
+    }
+    SimNetworkStats net;
+    sim_network_stats(&net);
+    fprintf(stderr, "MQTT: %llu connects, %llu publishes (%llu birth, %llu data, %llu death, %llu retained, "
+                    "%llu by topic alias), %llu bytes (%.0f B/s), largest payload %zu B\n",
+            (unsigned long long)net.connects, (unsigned long long)net.publishes, (unsigned long long)net.births,
+            (unsigned long long)net.data, (unsigned long long)net.deaths, (unsigned long long)net.retained,
+            (unsigned long long)net.aliased,
+            (unsigned long long)net.publish_bytes, net.publish_bytes / seconds, net.largest_payload);
+    fprintf(stderr, "UDP: %llu datagrams, %llu bytes, %llu NTP replies\n", (unsigned long long)net.datagrams,
+            (unsigned long long)net.datagram_bytes, (unsigned long long)net.ntp_replies);
+    if (m_scrape_s > 0) {
+        fprintf(stderr, "HTTP: %llu requests, %llu responses; the last:\n%s\n", (unsigned long long)net.http_requests,
+                (unsigned long long)net.http_responses, sim_http_response());
+    }
+    fprintf(stderr, "Frames %lu, conversions %lu, invalid %lu, register mismatches %lu, publish failures %lu\n",
+            (unsigned long)health_counter(HEALTH_FRAMES), (unsigned long)health_counter(HEALTH_CONVERSIONS),
+            (unsigned long)health_counter(HEALTH_INVALID_DATA),
+            (unsigned long)health_counter(HEALTH_REGISTER_MISMATCHES),
+            (unsigned long)health_counter(HEALTH_PUBLISH_FAILURES));
+    fprintf(stderr, "ADC recoveries %lu, reconfigurations %lu\n",
+            (unsigned long)health_counter(HEALTH_ADC_RECOVERIES),
+            (unsigned long)health_counter(HEALTH_ADC_RECONFIGURATIONS));
+    fprintf(stderr, "Broker connects %lu, link losses %lu, commands refused as busy %lu\n",
+            (unsigned long)health_counter(HEALTH_BROKER_CONNECTS), (unsigned long)health_counter(HEALTH_LINK_LOSSES),
+            (unsigned long)health_counter(HEALTH_COMMANDS_BUSY));
+    fprintf(stderr, "Frames lost %lu, replayed %lu, resent %lu\n",
+            (unsigned long)(health_counter(HEALTH_FRAMES_LOST) + history_dropped()),
+            (unsigned long)health_counter(HEALTH_FRAMES_REPLAYED),
+            (unsigned long)health_counter(HEALTH_FRAMES_RESENT));
+    fprintf(stderr, "Scheduler utilization %.1f%%\n", scheduler_utilization() * 100);
+#ifdef USE_FRAME_SYNC
+    fprintf(stderr, "Frame sync: %lu edges driven, %lu dropped, %lu frames taken without one, %lu overruns\n",
+            m_sync_edges, m_sync_dropped, (unsigned long)health_counter(HEALTH_SYNC_MISSED),
+            (unsigned long)health_counter(HEALTH_FRAME_OVERRUNS));
+#endif
+    report_faults();
+#ifdef USE_PROFILER
+    fprintf(stderr, "%-12s %10s %8s %8s %8s %8s (us)\n", "Phase", "count", "min", "avg", "max", "p99");
+    for (int phase = 0; phase < NUM_PROFILE_PHASES; phase++) {
+        ProfileStats stats;
+        if (profile_stats(phase, &stats)) {
+            fprintf(stderr, "%-12s %10lu %8lu %8lu %8lu %8lu\n", profile_phase_name(phase), stats.count,
+                    (unsigned long)stats.min_us, (unsigned long)stats.avg_us, (unsigned long)stats.max_us,
+                    (unsigned long)stats.p99_us);
+        }
+    }
+#endif
+}
+
+
+int main(int argc, char **argv) {
+    sim_adc_init();
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    signal(SIGINT, interrupted);
+    signal(SIGTERM, interrupted);
+
+    pthread_attr_t attr;
+    pthread_t firmware;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, native_stack, sizeof(native_stack));
+    if (pthread_create(&firmware, &attr, run_firmware, NULL) != 0) {
+        perror("pthread_create");
+        return 1;
+    }
+    pthread_join(firmware, NULL);
+    report();
+    return 0;
+}
@@ -0,0 +1,777 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file sim_mcp3561.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Simulated MCP3561 ADCs on the SPI bus: the register map and command byte
+ * protocol, one-shot, continuous and SCAN mode conversions at the data rate set
+ * by Config1, and data-ready interrupts, reading the thermistor that the MOSFET
+ * outputs connect through the divider on each of the ADC_INPUT_PAIRS inputs.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <math.h>
+#include "native_sim.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_acquisition.h"
+
+#define MCLK_HZ             4915200.0   // Internal oscillator
+#define DMCLK_NS_PER_PRE    800         // Timer register units, as TIMER_DMCLK() counts them
+#define DMA_SETUP_NS        1000
+#define DIVIDER_OHMS        10000.0
+#define CODE_FULL_SCALE     8388608.0   // 2^23
+#define INTERNAL_C_PER_CODE (0.00133 * (2.4 / 3.3))
+#define INTERNAL_C_OFFSET   267.146
+#define KELVIN              273.15
+#define NOMINAL_K           298.15
+
+#ifdef thermistor_10K
+    #define SIM_R0_OHMS 10000.0
+    #define SIM_BETA_K  3977.0
+#elif defined(thermistor_2K)
+    #define SIM_R0_OHMS 2200.0
+    #define SIM_BETA_K  3930.0
+#endif
+
+// Registers
+#define REG_ADCDATA 0x0
+#define REG_CONFIG0 0x1
+#define REG_CONFIG1 0x2
+#define REG_CONFIG2 0x3
+#define REG_CONFIG3 0x4
+#define REG_IRQ     0x5
+#define REG_MUX     0x6
+#define REG_SCAN    0x7
+#define REG_TIMER   0x8
+#define REG_OFFSETCAL 0x9
+#define REG_GAINCAL 0xA
+#define REG_LOCK    0xD
+#define NUM_REGS    16
+#define LOCK_PASSWORD 0xA5
+
+// Config3 EN_CRCCOM: a CRC-16 follows the data of every ADCDATA static read
+#define CONFIG3_EN_CRCCOM 0x04
+// Config3 EN_OFFCAL and EN_GAINCAL: OFFSETCAL is added to each code, which is then
+// scaled by GAINCAL / 2^23
+#define CONFIG3_EN_OFFCAL  0x02
+#define CONFIG3_EN_GAINCAL 0x01
+
+// Fast commands
+#define FAST_START      0xA
+#define FAST_STANDBY    0xB
+#define FAST_SHUTDOWN   0xC
+#define FAST_FULL_SHDN  0xD
+#define FAST_RESET      0xE
+
+// Mux and Scan inputs
+#define MUX_THERMISTOR  0x01
+#define MUX_TEMP        0xDE
+#define MUX_SHORTED     0x88
+#define MUX_REFERENCE   0xBC
+#define SCAN_DIFF_A_BIT 8
+#define SCAN_TEMP_BIT   12
+
+// Command types, CMD[1:0]
+enum CommandType {
+    CMD_FAST,
+    CMD_STATIC_READ,
+    CMD_INCREMENTAL_WRITE,
+    CMD_INCREMENTAL_READ
+};
+
+// Register widths in bytes, 24-bit data format
+static const uint8_t reg_bytes[NUM_REGS] = {3, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 1, 1, 2};
+static const uint32_t reg_reset[NUM_REGS] = {0, 0xC0, 0x0C, 0x8B, 0x00, 0x73, 0x01, 0, 0,
+                                             0, 0x800000, 0x900000, 0x000050, 0xA5, 0xA3, 0};
+static const uint32_t osr_ratios[16] = {32, 64, 128, 256, 512, 1024, 2048, 4096,
+                                        8192, 16384, 20480, 24576, 40960, 49152, 81920, 98304};
+
+// Header pin of each thermistor's MOSFET, as wired on the board; the smaller
+// variants use the first ones
+static const uint8_t mosfet_pins[32] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 24, 25, 26, 27, 28, 29,
+                                        30, 31, 32, 36, 37, 40, 41, 14, 15, 16, 17, 18, 19,
+                                        20, 21, 22};
+static const uint8_t cs_pins[NUM_ADCS] = ADC_CS_PINS;
+static const uint8_t irq_pins[NUM_ADCS] = ADC_IRQ_PINS;
+
+struct SimADC {
+    int id;
+    uint32_t reg[NUM_REGS];
+
+    // SPI frame
+    bool selected;
+    bool have_command;
+    CommandType type;
+    int address;
+    int byte_index;
+    uint32_t shift;
+    uint8_t frame[4];           // STATUS and data bytes of the ADCDATA read, for its CRC
+
+    // Status flags
+    bool por;                   // Powered up since the IRQ register was last read
+    bool locked;                // Register writes locked, with CRCCFG taken
+    uint16_t crccfg;
+
+    // Conversions
+    uint32_t event;
+    uint32_t data;
+    bool data_ready;            // Not read since the last conversion
+    uint32_t cycle_scan;        // Scan channels of the cycle in progress
+    int scan_bit;               // Channel being converted, -1 outside SCAN mode
+    double settle_from[ADC_INPUT_PAIRS];    // Input code of each pair when its MOSFETs last switched
+    uint64_t switched_ns[ADC_INPUT_PAIRS];
+
+    SimADCStats stats;
+};
+
+SPIClass SPI;
+
+static SimADC m_adc[NUM_ADCS];
+static SimSignal m_signal[NUMBER_OF_THERMISTORS];
+static SimSignal m_temp_signal;
+static double m_settle_tau_ns = 0;
+static uint32_t m_max_sck_hz = 20000000;
+static double m_spi_error_rate = 0;
+static double m_irq_drop_rate = 0;
+static double m_offset_error = 0;          // Codes, at the converter's output
+static double m_gain_error = 0;            // Fraction
+static uint64_t m_noise_state = 0x9E3779B97F4A7C15ULL;
+
+
+static double uniform() {
+    m_noise_state ^= m_noise_state << 13;
+    m_noise_state ^= m_noise_state >> 7;
+    m_noise_state ^= m_noise_state << 17;
+    return ((m_noise_state >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+static double gaussian() {
+    return sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+
+/*
+Value of a signal at t_ns, in °C.
+*/
+static double signal_value(const SimSignal *signal, uint64_t t_ns) {
+    double t = t_ns * 1e-9;
+    double phase = signal->period_s > 0 ? fmod(t, signal->period_s) / signal->period_s : 0;
+    switch (signal->shape) {
+    case SIM_SINE:
+        return signal->level_c + signal->amplitude_c * sin(2.0 * M_PI * phase);
+    case SIM_RAMP:
+        return signal->level_c + signal->amplitude_c * (2.0 * phase - 1.0);
+    case SIM_SQUARE:
+        return signal->level_c + (phase < 0.5 ? signal->amplitude_c : -signal->amplitude_c);
+    case SIM_STEP:
+        return signal->level_c + (t >= signal->period_s ? signal->amplitude_c : 0);
+    default:
+        return signal->level_c;
+    }
+}
+
+
+/*
+Resistance of a thermistor at t_ns; INFINITY when open.
+*/
+static double thermistor_ohms(int channel, uint64_t t_ns) {
+    const SimSignal *signal = &m_signal[channel];
+    if (signal->shape == SIM_OPEN) {
+        return INFINITY;
+    }
+    if (signal->shape == SIM_SHORT) {
+        return 0;
+    }
+    double kelvin = signal_value(signal, t_ns) + KELVIN;
+    return SIM_R0_OHMS * exp(SIM_BETA_K * (1.0 / kelvin - 1.0 / NOMINAL_K));
+}
+
+
+/*
+Ideal code at a thermistor input pair: the MOSFETs of this ADC's block wired to
+it that are on, in parallel, against the divider resistor. flip_pin, if >= 0, is
+taken at the other level, for the input just before it switched.
+*/
+static double thermistor_code(const SimADC *adc, int pair, uint64_t t_ns, int flip_pin) {
+    double siemens = 0;
+    bool any = false;
+    int first = adc->id * CHANNELS_PER_ADC + pair;
+    for (int channel = first; channel < first - pair + CHANNELS_PER_ADC && channel < NUMBER_OF_THERMISTORS;
+         channel += ADC_INPUT_PAIRS) {
+        int level = sim_pin_level(mosfet_pins[channel]);
+        if (mosfet_pins[channel] == flip_pin) {
+            level = !level;
+        }
+        if (level) {
+            double ohms = thermistor_ohms(channel, t_ns);
+            siemens += ohms > 0 ? 1.0 / ohms : INFINITY;
+            any = true;
+        }
+    }
+    if (!any || siemens == 0) {
+        return CODE_FULL_SCALE;
+    }
+    double ohms = 1.0 / siemens;
+    return CODE_FULL_SCALE * ohms / (ohms + DIVIDER_OHMS);
+}
+
+
+/*
+Thermistor input pair as the ADC sees it, settling towards the ideal code after
+a switch.
+*/
+static double settled_code(const SimADC *adc, int pair, uint64_t t_ns, int flip_pin) {
+    double ideal = thermistor_code(adc, pair, t_ns, flip_pin);
+    if (m_settle_tau_ns <= 0 || adc->switched_ns[pair] == 0) {
+        return ideal;
+    }
+    double remaining = exp(-(double)(t_ns - adc->switched_ns[pair]) / m_settle_tau_ns);
+    return ideal + (adc->settle_from[pair] - ideal) * remaining;
+}
+
+
+static uint32_t to_code(const SimADC *adc, double code, double noise_lsb) {
+    code = (code * (1.0 + m_gain_error)) + m_offset_error + noise_lsb * gaussian();
+    uint32_t config3 = adc->reg[REG_CONFIG3];
+    if (config3 & CONFIG3_EN_OFFCAL) {
+        code += (int32_t)(adc->reg[REG_OFFSETCAL] << 8) >> 8;
+    }
+    if (config3 & CONFIG3_EN_GAINCAL) {
+        code *= adc->reg[REG_GAINCAL] / CODE_FULL_SCALE;
+    }
+    code = round(code);
+    if (code > CODE_FULL_SCALE - 1) {
+        code = CODE_FULL_SCALE - 1;
+    }
+    if (code < -CODE_FULL_SCALE) {
+        code = -CODE_FULL_SCALE;
+    }
+    return (uint32_t)(int32_t)code & 0x00FFFFFF;
+}
+
+
+/*
+Input gain and output noise scale of the conversion settings: the PGA gain of
+Config2, and white noise falling with the square root of the oversampling ratio
+(the signals' noise_lsb is at OSR 20480).
+*/
+static double adc_gain(const SimADC *adc) {
+    uint32_t code = (adc->reg[REG_CONFIG2] >> 3) & 0x07;
+    return code == 0 ? 1.0 / 3.0 : (double)(1u << (code - 1));
+}
+
+static double noise_scale(const SimADC *adc) {
+    return sqrt(20480.0 / osr_ratios[(adc->reg[REG_CONFIG1] >> 2) & 0x0F]);
+}
+
+
+/*
+Converts the input selected by the Mux register (CH0/CH1 for the thermistors),
+or by the Scan channel being converted. The shorted and reference inputs convert
+with the noise of the thermistor input.
+*/
+static uint32_t sample(SimADC *adc, uint64_t t_ns) {
+    bool temp = adc->scan_bit >= 0 ? adc->scan_bit == SCAN_TEMP_BIT : adc->reg[REG_MUX] == MUX_TEMP;
+    int pair = adc->scan_bit >= 0 ? adc->scan_bit - SCAN_DIFF_A_BIT : 0;
+    bool thermistor = adc->scan_bit >= 0 ? pair >= 0 && pair < ADC_INPUT_PAIRS : adc->reg[REG_MUX] == MUX_THERMISTOR;
+    if (temp) {
+        return to_code(adc, adc_gain(adc) * (signal_value(&m_temp_signal, t_ns) + INTERNAL_C_OFFSET) / INTERNAL_C_PER_CODE,
+                       m_temp_signal.noise_lsb * noise_scale(adc));
+    }
+    int first = adc->id * CHANNELS_PER_ADC;
+    double noise = (first < NUMBER_OF_THERMISTORS ? m_signal[first].noise_lsb : 0) * noise_scale(adc);
+    if (thermistor) {
+        return to_code(adc, adc_gain(adc) * settled_code(adc, pair, t_ns, -1), noise);
+    }
+    if (adc->scan_bit < 0 && adc->reg[REG_MUX] == MUX_SHORTED) {
+        return to_code(adc, 0, noise);
+    }
+    if (adc->scan_bit < 0 && adc->reg[REG_MUX] == MUX_REFERENCE) {
+        return to_code(adc, adc_gain(adc) * CODE_FULL_SCALE, noise);
+    }
+    return 0;
+}
+
+
+static uint64_t conversion_ns(const SimADC *adc) {
+    uint32_t config1 = adc->reg[REG_CONFIG1];
+    uint32_t prescaler = 1u << (config1 >> 6);
+    uint32_t osr = osr_ratios[(config1 >> 2) & 0x0F];
+    return (uint64_t)(4.0 * prescaler * osr / MCLK_HZ * 1e9);
+}
+
+
+static int next_scan_bit(uint32_t scan, int after) {
+    for (int bit = after + 1; bit < 16; bit++) {
+        if (scan & (1UL << bit)) {
+            return bit;
+        }
+    }
+    return -1;
+}
+
+
+static void conversion_done(void *context);
+
+
+static void schedule_conversion(SimADC *adc, uint64_t delay_ns) {
+    sim_cancel(adc->event);
+    adc->event = sim_schedule(sim_now_ns() + delay_ns + conversion_ns(adc), conversion_done, adc);
+}
+
+
+/*
+Conversion start/restart fast command, or Config0 written with ADC_MODE = 11.
+*/
+static void start_conversion(SimADC *adc) {
+    adc->reg[REG_CONFIG0] |= 0x03;
+    adc->cycle_scan = adc->reg[REG_SCAN] & 0xFFFF;
+    adc->scan_bit = adc->cycle_scan != 0 ? next_scan_bit(adc->cycle_scan, -1) : -1;
+    schedule_conversion(adc, 0);
+}
+
+
+static void stop_conversion(SimADC *adc, uint32_t adc_mode) {
+    sim_cancel(adc->event);
+    adc->event = 0;
+    adc->reg[REG_CONFIG0] = (adc->reg[REG_CONFIG0] & ~0x03) | adc_mode;
+}
+
+
+static void start_cycle(void *context) {
+    SimADC *adc = (SimADC *)context;
+    adc->event = 0;
+    start_conversion(adc);
+}
+
+
+/*
+Latches the new data, pulls IRQ low and moves on as Config3 CONV_MODE says.
+*/
+static void conversion_done(void *context) {
+    SimADC *adc = (SimADC *)context;
+    uint64_t now = sim_now_ns();
+    adc->event = 0;
+    if (adc->data_ready) {
+        adc->stats.overruns++;
+    }
+    adc->data = sample(adc, now);
+    adc->data_ready = true;
+    adc->stats.conversions++;
+    // IRQ pulses high ahead of new data if the last was never read; a dropped
+    // edge leaves it high, as a glitch on the line would
+    sim_set_input(irq_pins[adc->id], -1);
+    if (m_irq_drop_rate <= 0 || uniform() >= m_irq_drop_rate) {
+        sim_set_input(irq_pins[adc->id], LOW);
+    }
+
+    bool continuous = (adc->reg[REG_CONFIG3] >> 6) == 0x3;
+    if (adc->scan_bit >= 0) {
+        adc->scan_bit = next_scan_bit(adc->cycle_scan, adc->scan_bit);
+        if (adc->scan_bit >= 0) {
+            schedule_conversion(adc, 0);
+        } else if (continuous) {
+            uint32_t prescaler = 1u << (adc->reg[REG_CONFIG1] >> 6);
+            uint64_t delay_ns = (uint64_t)adc->reg[REG_TIMER] * DMCLK_NS_PER_PRE * prescaler;
+            adc->event = sim_schedule(now + delay_ns, start_cycle, adc);
+        } else {
+            stop_conversion(adc, 0x02);
+        }
+    } else if (continuous) {
+        schedule_conversion(adc, 0);
+    } else {
+        stop_conversion(adc, (adc->reg[REG_CONFIG3] >> 6) == 0x2 ? 0x02 : 0x00);
+    }
+}
+
+
+static void reset_registers(SimADC *adc) {
+    memcpy(adc->reg, reg_reset, sizeof(adc->reg));
+    adc->locked = false;
+}
+
+
+static uint16_t crc16(const uint8_t *bytes, int count);
+
+
+/*
+CRC of the configuration, Config0 to GainCal, leaving out the bits the ADC
+changes itself (Config0 ADC_MODE and the IRQ status flags).
+*/
+static uint16_t config_crc(const SimADC *adc) {
+    uint8_t bytes[4 * (REG_GAINCAL - REG_CONFIG0 + 1)];
+    int n = 0;
+    for (int address = REG_CONFIG0; address <= REG_GAINCAL; address++) {
+        uint32_t value = adc->reg[address];
+        if (address == REG_CONFIG0) {
+            value &= ~0x03u;
+        } else if (address == REG_IRQ) {
+            value &= 0x0F;
+        }
+        for (int byte = reg_bytes[address] - 1; byte >= 0; byte--) {
+            bytes[n++] = (value >> (8 * byte)) & 0xFF;
+        }
+    }
+    return crc16(bytes, n);
+}
+
+
+static void write_register(SimADC *adc, int address, uint32_t value) {
+    if (address == REG_LOCK) {
+        adc->reg[REG_LOCK] = value;
+        adc->locked = value != LOCK_PASSWORD;
+        if (adc->locked) {
+            adc->crccfg = config_crc(adc);
+        }
+        return;
+    }
+    if (address == REG_ADCDATA || address > REG_TIMER + 2 || adc->locked) {
+        return;     // Read only, reserved, or locked
+    }
+    if (address == REG_IRQ) {
+        value &= 0x0F;
+    }
+    adc->reg[address] = value;
+    if (address == REG_CONFIG0 && (value & 0x03) == 0x03) {
+        start_conversion(adc);
+    }
+}
+
+
+static bool crccfg_error(const SimADC *adc) {
+    return adc->locked && config_crc(adc) != adc->crccfg;
+}
+
+
+static uint32_t read_register(SimADC *adc, int address) {
+    if (address == REG_ADCDATA) {
+        return adc->data;
+    }
+    if (address == REG_IRQ) {
+        // The status flags are active low; reading them clears POR_STATUS
+        uint32_t value = (adc->data_ready ? 0x00 : 0x40) | (crccfg_error(adc) ? 0x00 : 0x20) |
+                         (adc->por ? 0x00 : 0x10) | (adc->reg[REG_IRQ] & 0x0F);
+        adc->por = false;
+        return value;
+    }
+    return adc->reg[address];
+}
+
+
+/*
+STATUS byte clocked out with every command byte.
+*/
+static uint8_t status_byte(const SimADC *adc) {
+    return 0x10 | (adc->data_ready ? 0x00 : 0x04) | (crccfg_error(adc) ? 0x00 : 0x02) | (adc->por ? 0x00 : 0x01);
+}
+
+
+/*
+CRC-16 ANSI (0x8005, MSB first, from 0x0000), as appended with EN_CRCCOM.
+*/
+static uint16_t crc16(const uint8_t *bytes, int count) {
+    uint16_t crc = 0;
+    for (int i = 0; i < count; i++) {
+        crc ^= (uint16_t)(bytes[i] << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+
+/*
+One byte of an SPI frame on a selected device.
+*/
+static uint8_t exchange(SimADC *adc, uint8_t mosi, bool garbled) {
+    adc->stats.spi_bytes++;
+    if (!adc->have_command) {
+        adc->have_command = true;
+        adc->type = (CommandType)(mosi & 0x03);
+        adc->address = (mosi >> 2) & 0x0F;
+        adc->byte_index = 0;
+        adc->shift = 0;
+        uint8_t status = status_byte(adc);
+        adc->frame[0] = status;
+        if ((mosi >> 6) != 0x01) {
+            adc->type = CMD_FAST;   // Addressed to another device
+            adc->address = 0;
+        } else if (adc->type == CMD_FAST) {
+            switch (adc->address) {
+            case FAST_START:      start_conversion(adc); break;
+            case FAST_STANDBY:    stop_conversion(adc, 0x02); break;
+            case FAST_SHUTDOWN:
+            case FAST_FULL_SHDN:  stop_conversion(adc, 0x00); break;
+            case FAST_RESET:      stop_conversion(adc, 0x00); reset_registers(adc); break;
+            default:              break;
+            }
+        }
+        return status;
+    }
+
+    int width = reg_bytes[adc->address];
+    if (m_spi_error_rate > 0 && uniform() < m_spi_error_rate) {
+        garbled = true;
+    }
+    switch (adc->type) {
+    case CMD_STATIC_READ:
+    case CMD_INCREMENTAL_READ: {
+        if (adc->type == CMD_STATIC_READ && adc->address == REG_ADCDATA && (adc->reg[REG_CONFIG3] & CONFIG3_EN_CRCCOM)) {
+            // Data bytes, then the CRC of STATUS and data, then the data again
+            uint8_t out;
+            if (adc->byte_index < width) {
+                out = (adc->data >> (8 * (width - 1 - adc->byte_index))) & 0xFF;
+                adc->frame[1 + adc->byte_index] = out;
+                if (adc->byte_index == width - 1) {
+                    adc->data_ready = false;
+                    adc->stats.data_reads++;
+                    sim_set_input(irq_pins[adc->id], -1);
+                }
+            } else {
+                uint16_t crc = crc16(adc->frame, 1 + width);
+                out = adc->byte_index == width ? crc >> 8 : crc & 0xFF;
+            }
+            adc->byte_index = (adc->byte_index + 1) % (width + 2);
+            return garbled ? out ^ 0x10 : out;
+        }
+        uint32_t value = read_register(adc, adc->address);
+        uint8_t out = (value >> (8 * (width - 1 - adc->byte_index))) & 0xFF;
+        if (++adc->byte_index == width) {
+            adc->byte_index = 0;
+            if (adc->address == REG_ADCDATA) {
+                adc->data_ready = false;
+                adc->stats.data_reads++;
+                sim_set_input(irq_pins[adc->id], -1);
+            }
+            if (adc->type == CMD_INCREMENTAL_READ) {
+                adc->address = (adc->address + 1) % NUM_REGS;
+            }
+        }
+        return garbled ? out ^ 0x10 : out;
+    }
+    case CMD_INCREMENTAL_WRITE:
+        adc->shift = (adc->shift << 8) | mosi;
+        if (++adc->byte_index == width) {
+            write_register(adc, adc->address, adc->shift & ((1UL << (8 * width)) - 1));
+            adc->byte_index = 0;
+            adc->shift = 0;
+            adc->address = adc->address + 1 > REG_TIMER + 2 ? REG_CONFIG0 : adc->address + 1;
+        }
+        return 0x00;
+    default:
+        return 0x00;
+    }
+}
+
+
+static void chip_select(uint8_t pin, uint8_t level, void *context) {
+    (void)pin;
+    SimADC *adc = (SimADC *)context;
+    adc->selected = (level == LOW);
+    if (adc->selected) {
+        adc->stats.spi_frames++;
+    }
+    adc->have_command = false;
+}
+
+
+static void mosfet_switched(uint8_t pin, uint8_t level, void *context) {
+    (void)level;
+    (void)context;
+    uint64_t now = sim_now_ns();
+    for (int n = 0; n < NUM_ADCS; n++) {
+        SimADC *adc = &m_adc[n];
+        int first = n * CHANNELS_PER_ADC;
+        for (int channel = first; channel < first + CHANNELS_PER_ADC && channel < NUMBER_OF_THERMISTORS; channel++) {
+            if (mosfet_pins[channel] == pin) {
+                int pair = (channel - first) % ADC_INPUT_PAIRS;
+                adc->settle_from[pair] = settled_code(adc, pair, now, pin);
+                adc->switched_ns[pair] = now;
+            }
+        }
+    }
+}
+
+
+/*
+Powers the ADCs up and gives every thermistor a slow sine about a temperature
+of its own, with a few LSB of noise, until sim_adc_set_signal() says otherwise.
+*/
+void sim_adc_init() {
+    for (int n = 0; n < NUM_ADCS; n++) {
+        SimADC *adc = &m_adc[n];
+        memset(adc, 0, sizeof(*adc));
+        adc->id = n;
+        adc->scan_bit = -1;
+        adc->por = true;
+        reset_registers(adc);
+        sim_watch_pin(cs_pins[n], chip_select, adc);
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        m_signal[channel] = SimSignal{SIM_SINE, 20.0 + 0.25 * channel, 0.5, 600.0, 3.0};
+        sim_watch_pin(mosfet_pins[channel], mosfet_switched, NULL);
+    }
+    m_temp_signal = SimSignal{SIM_CONSTANT, 30.0, 0, 0, 3.0};
+}
+
+
+void sim_adc_set_signal(int channel, const SimSignal *signal) {
+    if (channel == SIM_ADC_TEMP) {
+        m_temp_signal = *signal;
+    } else if (channel >= 0 && channel < NUMBER_OF_THERMISTORS) {
+        m_signal[channel] = *signal;
+    }
+}
+
+
+void sim_adc_set_settling(double tau_us) {
+    m_settle_tau_ns = tau_us * 1000.0;
+}
+
+
+void sim_adc_set_max_sck(uint32_t hz) {
+    m_max_sck_hz = hz;
+}
+
+
+void sim_adc_set_spi_error_rate(double rate) {
+    m_spi_error_rate = rate;
+}
+
+
+void sim_adc_set_irq_drop_rate(double rate) {
+    m_irq_drop_rate = rate;
+}
+
+
+void sim_adc_set_error(double offset_codes, double gain_ppm) {
+    m_offset_error = offset_codes;
+    m_gain_error = gain_ppm * 1e-6;
+}
+
+
+/*
+A brown-out on ADC adc's supply: a power-on reset, leaving it shut down with
+every register at its default.
+*/
+void sim_adc_brownout(int adc) {
+    if (adc >= 0 && adc < NUM_ADCS) {
+        stop_conversion(&m_adc[adc], 0x00);
+        reset_registers(&m_adc[adc]);
+        m_adc[adc].por = true;
+        m_adc[adc].data_ready = false;
+    }
+}
+
+
+/*
+A register upset on ADC adc: one bit of Config2 flips (the PGA gain), as a
+glitch could leave it, whatever the lock.
+*/
+void sim_adc_upset(int adc) {
+    if (adc >= 0 && adc < NUM_ADCS) {
+        m_adc[adc].reg[REG_CONFIG2] ^= 0x08;
+    }
+}
+
+
+void sim_adc_stats(int adc, SimADCStats *stats) {
+    if (adc >= 0 && adc < NUM_ADCS) {
+        *stats = m_adc[adc].stats;
+    }
+}
+
+
+/*
+SPI bus. Every selected device sees the byte; their outputs are wired-AND, as
+contending open outputs would be.
+*/
+static uint8_t bus_exchange(uint8_t mosi, uint32_t clock) {
+    uint8_t miso = 0xFF;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (m_adc[n].selected) {
+            miso &= exchange(&m_adc[n], mosi, clock > m_max_sck_hz);
+        }
+    }
+    return miso;
+}
+
+
+static void dma_done(void *context) {
+    ((EventResponder *)context)->triggerEvent();
+}
+
+
+uint8_t SPIClass::transfer(uint8_t data) {
+    sim_consume_ns(8000000000ULL / m_clock);
+    return bus_exchange(data, m_clock);
+}
+
+
+uint16_t SPIClass::transfer16(uint16_t data) {
+    uint16_t out = (uint16_t)transfer(data >> 8) << 8;
+    return out | transfer(data & 0xFF);
+}
+
+
+uint32_t SPIClass::transfer32(uint32_t data) {
+    uint32_t out = 0;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out = (out << 8) | transfer((data >> shift) & 0xFF);
+    }
+    return out;
+}
+
+
+void SPIClass::transfer(const void *tx, void *rx, size_t count) {
+    const uint8_t *out = (const uint8_t *)tx;
+    uint8_t *in = (uint8_t *)rx;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t b = transfer(out != NULL ? out[i] : 0x00);
+        if (in != NULL) {
+            in[i] = b;
+        }
+    }
+}
+
+
+/*
+DMA transfer: the bytes are exchanged at once but the completion event only
+runs once they would have been clocked out.
+*/
+bool SPIClass::transfer(const void *tx, void *rx, size_t count, EventResponderRef event) {
+    const uint8_t *out = (const uint8_t *)tx;
+    uint8_t *in = (uint8_t *)rx;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t b = bus_exchange(out != NULL ? out[i] : 0x00, m_clock);
+        if (in != NULL) {
+            in[i] = b;
+        }
+    }
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (m_adc[n].selected) {
+            m_adc[n].stats.dma_reads++;
+        }
+    }
+    sim_schedule(sim_now_ns() + DMA_SETUP_NS + count * 8000000000ULL / m_clock, dma_done, &event);
+    return true;
+}
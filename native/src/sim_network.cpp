@@ -0,0 +1,979 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file sim_network.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Simulated network of the host-native build: NativeEthernet's TCP client
+ * talking to an in-process MQTT 3.1.1 and 5 broker over a link of set bandwidth
+ * and latency, and UDP sockets with an SNTP responder.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <NativeEthernet.h>
+#include <time.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "native_sim.h"
+
+#define MAX_SOCKETS         16
+#define TCP_BUFFER_BYTES    2048    // NativeEthernet's default socket buffer
+#define UDP_MAX_BYTES       1500
+#define NTP_PORT            123
+#define NTP_PACKET_SIZE     48
+#define NTP_UNIX_OFFSET_S   2208988800ULL
+#define TOPIC_ALIAS_MAXIMUM 16      // Topic aliases the broker takes from an MQTT 5 client
+#define TCP_RTO_NS          200000000ULL    // What a lost segment costs: the minimum retransmission timeout
+
+// MQTT control packet types
+#define MQTT_CONNECT     1
+#define MQTT_CONNACK     2
+#define MQTT_PUBLISH     3
+#define MQTT_PUBACK      4
+#define MQTT_SUBSCRIBE   8
+#define MQTT_SUBACK      9
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_UNSUBACK    11
+#define MQTT_PINGREQ     12
+#define MQTT_PINGRESP    13
+#define MQTT_DISCONNECT  14
+
+#define MQTT_VERSION_5   5
+#define MQTT_TOPIC_ALIAS 0x23       // PUBLISH property
+
+typedef std::vector<uint8_t> Bytes;
+
+// Firmware end of a TCP connection, and the broker's session on it
+struct TcpSocket {
+    bool open;
+    bool peer_closed;
+    std::deque<std::pair<uint64_t, uint8_t>> rx;    // Arrival time, byte
+    uint64_t backlog;                   // Written bytes not yet on the wire
+    uint64_t drained_ns;
+
+    Bytes parse;                        // Broker's partial packet
+    bool session;                       // CONNECT accepted
+    bool graceful;                      // DISCONNECT received
+    uint8_t version;                    // Protocol level of the session
+    std::map<uint16_t, std::string> aliases;    // Topic aliases the client has set
+    std::vector<std::string> filters;
+    std::string will_topic;
+    Bytes will_payload;
+    bool will_retain;
+
+    uint16_t inbound;                   // Port the scraper connected to, 0 for the broker's
+    bool accepted;                      // Handed to the firmware by EthernetServer::accept()
+    std::string response;               // What the firmware wrote back to the scraper
+};
+
+struct Datagram {
+    uint64_t at_ns;
+    IPAddress ip;
+    uint16_t port;
+    Bytes data;
+};
+
+struct UdpSocket {
+    bool open;
+    uint16_t port;
+    bool building;
+    IPAddress to_ip;
+    uint16_t to_port;
+    Bytes tx;
+    std::deque<Datagram> rx;
+    Datagram current;
+    size_t read_pos;
+};
+
+EthernetClass Ethernet;
+
+static TcpSocket m_tcp[MAX_SOCKETS];
+static UdpSocket m_udp[MAX_SOCKETS];
+static double m_bytes_per_ns = 100e6 / 8 / 1e9;
+static uint64_t m_latency_ns = 200000;
+static bool m_broker_up = true;
+static bool m_cable_plugged = true;
+static bool m_mqtt5 = true;
+static bool m_ntp_up = true;
+static double m_loss_rate = 0;
+static uint64_t m_loss_state = 0xD1B54A32D192ED03ULL;
+static std::map<std::string, Bytes> m_retained;
+static SimNetworkStats m_stats;
+static std::set<uint16_t> m_listening;  // Ports with an EthernetServer
+static std::string m_http_response;
+static int64_t m_utc_offset_ns = 0;
+static bool m_utc_set = false;
+
+
+void sim_network_set_link(double mbps, uint32_t latency_us) {
+    m_bytes_per_ns = mbps * 1e6 / 8 / 1e9;
+    m_latency_ns = (uint64_t)latency_us * 1000;
+}
+
+
+void sim_network_stats(SimNetworkStats *stats) {
+    *stats = m_stats;
+}
+
+
+void sim_network_set_loss(double rate) {
+    m_loss_rate = rate;
+}
+
+
+void sim_ntp_set_up(bool up) {
+    m_ntp_up = up;
+}
+
+
+// True for a packet the link loses, with chance m_loss_rate
+static bool lost() {
+    if (m_loss_rate <= 0) {
+        return false;
+    }
+    m_loss_state ^= m_loss_state << 13;
+    m_loss_state ^= m_loss_state >> 7;
+    m_loss_state ^= m_loss_state << 17;
+    return ((m_loss_state >> 11) * (1.0 / 9007199254740992.0)) < m_loss_rate;
+}
+
+
+void EthernetClass::begin(uint8_t *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet) {
+    (void)mac;
+    (void)dns;
+    (void)gateway;
+    (void)subnet;
+    m_ip = ip;
+}
+
+
+EthernetLinkStatus EthernetClass::linkStatus() {
+    return m_cable_plugged ? LinkON : LinkOFF;
+}
+
+
+/*
+MQTT broker
+*/
+static size_t encode_length(uint8_t *out, size_t length) {
+    size_t n = 0;
+    do {
+        uint8_t digit = length % 128;
+        length /= 128;
+        out[n++] = digit | (length > 0 ? 0x80 : 0);
+    } while (length > 0);
+    return n;
+}
+
+
+static void drain(TcpSocket *socket) {
+    uint64_t now = sim_now_ns();
+    uint64_t sent = (uint64_t)((now - socket->drained_ns) * m_bytes_per_ns);
+    socket->backlog = sent >= socket->backlog ? 0 : socket->backlog - sent;
+    socket->drained_ns = now;
+}
+
+
+static uint64_t backlog_ns(const TcpSocket *socket) {
+    return (uint64_t)(socket->backlog / m_bytes_per_ns);
+}
+
+
+/*
+Queues bytes from the broker, arriving once what the firmware sent before them
+has gone out and the link latency has passed; a lost segment arrives a
+retransmission timeout later.
+*/
+static void send_to_client(TcpSocket *socket, const uint8_t *data, size_t length) {
+    uint64_t arrival = sim_now_ns() + backlog_ns(socket) + m_latency_ns + (uint64_t)(length / m_bytes_per_ns);
+    if (lost()) {
+        arrival += TCP_RTO_NS;
+    }
+    for (size_t i = 0; i < length; i++) {
+        socket->rx.push_back(std::make_pair(arrival, data[i]));
+    }
+}
+
+
+static void send_packet(TcpSocket *socket, uint8_t header, const Bytes &body) {
+    uint8_t fixed[5];
+    fixed[0] = header;
+    size_t n = 1 + encode_length(&fixed[1], body.size());
+    send_to_client(socket, fixed, n);
+    send_to_client(socket, body.data(), body.size());
+}
+
+
+static std::vector<std::string> topic_levels(const std::string &topic) {
+    std::vector<std::string> levels;
+    size_t start = 0;
+    size_t slash;
+    while ((slash = topic.find('/', start)) != std::string::npos) {
+        levels.push_back(topic.substr(start, slash - start));
+        start = slash + 1;
+    }
+    levels.push_back(topic.substr(start));
+    return levels;
+}
+
+
+static bool topic_matches(const std::string &filter, const std::string &topic) {
+    std::vector<std::string> f = topic_levels(filter);
+    std::vector<std::string> t = topic_levels(topic);
+    for (size_t i = 0; i < f.size(); i++) {
+        if (f[i] == "#") {
+            return true;
+        }
+        if (i >= t.size() || (f[i] != "+" && f[i] != t[i])) {
+            return false;
+        }
+    }
+    return f.size() == t.size();
+}
+
+
+static void deliver(TcpSocket *socket, const std::string &topic, const Bytes &payload, bool retain) {
+    Bytes body;
+    body.push_back(topic.size() >> 8);
+    body.push_back(topic.size() & 0xFF);
+    body.insert(body.end(), topic.begin(), topic.end());
+    if (socket->version == MQTT_VERSION_5) {
+        body.push_back(0);                      // No properties
+    }
+    body.insert(body.end(), payload.begin(), payload.end());
+    send_packet(socket, (MQTT_PUBLISH << 4) | (retain ? 0x01 : 0x00), body);
+}
+
+
+static void count_publish(const std::string &topic, size_t payload_length, size_t packet_length, bool retain) {
+    m_stats.publishes++;
+    if (retain) {
+        m_stats.retained++;
+    }
+    m_stats.publish_bytes += packet_length;
+    if (payload_length > m_stats.largest_payload) {
+        m_stats.largest_payload = payload_length;
+    }
+    // spBv1.0/<group>/<message type>/<node>[/<device>]
+    size_t first = topic.find('/');
+    size_t second = first == std::string::npos ? first : topic.find('/', first + 1);
+    size_t third = second == std::string::npos ? second : topic.find('/', second + 1);
+    if (third == std::string::npos) {
+        return;
+    }
+    std::string type = topic.substr(second + 1, third - second - 1);
+    if (type == "NBIRTH" || type == "DBIRTH") {
+        m_stats.births++;
+    } else if (type == "NDATA" || type == "DDATA") {
+        m_stats.data++;
+    } else if (type == "NDEATH" || type == "DDEATH") {
+        m_stats.deaths++;
+    }
+}
+
+
+static void route(const std::string &topic, const Bytes &payload, bool retain) {
+    if (retain) {
+        if (payload.empty()) {
+            m_retained.erase(topic);
+        } else {
+            m_retained[topic] = payload;
+        }
+    }
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        TcpSocket *socket = &m_tcp[i];
+        if (!socket->open || socket->peer_closed || !socket->session) {
+            continue;
+        }
+        for (size_t f = 0; f < socket->filters.size(); f++) {
+            if (topic_matches(socket->filters[f], topic)) {
+                deliver(socket, topic, payload, false);
+                break;
+            }
+        }
+    }
+}
+
+
+static std::string read_string(const Bytes &packet, size_t *pos) {
+    if (*pos + 2 > packet.size()) {
+        *pos = packet.size();
+        return std::string();
+    }
+    size_t length = ((size_t)packet[*pos] << 8) | packet[*pos + 1];
+    *pos += 2;
+    if (*pos + length > packet.size()) {
+        length = packet.size() - *pos;
+    }
+    std::string s((const char *)&packet[*pos], length);
+    *pos += length;
+    return s;
+}
+
+
+/*
+Reads the MQTT 5 properties at pos, returning the topic alias among them, 0 if
+there's none. Returns false if they run past the end of the packet.
+*/
+static bool read_properties(const Bytes &packet, size_t *pos, uint16_t *alias) {
+    size_t length = 0;
+    size_t shift = 0;
+    do {
+        if (*pos >= packet.size() || shift > 21) {
+            return false;
+        }
+        length |= (size_t)(packet[*pos] & 0x7F) << shift;
+        shift += 7;
+    } while (packet[(*pos)++] & 0x80);
+    if (*pos + length > packet.size()) {
+        return false;
+    }
+    size_t end = *pos + length;
+    *alias = 0;
+    // The firmware sends no property but the topic alias
+    if (length == 3 && packet[*pos] == MQTT_TOPIC_ALIAS) {
+        *alias = ((uint16_t)packet[*pos + 1] << 8) | packet[*pos + 2];
+    }
+    *pos = end;
+    return true;
+}
+
+
+static void handle_connect(TcpSocket *socket, const Bytes &body) {
+    size_t pos = 0;
+    uint16_t alias;
+    read_string(body, &pos);                    // Protocol name
+    socket->version = pos < body.size() ? body[pos] : 0;
+    uint8_t flags = pos + 1 < body.size() ? body[pos + 1] : 0;
+    pos += 4;                                   // Level, flags, keep alive
+    if (socket->version == MQTT_VERSION_5 && !m_mqtt5) {
+        // As a 3.1.1 broker: unacceptable protocol level
+        send_packet(socket, MQTT_CONNACK << 4, Bytes{0x00, 0x01});
+        socket->peer_closed = true;
+        return;
+    }
+    if (socket->version == MQTT_VERSION_5 && !read_properties(body, &pos, &alias)) {
+        socket->peer_closed = true;
+        return;
+    }
+    read_string(body, &pos);                    // Client identifier
+    if (flags & 0x04) {
+        if (socket->version == MQTT_VERSION_5 && !read_properties(body, &pos, &alias)) {
+            socket->peer_closed = true;
+            return;
+        }
+        socket->will_topic = read_string(body, &pos);
+        std::string will = read_string(body, &pos);
+        socket->will_payload.assign(will.begin(), will.end());
+        socket->will_retain = (flags & 0x20) != 0;
+    }
+    socket->session = true;
+    socket->graceful = false;
+    socket->aliases.clear();
+    m_stats.connects++;
+    if (socket->version == MQTT_VERSION_5) {
+        // Session not present, success, and a Topic Alias Maximum property
+        send_packet(socket, MQTT_CONNACK << 4, Bytes{0x00, 0x00, 0x03, 0x22, 0x00, TOPIC_ALIAS_MAXIMUM});
+    } else {
+        send_packet(socket, MQTT_CONNACK << 4, Bytes{0x00, 0x00});
+    }
+}
+
+
+static void handle_packet(TcpSocket *socket, uint8_t header, const Bytes &body, size_t packet_length) {
+    uint8_t type = header >> 4;
+    if (!socket->session && type != MQTT_CONNECT) {
+        socket->peer_closed = true;
+        return;
+    }
+    switch (type) {
+    case MQTT_CONNECT:
+        handle_connect(socket, body);
+        break;
+    case MQTT_PUBLISH: {
+        uint8_t qos = (header >> 1) & 0x03;
+        size_t pos = 0;
+        std::string topic = read_string(body, &pos);
+        uint16_t id = 0;
+        if (qos > 0 && pos + 2 <= body.size()) {
+            id = ((uint16_t)body[pos] << 8) | body[pos + 1];
+            pos += 2;
+        }
+        if (socket->version == MQTT_VERSION_5) {
+            uint16_t alias;
+            if (!read_properties(body, &pos, &alias) || alias > TOPIC_ALIAS_MAXIMUM ||
+                (topic.empty() && socket->aliases.count(alias) == 0)) {
+                // Protocol error; a real broker would send a DISCONNECT first
+                socket->peer_closed = true;
+                break;
+            }
+            if (alias != 0 && topic.empty()) {
+                topic = socket->aliases[alias];
+                m_stats.aliased++;
+            } else if (alias != 0) {
+                socket->aliases[alias] = topic;
+            }
+        }
+        Bytes payload(body.begin() + (pos < body.size() ? pos : body.size()), body.end());
+        count_publish(topic, payload.size(), packet_length, (header & 0x01) != 0);
+        route(topic, payload, (header & 0x01) != 0);
+        if (qos == 1) {
+            send_packet(socket, MQTT_PUBACK << 4, Bytes{(uint8_t)(id >> 8), (uint8_t)(id & 0xFF)});
+        }
+        break;
+    }
+    case MQTT_SUBSCRIBE: {
+        Bytes ack(body.begin(), body.begin() + (body.size() < 2 ? body.size() : 2));
+        size_t pos = 2;
+        if (socket->version == MQTT_VERSION_5) {
+            uint16_t alias;
+            read_properties(body, &pos, &alias);
+            ack.push_back(0);                   // No properties
+        }
+        while (pos < body.size()) {
+            std::string filter = read_string(body, &pos);
+            uint8_t qos = pos < body.size() ? body[pos++] : 0;
+            socket->filters.push_back(filter);
+            ack.push_back(qos > 1 ? 1 : qos);
+            for (std::map<std::string, Bytes>::iterator it = m_retained.begin(); it != m_retained.end(); ++it) {
+                if (topic_matches(filter, it->first)) {
+                    deliver(socket, it->first, it->second, true);
+                }
+            }
+        }
+        send_packet(socket, MQTT_SUBACK << 4, ack);
+        break;
+    }
+    case MQTT_UNSUBSCRIBE: {
+        Bytes ack(body.begin(), body.begin() + (body.size() < 2 ? body.size() : 2));
+        size_t pos = 2;
+        if (socket->version == MQTT_VERSION_5) {
+            uint16_t alias;
+            read_properties(body, &pos, &alias);
+            ack.push_back(0);                   // No properties
+        }
+        while (pos < body.size()) {
+            std::string filter = read_string(body, &pos);
+            for (size_t f = 0; f < socket->filters.size(); f++) {
+                if (socket->filters[f] == filter) {
+                    socket->filters.erase(socket->filters.begin() + f);
+                    break;
+                }
+            }
+            if (socket->version == MQTT_VERSION_5) {
+                ack.push_back(0);               // Success
+            }
+        }
+        send_packet(socket, MQTT_UNSUBACK << 4, ack);
+        break;
+    }
+    case MQTT_PINGREQ:
+        send_packet(socket, MQTT_PINGRESP << 4, Bytes());
+        break;
+    case MQTT_DISCONNECT:
+        socket->graceful = true;
+        socket->peer_closed = true;
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*
+Feeds the bytes the firmware wrote to the broker, a whole packet at a time.
+*/
+static void broker_receive(TcpSocket *socket, const uint8_t *data, size_t length) {
+    socket->parse.insert(socket->parse.end(), data, data + length);
+    while (socket->parse.size() >= 2 && !socket->peer_closed) {
+        size_t remaining = 0;
+        size_t multiplier = 1;
+        size_t pos = 1;
+        bool complete = false;
+        while (pos < socket->parse.size() && pos < 5) {
+            uint8_t digit = socket->parse[pos++];
+            remaining += (digit & 0x7F) * multiplier;
+            multiplier *= 128;
+            if (!(digit & 0x80)) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || socket->parse.size() < pos + remaining) {
+            return;
+        }
+        uint8_t header = socket->parse[0];
+        Bytes body(socket->parse.begin() + pos, socket->parse.begin() + pos + remaining);
+        socket->parse.erase(socket->parse.begin(), socket->parse.begin() + pos + remaining);
+        handle_packet(socket, header, body, pos + remaining);
+    }
+}
+
+
+/*
+Broker side of a connection going away: the will goes out unless the client
+said DISCONNECT.
+*/
+static void end_session(TcpSocket *socket) {
+    if (socket->session && !socket->graceful && !socket->will_topic.empty()) {
+        count_publish(socket->will_topic, socket->will_payload.size(), socket->will_payload.size(),
+                      socket->will_retain);
+        route(socket->will_topic, socket->will_payload, socket->will_retain);
+    }
+    socket->session = false;
+}
+
+
+/*
+Stopping the broker ends every session. It comes back without the retained
+messages, as Mosquitto does without persistence.
+*/
+void sim_broker_set_up(bool up) {
+    m_broker_up = up;
+    if (!up) {
+        m_retained.clear();
+        for (int i = 0; i < MAX_SOCKETS; i++) {
+            if (m_tcp[i].open && !m_tcp[i].peer_closed) {
+                end_session(&m_tcp[i]);
+                m_tcp[i].peer_closed = true;
+            }
+        }
+    }
+}
+
+
+/*
+Pulling the cable loses every connection, and the broker publishes their wills
+as it would once their keep alives ran out. Connects time out until it's back.
+*/
+void sim_network_set_cable(bool plugged) {
+    m_cable_plugged = plugged;
+    if (!plugged) {
+        for (int i = 0; i < MAX_SOCKETS; i++) {
+            if (m_tcp[i].open && !m_tcp[i].peer_closed) {
+                end_session(&m_tcp[i]);
+                m_tcp[i].peer_closed = true;
+            }
+        }
+    }
+}
+
+
+void sim_broker_set_mqtt5(bool accept) {
+    m_mqtt5 = accept;
+}
+
+
+void sim_broker_publish(const char *topic, const uint8_t *payload, size_t length, bool retain) {
+    route(topic, Bytes(payload, payload + length), retain);
+}
+
+
+/*
+EthernetClient
+*/
+static TcpSocket *tcp(int index) {
+    return index >= 0 && m_tcp[index].open ? &m_tcp[index] : NULL;
+}
+
+
+int EthernetClient::connect(IPAddress ip, uint16_t port) {
+    (void)ip;
+    (void)port;
+    stop();
+    if (!m_broker_up || !m_cable_plugged) {
+        sim_advance_ns((uint64_t)m_timeout_ms * 1000000);
+        return 0;
+    }
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        if (!m_tcp[i].open) {
+            m_tcp[i] = TcpSocket();
+            m_tcp[i].open = true;
+            m_tcp[i].drained_ns = sim_now_ns();
+            m_socket = i;
+            // SYN, SYN-ACK
+            sim_advance_ns(2 * m_latency_ns);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int EthernetClient::connect(const char *host, uint16_t port) {
+    (void)host;
+    return connect(IPAddress(), port);
+}
+
+
+/*
+Blocks, as NativeEthernet does, while the socket buffer has no room. A lost
+segment holds up the link for a retransmission timeout.
+*/
+size_t EthernetClient::write(const uint8_t *buf, size_t size) {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL || socket->peer_closed) {
+        return 0;
+    }
+    drain(socket);
+    if (lost()) {
+        socket->backlog += (uint64_t)(TCP_RTO_NS * m_bytes_per_ns);
+    }
+    if (socket->backlog + size > TCP_BUFFER_BYTES) {
+        uint64_t excess = socket->backlog + size - TCP_BUFFER_BYTES;
+        sim_advance_ns((uint64_t)(excess / m_bytes_per_ns) + 1);
+        drain(socket);
+    }
+    socket->backlog += size;
+    if (socket->inbound != 0) {
+        socket->response.append((const char *)buf, size);
+    } else {
+        broker_receive(socket, buf, size);
+    }
+    return size;
+}
+
+
+int EthernetClient::availableForWrite() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL || socket->peer_closed) {
+        return 0;
+    }
+    drain(socket);
+    return socket->backlog >= TCP_BUFFER_BYTES ? 0 : TCP_BUFFER_BYTES - socket->backlog;
+}
+
+
+int EthernetClient::available() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL) {
+        return 0;
+    }
+    uint64_t now = sim_now_ns();
+    int count = 0;
+    for (size_t i = 0; i < socket->rx.size() && socket->rx[i].first <= now; i++) {
+        count++;
+    }
+    return count;
+}
+
+
+int EthernetClient::read() {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+
+int EthernetClient::read(uint8_t *buf, size_t size) {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL) {
+        return -1;
+    }
+    uint64_t now = sim_now_ns();
+    size_t n = 0;
+    while (n < size && !socket->rx.empty() && socket->rx.front().first <= now) {
+        buf[n++] = socket->rx.front().second;
+        socket->rx.pop_front();
+    }
+    return n > 0 ? (int)n : -1;
+}
+
+
+int EthernetClient::peek() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL || socket->rx.empty() || socket->rx.front().first > sim_now_ns()) {
+        return -1;
+    }
+    return socket->rx.front().second;
+}
+
+
+void EthernetClient::flush() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket != NULL) {
+        drain(socket);
+        sim_advance_ns(backlog_ns(socket));
+        drain(socket);
+    }
+}
+
+
+void EthernetClient::stop() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket != NULL) {
+        if (socket->inbound != 0) {
+            m_http_response = socket->response;
+            m_stats.http_responses++;
+        } else {
+            end_session(socket);
+        }
+        socket->open = false;
+    }
+    m_socket = -1;
+}
+
+
+uint8_t EthernetClient::connected() {
+    TcpSocket *socket = tcp(m_socket);
+    if (socket == NULL) {
+        return 0;
+    }
+    return !socket->peer_closed || available() > 0;
+}
+
+
+/*
+EthernetServer and the scraper
+*/
+void EthernetServer::begin() {
+    m_listening.insert(m_port);
+}
+
+
+/*
+The next connection the scraper has made to the port, once its handshake is
+done; an empty client if there is none.
+*/
+EthernetClient EthernetServer::accept() {
+    uint64_t now = sim_now_ns();
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        TcpSocket *socket = &m_tcp[i];
+        if (socket->open && socket->inbound == m_port && !socket->accepted &&
+            (socket->rx.empty() || socket->rx.front().first <= now)) {
+            socket->accepted = true;
+            return EthernetClient(i);
+        }
+    }
+    return EthernetClient();
+}
+
+
+bool sim_http_get(uint16_t port, const char *path) {
+    if (m_listening.count(port) == 0) {
+        return false;
+    }
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        if (!m_tcp[i].open) {
+            m_tcp[i] = TcpSocket();
+            m_tcp[i].open = true;
+            m_tcp[i].drained_ns = sim_now_ns();
+            m_tcp[i].inbound = port;
+            std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: node\r\n\r\n";
+            // After the handshake
+            send_to_client(&m_tcp[i], (const uint8_t *)request.data(), request.size());
+            for (auto &byte : m_tcp[i].rx) {
+                byte.first += 2 * m_latency_ns;
+            }
+            m_stats.http_requests++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+const char *sim_http_response() {
+    return m_http_response.c_str();
+}
+
+
+/*
+SNTP responder
+*/
+static uint64_t utc_ns() {
+    if (!m_utc_set) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        m_utc_offset_ns = (int64_t)((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) - (int64_t)sim_now_ns();
+        m_utc_set = true;
+    }
+    return sim_now_ns() + m_utc_offset_ns;
+}
+
+
+static void put_ntp_time(uint8_t *out, uint64_t unix_ns) {
+    uint64_t seconds = unix_ns / 1000000000ULL + NTP_UNIX_OFFSET_S;
+    uint64_t fraction = ((unix_ns % 1000000000ULL) << 32) / 1000000000ULL;
+    for (int i = 0; i < 4; i++) {
+        out[i] = (seconds >> (24 - 8 * i)) & 0xFF;
+        out[4 + i] = (fraction >> (24 - 8 * i)) & 0xFF;
+    }
+}
+
+
+static void ntp_reply(UdpSocket *socket, const Bytes &request) {
+    if (request.size() < NTP_PACKET_SIZE) {
+        return;
+    }
+    uint64_t receive = utc_ns() + m_latency_ns;
+    Datagram reply;
+    reply.at_ns = sim_now_ns() + 2 * m_latency_ns;
+    reply.ip = socket->to_ip;
+    reply.port = NTP_PORT;
+    reply.data.assign(NTP_PACKET_SIZE, 0);
+    reply.data[0] = (4 << 3) | 4;       // No leap warning, version 4, server
+    reply.data[1] = 1;                  // Stratum
+    reply.data[2] = request[2];
+    reply.data[3] = (uint8_t)-20;       // Precision, about 1 us
+    memcpy(&reply.data[12], "SIM", 4);
+    put_ntp_time(&reply.data[16], receive);
+    memcpy(&reply.data[24], &request[40], 8);
+    put_ntp_time(&reply.data[32], receive);
+    put_ntp_time(&reply.data[40], receive + 10000);
+    socket->rx.push_back(reply);
+    m_stats.ntp_replies++;
+}
+
+
+/*
+EthernetUDP
+*/
+static UdpSocket *udp(int index) {
+    return index >= 0 && m_udp[index].open ? &m_udp[index] : NULL;
+}
+
+
+uint8_t EthernetUDP::begin(uint16_t port) {
+    stop();
+    for (int i = 0; i < MAX_SOCKETS; i++) {
+        if (!m_udp[i].open) {
+            m_udp[i] = UdpSocket();
+            m_udp[i].open = true;
+            m_udp[i].port = port;
+            m_socket = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void EthernetUDP::stop() {
+    if (udp(m_socket) != NULL) {
+        m_udp[m_socket].open = false;
+    }
+    m_socket = -1;
+}
+
+
+int EthernetUDP::beginPacket(IPAddress ip, uint16_t port) {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL) {
+        return 0;
+    }
+    socket->building = true;
+    socket->to_ip = ip;
+    socket->to_port = port;
+    socket->tx.clear();
+    return 1;
+}
+
+
+size_t EthernetUDP::write(const uint8_t *buffer, size_t size) {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL || !socket->building) {
+        return 0;
+    }
+    if (socket->tx.size() + size > UDP_MAX_BYTES) {
+        size = UDP_MAX_BYTES - socket->tx.size();
+    }
+    socket->tx.insert(socket->tx.end(), buffer, buffer + size);
+    return size;
+}
+
+
+int EthernetUDP::endPacket() {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL || !socket->building) {
+        return 0;
+    }
+    socket->building = false;
+    m_stats.datagrams++;
+    m_stats.datagram_bytes += socket->tx.size();
+    if (socket->to_port == NTP_PORT && m_ntp_up && !lost()) {
+        ntp_reply(socket, socket->tx);
+    }
+    return 1;
+}
+
+
+int EthernetUDP::parsePacket() {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL) {
+        return 0;
+    }
+    socket->current.data.clear();
+    socket->read_pos = 0;
+    if (socket->rx.empty() || socket->rx.front().at_ns > sim_now_ns()) {
+        return 0;
+    }
+    socket->current = socket->rx.front();
+    socket->rx.pop_front();
+    return socket->current.data.size();
+}
+
+
+int EthernetUDP::available() {
+    UdpSocket *socket = udp(m_socket);
+    return socket == NULL ? 0 : socket->current.data.size() - socket->read_pos;
+}
+
+
+int EthernetUDP::read() {
+    unsigned char b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+
+int EthernetUDP::read(unsigned char *buffer, size_t len) {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL) {
+        return -1;
+    }
+    size_t n = socket->current.data.size() - socket->read_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buffer, &socket->current.data[socket->read_pos], n);
+    socket->read_pos += n;
+    return n;
+}
+
+
+int EthernetUDP::peek() {
+    UdpSocket *socket = udp(m_socket);
+    if (socket == NULL || socket->read_pos >= socket->current.data.size()) {
+        return -1;
+    }
+    return socket->current.data[socket->read_pos];
+}
+
+
+IPAddress EthernetUDP::remoteIP() {
+    UdpSocket *socket = udp(m_socket);
+    return socket == NULL ? IPAddress() : socket->current.ip;
+}
+
+
+uint16_t EthernetUDP::remotePort() {
+    UdpSocket *socket = udp(m_socket);
+    return socket == NULL ? 0 : socket->current.port;
+}
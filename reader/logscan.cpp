@@ -0,0 +1,201 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file logscan.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Log scan tool: the min, max and mean of each channel over a time range
+ * of SD card logs and ingest tool files, and how often they crossed a
+ * threshold, with sdlog_reader.  The files are taken in the order given, so a
+ * channel's crossings carry on from one file into the next.
+ *
+ *     .pio/build/native_logscan/program --from 1700000000 --to 1700086400 --channel 12 THERMISTOR3_*.BIN
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sdlog_reader.h"
+
+#define MAX_FILES 4096
+
+// Scan settings, from the command line
+static const char *m_files[MAX_FILES];
+static int m_num_files = 0;
+static uint64_t m_from = 0;
+static uint64_t m_to = UINT64_MAX;
+static uint64_t m_slots = 0;                    // 0 for every slot
+static float m_threshold = NAN;
+
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+
+// A frame time as text: UTC seconds, or seconds since boot marked with a 'b'
+static void print_time(uint64_t time) {
+    if (time & SDLOG_LOCAL_TIME) {
+        printf(" b%17.6f", (time & ~SDLOG_LOCAL_TIME) / 1e6);
+    } else {
+        printf(" %18.6f", time / 1e6);
+    }
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options] LOG_FILE...\n"
+            "  --from T              Frames from UTC seconds T (default the first)\n"
+            "  --to T                Frames up to UTC seconds T (default the last)\n"
+            "  --channel N           Thermistor N, 1 to %d, or 0 for the ADC temperature;\n"
+            "                        may be given more than once (default all)\n"
+            "  --threshold C         Count the crossings of C degrees\n"
+            "LOG_FILE is an SD card log (TMXnnnnn.BIN) or an ingest tool file, taken in order.\n",
+            program, NUMBER_OF_THERMISTORS);
+}
+
+
+static bool parse_time(const char *value, uint64_t *time) {
+    char *end;
+    double seconds = strtod(value, &end);
+    if (end == value || *end != '\0' || !(seconds >= 0 && seconds < 1.8e13)) {
+        return false;
+    }
+    *time = (uint64_t)(seconds * 1e6);
+    return true;
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            if (m_num_files == MAX_FILES) {
+                return false;
+            }
+            m_files[m_num_files++] = arg;
+            continue;
+        }
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--from") == 0) {
+            if (!parse_time(value, &m_from)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--to") == 0) {
+            if (!parse_time(value, &m_to)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--channel") == 0) {
+            int channel = atoi(value);
+            if (channel < 0 || channel > NUMBER_OF_THERMISTORS) {
+                return false;
+            }
+            m_slots |= 1ULL << (channel == 0 ? SLOTS_PER_PASS - 1 : channel - 1);
+        } else if (strcmp(arg, "--threshold") == 0) {
+            m_threshold = atof(value);
+        } else {
+            return false;
+        }
+    }
+    if (m_slots == 0) {
+        m_slots = (1ULL << SLOTS_PER_PASS) - 1;
+    }
+    return m_num_files > 0 && m_from <= m_to;
+}
+
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    SdLogReader *log = new SdLogReader();
+    SdLogBlock *block = new SdLogBlock();
+    SdLogStats stats[SLOTS_PER_PASS];
+    for (unsigned int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        sdlog_stats_reset(&stats[slot], m_threshold);
+    }
+
+    double start = seconds_now();
+    uint64_t frames = 0;
+    unsigned long segments = 0, bad_segments = 0;
+    for (int f = 0; f < m_num_files; f++) {
+        if (!sdlog_open(log, m_files[f])) {
+            fprintf(stderr, "%s\n", log->error);
+            continue;
+        }
+        frames += sdlog_scan(log, block, m_from, m_to, m_slots, stats);
+        segments += log->num_spans;
+        bad_segments += log->bad_segments;
+        sdlog_close(log);
+    }
+    double elapsed = seconds_now() - start;
+
+    printf("%-8s %10s %10s %9s %18s %9s %18s %9s", "Channel", "frames", "values", "min", "at", "max", "at", "mean");
+    if (!isnan(m_threshold)) {
+        printf(" %8s %8s %8s %18s", "above %", "rising", "falling", "first crossing");
+    }
+    printf("\n");
+    for (unsigned int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        const SdLogStats *s = &stats[slot];
+        if (!(m_slots & (1ULL << slot)) || s->frames == 0) {
+            continue;
+        }
+        char name[12];
+        if (slot == SLOTS_PER_PASS - 1) {
+            snprintf(name, sizeof(name), "ADC");
+        } else {
+            snprintf(name, sizeof(name), "T%u", slot + 1);
+        }
+        printf("%-8s %10llu %10llu", name, (unsigned long long)s->frames, (unsigned long long)s->values);
+        if (s->values == 0) {
+            printf("\n");
+            continue;
+        }
+        printf(" %9.3f", s->min);
+        print_time(s->min_time);
+        printf(" %9.3f", s->max);
+        print_time(s->max_time);
+        printf(" %9.3f", s->sum / s->values);
+        if (!isnan(m_threshold)) {
+            printf(" %8.2f %8llu %8llu", 100.0 * s->above / s->values, (unsigned long long)s->rising,
+                   (unsigned long long)s->falling);
+            if (s->rising + s->falling > 0) {
+                print_time(s->first_crossing);
+            }
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+    fprintf(stderr, "%llu frames scanned in %.3f s (%.1f M frames/s), %d files of %lu data segments",
+            (unsigned long long)frames, elapsed, elapsed > 0 ? frames / elapsed / 1e6 : 0, m_num_files, segments);
+    if (bad_segments > 0) {
+        fprintf(stderr, ", %lu segments failed their CRC or were cut short", bad_segments);
+    }
+    fprintf(stderr, "\n");
+    delete block;
+    delete log;
+    return 0;
+}
@@ -0,0 +1,615 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file sdlog_reader.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Host library for reading SD card logs and ingest tool files: the
+ * segment list, block decoding and the column scans.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "sdlog_reader.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "thermistorMux_crc.h"
+#include "thermistorMux_delta.h"
+
+static_assert(SLOTS_PER_PASS <= 64, "sdlog_scan() takes the slots as a 64 bit mask");
+
+// Lanes of the partial sums in the mean, so adding them up needs no reordering
+#define SUM_LANES 8
+
+
+static const uint8_t *segment_at(const SdLogReader *log, uint32_t n) {
+    return &log->map[(size_t)n * SDLOG_SEGMENT_SIZE];
+}
+
+
+/*
+Whether segment n is in place: in the file, numbered n, and of the kind magic.
+The pre-allocated tail of a file cut short by a power loss is zeros, so the
+list ends at the first segment out of place.
+*/
+static bool segment_in_place(const SdLogReader *log, uint32_t n, const char *magic) {
+    if (n >= log->segments) {
+        return false;
+    }
+    const uint8_t *segment = segment_at(log, n);
+    uint32_t number;
+    memcpy(&number, &segment[4], 4);
+    return number == n && memcmp(segment, magic, 4) == 0 && segment[11] == SDLOG_VERSION;
+}
+
+
+/*
+Copies segment n into raw and checks its CRC.
+*/
+static bool segment_intact(const SdLogReader *log, uint32_t n, uint8_t *raw) {
+    memcpy(raw, segment_at(log, n), SDLOG_SEGMENT_SIZE);
+    uint32_t crc;
+    memcpy(&crc, &raw[12], 4);
+    memset(&raw[12], 0, 4);
+    return crc == crc32(raw, SDLOG_SEGMENT_SIZE);
+}
+
+
+static bool add_span(SdLogReader *log, size_t *capacity, uint32_t segment, uint16_t frames, uint64_t first,
+                     uint64_t last) {
+    if (log->num_spans == *capacity) {
+        size_t grown = *capacity == 0 ? 1024 : *capacity * 2;
+        SdLogSpan *spans = (SdLogSpan *)realloc(log->spans, grown * sizeof(SdLogSpan));
+        if (spans == NULL) {
+            return false;
+        }
+        log->spans = spans;
+        *capacity = grown;
+    }
+    log->spans[log->num_spans++] = {segment, frames, first, last};
+    return true;
+}
+
+
+/*
+Lists the data segments: those before each intact index segment from its
+entries, the others (the last group, and any whose index is lost) from their
+own headers. An index segment isn't checked further than its CRC; a data
+segment is checked when it is read.
+*/
+static bool list_spans(SdLogReader *log) {
+    size_t capacity = 0;
+    uint8_t *raw = (uint8_t *)malloc(SDLOG_SEGMENT_SIZE);
+    if (raw == NULL) {
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t index = SDLOG_INDEX_INTERVAL; ok; index += SDLOG_INDEX_INTERVAL) {
+        if (segment_in_place(log, index, "TMXI") && segment_intact(log, index, raw)) {
+            uint16_t entries;
+            memcpy(&entries, &raw[8], 2);
+            for (uint16_t i = 0; ok && i < entries && i < SDLOG_INDEX_INTERVAL - 1; i++) {
+                const uint8_t *entry = &raw[SDLOG_HEADER_SIZE + i * SDLOG_INDEX_ENTRY_SIZE];
+                uint32_t segment;
+                uint16_t frames;
+                uint64_t first, last;
+                memcpy(&segment, &entry[0], 4);
+                memcpy(&frames, &entry[4], 2);
+                memcpy(&first, &entry[8], 8);
+                memcpy(&last, &entry[16], 8);
+                if (segment < log->segments) {
+                    ok = add_span(log, &capacity, segment, frames, first, last);
+                }
+            }
+            continue;
+        }
+        uint32_t segment = index - SDLOG_INDEX_INTERVAL + 1;
+        for (; ok && segment < index && segment_in_place(log, segment, "TMXD"); segment++) {
+            const uint8_t *header = segment_at(log, segment);
+            uint16_t frames;
+            uint64_t first, last;
+            memcpy(&frames, &header[8], 2);
+            memcpy(&first, &header[16], 8);
+            memcpy(&last, &header[24], 8);
+            ok = add_span(log, &capacity, segment, frames, first, last);
+        }
+        if (segment < index || index >= log->segments) {
+            break;
+        }
+        // A whole group, so its index was written and lost
+        log->bad_segments++;
+    }
+    free(raw);
+    return ok;
+}
+
+
+/*
+Maps the log file at path and lists its data segments. On failure the reason
+is in log->error.
+*/
+bool sdlog_open(SdLogReader *log, const char *path) {
+    memset(log, 0, sizeof(*log));
+    log->fd = open(path, O_RDONLY);
+    struct stat info;
+    if (log->fd < 0 || fstat(log->fd, &info) != 0) {
+        snprintf(log->error, sizeof(log->error), "%s: %s", path, strerror(errno));
+        sdlog_close(log);
+        return false;
+    }
+    log->size = (size_t)info.st_size;
+    log->segments = (uint32_t)(log->size / SDLOG_SEGMENT_SIZE);
+    if (log->segments > 0) {
+        void *map = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+        if (map == MAP_FAILED) {
+            snprintf(log->error, sizeof(log->error), "%s: %s", path, strerror(errno));
+            sdlog_close(log);
+            return false;
+        }
+        log->map = (const uint8_t *)map;
+        madvise(map, log->size, MADV_SEQUENTIAL);
+    }
+    uint8_t *header = (uint8_t *)malloc(SDLOG_SEGMENT_SIZE);
+    bool valid = header != NULL && segment_in_place(log, 0, "TMXH") && segment_intact(log, 0, header);
+    if (valid) {
+        log->columns = header[10];
+        log->node = header[40];
+        log->kind = header[41];
+        memcpy(log->firmware, &header[48], sizeof(log->firmware) - 1);
+    }
+    free(header);
+    if (!valid) {
+        snprintf(log->error, sizeof(log->error), "%s is not a version %d Thermistor Mux log", path, SDLOG_VERSION);
+        sdlog_close(log);
+        return false;
+    }
+    if (log->columns < 2 || log->columns > SLOTS_PER_PASS ||
+        (log->kind != SDLOG_COLUMNS_CODES && log->kind != SDLOG_COLUMNS_MDEG)) {
+        snprintf(log->error, sizeof(log->error), "%s: %u columns of kind %u can't be read", path, log->columns,
+                 log->kind);
+        sdlog_close(log);
+        return false;
+    }
+    if (!list_spans(log)) {
+        snprintf(log->error, sizeof(log->error), "%s: out of memory", path);
+        sdlog_close(log);
+        return false;
+    }
+    log->ordered = true;
+    for (size_t i = 0; i < log->num_spans; i++) {
+        if (log->spans[i].first > log->spans[i].last ||
+            (i > 0 && log->spans[i].first < log->spans[i - 1].last)) {
+            log->ordered = false;
+        }
+    }
+    make_thermistor_conversion(DEFAULT_SENSOR_MODEL, log->conversion);
+    return true;
+}
+
+
+void sdlog_close(SdLogReader *log) {
+    if (log->map != NULL) {
+        munmap((void *)log->map, log->size);
+        log->map = NULL;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+        log->fd = -1;
+    }
+    free(log->spans);
+    log->spans = NULL;
+    log->num_spans = 0;
+}
+
+
+/*
+The first span that might hold a frame at or after time: with the spans in
+time order, by a binary search of their last times, otherwise the first.
+*/
+size_t sdlog_seek(const SdLogReader *log, uint64_t time) {
+    if (!log->ordered) {
+        return 0;
+    }
+    size_t low = 0, high = log->num_spans;
+    while (low < high) {
+        size_t middle = low + ((high - low) / 2);
+        if (log->spans[middle].last < time) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+/*
+The file column of a scan slot, -1 if the file doesn't have it: thermistors
+from column 0, and the ADC temperature in the last.
+*/
+int sdlog_column(const SdLogReader *log, unsigned int slot) {
+    if (slot == SLOTS_PER_PASS - 1) {
+        return log->columns - 1;
+    }
+    return slot < (unsigned int)log->columns - 1 ? (int)slot : -1;
+}
+
+
+/*
+Puts a column's decoded values in range: codes sign extended, and SDLOG_NO_VALUE
+where a code has no temperature. Thermistor codes are sized as a working
+thermistor's, the ADC temperature's only have to be unsaturated.
+*/
+static void normalize_column(const SdLogReader *log, int32_t *values, size_t n, bool thermistor) {
+    if (log->kind != SDLOG_COLUMNS_CODES) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        int32_t code = sign_extend_code((uint32_t)values[i] & 0x00FFFFFF);
+        bool valid = thermistor ? (code > 0 && code < 0x007FFFFF) : !sign_extended_code_invalid(code);
+        values[i] = valid ? code : SDLOG_NO_VALUE;
+    }
+}
+
+
+/*
+Decodes span's data segment into block. Returns false, counting it bad, for a
+segment that fails its CRC or whose frames are cut short.
+*/
+bool sdlog_read_block(SdLogReader *log, size_t span, SdLogBlock *block) {
+    uint32_t segment = log->spans[span].segment;
+    block->segment = segment;
+    block->frames = 0;
+    if (!segment_in_place(log, segment, "TMXD") || !segment_intact(log, segment, block->raw)) {
+        log->bad_segments++;
+        return false;
+    }
+    uint16_t frames;
+    uint64_t time;
+    memcpy(&frames, &block->raw[8], 2);
+    memcpy(&time, &block->raw[16], 8);
+    if (frames > SDLOG_BLOCK_FRAMES) {
+        log->bad_segments++;
+        return false;
+    }
+    DeltaCoder coder;
+    delta_reset(&coder, time);
+    size_t pos = SDLOG_HEADER_SIZE;
+    for (uint16_t frame = 0; frame < frames; frame++) {
+        size_t n = delta_get_time(&coder, &block->raw[pos], SDLOG_SEGMENT_SIZE - pos, &block->time[frame]);
+        for (unsigned int column = 0; n > 0 && column < log->columns; column++) {
+            pos += n;
+            uint32_t code;
+            n = delta_get_code(&coder, &block->raw[pos], SDLOG_SEGMENT_SIZE - pos, column, &code);
+            unsigned int slot = column == (unsigned int)log->columns - 1 ? SLOTS_PER_PASS - 1 : column;
+            block->values[slot][frame] = (int32_t)code;
+        }
+        if (n == 0) {
+            log->bad_segments++;
+            return false;
+        }
+        pos += n;
+    }
+    block->frames = frames;
+    for (unsigned int column = 0; column < log->columns; column++) {
+        bool thermistor = column < (unsigned int)log->columns - 1;
+        normalize_column(log, block->values[thermistor ? column : SLOTS_PER_PASS - 1], frames, thermistor);
+    }
+    return true;
+}
+
+
+static bool thermistor_codes(const SdLogReader *log, unsigned int slot) {
+    return log->kind == SDLOG_COLUMNS_CODES && slot != SLOTS_PER_PASS - 1;
+}
+
+
+/*
+A decoded value of slot in °C, NAN for SDLOG_NO_VALUE.
+*/
+float sdlog_value_temp(const SdLogReader *log, unsigned int slot, int32_t value) {
+    if (value == SDLOG_NO_VALUE) {
+        return NAN;
+    }
+    if (log->kind == SDLOG_COLUMNS_MDEG) {
+        return value / 1000.0f;
+    }
+    if (slot == SLOTS_PER_PASS - 1) {
+        return (INTERNAL_TEMP_SCALE * (float)value) + INTERNAL_TEMP_OFFSET;
+    }
+    return thermistor_lut_temp(&log->conversion, value);
+}
+
+
+/*
+The block's values of slot in °C, into out (block->frames of them). Returns the
+number without a value, NAN in out.
+*/
+size_t sdlog_block_temps(const SdLogReader *log, const SdLogBlock *block, unsigned int slot, float *out) {
+    const int32_t *values = block->values[slot];
+    size_t n = block->frames;
+    if (thermistor_codes(log, slot)) {
+        return convert_code_block(&log->conversion, values, out, n);
+    }
+    size_t invalid = 0;
+    float scale = log->kind == SDLOG_COLUMNS_MDEG ? 0.001f : INTERNAL_TEMP_SCALE;
+    float offset = log->kind == SDLOG_COLUMNS_MDEG ? 0 : INTERNAL_TEMP_OFFSET;
+    for (size_t i = 0; i < n; i++) {
+        bool valid = values[i] != SDLOG_NO_VALUE;
+        out[i] = valid ? (scale * (float)values[i]) + offset : NAN;
+        invalid += !valid;
+    }
+    return invalid;
+}
+
+
+void sdlog_stats_reset(SdLogStats *stats, float threshold) {
+    memset(stats, 0, sizeof(*stats));
+    stats->min = NAN;
+    stats->max = NAN;
+    stats->threshold = threshold;
+    stats->state = -1;
+}
+
+
+/*
+The key of a value: the value, or for thermistor codes its negation, so keys go
+up with the temperature. SDLOG_NO_VALUE (INT32_MIN) negates to itself, and
+stays below every key.
+*/
+static void make_keys(const SdLogReader *log, unsigned int slot, const int32_t *values, int32_t *keys, size_t n) {
+    uint32_t flip = thermistor_codes(log, slot) ? 0xFFFFFFFF : 0;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = (int32_t)(((uint32_t)values[i] ^ flip) - flip);
+    }
+}
+
+
+static float key_temp(const SdLogReader *log, unsigned int slot, int32_t key) {
+    if (thermistor_codes(log, slot) && key != SDLOG_NO_VALUE) {
+        key = -key;
+    }
+    return sdlog_value_temp(log, slot, key);
+}
+
+
+/*
+The key over which a value is over the threshold, °C. A thermistor's is found
+by a binary search of its codes, whose temperatures only go down.
+*/
+static int32_t threshold_key(const SdLogReader *log, unsigned int slot, float threshold) {
+    if (thermistor_codes(log, slot)) {
+        int32_t low = 1, high = 0x007FFFFF;
+        while (low < high) {
+            int32_t middle = low + ((high - low) / 2);
+            if (thermistor_lut_temp(&log->conversion, middle) <= threshold) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return -low;
+    }
+    double value = log->kind == SDLOG_COLUMNS_MDEG ? threshold * 1000.0
+                                                   : (threshold - INTERNAL_TEMP_OFFSET) / INTERNAL_TEMP_SCALE;
+    value = floor(value);
+    if (value < INT32_MIN + 1.0) {
+        return INT32_MIN + 1;
+    }
+    return value > INT32_MAX ? INT32_MAX : (int32_t)value;
+}
+
+
+/*
+Index of the first of the n keys equal to key, n if there is none.
+*/
+static size_t find_key(const int32_t *keys, size_t n, int32_t key) {
+    size_t i = 0;
+    while (i < n && keys[i] != key) {
+        i++;
+    }
+    return i;
+}
+
+
+/*
+Counts the threshold crossings in n keys, carrying on from the last state. A
+column with every value there is counted in one pass without branches; one
+with gaps crosses between the values on either side of them.
+*/
+static void count_crossings(const SdLogBlock *block, const int32_t *keys, size_t n, size_t valid, int32_t threshold,
+                            SdLogStats *stats) {
+    uint64_t crossings = stats->rising + stats->falling;
+    int8_t state = stats->state;
+    if (valid == n) {
+        uint32_t rising = 0, falling = 0;
+        for (size_t i = 1; i < n; i++) {
+            uint32_t over = keys[i] > threshold;
+            uint32_t before = keys[i - 1] > threshold;
+            rising += over & (before ^ 1);
+            falling += before & (over ^ 1);
+        }
+        int8_t first = keys[0] > threshold;
+        if (state >= 0 && state != first) {
+            (first ? rising : falling)++;
+        }
+        stats->rising += rising;
+        stats->falling += falling;
+        stats->state = keys[n - 1] > threshold;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            if (keys[i] == SDLOG_NO_VALUE) {
+                continue;
+            }
+            int8_t over = keys[i] > threshold;
+            if (stats->state >= 0 && stats->state != over) {
+                (over ? stats->rising : stats->falling)++;
+            }
+            stats->state = over;
+        }
+    }
+    if (crossings > 0 || stats->rising + stats->falling == 0) {
+        return;
+    }
+    // The first crossing of all is in this block: found again
+    for (size_t i = 0; i < n; i++) {
+        if (keys[i] == SDLOG_NO_VALUE) {
+            continue;
+        }
+        int8_t over = keys[i] > threshold;
+        if (state >= 0 && state != over) {
+            stats->first_crossing = block->time[i];
+            return;
+        }
+        state = over;
+    }
+}
+
+
+/*
+Adds the block's n keys of slot, from frame 0, to stats.
+*/
+static void scan_keys(const SdLogReader *log, SdLogBlock *block, unsigned int slot, size_t n, SdLogStats *stats) {
+    const int32_t *keys = block->keys;
+    int32_t threshold = isnan(stats->threshold) ? INT32_MAX : threshold_key(log, slot, stats->threshold);
+    // The min is taken of the keys less INT32_MIN + 1, unsigned, which puts
+    // SDLOG_NO_VALUE above every key rather than picking it out
+    uint32_t low = UINT32_MAX;
+    int32_t high = INT32_MIN;
+    uint32_t valid = 0, above = 0;
+    for (size_t i = 0; i < n; i++) {
+        int32_t key = keys[i];
+        low = min(low, (uint32_t)key - 0x80000001);
+        high = max(high, key);
+        valid += key != SDLOG_NO_VALUE;
+        above += key > threshold;
+    }
+    stats->frames += n;
+    if (valid == 0) {
+        return;
+    }
+    stats->values += valid;
+    stats->above += above;
+
+    float coldest = key_temp(log, slot, (int32_t)(low + 0x80000001));
+    float hottest = key_temp(log, slot, high);
+    if (!(coldest >= stats->min)) {
+        stats->min = coldest;
+        stats->min_time = block->time[find_key(keys, n, (int32_t)(low + 0x80000001))];
+    }
+    if (!(hottest <= stats->max)) {
+        stats->max = hottest;
+        stats->max_time = block->time[find_key(keys, n, high)];
+    }
+
+    if (!thermistor_codes(log, slot)) {
+        // Linear in the value, so the mean is of the sum
+        int64_t sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += keys[i] != SDLOG_NO_VALUE ? keys[i] : 0;
+        }
+        float scale = log->kind == SDLOG_COLUMNS_MDEG ? 0.001f : INTERNAL_TEMP_SCALE;
+        float offset = log->kind == SDLOG_COLUMNS_MDEG ? 0 : INTERNAL_TEMP_OFFSET;
+        stats->sum += ((double)scale * sum) + ((double)offset * valid);
+    } else {
+        // A block's sum is well within a float; a NAN, no value, adds 0
+        sdlog_block_temps(log, block, slot, block->temps);
+        float lanes[SUM_LANES] = {};
+        size_t i = 0;
+        for (; i + SUM_LANES <= n; i += SUM_LANES) {
+            for (int lane = 0; lane < SUM_LANES; lane++) {
+                float temp = block->temps[i + lane];
+                lanes[lane] += temp == temp ? temp : 0.0f;
+            }
+        }
+        for (; i < n; i++) {
+            lanes[0] += block->temps[i] == block->temps[i] ? block->temps[i] : 0.0f;
+        }
+        for (int lane = 0; lane < SUM_LANES; lane++) {
+            stats->sum += lanes[lane];
+        }
+    }
+
+    if (!isnan(stats->threshold)) {
+        count_crossings(block, keys, n, valid, threshold, stats);
+    }
+}
+
+
+/*
+Leaves only the block's frames from from to to, in order.
+*/
+static void select_frames(SdLogBlock *block, uint64_t from, uint64_t to, uint64_t slots) {
+    size_t kept = 0;
+    for (size_t i = 0; i < block->frames; i++) {
+        if (block->time[i] < from || block->time[i] > to) {
+            continue;
+        }
+        block->time[kept] = block->time[i];
+        for (unsigned int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+            if (slots & (1ULL << slot)) {
+                block->values[slot][kept] = block->values[slot][i];
+            }
+        }
+        kept++;
+    }
+    block->frames = (uint16_t)kept;
+}
+
+
+/*
+Scans the log's frames from from to to (frame times) for the scan slots in
+slots, bit n for slot n, adding to stats[slot]. The data segments are decoded
+into block. Returns the frames scanned.
+*/
+uint64_t sdlog_scan(SdLogReader *log, SdLogBlock *block, uint64_t from, uint64_t to, uint64_t slots,
+                    SdLogStats *stats) {
+    uint64_t frames = 0;
+    for (unsigned int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        if (sdlog_column(log, slot) < 0) {
+            slots &= ~(1ULL << slot);
+        }
+    }
+    for (size_t span = sdlog_seek(log, from); span < log->num_spans; span++) {
+        const SdLogSpan *entry = &log->spans[span];
+        if (entry->first > to && log->ordered) {
+            break;
+        }
+        if (entry->last < from || entry->first > to || !sdlog_read_block(log, span, block) || block->frames == 0) {
+            continue;
+        }
+        if (block->time[0] < from || block->time[block->frames - 1] > to) {
+            select_frames(block, from, to, slots);
+        }
+        size_t n = block->frames;
+        if (n == 0) {
+            continue;
+        }
+        for (unsigned int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+            if (slots & (1ULL << slot)) {
+                make_keys(log, slot, block->values[slot], block->keys, n);
+                scan_keys(log, block, slot, n, &stats[slot]);
+            }
+        }
+        frames += n;
+    }
+    return frames;
+}
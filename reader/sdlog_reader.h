@@ -0,0 +1,120 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file sdlog_reader.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Host library for reading SD card logs and ingest tool files (format in
+ * thermistorMux_sdlog.h). A file is memory-mapped and its data segments listed
+ * from the index segments, without touching the data, so a time range is found
+ * by a binary search of the list. Each data segment is decoded into a block of
+ * columns, one array per scan slot, and sdlog_scan() keeps the min, max, mean
+ * and threshold crossings of the slots over a time range, in passes over the
+ * columns that the compiler vectorizes.
+ *
+ * Values are compared in a key per column that orders like the temperature (a
+ * thermistor's code goes down as it warms), so a block is scanned in integers
+ * and only its extremes are converted; thermistor means are converted a block at
+ * a time with convert_code_block(). Codes are converted with the firmware's
+ * default sensor model, uncalibrated, as in the replay tool.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef SDLOG_READER_H
+#define SDLOG_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thermistorMux_sdlog.h"
+#include "thermistorMux_conversion.h"
+
+// Most frames a data segment can hold: a byte of time and of each of two columns
+#define SDLOG_BLOCK_FRAMES      ((SDLOG_SEGMENT_SIZE - SDLOG_HEADER_SIZE) / 3)
+#define SDLOG_ERROR_SIZE        160
+
+// A data segment, from an index segment or its own header
+struct SdLogSpan {
+    uint32_t segment;
+    uint16_t frames;
+    uint64_t first;                             // Frame times
+    uint64_t last;
+};
+
+/*
+One data segment, decoded. values[slot] holds the column of a scan slot: the
+thermistors from 0, the ADC temperature at SLOTS_PER_PASS - 1. A value is a
+sign extended code or milli-degrees, as the file's kind, or SDLOG_NO_VALUE:
+unknown in an ingest file, or a code that can't be converted (saturated, or a
+thermistor code at or below 0).
+*/
+struct SdLogBlock {
+    uint32_t segment;
+    uint16_t frames;
+    uint64_t time[SDLOG_BLOCK_FRAMES];
+    int32_t values[SLOTS_PER_PASS][SDLOG_BLOCK_FRAMES];
+    int32_t keys[SDLOG_BLOCK_FRAMES];           // Scratch for sdlog_scan()
+    float temps[SDLOG_BLOCK_FRAMES];
+    uint8_t raw[SDLOG_SEGMENT_SIZE];
+};
+
+struct SdLogReader {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    uint32_t segments;                          // Whole segments in the file
+    uint8_t columns;
+    uint8_t kind;                               // SDLOG_COLUMNS_*
+    uint8_t node;
+    char firmware[33];
+    SdLogSpan *spans;                           // The data segments, in file order
+    size_t num_spans;
+    bool ordered;                               // Spans in time order, not overlapping
+    unsigned long bad_segments;                 // Found failing their CRC, or cut short
+    ThermistorConversion conversion;            // The default sensor model
+    char error[SDLOG_ERROR_SIZE];
+};
+
+/*
+A scan slot's figures over the frames scanned, in °C. Start it with
+sdlog_stats_reset(); sdlog_scan() adds to it, so it can run over several files.
+*/
+struct SdLogStats {
+    uint64_t frames;                            // Frames in the range
+    uint64_t values;                            // Of them with a value
+    double sum;                                 // Of the values, for the mean
+    float min;
+    float max;
+    uint64_t min_time;                          // First frame at the min and max
+    uint64_t max_time;
+    float threshold;                            // NAN to count no crossings
+    uint64_t above;                             // Values over the threshold
+    uint64_t rising;                            // Values over it after one not
+    uint64_t falling;
+    uint64_t first_crossing;                    // Time of the first, with rising or falling
+    int8_t state;                               // Last value over it (1), not (0), none yet (-1)
+};
+
+bool sdlog_open(SdLogReader *log, const char *path);
+void sdlog_close(SdLogReader *log);
+size_t sdlog_seek(const SdLogReader *log, uint64_t time);
+bool sdlog_read_block(SdLogReader *log, size_t span, SdLogBlock *block);
+int sdlog_column(const SdLogReader *log, unsigned int slot);
+float sdlog_value_temp(const SdLogReader *log, unsigned int slot, int32_t value);
+size_t sdlog_block_temps(const SdLogReader *log, const SdLogBlock *block, unsigned int slot, float *out);
+void sdlog_stats_reset(SdLogStats *stats, float threshold);
+uint64_t sdlog_scan(SdLogReader *log, SdLogBlock *block, uint64_t from, uint64_t to, uint64_t slots, SdLogStats *stats);
+
+#endif
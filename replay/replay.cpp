@@ -0,0 +1,593 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file replay.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Replay tool: re-publishes SD card logs and ingest tool captures (see
+ * thermistorMux_sdlog.h) as the NBIRTH and NDATA of simulated nodes, in real
+ * time, sped up, or as fast as the broker takes them.  As in the fleet
+ * simulator, each node is a process of its own running cf_sparkplug, with the
+ * firmware's topics and metric names.  Logged ADC codes are converted with the
+ * firmware's default sensor model; ingest captures are in milli-degrees
+ * already.  Node n plays file n modulo the number of files, so a few captures
+ * can drive a large fleet.
+ *
+ *     .pio/build/native_replay/program --broker 192.168.1.10 --speed 10 TMX00001.BIN
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "cf_sparkplug.h"
+#include "command_ADC.h"
+#include "native_sim.h"
+#include "../fleet/posix_client.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_delta.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_sdlog.h"
+
+#define GROUP_ID              "VI"              // As in thermistorMux_network.cpp
+#define NODE_ID_PREFIX        "THERMISTOR"
+#define TOPIC_SIZE            64
+#define MAX_FILES             64
+#define RECONNECT_MIN_MS      500
+#define RECONNECT_MAX_MS      16000
+
+// Replay settings, from the command line
+static const char *m_files[MAX_FILES];
+static int m_num_files = 0;
+static int m_nodes = 0;                         // 0 for one per file
+static int m_first_id = 0;
+static char m_host[128] = "localhost";
+static uint16_t m_port = 1883;
+static double m_speed = 1;                      // 0 as fast as possible
+static bool m_loop = false;
+static bool m_keep_times = false;
+static float m_deadband = 0;
+
+// What a node did, passed back to the parent through a pipe
+struct NodeStats {
+    unsigned long connects;
+    unsigned long births;
+    unsigned long frames;
+    unsigned long data;
+    unsigned long publish_failures;
+    unsigned long bad_segments;
+    unsigned long passes;                       // Times through the file
+};
+
+static volatile sig_atomic_t m_stop = 0;
+
+/*
+Node state.  A node is the only thing running in its process, so, as in the
+fleet simulator, it lives in file-scope variables.
+*/
+enum ReplayAlias {
+    RMA_bdSeq = 0,
+    RMA_Rebirth,
+    RMA_CommsVersion,
+    RMA_FirmwareVersion,
+    RMA_Units,
+    RMA_THERMISTOR1,
+    RMA_ADC_Temperature = RMA_THERMISTOR1 + NUMBER_OF_THERMISTORS,
+    RMA_End
+};
+
+static char m_node_id[16];
+static char m_birth_topic[TOPIC_SIZE];
+static char m_death_topic[TOPIC_SIZE];
+static char m_data_topic[TOPIC_SIZE];
+static char m_cmd_topic[TOPIC_SIZE];
+
+static uint64_t m_bdSeq = (uint64_t)-1;
+static bool m_rebirth = false;
+static bool m_rebirth_due = false;
+static uint64_t m_comms_version = COMMS_VERSION;
+static char m_firmware[48];
+static const char *m_firmware_version = m_firmware;
+static const char *m_units = "C";
+static float m_temps[NUMBER_OF_THERMISTORS];
+static float m_sent_temps[NUMBER_OF_THERMISTORS];
+static float m_ADC_temperature = NAN;
+static char m_names[NUMBER_OF_THERMISTORS][24];
+static uint64_t m_frame_ms = 0;                 // Timestamp of the frame being published
+
+static MetricSpec m_bdseq_metrics[] = {
+    metric_spec("bdSeq", RMA_bdSeq, false, METRIC_DATA_TYPE_INT64, &m_bdSeq),
+};
+static MetricSpec m_node_metrics[RMA_End - 1];
+
+static PosixClient m_client;
+static PubSubClient m_broker;
+static NodeStats m_stats;
+
+/*
+The log file being played: its header, and the data segment being read.
+*/
+struct LogFile {
+    FILE *file;
+    uint8_t columns;
+    uint8_t kind;                               // SDLOG_COLUMNS_*
+    uint32_t segment;                           // Segment in data
+    uint16_t frames;                            // Frames left in data
+    size_t pos;                                 // Next byte of data
+    DeltaCoder coder;
+    uint8_t data[SDLOG_SEGMENT_SIZE];
+};
+static LogFile m_log;
+
+
+static unsigned long long wall_micros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static unsigned long long frame_millis(void) {
+    return m_frame_ms;
+}
+
+
+/*
+Reads segment n of the log into its buffer, returning false at the end of the
+file or at a segment out of place, as the pre-allocated tail of a log cut short
+by a power loss is. intact is whether it passes its CRC.
+*/
+static bool read_segment(LogFile *log, uint32_t n, bool *intact) {
+    if (fseek(log->file, (long)n * SDLOG_SEGMENT_SIZE, SEEK_SET) != 0 ||
+        fread(log->data, SDLOG_SEGMENT_SIZE, 1, log->file) != 1) {
+        return false;
+    }
+    uint32_t number, crc;
+    memcpy(&number, &log->data[4], 4);
+    memcpy(&crc, &log->data[12], 4);
+    memset(&log->data[12], 0, 4);
+    if (number != n) {
+        return false;
+    }
+    *intact = log->data[11] == SDLOG_VERSION && crc == crc32(log->data, SDLOG_SEGMENT_SIZE);
+    return true;
+}
+
+
+static bool open_log(LogFile *log, const char *path) {
+    memset(log, 0, sizeof(*log));
+    log->file = fopen(path, "rb");
+    if (log->file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    bool intact;
+    if (!read_segment(log, 0, &intact) || !intact || memcmp(log->data, "TMXH", 4) != 0) {
+        fprintf(stderr, "%s is not a version %d Thermistor Mux log\n", path, SDLOG_VERSION);
+        return false;
+    }
+    log->columns = log->data[10];
+    log->kind = log->data[41];
+    if (log->columns < 2 || log->columns > SLOTS_PER_PASS ||
+        (log->kind != SDLOG_COLUMNS_CODES && log->kind != SDLOG_COLUMNS_MDEG)) {
+        fprintf(stderr, "%s: %u columns of kind %u can't be played\n", path, log->columns, log->kind);
+        return false;
+    }
+    snprintf(m_firmware, sizeof(m_firmware), "%.31s (replay)", (const char *)&log->data[48]);
+    log->segment = 0;
+    return true;
+}
+
+
+/*
+Reads the next frame of the log into time and values, going on to the next
+data segment as each runs out. Returns false at the end of the file.
+*/
+static bool next_frame(LogFile *log, uint64_t *time, uint32_t *values) {
+    while (log->frames == 0) {
+        bool intact;
+        if (!read_segment(log, ++log->segment, &intact)) {
+            return false;
+        }
+        if (!intact) {
+            m_stats.bad_segments++;
+            continue;
+        }
+        if (memcmp(log->data, "TMXD", 4) != 0) {
+            continue;
+        }
+        memcpy(&log->frames, &log->data[8], 2);
+        uint64_t first;
+        memcpy(&first, &log->data[16], 8);
+        delta_reset(&log->coder, first);
+        log->pos = SDLOG_HEADER_SIZE;
+    }
+    size_t n = delta_get_time(&log->coder, &log->data[log->pos], SDLOG_SEGMENT_SIZE - log->pos, time);
+    for (int slot = 0; n > 0 && slot < log->columns; slot++) {
+        log->pos += n;
+        n = delta_get_code(&log->coder, &log->data[log->pos], SDLOG_SEGMENT_SIZE - log->pos, slot, &values[slot]);
+    }
+    if (n == 0) {
+        // Cut short; the rest of the segment is lost
+        m_stats.bad_segments++;
+        log->frames = 0;
+        return next_frame(log, time, values);
+    }
+    log->pos += n;
+    log->frames--;
+    return true;
+}
+
+
+/*
+The frame's temperatures, into m_temps and m_ADC_temperature. The last column
+is the ADC temperature; a log of fewer thermistors than this build leaves the
+rest NAN, so they're never sent.
+*/
+static void convert_frame(const LogFile *log, const uint32_t *values) {
+    int channels = min(log->columns - 1, NUMBER_OF_THERMISTORS);
+    for (int i = channels; i < NUMBER_OF_THERMISTORS; i++) {
+        m_temps[i] = NAN;
+    }
+    uint32_t adc = values[log->columns - 1];
+    if (log->kind == SDLOG_COLUMNS_CODES) {
+        convert_thermistor_block(values, m_temps, channels);
+        convert_internal_block(&adc, &m_ADC_temperature, 1);
+        return;
+    }
+    for (int i = 0; i < channels; i++) {
+        m_temps[i] = (int32_t)values[i] == SDLOG_NO_VALUE ? NAN : (int32_t)values[i] / 1000.0f;
+    }
+    m_ADC_temperature = (int32_t)adc == SDLOG_NO_VALUE ? NAN : (int32_t)adc / 1000.0f;
+}
+
+
+static void set_up_node(int id) {
+    snprintf(m_node_id, sizeof(m_node_id), NODE_ID_PREFIX "%d", id);
+    snprintf(m_birth_topic, sizeof(m_birth_topic), NODE_TOPIC(NBIRTH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_death_topic, sizeof(m_death_topic), NODE_TOPIC(NDEATH_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_data_topic, sizeof(m_data_topic), NODE_TOPIC(NDATA_MESSAGE_TYPE, "%s"), m_node_id);
+    snprintf(m_cmd_topic, sizeof(m_cmd_topic), NODE_TOPIC(NCMD_MESSAGE_TYPE, "%s"), m_node_id);
+
+    MetricSpec properties[] = {
+        metric_spec("Node Control/Rebirth",              RMA_Rebirth,         true,  METRIC_DATA_TYPE_BOOLEAN, &m_rebirth),
+        metric_spec("Properties/Communications Version", RMA_CommsVersion,    false, METRIC_DATA_TYPE_INT64,   &m_comms_version),
+        metric_spec("Properties/Firmware Version",       RMA_FirmwareVersion, false, METRIC_DATA_TYPE_STRING,  &m_firmware_version),
+        metric_spec("Properties/Units",                  RMA_Units,           false, METRIC_DATA_TYPE_STRING,  &m_units),
+    };
+    memcpy(m_node_metrics, properties, sizeof(properties));
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        snprintf(m_names[i], sizeof(m_names[i]), "Inputs/THERMISTOR%d", i + 1);
+        m_node_metrics[RMA_THERMISTOR1 - 1 + i] = metric_spec(m_names[i], (unsigned int)(RMA_THERMISTOR1 + i), false,
+                                                              METRIC_DATA_TYPE_FLOAT, &m_temps[i]);
+        m_temps[i] = NAN;
+        m_sent_temps[i] = NAN;
+    }
+    m_node_metrics[RMA_ADC_Temperature - 1] = metric_spec("Inputs/ADC Internal Temperature", RMA_ADC_Temperature, false,
+                                                          METRIC_DATA_TYPE_FLOAT, &m_ADC_temperature);
+
+    set_gettimestamp_callback(frame_millis);
+    set_max_metrics(NUM_ELEM(m_bdseq_metrics) + NUM_ELEM(m_node_metrics));
+    if (!check_metrics(ARRAY_AND_SIZE(m_bdseq_metrics), RMA_bdSeq + 1) ||
+        !check_metrics(ARRAY_AND_SIZE(m_node_metrics), RMA_End)) {
+        fprintf(stderr, "%s: %s\n", m_node_id, sparkplug_error_text());
+        exit(1);
+    }
+}
+
+
+static bool connect_node() {
+    m_bdSeq++;
+    update_metric(ARRAY_AND_SIZE(m_bdseq_metrics), &m_bdSeq);
+    set_up_ndeath_payload();
+    m_frame_ms = wall_micros() / 1000;
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) || !connect(&m_broker, m_node_id, m_death_topic)) {
+        m_bdSeq--;
+        return false;
+    }
+    if (!m_broker.subscribe(m_cmd_topic)) {
+        m_client.drop();
+        return false;
+    }
+    return true;
+}
+
+
+static void publish_births() {
+    set_up_nbirth_payload();
+    if (!add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics)) ||
+        !publish_metrics(&m_broker, 1, m_birth_topic, true, ARRAY_AND_SIZE(m_node_metrics))) {
+        m_stats.publish_failures++;
+        return;
+    }
+    memcpy(m_sent_temps, m_temps, sizeof(m_temps));
+    m_stats.births++;
+}
+
+
+/*
+Publishes the frame in m_temps: the thermistors that moved by the deadband
+since they were last sent, and the ADC temperature when it changes.
+*/
+static void publish_frame() {
+    static float sent_ADC_temperature = NAN;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        if (!isnan(m_temps[i]) && !(fabsf(m_temps[i] - m_sent_temps[i]) < m_deadband)) {
+            update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_temps[i]);
+            m_sent_temps[i] = m_temps[i];
+        }
+    }
+    if (!isnan(m_ADC_temperature) && m_ADC_temperature != sent_ADC_temperature) {
+        update_metric(ARRAY_AND_SIZE(m_node_metrics), &m_ADC_temperature);
+        sent_ADC_temperature = m_ADC_temperature;
+    }
+    set_up_next_payload();
+    if (!add_metrics(false, ARRAY_AND_SIZE(m_node_metrics)) ||
+        !publish_payload(&m_broker, 1, m_data_topic)) {
+        if (sparkplug_error() != SPARKPLUG_NO_METRICS) {
+            m_stats.publish_failures++;
+        }
+        return;
+    }
+    m_stats.data++;
+}
+
+
+static void command_received(char *topic, byte *payload, unsigned int len) {
+    if (strcmp(topic, m_cmd_topic) != 0) {
+        return;
+    }
+    static CommandPayload command;
+    if (!decode_command_payload(payload, len, &command)) {
+        return;
+    }
+    for (unsigned int i = 0; i < command.metrics_count; i++) {
+        Metric *metric = &command.metrics[i];
+        MetricSpec *spec = find_received_metric(ARRAY_AND_SIZE(m_node_metrics), metric);
+        if (spec != NULL && spec->alias == RMA_Rebirth && metric->value.boolean_value) {
+            m_rebirth_due = true;
+        }
+    }
+}
+
+
+static void stop_requested(int signum) {
+    (void)signum;
+    m_stop = 1;
+}
+
+
+/*
+Keeps the broker connection up, reconnecting with a birth after a drop.
+Returns false while it's down.
+*/
+static bool service_broker() {
+    static uint32_t next_connect = 0;
+    static uint32_t backoff_ms = RECONNECT_MIN_MS;
+    if (!m_broker.connected()) {
+        uint32_t now = millis();
+        if ((int32_t)(now - next_connect) < 0) {
+            return false;
+        }
+        if (!connect_node()) {
+            next_connect = now + backoff_ms;
+            backoff_ms = min(backoff_ms * 2, (uint32_t)RECONNECT_MAX_MS);
+            return false;
+        }
+        m_stats.connects++;
+        backoff_ms = RECONNECT_MIN_MS;
+        m_rebirth_due = false;
+        publish_births();
+    }
+    m_broker.loop();
+    if (m_rebirth_due) {
+        m_rebirth_due = false;
+        publish_births();
+    }
+    return true;
+}
+
+
+/*
+Plays the node's file: each frame waits until its time in the log, divided by
+the speed, has passed since the start, and is then published with the wall
+clock time or, with --keep-times, its logged one. Logs that step back in time
+(history written as it arrived) publish those frames at once.
+*/
+static void run_node(int id, const char *path, int stats_fd) {
+    signal(SIGINT, stop_requested);
+    signal(SIGTERM, stop_requested);
+    set_up_node(id);
+    m_broker.setClient(m_client);
+    m_broker.setServer(m_host, m_port);
+    m_broker.setCallback(command_received);
+    m_broker.setBufferSize(MQTT_BUF_SIZE);
+
+    uint32_t values[SLOTS_PER_PASS];
+    bool opened = open_log(&m_log, path);
+    bool restart = true;
+    uint64_t first_log_us = 0;
+    uint64_t start_us = 0;
+    while (opened && !m_stop) {
+        uint64_t time;
+        if (!next_frame(&m_log, &time, values)) {
+            m_stats.passes++;
+            if (!m_loop || m_stats.frames == 0) {
+                break;
+            }
+            m_log.segment = 0;
+            m_log.frames = 0;
+            restart = true;
+            continue;
+        }
+        // Pace on the time without the unsynced flag
+        uint64_t log_us = time & ~SDLOG_LOCAL_TIME;
+        if (restart) {
+            first_log_us = log_us;
+            start_us = wall_micros();
+            restart = false;
+        }
+        if (m_speed > 0 && log_us > first_log_us) {
+            uint64_t due_us = start_us + (uint64_t)((log_us - first_log_us) / m_speed);
+            while (!m_stop && wall_micros() < due_us) {
+                service_broker();
+                usleep(min(due_us - wall_micros(), (uint64_t)500));
+            }
+        }
+        while (!m_stop && !service_broker()) {
+            usleep(1000);
+        }
+        convert_frame(&m_log, values);
+        m_frame_ms = m_keep_times && !(time & SDLOG_LOCAL_TIME) ? time / 1000 : wall_micros() / 1000;
+        publish_frame();
+        m_stats.frames++;
+    }
+    if (m_log.file != NULL) {
+        fclose(m_log.file);
+    }
+
+    if (m_broker.connected()) {
+        m_frame_ms = wall_micros() / 1000;
+        set_up_ndeath_payload();
+        add_metrics(true, ARRAY_AND_SIZE(m_bdseq_metrics));
+        disconnect(&m_broker, m_death_topic);
+    }
+    if (write(stats_fd, &m_stats, sizeof(m_stats)) != sizeof(m_stats)) {
+        perror("write");
+    }
+    close(stats_fd);
+}
+
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options] LOG_FILE...\n"
+            "  --broker HOST[:PORT]  MQTT broker (default localhost:1883)\n"
+            "  --nodes N             Nodes to play, node n the file n modulo the files (default one per file)\n"
+            "  --first-id N          Module ID of the first node (default 0)\n"
+            "  --speed X             X times real time, 0 as fast as possible (default 1)\n"
+            "  --loop                Play the files over until Ctrl-C\n"
+            "  --keep-times          Stamp the NDATA with the logged times instead of when they're sent\n"
+            "  --deadband C          Only send channels that moved by C since last sent (default 0)\n"
+            "LOG_FILE is an SD card log (TMXnnnnn.BIN) or an ingest tool capture.\n",
+            program);
+}
+
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            if (m_num_files == MAX_FILES) {
+                return false;
+            }
+            m_files[m_num_files++] = arg;
+            continue;
+        }
+        if (strcmp(arg, "--loop") == 0) {
+            m_loop = true;
+            continue;
+        }
+        if (strcmp(arg, "--keep-times") == 0) {
+            m_keep_times = true;
+            continue;
+        }
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return false;
+        }
+        i++;
+        if (strcmp(arg, "--broker") == 0) {
+            unsigned int port = m_port;
+            if (sscanf(value, "%127[^:]:%u", m_host, &port) < 1 || port == 0 || port > 65535) {
+                return false;
+            }
+            m_port = port;
+        } else if (strcmp(arg, "--nodes") == 0) {
+            m_nodes = atoi(value);
+        } else if (strcmp(arg, "--first-id") == 0) {
+            m_first_id = atoi(value);
+        } else if (strcmp(arg, "--speed") == 0) {
+            m_speed = atof(value);
+        } else if (strcmp(arg, "--deadband") == 0) {
+            m_deadband = atof(value);
+        } else {
+            return false;
+        }
+    }
+    if (m_nodes == 0) {
+        m_nodes = m_num_files;
+    }
+    return m_num_files > 0 && m_nodes > 0 && m_first_id >= 0 && m_speed >= 0 && m_deadband >= 0;
+}
+
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    sim_serial_quiet(true);
+    signal(SIGINT, SIG_IGN);   // Each node winds down on Ctrl-C itself
+
+    pid_t *pids = new pid_t[m_nodes];
+    int *fds = new int[m_nodes];
+    for (int n = 0; n < m_nodes; n++) {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        pids[n] = fork();
+        if (pids[n] == 0) {
+            close(pipe_fds[0]);
+            run_node(m_first_id + n, m_files[n % m_num_files], pipe_fds[1]);
+            _exit(0);
+        }
+        close(pipe_fds[1]);
+        fds[n] = pipe_fds[0];
+    }
+
+    NodeStats total = {};
+    fprintf(stderr, "%-14s %8s %8s %8s %8s %8s %8s %8s\n", "Node", "connects", "births", "frames", "data",
+            "pub fail", "bad segs", "passes");
+    for (int n = 0; n < m_nodes; n++) {
+        NodeStats stats = {};
+        if (read(fds[n], &stats, sizeof(stats)) != sizeof(stats)) {
+            fprintf(stderr, NODE_ID_PREFIX "%d: no statistics\n", m_first_id + n);
+        }
+        close(fds[n]);
+        waitpid(pids[n], NULL, 0);
+        fprintf(stderr, NODE_ID_PREFIX "%-4d %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", m_first_id + n,
+                stats.connects, stats.births, stats.frames, stats.data, stats.publish_failures,
+                stats.bad_segments, stats.passes);
+        total.connects += stats.connects;
+        total.births += stats.births;
+        total.frames += stats.frames;
+        total.data += stats.data;
+        total.publish_failures += stats.publish_failures;
+        total.bad_segments += stats.bad_segments;
+        total.passes += stats.passes;
+    }
+    fprintf(stderr, "%-14s %8lu %8lu %8lu %8lu %8lu %8lu %8lu\n", "Total", total.connects, total.births,
+            total.frames, total.data, total.publish_failures, total.bad_segments, total.passes);
+    delete[] pids;
+    delete[] fds;
+    return 0;
+}
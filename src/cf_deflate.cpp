@@ -0,0 +1,301 @@
+/**
+ * @file cf_deflate.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Small-footprint zlib (DEFLATE) compressor and decompressor for Sparkplug
+ * payloads.
+ * @version 1.0
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+
+#include "cf_deflate.h"
+#include <string.h>
+
+
+/*
+  Private variables
+*/
+
+#define HASH_BITS     12
+#define HASH_SIZE     (1 << HASH_BITS)
+#define MIN_MATCH     3
+#define MAX_MATCH     258
+#define WINDOW_SIZE   32768
+#define NO_POSITION   0xFFFF
+
+// Most recent input position of each 3-byte hash; the working buffer
+static uint16_t m_head[HASH_SIZE];
+
+// Base match lengths and distances of the DEFLATE length and distance codes,
+// with their extra bits
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+typedef struct
+{
+    uint8_t *out;
+    size_t   size;
+    size_t   pos;
+    uint32_t bits;        // Pending bits, LSB first
+    int      count;
+    bool     overflow;
+} BitWriter;
+
+
+static void put_bits(BitWriter *writer, uint32_t value, int count){
+    writer->bits |= value << writer->count;
+    writer->count += count;
+    while(writer->count >= 8){
+        if(writer->pos < writer->size)
+            writer->out[writer->pos++] = writer->bits & 0xFF;
+        else
+            writer->overflow = true;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+
+// Huffman codes go out most significant bit first, so are bit-reversed for
+// put_bits().
+static void put_code(BitWriter *writer, uint32_t code, int length){
+    uint32_t reversed = 0;
+    for(int i = 0; i < length; i++){
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    put_bits(writer, reversed, length);
+}
+
+
+// Write a literal/length symbol with the fixed Huffman code.
+static void put_symbol(BitWriter *writer, unsigned int symbol){
+    if(symbol < 144)
+        put_code(writer, 0x30 + symbol, 8);
+    else if(symbol < 256)
+        put_code(writer, 0x190 + symbol - 144, 9);
+    else if(symbol < 280)
+        put_code(writer, symbol - 256, 7);
+    else
+        put_code(writer, 0xC0 + symbol - 280, 8);
+}
+
+
+static void put_match(BitWriter *writer, unsigned int length, unsigned int distance){
+    int code = 28;
+    while(length_base[code] > length)
+        code--;
+    put_symbol(writer, 257 + code);
+    put_bits(writer, length - length_base[code], length_extra[code]);
+    code = 29;
+    while(distance_base[code] > distance)
+        code--;
+    put_code(writer, code, 5);
+    put_bits(writer, distance - distance_base[code], distance_extra[code]);
+}
+
+
+typedef struct
+{
+    const uint8_t *in;
+    size_t         size;
+    size_t         pos;
+    uint32_t       bits;        // Pending bits, LSB first
+    int            count;
+    bool           underflow;
+} BitReader;
+
+
+static uint32_t get_bits(BitReader *reader, int count){
+    while(reader->count < count){
+        if(reader->pos < reader->size)
+            reader->bits |= (uint32_t) reader->in[reader->pos++] << reader->count;
+        else
+            reader->underflow = true;
+        reader->count += 8;
+    }
+    uint32_t value = reader->bits & ((1u << count) - 1);
+    reader->bits >>= count;
+    reader->count -= count;
+    return value;
+}
+
+
+// Read a literal/length symbol of the fixed Huffman code, a bit at a time
+// most significant first.  Returns a value over 287 for a code that isn't one.
+static unsigned int get_symbol(BitReader *reader){
+    uint32_t code = 0;
+    for(int length = 1; length <= 9 && !reader->underflow; length++){
+        code = (code << 1) | get_bits(reader, 1);
+        if(length == 7 && code < 24)
+            return 256 + code;
+        if(length == 8 && code >= 0x30 && code < 0xC0)
+            return code - 0x30;
+        if(length == 8 && code >= 0xC0 && code < 0xC8)
+            return 280 + code - 0xC0;
+        if(length == 9 && code >= 0x190)
+            return 144 + code - 0x190;
+    }
+    return 288;
+}
+
+
+static uint32_t adler32(const uint8_t *data, size_t len){
+    uint32_t a = 1, b = 0;
+    for(size_t i = 0; i < len; i++){
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+
+static unsigned int hash3(const uint8_t *p){
+    uint32_t value = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+/*
+  Public functions
+*/
+
+size_t deflate_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size){
+    if(in_len > DEFLATE_MAX_INPUT || out_size < 6)
+        return 0;
+    BitWriter writer = {out, out_size - 4, 0, 0, 0, false};
+
+    // zlib header: deflate with a 32K window, fastest compression level
+    writer.out[writer.pos++] = 0x78;
+    writer.out[writer.pos++] = 0x01;
+    // One final block with the fixed codes
+    put_bits(&writer, 1, 1);
+    put_bits(&writer, 1, 2);
+
+    memset(m_head, 0xFF, sizeof(m_head));
+    size_t pos = 0;
+    while(pos < in_len && !writer.overflow){
+        unsigned int length = 0;
+        unsigned int distance = 0;
+        if(pos + MIN_MATCH <= in_len){
+            unsigned int hash = hash3(&in[pos]);
+            unsigned int candidate = m_head[hash];
+            m_head[hash] = pos;
+            if(candidate != NO_POSITION && pos - candidate <= WINDOW_SIZE){
+                size_t limit = in_len - pos;
+                if(limit > MAX_MATCH)
+                    limit = MAX_MATCH;
+                while(length < limit && in[candidate + length] == in[pos + length])
+                    length++;
+                distance = pos - candidate;
+            }
+        }
+        if(length >= MIN_MATCH){
+            put_match(&writer, length, distance);
+            // Hash the positions skipped over, so later matches can start there
+            for(size_t i = pos + 1; i < pos + length && i + MIN_MATCH <= in_len; i++)
+                m_head[hash3(&in[i])] = i;
+            pos += length;
+        }
+        else{
+            put_symbol(&writer, in[pos]);
+            pos++;
+        }
+    }
+    put_symbol(&writer, 256);
+    if(writer.count > 0)
+        put_bits(&writer, 0, 8 - writer.count);
+    if(writer.overflow)
+        return 0;
+
+    // Adler-32 of the input, most significant byte first
+    uint32_t adler = adler32(in, in_len);
+    for(int i = 3; i >= 0; i--)
+        out[writer.pos++] = (adler >> (8 * i)) & 0xFF;
+    return writer.pos;
+}
+
+
+size_t deflate_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size){
+    // zlib header: deflate, no preset dictionary, and the header check
+    if(in_len < 6 || (in[0] & 0x0F) != 8 || (in[1] & 0x20) != 0 || ((in[0] << 8) | in[1]) % 31 != 0)
+        return 0;
+    BitReader reader = {in, in_len - 4, 2, 0, 0, false};
+    size_t pos = 0;
+    bool last = false;
+    while(!last){
+        last = get_bits(&reader, 1);
+        uint32_t type = get_bits(&reader, 2);
+        if(type == 0){
+            // Stored: byte aligned LEN and its complement, then LEN bytes
+            reader.bits = 0;
+            reader.count = 0;
+            if(reader.pos + 4 > reader.size)
+                return 0;
+            uint16_t len = reader.in[reader.pos] | (reader.in[reader.pos + 1] << 8);
+            uint16_t nlen = reader.in[reader.pos + 2] | (reader.in[reader.pos + 3] << 8);
+            reader.pos += 4;
+            if((uint16_t) ~nlen != len || reader.pos + len > reader.size || pos + len > out_size)
+                return 0;
+            memcpy(&out[pos], &reader.in[reader.pos], len);
+            reader.pos += len;
+            pos += len;
+        }
+        else if(type == 1){
+            for(;;){
+                unsigned int symbol = get_symbol(&reader);
+                if(reader.underflow || symbol > 285)
+                    return 0;
+                if(symbol < 256){
+                    if(pos >= out_size)
+                        return 0;
+                    out[pos++] = symbol;
+                    continue;
+                }
+                if(symbol == 256)
+                    break;
+                unsigned int code = symbol - 257;
+                size_t length = length_base[code] + get_bits(&reader, length_extra[code]);
+                uint32_t distance_code = 0;
+                for(int i = 0; i < 5; i++)
+                    distance_code = (distance_code << 1) | get_bits(&reader, 1);
+                if(distance_code > 29)
+                    return 0;
+                size_t distance = distance_base[distance_code] + get_bits(&reader, distance_extra[distance_code]);
+                if(reader.underflow || distance > pos || pos + length > out_size)
+                    return 0;
+                // Byte by byte, as a match may overlap what it copies
+                for(size_t i = 0; i < length; i++, pos++)
+                    out[pos] = out[pos - distance];
+            }
+        }
+        else{
+            // Dynamic Huffman codes aren't read, nor are the reserved blocks
+            return 0;
+        }
+        if(reader.underflow)
+            return 0;
+    }
+
+    const uint8_t *check = &in[in_len - 4];
+    uint32_t adler = ((uint32_t) check[0] << 24) | (check[1] << 16) | (check[2] << 8) | check[3];
+    if(adler != adler32(out, pos))
+        return 0;
+    return pos;
+}
@@ -0,0 +1,39 @@
+/**
+ * @file cf_deflate.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Small-footprint zlib (DEFLATE) compressor and decompressor for Sparkplug
+ * payloads.
+ * @version 1.0
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef CF_DEFLATE_H
+#define CF_DEFLATE_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Largest input deflate_compress() takes; match positions are kept as 16 bits.
+#define DEFLATE_MAX_INPUT  65535
+
+
+// Compress in_len bytes into a zlib stream (RFC 1950) of one fixed Huffman
+// DEFLATE block (RFC 1951), as Python's zlib.decompress() and Java's Inflater
+// read.  Matches are found with a single-probe hash table in a static working
+// buffer, so nothing is allocated.  Returns the compressed length, or 0 if it
+// doesn't fit in out_size bytes or the input is too long.
+size_t deflate_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size);
+
+// Decompress a zlib stream of in_len bytes into out, checking its Adler-32.
+// Reads stored and fixed Huffman blocks, which is what deflate_compress()
+// writes, but not dynamic Huffman ones.  Returns the decompressed length, or 0
+// if the stream is malformed, uses dynamic codes or doesn't fit in out_size
+// bytes.
+size_t deflate_decompress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size);
+
+
+#endif
@@ -10,24 +10,103 @@
 
 
 #include "cf_sparkplug.h"
+#include "cf_deflate.h"
+#include <pb_encode.h>
+#include <math.h>
+#include <limits.h>
 
 
 /*
   Private variables
 */
 
-// Module error message, set when an error occurs
-char cf_sparkplug_error[MAX_CF_SPARKPLUG_ERROR_LEN] = "No error";
+// The last error, recorded as a code with the name and number it concerns so
+// that failing, which NDATA publishing does routinely, costs a few stores.  The
+// message is only formatted by sparkplug_error_text().
+#define NO_ERROR_NUMBER  LONG_MIN
+
+typedef struct
+{
+    SparkplugError  code;
+    const char     *what;     // Name, topic or detail; NULL for none
+    long            number;   // Alias, count, index...; NO_ERROR_NUMBER for none
+} ErrorState;
+
+#ifdef NATIVE_BUILD
+// Host tools decode on several threads at once, each reading its own errors
+static thread_local ErrorState m_error = {SPARKPLUG_OK, NULL, NO_ERROR_NUMBER};
+#else
+static ErrorState m_error = {SPARKPLUG_OK, NULL, NO_ERROR_NUMBER};
+#endif
+
+static const char * const m_error_messages[NUM_SPARKPLUG_ERRORS] = {
+    "No error",
+    "No metrics",
+    "Invalid call",
+    "No memory",
+    "Too many",
+    "No such metric",
+    "Bad metric",
+    "Metric datatype mismatch",
+    "Metric is read-only",
+    "Unsupported metric",
+    "Failed to encode",
+    "Too big",
+    "Outbound queue full",
+    "Failed to publish",
+    "Failed to connect",
+    "Malformed message"
+};
+
+
+// Record an error.  Always returns false, for returning straight from a
+// failing function.
+static bool set_error(SparkplugError code, const char *what, long number = NO_ERROR_NUMBER){
+    m_error.code = code;
+    m_error.what = what;
+    m_error.number = number;
+    return false;
+}
+
+
+static void clear_error(void){
+    m_error.code = SPARKPLUG_OK;
+}
 
 // Sparkplug variables
-static uint8_t encode_buffer[BIN_BUF_SIZE];  // Buffer to store encoded binary data for Sparkplug
+static uint8_t encode_buffer[BIN_BUF_SIZE];  // Buffer to store the encoded Will payload
+
+// Published payloads are encoded straight into the broker's network client.
+// nanopb writes a few bytes at a time, so writes are gathered into chunks of
+// this size first, the MQTT header leading the first one.
+#define STREAM_CHUNK_SIZE  MQTT_WRITE_SEGMENT
+
+// An MQTT PUBLISH fixed header, remaining length, topic and MQTT 5 properties
+#define PUBLISH_HEADER_SIZE(topic_size)  MQTT_PUBLISH_HEADER_SIZE(topic_size)
+
+typedef struct
+{
+    PubSubClient *broker;
+    size_t        used;
+    uint8_t       chunk[STREAM_CHUNK_SIZE];
+} BrokerStream;
+
+// The message sequence number (wraps at 255 back to 0) of the module payload.
+// Each broker carries on its own count from it, so a message one broker
+// doesn't take leaves no gap on the others: a queued broker's is its queue's
+// seq, and any other's is kept in m_broker_seqs.
+static uint8_t m_seq = 0;
 
-static uint8_t m_seq = 0;   // The message sequence number (wraps at 255 back to 0)
+static SocketWriteStats m_write_stats = {0, 0, 0};
+// Gathers a PUBLISH header with the start of its payload into one write
+static uint8_t m_segment[MQTT_WRITE_SEGMENT];
 
 // Module-level metrics and payload for publishing messages
 static unsigned int  m_max_metrics = 0;
 static Metric       *m_metrics = NULL;
+static bool          m_fixed_metrics = false;  // m_metrics is the caller's storage, not the heap
 static Payload       m_payload = org_eclipse_tahu_protobuf_Payload_init_default;
+static unsigned int  m_member_count = 0;  // Template member metrics, taken from the top of m_metrics
 
 
 // Default timestamp function that just returns zero.  Replace this by calling
@@ -40,6 +119,224 @@ unsigned long long null_timestamp(void){
 static GetTimestamp m_gettimestamp = null_timestamp;
 
 
+// Lookup index for a metrics array, built by check_metrics().  Aliases are
+// contiguous from first_alias, so by_alias is a direct table.  Variables and
+// names go through open-addressed hash tables of metric_hash_size() entries
+// holding metric index + 1 (0 = empty slot).  The dirty bitset has one bit per
+// alias, set for every updated metric, so add_metrics() only visits those.
+// Bits [stream_first, stream_end) span the streaming metrics; while changed is
+// clear, no other metric is pending, and only their words are looked at.
+#define MAX_METRIC_INDEXES   12   // Per-broker bdSeq tables, the node and its devices
+
+typedef struct
+{
+    MetricSpec   *metrics;
+    int           num_metrics;
+    unsigned int  first_alias;
+    MetricSpec  **by_alias;
+    uint16_t     *by_variable;
+    uint16_t     *by_name;
+    uint32_t     *dirty;
+    unsigned int  hash_mask;
+    unsigned int  stream_first;
+    unsigned int  stream_end;
+    bool          changed;      // An on-change metric is marked in dirty
+} MetricIndex;
+
+#define DIRTY_WORDS(n)  (((n) + 31) / 32)
+
+static_assert(sizeof(void *) != 4 || sizeof(MetricSpec) == 32,
+              "a MetricSpec fills one 32-byte cache line on the Teensy");
+
+static MetricIndex m_indexes[MAX_METRIC_INDEXES];
+static int         m_num_indexes = 0;
+
+
+// Smallest power of two that's at least twice the number of metrics
+static unsigned int metric_hash_size(int num_metrics){
+    unsigned int size = 4;
+    while(size < 2 * (unsigned) num_metrics)
+        size <<= 1;
+    return size;
+}
+
+
+static unsigned int hash_variable(void *variable){
+    // Multiplicative hash; the low bits are always zero for aligned variables
+    return ((uint32_t) ((uintptr_t) variable >> 2)) * 2654435761u;
+}
+
+
+static unsigned int hash_name(const char *name){
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while(*name != '\0'){
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Return the index built for the specified metrics array, or NULL if it
+// hasn't been indexed.
+static MetricIndex * get_metric_index(MetricSpec *metrics, int num_metrics){
+    for(int i = 0; i < m_num_indexes; i++)
+        if(m_indexes[i].metrics == metrics && m_indexes[i].num_metrics == num_metrics)
+            return &m_indexes[i];
+    return NULL;
+}
+
+
+static void free_metric_index(MetricIndex *index){
+    free(index->by_alias);
+    free(index->by_variable);
+    free(index->by_name);
+    free(index->dirty);
+    index->by_alias = NULL;
+    index->by_variable = NULL;
+    index->by_name = NULL;
+    index->dirty = NULL;
+}
+
+
+// Build (or rebuild) the lookup index for the specified metrics array.  The
+// metrics must already have been checked by check_metrics().  Returns false if
+// there's no memory for it, in which case lookups fall back to a linear scan.
+static bool build_metric_index(MetricSpec *metrics, int num_metrics,
+                               unsigned int first_alias){
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index == NULL){
+        if(m_num_indexes >= MAX_METRIC_INDEXES){
+            set_error(SPARKPLUG_TOO_MANY, "metric indexes", MAX_METRIC_INDEXES);
+            return false;
+        }
+        index = &m_indexes[m_num_indexes++];
+    }
+    else
+        free_metric_index(index);
+
+    unsigned int hash_size = metric_hash_size(num_metrics);
+    index->metrics = metrics;
+    index->num_metrics = num_metrics;
+    index->first_alias = first_alias;
+    index->hash_mask = hash_size - 1;
+    index->stream_first = num_metrics;
+    index->stream_end = 0;
+    index->changed = false;
+    index->by_alias = (MetricSpec **) calloc(num_metrics, sizeof(*index->by_alias));
+    index->by_variable = (uint16_t *) calloc(hash_size, sizeof(*index->by_variable));
+    index->by_name = (uint16_t *) calloc(hash_size, sizeof(*index->by_name));
+    index->dirty = (uint32_t *) calloc(DIRTY_WORDS(num_metrics), sizeof(*index->dirty));
+    if(index->by_alias == NULL || index->by_variable == NULL || index->by_name == NULL ||
+       index->dirty == NULL){
+        set_error(SPARKPLUG_NO_MEMORY, "metric index", num_metrics);
+        free_metric_index(index);
+        return false;
+    }
+
+    for(int idx = 0; idx < num_metrics; idx++){
+        MetricSpec *metric = &metrics[idx];
+        unsigned int bit = metric->alias - first_alias;
+        index->by_alias[bit] = metric;
+        if(metric->kind == METRIC_STREAMING){
+            index->stream_first = min(index->stream_first, bit);
+            index->stream_end = max(index->stream_end, bit + 1);
+        }
+        if(metric->updated){
+            index->dirty[bit / 32] |= 1ul << (bit % 32);
+            if(metric->kind != METRIC_STREAMING)
+                index->changed = true;
+        }
+
+        unsigned int slot = hash_variable(metric->variable) & index->hash_mask;
+        while(index->by_variable[slot] != 0)
+            slot = (slot + 1) & index->hash_mask;
+        index->by_variable[slot] = idx + 1;
+
+        slot = hash_name(metric->name) & index->hash_mask;
+        while(index->by_name[slot] != 0)
+            slot = (slot + 1) & index->hash_mask;
+        index->by_name[slot] = idx + 1;
+    }
+    if(index->stream_end == 0)
+        index->stream_first = 0;
+    return true;
+}
+
+
+// Mark the metric as having a pending update in the index's dirty bitset.
+static void mark_dirty(MetricIndex *index, MetricSpec *metric){
+    if(index == NULL || index->dirty == NULL)
+        return;
+    unsigned int bit = metric->alias - index->first_alias;
+    index->dirty[bit / 32] |= 1ul << (bit % 32);
+    if(metric->kind != METRIC_STREAMING)
+        index->changed = true;
+}
+
+
+// Indexed lookups.  Return NULL without setting an error if not found.
+static MetricSpec * index_find_alias(MetricIndex *index, unsigned int alias){
+    if(index->by_alias == NULL || alias < index->first_alias ||
+       alias - index->first_alias >= (unsigned) index->num_metrics)
+        return NULL;
+    return index->by_alias[alias - index->first_alias];
+}
+
+
+static MetricSpec * index_find_variable(MetricIndex *index, void *variable){
+    if(index->by_variable == NULL)
+        return NULL;
+    unsigned int slot = hash_variable(variable) & index->hash_mask;
+    while(index->by_variable[slot] != 0){
+        MetricSpec *metric = &index->metrics[index->by_variable[slot] - 1];
+        if(metric->variable == variable)
+            return metric;
+        slot = (slot + 1) & index->hash_mask;
+    }
+    return NULL;
+}
+
+
+static MetricSpec * index_find_name(MetricIndex *index, const char *name){
+    if(index->by_name == NULL)
+        return NULL;
+    unsigned int slot = hash_name(name) & index->hash_mask;
+    while(index->by_name[slot] != 0){
+        MetricSpec *metric = &index->metrics[index->by_name[slot] - 1];
+        if(strcmp(metric->name, name) == 0)
+            return metric;
+        slot = (slot + 1) & index->hash_mask;
+    }
+    return NULL;
+}
+
+
+// The error recorded by the last call that failed, or SPARKPLUG_OK.
+SparkplugError sparkplug_error(void){
+    return m_error.code;
+}
+
+
+// Format the last error as a message, for debug output.
+const char * sparkplug_error_text(void){
+#ifdef NATIVE_BUILD
+    static thread_local char text[MAX_CF_SPARKPLUG_ERROR_LEN];
+#else
+    static char text[MAX_CF_SPARKPLUG_ERROR_LEN];
+#endif
+    SparkplugError code = m_error.code < NUM_SPARKPLUG_ERRORS ? m_error.code : SPARKPLUG_INVALID;
+    if(code == SPARKPLUG_OK)
+        return m_error_messages[code];
+    size_t n = snprintf(text, sizeof(text), "%s", m_error_messages[code]);
+    if(m_error.what != NULL && n < sizeof(text))
+        n += snprintf(&text[n], sizeof(text) - n, ": %s", m_error.what);
+    if(m_error.number != NO_ERROR_NUMBER && n < sizeof(text))
+        snprintf(&text[n], sizeof(text) - n, m_error.what != NULL ? " %ld" : ": %ld", m_error.number);
+    return text;
+}
+
 // Set the callback function for getting a payload or metric timestamp.
 void set_gettimestamp_callback(GetTimestamp timestamp_function){
     if(timestamp_function != NULL)
@@ -48,8 +345,15 @@ void set_gettimestamp_callback(GetTimestamp timestamp_function){
 
 
 // Set the maximum number of metrics that will ever need to be sent in a single
-// payload.
-void set_max_metrics(unsigned int max_metrics){
+// payload.  With storage from set_metric_storage() the limit can't grow, so
+// asking for more fails.
+bool set_max_metrics(unsigned int max_metrics){
+    if(m_fixed_metrics){
+        if(max_metrics > m_max_metrics)
+            return set_error(SPARKPLUG_TOO_MANY, "metrics for the storage", m_max_metrics);
+        return true;
+    }
+
     // Adjust the size of the allocated memory to handle the specified number
     // of metrics
     m_max_metrics = max_metrics;
@@ -63,6 +367,20 @@ void set_max_metrics(unsigned int max_metrics){
     // Discard any metrics from the current payload beyond the new maximum
     if(m_payload.metrics_count > m_max_metrics)
         m_payload.metrics_count = m_max_metrics;
+    return true;
+}
+
+
+// Hold payload metrics in the caller's storage of max_metrics metrics from now
+// on, releasing any heap storage.
+void set_metric_storage(Metric *storage, unsigned int max_metrics){
+    if(!m_fixed_metrics)
+        free(m_metrics);
+    m_metrics = storage;
+    m_max_metrics = storage != NULL ? max_metrics : 0;
+    m_fixed_metrics = storage != NULL;
+    m_payload.metrics_count = 0;
+    m_member_count = 0;
 }
 
 
@@ -73,8 +391,7 @@ bool set_metric_variable(MetricSpec *metrics, int num_metrics,
                          unsigned int alias, void *variable){
     // Check the parameters are valid
     if(variable == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Null variable");
+        set_error(SPARKPLUG_INVALID, "Null variable");
         return false;
     }
 
@@ -86,21 +403,72 @@ bool set_metric_variable(MetricSpec *metrics, int num_metrics,
     // Found the metric - set its variable pointer to the specified address
     metric->variable = variable;
 
+    // Keep the variable index in step if the array has already been checked
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index != NULL)
+        build_metric_index(metrics, num_metrics, index->first_alias);
+
     // Success
     return true;
 }
 
 
+// Leave the metric with the specified alias out of (or put it back into) every
+// payload.  Returns false if no such metric exists.
+bool set_metric_disabled(MetricSpec *metrics, int num_metrics,
+                         unsigned int alias, bool disabled){
+    MetricSpec *metric = find_metric_by_alias(metrics, num_metrics, alias);
+    if(metric == NULL){
+        set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, alias);
+        return false;
+    }
+    // The metric comes into or goes out of the births
+    if(metric->disabled != disabled)
+        invalidate_birth_cache();
+    metric->disabled = disabled;
+    return true;
+}
+
+
+// Reached by a metric_spec() row built at run time for a variable of the wrong
+// type; the row it returns is empty.
+void metric_variable_type_mismatch(){
+    set_error(SPARKPLUG_TYPE_MISMATCH, "metric_spec() variable");
+}
+
+
+// Returns true if set_metric_value() can encode the datatype.
+static bool metric_datatype_supported(uint32_t datatype){
+    switch(datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+    case METRIC_DATA_TYPE_INT16:
+    case METRIC_DATA_TYPE_INT32:
+    case METRIC_DATA_TYPE_INT64:
+    case METRIC_DATA_TYPE_FLOAT:
+    case METRIC_DATA_TYPE_STRING:
+    case METRIC_DATA_TYPE_BYTES:
+    case METRIC_DATA_TYPE_INT32_ARRAY:
+    case METRIC_DATA_TYPE_FLOAT_ARRAY:
+    case METRIC_DATA_TYPE_TEMPLATE:
+    case METRIC_DATA_TYPE_DATASET:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
 // Make sure all the metrics in the given array have unique alias numbers in
-// the given range, have non-empty names, and have been linked to variables.
+// the given range, have non-empty names, have datatypes that can be sent, and
+// have been linked to variables.
 // Also, if necessary increase the maximum number of metrics that can be sent
-// in a single payload to the number of metrics in this array.
+// in a single payload to the number of metrics in this array.  The array is
+// then indexed for constant-time lookups.
 bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias){
     // Check the parameters are valid
     if(metrics == NULL || num_metrics <= 0){
         // Invalid metric array
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty metrics array");
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
         return false;
     }
 
@@ -109,8 +477,7 @@ bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias)
     unsigned int last_alias  = end_alias - 1;
     bool *alias_found = (bool *) calloc(num_metrics, sizeof(*alias_found));
     if(alias_found == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "No memory for %d alias_found entries", num_metrics);
+        set_error(SPARKPLUG_NO_MEMORY, "alias check", num_metrics);
         return false;
     }
 
@@ -119,31 +486,32 @@ bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias)
         MetricSpec *metric = &metrics[idx];
         if(metric->name == NULL || strcmp(metric->name, "") == 0){
             // This metric hasn't been given a valid name
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Empty name for metric #%d", idx);
+            set_error(SPARKPLUG_BAD_METRIC, "Empty name, metric #", idx);
             free(alias_found);
             return false;
         }
         if(metric->variable == NULL){
             // This metric hasn't been linked to a variable
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Null variable for metric #%d (%s)", idx, metric->name);
+            set_error(SPARKPLUG_BAD_METRIC, "Null variable, metric #", idx);
+            free(alias_found);
+            return false;
+        }
+        if(!metric_datatype_supported(metric->datatype)){
+            // Found now rather than on every publish
+            set_error(SPARKPLUG_UNSUPPORTED, metric->name, metric->datatype);
             free(alias_found);
             return false;
         }
         unsigned int alias_num = metric->alias;
         if(alias_num < first_alias || alias_num > last_alias){
             // Alias number is out of range
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Metric alias is out of range: %d [%d,%d]",
-                     alias_num, first_alias, last_alias);
+            set_error(SPARKPLUG_BAD_METRIC, "Alias out of range", alias_num);
             free(alias_found);
             return false;
         }
         if(alias_found[alias_num - first_alias]){
             // Alias number has already been used
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Metric alias has already been used: %d", alias_num);
+            set_error(SPARKPLUG_BAD_METRIC, "Alias already used", alias_num);
             free(alias_found);
             return false;
         }
@@ -152,11 +520,27 @@ bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias)
 
     free(alias_found);
 
+    // All alias numbers are valid and unique
+    return index_metrics(metrics, num_metrics, end_alias);
+}
+
+
+// Ready a metrics array that's already known to be valid, e.g. checked at
+// compile time: increase the maximum number of metrics in a payload if
+// necessary, and index the array.
+bool index_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias){
+    if(metrics == NULL || num_metrics <= 0){
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
+        return false;
+    }
+
     // Set aside enough memory to store at least this many metrics
-    if((unsigned) num_metrics > m_max_metrics)
-        set_max_metrics(num_metrics);
+    if((unsigned) num_metrics > m_max_metrics && !set_max_metrics(num_metrics))
+        return false;
 
-    // All alias numbers are valid and unique
+    // Index the array for constant-time lookups.  Not fatal if it fails;
+    // lookups on this array just fall back to a linear scan.
+    build_metric_index(metrics, num_metrics, end_alias - num_metrics);
     return true;
 }
 
@@ -168,20 +552,26 @@ MetricSpec * find_metric_by_alias(MetricSpec *metrics, int num_metrics,
     // Check the parameters are valid
     if(metrics == NULL || num_metrics <= 0){
         // Invalid metric array
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty metrics array");
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
         return NULL;
     }
 
-    for(int idx = 0; idx < num_metrics; idx++){
-        if(metrics[idx].alias == alias)
-            // Found it
-            return &metrics[idx];
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index != NULL && index->by_alias != NULL){
+        MetricSpec *metric = index_find_alias(index, alias);
+        if(metric != NULL)
+            return metric;
+    }
+    else{
+        for(int idx = 0; idx < num_metrics; idx++){
+            if(metrics[idx].alias == alias)
+                // Found it
+                return &metrics[idx];
+        }
     }
 
     // A metric with the specified alias wasn't in the metrics array
-    snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-             "No metric with alias %u", alias);
+    set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, alias);
     return NULL;
 }
 
@@ -193,98 +583,139 @@ MetricSpec * find_metric_by_variable(MetricSpec *metrics, int num_metrics,
     // Check the parameters are valid
     if(metrics == NULL || num_metrics <= 0){
         // Invalid metric array
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty metrics array");
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
         return NULL;
     }
     if(variable == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Null variable");
+        set_error(SPARKPLUG_INVALID, "Null variable");
         return NULL;
     }
 
-    for(int idx = 0; idx < num_metrics; idx++){
-        if(metrics[idx].variable == variable)
-            // Found it
-            return &metrics[idx];
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index != NULL && index->by_variable != NULL){
+        MetricSpec *metric = index_find_variable(index, variable);
+        if(metric != NULL)
+            return metric;
+    }
+    else{
+        for(int idx = 0; idx < num_metrics; idx++){
+            if(metrics[idx].variable == variable)
+                // Found it
+                return &metrics[idx];
+        }
     }
 
     // A metric with the specified variable wasn't in the metrics array
-    snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "No metric for variable");
+    set_error(SPARKPLUG_NO_SUCH_METRIC, "variable");
     return NULL;
 }
 
 
+// The value field a metric of the datatype is sent in, 0 for none a received
+// metric can carry
+static pb_size_t received_value_tag(uint32_t datatype){
+    switch(datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+        return org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag;
+    case METRIC_DATA_TYPE_INT16:
+    case METRIC_DATA_TYPE_INT32:
+        return org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+    case METRIC_DATA_TYPE_INT64:
+        return org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
+    case METRIC_DATA_TYPE_FLOAT:
+        return org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+    case METRIC_DATA_TYPE_STRING:
+        return org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
+    case METRIC_DATA_TYPE_BYTES:
+    case METRIC_DATA_TYPE_INT32_ARRAY:
+    case METRIC_DATA_TYPE_FLOAT_ARRAY:
+        return org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag;
+    default:
+        return 0;
+    }
+}
+
+
 // Return a pointer to the metric in the array that matches the received metric.
 // If the name is supplied, it is used to find a match.  Otherwise the alias is
 // used to find a match.  Returns NULL if no such metric exists, if the data
-// type doesn't match, or if the metric is read-only.
+// type doesn't match, if the metric is null or its value isn't in the field
+// its datatype uses, or if the metric is read-only.
 MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *metric){
     // Check the parameters are valid
     if(metrics == NULL || num_metrics <= 0){
         // Invalid metric array
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty metrics array");
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
         return NULL;
     }
     if(metric == NULL){
         // Invalid metric
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Null metric");
+        set_error(SPARKPLUG_INVALID, "Null metric");
         return NULL;
     }
     if(metric->name == NULL && !metric->has_alias){
         // Invalid metric
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "No name or alias for metric");
+        set_error(SPARKPLUG_INVALID, "No name or alias for metric");
         return NULL;
     }
 
     bool found = false;
-    int idx;
-    for(idx = 0; idx < num_metrics; idx++){
-        if(metric->name != NULL){
-            // The name was supplied - check to see if it matches
-            if(strcmp(metrics[idx].name, metric->name) == 0){
+    int idx = 0;
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index != NULL && index->by_alias != NULL){
+        // Name takes precedence; only use the alias if the name wasn't supplied
+        MetricSpec *match = metric->name != NULL ? index_find_name(index, metric->name)
+                                                 : index_find_alias(index, metric->alias);
+        if(match != NULL){
+            found = true;
+            idx = match - metrics;
+        }
+    }
+    else{
+        for(idx = 0; idx < num_metrics; idx++){
+            if(metric->name != NULL){
+                // The name was supplied - check to see if it matches
+                if(strcmp(metrics[idx].name, metric->name) == 0){
+                    found = true;
+                    break;
+                }
+            }
+            // Only check the alias if the name wasn't supplied
+            else if(metrics[idx].alias == metric->alias){
                 found = true;
                 break;
             }
         }
-        // Only check the alias if the name wasn't supplied
-        else if(metrics[idx].alias == metric->alias){
-            found = true;
-            break;
-        }
     }
 
     if(!found){
         // The metric wasn't in the metrics array
         if(metric->name != NULL)
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "No metric found with name \"%s\"", metric->name);
+            set_error(SPARKPLUG_NO_SUCH_METRIC, metric->name);
         else
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "No metric found with alias %u",
-                     (unsigned int) metric->alias);
+            set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, metric->alias);
         return NULL;
     }
 
     // Check that the data type matches
     if(metrics[idx].datatype != metric->datatype){
         // Datatype doesn't match
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Metric datatype mismatch for %s: received %u != expected %u",
-                 metrics[idx].name, (unsigned int) metric->datatype,
-                 (unsigned int) metrics[idx].datatype);
+        set_error(SPARKPLUG_TYPE_MISMATCH, metrics[idx].name, metric->datatype);
+        return NULL;
+    }
+
+    // Check that it has a value, of its datatype: the handlers read the value
+    // field as the spec's type, a string's pointer included
+    if(metric->which_value == 0 || metric->which_value != received_value_tag(metrics[idx].datatype)){
+        // Null, or the value in another field
+        set_error(SPARKPLUG_TYPE_MISMATCH, metrics[idx].name, metric->which_value);
         return NULL;
     }
 
     // Check that the metric is writable
     if(!metrics[idx].writable){
         // Metric is read-only
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Metric is read-only: %s", metrics[idx].name);
+        set_error(SPARKPLUG_READ_ONLY, metrics[idx].name);
         return NULL;
     }
 
@@ -301,151 +732,1116 @@ bool update_metric(MetricSpec *metrics, int num_metrics, void *variable){
     if(metric == NULL)
         // Couldn't find the specified metric
         return false;
+    if(metric->kind == METRIC_BIRTH_ONLY){
+        // Only ever sent in births
+        set_error(SPARKPLUG_READ_ONLY, "Birth-only metric", metric->alias);
+        return false;
+    }
 
     // Found the metric - mark it as updated and set its timestamp to now
     metric->updated = true;
     metric->timestamp = m_gettimestamp();
+    mark_dirty(get_metric_index(metrics, num_metrics), metric);
 
     // Success
     return true;
 }
 
 
-// Connect to the specified broker with the specified node ID and will topic
-// using the current module payload.  Returns true if successful, or false if
-// an error occurs.
-bool connect(PubSubClient *broker, const char *nodeId, const char *willTopic){
-    if(broker == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "connect() error: NULL broker");
-        return false;
+// Mark the count metrics with aliases starting at first_alias as updated, all
+// with the same timestamp.  If timestamp is zero the current time is used.
+// Returns false if any alias in the range doesn't exist; otherwise returns true.
+bool update_metric_range(MetricSpec *metrics, int num_metrics, unsigned int first_alias,
+                         unsigned int count, unsigned long long timestamp){
+    if(timestamp == 0)
+        timestamp = m_gettimestamp();
+
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(index == NULL || index->dirty == NULL){
+        // Not indexed - one lookup per metric
+        for(unsigned int alias = first_alias; alias < first_alias + count; alias++){
+            MetricSpec *metric = find_metric_by_alias(metrics, num_metrics, alias);
+            if(metric == NULL)
+                return false;
+            if(metric->kind == METRIC_BIRTH_ONLY){
+                set_error(SPARKPLUG_READ_ONLY, "Birth-only metric", alias);
+                return false;
+            }
+            metric->updated = true;
+            metric->timestamp = timestamp;
+        }
+        return true;
     }
 
-    // Include the current metrics list in the payload
-    m_payload.metrics = m_metrics;
-
-    // Encode the module payload to a buffer
-    sparkplugb_arduino_encoder encoder;
-    int msg_len = encoder.encode(&m_payload, encode_buffer, BIN_BUF_SIZE);
-    //### What is an invalid value for msg_len?
-    if(msg_len <= 0 || msg_len > BIN_BUF_SIZE){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Failed to encode Will payload: %d", msg_len);
+    if(first_alias < index->first_alias ||
+       first_alias + count > index->first_alias + (unsigned) num_metrics){
+        set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, first_alias + count - 1);
         return false;
     }
 
-    // Try to connect to the broker, registering the will message
-    if(!broker->connect(nodeId, willTopic, 0, false, encode_buffer, msg_len)){
-        // Can't connect
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Broker refused connection");
+    unsigned int bit = first_alias - index->first_alias;
+    unsigned int end = bit + count;
+    bool changed = false;
+    for(unsigned int i = bit; i < end; i++){
+        uint8_t kind = index->by_alias[i]->kind;
+        if(kind == METRIC_BIRTH_ONLY){
+            set_error(SPARKPLUG_READ_ONLY, "Birth-only metric", index->first_alias + i);
+            return false;
+        }
+        changed |= kind != METRIC_STREAMING;
+    }
+    for(unsigned int i = bit; i < end; i++){
+        MetricSpec *metric = index->by_alias[i];
+        metric->updated = true;
+        metric->timestamp = timestamp;
+    }
+    if(changed)
+        index->changed = true;
+
+    // Set the bits [bit, end) a word at a time
+    while(bit < end){
+        unsigned int word = bit / 32;
+        unsigned int shift = bit % 32;
+        unsigned int n = min(32 - shift, end - bit);
+        uint32_t mask = (n == 32) ? 0xFFFFFFFFul : (((1ul << n) - 1) << shift);
+        index->dirty[word] |= mask;
+        bit += n;
+    }
+    return true;
+}
+
+
+// Wire format tags: (field number << 3) | wire type
+#define WIRE_VARINT   0
+#define WIRE_LENGTH   2
+#define WIRE_FIXED64  1
+#define WIRE_FIXED32  5
+#define WIRE_TAG(field, type)  (((field) << 3) | (type))
+
+static size_t put_varint(uint8_t *out, uint64_t value, unsigned int width);
+static size_t varint_size(uint64_t value);
+
+
+// Plain payload encoder.  An NDATA message is a timestamp, a seq and a run of
+// metrics that each carry only an alias, timestamp, datatype, flags and a
+// scalar value, so it is written here field by field rather than through
+// nanopb's generic descriptor walk.  The bytes are the same as pb_encode()'s;
+// any other payload goes through pb_encode().
+#define PLAIN_METRIC_MAX_SIZE  48   // Tag, length and the largest plain metric body
+
+// Returns true if the metric has nothing the plain encoder doesn't handle.
+static bool plain_metric(const Metric *metric){
+    if(metric->name != NULL || metric->has_metadata || metric->has_properties)
+        return false;
+    switch(metric->which_value){
+    case 0:
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+    case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+    case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag:
+    case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+        return true;
+    default:
         return false;
     }
+}
 
-    // Success
+
+// Returns true if the payload and all its metrics can be plain encoded.
+static bool plain_payload(const Payload *payload){
+    if(payload->uuid != NULL || payload->body != NULL || payload->extensions != NULL)
+        return false;
+    for(pb_size_t i = 0; i < payload->metrics_count; i++)
+        if(!plain_metric(&payload->metrics[i]))
+            return false;
     return true;
 }
 
 
-// Disconnect from the current broker.  If finalTopic is specified, a final
-// message will be published before disconnecting using the specified topic and
-// the current module payload.
-//### Disconnect gracefully (no NDEATH) or abruptly (NDEATH published after timeout)?
-//### There doesn't appear to be any way in PubSubClient to break the
-//    connection without sending the MQTT_DISCONNECT message, so we may
-//    have to publish NDEATH explicitly.
-void disconnect(PubSubClient *broker, const char *finalTopic){
-    // Only disconnect if currently connected
-    if(broker != NULL && broker->connected()){
-        if(finalTopic != NULL)
-            // Publish the final message explicitly
-            publish_payload(broker, 1, finalTopic);
+// Append a varint field
+static size_t put_varint_field(uint8_t *out, unsigned int field, uint64_t value){
+    out[0] = WIRE_TAG(field, WIRE_VARINT);
+    return 1 + put_varint(&out[1], value, 0);
+}
 
-        // Disconnect gracefully from the broker
-        broker->disconnect();
+
+// Write the fields of a plain metric, in field number order as nanopb does.
+// At most PLAIN_METRIC_MAX_SIZE - 2 bytes.
+static size_t put_plain_metric_body(uint8_t *out, const Metric *metric){
+    size_t n = 0;
+    if(metric->has_alias)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_alias_tag, metric->alias);
+    if(metric->has_timestamp)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag, metric->timestamp);
+    if(metric->has_datatype)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag, metric->datatype);
+    if(metric->has_is_historical)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_is_historical_tag, metric->is_historical);
+    if(metric->has_is_transient)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_is_transient_tag, metric->is_transient);
+    if(metric->has_is_null)
+        n += put_varint_field(&out[n], org_eclipse_tahu_protobuf_Payload_Metric_is_null_tag, metric->is_null);
+
+    switch(metric->which_value){
+    case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+        n += put_varint_field(&out[n], metric->which_value, metric->value.int_value);
+        break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+        n += put_varint_field(&out[n], metric->which_value, metric->value.long_value);
+        break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+        n += put_varint_field(&out[n], metric->which_value, metric->value.boolean_value);
+        break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+        // Fixed-width fields are little-endian, as is the Cortex-M7
+        out[n++] = WIRE_TAG(metric->which_value, WIRE_FIXED32);
+        memcpy(&out[n], &metric->value.float_value, 4);
+        n += 4;
+        break;
+    case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag:
+        out[n++] = WIRE_TAG(metric->which_value, WIRE_FIXED64);
+        memcpy(&out[n], &metric->value.double_value, 8);
+        n += 8;
+        break;
     }
+    return n;
 }
 
 
-// Set up the module payload with default settings but no metrics.
-void set_up_next_payload(void){
-    m_payload.has_timestamp = true;
-    m_payload.timestamp = 0;      // Not assigned yet - set when publishing
-    m_payload.metrics_count = 0;  // Start off with no metrics
-    m_payload.has_seq = true;
-    m_payload.seq = m_seq;
+// Write a plain payload to the stream a field at a time.  Works on a sizing
+// stream too.
+static bool write_plain_payload(pb_ostream_t *ostream, const Payload *payload){
+    uint8_t field[PLAIN_METRIC_MAX_SIZE];
+    if(payload->has_timestamp){
+        size_t n = put_varint_field(field, org_eclipse_tahu_protobuf_Payload_timestamp_tag, payload->timestamp);
+        if(!pb_write(ostream, field, n))
+            return false;
+    }
+    for(pb_size_t i = 0; i < payload->metrics_count; i++){
+        // A plain metric body is always under 128 bytes, so its length is one byte
+        size_t n = put_plain_metric_body(&field[2], &payload->metrics[i]);
+        field[0] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_metrics_tag, WIRE_LENGTH);
+        field[1] = (uint8_t) n;
+        if(!pb_write(ostream, field, n + 2))
+            return false;
+    }
+    if(payload->has_seq){
+        size_t n = put_varint_field(field, org_eclipse_tahu_protobuf_Payload_seq_tag, payload->seq);
+        if(!pb_write(ostream, field, n))
+            return false;
+    }
+    return true;
 }
 
 
-// Set up the module payload for an NBIRTH message, with no metrics yet.
-void set_up_nbirth_payload(void){
-    // Reset the message sequence number for the NBIRTH message
-    m_seq = 0;
+// Encode the payload into the stream, plain encoded if it can be.
+static bool encode_to_stream(pb_ostream_t *ostream, const Payload *payload){
+    if(plain_payload(payload))
+        return write_plain_payload(ostream, payload);
+    return pb_encode(ostream, org_eclipse_tahu_protobuf_Payload_fields, payload);
+}
 
-    // Create NBIRTH payload
-    set_up_next_payload();
+
+// Work out the encoded size of the payload, as encode_to_stream() will write it.
+static bool encoded_size(size_t *size, const Payload *payload){
+    if(!plain_payload(payload))
+        return pb_get_encoded_size(size, org_eclipse_tahu_protobuf_Payload_fields, payload);
+    pb_ostream_t ostream = PB_OSTREAM_SIZING;
+    if(!write_plain_payload(&ostream, payload))
+        return false;
+    *size = ostream.bytes_written;
+    return true;
 }
 
 
-// Set up the module payload for an NDEATH message, with no metrics yet.
-void set_up_ndeath_payload(void){
-    // Create NDEATH payload
-    set_up_next_payload();
+// Encode the payload into buffer with the plain encoder, without going through
+// nanopb.  Returns the encoded length, or 0 if the payload isn't plain or
+// doesn't fit.
+size_t encode_plain_payload(const Payload *payload, uint8_t *buffer, size_t size){
+    if(!plain_payload(payload))
+        return 0;
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, size);
+    if(!write_plain_payload(&ostream, payload))
+        return 0;
+    return ostream.bytes_written;
+}
 
-    // The NDEATH payload has no seq number
-    m_payload.has_seq = false;
-    m_payload.seq = 0;
+
+// Write an MQTT PUBLISH fixed header (QoS 0, retained if asked), remaining length
+// and topic for a payload of payload_len bytes into header, which must hold
+// PUBLISH_HEADER_SIZE(strlen(topic)) bytes.  On an MQTT 5 connection the topic
+// is replaced by its alias once the broker has it.  Only build the header of a
+// publish that's then written, as the broker learns a new alias from it.
+// Returns its length.
+static size_t put_publish_header(PubSubClient *broker, uint8_t *header, const char *topic, size_t payload_len,
+                                 bool retained = false){
+    return broker->publishHeader(header, topic, payload_len, retained);
 }
 
 
-// Add the specified metric to the module payload.  If full is false, the
-// metric is only added if it has been updated; if full is true the metric is
-// added regardless and its name is included.  If the metric's timestamp is
-// zero it is set now.  Returns false if an error occurs; otherwise returns
-// true.
-bool add_metric_to_payload(bool full, MetricSpec *metric){
-    if(metric == NULL){
-        // No such metric
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error), "No metric");
-        return false;
-    }
+// One socket write of part of a PUBLISH, counted in the write statistics.
+static size_t write_segment(PubSubClient *broker, const uint8_t *data, size_t len){
+    size_t written = broker->write(data, len);
+    m_write_stats.writes++;
+    m_write_stats.bytes += written;
+    return written;
+}
 
-    if(metric->variable == NULL){
-        // No variable has been attached to this metric
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "No metric variable");
+
+// Publish a payload to the broker, blocking until it's all written: the header
+// and topic go out with the start of the payload, the rest in whole segments.
+// Returns false if the broker isn't connected or the client didn't take it all.
+static bool write_publish(PubSubClient *broker, const char *topic, const uint8_t *payload, size_t len){
+    if(!broker->connected() || PUBLISH_HEADER_SIZE(strlen(topic)) > MQTT_WRITE_SEGMENT)
         return false;
+    size_t used = put_publish_header(broker, m_segment, topic, len);
+    size_t first = MQTT_WRITE_SEGMENT - used;
+    if(first > len)
+        first = len;
+    memcpy(&m_segment[used], payload, first);
+    if(write_segment(broker, m_segment, used + first) != used + first)
+        return false;
+    for(size_t sent = first; sent < len; ){
+        size_t count = len - sent;
+        if(count > MQTT_WRITE_SEGMENT)
+            count = MQTT_WRITE_SEGMENT;
+        if(write_segment(broker, &payload[sent], count) != count)
+            return false;
+        sent += count;
     }
+    m_write_stats.publishes++;
+    return true;
+}
 
-    // Add this metric if we're adding the full metric or it has been updated
-    if(full || metric->updated){
-        if(m_metrics == NULL){
-            // No memory set aside for metrics?
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "No memory for metrics");
-            return false;
-        }
-        if(m_payload.metrics_count >= m_max_metrics){
-            // Payload is already full of metrics
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Too many metrics, > %d", m_max_metrics);
-            return false;
-        }
 
-        // The metric change is no longer pending
-        metric->updated = false;
+void socket_write_stats(SocketWriteStats *stats){
+    *stats = m_write_stats;
+    m_write_stats.publishes = 0;
+    m_write_stats.writes = 0;
+    m_write_stats.bytes = 0;
+}
 
-        // Set the metric timestamp if it hasn't been set
-        if(metric->timestamp == 0)
-            metric->timestamp = m_gettimestamp();
 
-        Metric *next_metric = &m_metrics[m_payload.metrics_count];
-        m_payload.metrics_count++;
+// Outbound queues.  Once a broker has been given one with
+// set_up_outbound_queue(), publishing only encodes the message into the queue;
+// drain_outbound_queues() then writes it out as the socket has room, so a full
+// TCP window never blocks loop().  Seq is assigned per broker as each message
+// starts going out, so a dropped NDATA doesn't leave a gap in the sequence.
+// With set_outbound_qos(1), NDATA/DDATA go at QoS 1 and stay queued once
+// written until the broker acks them, up to OUTBOUND_QOS1_WINDOW at a time, so
+// several are in flight at once rather than one per round trip.  Those not
+// acked when the connection drops are sent again after the births on
+// reconnecting, with a new seq.
+#define OUTBOUND_QUEUE_DEPTH  4
+#define OUTBOUND_QOS1_WINDOW  2     // Written but unacked messages; the rest of the queue takes new ones
+#define OUTBOUND_MSG_SIZE     8192  // Default message size: an NBIRTH or a batch of history
+#define OUTBOUND_TOPIC_SIZE   64
+#define MAX_OUTBOUND_QUEUES   4
+#define SEQ_FIELD_SIZE        3     // Tag and up to a 2-byte varint
+
+typedef struct
+{
+    char     topic[OUTBOUND_TOPIC_SIZE];
+    uint8_t  header[PUBLISH_HEADER_SIZE(OUTBOUND_TOPIC_SIZE)];
+    size_t   header_len;
+    uint8_t *data;        // The queue's message_size bytes
+    size_t   len;
+    size_t   sent;        // Bytes of header and data written to the broker so far
+    bool     started;     // The MQTT header has been built and taken the seq
+    bool     droppable;   // NDATA/DDATA; births and deaths are never dropped
+    bool     has_seq;     // Append the broker's next seq when starting
+    bool     reset_seq;   // NBIRTH: seq restarts from 0
+    uint8_t  qos;
+    uint16_t packet_id;   // QoS 1 packet identifier, taken when starting
+    size_t   body_len;    // len before the seq was appended
+    bool     dup;         // QoS 1 message that may have reached the broker before
+    bool     held;        // Kept over a reconnect: waits for the NBIRTH to go first
+    bool     retained;    // See publish_retained_payload()
+    unsigned long queued_ms;  // millis() when it was queued
+} OutboundMessage;
+
+typedef struct
+{
+    PubSubClient    *broker;
+    Client          *client;
+    OutboundMessage *slots;
+    uint8_t          order[OUTBOUND_QUEUE_DEPTH];  // Queued slots oldest first, then free ones
+    unsigned int     count;
+    unsigned int     unacked;   // Leading messages written and waiting for their PUBACK
+    unsigned int     peak;
+    unsigned long    dropped;
+    unsigned long    retransmitted;
+    unsigned long    latency_peak;  // Longest from queued to written, or acked at QoS 1, ms
+    uint8_t          seq;
+    size_t           message_size;  // Largest message a slot holds, seq included
+} OutboundQueue;
+
+static OutboundQueue  m_queues[MAX_OUTBOUND_QUEUES];
+static int            m_num_queues = 0;
+static OutboundPolicy m_outbound_policy = OUTBOUND_DROP_OLDEST;
+static uint8_t        m_outbound_qos = 0;
+static bool           m_split_part = false;  // Queuing the second or later part of a split payload
+static bool           m_retained = false;    // Publishing from publish_retained_payload()
+
+
+static OutboundQueue * get_outbound_queue(PubSubClient *broker){
+    for(int i = 0; i < m_num_queues; i++)
+        if(m_queues[i].broker == broker)
+            return &m_queues[i];
+    return NULL;
+}
 
-        // Include the metric name if the full metric is being added
-        if(full)
-            next_metric->name = (char *) metric->name;
-        else
+
+// The seq of a broker without an outbound queue
+typedef struct
+{
+    PubSubClient *broker;
+    uint8_t       seq;
+} BrokerSeq;
+
+#define MAX_BROKER_SEQS  4
+
+static BrokerSeq m_broker_seqs[MAX_BROKER_SEQS];
+static int       m_num_broker_seqs = 0;
+
+
+// The seq the broker's next message on topic carries, where the broker has no
+// outbound queue: an NBIRTH restarts it from 0.  A broker seen for the first
+// time starts from the module seq; past MAX_BROKER_SEQS brokers share it.  The
+// caller advances the seq once the message is published.
+static uint8_t * broker_seq(PubSubClient *broker, const char *topic){
+    uint8_t *seq = &m_seq;
+    for(int i = 0; i < m_num_broker_seqs && seq == &m_seq; i++)
+        if(m_broker_seqs[i].broker == broker)
+            seq = &m_broker_seqs[i].seq;
+    if(seq == &m_seq && m_num_broker_seqs < MAX_BROKER_SEQS){
+        BrokerSeq *entry = &m_broker_seqs[m_num_broker_seqs++];
+        entry->broker = broker;
+        entry->seq = m_seq;
+        seq = &entry->seq;
+    }
+    if(strstr(topic, "/" NBIRTH_MESSAGE_TYPE "/") != NULL)
+        *seq = 0;
+    return seq;
+}
+
+
+// Remove the message at position pos in the queue.
+static void remove_outbound(OutboundQueue *queue, unsigned int pos){
+    uint8_t slot = queue->order[pos];
+    for(unsigned int i = pos; i + 1 < queue->count; i++)
+        queue->order[i] = queue->order[i + 1];
+    queue->order[--queue->count] = slot;
+}
+
+
+// Give back a message just reserved that couldn't be filled in.
+static void unreserve_outbound(OutboundQueue *queue, const OutboundMessage *msg){
+    for(unsigned int pos = 0; pos < queue->count; pos++)
+        if(&queue->slots[queue->order[pos]] == msg){
+            remove_outbound(queue, pos);
+            return;
+        }
+}
+
+
+// Drop the oldest NDATA/DDATA that hasn't started going out, only one for the
+// specified topic unless it's NULL; coalescing leaves those held over a
+// reconnect, which have to get through.  Returns false if there's none.
+static bool drop_oldest_data(OutboundQueue *queue, const char *topic){
+    for(unsigned int pos = 0; pos < queue->count; pos++){
+        OutboundMessage *msg = &queue->slots[queue->order[pos]];
+        if(msg->droppable && !msg->started &&
+           (topic == NULL || (!msg->held && strcmp(msg->topic, topic) == 0))){
+            remove_outbound(queue, pos);
+            queue->dropped++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Header and data bytes of a queued message
+static inline size_t outbound_total(const OutboundMessage *msg){
+    return msg->header_len + msg->len;
+}
+
+
+// Start a message going out: append the broker's next seq, if it takes one,
+// and build its MQTT header.  An NBIRTH releases the messages held over from
+// the previous connection, which follow it.
+static void start_outbound(OutboundQueue *queue, OutboundMessage *msg){
+    msg->body_len = msg->len;
+    if(msg->has_seq){
+        if(msg->reset_seq)
+            queue->seq = 0;
+        msg->data[msg->len++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_seq_tag, WIRE_VARINT);
+        msg->len += put_varint(&msg->data[msg->len], queue->seq++, 0);
+    }
+    if(msg->qos > 0){
+        msg->packet_id = queue->broker->nextPacketId();
+        msg->header_len = queue->broker->publishHeader(msg->header, msg->topic, msg->len, false, msg->qos,
+                                                       msg->packet_id, msg->dup);
+        if(msg->dup)
+            queue->retransmitted++;
+    }
+    else
+        msg->header_len = put_publish_header(queue->broker, msg->header, msg->topic, msg->len, msg->retained);
+    msg->started = true;
+    if(msg->reset_seq)
+        for(unsigned int pos = 0; pos < queue->count; pos++)
+            queue->slots[queue->order[pos]].held = false;
+}
+
+
+// Note how long a message that's got through took from being queued.
+static void note_outbound_latency(OutboundQueue *queue, const OutboundMessage *msg){
+    unsigned long latency = millis() - msg->queued_ms;
+    if(latency > queue->latency_peak)
+        queue->latency_peak = latency;
+}
+
+
+// Done with the message being written once it's all gone: a QoS 1 one joins
+// the unacked messages, anything else leaves the queue.
+static void sent_outbound(OutboundQueue *queue){
+    OutboundMessage *msg = &queue->slots[queue->order[queue->unacked]];
+    if(msg->qos > 0 && msg->sent == outbound_total(msg))
+        queue->unacked++;
+    else{
+        if(msg->sent == outbound_total(msg))
+            note_outbound_latency(queue, msg);
+        remove_outbound(queue, queue->unacked);
+    }
+}
+
+
+static void finish_outbound(OutboundQueue *queue);
+static void drain_outbound_queue(OutboundQueue *queue);
+
+// Reserve a message at the back of the queue for the specified topic, making
+// room by writing out what the socket will take, then by dropping a queued
+// NDATA if necessary; so the NDATA and DDATA messages published together for
+// one frame don't push each other out.  A birth or death that finds nothing to
+// drop writes the oldest message out first, blocking, as it would have gone
+// without a queue; e.g. an NBIRTH followed by the DBIRTH of several devices.
+// Returns NULL if there's no room, counting the message as dropped if it's an
+// NDATA itself.
+static OutboundMessage * reserve_outbound(OutboundQueue *queue, const char *topic, bool has_seq){
+    if(strlen(topic) >= OUTBOUND_TOPIC_SIZE){
+        set_error(SPARKPLUG_TOO_BIG, topic);
+        return NULL;
+    }
+    bool droppable = strstr(topic, "/" NDATA_MESSAGE_TYPE "/") != NULL ||
+                     strstr(topic, "/" DDATA_MESSAGE_TYPE "/") != NULL;
+
+    // Coalescing keeps only the newest NDATA waiting, and the newest DDATA of
+    // each device, but not at the cost of earlier parts of the same payload
+    if(droppable && m_outbound_policy == OUTBOUND_COALESCE && !m_split_part)
+        drop_oldest_data(queue, topic);
+    if(queue->count == OUTBOUND_QUEUE_DEPTH && queue->broker->connected())
+        drain_outbound_queue(queue);
+    if(queue->count == OUTBOUND_QUEUE_DEPTH && !drop_oldest_data(queue, NULL) &&
+       !droppable && queue->broker->connected() && queue->unacked < queue->count){
+        OutboundMessage *oldest = &queue->slots[queue->order[queue->unacked]];
+        if(!oldest->started)
+            start_outbound(queue, oldest);
+        finish_outbound(queue);
+    }
+    if(queue->count == OUTBOUND_QUEUE_DEPTH){
+        if(droppable)
+            queue->dropped++;
+        set_error(SPARKPLUG_QUEUE_FULL, topic);
+        return NULL;
+    }
+
+    // A birth goes ahead of any messages held over from the previous
+    // connection, which mustn't reach the host before it
+    unsigned int pos = queue->count++;
+    if(!droppable)
+        while(pos > 0 && queue->slots[queue->order[pos - 1]].held){
+            uint8_t slot = queue->order[pos];
+            queue->order[pos] = queue->order[pos - 1];
+            queue->order[--pos] = slot;
+        }
+    OutboundMessage *msg = &queue->slots[queue->order[pos]];
+    if(queue->count > queue->peak)
+        queue->peak = queue->count;
+    strcpy(msg->topic, topic);
+    msg->header_len = 0;
+    msg->len = 0;
+    msg->sent = 0;
+    msg->started = false;
+    msg->droppable = droppable;
+    msg->has_seq = has_seq;
+    msg->reset_seq = strstr(topic, "/" NBIRTH_MESSAGE_TYPE "/") != NULL;
+    msg->qos = droppable ? m_outbound_qos : 0;
+    msg->dup = false;
+    msg->held = false;
+    msg->retained = m_retained;
+    msg->queued_ms = millis();
+    return msg;
+}
+
+
+// Write count more bytes of a started message, no more than are left.  While
+// any of the header is still to go it's gathered with the start of the data
+// into one write of up to MQTT_WRITE_SEGMENT bytes.  Returns the bytes written.
+static size_t write_outbound(OutboundQueue *queue, OutboundMessage *msg, size_t count){
+    size_t written;
+    if(msg->sent < msg->header_len){
+        if(count > MQTT_WRITE_SEGMENT)
+            count = MQTT_WRITE_SEGMENT;
+        size_t header = msg->header_len - msg->sent;
+        if(header > count)
+            header = count;
+        memcpy(m_segment, &msg->header[msg->sent], header);
+        memcpy(&m_segment[header], msg->data, count - header);
+        written = write_segment(queue->broker, m_segment, count);
+    }
+    else
+        written = write_segment(queue->broker, &msg->data[msg->sent - msg->header_len], count);
+    msg->sent += written;
+    if(msg->sent == outbound_total(msg))
+        m_write_stats.publishes++;
+    return written;
+}
+
+
+// Write the rest of a message that has started going out, blocking if
+// necessary, so nothing else is written to the broker in the middle of it.
+static void finish_outbound(OutboundQueue *queue){
+    if(queue->count == queue->unacked)
+        return;
+    OutboundMessage *msg = &queue->slots[queue->order[queue->unacked]];
+    if(msg->started){
+        while(msg->sent < outbound_total(msg) && queue->broker->connected()){
+            size_t count = outbound_total(msg) - msg->sent;
+            if(count > MQTT_WRITE_SEGMENT)
+                count = MQTT_WRITE_SEGMENT;
+            if(write_outbound(queue, msg, count) == 0)
+                break;
+        }
+        sent_outbound(queue);
+    }
+}
+
+
+// The broker has acked a QoS 1 message, so it leaves the queue.
+static void outbound_acked(PubSubClient *broker, uint16_t packet_id){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    if(queue == NULL)
+        return;
+    for(unsigned int pos = 0; pos < queue->unacked; pos++)
+        if(queue->slots[queue->order[pos]].packet_id == packet_id){
+            note_outbound_latency(queue, &queue->slots[queue->order[pos]]);
+            remove_outbound(queue, pos);
+            queue->unacked--;
+            return;
+        }
+}
+
+
+// Keep only the QoS 1 messages of a broker's queue over a reconnect, to be
+// sent again from the start with a new seq once the births have gone.  Those
+// that were started may have reached the broker, so go again as duplicates.
+static void hold_outbound(OutboundQueue *queue){
+    unsigned int pos = 0;
+    while(pos < queue->count){
+        OutboundMessage *msg = &queue->slots[queue->order[pos]];
+        if(msg->qos == 0){
+            remove_outbound(queue, pos);
+            continue;
+        }
+        if(msg->started){
+            msg->len = msg->body_len;
+            msg->header_len = 0;
+            msg->sent = 0;
+            msg->started = false;
+            msg->dup = true;
+        }
+        msg->held = true;
+        pos++;
+    }
+    queue->unacked = 0;
+}
+
+
+// Give the broker an outbound queue drained through its network client, with
+// slots of message_size bytes (OUTBOUND_MSG_SIZE if 0).
+bool set_up_outbound_queue(PubSubClient *broker, Client *client, size_t message_size){
+    if(broker == NULL || client == NULL){
+        set_error(SPARKPLUG_INVALID, "Null broker or client");
+        return false;
+    }
+    OutboundQueue *queue = get_outbound_queue(broker);
+    if(queue != NULL){
+        queue->client = client;
+        return true;
+    }
+    if(m_num_queues >= MAX_OUTBOUND_QUEUES){
+        set_error(SPARKPLUG_TOO_MANY, "outbound queues", MAX_OUTBOUND_QUEUES);
+        return false;
+    }
+
+    // Allocated once and kept, so it doesn't fragment the heap
+    if(message_size == 0)
+        message_size = OUTBOUND_MSG_SIZE;
+    queue = &m_queues[m_num_queues];
+    queue->slots = (OutboundMessage *) malloc(OUTBOUND_QUEUE_DEPTH * sizeof(*queue->slots));
+    uint8_t *data = (uint8_t *) malloc(OUTBOUND_QUEUE_DEPTH * message_size);
+    if(queue->slots == NULL || data == NULL){
+        free(queue->slots);
+        free(data);
+        set_error(SPARKPLUG_NO_MEMORY, "outbound queue", message_size);
+        return false;
+    }
+    for(int i = 0; i < OUTBOUND_QUEUE_DEPTH; i++)
+        queue->slots[i].data = &data[i * message_size];
+    queue->message_size = message_size;
+    queue->broker = broker;
+    queue->client = client;
+    for(int i = 0; i < OUTBOUND_QUEUE_DEPTH; i++)
+        queue->order[i] = i;
+    queue->count = 0;
+    queue->unacked = 0;
+    queue->peak = 0;
+    queue->dropped = 0;
+    queue->latency_peak = 0;
+    queue->retransmitted = 0;
+    queue->seq = 0;
+    broker->setAckCallback(outbound_acked);
+    m_num_queues++;
+    return true;
+}
+
+
+void set_outbound_policy(OutboundPolicy policy){
+    m_outbound_policy = policy;
+}
+
+
+// Messages queued from now on; those already queued keep theirs.
+void set_outbound_qos(uint8_t qos){
+    m_outbound_qos = qos > 0 ? 1 : 0;
+}
+
+
+// Write as much of the queued messages as the broker's socket will take
+// without blocking, stopping at a QoS 1 message while the unacked window is
+// full or at a held message until the NBIRTH is queued.
+static void drain_outbound_queue(OutboundQueue *queue){
+    while(queue->count > queue->unacked){
+        OutboundMessage *msg = &queue->slots[queue->order[queue->unacked]];
+        if(!msg->started){
+            if(msg->held || (msg->qos > 0 && queue->unacked >= OUTBOUND_QOS1_WINDOW))
+                break;
+            start_outbound(queue, msg);
+        }
+
+        int room = queue->client->availableForWrite();
+        if(room <= 0)
+            break;
+        size_t count = outbound_total(msg) - msg->sent;
+        if(count > (size_t) room){
+            // Whole segments only until the rest fits, rather than a short
+            // segment for every bit of room that opens up
+            count = room - room % MQTT_WRITE_SEGMENT;
+            if(count == 0)
+                break;
+        }
+        if(msg->sent < msg->header_len && count > MQTT_WRITE_SEGMENT)
+            count = MQTT_WRITE_SEGMENT;
+        size_t written = write_outbound(queue, msg, count);
+        if(msg->sent < outbound_total(msg)){
+            // Go round for the rest if the socket took it all
+            if(written < count)
+                break;
+            continue;
+        }
+        sent_outbound(queue);
+    }
+}
+
+
+// Write as much of the queued messages as each broker's socket will take
+// without blocking.  A broker's queue is discarded once it's disconnected,
+// but for QoS 1 messages; the births after reconnecting supersede it.
+void drain_outbound_queues(void){
+    for(int i = 0; i < m_num_queues; i++){
+        OutboundQueue *queue = &m_queues[i];
+        if(!queue->broker->connected()){
+            hold_outbound(queue);
+            continue;
+        }
+        drain_outbound_queue(queue);
+    }
+}
+
+
+bool outbound_in_flight(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    return queue != NULL && queue->count > queue->unacked && queue->slots[queue->order[queue->unacked]].started;
+}
+
+
+unsigned int outbound_queue_depth(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    return queue != NULL ? queue->count : 0;
+}
+
+
+unsigned int outbound_queue_peak(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    if(queue == NULL)
+        return 0;
+    unsigned int peak = queue->peak;
+    queue->peak = queue->count;
+    return peak;
+}
+
+
+unsigned long outbound_latency(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    if(queue == NULL)
+        return 0;
+    unsigned long latency = queue->latency_peak;
+    if(queue->count > 0){
+        unsigned long waiting = millis() - queue->slots[queue->order[0]].queued_ms;
+        if(waiting > latency)
+            latency = waiting;
+    }
+    queue->latency_peak = 0;
+    return latency;
+}
+
+
+unsigned long outbound_dropped(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    return queue != NULL ? queue->dropped : 0;
+}
+
+
+unsigned long outbound_retransmitted(PubSubClient *broker){
+    OutboundQueue *queue = get_outbound_queue(broker);
+    return queue != NULL ? queue->retransmitted : 0;
+}
+
+static bool publish_to_brokers(PubSubClient *broker_array, int num_brokers, const char *topic,
+                               bool use_queues);
+
+
+// Start connecting to the specified broker with the specified node ID and
+// will topic using the current module payload.  Returns true once the CONNECT
+// packet is sent, or false if an error occurs.
+bool begin_connect(PubSubClient *broker, const char *nodeId, const char *willTopic){
+    if(broker == NULL){
+        set_error(SPARKPLUG_INVALID, "Null broker");
+        return false;
+    }
+
+    // Include the current metrics list in the payload
+    m_payload.metrics = m_metrics;
+
+    // Encode the module payload to a buffer
+    sparkplugb_arduino_encoder encoder;
+    int msg_len = encoder.encode(&m_payload, encode_buffer, BIN_BUF_SIZE);
+    //### What is an invalid value for msg_len?
+    if(msg_len <= 0 || msg_len > BIN_BUF_SIZE){
+        set_error(SPARKPLUG_ENCODE_FAILED, "Will payload");
+        return false;
+    }
+
+    // Try to connect to the broker, registering the will message
+    if(!broker->startConnect(nodeId, NULL, NULL, willTopic, 0, false, encode_buffer,
+                             msg_len, true)){
+        // Can't connect
+        set_error(SPARKPLUG_CONNECT_FAILED, "Can't reach broker", broker->state());
+        return false;
+    }
+    return true;
+}
+
+
+// Check on a connection started with begin_connect().  Returns 1 once the
+// broker has accepted it, 0 while still waiting, or -1 if it failed.
+int poll_connect(PubSubClient *broker){
+    int state = broker->pollConnect();
+    if(state == MQTT_CONNECTING)
+        return 0;
+    if(state != MQTT_CONNECTED){
+        set_error(SPARKPLUG_CONNECT_FAILED, "Broker refused connection", state);
+        return -1;
+    }
+
+    // Anything still queued belongs to the previous session, and only QoS 1
+    // messages are kept for it
+    OutboundQueue *queue = get_outbound_queue(broker);
+    if(queue != NULL)
+        hold_outbound(queue);
+
+    // Success
+    return 1;
+}
+
+
+// Connect to the specified broker with the specified node ID and will topic
+// using the current module payload.  Returns true if successful, or false if
+// an error occurs.
+bool connect(PubSubClient *broker, const char *nodeId, const char *willTopic){
+    if(!begin_connect(broker, nodeId, willTopic))
+        return false;
+    int result;
+    while((result = poll_connect(broker)) == 0)
+        ;
+    return result > 0;
+}
+
+
+// Disconnect from the current broker.  If finalTopic is specified, a final
+// message will be published before disconnecting using the specified topic and
+// the current module payload.
+//### Disconnect gracefully (no NDEATH) or abruptly (NDEATH published after timeout)?
+//### There doesn't appear to be any way in PubSubClient to break the
+//    connection without sending the MQTT_DISCONNECT message, so we may
+//    have to publish NDEATH explicitly.
+void disconnect(PubSubClient *broker, const char *finalTopic){
+    // Only disconnect if currently connected
+    if(broker != NULL && broker->connected()){
+        // Finish any message that's partly written and discard the rest of
+        // the queue, then publish the final message straight away
+        OutboundQueue *queue = get_outbound_queue(broker);
+        if(queue != NULL){
+            finish_outbound(queue);
+            queue->count = 0;
+            queue->unacked = 0;
+        }
+        if(finalTopic != NULL){
+            // Publish the final message explicitly
+            m_payload.metrics = m_metrics;
+            publish_to_brokers(broker, 1, finalTopic, false);
+        }
+
+        // Disconnect gracefully from the broker
+        broker->disconnect();
+    }
+}
+
+
+// Set up the module payload with default settings but no metrics.
+void set_up_next_payload(void){
+    m_payload.has_timestamp = true;
+    m_payload.timestamp = 0;      // Not assigned yet - set when publishing
+    m_payload.metrics_count = 0;  // Start off with no metrics
+    m_member_count = 0;
+    m_payload.has_seq = true;
+    m_payload.seq = m_seq;
+}
+
+
+// Set up the module payload for an NBIRTH message, with no metrics yet.
+void set_up_nbirth_payload(void){
+    // Reset the message sequence number for the NBIRTH message
+    m_seq = 0;
+
+    // Create NBIRTH payload
+    set_up_next_payload();
+}
+
+
+// Set up the module payload for an NDEATH message, with no metrics yet.
+void set_up_ndeath_payload(void){
+    // Create NDEATH payload
+    set_up_next_payload();
+
+    // The NDEATH payload has no seq number
+    m_payload.has_seq = false;
+    m_payload.seq = 0;
+}
+
+
+static bool set_metric_value(Metric *next_metric, MetricSpec *metric, void *variable, bool full);
+
+// Set the Template value of the payload metric: a definition or an instance,
+// with a member metric for each member that has been updated (every member if
+// full is true).  Member metrics carry names but no aliases and are taken from
+// the top of the payload metric storage.  Returns false if there isn't room
+// for them or a member can't be encoded.
+static bool set_template_value(Metric *next_metric, MetricTemplate *templ, bool full){
+    org_eclipse_tahu_protobuf_Payload_Template *value = &next_metric->value.template_value;
+    next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_template_value_tag;
+    memset(value, 0, sizeof(*value));
+    value->template_ref = (char *) templ->template_ref;
+    value->has_is_definition = true;
+    value->is_definition = templ->template_ref == NULL;
+
+    unsigned int count = 0;
+    for(unsigned int i = 0; i < templ->num_members; i++)
+        if(full || templ->members[i].updated)
+            count++;
+    if(m_payload.metrics_count + m_member_count + count > m_max_metrics){
+        set_error(SPARKPLUG_TOO_MANY, "metrics with template members", m_max_metrics);
+        return false;
+    }
+    unsigned int first_member = m_member_count;
+    m_member_count += count;
+    value->metrics = &m_metrics[m_max_metrics - m_member_count];
+    value->metrics_count = count;
+
+    Metric *member_metric = value->metrics;
+    for(unsigned int i = 0; i < templ->num_members; i++){
+        MetricSpec *member = &templ->members[i];
+        if(!full && !member->updated)
+            continue;
+        member->updated = false;
+        memset(member_metric, 0, sizeof(*member_metric));
+        member_metric->name = (char *) member->name;
+        member_metric->has_datatype = true;
+        member_metric->datatype = member->datatype;
+        if(!set_metric_value(member_metric, member, member->variable, full)){
+            m_member_count = first_member;
+            return false;
+        }
+        member_metric++;
+    }
+    return true;
+}
+
+
+// Set the value of the payload metric from the variable, according to the
+// datatype of the metric spec.  A NaN float, an INT16_MIN Int16 or an INT32_MIN
+// Int32 is sent as a null metric.  full is passed on to a Template's members.  Returns false if
+// the datatype isn't supported.
+static bool set_metric_value(Metric *next_metric, MetricSpec *metric, void *variable, bool full){
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag;
+        next_metric->value.boolean_value = *(bool *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_INT16:
+        if(*(int16_t *) variable == INT16_MIN){
+            next_metric->which_value = 0;
+            next_metric->has_is_null = true;
+            next_metric->is_null = true;
+            break;
+        }
+        // As its own 16-bit two's complement, at most 3 bytes; a decoder taking
+        // int_value as an Int16 reads it the same as the sign extended form
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+        next_metric->value.int_value = (uint16_t) *(int16_t *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_INT32:
+        if(*(int32_t *) variable == INT32_MIN){
+            next_metric->which_value = 0;
+            next_metric->has_is_null = true;
+            next_metric->is_null = true;
+            break;
+        }
+        // Sparkplug carries Int32 as its two's complement in int_value
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag;
+        next_metric->value.int_value = (uint32_t) *(int32_t *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_INT64:
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
+        next_metric->value.long_value = *(uint64_t *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_FLOAT:
+        // NaN marks a value that couldn't be read; send it as null
+        if(isnan(*(float *) variable)){
+            next_metric->which_value = 0;
+            next_metric->has_is_null = true;
+            next_metric->is_null = true;
+            break;
+        }
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+        next_metric->value.float_value = *(float *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_STRING:
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
+        next_metric->value.string_value = *(char **) variable;
+        break;
+
+    case METRIC_DATA_TYPE_BYTES:
+    case METRIC_DATA_TYPE_INT32_ARRAY:
+    case METRIC_DATA_TYPE_FLOAT_ARRAY:
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag;
+        next_metric->value.bytes_value = (pb_bytes_array_t *) variable;
+        break;
+
+    case METRIC_DATA_TYPE_TEMPLATE:
+        return set_template_value(next_metric, (MetricTemplate *) variable, full);
+
+    case METRIC_DATA_TYPE_DATASET:
+        next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_dataset_value_tag;
+        next_metric->value.dataset_value = *(DataSet *) variable;
+        break;
+
+    default:
+        // Unsupported type
+        set_error(SPARKPLUG_UNSUPPORTED, NULL, metric->datatype);
+        return false;
+    }
+    return true;
+}
+
+
+// Add the specified metric to the module payload.  If full is false, the
+// metric is only added if it has been updated; if full is true the metric is
+// added regardless and its name is included.  If the metric's timestamp is
+// zero it is set now.  Returns false if an error occurs; otherwise returns
+// true.
+bool add_metric_to_payload(bool full, MetricSpec *metric){
+    if(metric == NULL){
+        // No such metric
+        set_error(SPARKPLUG_INVALID, "Null metric");
+        return false;
+    }
+
+    if(metric->variable == NULL){
+        // No variable has been attached to this metric
+        set_error(SPARKPLUG_BAD_METRIC, metric->name);
+        return false;
+    }
+
+    // A disabled metric is never sent, so nothing is pending for it
+    if(metric->disabled){
+        metric->updated = false;
+        return true;
+    }
+
+    // Add this metric if we're adding the full metric or it has been updated
+    if(full || metric->updated){
+        if(m_metrics == NULL){
+            // No memory set aside for metrics?
+            set_error(SPARKPLUG_NO_MEMORY, "metrics");
+            return false;
+        }
+        if(m_payload.metrics_count >= m_max_metrics){
+            // Payload is already full of metrics
+            set_error(SPARKPLUG_TOO_MANY, "metrics", m_max_metrics);
+            return false;
+        }
+
+        // The metric change is no longer pending
+        metric->updated = false;
+
+        // Set the metric timestamp if it hasn't been set
+        if(metric->timestamp == 0)
+            metric->timestamp = m_gettimestamp();
+
+        Metric *next_metric = &m_metrics[m_payload.metrics_count];
+        m_payload.metrics_count++;
+
+        // Include the metric name if the full metric is being added
+        if(full)
+            next_metric->name = (char *) metric->name;
+        else
             next_metric->name = NULL;
         next_metric->has_alias = true;
         next_metric->alias = metric->alias;
@@ -455,84 +1851,927 @@ bool add_metric_to_payload(bool full, MetricSpec *metric){
         next_metric->has_is_transient = false;
         next_metric->has_is_null = false;
         next_metric->has_metadata = false;
-        next_metric->has_properties = false;
+        // Properties describe the metric, so only births carry them
+        next_metric->has_properties = full && metric->properties != NULL;
+        if(next_metric->has_properties)
+            next_metric->properties = *metric->properties;
         next_metric->has_datatype = true;
         next_metric->datatype = metric->datatype;
 
-        // Set data type and value based on metric type
-        switch(metric->datatype){
-        case METRIC_DATA_TYPE_BOOLEAN:
-            next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag;
-            next_metric->value.boolean_value = *(bool *) metric->variable;
-            break;
+        // Set data type and value based on metric type
+        if(!set_metric_value(next_metric, metric, metric->variable, full)){
+            m_payload.metrics_count--;
+            return false;
+        }
+    }
+
+    // Success
+    return true;
+}
+
+
+// Add the metric with the specified alias or variable to the module payload.
+// If variable is non-NULL then it is used to locate the matching metric.  If
+// variable is NULL then the alias is used to locate the matching metric.  If
+// full is false, the metric is only added if it has been updated; if full is
+// true the metric is added regardless and its name is included.  Returns false
+// if an error occurs; otherwise returns true.
+bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
+                unsigned int alias){
+    MetricSpec *metric = NULL;
+    if(variable != NULL)
+        metric = find_metric_by_variable(metrics, num_metrics, variable);
+    else
+        metric = find_metric_by_alias(metrics, num_metrics, alias);
+    if(metric == NULL)
+        return false;
+    return add_metric_to_payload(full, metric);
+}
+
+
+// Add the metric with the specified alias and its name to the module payload,
+// leaving its updated flag alone.  Returns false if an error occurs; otherwise
+// returns true.
+bool add_named_metric(MetricSpec *metrics, int num_metrics, unsigned int alias){
+    MetricSpec *metric = find_metric_by_alias(metrics, num_metrics, alias);
+    if(metric == NULL){
+        set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, alias);
+        return false;
+    }
+    bool updated = metric->updated && !metric->disabled;
+    bool added = add_metric_to_payload(true, metric);
+    metric->updated = updated;
+    return added;
+}
+
+
+// Add a value of the metric with the specified alias to the module payload,
+// stamped with timestamp and taking the value from variable rather than the
+// metric's own variable.  The metric's updated flag is left alone.  Returns
+// false if an error occurs; otherwise returns true.
+static bool add_stamped_metric(MetricSpec *metrics, int num_metrics, unsigned int alias,
+                               void *variable, unsigned long long timestamp, bool historical){
+    MetricSpec *metric = find_metric_by_alias(metrics, num_metrics, alias);
+    if(metric == NULL){
+        set_error(SPARKPLUG_NO_SUCH_METRIC, NULL, alias);
+        return false;
+    }
+    if(variable == NULL){
+        set_error(SPARKPLUG_INVALID, "Null historical value");
+        return false;
+    }
+    if(metric->disabled)
+        return true;
+    if(m_metrics == NULL || m_payload.metrics_count >= m_max_metrics){
+        set_error(SPARKPLUG_TOO_MANY, "metrics", m_max_metrics);
+        return false;
+    }
+
+    Metric *next_metric = &m_metrics[m_payload.metrics_count];
+    m_payload.metrics_count++;
+    next_metric->name = NULL;
+    next_metric->has_alias = true;
+    next_metric->alias = metric->alias;
+    next_metric->has_timestamp = true;
+    next_metric->timestamp = timestamp;
+    next_metric->has_is_historical = historical;
+    next_metric->is_historical = historical;
+    next_metric->has_is_transient = false;
+    next_metric->has_is_null = false;
+    next_metric->has_metadata = false;
+    next_metric->has_properties = false;
+    next_metric->has_datatype = true;
+    next_metric->datatype = metric->datatype;
+    if(!set_metric_value(next_metric, metric, variable, true)){
+        m_payload.metrics_count--;
+        return false;
+    }
+    return true;
+}
+
+bool add_historical_metric(MetricSpec *metrics, int num_metrics, unsigned int alias,
+                           void *variable, unsigned long long timestamp){
+    return add_stamped_metric(metrics, num_metrics, alias, variable, timestamp, true);
+}
+
+bool add_sampled_metric(MetricSpec *metrics, int num_metrics, unsigned int alias,
+                        void *variable, unsigned long long timestamp){
+    return add_stamped_metric(metrics, num_metrics, alias, variable, timestamp, false);
+}
+
+
+// Add any updated metrics in the array to the module payload.  If full is true
+// include all the metrics, whether updated or not, together with their names.
+// Returns false if an error occurs; otherwise returns true.
+bool add_metrics(bool full, MetricSpec *metrics, int num_metrics){
+    // Check the parameters are valid
+    if(metrics == NULL || num_metrics <= 0){
+        // Invalid metric array
+        set_error(SPARKPLUG_INVALID, "Empty metrics array");
+        return false;
+    }
+
+    // For an indexed array only visit the metrics marked in the dirty bitset:
+    // the streaming metrics' words, or all of them if anything else is marked
+    MetricIndex *index = get_metric_index(metrics, num_metrics);
+    if(!full && index != NULL && index->dirty != NULL){
+        unsigned int first_word = 0;
+        unsigned int end_word = DIRTY_WORDS(num_metrics);
+        if(!index->changed){
+            first_word = index->stream_first / 32;
+            end_word = DIRTY_WORDS(index->stream_end);
+        }
+        index->changed = false;
+        for(unsigned int word = first_word; word < end_word; word++){
+            uint32_t bits = index->dirty[word];
+            index->dirty[word] = 0;
+            while(bits != 0){
+                unsigned int bit = __builtin_ctz(bits);
+                if(!add_metric_to_payload(false, index->by_alias[word * 32 + bit])){
+                    // Leave this and the remaining metrics pending
+                    index->dirty[word] |= bits;
+                    index->changed = true;
+                    return false;
+                }
+                bits &= bits - 1;
+            }
+        }
+        return true;
+    }
+
+    // Scan through the metrics array looking for metrics to add
+    for(int idx = 0; idx < num_metrics; idx++)
+        if(!add_metric_to_payload(full, &metrics[idx]))
+            return false;
+
+    // A full payload includes everything, so nothing is pending any more
+    if(full && index != NULL && index->dirty != NULL){
+        memset(index->dirty, 0, DIRTY_WORDS(num_metrics) * sizeof(*index->dirty));
+        index->changed = false;
+    }
+
+    // Success
+    return true;
+}
+
+
+// Send any gathered bytes to the broker.  Returns false if the client didn't
+// take them all.
+static bool flush_broker_stream(BrokerStream *stream){
+    if(stream->used == 0)
+        return true;
+    size_t written = write_segment(stream->broker, stream->chunk, stream->used);
+    bool ok = (written == stream->used);
+    stream->used = 0;
+    return ok;
+}
+
+
+// nanopb output callback: gather encoded bytes and pass them to the broker a
+// chunk at a time.
+static bool write_broker_stream(pb_ostream_t *ostream, const pb_byte_t *buf, size_t count){
+    BrokerStream *stream = (BrokerStream *) ostream->state;
+    while(count > 0){
+        size_t n = STREAM_CHUNK_SIZE - stream->used;
+        if(n > count)
+            n = count;
+        memcpy(&stream->chunk[stream->used], buf, n);
+        stream->used += n;
+        buf += n;
+        count -= n;
+        if(stream->used == STREAM_CHUNK_SIZE && !flush_broker_stream(stream))
+            return false;
+    }
+    return true;
+}
+
+
+// Encode a payload straight into a publish to the specified broker, the MQTT
+// header leading the first chunk.  msg_len must be the encoded size from
+// encoded_size().
+static bool stream_payload(PubSubClient *broker, const char *topic, const Payload *payload,
+                           size_t msg_len){
+    if(!broker->connected() || PUBLISH_HEADER_SIZE(strlen(topic)) > STREAM_CHUNK_SIZE)
+        return false;
+
+    static BrokerStream stream;
+    stream.broker = broker;
+    stream.used = put_publish_header(broker, stream.chunk, topic, msg_len, m_retained);
+    pb_ostream_t ostream = PB_OSTREAM_SIZING;
+    ostream.callback = write_broker_stream;
+    ostream.state = &stream;
+    ostream.max_size = msg_len;
+    // A short message is dropped by the broker
+    if(!encode_to_stream(&ostream, payload) || !flush_broker_stream(&stream))
+        return false;
+    m_write_stats.publishes++;
+    return true;
+}
+
+
+// Frozen payload: a pre-encoded payload for a fixed block of float metrics.
+// Integer fields that change (timestamps, seq) are written as fixed width,
+// zero padded varints so they can be patched in place; protobuf decoders accept
+// the padding.  A frame then costs a handful of stores rather than an encode.
+#define FROZEN_TIMESTAMP_WIDTH  7   // 49 bits of milliseconds
+#define FROZEN_SEQ_WIDTH        2   // seq is 0..255
+#define FROZEN_INT32_WIDTH      5   // int_value, 32 bits
+#define FROZEN_INT16_WIDTH      3   // int_value, 16 bits (see set_metric_value())
+#define FROZEN_INT64_WIDTH      10  // long_value, 64 bits
+
+typedef struct
+{
+    MetricSpec *metric;
+    uint16_t    timestamp_offset;
+    uint16_t    value_offset;
+    uint16_t    value_size;
+} FrozenMetric;
+
+static uint8_t      *m_frozen_buffer = NULL;
+static size_t        m_frozen_len = 0;
+static FrozenMetric *m_frozen_metrics = NULL;
+static unsigned int  m_frozen_count = 0;
+static uint16_t      m_frozen_timestamp_offset = 0;
+static uint16_t      m_frozen_seq_offset = 0;
+static MetricIndex  *m_frozen_index = NULL;
+
+
+// Append a varint; if width is non-zero, pad it to exactly width bytes.
+static size_t put_varint(uint8_t *out, uint64_t value, unsigned int width){
+    size_t n = 0;
+    do{
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if(value != 0 || (width != 0 && n + 1 < width))
+            byte |= 0x80;
+        out[n++] = byte;
+    }while(value != 0 || (width != 0 && n < width));
+    return n;
+}
+
+
+// Size of a varint without padding
+static size_t varint_size(uint64_t value){
+    size_t n = 1;
+    while(value >= 0x80){
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+
+// Size of the encoded value of a frozen metric, or 0 if it can't be frozen
+static size_t frozen_value_size(MetricSpec *metric){
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_FLOAT:
+        return 4;
+    case METRIC_DATA_TYPE_INT16:
+        return FROZEN_INT16_WIDTH;
+    case METRIC_DATA_TYPE_INT32:
+        return FROZEN_INT32_WIDTH;
+    case METRIC_DATA_TYPE_INT64:
+        return FROZEN_INT64_WIDTH;
+    case METRIC_DATA_TYPE_INT32_ARRAY:
+    case METRIC_DATA_TYPE_FLOAT_ARRAY:
+        return ((pb_bytes_array_t *) metric->variable)->size;
+    default:
+        return 0;
+    }
+}
+
+
+// Returns true if a frozen metric's value is an int_value or long_value varint
+static bool frozen_varint(MetricSpec *metric){
+    return metric->datatype == METRIC_DATA_TYPE_INT16 || metric->datatype == METRIC_DATA_TYPE_INT32 ||
+           metric->datatype == METRIC_DATA_TYPE_INT64;
+}
+
+
+// Size of the encoded body of a frozen metric
+static size_t frozen_body_size(MetricSpec *metric, size_t value_size){
+    size_t body = 1 + varint_size(metric->alias) + 1 + FROZEN_TIMESTAMP_WIDTH +
+                  1 + varint_size(metric->datatype) + 1 + value_size;
+    if(metric->datatype != METRIC_DATA_TYPE_FLOAT && !frozen_varint(metric))
+        body += 1 + varint_size(value_size);    // bytes_value: 2-byte tag and length
+    return body;
+}
+
+
+// Freeze the NDATA layout for the count metrics with consecutive aliases
+// starting at first_alias, which must all be floats, Int16s, Int32s, Int64s or arrays.  Replaces any
+// previously frozen payload.  Returns false if an error occurs.
+bool freeze_payload(MetricSpec *metrics, int num_metrics, unsigned int first_alias,
+                    unsigned int count){
+    unfreeze_payload();
+    if(count == 0){
+        set_error(SPARKPLUG_NO_METRICS, "to freeze");
+        return false;
+    }
+
+    // Collect the metrics and work out the encoded size
+    m_frozen_metrics = (FrozenMetric *) calloc(count, sizeof(*m_frozen_metrics));
+    if(m_frozen_metrics == NULL){
+        set_error(SPARKPLUG_NO_MEMORY, "frozen metrics", count);
+        return false;
+    }
+    size_t len = 1 + FROZEN_TIMESTAMP_WIDTH + 1 + FROZEN_SEQ_WIDTH;
+    unsigned int frozen = 0;
+    for(unsigned int i = 0; i < count; i++){
+        MetricSpec *metric = find_metric_by_alias(metrics, num_metrics, first_alias + i);
+        if(metric != NULL && metric->disabled)
+            continue;
+        size_t value_size = 0;
+        if(metric != NULL && metric->variable != NULL)
+            value_size = frozen_value_size(metric);
+        if(value_size == 0){
+            if(metric != NULL)
+                set_error(SPARKPLUG_UNSUPPORTED, metric->name);
+            unfreeze_payload();
+            return false;
+        }
+        m_frozen_metrics[frozen].metric = metric;
+        m_frozen_metrics[frozen].value_size = value_size;
+        frozen++;
+        size_t body = frozen_body_size(metric, value_size);
+        len += 1 + varint_size(body) + body;
+    }
+    if(frozen == 0){
+        set_error(SPARKPLUG_NO_METRICS, "to freeze");
+        unfreeze_payload();
+        return false;
+    }
+
+    m_frozen_buffer = (uint8_t *) malloc(len);
+    if(m_frozen_buffer == NULL || len > 0xFFFF){
+        set_error(SPARKPLUG_NO_MEMORY, "frozen payload", len);
+        unfreeze_payload();
+        return false;
+    }
+
+    // Encode the layout, remembering where the patchable fields are
+    uint8_t *out = m_frozen_buffer;
+    size_t pos = 0;
+    out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_timestamp_tag, WIRE_VARINT);
+    m_frozen_timestamp_offset = pos;
+    pos += put_varint(&out[pos], 0, FROZEN_TIMESTAMP_WIDTH);
+    for(unsigned int i = 0; i < frozen; i++){
+        MetricSpec *metric = m_frozen_metrics[i].metric;
+        size_t value_size = m_frozen_metrics[i].value_size;
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_metrics_tag, WIRE_LENGTH);
+        pos += put_varint(&out[pos], frozen_body_size(metric, value_size), 0);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_alias_tag, WIRE_VARINT);
+        pos += put_varint(&out[pos], metric->alias, 0);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag, WIRE_VARINT);
+        m_frozen_metrics[i].timestamp_offset = pos;
+        pos += put_varint(&out[pos], 0, FROZEN_TIMESTAMP_WIDTH);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag, WIRE_VARINT);
+        pos += put_varint(&out[pos], metric->datatype, 0);
+        if(metric->datatype == METRIC_DATA_TYPE_FLOAT){
+            out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag, WIRE_FIXED32);
+        }else if(metric->datatype == METRIC_DATA_TYPE_INT64){
+            out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag, WIRE_VARINT);
+        }else if(frozen_varint(metric)){
+            out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag, WIRE_VARINT);
+        }else{
+            // Field 16 needs a 2-byte tag
+            pos += put_varint(&out[pos], WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag,
+                                                  WIRE_LENGTH), 0);
+            pos += put_varint(&out[pos], value_size, 0);
+        }
+        m_frozen_metrics[i].value_offset = pos;
+        if(frozen_varint(metric))
+            put_varint(&out[pos], 0, value_size);
+        else
+            memset(&out[pos], 0, value_size);
+        pos += value_size;
+    }
+    out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_seq_tag, WIRE_VARINT);
+    m_frozen_seq_offset = pos;
+    pos += put_varint(&out[pos], 0, FROZEN_SEQ_WIDTH);
+
+    m_frozen_len = pos;
+    m_frozen_count = frozen;
+    m_frozen_index = get_metric_index(metrics, num_metrics);
+    return true;
+}
+
+
+// Discard the frozen payload, if any.
+void unfreeze_payload(void){
+    free(m_frozen_buffer);
+    free(m_frozen_metrics);
+    m_frozen_buffer = NULL;
+    m_frozen_metrics = NULL;
+    m_frozen_len = 0;
+    m_frozen_count = 0;
+    m_frozen_index = NULL;
+}
+
+
+bool payload_frozen(void){
+    return m_frozen_buffer != NULL;
+}
+
+
+// Patch the current values of the frozen metrics into the frozen payload and
+// publish it with the specified topic to all connected brokers.  All metrics
+// get the specified timestamp (the current time if zero).  The metrics are no
+// longer pending afterwards.  Returns true if it published to at least one
+// broker; otherwise returns false.
+bool publish_frozen_payload(PubSubClient *broker_array, int num_brokers, const char *topic,
+                            unsigned long long timestamp){
+    clear_error();
+    if(m_frozen_buffer == NULL){
+        set_error(SPARKPLUG_INVALID, "No frozen payload");
+        return false;
+    }
+    if(broker_array == NULL || num_brokers <= 0 || topic == NULL){
+        set_error(SPARKPLUG_INVALID, "Empty broker array or null topic");
+        return false;
+    }
+
+    unsigned long long now = m_gettimestamp();
+    if(timestamp == 0)
+        timestamp = now;
+
+    // Patch the metric values and timestamps
+    uint8_t metric_timestamp[FROZEN_TIMESTAMP_WIDTH];
+    put_varint(metric_timestamp, timestamp, FROZEN_TIMESTAMP_WIDTH);
+    for(unsigned int i = 0; i < m_frozen_count; i++){
+        FrozenMetric *frozen = &m_frozen_metrics[i];
+        MetricSpec *metric = frozen->metric;
+        memcpy(&m_frozen_buffer[frozen->timestamp_offset], metric_timestamp, FROZEN_TIMESTAMP_WIDTH);
+        // fixed32 and packed arrays are little-endian, as is the Cortex-M7; an
+        // Int16, Int32 or Int64 is a varint padded to a fixed width
+        if(metric->datatype == METRIC_DATA_TYPE_INT16){
+            put_varint(&m_frozen_buffer[frozen->value_offset], (uint16_t) *(int16_t *) metric->variable,
+                       FROZEN_INT16_WIDTH);
+        }else if(metric->datatype == METRIC_DATA_TYPE_INT32){
+            put_varint(&m_frozen_buffer[frozen->value_offset], (uint32_t) *(int32_t *) metric->variable,
+                       FROZEN_INT32_WIDTH);
+        }else if(metric->datatype == METRIC_DATA_TYPE_INT64){
+            put_varint(&m_frozen_buffer[frozen->value_offset], *(uint64_t *) metric->variable,
+                       FROZEN_INT64_WIDTH);
+        }else{
+            const void *value = metric->variable;
+            if(metric->datatype != METRIC_DATA_TYPE_FLOAT)
+                value = ((pb_bytes_array_t *) metric->variable)->bytes;
+            memcpy(&m_frozen_buffer[frozen->value_offset], value, frozen->value_size);
+        }
+        metric->timestamp = timestamp;
+        metric->updated = false;
+        if(m_frozen_index != NULL && m_frozen_index->dirty != NULL){
+            unsigned int bit = metric->alias - m_frozen_index->first_alias;
+            m_frozen_index->dirty[bit / 32] &= ~(1ul << (bit % 32));
+        }
+    }
+    put_varint(&m_frozen_buffer[m_frozen_timestamp_offset], now, FROZEN_TIMESTAMP_WIDTH);
+    put_varint(&m_frozen_buffer[m_frozen_seq_offset], m_seq, FROZEN_SEQ_WIDTH);
+
+    bool published = false;
+    for(int i = 0; i < num_brokers; ++i){
+        PubSubClient *broker = &broker_array[i];
+        if(!broker->connected())
+            continue;
+        OutboundQueue *queue = get_outbound_queue(broker);
+        if(queue != NULL){
+            // Seq is the last field; the queue appends its own
+            OutboundMessage *msg = reserve_outbound(queue, topic, true);
+            if(msg == NULL)
+                continue;
+            msg->len = m_frozen_len - 1 - FROZEN_SEQ_WIDTH;
+            if(msg->len + SEQ_FIELD_SIZE > queue->message_size){
+                set_error(SPARKPLUG_TOO_BIG, "queued payload");
+                unreserve_outbound(queue, msg);
+                continue;
+            }
+            memcpy(msg->data, m_frozen_buffer, msg->len);
+            published = true;
+            continue;
+        }
+        uint8_t *seq = broker_seq(broker, topic);
+        put_varint(&m_frozen_buffer[m_frozen_seq_offset], *seq, FROZEN_SEQ_WIDTH);
+        if(!write_publish(broker, topic, m_frozen_buffer, m_frozen_len)){
+            set_error(SPARKPLUG_PUBLISH_FAILED, topic, i);
+            continue;
+        }
+        (*seq)++;
+        published = true;
+    }
+
+    if(published)
+        m_seq++;
+    return published;
+}
+
+
+// Command payload decoding.  NCMD metrics only carry a name or alias, a
+// datatype and a scalar value, so they're decoded straight from the wire into
+// a fixed-size CommandPayload instead of through nanopb, which would
+// heap-allocate the metrics array and every string.  Anything else in the
+// payload (metadata, properties, datasets...) is skipped.
+
+// Read a varint; returns false if it runs past the end of the buffer.
+static bool get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value){
+    uint64_t result = 0;
+    for(unsigned int shift = 0; shift < 64; shift += 7){
+        if(*pos >= end)
+            return false;
+        uint8_t byte = *(*pos)++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if((byte & 0x80) == 0){
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Skip over a field's value.  Returns false if it's malformed.
+static bool skip_field(const uint8_t **pos, const uint8_t *end, unsigned int wire_type){
+    uint64_t len;
+    switch(wire_type){
+    case WIRE_VARINT:
+        return get_varint(pos, end, &len);
+    case WIRE_LENGTH:
+        if(!get_varint(pos, end, &len) || len > (uint64_t) (end - *pos))
+            return false;
+        *pos += len;
+        return true;
+    case WIRE_FIXED32:
+        if(end - *pos < 4)
+            return false;
+        *pos += 4;
+        return true;
+    case 1: // 64-bit
+        if(end - *pos < 8)
+            return false;
+        *pos += 8;
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// Where a decoded payload's names, strings and bytes values are copied to
+typedef struct
+{
+    char       *strings;
+    size_t      size;
+    size_t      used;
+    const char *what;           // The payload, metrics and string bytes, for errors
+    const char *what_metrics;
+    const char *what_strings;
+} DecodeArena;
+
+
+// Copy a length-delimited string into the payload's string arena.
+static bool get_string(const uint8_t **pos, const uint8_t *end, DecodeArena *arena, char **value){
+    uint64_t len;
+    if(!get_varint(pos, end, &len) || len > (uint64_t) (end - *pos))
+        return false;
+    if(arena->used + len + 1 > arena->size){
+        set_error(SPARKPLUG_TOO_MANY, arena->what_strings, arena->size);
+        return false;
+    }
+    char *str = &arena->strings[arena->used];
+    memcpy(str, *pos, len);
+    str[len] = '\0';
+    arena->used += len + 1;
+    *pos += len;
+    *value = str;
+    return true;
+}
+
+
+// Copy a length-delimited bytes value into the payload's string arena, as a
+// pb_bytes_array_t aligned for its size field.
+static bool get_bytes(const uint8_t **pos, const uint8_t *end, DecodeArena *arena, pb_bytes_array_t **value){
+    uint64_t len;
+    if(!get_varint(pos, end, &len) || len > (uint64_t) (end - *pos))
+        return false;
+    size_t align = alignof(pb_bytes_array_t);
+    size_t start = arena->used + (align - (uintptr_t) &arena->strings[arena->used] % align) % align;
+    if(start + PB_BYTES_ARRAY_T_ALLOCSIZE(len) > arena->size){
+        set_error(SPARKPLUG_TOO_MANY, arena->what_strings, arena->size);
+        return false;
+    }
+    pb_bytes_array_t *bytes = (pb_bytes_array_t *) &arena->strings[start];
+    bytes->size = len;
+    memcpy(bytes->bytes, *pos, len);
+    arena->used = start + PB_BYTES_ARRAY_T_ALLOCSIZE(len);
+    *pos += len;
+    *value = bytes;
+    return true;
+}
+
 
-        case METRIC_DATA_TYPE_INT64:
-            next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
-            next_metric->value.long_value = *(uint64_t *) metric->variable;
+static bool decode_metric(const uint8_t *pos, const uint8_t *end, DecodeArena *arena, Metric *metric){
+    memset(metric, 0, sizeof(*metric));
+    while(pos < end){
+        uint64_t key, value;
+        if(!get_varint(&pos, end, &key))
+            return false;
+        unsigned int field = key >> 3;
+        unsigned int wire_type = key & 7;
+        switch(field){
+        case org_eclipse_tahu_protobuf_Payload_Metric_name_tag:
+            if(wire_type != WIRE_LENGTH || !get_string(&pos, end, arena, &metric->name))
+                return false;
             break;
-
-        case METRIC_DATA_TYPE_FLOAT:
-            next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
-            next_metric->value.float_value = *(float *) metric->variable;
+        case org_eclipse_tahu_protobuf_Payload_Metric_alias_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_is_historical_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_is_null_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag:
+        case org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag:
+            if(wire_type != WIRE_VARINT || !get_varint(&pos, end, &value))
+                return false;
+            if(field == org_eclipse_tahu_protobuf_Payload_Metric_alias_tag){
+                metric->has_alias = true;
+                metric->alias = value;
+            }
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag){
+                metric->has_timestamp = true;
+                metric->timestamp = value;
+            }
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag){
+                metric->has_datatype = true;
+                metric->datatype = value;
+            }
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_is_historical_tag){
+                metric->has_is_historical = true;
+                metric->is_historical = (value != 0);
+            }
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_is_null_tag){
+                metric->has_is_null = true;
+                metric->is_null = (value != 0);
+            }
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag)
+                metric->value.int_value = value;
+            else if(field == org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag)
+                metric->value.long_value = value;
+            else
+                metric->value.boolean_value = (value != 0);
+            if(field >= org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag)
+                metric->which_value = field;
             break;
-
-        case METRIC_DATA_TYPE_STRING:
-            next_metric->which_value = org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
-            next_metric->value.string_value = *(char **) metric->variable;
+        case org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag:
+            if(wire_type != WIRE_FIXED32 || end - pos < 4)
+                return false;
+            // fixed32 is little-endian, as is the Cortex-M7
+            memcpy(&metric->value.float_value, pos, 4);
+            pos += 4;
+            metric->which_value = field;
+            break;
+        case org_eclipse_tahu_protobuf_Payload_Metric_double_value_tag:
+            if(wire_type != 1 || end - pos < 8)
+                return false;
+            memcpy(&metric->value.double_value, pos, 8);
+            pos += 8;
+            metric->which_value = field;
+            break;
+        case org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag:
+            if(wire_type != WIRE_LENGTH || !get_string(&pos, end, arena, &metric->value.string_value))
+                return false;
+            metric->which_value = field;
+            break;
+        case org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag:
+            if(wire_type != WIRE_LENGTH || !get_bytes(&pos, end, arena, &metric->value.bytes_value))
+                return false;
+            metric->which_value = field;
             break;
-
         default:
-            // Unsupported type
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Unsupported metric datatype: %u",
-                     (unsigned int) metric->datatype);
-            m_payload.metrics_count--;
-            return false;
+            // Transient flags, metadata, properties and value types neither
+            // commands nor the node's data use
+            if(!skip_field(&pos, end, wire_type))
+                return false;
+            break;
         }
     }
+    return true;
+}
 
-    // Success
+
+// Decode a payload's timestamp, seq, uuid, body and up to max_metrics metrics,
+// the strings going into arena.  Returns false if the payload is malformed or
+// too big for the storage given.
+static bool decode_payload(const uint8_t *buffer, size_t len, Payload *payload, unsigned int max_metrics,
+                           DecodeArena *arena){
+    const uint8_t *pos = buffer;
+    const uint8_t *end = buffer + len;
+    while(pos < end){
+        uint64_t key, value;
+        if(!get_varint(&pos, end, &key))
+            break;
+        unsigned int field = key >> 3;
+        unsigned int wire_type = key & 7;
+        if(field == org_eclipse_tahu_protobuf_Payload_timestamp_tag && wire_type == WIRE_VARINT){
+            if(!get_varint(&pos, end, &value))
+                break;
+            payload->has_timestamp = true;
+            payload->timestamp = value;
+        }
+        else if(field == org_eclipse_tahu_protobuf_Payload_seq_tag && wire_type == WIRE_VARINT){
+            if(!get_varint(&pos, end, &value))
+                break;
+            payload->has_seq = true;
+            payload->seq = value;
+        }
+        else if(field == org_eclipse_tahu_protobuf_Payload_uuid_tag && wire_type == WIRE_LENGTH){
+            if(!get_string(&pos, end, arena, &payload->uuid))
+                break;
+        }
+        else if(field == org_eclipse_tahu_protobuf_Payload_body_tag && wire_type == WIRE_LENGTH){
+            if(!get_bytes(&pos, end, arena, &payload->body))
+                break;
+        }
+        else if(field == org_eclipse_tahu_protobuf_Payload_metrics_tag && wire_type == WIRE_LENGTH){
+            if(payload->metrics_count >= max_metrics){
+                set_error(SPARKPLUG_TOO_MANY, arena->what_metrics, max_metrics);
+                return false;
+            }
+            if(!get_varint(&pos, end, &value) || value > (uint64_t) (end - pos))
+                break;
+            if(!decode_metric(pos, pos + value, arena, &payload->metrics[payload->metrics_count])){
+                if(m_error.code == SPARKPLUG_OK)
+                    set_error(SPARKPLUG_MALFORMED, "metric #", payload->metrics_count);
+                return false;
+            }
+            payload->metrics_count++;
+            pos += value;
+        }
+        else if(!skip_field(&pos, end, wire_type))
+            break;
+    }
+    if(pos != end){
+        if(m_error.code == SPARKPLUG_OK)
+            set_error(SPARKPLUG_MALFORMED, arena->what);
+        return false;
+    }
     return true;
 }
 
 
-// Add the metric with the specified alias or variable to the module payload.
-// If variable is non-NULL then it is used to locate the matching metric.  If
-// variable is NULL then the alias is used to locate the matching metric.  If
-// full is false, the metric is only added if it has been updated; if full is
-// true the metric is added regardless and its name is included.  Returns false
-// if an error occurs; otherwise returns true.
-bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
-                unsigned int alias){
-    MetricSpec *metric = NULL;
-    if(variable != NULL)
-        metric = find_metric_by_variable(metrics, num_metrics, variable);
-    else
-        metric = find_metric_by_alias(metrics, num_metrics, alias);
-    if(metric == NULL)
+// Decode a command (NCMD/DCMD) payload into command without allocating any
+// memory.  Returns false if the payload is malformed or exceeds the command's
+// capacity.
+bool decode_command_payload(const uint8_t *buffer, size_t len, CommandPayload *command){
+    clear_error();
+    command->timestamp = 0;
+    command->metrics_count = 0;
+    if(buffer == NULL){
+        set_error(SPARKPLUG_INVALID, "Null command payload");
         return false;
-    return add_metric_to_payload(full, metric);
+    }
+    Payload payload;
+    memset(&payload, 0, sizeof(payload));
+    payload.metrics = command->metrics;
+    DecodeArena arena = {command->strings, sizeof(command->strings), 0,
+                         "command payload", "command metrics", "command string bytes"};
+    bool decoded = decode_payload(buffer, len, &payload, MAX_COMMAND_METRICS, &arena);
+    command->timestamp = payload.timestamp;
+    command->metrics_count = payload.metrics_count;
+    return decoded;
 }
 
 
-// Add any updated metrics in the array to the module payload.  If full is true
-// include all the metrics, whether updated or not, together with their names.
-// Returns false if an error occurs; otherwise returns true.
-bool add_metrics(bool full, MetricSpec *metrics, int num_metrics){
-    // Check the parameters are valid
-    if(metrics == NULL || num_metrics <= 0){
-        // Invalid metric array
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty metrics array");
+// Compressed payloads.  A payload of at least m_compress_threshold bytes is
+// sent as the Sparkplug compressed envelope instead: uuid SPBV1.0_COMPRESSED,
+// the DEFLATE'd payload as the body, and an "algorithm" metric.  The seq goes
+// on the envelope only, as it's appended per broker by the outbound queues, so
+// a host takes it from there.
+#define COMPRESS_INPUT_SIZE   16384
+#define COMPRESSED_UUID       "SPBV1.0_COMPRESSED"
+#define COMPRESS_ALGORITHM    "DEFLATE"
+
+static size_t  m_compress_threshold = 0;  // 0 = never compress
+static uint8_t m_compress_input[COMPRESS_INPUT_SIZE];
+static PB_BYTES_ARRAY_T(OUTBOUND_MSG_SIZE) m_compressed_body;
+static Payload m_compressed_payload = org_eclipse_tahu_protobuf_Payload_init_default;
+static Metric  m_algorithm_metric;
+
+
+// Set the encoded size from which payloads are published compressed, or 0 to
+// always publish them as they are.
+void set_payload_compression(size_t threshold){
+    m_compress_threshold = threshold;
+}
+
+
+size_t payload_compression(void){
+    return m_compress_threshold;
+}
+
+
+// Wrap the module payload, msg_len bytes encoded, in a compressed envelope if
+// it's big enough to be worth it.  Returns the payload to publish, updating
+// msg_len if it's the envelope.
+static Payload * compress_payload(size_t *msg_len){
+    if(m_compress_threshold == 0 || *msg_len < m_compress_threshold ||
+       *msg_len > COMPRESS_INPUT_SIZE)
+        return &m_payload;
+
+    bool has_seq = m_payload.has_seq;
+    m_payload.has_seq = false;
+    pb_ostream_t ostream = pb_ostream_from_buffer(m_compress_input, sizeof(m_compress_input));
+    bool ok = encode_to_stream(&ostream, &m_payload);
+    m_payload.has_seq = has_seq;
+    if(!ok)
+        return &m_payload;
+    size_t len = deflate_compress(m_compress_input, ostream.bytes_written, m_compressed_body.bytes,
+                                  sizeof(m_compressed_body.bytes));
+    if(len == 0 || len >= *msg_len)
+        return &m_payload;
+    m_compressed_body.size = len;
+
+    memset(&m_algorithm_metric, 0, sizeof(m_algorithm_metric));
+    m_algorithm_metric.name = (char *) "algorithm";
+    m_algorithm_metric.has_datatype = true;
+    m_algorithm_metric.datatype = METRIC_DATA_TYPE_STRING;
+    m_algorithm_metric.which_value = org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
+    m_algorithm_metric.value.string_value = (char *) COMPRESS_ALGORITHM;
+
+    m_compressed_payload.has_timestamp = true;
+    m_compressed_payload.timestamp = m_payload.timestamp;
+    m_compressed_payload.has_seq = m_payload.has_seq;
+    m_compressed_payload.seq = m_payload.seq;
+    m_compressed_payload.metrics_count = 1;
+    m_compressed_payload.metrics = &m_algorithm_metric;
+    m_compressed_payload.uuid = (char *) COMPRESSED_UUID;
+    m_compressed_payload.body = (pb_bytes_array_t *) &m_compressed_body;
+    size_t compressed_len = 0;
+    if(!pb_get_encoded_size(&compressed_len, org_eclipse_tahu_protobuf_Payload_fields, &m_compressed_payload) ||
+       compressed_len >= *msg_len)
+        return &m_payload;
+    *msg_len = compressed_len;
+    return &m_compressed_payload;
+}
+
+
+// Decode a data payload into data, inflating it first if it's the compressed
+// envelope.  The envelope's body is inflated before the arena is reused for
+// the payload inside.
+bool decode_data_payload(const uint8_t *buffer, size_t len, DataPayload *data){
+    clear_error();
+    data->has_timestamp = false;
+    data->has_seq = false;
+    data->compressed = false;
+    data->metrics_count = 0;
+    if(buffer == NULL){
+        set_error(SPARKPLUG_INVALID, "Null data payload");
         return false;
     }
+    Payload payload;
+    memset(&payload, 0, sizeof(payload));
+    payload.metrics = data->metrics;
+    DecodeArena arena = {data->strings, sizeof(data->strings), 0,
+                         "data payload", "data metrics", "data string bytes"};
+    if(!decode_payload(buffer, len, &payload, MAX_DATA_METRICS, &arena))
+        return false;
 
-    // Scan through the metrics array looking for metrics to add
-    for(int idx = 0; idx < num_metrics; idx++)
-        if(!add_metric_to_payload(full, &metrics[idx]))
+    if(payload.uuid != NULL && strcmp(payload.uuid, COMPRESSED_UUID) == 0){
+        const char *algorithm = NULL;
+        for(unsigned int i = 0; i < payload.metrics_count; i++){
+            Metric *metric = &payload.metrics[i];
+            if(metric->name != NULL && strcmp(metric->name, "algorithm") == 0 &&
+               metric->which_value == org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag)
+                algorithm = metric->value.string_value;
+        }
+        if(algorithm == NULL || strcmp(algorithm, COMPRESS_ALGORITHM) != 0){
+            set_error(SPARKPLUG_UNSUPPORTED, "compression algorithm");
             return false;
+        }
+        size_t inflated = 0;
+        if(payload.body != NULL)
+            inflated = deflate_decompress(payload.body->bytes, payload.body->size, data->inflated,
+                                          sizeof(data->inflated));
+        if(inflated == 0){
+            set_error(SPARKPLUG_MALFORMED, "compressed body");
+            return false;
+        }
+        bool has_seq = payload.has_seq;
+        unsigned long long seq = payload.seq;
+        memset(&payload, 0, sizeof(payload));
+        payload.metrics = data->metrics;
+        arena.used = 0;
+        if(!decode_payload(data->inflated, inflated, &payload, MAX_DATA_METRICS, &arena))
+            return false;
+        payload.has_seq = has_seq;
+        payload.seq = seq;
+        data->compressed = true;
+    }
 
-    // Success
+    data->has_timestamp = payload.has_timestamp;
+    data->timestamp = payload.timestamp;
+    data->has_seq = payload.has_seq;
+    data->seq = payload.seq;
+    data->metrics_count = payload.metrics_count;
     return true;
 }
 
@@ -540,30 +2779,30 @@ bool add_metrics(bool full, MetricSpec *metrics, int num_metrics){
 // Publish the module payload with the specified topic to all the brokers.
 // Doesn't publish to brokers that we're not connected to or if the payload has
 // no metrics.  Note that this sends a duplicate of the message to each broker,
-// so the seq and timestamp fields will be identical.  Returns true if it
-// successfully published to at least one broker; otherwise, returns false.
-bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *topic){
+// so the seq and timestamp fields will be identical.  If use_queues is false,
+// brokers with an outbound queue are written to directly as well.  Returns true
+// if it successfully published to at least one broker; otherwise, returns false.
+static bool publish_to_brokers(PubSubClient *broker_array, int num_brokers, const char *topic,
+                               bool use_queues){
     // Since the function returns false if we're not connected to any brokers,
     // an empty error message indicates no error
-    strcpy(cf_sparkplug_error, "");
+    clear_error();
 
     // Check the parameters are valid
     if(broker_array == NULL || num_brokers <= 0){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Empty broker array");
+        set_error(SPARKPLUG_INVALID, "Empty broker array");
         return false;
     }
     if(topic == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error), "Null topic");
+        set_error(SPARKPLUG_INVALID, "Null topic");
         return false;
     }
 
-    // Include the current metrics list in the payload
-    m_payload.metrics = m_metrics;
-
-    // Don't publish if the payload doesn't contain any metrics
-    if(m_payload.metrics_count == 0 || m_payload.metrics == NULL){
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error), "No metrics");
+    // Don't publish if the payload doesn't contain any metrics, unless it's a
+    // DDEATH, which has none
+    if((m_payload.metrics_count == 0 && strstr(topic, "/" DDEATH_MESSAGE_TYPE "/") == NULL) ||
+       m_payload.metrics == NULL){
+        set_error(SPARKPLUG_NO_METRICS, NULL);
         return false;
     }
 
@@ -571,11 +2810,17 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
     unsigned long long timestamp = m_gettimestamp();
     m_payload.timestamp = timestamp;
 
-    // Encode the payload to a buffer
-    sparkplugb_arduino_encoder encoder;
-    int msg_len = encoder.encode(&m_payload, encode_buffer, BIN_BUF_SIZE);
+    // Size the payload so the MQTT header can be sent before encoding it
+    size_t msg_len = 0;
+    if(!encoded_size(&msg_len, &m_payload)){
+        set_error(SPARKPLUG_ENCODE_FAILED, topic);
+        return false;
+    }
+
+    Payload *payload = compress_payload(&msg_len);
 
     bool published = false;
+    OutboundMessage *encoded = NULL;
     for(int i = 0; i < num_brokers; ++i){
         PubSubClient *broker = &broker_array[i];
 
@@ -583,12 +2828,58 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
         if(!broker->connected())
             continue;
 
-        // Send the message to the broker
-        if(!broker->publish(topic, encode_buffer, msg_len, false)){
-            snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                     "Failed to publish message to broker%d: %s", i, topic);
+        // Queue the message if the broker has an outbound queue, encoding it
+        // the first time and copying it for any other queues
+        OutboundQueue *queue = use_queues ? get_outbound_queue(broker) : NULL;
+        if(queue != NULL){
+            if(msg_len + SEQ_FIELD_SIZE > queue->message_size){
+                set_error(SPARKPLUG_TOO_BIG, "queued payload");
+                continue;
+            }
+            OutboundMessage *msg = reserve_outbound(queue, topic, m_payload.has_seq);
+            if(msg == NULL)
+                continue;
+            if(encoded != NULL){
+                // The size check above means it fits this queue too
+                memcpy(msg->data, encoded->data, encoded->len);
+                msg->len = encoded->len;
+            }
+            else{
+                // Seq is appended per broker as the message goes out
+                bool has_seq = payload->has_seq;
+                payload->has_seq = false;
+                pb_ostream_t ostream = pb_ostream_from_buffer(msg->data, queue->message_size - SEQ_FIELD_SIZE);
+                bool ok = encode_to_stream(&ostream, payload);
+                payload->has_seq = has_seq;
+                if(!ok){
+                    set_error(SPARKPLUG_ENCODE_FAILED, topic);
+                    unreserve_outbound(queue, msg);
+                    continue;
+                }
+                msg->len = ostream.bytes_written;
+                encoded = msg;
+            }
+            published = true;
+            continue;
+        }
+
+        // Send the message to the broker with its seq, encoding it on the way
+        uint8_t *seq = NULL;
+        size_t len = msg_len;
+        unsigned long long module_seq = payload->seq;
+        if(payload->has_seq){
+            seq = broker_seq(broker, topic);
+            payload->seq = *seq;
+            len = msg_len - varint_size(module_seq) + varint_size(*seq);
+        }
+        bool ok = stream_payload(broker, topic, payload, len);
+        payload->seq = module_seq;
+        if(!ok){
+            set_error(SPARKPLUG_PUBLISH_FAILED, topic, i);
             continue;
         }
+        if(seq != NULL)
+            (*seq)++;
 
         // Success
         published = true;
@@ -604,6 +2895,154 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
 }
 
 
+// Largest payload, less seq, that fits every outbound queue; 0 if there are
+// no queues.
+static size_t queued_payload_limit(void){
+    size_t limit = 0;
+    for(int i = 0; i < m_num_queues; i++)
+        if(limit == 0 || m_queues[i].message_size - SEQ_FIELD_SIZE < limit)
+            limit = m_queues[i].message_size - SEQ_FIELD_SIZE;
+    return limit;
+}
+
+
+// Encoded size of a metric within the payload, tag and length included.
+static size_t metric_field_size(const Metric *metric){
+    size_t size = 0;
+    if(!pb_get_encoded_size(&size, org_eclipse_tahu_protobuf_Payload_Metric_fields, metric))
+        return SIZE_MAX;
+    return 1 + varint_size(size) + size;
+}
+
+
+// Publish the module payload's metrics over as many payloads as it takes for
+// each to fit in limit bytes, in order and each with the next seq.  Returns
+// false if a single metric doesn't fit or any part fails to publish.
+static bool publish_split(PubSubClient *broker_array, int num_brokers, const char *topic,
+                          size_t limit){
+    pb_size_t total = m_payload.metrics_count;
+    m_payload.metrics_count = 0;
+    size_t header = 0;
+    pb_get_encoded_size(&header, org_eclipse_tahu_protobuf_Payload_fields, &m_payload);
+    header += SEQ_FIELD_SIZE;
+
+    bool ok = true;
+    pb_size_t first = 0;
+    while(first < total && ok){
+        size_t size = header;
+        pb_size_t count = 0;
+        while(first + count < total){
+            size_t metric_size = metric_field_size(&m_metrics[first + count]);
+            if(metric_size == SIZE_MAX || size + metric_size > limit)
+                break;
+            size += metric_size;
+            count++;
+        }
+        if(count == 0){
+            set_error(SPARKPLUG_TOO_BIG, topic);
+            ok = false;
+            break;
+        }
+        m_payload.metrics = &m_metrics[first];
+        m_payload.metrics_count = count;
+        m_payload.seq = m_seq;
+        m_split_part = first > 0;
+        // Make what room the sockets allow for the next part
+        if(m_split_part)
+            drain_outbound_queues();
+        ok = publish_to_brokers(broker_array, num_brokers, topic, true);
+        first += count;
+    }
+    m_split_part = false;
+    m_payload.metrics = m_metrics;
+    m_payload.metrics_count = total;
+    return ok;
+}
+
+
+// Publish the module payload with the specified topic to all the brokers,
+// through their outbound queues where they have one.  An NDATA/DDATA too big
+// for the queues is split over several payloads first; a birth has to go as
+// one.
+bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *topic){
+    m_payload.metrics = m_metrics;
+    size_t limit = queued_payload_limit();
+    size_t msg_len = 0;
+    if(limit == 0 || topic == NULL ||
+       (strstr(topic, "/" NDATA_MESSAGE_TYPE "/") == NULL && strstr(topic, "/" DDATA_MESSAGE_TYPE "/") == NULL) ||
+       !encoded_size(&msg_len, &m_payload) ||
+       msg_len <= limit)
+        return publish_to_brokers(broker_array, num_brokers, topic, true);
+    return publish_split(broker_array, num_brokers, topic, limit);
+}
+
+
+// Publish the module payload to all the brokers as a retained message without
+// a seq, through their outbound queues where they have one.  For topics outside
+// the Sparkplug namespace, where a new subscriber gets the last one at once.
+// Returns true if it published to at least one broker; otherwise, returns false.
+bool publish_retained_payload(PubSubClient *broker_array, int num_brokers, const char *topic){
+    m_payload.metrics = m_metrics;
+    bool has_seq = m_payload.has_seq;
+    m_payload.has_seq = false;
+    m_retained = true;
+    bool published = publish_to_brokers(broker_array, num_brokers, topic, true);
+    m_retained = false;
+    m_payload.has_seq = has_seq;
+    return published;
+}
+
+
+// Publish the module payload to all the brokers without a seq, through their
+// outbound queues where they have one.  For topics outside the Sparkplug
+// namespace, such as a loopback the node subscribes to itself.  Returns true if
+// it published to at least one broker; otherwise, returns false.
+bool publish_unsequenced_payload(PubSubClient *broker_array, int num_brokers, const char *topic){
+    m_payload.metrics = m_metrics;
+    bool has_seq = m_payload.has_seq;
+    m_payload.has_seq = false;
+    bool published = publish_to_brokers(broker_array, num_brokers, topic, true);
+    m_payload.has_seq = has_seq;
+    return published;
+}
+
+
+// Encode the module payload into the buffer, as it would be published but
+// without touching any broker or the sequence number.  Returns the encoded
+// length, or 0 if an error occurs.
+size_t encode_payload(uint8_t *buffer, size_t size){
+    clear_error();
+    m_payload.metrics = m_metrics;
+    if(buffer == NULL || m_payload.metrics_count == 0 || m_payload.metrics == NULL){
+        set_error(SPARKPLUG_INVALID, "No metrics or buffer");
+        return 0;
+    }
+    m_payload.timestamp = m_gettimestamp();
+
+    pb_ostream_t ostream = pb_ostream_from_buffer(buffer, size);
+    if(!encode_to_stream(&ostream, &m_payload)){
+        set_error(SPARKPLUG_ENCODE_FAILED, PB_GET_ERROR(&ostream));
+        return 0;
+    }
+    return ostream.bytes_written;
+}
+
+
+// Publish a DDEATH message: a payload with no metrics, just the timestamp and
+// the next seq.  Returns true if it successfully published to at least one
+// broker; otherwise, returns false.
+bool publish_device_death(PubSubClient *broker_array, int num_brokers, const char *topic){
+    if(topic == NULL || strstr(topic, "/" DDEATH_MESSAGE_TYPE "/") == NULL){
+        clear_error();
+        set_error(SPARKPLUG_INVALID, "Not a DDEATH topic");
+        return false;
+    }
+    set_up_next_payload();
+    m_payload.metrics = m_metrics;
+    return publish_to_brokers(broker_array, num_brokers, topic, true);
+}
+
+
 // Add the specified metrics to the module payload and publish it.  This
 // function combines the add_metrics() function and the publish_payload()
 // function.  Returns true if it successfully published to at least one broker;
@@ -615,6 +3054,482 @@ bool publish_metrics(PubSubClient *broker_array, int num_brokers, const char *to
 }
 
 
+// Birth cache: each NBIRTH/DBIRTH encoded once, names and all, with its integer
+// values, timestamps and seq padded to a fixed width as in the frozen payload.
+// A rebirth then only patches the current values into the cached bytes; the
+// names, which are most of a birth, aren't encoded again.  A cache is rebuilt
+// when a value no longer fits its slot (a string or array changing length, or
+// a value turning null or back) and dropped when the metric definitions change.
+#define BIRTH_INT64_WIDTH   10  // long_value, 64 bits
+#define MAX_BIRTH_CACHES    9   // The NBIRTH and up to 8 DBIRTHs
+
+typedef struct
+{
+    MetricSpec   *metrics;      // The array the birth was encoded from, NULL if unused
+    int           num_metrics;
+    bool          has_bdseq;    // The first entry is the bdSeq metric
+    uint8_t      *buffer;
+    size_t        len;
+    FrozenMetric *entries;      // value_size 0 for a null value
+    unsigned int  count;
+    uint16_t      timestamp_offset;
+    uint16_t      seq_offset;
+    bool          alias_only;   // Encoded without names, see set_alias_only_births()
+} BirthCache;
+
+static BirthCache m_birth_caches[MAX_BIRTH_CACHES];
+static uint32_t     m_alias_only_hash = 0;      // 0 = always name every metric
+static unsigned int m_alias_only_named = 0;     // Alias of the metric still named
+
+
+// Size of the encoded value of a metric in a cached birth, after its tag: 0 for
+// a null value, SIZE_MAX for a datatype the cache doesn't take.  Strings and
+// arrays include their length.
+static size_t birth_value_size(MetricSpec *metric){
+    size_t len;
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+        return 1;
+    case METRIC_DATA_TYPE_INT16:
+        return *(int16_t *) metric->variable == INT16_MIN ? 0 : FROZEN_INT16_WIDTH;
+    case METRIC_DATA_TYPE_INT32:
+        return *(int32_t *) metric->variable == INT32_MIN ? 0 : FROZEN_INT32_WIDTH;
+    case METRIC_DATA_TYPE_INT64:
+        return BIRTH_INT64_WIDTH;
+    case METRIC_DATA_TYPE_FLOAT:
+        return isnan(*(float *) metric->variable) ? 0 : 4;
+    case METRIC_DATA_TYPE_STRING:
+        if(*(char **) metric->variable == NULL)
+            return SIZE_MAX;
+        len = strlen(*(char **) metric->variable);
+        return varint_size(len) + len;
+    case METRIC_DATA_TYPE_BYTES:
+    case METRIC_DATA_TYPE_INT32_ARRAY:
+    case METRIC_DATA_TYPE_FLOAT_ARRAY:
+        len = ((pb_bytes_array_t *) metric->variable)->size;
+        return varint_size(len) + len;
+    default:
+        return SIZE_MAX;
+    }
+}
+
+
+// Tag of the value field of a metric, as encoded (bytes_value takes 2 bytes)
+static size_t put_birth_value_tag(uint8_t *out, MetricSpec *metric){
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_boolean_value_tag, WIRE_VARINT), 0);
+    case METRIC_DATA_TYPE_INT16:
+    case METRIC_DATA_TYPE_INT32:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_int_value_tag, WIRE_VARINT), 0);
+    case METRIC_DATA_TYPE_INT64:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag, WIRE_VARINT), 0);
+    case METRIC_DATA_TYPE_FLOAT:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag, WIRE_FIXED32), 0);
+    case METRIC_DATA_TYPE_STRING:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag, WIRE_LENGTH), 0);
+    default:
+        return put_varint(out, WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag, WIRE_LENGTH), 0);
+    }
+}
+
+
+// Write the current value of a metric into its slot, which birth_value_size()
+// says is big enough
+static void put_birth_value(uint8_t *out, MetricSpec *metric){
+    const char *text;
+    const pb_bytes_array_t *bytes;
+    size_t n;
+    switch(metric->datatype){
+    case METRIC_DATA_TYPE_BOOLEAN:
+        out[0] = *(bool *) metric->variable ? 1 : 0;
+        break;
+    case METRIC_DATA_TYPE_INT16:
+        put_varint(out, (uint16_t) *(int16_t *) metric->variable, FROZEN_INT16_WIDTH);
+        break;
+    case METRIC_DATA_TYPE_INT32:
+        put_varint(out, (uint32_t) *(int32_t *) metric->variable, FROZEN_INT32_WIDTH);
+        break;
+    case METRIC_DATA_TYPE_INT64:
+        put_varint(out, *(uint64_t *) metric->variable, BIRTH_INT64_WIDTH);
+        break;
+    case METRIC_DATA_TYPE_FLOAT:
+        memcpy(out, metric->variable, 4);
+        break;
+    case METRIC_DATA_TYPE_STRING:
+        text = *(char **) metric->variable;
+        n = strlen(text);
+        memcpy(&out[put_varint(out, n, 0)], text, n);
+        break;
+    default:
+        bytes = (pb_bytes_array_t *) metric->variable;
+        memcpy(&out[put_varint(out, bytes->size, 0)], bytes->bytes, bytes->size);
+        break;
+    }
+}
+
+
+// Whether a metric of a cached birth carries its name: in an alias-only birth
+// just the bdSeq metric and the one set_alias_only_births() names do
+static bool birth_named(const BirthCache *cache, MetricSpec *metric, bool is_bdseq){
+    return !cache->alias_only || is_bdseq || metric->alias == m_alias_only_named;
+}
+
+
+// Size of a metric's properties in a cached birth, tag and length included: 0
+// for none, SIZE_MAX if they can't be encoded.
+static size_t birth_properties_size(MetricSpec *metric){
+    size_t size;
+    if(metric->properties == NULL)
+        return 0;
+    if(!pb_get_encoded_size(&size, org_eclipse_tahu_protobuf_Payload_PropertySet_fields, metric->properties))
+        return SIZE_MAX;
+    return 1 + varint_size(size) + size;
+}
+
+
+// Write a metric's properties, which never change, into a cached birth, if
+// birth_properties_size() can encode them.  Returns the bytes written.
+static size_t put_birth_properties(uint8_t *out, MetricSpec *metric){
+    size_t size;
+    if(metric->properties == NULL ||
+       !pb_get_encoded_size(&size, org_eclipse_tahu_protobuf_Payload_PropertySet_fields, metric->properties))
+        return 0;
+    size_t n = 0;
+    out[n++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_properties_tag, WIRE_LENGTH);
+    n += put_varint(&out[n], size, 0);
+    pb_ostream_t ostream = pb_ostream_from_buffer(&out[n], size);
+    pb_encode(&ostream, org_eclipse_tahu_protobuf_Payload_PropertySet_fields, metric->properties);
+    return n + size;
+}
+
+
+// Size of the encoded body of a metric in a cached birth
+static size_t birth_body_size(MetricSpec *metric, size_t value_size, bool named){
+    size_t name_len = named ? strlen(metric->name) : 0;
+    size_t body = (named ? 1 + varint_size(name_len) + name_len : 0) + 1 + varint_size(metric->alias) +
+                  1 + FROZEN_TIMESTAMP_WIDTH + 1 + varint_size(metric->datatype) +
+                  birth_properties_size(metric);
+    if(value_size == 0)
+        return body + 2;    // is_null
+    uint8_t tag[2];
+    return body + put_birth_value_tag(tag, metric) + value_size;
+}
+
+
+// Discard a birth cache.
+static void free_birth_cache(BirthCache *cache){
+    free(cache->buffer);
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
+
+
+// Drop every cached birth, so the next of each is encoded afresh.
+void invalidate_birth_cache(void){
+    for(int i = 0; i < MAX_BIRTH_CACHES; i++)
+        free_birth_cache(&m_birth_caches[i]);
+}
+
+
+// The birth cache for an array of metrics: the one it already has, otherwise
+// an unused one, otherwise NULL.
+static BirthCache * get_birth_cache(MetricSpec *metrics, int num_metrics){
+    BirthCache *unused = NULL;
+    for(int i = 0; i < MAX_BIRTH_CACHES; i++){
+        BirthCache *cache = &m_birth_caches[i];
+        if(cache->metrics == metrics && cache->num_metrics == num_metrics)
+            return cache;
+        if(cache->metrics == NULL && unused == NULL)
+            unused = cache;
+    }
+    if(unused != NULL){
+        unused->metrics = metrics;
+        unused->num_metrics = num_metrics;
+    }
+    return unused;
+}
+
+
+// Encode the layout of a birth into its cache: the bdSeq metric if there is
+// one, then every metric in the array that isn't disabled, each with its name
+// and a slot the size of its current value.  The values themselves are left
+// to fill_birth_cache().  An alias-only birth leaves out the names, as
+// birth_named() says.  Returns false, leaving the cache empty, if a metric
+// can't be cached.
+static bool layout_birth_cache(BirthCache *cache, MetricSpec *bdseq, bool alias_only){
+    MetricSpec *metrics = cache->metrics;
+    int num_metrics = cache->num_metrics;
+    free(cache->buffer);
+    free(cache->entries);
+    cache->buffer = NULL;
+    cache->len = 0;
+    cache->count = 0;
+    cache->has_bdseq = bdseq != NULL;
+    cache->alias_only = alias_only;
+
+    unsigned int count = cache->has_bdseq ? 1 : 0;
+    for(int i = 0; i < num_metrics; i++)
+        if(!metrics[i].disabled)
+            count++;
+    cache->entries = (FrozenMetric *) calloc(count, sizeof(*cache->entries));
+    if(cache->entries == NULL)
+        return false;
+
+    // Collect the metrics and work out the encoded size
+    size_t len = 1 + FROZEN_TIMESTAMP_WIDTH + 1 + FROZEN_SEQ_WIDTH;
+    unsigned int n = 0;
+    for(int i = cache->has_bdseq ? -1 : 0; i < num_metrics; i++){
+        MetricSpec *metric = i < 0 ? bdseq : &metrics[i];
+        if(metric->disabled && i >= 0)
+            continue;
+        size_t value_size = SIZE_MAX;
+        if(metric->variable != NULL && metric->name != NULL && birth_properties_size(metric) != SIZE_MAX)
+            value_size = birth_value_size(metric);
+        if(value_size == SIZE_MAX){
+            free(cache->entries);
+            cache->entries = NULL;
+            return false;
+        }
+        cache->entries[n].metric = metric;
+        cache->entries[n].value_size = value_size;
+        n++;
+        size_t body = birth_body_size(metric, value_size, birth_named(cache, metric, i < 0));
+        len += 1 + varint_size(body) + body;
+    }
+    if(len > 0xFFFF || (cache->buffer = (uint8_t *) malloc(len)) == NULL){
+        free(cache->entries);
+        cache->entries = NULL;
+        return false;
+    }
+
+    // Encode the layout, remembering where the patchable fields are
+    uint8_t *out = cache->buffer;
+    size_t pos = 0;
+    out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_timestamp_tag, WIRE_VARINT);
+    cache->timestamp_offset = pos;
+    pos += put_varint(&out[pos], 0, FROZEN_TIMESTAMP_WIDTH);
+    for(unsigned int i = 0; i < count; i++){
+        FrozenMetric *entry = &cache->entries[i];
+        MetricSpec *metric = entry->metric;
+        bool named = birth_named(cache, metric, cache->has_bdseq && i == 0);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_metrics_tag, WIRE_LENGTH);
+        pos += put_varint(&out[pos], birth_body_size(metric, entry->value_size, named), 0);
+        if(named){
+            size_t name_len = strlen(metric->name);
+            out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_name_tag, WIRE_LENGTH);
+            pos += put_varint(&out[pos], name_len, 0);
+            memcpy(&out[pos], metric->name, name_len);
+            pos += name_len;
+        }
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_alias_tag, WIRE_VARINT);
+        pos += put_varint(&out[pos], metric->alias, 0);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_timestamp_tag, WIRE_VARINT);
+        entry->timestamp_offset = pos;
+        pos += put_varint(&out[pos], 0, FROZEN_TIMESTAMP_WIDTH);
+        out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_datatype_tag, WIRE_VARINT);
+        pos += put_varint(&out[pos], metric->datatype, 0);
+        if(entry->value_size == 0){
+            out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_Metric_is_null_tag, WIRE_VARINT);
+            out[pos++] = 1;
+        }
+        // Properties come between is_null and the value, in field order
+        pos += put_birth_properties(&out[pos], metric);
+        if(entry->value_size == 0){
+            entry->value_offset = pos;
+            continue;
+        }
+        pos += put_birth_value_tag(&out[pos], metric);
+        entry->value_offset = pos;
+        memset(&out[pos], 0, entry->value_size);
+        pos += entry->value_size;
+    }
+    out[pos++] = WIRE_TAG(org_eclipse_tahu_protobuf_Payload_seq_tag, WIRE_VARINT);
+    cache->seq_offset = pos;
+    pos += put_varint(&out[pos], 0, FROZEN_SEQ_WIDTH);
+
+    cache->len = pos;
+    cache->count = count;
+    return true;
+}
+
+
+// Patch the current values and timestamps into a cached birth, taking the
+// bdSeq value from bdseq.  Returns false, changing nothing, if the layout no
+// longer fits: a different bdSeq metric, a metric enabled or disabled, a value
+// whose slot is the wrong size, or names wanted where they were left out (or
+// the other way round).
+static bool fill_birth_cache(BirthCache *cache, MetricSpec *bdseq, bool alias_only){
+    if(cache->buffer == NULL || cache->has_bdseq != (bdseq != NULL) || cache->alias_only != alias_only)
+        return false;
+    unsigned int first = 0;
+    if(bdseq != NULL){
+        MetricSpec *cached = cache->entries[0].metric;
+        if(bdseq->alias != cached->alias || bdseq->datatype != cached->datatype ||
+           bdseq->variable == NULL || strcmp(bdseq->name, cached->name) != 0)
+            return false;
+        cache->entries[0].metric = bdseq;
+        first = 1;
+    }
+    unsigned int enabled = 0;
+    for(int i = 0; i < cache->num_metrics; i++)
+        if(!cache->metrics[i].disabled)
+            enabled++;
+    if(enabled != cache->count - first)
+        return false;
+    for(unsigned int i = 0; i < cache->count; i++){
+        MetricSpec *metric = cache->entries[i].metric;
+        if((metric->disabled && i >= first) || birth_value_size(metric) != cache->entries[i].value_size)
+            return false;
+    }
+
+    // As add_metrics() does for a full payload, the values are no longer
+    // pending and any without a timestamp get one now
+    for(unsigned int i = 0; i < cache->count; i++){
+        FrozenMetric *entry = &cache->entries[i];
+        MetricSpec *metric = entry->metric;
+        metric->updated = false;
+        if(metric->timestamp == 0)
+            metric->timestamp = m_gettimestamp();
+        put_varint(&cache->buffer[entry->timestamp_offset], metric->timestamp, FROZEN_TIMESTAMP_WIDTH);
+        if(entry->value_size != 0)
+            put_birth_value(&cache->buffer[entry->value_offset], metric);
+    }
+    for(int i = 0; i < cache->num_metrics; i++)
+        cache->metrics[i].updated = false;
+    MetricIndex *index = get_metric_index(cache->metrics, cache->num_metrics);
+    if(index != NULL && index->dirty != NULL){
+        memset(index->dirty, 0, DIRTY_WORDS(cache->num_metrics) * sizeof(*index->dirty));
+        index->changed = false;
+    }
+    if(bdseq != NULL && (index = get_metric_index(bdseq, 1)) != NULL && index->dirty != NULL)
+        index->dirty[0] = 0;
+    put_varint(&cache->buffer[cache->timestamp_offset], m_gettimestamp(), FROZEN_TIMESTAMP_WIDTH);
+    put_varint(&cache->buffer[cache->seq_offset], m_seq, FROZEN_SEQ_WIDTH);
+    return true;
+}
+
+
+// Publish a cached birth as it is to all connected brokers.  Returns true if it
+// published to at least one broker; otherwise returns false.
+static bool publish_birth_cache(BirthCache *cache, PubSubClient *broker_array, int num_brokers,
+                                const char *topic){
+    bool published = false;
+    for(int i = 0; i < num_brokers; ++i){
+        PubSubClient *broker = &broker_array[i];
+        if(!broker->connected())
+            continue;
+        OutboundQueue *queue = get_outbound_queue(broker);
+        if(queue != NULL){
+            // Seq is the last field; the queue appends its own
+            size_t len = cache->len - 1 - FROZEN_SEQ_WIDTH;
+            if(len + SEQ_FIELD_SIZE > queue->message_size){
+                set_error(SPARKPLUG_TOO_BIG, "queued payload");
+                continue;
+            }
+            OutboundMessage *msg = reserve_outbound(queue, topic, true);
+            if(msg == NULL)
+                continue;
+            memcpy(msg->data, cache->buffer, len);
+            msg->len = len;
+            published = true;
+            continue;
+        }
+        uint8_t *seq = broker_seq(broker, topic);
+        put_varint(&cache->buffer[cache->seq_offset], *seq, FROZEN_SEQ_WIDTH);
+        if(!write_publish(broker, topic, cache->buffer, cache->len)){
+            set_error(SPARKPLUG_PUBLISH_FAILED, topic, i);
+            continue;
+        }
+        (*seq)++;
+        published = true;
+    }
+
+    if(published)
+        m_seq++;
+    return published;
+}
+
+
+// Publish a birth message: the bdSeq metric, if bdseq isn't NULL, then all the
+// metrics in the array with their names, or without if the host has confirmed
+// their definitions (see set_alias_only_births()).  It's patched into the
+// array's birth cache where that still fits, otherwise encoded into it afresh;
+// births the cache can't take (Template metrics, or compression on) are
+// published as publish_metrics() would, always with names.  Returns true if it
+// published to at least one broker; otherwise, returns false.
+bool publish_birth(PubSubClient *broker_array, int num_brokers, const char *topic,
+                   MetricSpec *bdseq, MetricSpec *metrics, int num_metrics){
+    clear_error();
+    if(broker_array == NULL || num_brokers <= 0 || topic == NULL ||
+       metrics == NULL || num_metrics <= 0){
+        set_error(SPARKPLUG_INVALID, "Empty broker or metrics array, or null topic");
+        return false;
+    }
+    if(strstr(topic, "/" NBIRTH_MESSAGE_TYPE "/") != NULL)
+        set_up_nbirth_payload();
+    else
+        set_up_next_payload();
+
+    BirthCache *cache = m_compress_threshold == 0 ? get_birth_cache(metrics, num_metrics) : NULL;
+    bool alias_only = m_alias_only_hash != 0 &&
+                      birth_definitions_hash(bdseq, metrics, num_metrics) == m_alias_only_hash;
+    if(cache != NULL && !fill_birth_cache(cache, bdseq, alias_only) &&
+       !(layout_birth_cache(cache, bdseq, alias_only) && fill_birth_cache(cache, bdseq, alias_only))){
+        free_birth_cache(cache);
+        cache = NULL;
+    }
+    // The padding makes a cached birth a little bigger than an encoded one,
+    // which might still fit the outbound queues when it doesn't
+    size_t limit = queued_payload_limit();
+    if(cache != NULL && limit != 0 && cache->len - 1 - FROZEN_SEQ_WIDTH > limit){
+        free_birth_cache(cache);
+        cache = NULL;
+    }
+    if(cache == NULL)
+        return (bdseq == NULL || add_metrics(true, bdseq, 1)) &&
+               publish_metrics(broker_array, num_brokers, topic, true, metrics, num_metrics);
+    return publish_birth_cache(cache, broker_array, num_brokers, topic);
+}
+
+
+// FNV-1a over size bytes, continuing from hash
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t size){
+    const uint8_t *bytes = (const uint8_t *) data;
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Hash of the definitions a birth of the array would carry: the name, alias
+// and datatype of the bdSeq metric, unless bdseq is NULL, and of each metric
+// that isn't disabled.  Never 0.
+uint32_t birth_definitions_hash(MetricSpec *bdseq, MetricSpec *metrics, int num_metrics){
+    uint32_t hash = 2166136261u;
+    for(int i = bdseq != NULL ? -1 : 0; i < num_metrics; i++){
+        MetricSpec *metric = i < 0 ? bdseq : &metrics[i];
+        if(metric->disabled && i >= 0)
+            continue;
+        uint32_t alias = metric->alias;
+        hash = hash_bytes(hash, metric->name, strlen(metric->name) + 1);
+        hash = hash_bytes(hash, &alias, sizeof(alias));
+        hash = hash_bytes(hash, &metric->datatype, sizeof(metric->datatype));
+    }
+    return hash != 0 ? hash : 1;
+}
+
+
+// Leave the names out of births whose definitions hash to hash, except for the
+// bdSeq metric and the metric with alias named_alias.  0 names every metric.
+void set_alias_only_births(uint32_t hash, unsigned int named_alias){
+    m_alias_only_hash = hash;
+    m_alias_only_named = named_alias;
+}
+
+
 // Check to see if a received message is a Primary Host state message.  If it
 // is, handle it and return true, even if it's invalid; otherwise return false.
 bool process_host_state_message(const char *topic, byte *payload, unsigned int len,
@@ -625,25 +3540,24 @@ bool process_host_state_message(const char *topic, byte *payload, unsigned int l
 
     // Since the function returns true or false to indicate whether this was a
     // Primary Host state message, an empty error message indicates no error
-    strcpy(cf_sparkplug_error, "");
+    clear_error();
 
     // Check Primary Host state
     bool online = false;
     char *payload_str = (char *) payload;
     if(payload_str == NULL)
         // No state string - assume Primary Host is not online
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Null Primary Host state: NULL, len = %u", len);
-    else if(strcmp(payload_str, HOST_ONLINE) == 0)
+        set_error(SPARKPLUG_MALFORMED, "Null Primary Host state", len);
+    // The payload isn't NUL terminated
+    else if(len == strlen(HOST_ONLINE) && memcmp(payload_str, HOST_ONLINE, len) == 0)
         // Primary Host is connected to this broker
         online = true;
-    else if(strcmp(payload_str, HOST_OFFLINE) == 0){
+    else if(len == strlen(HOST_OFFLINE) && memcmp(payload_str, HOST_OFFLINE, len) == 0){
         // Primary Host is not connected to this broker
     }
     else
         // Unrecognized state - assume Primary Host is not online
-        snprintf(cf_sparkplug_error, sizeof(cf_sparkplug_error),
-                 "Unrecognized Primary Host state: \"%.*s\"", len, payload_str);
+        set_error(SPARKPLUG_MALFORMED, "Unrecognized Primary Host state", len);
 
     // Copy the online indicator back to the caller, if desired
     if(host_online != NULL)
@@ -32,7 +32,15 @@
 #define NCMD_MESSAGE_TYPE     "NCMD"            // Node command message identifier
 #define DCMD_MESSAGE_TYPE     "DCMD"            // Device command message identifier
 
-#define BIN_BUF_SIZE  2048  // Binary data buffer size for Sparkplug
+#define BIN_BUF_SIZE  512   // Binary data buffer size for Sparkplug; holds the
+                            // encoded Will (NDEATH) payload.  Published payloads
+                            // are streamed to the broker and aren't limited by it.
+#define MQTT_BUF_SIZE 1536  // PubSubClient buffer size; incoming messages, up to
+                            // a calibration upload, and the Will payload
+#ifndef MQTT_WRITE_SEGMENT
+#define MQTT_WRITE_SEGMENT 1460  // Socket write size for publishes: one full TCP
+                                 // segment (Ethernet MSS); see socket_write_stats()
+#endif
 
 #define NODE_TOPIC(type, node_id)               SPARKPLUG_VERSION "/" GROUP_ID "/" type "/" node_id
 #define DEVICE_TOPIC(type, node_id, device_id)  SPARKPLUG_VERSION "/" GROUP_ID "/" type "/" node_id "/" device_id
@@ -41,39 +49,225 @@
 #define ARRAY_AND_SIZE(array)  (array), NUM_ELEM(array)
 
 
+// Sparkplug 3.0 array datatypes, which tahu.h predates.  The value is sent as
+// bytes_value holding the packed little-endian elements.  The variable of an
+// array metric is a METRIC_ARRAY_T whose size is the number of bytes in use.
+#define METRIC_DATA_TYPE_INT32_ARRAY  24
+#define METRIC_DATA_TYPE_FLOAT_ARRAY  30
+
+#define METRIC_ARRAY_T(type, n)     PB_BYTES_ARRAY_T(sizeof(type) * (n))
+#define METRIC_ARRAY_INIT(type, n)  {sizeof(type) * (n), {0}}
+
 // Short-form type names for readability
 typedef org_eclipse_tahu_protobuf_Payload         Payload;
 typedef org_eclipse_tahu_protobuf_Payload_Metric  Metric;
-
-// This structure stores the specification for a metric
+typedef org_eclipse_tahu_protobuf_Payload_PropertySet    PropertySet;
+typedef org_eclipse_tahu_protobuf_Payload_PropertyValue  PropertyValue;
+typedef org_eclipse_tahu_protobuf_Payload_DataSet       DataSet;
+typedef org_eclipse_tahu_protobuf_Payload_DataSet_Row   DataSetRow;
+typedef org_eclipse_tahu_protobuf_Payload_DataSet_DataSetValue  DataSetValue;
+
+// How a metric is published after the birth it's defined in.  Birth-only
+// metrics (firmware version, units...) never change once born, so they can't be
+// marked updated and no NDATA looks at them.  Streaming metrics are updated with
+// every frame; an NDATA only walks their part of an indexed array unless an
+// on-change metric (a setting, a status) has been updated too.
+typedef enum
+{
+    METRIC_ON_CHANGE,
+    METRIC_BIRTH_ONLY,
+    METRIC_STREAMING
+} MetricKind;
+
+// This structure stores the specification for a metric.  The fields the
+// per-frame updates and NDATA encoding touch come first, and the fields are
+// ordered so there's no padding: 32 bytes on the Teensy.  Build rows with
+// METRIC_SPEC() rather than by position.
 typedef struct
 {
-    const char   *name;
-    unsigned int  alias;
-    bool          writable;
-    uint32_t      datatype;
+    unsigned long long timestamp;
     void         *variable;
     bool          updated;
-    unsigned long long timestamp;
+    bool          disabled;     // Left out of every payload while set
+    bool          writable;
+    uint8_t       kind;         // MetricKind
+    uint32_t      datatype;
+    unsigned int  alias;
+    const char   *name;
+    const PropertySet *properties;  // Sent with the metric in births; NULL for none
 } MetricSpec;
 
+// A metric row: not updated, unstamped, enabled, on-change and without properties
+#define METRIC_SPEC(name, alias, writable, datatype, variable) \
+    {0, (variable), false, false, (writable), METRIC_ON_CHANGE, (datatype), (alias), (name), NULL}
+
+
+// The variable of a Template metric (METRIC_DATA_TYPE_TEMPLATE): a definition
+// if template_ref is NULL, otherwise an instance of the definition it names.
+// Each member is sent as a metric with the member's name, datatype and
+// variable; members aren't indexed and have no aliases of their own.  An
+// instance in NDATA only carries the members marked updated.
+typedef struct
+{
+    const char   *template_ref;
+    MetricSpec   *members;
+    unsigned int  num_members;
+} MetricTemplate;
+
+// The variable of a DataSet metric (METRIC_DATA_TYPE_DATASET) is a DataSet
+// whose columns, types and rows point at the caller's storage; it's sent whole
+// in every payload it's in.
+
+
+// Type-checked metric rows.  metric_spec() builds the same row as
+// METRIC_SPEC(), but only if the variable has the C type the datatype is
+// encoded from.  In a constexpr table anything else fails the build, as the
+// call to metric_variable_type_mismatch() isn't a constant expression; a row
+// built at run time is left empty instead, so check_metrics() rejects it.  A
+// module with variable types of its own adds metric_type_matches() overloads
+// for them before its tables.
+void metric_variable_type_mismatch();
+
+constexpr bool metric_type_matches(uint32_t datatype, const bool *){
+    return datatype == METRIC_DATA_TYPE_BOOLEAN;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const int16_t *){
+    return datatype == METRIC_DATA_TYPE_INT16;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const int32_t *){
+    return datatype == METRIC_DATA_TYPE_INT32;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const uint64_t *){
+    return datatype == METRIC_DATA_TYPE_INT64;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const float *){
+    return datatype == METRIC_DATA_TYPE_FLOAT;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const char * const *){
+    return datatype == METRIC_DATA_TYPE_STRING;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const DataSet *){
+    return datatype == METRIC_DATA_TYPE_DATASET;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const MetricTemplate *){
+    return datatype == METRIC_DATA_TYPE_TEMPLATE;
+}
+// Any PB_BYTES_ARRAY_T or METRIC_ARRAY_T, sent as bytes_value
+template<typename T>
+constexpr auto metric_type_matches(uint32_t datatype, const T *) -> decltype(((const T *) 0)->bytes, bool()){
+    return datatype == METRIC_DATA_TYPE_BYTES || datatype == METRIC_DATA_TYPE_INT32_ARRAY ||
+           datatype == METRIC_DATA_TYPE_FLOAT_ARRAY;
+}
+
+template<typename T>
+constexpr MetricSpec metric_spec(const char *name, unsigned int alias, bool writable,
+                                 uint32_t datatype, T *variable){
+    return metric_type_matches(datatype, variable) ?
+           MetricSpec METRIC_SPEC(name, alias, writable, datatype, variable) :
+           (metric_variable_type_mismatch(), MetricSpec{});
+}
+
+
+// A command payload decoded by decode_command_payload(), with all storage
+// inline so command handling never touches the heap.  Names, string values and
+// bytes values point into strings.
+#define MAX_COMMAND_METRICS   16
+#define COMMAND_STRINGS_SIZE  1536
+
+typedef struct
+{
+    unsigned long long timestamp;
+    unsigned int       metrics_count;
+    Metric             metrics[MAX_COMMAND_METRICS];
+    char               strings[COMMAND_STRINGS_SIZE];
+} CommandPayload;
+
+
+// A data payload (NBIRTH, NDATA, DBIRTH, DDATA) decoded by
+// decode_data_payload(), for a host reading what nodes publish.  As with
+// CommandPayload all storage is inline, so a host can decode every message into
+// one static DataPayload however many nodes it follows; at over 100 KB it's too
+// big for the node's own RAM.  A compressed envelope is inflated into inflated
+// and the payload inside decoded, with the envelope's seq.
+#define MAX_DATA_METRICS      512
+#define DATA_STRINGS_SIZE     16384
+#define DATA_INFLATE_SIZE     16384
+
+typedef struct
+{
+    bool               has_timestamp;
+    unsigned long long timestamp;
+    bool               has_seq;
+    unsigned long long seq;
+    bool               compressed;
+    unsigned int       metrics_count;
+    Metric             metrics[MAX_DATA_METRICS];
+    char               strings[DATA_STRINGS_SIZE];
+    uint8_t            inflated[DATA_INFLATE_SIZE];
+} DataPayload;
+
 
 typedef unsigned long long (*GetTimestamp)(void);
 
+// What to do with NDATA/DDATA messages when a broker's outbound queue backs up.
+// Births and deaths are never dropped.
+typedef enum
+{
+    OUTBOUND_DROP_OLDEST,   // When the queue is full, drop the oldest waiting data message
+    OUTBOUND_COALESCE       // Keep only the newest waiting data message on each topic
+} OutboundPolicy;
+
+
+// Module errors.  A function that fails records one of these, read back with
+// sparkplug_error(); a call that returns false without recording one (such as
+// publishing while no broker is connected) leaves SPARKPLUG_OK.
+typedef enum
+{
+    SPARKPLUG_OK,
+    SPARKPLUG_NO_METRICS,       // Nothing to publish; routine for NDATA
+    SPARKPLUG_INVALID,          // Null or empty argument, or not set up
+    SPARKPLUG_NO_MEMORY,
+    SPARKPLUG_TOO_MANY,         // A fixed limit (metrics, queues, indexes...) exceeded
+    SPARKPLUG_NO_SUCH_METRIC,
+    SPARKPLUG_BAD_METRIC,       // Invalid metric spec: empty name, bad alias, no variable
+    SPARKPLUG_TYPE_MISMATCH,
+    SPARKPLUG_READ_ONLY,
+    SPARKPLUG_UNSUPPORTED,      // Datatype that can't be sent or frozen
+    SPARKPLUG_ENCODE_FAILED,
+    SPARKPLUG_TOO_BIG,          // Payload or topic too big for the outbound queue
+    SPARKPLUG_QUEUE_FULL,
+    SPARKPLUG_PUBLISH_FAILED,
+    SPARKPLUG_CONNECT_FAILED,
+    SPARKPLUG_MALFORMED,        // Received message that can't be decoded
+    NUM_SPARKPLUG_ERRORS
+} SparkplugError;
 
-// Module error message, set when an error occurs
 #define MAX_CF_SPARKPLUG_ERROR_LEN  200
-extern char cf_sparkplug_error[MAX_CF_SPARKPLUG_ERROR_LEN];
 
 
 // Public functions
 
+// The error recorded by the last call that failed, or SPARKPLUG_OK.
+SparkplugError sparkplug_error(void);
+
+// The last error as a message, formatted only when this is called (for debug
+// output).  The text is overwritten by the next call.
+const char * sparkplug_error_text(void);
+
 // Set the callback function to get the timestamp for a payload or metric.
 void set_gettimestamp_callback(GetTimestamp timestamp_function);
 
 // Set the maximum number of metrics that will ever need to be sent in a single
-// payload.
-void set_max_metrics(unsigned int max_metrics);
+// payload, counting the members of any Template metrics.  The storage for them
+// is reallocated on the heap, unless set_metric_storage() has been called: then
+// this fails if max_metrics is more than that storage holds.
+bool set_max_metrics(unsigned int max_metrics);
+
+// Keep the payload metrics in storage, an array of max_metrics metrics sized at
+// compile time, rather than on the heap.  The limit is then fixed, and
+// check_metrics()/index_metrics() fail on an array bigger than it.  NULL goes
+// back to heap storage (with no metrics until set_max_metrics()).
+void set_metric_storage(Metric *storage, unsigned int max_metrics);
 
 // Assign the specified variable pointer to the metric in the array with the
 // specified alias.  Returns false if no such metric exists or if the variable
@@ -81,12 +275,25 @@ void set_max_metrics(unsigned int max_metrics);
 bool set_metric_variable(MetricSpec *metrics, int num_metrics,
                          unsigned int alias, void *variable);
 
+// Leave the metric with the specified alias out of (or put it back into) every
+// payload, births included.  A frozen payload must be frozen again afterwards.
+// Returns false if no such metric exists.
+bool set_metric_disabled(MetricSpec *metrics, int num_metrics,
+                         unsigned int alias, bool disabled);
+
 // Make sure all the metrics in the given array have unique alias numbers in
-// the given range, have non-empty names, and have been linked to variables.
+// the given range, have non-empty names, have datatypes that can be sent, and
+// have been linked to variables.
 // Also, if necessary increase the maximum number of metrics that can be sent
-// in a single payload to the number of metrics in this array.
+// in a single payload to the number of metrics in this array.  The array is
+// then indexed so that lookups by alias, variable or name on it take constant
+// time (up to 4 arrays; others fall back to a linear scan).
 bool check_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias);
 
+// Set up a metrics array that's already known to be valid, as check_metrics()
+// does after checking it: raise the payload metric limit and index the array.
+bool index_metrics(MetricSpec *metrics, int num_metrics, unsigned int end_alias);
+
 // Return a pointer to the metric in the array with the specified alias.
 // Returns NULL if no such metric exists.
 MetricSpec * find_metric_by_alias(MetricSpec *metrics, int num_metrics,
@@ -100,7 +307,8 @@ MetricSpec * find_metric_by_variable(MetricSpec *metrics, int num_metrics,
 // Return a pointer to the metric in the array that matches the received metric.
 // If the name is supplied, it is used to find a match.  Otherwise the alias is
 // used to find a match.  Returns NULL if no such metric exists, if the data
-// type doesn't match, or if the metric is read-only.
+// type doesn't match, if the metric is null or its value isn't in the field
+// its datatype uses, or if the metric is read-only.
 MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *metric);
 
 // Mark the metric with the specified variable as updated.  This also sets its
@@ -108,11 +316,28 @@ MetricSpec * find_received_metric(MetricSpec *metrics, int num_metrics, Metric *
 // true.
 bool update_metric(MetricSpec *metrics, int num_metrics, void *variable);
 
+// Mark the count metrics with consecutive aliases starting at first_alias as
+// updated, all with the same timestamp (the current time if timestamp is
+// zero).  On an indexed array this is a few bitset writes.  Returns false if
+// any alias in the range doesn't exist; otherwise returns true.
+bool update_metric_range(MetricSpec *metrics, int num_metrics, unsigned int first_alias,
+                         unsigned int count, unsigned long long timestamp);
+
 // Connect to the specified broker with the specified node ID and will topic
 // using the current module payload.  Returns true if successful, or false if
 // an error occurs.
 bool connect(PubSubClient *broker, const char *nodeId, const char *willTopic);
 
+// Start connecting to the specified broker as connect() does, but return once
+// the CONNECT packet is sent rather than waiting for the broker to accept it.
+// The TCP connect still blocks for up to the client's connection timeout.
+// Returns false if an error occurs.
+bool begin_connect(PubSubClient *broker, const char *nodeId, const char *willTopic);
+
+// Check on a connection started with begin_connect().  Returns 1 once the
+// broker has accepted it, 0 while still waiting, or -1 if it failed.
+int poll_connect(PubSubClient *broker);
+
 // Disconnect from the current broker.  If finalTopic is specified, a final
 // message will be published before disconnecting using the specified topic and
 // the current module payload.
@@ -127,6 +352,15 @@ void set_up_nbirth_payload(void);
 // Set up the module payload for an NDEATH message, with no metrics yet.
 void set_up_ndeath_payload(void);
 
+// Devices share the node's seq: a DBIRTH, DDATA or DDEATH is set up with
+// set_up_next_payload() like an NDATA, and its metrics are a table of their own
+// whose aliases are unique across the node and all its devices.
+
+// Publish a DDEATH message, which carries just the timestamp and seq, with the
+// specified topic to all the brokers.  Returns true if it published to at least
+// one broker; otherwise, returns false.
+bool publish_device_death(PubSubClient *broker_array, int num_brokers, const char *topic);
+
 // Add the metric with the specified alias or variable to the module payload.
 // If variable is non-NULL then it is used to locate the matching metric.  If
 // variable is NULL then the alias is used to locate the matching metric.  If
@@ -136,18 +370,135 @@ void set_up_ndeath_payload(void);
 bool add_metric(bool full, MetricSpec *metrics, int num_metrics, void *variable,
                 unsigned int alias);
 
+// Add the metric with the specified alias to the module payload with its name,
+// as a full add_metric() would, but leaving its updated flag alone so a change
+// still pending goes out with the next NDATA.  Returns false if an error
+// occurs; otherwise returns true.
+bool add_named_metric(MetricSpec *metrics, int num_metrics, unsigned int alias);
+
+// Add a historical value of the metric with the specified alias to the module
+// payload, with is_historical set and the value taken from variable instead of
+// the metric's own variable.  Returns false if an error occurs; otherwise
+// returns true.
+bool add_historical_metric(MetricSpec *metrics, int num_metrics, unsigned int alias,
+                           void *variable, unsigned long long timestamp);
+
+// Add a live value of the metric with the specified alias to the module
+// payload, stamped with the time it was sampled, so one payload can carry
+// several samples of the metric.  Otherwise as add_historical_metric().
+bool add_sampled_metric(MetricSpec *metrics, int num_metrics, unsigned int alias,
+                        void *variable, unsigned long long timestamp);
+
 // Add any updated metrics in the array to the module payload.  If full is true
 // include all the metrics, whether updated or not, together with their names.
 // Returns false if an error occurs; otherwise returns true.
 bool add_metrics(bool full, MetricSpec *metrics, int num_metrics);
 
+// Freeze the NDATA layout for the count metrics with consecutive aliases
+// starting at first_alias, less any disabled ones, which must be floats, integers or
+// arrays whose size doesn't change afterwards: the payload is encoded once, and each
+// publish_frozen_payload() only patches values, timestamps and seq into it.
+// Replaces any previously frozen payload.  Returns false if an error occurs.
+bool freeze_payload(MetricSpec *metrics, int num_metrics, unsigned int first_alias,
+                    unsigned int count);
+
+// Discard the frozen payload, if any.
+void unfreeze_payload(void);
+
+// Returns true if a frozen payload has been built.
+bool payload_frozen(void);
+
+// Publish the frozen payload with the current values of its metrics, all with
+// the specified timestamp (the current time if zero), to all connected brokers.
+// Returns true if it published to at least one broker; otherwise returns false.
+bool publish_frozen_payload(PubSubClient *broker_array, int num_brokers, const char *topic,
+                            unsigned long long timestamp);
+
+// Give the broker an outbound queue, drained through its network client.  From
+// then on, publishing to it only queues the message, and it goes out as
+// drain_outbound_queues() finds room in the socket.  Each queued message can be
+// up to message_size bytes (8 KB if 0); a larger NDATA/DDATA is split over
+// several messages, but a birth has to fit.  Returns false if an error occurs.
+bool set_up_outbound_queue(PubSubClient *broker, Client *client, size_t message_size);
+
+// Set the drop/coalesce policy for data messages in all outbound queues.
+void set_outbound_policy(OutboundPolicy policy);
+
+// Set the QoS (0 or 1) of the NDATA/DDATA queued from now on.  At QoS 1 a few
+// are kept in flight at once until the broker acks them; any not acked when
+// the connection drops are sent again after the births on reconnecting.
+void set_outbound_qos(uint8_t qos);
+
+// Write as much of each outbound queue as its socket will take without
+// blocking.  Call this regularly from loop().
+void drain_outbound_queues(void);
+
+// Returns true while a queued message is partly written to the broker.  The
+// broker's loop() mustn't be called then, as it could write a ping into the
+// middle of the message.
+bool outbound_in_flight(PubSubClient *broker);
+
+// Number of messages in the broker's outbound queue.
+unsigned int outbound_queue_depth(PubSubClient *broker);
+
+// Largest number of messages in the broker's outbound queue since the last call.
+unsigned int outbound_queue_peak(PubSubClient *broker);
+
+// Longest a message took to get through the broker's outbound queue since the
+// last call, from being queued to being written, or acked at QoS 1, in ms; or
+// how long the oldest one still queued has waited, if longer.
+unsigned long outbound_latency(PubSubClient *broker);
+
+// Number of data messages the broker's outbound queue has dropped.
+unsigned long outbound_dropped(PubSubClient *broker);
+
+// Number of QoS 1 messages the broker's outbound queue has sent again after
+// reconnecting.
+unsigned long outbound_retransmitted(PubSubClient *broker);
+
+// Each MQTT PUBLISH is built contiguously, header and topic in front of the
+// payload, and handed to the socket MQTT_WRITE_SEGMENT bytes at a time, so a
+// message takes as few, and as full, TCP segments as it can.
+typedef struct
+{
+    unsigned long      publishes;   // PUBLISH packets written whole
+    unsigned long      writes;      // Socket writes they took
+    unsigned long long bytes;       // Bytes written, MQTT headers included
+} SocketWriteStats;
+
+// Publish and socket write counts, over all brokers, since the last call.
+void socket_write_stats(SocketWriteStats *stats);
+
+// Publish payloads whose encoding is at least threshold bytes (up to 16 KB) in
+// the Sparkplug compressed envelope, DEFLATE'd, when that makes them smaller.
+// 0 turns compression off, the default.
+void set_payload_compression(size_t threshold);
+
+// The threshold set by set_payload_compression().
+size_t payload_compression(void);
+
 // Publish the module payload with the specified topic to all the brokers.
 // Doesn't publish to brokers that we're not connected to or if the payload has
-// no metrics.  Note that this sends a duplicate of the message to each broker,
-// so the seq and timestamp fields will be identical.  Returns true if it
-// successfully published to at least one broker; otherwise, returns false.
+// no metrics.  Each broker gets the same body and timestamp, with the seq that
+// broker is up to: each keeps its own count, restarted by its NBIRTH, so a
+// broker that misses a message doesn't leave a gap on the others.  Returns
+// true if it successfully published to at least one broker; otherwise, returns
+// false.
 bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *topic);
 
+// Publish the module payload with the specified topic to all the brokers as a
+// retained MQTT message, without a seq and leaving the module's seq alone.  Only
+// for topics outside the Sparkplug namespace, which doesn't allow retained
+// messages.  Returns true if it published to at least one broker; otherwise,
+// returns false.
+bool publish_retained_payload(PubSubClient *broker_array, int num_brokers, const char *topic);
+
+// Publish the module payload with the specified topic to all the brokers
+// without a seq, leaving the module's seq alone.  Only for topics outside the
+// Sparkplug namespace whose messages aren't to be retained.  Returns true if it
+// published to at least one broker; otherwise, returns false.
+bool publish_unsequenced_payload(PubSubClient *broker_array, int num_brokers, const char *topic);
+
 // Add the specified metrics to the module payload and publish it.  This
 // function combines the add_metrics() function and the publish_payload()
 // function.  Returns true if it successfully published to at least one broker;
@@ -155,6 +506,55 @@ bool publish_payload(PubSubClient *broker_array, int num_brokers, const char *to
 bool publish_metrics(PubSubClient *broker_array, int num_brokers, const char *topic,
                      bool full, MetricSpec *metrics, int num_metrics);
 
+// Publish a birth (NBIRTH or DBIRTH) with the bdSeq metric, unless bdseq is
+// NULL, followed by all the metrics in the array, to all the brokers.  The
+// encoded birth is cached per array, so a rebirth only patches the current
+// values, timestamps and seq into it instead of encoding every name again.
+// Returns true if it published to at least one broker; otherwise, returns false.
+bool publish_birth(PubSubClient *broker_array, int num_brokers, const char *topic,
+                   MetricSpec *bdseq, MetricSpec *metrics, int num_metrics);
+
+// Hash of the metric definitions (name, alias and datatype) a birth of the
+// array would carry, the bdSeq metric's included unless bdseq is NULL.  It
+// changes when a metric is enabled or disabled, and is never 0.
+uint32_t birth_definitions_hash(MetricSpec *bdseq, MetricSpec *metrics, int num_metrics);
+
+// Publish births whose definitions hash to hash without metric names, once a
+// host has confirmed it holds those definitions from an earlier birth.  The
+// bdSeq metric and the metric with alias named_alias keep their names, so the
+// host can tell which definitions a birth has before it knows them.  Births
+// published other than from the birth cache always have names.  0, the
+// default, names every metric.
+void set_alias_only_births(uint32_t hash, unsigned int named_alias);
+
+// Drop the cached births, so each is encoded afresh next time.  Enabling or
+// disabling a metric does this itself; call it after changing the name, alias
+// or datatype of a metric.
+void invalidate_birth_cache(void);
+
+// Encode the module payload into buffer as publish_payload() would send it,
+// without publishing it or advancing seq.  Returns the encoded length, or 0 if
+// the payload has no metrics or doesn't fit.
+size_t encode_payload(uint8_t *buffer, size_t size);
+
+// Encode the payload into buffer with the plain encoder that publishing uses
+// for payloads whose metrics are all unnamed scalars (the shape of NDATA),
+// bypassing nanopb; the bytes match pb_encode()'s.  Returns the encoded length,
+// or 0 if the payload isn't of that shape or doesn't fit.
+size_t encode_plain_payload(const Payload *payload, uint8_t *buffer, size_t size);
+
+// Decode a received command (NCMD/DCMD) payload into command, without
+// allocating memory.  Returns false if the payload is malformed or has more
+// metrics or string data than a CommandPayload holds.
+bool decode_command_payload(const uint8_t *buffer, size_t len, CommandPayload *command);
+
+// Decode a received data payload into data, without allocating memory,
+// inflating a DEFLATE compressed envelope.  Metrics keep their alias, datatype,
+// timestamp, is_historical and is_null, and a name if they have one.  Returns
+// false if the payload is malformed, compressed some other way, or has more
+// metrics or string data than a DataPayload holds.
+bool decode_data_payload(const uint8_t *buffer, size_t len, DataPayload *data);
+
 // Check to see if a received message is a Primary Host state message.  If it
 // is, handle it and return true, even if it's invalid; otherwise return false.
 bool process_host_state_message(const char *topic, byte *payload, unsigned int len,
@@ -25,151 +25,854 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 #include "command_ADC.h"
 #include "thermistorMux_global.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_log.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_flexspi.h"
+#include <EventResponder.h>
 
-#define CS 10
-
-/*
-Resistance at 25 degrees C
-The beta coefficient of the thermistor (usually 3000-4000)
-*/
-#ifdef thermistor_10K
-    #define THERMISTORNOMINAL 10000
-    #define BCOEFFICIENT 2.514458134e-4 // = 1/3977, B = 3997 K
-#elif thermistor_2K 
-    #define THERMISTORNOMINAL 2200   
-    #define BCOEFFICIENT 2.544529262e-4 // = 1/3930, B = 3930 K
-#else 
+#ifndef THERMISTORNOMINAL
     #error A thermistor value must be defined.
 #endif
 
-// temp. for nominal resistance (almost always 25 C = 298.15 K)
-#define TEMPERATURENOMINAL 298.15   
-
 /*
 COMMAND Byte CMD[7:0]
 Device Address(Hard Coded into device) - CMD[7:6] 
 Register Address/ Fast COMMAND bits    - CMD[5:2]
 COMMAND type                           - CMD[1:0]
+Incremental writes are built by mcp_incremental_write() (see command_ADC_registers.h).
 */
-#define STANDBY 0b01101100
-#define POINT_CONFIG0_WRITE 0b01000110 //Command byte: Incremental write starting at Config0 register
-                                //      01 : Device address
-                                //    0001 : Register address; Config0
-                                //      10 : Incremental write; starting at register 0x1   
-#define POINT_MUX_WRITE 0b01011010 //CONVERSION byte; Incremental write starting at Mux register
-                                //      01 : Device address
-                                //    0110 : Register address; Mux Reg
-                                //      10 : Incremental write; starting at register 0x06
-#define CONFIG0_SET 0b11100011  //Config0 register byte: 0x01
-                                //     11 : Full shutdown mode disable
-                                //     10 : Internal digital clock selected; no output
-                                //     00 : No current applied to ADC inputs
-                                //     11 : ADC Conversion Mode selected
-#define CONFIG1_SET 0b00101000  //Config1 register byte: 0x02
-                                //     00 : Prescaler AMCLK = MCLK (default)
-                                //   1010 : Oversampling ratio; OSR = 20480 (data rate is 60 samples/sec)
-                                //     00 : Reserved = '00'
-#define CONFIG2_SET 0b10001111  // Config2 register byte: 0x03
-                                //     10 : Channel current x 1
-                                //    001 : Gain x 1
-                                //      1 : Analog input multiplexer auto-zeroing algorithm enabled
-                                //     11 : Reserved = '11'
-#define CONFIG3_SET 0b10000000  // Config3 register byte: 0x04
-                                //     10 : One-shot conversion or one-shot cycle in SCAN mode. It sets ADC_MODE[1:0] to ‘10’ (standby) at
-                                //          the end of the conversion or at the end of the conversion cycle in SCAN mode.
-                                //     00 : 24-bit (default ADC coding): 24-bit ADC data. It does not allow overrange (ADC code locked to
-                                //          0xFFFFFF or 0x800000).
-                                //      0 : 16-bit wide (CRC-16 only) (default)
-                                //      0 : CRC on communications disabled (default)
-                                //      0 : Digital offset cal disabled (default)
-                                //      0 : Digital gain cal diabled (default)
-#define IRQ_SET 0b00000010      // IRQ: Interrupt request register byte: 0x05
-                                //      x : Unimplemented, read as '0'
-                                //      x : ADCDATA has not been updated since last reading or last Reset (default)
-                                //      x : CRC error has not occurred for the Configuration registers (default)
-                                //      x : POR has not occurred since the last reading (default)
-                                //      0 : IRQ output is selected. All interrupts can appear on the IRQ/MDAT pin.
-                                //      0 : The Inactive state is high-Z (requires a pull-up resistor to DV_DD) (default)
-                                //      1 : Enable Fast Commands in the command Byte
-                                //      0 : Disable Conversion Start Interrupt Output
-#define THERM_MUX_SET 0b00000001 // Multiplexer regiter byte: 0x06, set to thermistor output data
-                                //   0000 : CH0 = MUX_VIN+ Input  
-                                //   0001 : Ch1 = MUX_VIN- Input
-#define ADC_TEMP_MUX_SET 0xDE // Multiplexer regiter byte: 0x06, set to internal temperature data
-                                //   1101 : Internal temp diode P 
-                                //   1110 : Internal temp diode M                                 
+#define STANDBY 0b01101100 //Fast command: ends the conversion in progress
+#define START_CONVERSION 0b01101000 //Fast command: starts/restarts a conversion
 #define ADCDATA_READ 0b01000001 //Command byte: Read ADC Conversion Data
                                 //      01 : Device address
                                 //    0000 : Register address 
                                 //      01 : Static Read   
-#define V_REF_MUX_SET 0b10111100 // Multiplexer regiter byte: 0x06, set to read Vref
-                                //   1011 : REFIN+
-                                //   1100 : REFIN- 
-#define START_CONVERSION 0b01101000 // Fast Command
+#define POINT_CONFIG0_READ 0b01000111 //Command byte: Incremental read starting at Config0 register
+                                //      01 : Device address
+                                //    0001 : Register address; Config0
+                                //      11 : Incremental read; starting at register 0x1
+#define POINT_IRQ_READ 0b01010101 //Command byte: Static read of IRQ register, to poll the STATUS byte
+                                //      01 : Device address
+                                //    0101 : Register address; IRQ Reg
+                                //      01 : Static read
+#define POINT_TIMER_READ 0b01100011 //Command byte: Incremental read starting at Timer register
+                                //      01 : Device address
+                                //    1000 : Register address; Timer Reg
+                                //      11 : Incremental read; starting at register 0x08
+#define STATUS_DR 0b00000100    //STATUS byte DR_STATUS, low once new ADCDATA is ready
+#define STATUS_CRCCFG 0b00000010 //STATUS byte CRCCFG_STATUS, low once a locked register no longer matches CRCCFG
+#define STATUS_POR 0b00000001   //STATUS byte POR_STATUS, low after a power-on reset until the IRQ register is read
+#define LOCK_PASSWORD 0xA5      //LOCK register: unlocks the register writes; any other value locks them
+#define LOCK_SET 0x00           //  and takes CRCCFG of the registers as they are, for CRCCFG_STATUS to check
+#define CONFIG0_MODE_MASK 0b00000011 //Config0 ADC_MODE[1:0]; 11 starts a conversion when written
+#define CONFIG0_MODE_STANDBY 0b00000010
+
+//Fields changed at run time: the data rate, the PGA gain, the conversion mode and calibration
+#define CONFIG1_OSR_MASK 0b00111100 //Config1 OSR[3:0] bits
+#define CONFIG1_OSR_SHIFT 2
+#define CONFIG1_PRE_MASK 0b11000000 //Config1 PRE[1:0] bits; AMCLK = MCLK / 2^PRE
+#define CONFIG1_PRE_SHIFT 6
+#define CONFIG2_GAIN_MASK 0b00111000 //Config2 GAIN[2:0] bits; 001 = x1, each code above doubles it
+#define CONFIG2_GAIN_SHIFT 3
+#define CONFIG2_GAIN_X1 MCP_GAIN_X1
+#define CONFIG2_GAIN_THIRD MCP_GAIN_THIRD //x1/3, the only gain the reference input is in range at
+#define CONFIG3_EN_OFFCAL 0b00000010 //Config3 EN_OFFCAL: OFFSETCAL is added to every conversion
+#define CONFIG3_EN_GAINCAL 0b00000001 //Config3 EN_GAINCAL: then multiplied by GAINCAL / 2^23
+#define TIMER_DMCLK(us, pre) (((uint32_t)(us) * 5) / 4 / (pre))  // Timer register (24 bits): 0x08
+                                //          Delay between scan cycles, in DMCLK periods (1.25 MHz / prescaler). The
+                                //          data-ready handler switches the MOSFETs as a cycle ends, so the
+                                //          delay only needs to cover the input settling.
+#define GAINCAL_UNITY 0x800000  // GainCal register (24 bits): 0x0A, gain of GAINCAL / 2^23
+
+/*
+Register images. init() programs one_shot_registers: one conversion per start of
+the MOSFET switched thermistor, then standby. The scan engine switches Config3
+between it and continuous_registers outside SCAN mode, and start_scan() programs
+scan_registers, whose cycles convert the thermistor pairs from Diff A (one per
+ADC_INPUT_PAIRS) and, when listed, the internal temperature, with the Timer set from the settling time. The data rate
+is set by the acquisition profile (see adc_profiles) and calibration bits by
+self_calibrate(), so init() patches both into the frame it sends.
+*/
+static constexpr MCPRegisters one_shot_registers = MCPRegisters()
+    .clock(MCP_CLOCK_INTERNAL)              //ADC_MCLK_KHZ is the internal oscillator
+    .current_source(MCP_CURRENT_NONE)
+    .adc_mode(MCP_MODE_CONVERSION)
+    .prescaler(1)
+    .oversampling(20480)                    //60 samples/sec
+    .boost(MCP_BOOST_X1)
+    .gain(MCP_GAIN_X1)
+    .mux_auto_zero(true)
+    .conversion_mode(MCP_CONV_ONE_SHOT)
+    .data_format(MCP_DATA_24)               //Saturates at 0x7FFFFF/0x800000, which read() checks for
+    .crc(true)                              //ADCDATA reads are checked (see adcdata_crc_ok())
+    .offset_cal(false)
+    .gain_cal(false)
+    .irq_mode(MCP_IRQ_OUTPUT_HIGH_Z)        //Pulled up on the board
+    .fast_commands(true)
+    .start_interrupt(false)
+    .input(MCP_MUX_CH0, MCP_MUX_CH1);
+static constexpr MCPRegisters continuous_registers = one_shot_registers.conversion_mode(MCP_CONV_CONTINUOUS);
+//Diff A onwards, one per thermistor input pair (see ADC_INPUT_PAIRS); the ADC converts them in that order
+static constexpr uint32_t SCAN_THERMISTORS = (MCP_SCAN_DIFF_A << ADC_INPUT_PAIRS) - MCP_SCAN_DIFF_A;
+static constexpr MCPRegisters scan_registers = continuous_registers.scan_channels(SCAN_THERMISTORS, MCP_SCAN_DELAY_0);
+
+static_assert(one_shot_registers.check() == 0 && continuous_registers.check() == 0 && scan_registers.check() == 0,
+              "an ADC register image has a setting the MCP3561 doesn't take");
+static_assert((one_shot_registers.config3 & 0x3C) == 0x04,
+              "ADCDATA reads expect 24 bit codes followed by a CRC-16 (see ADCDATA_FRAME_BYTES)");
+static_assert(one_shot_registers.irq & 0x02, "STANDBY and START_CONVERSION are fast commands");
+
+//Register bytes the rest of this file compares and switches between
+static constexpr uint8_t CONFIG0_SET = one_shot_registers.config0;
+static constexpr uint8_t CONFIG1_SET = one_shot_registers.config1;
+static constexpr uint8_t CONFIG2_SET = one_shot_registers.config2;
+static constexpr uint8_t CONFIG3_SET = one_shot_registers.config3;
+static constexpr uint8_t CONFIG3_CONTINUOUS_SET = continuous_registers.config3;
+static constexpr uint8_t CONFIG3_SCAN_SET = scan_registers.config3;
+static constexpr uint8_t IRQ_SET = one_shot_registers.irq;
+static constexpr uint8_t THERM_MUX_SET = one_shot_registers.mux;                    //CH0 - CH1
+static constexpr uint8_t ADC_TEMP_MUX_SET = mcp_mux(MCP_MUX_TEMP_P, MCP_MUX_TEMP_M);  //Internal temp diode
+static constexpr uint8_t SHORTED_MUX_SET = mcp_mux(MCP_MUX_AGND, MCP_MUX_AGND);       //Both on AGND, for the offset
+static constexpr uint8_t V_REF_MUX_SET = mcp_mux(MCP_MUX_REFIN_POS, MCP_MUX_REFIN_NEG);
+#define SCAN_TEMP MCP_SCAN_TEMP
+
+//Frames sent whole: init() from Config0 to Mux, start_scan() and stop_scan() from Config3 to Timer
+static constexpr MCPFrame init_frame = mcp_write_frame(one_shot_registers, MCP_REG_CONFIG0, MCP_REG_MUX);
+static constexpr MCPFrame scan_frame = mcp_write_frame(scan_registers, MCP_REG_CONFIG3, MCP_REG_TIMER);
+static constexpr MCPFrame one_shot_frame = mcp_write_frame(one_shot_registers, MCP_REG_CONFIG3, MCP_REG_TIMER);
+#define INIT_CONFIG1_BYTE mcp_frame_offset(MCP_REG_CONFIG0, MCP_REG_CONFIG1)
+#define INIT_CONFIG3_BYTE mcp_frame_offset(MCP_REG_CONFIG0, MCP_REG_CONFIG3)
+#define SCAN_CONFIG3_BYTE mcp_frame_offset(MCP_REG_CONFIG3, MCP_REG_CONFIG3)
+#define SCAN_SCAN_BYTE mcp_frame_offset(MCP_REG_CONFIG3, MCP_REG_SCAN)
+#define SCAN_TIMER_BYTE mcp_frame_offset(MCP_REG_CONFIG3, MCP_REG_TIMER)
+
+#ifdef USE_ADC_SELF_CAL
+//Conversions averaged per self-calibration measurement, after one discarded as
+//the input settles; at most a full-scale offset this far off, and a gain error
+//this large, is taken as a real measurement.
+#define SELF_CAL_CONVERSIONS 8
+#define SELF_CAL_MAX_OFFSET 0x40000     //3% of full scale
+#define SELF_CAL_MAX_GAIN_ERROR 0.05f
+#endif
+
+//Internal oscillator, for the conversion times data-ready waits allow for
+#define ADC_MCLK_KHZ 4915
+
+#if NUM_ADCS < 1 || NUM_ADCS > MAX_ADCS
+    #error NUM_ADCS must be between 1 and MAX_ADCS.
+#endif
+
+//SPI clocks tried by tune_ADC_SPI_clock(), slowest first. The MCP3561 takes SCK up to 20 MHz.
+static const uint32_t spi_clock_steps[] = {2000000, 4000000, 5000000, 8000000, 10000000,
+                                           12000000, 16000000, 20000000};
+#define SPI_CLOCK_DEFAULT_HZ 5000000
+#define SPI_CLOCK_MAX_HZ 20000000
+//Timer register patterns written and read back at each clock, and the passes of them.
+static const uint32_t spi_test_patterns[] = {0xA5A5A5, 0x5A5A5A, 0xFF00FF, 0x00FF00, 0x0F0F0F};
+#define SPI_TEST_PASSES 16
+
+//ADCDATA read frame with CRC on communications: STATUS byte (clocked out with the
+//command), 24 data bits, then the CRC-16 of those four bytes.
+#define ADCDATA_FRAME_BYTES 6
+//Handed on for a read whose CRC failed again on the re-read: a saturated code, so
+//it is counted and converted as invalid data rather than taken as a temperature.
+#define ADCDATA_CRC_FAILED 0x007FFFFF
+//Handed on in the same way for a read whose STATUS byte says the configuration
+//was lost (see Mcp3561::config_lost()): the code was converted with other settings.
+#define ADCDATA_CONFIG_LOST 0x007FFFFF
+//Config0 to GainCal in one incremental write: command, six bytes, four 24 bit registers
+#define RESTORE_FRAME_BYTES 19
+
+//Each transfer is its own SPI transaction, so the bus can be shared with other devices.
+static uint32_t spi_clock_hz = SPI_CLOCK_DEFAULT_HZ;
+static SPISettings adc_spi(SPI_CLOCK_DEFAULT_HZ, MSBFIRST, SPI_MODE0);
+
+/*
+Acquisition profiles, selected with set_ADC_profile(). The sinc filter has a notch
+at the data rate and each multiple of it, so a data rate that divides the line
+frequency rejects the mains hum and its harmonics:
+    data rate = MCLK / (4 * prescaler * OSR), MCLK = 4.9152 MHz (internal oscillator)
+The notch depth is only as good as the oscillator's accuracy. The slower profiles
+integrate over more line cycles for less noise per sample. Each profile's Config1
+write is built at compile time (see profile_frames), so one that the ADC doesn't
+take fails the build.
+*/
+static constexpr ADCProfile adc_profiles[] = {
+    {"60Hz",      1, 20480, 60},    //60 SPS (as one_shot_registers)
+    {"50Hz",      1, 24576, 50},    //50 SPS
+    {"60Hz-15",   1, 81920, 60},    //15 SPS, 4 line cycles per conversion
+    {"50Hz-12.5", 1, 98304, 50},    //12.5 SPS, 4 line cycles per conversion
+    {"60Hz-7.5",  2, 81920, 60},    //7.5 SPS, 8 line cycles per conversion
+    {"50Hz-6.25", 8, 24576, 50},    //6.25 SPS, 8 line cycles per conversion
+    {"Fast",      1, 2048,  0}      //600 SPS, no mains rejection
+};
+#define ADC_PROFILE_COUNT ((int)(sizeof(adc_profiles) / sizeof(adc_profiles[0])))
+
+//Config1 write of each profile, and the MCP_ERROR_ bits of any the ADC doesn't take
+struct ProfileFrames {
+    MCPFrame config1[ADC_PROFILE_COUNT];
+    uint8_t errors;
+};
+
+constexpr ProfileFrames make_profile_frames() {
+    ProfileFrames frames = {};
+    for (int n = 0; n < ADC_PROFILE_COUNT; n++) {
+        MCPRegisters image = one_shot_registers.prescaler(adc_profiles[n].prescaler).oversampling(adc_profiles[n].osr);
+        frames.errors |= image.check();
+        frames.config1[n] = mcp_write_frame(image, MCP_REG_CONFIG1, MCP_REG_CONFIG1);
+    }
+    return frames;
+}
+
+static constexpr ProfileFrames profile_frames = make_profile_frames();
+static_assert(profile_frames.errors == 0, "an acquisition profile has a prescaler or ratio the MCP3561 doesn't take");
+
+static const uint8_t adc_cs_pins[NUM_ADCS] = ADC_CS_PINS;
+static const uint8_t adc_irq_pins[NUM_ADCS] = ADC_IRQ_PINS;
+static Mcp3561 adc_devices[NUM_ADCS];
+
+//DMA transfer buffers for asynchronous ADCDATA reads, one pair per device. Kept in
+//DMAMEM and cache line sized so the SPI library's cache maintenance never touches
+//other data. The rest of the read path is FASTRUN, in ITCM with the handlers.
+static uint8_t adcdata_tx_buff[NUM_ADCS][32] DMAMEM __attribute__((aligned(32)));
+static uint8_t adcdata_rx_buff[NUM_ADCS][32] DMAMEM __attribute__((aligned(32)));
+
+//The ADCDATA read frame: the command byte, then zeros clocking out the status byte,
+//24 data bits and CRC-16. Built once; each device's DMA copy is filled by begin().
+static const uint8_t adcdata_read_frame[ADCDATA_FRAME_BYTES] = {ADCDATA_READ};
+
+//Device whose asynchronous read owns the SPI bus, NULL while it is free. Reads
+//asked for while it is taken are queued and started from its DMA completion. The
+//data-ready, DMA and timer interrupts run at one priority, so none of them can
+//preempt another mid-transfer.
+static Mcp3561 *volatile bus_owner = NULL;
+
+#ifdef USE_FLEXIO_SPI
+//Set once the FlexIO lockstep engine is up; reads then all go through it. The
+//devices in its transaction in flight, a bit each.
+static bool lockstep_ready = false;
+static volatile uint8_t lockstep_devices = 0;
+#endif
+
+/*
+Sends a 24 bit register value, MSB first.
+*/
+static void transfer24(uint32_t value) {
+    SPI.transfer((value >> 16) & 0xFF);
+    SPI.transfer((value >> 8) & 0xFF);
+    SPI.transfer(value & 0xFF);
+}
+
+/*
+Stores a 24 bit register value in a frame, MSB first.
+*/
+static void put24(uint8_t *bytes, uint32_t value) {
+    bytes[0] = (value >> 16) & 0xFF;
+    bytes[1] = (value >> 8) & 0xFF;
+    bytes[2] = value & 0xFF;
+}
+
+Mcp3561::Mcp3561()
+    : m_id(0), m_cs_pin(0), m_irq_pin(0), m_config1(CONFIG1_SET), m_config3_cal(0), m_callback(NULL), m_busy(false),
+      m_queued(false), m_crc_retried(false), m_locked(false) {
+    m_shadow.config0 = CONFIG0_SET;
+    m_shadow.config1 = CONFIG1_SET;
+    m_shadow.config2 = CONFIG2_SET;
+    m_shadow.config3 = CONFIG3_SET;
+    m_shadow.irq = IRQ_SET;
+    m_shadow.mux = THERM_MUX_SET;
+    m_shadow.scan = 0;
+    m_shadow.timer = 0;
+    m_shadow.offsetcal = 0;
+    m_shadow.gaincal = GAINCAL_UNITY;
+}
+
+/*
+Assigns the device its index and pins, and fills its DMA read frame. Only call
+while no transfer is in flight.
+*/
+void Mcp3561::begin(uint8_t id, uint8_t cs_pin, uint8_t irq_pin) {
+    m_id = id;
+    m_cs_pin = cs_pin;
+    m_irq_pin = irq_pin;
+    memcpy(adcdata_tx_buff[id], adcdata_read_frame, ADCDATA_FRAME_BYTES);
+    m_event.setContext(this);
+    m_event.attachImmediate(dma_complete);
+}
+
+void Mcp3561::select() {
+    SPI.beginTransaction(adc_spi);
+    digitalWrite(m_cs_pin, LOW);
+}
+
+void Mcp3561::deselect() {
+    digitalWrite(m_cs_pin, HIGH);
+    SPI.endTransaction();
+}
+
 /*
-Scan Register & Timer registers not used
-OffsetCal & GainCal registers not used
+Sets the SPI clock for the ADC transfers, up to SPI_CLOCK_MAX_HZ. Only call while
+no transfer is in flight. Returns false for an out of range clock.
 */
+bool set_ADC_SPI_clock(uint32_t hz) {
+    if (hz == 0 || hz > SPI_CLOCK_MAX_HZ) {
+        return false;
+    }
+    spi_clock_hz = hz;
+    adc_spi = SPISettings(hz, MSBFIRST, SPI_MODE0);
+#ifdef USE_FLEXIO_SPI
+    if (lockstep_ready) {
+        flexspi_set_clock(hz);
+    }
+#endif
+    return true;
+}
 
-//Temporary ADC data storage buffer.
-static uint32_t temp_data_buff;
+uint32_t ADC_SPI_clock() {
+    return spi_clock_hz;
+}
+
+/*
+Writes the test patterns to the Timer register and reads them back at the
+current clock. The Timer register is put back as shadowed afterwards.
+*/
+FLASHMEM bool Mcp3561::patterns_read_back() {
+    bool passed = true;
+    for (int pass = 0; pass < SPI_TEST_PASSES && passed; pass++) {
+        for (unsigned int i = 0; i < sizeof(spi_test_patterns) / sizeof(spi_test_patterns[0]); i++) {
+            select();
+            SPI.transfer(mcp_incremental_write(MCP_REG_TIMER));
+            transfer24(spi_test_patterns[i]);
+            deselect();
+            select();
+            SPI.transfer(POINT_TIMER_READ);
+            uint32_t readback = ((uint32_t)SPI.transfer(0x00) << 16);
+            readback |= ((uint32_t)SPI.transfer(0x00) << 8);
+            readback |= SPI.transfer(0x00);
+            deselect();
+            if (readback != spi_test_patterns[i]) {
+                passed = false;
+                break;
+            }
+        }
+    }
+    select();
+    SPI.transfer(mcp_incremental_write(MCP_REG_TIMER));
+    transfer24(m_shadow.timer);
+    deselect();
+    return passed;
+}
+
+//Every device reads back at the current clock.
+FLASHMEM static bool spi_patterns_read_back() {
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (!adc_devices[n].patterns_read_back()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Picks the ADC SPI clock: ADC_SPI_CLOCK_HZ if it is set, otherwise one step below
+the fastest of spi_clock_steps at which register writes read back reliably from
+every ADC, for margin. Call once at start-up with the scan engine stopped. Returns
+false, leaving the default clock, if an ADC doesn't read back even at the slowest
+clock.
+*/
+FLASHMEM bool tune_ADC_SPI_clock() {
+#if ADC_SPI_CLOCK_HZ != 0
+    if (!set_ADC_SPI_clock(ADC_SPI_CLOCK_HZ) || !spi_patterns_read_back()) {
+        LogError("ADC SPI read-back failed at %lu Hz.", (unsigned long)ADC_SPI_CLOCK_HZ);
+        set_ADC_SPI_clock(SPI_CLOCK_DEFAULT_HZ);
+        return false;
+    }
+    return true;
+#else
+    const int steps = sizeof(spi_clock_steps) / sizeof(spi_clock_steps[0]);
+    int fastest = -1;
+    for (int step = 0; step < steps; step++) {
+        set_ADC_SPI_clock(spi_clock_steps[step]);
+        if (!spi_patterns_read_back()) {
+            break;
+        }
+        fastest = step;
+    }
+    if (fastest < 0) {
+        LogError("ADC SPI read-back failed, keeping %lu Hz.", (unsigned long)SPI_CLOCK_DEFAULT_HZ);
+        set_ADC_SPI_clock(SPI_CLOCK_DEFAULT_HZ);
+        return false;
+    }
+    set_ADC_SPI_clock(spi_clock_steps[fastest > 0 ? fastest - 1 : 0]);
+    LogInfo("ADC SPI clock %lu Hz (read back up to %lu Hz).", (unsigned long)spi_clock_hz,
+            (unsigned long)spi_clock_steps[fastest]);
+    return true;
+#endif
+}
+
+/*
+Initializes every ADC with desired settings(defined above).
+*/
+FLASHMEM bool initADC() {
+    bool success = true;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        adc_devices[n].begin(n, adc_cs_pins[n], adc_irq_pins[n]);
+        success = adc_devices[n].init() && success;
+    }
+#ifdef USE_FLEXIO_SPI
+    lockstep_devices = 0;
+    lockstep_ready = flexspi_begin(adcdata_read_frame, ADCDATA_FRAME_BYTES, spi_clock_hz, Mcp3561::start_lockstep,
+                                   Mcp3561::lockstep_complete);
+    if (!lockstep_ready) {
+        LogWarn("No FlexIO SPI, so the ADCs are read one at a time.");
+    }
+#endif
+    return success;
+}
+
+/*
+ADC n, 0 to NUM_ADCS - 1. NULL for any other n.
+*/
+Mcp3561 *ADC_device(int n) {
+    if (n < 0 || n >= NUM_ADCS) {
+        return NULL;
+    }
+    return &adc_devices[n];
+}
+
+/*
+Returns true while an asynchronous ADCDATA read of any ADC owns the bus.
+*/
+bool ADC_bus_busy() {
+    return bus_owner != NULL;
+}
+
+/*
+Sends an incremental write built by mcp_write_frame() in one chip select frame.
+The frame is a copy, so the transfer can overwrite it with what is read back.
+*/
+void Mcp3561::write_frame(MCPFrame frame) {
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(frame.bytes, frame.length);
+    deselect(); //Set CS to high to end data transfer
+}
+
+/*
+Locks the register writes, which has the ADC take CRCCFG of its configuration
+and flag CRCCFG_STATUS in every STATUS byte from then on if a register changes,
+or unlocks them again. Fast commands and reads still work while locked.
+*/
+FASTRUN void Mcp3561::set_lock(bool locked) {
+    uint8_t frame[2] = {mcp_incremental_write(MCP_REG_LOCK), (uint8_t)(locked ? LOCK_SET : LOCK_PASSWORD)};
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(frame, sizeof(frame));
+    deselect(); //Set CS to high to end data transfer
+    m_locked = locked;
+}
+
+/*
+Whether a STATUS byte says the ADC lost its configuration: a power-on reset
+(a brown-out on its supply) put every register back to its default, or, while
+locked, a register no longer matches the CRC taken when it was locked.
+*/
+FASTRUN bool Mcp3561::config_lost(uint8_t status) {
+    return !(status & STATUS_POR) || (m_locked && !(status & STATUS_CRCCFG));
+}
+
+/*
+Puts the shadowed configuration back after config_lost(): Config0 to GainCal in
+one incremental write, a read of the IRQ register to clear POR_STATUS, the lock
+again if it was locked, and a conversion start, so the scan resumes within one
+conversion time (a SCAN cycle starts over from its first channel). Short enough
+to be called from the ADC interrupt handler, with the bus taken.
+*/
+FASTRUN void Mcp3561::restore_config() {
+    bool locked = m_locked;
+    if (locked) {
+        set_lock(false);
+    }
+    uint8_t frame[RESTORE_FRAME_BYTES];
+    frame[0] = mcp_incremental_write(MCP_REG_CONFIG0);
+    //Written in standby, so nothing converts with half the registers written
+    frame[1] = (m_shadow.config0 & ~CONFIG0_MODE_MASK) | CONFIG0_MODE_STANDBY;
+    frame[2] = m_shadow.config1;
+    frame[3] = m_shadow.config2;
+    frame[4] = m_shadow.config3;
+    frame[5] = m_shadow.irq;
+    frame[6] = m_shadow.mux;
+    put24(&frame[7], m_shadow.scan);
+    put24(&frame[10], m_shadow.timer);
+    put24(&frame[13], m_shadow.offsetcal);
+    put24(&frame[16], m_shadow.gaincal);
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(frame, sizeof(frame));
+    deselect(); //Set CS to high to end data transfer
+    select();
+    SPI.transfer(POINT_IRQ_READ);
+    SPI.transfer(0x00);
+    deselect();
+    if (locked) {
+        set_lock(true);
+    }
+    start_conversion();
+    health_count(HEALTH_ADC_RECONFIGURATIONS);
+}
+
+/*
+Polls the STATUS byte and restores the configuration if it was lost, for an ADC
+that stopped converting: a power-on reset leaves it shut down, with no ADCDATA
+read to see it by. Skipped, returning false, while an asynchronous read owns the
+bus. Returns true if the configuration was restored.
+*/
+bool Mcp3561::restore_if_lost() {
+    noInterrupts();
+    if (bus_owner != NULL || m_busy) {
+        interrupts();
+        return false;
+    }
+    select(); //Set CS to Low to begin data transfer
+    uint8_t status = SPI.transfer(POINT_IRQ_READ);
+    SPI.transfer(0x00);
+    deselect(); //Set CS to high to end data transfer
+    bool lost = config_lost(status);
+    if (lost) {
+        restore_config();
+    }
+    interrupts();
+    return lost;
+}
 
 /*
-Initializes ADC with desired settings(defined above). 
+Writes one_shot_registers to this ADC, with the data rate set and the offset and
+gain correction of the last self-calibration if there was one.
 */
-bool initADC() {
-    
-    digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
+FLASHMEM bool Mcp3561::init() {
     //ADC offers incremental write feature, after one register is written, moves on to
     //the next in the incremental write loop. (see figure 6-3 of ADC datasheet).
-    SPI.transfer(POINT_CONFIG0_WRITE); //ADC Command byte; Incremental write starting at reg 0x01
-    SPI.transfer(CONFIG0_SET);
-    SPI.transfer(CONFIG1_SET);
-    SPI.transfer(CONFIG2_SET);
-    SPI.transfer(CONFIG3_SET);
-    SPI.transfer(IRQ_SET);
-    SPI.transfer(THERM_MUX_SET);
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer
+    MCPFrame frame = init_frame;
+    frame.bytes[INIT_CONFIG1_BYTE] = m_config1;
+    frame.bytes[INIT_CONFIG3_BYTE] |= m_config3_cal;
+    set_lock(false); //In case it was left locked in SCAN mode
+    write_frame(frame);
+    select();
+    SPI.transfer(mcp_incremental_write(MCP_REG_OFFSETCAL)); //Incremental write; OffsetCal, GainCal
+    transfer24(m_shadow.offsetcal);
+    transfer24(m_shadow.gaincal);
+    deselect();
+    select();
+    SPI.transfer(POINT_IRQ_READ); //Clears POR_STATUS, low since power-up
+    SPI.transfer(0x00);
+    deselect();
+    m_shadow.config0 = CONFIG0_SET;
+    m_shadow.config1 = m_config1;
+    m_shadow.config2 = CONFIG2_SET;
+    m_shadow.config3 = CONFIG3_SET | m_config3_cal;
+    m_shadow.irq = IRQ_SET;
+    m_shadow.mux = THERM_MUX_SET;
     delay(10);
 
     return true;
 }
 
 /*
-Set Mux inputs to internal temperature probes.
+Sets the oversampling ratio, one of the ratios in mcp_osr_ratios. Higher ratios
+are quieter but slower: OSR 20480 gives 60 samples/sec, and the conversion time
+scales with the ratio. Only call while no conversion is running.
+Returns false for a ratio the ADC doesn't support.
 */
-void  setADCInternalTempRead() {
-    digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    SPI.transfer(POINT_MUX_WRITE); //Command byte - set register address to 0x06; MUX Register
-    SPI.transfer(ADC_TEMP_MUX_SET); //Set Mux register to read internal ADC temp
-    delay(1);
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer  
+bool Mcp3561::set_oversampling(uint32_t osr) {
+    uint8_t code = mcp_osr_code(osr);
+    if (code > 15) {
+        return false;
+    }
+    m_config1 = (m_config1 & ~CONFIG1_OSR_MASK) | (code << CONFIG1_OSR_SHIFT);
+    write_registers(m_config1, m_shadow.config2, m_shadow.config3, m_shadow.mux);
+    return true;
+}
+
+/*
+Sets the prescaler and oversampling ratio of acquisition profile n (see
+adc_profiles) in one precomputed Config1 write. Only call while no conversion is
+running, with a valid n.
+*/
+void Mcp3561::set_profile(int n) {
+    const MCPFrame &frame = profile_frames.config1[n];
+    write_frame(frame);
+    m_config1 = frame.bytes[1];
+    m_shadow.config1 = m_config1;
+}
+
+/*
+Current oversampling ratio.
+*/
+uint32_t Mcp3561::oversampling() {
+    return mcp_osr_ratios[(m_config1 & CONFIG1_OSR_MASK) >> CONFIG1_OSR_SHIFT];
+}
+
+/*
+Sets the AMCLK prescaler: 1, 2, 4 or 8. Each step halves the data rate at the
+same oversampling ratio. Only call while no conversion is running. Returns false
+for any other divider.
+*/
+bool Mcp3561::set_prescaler(unsigned int divider) {
+    uint8_t code = mcp_prescaler_code(divider);
+    if (code > 3) {
+        return false;
+    }
+    m_config1 = (m_config1 & ~CONFIG1_PRE_MASK) | (code << CONFIG1_PRE_SHIFT);
+    write_registers(m_config1, m_shadow.config2, m_shadow.config3, m_shadow.mux);
+    return true;
+}
+
+unsigned int Mcp3561::prescaler() {
+    return 1u << ((m_config1 & CONFIG1_PRE_MASK) >> CONFIG1_PRE_SHIFT);
+}
+
+/*
+Time one conversion takes at the oversampling ratio and prescaler set, or at the
+ratio osr_steps codes below it as set_conversion() lowers it, microseconds.
+*/
+uint32_t Mcp3561::conversion_us(uint8_t osr_steps) {
+    uint8_t osr_code = (m_config1 & CONFIG1_OSR_MASK) >> CONFIG1_OSR_SHIFT;
+    osr_code = osr_steps < osr_code ? osr_code - osr_steps : 0;
+    return (uint32_t)((4000ULL * prescaler() * mcp_osr_ratios[osr_code]) / ADC_MCLK_KHZ);
+}
+
+/*
+Sets the oversampling ratio of every ADC, so their conversions keep pace.
+*/
+bool set_ADC_oversampling(uint32_t osr) {
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (!adc_devices[n].set_oversampling(osr)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t ADC_oversampling() {
+    return adc_devices[0].oversampling();
+}
+
+/*
+Acquisition profile n, 0 to the number of profiles - 1. NULL for any other n.
+*/
+const ADCProfile *ADC_profile(int n) {
+    if (n < 0 || n >= ADC_PROFILE_COUNT) {
+        return NULL;
+    }
+    return &adc_profiles[n];
+}
+
+/*
+Index of the profile with the given name, -1 if there is none.
+*/
+int find_ADC_profile(const char *name) {
+    for (int n = 0; n < ADC_PROFILE_COUNT; n++) {
+        if (strcmp(adc_profiles[n].name, name) == 0) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/*
+Applies acquisition profile n (prescaler and oversampling ratio) to every ADC.
+Only call while no conversion is running. Returns false for an invalid n.
+*/
+bool set_ADC_profile(int n) {
+    const ADCProfile *profile = ADC_profile(n);
+    if (profile == NULL) {
+        return false;
+    }
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        adc_devices[adc].set_profile(n);
+    }
+    return true;
+}
+
+/*
+Index of the profile matching the ADC settings in use, -1 if none does (the
+oversampling ratio was set on its own).
+*/
+int ADC_profile_in_use() {
+    for (int n = 0; n < ADC_PROFILE_COUNT; n++) {
+        if (adc_profiles[n].prescaler == adc_devices[0].prescaler() &&
+            adc_profiles[n].osr == adc_devices[0].oversampling()) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+/*
+Mux register setting for an input.
+*/
+FASTRUN static inline uint8_t input_mux(ADCInput input) {
+    switch (input) {
+    case ADC_INPUT_INTERNAL_TEMP: return ADC_TEMP_MUX_SET;   //Internal ADC temp diode
+    case ADC_INPUT_SHORTED:       return SHORTED_MUX_SET;    //AGND on both inputs
+    case ADC_INPUT_REFERENCE:     return V_REF_MUX_SET;      //REFIN+ & REFIN-
+    default:                      return THERM_MUX_SET;      //CH0 & CH1 inputs
+    }
+}
+
+/*
+Writes the registers set per conversion, Config1 to Mux, in one incremental
+write of the run from the first to the last that differ from the shadow (the IRQ
+register in between is written as shadowed). The frame is built first and sent
+in one transfer, and nothing is sent if every register is as shadowed. Short
+enough to be called from the ADC interrupt handler while no conversion is running.
+*/
+FASTRUN void Mcp3561::write_registers(uint8_t config1, uint8_t config2, uint8_t config3, uint8_t mux) {
+    const uint8_t values[5] = {config1, config2, config3, m_shadow.irq, mux};
+    const uint8_t shadow[5] = {m_shadow.config1, m_shadow.config2, m_shadow.config3, m_shadow.irq, m_shadow.mux};
+    int first = 0;
+    int last = 4;
+    while (first <= last && values[first] == shadow[first]) {
+        first++;
+    }
+    if (first > last) {
+        return;
+    }
+    while (values[last] == shadow[last]) {
+        last--;
+    }
+    uint8_t frame[6];
+    frame[0] = mcp_incremental_write((MCPRegister)(MCP_REG_CONFIG1 + first));
+    memcpy(frame + 1, values + first, last - first + 1);
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(frame, last - first + 2);
+    deselect(); //Set CS to high to end data transfer
+    m_shadow.config1 = config1;
+    m_shadow.config2 = config2;
+    m_shadow.config3 = config3;
+    m_shadow.mux = mux;
+}
+
+/*
+Sets Mux inputs to the requested source without holding CS low for a delay,
+so it is short enough to be called from the ADC interrupt handler.
+*/
+void Mcp3561::select_input(ADCInput input) {
+    write_registers(m_shadow.config1, m_shadow.config2, m_shadow.config3, input_mux(input));
+}
+
+/*
+Readies the next conversion outside SCAN mode: its input, one-shot or continuous
+mode (see ADCConversionMode), an oversampling ratio conversion.osr_steps codes
+below the one set by set_oversampling() (down to the lowest), and a PGA gain of
+1 << conversion.gain_shift (at most x64), or x1/3 for the reference input, the
+only gain it is in range at. Whatever changed goes in one SPI frame, so slots with
+the same settings cost nothing; a mode change takes effect from the next start.
+Short enough to be called from the ADC interrupt handler while no conversion is
+running.
+*/
+FASTRUN void Mcp3561::set_conversion(const ADCConversion &conversion) {
+    uint8_t osr_code = (m_config1 & CONFIG1_OSR_MASK) >> CONFIG1_OSR_SHIFT;
+    osr_code = conversion.osr_steps < osr_code ? osr_code - conversion.osr_steps : 0;
+    uint8_t gain_code = CONFIG2_GAIN_THIRD;
+    if (conversion.input != ADC_INPUT_REFERENCE) {
+        uint8_t gain_shift = conversion.gain_shift;
+        if (gain_shift > 7 - CONFIG2_GAIN_X1) {
+            gain_shift = 7 - CONFIG2_GAIN_X1;
+        }
+        gain_code = CONFIG2_GAIN_X1 + gain_shift;
+    }
+    uint8_t config1 = (m_config1 & ~CONFIG1_OSR_MASK) | (osr_code << CONFIG1_OSR_SHIFT);
+    uint8_t config2 = (m_shadow.config2 & ~CONFIG2_GAIN_MASK) | (gain_code << CONFIG2_GAIN_SHIFT);
+    uint8_t config3 = ((conversion.mode == ADC_CONTINUOUS) ? CONFIG3_CONTINUOUS_SET : CONFIG3_SET) | m_config3_cal;
+    write_registers(config1, config2, config3, input_mux(conversion.input));
+}
+
+/*
+Puts the ADC in SCAN mode: continuous conversion cycles over the thermistor pairs
+(Diff A onwards, see ADC_INPUT_PAIRS), plus the internal temperature sensor if include_temp is set, with delay_us between
+cycles. The Mux register is ignored while the Scan register is set. The
+registers stay locked while scanning, so a change to any of them is flagged in
+the STATUS byte of the next read (see config_lost()).
+*/
+void Mcp3561::start_scan(bool include_temp, unsigned int delay_us) {
+    //Incremental write; Config3, IRQ, Mux, Scan, Timer
+    MCPFrame frame = scan_frame;
+    frame.bytes[SCAN_CONFIG3_BYTE] |= m_config3_cal;
+    uint32_t scan = include_temp ? (SCAN_THERMISTORS | SCAN_TEMP) : SCAN_THERMISTORS;
+    put24(&frame.bytes[SCAN_SCAN_BYTE], scan);
+    uint32_t timer = TIMER_DMCLK(delay_us, prescaler()) & 0x00FFFFFF;
+    put24(&frame.bytes[SCAN_TIMER_BYTE], timer);
+    write_frame(frame);
+    m_shadow.config3 = CONFIG3_SCAN_SET | m_config3_cal;
+    m_shadow.irq = IRQ_SET;
+    m_shadow.mux = THERM_MUX_SET;
+    m_shadow.scan = scan;
+    m_shadow.timer = timer;
+    set_lock(true); //Nothing is written until stop_scan(), so the configuration can be CRC checked
+    start_conversion();
+}
+
+/*
+Changes the scan cycle channels while in SCAN mode. Takes effect from the next
+cycle; short enough to be called from the ADC interrupt handler.
+*/
+void Mcp3561::set_scan_list(bool include_temp) {
+    set_lock(false);
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(mcp_incremental_write(MCP_REG_SCAN)); //Command byte - set register address to 0x07; Scan Register
+    uint32_t scan = include_temp ? (SCAN_THERMISTORS | SCAN_TEMP) : SCAN_THERMISTORS;
+    transfer24(scan);
+    deselect(); //Set CS to high to end data transfer
+    m_shadow.scan = scan;
+    set_lock(true);
+}
+
+/*
+Leaves SCAN mode: puts the ADC in standby and restores the one-shot, Mux driven
+settings from init().
+*/
+void Mcp3561::stop_scan() {
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(STANDBY); //Standby fast command, ends the conversion cycles
+    deselect(); //Set CS to high to end data transfer
+    set_lock(false);
+
+    //Incremental write; Config3, IRQ, Mux, Scan, Timer. No scan channels; Mux register selects the input
+    MCPFrame frame = one_shot_frame;
+    frame.bytes[SCAN_CONFIG3_BYTE] |= m_config3_cal;
+    write_frame(frame);
+    m_shadow.config3 = CONFIG3_SET | m_config3_cal;
+    m_shadow.irq = IRQ_SET;
+    m_shadow.mux = THERM_MUX_SET;
+    m_shadow.scan = 0;
+    m_shadow.timer = 0;
+}
+
+void Mcp3561::write_config3(uint8_t config3) {
+    write_registers(m_shadow.config1, m_shadow.config2, config3, m_shadow.mux);
 }
 
 /*
-Sets Mux inputs to ch0/ch1; thermistors.
+Ends the conversion in progress, e.g. the one continuous mode went on to after
+the last sample wanted.
 */
-void setThermistorMuxRead() {
-    digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    SPI.transfer(POINT_MUX_WRITE); //Command byte - set register address to 0x06; Mux Register
-    SPI.transfer(THERM_MUX_SET); //Set Mux to original settings; CH0 & CH1 inputs
-    delay(1);
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer
+void Mcp3561::standby() {
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(STANDBY); //Standby fast command
+    deselect(); //Set CS to high to end data transfer
 }
 
 /*
 Starts/Restarts conversion to gather new data.
 */
-void start_conversion(){
-    digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
+void Mcp3561::start_conversion() {
+    select(); //Set CS to Low to begin data transfer
     SPI.transfer(START_CONVERSION); //Restart conversion fast command to gather new data. 
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer
+    deselect(); //Set CS to high to end data transfer
 }
 
-float read_ADCDATA() {
-    digitalWrite(CS, LOW); //Set CS to Low to begin data transfer
-    temp_data_buff = SPI.transfer32(0x41000000); //Send read ADC_DATA register, 32 bit command, & saves output(status byte + 24 data bytes) on a uint32 buffer. 
-    digitalWrite(CS, HIGH); //Set CS to high to end data transfer
+float Mcp3561::read() {
+    uint32_t temp_data_buff = read_raw(); //Status byte + 24 data bits, CRC checked (a failed read comes back saturated)
 
     /*
     Mask status byte and check for valid data.
@@ -178,45 +881,985 @@ float read_ADCDATA() {
     */
     if (((temp_data_buff & 0x00FFFFFF) == 0x007FFFFF) || ((temp_data_buff & 0x00FFFFFF) == 0x00800000)){ 
         Serial.printf("Invalid temperature data.\n");
+        health_count(HEALTH_INVALID_DATA);
     }
     /*
-    Reads status of Mux register to determine source of output data. 
-    Output structure;0xXX(status byte)XX(Mux register read data)
-    0x1701: Mux register inputs are thermistors
-    0x17DE: Mux register inputs are internal temp probes. 
+    Uses the shadowed Mux register to determine source of output data.
+    0x01: Mux register inputs are thermistors
+    0xDE: Mux register inputs are internal temp probes. 
     If/else statement then sends data to appropriate conversion function. 
+    (verify_registers() checks the shadow against the device.)
     */
     else {
-        digitalWrite(CS, LOW);//Set CS to Low to begin data transfer
-        uint16_t MUX_REG_STATUS = SPI.transfer16(0x5900);
-        digitalWrite(CS, HIGH); //Set CS to high to end data transfer
-
         //Mask Status byte, ensure only data is sent to conversion functions. 
         temp_data_buff = (temp_data_buff & 0x00FFFFFF);
-        if(MUX_REG_STATUS == 0x1701) {
+        if(m_shadow.mux == THERM_MUX_SET) {
             return convert_thermistor_temp(temp_data_buff);
             //return convert_thermistor_temp(0x00FFFFFB);
 
         }
-        else if(MUX_REG_STATUS == 0x17DE) {
+        else if(m_shadow.mux == ADC_TEMP_MUX_SET) {
            return convert_internal_temp(temp_data_buff);
             //return convert_internal_temp(0x00FFFFFB);
         }
         else {
             Serial.println("Invalid data return.");
+            health_count(HEALTH_REGISTER_MISMATCHES);
             return(0);
         }
     } 
     return(0);
 }
 
+/*
+Reads the configuration registers back and compares them with the shadow copy.
+Bits the ADC changes on its own (Config0 ADC_MODE, which drops to standby after a
+one-shot conversion, and the IRQ status flags) are ignored. Skipped, returning
+true, while an asynchronous ADCDATA read owns the bus. Safe to call while the scan
+engine is running.
+*/
+bool Mcp3561::verify_registers() {
+    uint8_t readback[18];
+    noInterrupts();
+    if (bus_owner != NULL || m_busy) {
+        interrupts();
+        return true;
+    }
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(POINT_CONFIG0_READ);
+    for (unsigned int i = 0; i < sizeof(readback); i++) {
+        readback[i] = SPI.transfer(0x00);
+    }
+    deselect(); //Set CS to high to end data transfer
+    ADCRegisters expected;
+    expected.config0 = m_shadow.config0;
+    expected.config1 = m_shadow.config1;
+    expected.config2 = m_shadow.config2;
+    expected.config3 = m_shadow.config3;
+    expected.irq = m_shadow.irq;
+    expected.mux = m_shadow.mux;
+    expected.scan = m_shadow.scan;
+    expected.timer = m_shadow.timer;
+    expected.offsetcal = m_shadow.offsetcal;
+    expected.gaincal = m_shadow.gaincal;
+    interrupts();
+
+    uint32_t scan  = ((uint32_t)readback[6] << 16) | ((uint32_t)readback[7] << 8) | readback[8];
+    uint32_t timer = ((uint32_t)readback[9] << 16) | ((uint32_t)readback[10] << 8) | readback[11];
+    uint32_t offsetcal = ((uint32_t)readback[12] << 16) | ((uint32_t)readback[13] << 8) | readback[14];
+    uint32_t gaincal = ((uint32_t)readback[15] << 16) | ((uint32_t)readback[16] << 8) | readback[17];
+    bool match = ((readback[0] & 0xFC) == (expected.config0 & 0xFC)) &&
+                 (readback[1] == expected.config1) &&
+                 (readback[2] == expected.config2) &&
+                 (readback[3] == expected.config3) &&
+                 ((readback[4] & 0x0F) == (expected.irq & 0x0F)) &&
+                 (readback[5] == expected.mux) &&
+                 (scan == expected.scan) &&
+                 (timer == expected.timer) &&
+                 (offsetcal == expected.offsetcal) &&
+                 (gaincal == expected.gaincal);
+    if (!match) {
+        LogError("ADC %d register mismatch: %02X %02X %02X %02X %02X %02X %06lX %06lX %06lX %06lX", m_id,
+                 readback[0], readback[1], readback[2], readback[3], readback[4], readback[5],
+                 (unsigned long)scan, (unsigned long)timer, (unsigned long)offsetcal, (unsigned long)gaincal);
+        health_count(HEALTH_REGISTER_MISMATCHES);
+    }
+    return match;
+}
+
+/*
+Checks the registers of every ADC (see Mcp3561::verify_registers()).
+*/
+bool verify_ADC_registers() {
+    bool match = true;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        match = adc_devices[n].verify_registers() && match;
+    }
+    return match;
+}
+
+#ifdef USE_ADC_SELF_CAL
+/*
+Waits for the conversion in progress to finish, polling the DR_STATUS bit of the
+STATUS byte that is clocked out with every command byte. Allows twice the
+conversion time. Only for the blocking routines, with the scan engine stopped.
+*/
+FLASHMEM bool Mcp3561::wait_data_ready() {
+    unsigned long timeout_ms = (2 * conversion_us(0)) / 1000 + 2;
+    unsigned long start = millis();
+    do {
+        select(); //Set CS to Low to begin data transfer
+        uint8_t status = SPI.transfer(POINT_IRQ_READ);
+        deselect(); //Set CS to high to end data transfer
+        if ((status & STATUS_DR) == 0) {
+            return true;
+        }
+        delayMicroseconds(100);
+    } while ((millis() - start) < timeout_ms);
+    return false;
+}
+
+/*
+Mean of SELF_CAL_CONVERSIONS one-shot conversions of input at PGA gain code
+gain_code (0 for x1/3, CONFIG2_GAIN_X1 for x1), with the ADC's own correction
+as it is in Config3. Leaves the input and gain switched. Returns false if a
+conversion times out, saturates or fails its CRC.
+*/
+FLASHMEM bool Mcp3561::measure(ADCInput input, uint8_t gain_code, int32_t *mean) {
+    uint8_t config2 = (m_shadow.config2 & ~CONFIG2_GAIN_MASK) | (gain_code << CONFIG2_GAIN_SHIFT);
+    write_registers(m_shadow.config1, config2, m_shadow.config3, input_mux(input));
+
+    int64_t sum = 0;
+    for (int n = -1; n < SELF_CAL_CONVERSIONS; n++) {
+        start_conversion();
+        read_raw(); //Clears DR_STATUS of any data left from before, e.g. the conversion init() started
+        if (!wait_data_ready()) {
+            return false;
+        }
+        uint32_t code = read_raw() & 0x00FFFFFF;
+        if (code == 0x007FFFFF || code == 0x00800000) {
+            return false;
+        }
+        if (n >= 0) {
+            sum += (int32_t)(code << 8) >> 8; //Sign extend the 24 bit code
+        }
+    }
+    *mean = (int32_t)(sum / SELF_CAL_CONVERSIONS);
+    return true;
+}
+
+/*
+Measures the converter's own offset and gain error and has the ADC correct its
+output for them from then on: OFFSETCAL cancels the code of the shorted inputs at
+gain x1, and GAINCAL scales the reference input to its ideal code. The reference
+is only in range at gain x1/3 (2^23 / 3 ideally, measured from that gain's own
+offset), so the gain error of the x1/3 stage stands in for the x1 one. What is
+left (the divider and each thermistor) is per channel and stays with the channel
+calibration.
+
+Blocks for 3 * (SELF_CAL_CONVERSIONS + 1) conversions; only call with the scan
+engine stopped (see acquisition_stop()), which leaves the ADC converting one-shot
+on the thermistor input, as it is left again here. Returns false, keeping the
+previous correction, if a measurement fails or is out of the plausible range.
+*/
+FLASHMEM bool Mcp3561::self_calibrate() {
+    uint8_t config2 = m_shadow.config2;
+    write_config3(CONFIG3_SET); //Measure the uncorrected output
+    int32_t offset = 0, short_third = 0, ref_third = 0;
+    bool measured = measure(ADC_INPUT_SHORTED, CONFIG2_GAIN_X1, &offset) &&
+                    measure(ADC_INPUT_SHORTED, 0, &short_third) &&
+                    measure(ADC_INPUT_REFERENCE, 0, &ref_third);
+
+    write_registers(m_shadow.config1, config2, m_shadow.config3, THERM_MUX_SET);
+
+    float gain = 0;
+    if (measured && ref_third > short_third) {
+        gain = (GAINCAL_UNITY / 3.0f) / (float)(ref_third - short_third);
+    }
+    if (!measured || offset > SELF_CAL_MAX_OFFSET || offset < -SELF_CAL_MAX_OFFSET ||
+        fabsf(gain - 1.0f) > SELF_CAL_MAX_GAIN_ERROR) {
+        LogError("ADC %d self-calibration failed: offset %ld, reference %ld.", m_id, (long)offset,
+                 (long)(ref_third - short_third));
+        write_config3(CONFIG3_SET | m_config3_cal);
+        return false;
+    }
+
+    uint32_t offsetcal = (uint32_t)(-offset) & 0x00FFFFFF;
+    uint32_t gaincal = (uint32_t)lroundf(gain * GAINCAL_UNITY);
+    select(); //Set CS to Low to begin data transfer
+    SPI.transfer(mcp_incremental_write(MCP_REG_OFFSETCAL)); //Incremental write; OffsetCal, GainCal
+    transfer24(offsetcal);
+    transfer24(gaincal);
+    deselect(); //Set CS to high to end data transfer
+    m_shadow.offsetcal = offsetcal;
+    m_shadow.gaincal = gaincal;
+    m_config3_cal = CONFIG3_EN_OFFCAL | CONFIG3_EN_GAINCAL;
+    write_config3(CONFIG3_SET | m_config3_cal);
+    return true;
+}
+
+/*
+Offset added to every conversion by the last self-calibration, in codes.
+*/
+int32_t Mcp3561::offset_cal() {
+    return (int32_t)(m_shadow.offsetcal << 8) >> 8;
+}
+
+/*
+Gain every conversion is scaled by after the offset, 1.0 until calibrated.
+*/
+float Mcp3561::gain_cal() {
+    return (float)m_shadow.gaincal / GAINCAL_UNITY;
+}
+
+/*
+Self-calibrates every ADC (see Mcp3561::self_calibrate()). Only call with the scan
+engine stopped. Returns false if any of them failed, which keeps its last correction.
+*/
+FLASHMEM bool self_calibrate_ADCs() {
+    bool success = true;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        success = adc_devices[n].self_calibrate() && success;
+    }
+    return success;
+}
+#endif
+
+/*
+Whether an ADCDATA read frame arrived intact: its CRC-16 matches the STATUS and
+data bytes.
+*/
+FASTRUN static inline bool adcdata_crc_ok(const uint8_t *frame) {
+    return crc16_ansi(frame, 4) == (((uint16_t)frame[4] << 8) | frame[5]);
+}
+
+//Status byte + 24 data bits of an ADCDATA read frame
+FASTRUN static inline uint32_t adcdata_raw(const uint8_t *frame) {
+    return ((uint32_t)frame[0] << 24) | ((uint32_t)frame[1] << 16) |
+           ((uint32_t)frame[2] << 8)  |  (uint32_t)frame[3];
+}
+
+/*
+Reads the ADCDATA register and returns the raw output (status byte + 24 data bits)
+without checking the Mux register. Used by the scan engine, which already knows
+which input it selected, so it is safe to call from the ADC interrupt handler.
+A frame that fails its CRC is read again at once (the data stays latched until
+the next conversion); if that fails too the read returns ADCDATA_CRC_FAILED.
+One whose STATUS byte says the configuration was lost has it restored, and
+returns ADCDATA_CONFIG_LOST; a power-on reset turns the CRC off too, so the
+STATUS byte is checked whatever the CRC.
+*/
+FASTRUN uint32_t Mcp3561::read_raw() {
+    uint8_t frame[ADCDATA_FRAME_BYTES];
+    for (int attempt = 0; attempt < 2; attempt++) {
+        select(); //Set CS to Low to begin data transfer
+        SPI.transfer(adcdata_read_frame, frame, sizeof(frame)); //Read ADC_DATA register: status byte, 24 data bits, CRC-16
+        deselect(); //Set CS to high to end data transfer
+        if (config_lost(frame[0])) {
+            restore_config();
+            return (adcdata_raw(frame) & 0xFF000000) | ADCDATA_CONFIG_LOST;
+        }
+        if (adcdata_crc_ok(frame)) {
+            return adcdata_raw(frame);
+        }
+        health_count(HEALTH_ADC_CRC_ERRORS);
+    }
+    return (adcdata_raw(frame) & 0xFF000000) | ADCDATA_CRC_FAILED;
+}
+
+/*
+Takes the bus and starts the DMA frame of a read. If DMA can't be started the
+read is dropped and the bus freed again.
+*/
+FASTRUN void Mcp3561::start_dma() {
+    bus_owner = this;
+    select(); //Set CS to Low to begin data transfer
+    if (!SPI.transfer(adcdata_tx_buff[m_id], adcdata_rx_buff[m_id], ADCDATA_FRAME_BYTES, m_event)) {
+        deselect();
+        bus_owner = NULL;
+        m_busy = false;
+    }
+}
+
+/*
+Starts the reads queued while the bus was taken, lowest device first. Each one
+that gets the bus starts the rest from its own completion.
+*/
+FASTRUN void Mcp3561::start_queued_reads() {
+    for (int n = 0; n < NUM_ADCS && bus_owner == NULL; n++) {
+        Mcp3561 *adc = &adc_devices[n];
+        if (adc->m_queued) {
+            adc->m_queued = false;
+            adc->start_dma();
+        }
+    }
+}
+
+/*
+DMA completion handler for read_async(). Ends the SPI frame, frees the bus and
+passes the assembled raw data to the registered callback, which may use the bus
+for blocking transfers. Queued reads of other devices are started after it. A
+frame that fails its CRC is read again straight away, keeping the bus; a second
+failure passes on ADCDATA_CRC_FAILED, as read_raw() does. A lost configuration
+is restored with the bus still taken, passing on ADCDATA_CONFIG_LOST.
+*/
+FASTRUN void Mcp3561::dma_complete(EventResponderRef event) {
+    Mcp3561 *adc = (Mcp3561 *)event.getContext();
+    adc->deselect(); //Set CS to high to end data transfer
+    const uint8_t *rx = adcdata_rx_buff[adc->m_id];
+    uint32_t raw_data = adcdata_raw(rx);
+    if (adc->config_lost(rx[0])) {
+        adc->restore_config();
+        raw_data = (raw_data & 0xFF000000) | ADCDATA_CONFIG_LOST;
+    } else if (!adcdata_crc_ok(rx)) {
+        health_count(HEALTH_ADC_CRC_ERRORS);
+        if (!adc->m_crc_retried) {
+            adc->m_crc_retried = true;
+            adc->start_dma();
+            if (adc->m_busy) {
+                return;
+            }
+            // DMA couldn't be started again - re-read with blocking transfers
+            raw_data = adc->read_raw();
+        } else {
+            raw_data = (raw_data & 0xFF000000) | ADCDATA_CRC_FAILED;
+        }
+    }
+    adc->m_crc_retried = false;
+    bus_owner = NULL;
+    adc->m_busy = false;
+    ADCDataCallback callback = adc->m_callback;
+    if (callback != NULL) {
+        callback(adc, raw_data);
+    }
+    start_queued_reads();
+}
+
+#ifdef USE_FLEXIO_SPI
+/*
+Start interrupt of the lockstep engine, pended by read_async(): takes the bus
+for every read queued, selects their devices and reads them all in one
+transaction. While the bus is taken the reads wait for its completion. If the
+transaction can't be started the reads are dropped, as in start_dma().
+*/
+FASTRUN void Mcp3561::start_lockstep() {
+    uint8_t devices = 0;
+    __disable_irq();
+    if (bus_owner == NULL) {
+        for (int n = 0; n < NUM_ADCS; n++) {
+            Mcp3561 *adc = &adc_devices[n];
+            if (adc->m_queued) {
+                adc->m_queued = false;
+                if (devices == 0) {
+                    bus_owner = adc;
+                }
+                devices |= 1 << n;
+            }
+        }
+        lockstep_devices = devices;
+    }
+    __enable_irq();
+    if (devices == 0) {
+        return;
+    }
+    SPI.beginTransaction(adc_spi);
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (devices & (1 << n)) {
+            digitalWrite(adc_devices[n].m_cs_pin, LOW);
+        }
+    }
+    if (!flexspi_transfer()) {
+        for (int n = 0; n < NUM_ADCS; n++) {
+            if (devices & (1 << n)) {
+                digitalWrite(adc_devices[n].m_cs_pin, HIGH);
+                adc_devices[n].m_busy = false;
+            }
+        }
+        SPI.endTransaction();
+        lockstep_devices = 0;
+        bus_owner = NULL;
+    }
+}
+
+/*
+Receive completion of the lockstep engine. Ends the chip select frames, frees
+the bus and passes each device's raw data to its callback, as dma_complete()
+does. A frame that fails its CRC is queued for the next transaction once; a
+second failure passes on ADCDATA_CRC_FAILED. A lost configuration is restored
+before the bus is freed, passing on ADCDATA_CONFIG_LOST.
+*/
+FASTRUN void Mcp3561::lockstep_complete() {
+    uint8_t devices = lockstep_devices;
+    uint8_t done = 0;
+    uint32_t raw_data[NUM_ADCS];
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (devices & (1 << n)) {
+            digitalWrite(adc_devices[n].m_cs_pin, HIGH); //Set CS to high to end data transfer
+        }
+    }
+    SPI.endTransaction();
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (!(devices & (1 << n))) {
+            continue;
+        }
+        Mcp3561 *adc = &adc_devices[n];
+        uint8_t frame[ADCDATA_FRAME_BYTES];
+        flexspi_lane_frame(n, frame);
+        raw_data[n] = adcdata_raw(frame);
+        if (adc->config_lost(frame[0])) {
+            adc->restore_config();
+            raw_data[n] = (raw_data[n] & 0xFF000000) | ADCDATA_CONFIG_LOST;
+        } else if (!adcdata_crc_ok(frame)) {
+            health_count(HEALTH_ADC_CRC_ERRORS);
+            if (!adc->m_crc_retried) {
+                adc->m_crc_retried = true;
+                adc->m_queued = true;
+                continue;
+            }
+            raw_data[n] = (raw_data[n] & 0xFF000000) | ADCDATA_CRC_FAILED;
+        }
+        done |= 1 << n;
+    }
+    lockstep_devices = 0;
+    bus_owner = NULL;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (!(done & (1 << n))) {
+            continue;
+        }
+        Mcp3561 *adc = &adc_devices[n];
+        adc->m_crc_retried = false;
+        adc->m_busy = false;
+        ADCDataCallback callback = adc->m_callback;
+        if (callback != NULL) {
+            callback(adc, raw_data[n]);
+        }
+    }
+    //The re-reads, and any reads asked for while the bus was taken
+    for (int n = 0; n < NUM_ADCS; n++) {
+        if (adc_devices[n].m_queued) {
+            flexspi_request();
+            break;
+        }
+    }
+}
+#endif
+
+/*
+Starts a DMA read of the ADCDATA register (same frame as read_raw()) and
+returns immediately. If another ADC's read owns the bus this one is queued behind
+it. The callback is run from the DMA interrupt once the data has arrived. Returns
+false if a read of this ADC is already in progress or DMA can't be started. With
+the lockstep engine (USE_FLEXIO_SPI) the read is queued for its next
+transaction, with the other ADCs' reads asked for by then.
+*/
+FASTRUN bool Mcp3561::read_async(ADCDataCallback callback) {
+    if (m_busy) {
+        return false;
+    }
+    m_busy = true;
+    m_crc_retried = false;
+    m_callback = callback;
+#ifdef USE_FLEXIO_SPI
+    if (lockstep_ready) {
+        m_queued = true;
+        flexspi_request();
+        return true;
+    }
+#endif
+    if (bus_owner != NULL) {
+        m_queued = true;
+        return true;
+    }
+    start_dma();
+    return m_busy;
+}
+
+/*
+Validates raw ADCDATA (see Mcp3561::read()) and sends it to the conversion function
+for the given input. Invalid (saturated) data returns 0, as Mcp3561::read() does.
+*/
+FASTRUN float convert_ADCDATA(uint32_t raw_data, ADCInput input) {
+    uint32_t masked_data = raw_data & 0x00FFFFFF;
+    if ((masked_data == 0x007FFFFF) || (masked_data == 0x00800000)) {
+        Serial.printf("Invalid temperature data.\n");
+        return(0);
+    }
+    if (input == ADC_INPUT_INTERNAL_TEMP) {
+        return convert_internal_temp(masked_data);
+    }
+    return convert_thermistor_temp(masked_data);
+}
+
+#ifdef USE_REF_TRACKING
+//Ideal code of the reference input at gain x1/3 (2^23 / 3), and how far off a
+//reading can be and still be taken for one
+#define REFERENCE_IDEAL_CODE  2796203
+#define REFERENCE_MAX_ERROR   0.05f
+
+//Scale of each ADC's thermistor codes, see set_ADC_reference_code()
+static float reference_scale[MAX_ADCS] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+/*
+Updates the scale of ADC adc's thermistor codes from raw_data, a conversion of
+its reference input at gain x1/3 (see acquisition_reference_code()): the ideal
+code over the measured one. The thermistor divider is ratiometric already, so
+what the scale takes out is a drift of the converter's own gain, which moves the
+reference reading and the thermistor codes alike. It reads the offset too,
+unless USE_ADC_SELF_CAL has removed it. A code that can't be a reference
+reading (none yet, saturated or more than REFERENCE_MAX_ERROR off) keeps the
+last scale and returns false.
+*/
+bool set_ADC_reference_code(int adc, uint32_t raw_data) {
+    uint32_t masked_data = raw_data & 0x00FFFFFF;
+    if (adc < 0 || adc >= NUM_ADCS || masked_data == 0 || masked_data == 0x007FFFFF || masked_data == 0x00800000) {
+        return false;
+    }
+    float scale = (float)REFERENCE_IDEAL_CODE / (float)sign_extend_code(masked_data);
+    if (!(fabsf(scale - 1.0f) <= REFERENCE_MAX_ERROR)) {
+        return false;
+    }
+    reference_scale[adc] = scale;
+    return true;
+}
+
+
+/*
+Scale the thermistor codes of ADC adc are converted with, 1.0 until its
+reference input has been read.
+*/
+float ADC_reference_scale(int adc) {
+    if (adc < 0 || adc >= NUM_ADCS) {
+        return 1.0f;
+    }
+    return reference_scale[adc];
+}
+#endif
+
+//Thermistor code of channel as converted: scaled to the ADC's reference reading
+//with USE_REF_TRACKING
+static inline int32_t thermistor_code(size_t channel, uint32_t masked_data) {
+#ifdef USE_REF_TRACKING
+    return (int32_t)lrintf((float)sign_extend_code(masked_data) * reference_scale[channel / CHANNELS_PER_ADC]);
+#else
+    (void)channel;
+    return sign_extend_code(masked_data);
+#endif
+}
+
+/*
+Converts n raw ADCDATA values (status byte is masked off) from the internal
+temperature sensor. Saturated codes give NAN, so they can't pass for a reading.
+Returns the number of saturated codes.
+*/
+FASTRUN size_t convert_internal_block(const uint32_t *codes, float *out, size_t n) {
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        if (code_saturated(masked_data)) {
+            out[i] = NAN;
+            invalid++;
+            continue;
+        }
+        out[i] = (INTERNAL_TEMP_SCALE * (float)sign_extend_code(masked_data)) + INTERNAL_TEMP_OFFSET;
+    }
+    return invalid;
+}
+
+/*
+The thermistor tables and their arithmetic are in thermistorMux_conversion.h,
+shared with the host tools. The table for the build's thermistor is made at
+compile time and the others when a model is assigned, so each channel converts
+at the same speed whatever the mix of models.
+*/
+static constexpr SensorModel default_sensor = DEFAULT_SENSOR_MODEL;
+
+constexpr ThermistorConversion make_default_conversion() {
+    ThermistorConversion table = {};
+    make_thermistor_conversion(default_sensor, table);
+    return table;
+}
+
+static constexpr ThermistorConversion default_conversion = make_default_conversion();
+
+/*
+Everything the conversion reads is in a ConversionSet, read through one pointer
+to the current version. A change is made to a copy of it, off the hot path,
+which then replaces it in one pointer store (conversion_publish()), so a
+conversion never sees half of a change and never waits for one. A frame pins the
+version it started with (conversion_pin()) for as long as it converts, and a
+version is reused for a copy only while neither current nor pinned, so three
+are enough. The sensor tables are shared out of a pool the same way: one is
+rebuilt only while no current or pinned version uses it.
+
+Writers run in the main loop, one at a time.
+*/
+#define CONVERSION_SETS     3
+#define SENSOR_TABLES       (SENSOR_MAX_MODELS + 1)
+
+constexpr ConversionSet make_default_set() {
+    ConversionSet set = {};
+    for (int model = 0; model < SENSOR_MAX_MODELS; model++) {
+        set.model[model] = &default_conversion;
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        set.channel[channel] = &default_conversion;
+        for (int s = 0; s < CAL_SEGMENTS; s++) {
+            set.cal[channel].start[s] = (s == 0) ? -INFINITY : INFINITY;
+            set.cal[channel].gain[s] = 1.0f;
+#ifdef USE_MILLIDEGREE_NDATA
+            set.cal_fixed[channel].start[s] = (s == 0) ? INT32_MIN : INT32_MAX;
+            set.cal_fixed[channel].gain[s] = 1 << CAL_GAIN_SHIFT;
+#endif
+        }
+    }
+    return set;
+}
+
+//Channels start on the default model, uncalibrated
+static ConversionSet conversion_sets[CONVERSION_SETS] = {make_default_set()};
+static ConversionSet *current_set = &conversion_sets[0];
+static const ConversionSet *pinned_set = NULL;
+static ThermistorConversion sensor_tables[SENSOR_TABLES];
+
+/*
+The current version, as published. A block conversion reads it once, so it
+converts every channel from one version even unpinned.
+*/
+FASTRUN const ConversionSet * conversion_set() {
+    const ConversionSet *set = __atomic_load_n(&pinned_set, __ATOMIC_ACQUIRE);
+    return (set != NULL) ? set : __atomic_load_n(&current_set, __ATOMIC_ACQUIRE);
+}
+
+/*
+Pins the current version for a frame, keeping it, its tables and its
+calibration unchanged, and what conversion_set() returns, until
+conversion_unpin(). Pins nest no deeper than one: there is one conversion stage.
+*/
+FASTRUN const ConversionSet * conversion_pin() {
+    ConversionSet *set;
+    do {
+        set = __atomic_load_n(&current_set, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&pinned_set, set, __ATOMIC_SEQ_CST);
+    } while (set != __atomic_load_n(&current_set, __ATOMIC_SEQ_CST));
+    return set;
+}
+
+/*
+Retires the pinned version, once the frame is converted; the next update can
+reuse it.
+*/
+FASTRUN void conversion_unpin() {
+    __atomic_store_n(&pinned_set, (const ConversionSet *)NULL, __ATOMIC_SEQ_CST);
+}
+
+/*
+A copy of the current version to change, for conversion_publish(). Conversion
+carries on with the current version meanwhile; until it is published the only
+other writer call allowed is conversion_publish().
+*/
+ConversionSet * conversion_begin_update() {
+    const ConversionSet *current = current_set;
+    const ConversionSet *pinned = __atomic_load_n(&pinned_set, __ATOMIC_SEQ_CST);
+    ConversionSet *next = &conversion_sets[0];
+    while (next == current || next == pinned) {
+        next++;
+    }
+    *next = *current;
+    next->version = current->version + 1;
+    return next;
+}
+
+/*
+Makes next, from conversion_begin_update(), the current version: every
+conversion started from here on uses it.
+*/
+void conversion_publish(ConversionSet *next) {
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        next->channel[channel] = next->model[next->channel_model[channel]];
+    }
+    __atomic_store_n(&current_set, next, __ATOMIC_SEQ_CST);
+}
+
+//A pool table that neither the current nor the pinned version uses, NULL if
+//a frame converting with an older version still holds the spare.
+static ThermistorConversion *free_sensor_table() {
+    const ConversionSet *pinned = __atomic_load_n(&pinned_set, __ATOMIC_SEQ_CST);
+    for (int t = 0; t < SENSOR_TABLES; t++) {
+        bool used = false;
+        for (int model = 0; model < SENSOR_MAX_MODELS; model++) {
+            used |= current_set->model[model] == &sensor_tables[t];
+            used |= pinned != NULL && pinned->model[model] == &sensor_tables[t];
+        }
+        if (!used) {
+            return &sensor_tables[t];
+        }
+    }
+    return NULL;
+}
+
+static inline const ThermistorConversion *channel_conversion(const ConversionSet *set, size_t channel) {
+    return set->channel[channel < NUMBER_OF_THERMISTORS ? channel : 0];
+}
+
+/*
+The build's thermistor (thermistor_10K or thermistor_2K) on the board's divider,
+which every channel uses until set_sensor_model() assigns another.
+*/
+const SensorModel * default_sensor_model() {
+    return &default_sensor;
+}
+
+/*
+Whether a model describes a thermistor the conversion can use: positive
+resistances and voltages, a Beta of 100 to 20000 K, and for Steinhart-Hart
+coefficients that put the nominal resistance between -100 and +300 C.
+*/
+bool sensor_model_valid(const SensorModel *sensor) {
+    if (!(sensor->nominal_ohms > 0 && sensor->divider_ohms > 0 && sensor->vref > 0 && sensor->supply > 0)) {
+        return false;
+    }
+    if (sensor->equation == SENSOR_BETA) {
+        return sensor->beta >= 100 && sensor->beta <= 20000;
+    }
+    if (sensor->equation != SENSOR_STEINHART_HART) {
+        return false;
+    }
+    double ln_r = log(sensor->nominal_ohms);
+    double kelvin = 1 / (sensor->a + (sensor->b * ln_r) + (sensor->c * ln_r * ln_r * ln_r));
+    return kelvin >= 173.15 && kelvin <= 573.15;
+}
+
+/*
+Builds the conversion table for sensor model slot model (0 to
+SENSOR_MAX_MODELS - 1), used from then on by every channel assigned to it. NULL
+puts the slot back to the default model. The table is built into a spare one,
+so a frame converting meanwhile keeps the old. Returns false, changing nothing,
+for an invalid slot or model, or with no spare table: a frame still holding the
+one replaced last time.
+*/
+bool set_sensor_model(int model, const SensorModel *sensor) {
+    if (model < 0 || model >= SENSOR_MAX_MODELS || (sensor != NULL && !sensor_model_valid(sensor))) {
+        return false;
+    }
+    const ThermistorConversion *table = &default_conversion;
+    if (sensor != NULL) {
+        ThermistorConversion *spare = free_sensor_table();
+        if (spare == NULL) {
+            return false;
+        }
+        make_thermistor_conversion(*sensor, *spare);
+        table = spare;
+    }
+    ConversionSet *next = conversion_begin_update();
+    next->model[model] = table;
+    conversion_publish(next);
+    return true;
+}
+
+/*
+Converts channel's codes with sensor model slot model from now on.
+*/
+bool set_channel_sensor(int channel, int model) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS || model < 0 || model >= SENSOR_MAX_MODELS) {
+        return false;
+    }
+    ConversionSet *next = conversion_begin_update();
+    next->channel_model[channel] = model;
+    conversion_publish(next);
+    return true;
+}
+
+int channel_sensor(int channel) {
+    return (channel >= 0 && channel < NUMBER_OF_THERMISTORS) ? conversion_set()->channel_model[channel] : -1;
+}
+
+/*
+Uncalibrated temperature, C, that channel converts a thermistor resistance of
+ohms to with its sensor model, from the exact equation rather than the table.
+*/
+float channel_model_temp(int channel, double ohms) {
+    const ThermistorConversion *table = channel_conversion(conversion_set(), channel);
+    double ln_r = log(ohms);
+    return (float)((1 / (table->a + (table->b * ln_r) + (table->c * ln_r * ln_r * ln_r))) - 273.15);
+}
+
+/*
+Power, W, that channel's thermistor dissipates while excited at raw_data:
+V (supply - V) / divider_ohms, V = the thermistor's voltage. 0 for a code
+outside the divider's range.
+*/
+float channel_excitation_watts(int channel, uint32_t raw_data) {
+    const ThermistorConversion *table = channel_conversion(conversion_set(), channel);
+    int32_t code = ((int32_t)(raw_data << 8)) >> 8;
+    float voltage = table->volts_per_code * (float)code;
+    if (!(voltage > 0 && voltage < table->supply)) {
+        return 0;
+    }
+    return (voltage * (table->supply - voltage)) / table->divider_ohms;
+}
+
+/*
+Converts n raw ADCDATA values (status byte is masked off) from the thermistor
+input, codes[i] from thermistor i, e.g. a whole frame in one call, using the
+lookup table of each channel's sensor model. Saturated codes give NAN, so they
+can't pass for a reading. Returns the number of saturated codes.
+
+    V = code * vref / 2^23
+    R = (V * divider) / (supply - V)
+    T = 1 / (a + b * ln(R) + c * ln(R)^3) - 273.15
+*/
+FASTRUN size_t convert_thermistor_block(const uint32_t *codes, float *out, size_t n) {
+    const ConversionSet *set = conversion_set();
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        if (code_saturated(masked_data)) {
+            out[i] = NAN;
+            invalid++;
+            continue;
+        }
+        out[i] = thermistor_lut_temp(channel_conversion(set, i), thermistor_code(i, masked_data));
+    }
+    return invalid;
+}
+
+/*
+The n sign extended codes convert_thermistor_block() converts codes[i] (raw
+ADCDATA, status byte masked off) as: scaled to the ADC's reference reading with
+USE_REF_TRACKING. A saturated code stays saturated, so convert_code_block() with
+the channel's table gives what convert_thermistor_block() does.
+*/
+void thermistor_code_block(const uint32_t *codes, int32_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        out[i] = code_saturated(masked_data) ? sign_extend_code(masked_data) : thermistor_code(i, masked_data);
+    }
+}
+
+/*
+As convert_thermistor_block(), applying a per-channel linear calibration in the
+same pass: out[i] = (gain[i] * T) + offset[i]. Saturated codes still give NAN.
+*/
+size_t convert_thermistor_block_calibrated(const uint32_t *codes, const float *gain, const float *offset,
+                                           float *out, size_t n) {
+    const ConversionSet *set = conversion_set();
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        if (code_saturated(masked_data)) {
+            out[i] = NAN;
+            invalid++;
+            continue;
+        }
+        out[i] = (gain[i] * thermistor_lut_temp(channel_conversion(set, i), thermistor_code(i, masked_data))) + offset[i];
+    }
+    return invalid;
+}
+
+
+/*
+As convert_thermistor_block(), applying each channel's piecewise-linear
+calibration in the same pass: out[i] = (gain * T) + offset for the segment of
+cal[i] that T falls in. Saturated codes still give NAN.
+*/
+FASTRUN size_t convert_thermistor_block_piecewise(const uint32_t *codes, const CalSegments *cal, float *out, size_t n) {
+    const ConversionSet *set = conversion_set();
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        if (code_saturated(masked_data)) {
+            out[i] = NAN;
+            invalid++;
+            continue;
+        }
+        out[i] = apply_cal_segments(&cal[i], thermistor_lut_temp(channel_conversion(set, i), thermistor_code(i, masked_data)));
+    }
+    return invalid;
+}
+
+#ifdef USE_MILLIDEGREE_NDATA
+//Table lookup for one sign extended code, in milli-degrees; exact equation in
+//the end segments, THERMISTOR_NULL where it has no value.
+static inline int32_t thermistor_lut_mdeg(const ThermistorConversion *table, int32_t code) {
+    int32_t index = code >> THERM_LUT_SHIFT;
+    if (index >= 1 && index < THERM_LUT_SIZE - 1) {
+        int32_t fraction = code & ((1 << THERM_LUT_SHIFT) - 1);
+        int32_t low = table->mdeg[index];
+        return low + (int32_t)(((int64_t)(table->mdeg[index + 1] - low) * fraction) >> THERM_LUT_SHIFT);
+    }
+    float temp = thermistor_lut_temp(table, code);
+    return (fabsf(temp) < 2.0e6f) ? (int32_t)lrintf(temp * 1000) : THERMISTOR_NULL;
+}
+
+//A calibration value in milli-degrees, or scaled by 2^shift for a gain; infinite
+//starts become the ends of the int32_t range.
+static int32_t fix_cal_value(float value, int shift) {
+    double scaled = ldexp((double)value, shift);
+    if (!(scaled > INT32_MIN + 1.0)) {
+        return INT32_MIN;
+    }
+    if (!(scaled < INT32_MAX)) {
+        return INT32_MAX;
+    }
+    return (int32_t)lround(scaled);
+}
+
+/*
+Converts a channel's piecewise-linear calibration to the fixed point form used
+by convert_thermistor_block_mdeg(). Call it whenever cal changes.
+*/
+void fix_cal_segments(const CalSegments *cal, CalSegmentsFixed *fixed) {
+    for (int s = 0; s < CAL_SEGMENTS; s++) {
+        fixed->start[s] = fix_cal_value(cal->start[s] * 1000, 0);
+        fixed->gain[s] = fix_cal_value(cal->gain[s], CAL_GAIN_SHIFT);
+        fixed->offset[s] = fix_cal_value(cal->offset[s] * 1000, 0);
+    }
+}
+
+//As cal_segment(), for a temperature in milli-degrees.
+static inline unsigned int cal_segment_fixed(const CalSegmentsFixed *cal, int32_t temp) {
+    unsigned int s = (temp >= cal->start[4]) ? 4 : 0;
+    s += (temp >= cal->start[s + 2]) ? 2 : 0;
+    s += (temp >= cal->start[s + 1]) ? 1 : 0;
+    return s;
+}
+
+/*
+As convert_thermistor_block_piecewise(), in whole milli-degrees with integer
+arithmetic from the code onward:
+    out[i] = ((gain * T) >> CAL_GAIN_SHIFT) + offset, rounded
+Saturated codes give THERMISTOR_NULL. Returns the number of saturated codes.
+*/
+FASTRUN size_t convert_thermistor_block_mdeg(const uint32_t *codes, const CalSegmentsFixed *cal, int32_t *out, size_t n) {
+    const ConversionSet *set = conversion_set();
+    size_t invalid = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t masked_data = codes[i] & 0x00FFFFFF;
+        if (code_saturated(masked_data)) {
+            out[i] = THERMISTOR_NULL;
+            invalid++;
+            continue;
+        }
+        int32_t temp = thermistor_lut_mdeg(channel_conversion(set, i), thermistor_code(i, masked_data));
+        if (temp == THERMISTOR_NULL) {
+            out[i] = THERMISTOR_NULL;
+            continue;
+        }
+        unsigned int s = cal_segment_fixed(&cal[i], temp);
+        int64_t scaled = (((int64_t)cal[i].gain[s] * temp) + (1 << (CAL_GAIN_SHIFT - 1))) >> CAL_GAIN_SHIFT;
+        scaled += cal[i].offset[s];
+        out[i] = (scaled > INT32_MIN && scaled <= INT32_MAX) ? (int32_t)scaled : THERMISTOR_NULL;
+    }
+    return invalid;
+}
+#endif
+
+/*
+Classifies one raw ADCDATA value (status byte is masked off) from the thermistor
+input of channel: saturated or implausibly high or low resistance for its
+sensor model means the thermistor is open or shorted rather than reading a
+temperature.
+*/
+FASTRUN ThermistorFault classify_thermistor_code(int channel, uint32_t raw_data) {
+    const ThermistorConversion *table = channel_conversion(conversion_set(), channel);
+    int32_t code = sign_extend_code(raw_data & 0x00FFFFFF);
+    if (code >= table->open_code) {
+        return THERMISTOR_OPEN;
+    }
+    if (code <= table->short_code) {
+        return THERMISTOR_SHORT;
+    }
+    return THERMISTOR_OK;
+}
+
+
 /**
 Datasheet tranfer equation is for V_ref = 3.3 V & Gain = 1.
     Temp (C) = [0.00133 * ADCDATA(LSB)] - 267.146
 We are implementing V_ref = 2.4 V & Gain = 1.
     Temp (C) = [0.00133 * (V_ref/3.3V) * (ADCDATA(LSB))] - 267.146
 **/
-float convert_internal_temp(uint32_t masked_internal_data) {
+FASTRUN float convert_internal_temp(uint32_t masked_internal_data) {
     int32_t internal_data = int32_t(masked_internal_data);
 
     //Two's Complement conversion for negative ADC output data.
@@ -244,7 +1887,7 @@ https://www.tme.eu/Document/32a31570f1c819f9b3730213e5eca259/TT7-10KC3-11.pdf
     R = measured resistance (thermistance)
     R_o = resistance at room temperature (10K or 2.2K ohms)
 **/
-float convert_thermistor_temp(uint32_t masked_therm_data){
+FASTRUN float convert_thermistor_temp(uint32_t masked_therm_data){
     float ADC_output_voltage;
     float thermistance;
     int32_t therm_data = int32_t(masked_therm_data);
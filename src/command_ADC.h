@@ -23,18 +23,223 @@ this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
 #include <avr/io.h>
+#include <stddef.h>
+#include <EventResponder.h>
+#include "thermistorMux_global.h"
+#include "command_ADC_registers.h"
+#include "thermistorMux_conversion.h"
 
 #ifndef ADC_H
 #define ADC_H
 
 
+// ADC input sources selectable through the MUX register
+enum ADCInput {
+    ADC_INPUT_THERMISTOR,     // CH0/CH1, the currently switched thermistor
+    ADC_INPUT_INTERNAL_TEMP,  // Internal temperature diode
+    ADC_INPUT_SHORTED,        // Both inputs on AGND, for the offset (see self_calibrate())
+    ADC_INPUT_REFERENCE       // REFIN+/REFIN-, for the gain
+};
+
+// How the ADC sequences conversions outside SCAN mode
+enum ADCConversionMode {
+    ADC_ONE_SHOT,             // One conversion per start_conversion(), then standby
+    ADC_CONTINUOUS            // Back to back conversions until standby()
+};
+
+// Settings of the next conversion outside SCAN mode, see Mcp3561::set_conversion()
+struct ADCConversion {
+    ADCInput input;
+    ADCConversionMode mode;
+    uint8_t osr_steps;        // Oversampling ratio codes below the one set (down to the lowest)
+    uint8_t gain_shift;       // PGA gain 1 << gain_shift, at most x64; the reference input is always x1/3
+};
+
+// What a thermistor input reading says about the channel
+enum ThermistorFault {
+    THERMISTOR_OK,
+    THERMISTOR_OPEN,      // Far above the thermistor's resistance range, or saturated high
+    THERMISTOR_SHORT      // Near zero resistance, a negative code, or saturated low
+};
+
+// Sensor models in use at once; each channel converts with one of them
+#define SENSOR_MAX_MODELS 4
+
+#ifdef USE_MILLIDEGREE_NDATA
+// CalSegments in fixed point, see convert_thermistor_block_mdeg(): starts and
+// offsets in milli-degrees, gains scaled by 2^CAL_GAIN_SHIFT.
+#define CAL_GAIN_SHIFT  24
+struct CalSegmentsFixed {
+    int32_t start[CAL_SEGMENTS];
+    int32_t gain[CAL_SEGMENTS];
+    int32_t offset[CAL_SEGMENTS];
+};
+#endif
+
+// One version of everything the thermistor conversion reads: the sensor model
+// in each slot, each channel's slot, and each channel's calibration. A version
+// is never changed once published, see conversion_begin_update().
+struct ConversionSet {
+    uint32_t version;
+    const ThermistorConversion *model[SENSOR_MAX_MODELS];
+    uint8_t channel_model[NUMBER_OF_THERMISTORS];
+    const ThermistorConversion *channel[NUMBER_OF_THERMISTORS];     // model[channel_model[]], set on publishing
+    CalSegments cal[NUMBER_OF_THERMISTORS];
+#ifdef USE_MILLIDEGREE_NDATA
+    CalSegmentsFixed cal_fixed[NUMBER_OF_THERMISTORS];
+#endif
+};
+
+// ADC clock and filter settings for a data rate, see set_ADC_profile()
+struct ADCProfile {
+    const char *name;
+    uint8_t prescaler;          // AMCLK divider: 1, 2, 4 or 8
+    uint32_t osr;               // Oversampling ratio
+    uint16_t line_hz;           // Mains frequency rejected, 0 for none
+};
+
+class Mcp3561;
+
+// Called when an asynchronous ADCDATA read completes, with the ADC it was read
+// from and the raw output (status byte + 24 data bits). Runs in the DMA
+// interrupt context.
+typedef void (*ADCDataCallback)(Mcp3561 *adc, uint32_t raw_data);
+
+// Configuration registers as last written. The firmware is the only writer, so
+// reads are tagged from here instead of reading the Mux register back.
+struct ADCRegisters {
+    uint8_t config0;
+    uint8_t config1;
+    uint8_t config2;
+    uint8_t config3;
+    uint8_t irq;
+    uint8_t mux;
+    uint32_t scan;
+    uint32_t timer;
+    uint32_t offsetcal;
+    uint32_t gaincal;
+};
+
+/*
+One MCP3561 on the shared SPI bus, with its own chip select, data-ready (IRQ)
+pin and register shadow. The NUM_ADCS devices are set up by initADC() and
+reached through ADC_device(). All of them share the SPI clock.
+*/
+class Mcp3561 {
+public:
+    Mcp3561();
+    void begin(uint8_t id, uint8_t cs_pin, uint8_t irq_pin);
+    bool init();
+    bool set_oversampling(uint32_t osr);
+    uint32_t oversampling();
+    bool set_prescaler(unsigned int divider);
+    void set_profile(int n);
+    unsigned int prescaler();
+    uint32_t conversion_us(uint8_t osr_steps);
+    void select_input(ADCInput input);
+    void set_conversion(const ADCConversion &conversion);
+    void start_conversion();
+    void standby();
+    void start_scan(bool include_temp, unsigned int delay_us);
+    void set_scan_list(bool include_temp);
+    void stop_scan();
+    float read();
+    uint32_t read_raw();
+    bool read_async(ADCDataCallback callback);
+    bool async_busy() { return m_busy; }
+    bool verify_registers();
+    bool restore_if_lost();
+    bool patterns_read_back();
+#ifdef USE_ADC_SELF_CAL
+    bool self_calibrate();
+    int32_t offset_cal();
+    float gain_cal();
+#endif
+    uint8_t id() { return m_id; }
+    uint8_t irq_pin() { return m_irq_pin; }
+
+private:
+    void select();
+    void deselect();
+    void start_dma();
+    static void dma_complete(EventResponderRef event);
+    static void start_queued_reads();
+#ifdef USE_FLEXIO_SPI
+    static void start_lockstep();
+    static void lockstep_complete();
+    friend bool initADC();
+#endif
+    void write_frame(MCPFrame frame);
+    void write_registers(uint8_t config1, uint8_t config2, uint8_t config3, uint8_t mux);
+    void write_config3(uint8_t config3);
+    void set_lock(bool locked);
+    bool config_lost(uint8_t status);
+    void restore_config();
+#ifdef USE_ADC_SELF_CAL
+    bool wait_data_ready();
+    bool measure(ADCInput input, uint8_t gain_code, int32_t *mean);
+#endif
+
+    uint8_t m_id;
+    uint8_t m_cs_pin;
+    uint8_t m_irq_pin;
+    volatile ADCRegisters m_shadow;
+    uint8_t m_config1;              // As set by set_oversampling(), kept across init()
+    uint8_t m_config3_cal;          // Config3 EN_OFFCAL/EN_GAINCAL, set once self_calibrate() has programmed them
+    EventResponder m_event;
+    volatile ADCDataCallback m_callback;
+    volatile bool m_busy;           // An asynchronous read is queued or in flight
+    volatile bool m_queued;         // Waiting for another device's read to free the bus
+    volatile bool m_crc_retried;    // The read in flight is the re-read of a frame that failed its CRC
+    volatile bool m_locked;         // Register writes locked, with the configuration CRC checked (SCAN mode)
+};
+
 bool initADC();
-void setADCInternalTempRead();
-void setThermistorMuxRead();
-void start_conversion();
-float read_ADCDATA();
+Mcp3561 *ADC_device(int n);
+bool ADC_bus_busy();
+bool set_ADC_SPI_clock(uint32_t hz);
+uint32_t ADC_SPI_clock();
+bool tune_ADC_SPI_clock();
+bool set_ADC_oversampling(uint32_t osr);
+uint32_t ADC_oversampling();
+const ADCProfile *ADC_profile(int n);
+int find_ADC_profile(const char *name);
+bool set_ADC_profile(int n);
+int ADC_profile_in_use();
+bool verify_ADC_registers();
+#ifdef USE_ADC_SELF_CAL
+bool self_calibrate_ADCs();
+#endif
+#ifdef USE_REF_TRACKING
+bool set_ADC_reference_code(int adc, uint32_t raw_data);
+float ADC_reference_scale(int adc);
+#endif
+float convert_ADCDATA(uint32_t raw_data, ADCInput input);
 float convert_internal_temp(uint32_t);
 float convert_thermistor_temp(uint32_t);
+size_t convert_internal_block(const uint32_t *codes, float *out, size_t n);
+size_t convert_thermistor_block(const uint32_t *codes, float *out, size_t n);
+void thermistor_code_block(const uint32_t *codes, int32_t *out, size_t n);
+ThermistorFault classify_thermistor_code(int channel, uint32_t raw_data);
+const ConversionSet * conversion_set();
+const ConversionSet * conversion_pin();
+void conversion_unpin();
+ConversionSet * conversion_begin_update();
+void conversion_publish(ConversionSet *next);
+const SensorModel * default_sensor_model();
+bool sensor_model_valid(const SensorModel *sensor);
+bool set_sensor_model(int model, const SensorModel *sensor);
+bool set_channel_sensor(int channel, int model);
+int channel_sensor(int channel);
+float channel_model_temp(int channel, double ohms);
+float channel_excitation_watts(int channel, uint32_t raw_data);
+size_t convert_thermistor_block_calibrated(const uint32_t *codes, const float *gain, const float *offset,
+                                           float *out, size_t n);
+size_t convert_thermistor_block_piecewise(const uint32_t *codes, const CalSegments *cal, float *out, size_t n);
+#ifdef USE_MILLIDEGREE_NDATA
+void fix_cal_segments(const CalSegments *cal, CalSegmentsFixed *fixed);
+size_t convert_thermistor_block_mdeg(const uint32_t *codes, const CalSegmentsFixed *cal, int32_t *out, size_t n);
+#endif
 
 
 #endif
\ No newline at end of file
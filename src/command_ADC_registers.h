@@ -0,0 +1,425 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file command_ADC_registers.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief MCP3561 register images composed from named fields at compile time.
+ * An MCPRegisters starts from the power-on defaults and each setter returns a
+ * copy with one field changed, so an image reads as a list of settings:
+ *
+ *     static constexpr MCPRegisters regs = MCPRegisters().oversampling(20480).gain(MCP_GAIN_X1);
+ *     static_assert(regs.check() == 0, "...");
+ *
+ * A value the ADC doesn't support (an oversampling ratio not in Table 5-6, a
+ * prescaler other than 1, 2, 4 or 8, the same input on both sides of the Mux, a
+ * Timer over 24 bits) sets a bit of errors rather than the field, and check()
+ * adds the combinations that don't go together. mcp_write_frame() turns a run
+ * of an image's registers into the incremental write that programs them (see
+ * figure 6-3 of ADC datasheet).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef COMMAND_ADC_REGISTERS_H
+#define COMMAND_ADC_REGISTERS_H
+
+#include <stdint.h>
+
+// Hard coded device address, CMD[7:6] of every command byte
+#define MCP_DEVICE_ADDRESS  0b01
+// Longest incremental write of an image, Config0 to Timer: command, 6 bytes, 2 x 24 bits
+#define MCP_FRAME_MAX       13
+
+// Register addresses, CMD[5:2] (Table 8-1 of ADC datasheet)
+enum MCPRegister {
+    MCP_REG_ADCDATA,
+    MCP_REG_CONFIG0,
+    MCP_REG_CONFIG1,
+    MCP_REG_CONFIG2,
+    MCP_REG_CONFIG3,
+    MCP_REG_IRQ,
+    MCP_REG_MUX,
+    MCP_REG_SCAN,
+    MCP_REG_TIMER,
+    MCP_REG_OFFSETCAL,
+    MCP_REG_GAINCAL,
+    MCP_REG_LOCK = 0xD,                 // Write lock; while locked the configuration's CRC is checked
+    MCP_REG_CRCCFG = 0xF                // CRC-16 of Config0 to GainCal taken when locked, read only
+};
+
+// Config0 CLK_SEL[1:0]
+enum MCPClock {
+    MCP_CLOCK_EXTERNAL = 0b00,          // MCLK from the clock pin
+    MCP_CLOCK_INTERNAL = 0b10,          // Internal oscillator, no clock output
+    MCP_CLOCK_INTERNAL_OUTPUT = 0b11    // Internal oscillator, AMCLK on the clock pin
+};
+
+// Config0 CS_SEL[1:0], burn-out current sources on the inputs
+enum MCPCurrentSource {
+    MCP_CURRENT_NONE = 0b00,
+    MCP_CURRENT_0U9A = 0b01,
+    MCP_CURRENT_3U7A = 0b10,
+    MCP_CURRENT_15UA = 0b11
+};
+
+// Config0 ADC_MODE[1:0]; writing conversion mode starts a conversion
+enum MCPAdcMode {
+    MCP_MODE_SHUTDOWN = 0b00,
+    MCP_MODE_STANDBY = 0b10,
+    MCP_MODE_CONVERSION = 0b11
+};
+
+// Config2 BOOST[1:0], bias current of the input buffers
+enum MCPBoost {
+    MCP_BOOST_HALF = 0b00,
+    MCP_BOOST_TWO_THIRDS = 0b01,
+    MCP_BOOST_X1 = 0b10,
+    MCP_BOOST_X2 = 0b11
+};
+
+// Config2 GAIN[2:0]
+enum MCPGain {
+    MCP_GAIN_THIRD,
+    MCP_GAIN_X1,
+    MCP_GAIN_X2,
+    MCP_GAIN_X4,
+    MCP_GAIN_X8,
+    MCP_GAIN_X16,
+    MCP_GAIN_X32,
+    MCP_GAIN_X64
+};
+
+// Config3 CONV_MODE[1:0]
+enum MCPConversionMode {
+    MCP_CONV_ONE_SHOT_SHUTDOWN = 0b00,  // One conversion (or SCAN cycle), then shutdown
+    MCP_CONV_ONE_SHOT = 0b10,           // One conversion (or SCAN cycle), then standby
+    MCP_CONV_CONTINUOUS = 0b11          // Back to back conversions (or cycles, Timer apart in SCAN mode)
+};
+
+// Config3 DATA_FORMAT[1:0] of ADCDATA
+enum MCPDataFormat {
+    MCP_DATA_24 = 0b00,                 // 24 bit code, locked at 0x7FFFFF/0x800000 when out of range
+    MCP_DATA_32_LEFT = 0b01,            // 24 bit code and 8 zero bits
+    MCP_DATA_32_SIGN = 0b10,            // Sign extended to 32 bits, allows overrange
+    MCP_DATA_32_CHANNEL = 0b11          // As MCP_DATA_32_SIGN with the SCAN channel ID in the top nibble
+};
+
+// IRQ IRQ_MODE[1:0]
+enum MCPIrqMode {
+    MCP_IRQ_OUTPUT_HIGH_Z = 0b00,       // IRQ output, high-Z while inactive (needs a pull-up)
+    MCP_IRQ_OUTPUT_HIGH = 0b01,         // IRQ output, driven high while inactive
+    MCP_MDAT_OUTPUT_HIGH_Z = 0b10,      // Modulator output, high-Z while inactive
+    MCP_MDAT_OUTPUT_HIGH = 0b11
+};
+
+// Mux MUX_VIN+/MUX_VIN- input codes
+enum MCPMuxInput {
+    MCP_MUX_CH0, MCP_MUX_CH1, MCP_MUX_CH2, MCP_MUX_CH3,
+    MCP_MUX_CH4, MCP_MUX_CH5, MCP_MUX_CH6, MCP_MUX_CH7,
+    MCP_MUX_AGND,
+    MCP_MUX_AVDD,
+    MCP_MUX_RESERVED,
+    MCP_MUX_REFIN_POS,
+    MCP_MUX_REFIN_NEG,
+    MCP_MUX_TEMP_P,                     // Internal temperature diode
+    MCP_MUX_TEMP_M,
+    MCP_MUX_VCM
+};
+
+// Scan register SCAN[15:0] channels, converted in this order each cycle
+#define MCP_SCAN_SINGLE(ch)  (1UL << (ch))     // CH0 to CH7 against AGND
+#define MCP_SCAN_DIFF_A      (1UL << 8)        // CH0 - CH1
+#define MCP_SCAN_DIFF_B      (1UL << 9)        // CH2 - CH3
+#define MCP_SCAN_DIFF_C      (1UL << 10)       // CH4 - CH5
+#define MCP_SCAN_DIFF_D      (1UL << 11)       // CH6 - CH7
+#define MCP_SCAN_TEMP        (1UL << 12)       // Internal temperature diode
+#define MCP_SCAN_AVDD        (1UL << 13)
+#define MCP_SCAN_VCM         (1UL << 14)
+#define MCP_SCAN_OFFSET      (1UL << 15)       // Shorted inputs, for the offset
+#define MCP_SCAN_CHANNELS    0x00FFFFUL
+
+// Scan register DLY[2:0], DMCLK periods between the conversions of a cycle
+enum MCPScanDelay {
+    MCP_SCAN_DELAY_0, MCP_SCAN_DELAY_8, MCP_SCAN_DELAY_16, MCP_SCAN_DELAY_32,
+    MCP_SCAN_DELAY_64, MCP_SCAN_DELAY_128, MCP_SCAN_DELAY_256, MCP_SCAN_DELAY_512
+};
+
+// MCPRegisters errors, a bit per setting the ADC can't take
+#define MCP_ERROR_PRESCALER     0x01    // Not 1, 2, 4 or 8
+#define MCP_ERROR_OSR           0x02    // Not one of the ratios of Table 5-6
+#define MCP_ERROR_MUX           0x04    // Both sides on one input, or on the reserved code
+#define MCP_ERROR_TIMER         0x08    // Over 24 bits
+#define MCP_ERROR_TIMER_UNUSED  0x10    // A Timer delay outside continuous SCAN mode, where it is ignored
+
+// Oversampling ratio for each OSR[3:0] code (Table 5-6 of ADC datasheet)
+static constexpr uint32_t mcp_osr_ratios[16] = {32, 64, 128, 256, 512, 1024, 2048, 4096,
+                                                8192, 16384, 20480, 24576, 40960, 49152, 81920, 98304};
+
+/*
+OSR[3:0] code of an oversampling ratio, 16 for a ratio the ADC doesn't support.
+*/
+constexpr uint8_t mcp_osr_code(uint32_t osr) {
+    uint8_t code = 0;
+    while (code < 16 && mcp_osr_ratios[code] != osr) {
+        code++;
+    }
+    return code;
+}
+
+/*
+PRE[1:0] code of an AMCLK prescaler, 4 for a divider other than 1, 2, 4 or 8.
+*/
+constexpr uint8_t mcp_prescaler_code(unsigned int divider) {
+    uint8_t code = 0;
+    while (code < 4 && (1u << code) != divider) {
+        code++;
+    }
+    return code;
+}
+
+/*
+Mux register byte for a pair of inputs.
+*/
+constexpr uint8_t mcp_mux(MCPMuxInput positive, MCPMuxInput negative) {
+    return (uint8_t)((positive << 4) | negative);
+}
+
+// The writable registers from Config0 to Timer
+struct MCPRegisters {
+    uint8_t config0;
+    uint8_t config1;
+    uint8_t config2;
+    uint8_t config3;
+    uint8_t irq;
+    uint8_t mux;
+    uint32_t scan;
+    uint32_t timer;
+    uint8_t errors;                     // MCP_ERROR_ bits of the settings that were refused
+
+    // Power-on defaults (Table 8-1 of ADC datasheet), writable bits only
+    constexpr MCPRegisters()
+        : config0(0xC0), config1(0x0C), config2(0x8B), config3(0x00), irq(0x03), mux(0x01), scan(0), timer(0),
+          errors(0) {}
+
+    // Config0
+    constexpr MCPRegisters clock(MCPClock clock) const {
+        MCPRegisters r = *this;
+        r.config0 = (uint8_t)((config0 & ~0x30) | (clock << 4));
+        return r;
+    }
+    constexpr MCPRegisters current_source(MCPCurrentSource current) const {
+        MCPRegisters r = *this;
+        r.config0 = (uint8_t)((config0 & ~0x0C) | (current << 2));
+        return r;
+    }
+    constexpr MCPRegisters adc_mode(MCPAdcMode mode) const {
+        MCPRegisters r = *this;
+        r.config0 = (uint8_t)((config0 & ~0x03) | mode);
+        return r;
+    }
+
+    // Config1: data rate = MCLK / (4 * prescaler * OSR)
+    constexpr MCPRegisters prescaler(unsigned int divider) const {
+        MCPRegisters r = *this;
+        uint8_t code = mcp_prescaler_code(divider);
+        if (code > 3) {
+            r.errors |= MCP_ERROR_PRESCALER;
+            return r;
+        }
+        r.config1 = (uint8_t)((config1 & ~0xC0) | (code << 6));
+        return r;
+    }
+    constexpr MCPRegisters oversampling(uint32_t osr) const {
+        MCPRegisters r = *this;
+        uint8_t code = mcp_osr_code(osr);
+        if (code > 15) {
+            r.errors |= MCP_ERROR_OSR;
+            return r;
+        }
+        r.config1 = (uint8_t)((config1 & ~0x3C) | (code << 2));
+        return r;
+    }
+
+    // Config2; bits 1:0 stay '11'
+    constexpr MCPRegisters boost(MCPBoost boost) const {
+        MCPRegisters r = *this;
+        r.config2 = (uint8_t)((config2 & ~0xC0) | (boost << 6));
+        return r;
+    }
+    constexpr MCPRegisters gain(MCPGain gain) const {
+        MCPRegisters r = *this;
+        r.config2 = (uint8_t)((config2 & ~0x38) | (gain << 3));
+        return r;
+    }
+    constexpr MCPRegisters mux_auto_zero(bool enable) const {
+        MCPRegisters r = *this;
+        r.config2 = (uint8_t)((config2 & ~0x04) | (enable ? 0x04 : 0));
+        return r;
+    }
+
+    // Config3
+    constexpr MCPRegisters conversion_mode(MCPConversionMode mode) const {
+        MCPRegisters r = *this;
+        r.config3 = (uint8_t)((config3 & ~0xC0) | (mode << 6));
+        return r;
+    }
+    constexpr MCPRegisters data_format(MCPDataFormat format) const {
+        MCPRegisters r = *this;
+        r.config3 = (uint8_t)((config3 & ~0x30) | (format << 4));
+        return r;
+    }
+    // CRC on communications: a CRC-16 (or CRC-32 with wide) follows every read
+    constexpr MCPRegisters crc(bool enable, bool wide = false) const {
+        MCPRegisters r = *this;
+        r.config3 = (uint8_t)((config3 & ~0x0C) | (wide ? 0x08 : 0) | (enable ? 0x04 : 0));
+        return r;
+    }
+    constexpr MCPRegisters offset_cal(bool enable) const {
+        MCPRegisters r = *this;
+        r.config3 = (uint8_t)((config3 & ~0x02) | (enable ? 0x02 : 0));
+        return r;
+    }
+    constexpr MCPRegisters gain_cal(bool enable) const {
+        MCPRegisters r = *this;
+        r.config3 = (uint8_t)((config3 & ~0x01) | (enable ? 0x01 : 0));
+        return r;
+    }
+
+    // IRQ
+    constexpr MCPRegisters irq_mode(MCPIrqMode mode) const {
+        MCPRegisters r = *this;
+        r.irq = (uint8_t)((irq & ~0x0C) | (mode << 2));
+        return r;
+    }
+    constexpr MCPRegisters fast_commands(bool enable) const {
+        MCPRegisters r = *this;
+        r.irq = (uint8_t)((irq & ~0x02) | (enable ? 0x02 : 0));
+        return r;
+    }
+    // Conversion start interrupt on the IRQ pin
+    constexpr MCPRegisters start_interrupt(bool enable) const {
+        MCPRegisters r = *this;
+        r.irq = (uint8_t)((irq & ~0x01) | (enable ? 0x01 : 0));
+        return r;
+    }
+
+    // Mux, ignored while the Scan register lists channels
+    constexpr MCPRegisters input(MCPMuxInput positive, MCPMuxInput negative) const {
+        MCPRegisters r = *this;
+        if (positive == negative || positive == MCP_MUX_RESERVED || negative == MCP_MUX_RESERVED) {
+            r.errors |= MCP_ERROR_MUX;
+            return r;
+        }
+        r.mux = mcp_mux(positive, negative);
+        return r;
+    }
+
+    // Scan and Timer: SCAN mode converts the channels listed (MCP_SCAN_ bits)
+    // each cycle, and in continuous mode starts the next cycle timer DMCLK
+    // periods after the last
+    constexpr MCPRegisters scan_channels(uint32_t channels, MCPScanDelay delay = MCP_SCAN_DELAY_0) const {
+        MCPRegisters r = *this;
+        r.scan = ((uint32_t)delay << 21) | (channels & MCP_SCAN_CHANNELS);
+        return r;
+    }
+    constexpr MCPRegisters scan_timer(uint32_t dmclk_periods) const {
+        MCPRegisters r = *this;
+        if (dmclk_periods > 0xFFFFFF) {
+            r.errors |= MCP_ERROR_TIMER;
+            return r;
+        }
+        r.timer = dmclk_periods;
+        return r;
+    }
+
+    /*
+    Settings refused by the setters, and those that don't go together: a
+    Timer delay is only used between continuous SCAN cycles.
+    */
+    constexpr uint8_t check() const {
+        uint8_t found = errors;
+        bool continuous_scan = (scan & MCP_SCAN_CHANNELS) != 0 && (config3 >> 6) == MCP_CONV_CONTINUOUS;
+        if (timer != 0 && !continuous_scan) {
+            found |= MCP_ERROR_TIMER_UNUSED;
+        }
+        return found;
+    }
+
+    /*
+    Value of a register of the image, 0 for one it doesn't hold.
+    */
+    constexpr uint32_t value(MCPRegister reg) const {
+        return reg == MCP_REG_CONFIG0 ? config0 :
+               reg == MCP_REG_CONFIG1 ? config1 :
+               reg == MCP_REG_CONFIG2 ? config2 :
+               reg == MCP_REG_CONFIG3 ? config3 :
+               reg == MCP_REG_IRQ     ? irq :
+               reg == MCP_REG_MUX     ? mux :
+               reg == MCP_REG_SCAN    ? scan :
+               reg == MCP_REG_TIMER   ? timer : 0;
+    }
+};
+
+/*
+Bytes of a register: the 8 bit configuration registers, then the 24 bit ones.
+*/
+constexpr uint8_t mcp_register_bytes(MCPRegister reg) {
+    return (reg >= MCP_REG_CONFIG0 && reg <= MCP_REG_MUX) ? 1 : 3;
+}
+
+/*
+Command byte of an incremental write starting at reg.
+*/
+constexpr uint8_t mcp_incremental_write(MCPRegister reg) {
+    return (uint8_t)((MCP_DEVICE_ADDRESS << 6) | (reg << 2) | 0b10);
+}
+
+/*
+Position in an incremental write starting at first of reg's first byte.
+*/
+constexpr uint8_t mcp_frame_offset(MCPRegister first, MCPRegister reg) {
+    uint8_t offset = 1;
+    for (int r = first; r < reg; r++) {
+        offset += mcp_register_bytes((MCPRegister)r);
+    }
+    return offset;
+}
+
+// An incremental write ready to send: the command byte, then each register MSB first
+struct MCPFrame {
+    uint8_t bytes[MCP_FRAME_MAX];
+    uint8_t length;                     // 0 for a run outside Config0 to Timer
+};
+
+/*
+Incremental write of registers first to last of image, in one chip select frame.
+*/
+constexpr MCPFrame mcp_write_frame(const MCPRegisters &image, MCPRegister first, MCPRegister last) {
+    MCPFrame frame = {};
+    if (first < MCP_REG_CONFIG0 || last > MCP_REG_TIMER || first > last) {
+        return frame;
+    }
+    frame.bytes[frame.length++] = mcp_incremental_write(first);
+    for (int reg = first; reg <= last; reg++) {
+        uint32_t value = image.value((MCPRegister)reg);
+        for (int byte = mcp_register_bytes((MCPRegister)reg) - 1; byte >= 0; byte--) {
+            frame.bytes[frame.length++] = (uint8_t)(value >> (8 * byte));
+        }
+    }
+    return frame;
+}
+
+#endif
@@ -0,0 +1,1880 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_acquisition.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Interrupt-driven scan engine. Each ADC data-ready interrupt reads the
+ * finished conversion, switches the MOSFETs to the next slot and starts the next
+ * conversion, so the main loop never waits on the ADC. Samples are handed off
+ * through the sample ring and reassembled into passes on the loop() side.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_acquisition.h"
+#include "command_ADC.h"
+#include "thermistorMux_ring.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_scantrace.h"
+#include "thermistorMux_autorange.h"
+
+// Maximum time to wait for the conversion in progress when stopping the engine.
+// One conversion at OSR 20480 takes ~17 ms, at the highest OSR (98304) ~80 ms,
+// and up to 8 times that with the prescaler (see ADCProfile).
+#define STOP_TIMEOUT_MS 700
+
+// Settling time of a thermistor input after its MOSFET is switched on, with the
+// board's input filter. Half the dead time the conversions used to get between
+// them, which has been plenty.
+#define DEFAULT_SETTLE_US 500
+
+// Wait before retrying a conversion start that found another ADC's read on the
+// bus. A 4 byte ADCDATA read takes a few microseconds.
+#define BUS_RETRY_US 5
+
+// A running engine's next data-ready is due within the longest settling time (or
+// scan timer) and conversion time it can take, plus ACQ_IRQ_SLACK_US for the
+// readout and bus retries; past that it is late. An engine that has waited
+// ACQ_MISSED_DEADLINES deadlines has missed it (see acquisition_missed_engines()).
+// A data-ready sooner than a quarter of the shortest conversion is a duplicate
+// edge, and ignored.
+#define ACQ_IRQ_SLACK_US      1000
+#define ACQ_MISSED_DEADLINES  4
+
+/*
+Array representing 32 Mosfets
+mosfet[0] = header pin 0; mosfet Q1
+mosfet[1] = header pin 1; mosfet Q2
+...
+mosfet[31] = header pin 22; mosfet Q32
+The 8 and 16 channel boards are populated with the first MOSFETs of this layout.
+*/
+#if NUMBER_OF_THERMISTORS > 32
+    #error No MOSFET pin map for more than 32 thermistors: the 32 channel layout uses every free header pin.
+#endif
+static constexpr unsigned int mosfet_layout[32] = {0,1,2,3,4,5,6,7,8,9,24,25,26,27,28,29,30,31,
+                                  32,36,37,40,41,14,15,16,17,18,19,20,21,22};
+
+struct MosfetPins {
+    unsigned int pin[NUMBER_OF_THERMISTORS];
+    constexpr unsigned int operator[](int channel) const { return pin[channel]; }
+};
+
+constexpr MosfetPins make_mosfet_pins() {
+    MosfetPins pins = {};
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        pins.pin[channel] = mosfet_layout[channel];
+    }
+    return pins;
+}
+
+static constexpr MosfetPins mosfet = make_mosfet_pins();
+
+/*
+Fast GPIO port and bit of each Teensy 4.1 header pin used for a MOSFET, so a
+switch is a single store to the port's DR_SET, DR_CLEAR or DR_TOGGLE register
+instead of a digitalWrite() lookup. Checked against the core's pin map by
+acquisition_init(); digitalWrite() is used if they ever disagree.
+*/
+struct GpioPin {
+    uint32_t port;      // GPIO6..GPIO9 base address
+    uint32_t mask;
+};
+
+#define GPIO_DR_OFFSET          0x00
+#define GPIO_DR_SET_OFFSET      0x84
+#define GPIO_DR_CLEAR_OFFSET    0x88
+#define GPIO_DR_TOGGLE_OFFSET   0x8C
+
+constexpr GpioPin teensy41_gpio(unsigned int pin) {
+    // {GPIO port, bit} for header pins 0..41; pins not used for MOSFETs are {0, 0}
+    constexpr uint8_t map[42][2] = {
+        {6, 3},  {6, 2},  {9, 4},  {9, 5},  {9, 6},  {9, 8},  {7, 10}, {7, 17}, {7, 16}, {7, 11},
+        {0, 0},  {0, 0},  {0, 0},  {0, 0},  {6, 18}, {6, 19}, {6, 23}, {6, 22}, {6, 17}, {6, 16},
+        {6, 26}, {6, 27}, {6, 24}, {0, 0},  {6, 12}, {6, 13}, {6, 30}, {6, 31}, {8, 18}, {9, 31},
+        {8, 23}, {8, 22}, {7, 12}, {0, 0},  {0, 0},  {0, 0},  {7, 18}, {7, 19}, {0, 0},  {0, 0},
+        {6, 20}, {6, 21}
+    };
+    return GpioPin{map[pin][0] == 6 ? (uint32_t)IMXRT_GPIO6_ADDRESS :
+                   map[pin][0] == 7 ? (uint32_t)IMXRT_GPIO7_ADDRESS :
+                   map[pin][0] == 8 ? (uint32_t)IMXRT_GPIO8_ADDRESS :
+                   map[pin][0] == 9 ? (uint32_t)IMXRT_GPIO9_ADDRESS : 0,
+                   (uint32_t)1 << map[pin][1]};
+}
+
+struct MosfetTable {
+    GpioPin pin[NUMBER_OF_THERMISTORS];
+};
+
+constexpr MosfetTable make_mosfet_table() {
+    MosfetTable table = {};
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        table.pin[channel] = teensy41_gpio(mosfet[channel]);
+    }
+    return table;
+}
+
+static constexpr MosfetTable mosfet_gpio = make_mosfet_table();
+static bool m_fast_gpio = false;    // mosfet_gpio matches the core's pin map
+
+static inline volatile uint32_t *gpio_register(uint32_t port, uint32_t offset) {
+    return (volatile uint32_t *)(uintptr_t)(port + offset);
+}
+
+// Scan engine states
+enum AcquisitionState {
+    ACQ_IDLE,       // No conversion in progress, interrupts go to the polling flag
+    ACQ_ARMED,      // First MOSFETs on, waiting for acquisition_fire_passes()
+    ACQ_RUNNING,    // Scanning; each interrupt advances to the next slot
+    ACQ_STOPPING    // Finish the conversion in progress, then go idle
+};
+
+// A conversion slot of a compiled scan list, and the samples it dwells for
+struct ScanStep {
+    uint8_t slot;
+    uint8_t samples;
+};
+
+/*
+One scan engine per ADC, cycling through the thermistors wired to that ADC. The
+first engine with an enabled thermistor also converts the ADC internal
+temperature at the end of its passes; the others end theirs on their last
+thermistor. Everything but the pass bookkeeping is only touched from the
+interrupts, which don't preempt each other.
+*/
+struct ScanEngine {
+    Mcp3561 *adc;
+    ChannelMask channels;               // Thermistors on this ADC's input
+    volatile AcquisitionState state;
+    volatile int slot;                  // Slot currently being converted
+    volatile unsigned int passes_left;  // Passes until the engine stops, 0 = no limit
+    bool temp;                          // Converts ADC_TEMP_SLOT at the end of its passes
+    bool temp_pass;                     // Converts it at the end of the pass being scanned
+
+    // Thermistors in the pass being scanned
+    ChannelMask scan_mask;
+    int first_slot;                     // First slot of a pass
+    uint8_t last_index;                 // Position in the pass of the last thermistor
+    // The scan list's steps for this engine's thermistors, ending with
+    // ADC_TEMP_SLOT and SLOTS_PER_PASS; only walked while m_list_active
+    ScanStep steps[MAX_SCAN_STEPS + 2];
+    const ScanStep *step;               // Step being converted
+    ChannelMask steps_skip;             // Skip mask the steps were compiled for
+    volatile uint8_t index;             // Position in the pass of the slot being converted
+    volatile uint8_t repeat;            // Samples of that slot already taken
+    volatile int read_slot;             // Slot of the sample being read out
+    volatile uint8_t read_index;        // Its position in the pass
+    volatile bool read_last;            // It is the last sample of its pass
+    volatile uint32_t switch_cycles;    // ARM_DWT_CYCCNT when the MOSFETs last switched
+    volatile uint32_t wait_cycles;      // ARM_DWT_CYCCNT when it started waiting for the next data-ready
+#ifdef USE_ADC_SCAN_MODE
+    bool scan_temp;                     // The Scan register includes the internal temperature
+#else
+    IntervalTimer settle_timer;         // Starts a conversion once its slot has settled
+    volatile uint32_t settle_due;       // ARM_DWT_CYCCNT when it is due to fire
+    bool continuous;                    // The ADC is in continuous conversion mode
+#ifdef USE_ADC_AUTO_RANGE
+    volatile uint8_t gain_shift;        // PGA gain set for the conversion in progress
+#endif
+#ifdef USE_REF_TRACKING
+    unsigned int ref_passes;            // Passes started since the reference input was last converted
+    volatile uint32_t ref_code;         // Its last conversion, 0 until there is one
+#endif
+#endif
+};
+
+static ScanEngine m_engine[NUM_ADCS];
+#ifndef USE_ADC_SCAN_MODE
+static void start_settled_conversion(ScanEngine *engine);
+#endif
+
+// Engines with an enabled thermistor; only these run. Only changed while idle.
+static uint32_t m_active_engines = 1;
+
+// Enabled thermistors; disabled ones are skipped by the scan. Only changed while
+// the engine is idle.
+static ChannelMask m_channel_mask = ALL_CHANNELS_MASK;
+// Enabled thermistors left out of the scan for now (e.g. faulted ones). A change
+// is picked up by the engine at the start of the next pass.
+static volatile ChannelMask m_skip_mask = 0;
+// Enabled thermistors resting from excitation (see thermistorMux_selfheat.h):
+// left out of the passes, after the skip mask, unless that leaves none. A change
+// is picked up at the start of the next pass.
+static volatile ChannelMask m_rest_mask = 0;
+// Excitation of each thermistor: the cycles its MOSFET has been on, up to the
+// last switch off (mod 2^32), and while it is on, when it was switched on
+static volatile uint32_t m_excited_cycles[NUMBER_OF_THERMISTORS];
+static volatile uint32_t m_on_cycles[NUMBER_OF_THERMISTORS];
+static volatile bool m_excited[NUMBER_OF_THERMISTORS];
+// Thermistors a burst capture dwells on in place of the enabled ones, whatever
+// the skip mask and the adaptive schedule (see acquisition_set_burst_channels());
+// 0 while scanning normally. Only changed while idle.
+static ChannelMask m_burst_mask = 0;
+
+// Adaptive schedule: each thermistor is scanned every m_interval[n] passes,
+// m_countdown[n] passes from now. Passes with nothing due are skipped.
+static volatile uint8_t m_interval[NUMBER_OF_THERMISTORS];
+static uint8_t m_countdown[NUMBER_OF_THERMISTORS];
+static volatile bool m_adaptive = false;    // Some interval is above 1
+
+// Frame banks (see acquisition_set_frame_banks()): the thermistors of each, and
+// those of the bank the engines scan. Only changed while idle.
+static ChannelMask m_bank_channels[MAX_FRAME_BANKS] = {ALL_CHANNELS_MASK};
+static unsigned int m_frame_banks = 1;
+static ChannelMask m_bank_mask = ALL_CHANNELS_MASK;
+
+// Samples converted back to back on each slot per pass, averaged into the pass.
+// Only changed while idle.
+static unsigned int m_dwell_samples = 1;
+
+// Scan list (see acquisition_set_scan_list()): its entries, the conversion
+// slots of a pass they spread to, in order, and the thermistors they take. Only
+// changed while idle. The engines walk it in place of the enable mask while
+// m_list_active, which update_engines() works out.
+static ScanEntry m_scan_list[MAX_SCAN_ENTRIES];
+static ScanStep m_scan_steps[MAX_SCAN_STEPS];
+static unsigned int m_scan_step_count = 0;
+static ChannelMask m_list_mask = 0;
+static bool m_list_active = false;
+
+// The internal temperature is converted every m_temp_interval passes, the next
+// time in m_temp_countdown passes; the passes in between repeat the last code.
+// The die temperature changes over minutes, so a pass rarely needs a fresh one.
+static volatile unsigned int m_temp_interval = ADC_TEMP_INTERVAL_PASSES;
+static unsigned int m_temp_countdown = 0;
+
+#ifdef USE_REF_TRACKING
+// Each engine converts its ADC's reference input every m_ref_interval passes,
+// in ADC_REF_SLOT: between two passes, with the first thermistor of the next
+// already switched on to settle meanwhile. It isn't part of either pass.
+#define ADC_REF_SLOT  (SLOTS_PER_PASS + 1)
+static volatile unsigned int m_ref_interval = ADC_REF_INTERVAL_PASSES;
+#endif
+
+// Settling time after a MOSFET switch before a conversion, per slot. These cover
+// the input RC of the board; re-characterize them if the front end changes.
+static unsigned int m_settle_us[SLOTS_PER_PASS];
+
+// Data-ready deadlines in cycles (see ACQ_IRQ_SLACK_US), for the settling and
+// conversion times the engines were started with
+static uint32_t m_deadline_cycles = UINT32_MAX;
+static uint32_t m_missed_cycles = UINT32_MAX;
+static uint32_t m_duplicate_cycles = 0;
+
+// Pass being reassembled from the sample ring, loop() side only. Each engine's
+// passes are reassembled on their own; a pass is complete once every active
+// engine has completed one since the last.
+struct PassAssembly {
+    uint32_t data[SLOTS_PER_PASS];      // First or saturated sample; only the engine's own slots are used
+    int32_t sum[SLOTS_PER_PASS];        // Sign extended codes of the slot's dwell samples
+    uint8_t count[SLOTS_PER_PASS];      // Samples in sum, 0 once one is saturated
+    uint8_t next_index;                 // Position expected from the next sample
+    ChannelMask mask;                   // Thermistors in the pass so far
+};
+static PassAssembly m_assembly[NUM_ADCS];
+static uint32_t m_pass_data[SLOTS_PER_PASS];    // Channels not scanned are 0
+static ChannelMask m_pass_mask = 0;         // Thermistors in the completed engine passes
+static uint32_t m_engines_done = 0;         // Engines that have completed a pass into m_pass_data
+static uint64_t m_done_cycles = 0;          // Read time of the latest of those passes' last samples
+static ChannelMask m_pass_channels = 0;     // Thermistors in the last complete pass
+static uint64_t m_pass_cycles = 0;          // Read time of the pass's last sample
+static bool m_pass_temp = false;            // The internal temperature is in m_pass_data
+static uint32_t m_temp_code = 0x00800000;   // Last internal temperature code, saturated until one is read
+static unsigned long m_broken_passes = 0;   // Passes discarded after a dropped sample
+static SampleHook m_sample_hook = NULL;
+
+
+/*
+The ADC whose input a thermistor is wired to.
+*/
+int acquisition_adc_for_channel(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return 0;
+    }
+    return channel / CHANNELS_PER_ADC;
+}
+
+
+/*
+Samples the engine takes of the slot it is converting: the dwell samples, or
+those of its scan list step. In SCAN mode the internal temperature is converted
+once, in the same cycle as the last thermistor's last sample.
+*/
+static inline unsigned int slot_samples(const ScanEngine *engine) {
+#ifdef USE_ADC_SCAN_MODE
+    if (engine->slot == ADC_TEMP_SLOT) {
+        return 1;
+    }
+#endif
+#ifdef USE_REF_TRACKING
+    if (engine->slot == ADC_REF_SLOT) {
+        return 1;
+    }
+#endif
+    if (m_list_active) {
+        return engine->step->samples;
+    }
+    return m_dwell_samples;
+}
+
+
+/*
+First thermistor of the input group whose MOSFETs are on while the engine
+converts its current slot, -1 for none.
+*/
+static inline int switched_channel(const ScanEngine *engine) {
+    int slot = engine->slot;
+#ifdef USE_REF_TRACKING
+    if (slot == ADC_REF_SLOT) {
+        slot = engine->first_slot;
+    }
+#endif
+    return slot < NUMBER_OF_THERMISTORS ? CHANNEL_GROUP(slot) : -1;
+}
+
+
+/*
+Mask widened to whole input groups (see ADC_INPUT_PAIRS): a SCAN cycle converts
+every input of the group switched on, so a group is scanned if any of its
+thermistors is.
+*/
+static inline ChannelMask group_mask(ChannelMask mask) {
+#if ADC_INPUT_PAIRS > 1
+    ChannelMask groups = 0;
+    for (ChannelMask left = mask; left != 0; left &= left - 1) {
+        groups |= (CHANNEL_BIT(ADC_INPUT_PAIRS) - 1) << CHANNEL_GROUP(channel_mask_first(left));
+    }
+    return groups;
+#else
+    return mask;
+#endif
+}
+
+
+/*
+First slot from slot onwards that is scanned by engine: a thermistor in its scan
+mask, ADC_TEMP_SLOT if it converts the internal temperature, or SLOTS_PER_PASS
+past the end of the pass.
+*/
+static inline int scanned_slot_from(const ScanEngine *engine, int slot) {
+    while (slot < NUMBER_OF_THERMISTORS && !(engine->scan_mask & CHANNEL_BIT(slot))) {
+        slot++;
+    }
+    if (slot == ADC_TEMP_SLOT && !engine->temp_pass) {
+        slot = SLOTS_PER_PASS;
+    }
+    return slot;
+}
+
+
+/*
+Slot of the engine's next scan list step, moving on to it; as
+scanned_slot_from(), the internal temperature only on its passes.
+*/
+static inline int next_step_slot(ScanEngine *engine) {
+    int slot = (++engine->step)->slot;
+    if (slot == ADC_TEMP_SLOT && !engine->temp_pass) {
+        slot = SLOTS_PER_PASS;
+    }
+    return slot;
+}
+
+
+/*
+Thermistors from mask that are due in the next pass by the adaptive schedule,
+counting down the others.
+*/
+static ChannelMask scheduled_channels(ChannelMask mask) {
+    ChannelMask due = 0;
+    while (due == 0) {
+        for (ChannelMask left = mask; left != 0; left &= left - 1) {
+            int channel = channel_mask_first(left);
+            uint8_t interval = m_interval[channel];
+            if (m_countdown[channel] <= 1 || interval <= 1) {
+                due |= CHANNEL_BIT(channel);
+                m_countdown[channel] = interval;
+            }
+            else if (--m_countdown[channel] > interval) {
+                m_countdown[channel] = interval;
+            }
+        }
+    }
+    return due;
+}
+
+
+/*
+Thermistors the engines scan: the burst channels during a burst capture,
+otherwise the enabled ones, only those in the scan list if it has any, of the
+frame bank selected.
+*/
+static inline ChannelMask scanned_channel_mask() {
+    if (m_burst_mask != 0) {
+        return m_burst_mask;
+    }
+    ChannelMask listed = m_list_mask & m_channel_mask;
+    return (listed != 0 ? listed : m_channel_mask) & m_bank_mask;
+}
+
+
+/*
+Compiles the scan list's steps for an engine's enabled thermistors of the frame
+bank selected, leaving out
+those in skip unless that would leave none, then the internal temperature. Takes
+as long as the list, so it is only redone between passes when the skip mask has
+changed.
+*/
+static void compile_steps(ScanEngine *engine, ChannelMask skip) {
+    ChannelMask listed = m_list_mask & m_channel_mask & m_bank_mask & engine->channels;
+    ChannelMask mask = listed & ~skip;
+    if (mask == 0) {
+        mask = listed;
+    }
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < m_scan_step_count; i++) {
+        const ScanStep *step = &m_scan_steps[i];
+        if (mask & CHANNEL_BIT(step->slot)) {
+            engine->steps[count].slot = step->slot;
+            engine->steps[count].samples = step->samples != 0 ? step->samples : (uint8_t)m_dwell_samples;
+            count++;
+        }
+    }
+    engine->last_index = (uint8_t)(count - 1);
+    engine->steps[count].slot = ADC_TEMP_SLOT;
+    engine->steps[count].samples = (uint8_t)m_dwell_samples;
+    engine->steps[count + 1].slot = SLOTS_PER_PASS;
+    engine->steps[count + 1].samples = 0;
+    engine->steps_skip = skip;
+    engine->scan_mask = mask;
+}
+
+
+/*
+Works out an active engine's thermistors for the next pass from the enable,
+skip and rest masks and the adaptive schedule. If every enabled thermistor of
+the engine would be skipped they are all scanned instead, and if all of those
+are resting they are scanned anyway, so a pass always has at least one.
+A burst scans all of its channels on the engine every pass. A scan list is
+walked from its first step every pass instead, whatever the adaptive schedule.
+With several input pairs the mask is then widened to whole groups.
+*/
+static void update_scan_mask(ScanEngine *engine) {
+    engine->temp_pass = false;
+    if (engine->temp && (m_temp_countdown == 0 || --m_temp_countdown == 0)) {
+        engine->temp_pass = true;
+        m_temp_countdown = m_temp_interval;
+    }
+    if (m_list_active) {
+        ChannelMask skip = m_skip_mask | m_rest_mask;
+        if (skip != engine->steps_skip) {
+            compile_steps(engine, skip);
+        }
+        engine->step = engine->steps;
+        engine->first_slot = engine->steps[0].slot;
+        return;
+    }
+    ChannelMask enabled = scanned_channel_mask() & engine->channels;
+    ChannelMask mask = enabled;
+    if (m_burst_mask == 0) {
+        mask &= ~m_skip_mask;
+        if (mask == 0) {
+            mask = enabled;
+        }
+        if (mask & ~m_rest_mask) {
+            mask &= ~m_rest_mask;
+        }
+        if (m_adaptive) {
+            mask = scheduled_channels(mask);
+        }
+    }
+    mask = group_mask(mask);
+    engine->scan_mask = mask;
+    engine->first_slot = scanned_slot_from(engine, 0);
+    engine->last_index = (uint8_t)(channel_mask_count(mask) / ADC_INPUT_PAIRS - 1);
+}
+
+
+/*
+Works out the data-ready deadlines for the settling times and the ADCs'
+conversion times. Only called while idle.
+*/
+static void update_deadlines() {
+    unsigned int settle_us = 0;
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        if (m_settle_us[slot] > settle_us) {
+            settle_us = m_settle_us[slot];
+        }
+    }
+    uint32_t longest = 0;
+    uint32_t shortest = UINT32_MAX;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        Mcp3561 *device = m_engine[adc].adc;
+        uint32_t conversion = device->conversion_us(0);
+#ifdef USE_ADC_AUTO_RANGE
+        uint32_t fastest = device->conversion_us(AUTORANGE_MAX_OSR_STEPS);
+#else
+        uint32_t fastest = conversion;
+#endif
+        if (conversion > longest) {
+            longest = conversion;
+        }
+        if (fastest < shortest) {
+            shortest = fastest;
+        }
+    }
+    uint32_t cycles_per_us = F_CPU_ACTUAL / 1000000;
+    m_deadline_cycles = (settle_us + longest + ACQ_IRQ_SLACK_US) * cycles_per_us;
+    m_missed_cycles = ACQ_MISSED_DEADLINES * m_deadline_cycles;
+    m_duplicate_cycles = (shortest / 4) * cycles_per_us;
+}
+
+
+/*
+Works out which engines are active for the enable mask (or the scan list), which
+one converts the internal temperature, and their first passes. A burst leaves
+the internal temperature out, and the scan list. Only called while idle.
+*/
+static void update_engines() {
+    m_active_engines = 0;
+    m_list_active = m_burst_mask == 0 && (m_list_mask & m_channel_mask) != 0;
+    // The first pass after a start always converts it
+    m_temp_countdown = 0;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        engine->temp = false;
+        if (scanned_channel_mask() & engine->channels) {
+            engine->temp = m_active_engines == 0 && m_burst_mask == 0;
+            m_active_engines |= 1UL << adc;
+            if (m_list_active) {
+                compile_steps(engine, m_skip_mask);
+            }
+            update_scan_mask(engine);
+        }
+    }
+}
+
+
+#ifdef USE_ADC_SCAN_MODE
+/*
+True if the ADC's next conversion is the last thermistor's last sample of the
+pass, whose cycle also converts the internal temperature.
+*/
+static inline bool temp_next(const ScanEngine *engine) {
+    return engine->temp_pass && engine->index == engine->last_index &&
+           engine->repeat + 1u >= slot_samples(engine);
+}
+#else
+/*
+Readies the ADC for the engine's slot, in one SPI frame: its input, continuous
+mode if the slot takes several samples, so they follow each other without a
+restart, and one-shot mode otherwise, and the range it converts at.
+*/
+static void ready_slot(ScanEngine *engine) {
+    int slot = engine->slot;
+    ADCConversion conversion = {ADC_INPUT_THERMISTOR, ADC_ONE_SHOT, 0, 0};
+    if (slot == ADC_TEMP_SLOT) {
+        conversion.input = ADC_INPUT_INTERNAL_TEMP;
+    }
+#ifdef USE_REF_TRACKING
+    else if (slot == ADC_REF_SLOT) {
+        conversion.input = ADC_INPUT_REFERENCE;
+    }
+#endif
+    engine->continuous = slot_samples(engine) > 1;
+    if (engine->continuous) {
+        conversion.mode = ADC_CONTINUOUS;
+    }
+#ifdef USE_ADC_AUTO_RANGE
+    // The internal temperature conversion assumes the configured ratio and gain x1
+    if (slot < NUMBER_OF_THERMISTORS) {
+        AutoRange range = autorange_setting(slot);
+        conversion.osr_steps = range.osr_steps;
+        conversion.gain_shift = range.gain_shift;
+    }
+    engine->gain_shift = conversion.gain_shift;
+#endif
+    engine->adc->set_conversion(conversion);
+}
+
+
+#ifdef USE_REF_TRACKING
+/*
+Counts a pass started by the engine, true if its reference input is due to be
+converted before it.
+*/
+static inline bool reference_due(ScanEngine *engine) {
+    if (++engine->ref_passes < m_ref_interval) {
+        return false;
+    }
+    engine->ref_passes = 0;
+    return true;
+}
+#endif
+#endif
+
+
+/*
+Books a thermistor's excitation as its MOSFET switches on or off.
+*/
+static inline void excitation_on(int channel) {
+    if (!m_excited[channel]) {
+        m_on_cycles[channel] = ARM_DWT_CYCCNT;
+        m_excited[channel] = true;
+    }
+}
+
+
+static inline void excitation_off(int channel) {
+    if (m_excited[channel]) {
+        m_excited_cycles[channel] += ARM_DWT_CYCCNT - m_on_cycles[channel];
+        m_excited[channel] = false;
+    }
+}
+
+
+void mosfet_on(int channel) {
+    excitation_on(channel);
+    if (m_fast_gpio) {
+        *gpio_register(mosfet_gpio.pin[channel].port, GPIO_DR_SET_OFFSET) = mosfet_gpio.pin[channel].mask;
+        return;
+    }
+    digitalWrite(mosfet[channel], HIGH);
+}
+
+
+void mosfet_off(int channel) {
+    excitation_off(channel);
+    if (m_fast_gpio) {
+        *gpio_register(mosfet_gpio.pin[channel].port, GPIO_DR_CLEAR_OFFSET) = mosfet_gpio.pin[channel].mask;
+        return;
+    }
+    digitalWrite(mosfet[channel], LOW);
+}
+
+
+/*
+Turns channel from off and channel to on (either may be -1 for none). When both
+pins are on one port, a single DR_TOGGLE store switches them together.
+*/
+static inline void mosfet_switch(int from, int to) {
+    if (m_fast_gpio && from >= 0 && to >= 0 &&
+        mosfet_gpio.pin[from].port == mosfet_gpio.pin[to].port) {
+        excitation_off(from);
+        excitation_on(to);
+        *gpio_register(mosfet_gpio.pin[from].port, GPIO_DR_TOGGLE_OFFSET) =
+            mosfet_gpio.pin[from].mask | mosfet_gpio.pin[to].mask;
+        return;
+    }
+    if (from >= 0) {
+        mosfet_off(from);
+    }
+    if (to >= 0) {
+        mosfet_on(to);
+    }
+}
+
+
+/*
+As mosfet_on(), mosfet_off() and mosfet_switch(), for the whole input group from
+its first thermistor (see ADC_INPUT_PAIRS).
+*/
+static inline void group_on(int channel) {
+    for (int input = 0; input < ADC_INPUT_PAIRS; input++) {
+        mosfet_on(channel + input);
+    }
+}
+
+
+static inline void group_off(int channel) {
+    for (int input = 0; input < ADC_INPUT_PAIRS; input++) {
+        mosfet_off(channel + input);
+    }
+}
+
+
+static inline void group_switch(int from, int to) {
+    for (int input = 0; input < ADC_INPUT_PAIRS; input++) {
+        mosfet_switch(from >= 0 ? from + input : -1, to >= 0 ? to + input : -1);
+    }
+}
+
+
+/*
+MOSFET digital control I/O ports, set to output. All MOSFETS turned off (pins set to LOW).
+Also assigns the thermistors to the ADCs in blocks of CHANNELS_PER_ADC.
+*/
+FLASHMEM bool acquisition_init() {
+    bool fast_gpio = true;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        pinMode(mosfet[channel], OUTPUT);
+        mosfet_off(channel);
+        m_settle_us[channel] = DEFAULT_SETTLE_US;
+        const GpioPin *pin = &mosfet_gpio.pin[channel];
+        if (portOutputRegister(mosfet[channel]) != gpio_register(pin->port, GPIO_DR_OFFSET) ||
+            digitalPinToBitMask(mosfet[channel]) != pin->mask) {
+            fast_gpio = false;
+        }
+    }
+    m_fast_gpio = fast_gpio;
+    // No MOSFET to switch for the internal temperature
+    m_settle_us[ADC_TEMP_SLOT] = 0;
+#ifdef USE_ADC_AUTO_RANGE
+    autorange_reset();
+#endif
+
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        engine->adc = ADC_device(adc);
+        engine->channels = 0;
+        engine->state = ACQ_IDLE;
+#ifndef USE_ADC_SCAN_MODE
+        engine->settle_timer.priority(ACQUISITION_IRQ_PRIORITY);
+#endif
+#ifdef USE_REF_TRACKING
+        // Converted before the first pass
+        engine->ref_passes = MAX_REF_INTERVAL_PASSES;
+        engine->ref_code = 0;
+#endif
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        m_engine[acquisition_adc_for_channel(channel)].channels |= CHANNEL_BIT(channel);
+    }
+    update_engines();
+    return true;
+}
+
+
+/*
+Starts scanning from the first thermistor. Conversions then continue from the
+ADC interrupt until acquisition_stop() is called.
+*/
+void acquisition_start() {
+    acquisition_start_passes(0);
+}
+
+
+/*
+Starts every active engine from its first thermistor, each stopping by itself
+after passes full passes (0 for no limit).
+*/
+void acquisition_start_passes(unsigned int passes) {
+    acquisition_arm_passes(passes);
+    acquisition_fire_passes();
+}
+
+
+/*
+Readies every active engine for passes full passes (0 for no limit) from its first
+thermistor, switching its MOSFETs on so the slot settles, without starting any
+conversion; acquisition_fire_passes() starts them. The engines count as running
+from here, and acquisition_stop() disarms them.
+*/
+void acquisition_arm_passes(unsigned int passes) {
+    if (acquisition_running()) {
+        return;
+    }
+    // Samples from before a stop belong to an abandoned pass
+    sample_ring_clear();
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        m_assembly[adc].next_index = 0;
+        m_assembly[adc].mask = 0;
+    }
+    memset(m_pass_data, 0, sizeof(m_pass_data));
+    m_pass_mask = 0;
+    m_pass_temp = false;
+    m_engines_done = 0;
+    update_engines();
+    update_deadlines();
+
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        if (!(m_active_engines & (1UL << adc))) {
+            continue;
+        }
+        engine->passes_left = passes;
+        engine->index = 0;
+        engine->repeat = 0;
+        engine->slot = engine->first_slot;
+#ifndef USE_ADC_SCAN_MODE
+#ifdef USE_REF_TRACKING
+        // A frame of one pass never gets to a pass end to convert it at
+        if (reference_due(engine)) {
+            engine->slot = ADC_REF_SLOT;
+        }
+#endif
+        ready_slot(engine);
+#endif
+        group_on(engine->first_slot);
+        engine->switch_cycles = ARM_DWT_CYCCNT;
+        SCAN_TRACE(SCAN_TRACE_MOSFET_ON, adc, engine->first_slot);
+        engine->state = ACQ_ARMED;
+    }
+}
+
+
+/*
+Starts the conversions of the engines armed by acquisition_arm_passes(), once
+their first slots have had their settling time since the switch. Safe to call
+from an interrupt, so a timer can start a frame on time; does nothing unless
+armed.
+*/
+FASTRUN void acquisition_fire_passes() {
+#ifdef USE_ADC_SCAN_MODE
+    // Every first slot settles together, then the ADCs are started back to back
+    uint32_t settle_cycles = 0;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        if (engine->state == ACQ_ARMED) {
+            uint32_t settle = m_settle_us[engine->first_slot] * (F_CPU_ACTUAL / 1000000);
+            uint32_t elapsed = ARM_DWT_CYCCNT - engine->switch_cycles;
+            if (settle > elapsed && settle - elapsed > settle_cycles) {
+                settle_cycles = settle - elapsed;
+            }
+        }
+    }
+    uint32_t wait_start = ARM_DWT_CYCCNT;
+    while (ARM_DWT_CYCCNT - wait_start < settle_cycles) {
+    }
+#endif
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        if (engine->state != ACQ_ARMED) {
+            continue;
+        }
+        engine->state = ACQ_RUNNING;
+        engine->wait_cycles = ARM_DWT_CYCCNT;
+#ifdef USE_ADC_SCAN_MODE
+        // The ADC converts the internal temperature right after the last thermistor.
+        // The scan timer between cycles settles the slot switched to at data-ready,
+        // so it is the longest settling time of the engine's channels scanned. A
+        // single thermistor (or group) stays switched on, and without the internal
+        // temperature the Scan register is never rewritten between cycles, so then
+        // they can follow back to back.
+        unsigned int settle_us = engine->temp ? m_settle_us[ADC_TEMP_SLOT] : 0;
+        ChannelMask scanned = group_mask(scanned_channel_mask() & engine->channels);
+        bool back_to_back = channel_mask_count(scanned) == ADC_INPUT_PAIRS && !engine->temp;
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS && !back_to_back; channel++) {
+            if ((scanned & CHANNEL_BIT(channel)) && m_settle_us[channel] > settle_us) {
+                settle_us = m_settle_us[channel];
+            }
+        }
+        engine->scan_temp = temp_next(engine);
+        SCAN_TRACE(SCAN_TRACE_CONVERSION_START, adc, engine->slot);
+        engine->adc->start_scan(engine->scan_temp, settle_us);
+#else
+        start_settled_conversion(engine);
+#endif
+    }
+}
+
+
+/*
+Stops scanning once the conversions in progress have finished, leaving all
+MOSFETs off. Blocks for at most one conversion time.
+*/
+void acquisition_stop() {
+    // An armed engine has nothing to finish; disarm it before its timer can fire
+    __disable_irq();
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        if (engine->state == ACQ_RUNNING) {
+            engine->state = ACQ_STOPPING;
+        } else if (engine->state == ACQ_ARMED) {
+            group_off(engine->first_slot);
+            engine->state = ACQ_IDLE;
+        }
+    }
+    __enable_irq();
+    unsigned long start = millis();
+    while (acquisition_running() && (millis() - start) < STOP_TIMEOUT_MS) {
+        yield();
+    }
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        if (engine->state != ACQ_IDLE) {
+            // Data-ready never arrived; force the engine idle
+#ifndef USE_ADC_SCAN_MODE
+            engine->settle_timer.end();
+#endif
+            if (switched_channel(engine) >= 0) {
+                group_off(switched_channel(engine));
+            }
+            engine->state = ACQ_IDLE;
+        }
+#ifdef USE_ADC_SCAN_MODE
+        // Back to one-shot conversions on the thermistor input for the blocking routines
+        engine->adc->stop_scan();
+#else
+        // Leave the ADC in one-shot mode on the thermistor input for the blocking routines
+        engine->adc->standby();
+        ADCConversion conversion = {ADC_INPUT_THERMISTOR, ADC_ONE_SHOT, 0, 0};
+        engine->adc->set_conversion(conversion);
+        engine->continuous = false;
+#ifdef USE_ADC_AUTO_RANGE
+        engine->gain_shift = 0;
+#endif
+#endif
+    }
+}
+
+
+/*
+Engines (bit n for ADC n) that have been running ACQ_MISSED_DEADLINES data-ready
+deadlines without one: the interrupt was lost, or the ADC stopped converting,
+and the engine would wait for it forever. Each counts as a missed interrupt. The
+caller recovers them by stopping the scan and re-initializing the ADCs. An ADC
+past its deadline that a power-on reset shut down is put back in place first
+(see Mcp3561::restore_if_lost()), and its engine carries on waiting.
+*/
+uint32_t acquisition_missed_engines() {
+    uint32_t missed = 0;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ScanEngine *engine = &m_engine[adc];
+        // Read before the cycle counter, so a data-ready in between can't make it look ahead
+        uint32_t since = engine->wait_cycles;
+        uint32_t waited = ARM_DWT_CYCCNT - since;
+        if (engine->state == ACQ_RUNNING && waited > m_deadline_cycles && engine->adc->restore_if_lost()) {
+            engine->wait_cycles = ARM_DWT_CYCCNT;
+            continue;
+        }
+        if (engine->state == ACQ_RUNNING && waited > m_missed_cycles) {
+            missed |= 1UL << adc;
+            health_count(HEALTH_IRQ_MISSED);
+        }
+    }
+    return missed;
+}
+
+
+bool acquisition_running() {
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        if (m_engine[adc].state != ACQ_IDLE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+#ifndef USE_ADC_SCAN_MODE
+static void settle_done(ScanEngine *engine);
+
+// Settling timer handlers, one per engine
+template <int ADC>
+FASTRUN static void settle_isr() {
+    settle_done(&m_engine[ADC]);
+}
+
+static void (*const settle_handlers[MAX_ADCS])() = {settle_isr<0>, settle_isr<1>, settle_isr<2>, settle_isr<3>};
+
+
+FASTRUN static void start_settle_timer(ScanEngine *engine, unsigned int us) {
+    engine->settle_due = ARM_DWT_CYCCNT + us * (F_CPU_ACTUAL / 1000000);
+    engine->settle_timer.begin(settle_handlers[engine->adc->id()], us);
+}
+
+
+/*
+Starts the conversion of the slot the MOSFETs were switched to, once it has had
+its settling time, from the settling timer when it hasn't had it yet. While
+another ADC's read owns the bus the start is retried shortly after. How late the
+timer ran is noted as an interrupt latency.
+*/
+FASTRUN static void settle_done(ScanEngine *engine) {
+    engine->settle_timer.end();
+    uint32_t late = ARM_DWT_CYCCNT - engine->settle_due;
+    if (late < UINT32_MAX / 2) {
+        health_note_latency(late);
+    }
+    if (engine->state == ACQ_RUNNING) {
+        if (ADC_bus_busy()) {
+            start_settle_timer(engine, BUS_RETRY_US);
+            return;
+        }
+        SCAN_TRACE(SCAN_TRACE_CONVERSION_START, engine->adc->id(), engine->slot);
+        engine->adc->start_conversion();
+        return;
+    }
+    // Stopped while settling; no conversion to wait for
+    if (switched_channel(engine) >= 0) {
+        mosfet_off(switched_channel(engine));
+    }
+    engine->state = ACQ_IDLE;
+}
+
+
+FASTRUN static void start_settled_conversion(ScanEngine *engine) {
+    // The reference input has no MOSFET to settle
+    unsigned int settle_us = engine->slot < SLOTS_PER_PASS ? m_settle_us[engine->slot] : 0;
+    uint32_t settle = settle_us * (F_CPU_ACTUAL / 1000000);
+    uint32_t elapsed = ARM_DWT_CYCCNT - engine->switch_cycles;
+    if (elapsed >= settle) {
+        SCAN_TRACE(SCAN_TRACE_CONVERSION_START, engine->adc->id(), engine->slot);
+        engine->adc->start_conversion();
+        return;
+    }
+    start_settle_timer(engine, (settle - elapsed) / (F_CPU_ACTUAL / 1000000) + 1);
+}
+#endif
+
+
+/*
+Stores the sample read out for the conversion that raised the last data-ready,
+then readies the ADC for the slot the MOSFETs have already been switched to.
+
+In SCAN mode the ADC runs continuous cycles and the next one starts on its own
+after the scan timer, which is the settling time. The Scan register adds the
+internal temperature to the cycle of the last thermistor of a pass. Otherwise
+the next conversion is started once the new slot has settled: in continuous mode
+if the slot dwells for several samples, which then need no restarts, in one-shot
+mode if it takes one.
+*/
+FASTRUN static void acquisition_store(Mcp3561 *adc, uint32_t raw_data) {
+    ScanEngine *engine = &m_engine[adc->id()];
+    SCAN_TRACE(SCAN_TRACE_READOUT_DONE, adc->id(), engine->read_slot);
+    bool reference = false;
+#ifdef USE_REF_TRACKING
+    // Kept for the conversions, not part of a pass
+    reference = engine->read_slot == ADC_REF_SLOT;
+    if (reference) {
+        engine->ref_code = raw_data;
+    }
+#endif
+    if (!reference) {
+        ADCSample sample;
+#ifdef USE_ADC_AUTO_RANGE
+        // Codes leave the engine at gain x1, whatever the slot was converted at
+        sample.raw_data = autorange_normalize(raw_data, engine->gain_shift);
+#else
+        sample.raw_data = raw_data;
+#endif
+        sample.cycles = time_cycles64();
+        sample.channel = engine->read_slot;
+        sample.index = engine->read_index;
+        sample.adc = adc->id();
+        sample.last = engine->read_last;
+        sample_ring_push(&sample);
+    }
+    health_count(HEALTH_CONVERSIONS);
+
+    if (engine->state == ACQ_STOPPING) {
+        // Stopped within a slot's dwell or a group's cycle, with its MOSFETs still on
+        if (switched_channel(engine) >= 0) {
+            group_off(switched_channel(engine));
+        }
+#ifdef USE_ADC_SCAN_MODE
+        adc->stop_scan();
+#else
+        if (engine->continuous) {
+            adc->standby();
+        }
+#endif
+        engine->state = ACQ_IDLE;
+        return;
+    }
+
+#ifdef USE_ADC_SCAN_MODE
+    // The next cycle converts slot; left alone while the internal temperature
+    // is still to come in this one
+    int slot = engine->slot;
+    bool include_temp = temp_next(engine);
+    if (slot != ADC_TEMP_SLOT && include_temp != engine->scan_temp) {
+        adc->set_scan_list(include_temp);
+        engine->scan_temp = include_temp;
+    }
+#else
+    if (engine->repeat > 0) {
+        // Dwelling in continuous mode; the ADC is already converting the next sample
+        return;
+    }
+    if (engine->continuous) {
+        // The dwell has ended; stop the conversion the ADC went on to
+        adc->standby();
+    }
+    ready_slot(engine);
+    start_settled_conversion(engine);
+#endif
+}
+
+
+/*
+Reads out the conversion that raised data-ready. With USE_SPI_DMA the read is
+handed to DMA (queued behind another ADC's read if that owns the bus) and stored
+from the DMA completion interrupt; otherwise it is read and stored here.
+*/
+static inline void read_sample(ScanEngine *engine) {
+#ifdef USE_SPI_DMA
+    if (engine->adc->read_async(acquisition_store)) {
+        return;
+    }
+    if (engine->adc->async_busy()) {
+        // The last read is still in flight, so this conversion is lost; the pass
+        // is discarded on reassembly and the ADC is readied when that read completes
+        return;
+    }
+    // DMA couldn't be started - fall back to a blocking read
+#endif
+    acquisition_store(engine->adc, engine->adc->read_raw());
+}
+
+
+/*
+Called from the data-ready interrupt of ADC adc while the engine is running. The
+result is latched in ADCDATA until read, so the MOSFETs are switched to the next
+slot first and its settling runs during the readout; a slot that dwells for
+several samples stays switched on until its last.
+
+The thermistors for the next pass (skip mask and adaptive schedule) are worked
+out between passes, once the last slot of the pass has been converted. A
+data-ready is counted late past its deadline, and one with no conversion to read
+is counted and ignored (see ACQ_IRQ_SLACK_US).
+*/
+FASTRUN void acquisition_isr(int adc) {
+    ScanEngine *engine = &m_engine[adc];
+    if (engine->state == ACQ_IDLE) {
+        return;
+    }
+    if (engine->state == ACQ_ARMED) {
+        // No conversion has been started yet
+        health_count(HEALTH_IRQ_DUPLICATES);
+        return;
+    }
+    uint32_t now = ARM_DWT_CYCCNT;
+    uint32_t waited = now - engine->wait_cycles;
+    if (waited < m_duplicate_cycles) {
+        // A second edge for the conversion already read; advancing on it would
+        // put every later sample in the wrong slot
+        health_count(HEALTH_IRQ_DUPLICATES);
+        return;
+    }
+    if (waited > m_deadline_cycles) {
+        health_count(HEALTH_IRQ_LATE);
+    }
+    engine->wait_cycles = now;
+    int slot = engine->slot;
+    SCAN_TRACE(SCAN_TRACE_DATA_READY, adc, slot);
+    engine->read_slot = slot;
+    engine->read_index = engine->index;
+    engine->read_last = false;
+#ifdef USE_REF_TRACKING
+    if (slot == ADC_REF_SLOT) {
+        // The next pass starts on the thermistor already switched on
+        engine->slot = engine->first_slot;
+        if (engine->state == ACQ_STOPPING) {
+            mosfet_off(engine->first_slot);
+        }
+        read_sample(engine);
+        return;
+    }
+#endif
+#if ADC_INPUT_PAIRS > 1
+    if (slot < NUMBER_OF_THERMISTORS && CHANNEL_GROUP(slot + 1) == CHANNEL_GROUP(slot)) {
+        // The group's next input, converted in the same SCAN cycle
+        engine->slot = slot + 1;
+        read_sample(engine);
+        return;
+    }
+#endif
+    if (++engine->repeat < slot_samples(engine)) {
+        // Dwelling; the next cycle converts the same slot (or group), so nothing to switch
+        engine->slot = slot < NUMBER_OF_THERMISTORS ? CHANNEL_GROUP(slot) : slot;
+        read_sample(engine);
+        return;
+    }
+    engine->repeat = 0;
+    engine->index++;
+
+    int next = m_list_active ? next_step_slot(engine) : scanned_slot_from(engine, slot + 1);
+    if (next == SLOTS_PER_PASS) {
+        update_scan_mask(engine);
+        next = engine->first_slot;
+        engine->index = 0;
+        engine->read_last = true;
+        if (engine->passes_left != 0 && --engine->passes_left == 0) {
+            engine->state = ACQ_STOPPING;
+        }
+    }
+    bool stopping = engine->state == ACQ_STOPPING;
+    int group = slot < NUMBER_OF_THERMISTORS ? CHANNEL_GROUP(slot) : slot;
+    int off = group < NUMBER_OF_THERMISTORS && (group != next || stopping) ? group : -1;
+    int on = next < NUMBER_OF_THERMISTORS && next != group && !stopping ? next : -1;
+    group_switch(off, on);
+    if (on >= 0) {
+        engine->switch_cycles = ARM_DWT_CYCCNT;
+        SCAN_TRACE(SCAN_TRACE_MOSFET_ON, adc, on);
+    }
+#ifdef USE_REF_TRACKING
+    if (engine->read_last && !stopping && reference_due(engine)) {
+        next = ADC_REF_SLOT;
+    }
+#endif
+    engine->slot = next;
+    read_sample(engine);
+}
+
+
+/*
+Adds a sample to the average of its slot's dwell samples, starting the average
+with the slot's first sample. A saturated sample replaces the average, so the
+pass still shows the fault.
+*/
+static void add_dwell_sample(PassAssembly *assembly, const ADCSample *sample, bool first) {
+    int slot = sample->channel;
+    uint32_t code = sample->raw_data & 0x00FFFFFF;
+    if (first) {
+        assembly->data[slot] = sample->raw_data;
+        assembly->sum[slot] = 0;
+        assembly->count[slot] = 0;
+    }
+    else if (assembly->count[slot] == 0) {
+        return;     // Already saturated
+    }
+    if (code == 0x007FFFFF || code == 0x00800000) {
+        health_count(HEALTH_INVALID_DATA);
+        assembly->data[slot] = sample->raw_data;
+        assembly->count[slot] = 0;
+        return;
+    }
+    assembly->sum[slot] += ((int32_t)(code << 8)) >> 8;
+    assembly->count[slot]++;
+}
+
+
+/*
+Raw ADCDATA for a slot of an engine pass: the mean code of its dwell samples.
+*/
+static uint32_t dwell_code(const PassAssembly *assembly, int slot) {
+    if (assembly->count[slot] <= 1) {
+        return assembly->data[slot];
+    }
+    return (uint32_t)(assembly->sum[slot] / assembly->count[slot]) & 0x00FFFFFF;
+}
+
+
+/*
+Drains the sample ring and copies the next complete pass (SLOTS_PER_PASS raw
+ADCDATA values, 0 for channels not scanned, each slot's dwell samples averaged)
+into raw_data. If cycles isn't NULL it is set to the time_cycles64()
+stamp of the pass's last sample. Returns false if no pass has completed yet; any
+partial pass is kept for the next call. An engine pass with a gap (samples
+dropped while the ring was full, or the engine restarted) is discarded, and the
+pass waits for that engine's next one.
+
+With several ADCs an engine may complete a second pass while another is still
+on its first; the newer data then replaces the older in the complete pass.
+*/
+bool acquisition_get_pass(uint32_t *raw_data, uint64_t *cycles) {
+    ADCSample sample;
+    while (sample_ring_pop(&sample)) {
+        if (m_sample_hook != NULL) {
+            m_sample_hook(&sample);
+        }
+#ifdef USE_ADC_AUTO_RANGE
+        if (sample.channel < NUMBER_OF_THERMISTORS) {
+            autorange_update(sample.channel, sample.raw_data);
+        }
+#endif
+        PassAssembly *assembly = &m_assembly[sample.adc];
+        // A group's inputs that are only converted with it (see group_mask()) just
+        // keep their place in the pass
+        bool kept = sample.channel >= NUMBER_OF_THERMISTORS ||
+                    (scanned_channel_mask() & CHANNEL_BIT(sample.channel));
+        if (assembly->next_index != 0 && sample.index + 1 == assembly->next_index) {
+            // Another dwell sample of the slot just started, or another input of its group
+            if (kept) {
+                bool first = sample.channel < NUMBER_OF_THERMISTORS && !(assembly->mask & CHANNEL_BIT(sample.channel));
+                add_dwell_sample(assembly, &sample, first);
+                if (sample.channel < NUMBER_OF_THERMISTORS) {
+                    assembly->mask |= CHANNEL_BIT(sample.channel);
+                }
+            }
+        }
+        else if (sample.index != assembly->next_index) {
+            if (assembly->next_index != 0) {
+                m_broken_passes++;
+            }
+            assembly->next_index = 0;
+            assembly->mask = 0;
+            if (sample.index != 0) {
+                continue;   // Resynchronize on the start of the engine's next pass
+            }
+        }
+        if (sample.index == assembly->next_index) {
+            // A thermistor the scan list converts again adds to its first average
+            bool first = sample.channel >= NUMBER_OF_THERMISTORS || !(assembly->mask & CHANNEL_BIT(sample.channel));
+            if (kept) {
+                add_dwell_sample(assembly, &sample, first);
+            }
+            assembly->next_index++;
+            if (sample.channel < NUMBER_OF_THERMISTORS && kept) {
+                assembly->mask |= CHANNEL_BIT(sample.channel);
+            }
+        }
+        if (!sample.last) {
+            continue;
+        }
+
+        // Engine pass complete; fold it into the pass
+        for (ChannelMask left = assembly->mask; left != 0; left &= left - 1) {
+            int channel = channel_mask_first(left);
+            m_pass_data[channel] = dwell_code(assembly, channel);
+        }
+        if (sample.channel == ADC_TEMP_SLOT) {
+            m_pass_data[ADC_TEMP_SLOT] = dwell_code(assembly, ADC_TEMP_SLOT);
+            m_pass_temp = true;
+        }
+        m_pass_mask |= assembly->mask;
+        assembly->next_index = 0;
+        assembly->mask = 0;
+        m_engines_done |= 1UL << sample.adc;
+        if (sample.cycles > m_done_cycles) {
+            m_done_cycles = sample.cycles;
+        }
+        if ((m_engines_done & m_active_engines) != m_active_engines) {
+            continue;
+        }
+
+        m_pass_channels = m_pass_mask;
+        m_pass_cycles = m_done_cycles;
+        if (m_pass_temp) {
+            m_temp_code = m_pass_data[ADC_TEMP_SLOT];
+        }
+        else {
+            m_pass_data[ADC_TEMP_SLOT] = m_temp_code;
+        }
+        memcpy(raw_data, m_pass_data, sizeof(m_pass_data));
+        if (cycles != NULL) {
+            *cycles = m_pass_cycles;
+        }
+        memset(m_pass_data, 0, sizeof(m_pass_data));
+        m_pass_mask = 0;
+        m_pass_temp = false;
+        m_engines_done = 0;
+        m_done_cycles = 0;
+        return true;
+    }
+    return false;
+}
+
+
+/*
+Samples lost because loop() fell behind and the sample ring was full.
+*/
+unsigned long acquisition_overruns() {
+    return sample_ring_dropped();
+}
+
+
+unsigned long acquisition_broken_passes() {
+    return m_broken_passes;
+}
+
+
+/*
+Sets a function to be called with every sample acquisition_get_pass() takes from
+the sample ring, including those of discarded passes. NULL for none.
+*/
+void acquisition_set_sample_hook(SampleHook hook) {
+    m_sample_hook = hook;
+}
+
+
+/*
+Sets which thermistors are scanned, bit n for thermistor n; the ADC internal
+temperature is always scanned, at its own interval. Fewer channels give
+proportionally faster passes.
+Returns false if the engine is running or no thermistor is enabled.
+*/
+bool acquisition_set_channel_mask(ChannelMask mask) {
+    mask &= ALL_CHANNELS_MASK;
+    if (acquisition_running() || mask == 0) {
+        return false;
+    }
+    m_channel_mask = mask;
+    update_engines();
+    return true;
+}
+
+
+ChannelMask acquisition_channel_mask() {
+    return m_channel_mask;
+}
+
+
+/*
+Has the engines dwell on the thermistors in mask alone for a burst capture,
+every one of them every pass, skipped or not, and without the internal
+temperature, from the next start; 0 goes back
+to the enabled thermistors. The channel mask itself, which the payloads follow,
+is left alone. Returns false if the engine is running.
+*/
+bool acquisition_set_burst_channels(ChannelMask mask) {
+    if (acquisition_running()) {
+        return false;
+    }
+    m_burst_mask = mask & ALL_CHANNELS_MASK;
+    update_engines();
+    return true;
+}
+
+
+ChannelMask acquisition_burst_channels() {
+    return m_burst_mask;
+}
+
+
+bool acquisition_channel_enabled(int channel) {
+    return channel >= 0 && channel < NUMBER_OF_THERMISTORS && (m_channel_mask & CHANNEL_BIT(channel));
+}
+
+
+/*
+Sets which enabled thermistors to leave out of the scan for now, bit n for
+thermistor n. Safe while the engine is running; the change takes effect from
+the next pass. Skipping every enabled thermistor of an ADC scans them all.
+*/
+void acquisition_set_skip_mask(ChannelMask mask) {
+#if NUMBER_OF_THERMISTORS > 32
+    // Two words, which the ISR mustn't see half written
+    noInterrupts();
+    m_skip_mask = mask & ALL_CHANNELS_MASK;
+    interrupts();
+#else
+    m_skip_mask = mask & ALL_CHANNELS_MASK;
+#endif
+}
+
+
+/*
+Sets which enabled thermistors rest from excitation, bit n for thermistor n.
+Safe while the engine is running; the change takes effect from the next pass.
+An ADC whose thermistors are all resting or skipped scans them anyway (see
+acquisition_resting()).
+*/
+void acquisition_set_rest_mask(ChannelMask mask) {
+#if NUMBER_OF_THERMISTORS > 32
+    noInterrupts();
+    m_rest_mask = mask & ALL_CHANNELS_MASK;
+    interrupts();
+#else
+    m_rest_mask = mask & ALL_CHANNELS_MASK;
+#endif
+}
+
+
+/*
+True if the rest mask takes every thermistor an ADC would scan, which it then
+scans anyway: only holding the scan keeps them resting. A burst doesn't rest.
+*/
+bool acquisition_resting() {
+    ChannelMask rest = m_rest_mask;
+    if (rest == 0 || m_burst_mask != 0) {
+        return false;
+    }
+    ChannelMask scanned = scanned_channel_mask();
+    ChannelMask skip = m_skip_mask;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ChannelMask channels = scanned & m_engine[adc].channels;
+        ChannelMask left = channels & ~skip;
+        if (left == 0) {
+            left = channels;
+        }
+        if (left != 0 && (left & ~rest) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+Cycles thermistor channel's MOSFET has been on since start-up, mod 2^32, up to
+now. Two readings under a cycle counter wrap (~7 s) apart give the excitation
+between them.
+*/
+uint32_t acquisition_excitation_cycles(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return 0;
+    }
+    noInterrupts();
+    uint32_t cycles = m_excited_cycles[channel];
+    if (m_excited[channel]) {
+        cycles += ARM_DWT_CYCCNT - m_on_cycles[channel];
+    }
+    interrupts();
+    return cycles;
+}
+
+
+/*
+Thermistors that were scanned in the pass last returned by acquisition_get_pass().
+*/
+ChannelMask acquisition_pass_channels() {
+    return m_pass_channels;
+}
+
+
+/*
+Sets the adaptive schedule: thermistor n is scanned every intervals[n] passes
+(1..255; 0 is taken as 1). Channels whose interval changes are spread over the
+passes of their new interval, so quiet channels don't all come due together.
+Safe while the engine is running.
+*/
+void acquisition_set_channel_intervals(const uint8_t *intervals) {
+    bool adaptive = false;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        uint8_t interval = intervals[channel] > 1 ? intervals[channel] : 1;
+        if (interval != m_interval[channel]) {
+            m_interval[channel] = interval;
+            m_countdown[channel] = 1 + (channel % interval);
+        }
+        adaptive |= interval > 1;
+    }
+    m_adaptive = adaptive;
+}
+
+
+/*
+Passes between scans of a thermistor under the adaptive schedule; 1 is every pass.
+*/
+unsigned int acquisition_channel_interval(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS || m_interval[channel] == 0) {
+        return 1;
+    }
+    return m_interval[channel];
+}
+
+
+/*
+Splits each frame into banks (1 to MAX_FRAME_BANKS; 1 for whole frames), which
+are scanned one at a time, so each bank's part of a frame is taken in a fraction
+of the frame's time. A bank takes an equal share of every ADC's thermistors, in
+order, so every engine keeps converting and a bank's passes are shorter in
+proportion. Selects the first bank. Returns false if the engine is running, or
+an ADC's input groups don't divide among the banks.
+*/
+bool acquisition_set_frame_banks(unsigned int banks) {
+    if (acquisition_running() || banks < 1 || banks > MAX_FRAME_BANKS) {
+        return false;
+    }
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        if ((channel_mask_count(m_engine[adc].channels) / ADC_INPUT_PAIRS) % banks != 0) {
+            return false;
+        }
+    }
+    memset(m_bank_channels, 0, sizeof(m_bank_channels));
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        ChannelMask channels = m_engine[adc].channels;
+        unsigned int share = channel_mask_count(channels) / banks;
+        unsigned int position = 0;
+        for (ChannelMask left = channels; left != 0; left &= left - 1, position++) {
+            m_bank_channels[position / share] |= CHANNEL_BIT(channel_mask_first(left));
+        }
+    }
+    m_frame_banks = banks;
+    m_bank_mask = m_bank_channels[0];
+    update_engines();
+    return true;
+}
+
+
+unsigned int acquisition_frame_banks() {
+    return m_frame_banks;
+}
+
+
+/*
+The thermistors of frame bank bank the engines scan: the enabled ones, only
+those in the scan list if it has any. 0 past the last bank, or for a bank with
+none to scan.
+*/
+ChannelMask acquisition_bank_channels(unsigned int bank) {
+    if (bank >= m_frame_banks) {
+        return 0;
+    }
+    ChannelMask listed = m_list_mask & m_channel_mask;
+    return (listed != 0 ? listed : m_channel_mask) & m_bank_channels[bank];
+}
+
+
+/*
+Has the engines scan frame bank bank from the next start. Returns false if the
+engine is running, or the bank has no thermistor to scan.
+*/
+bool acquisition_select_bank(unsigned int bank) {
+    if (acquisition_running() || acquisition_bank_channels(bank) == 0) {
+        return false;
+    }
+    m_bank_mask = m_bank_channels[bank];
+    update_engines();
+    return true;
+}
+
+
+/*
+Sets the samples converted back to back on each slot per pass (1 to
+MAX_DWELL_SAMPLES), averaged into the pass. Several cost one MOSFET switch and
+settling time per slot instead of one per sample; outside SCAN mode they are
+converted in continuous mode, without a restart for each. Returns false if the
+engine is running or samples is out of range.
+*/
+bool acquisition_set_dwell_samples(unsigned int samples) {
+    if (acquisition_running() || samples < 1 || samples > MAX_DWELL_SAMPLES) {
+        return false;
+    }
+    m_dwell_samples = samples;
+    return true;
+}
+
+
+unsigned int acquisition_dwell_samples() {
+    return m_dwell_samples;
+}
+
+
+/*
+Sets how often the ADC internal temperature is converted, every passes passes
+(1 to MAX_TEMP_INTERVAL_PASSES); passes without a conversion carry the last
+one's code. Safe while the engine is running; the change takes effect from the
+next conversion of it. Returns false if passes is out of range.
+*/
+bool acquisition_set_temp_interval(unsigned int passes) {
+    if (passes < 1 || passes > MAX_TEMP_INTERVAL_PASSES) {
+        return false;
+    }
+    m_temp_interval = passes;
+    return true;
+}
+
+
+unsigned int acquisition_temp_interval() {
+    return m_temp_interval;
+}
+
+
+#ifdef USE_REF_TRACKING
+/*
+Sets how often each ADC's reference input is converted, before every passes
+passes (1 to MAX_REF_INTERVAL_PASSES). Safe while the engine is running; the
+change takes effect from the next conversion of it. Returns false if passes is
+out of range.
+*/
+bool acquisition_set_ref_interval(unsigned int passes) {
+    if (passes < 1 || passes > MAX_REF_INTERVAL_PASSES) {
+        return false;
+    }
+    m_ref_interval = passes;
+    return true;
+}
+
+
+unsigned int acquisition_ref_interval() {
+    return m_ref_interval;
+}
+
+
+/*
+Raw ADCDATA of the last conversion of ADC adc's reference input, at gain x1/3;
+0 until one has been read (see set_ADC_reference_code()).
+*/
+uint32_t acquisition_reference_code(int adc) {
+    if (adc < 0 || adc >= NUM_ADCS) {
+        return 0;
+    }
+    return m_engine[adc].ref_code;
+}
+#endif
+
+
+/*
+Sets the scan list: the thermistors the engines convert each pass, in the order
+given, in place of every enabled thermistor in index order. An entry takes
+repeat slots of the pass, spread evenly over it (smooth weighted round robin,
+the earlier entry first where two are due together), each dwelling for its
+samples; a thermistor's samples in a pass are averaged together, however many
+slots and entries it has. Each ADC's engine walks the slots of its own
+thermistors, leaving out disabled ones, and skipped ones unless that leaves
+none. The temperature, reference and burst handling are as without a list; the
+adaptive schedule is not applied. The list is compiled here into a flat table of
+slots, so the interrupt only steps through it. NULL or an empty list (see
+ScanEntry) goes back to the enable mask, as does a list with no enabled
+thermistor. Returns false, changing nothing, if the engine is running or an
+entry is out of range, or the list takes more than MAX_SCAN_STEPS slots or
+MAX_SCAN_CHANNEL_SAMPLES samples of a thermistor (counting dwell samples of 0 as
+MAX_DWELL_SAMPLES). With several input pairs (see ADC_INPUT_PAIRS) only an empty
+list is taken.
+*/
+bool acquisition_set_scan_list(const ScanEntry *list) {
+    if (acquisition_running()) {
+        return false;
+    }
+#if ADC_INPUT_PAIRS > 1
+    // A group's inputs are converted together, in the ADC's order
+    if (list != NULL && list[0].repeat != 0) {
+        return false;
+    }
+#endif
+    unsigned int entries = 0;
+    unsigned int steps = 0;
+    unsigned int samples[NUMBER_OF_THERMISTORS] = {};
+    while (list != NULL && entries < MAX_SCAN_ENTRIES && list[entries].repeat != 0) {
+        const ScanEntry *entry = &list[entries];
+        if (entry->channel >= NUMBER_OF_THERMISTORS || entry->repeat > MAX_SCAN_REPEAT ||
+            entry->samples > MAX_DWELL_SAMPLES) {
+            return false;
+        }
+        steps += entry->repeat;
+        samples[entry->channel] += entry->repeat * (entry->samples != 0 ? entry->samples : MAX_DWELL_SAMPLES);
+        if (steps > MAX_SCAN_STEPS || samples[entry->channel] > MAX_SCAN_CHANNEL_SAMPLES) {
+            return false;
+        }
+        entries++;
+    }
+
+    memset(m_scan_list, 0, sizeof(m_scan_list));
+    m_list_mask = 0;
+    int credit[MAX_SCAN_ENTRIES] = {};
+    for (unsigned int i = 0; i < entries; i++) {
+        m_scan_list[i] = list[i];
+        m_list_mask |= CHANNEL_BIT(list[i].channel);
+    }
+    for (unsigned int step = 0; step < steps; step++) {
+        unsigned int due = 0;
+        for (unsigned int i = 0; i < entries; i++) {
+            credit[i] += m_scan_list[i].repeat;
+            if (credit[i] > credit[due]) {
+                due = i;
+            }
+        }
+        credit[due] -= (int)steps;
+        m_scan_steps[step].slot = m_scan_list[due].channel;
+        m_scan_steps[step].samples = m_scan_list[due].samples;
+    }
+    m_scan_step_count = steps;
+    update_engines();
+    return true;
+}
+
+
+/*
+Copies the scan list in use into list, MAX_SCAN_ENTRIES entries, ended by one
+with a repeat of 0 if shorter.
+*/
+void acquisition_scan_list(ScanEntry *list) {
+    memcpy(list, m_scan_list, sizeof(m_scan_list));
+}
+
+
+/*
+Reads a scan list from text: comma separated entries of a thermistor number
+(1 up), then optionally "x" and its repeat and "/" and its dwell samples, e.g.
+"1x4/2,2,3,4". "" or "-" is an empty list. Returns false for a malformed entry,
+or more than MAX_SCAN_ENTRIES; the ranges are checked by
+acquisition_set_scan_list().
+*/
+bool acquisition_parse_scan_list(const char *text, ScanEntry *list) {
+    memset(list, 0, MAX_SCAN_ENTRIES * sizeof(ScanEntry));
+    if (strcmp(text, "-") == 0) {
+        return true;
+    }
+    const char *pos = text;
+    unsigned int entries = 0;
+    while (*pos != '\0') {
+        if (entries >= MAX_SCAN_ENTRIES) {
+            return false;
+        }
+        char *end;
+        unsigned long number = strtoul(pos, &end, 10);
+        unsigned long repeat = 1;
+        unsigned long samples = 0;
+        if (end == pos || number < 1 || number > NUMBER_OF_THERMISTORS) {
+            return false;
+        }
+        pos = end;
+        if (*pos == 'x') {
+            repeat = strtoul(pos + 1, &end, 10);
+            if (end == pos + 1 || repeat < 1 || repeat > MAX_SCAN_REPEAT) {
+                return false;
+            }
+            pos = end;
+        }
+        if (*pos == '/') {
+            samples = strtoul(pos + 1, &end, 10);
+            if (end == pos + 1 || samples < 1 || samples > MAX_DWELL_SAMPLES) {
+                return false;
+            }
+            pos = end;
+        }
+        if (*pos == ',' && pos[1] != '\0') {
+            pos++;
+        }
+        else if (*pos != '\0') {
+            return false;
+        }
+        list[entries].channel = (uint8_t)(number - 1);
+        list[entries].repeat = (uint8_t)repeat;
+        list[entries].samples = (uint8_t)samples;
+        entries++;
+    }
+    return true;
+}
+
+
+/*
+Writes a scan list as acquisition_parse_scan_list() takes it, "-" if empty.
+*/
+void acquisition_format_scan_list(const ScanEntry *list, char *buffer, size_t size) {
+    size_t length = 0;
+    snprintf(buffer, size, "-");
+    for (unsigned int i = 0; i < MAX_SCAN_ENTRIES && list[i].repeat != 0 && length < size; i++) {
+        char entry[12];
+        int used = snprintf(entry, sizeof(entry), "%u", list[i].channel + 1u);
+        if (list[i].repeat > 1) {
+            used += snprintf(entry + used, sizeof(entry) - used, "x%u", list[i].repeat);
+        }
+        if (list[i].samples != 0) {
+            snprintf(entry + used, sizeof(entry) - used, "/%u", list[i].samples);
+        }
+        int written = snprintf(buffer + length, size - length, "%s%s", i > 0 ? "," : "", entry);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+    }
+}
+
+
+/*
+Sets the settling time between switching a thermistor's MOSFET on and starting
+its conversion (up to MAX_SETTLE_US). Applies from the next start of the engine.
+Returns false for an invalid channel or time.
+*/
+bool acquisition_set_settling_us(int channel, unsigned int us) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS || us > MAX_SETTLE_US) {
+        return false;
+    }
+    m_settle_us[channel] = us;
+    return true;
+}
+
+
+unsigned int acquisition_settling_us(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return 0;
+    }
+    return m_settle_us[channel];
+}
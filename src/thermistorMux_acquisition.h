@@ -0,0 +1,145 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_acquisition.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Interrupt-driven scan engine definitions and function prototypes.
+ * One engine per ADC cycles through that ADC's MOSFETs (and the ADC internal
+ * temperature input) from its data-ready interrupt, handing each raw sample to
+ * loop() through the sample ring.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-16
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_ACQUISITION_H
+#define THERMISTORMUX_ACQUISITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_ring.h"
+
+// Slots in one scan pass: one per thermistor, followed by the ADC internal
+// temperature.
+#define ADC_TEMP_SLOT     NUMBER_OF_THERMISTORS
+#define SLOTS_PER_PASS    (NUMBER_OF_THERMISTORS + 1)
+
+// Channel enable mask with every thermistor enabled; bit n is thermistor n
+#define ALL_CHANNELS_MASK ((ChannelMask)~(ChannelMask)0 >> (8 * sizeof(ChannelMask) - NUMBER_OF_THERMISTORS))
+
+// Thermistors on each ADC's input; ADC n takes thermistors n * CHANNELS_PER_ADC
+// onwards (see NUM_ADCS)
+#define CHANNELS_PER_ADC  ((NUMBER_OF_THERMISTORS + NUM_ADCS - 1) / NUM_ADCS)
+
+// First thermistor of channel's input group, whose MOSFETs are switched on
+// together and converted in one SCAN cycle (see ADC_INPUT_PAIRS)
+#define CHANNEL_GROUP(channel) ((channel) - (channel) % ADC_INPUT_PAIRS)
+#if CHANNELS_PER_ADC % ADC_INPUT_PAIRS != 0
+    #error Each ADC block of thermistors must be a whole number of ADC_INPUT_PAIRS groups.
+#endif
+
+// Most samples a slot can dwell for in one pass
+#define MAX_DWELL_SAMPLES 16
+
+// Most banks a frame can be split into, each scanned on its own (see
+// acquisition_set_frame_banks())
+#define MAX_FRAME_BANKS   8
+
+// Passes between conversions of the ADC internal temperature, by default and at
+// most (see acquisition_set_temp_interval())
+#define ADC_TEMP_INTERVAL_PASSES  50
+#define MAX_TEMP_INTERVAL_PASSES  10000
+
+#ifdef USE_REF_TRACKING
+// Passes between conversions of each ADC's reference input, by default and at
+// most (see acquisition_set_ref_interval())
+#define ADC_REF_INTERVAL_PASSES   100
+#define MAX_REF_INTERVAL_PASSES   10000
+#endif
+
+// Longest settling time that can be set for a channel, microseconds
+#define MAX_SETTLE_US 10000
+
+// Scan list limits (see acquisition_set_scan_list()): entries, repeats of an
+// entry and conversion slots per pass, and samples of one thermistor per pass,
+// which are averaged in a byte's count
+#define MAX_SCAN_ENTRIES         24
+#define MAX_SCAN_REPEAT          16
+#define MAX_SCAN_STEPS           64
+#define MAX_SCAN_CHANNEL_SAMPLES 255
+// "32x16/16," per entry
+#define SCAN_LIST_TEXT_SIZE      (MAX_SCAN_ENTRIES * 9 + 1)
+
+// One entry of a scan list. A repeat of 0 ends the list, so a zeroed list is
+// empty.
+struct ScanEntry {
+    uint8_t channel;    // Thermistor index
+    uint8_t repeat;     // Conversions of it per pass, 1 to MAX_SCAN_REPEAT, spread over the pass
+    uint8_t samples;    // Dwell samples each time, 1 to MAX_DWELL_SAMPLES; 0 = acquisition_dwell_samples()
+};
+
+// Called with every sample as loop() takes it from the sample ring
+typedef void (*SampleHook)(const ADCSample *sample);
+
+bool acquisition_init();
+void acquisition_start();
+void acquisition_start_passes(unsigned int passes);
+void acquisition_arm_passes(unsigned int passes);
+void acquisition_fire_passes();
+void acquisition_stop();
+bool acquisition_running();
+uint32_t acquisition_missed_engines();
+void acquisition_isr(int adc);
+int acquisition_adc_for_channel(int channel);
+bool acquisition_get_pass(uint32_t *raw_data, uint64_t *cycles);
+unsigned long acquisition_overruns();
+unsigned long acquisition_broken_passes();
+void acquisition_set_sample_hook(SampleHook hook);
+bool acquisition_set_channel_mask(ChannelMask mask);
+ChannelMask acquisition_channel_mask();
+bool acquisition_set_burst_channels(ChannelMask mask);
+ChannelMask acquisition_burst_channels();
+bool acquisition_channel_enabled(int channel);
+void acquisition_set_skip_mask(ChannelMask mask);
+void acquisition_set_rest_mask(ChannelMask mask);
+bool acquisition_resting();
+uint32_t acquisition_excitation_cycles(int channel);
+ChannelMask acquisition_pass_channels();
+void acquisition_set_channel_intervals(const uint8_t *intervals);
+unsigned int acquisition_channel_interval(int channel);
+bool acquisition_set_frame_banks(unsigned int banks);
+unsigned int acquisition_frame_banks();
+ChannelMask acquisition_bank_channels(unsigned int bank);
+bool acquisition_select_bank(unsigned int bank);
+bool acquisition_set_dwell_samples(unsigned int samples);
+unsigned int acquisition_dwell_samples();
+bool acquisition_set_temp_interval(unsigned int passes);
+unsigned int acquisition_temp_interval();
+#ifdef USE_REF_TRACKING
+bool acquisition_set_ref_interval(unsigned int passes);
+unsigned int acquisition_ref_interval();
+uint32_t acquisition_reference_code(int adc);
+#endif
+bool acquisition_set_scan_list(const ScanEntry *list);
+void acquisition_scan_list(ScanEntry *list);
+bool acquisition_parse_scan_list(const char *text, ScanEntry *list);
+void acquisition_format_scan_list(const ScanEntry *list, char *buffer, size_t size);
+bool acquisition_set_settling_us(int channel, unsigned int us);
+unsigned int acquisition_settling_us(int channel);
+void mosfet_on(int channel);
+void mosfet_off(int channel);
+
+#endif
@@ -0,0 +1,379 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_alarm.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief On-device alarms. Each pass's readings are checked against the
+ * channel limits as soon as they are converted, so an alarm goes out within one
+ * pass rather than after an averaged frame and the host's own checks. The pass
+ * readings are unfiltered: leave room for their noise in the limits.
+ *
+ * Limits are written as a ',' separated list in thermistor order, °C for high
+ * and low and °C/s for rate, with '-' (or nothing) for no limit; channels left
+ * off have none. They are kept in EEPROM as one CRC32-checked record after the
+ * sensor models. Entries past the last thermistor limit the virtual channels
+ * (see thermistorMux_virtual.cpp), in order; those stay in RAM only, as the
+ * EEPROM has no room left for them.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_alarm.h"
+#include "thermistorMux_sensor.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_log.h"
+#include <EEPROM.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ALARM_MAGIC   0x4C41        // "AL"
+#define ALARM_VERSION 1
+
+// Limits beyond these can't be meant for a thermistor
+#define ALARM_MIN_TEMP_C  -273.15f
+#define ALARM_MAX_TEMP_C  1000.0f
+#define ALARM_MAX_RATE    1000.0f   // °C/s
+
+struct AlarmRecord {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels;                                   // NUMBER_OF_THERMISTORS when saved
+    float limit[NUM_ALARM_KINDS][NUMBER_OF_THERMISTORS];  // NAN for none
+    uint32_t crc;                                       // CRC32 of everything before it
+};
+
+#define ALARM_EE_BASE SENSOR_EE_END
+static_assert(sizeof(AlarmRecord) <= ALARM_EE_SIZE, "alarm record runs into the records after it");
+static_assert(ALARM_EE_END <= E2END + 1, "alarm limits don't fit in EEPROM");
+
+// Each check slot: the thermistors, then the virtual channels
+#define ALARM_SLOTS  (NUMBER_OF_THERMISTORS + MAX_VIRTUAL_CHANNELS)
+
+static AlarmRecord m_record;                    // The limits in use
+static float m_virtualLimit[NUM_ALARM_KINDS][MAX_VIRTUAL_CHANNELS];  // NAN for none
+static ChannelMask m_limited = 0;               // Channels with any limit
+static uint32_t m_virtualLimited = 0;           // Virtual channels with any limit, bit n for virtual channel n + 1
+static ChannelMask m_active[NUM_ALARM_KINDS] = {0};
+static uint32_t m_virtualActive[NUM_ALARM_KINDS] = {0};
+
+// Rate of change reference of each slot: the reading and time it is measured from
+static float    m_rateTemp[ALARM_SLOTS];
+static uint64_t m_rateCycles[ALARM_SLOTS] = {0};  // 0 = none yet
+
+static const char *const kindNames[NUM_ALARM_KINDS] = {"high", "low", "rate"};
+
+
+static bool limit_valid(AlarmKind kind, float limit) {
+    if (isnan(limit)) {
+        return true;
+    }
+    if (kind == ALARM_RATE) {
+        return limit > 0 && limit <= ALARM_MAX_RATE;
+    }
+    return limit >= ALARM_MIN_TEMP_C && limit <= ALARM_MAX_TEMP_C;
+}
+
+
+static bool record_valid(const AlarmRecord *record) {
+    if (record->magic != ALARM_MAGIC || record->version != ALARM_VERSION ||
+        record->channels != NUMBER_OF_THERMISTORS ||
+        record->crc != crc32(record, offsetof(AlarmRecord, crc))) {
+        return false;
+    }
+    for (int kind = 0; kind < NUM_ALARM_KINDS; kind++) {
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            if (!limit_valid((AlarmKind)kind, record->limit[kind][channel])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+//Limit of one kind of a slot, NAN for none.
+static float slot_limit(AlarmKind kind, int slot) {
+    return (slot < NUMBER_OF_THERMISTORS) ? m_record.limit[kind][slot]
+                                          : m_virtualLimit[kind][slot - NUMBER_OF_THERMISTORS];
+}
+
+
+//Puts the record's limits and the virtual ones in use, clearing every alarm so
+//each is judged afresh.
+static void apply_record() {
+    m_limited = 0;
+    m_virtualLimited = 0;
+    for (int kind = 0; kind < NUM_ALARM_KINDS; kind++) {
+        m_active[kind] = 0;
+        m_virtualActive[kind] = 0;
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            if (!isnan(m_record.limit[kind][channel])) {
+                m_limited |= CHANNEL_BIT(channel);
+            }
+        }
+        for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+            if (!isnan(m_virtualLimit[kind][v])) {
+                m_virtualLimited |= 1UL << v;
+            }
+        }
+    }
+    for (int slot = 0; slot < ALARM_SLOTS; slot++) {
+        m_rateCycles[slot] = 0;
+    }
+}
+
+
+/*
+Restores the limits saved by alarm_set_limits(). Erased or corrupt EEPROM leaves
+every channel without limits.
+*/
+void alarm_load() {
+    EEPROM.get(ALARM_EE_BASE, m_record);
+    if (!record_valid(&m_record)) {
+        if (m_record.magic == ALARM_MAGIC) {
+            LogWarn("Alarm limits in EEPROM are corrupt; alarms are off.");
+        }
+        memset(&m_record, 0, sizeof(m_record));
+        m_record.magic = ALARM_MAGIC;
+        m_record.version = ALARM_VERSION;
+        m_record.channels = NUMBER_OF_THERMISTORS;
+        for (int kind = 0; kind < NUM_ALARM_KINDS; kind++) {
+            for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+                m_record.limit[kind][channel] = NAN;
+            }
+        }
+    }
+    for (int kind = 0; kind < NUM_ALARM_KINDS; kind++) {
+        for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+            m_virtualLimit[kind][v] = NAN;
+        }
+    }
+    apply_record();
+}
+
+
+/*
+True if any channel or virtual channel has a limit, i.e. the passes need
+checking.
+*/
+bool alarm_enabled() {
+    return m_limited != 0 || m_virtualLimited != 0;
+}
+
+
+/*
+Sets and saves one kind of limit for every channel from text (see the file
+comment), and for the virtual channels after them; "" removes them all. Clears
+the alarms. Returns false, changing nothing, for a malformed or out of range
+limit or more entries than channels and virtual channels.
+*/
+bool alarm_set_limits(AlarmKind kind, const char *text) {
+    if (kind < 0 || kind >= NUM_ALARM_KINDS) {
+        return false;
+    }
+    float limits[ALARM_SLOTS];
+    for (int slot = 0; slot < ALARM_SLOTS; slot++) {
+        limits[slot] = NAN;
+    }
+    const char *pos = text;
+    int channel = 0;
+    while (*pos != '\0') {
+        if (channel >= ALARM_SLOTS) {
+            return false;
+        }
+        const char *end = strchr(pos, ',');
+        size_t length = (end != NULL) ? (size_t)(end - pos) : strlen(pos);
+        char entry[16];
+        if (length >= sizeof(entry)) {
+            return false;
+        }
+        memcpy(entry, pos, length);
+        entry[length] = '\0';
+        float limit = NAN;
+        char dash;
+        int used = 0;
+        bool none = (sscanf(entry, " %c %n", &dash, &used) != 1) || (dash == '-' && entry[used] == '\0');
+        if (!none && (sscanf(entry, " %f %n", &limit, &used) != 1 || entry[used] != '\0' || isnan(limit))) {
+            return false;
+        }
+        if (!limit_valid(kind, limit)) {
+            return false;
+        }
+        limits[channel++] = limit;
+        pos += length + ((end != NULL) ? 1 : 0);
+    }
+    memcpy(m_record.limit[kind], limits, sizeof(m_record.limit[kind]));
+    memcpy(m_virtualLimit[kind], &limits[NUMBER_OF_THERMISTORS], sizeof(m_virtualLimit[kind]));
+    m_record.crc = crc32(&m_record, offsetof(AlarmRecord, crc));
+    EEPROM.put(ALARM_EE_BASE, m_record);
+    apply_record();
+    return true;
+}
+
+
+/*
+Writes one kind of limit for every channel as alarm_set_limits() takes it,
+followed by the virtual channels' up to the last one set.
+*/
+void alarm_format_limits(AlarmKind kind, char *buffer, size_t size) {
+    int slots = ALARM_SLOTS;
+    while (slots > NUMBER_OF_THERMISTORS && isnan(slot_limit(kind, slots - 1))) {
+        slots--;
+    }
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int channel = 0; channel < slots && length < size; channel++) {
+        float limit = slot_limit(kind, channel);
+        const char *separator = (channel > 0) ? "," : "";
+        int written = isnan(limit) ? snprintf(buffer + length, size - length, "%s-", separator) :
+                                     snprintf(buffer + length, size - length, "%s%g", separator, limit);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+    }
+}
+
+
+//True if one alarm of a slot is active.
+static bool slot_active(AlarmKind kind, int slot) {
+    return (slot < NUMBER_OF_THERMISTORS) ? (m_active[kind] & CHANNEL_BIT(slot)) != 0
+                                          : (m_virtualActive[kind] & (1UL << (slot - NUMBER_OF_THERMISTORS))) != 0;
+}
+
+
+//Sets or clears one alarm of a slot, logging the change. Returns true if it changed.
+static bool set_alarm(AlarmKind kind, int slot, bool active, float value) {
+    if (slot_active(kind, slot) == active) {
+        return false;
+    }
+    bool thermistor = slot < NUMBER_OF_THERMISTORS;
+    const char *what = thermistor ? "Thermistor" : "Virtual channel";
+    int number = (thermistor ? slot : slot - NUMBER_OF_THERMISTORS) + 1;
+    if (thermistor) {
+        m_active[kind] ^= CHANNEL_BIT(slot);
+    }
+    else {
+        m_virtualActive[kind] ^= 1UL << (slot - NUMBER_OF_THERMISTORS);
+    }
+    if (active) {
+        LogWarn("%s %d %s alarm: %.2f", what, number, kindNames[kind], value);
+    }
+    else {
+        LogInfo("%s %d %s alarm cleared: %.2f", what, number, kindNames[kind], value);
+    }
+    return true;
+}
+
+
+//Checks one slot's reading, temp in °C, against its limits. Returns true if any
+//of its alarms was raised or cleared.
+static bool check_slot(int slot, float temp, uint64_t cycles) {
+    if (isnan(temp)) {
+        return false;
+    }
+    bool changed = false;
+    float high = slot_limit(ALARM_HIGH, slot);
+    if (!isnan(high)) {
+        bool active = slot_active(ALARM_HIGH, slot) ? (temp > high - ALARM_HYSTERESIS_C) : (temp > high);
+        changed |= set_alarm(ALARM_HIGH, slot, active, temp);
+    }
+    float low = slot_limit(ALARM_LOW, slot);
+    if (!isnan(low)) {
+        bool active = slot_active(ALARM_LOW, slot) ? (temp < low + ALARM_HYSTERESIS_C) : (temp < low);
+        changed |= set_alarm(ALARM_LOW, slot, active, temp);
+    }
+    float rate_limit = slot_limit(ALARM_RATE, slot);
+    if (isnan(rate_limit)) {
+        return changed;
+    }
+    if (m_rateCycles[slot] == 0) {
+        m_rateTemp[slot] = temp;
+        m_rateCycles[slot] = cycles;
+        return changed;
+    }
+    uint64_t elapsed = cycles - m_rateCycles[slot];
+    if (elapsed < (uint64_t)ALARM_RATE_INTERVAL_MS * (F_CPU_ACTUAL / 1000)) {
+        return changed;
+    }
+    float rate = (temp - m_rateTemp[slot]) * ((float)F_CPU_ACTUAL / (float)elapsed);
+    m_rateTemp[slot] = temp;
+    m_rateCycles[slot] = cycles;
+    changed |= set_alarm(ALARM_RATE, slot, fabsf(rate) > rate_limit, rate);
+    return changed;
+}
+
+
+/*
+Checks one pass's readings, temps[i] for thermistor i in °C, of the channels that
+were read (and aren't faulted). cycles is the pass's time_cycles64() stamp.
+Returns true if any alarm was raised or cleared; alarm_mask() has them.
+*/
+bool alarm_check_pass(const float *temps, ChannelMask channels, uint64_t cycles) {
+    bool changed = false;
+    ChannelMask check = channels & m_limited;
+    while (check != 0) {
+        int channel = channel_mask_first(check);
+        check &= check - 1;
+        changed |= check_slot(channel, temps[channel], cycles);
+    }
+    return changed;
+}
+
+
+/*
+Checks one pass's virtual channels, values[v] for virtual channel v + 1 in °C
+(NAN for one not read), as alarm_check_pass() does the thermistors.
+*/
+bool alarm_check_virtual(const float *values, uint64_t cycles) {
+    bool changed = false;
+    for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+        if (m_virtualLimited & (1UL << v)) {
+            changed |= check_slot(NUMBER_OF_THERMISTORS + v, values[v], cycles);
+        }
+    }
+    return changed;
+}
+
+
+/*
+Clears the virtual channels' alarms, e.g. after they are redefined, so each is
+judged afresh.
+*/
+void alarm_reset_virtual() {
+    for (int kind = 0; kind < NUM_ALARM_KINDS; kind++) {
+        m_virtualActive[kind] = 0;
+    }
+    for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+        m_rateCycles[NUMBER_OF_THERMISTORS + v] = 0;
+    }
+}
+
+
+/*
+Channels with one kind of alarm active, bit n for thermistor n.
+*/
+ChannelMask alarm_mask(AlarmKind kind) {
+    return m_active[kind];
+}
+
+
+/*
+Virtual channels with one kind of alarm active, bit n for virtual channel n + 1.
+*/
+uint32_t alarm_virtual_mask(AlarmKind kind) {
+    return m_virtualActive[kind];
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_alarm.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief On-device alarms: per-channel high, low and rate-of-change limits
+ * checked on every pass, ahead of the averaging.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_ALARM_H
+#define THERMISTORMUX_ALARM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_sensor.h"
+#include "thermistorMux_virtual.h"
+
+enum AlarmKind {
+    ALARM_HIGH,         // Above the high limit
+    ALARM_LOW,          // Below the low limit
+    ALARM_RATE,         // Changing faster than the rate limit, either way
+    NUM_ALARM_KINDS
+};
+
+// A high or low alarm clears once the temperature is this far back inside its
+// limit, so pass-to-pass noise doesn't toggle it, °C
+#define ALARM_HYSTERESIS_C      0.5
+// Rate of change is measured over at least this long, ms
+#define ALARM_RATE_INTERVAL_MS  1000
+
+// Longest text of alarm_format_limits(), "-123.456," per thermistor and
+// virtual channel
+#define ALARM_LIMITS_TEXT_SIZE  ((NUMBER_OF_THERMISTORS + MAX_VIRTUAL_CHANNELS) * 12)
+
+// EEPROM kept for the alarm record, after the sensor models
+#define ALARM_EE_SIZE  (NUM_ALARM_KINDS * NUMBER_OF_THERMISTORS * 4 + 8)
+#define ALARM_EE_END   (SENSOR_EE_END + ALARM_EE_SIZE)
+
+void alarm_load();
+bool alarm_enabled();
+bool alarm_set_limits(AlarmKind kind, const char *text);
+void alarm_format_limits(AlarmKind kind, char *buffer, size_t size);
+bool alarm_check_pass(const float *temps, ChannelMask channels, uint64_t cycles);
+bool alarm_check_virtual(const float *values, uint64_t cycles);
+void alarm_reset_virtual();
+ChannelMask alarm_mask(AlarmKind kind);
+uint32_t alarm_virtual_mask(AlarmKind kind);
+
+#endif
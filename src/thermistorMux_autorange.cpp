@@ -0,0 +1,161 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_autorange.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel ADC auto-ranging. Every thermistor sample taken from the ring
+ * updates an exponentially weighted mean of the channel's gain x1 code, and of
+ * its noise from second differences, which a steady temperature ramp leaves out. Once they have settled after a change, the PGA gain is raised as far as
+ * the mean plus a noise margin still fits under full scale, and dropped at once
+ * when the code nears saturation; the oversampling ratio is stepped down from the
+ * configured one while the noise stays well under AUTORANGE_NOISE_CODES, and back
+ * up when it goes over. The scan engine applies each slot's settings before
+ * converting it (see ready_slot()) and normalizes the codes read.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_autorange.h"
+
+#ifdef USE_ADC_AUTO_RANGE
+
+#include <Arduino.h>
+#include <math.h>
+
+// Target noise of a channel's samples, gain x1 codes RMS. About 1 mK for the
+// 10K thermistor near 25 C.
+#define AUTORANGE_NOISE_CODES   64.0f
+
+// The gain is raised while the mean plus this many standard deviations, at the
+// new gain, stays under AUTORANGE_GAIN_UP_CODES, and dropped once it reaches
+// AUTORANGE_GAIN_DOWN_CODES. Full scale is 0x7FFFFF.
+#define AUTORANGE_NOISE_MARGIN  4.0f
+#define AUTORANGE_GAIN_UP_CODES    0x500000
+#define AUTORANGE_GAIN_DOWN_CODES  0x680000
+
+// Weight of each new sample in the running mean and variance, and the samples
+// taken after a change before the next decision
+#define AUTORANGE_WEIGHT        0.125f
+#define AUTORANGE_SETTLE_SAMPLES 16
+
+// Running estimate of one channel
+struct RangeEstimate {
+    float mean;                 // Gain x1 code
+    float variance;             // Of the noise, from second differences
+    float last[2];              // The two codes before this one
+    uint16_t samples;           // Since the last change
+};
+
+static volatile AutoRange m_setting[NUMBER_OF_THERMISTORS] = {};
+static RangeEstimate m_estimate[NUMBER_OF_THERMISTORS] = {};
+
+
+/*
+Back to the configured oversampling ratio and gain x1 on every channel, e.g. when
+the scan configuration or sensor models change.
+*/
+void autorange_reset() {
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        m_setting[channel].osr_steps = 0;
+        m_setting[channel].gain_shift = 0;
+        m_estimate[channel] = {0, 0, {0, 0}, 0};
+    }
+}
+
+
+/*
+Largest gain shift at which a channel with this mean and noise (gain x1 codes)
+stays clear of full scale.
+*/
+static uint8_t best_gain_shift(float peak) {
+    uint8_t shift = 0;
+    while (shift < AUTORANGE_MAX_GAIN_SHIFT && peak * (float)(2u << shift) < AUTORANGE_GAIN_UP_CODES) {
+        shift++;
+    }
+    return shift;
+}
+
+
+/*
+Adds a thermistor sample (raw ADCDATA, already normalized to gain x1) to the
+channel's estimate and moves its settings one step when the estimate calls for
+it. Called from loop() as samples are taken from the ring.
+*/
+void autorange_update(int channel, uint32_t raw_data) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return;
+    }
+    RangeEstimate *estimate = &m_estimate[channel];
+    AutoRange setting = {m_setting[channel].osr_steps, m_setting[channel].gain_shift};
+    uint32_t masked_data = raw_data & 0x00FFFFFF;
+    if (masked_data == 0x007FFFFF || masked_data == 0x00800000) {
+        // Saturated: no gain headroom at all until it has been measured again
+        if (setting.gain_shift != 0) {
+            m_setting[channel].gain_shift = 0;
+            estimate->samples = 0;
+        }
+        return;
+    }
+    float code = (float)(((int32_t)(masked_data << 8)) >> 8);
+    if (estimate->samples == 0) {
+        estimate->mean = code;
+        estimate->variance = 0;
+    } else {
+        estimate->mean += AUTORANGE_WEIGHT * (code - estimate->mean);
+    }
+    if (estimate->samples >= 2) {
+        // x[n] - 2 x[n-1] + x[n-2] has 6 times the variance of white noise
+        float second = code - 2.0f * estimate->last[0] + estimate->last[1];
+        float variance = second * second / 6.0f;
+        estimate->variance = estimate->samples == 2 ? variance :
+                             estimate->variance + AUTORANGE_WEIGHT * (variance - estimate->variance);
+    }
+    estimate->last[1] = estimate->last[0];
+    estimate->last[0] = code;
+    if (++estimate->samples < AUTORANGE_SETTLE_SAMPLES) {
+        return;
+    }
+
+    float noise = sqrtf(estimate->variance);
+    float peak = fabsf(estimate->mean) + AUTORANGE_NOISE_MARGIN * noise;
+    uint8_t gain_shift = best_gain_shift(peak);
+    if (peak * (float)(1u << setting.gain_shift) < AUTORANGE_GAIN_DOWN_CODES && gain_shift < setting.gain_shift) {
+        // Still clear of full scale; keep the gain rather than hunt
+        gain_shift = setting.gain_shift;
+    }
+    uint8_t osr_steps = setting.osr_steps;
+    if (noise > AUTORANGE_NOISE_CODES && osr_steps > 0) {
+        osr_steps--;
+    } else if (noise < 0.5f * AUTORANGE_NOISE_CODES && osr_steps < AUTORANGE_MAX_OSR_STEPS) {
+        osr_steps++;
+    }
+    if (gain_shift != setting.gain_shift || osr_steps != setting.osr_steps) {
+        m_setting[channel].gain_shift = gain_shift;
+        m_setting[channel].osr_steps = osr_steps;
+        estimate->samples = 0;
+    }
+}
+
+
+/*
+Conversion settings for a thermistor. Read by the scan engine from its interrupts.
+*/
+FASTRUN AutoRange autorange_setting(int channel) {
+    AutoRange setting = {m_setting[channel].osr_steps, m_setting[channel].gain_shift};
+    return setting;
+}
+
+#endif
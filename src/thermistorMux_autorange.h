@@ -0,0 +1,63 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_autorange.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel ADC auto-ranging for the one-shot scan engine: each thermistor's
+ * oversampling ratio and PGA gain, chosen from its recent codes, and the
+ * normalization of its samples back to gain x1 codes.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_AUTORANGE_H
+#define THERMISTORMUX_AUTORANGE_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Highest PGA gain used, as a shift: x1 << AUTORANGE_MAX_GAIN_SHIFT
+#define AUTORANGE_MAX_GAIN_SHIFT  3
+
+// Most OSR steps below the configured ratio (see osr_ratios in command_ADC.cpp)
+#define AUTORANGE_MAX_OSR_STEPS   6
+
+// Conversion settings of one thermistor
+struct AutoRange {
+    uint8_t osr_steps;          // OSR codes below the configured oversampling ratio
+    uint8_t gain_shift;         // PGA gain = 1 << gain_shift
+};
+
+void autorange_reset();
+void autorange_update(int channel, uint32_t raw_data);
+AutoRange autorange_setting(int channel);
+
+/*
+Scales a raw ADCDATA value (status byte + 24 data bits) converted at gain
+1 << gain_shift back to the gain x1 code, rounding to nearest. Saturated codes
+are kept as they are, so they are still seen as invalid.
+*/
+static inline uint32_t autorange_normalize(uint32_t raw_data, uint8_t gain_shift) {
+    uint32_t masked_data = raw_data & 0x00FFFFFF;
+    if (gain_shift == 0 || masked_data == 0x007FFFFF || masked_data == 0x00800000) {
+        return raw_data;
+    }
+    int32_t code = ((int32_t)(masked_data << 8)) >> 8;
+    code = (code + (1 << (gain_shift - 1))) >> gain_shift;
+    return (raw_data & 0xFF000000) | ((uint32_t)code & 0x00FFFFFF);
+}
+
+#endif
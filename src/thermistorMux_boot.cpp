@@ -0,0 +1,101 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_boot.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Boot timeline. The phases of setup() and network_init(), and the
+ * milestones after it (link up, time sync, broker connect, first NBIRTH), are
+ * stamped with the 64-bit cycle counter when they finish. The counter starts at
+ * reset, so the first phase includes the core's own start-up. The timeline reads
+ * "memory 301.2, warm boot 301.4, ..., NBIRTH 1834.0": each phase and the ms
+ * since reset at which it finished. The cycle counter is extended only when
+ * read, so a phase longer than its ~7 s wrap would show a wrap short.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_boot.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_global.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CYCLES_PER_MS (F_CPU_ACTUAL / 1000)
+
+struct BootMark {
+    const char *phase;      // A string literal
+    uint64_t cycles;        // time_cycles64() when it finished
+};
+
+static BootMark m_marks[BOOT_MAX_MARKS];
+static int m_count = 0;
+static bool m_finished = false;
+
+
+/*
+Stamps the end of a start-up phase, named by a string literal. A phase already
+stamped keeps its first time, so a milestone can be marked every time it
+happens. Ignored after boot_finish(), or once the timeline is full.
+*/
+void boot_mark(const char *phase) {
+    if (m_finished || m_count >= BOOT_MAX_MARKS) {
+        return;
+    }
+    for (int i = 0; i < m_count; i++) {
+        if (strcmp(m_marks[i].phase, phase) == 0) {
+            return;
+        }
+    }
+    m_marks[m_count].phase = phase;
+    m_marks[m_count].cycles = time_cycles64();
+    m_count++;
+}
+
+
+/*
+Closes the timeline, as the first NBIRTH goes out, and logs it a phase a line.
+*/
+void boot_finish() {
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+    for (int i = 0; i < m_count; i++) {
+        LogInfo("Boot: %s at %.1f ms", m_marks[i].phase, (double)m_marks[i].cycles / CYCLES_PER_MS);
+    }
+}
+
+
+bool boot_finished() {
+    return m_finished;
+}
+
+
+/*
+Writes the timeline: each phase and when it finished, in ms since reset.
+*/
+void boot_format_timeline(char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < m_count && length < size; i++) {
+        int written = snprintf(buffer + length, size - length, "%s%s %.1f", (i > 0) ? ", " : "",
+                               m_marks[i].phase, (double)m_marks[i].cycles / CYCLES_PER_MS);
+        if (written < 0) {
+            return;
+        }
+        length += (size_t)written;
+    }
+}
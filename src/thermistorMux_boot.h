@@ -0,0 +1,42 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_boot.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Boot timeline definitions and function prototypes. Each start-up phase
+ * is stamped with the cycle counter as it finishes, up to the first NBIRTH,
+ * which carries the timeline as Properties/Boot Timeline.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_BOOT_H
+#define THERMISTORMUX_BOOT_H
+
+#include <stddef.h>
+
+// Phases the timeline holds
+#define BOOT_MAX_MARKS  24
+
+// Longest text of boot_format_timeline(), "network config 123456.7, " a phase
+#define BOOT_TIMELINE_TEXT_SIZE  (BOOT_MAX_MARKS * 26)
+
+void boot_mark(const char *phase);
+void boot_finish();
+bool boot_finished();
+void boot_format_timeline(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,179 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_calcapture.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration capture. Each channel keeps its last CALCAPTURE_WINDOW
+ * filtered frames; they are judged against the window median and its absolute
+ * deviation, so a few spikes neither pull the reading nor block it. The slope is
+ * the least squares line of the frames kept against the time they were added.
+ * The stability thresholds are written as "stddev,slope,hold" (°C, °C per
+ * minute, seconds) and aren't saved across a reset.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_calcapture.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+struct ChannelCapture {
+    float window[CALCAPTURE_WINDOW];    // Uncalibrated temperatures, oldest at next once full
+    uint32_t time[CALCAPTURE_WINDOW];   // millis() each was added
+    uint8_t next;                       // Next window entry to write
+    uint8_t count;                      // Valid entries
+    bool stable;                        // At the last judgement
+    uint32_t stable_since;              // Time of the newest frame when it became stable
+};
+
+static ChannelCapture m_channels[NUMBER_OF_THERMISTORS];
+static float m_stddev = CALCAPTURE_STABLE_STDDEV_C;
+static float m_slope = CALCAPTURE_STABLE_SLOPE_C;
+static float m_hold = CALCAPTURE_HOLD_S;
+
+
+/*
+Forgets every frame collected, for a new reference point.
+*/
+void calcapture_start() {
+    memset(m_channels, 0, sizeof(m_channels));
+}
+
+
+/*
+Adds one frame of uncalibrated temperatures for the thermistors in channels (bit
+n for thermistor n), converted at time_ms (millis()). NAN readings are left out.
+*/
+void calcapture_add_frame(const float *raw_temps, ChannelMask channels, uint32_t time_ms) {
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (!(channels & CHANNEL_BIT(channel)) || isnan(raw_temps[channel])) {
+            continue;
+        }
+        ChannelCapture *capture = &m_channels[channel];
+        capture->window[capture->next] = raw_temps[channel];
+        capture->time[capture->next] = time_ms;
+        capture->next = (capture->next + 1) % CALCAPTURE_WINDOW;
+        if (capture->count < CALCAPTURE_WINDOW) {
+            capture->count++;
+        }
+    }
+}
+
+
+static float median(float *values, int count) {
+    // Insertion sort in place; count is at most CALCAPTURE_WINDOW
+    for (int i = 1; i < count; i++) {
+        float value = values[i];
+        int j = i;
+        while (j > 0 && values[j - 1] > value) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+    if (count & 1) {
+        return values[count / 2];
+    }
+    return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+
+/*
+Judges a channel's reading over its window, once per frame added: it is ready
+once every judgement for the hold time has found it stable. Returns false,
+leaving result alone, until the window is full.
+*/
+bool calcapture_evaluate(int channel, CalCaptureResult *result) {
+    ChannelCapture *capture = &m_channels[channel];
+    if (capture->count < CALCAPTURE_WINDOW) {
+        return false;
+    }
+    float sorted[CALCAPTURE_WINDOW];
+    memcpy(sorted, capture->window, sizeof(sorted));
+    float centre = median(sorted, CALCAPTURE_WINDOW);
+    for (int i = 0; i < CALCAPTURE_WINDOW; i++) {
+        sorted[i] = fabsf(capture->window[i] - centre);
+    }
+    float limit = CALCAPTURE_OUTLIER_SIGMAS * 1.4826f * median(sorted, CALCAPTURE_WINDOW);
+    if (limit < CALCAPTURE_OUTLIER_FLOOR_C) {
+        limit = CALCAPTURE_OUTLIER_FLOOR_C;
+    }
+
+    // Mean and variance of the frames kept (Welford), and their covariance with
+    // time, in minutes since the oldest frame
+    uint32_t oldest = capture->time[capture->next];
+    uint32_t newest = capture->time[(capture->next + CALCAPTURE_WINDOW - 1) % CALCAPTURE_WINDOW];
+    double mean = 0, m2 = 0;
+    double time_mean = 0, time_m2 = 0, covariance = 0;
+    unsigned int inliers = 0;
+    for (int age = 0; age < CALCAPTURE_WINDOW; age++) {
+        int entry = (capture->next + age) % CALCAPTURE_WINDOW;
+        float temp = capture->window[entry];
+        if (fabsf(temp - centre) > limit) {
+            continue;
+        }
+        double minutes = (capture->time[entry] - oldest) / 60000.0;
+        inliers++;
+        double delta = temp - mean;
+        double time_delta = minutes - time_mean;
+        mean += delta / inliers;
+        time_mean += time_delta / inliers;
+        m2 += delta * (temp - mean);
+        time_m2 += time_delta * (minutes - time_mean);
+        covariance += time_delta * (temp - mean);
+    }
+    result->mean = (float)mean;
+    result->variance = inliers > 1 ? (float)(m2 / (inliers - 1)) : 0;
+    result->slope = time_m2 > 0 ? (float)(covariance / time_m2) : 0;
+    result->inliers = inliers;
+    result->stable = inliers >= CALCAPTURE_MIN_INLIERS &&
+                     result->variance <= m_stddev * m_stddev &&
+                     fabsf(result->slope) <= m_slope;
+    if (result->stable && !capture->stable) {
+        capture->stable_since = newest;
+    }
+    capture->stable = result->stable;
+    result->ready = result->stable && (newest - capture->stable_since) >= (uint32_t)(m_hold * 1000);
+    return true;
+}
+
+
+/*
+Sets the stability thresholds from text (see the file comment). Returns false,
+changing nothing, for a malformed or out of range value.
+*/
+bool calcapture_set_stability(const char *text) {
+    float stddev, slope, hold;
+    int used = 0;
+    if (sscanf(text, " %f , %f , %f %n", &stddev, &slope, &hold, &used) != 3 || text[used] != '\0' ||
+        !(stddev > 0 && stddev <= 1) || !(slope > 0 && slope <= 10) || !(hold >= 0 && hold <= CALCAPTURE_MAX_HOLD_S)) {
+        return false;
+    }
+    m_stddev = stddev;
+    m_slope = slope;
+    m_hold = hold;
+    return true;
+}
+
+
+/*
+Writes the stability thresholds as calcapture_set_stability() takes them.
+*/
+void calcapture_format_stability(char *buffer, size_t size) {
+    snprintf(buffer, size, "%g,%g,%g", m_stddev, m_slope, m_hold);
+}
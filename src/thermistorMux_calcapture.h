@@ -0,0 +1,70 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_calcapture.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration capture definitions and function prototypes. Filtered frames
+ * taken at a reference temperature are collected per channel, outliers are
+ * rejected and a reading is only accepted once it has been stable for the hold
+ * time.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CALCAPTURE_H
+#define THERMISTORMUX_CALCAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Frames each channel's reading is judged over
+#define CALCAPTURE_WINDOW       16
+// A frame further than this many robust standard deviations (1.4826 * median
+// absolute deviation) from the window median is an outlier, but never one
+// closer than CALCAPTURE_OUTLIER_FLOOR_C
+#define CALCAPTURE_OUTLIER_SIGMAS   3.5f
+#define CALCAPTURE_OUTLIER_FLOOR_C  0.005f
+// Stable: at least CALCAPTURE_MIN_INLIERS frames in the window are kept, and
+// their standard deviation and the slope of their line over time are within the
+// stability thresholds (see calcapture_set_stability()). Ready: stable at every
+// judgement for the hold time.
+#define CALCAPTURE_MIN_INLIERS      12
+#define CALCAPTURE_STABLE_STDDEV_C  0.02f       // Default standard deviation, °C
+#define CALCAPTURE_STABLE_SLOPE_C   0.05f       // Default slope, °C per minute
+#define CALCAPTURE_HOLD_S           0.0f        // Default hold time, s
+#define CALCAPTURE_MAX_HOLD_S       300.0f
+// Longest text of calcapture_format_stability()
+#define CALCAPTURE_STABILITY_TEXT_SIZE 48
+
+// A channel's reading over the window, see calcapture_evaluate()
+struct CalCaptureResult {
+    float mean;             // Mean of the frames kept, uncalibrated °C
+    float variance;         // Their variance, °C^2
+    float slope;            // Their trend, °C per minute
+    unsigned int inliers;   // Frames kept
+    bool stable;
+    bool ready;             // Stable for the hold time
+};
+
+void calcapture_start();
+void calcapture_add_frame(const float *raw_temps, ChannelMask channels, uint32_t time_ms);
+bool calcapture_evaluate(int channel, CalCaptureResult *result);
+bool calcapture_set_stability(const char *text);
+void calcapture_format_stability(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,192 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_calstore.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration persistence. The points are stored whole as a blob with a
+ * version, the channel and point counts and a CRC32, alternating between two
+ * EEPROM slots: a save only overwrites the older copy, and only the bytes of it
+ * that differ, so a reset part way through leaves the previous calibration. The
+ * two-point layout of older firmware is migrated on the first load.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_calstore.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_log.h"
+#include <EEPROM.h>
+#include <stddef.h>
+#include <string.h>
+
+// Older layout: calibrated flag, reference temperatures of points 1 & 2, then the
+// raw readings of points 1 & 2 per thermistor. After the channel mask and
+// acquisition profile (see thermistor_Mux.cpp), the points taken (0xFF before
+// there were more than two) and the reference temperatures and raw readings of
+// points 3 on.
+#define LEGACY_EE_FLAG 0
+#define LEGACY_EE_REFS 1
+#define LEGACY_EE_RAW(channel) (LEGACY_EE_REFS + (2 * sizeof(float)) + ((channel) * 2 * sizeof(float)))
+#define LEGACY_EE_POINTS (LEGACY_EE_RAW(NUMBER_OF_THERMISTORS) + sizeof(uint32_t) + 1)
+#define LEGACY_EE_EXTRA_REFS (LEGACY_EE_POINTS + 1)
+#define LEGACY_EE_EXTRA_RAW(channel) (LEGACY_EE_EXTRA_REFS + ((CAL_MAX_POINTS - 2) * sizeof(float)) + \
+                                      ((channel) * (CAL_MAX_POINTS - 2) * sizeof(float)))
+#define LEGACY_EE_END LEGACY_EE_EXTRA_RAW(NUMBER_OF_THERMISTORS)
+
+#define CALSTORE_MAGIC   0x4C43     // "CL"
+#define CALSTORE_VERSION 1
+
+struct CalBlob {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels;       // NUMBER_OF_THERMISTORS when saved
+    uint8_t points;         // CAL_MAX_POINTS when saved
+    uint16_t sequence;      // The newer slot has the later (wrapping) sequence
+    CalData data;
+    uint32_t crc;           // CRC32 of everything before it
+};
+
+// The two slots, past the older layout
+#define CALSTORE_EE_BASE 1088
+#define CALSTORE_EE_SLOT(slot) (CALSTORE_EE_BASE + ((slot) * sizeof(CalBlob)))
+static_assert(CALSTORE_EE_BASE >= LEGACY_EE_END, "calibration slots overlap the older layout");
+static_assert(CALSTORE_EE_SLOT(2) <= CALSTORE_EE_END, "calibration slots run into the records after them");
+static_assert(CALSTORE_EE_END <= E2END + 1, "calibration slots don't fit in EEPROM");
+
+static CalBlob m_blob;          // Newest blob loaded or saved
+static int m_slot = -1;         // Slot it is in, -1 if neither holds one
+
+
+static bool blob_valid(const CalBlob *blob) {
+    return blob->magic == CALSTORE_MAGIC && blob->version == CALSTORE_VERSION &&
+           blob->channels == NUMBER_OF_THERMISTORS && blob->points == CAL_MAX_POINTS &&
+           blob->crc == crc32(blob, offsetof(CalBlob, crc));
+}
+
+
+/*
+Reads the calibration in the older layout, if there is any.
+*/
+static bool load_legacy(CalData *data) {
+    uint8_t taken = EEPROM.read(LEGACY_EE_POINTS);
+    if (taken == 0xFF) {
+        taken = (EEPROM.read(LEGACY_EE_FLAG) == 0x01) ? 0x03 : 0x00;
+    }
+    if (taken == 0) {
+        return false;
+    }
+    memset(data, 0, sizeof(*data));
+    data->taken = taken;
+    for (int point = 0; point < CAL_MAX_POINTS; point++) {
+        if (!(taken & (1 << point))) {
+            continue;
+        }
+        if (point < 2) {
+            EEPROM.get(LEGACY_EE_REFS + (point * sizeof(float)), data->ref[point]);
+        }
+        else {
+            EEPROM.get(LEGACY_EE_EXTRA_REFS + ((point - 2) * sizeof(float)), data->ref[point]);
+        }
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            if (point < 2) {
+                EEPROM.get(LEGACY_EE_RAW(channel) + (point * sizeof(float)), data->raw[channel][point]);
+            }
+            else {
+                EEPROM.get(LEGACY_EE_EXTRA_RAW(channel) + ((point - 2) * sizeof(float)), data->raw[channel][point]);
+            }
+        }
+    }
+    return true;
+}
+
+
+/*
+Loads the newest valid calibration blob into data, migrating calibration saved by
+older firmware if neither slot holds one. Returns false, with no points taken,
+if there is no calibration to load.
+*/
+bool calstore_load(CalData *data) {
+    CalBlob blob;
+    bool corrupt = false;
+    m_slot = -1;
+    for (int slot = 0; slot < 2; slot++) {
+        EEPROM.get(CALSTORE_EE_SLOT(slot), blob);
+        if (!blob_valid(&blob)) {
+            corrupt |= blob.magic == CALSTORE_MAGIC;
+            continue;
+        }
+        if (m_slot < 0 || (int16_t)(blob.sequence - m_blob.sequence) > 0) {
+            m_blob = blob;
+            m_slot = slot;
+        }
+    }
+    if (m_slot >= 0) {
+        if (corrupt) {
+            LogWarn("A calibration copy in EEPROM is corrupt; using the other.");
+        }
+        *data = m_blob.data;
+        return true;
+    }
+    if (corrupt) {
+        LogError("Calibration data in EEPROM is corrupt; running uncalibrated.");
+    }
+    else if (load_legacy(data)) {
+        if (calstore_save(data)) {
+            // The older copy is not read again
+            EEPROM.update(LEGACY_EE_FLAG, 0x00);
+            EEPROM.update(LEGACY_EE_POINTS, 0x00);
+            LogInfo("Calibration data moved to the versioned EEPROM layout.");
+        }
+        return true;
+    }
+    memset(data, 0, sizeof(*data));
+    return false;
+}
+
+
+/*
+Saves data over the older of the two copies and reads it back. Returns false,
+leaving the previous copy in use, if it didn't read back intact.
+*/
+bool calstore_save(const CalData *data) {
+    int slot = (m_slot == 0) ? 1 : 0;
+    uint16_t sequence = (m_slot >= 0) ? m_blob.sequence + 1 : 0;
+    CalBlob blob;
+    // Padding is zeroed too, so the CRC and the changed-byte writes are repeatable
+    memset(&blob, 0, sizeof(blob));
+    blob.magic = CALSTORE_MAGIC;
+    blob.version = CALSTORE_VERSION;
+    blob.channels = NUMBER_OF_THERMISTORS;
+    blob.points = CAL_MAX_POINTS;
+    blob.sequence = sequence;
+    memcpy(blob.data.ref, data->ref, sizeof(blob.data.ref));
+    memcpy(blob.data.raw, data->raw, sizeof(blob.data.raw));
+    blob.data.taken = data->taken;
+    blob.crc = crc32(&blob, offsetof(CalBlob, crc));
+    // EEPROM.put() only writes the bytes that differ
+    EEPROM.put(CALSTORE_EE_SLOT(slot), blob);
+
+    CalBlob check;
+    EEPROM.get(CALSTORE_EE_SLOT(slot), check);
+    if (memcmp(&check, &blob, sizeof(blob)) != 0) {
+        LogError("Calibration data didn't read back from EEPROM.");
+        return false;
+    }
+    m_blob = blob;
+    m_slot = slot;
+    return true;
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_calstore.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration persistence definitions and function prototypes. The
+ * calibration points are kept in EEPROM as one versioned, CRC32-checked blob.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CALSTORE_H
+#define THERMISTORMUX_CALSTORE_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "command_ADC.h"
+
+// The calibration points taken: their reference temperatures and each
+// thermistor's uncalibrated reading at them
+struct CalData {
+    float ref[CAL_MAX_POINTS];
+    float raw[NUMBER_OF_THERMISTORS][CAL_MAX_POINTS];
+    uint8_t taken;      // Bit n for point n + 1
+};
+
+// First EEPROM address past the calibration slots, for the records after them
+#define CALSTORE_EE_END 3328
+
+bool calstore_load(CalData *data);
+bool calstore_save(const CalData *data);
+
+#endif
@@ -0,0 +1,195 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_calupload.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration upload. An upload is little-endian:
+ *      magic    uint16  0x5543 ("CU")
+ *      version  uint8   CAL_UPLOAD_VERSION
+ *      form     uint8   CalUploadForm
+ *      channels uint8   NUMBER_OF_THERMISTORS
+ *      points   uint8   calibration points it makes, 2 to CAL_MAX_POINTS
+ *      reserved uint16  0
+ *      body             by form, float32 values, thermistor 1 first:
+ *          points:         ref[points], then raw[points] per thermistor
+ *          linear:         gain, offset per thermistor (points must be 2)
+ *          Steinhart-Hart: low, high, then a, b, c per thermistor
+ *      crc      uint32  CRC32 of everything before it
+ * Every form is turned into the calibration points the reference point sweeps
+ * take, so it is saved and converted the same way. The linear form makes points
+ * at 0 and 100 °C; the Steinhart-Hart one spreads its points evenly from low to
+ * high °C, each at the resistance the coefficients give and the reading the
+ * channel's sensor model makes of it. A thermistor with NAN for its values is
+ * left uncalibrated. References must rise, and so must each thermistor's raw
+ * readings with them.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_calupload.h"
+#include "thermistorMux_crc.h"
+#include "command_ADC.h"
+#include <math.h>
+#include <string.h>
+
+#define CAL_UPLOAD_MAGIC   0x5543   // "CU"
+#define CAL_UPLOAD_VERSION 1
+#define CAL_UPLOAD_CRC     4
+
+// Temperatures, °C, beyond any calibration the thermistors can take
+#define CAL_UPLOAD_MIN_C   -100.0f
+#define CAL_UPLOAD_MAX_C   300.0f
+
+// Where the linear form puts its points
+static const float linearRefs[2] = {0.0f, 100.0f};
+
+
+static bool temp_valid(float temp) {
+    return temp >= CAL_UPLOAD_MIN_C && temp <= CAL_UPLOAD_MAX_C;
+}
+
+
+static float get_float(const uint8_t *blob, size_t *pos) {
+    float value;
+    memcpy(&value, &blob[*pos], sizeof(value));
+    *pos += sizeof(value);
+    return value;
+}
+
+
+/*
+Resistance, ohms, at which Steinhart-Hart coefficients a, b and c give temp °C:
+the real root ln(R) of c ln(R)^3 + b ln(R) + a - 1/T = 0. NAN if there is none.
+*/
+static double steinhart_hart_ohms(double a, double b, double c, float temp) {
+    double y = a - (1 / (temp + 273.15));
+    if (c == 0) {
+        return (b != 0) ? exp(-y / b) : NAN;
+    }
+    double p = b / c;
+    double q = y / c;
+    double disc = ((q * q) / 4) + ((p * p * p) / 27);
+    if (!(disc >= 0)) {
+        return NAN;
+    }
+    double root = sqrt(disc);
+    return exp(cbrt((-q / 2) + root) + cbrt((-q / 2) - root));
+}
+
+
+// Body bytes of each form, by the points it makes
+static size_t body_size(int form, int points) {
+    switch (form) {
+    case CAL_UPLOAD_POINTS:
+        return (points + (NUMBER_OF_THERMISTORS * points)) * sizeof(float);
+    case CAL_UPLOAD_LINEAR:
+        return NUMBER_OF_THERMISTORS * 2 * sizeof(float);
+    default:
+        return (2 + (NUMBER_OF_THERMISTORS * 3)) * sizeof(float);
+    }
+}
+
+
+/*
+Decodes and checks an upload (see the file comment) into data, every point it
+makes taken. Returns false, leaving data unchanged, for a malformed upload or
+one that doesn't make a usable calibration of every thermistor.
+*/
+bool calupload_decode(const uint8_t *blob, size_t size, CalData *data) {
+    if (size < CAL_UPLOAD_HEADER + CAL_UPLOAD_CRC || blob[0] != (CAL_UPLOAD_MAGIC & 0xFF) ||
+        blob[1] != (CAL_UPLOAD_MAGIC >> 8) || blob[2] != CAL_UPLOAD_VERSION) {
+        return false;
+    }
+    int form = blob[3];
+    int points = blob[5];
+    if (form >= NUM_CAL_UPLOAD_FORMS || blob[4] != NUMBER_OF_THERMISTORS || points < 2 || points > CAL_MAX_POINTS ||
+        (form == CAL_UPLOAD_LINEAR && points != 2) ||
+        size != CAL_UPLOAD_HEADER + body_size(form, points) + CAL_UPLOAD_CRC) {
+        return false;
+    }
+    uint32_t crc;
+    memcpy(&crc, &blob[size - CAL_UPLOAD_CRC], sizeof(crc));
+    if (crc != crc32(blob, size - CAL_UPLOAD_CRC)) {
+        return false;
+    }
+
+    // Values are little-endian, as is the Cortex-M7
+    static CalData decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    decoded.taken = (1 << points) - 1;
+    size_t pos = CAL_UPLOAD_HEADER;
+    if (form == CAL_UPLOAD_POINTS) {
+        for (int point = 0; point < points; point++) {
+            decoded.ref[point] = get_float(blob, &pos);
+        }
+    }
+    else if (form == CAL_UPLOAD_LINEAR) {
+        memcpy(decoded.ref, linearRefs, sizeof(linearRefs));
+    }
+    else {
+        float low = get_float(blob, &pos);
+        float high = get_float(blob, &pos);
+        for (int point = 0; point < points; point++) {
+            decoded.ref[point] = low + ((high - low) * point / (points - 1));
+        }
+    }
+    for (int point = 0; point < points; point++) {
+        if (!temp_valid(decoded.ref[point]) || (point > 0 && !(decoded.ref[point] > decoded.ref[point - 1]))) {
+            return false;
+        }
+    }
+
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        float *raw = decoded.raw[channel];
+        bool uncalibrated = false;
+        if (form == CAL_UPLOAD_POINTS) {
+            for (int point = 0; point < points; point++) {
+                raw[point] = get_float(blob, &pos);
+            }
+            uncalibrated = isnan(raw[0]);
+        }
+        else if (form == CAL_UPLOAD_LINEAR) {
+            float gain = get_float(blob, &pos);
+            float offset = get_float(blob, &pos);
+            uncalibrated = isnan(gain);
+            for (int point = 0; point < points && !uncalibrated; point++) {
+                raw[point] = (gain > 0) ? (decoded.ref[point] - offset) / gain : NAN;
+            }
+        }
+        else {
+            double a = get_float(blob, &pos);
+            double b = get_float(blob, &pos);
+            double c = get_float(blob, &pos);
+            uncalibrated = isnan(a);
+            for (int point = 0; point < points && !uncalibrated; point++) {
+                raw[point] = channel_model_temp(channel, steinhart_hart_ohms(a, b, c, decoded.ref[point]));
+            }
+        }
+        // Left as read, the thermistor's raw temperature
+        if (uncalibrated) {
+            memcpy(raw, decoded.ref, points * sizeof(float));
+            continue;
+        }
+        for (int point = 0; point < points; point++) {
+            if (!temp_valid(raw[point]) || (point > 0 && !(raw[point] > raw[point - 1]))) {
+                return false;
+            }
+        }
+    }
+    *data = decoded;
+    return true;
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_calupload.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Calibration upload definitions and function prototypes. A host with
+ * known sensor coefficients writes every thermistor's calibration in one blob
+ * (Node Control/Calibration Upload) instead of taking reference points.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CALUPLOAD_H
+#define THERMISTORMUX_CALUPLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_calstore.h"
+
+// How an upload gives each thermistor's calibration
+enum CalUploadForm {
+    CAL_UPLOAD_POINTS,          // Reference temperatures and each thermistor's raw reading at them
+    CAL_UPLOAD_LINEAR,          // Gain and offset: temp = (gain * raw temp) + offset
+    CAL_UPLOAD_STEINHART_HART,  // The thermistor's own Steinhart-Hart coefficients
+    NUM_CAL_UPLOAD_FORMS
+};
+
+// Largest upload: the points form with every point
+#define CAL_UPLOAD_HEADER   8
+#define CAL_UPLOAD_MAX_SIZE (CAL_UPLOAD_HEADER + ((CAL_MAX_POINTS + (NUMBER_OF_THERMISTORS * CAL_MAX_POINTS)) * 4) + 4)
+
+bool calupload_decode(const uint8_t *blob, size_t size, CalData *data);
+
+#endif
@@ -0,0 +1,64 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_channels.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-thermistor state shared by the conversion and publishing stages (see thermistorMux_channels.h).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_channels.h"
+
+// Zeroed at start-up, in DTCM with the rest of .bss
+ChannelState Channels;
+
+
+/*
+Conversion side. Marks the frame as being written, before any of it changes.
+*/
+void channels_frame_begin() {
+    Channels.frame_seq = Channels.frame_seq + 1;
+    // The odd sequence must be visible before the frame starts to change
+    __sync_synchronize();
+}
+
+
+/*
+Conversion side. Stamps the frame with the read time of its last sample, the
+next frame number, the thermistors it took (its bank's, or ALL_CHANNELS_MASK)
+and whether its bank ends the frame, and marks it complete.
+*/
+void channels_frame_end(uint64_t cycles, ChannelMask part, bool last) {
+    Channels.frame_cycles = cycles;
+    Channels.frame_part = part;
+    Channels.frame_last = last;
+    Channels.frame_number = Channels.frame_number + 1;
+    // Frame and stamp must be in memory before the even sequence is
+    __sync_synchronize();
+    Channels.frame_seq = Channels.frame_seq + 1;
+}
+
+
+/*
+Reader side. True if the frame read after seeing frame_seq == seq is complete:
+no conversion was under way when seq was read, and none has begun since.
+*/
+bool channels_frame_complete(uint32_t seq) {
+    // Finish reading the frame before looking at the sequence again
+    __sync_synchronize();
+    return (seq & 1) == 0 && Channels.frame_seq == seq;
+}
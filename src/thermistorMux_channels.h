@@ -0,0 +1,85 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_channels.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-thermistor state shared by the conversion and publishing stages, laid out as one array per quantity so each stage sweeps contiguous memory.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CHANNELS_H
+#define THERMISTORMUX_CHANNELS_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_virtual.h"
+
+/*
+State of every thermistor, thermistor order. Each stage of the frame pipeline
+only touches its own arrays (conversion writes frame, codes and pass, adaptive
+sampling reads frame, publishing reads frame, codes and deadband_*), so a sweep
+over one quantity doesn't drag the others through the cache.
+
+The thermistor metrics point straight at frame, so a converted frame goes to the
+encoder without being copied (with USE_QUANTIZED_NDATA they point at quantized,
+which publish_data() scales it into). The conversion writes it between
+channels_frame_begin() and channels_frame_end(), which make frame_seq odd
+meanwhile, seqlock style: a reader that finds it odd, or changed after reading,
+has seen a partial frame. Conversion and publishing run back to back in one
+scheduler pass today, so publish_data() only checks, and never has to wait.
+*/
+struct ChannelState {
+    // Conversion (thermistor_Mux.cpp), and the thermistor metrics
+    ThermistorValue frame[NUMBER_OF_THERMISTORS];       // Last averaged frame; THERMISTOR_NULL while faulted
+    volatile uint32_t frame_seq;                        // Frames begun and ended; odd while frame is written
+    uint64_t frame_cycles;                              // time_cycles64() stamp of the frame's last sample
+    uint64_t frame_number;                              // Frames converted, carried across warm reboots
+    ChannelMask frame_part;                             // Thermistors the frame's bank took, ALL_CHANNELS_MASK for whole frames
+    bool frame_last;                                    // The frame's bank was the last, or the frame is whole
+    int32_t codes[NUMBER_OF_THERMISTORS];               // The frame's codes as converted; RAW_CODE_NULL while faulted
+    float pass[NUMBER_OF_THERMISTORS];                  // Last pass, for the alarm checks, °C
+    // Adaptive sampling (thermistor_Mux.cpp)
+    float change[NUMBER_OF_THERMISTORS];                // Smoothed |temperature change| per pass, °C
+    float fresh_temp[NUMBER_OF_THERMISTORS];            // Temperature of the last fresh frame, °C
+    uint32_t fresh_pass[NUMBER_OF_THERMISTORS];         // Pass of the last fresh frame, 0 = none yet
+    uint8_t interval[NUMBER_OF_THERMISTORS];            // Passes between scans
+    uint16_t depth[NUMBER_OF_THERMISTORS];              // Samples a frame needs to meet the target noise, 0 = unknown
+    // Publishing (thermistorMux_network.cpp)
+    bool faulted[NUMBER_OF_THERMISTORS];                // The channel template Fault members
+    float virtual_frame[MAX_VIRTUAL_CHANNELS];          // Virtual channels of frame, °C; NAN if undefined or unread
+#ifdef USE_QUANTIZED_NDATA
+    int16_t quantized[NUMBER_OF_THERMISTORS];           // frame as published, read by the thermistor metrics
+#endif
+    // Report by exception; the extra entries are the ADC temperature, then the
+    // virtual channels (see DEADBAND_VIRTUAL())
+    float deadband_value[NUMBER_OF_THERMISTORS + 1 + MAX_VIRTUAL_CHANNELS];    // Last value published, °C
+    unsigned long long deadband_time[NUMBER_OF_THERMISTORS + 1 + MAX_VIRTUAL_CHANNELS];  // When, ms; 0 = publish with the next frame
+    // Predictive deadband: the line through the last two values published
+    unsigned long long predict_time[NUMBER_OF_THERMISTORS + 1 + MAX_VIRTUAL_CHANNELS];   // When the last was, ms; 0 = since the birth
+    float predict_slope[NUMBER_OF_THERMISTORS + 1 + MAX_VIRTUAL_CHANNELS];     // °C/ms
+};
+
+// Deadband entry of virtual channel v + 1
+#define DEADBAND_VIRTUAL(v)  (NUMBER_OF_THERMISTORS + 1 + (v))
+
+extern ChannelState Channels;
+
+void channels_frame_begin();
+void channels_frame_end(uint64_t cycles, ChannelMask part, bool last);
+bool channels_frame_complete(uint32_t seq);
+
+#endif
@@ -0,0 +1,254 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_config.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Node configuration blob. A blob is little-endian:
+ *      magic    uint16  0x434E ("NC")
+ *      version  uint8   CONFIG_VERSION
+ *      length   uint8   bytes of records that follow
+ *      records          key uint8, size uint8, value (see ConfigKey)
+ *      crc      uint32  CRC32 of everything before it
+ * A blob written by the host need only carry the settings it changes; the
+ * others keep their values. The node always encodes every setting, so the blob
+ * it publishes, saves and hashes describes it completely. The blob is kept in
+ * EEPROM after the alarm limits, or with USE_CONFIG_JOURNAL in a journal of
+ * blobs in program flash (see thermistorMux_journal.h). The calibration, sensor
+ * models and alarm limits have records of their own and aren't part of it.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_config.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_journal.h"
+#include "thermistorMux_log.h"
+#include <EEPROM.h>
+#include <math.h>
+#include <string.h>
+
+#define CONFIG_MAGIC    0x434E      // "NC"
+#define CONFIG_VERSION  1
+#define CONFIG_HEADER   4
+#define CONFIG_CRC      4
+
+#define CONFIG_EE_BASE ALARM_EE_END
+static_assert(CONFIG_EE_END <= E2END + 1, "node configuration doesn't fit in EEPROM");
+
+// Where each key's value lives in a NodeConfig, and its size in the blob
+struct ConfigField {
+    uint8_t offset;
+    uint8_t size;
+};
+
+#define CONFIG_FIELD(member) {offsetof(NodeConfig, member), sizeof(((NodeConfig *)0)->member)}
+static const ConfigField configFields[NUM_CONFIG_KEYS] = {
+    {0, 0},
+    CONFIG_FIELD(deadband),
+    CONFIG_FIELD(deadband_percent),
+    CONFIG_FIELD(heartbeat_ms),
+    CONFIG_FIELD(averaging_passes),
+    CONFIG_FIELD(frame_period_ms),
+    CONFIG_FIELD(osr),
+    CONFIG_FIELD(dwell_samples),
+    CONFIG_FIELD(channel_mask),
+    CONFIG_FIELD(quiet_interval),
+    CONFIG_FIELD(temp_interval),
+    CONFIG_FIELD(spike_filter),
+    CONFIG_FIELD(stats_window),
+    CONFIG_FIELD(compression_bytes),
+    CONFIG_FIELD(ref_interval),
+    CONFIG_FIELD(settling_us),
+    CONFIG_FIELD(scan_list),
+    CONFIG_FIELD(frame_banks),
+};
+
+// Every key and its record, magic and length included, must fit
+static_assert(CONFIG_HEADER + (NUM_CONFIG_KEYS - 1) * 2 + sizeof(NodeConfig) + CONFIG_CRC <= CONFIG_BLOB_SIZE,
+              "CONFIG_BLOB_SIZE can't hold every setting");
+static_assert(CONFIG_BLOB_SIZE - CONFIG_HEADER - CONFIG_CRC <= 255, "record length doesn't fit its byte");
+static_assert(sizeof(NodeConfig) <= 255, "field offsets don't fit their byte");
+
+
+/*
+True if key in a NodeConfig is a float.
+*/
+static bool key_is_float(int key) {
+    return key == CONFIG_DEADBAND || key == CONFIG_DEADBAND_PERCENT;
+}
+
+
+/*
+Reads the settings of a blob of size bytes over config, leaving the settings it
+doesn't carry as they are. Returns false, changing nothing, if the blob is
+malformed, of another version, fails its CRC, repeats a key, has a key or value
+size this firmware doesn't know, or a float that isn't finite. Only the format
+is checked here; whether the values make sense is up to the settings' setters.
+*/
+bool config_decode(const uint8_t *blob, size_t size, NodeConfig *config) {
+    if (size < CONFIG_HEADER + CONFIG_CRC || blob[0] != (CONFIG_MAGIC & 0xFF) || blob[1] != (CONFIG_MAGIC >> 8) ||
+        blob[2] != CONFIG_VERSION || CONFIG_HEADER + (size_t)blob[3] + CONFIG_CRC != size) {
+        return false;
+    }
+    uint32_t crc;
+    memcpy(&crc, &blob[size - CONFIG_CRC], sizeof(crc));
+    if (crc != crc32(blob, size - CONFIG_CRC)) {
+        return false;
+    }
+
+    // Values are little-endian, as is the Cortex-M7
+    NodeConfig decoded = *config;
+    uint32_t seen = 0;
+    size_t pos = CONFIG_HEADER;
+    size_t end = size - CONFIG_CRC;
+    while (pos < end) {
+        if (end - pos < 2) {
+            return false;
+        }
+        int key = blob[pos];
+        size_t length = blob[pos + 1];
+        pos += 2;
+        if (key <= 0 || key >= NUM_CONFIG_KEYS || (seen & (1u << key)) != 0 ||
+            length != configFields[key].size || end - pos < length) {
+            return false;
+        }
+        seen |= 1u << key;
+        if (key_is_float(key)) {
+            float value;
+            memcpy(&value, &blob[pos], sizeof(value));
+            if (!isfinite(value)) {
+                return false;
+            }
+        }
+        memcpy((uint8_t *)&decoded + configFields[key].offset, &blob[pos], length);
+        pos += length;
+    }
+    *config = decoded;
+    return true;
+}
+
+
+/*
+Writes every setting of config as a blob of at most size bytes. Returns the
+blob's size, 0 if it doesn't fit.
+*/
+size_t config_encode(const NodeConfig *config, uint8_t *blob, size_t size) {
+    return config_encode_changes(NULL, config, blob, size);
+}
+
+
+/*
+Writes the settings of config that differ from base as a blob of at most size
+bytes, every setting if base is NULL. Returns the blob's size, 0 if it doesn't
+fit. With nothing changed the blob carries no records.
+*/
+size_t config_encode_changes(const NodeConfig *base, const NodeConfig *config, uint8_t *blob, size_t size) {
+    size_t pos = CONFIG_HEADER;
+    for (int key = 1; key < NUM_CONFIG_KEYS; key++) {
+#ifndef USE_REF_TRACKING
+        if (key == CONFIG_REF_INTERVAL) {
+            continue;
+        }
+#endif
+        size_t length = configFields[key].size;
+        if (base != NULL && memcmp((const uint8_t *)base + configFields[key].offset,
+                                   (const uint8_t *)config + configFields[key].offset, length) == 0) {
+            continue;
+        }
+        if (pos + 2 + length + CONFIG_CRC > size) {
+            return 0;
+        }
+        blob[pos] = (uint8_t)key;
+        blob[pos + 1] = (uint8_t)length;
+        memcpy(&blob[pos + 2], (const uint8_t *)config + configFields[key].offset, length);
+        pos += 2 + length;
+    }
+    blob[0] = CONFIG_MAGIC & 0xFF;
+    blob[1] = CONFIG_MAGIC >> 8;
+    blob[2] = CONFIG_VERSION;
+    blob[3] = (uint8_t)(pos - CONFIG_HEADER);
+    uint32_t crc = crc32(blob, pos);
+    memcpy(&blob[pos], &crc, sizeof(crc));
+    return pos + CONFIG_CRC;
+}
+
+
+/*
+The CRC of config's blob, as config_encode() writes it: the same settings give
+the same hash on every node of this build.
+*/
+uint32_t config_hash(const NodeConfig *config) {
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    size_t size = config_encode(config, blob, sizeof(blob));
+    uint32_t crc;
+    memcpy(&crc, &blob[size - CONFIG_CRC], sizeof(crc));
+    return crc;
+}
+
+
+/*
+Reads the blob saved by config_save() over config. Returns false, changing
+nothing, for erased or corrupt EEPROM. With USE_CONFIG_JOURNAL the journal is
+read instead, and a blob in EEPROM only if the journal is empty, to carry it
+over.
+*/
+bool config_load(NodeConfig *config) {
+#ifdef USE_CONFIG_JOURNAL
+    if (journal_load(config)) {
+        return true;
+    }
+#endif
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    EEPROM.get(CONFIG_EE_BASE, blob);
+    uint16_t magic = blob[0] | (blob[1] << 8);
+    size_t size = CONFIG_HEADER + (size_t)blob[3] + CONFIG_CRC;
+    if (magic != CONFIG_MAGIC) {
+        // Never saved
+        return false;
+    }
+    if (size > sizeof(blob) || !config_decode(blob, size, config)) {
+        LogWarn("Node configuration in EEPROM is corrupt; using the defaults.");
+        return false;
+    }
+#ifdef USE_CONFIG_JOURNAL
+    journal_save(config);
+#endif
+    return true;
+}
+
+
+/*
+Saves every setting of config as one blob, in a single EEPROM write, or with
+USE_CONFIG_JOURNAL appends the settings that changed to the journal.
+*/
+bool config_save(const NodeConfig *config) {
+#ifdef USE_CONFIG_JOURNAL
+    return journal_save(config);
+#else
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    memset(blob, 0xFF, sizeof(blob));
+    config_encode(config, blob, sizeof(blob));
+    // EEPROM.put() only writes the bytes that differ
+    EEPROM.put(CONFIG_EE_BASE, blob);
+    uint8_t check[CONFIG_BLOB_SIZE];
+    EEPROM.get(CONFIG_EE_BASE, check);
+    if (memcmp(check, blob, sizeof(check)) != 0) {
+        LogError("Node configuration didn't save to EEPROM.");
+        return false;
+    }
+    return true;
+#endif
+}
@@ -0,0 +1,92 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_config.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Node configuration blob: the node's tunables as one versioned binary
+ * record, written by one NCMD, applied together and kept in EEPROM.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CONFIG_H
+#define THERMISTORMUX_CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_alarm.h"
+#include "thermistorMux_acquisition.h"
+
+// Largest blob, header to CRC
+#define CONFIG_BLOB_SIZE 256
+
+// EEPROM kept for the blob, after the alarm limits
+#define CONFIG_EE_SIZE  CONFIG_BLOB_SIZE
+#define CONFIG_EE_END   (ALARM_EE_END + CONFIG_EE_SIZE)
+
+// Record keys of the blob. Numbers are never reused; a new setting takes the
+// next one.
+enum ConfigKey {
+    CONFIG_DEADBAND = 1,            // float, °C
+    CONFIG_DEADBAND_PERCENT,        // float, %
+    CONFIG_HEARTBEAT_MS,            // uint32
+    CONFIG_AVERAGING_PASSES,        // uint32
+    CONFIG_FRAME_PERIOD_MS,         // uint32
+    CONFIG_ADC_OSR,                 // uint32
+    CONFIG_DWELL_SAMPLES,           // uint32
+    CONFIG_CHANNEL_MASK,            // uint64, bit n for thermistor n
+    CONFIG_QUIET_INTERVAL,          // uint32, passes
+    CONFIG_TEMP_INTERVAL,           // uint32, passes
+    CONFIG_SPIKE_FILTER,            // uint8, SpikeFilter
+    CONFIG_STATS_WINDOW,            // uint32, frames
+    CONFIG_COMPRESSION_BYTES,       // uint32
+    CONFIG_REF_INTERVAL,            // uint32, passes; only applied with USE_REF_TRACKING
+    CONFIG_SETTLING_US,             // uint16 per thermistor, µs
+    CONFIG_SCAN_LIST,               // ScanEntry per entry, MAX_SCAN_ENTRIES
+    CONFIG_FRAME_BANKS,             // uint32
+    NUM_CONFIG_KEYS
+};
+
+// The settings a blob carries
+struct NodeConfig {
+    float deadband;
+    float deadband_percent;
+    uint32_t heartbeat_ms;
+    uint32_t averaging_passes;
+    uint32_t frame_period_ms;
+    uint32_t osr;
+    uint32_t dwell_samples;
+    uint64_t channel_mask;
+    uint32_t quiet_interval;
+    uint32_t temp_interval;
+    uint8_t spike_filter;
+    uint32_t stats_window;
+    uint32_t compression_bytes;
+    uint32_t ref_interval;
+    uint16_t settling_us[NUMBER_OF_THERMISTORS];
+    ScanEntry scan_list[MAX_SCAN_ENTRIES];
+    uint32_t frame_banks;
+};
+
+bool config_decode(const uint8_t *blob, size_t size, NodeConfig *config);
+size_t config_encode(const NodeConfig *config, uint8_t *blob, size_t size);
+size_t config_encode_changes(const NodeConfig *base, const NodeConfig *config, uint8_t *blob, size_t size);
+uint32_t config_hash(const NodeConfig *config);
+bool config_load(NodeConfig *config);
+bool config_save(const NodeConfig *config);
+
+#endif
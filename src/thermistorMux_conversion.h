@@ -0,0 +1,283 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_conversion.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Thermistor code conversion and calibration, header only and free of
+ * the Arduino core, so the firmware (see command_ADC.cpp) and the host tools
+ * convert a code with the same tables and arithmetic. A sensor model is made
+ * into a ThermistorConversion table once; codes are then converted one at a
+ * time by thermistor_lut_temp(), or a block at a time by convert_code_block(),
+ * whose table pass has no branches so a host compiler vectorizes it. The codes
+ * are sign extended 24 bit ADCDATA, as published in Inputs/Raw Codes.
+ *
+ * The default model follows thermistor_10K or thermistor_2K, and the tables
+ * hold milli-degree entries with USE_MILLIDEGREE_NDATA: in the firmware both
+ * come from thermistorMux_global.h, which a host tool includes first too.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CONVERSION_H
+#define THERMISTORMUX_CONVERSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+/*
+Resistance at 25 degrees C
+The beta coefficient of the thermistor (usually 3000-4000)
+*/
+#if defined(thermistor_10K)
+    #define THERMISTORNOMINAL 10000
+    #define BCOEFFICIENT 2.514458134e-4 // = 1/3977, B = 3997 K
+#elif defined(thermistor_2K)
+    #define THERMISTORNOMINAL 2200
+    #define BCOEFFICIENT 2.544529262e-4 // = 1/3930, B = 3930 K
+#endif
+
+// temp. for nominal resistance (almost always 25 C = 298.15 K)
+#define TEMPERATURENOMINAL 298.15
+
+/*
+The ADC's internal temperature diode, single precision and folded at compile
+time: the per-code math of convert_internal_temp(), the data sheet's transfer
+equation for V_ref = 3.3 V scaled to the board's 2.4 V.
+*/
+#define INTERNAL_TEMP_SCALE  (0.00133f * (2.4f / 3.3f))
+#define INTERNAL_TEMP_OFFSET (-267.146f)
+
+// A published code for a channel that has none: disabled or faulted
+#define RAW_CODE_NULL INT32_MIN
+
+// A thermistor and its divider, for converting one channel's codes (see
+// set_sensor_model()). The Beta equation, 1/T = 1/T_o + (1/B) ln(R/R_o), uses
+// nominal_ohms (R_o at 25 C) and beta; the Steinhart-Hart one,
+// 1/T = a + b ln(R) + c ln(R)^3, uses a, b and c, with nominal_ohms only setting
+// the open and short limits. The thermistor is the low side of the divider:
+// R = divider_ohms * V / (supply - V), V = code * vref / 2^23.
+enum SensorEquation {
+    SENSOR_BETA,
+    SENSOR_STEINHART_HART
+};
+
+struct SensorModel {
+    uint8_t equation;       // SensorEquation
+    float nominal_ohms;
+    float beta;             // K
+    float a, b, c;
+    float divider_ohms;
+    float vref;             // ADC reference, V
+    float supply;           // Divider supply, V
+};
+
+#ifdef THERMISTORNOMINAL
+//The build's thermistor, on the board's divider.
+static constexpr SensorModel DEFAULT_SENSOR_MODEL = {SENSOR_BETA, THERMISTORNOMINAL, (float)(1 / BCOEFFICIENT),
+                                                     0, 0, 0, 10000, 2.33f, 2.33f};
+#endif
+
+// Per-channel piecewise-linear calibration, see convert_thermistor_block_piecewise().
+// Segment s covers raw temperatures from start[s] up to start[s + 1] and maps
+// them to (gain[s] * T) + offset[s]. start[0] is -INFINITY and unused segments
+// start at +INFINITY, so the end segments extrapolate.
+#define CAL_MAX_POINTS  8
+#define CAL_SEGMENTS    8   // CAL_MAX_POINTS - 1 segments, padded to a power of 2
+struct CalSegments {
+    float start[CAL_SEGMENTS];
+    float gain[CAL_SEGMENTS];
+    float offset[CAL_SEGMENTS];
+};
+
+/*
+Thermistor temperature lookup tables, one per sensor model: entry i holds the
+exact temperature at code i * 2^THERM_LUT_SHIFT; codes in between are linearly
+interpolated.
+Max interpolation error against the exact equation between -40 and 125 C:
+    thermistor_10K: 0.005 C
+    thermistor_2K:  0.09 C
+Codes in the first and last segments (beyond ~+300 C / -80 C) use the exact
+equation. With USE_MILLIDEGREE_NDATA each table also holds its entries as whole
+milli-degrees, interpolated in integers.
+*/
+#define THERM_LUT_BITS  10
+#define THERM_LUT_SIZE  (1 << THERM_LUT_BITS)
+#define THERM_LUT_SHIFT (23 - THERM_LUT_BITS)
+
+//A sensor model, ready for conversion: the table, and the Steinhart-Hart form of
+//its equation for the end segments.
+struct ThermistorConversion {
+    float temp[THERM_LUT_SIZE];
+#ifdef USE_MILLIDEGREE_NDATA
+    int32_t mdeg[THERM_LUT_SIZE];
+#endif
+    float volts_per_code;
+    float supply;
+    float divider_ohms;
+    float a, b, c;
+    int32_t open_code;
+    int32_t short_code;
+};
+
+/*
+Thermistor resistance ratios R/R_o beyond which the input can't be a working
+thermistor: ~-60 C and ~+290 C for either thermistor. As codes,
+    code = 2^23 * (supply / vref) * (r * R_o) / (divider + r * R_o)
+*/
+#define OPEN_RATIO  200.0
+#define SHORT_RATIO 0.002
+
+//Compile time natural log: ln(x) = k*ln(2) + 2*atanh((m-1)/(m+1)), x = m * 2^k, m in [1,2)
+constexpr double constexpr_log(double x) {
+    int k = 0;
+    while (x >= 2.0) {
+        x /= 2.0;
+        k++;
+    }
+    while (x < 1.0) {
+        x *= 2.0;
+        k--;
+    }
+    double y = (x - 1.0) / (x + 1.0);
+    double y2 = y * y;
+    double term = y;
+    double sum = 0.0;
+    for (int n = 1; n < 60; n += 2) {
+        sum += term / n;
+        term *= y2;
+    }
+    return (k * 0.69314718055994530942) + (2.0 * sum);
+}
+
+constexpr int32_t resistance_code(const SensorModel &sensor, double ohms) {
+    return (int32_t)(8388608.0 * ((double)sensor.supply / sensor.vref) * ohms / (sensor.divider_ohms + ohms));
+}
+
+//Runs at compile time for the default model and from set_sensor_model() for the others.
+constexpr void make_thermistor_conversion(const SensorModel &sensor, ThermistorConversion &table) {
+    double a = sensor.a, b = sensor.b, c = sensor.c;
+    if (sensor.equation == SENSOR_BETA) {
+        a = (1 / TEMPERATURENOMINAL) - (constexpr_log(sensor.nominal_ohms) / sensor.beta);
+        b = 1.0 / sensor.beta;
+        c = 0;
+    }
+    table.temp[0] = 0;
+    for (int i = 1; i < THERM_LUT_SIZE; i++) {
+        double voltage = (sensor.vref / 8388608.0) * ((double)i * (1 << THERM_LUT_SHIFT));
+        double thermistance = (voltage * sensor.divider_ohms) / (sensor.supply - voltage);
+        double ln_r = (thermistance > 0) ? constexpr_log(thermistance) : 0;
+        double temp = (1 / (a + (b * ln_r) + (c * ln_r * ln_r * ln_r))) - 273.15;
+        table.temp[i] = (float)temp;
+#ifdef USE_MILLIDEGREE_NDATA
+        table.mdeg[i] = (int32_t)((temp * 1000) + ((temp < 0) ? -0.5 : 0.5));
+#endif
+    }
+    table.volts_per_code = sensor.vref / 8388608.0f;
+    table.supply = sensor.supply;
+    table.divider_ohms = sensor.divider_ohms;
+    table.a = (float)a;
+    table.b = (float)b;
+    table.c = (float)c;
+    table.open_code = resistance_code(sensor, OPEN_RATIO * sensor.nominal_ohms);
+    table.short_code = resistance_code(sensor, SHORT_RATIO * sensor.nominal_ohms);
+}
+
+//24 bit two's complement code to int32
+static inline int32_t sign_extend_code(uint32_t masked_data) {
+    return ((int32_t)(masked_data << 8)) >> 8;
+}
+
+static inline bool code_saturated(uint32_t masked_data) {
+    return (masked_data == 0x007FFFFF) || (masked_data == 0x00800000);
+}
+
+//A sign extended code that has no temperature: saturated, or RAW_CODE_NULL
+static inline bool sign_extended_code_invalid(int32_t code) {
+    return (code >= 0x007FFFFF) || (code <= -0x00800000);
+}
+
+//The exact equation for one sign extended code.
+static inline float thermistor_exact_temp(const ThermistorConversion *table, int32_t code) {
+    float voltage = table->volts_per_code * (float)code;
+    float ln_r = logf((voltage * table->divider_ohms) / (table->supply - voltage));
+    return (1.0f / (table->a + (table->b * ln_r) + (table->c * ln_r * ln_r * ln_r))) - 273.15f;
+}
+
+//Table lookup for one sign extended code; exact equation in the end segments.
+static inline float thermistor_lut_temp(const ThermistorConversion *table, int32_t code) {
+    int32_t index = code >> THERM_LUT_SHIFT;
+    if (index >= 1 && index < THERM_LUT_SIZE - 1) {
+        float fraction = (float)(code & ((1 << THERM_LUT_SHIFT) - 1)) * (1.0f / (1 << THERM_LUT_SHIFT));
+        float low = table->temp[index];
+        return low + ((table->temp[index + 1] - low) * fraction);
+    }
+    return thermistor_exact_temp(table, code);
+}
+
+//Segment of a raw temperature: a fixed three step binary search over the
+//padded table, so the cost doesn't depend on the number of points. NAN falls in
+//segment 0 and stays NAN.
+static_assert(CAL_SEGMENTS == 8, "cal_segment() searches 8 segments");
+static inline unsigned int cal_segment(const CalSegments *cal, float temp) {
+    unsigned int s = (temp >= cal->start[4]) ? 4 : 0;
+    s += (temp >= cal->start[s + 2]) ? 2 : 0;
+    s += (temp >= cal->start[s + 1]) ? 1 : 0;
+    return s;
+}
+
+static inline float apply_cal_segments(const CalSegments *cal, float temp) {
+    unsigned int s = cal_segment(cal, temp);
+    return (cal->gain[s] * temp) + cal->offset[s];
+}
+
+/*
+Converts n sign extended codes, all of one sensor model, to uncalibrated
+temperatures, C. Every code is first interpolated in the table with its segment
+clamped, a pass without branches; the few in the end segments, and the invalid
+ones, are then redone with the exact equation or set to NAN. Returns the number
+of invalid codes.
+*/
+static inline size_t convert_code_block(const ThermistorConversion *table, const int32_t *codes, float *out,
+                                        size_t n) {
+    size_t ends = 0;
+    for (size_t i = 0; i < n; i++) {
+        int32_t code = codes[i];
+        int32_t index = code >> THERM_LUT_SHIFT;
+        int32_t segment = index < 1 ? 1 : (index > THERM_LUT_SIZE - 2 ? THERM_LUT_SIZE - 2 : index);
+        float fraction = (float)(code & ((1 << THERM_LUT_SHIFT) - 1)) * (1.0f / (1 << THERM_LUT_SHIFT));
+        float low = table->temp[segment];
+        out[i] = low + ((table->temp[segment + 1] - low) * fraction);
+        ends += (segment != index);
+    }
+    size_t invalid = 0;
+    for (size_t i = 0; ends > 0 && i < n; i++) {
+        int32_t index = codes[i] >> THERM_LUT_SHIFT;
+        if (index >= 1 && index < THERM_LUT_SIZE - 1) {
+            continue;
+        }
+        ends--;
+        if (sign_extended_code_invalid(codes[i])) {
+            out[i] = NAN;
+            invalid++;
+        } else {
+            out[i] = thermistor_exact_temp(table, codes[i]);
+        }
+    }
+    return invalid;
+}
+
+#endif
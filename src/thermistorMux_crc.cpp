@@ -0,0 +1,94 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_crc.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief CRC32 for the data kept in EEPROM and across resets, and the CRC-16 of
+ * the ADC's SPI frames.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_crc.h"
+#include <Arduino.h>
+
+
+// Standard (reflected, 0xEDB88320) CRC32 of each byte
+struct Crc32Table {
+    uint32_t entry[256];
+};
+
+static constexpr Crc32Table make_crc32_table() {
+    Crc32Table table = {};
+    for (int byte = 0; byte < 256; byte++) {
+        uint32_t crc = (uint32_t)byte;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+        table.entry[byte] = crc;
+    }
+    return table;
+}
+
+static constexpr Crc32Table crc32_table = make_crc32_table();
+
+
+/*
+Standard CRC32, table driven: besides the EEPROM records it checks every SD log
+segment, on the card and in the host tools reading the logs.
+*/
+uint32_t crc32(const void *buffer, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)buffer;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 8) ^ crc32_table.entry[(crc ^ bytes[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+
+// CRC-16 ANSI (polynomial x^16 + x^15 + x^2 + 1, 0x8005, MSB first) of each byte
+struct Crc16Table {
+    uint16_t entry[256];
+};
+
+static constexpr Crc16Table make_crc16_table() {
+    Crc16Table table = {};
+    for (int byte = 0; byte < 256; byte++) {
+        uint16_t crc = (uint16_t)(byte << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1);
+        }
+        table.entry[byte] = crc;
+    }
+    return table;
+}
+
+static constexpr Crc16Table crc16_table = make_crc16_table();
+
+
+/*
+CRC-16 ANSI from 0x0000, MSB first and unreflected, as the MCP3561 appends to
+its SPI reads with CRC on communications enabled. Table driven, a lookup per
+byte, as it checks every ADCDATA read from the interrupts.
+*/
+FASTRUN uint16_t crc16_ansi(const uint8_t *buffer, size_t size) {
+    uint16_t crc = 0x0000;
+    for (size_t i = 0; i < size; i++) {
+        crc = (uint16_t)(crc << 8) ^ crc16_table.entry[(crc >> 8) ^ buffer[i]];
+    }
+    return crc;
+}
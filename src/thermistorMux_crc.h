@@ -0,0 +1,34 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_crc.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief CRC32 for the data kept in EEPROM and across resets, and the CRC-16 of
+ * the ADC's SPI frames.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_CRC_H
+#define THERMISTORMUX_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32(const void *buffer, size_t size);
+uint16_t crc16_ansi(const uint8_t *buffer, size_t size);
+
+#endif
@@ -0,0 +1,269 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_dcp.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief AES-128 and SHA-256 on the DCP. Each call runs one or more work
+ * packets on channel 0 and waits for them. The DCP is a bus master that can't
+ * reach the tightly coupled memories, so data there, or not whole cache lines,
+ * goes through bounce buffers in DMAMEM; hashing keeps its state between
+ * packets in the DCP's context buffer. The host-native build runs the packets
+ * in software (native/src/sim_dcp.cpp).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_dcp.h"
+#include <Arduino.h>
+#include <string.h>
+
+// Work packet control words (see DcpPacket)
+#define DCP_CONTROL0_DECR_SEMAPHORE  (1u << 1)
+#define DCP_CONTROL0_ENABLE_CIPHER   (1u << 5)
+#define DCP_CONTROL0_ENABLE_HASH     (1u << 6)
+#define DCP_CONTROL0_CIPHER_ENCRYPT  (1u << 8)
+#define DCP_CONTROL0_CIPHER_INIT     (1u << 9)
+#define DCP_CONTROL0_PAYLOAD_KEY     (1u << 11)
+#define DCP_CONTROL0_HASH_INIT       (1u << 12)
+#define DCP_CONTROL0_HASH_TERM       (1u << 13)
+#define DCP_CONTROL1_AES128_CBC      (1u << 4)      // AES-128 cipher, CBC mode
+#define DCP_CONTROL1_SHA256          (2u << 16)
+#define DCP_STATUS_COMPLETE          (1u << 0)
+#define DCP_STATUS_ERRORS            0x7Eu
+
+// CTRL: context switching, so hashing resumes where the last packet left it
+#define DCP_CTRL_CONFIG   ((1u << 23) | (1u << 22) | (1u << 21))
+#define DCP_CHANNEL0      1u
+#define DCP_SEMA_VALUE(sema) (((sema) >> 16) & 0xFF)
+
+#define DCP_BOUNCE_SIZE   2048      // A whole number of SHA-256 blocks
+#define DCP_HASH_SIZE     65536     // Most hashed in place by one packet, well inside the timeout
+#define DCP_TIMEOUT_US    10000
+
+static DcpPacket m_packet DMAMEM __attribute__((aligned(32)));
+static uint32_t m_context[52] DMAMEM __attribute__((aligned(32)));   // All four channels'
+static uint8_t m_payload[2 * DCP_AES_BLOCK_SIZE] DMAMEM __attribute__((aligned(32)));  // Key and IV, or digest
+static uint8_t m_bounce_in[DCP_BOUNCE_SIZE] DMAMEM __attribute__((aligned(32)));
+static uint8_t m_bounce_out[DCP_BOUNCE_SIZE] DMAMEM __attribute__((aligned(32)));
+static bool m_ready = false;
+
+
+/*
+Turns the DCP's clock on and enables channel 0.
+*/
+bool dcp_init() {
+    CCM_CCGR0 |= CCM_CCGR0_DCP(CCM_CCGR_ON);
+    memset(m_context, 0, sizeof(m_context));
+    arm_dcache_flush(m_context, sizeof(m_context));
+    DCP_CTRL = DCP_CTRL_CONFIG;
+    DCP_CONTEXT = (uintptr_t)m_context;
+    DCP_CHANNELCTRL = DCP_CHANNEL0;
+    m_ready = true;
+    return true;
+}
+
+
+// Whether the DCP can read or write len bytes at p in place: not in ITCM or
+// DTCM, and whole cache lines, so invalidating them loses nothing else
+static bool in_place(const void *p, size_t len) {
+    uintptr_t address = (uintptr_t)p;
+    if (address < 0x00080000 || (address >= 0x20000000 && address < 0x20080000)) {
+        return false;
+    }
+    return address % 32 == 0 && len % 32 == 0;
+}
+
+
+// Runs the packet and waits for it; false on an error or timeout
+static bool run_packet() {
+    m_packet.next = 0;
+    m_packet.control0 |= DCP_CONTROL0_DECR_SEMAPHORE;
+    m_packet.status = 0;
+    arm_dcache_flush(&m_packet, sizeof(m_packet));
+    arm_dcache_flush(m_payload, sizeof(m_payload));
+    DCP_CH0CMDPTR = (uintptr_t)&m_packet;
+    DCP_CH0SEMA = 1;
+    uint32_t start = micros();
+    while (DCP_SEMA_VALUE(DCP_CH0SEMA) != 0) {
+        if (micros() - start > DCP_TIMEOUT_US) {
+            return false;
+        }
+    }
+    arm_dcache_delete(&m_packet, sizeof(m_packet));
+    arm_dcache_delete(m_payload, sizeof(m_payload));
+    return (m_packet.status & DCP_STATUS_COMPLETE) && !(m_packet.status & DCP_STATUS_ERRORS) &&
+           !(DCP_CH0STAT & DCP_STATUS_ERRORS);
+}
+
+
+/*
+SHA-256 of len bytes of data into digest. False if the DCP fails.
+*/
+bool dcp_sha256(const void *data, size_t len, uint8_t digest[DCP_SHA256_SIZE]) {
+    if (!m_ready) {
+        return false;
+    }
+    const uint8_t *bytes = (const uint8_t *)data;
+    bool direct = in_place(data, len);
+    size_t done = 0;
+    do {
+        size_t most = direct ? DCP_HASH_SIZE : DCP_BOUNCE_SIZE;
+        size_t chunk = (len - done < most) ? len - done : most;
+        const uint8_t *source = &bytes[done];
+        if (direct) {
+            arm_dcache_flush((void *)source, chunk);
+        } else {
+            memcpy(m_bounce_in, source, chunk);
+            arm_dcache_flush(m_bounce_in, chunk);
+            source = m_bounce_in;
+        }
+        m_packet.control0 = DCP_CONTROL0_ENABLE_HASH | (done == 0 ? DCP_CONTROL0_HASH_INIT : 0) |
+                            (done + chunk == len ? DCP_CONTROL0_HASH_TERM : 0);
+        m_packet.control1 = DCP_CONTROL1_SHA256;
+        m_packet.source = (uintptr_t)source;
+        m_packet.destination = 0;
+        m_packet.size = chunk;
+        m_packet.payload = (uintptr_t)m_payload;
+        if (!run_packet()) {
+            return false;
+        }
+        done += chunk;
+    } while (done < len);
+
+    // The DCP leaves the digest byte reversed
+    for (int i = 0; i < DCP_SHA256_SIZE; i++) {
+        digest[i] = m_payload[DCP_SHA256_SIZE - 1 - i];
+    }
+    return true;
+}
+
+
+/*
+AES-128-CBC of len bytes (a multiple of DCP_AES_BLOCK_SIZE) from in to out,
+which may be the same, encrypting or decrypting with key. iv is updated to the
+last ciphertext block, for the next call to chain from. False if the DCP fails.
+*/
+bool dcp_aes128_cbc(const uint8_t key[DCP_AES_BLOCK_SIZE], uint8_t iv[DCP_AES_BLOCK_SIZE], const uint8_t *in,
+                    uint8_t *out, size_t len, bool encrypt) {
+    if (!m_ready || len % DCP_AES_BLOCK_SIZE != 0) {
+        return false;
+    }
+    bool direct = in_place(in, len) && in_place(out, len);
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = direct ? len : (len - done < DCP_BOUNCE_SIZE ? len - done : DCP_BOUNCE_SIZE);
+        const uint8_t *source = &in[done];
+        uint8_t *destination = &out[done];
+        // Decrypting in place overwrites the last ciphertext block, so it's kept first
+        uint8_t next_iv[DCP_AES_BLOCK_SIZE] = {};
+        if (!encrypt) {
+            memcpy(next_iv, &source[chunk - DCP_AES_BLOCK_SIZE], DCP_AES_BLOCK_SIZE);
+        }
+        if (direct) {
+            arm_dcache_flush((void *)source, chunk);
+            arm_dcache_flush_delete(destination, chunk);
+        } else {
+            memcpy(m_bounce_in, source, chunk);
+            arm_dcache_flush(m_bounce_in, chunk);
+            arm_dcache_flush_delete(m_bounce_out, chunk);
+            source = m_bounce_in;
+            destination = m_bounce_out;
+        }
+        memcpy(m_payload, key, DCP_AES_BLOCK_SIZE);
+        memcpy(&m_payload[DCP_AES_BLOCK_SIZE], iv, DCP_AES_BLOCK_SIZE);
+        m_packet.control0 = DCP_CONTROL0_ENABLE_CIPHER | DCP_CONTROL0_CIPHER_INIT | DCP_CONTROL0_PAYLOAD_KEY |
+                            (encrypt ? DCP_CONTROL0_CIPHER_ENCRYPT : 0);
+        m_packet.control1 = DCP_CONTROL1_AES128_CBC;
+        m_packet.source = (uintptr_t)source;
+        m_packet.destination = (uintptr_t)destination;
+        m_packet.size = chunk;
+        m_packet.payload = (uintptr_t)m_payload;
+        if (!run_packet()) {
+            return false;
+        }
+        arm_dcache_delete(destination, chunk);
+        if (!direct) {
+            memcpy(&out[done], m_bounce_out, chunk);
+        }
+        if (encrypt) {
+            memcpy(iv, &out[done + chunk - DCP_AES_BLOCK_SIZE], DCP_AES_BLOCK_SIZE);
+        } else {
+            memcpy(iv, next_iv, DCP_AES_BLOCK_SIZE);
+        }
+        done += chunk;
+    }
+    return true;
+}
+
+
+/*
+Checks both against known answers: SHA-256 of "abc" (FIPS 180-2) and the first
+block of the AES-128-CBC example of NIST SP 800-38A, F.2.1, there and back.
+*/
+bool dcp_self_test() {
+    static const uint8_t sha256_abc[DCP_SHA256_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    static const uint8_t key[DCP_AES_BLOCK_SIZE] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    static const uint8_t iv[DCP_AES_BLOCK_SIZE] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    static const uint8_t plaintext[DCP_AES_BLOCK_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    static const uint8_t ciphertext[DCP_AES_BLOCK_SIZE] = {
+        0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d};
+
+    uint8_t digest[DCP_SHA256_SIZE];
+    if (!dcp_sha256("abc", 3, digest) || memcmp(digest, sha256_abc, sizeof(digest)) != 0) {
+        return false;
+    }
+    uint8_t chain[DCP_AES_BLOCK_SIZE];
+    uint8_t block[DCP_AES_BLOCK_SIZE];
+    memcpy(chain, iv, sizeof(chain));
+    if (!dcp_aes128_cbc(key, chain, plaintext, block, sizeof(block), true) ||
+        memcmp(block, ciphertext, sizeof(block)) != 0) {
+        return false;
+    }
+    memcpy(chain, iv, sizeof(chain));
+    return dcp_aes128_cbc(key, chain, ciphertext, block, sizeof(block), false) &&
+           memcmp(block, plaintext, sizeof(block)) == 0;
+}
+
+
+/*
+Time, microseconds, to encrypt a DCP_RECORD_SIZE record with AES-128-CBC and
+hash it with SHA-256, as a TLS record of a large NDATA would be; 0 if the DCP
+fails. The record is in RAM2, where the outbound queues are, so it's done in
+place.
+*/
+float dcp_record_us() {
+    static uint8_t record[DCP_RECORD_SIZE] DMAMEM __attribute__((aligned(32)));
+    uint8_t key[DCP_AES_BLOCK_SIZE];
+    uint8_t iv[DCP_AES_BLOCK_SIZE];
+    uint8_t digest[DCP_SHA256_SIZE];
+    for (size_t i = 0; i < sizeof(record); i++) {
+        record[i] = (uint8_t)i;
+    }
+    memset(key, 0x5A, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+
+    uint32_t start = ARM_DWT_CYCCNT;
+    bool ok = dcp_sha256(record, sizeof(record), digest) &&
+              dcp_aes128_cbc(key, iv, record, record, sizeof(record), true);
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    return ok ? cycles * (1e6f / F_CPU_ACTUAL) : 0.0f;
+}
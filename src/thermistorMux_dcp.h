@@ -0,0 +1,55 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_dcp.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief AES-128 and SHA-256 on the i.MX RT1062's Data Co-Processor (DCP): the
+ * symmetric crypto and hashing of a TLS record, off the CPU.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_DCP_H
+#define THERMISTORMUX_DCP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DCP_AES_BLOCK_SIZE   16
+#define DCP_SHA256_SIZE      32
+// Record timed by dcp_record_us(): a TLS record of a large NDATA
+#define DCP_RECORD_SIZE      2048
+
+// A DCP work packet, as the DCP reads it from memory
+struct DcpPacket {
+    uintptr_t next;             // Next packet of a chain, 0 for none
+    uint32_t control0;          // Operation and flags
+    uint32_t control1;          // Cipher, mode and hash selected
+    uintptr_t source;
+    uintptr_t destination;
+    uint32_t size;              // Bytes of source
+    uintptr_t payload;          // Key and IV in, or the digest out
+    volatile uint32_t status;   // Written back by the DCP
+};
+
+bool dcp_init();
+bool dcp_sha256(const void *data, size_t len, uint8_t digest[DCP_SHA256_SIZE]);
+bool dcp_aes128_cbc(const uint8_t key[DCP_AES_BLOCK_SIZE], uint8_t iv[DCP_AES_BLOCK_SIZE], const uint8_t *in,
+                    uint8_t *out, size_t len, bool encrypt);
+bool dcp_self_test();
+float dcp_record_us();
+
+#endif
@@ -0,0 +1,130 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_delta.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Delta coding of raw ADC codes and their times for the UDP stream and
+ * the SD log. Differences wrap around, so every code and time is coded exactly.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_delta.h"
+#include <string.h>
+
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+
+/*
+Reads a varint of at most max bytes from the size bytes at in. Returns the
+bytes read, 0 if it runs off the end or is too long.
+*/
+static size_t get_varint(const uint8_t *in, size_t size, size_t max, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t n = 0; n < size && n < max; n++) {
+        result |= (uint64_t)(in[n] & 0x7F) << (7 * n);
+        if ((in[n] & 0x80) == 0) {
+            *value = result;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+
+// Zigzag maps small differences of either sign to small numbers: 0, -1, 1, -2...
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+/*
+Starts a block whose times are coded from time, with every slot's last code 0.
+*/
+void delta_reset(DeltaCoder *coder, uint64_t time) {
+    memset(coder->code, 0, sizeof(coder->code));
+    coder->time = time;
+    coder->step = 0;
+}
+
+
+/*
+Codes one of slot's codes at out. Returns the bytes written, at most
+DELTA_MAX_CODE_SIZE.
+*/
+size_t delta_put_code(DeltaCoder *coder, uint8_t *out, unsigned int slot, uint32_t code) {
+    int32_t delta = (int32_t)(code - coder->code[slot]);
+    coder->code[slot] = code;
+    return put_varint(out, zigzag(delta));
+}
+
+
+/*
+Codes a time at out. Returns the bytes written (one while the step is steady),
+at most DELTA_MAX_TIME_SIZE.
+*/
+size_t delta_put_time(DeltaCoder *coder, uint8_t *out, uint64_t time) {
+    uint64_t step = time - coder->time;
+    int64_t change = (int64_t)(step - coder->step);
+    coder->time = time;
+    coder->step = step;
+    return put_varint(out, zigzag(change));
+}
+
+
+/*
+Reads one of slot's codes coded by delta_put_code() from the size bytes at in.
+Returns the bytes read, 0 if the coding is cut short or malformed.
+*/
+size_t delta_get_code(DeltaCoder *coder, const uint8_t *in, size_t size, unsigned int slot, uint32_t *code) {
+    uint64_t value;
+    size_t n = get_varint(in, size, DELTA_MAX_CODE_SIZE, &value);
+    if (n > 0) {
+        coder->code[slot] += (uint32_t)unzigzag(value);
+        *code = coder->code[slot];
+    }
+    return n;
+}
+
+
+/*
+Reads a time coded by delta_put_time() from the size bytes at in. Returns the
+bytes read, 0 if the coding is cut short or malformed.
+*/
+size_t delta_get_time(DeltaCoder *coder, const uint8_t *in, size_t size, uint64_t *time) {
+    uint64_t value;
+    size_t n = get_varint(in, size, DELTA_MAX_TIME_SIZE, &value);
+    if (n > 0) {
+        coder->step += (uint64_t)unzigzag(value);
+        coder->time += coder->step;
+        *time = coder->time;
+    }
+    return n;
+}
@@ -0,0 +1,54 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_delta.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Delta coding of raw ADC codes and their times for the UDP stream and
+ * the SD log. Each code is coded as its difference from the last code of the
+ * same scan slot, and each time as the change in its step from the last time,
+ * so a sample on a steady channel at the frame period takes a byte or two
+ * instead of a full code and timestamp. Both are zigzag varints: 7 bits a byte,
+ * low bits first, the top bit set on all but the last byte.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_DELTA_H
+#define THERMISTORMUX_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thermistorMux_acquisition.h"
+
+// Longest coding of a code and of a time
+#define DELTA_MAX_CODE_SIZE 5
+#define DELTA_MAX_TIME_SIZE 10
+
+// Coding state of one block. Blocks are coded on their own, so each datagram or
+// segment can be read without the ones before it.
+struct DeltaCoder {
+    uint32_t code[SLOTS_PER_PASS];  // Last code of each scan slot
+    uint64_t time;                  // Last time
+    uint64_t step;                  // Last time minus the one before it
+};
+
+void delta_reset(DeltaCoder *coder, uint64_t time);
+size_t delta_put_code(DeltaCoder *coder, uint8_t *out, unsigned int slot, uint32_t code);
+size_t delta_put_time(DeltaCoder *coder, uint8_t *out, uint64_t time);
+size_t delta_get_code(DeltaCoder *coder, const uint8_t *in, size_t size, unsigned int slot, uint32_t *code);
+size_t delta_get_time(DeltaCoder *coder, const uint8_t *in, size_t size, uint64_t *time);
+
+#endif
@@ -0,0 +1,344 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_drift.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief ADC die temperature compensation. The converter's offset and gain
+ * drift with its die temperature, and every thermistor reads off by much the
+ * same amount, so one model does for the board: the error is
+ * slope * u + curve * u², u being the die temperature less the reference one,
+ * at which the readings were true. Each calibration point sets the reference to
+ * the die temperature it was taken at.
+ *
+ * A drift capture fits the model. With the thermistors held at steady
+ * temperatures while the board's ambient swings (a bath, or a soak in a
+ * chamber), every frame adds each captured thermistor's change since its first
+ * reading against the die temperature's change to least squares sums; a pass
+ * over them at the end gives the fit, a quadratic if the die temperature swung
+ * over DRIFT_QUADRATIC_SPAN_C and a line otherwise. The model is saved in
+ * EEPROM, and can also be written directly as "slope,curve[,reference]" (°C
+ * per °C, °C per °C², °C), "-" for none.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_drift.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_log.h"
+#include <EEPROM.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DRIFT_MAGIC   0x5244        // "DR"
+#define DRIFT_VERSION 1
+
+// Coefficients and die temperatures beyond these can't be meant for the board
+#define DRIFT_MAX_SLOPE     10.0f
+#define DRIFT_MAX_CURVE     1.0f
+#define DRIFT_MIN_DIE_C     -40.0f
+#define DRIFT_MAX_DIE_C     125.0f
+
+struct DriftRecord {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t reserved;
+    float slope;            // °C per °C of die temperature
+    float curve;            // °C per °C²
+    float reference;        // Die temperature the readings were true at, °C; NAN until there is one
+    uint32_t crc;           // CRC32 of everything before it
+};
+
+#define DRIFT_EE_BASE CONFIG_EE_END
+static_assert(sizeof(DriftRecord) <= DRIFT_EE_SIZE, "drift model record runs into the records after it");
+static_assert(DRIFT_EE_END <= E2END + 1, "drift model doesn't fit in EEPROM");
+
+// Least squares sums of a capture: x is the die temperature's change since the
+// capture began, y a thermistor's change since its first reading
+struct DriftSums {
+    double n, x, x2, x3, x4, y, xy, x2y;
+};
+
+static DriftRecord m_record;
+static bool m_capturing = false;
+static DriftSums m_sums;
+static unsigned int m_frames = 0;
+static float m_start_die = NAN;
+static float m_min_die = 0;
+static float m_max_die = 0;
+static float m_base[NUMBER_OF_THERMISTORS];     // NAN until the thermistor's first reading
+
+
+static bool model_valid(float slope, float curve) {
+    return fabsf(slope) <= DRIFT_MAX_SLOPE && fabsf(curve) <= DRIFT_MAX_CURVE;
+}
+
+
+static bool die_valid(float die_temp) {
+    return die_temp >= DRIFT_MIN_DIE_C && die_temp <= DRIFT_MAX_DIE_C;
+}
+
+
+static void save_record() {
+    m_record.crc = crc32(&m_record, offsetof(DriftRecord, crc));
+    EEPROM.put(DRIFT_EE_BASE, m_record);
+}
+
+
+/*
+Restores the model saved by the last capture or drift_set_model(). Erased or
+corrupt EEPROM leaves the readings uncompensated.
+*/
+void drift_load() {
+    EEPROM.get(DRIFT_EE_BASE, m_record);
+    if (m_record.magic != DRIFT_MAGIC || m_record.version != DRIFT_VERSION ||
+        m_record.crc != crc32(&m_record, offsetof(DriftRecord, crc)) ||
+        !model_valid(m_record.slope, m_record.curve) ||
+        !(isnan(m_record.reference) || die_valid(m_record.reference))) {
+        if (m_record.magic == DRIFT_MAGIC) {
+            LogWarn("Drift model in EEPROM is corrupt; readings are uncompensated.");
+        }
+        memset(&m_record, 0, sizeof(m_record));
+        m_record.magic = DRIFT_MAGIC;
+        m_record.version = DRIFT_VERSION;
+        m_record.reference = NAN;
+    }
+}
+
+
+/*
+Sets and saves the model from text (see the file comment); without a reference
+the one in use is kept. Returns false, changing nothing, for a malformed or out
+of range value.
+*/
+bool drift_set_model(const char *text) {
+    float slope = 0;
+    float curve = 0;
+    float reference = m_record.reference;
+    char dash;
+    int used = 0;
+    if (sscanf(text, " %c %n", &dash, &used) == 1 && dash == '-' && text[used] == '\0') {
+        slope = 0;
+    }
+    else {
+        int values = sscanf(text, " %f , %f %n", &slope, &curve, &used);
+        if (values != 2) {
+            return false;
+        }
+        if (text[used] == ',') {
+            int more = 0;
+            if (sscanf(&text[used + 1], " %f %n", &reference, &more) != 1 || !die_valid(reference)) {
+                return false;
+            }
+            used += 1 + more;
+        }
+        if (text[used] != '\0' || !model_valid(slope, curve)) {
+            return false;
+        }
+    }
+    m_record.slope = slope;
+    m_record.curve = curve;
+    m_record.reference = reference;
+    save_record();
+    return true;
+}
+
+
+/*
+Writes the model as drift_set_model() takes it, "-" if there is none.
+*/
+void drift_format_model(char *buffer, size_t size) {
+    if (m_record.slope == 0 && m_record.curve == 0) {
+        snprintf(buffer, size, "-");
+    }
+    else if (isnan(m_record.reference)) {
+        snprintf(buffer, size, "%g,%g", m_record.slope, m_record.curve);
+    }
+    else {
+        snprintf(buffer, size, "%g,%g,%g", m_record.slope, m_record.curve, m_record.reference);
+    }
+}
+
+
+/*
+Takes die_temp as the die temperature the readings are true at, from a
+calibration point, re-centering the model on it.
+*/
+void drift_set_reference(float die_temp) {
+    if (!die_valid(die_temp) || die_temp == m_record.reference) {
+        return;
+    }
+    if (!isnan(m_record.reference)) {
+        m_record.slope += 2 * m_record.curve * (die_temp - m_record.reference);
+    }
+    m_record.reference = die_temp;
+    save_record();
+}
+
+
+/*
+Error of the readings at a die temperature, °C, to subtract from them; 0 with no
+model, no reference or an invalid die temperature.
+*/
+float drift_correction(float die_temp) {
+    float u = die_temp - m_record.reference;
+    if (!(fabsf(u) <= DRIFT_MAX_DIE_C - DRIFT_MIN_DIE_C)) {
+        return 0;
+    }
+    return (m_record.slope + m_record.curve * u) * u;
+}
+
+
+/*
+Starts a drift capture, dropping any unfinished one.
+*/
+void drift_capture_start() {
+    memset(&m_sums, 0, sizeof(m_sums));
+    m_frames = 0;
+    m_start_die = NAN;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        m_base[channel] = NAN;
+    }
+    m_capturing = true;
+}
+
+
+bool drift_capturing() {
+    return m_capturing;
+}
+
+
+/*
+Adds the uncompensated readings of channels from a converted frame, and the die
+temperature it was converted at, to the capture. Null readings are left out.
+*/
+void drift_capture_frame(const ThermistorValue *frame, ChannelMask channels, float die_temp) {
+    if (!m_capturing || !die_valid(die_temp)) {
+        return;
+    }
+    if (isnan(m_start_die)) {
+        m_start_die = die_temp;
+        m_min_die = die_temp;
+        m_max_die = die_temp;
+    }
+    m_min_die = fminf(m_min_die, die_temp);
+    m_max_die = fmaxf(m_max_die, die_temp);
+    double x = die_temp - m_start_die;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (!(channels & CHANNEL_BIT(channel)) || thermistor_null(frame[channel])) {
+            continue;
+        }
+        float temp = thermistor_celsius(frame[channel]);
+        if (isnan(m_base[channel])) {
+            m_base[channel] = temp;
+        }
+        double y = temp - m_base[channel];
+        m_sums.n += 1;
+        m_sums.x += x;
+        m_sums.x2 += x * x;
+        m_sums.x3 += x * x * x;
+        m_sums.x4 += x * x * x * x;
+        m_sums.y += y;
+        m_sums.xy += x * y;
+        m_sums.x2y += x * x * y;
+    }
+    m_frames++;
+}
+
+
+/*
+Solves the n by n system a x = b in place by Gaussian elimination with partial
+pivoting. Returns false if it is singular.
+*/
+static bool solve(double a[3][3], double b[3], int n) {
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < n; row++) {
+            if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+                pivot = row;
+            }
+        }
+        if (fabs(a[pivot][col]) < 1e-12) {
+            return false;
+        }
+        for (int k = 0; k < n; k++) {
+            double t = a[col][k];
+            a[col][k] = a[pivot][k];
+            a[pivot][k] = t;
+        }
+        double t = b[col];
+        b[col] = b[pivot];
+        b[pivot] = t;
+        for (int row = col + 1; row < n; row++) {
+            double f = a[row][col] / a[col][col];
+            for (int k = col; k < n; k++) {
+                a[row][k] -= f * a[col][k];
+            }
+            b[row] -= f * b[col];
+        }
+    }
+    for (int row = n - 1; row >= 0; row--) {
+        for (int k = row + 1; k < n; k++) {
+            b[row] -= a[row][k] * b[k];
+        }
+        b[row] /= a[row][row];
+    }
+    return true;
+}
+
+
+/*
+Ends the capture and fits the model to it, saving it centered on the reference
+die temperature (the capture's first, if no calibration point has set one).
+Returns false, keeping the model in use, if the capture had too few frames, too
+little swing of the die temperature or a fit out of range.
+*/
+bool drift_capture_finish() {
+    if (!m_capturing) {
+        return false;
+    }
+    m_capturing = false;
+    float span = m_max_die - m_min_die;
+    if (m_frames < DRIFT_MIN_FRAMES || !(span >= DRIFT_MIN_SPAN_C)) {
+        LogWarn("Drift capture of %u frames over %.2f °C of die temperature is too short to fit.", m_frames,
+                isnan(m_start_die) ? 0.0f : span);
+        return false;
+    }
+    int terms = span >= DRIFT_QUADRATIC_SPAN_C ? 3 : 2;
+    double a[3][3] = {{m_sums.n, m_sums.x, m_sums.x2},
+                      {m_sums.x, m_sums.x2, m_sums.x3},
+                      {m_sums.x2, m_sums.x3, m_sums.x4}};
+    double b[3] = {m_sums.y, m_sums.xy, m_sums.x2y};
+    if (!solve(a, b, terms)) {
+        LogWarn("Drift capture couldn't be fitted.");
+        return false;
+    }
+    double slope = b[1];
+    double curve = terms == 3 ? b[2] : 0;
+    float reference = isnan(m_record.reference) ? m_start_die : m_record.reference;
+    // The fit is of the change since the start; the error is 0 at the reference
+    slope += 2 * curve * (reference - m_start_die);
+    if (!model_valid((float)slope, (float)curve)) {
+        LogWarn("Drift fit of %g °C/°C, %g °C/°C² is out of range.", slope, curve);
+        return false;
+    }
+    m_record.slope = (float)slope;
+    m_record.curve = (float)curve;
+    m_record.reference = reference;
+    save_record();
+    LogInfo("Drift fitted over %.2f °C of die temperature: %g °C/°C, %g °C/°C².", span, slope, curve);
+    return true;
+}
@@ -0,0 +1,58 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_drift.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Board compensation of the ADC's drift with its die temperature: a
+ * linear or quadratic model of the thermistor reading error against the
+ * MCP3561 internal temperature, fitted by a drift capture and subtracted from
+ * every converted frame.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_DRIFT_H
+#define THERMISTORMUX_DRIFT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_config.h"
+
+// A capture needs at least this many frames, over at least this span of die
+// temperature, °C; over DRIFT_QUADRATIC_SPAN_C it is fitted with a quadratic
+#define DRIFT_MIN_FRAMES        30
+#define DRIFT_MIN_SPAN_C        2.0f
+#define DRIFT_QUADRATIC_SPAN_C  10.0f
+
+// Longest text of drift_format_model(), "-1.23456e-05," per value
+#define DRIFT_MODEL_TEXT_SIZE   48
+
+// EEPROM kept for the model, after the node configuration
+#define DRIFT_EE_SIZE  20
+#define DRIFT_EE_END   (CONFIG_EE_END + DRIFT_EE_SIZE)
+
+void drift_load();
+bool drift_set_model(const char *text);
+void drift_format_model(char *buffer, size_t size);
+void drift_set_reference(float die_temp);
+float drift_correction(float die_temp);
+void drift_capture_start();
+bool drift_capture_finish();
+bool drift_capturing();
+void drift_capture_frame(const ThermistorValue *frame, ChannelMask channels, float die_temp);
+
+#endif
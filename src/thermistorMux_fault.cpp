@@ -0,0 +1,133 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_fault.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Open/short thermistor detection. Every pass is checked for saturated or
+ * implausible codes; a channel that keeps giving them is faulted and skipped by
+ * the scan, which speeds up the passes for the rest. A faulted channel rejoins
+ * the scan for a pass every FAULT_REPROBE_MS and is cleared once it reads
+ * plausibly again.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-27
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_fault.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_log.h"
+
+// Consecutive bad passes before a channel is faulted, and good passes before a
+// faulted channel is cleared
+#define FAULT_CONFIRM_PASSES 3
+#define FAULT_CLEAR_PASSES   3
+// Time between re-probes of a faulted channel
+#define FAULT_REPROBE_MS     10000
+
+struct ChannelFault {
+    ThermistorFault fault;      // THERMISTOR_OK unless faulted
+    uint8_t bad_passes;         // Consecutive bad readings
+    uint8_t good_passes;        // Consecutive good readings while faulted
+    unsigned long next_probe;   // millis() when a skipped channel is next scanned
+};
+
+static ChannelFault m_channels[NUMBER_OF_THERMISTORS];
+static ChannelMask m_fault_mask = 0;    // Faulted channels
+static ChannelMask m_skip_mask = 0;     // Faulted channels currently left out of the scan
+
+
+static const char *fault_name(ThermistorFault fault) {
+    return fault == THERMISTOR_OPEN ? "open" : "shorted";
+}
+
+
+/*
+Checks the thermistors scanned in one pass (bit n of channels for thermistor n)
+and updates their fault state, then updates which faulted channels the scan
+skips: those not being re-probed or recovering.
+*/
+void fault_check_pass(const uint32_t *raw_data, ChannelMask channels) {
+    unsigned long now = millis();
+    ChannelMask skip = m_skip_mask;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        ChannelMask bit = CHANNEL_BIT(channel);
+        if (!(channels & bit)) {
+            continue;
+        }
+        ChannelFault *state = &m_channels[channel];
+        ThermistorFault fault = classify_thermistor_code(channel, raw_data[channel]);
+        if (fault == THERMISTOR_OK) {
+            state->bad_passes = 0;
+            if (state->fault != THERMISTOR_OK && ++state->good_passes >= FAULT_CLEAR_PASSES) {
+                LogInfo("Thermistor %d no longer %s.", channel + 1, fault_name(state->fault));
+                state->fault = THERMISTOR_OK;
+                m_fault_mask &= ~bit;
+            }
+            continue;
+        }
+        state->good_passes = 0;
+        if (state->fault == THERMISTOR_OK) {
+            if (++state->bad_passes < FAULT_CONFIRM_PASSES) {
+                continue;
+            }
+            state->fault = fault;
+            m_fault_mask |= bit;
+            LogWarn("Thermistor %d %s, re-probing every %d s.", channel + 1, fault_name(fault),
+                    FAULT_REPROBE_MS / 1000);
+        }
+        state->next_probe = now + FAULT_REPROBE_MS;
+        skip |= bit;
+    }
+
+    // Skipped channels due a re-probe rejoin the scan until their next reading
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        ChannelMask bit = CHANNEL_BIT(channel);
+        if ((skip & bit) && (long)(now - m_channels[channel].next_probe) >= 0) {
+            skip &= ~bit;
+        }
+    }
+    if (skip != m_skip_mask) {
+        m_skip_mask = skip;
+        acquisition_set_skip_mask(skip);
+    }
+}
+
+
+/*
+Clears every channel's fault state and puts them all back in the scan.
+*/
+void fault_reset() {
+    memset(m_channels, 0, sizeof(m_channels));
+    m_fault_mask = 0;
+    m_skip_mask = 0;
+    acquisition_set_skip_mask(0);
+}
+
+
+/*
+Faulted channels, bit n for thermistor n.
+*/
+ChannelMask fault_mask() {
+    return m_fault_mask;
+}
+
+
+ThermistorFault fault_state(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return THERMISTOR_OK;
+    }
+    return m_channels[channel].fault;
+}
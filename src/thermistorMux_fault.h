@@ -0,0 +1,38 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_fault.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Open/short thermistor detection definitions and function prototypes.
+ * A faulted channel is left out of the scan and only re-probed occasionally,
+ * and its temperature is published as null.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-27
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_FAULT_H
+#define THERMISTORMUX_FAULT_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "command_ADC.h"
+
+void fault_check_pass(const uint32_t *raw_data, ChannelMask channels);
+void fault_reset();
+ChannelMask fault_mask();
+ThermistorFault fault_state(int channel);
+
+#endif
@@ -0,0 +1,386 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_filter.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel streaming filters over raw ADC codes. Codes are sign extended
+ * from 24 bits and filtered in integer arithmetic. Saturated codes (see
+ * Mcp3561::read()) are left out; a channel with no valid samples in a frame outputs
+ * a saturated code so the conversion still flags it.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-19
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_filter.h"
+#include "thermistorMux_acquisition.h"
+
+#define CODE_POSITIVE_SATURATION 0x007FFFFF
+#define CODE_NEGATIVE_SATURATION 0x00800000
+
+// IIR state is kept with this many fractional bits
+#define IIR_FRACTION_BITS 16
+
+// Hampel threshold: 3 standard deviations, taken as 1.4826 MADs each (89/20 MADs
+// in all), but never below SPIKE_MIN_THRESHOLD codes, so a quiet channel's
+// noise isn't taken for spikes
+#define HAMPEL_MADS_NUM     89
+#define HAMPEL_MADS_DEN     20
+#define SPIKE_MIN_THRESHOLD 64
+
+// Each channel's noise is estimated from the differences of its successive
+// codes, which a slow drift barely adds to: half their mean square is the
+// variance of one code. The mean is taken over ~1/NOISE_SMOOTHING codes, and
+// there's no estimate until NOISE_MIN_CODES have been seen.
+#define NOISE_SMOOTHING 0.02f
+#define NOISE_MIN_CODES 16
+
+// Per-channel filter state
+struct ChannelFilter {
+    int64_t sum;                            // Boxcar/moving average accumulator
+    int64_t iir;                            // IIR output, IIR_FRACTION_BITS fraction
+    int32_t window[FILTER_MAX_LENGTH];      // Moving average/median history
+    uint8_t next;                           // Next window entry to write
+    uint8_t count;                          // Valid samples in window/accumulator
+    bool    iir_primed;
+    bool    fresh;                          // Sampled since the last frame
+    uint32_t last;                          // Last frame output, CODE_NEGATIVE_SATURATION if none
+    int32_t spike[SPIKE_WINDOW];            // Last codes, for the spike filter
+    uint8_t spike_next;                     // Next spike entry to write
+    uint8_t spike_count;                    // Codes in spike
+    int32_t noise_last;                     // Last code, for the noise estimate
+    uint32_t noise_codes;                   // Codes seen by the noise estimate
+    float noise_square;                     // Smoothed squared difference of successive codes
+};
+
+static ChannelFilter m_channels[SLOTS_PER_PASS];
+static FilterType m_type = FILTER_BOXCAR;
+static int m_length = FILTER_MAX_LENGTH;
+static int32_t m_alpha = 1 << (IIR_FRACTION_BITS - 2);     // 0.25
+static SpikeFilter m_spike = SPIKE_OFF;
+
+static const char *const spike_names[NUM_SPIKE_FILTERS] = {"Off", "Median", "Hampel"};
+
+
+// 24 bit two's complement code to int32
+static inline int32_t sign_extend(uint32_t raw_data) {
+    return ((int32_t)(raw_data << 8)) >> 8;
+}
+
+
+static inline uint32_t to_code(int32_t value) {
+    return ((uint32_t)value) & 0x00FFFFFF;
+}
+
+
+/*
+Selects the filter applied to every channel and clears its state.
+length: window for FILTER_MOVING_AVERAGE and FILTER_MEDIAN (1..FILTER_MAX_LENGTH).
+alpha: FILTER_IIR smoothing factor (0 < alpha <= 1).
+Returns false, leaving the filter unchanged, if a parameter is out of range.
+*/
+bool filter_configure(FilterType type, int length, float alpha) {
+    if ((type == FILTER_MOVING_AVERAGE || type == FILTER_MEDIAN) &&
+        (length < 1 || length > FILTER_MAX_LENGTH)) {
+        return false;
+    }
+    if (type == FILTER_IIR && !(alpha > 0.0f && alpha <= 1.0f)) {
+        return false;
+    }
+    m_type = type;
+    if (type == FILTER_MOVING_AVERAGE || type == FILTER_MEDIAN) {
+        m_length = length;
+    }
+    if (type == FILTER_IIR) {
+        m_alpha = (int32_t)(alpha * (1 << IIR_FRACTION_BITS) + 0.5f);
+    }
+    filter_reset();
+    return true;
+}
+
+
+FilterType filter_type() {
+    return m_type;
+}
+
+
+/*
+Selects the spike filter applied to every channel's codes before the filter
+(and before the frame average): none, a median of 5, or Hampel rejection, which
+only replaces the codes more than 3 standard deviations (from the median
+absolute deviation) off the median of 5. Either takes out an isolated spike
+without raising the averaging depth to hide it; the median also delays a step by
+2 samples and Hampel mostly doesn't. The window restarts, so the first codes after
+a change go through as they are.
+*/
+void filter_set_spike(SpikeFilter spike) {
+    if (spike < SPIKE_OFF || spike >= NUM_SPIKE_FILTERS) {
+        return;
+    }
+    m_spike = spike;
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        m_channels[slot].spike_count = 0;
+        m_channels[slot].spike_next = 0;
+    }
+}
+
+
+SpikeFilter filter_spike() {
+    return m_spike;
+}
+
+
+const char *filter_spike_name(SpikeFilter spike) {
+    if (spike < SPIKE_OFF || spike >= NUM_SPIKE_FILTERS) {
+        return "";
+    }
+    return spike_names[spike];
+}
+
+
+/*
+Spike filter with the given name, -1 if there is none.
+*/
+int filter_find_spike(const char *name) {
+    for (int spike = 0; spike < NUM_SPIKE_FILTERS; spike++) {
+        if (strcmp(name, spike_names[spike]) == 0) {
+            return spike;
+        }
+    }
+    return -1;
+}
+
+
+void filter_reset() {
+    memset(m_channels, 0, sizeof(m_channels));
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        m_channels[slot].last = CODE_NEGATIVE_SATURATION;
+    }
+}
+
+
+// Orders a and b, branch free
+static inline void sort_pair(int32_t &a, int32_t &b) {
+    int32_t low = a < b ? a : b;
+    b = a < b ? b : a;
+    a = low;
+}
+
+
+/*
+Median of SPIKE_WINDOW values, by a fixed sorting network of 7 compare-exchanges
+(only as far as the middle element is placed), so the cost doesn't depend on the
+data.
+*/
+static inline int32_t median5(const int32_t *values) {
+    int32_t v0 = values[0], v1 = values[1], v2 = values[2], v3 = values[3], v4 = values[4];
+    sort_pair(v0, v1);
+    sort_pair(v3, v4);
+    sort_pair(v0, v3);
+    sort_pair(v1, v4);
+    sort_pair(v1, v2);
+    sort_pair(v2, v3);
+    sort_pair(v1, v2);
+    return v2;
+}
+
+static_assert(SPIKE_WINDOW == 5, "median5() sorts SPIKE_WINDOW values");
+
+
+/*
+Passes a channel's code through the spike filter: adds it to the window and
+returns the code to filter in its place. Codes go through as they are until the
+window is full.
+*/
+static inline int32_t reject_spike(ChannelFilter *filter, int32_t code) {
+    filter->spike[filter->spike_next] = code;
+    filter->spike_next = (filter->spike_next + 1 == SPIKE_WINDOW) ? 0 : filter->spike_next + 1;
+    if (filter->spike_count < SPIKE_WINDOW) {
+        filter->spike_count++;
+        return code;
+    }
+    int32_t middle = median5(filter->spike);
+    if (m_spike == SPIKE_MEDIAN) {
+        return middle;
+    }
+    int32_t deviation[SPIKE_WINDOW];
+    for (int i = 0; i < SPIKE_WINDOW; i++) {
+        deviation[i] = abs(filter->spike[i] - middle);
+    }
+    int32_t threshold = (int32_t)(((int64_t)median5(deviation) * HAMPEL_MADS_NUM) / HAMPEL_MADS_DEN);
+    if (threshold < SPIKE_MIN_THRESHOLD) {
+        threshold = SPIKE_MIN_THRESHOLD;
+    }
+    return abs(code - middle) > threshold ? middle : code;
+}
+
+
+/*
+Adds a code, as filtered, to the channel's noise estimate. The first codes are
+averaged evenly, so the estimate doesn't start out near 0.
+*/
+static inline void track_noise(ChannelFilter *filter, int32_t code) {
+    if (filter->noise_codes > 0) {
+        float difference = (float)(code - filter->noise_last);
+        float alpha = 1.0f / filter->noise_codes;
+        if (alpha < NOISE_SMOOTHING) {
+            alpha = NOISE_SMOOTHING;
+        }
+        filter->noise_square += alpha * (difference * difference - filter->noise_square);
+    }
+    filter->noise_last = code;
+    filter->noise_codes++;
+}
+
+
+/*
+Adds one scan pass (SLOTS_PER_PASS raw ADCDATA values) to the filters. Only the
+thermistors in channels (bit n for thermistor n) and the internal temperature
+were scanned; the other slots are left alone. Codes go through the spike filter
+first.
+*/
+void filter_add_pass(const uint32_t *raw_data, ChannelMask channels) {
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        if (slot < NUMBER_OF_THERMISTORS && !(channels & CHANNEL_BIT(slot))) {
+            continue;
+        }
+        uint32_t masked_data = raw_data[slot] & 0x00FFFFFF;
+        if (masked_data == CODE_POSITIVE_SATURATION || masked_data == CODE_NEGATIVE_SATURATION) {
+            continue;
+        }
+        int32_t code = sign_extend(masked_data);
+        ChannelFilter *filter = &m_channels[slot];
+        filter->fresh = true;
+        if (m_spike != SPIKE_OFF) {
+            code = reject_spike(filter, code);
+        }
+        track_noise(filter, code);
+
+        switch (m_type) {
+            case FILTER_BOXCAR:
+                filter->sum += code;
+                filter->count++;
+                break;
+
+            case FILTER_MOVING_AVERAGE:
+                if (filter->count == m_length) {
+                    filter->sum -= filter->window[filter->next];
+                }
+                else {
+                    filter->count++;
+                }
+                filter->window[filter->next] = code;
+                filter->sum += code;
+                filter->next = (filter->next + 1) % m_length;
+                break;
+
+            case FILTER_IIR:
+                if (!filter->iir_primed) {
+                    filter->iir = (int64_t)code << IIR_FRACTION_BITS;
+                    filter->iir_primed = true;
+                }
+                else {
+                    filter->iir += ((((int64_t)code << IIR_FRACTION_BITS) - filter->iir) * m_alpha) >> IIR_FRACTION_BITS;
+                }
+                filter->count = 1;
+                break;
+
+            case FILTER_MEDIAN:
+                filter->window[filter->next] = code;
+                filter->next = (filter->next + 1) % m_length;
+                if (filter->count < m_length) {
+                    filter->count++;
+                }
+                break;
+        }
+    }
+}
+
+
+static int32_t median(const int32_t *values, int count) {
+    int32_t sorted[FILTER_MAX_LENGTH];
+    for (int i = 0; i < count; i++) {
+        // Insertion sort; count is at most FILTER_MAX_LENGTH
+        int32_t value = values[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+    if (count & 1) {
+        return sorted[count / 2];
+    }
+    return (int32_t)(((int64_t)sorted[count / 2 - 1] + sorted[count / 2]) / 2);
+}
+
+
+/*
+Writes the filter output for every slot as a raw 24 bit code, ready for
+convert_ADCDATA(). Ends the frame: boxcar and median state is cleared, moving
+average and IIR state carries over. A slot with no samples in the frame repeats
+its last output, or is saturated if it has none.
+Returns the thermistors (bit n for thermistor n) sampled during the frame.
+*/
+ChannelMask filter_get_frame(uint32_t *raw_data) {
+    ChannelMask fresh = 0;
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        ChannelFilter *filter = &m_channels[slot];
+        if (filter->fresh && slot < NUMBER_OF_THERMISTORS) {
+            fresh |= CHANNEL_BIT(slot);
+        }
+        filter->fresh = false;
+        if (filter->count == 0) {
+            raw_data[slot] = filter->last;
+            continue;
+        }
+        int32_t value;
+        switch (m_type) {
+            case FILTER_IIR:
+                value = (int32_t)((filter->iir + (1 << (IIR_FRACTION_BITS - 1))) >> IIR_FRACTION_BITS);
+                break;
+            case FILTER_MEDIAN:
+                value = median(filter->window, filter->count);
+                break;
+            default:
+                // Round to nearest
+                value = (int32_t)((filter->sum + (filter->sum >= 0 ? filter->count / 2 : -(filter->count / 2))) / filter->count);
+                break;
+        }
+        raw_data[slot] = to_code(value);
+        filter->last = raw_data[slot];
+
+        if (m_type == FILTER_BOXCAR || m_type == FILTER_MEDIAN) {
+            filter->sum = 0;
+            filter->count = 0;
+            filter->next = 0;
+        }
+    }
+    return fresh;
+}
+
+
+/*
+RMS noise of one code of a slot (thermistor n is slot n), in codes, from the
+codes added since the last filter_reset(). NAN until there are enough of them.
+*/
+float filter_noise(int slot) {
+    const ChannelFilter *filter = &m_channels[slot];
+    if (filter->noise_codes < NOISE_MIN_CODES) {
+        return NAN;
+    }
+    return sqrtf(filter->noise_square / 2);
+}
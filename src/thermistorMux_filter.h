@@ -0,0 +1,64 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_filter.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel streaming filters over raw ADC codes. Passes from the scan
+ * engine are filtered in integer accumulators; temperatures are only computed from
+ * the filter output once per published frame.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-19
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_FILTER_H
+#define THERMISTORMUX_FILTER_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Largest window for the moving average and median filters
+#define FILTER_MAX_LENGTH 16
+
+enum FilterType {
+    FILTER_BOXCAR,          // Mean of all samples in the frame
+    FILTER_MOVING_AVERAGE,  // Mean of the last <length> samples
+    FILTER_IIR,             // First-order IIR, y += alpha * (x - y)
+    FILTER_MEDIAN           // Median of the last <length> samples in the frame
+};
+
+// EMI spike rejection ahead of the filter, on each channel's last SPIKE_WINDOW
+// codes (see filter_set_spike())
+#define SPIKE_WINDOW 5
+
+enum SpikeFilter {
+    SPIKE_OFF,
+    SPIKE_MEDIAN,           // Each code replaced by the median of the window ending on it
+    SPIKE_HAMPEL,           // Only codes too far from that median (in MADs) replaced by it
+    NUM_SPIKE_FILTERS
+};
+
+bool filter_configure(FilterType type, int length, float alpha);
+FilterType filter_type();
+void filter_set_spike(SpikeFilter spike);
+SpikeFilter filter_spike();
+const char *filter_spike_name(SpikeFilter spike);
+int filter_find_spike(const char *name);
+void filter_reset();
+void filter_add_pass(const uint32_t *raw_data, ChannelMask channels);
+ChannelMask filter_get_frame(uint32_t *raw_data);
+float filter_noise(int slot);
+
+#endif
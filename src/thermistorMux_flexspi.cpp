@@ -0,0 +1,287 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_flexspi.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Lockstep SPI engine on FlexIO2. Timer 0 makes SCK, mode 0, on the
+ * LPSPI4 SCK pin and shifter 0 sends the frame on its MOSI pin, both taken
+ * over from LPSPI4 for the transaction only. Shifter 2 receives in 4 bit
+ * parallel mode from the FLEXSPI_MAX_LANES MISO lanes, consecutive FlexIO2
+ * pins from FLEXIO_SPI_LANE_FLEXIO, so each byte clocked comes in as one word
+ * holding the 8 samples of all four lanes, and the word is split into a byte
+ * a lane by flexspi_lane_frame(). Two DMA channels keep the shifters fed, and
+ * the receive one's completion ends the transaction.
+ * Transactions are started from a software-pended FlexIO2 interrupt just
+ * below the acquisition priority: the data-ready handlers that are pending
+ * at once all run first, so their reads go out together. The chip selects are
+ * the caller's; the engine doesn't know which lanes are taken.
+ * The FlexIO has to be clocked and found by flexspi_begin() (the host-native
+ * build has none), or the ADC driver keeps to LPSPI4.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_global.h"
+
+#ifdef USE_FLEXIO_SPI
+
+#include "thermistorMux_flexspi.h"
+#include <Arduino.h>
+#include <DMAChannel.h>
+#include <string.h>
+
+#if NUM_ADCS > FLEXSPI_MAX_LANES
+    #error USE_FLEXIO_SPI reads at most FLEXSPI_MAX_LANES ADCs, one a MISO lane.
+#endif
+
+// FlexIO2 clock: PLL3, 480 MHz, / 2 / 2, the most the FlexIO takes
+#define FLEXSPI_CLOCK_HZ        120000000
+#define FLEXSPI_CLK_SEL_PLL3    3
+#define FLEXSPI_CLK_PRED        1       // Divide by 2
+#define FLEXSPI_CLK_PODF        1       // Divide by 2
+
+// The LPSPI4 MOSI and SCK pins, their FlexIO2 pins and the pads' ALT modes
+#define FLEXSPI_MOSI_PIN        11      // GPIO_B0_02
+#define FLEXSPI_SCK_PIN         13      // GPIO_B0_03
+#define FLEXSPI_MOSI_FLEXIO     2
+#define FLEXSPI_SCK_FLEXIO      3
+#define FLEXSPI_PAD_FLEXIO      4
+#define FLEXSPI_PAD_LPSPI       3
+
+#define FLEXSPI_TX_SHIFTER      0
+#define FLEXSPI_RX_SHIFTER      2
+#define FLEXSPI_TIMER           0
+
+// Below the chain it gathers reads from, above the network
+#define FLEXSPI_START_PRIORITY  (ACQUISITION_IRQ_PRIORITY + 16)
+
+// Register fields (i.MX RT1060 reference manual, FlexIO chapter)
+#define FLEXSPI_CTRL_FLEXEN          (1u << 0)
+#define FLEXSPI_CTRL_SWRST           (1u << 1)
+#define FLEXSPI_PARAM_SHIFTERS(p)    ((p) & 0xFF)
+#define FLEXSPI_PARAM_PINS(p)        (((p) >> 16) & 0xFF)
+#define FLEXSPI_SHIFTCTL_TIMSEL(n)   ((uint32_t)(n) << 24)
+#define FLEXSPI_SHIFTCTL_TIMPOL      (1u << 23)      // Shift on the falling edge
+#define FLEXSPI_SHIFTCTL_OUTPUT      (3u << 16)
+#define FLEXSPI_SHIFTCTL_PINSEL(n)   ((uint32_t)(n) << 8)
+#define FLEXSPI_SHIFTCTL_RECEIVE     1u
+#define FLEXSPI_SHIFTCTL_TRANSMIT    2u
+#define FLEXSPI_SHIFTCFG_PWIDTH(n)   ((uint32_t)(n) << 16)
+#define FLEXSPI_TIMCTL_TRGSEL_SHIFT(n) ((uint32_t)(4 * (n) + 1) << 24)   // Shifter n's status flag
+#define FLEXSPI_TIMCTL_TRGPOL        (1u << 23)      // Trigger active low
+#define FLEXSPI_TIMCTL_TRGSRC        (1u << 22)      // Internal trigger
+#define FLEXSPI_TIMCTL_OUTPUT        (3u << 16)
+#define FLEXSPI_TIMCTL_PINSEL(n)     ((uint32_t)(n) << 8)
+#define FLEXSPI_TIMCTL_DUAL_8BIT     1u              // Dual 8 bit counters, baud and bits
+#define FLEXSPI_TIMCFG_OUTPUT_ZERO   (1u << 24)      // SCK idles low
+#define FLEXSPI_TIMCFG_DISABLE_CMP   (2u << 12)      // Disabled on the compare of the bits
+#define FLEXSPI_TIMCFG_ENABLE_TRG    (2u << 8)       // Enabled on a trigger high
+#define FLEXSPI_TIMCFG_STOP_DISABLE  (2u << 4)       // A stop bit when disabled
+#define FLEXSPI_TIMCFG_START_BIT     (1u << 1)
+
+// CCM fields of the FlexIO2 clock root
+#define FLEXSPI_CSCMR2_SEL(n)   ((uint32_t)(n) << 19)
+#define FLEXSPI_CSCMR2_MASK     (3u << 19)
+#define FLEXSPI_CS1CDR_PRED(n)  ((uint32_t)(n) << 9)
+#define FLEXSPI_CS1CDR_PODF(n)  ((uint32_t)(n) << 25)
+#define FLEXSPI_CS1CDR_MASK     ((7u << 9) | (7u << 25))
+#define FLEXSPI_CCGR3_ON        (3u << 0)
+
+static const uint8_t lane_pins[FLEXSPI_MAX_LANES] = FLEXIO_SPI_LANE_PINS;
+
+// One word a byte each way: the frame sent, and the lanes' samples received
+static uint32_t m_tx_words[FLEXSPI_MAX_BYTES] DMAMEM __attribute__((aligned(32)));
+static uint32_t m_rx_words[FLEXSPI_MAX_BYTES] DMAMEM __attribute__((aligned(32)));
+
+static DMAChannel m_tx_dma;
+static DMAChannel m_rx_dma;
+static size_t m_bytes = 0;
+static FlexSpiHandler m_complete = NULL;
+static bool m_ready = false;
+
+
+/*
+Hands the MOSI and SCK pads to the FlexIO for a transaction, or back to LPSPI4.
+*/
+FASTRUN static void take_pads(bool flexio) {
+    uint32_t mode = flexio ? FLEXSPI_PAD_FLEXIO : FLEXSPI_PAD_LPSPI;
+    *(portConfigRegister(FLEXSPI_MOSI_PIN)) = mode;
+    *(portConfigRegister(FLEXSPI_SCK_PIN)) = mode;
+}
+
+
+/*
+Receive DMA completion: every byte is in, the last clock has gone out.
+*/
+FASTRUN static void rx_complete() {
+    m_rx_dma.clearInterrupt();
+    FLEXIO2_SHIFTSDEN = 0;
+    take_pads(false);
+    arm_dcache_delete(m_rx_words, sizeof(m_rx_words));
+    if (m_complete != NULL) {
+        m_complete();
+    }
+}
+
+
+/*
+Clocks the FlexIO2 from PLL3 and resets it. Returns false if there is no
+FlexIO2 to be found, or it is too small for the engine.
+*/
+FLASHMEM static bool clock_flexio() {
+    CCM_CCGR3 &= ~FLEXSPI_CCGR3_ON;
+    CCM_CSCMR2 = (CCM_CSCMR2 & ~FLEXSPI_CSCMR2_MASK) | FLEXSPI_CSCMR2_SEL(FLEXSPI_CLK_SEL_PLL3);
+    CCM_CS1CDR = (CCM_CS1CDR & ~FLEXSPI_CS1CDR_MASK) | FLEXSPI_CS1CDR_PRED(FLEXSPI_CLK_PRED) |
+                 FLEXSPI_CS1CDR_PODF(FLEXSPI_CLK_PODF);
+    CCM_CCGR3 |= FLEXSPI_CCGR3_ON;
+    uint32_t param = FLEXIO2_PARAM;
+    if (FLEXSPI_PARAM_SHIFTERS(param) <= FLEXSPI_RX_SHIFTER ||
+        FLEXSPI_PARAM_PINS(param) < FLEXIO_SPI_LANE_FLEXIO + FLEXSPI_MAX_LANES) {
+        return false;
+    }
+    FLEXIO2_CTRL = FLEXSPI_CTRL_SWRST;
+    FLEXIO2_CTRL = 0;
+    return true;
+}
+
+
+/*
+Sets up the engine to send frame (bytes long) in every transaction, at hz.
+start is run from the interrupt flexspi_request() pends, complete from the
+receive DMA completion. Returns false, leaving the FlexIO unused, if it isn't
+there or the frame or clock can't be had. Only call while no transaction is in
+flight; calling again sets the engine up afresh.
+*/
+FLASHMEM bool flexspi_begin(const uint8_t *frame, size_t bytes, uint32_t hz, FlexSpiHandler start,
+                            FlexSpiHandler complete) {
+    m_ready = false;
+    m_tx_dma.begin();
+    m_rx_dma.begin();
+    m_tx_dma.disable();
+    m_rx_dma.disable();
+    if (bytes == 0 || bytes > FLEXSPI_MAX_BYTES || !clock_flexio()) {
+        return false;
+    }
+
+    for (size_t n = 0; n < bytes; n++) {
+        m_tx_words[n] = frame[n];
+    }
+    arm_dcache_flush(m_tx_words, sizeof(m_tx_words));
+    m_bytes = bytes;
+    m_complete = complete;
+
+    // Transmit on the falling edge, MSB first through the bit swapped buffer
+    FLEXIO2_SHIFTCFG0 = 0;
+    FLEXIO2_SHIFTCTL0 = FLEXSPI_SHIFTCTL_TIMSEL(FLEXSPI_TIMER) | FLEXSPI_SHIFTCTL_TIMPOL | FLEXSPI_SHIFTCTL_OUTPUT |
+                        FLEXSPI_SHIFTCTL_PINSEL(FLEXSPI_MOSI_FLEXIO) | FLEXSPI_SHIFTCTL_TRANSMIT;
+    // Sample the four lanes on the rising edge
+    FLEXIO2_SHIFTCFG2 = FLEXSPI_SHIFTCFG_PWIDTH(FLEXSPI_MAX_LANES - 1);
+    FLEXIO2_SHIFTCTL2 = FLEXSPI_SHIFTCTL_TIMSEL(FLEXSPI_TIMER) | FLEXSPI_SHIFTCTL_PINSEL(FLEXIO_SPI_LANE_FLEXIO) |
+                        FLEXSPI_SHIFTCTL_RECEIVE;
+    // SCK: 8 bits for each word the transmit shifter is loaded with
+    FLEXIO2_TIMCFG0 = FLEXSPI_TIMCFG_OUTPUT_ZERO | FLEXSPI_TIMCFG_DISABLE_CMP | FLEXSPI_TIMCFG_ENABLE_TRG |
+                      FLEXSPI_TIMCFG_STOP_DISABLE | FLEXSPI_TIMCFG_START_BIT;
+    FLEXIO2_TIMCTL0 = FLEXSPI_TIMCTL_TRGSEL_SHIFT(FLEXSPI_TX_SHIFTER) | FLEXSPI_TIMCTL_TRGPOL | FLEXSPI_TIMCTL_TRGSRC |
+                      FLEXSPI_TIMCTL_OUTPUT | FLEXSPI_TIMCTL_PINSEL(FLEXSPI_SCK_FLEXIO) | FLEXSPI_TIMCTL_DUAL_8BIT;
+    if (!flexspi_set_clock(hz)) {
+        return false;
+    }
+    FLEXIO2_CTRL = FLEXSPI_CTRL_FLEXEN;
+
+    for (int lane = 0; lane < FLEXSPI_MAX_LANES; lane++) {
+        *(portConfigRegister(lane_pins[lane])) = FLEXSPI_PAD_FLEXIO;
+    }
+    take_pads(false);
+
+    m_tx_dma.destination(FLEXIO2_SHIFTBUFBBS0);
+    m_tx_dma.triggerAtHwReq(DMAMUX_SOURCE_FLEXIO2_REQUEST0);
+    m_tx_dma.disableOnCompletion();
+    m_rx_dma.source(FLEXIO2_SHIFTBUF2);
+    m_rx_dma.triggerAtHwReq(DMAMUX_SOURCE_FLEXIO2_REQUEST2);
+    m_rx_dma.disableOnCompletion();
+    m_rx_dma.interruptAtCompletion();
+    m_rx_dma.attachInterrupt(rx_complete, ACQUISITION_IRQ_PRIORITY);
+
+    attachInterruptVector(IRQ_FLEXIO2, start);
+    NVIC_SET_PRIORITY(IRQ_FLEXIO2, FLEXSPI_START_PRIORITY);
+    NVIC_ENABLE_IRQ(IRQ_FLEXIO2);
+    m_ready = true;
+    return true;
+}
+
+
+/*
+Sets SCK to hz or the next slower rate the FlexIO clock divides to. Only call
+while no transaction is in flight. Returns false for a rate out of reach.
+*/
+bool flexspi_set_clock(uint32_t hz) {
+    if (hz == 0) {
+        return false;
+    }
+    uint32_t divider = (FLEXSPI_CLOCK_HZ + hz - 1) / hz;
+    divider = (divider + 1) & ~1u;
+    if (divider < 2 || divider > 512) {
+        return false;
+    }
+    FLEXIO2_TIMCMP0 = ((8 * 2 - 1) << 8) | (divider / 2 - 1);
+    return true;
+}
+
+
+/*
+Asks for start to be run, once the interrupts above it are done.
+*/
+FASTRUN void flexspi_request() {
+    NVIC_SET_PENDING(IRQ_FLEXIO2);
+}
+
+
+/*
+Starts a transaction, the lanes' chip selects taken: the frame goes out on
+MOSI and every lane is sampled. complete is run once it is in. Returns false
+if the engine isn't set up.
+*/
+FASTRUN bool flexspi_transfer() {
+    if (!m_ready) {
+        return false;
+    }
+    m_rx_dma.destinationBuffer(m_rx_words, m_bytes * sizeof(uint32_t));
+    m_tx_dma.sourceBuffer(m_tx_words, m_bytes * sizeof(uint32_t));
+    take_pads(true);
+    m_rx_dma.enable();
+    m_tx_dma.enable();
+    // The empty transmit buffer requests the first word, which starts SCK
+    FLEXIO2_SHIFTSDEN = (1u << FLEXSPI_TX_SHIFTER) | (1u << FLEXSPI_RX_SHIFTER);
+    return true;
+}
+
+
+/*
+The bytes the last transaction read on a lane. Bit 4c + l of a received word
+is lane l's sample on SCK edge c of the byte, the MSB first.
+*/
+FASTRUN void flexspi_lane_frame(int lane, uint8_t *frame) {
+    for (size_t n = 0; n < m_bytes; n++) {
+        uint32_t word = m_rx_words[n] >> lane;
+        uint8_t byte = 0;
+        for (int edge = 0; edge < 8; edge++) {
+            byte = (byte << 1) | ((word >> (4 * edge)) & 1);
+        }
+        frame[n] = byte;
+    }
+}
+
+#endif
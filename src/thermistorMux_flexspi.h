@@ -0,0 +1,47 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_flexspi.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Lockstep SPI engine definitions and function prototypes. FlexIO2
+ * clocks one frame out on the shared MOSI and SCK and samples up to
+ * FLEXSPI_MAX_LANES MISO lines at once, one per ADC, so the ADCs selected
+ * are all read in a single DMA-fed transaction.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_FLEXSPI_H
+#define THERMISTORMUX_FLEXSPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// MISO lanes sampled together: the receive shifter's 4 bit parallel width
+#define FLEXSPI_MAX_LANES  4
+// Longest frame
+#define FLEXSPI_MAX_BYTES  8
+
+// Run from the start interrupt, and from the receive DMA completion
+typedef void (*FlexSpiHandler)(void);
+
+bool flexspi_begin(const uint8_t *frame, size_t bytes, uint32_t hz, FlexSpiHandler start, FlexSpiHandler complete);
+bool flexspi_set_clock(uint32_t hz);
+void flexspi_request();
+bool flexspi_transfer();
+void flexspi_lane_frame(int lane, uint8_t *frame);
+
+#endif
@@ -0,0 +1,139 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_framesync.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Frame sync line: the pin, the board's role on it and the frame
+ * offset it publishes. The frames themselves are started by the grid task and
+ * the edge interrupt in thermistor_Mux.cpp.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_framesync.h"
+
+#ifdef USE_FRAME_SYNC
+
+#include <Arduino.h>
+#include "thermistorMux_time.h"
+
+static FrameSyncRole m_role = FRAME_SYNC_OFF;
+static void (*m_edge_isr)() = NULL;
+static volatile bool m_pulse_high = false;
+static int64_t m_offset = 0;
+
+
+static void apply_role() {
+    detachInterrupt(digitalPinToInterrupt(FRAME_SYNC_PIN));
+    m_pulse_high = false;
+    if (m_role == FRAME_SYNC_DRIVE) {
+        pinMode(FRAME_SYNC_PIN, OUTPUT);
+        digitalWrite(FRAME_SYNC_PIN, LOW);
+        return;
+    }
+    // Pulled down, so a follower with the line cut sees no edges rather than noise
+    pinMode(FRAME_SYNC_PIN, INPUT_PULLDOWN);
+    if (m_role == FRAME_SYNC_FOLLOW) {
+        attachInterrupt(digitalPinToInterrupt(FRAME_SYNC_PIN), m_edge_isr, RISING);
+    }
+}
+
+
+/*
+Sets the line up, driven by the board with hardware ID FRAME_SYNC_DRIVER_ID and
+followed by the others. edge_isr starts a follower's frame; it runs at the
+data-ready pins' priority, ACQUISITION_IRQ_PRIORITY, as they share a vector.
+*/
+void framesync_begin(int hardware_id, void (*edge_isr)()) {
+    m_edge_isr = edge_isr;
+    m_role = (hardware_id == FRAME_SYNC_DRIVER_ID) ? FRAME_SYNC_DRIVE : FRAME_SYNC_FOLLOW;
+    apply_role();
+}
+
+
+/*
+Node Control/Frame Sync: takes the board off the line, or makes it the driver
+or a follower, until the next reset. Returns false for a role out of range.
+*/
+bool framesync_set_role(int role) {
+    if (role < FRAME_SYNC_OFF || role >= NUM_FRAME_SYNC_ROLES) {
+        return false;
+    }
+    m_role = (FrameSyncRole)role;
+    m_offset = 0;
+    apply_role();
+    return true;
+}
+
+
+FrameSyncRole framesync_role() {
+    return m_role;
+}
+
+
+/*
+Driver: raises the line on a frame start. Called from the frame timer
+interrupt just before the conversions start, so the followers start theirs an
+edge interrupt's latency later.
+*/
+FASTRUN void framesync_pulse() {
+    if (m_role == FRAME_SYNC_DRIVE) {
+        digitalWrite(FRAME_SYNC_PIN, HIGH);
+        m_pulse_high = true;
+    }
+}
+
+
+/*
+Driver: lowers the line again, from the grid task, so each pulse is a grid
+task period wide at most and the next frame start is a fresh rising edge.
+*/
+void framesync_end_pulse() {
+    if (m_pulse_high) {
+        m_pulse_high = false;
+        digitalWrite(FRAME_SYNC_PIN, LOW);
+    }
+}
+
+
+/*
+Takes the number of a frame just converted and the cycle count it started on.
+Its index on the grid of period_ms that every board's frames start on is the
+UTC start over the period, rounded, as a follower starts its frames a latency
+after the driver's grid point, and the offset is that index less the frame
+number. Left as it was while the time service is unsynced.
+*/
+void framesync_note_frame(uint64_t frame_number, uint64_t start_cycles, unsigned int period_ms) {
+    if (m_role == FRAME_SYNC_OFF || period_ms == 0 || !time_synced()) {
+        return;
+    }
+    uint64_t period_us = (uint64_t)period_ms * 1000;
+    uint64_t index = (time_cycles_to_utc_micros(start_cycles) + (period_us / 2)) / period_us;
+    m_offset = (int64_t)(index - frame_number);
+}
+
+
+/*
+Properties/Frame Sync Offset: the grid index of a frame less its frame number
+(its last bank's, with frame banks), the same on every board of the line once
+all are synced, or 0 before the first frame taken synced. It changes as frames
+are missed.
+*/
+int64_t framesync_frame_offset() {
+    return m_offset;
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_framesync.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Frame sync line definitions and function prototypes, with
+ * USE_FRAME_SYNC. Boards in one rack share FRAME_SYNC_PIN: the driver raises
+ * it at each frame start and the followers start their frames on its rising
+ * edge, so every board samples within an interrupt latency of the others
+ * without PTP. Frame numbers still count on each board; Properties/Frame Sync
+ * Offset gives a host the frame's index on the shared grid from the number.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_FRAMESYNC_H
+#define THERMISTORMUX_FRAMESYNC_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Node Control/Frame Sync
+typedef enum
+{
+    FRAME_SYNC_OFF,         // Frames on the board's own grid, the line left alone
+    FRAME_SYNC_DRIVE,       // Frames on the board's own grid, each start pulsed on the line
+    FRAME_SYNC_FOLLOW,      // Frames started by the line's rising edge
+    NUM_FRAME_SYNC_ROLES
+} FrameSyncRole;
+
+// How far from a period after the last a follower takes an edge to come: the
+// interrupt latencies, and the two boards' clocks drifting apart over the
+// period. Past it the follower starts the frame itself, counting a missed edge.
+#define FRAME_SYNC_WINDOW_US    500
+#define FRAME_SYNC_DRIFT_PPM    100
+
+void framesync_begin(int hardware_id, void (*edge_isr)());
+bool framesync_set_role(int role);
+FrameSyncRole framesync_role();
+void framesync_pulse();
+void framesync_end_pulse();
+void framesync_note_frame(uint64_t frame_number, uint64_t start_cycles, unsigned int period_ms);
+int64_t framesync_frame_offset();
+
+#endif
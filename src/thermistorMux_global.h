@@ -54,13 +54,196 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 #define production_TEST
 
+// Read ADCDATA over SPI DMA from the scan engine, leaving the CPU free while
+// the frame is clocked in. Comment out to use blocking SPI transfers.
+#define USE_SPI_DMA
+
+// Let the ADC sequence the thermistor and internal temperature channels itself
+// (SCAN mode with the on-chip timer) instead of reprogramming the Mux register
+// around every pass. Comment out to use one-shot conversions.
+#define USE_ADC_SCAN_MODE
+
+// Encode the NDATA payload for the thermistor and ADC temperature metrics once
+// and only patch values, timestamps and seq into it for each frame. Comment out
+// to encode every NDATA message from scratch.
+#define USE_FROZEN_NDATA
+
+// Publish all the thermistor temperatures as a single Sparkplug FloatArray
+// metric (Inputs/THERMISTORS) instead of one Float metric per channel. Needs a
+// host that understands the Sparkplug 3.0 array types.
+//#define USE_ARRAY_NDATA
+
+// Publish each thermistor as an instance of a Sparkplug Template, the
+// ThermistorChannel UDT defined once in NBIRTH (members Value and Fault), rather
+// than as a bare Float metric. Needs a host that understands templates, and
+// USE_ARRAY_NDATA and USE_FROZEN_NDATA off: NDATA then carries the instances.
+//#define USE_CHANNEL_TEMPLATE
+
+// Convert straight from the ADC code to whole milli-degrees (integer table
+// lookup and fixed-point calibration) and publish the thermistor temperatures
+// as Sparkplug Int32 metrics in m°C, instead of floats in °C. The host scales
+// them; a faulted channel is still published as null.
+//#define USE_MILLIDEGREE_NDATA
+
+// Publish the thermistor temperatures as Sparkplug Int16 metrics counting
+// hundredths of a degree above -60 °C, with Scale and Offset properties in
+// NBIRTH for the host to apply, instead of floats: 2 or 3 bytes a value rather
+// than 5. With USE_ARRAY_NDATA, Inputs/THERMISTORS becomes a Bytes metric of
+// the zigzag varint deltas between consecutive channels, which needs
+// USE_FROZEN_NDATA off as its length changes. Needs USE_CHANNEL_TEMPLATE and
+// USE_DEVICE_BANKS off.
+//#define USE_QUANTIZED_NDATA
+
+// Keep the store-and-forward history of frames in the external PSRAM (needs
+// the PSRAM chip fitted) instead of RAM, for much longer outages.
+//#define USE_PSRAM_HISTORY
+
+// Queue published messages per broker and write them out as the socket has
+// room, instead of blocking loop() while the TCP window is full. Comment out to
+// publish synchronously.
+#define USE_OUTBOUND_QUEUE
+
+// Publish NDATA/DDATA at QoS 1, keeping up to two unacked in flight per broker
+// and sending any lost with a dropped connection again after the births.
+// Sparkplug B specifies QoS 0 for data messages, so it's off unless the
+// primary host expects it. Needs USE_OUTBOUND_QUEUE.
+//#define USE_QOS1_DATA
+
+// Keep only the newest NDATA, and each device's newest DDATA, waiting in a
+// broker's outbound queue, instead of dropping the oldest once it's full. For
+// hosts that only want the latest values from a node that falls behind.
+// Needs USE_OUTBOUND_QUEUE.
+//#define USE_COALESCE_DATA
+
+// Keep frames in the history instead of publishing them while the Primary Host
+// is OFFLINE on every broker node messages go to, then rebirth and replay them
+// once it's back. Only for sites with a Primary Host publishing STATE; without
+// one, frames would only ever be stored.
+//#define USE_HOST_STATE_GATING
+
+// Connect to the brokers with MQTT 5 and publish each topic by its topic alias
+// after the first time, instead of the full topic every time. A broker that
+// refuses MQTT 5 is connected to with 3.1.1 from the next attempt on. Comment
+// out to always use 3.1.1.
+#define USE_MQTT5
+
+// Self-test the DCP's AES-128 and SHA-256 at startup and publish the time it
+// takes over a 2 KB record, the crypto a TLS connection to the brokers would
+// offload to it. Comment out to leave the DCP off.
+#define USE_DCP_CRYPTO
+
+// Sync the time service from a PTP master on the LAN, falling back to NTP while
+// none is heard. Comment out to use NTP only.
+#define USE_PTP
+
+// Time the acquisition, conversion, calibration, log and publish phases with the
+// DWT cycle counter, for the Diagnostics/* metrics (see thermistorMux_profile.h).
+// Comment out to leave the phases untimed.
+#define USE_PROFILER
+
+// Serve the Health and Diagnostics metrics and the phase profiles over HTTP at
+// /metrics on port HTTP_METRICS_PORT, in the Prometheus text format, for
+// dashboards that don't decode Sparkplug (see thermistorMux_http.h). Comment
+// out to open no listening port.
+#define USE_METRICS_HTTP
+
+// Send raw conversions to a host over UDP (Node Control/Raw Stream Target),
+// and take burst captures on that stream (Node Control/Burst Capture); see
+// thermistorMux_stream.h. Comment out to compile out the stream, the bursts,
+// their metrics and the stream task.
+#define USE_RAW_STREAM
+
+// Keep each thermistor's min, max, mean and standard deviation over a window
+// of frames (Node Control/Statistics Window, the Statistics/* metrics) and the
+// rollups of them a host can query (Node Control/Rollup Query); see
+// thermistorMux_stats.h and thermistorMux_rollup.h. Comment out to compile
+// out the statistics, the rollup rings and their metrics.
+#define USE_CHANNEL_STATS
+
+// Take firmware updates over Sparkplug (Node Control/Firmware Update and
+// Firmware Chunk), staged in the spare program flash; see
+// thermistorMux_ota.h. Comment out to compile out the updater and its metrics.
+#define USE_FIRMWARE_UPDATE
+
+// Let the scan engine record the timing of its interrupts, MOSFET switches and
+// readouts into a trace ring on request (Node Control/Capture Scan Trace), for
+// jitter and settling measurements. Costs a test per event while not capturing.
+//#define USE_SCAN_TRACE
+
+// Log every frame's raw codes and timestamp to the SD card built into the
+// Teensy 4.1, in the binary format of thermistorMux_sdlog.h, when turned on
+// through Node Control/SD Logging. Needs the SdFat library shipped with
+// Teensyduino.
+//#define USE_SD_LOG
+
+// Keep the node configuration in an append-only journal on LittleFS in the
+// Teensy 4.1's program flash (see thermistorMux_journal.h) instead of in
+// EEPROM: each save appends only the settings that changed. Needs the LittleFS
+// library shipped with Teensyduino.
+//#define USE_CONFIG_JOURNAL
+
+// Publish the thermistors as Sparkplug devices, one per bank of DEVICE_BANK_SIZE
+// channels (by default one per ADC), each with its own DBIRTH, DDATA and DDEATH
+// and a Device Control/Rebirth, instead of as node metrics. The node keeps the
+// rest. Needs USE_ARRAY_NDATA, USE_CHANNEL_TEMPLATE and USE_FROZEN_NDATA off.
+//#define USE_DEVICE_BANKS
+
+// Choose each thermistor's ADC oversampling ratio and PGA gain from its recent
+// readings (see thermistorMux_autorange.h): a lower ratio than the configured one
+// while the channel's noise allows, and a higher gain while its code leaves the
+// headroom. Needs USE_ADC_SCAN_MODE off, as the settings change between slots.
+//#define USE_ADC_AUTO_RANGE
+
+// Measure each ADC's offset and gain error against its shorted and reference
+// inputs at start-up and every few minutes, and have the ADC correct its own
+// output with them (the OFFSETCAL and GAINCAL registers, see
+// Mcp3561::self_calibrate()). The codes shift by the correction, so recalibrate
+// the channels after turning it on.
+//#define USE_ADC_SELF_CAL
+
+// Convert each ADC's reference input (REFIN+/REFIN-) between passes every
+// Node Control/ADC Reference Interval passes, and scale its thermistor codes by
+// how far it reads from its ideal code, so a drift of the converter's gain drops
+// out of the readings (see set_ADC_reference_code()). Needs USE_ADC_SCAN_MODE
+// off, as the Scan register has no reference channel.
+//#define USE_REF_TRACKING
+
+// Read the ADCs' ADCDATA frames all at once on FlexIO2 (see
+// thermistorMux_flexspi.h) instead of one after another on LPSPI4: the frame
+// goes out on the shared MOSI and SCK while each ADC's SDO is sampled on its own
+// MISO lane, FLEXIO_SPI_LANE_PINS, ADC n on lane n. Each SDO stays wired to MISO
+// (pin 12) as well, for the register reads. Comment out to use LPSPI4 only.
+//#define USE_FLEXIO_SPI
+
+// Start the frames of boards in one rack together on a shared wire, the frame
+// sync line on FRAME_SYNC_PIN (see thermistorMux_framesync.h): the board with
+// hardware ID FRAME_SYNC_DRIVER_ID pulses it at each frame start and the others
+// start theirs on its rising edge. Every board needs the same frame period.
+// Comment out to leave the pin alone.
+//#define USE_FRAME_SYNC
+
+// Default frame period (Node Control/Frame Period): start each scan frame on a
+// multiple of this many milliseconds of UTC once the time service is synced, so
+// that frames from every node line up. 0 scans continuously.
+#define SCAN_GRID_MS  0
+
+// ADC SPI clock in Hz. 0 picks it at start-up: one step below the fastest clock
+// at which register writes to the ADC read back reliably (see tune_ADC_SPI_clock()).
+#define ADC_SPI_CLOCK_HZ  0
+
+// Default size in bytes from which NBIRTH and NDATA payloads are published in
+// the Sparkplug compressed (DEFLATE) envelope (Node Control/Compression
+// Threshold). The host must be able to decompress them; 0 never compresses.
+#define PAYLOAD_COMPRESSION_BYTES  0
+
 #define NUM_MODULES   32
 #define MAX_BOARD_ID  (NUM_MODULES - 1)
 
-// Display diagnostic messages on serial port if debugging is enabled
+// Display diagnostic messages on serial port if debugging is enabled.
+// Messages are queued and written from loop() (see thermistorMux_log.h).
 #ifdef DEBUG
-#define DebugPrint( msg )       Serial.println( msg )
-#define DebugPrintNoEOL( msg )  Serial.print( msg )
+#define DebugPrint( msg )       LogOutput.println( msg )
+#define DebugPrintNoEOL( msg )  LogOutput.print( msg )
 #else
 #define DebugPrint( msg )
 #define DebugPrintNoEOL( msg )
@@ -80,7 +263,178 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #define ID_PIN_3 34
 #define ID_PIN_4 33
 
+// Board variant: thermistor channels, 8, 16, 32 or 64. Set per build with
+// -DNUMBER_OF_THERMISTORS=n (see the variant environments in platformio.ini);
+// every per-channel table, mask, metric and EEPROM record is sized from it.
+#ifndef NUMBER_OF_THERMISTORS
 #define NUMBER_OF_THERMISTORS 32
+#endif
+
+#if NUMBER_OF_THERMISTORS != 8 && NUMBER_OF_THERMISTORS != 16 && \
+    NUMBER_OF_THERMISTORS != 32 && NUMBER_OF_THERMISTORS != 64
+    #error NUMBER_OF_THERMISTORS must be 8, 16, 32 or 64.
+#endif
+
+// The smallest image that still scans, converts and publishes the frames, for
+// deployments that need no more: the optional subsystems on by default above
+// are compiled out, with their metrics, buffers and tasks. Set by the
+// teensy41_lean environment in platformio.ini; a deployment needing only some
+// of them comments out the rest instead.
+#ifdef THERMISTOR_MUX_LEAN
+#undef USE_DCP_CRYPTO
+#undef USE_PTP
+#undef USE_PROFILER
+#undef USE_METRICS_HTTP
+#undef USE_RAW_STREAM
+#undef USE_CHANNEL_STATS
+#undef USE_FIRMWARE_UPDATE
+#endif
+
+#if defined(USE_SCAN_TRACE) && !defined(USE_RAW_STREAM)
+    #error USE_SCAN_TRACE needs USE_RAW_STREAM, which sends the trace.
+#endif
+#if defined(USE_CHANNEL_TEMPLATE) && (defined(USE_ARRAY_NDATA) || defined(USE_FROZEN_NDATA))
+    #error USE_CHANNEL_TEMPLATE needs USE_ARRAY_NDATA and USE_FROZEN_NDATA off.
+#endif
+#if defined(USE_ADC_AUTO_RANGE) && defined(USE_ADC_SCAN_MODE)
+    #error USE_ADC_AUTO_RANGE needs USE_ADC_SCAN_MODE off.
+#endif
+#if defined(USE_REF_TRACKING) && defined(USE_ADC_SCAN_MODE)
+    #error USE_REF_TRACKING needs USE_ADC_SCAN_MODE off.
+#endif
+#if defined(USE_QOS1_DATA) && !defined(USE_OUTBOUND_QUEUE)
+    #error USE_QOS1_DATA needs USE_OUTBOUND_QUEUE.
+#endif
+#if defined(USE_COALESCE_DATA) && !defined(USE_OUTBOUND_QUEUE)
+    #error USE_COALESCE_DATA needs USE_OUTBOUND_QUEUE.
+#endif
+#if defined(USE_QUANTIZED_NDATA) && (defined(USE_CHANNEL_TEMPLATE) || defined(USE_DEVICE_BANKS))
+    #error USE_QUANTIZED_NDATA needs USE_CHANNEL_TEMPLATE and USE_DEVICE_BANKS off.
+#endif
+#if defined(USE_QUANTIZED_NDATA) && defined(USE_ARRAY_NDATA) && defined(USE_FROZEN_NDATA)
+    #error USE_QUANTIZED_NDATA with USE_ARRAY_NDATA needs USE_FROZEN_NDATA off.
+#endif
+
+// Set of thermistors, bit n for thermistor n; only as wide as the board needs
+#if NUMBER_OF_THERMISTORS > 32
+typedef uint64_t ChannelMask;
+#define channel_mask_count(mask) __builtin_popcountll(mask)
+#define channel_mask_first(mask) __builtin_ctzll(mask)
+#else
+typedef uint32_t ChannelMask;
+#define channel_mask_count(mask) __builtin_popcount(mask)
+#define channel_mask_first(mask) __builtin_ctz(mask)
+#endif
+#define CHANNEL_BIT(channel) ((ChannelMask)1 << (channel))
+
+// A thermistor temperature as converted, held and published: milli-degrees C
+// with USE_MILLIDEGREE_NDATA, otherwise °C. THERMISTOR_NULL marks a channel
+// that couldn't be read (published as null).
+#ifdef USE_MILLIDEGREE_NDATA
+typedef int32_t ThermistorValue;
+#define THERMISTOR_NULL       INT32_MIN
+#define THERMISTOR_UNITS      "m°C"
+static inline bool thermistor_null(ThermistorValue value) { return value == THERMISTOR_NULL; }
+static inline float thermistor_celsius(ThermistorValue value) {
+  return thermistor_null(value) ? NAN : (float)value * 0.001f;
+}
+static inline ThermistorValue thermistor_value(float celsius) {
+  return isnan(celsius) ? THERMISTOR_NULL : (ThermistorValue)lroundf(celsius * 1000.0f);
+}
+#else
+typedef float ThermistorValue;
+#define THERMISTOR_NULL       NAN
+#define THERMISTOR_UNITS      "°C"
+static inline bool thermistor_null(ThermistorValue value) { return isnan(value); }
+static inline float thermistor_celsius(ThermistorValue value) { return value; }
+static inline ThermistorValue thermistor_value(float celsius) { return celsius; }
+#endif
+
+// MCP3561 ADCs on the SPI bus, with the chip select and data-ready (IRQ) pin of
+// each. The thermistors are split between them in equal contiguous blocks, ADC 0
+// taking the first: each ADC's CH0/CH1 input (its pairs, see ADC_INPUT_PAIRS)
+// must be wired to the MOSFETs of its block. The ADCs convert concurrently, so each added ADC adds its sample rate.
+// The 64 channel variant is laid out for two.
+#ifndef NUM_ADCS
+#if NUMBER_OF_THERMISTORS > 32
+#define NUM_ADCS      2
+#define ADC_CS_PINS   {10, 44}
+#define ADC_IRQ_PINS  {23, 45}
+#else
+#define NUM_ADCS      1
+#define ADC_CS_PINS   {10}
+#define ADC_IRQ_PINS  {23}
+#endif
+#endif
+#define MAX_ADCS      4
+
+// Differential input pairs of each ADC wired to thermistors: 1 for the MCP3561
+// (CH0/CH1), 2 for an MCP3562 and 4 for an MCP3564 (CH0/CH1 to CH6/CH7, SCAN
+// Diff A to D). Set per build with -DADC_INPUT_PAIRS=n. Thermistor n of an ADC's
+// block is wired to pair n % ADC_INPUT_PAIRS, so each run of ADC_INPUT_PAIRS
+// thermistors is a group on separate inputs: the scan engine switches a group's
+// MOSFETs on together and one SCAN cycle converts them all, so a pass takes a
+// settling time per group instead of per thermistor.
+#ifndef ADC_INPUT_PAIRS
+#define ADC_INPUT_PAIRS 1
+#endif
+#if ADC_INPUT_PAIRS != 1 && ADC_INPUT_PAIRS != 2 && ADC_INPUT_PAIRS != 4
+    #error ADC_INPUT_PAIRS must be 1, 2 or 4.
+#endif
+#if ADC_INPUT_PAIRS > 1 && !defined(USE_ADC_SCAN_MODE)
+    #error ADC_INPUT_PAIRS above 1 needs USE_ADC_SCAN_MODE.
+#endif
+
+#ifdef USE_FRAME_SYNC
+// The frame sync line, wired to the same pin of every board with a common
+// ground. The 32 channel layout takes every header pin, so by default it is
+// pad 42 under the board, one of the SD card socket's.
+#ifndef FRAME_SYNC_PIN
+#define FRAME_SYNC_PIN        42
+#endif
+#ifndef FRAME_SYNC_DRIVER_ID
+#define FRAME_SYNC_DRIVER_ID  0
+#endif
+#if defined(USE_SD_LOG) && FRAME_SYNC_PIN >= 42 && FRAME_SYNC_PIN <= 47
+    #error USE_FRAME_SYNC needs FRAME_SYNC_PIN off the SD card socket (pins 42 to 47) with USE_SD_LOG.
+#endif
+#endif
+
+// The MISO lanes of USE_FLEXIO_SPI: four consecutive FlexIO2 pins from
+// FLEXIO_SPI_LANE_FLEXIO, by default FlexIO2:16-19 on pins 8, 7, 36 and 37. A
+// board wired for it moves the MOSFETs it displaces.
+#ifndef FLEXIO_SPI_LANE_FLEXIO
+#define FLEXIO_SPI_LANE_FLEXIO  16
+#define FLEXIO_SPI_LANE_PINS    {8, 7, 36, 37}
+#endif
+
+// NVIC priorities, 0 highest in steps of 16 (Teensy's default is 128). The
+// acquisition chain - data-ready pins, PIT (settle and frame timers) and the SPI
+// DMA completion - shares one level, so none of them preempts another mid
+// transfer (see bus_owner in command_ADC.cpp), under SysTick (32) so millis()
+// keeps counting and above USB serial (112). Ethernet is put below everything
+// else: a burst of frames only delays the network stack.
+#define ACQUISITION_IRQ_PRIORITY  48
+#define ETHERNET_IRQ_PRIORITY     160
+
+#ifdef USE_DEVICE_BANKS
+// Thermistors per device bank; bank n ("Bank<n+1>") takes thermistors
+// n * DEVICE_BANK_SIZE onwards
+#ifndef DEVICE_BANK_SIZE
+#define DEVICE_BANK_SIZE  (NUMBER_OF_THERMISTORS / NUM_ADCS)
+#endif
+#define NUM_DEVICE_BANKS  (NUMBER_OF_THERMISTORS / DEVICE_BANK_SIZE)
+#define DEVICE_BANK(channel)  ((channel) / DEVICE_BANK_SIZE)
+
+#if defined(USE_ARRAY_NDATA) || defined(USE_CHANNEL_TEMPLATE) || defined(USE_FROZEN_NDATA)
+    #error USE_DEVICE_BANKS needs USE_ARRAY_NDATA, USE_CHANNEL_TEMPLATE and USE_FROZEN_NDATA off.
+#endif
+#if NUMBER_OF_THERMISTORS % DEVICE_BANK_SIZE != 0 || NUM_DEVICE_BANKS > 8
+    #error DEVICE_BANK_SIZE must divide NUMBER_OF_THERMISTORS into at most 8 banks.
+#endif
+#endif
+
+#include "thermistorMux_log.h"
 
 
 #endif
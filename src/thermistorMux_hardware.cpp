@@ -24,26 +24,27 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "thermistorMux_global.h"
 #include "thermistorMux_hardware.h"
 
-#define CS 10
 #define MOSI 11
 #define MISO 12
 #define SCK 13
 
 static int hardware_id = -1;
 
-static SPISettings settingsA(5000000, MSBFIRST, SPI_MODE0);
-
 bool initTeensySPI() {
 
-    pinMode(CS, OUTPUT); // Set CS pin to output 
-    digitalWrite(CS, HIGH); // Set CS to high
+    // Every ADC chip select high before the bus is first driven
+    static const uint8_t cs_pins[NUM_ADCS] = ADC_CS_PINS;
+    for (int n = 0; n < NUM_ADCS; n++) {
+        pinMode(cs_pins[n], OUTPUT); // Set CS pin to output
+        digitalWrite(cs_pins[n], HIGH); // Set CS to high
+    }
 
     SPI.setMOSI(MOSI);
     SPI.setMISO(MISO);
     SPI.setSCK(SCK);
 
+    // The ADC driver opens a transaction with its own clock for each transfer
     SPI.begin();
-    SPI.beginTransaction(settingsA);
 
     return true;
 }
@@ -57,8 +58,8 @@ bool hardwareID_init(){
   pinMode(ID_PIN_3,INPUT_PULLUP);
   pinMode(ID_PIN_4,INPUT_PULLUP);
 
-  // Wait for pin inputs to settle
-  delay(100);
+  // Wait for pin inputs to settle; the internal pull-ups take microseconds
+  delay(1);
 
   // Read the jumpers.  This must only be done once, even if they produce an
   // invalid ID, in order to ensure that they are correctly read.
@@ -75,7 +76,6 @@ bool hardwareID_init(){
                 ( pin1 << 1 ) +
                 ( pin0 << 0 );
 
-  delay(10000);
   DebugPrintNoEOL("Hardware ID = ");
   DebugPrint(hardware_id);
 
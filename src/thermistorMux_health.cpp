@@ -0,0 +1,104 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_health.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Operational health counters, and the worst interrupt latency seen.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_health.h"
+
+static volatile uint32_t m_counters[NUM_HEALTH_COUNTERS];
+// Longest an acquisition interrupt started after it was due, cycles, since the
+// last health_take_latency()
+static volatile uint32_t m_latency = 0;
+// Latest a frame on the UTC grid started after its grid point, cycles, since
+// the last health_take_phase(); UINT32_MAX while none has
+static volatile uint32_t m_phase = UINT32_MAX;
+
+
+/*
+Counts one event. An exclusive load/store increment, so it is safe from any
+interrupt priority and never masks interrupts.
+*/
+void health_count(HealthCounter counter) {
+    if (counter >= NUM_HEALTH_COUNTERS) {
+        return;
+    }
+    __atomic_fetch_add(&m_counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+Counts count events at once, like health_count().
+*/
+void health_add(HealthCounter counter, uint32_t count) {
+    if (counter >= NUM_HEALTH_COUNTERS) {
+        return;
+    }
+    __atomic_fetch_add(&m_counters[counter], count, __ATOMIC_RELAXED);
+}
+
+
+uint32_t health_counter(HealthCounter counter) {
+    if (counter >= NUM_HEALTH_COUNTERS) {
+        return 0;
+    }
+    return m_counters[counter];
+}
+
+
+/*
+Notes how many cycles past its due time an interrupt started. Lock-free like
+health_count(), so the interrupts can note their own latency.
+*/
+void health_note_latency(uint32_t cycles) {
+    uint32_t worst = __atomic_load_n(&m_latency, __ATOMIC_RELAXED);
+    while (cycles > worst &&
+           !__atomic_compare_exchange_n(&m_latency, &worst, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/*
+Worst latency noted since the last call, cycles, starting over from 0.
+*/
+uint32_t health_take_latency() {
+    return __atomic_exchange_n(&m_latency, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+Notes how many cycles past its UTC grid point a frame started, from the frame
+interrupt.
+*/
+void health_note_phase(uint32_t cycles) {
+    uint32_t worst = __atomic_load_n(&m_phase, __ATOMIC_RELAXED);
+    while ((worst == UINT32_MAX || cycles > worst) &&
+           !__atomic_compare_exchange_n(&m_phase, &worst, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+/*
+Latest frame start noted since the last call, cycles past its grid point, or
+UINT32_MAX if no frame started on the UTC grid since then.
+*/
+uint32_t health_take_phase() {
+    return __atomic_exchange_n(&m_phase, UINT32_MAX, __ATOMIC_RELAXED);
+}
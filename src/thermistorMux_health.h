@@ -0,0 +1,65 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_health.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Operational health counters. Any module counts events into the registry,
+ * from loop() or an interrupt handler; the network module publishes them with
+ * the scan rates as the Health metrics.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_HEALTH_H
+#define THERMISTORMUX_HEALTH_H
+
+#include <stdint.h>
+
+// Events counted by the registry. The counts run from start-up and wrap at 2^32.
+enum HealthCounter {
+    HEALTH_FRAMES,              // Frames converted
+    HEALTH_CONVERSIONS,         // Samples read out of the ADCs by the scan engine
+    HEALTH_INVALID_DATA,        // Saturated ADC reads
+    HEALTH_REGISTER_MISMATCHES, // ADC register checks failed, or a read with an unknown Mux setting
+    HEALTH_PUBLISH_FAILURES,    // NDATA messages that couldn't be published
+    HEALTH_BROKER_CONNECTS,     // Broker connections made
+    HEALTH_BDSEQ_INCREMENTS,    // Birth/death sequence numbers taken for connection attempts
+    HEALTH_ADC_CRC_ERRORS,      // ADCDATA read frames whose CRC didn't match (each re-read counts again)
+    HEALTH_FRAME_OVERRUNS,      // Frame starts missed because the frame before was still being taken
+    HEALTH_IRQ_MISSED,          // ADC data-ready interrupts the scan engine gave up waiting for
+    HEALTH_IRQ_LATE,            // Data-ready interrupts that came past their deadline
+    HEALTH_IRQ_DUPLICATES,      // Data-ready interrupts with no conversion to read
+    HEALTH_ADC_RECOVERIES,      // ADC re-initializations after a missed data-ready
+    HEALTH_ADC_RECONFIGURATIONS, // ADC configurations restored in place after a power-on reset or CRCCFG error
+    HEALTH_WATCHDOG_RECOVERIES, // Stalled check-ins the watchdog restarted
+    HEALTH_LINK_LOSSES,         // Times the Ethernet link went down
+    HEALTH_COMMANDS_BUSY,       // Node commands refused because the node was busy with one like it
+    HEALTH_FRAMES_LOST,         // Converted frames never published: skipped, or dropped from a replay
+    HEALTH_FRAMES_REPLAYED,     // Stored frames published from the history after an outage
+    HEALTH_FRAMES_RESENT,       // Published frames sent again for snapshot requests
+    HEALTH_SYNC_MISSED,         // Frames a frame sync follower took itself for want of an edge
+    NUM_HEALTH_COUNTERS
+};
+
+void health_count(HealthCounter counter);
+void health_add(HealthCounter counter, uint32_t count);
+uint32_t health_counter(HealthCounter counter);
+void health_note_latency(uint32_t cycles);
+uint32_t health_take_latency();
+void health_note_phase(uint32_t cycles);
+uint32_t health_take_phase();
+
+#endif
@@ -0,0 +1,311 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_history.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Store-and-forward history of published frames. Only loop() touches the
+ * history, so unlike the sample ring it needs no memory barriers. When it's full
+ * the oldest frame is overwritten, so a long outage keeps its most recent data.
+ * Published frames are overwritten first, as only the ones still to be replayed
+ * would be lost.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-24
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_history.h"
+#include "thermistorMux_time.h"
+
+#define HISTORY_MASK (HISTORY_SIZE - 1)
+#define HISTORY_CHUNKS (HISTORY_SIZE / HISTORY_CHUNK_FRAMES)
+#define HISTORY_CHUNK_MASK (HISTORY_CHUNK_FRAMES - 1)
+
+#if (HISTORY_SIZE & HISTORY_MASK) != 0
+    #error HISTORY_SIZE must be a power of 2.
+#endif
+
+#if (HISTORY_CHUNK_FRAMES & HISTORY_CHUNK_MASK) != 0 || HISTORY_CHUNK_FRAMES > HISTORY_SIZE
+    #error HISTORY_CHUNK_FRAMES must be a power of 2, no more than HISTORY_SIZE.
+#endif
+
+// HISTORY_CHUNK_FRAMES frames, field by field
+struct HistoryChunk {
+    unsigned long long timestamp[HISTORY_CHUNK_FRAMES];
+    uint64_t cycles[HISTORY_CHUNK_FRAMES];
+    ThermistorValue thermistor[NUMBER_OF_THERMISTORS][HISTORY_CHUNK_FRAMES];
+    float adc_temperature[HISTORY_CHUNK_FRAMES];
+    uint64_t frame[HISTORY_CHUNK_FRAMES];
+};
+
+#ifdef USE_PSRAM_HISTORY
+// External PSRAM isn't zeroed at startup, but only the indices below need to be
+EXTMEM static HistoryChunk m_chunks[HISTORY_CHUNKS];
+#else
+// DMAMEM isn't zeroed at startup either, so held frames outlive a warm reboot
+DMAMEM static HistoryChunk m_chunks[HISTORY_CHUNKS];
+#endif
+// Free running indices, also the positions of the frames.  The frames from
+// m_oldest to m_tail have been published and those from m_tail to m_head are
+// waiting to be.
+static uint32_t m_head = 0;    // Next frame to write
+static uint32_t m_tail = 0;    // Oldest frame waiting to be published
+static uint32_t m_oldest = 0;  // Oldest frame held
+static unsigned long m_dropped = 0;
+
+#define HISTORY_SAVED_MAGIC 0x48495354      // "HIST"
+
+// The indices as they were at a warm reboot, kept with the frames
+struct HistorySaved {
+    uint32_t magic;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t oldest;
+    uint32_t dropped;
+    uint32_t check;                         // magic ^ head ^ tail ^ oldest ^ dropped, inverted
+};
+
+DMAMEM static HistorySaved m_saved;
+
+
+static HistoryChunk * chunk_of(uint32_t index) {
+    return &m_chunks[(index & HISTORY_MASK) / HISTORY_CHUNK_FRAMES];
+}
+
+
+static uint32_t saved_check(const HistorySaved *saved) {
+    return ~(saved->magic ^ saved->head ^ saved->tail ^ saved->oldest ^ saved->dropped);
+}
+
+
+/*
+Starts the history, empty on a cold boot. On a warm boot it carries on with the
+frames held at the reset, if the indices saved by history_prepare_reset() are
+intact.
+*/
+void history_begin(bool warm) {
+    m_head = m_tail = m_oldest = 0;
+    m_dropped = 0;
+    if (warm && m_saved.magic == HISTORY_SAVED_MAGIC && m_saved.check == saved_check(&m_saved) &&
+        (m_saved.head - m_saved.oldest) <= HISTORY_SIZE &&
+        (m_saved.tail - m_saved.oldest) <= (m_saved.head - m_saved.oldest)) {
+        m_head = m_saved.head;
+        m_tail = m_saved.tail;
+        m_oldest = m_saved.oldest;
+        m_dropped = m_saved.dropped;
+        LogInfo("%u frames held across the reboot.", history_count());
+    }
+    m_saved.magic = 0;
+}
+
+
+/*
+Saves the indices for history_begin() and writes the frames back from the data
+cache, just before an intentional reset. The cycle counter restarts from 0, so a
+frame still waiting for its timestamp is stamped now, or dropped if the time
+service has never been synced. So are published frames still waiting for theirs.
+*/
+void history_prepare_reset() {
+    for (uint32_t index = m_oldest; index != m_head; index++) {
+        HistoryChunk *chunk = chunk_of(index);
+        unsigned int frame = index & HISTORY_CHUNK_MASK;
+        if (chunk->timestamp[frame] == 0 && time_synced()) {
+            chunk->timestamp[frame] = time_cycles_to_utc_millis(chunk->cycles[frame]);
+        }
+    }
+    while (m_head != m_tail && chunk_of(m_tail)->timestamp[m_tail & HISTORY_CHUNK_MASK] == 0) {
+        m_tail++;
+    }
+    while (m_oldest != m_tail && chunk_of(m_oldest)->timestamp[m_oldest & HISTORY_CHUNK_MASK] == 0) {
+        m_oldest++;
+    }
+    m_saved.magic = HISTORY_SAVED_MAGIC;
+    m_saved.head = m_head;
+    m_saved.tail = m_tail;
+    m_saved.oldest = m_oldest;
+    m_saved.dropped = m_dropped;
+    m_saved.check = saved_check(&m_saved);
+    arm_dcache_flush(&m_saved, sizeof(m_saved));
+    arm_dcache_flush(m_chunks, sizeof(m_chunks));
+}
+
+
+/*
+Appends a frame, overwriting the oldest one if the history is full.
+*/
+static void append(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                   uint64_t cycles, uint64_t frame_number) {
+    if ((m_head - m_oldest) >= HISTORY_SIZE) {
+        if (m_oldest == m_tail) {
+            m_tail++;
+            m_dropped++;
+        }
+        m_oldest++;
+    }
+    HistoryChunk *chunk = chunk_of(m_head);
+    unsigned int frame = m_head & HISTORY_CHUNK_MASK;
+    chunk->timestamp[frame] = timestamp;
+    chunk->cycles[frame] = cycles;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        chunk->thermistor[channel][frame] = thermistor[channel];
+    }
+    chunk->adc_temperature[frame] = adc_temperature;
+    chunk->frame[frame] = frame_number;
+    m_head++;
+}
+
+
+/*
+Appends a frame to be replayed. A frame taken before the time service was synced
+has timestamp 0 and is stamped from cycles when it is replayed.
+*/
+void history_store(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                   uint64_t cycles, uint64_t frame) {
+    append(thermistor, adc_temperature, timestamp, cycles, frame);
+}
+
+
+/*
+Appends a frame that has been published, for history_find() and history_read().
+It's left out while frames are waiting to be replayed, as it would otherwise be
+replayed after them.
+*/
+void history_retain(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                    uint64_t cycles, uint64_t frame) {
+    if (m_tail != m_head) {
+        return;
+    }
+    append(thermistor, adc_temperature, timestamp, cycles, frame);
+    m_tail = m_head;
+}
+
+
+/*
+Position of the oldest frame held.
+*/
+uint32_t history_first_retained() {
+    return m_oldest;
+}
+
+
+/*
+Position of the oldest frame waiting to be replayed, or of the next frame to be
+stored if there are none; the published frames end there.
+*/
+uint32_t history_first_pending() {
+    return m_tail;
+}
+
+
+/*
+Position of the oldest published frame stamped at or after since, UTC
+milliseconds, or history_first_pending() if there's none. Frames not yet stamped
+count as older. A linear scan, as the clock can be stepped, but only done once
+per query.
+*/
+uint32_t history_find(unsigned long long since) {
+    uint32_t index = m_oldest;
+    while (index != m_tail && chunk_of(index)->timestamp[index & HISTORY_CHUNK_MASK] < since) {
+        index++;
+    }
+    return index;
+}
+
+
+/*
+Points run at up to max_frames frames from position on, stopping at the end of a
+chunk. Returns the number of frames in the run, 0 if the frame at position has
+been overwritten or not been stored yet.
+*/
+unsigned int history_read(uint32_t position, unsigned int max_frames, HistoryRun *run) {
+    unsigned int held = m_head - m_oldest;
+    unsigned int index = position - m_oldest;
+    if (index >= held) {
+        return 0;
+    }
+    unsigned int frame = position & HISTORY_CHUNK_MASK;
+    unsigned int frames = HISTORY_CHUNK_FRAMES - frame;
+    if (frames > held - index) {
+        frames = held - index;
+    }
+    if (frames > max_frames) {
+        frames = max_frames;
+    }
+    const HistoryChunk *chunk = chunk_of(position);
+    run->frames = frames;
+    run->timestamp = &chunk->timestamp[frame];
+    run->cycles = &chunk->cycles[frame];
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        run->thermistor[channel] = &chunk->thermistor[channel][frame];
+    }
+    run->adc_temperature = &chunk->adc_temperature[frame];
+    run->frame = &chunk->frame[frame];
+    return frames;
+}
+
+
+/*
+Points run at up to max_frames frames from index places after the oldest one,
+stopping at the end of a chunk. Returns the number of frames in the run, 0 if
+there aren't that many frames held.
+*/
+unsigned int history_peek(unsigned int index, unsigned int max_frames, HistoryRun *run) {
+    if (index >= m_head - m_tail) {
+        return 0;
+    }
+    return history_read(m_tail + index, max_frames, run);
+}
+
+
+/*
+Marks the oldest count frames waiting as published, once they've been replayed.
+*/
+void history_discard(unsigned int count) {
+    unsigned int held = m_head - m_tail;
+    m_tail += (count < held) ? count : held;
+}
+
+
+unsigned int history_count() {
+    return m_head - m_tail;
+}
+
+
+/*
+Share of the history in use, %.
+*/
+float history_fill() {
+    return history_count() * 100.0f / HISTORY_SIZE;
+}
+
+
+/*
+Frames lost because the history was full.
+*/
+unsigned long history_dropped() {
+    return m_dropped;
+}
+
+
+/*
+Frame number of the newest frame held, 0 if there are none. After a warm boot
+the frame numbers carry on from it, so a host doesn't see them go backwards.
+*/
+uint64_t history_last_frame() {
+    if (m_head == m_oldest) {
+        return 0;
+    }
+    return chunk_of(m_head - 1)->frame[(m_head - 1) & HISTORY_CHUNK_MASK];
+}
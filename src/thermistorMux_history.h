@@ -0,0 +1,85 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_history.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Store-and-forward history of published frames. Frames that can't be
+ * published because no broker is connected are held here and replayed as
+ * historical metrics once a broker is back. Frames that have been published are
+ * kept too, until they're overwritten, for hosts to fill gaps from. They are
+ * kept in chunks laid out field by field (see HistoryChunk), and read back as
+ * runs of frames.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-24
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_HISTORY_H
+#define THERMISTORMUX_HISTORY_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Frames per history chunk. A chunk keeps each field of its frames together,
+// one column per channel, so replaying or scanning a channel reads memory in
+// order.
+#define HISTORY_CHUNK_FRAMES 32
+
+// History capacity in frames, must be a power of 2. A frame is 160 bytes with 32
+// thermistors, so 8 MB of PSRAM holds 32768 frames (~9 hours at one frame per
+// second), 16 MB holds 65536 and RAM holds 256 (~4 minutes).
+#ifdef USE_PSRAM_HISTORY
+#ifndef HISTORY_PSRAM_MB
+#define HISTORY_PSRAM_MB 8
+#endif
+#if HISTORY_PSRAM_MB >= 16
+#define HISTORY_SIZE 65536
+#else
+#define HISTORY_SIZE 32768
+#endif
+#else
+#define HISTORY_SIZE 256
+#endif
+
+// A run of stored frames held together in one chunk; field[i] is frame i of the
+// run. Valid until the frames are discarded.
+struct HistoryRun {
+    unsigned int frames;
+    const unsigned long long *timestamp;        // UTC milliseconds of each frame, 0 if not yet known
+    const uint64_t *cycles;                     // time_cycles64() stamp of each frame
+    const ThermistorValue *thermistor[NUMBER_OF_THERMISTORS];  // Temperatures, THERMISTOR_UNITS
+    const float *adc_temperature;               // ADC internal temperature, °C
+    const uint64_t *frame;                      // Frame number (ChannelState::frame_number)
+};
+
+void history_begin(bool warm);
+void history_prepare_reset();
+void history_store(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                   uint64_t cycles, uint64_t frame);
+unsigned int history_peek(unsigned int index, unsigned int max_frames, HistoryRun *run);
+void history_discard(unsigned int count);
+void history_retain(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                    uint64_t cycles, uint64_t frame);
+uint32_t history_first_retained();
+uint32_t history_first_pending();
+uint32_t history_find(unsigned long long since);
+unsigned int history_read(uint32_t position, unsigned int max_frames, HistoryRun *run);
+unsigned int history_count();
+float history_fill();
+unsigned long history_dropped();
+uint64_t history_last_frame();
+
+#endif
@@ -0,0 +1,187 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_http.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Scrape endpoint. The metrics text is double buffered: it is rendered
+ * into the buffer not being served, which then is served to the next
+ * connections, so a slow scraper never sees a rendering change under it. Only
+ * as much as the socket has room for is written each poll.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_http.h"
+#include "thermistorMux_global.h"
+#include <NativeEthernet.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef USE_METRICS_HTTP
+
+enum HttpState {
+    HTTP_IDLE,          // No connection
+    HTTP_REQUEST,       // Reading the request head
+    HTTP_RESPONSE       // Writing the head, then the body
+};
+
+static EthernetServer m_server(HTTP_METRICS_PORT);
+static bool m_started = false;
+static char m_metrics[2][HTTP_METRICS_SIZE];
+static size_t m_length[2] = {0, 0};
+static int m_current = 0;                       // The buffer new connections are served
+static EthernetClient m_client;
+static HttpState m_state = HTTP_IDLE;
+static unsigned long m_since = 0;               // millis() the connection was accepted
+static char m_request[HTTP_REQUEST_SIZE];
+static size_t m_requestLength = 0;
+static char m_head[160];
+static size_t m_headLength = 0;
+static const char *m_body = NULL;               // What follows the head, in m_metrics or static
+static size_t m_bodyLength = 0;
+static size_t m_sent = 0;                       // Of the head and body together
+static int m_serving = -1;                      // The buffer m_body is in, -1 for neither
+
+
+/*
+Starts listening on HTTP_METRICS_PORT.
+*/
+bool http_begin() {
+    m_server.begin();
+    m_started = true;
+    return true;
+}
+
+
+/*
+The buffer to render the next metrics text into, NULL while a connection is
+still being served from it; skip the rendering then.
+*/
+char *http_metrics_buffer() {
+    int next = m_current ^ 1;
+    return (m_serving == next) ? NULL : m_metrics[next];
+}
+
+
+/*
+Serves the length bytes just rendered into http_metrics_buffer() from the next
+connection on.
+*/
+void http_metrics_ready(size_t length) {
+    m_current ^= 1;
+    m_length[m_current] = (length < HTTP_METRICS_SIZE) ? length : HTTP_METRICS_SIZE;
+}
+
+
+static void close_connection() {
+    m_client.stop();
+    m_state = HTTP_IDLE;
+    m_serving = -1;
+}
+
+
+// Sets up the response to the request read
+static void respond() {
+    static const char notFound[] = "Only /metrics is served here.\n";
+    const char *status = "200 OK";
+    if (strncmp(m_request, "GET /metrics ", 13) == 0 || strncmp(m_request, "GET /metrics?", 13) == 0) {
+        m_serving = m_current;
+        m_body = m_metrics[m_current];
+        m_bodyLength = m_length[m_current];
+    } else {
+        status = (strncmp(m_request, "GET ", 4) == 0) ? "404 Not Found" : "405 Method Not Allowed";
+        m_body = notFound;
+        m_bodyLength = sizeof(notFound) - 1;
+    }
+    int length = snprintf(m_head, sizeof(m_head),
+                          "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                          status, (unsigned long)m_bodyLength);
+    m_headLength = (length > 0 && (size_t)length < sizeof(m_head)) ? length : 0;
+    m_sent = 0;
+    m_state = HTTP_RESPONSE;
+}
+
+
+/*
+Accepts a connection, reads its request or writes what the socket has room for
+of the response. Call often; it only waits for the last bytes of a response to
+leave before closing.
+*/
+void http_poll() {
+    if (!m_started) {
+        return;
+    }
+    if (m_state == HTTP_IDLE) {
+        m_client = m_server.accept();
+        if (!m_client) {
+            return;
+        }
+        m_state = HTTP_REQUEST;
+        m_since = millis();
+        m_requestLength = 0;
+    }
+    if (millis() - m_since > HTTP_TIMEOUT_MS || !m_client.connected()) {
+        close_connection();
+        return;
+    }
+
+    if (m_state == HTTP_REQUEST) {
+        int available = m_client.available();
+        while (available-- > 0) {
+            int c = m_client.read();
+            if (c < 0) {
+                break;
+            }
+            if (m_requestLength < sizeof(m_request) - 1) {
+                m_request[m_requestLength++] = (char)c;
+            }
+            m_request[m_requestLength] = '\0';
+            // A whole head, or as much of one as is kept
+            if (strstr(m_request, "\r\n\r\n") != NULL || strstr(m_request, "\n\n") != NULL ||
+                m_requestLength == sizeof(m_request) - 1) {
+                respond();
+                break;
+            }
+        }
+        if (m_state != HTTP_RESPONSE) {
+            return;
+        }
+    }
+
+    size_t total = m_headLength + m_bodyLength;
+    int room = m_client.availableForWrite();
+    while (room > 0 && m_sent < total) {
+        const char *from = (m_sent < m_headLength) ? &m_head[m_sent] : &m_body[m_sent - m_headLength];
+        size_t part = (m_sent < m_headLength) ? m_headLength - m_sent : total - m_sent;
+        if (part > (size_t)room) {
+            part = room;
+        }
+        size_t written = m_client.write((const uint8_t *)from, part);
+        if (written == 0) {
+            break;
+        }
+        m_sent += written;
+        room -= written;
+    }
+    if (m_sent == total) {
+        m_client.flush();
+        close_connection();
+    }
+}
+
+#endif
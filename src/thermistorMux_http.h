@@ -0,0 +1,51 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_http.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Scrape endpoint. A minimal HTTP/1.0 server answers GET /metrics with
+ * the Health and Diagnostics metrics and the phase profiles in the Prometheus
+ * text exposition format, for monitoring that doesn't speak Sparkplug. The text
+ * is rendered once per health interval into one of two buffers and served from
+ * it as is, so a scrape costs a copy into the socket and nothing on the
+ * acquisition side. One connection is served at a time.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_HTTP_H
+#define THERMISTORMUX_HTTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef HTTP_METRICS_PORT
+#define HTTP_METRICS_PORT       9100
+#endif
+// Largest rendering of the metrics
+#define HTTP_METRICS_SIZE       6144
+// Longest request head read; the rest is ignored
+#define HTTP_REQUEST_SIZE       256
+// A connection that hasn't sent its request, or taken the response, in this long is closed
+#define HTTP_TIMEOUT_MS         2000
+
+bool http_begin();
+char *http_metrics_buffer();
+void http_metrics_ready(size_t length);
+void http_poll();
+
+#endif
@@ -0,0 +1,181 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_journal.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Node configuration journal on LittleFS in program flash.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_journal.h"
+
+#ifdef USE_CONFIG_JOURNAL
+
+#include <LittleFS.h>
+#include <string.h>
+#include "thermistorMux_config.h"
+#include "thermistorMux_log.h"
+
+#define JOURNAL_FILE        "/config.jnl"
+#define JOURNAL_NEW_FILE    "/config.new"
+// A blob's header, which holds the length of its records
+#define JOURNAL_HEADER      4
+#define JOURNAL_CRC         4
+
+static_assert(CONFIG_BLOB_SIZE <= JOURNAL_MAX_BYTES, "journal can't hold a full configuration");
+
+static LittleFS_Program m_fs;
+static bool m_mounted = false;
+static bool m_tried = false;
+static NodeConfig m_journaled;      // The settings the journal replays to
+static bool m_have = false;         // m_journaled is valid
+static uint32_t m_size = 0;         // Bytes of whole blobs in the journal
+static bool m_torn = false;         // Something follows the last whole blob
+
+
+/*
+Mounts the file system, formatting the flash if it holds none. Only tried once.
+*/
+static bool mount() {
+    if (!m_tried) {
+        m_tried = true;
+        m_mounted = m_fs.begin(JOURNAL_FLASH_BYTES);
+        if (!m_mounted) {
+            LogError("Configuration journal's flash didn't mount.");
+        }
+    }
+    return m_mounted;
+}
+
+
+/*
+Reads the whole blobs of the journal over config, oldest first, stopping at
+JOURNAL_MAX_BYTES or the first blob that is torn or doesn't decode. Returns
+false if there were none.
+*/
+bool journal_load(NodeConfig *config) {
+    if (!mount()) {
+        return false;
+    }
+    // A compaction that didn't finish; the journal is still whole
+    if (m_fs.exists(JOURNAL_NEW_FILE)) {
+        m_fs.remove(JOURNAL_NEW_FILE);
+    }
+    File file = m_fs.open(JOURNAL_FILE, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    uint32_t length = file.size();
+    NodeConfig replayed = *config;
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    uint32_t pos = 0;
+    while (pos + JOURNAL_HEADER + JOURNAL_CRC <= length && pos < JOURNAL_MAX_BYTES) {
+        if (file.read(blob, JOURNAL_HEADER) != JOURNAL_HEADER) {
+            break;
+        }
+        size_t size = JOURNAL_HEADER + (size_t)blob[3] + JOURNAL_CRC;
+        if (size > sizeof(blob) || pos + size > length ||
+            file.read(&blob[JOURNAL_HEADER], size - JOURNAL_HEADER) != (int)(size - JOURNAL_HEADER) ||
+            !config_decode(blob, size, &replayed)) {
+            break;
+        }
+        pos += size;
+    }
+    file.close();
+    m_torn = (pos != length);
+    if (m_torn) {
+        LogWarn("Configuration journal is torn after %lu of %lu bytes; keeping what precedes it.",
+                (unsigned long)pos, (unsigned long)length);
+    }
+    if (pos == 0) {
+        return false;
+    }
+    *config = replayed;
+    m_journaled = replayed;
+    m_have = true;
+    m_size = pos;
+    return true;
+}
+
+
+/*
+Replaces the journal with a single blob of every setting of config.
+*/
+static bool compact(const NodeConfig *config) {
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    size_t size = config_encode(config, blob, sizeof(blob));
+    File file = m_fs.open(JOURNAL_NEW_FILE, FILE_WRITE_BEGIN);
+    if (!file) {
+        LogError("Configuration journal couldn't be compacted.");
+        return false;
+    }
+    bool written = (file.write(blob, size) == size);
+    file.close();
+    // LittleFS renames atomically, replacing the old journal
+    if (!written || !m_fs.rename(JOURNAL_NEW_FILE, JOURNAL_FILE)) {
+        m_fs.remove(JOURNAL_NEW_FILE);
+        LogError("Configuration journal couldn't be compacted.");
+        return false;
+    }
+    m_journaled = *config;
+    m_have = true;
+    m_size = size;
+    m_torn = false;
+    return true;
+}
+
+
+/*
+Appends the settings of config that differ from the journal's, or compacts it
+when there is no journal yet, it is torn, or the blob would take it past
+JOURNAL_MAX_BYTES. Saving the journaled settings again writes nothing.
+*/
+bool journal_save(const NodeConfig *config) {
+    if (!mount()) {
+        return false;
+    }
+    if (!m_have || m_torn) {
+        return compact(config);
+    }
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    size_t size = config_encode_changes(&m_journaled, config, blob, sizeof(blob));
+    if (size == JOURNAL_HEADER + JOURNAL_CRC) {
+        return true;
+    }
+    if (m_size + size > JOURNAL_MAX_BYTES) {
+        return compact(config);
+    }
+    File file = m_fs.open(JOURNAL_FILE, FILE_WRITE);
+    if (!file) {
+        LogError("Configuration journal couldn't be opened.");
+        return false;
+    }
+    bool written = (file.write(blob, size) == size);
+    file.close();
+    if (!written) {
+        // The next save compacts over whatever made it out
+        m_torn = true;
+        LogError("Configuration journal didn't save.");
+        return false;
+    }
+    m_journaled = *config;
+    m_size += size;
+    return true;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_journal.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Node configuration journal, with USE_CONFIG_JOURNAL. The settings are
+ * kept on LittleFS in the top JOURNAL_FLASH_BYTES of the Teensy 4.1's program
+ * flash rather than in EEPROM, as config blobs (see thermistorMux_config.cpp)
+ * appended to one file. The first blob carries every setting and each later one
+ * only those a save changed, so most saves write a few bytes; LittleFS spreads
+ * the writes over the flash. Loading replays the blobs in order and stops at the
+ * first that is torn or corrupt, which then is left behind by the next save.
+ * Once the file would pass JOURNAL_MAX_BYTES it is compacted into a single full
+ * blob, written to a new file that is renamed over the old, so a reset at any
+ * point leaves one of the two whole.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_JOURNAL_H
+#define THERMISTORMUX_JOURNAL_H
+
+#include "thermistorMux_global.h"
+
+// Program flash given to LittleFS, taken from the top of the flash
+#ifndef JOURNAL_FLASH_BYTES
+#define JOURNAL_FLASH_BYTES     (256 * 1024)
+#endif
+// Longest journal, bounding the replay at boot
+#ifndef JOURNAL_MAX_BYTES
+#define JOURNAL_MAX_BYTES       (16 * 1024)
+#endif
+
+struct NodeConfig;
+
+bool journal_load(NodeConfig *config);
+bool journal_save(const NodeConfig *config);
+
+#endif
@@ -0,0 +1,198 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_kalman.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Scalar Kalman filter per channel. A thermistor follows its
+ * surroundings through a first-order thermal lag, so between frames its
+ * temperature is modelled as drifting at random, the variance of the drift
+ * growing with the time between them (the process noise squared, per second).
+ * Each frame's reading, with the measurement noise squared as its variance, is
+ * then blended into the estimate, which replaces the reading.
+ *
+ * Noises are written as a ',' separated list in thermistor order, with '-' (or
+ * nothing) for none; a channel is only filtered with both set. They aren't
+ * saved, as the EEPROM has no room left for them.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_kalman.h"
+#include <stdio.h>
+#include <string.h>
+
+// Noises beyond this can't be meant for a thermistor
+#define KALMAN_MAX_NOISE  1000.0f
+
+struct KalmanState {
+    float estimate;         // °C
+    float variance;         // Of the estimate, °C²
+    uint64_t cycles;        // time_cycles64() stamp of the last reading; 0 = none yet
+};
+
+static float m_noise[NUM_KALMAN_NOISES][NUMBER_OF_THERMISTORS];    // NAN for none
+static ChannelMask m_filtered = 0;
+static KalmanState m_state[NUMBER_OF_THERMISTORS];
+
+
+/*
+Starts with no channel filtered.
+*/
+void kalman_begin() {
+    for (int kind = 0; kind < NUM_KALMAN_NOISES; kind++) {
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            m_noise[kind][channel] = NAN;
+        }
+    }
+    m_filtered = 0;
+}
+
+
+/*
+Sets one noise of each channel from text, e.g. "0.001,-,0.002" (see the file
+comment); "" removes them all. Changing either noise of a channel starts its
+estimate afresh from the next reading. Returns false, changing nothing, for a
+malformed, negative or out of range noise or more entries than channels.
+*/
+bool kalman_set_noise(KalmanNoise kind, const char *text) {
+    if (kind < 0 || kind >= NUM_KALMAN_NOISES) {
+        return false;
+    }
+    float noise[NUMBER_OF_THERMISTORS];
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        noise[channel] = NAN;
+    }
+    const char *pos = text;
+    int channel = 0;
+    while (*pos != '\0') {
+        if (channel >= NUMBER_OF_THERMISTORS) {
+            return false;
+        }
+        const char *end = strchr(pos, ',');
+        size_t length = (end != NULL) ? (size_t)(end - pos) : strlen(pos);
+        char entry[16];
+        if (length >= sizeof(entry)) {
+            return false;
+        }
+        memcpy(entry, pos, length);
+        entry[length] = '\0';
+        float value = NAN;
+        char dash;
+        int used = 0;
+        bool none = (sscanf(entry, " %c %n", &dash, &used) != 1) || (dash == '-' && entry[used] == '\0');
+        if (!none && (sscanf(entry, " %f %n", &value, &used) != 1 || entry[used] != '\0' ||
+                      !(value >= 0 && value <= KALMAN_MAX_NOISE))) {
+            return false;
+        }
+        noise[channel++] = value;
+        pos += length + ((end != NULL) ? 1 : 0);
+    }
+    m_filtered = 0;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        if (memcmp(&noise[i], &m_noise[kind][i], sizeof(float)) != 0) {
+            m_state[i].cycles = 0;
+        }
+        m_noise[kind][i] = noise[i];
+        if (!isnan(m_noise[KALMAN_PROCESS][i]) && !isnan(m_noise[KALMAN_MEASUREMENT][i])) {
+            m_filtered |= CHANNEL_BIT(i);
+        }
+    }
+    return true;
+}
+
+
+/*
+Writes one noise of every channel as kalman_set_noise() takes it.
+*/
+void kalman_format_noise(KalmanNoise kind, char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS && length < size; channel++) {
+        float noise = m_noise[kind][channel];
+        const char *separator = (channel > 0) ? "," : "";
+        int written = isnan(noise) ? snprintf(buffer + length, size - length, "%s-", separator) :
+                                     snprintf(buffer + length, size - length, "%s%g", separator, noise);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+    }
+}
+
+
+/*
+Channels filtered, bit n for thermistor n.
+*/
+ChannelMask kalman_channels() {
+    return m_filtered;
+}
+
+
+/*
+Replaces the readings in frame of the filtered channels by their estimates,
+blending in the readings of those among channels (the ones sampled in the
+frame). The others repeat their last reading, so they just repeat their
+estimate. cycles is the frame's time_cycles64() stamp. A null reading is left
+null, and the estimate left to drift until the next reading.
+*/
+void kalman_update(ThermistorValue *frame, ChannelMask channels, uint64_t cycles) {
+    ChannelMask update = m_filtered;
+    while (update != 0) {
+        int channel = channel_mask_first(update);
+        update &= update - 1;
+        KalmanState *state = &m_state[channel];
+        if (thermistor_null(frame[channel])) {
+            continue;
+        }
+        if (!(channels & CHANNEL_BIT(channel))) {
+            if (state->cycles != 0) {
+                frame[channel] = thermistor_value(state->estimate);
+            }
+            continue;
+        }
+        float reading = thermistor_celsius(frame[channel]);
+        float measurement = m_noise[KALMAN_MEASUREMENT][channel] * m_noise[KALMAN_MEASUREMENT][channel];
+        if (state->cycles == 0) {
+            state->estimate = reading;
+            state->variance = measurement;
+        }
+        else {
+            float seconds = (float)(cycles - state->cycles) / (float)F_CPU_ACTUAL;
+            float process = m_noise[KALMAN_PROCESS][channel] * m_noise[KALMAN_PROCESS][channel];
+            float predicted = state->variance + process * seconds;
+            float total = predicted + measurement;
+            // A channel with no noise at all just follows its readings
+            float gain = (total > 0) ? predicted / total : 1.0f;
+            state->estimate += gain * (reading - state->estimate);
+            state->variance = (1.0f - gain) * predicted;
+        }
+        state->cycles = cycles;
+        frame[channel] = thermistor_value(state->estimate);
+    }
+}
+
+
+/*
+Variance of a channel's estimate, °C², NAN if it isn't filtered or has had no
+reading yet.
+*/
+float kalman_variance(int channel) {
+    if (!(m_filtered & CHANNEL_BIT(channel)) || m_state[channel].cycles == 0) {
+        return NAN;
+    }
+    return m_state[channel].variance;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_kalman.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Optional per-channel scalar Kalman filter over the converted frames,
+ * for thermistors that change slowly: a smooth estimate from fewer passes per
+ * frame than plain averaging needs.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_KALMAN_H
+#define THERMISTORMUX_KALMAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+enum KalmanNoise {
+    KALMAN_PROCESS,         // How far the temperature wanders, °C per √s
+    KALMAN_MEASUREMENT,     // Noise of a frame's reading, °C RMS
+    NUM_KALMAN_NOISES
+};
+
+// Longest text of kalman_format_noise(), "123.456789," per thermistor
+#define KALMAN_NOISE_TEXT_SIZE  (NUMBER_OF_THERMISTORS * 12)
+
+void kalman_begin();
+bool kalman_set_noise(KalmanNoise kind, const char *text);
+void kalman_format_noise(KalmanNoise kind, char *buffer, size_t size);
+ChannelMask kalman_channels();
+void kalman_update(ThermistorValue *frame, ChannelMask channels, uint64_t cycles);
+float kalman_variance(int channel);
+
+#endif
@@ -0,0 +1,154 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_log.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Buffered, level filtered logging. In text mode messages are queued as
+ * "[L] message" lines; in binary mode text is discarded and only fixed size trace
+ * records are queued:
+ *     0xA5, event, cycles (4 bytes LE), value (4 bytes LE)
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-20
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <stdarg.h>
+#include "thermistorMux_log.h"
+
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE - 1)
+#define LOG_LINE_LENGTH 160
+#define TRACE_SYNC 0xA5
+
+#if (LOG_BUFFER_SIZE & LOG_BUFFER_MASK) != 0
+    #error LOG_BUFFER_SIZE must be a power of 2.
+#endif
+
+LogBuffer LogOutput;
+
+static uint8_t m_buffer[LOG_BUFFER_SIZE];
+static uint32_t m_head = 0;     // Free running write index
+static uint32_t m_tail = 0;     // Free running read index
+static unsigned long m_dropped = 0;
+static int m_level = LOG_LEVEL_DEBUG;
+static bool m_binary = false;
+
+static const char level_tag[] = {'E', 'W', 'I', 'D'};
+
+
+static size_t buffer_put(const uint8_t *data, size_t size) {
+    if ((LOG_BUFFER_SIZE - (m_head - m_tail)) < size) {
+        // Whole message or nothing, so lines are never cut short
+        m_dropped++;
+        return 0;
+    }
+    for (size_t i = 0; i < size; i++) {
+        m_buffer[(m_head + i) & LOG_BUFFER_MASK] = data[i];
+    }
+    m_head += size;
+    return size;
+}
+
+
+size_t LogBuffer::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+
+size_t LogBuffer::write(const uint8_t *buffer, size_t size) {
+    if (m_binary) {
+        return size;
+    }
+    return buffer_put(buffer, size);
+}
+
+
+/*
+Queues one formatted line at the given level. Messages longer than
+LOG_LINE_LENGTH are truncated.
+*/
+void log_printf(int level, const char *format, ...) {
+    if (level > m_level || m_binary) {
+        return;
+    }
+    char line[LOG_LINE_LENGTH];
+    int length = snprintf(line, sizeof(line), "[%c] ", level_tag[level & 3]);
+    va_list args;
+    va_start(args, format);
+    int message = vsnprintf(line + length, sizeof(line) - length - 1, format, args);
+    va_end(args);
+    if (message < 0) {
+        return;
+    }
+    length += min(message, (int)(sizeof(line) - length - 2));
+    line[length++] = '\n';
+    buffer_put((const uint8_t *)line, length);
+}
+
+
+void log_set_level(int level) {
+    m_level = constrain(level, LOG_LEVEL_ERROR, LOG_LEVEL_DEBUG);
+}
+
+
+int log_level() {
+    return m_level;
+}
+
+
+/*
+Switches between text messages and binary trace records. Anything already queued
+is discarded so the two never mix on the port.
+*/
+void log_set_binary(bool binary) {
+    m_binary = binary;
+    m_tail = m_head;
+}
+
+
+/*
+Queues a binary trace record. Ignored in text mode.
+*/
+void log_trace(uint8_t event, uint32_t value) {
+    if (!m_binary) {
+        return;
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT;
+    uint8_t record[10] = {TRACE_SYNC, event,
+                          (uint8_t)cycles, (uint8_t)(cycles >> 8), (uint8_t)(cycles >> 16), (uint8_t)(cycles >> 24),
+                          (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    buffer_put(record, sizeof(record));
+}
+
+
+/*
+Writes as much of the queue as the serial port will take without blocking. Call
+from loop(); when no serial monitor is attached the port simply takes nothing.
+*/
+void log_drain() {
+    int room = Serial.availableForWrite();
+    while (room > 0 && m_tail != m_head) {
+        uint32_t start = m_tail & LOG_BUFFER_MASK;
+        uint32_t contiguous = min(m_head - m_tail, (uint32_t)(LOG_BUFFER_SIZE - start));
+        uint32_t count = min(contiguous, (uint32_t)room);
+        Serial.write(&m_buffer[start], count);
+        m_tail += count;
+        room -= count;
+    }
+}
+
+
+unsigned long log_dropped() {
+    return m_dropped;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_log.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Buffered, level filtered logging. Messages are queued in a RAM ring and
+ * written to the serial port from loop() with log_drain(), only as fast as the port
+ * accepts them, so logging never blocks acquisition. Without DEBUG every log call
+ * compiles away.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-20
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_LOG_H
+#define THERMISTORMUX_LOG_H
+
+#include <Arduino.h>
+#include "thermistorMux_global.h"
+
+// RAM ring size in bytes, must be a power of 2
+#define LOG_BUFFER_SIZE 4096
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+// Messages above this level are removed at compile time
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Binary trace event IDs (see log_trace())
+enum LogTraceEvent {
+    TRACE_FRAME_DONE = 1,   // Frame converted; value = frame number
+    TRACE_FRAME_PUBLISHED,  // publish_data() returned; value = cycles spent
+    TRACE_SAMPLES_DROPPED   // Sample ring overrun; value = total dropped
+};
+
+/*
+Print sink that queues into the log ring. DebugPrint()/DebugPrintNoEOL() write here.
+Only to be used from loop() context, not from interrupt handlers.
+*/
+class LogBuffer : public Print {
+public:
+    virtual size_t write(uint8_t b);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+};
+
+extern LogBuffer LogOutput;
+
+void log_printf(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_set_level(int level);
+int log_level();
+void log_set_binary(bool binary);
+void log_trace(uint8_t event, uint32_t value);
+void log_drain();
+unsigned long log_dropped();
+
+#ifdef DEBUG
+#define LogAt( level, ... ) do { if ((level) <= LOG_COMPILE_LEVEL) log_printf((level), __VA_ARGS__); } while (0)
+#define LogTrace( event, value ) log_trace((event), (value))
+#else
+#define LogAt( level, ... ) do { } while (0)
+#define LogTrace( event, value ) do { (void)(event); (void)(value); } while (0)
+#endif
+
+#define LogError( ... ) LogAt(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LogWarn( ... )  LogAt(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LogInfo( ... )  LogAt(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LogDebug( ... ) LogAt(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,136 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_memory.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief RAM headroom tracking. On the Teensy 4.1 the stack grows down through
+ * DTCM towards the end of .bss, and malloc() takes the heap from RAM2 above the
+ * DMAMEM variables. The unused stack is painted with a pattern at start-up; the
+ * deepest the stack has reached is where the pattern stops.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_memory.h"
+#include "thermistorMux_global.h"
+#include <malloc.h>
+
+#define STACK_PAINT       0xA5A5A5A5
+// Left unpainted below the stack pointer of memory_init(), for its own frame
+#define STACK_PAINT_GUARD 256
+
+// Linker and core symbols
+extern unsigned long _ebss;
+extern unsigned long _estack;
+extern char _heap_start;
+extern char _heap_end;
+extern char *__brkval;
+
+static bool m_painted = false;
+static size_t m_heap_peak = 0;
+static bool m_stack_low = false;    // Warned; the stack's depth never recovers
+static bool m_heap_low = false;     // Warned; cleared once the heap has room again
+
+
+/*
+Paints the free stack, from the end of .bss up to just below the caller's frame.
+Call first thing in setup().
+*/
+void memory_init() {
+    uint32_t *end = (uint32_t *)__builtin_frame_address(0) - STACK_PAINT_GUARD / sizeof(uint32_t);
+    for (uint32_t *word = (uint32_t *)&_ebss; word < end; word++) {
+        *word = STACK_PAINT;
+    }
+    m_painted = true;
+}
+
+
+size_t memory_stack_size() {
+    return (char *)&_estack - (char *)&_ebss;
+}
+
+
+/*
+Stack that has never been used since memory_init(): the painted words left
+above the end of .bss, 0 if it was never painted. Takes time in proportion to
+the free stack, about 0.2 ms per 100 KB.
+*/
+size_t memory_stack_free() {
+    if (!m_painted) {
+        return 0;
+    }
+    const uint32_t *word = (const uint32_t *)&_ebss;
+    const uint32_t *top = (const uint32_t *)&_estack;
+    while (word < top && *word == STACK_PAINT) {
+        word++;
+    }
+    return (const char *)word - (const char *)&_ebss;
+}
+
+
+size_t memory_heap_used() {
+    return mallinfo().uordblks;
+}
+
+
+/*
+Most heap in use at any memory_check() so far.
+*/
+size_t memory_heap_peak() {
+    return m_heap_peak;
+}
+
+
+/*
+Heap that can still be allocated: the free blocks in the arena and the space
+above it.
+*/
+size_t memory_heap_free() {
+    return (size_t)(&_heap_end - __brkval) + mallinfo().fordblks;
+}
+
+
+/*
+Updates the heap peak and warns once when the stack or heap headroom drops
+below its threshold. Call regularly from loop().
+*/
+void memory_check() {
+    size_t used = memory_heap_used();
+    if (used > m_heap_peak) {
+        m_heap_peak = used;
+    }
+
+    size_t stack_free = memory_stack_free();
+    if (stack_free < MEMORY_STACK_WARN_BYTES) {
+        if (!m_stack_low) {
+            LogWarn("Stack headroom low: %u of %u bytes never used.", (unsigned int)stack_free,
+                    (unsigned int)memory_stack_size());
+        }
+        m_stack_low = true;
+    }
+
+    size_t heap_free = memory_heap_free();
+    if (heap_free < MEMORY_HEAP_WARN_BYTES) {
+        if (!m_heap_low) {
+            LogWarn("Heap headroom low: %u bytes free, %u in use.", (unsigned int)heap_free,
+                    (unsigned int)used);
+        }
+        m_heap_low = true;
+    }
+    else {
+        m_heap_low = false;
+    }
+}
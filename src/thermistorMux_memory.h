@@ -0,0 +1,43 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_memory.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief RAM headroom tracking: stack painting at start-up and heap usage, for
+ * the memory diagnostic metrics and a warning when either runs low.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_MEMORY_H
+#define THERMISTORMUX_MEMORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Headroom below which memory_check() warns, bytes
+#define MEMORY_STACK_WARN_BYTES  4096
+#define MEMORY_HEAP_WARN_BYTES   16384
+
+void memory_init();
+void memory_check();
+size_t memory_stack_size();
+size_t memory_stack_free();
+size_t memory_heap_used();
+size_t memory_heap_peak();
+size_t memory_heap_free();
+
+#endif
@@ -26,14 +26,49 @@ this program. If not, see <https://www.gnu.org/licenses/>.
  * @copyright Copyright (c) 2021
  */
 
+#include <ctype.h>
 #include "thermistorMux_network.h"
 #include "thermistorMux_hardware.h"
 #include "thermistorMux_global.h"
 #include "thermistor_Mux.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_history.h"
+#include "thermistorMux_ntp.h"
+#include "thermistorMux_ptp.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_profile.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_scantrace.h"
+#include "thermistorMux_memory.h"
+#include "thermistorMux_warmboot.h"
+#include "thermistorMux_sensor.h"
+#include "thermistorMux_kalman.h"
+#include "thermistorMux_drift.h"
+#include "thermistorMux_alarm.h"
+#include "thermistorMux_sdlog.h"
+#include "thermistorMux_channels.h"
+#include "thermistorMux_scheduler.h"
+#include "thermistorMux_filter.h"
+#include "thermistorMux_config.h"
+#include "thermistorMux_calupload.h"
+#include "thermistorMux_calcapture.h"
+#include "thermistorMux_dcp.h"
+#include "thermistorMux_http.h"
+#include "thermistorMux_virtual.h"
+#include "thermistorMux_boot.h"
+#include "thermistorMux_selfheat.h"
+#include "thermistorMux_throttle.h"
+#include "thermistorMux_framesync.h"
+#include "thermistorMux_selftest.h"
+#include "thermistorMux_stream.h"
+#include "thermistorMux_stats.h"
+#include "thermistorMux_rollup.h"
+#include "thermistorMux_ota.h"
+#include "thermistorMux_log.h"
+#include "command_ADC.h"
 #include "cf_sparkplug.h"
 #include <NativeEthernet.h>
 #include <PubSubClient.h>
-#include <NTPClient_Generic.h>
 #include <sparkplugb_arduino.hpp>
 
 // Reset defines
@@ -45,11 +80,113 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 #define MUX_VERSION_COMPLETE "1v1"
 
+// Default maximum time a channel may go unpublished while report-by-exception
+// is enabled
+#define DEFAULT_HEARTBEAT_MS  60000
+
+// Stored frames are replayed in batches of HISTORY_FRAMES_PER_PAYLOAD, at most
+// one batch every HISTORY_REPLAY_INTERVAL_MS, so catching up after an outage
+// doesn't starve loop()
+#define HISTORY_FRAMES_PER_PAYLOAD  8
+#define HISTORY_REPLAY_INTERVAL_MS  100
+// The buckets a rollup query asks for are sent ROLLUP_BUCKETS_PER_PAYLOAD to an
+// NDATA, at the same rate
+#define ROLLUP_BUCKETS_PER_PAYLOAD  8
+#define ROLLUP_QUERY_SIZE           48
+// Live frames can be batched into one NDATA, up to a replay batch of them; the
+// banks' thermistors go in DDATA messages of their own, so their builds don't
+// batch.  A batch is published once it's full, or once BATCH_MAX_INTERVAL_MS
+// at most after its first frame was collected.
+#ifdef USE_DEVICE_BANKS
+#define BATCH_MAX_FRAMES  1
+#else
+#define BATCH_MAX_FRAMES  HISTORY_FRAMES_PER_PAYLOAD
+#endif
+#define DEFAULT_BATCH_INTERVAL_MS  1000
+#define BATCH_MAX_INTERVAL_MS      10000
+// Longest that frames are held after boot for the time service to sync, so
+// they can be stamped with UTC; after that they're published stamped with the
+// time since boot until it does.
+#define BOOT_SYNC_WAIT_MS  5000
+
+// The last value: the latest frame with every metric's name and the definitions
+// hash, retained on a topic of its own outside the Sparkplug namespace so a
+// host starting up can show the node at once, without asking for a rebirth.
+// Republished at most this often (Node Control/Last Value Interval; 0 = never),
+// when there's a newer frame.
+#define LAST_VALUE_INTERVAL_MS  10000
+#define LAST_VALUE_TOPIC_TYPE   "LAST_VALUE"    // GROUP_ID "/LAST_VALUE/" node_id
+
+// The self test's loopback: the node times a message it publishes to itself
+// through the broker, on a topic of its own outside the Sparkplug namespace
+#define SELF_TEST_TOPIC_TYPE    "SELF_TEST"     // GROUP_ID "/SELF_TEST/" node_id
+// A frame's NDATA, encoded by the self test to time it
+#define SELF_TEST_ENCODE_SIZE   (NUMBER_OF_THERMISTORS * 64 + 512)
+
+// Node commands waiting to be run outside the MQTT callback
+#define NODE_COMMAND_QUEUE_DEPTH    4
+// Commands that republish many metrics (a Rebirth, Calibration Status, Clear
+// Cal Data) go out at most once in this long.  Repeats of a Rebirth or a
+// Calibration Status request in the meantime are folded into the one waiting;
+// a repeated Clear Cal Data is refused as busy.
+#define COMMAND_HOLDOFF_MS          1000
+
+// How often the outbound queue metrics are refreshed
+#define OUTBOUND_STATS_INTERVAL_MS  10000
+
+// Interval between the Health metrics messages, milliseconds
+#define HEALTH_INTERVAL_MS  30000
+
+// Broker connection manager.  The TCP connect is the only step that blocks,
+// for at most BROKER_CONNECT_BUDGET_MS, and only one is started per call of
+// check_brokers().  Failed attempts are retried after a jittered exponential
+// backoff between the two BROKER_BACKOFF_ limits.
+#define BROKER_CONNECT_BUDGET_MS    250
+#define BROKER_SOCKET_TIMEOUT_S     5
+#define BROKER_BACKOFF_MIN_MS       500
+#define BROKER_BACKOFF_MAX_MS       60000
+
+// A connected broker whose outbound queue doesn't go down for this long has a
+// stuck socket: the watchdog restarts the broker connections, then reboots.
+#define NETWORK_STALL_MS            30000
+
+// NativeEthernet has no link-change interrupt, so the PHY link bit is sampled
+// this often.  While the link is down no connects are attempted, and when it
+// comes back every broker is retried at once.
+#define LINK_POLL_INTERVAL_MS       10
+
+// NativeEthernet (FNET) memory, applied before Ethernet.begin(); each can be set
+// from the build flags (-DNET_SOCKET_BUFFER_SIZE=16384).  Every socket gets TX
+// and RX buffers of NET_SOCKET_BUFFER_SIZE, which also caps the TCP window, and
+// the stack heap must hold them all besides the stack's own packet buffers.
+// Sockets: one per broker, NTP, the raw stream and the two PTP ports.
+#ifndef NET_SOCKETS
+#ifdef USE_PTP
+#define NET_SOCKETS             (NUM_BROKERS + 4)
+#else
+#define NET_SOCKETS             (NUM_BROKERS + 2)
+#endif
+#endif
+#ifndef NET_SOCKET_BUFFER_SIZE
+#define NET_SOCKET_BUFFER_SIZE  8192
+#endif
+#ifndef NET_STACK_HEAP_OVERHEAD
+#define NET_STACK_HEAP_OVERHEAD 32768
+#endif
+#define NET_STACK_HEAP_SIZE     (NET_SOCKETS * 2 * NET_SOCKET_BUFFER_SIZE + NET_STACK_HEAP_OVERHEAD)
+
 // Common network configuration values: TBD
 #define GATEWAY 128, 96, 11, 233
 #define SUBNET 255, 255, 0, 0
 #define DNS 128, 96, 11, 233
-#define NUM_BROKERS  1
+// Broker slots, in failover order.  Slots with no server configured are
+// unused; the list can be replaced at run time through Node Control/Broker List.
+#define NUM_BROKERS  3
+#define BROKER_LIST_SIZE  (NUM_BROKERS * 22)   // "255.255.255.255:65535,"
+#define STREAM_TARGET_SIZE  22                 // "255.255.255.255:65535"
+#define SAMPLE_SCHEDULE_SIZE (NUMBER_OF_THERMISTORS * 4)   // "128," per thermistor
+#define SETTLING_TIMES_SIZE  (NUMBER_OF_THERMISTORS * 6)   // "10000," per thermistor
+#define DIAGNOSTICS_SIZE     96     // One phase's profile, see publish_diagnostics()
 
 #if defined(production_TEST)
 // MQTT broker definitions: TBD
@@ -69,6 +206,7 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #define MQTT_BROKER1 169,254,32,245
 
 #define MQTT_BROKER1_PORT 1883
+// Standby brokers, if any: define MQTT_BROKER2/MQTT_BROKER2_PORT and so on
 
 //NTP server address
 #define NTP_IP  {169, 254, 39, 226}
@@ -85,45 +223,475 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 
 // Sparkplug settings
 #define GROUP_ID              "VI"              // This node's group ID
-#define NODE_ID_TEMPLATE      "THERMISTORx"            // Template for this node's node ID
-#define NODE_ID_TOKEN         'x'               // Character to be replaced with module ID
+#define NODE_ID_PREFIX        "THERMISTOR"      // Node ID is this followed by the module ID
+#define NODE_ID_SIZE          sizeof(NODE_ID_PREFIX "31")
+#ifdef USE_DEVICE_BANKS
+#define DEVICE_ID_PREFIX      "Bank"            // Bank n's device ID is this followed by n + 1
+#define DEVICE_ID_SIZE        sizeof(DEVICE_ID_PREFIX "8")
+// Longest topic name: the DBIRTH/DDEATH topics with a two digit module ID
+#define TOPIC_NAME_SIZE       (sizeof(DEVICE_TOPIC(DBIRTH_MESSAGE_TYPE, "", "")) + NODE_ID_SIZE - 1 + \
+                               DEVICE_ID_SIZE - 1)
+#else
+// Longest topic name: the NBIRTH/NDEATH topics with a two digit module ID
+#define TOPIC_NAME_SIZE       (sizeof(NODE_TOPIC(NBIRTH_MESSAGE_TYPE, "")) + NODE_ID_SIZE - 1)
+#endif
+#if MAX_BOARD_ID > 99
+  #error NODE_ID_SIZE only allows for two digit module IDs
+#endif
 
 /*
   Private variables
 */
 // NTP variables
-static EthernetUDP ntpUDP;
 static IPAddress ntpIP = NTP_IP;
-// Can use "pool.ntp.org" if connected to internet, but might have outages.
-// TODO: decrease sync frequency to avoid violation of pool.ntp.org terms of service
-static NTPClient ntp(ntpUDP, ntpIP);
 
 // MQTT variables
 static EthernetClient enet[NUM_BROKERS];
 static PubSubClient m_broker[NUM_BROKERS];
 
-// Sparkplug node and topic names
-static String node_id        = NODE_ID_TEMPLATE;
-static String nodeBirthTopic = NODE_TOPIC(NBIRTH_MESSAGE_TYPE, NODE_ID_TEMPLATE);
-static String nodeDeathTopic = NODE_TOPIC(NDEATH_MESSAGE_TYPE, NODE_ID_TEMPLATE);
-static String nodeDataTopic  = NODE_TOPIC(NDATA_MESSAGE_TYPE,  NODE_ID_TEMPLATE);
-static String nodeCmdTopic   = NODE_TOPIC(NCMD_MESSAGE_TYPE,   NODE_ID_TEMPLATE);
+// Connection states of a broker, in the order they are passed through
+enum BrokerState {
+    BROKER_IDLE,            // Not connected; waiting for retry_at
+    BROKER_CONNECTING,      // CONNECT sent, waiting for the CONNACK
+    BROKER_SUBSCRIBING,     // Connected, subscribing to our topics
+    BROKER_BIRTH,           // Subscribed, birth messages to be published
+    BROKER_ONLINE,          // Births published
+    BROKER_STANDBY          // Subscribed, kept warm for failover without births
+};
+
+struct BrokerLink {
+    BrokerState state;
+    unsigned long retry_at;     // millis() of the next connect attempt
+    unsigned long backoff_ms;   // Backoff before the next attempt after this one
+    unsigned long attempts;     // Failed attempts since last online
+    IPAddress ip;               // Server; unused slot if port is 0
+    uint16_t port;
+    bool host_online;           // Last Primary Host STATE seen on this broker
+};
+static BrokerLink m_link[NUM_BROKERS];
+static bool m_linkUp = true;                // Ethernet link at the last sample
+static unsigned long m_linkCheckedAt = 0;   // millis() of the last sample
+
+// In active/standby mode node messages only go to the active broker, and the
+// others are kept connected so that failing over is just a matter of
+// publishing births to one of them.  In fan-out mode they go to every broker.
+static int  m_activeBroker  = 0;
+static bool m_brokerFanOut  = false;
+// Broker whose loop() is running, so callbacks know where a message came from
+static int  m_loopingBroker = -1;
+
+// Brokers that node messages go to, as a broker array and its size
+#define TARGET_BROKERS  (m_brokerFanOut ? m_broker : &m_broker[m_activeBroker]), \
+                        (m_brokerFanOut ? NUM_BROKERS : 1)
+
+// A topic name, with the length and hash incoming topics are matched against
+struct TopicName {
+    char name[TOPIC_NAME_SIZE];
+    size_t len;
+    uint32_t hash;
+};
+
+// Sparkplug node and topic names, filled in by generateNames()
+static char node_id[NODE_ID_SIZE] = NODE_ID_PREFIX;
+static TopicName nodeBirthTopic;
+static TopicName nodeDeathTopic;
+static TopicName nodeDataTopic;
+static TopicName nodeCmdTopic;
+static TopicName hostStateTopic;
+static TopicName lastValueTopic;
+static TopicName selfTestTopic;
+#ifdef USE_DEVICE_BANKS
+// The topics of each bank's device messages
+struct BankTopics {
+    TopicName birth;
+    TopicName death;
+    TopicName data;
+    TopicName cmd;
+};
+static BankTopics bankTopics[NUM_DEVICE_BANKS];
+#endif
+
+// Handler of the messages on a subscribed topic
+typedef void (*TopicHandler)(const char *topic, byte *payload, unsigned int len);
+
+// The subscribed topics, set up by generateNames() and subscribed to by
+// subscribeTopics().  Incoming topics are looked up by hash in an open
+// addressed table, so dispatch costs a probe or two however many topics there
+// are.
+#ifdef USE_DEVICE_BANKS
+#define SUBSCRIPTION_SLOTS 32  // Power of 2, at least twice the topics
+static_assert(SUBSCRIPTION_SLOTS >= 2 * (3 + NUM_DEVICE_BANKS), "too few subscription slots for the bank DCMD topics");
+#else
+#define SUBSCRIPTION_SLOTS 8   // Power of 2, at least twice the topics
+#endif
+struct Subscription {
+    const TopicName *topic;    // NULL for a free slot
+    TopicHandler handler;
+};
+static Subscription m_subscriptions[SUBSCRIPTION_SLOTS];
+static unsigned int m_numSubscriptions = 0;
 
 // These variables hold the last published value of each metric
 static uint64_t m_bdSeq[NUM_BROKERS]  = {0};  // Node birth/death sequence numbers
 static bool     m_nodeReboot          = false;
 static bool     m_nodeRebirth         = false;
+#ifdef USE_DEVICE_BANKS
+static bool     m_bankRebirth[NUM_DEVICE_BANKS] = {false};
+#endif
 static bool     m_nodeNextServer      = false;
 static bool     m_nodeClearCal        = false;
 static bool     m_nodeCalibrated      = false;
 static bool     m_nodeCalibrationINW  = false;
 static uint64_t m_commsVersion        = COMMS_VERSION;
 static const char *m_firmwareVersion  = MUX_VERSION_COMPLETE;
-static float    m_calTemp1            = {0.0};
-static float    m_calTemp2            = {0.0};
-static const char *m_units            = "°C";// The user units
-static float    m_THERMISTOR[NUMBER_OF_THERMISTORS] = {0.0};
+static const char *m_resetCause       = "";  // Why the node last booted (see thermistorMux_watchdog.h)
+static char     m_bootTimelineBuffer[BOOT_TIMELINE_TEXT_SIZE] = "";
+static const char *m_bootTimeline     = m_bootTimelineBuffer;  // Start-up phases up to the first NBIRTH, see thermistorMux_boot.cpp
+static float    m_calTemp[CAL_MAX_POINTS] = {0.0};  // Reference temperature of each calibration point
+static float    m_calNoise            = 0;  // Largest standard deviation over the last point taken, °C
+static uint64_t m_calReady            = 0;  // Thermistors stable for the hold time in the running capture
+static char     m_calStabilityBuffer[CALCAPTURE_STABILITY_TEXT_SIZE] = "";
+static const char *m_calStability     = m_calStabilityBuffer;  // Capture thresholds, see thermistorMux_calcapture.cpp
+static const char *m_units            = THERMISTOR_UNITS;// The user units of the thermistors
+// Sparkplug datatype of the thermistor temperatures, and the type of a value
+// as published
+#ifdef USE_QUANTIZED_NDATA
+// Whole steps of THERMISTOR_SCALE_C above THERMISTOR_OFFSET_C, announced in
+// NBIRTH by the Scale and Offset properties of the thermistor metrics; the
+// array is the Bytes of THERMISTOR_ENCODING (see pack_enabled_channels())
+#define THERMISTOR_DATA_TYPE        METRIC_DATA_TYPE_INT16
+#define THERMISTOR_ARRAY_DATA_TYPE  METRIC_DATA_TYPE_BYTES
+#define THERMISTOR_SCALE_C          0.01
+#define THERMISTOR_OFFSET_C         -60.0
+#define THERMISTOR_ENCODING         "zigzag-varint-delta"
+typedef int16_t ThermistorMetricValue;
+#elif defined(USE_MILLIDEGREE_NDATA)
+#define THERMISTOR_DATA_TYPE        METRIC_DATA_TYPE_INT32
+#define THERMISTOR_ARRAY_DATA_TYPE  METRIC_DATA_TYPE_INT32_ARRAY
+typedef ThermistorValue ThermistorMetricValue;
+#else
+#define THERMISTOR_DATA_TYPE        METRIC_DATA_TYPE_FLOAT
+#define THERMISTOR_ARRAY_DATA_TYPE  METRIC_DATA_TYPE_FLOAT_ARRAY
+typedef ThermistorValue ThermistorMetricValue;
+#endif
+
+// A thermistor temperature as its metric publishes it.  Quantized, it's limited
+// to 0..INT16_MAX steps, so any value takes at most 3 bytes, and INT16_MIN is
+// null.
+static inline ThermistorMetricValue thermistor_metric_value(ThermistorValue value){
+#ifdef USE_QUANTIZED_NDATA
+    if(thermistor_null(value))
+        return INT16_MIN;
+    float steps = (thermistor_celsius(value) - (float) THERMISTOR_OFFSET_C) / (float) THERMISTOR_SCALE_C;
+    if(steps <= 0)
+        return 0;
+    if(steps >= INT16_MAX)
+        return INT16_MAX;
+    return (int16_t) lrintf(steps);
+#else
+    return value;
+#endif
+}
+
+#ifdef USE_QUANTIZED_NDATA
+// Each thermistor metric's properties: published value * Scale + Offset is °C
+static char *m_thermistorPropertyKeys[] = {
+    (char *) "Scale", (char *) "Offset",
+#ifdef USE_ARRAY_NDATA
+    (char *) "Encoding",
+#endif
+};
+static PropertyValue m_thermistorPropertyValues[NUM_ELEM(m_thermistorPropertyKeys)];
+static PropertySet m_thermistorProperties = {NUM_ELEM(m_thermistorPropertyKeys), m_thermistorPropertyKeys,
+                                             NUM_ELEM(m_thermistorPropertyValues), m_thermistorPropertyValues,
+                                             NULL};
+#define THERMISTOR_PROPERTIES  (&m_thermistorProperties)
+#define THERMISTOR_VARIABLE(channel)  (&Channels.quantized[channel])
+
+// Fill in the values of the thermistor metrics' properties.
+static void setup_thermistor_properties(){
+    for(PropertyValue &value : m_thermistorPropertyValues){
+        value.has_type = true;
+        value.type = PROPERTY_DATA_TYPE_DOUBLE;
+        value.which_value = org_eclipse_tahu_protobuf_Payload_PropertyValue_double_value_tag;
+    }
+    m_thermistorPropertyValues[0].value.double_value = THERMISTOR_SCALE_C;
+    m_thermistorPropertyValues[1].value.double_value = THERMISTOR_OFFSET_C;
+#ifdef USE_ARRAY_NDATA
+    m_thermistorPropertyValues[2].type = PROPERTY_DATA_TYPE_STRING;
+    m_thermistorPropertyValues[2].which_value = org_eclipse_tahu_protobuf_Payload_PropertyValue_string_value_tag;
+    m_thermistorPropertyValues[2].value.string_value = (char *) THERMISTOR_ENCODING;
+#endif
+}
+#else
+#define THERMISTOR_PROPERTIES  nullptr
+#define THERMISTOR_VARIABLE(channel)  (&Channels.frame[channel])
+#endif
+#ifdef USE_ARRAY_NDATA
+typedef METRIC_ARRAY_T(ThermistorValue, NUMBER_OF_THERMISTORS) ThermistorArray;
+static ThermistorArray m_THERMISTORS = METRIC_ARRAY_INIT(ThermistorValue, NUMBER_OF_THERMISTORS);
+#else
+// Each thermistor metric is its entry of Channels.frame, written by the conversion
+#endif
+#ifdef USE_CHANNEL_TEMPLATE
+// Each thermistor is an instance of the ThermistorChannel template, whose
+// members are its temperature and whether it's faulted. The definition is only
+// sent in NBIRTH; its members give the defaults.
+#define CHANNEL_TEMPLATE_NAME  "ThermistorChannel"
+enum ChannelMember {
+    CM_Value,
+    CM_Fault,
+    NUM_CHANNEL_MEMBERS
+};
+static MetricSpec m_channelMembers[NUMBER_OF_THERMISTORS][NUM_CHANNEL_MEMBERS];
+static MetricTemplate m_channelInstance[NUMBER_OF_THERMISTORS];
+static ThermistorValue m_channelDefaultValue = THERMISTOR_NULL;
+static bool m_channelDefaultFault = false;
+static MetricSpec m_channelDefinitionMembers[NUM_CHANNEL_MEMBERS] = {
+    METRIC_SPEC("Value", 0, false, THERMISTOR_DATA_TYPE, &m_channelDefaultValue),
+    METRIC_SPEC("Fault", 0, false, METRIC_DATA_TYPE_BOOLEAN, &m_channelDefaultFault),
+};
+static MetricTemplate m_channelDefinition = {NULL, ARRAY_AND_SIZE(m_channelDefinitionMembers)};
+#endif
+
+// Statistics of each thermistor over the last window, thermistor order, °C;
+// NaN (0 samples) for one with no readings
+typedef METRIC_ARRAY_T(float, NUMBER_OF_THERMISTORS) ChannelFloatArray;
+typedef METRIC_ARRAY_T(int32_t, NUMBER_OF_THERMISTORS) ChannelCountArray;
+#ifdef USE_CHANNEL_STATS
+static uint64_t m_statsWindow         = 0;  // Frames per statistics window; 0 = off
+#endif
+// Alarm limits of each kind, see thermistorMux_alarm.cpp, and the channels in
+// alarm, bit n for thermistor n
+static char     m_alarmLimitsBuffer[NUM_ALARM_KINDS][ALARM_LIMITS_TEXT_SIZE] = {""};
+static const char *m_alarmLimits[NUM_ALARM_KINDS] = {
+    m_alarmLimitsBuffer[ALARM_HIGH], m_alarmLimitsBuffer[ALARM_LOW], m_alarmLimitsBuffer[ALARM_RATE]
+};
+static uint64_t m_alarms[NUM_ALARM_KINDS] = {0};
+static uint64_t m_virtualAlarms[NUM_ALARM_KINDS] = {0};  // Virtual channels in alarm, bit n for virtual channel n + 1
+// Virtual channel definitions, see thermistorMux_virtual.cpp
+static char     m_virtualChannelsBuffer[VIRTUAL_TEXT_SIZE] = "";
+static const char *m_virtualChannels  = m_virtualChannelsBuffer;
+static char     m_newVirtualChannels[VIRTUAL_TEXT_SIZE] = "";  // Set by NCMD, applied by run_node_commands()
+static uint64_t m_compressionThreshold = PAYLOAD_COMPRESSION_BYTES;  // Payload size from which it's compressed, 0 = never
+#ifdef USE_SD_LOG
+static bool     m_sdLogging           = false;  // Set by the host to log the frames to the SD card
+static char     m_sdLogFileBuffer[SDLOG_FILE_NAME_SIZE] = "";
+static const char *m_sdLogFile        = m_sdLogFileBuffer;  // Log file being written, "" when none
+static uint64_t m_sdLogDropped        = 0;  // Frames the SD card fell too far behind to log
+#endif
+#ifdef USE_CHANNEL_STATS
+static ChannelFloatArray m_statsMin    = METRIC_ARRAY_INIT(float, NUMBER_OF_THERMISTORS);
+static ChannelFloatArray m_statsMax    = METRIC_ARRAY_INIT(float, NUMBER_OF_THERMISTORS);
+static ChannelFloatArray m_statsMean   = METRIC_ARRAY_INIT(float, NUMBER_OF_THERMISTORS);
+static ChannelFloatArray m_statsStdDev = METRIC_ARRAY_INIT(float, NUMBER_OF_THERMISTORS);
+static ChannelCountArray m_statsSamples = METRIC_ARRAY_INIT(int32_t, NUMBER_OF_THERMISTORS);
+// Rollup query being answered, "<1s|1m|1h> <from> [<to>]" in UTC milliseconds,
+// "" when none; see start_rollup_query()
+static char     m_rollupQueryBuffer[ROLLUP_QUERY_SIZE] = "";
+static const char *m_rollupQuery      = m_rollupQueryBuffer;
+static RollupLevel m_rollupLevel      = ROLLUP_SECOND;
+static unsigned long long m_rollupFrom = 0;  // Start of the next bucket to send
+static unsigned long long m_rollupTo  = 0;
+// Statistics values of the rollup buckets in a query answer
+struct RollupArrays {
+    ChannelFloatArray min;
+    ChannelFloatArray max;
+    ChannelFloatArray mean;
+    ChannelCountArray samples;
+};
+static RollupArrays m_rollupArrays[ROLLUP_BUCKETS_PER_PAYLOAD];
+#endif
+// Published frames being sent again for a host to fill a gap with: those
+// stamped from m_snapshotSince (UTC milliseconds, 0 when none) on, at the
+// history positions from m_snapshotNext up to m_snapshotEnd
+static uint64_t m_snapshotSince       = 0;
+static uint64_t m_lastValueInterval   = LAST_VALUE_INTERVAL_MS;  // ms between last values, 0 = none
+static uint32_t m_snapshotNext        = 0;
+static uint32_t m_snapshotEnd         = 0;
+
+#ifdef USE_ARRAY_NDATA
+// Array values for the stored frames in a replay payload
+static ThermistorArray m_historyArrays[HISTORY_FRAMES_PER_PAYLOAD];
+#endif
 static float    m_ADC_temperature     = 0.0;
+static uint64_t m_frameNumber         = 0;  // Number of the frame last handed to publish_data()
+static float    m_deadband            = 0.0;  // Absolute deadband, °C; 0 = off
+static float    m_deadbandPercent     = 0.0;  // Relative deadband, % of the last published value; 0 = off
+static bool     m_predictiveDeadband  = false;  // Deadbands around the linear prediction, not the last value
+static uint64_t m_heartbeatInterval   = DEFAULT_HEARTBEAT_MS;  // ms; 0 = none
+static uint64_t m_batchFrames         = 1;  // Frames per NDATA; 1 = off
+static uint64_t m_batchInterval       = DEFAULT_BATCH_INTERVAL_MS;  // ms; latest a batch is published
+// Frames collected for the next batched NDATA, a column per channel
+static ThermistorValue    m_batchThermistor[NUMBER_OF_THERMISTORS][BATCH_MAX_FRAMES];
+static float              m_batchAdcTemperature[BATCH_MAX_FRAMES];
+static unsigned long long m_batchTimestamp[BATCH_MAX_FRAMES];
+static uint64_t           m_batchCycles[BATCH_MAX_FRAMES];
+static uint64_t           m_batchFrame[BATCH_MAX_FRAMES];
+static unsigned int       m_batchCount = 0;
+static unsigned long      m_batchStart = 0;  // millis() when the first was collected
+static uint64_t m_outboundQueueDepth  = 0;  // Peak outbound queue depth over the last interval
+static uint64_t m_outboundDrops       = 0;  // NDATA messages dropped by the outbound queues
+static uint64_t m_outboundRetransmits = 0;  // QoS 1 data messages sent again after reconnecting
+static uint64_t m_sendLatency         = 0;  // Longest outbound send latency over the last interval, ms
+static unsigned long m_sendLatencyPeak = 0;  // Of the throttle checks since the last interval, ms
+static bool     m_adaptiveThrottle    = true;  // Step the publish profile down under broker backpressure
+static uint64_t m_throttleLatency     = THROTTLE_DEFAULT_LATENCY_MS;  // Send latency that counts as backpressure, ms
+static const char *m_publishProfile   = throttle_profile_name(PUBLISH_CONFIGURED);  // See thermistorMux_throttle.h
+static float    m_socketWritesPerPublish = 0.0;  // Socket writes per MQTT PUBLISH over the last interval
+static float    m_socketWriteSize     = 0.0;  // Average bytes per socket write over the last interval
+static uint64_t m_netSockets          = NET_SOCKETS;             // Sockets the network stack is sized for
+static uint64_t m_netSocketBuffer     = NET_SOCKET_BUFFER_SIZE;  // TX and RX buffer of each socket, bytes
+static uint64_t m_netStackHeap        = NET_STACK_HEAP_SIZE;     // Network stack heap, bytes
+#ifdef USE_FRAME_SYNC
+static uint64_t m_frameSync           = FRAME_SYNC_OFF;  // FrameSyncRole, see thermistorMux_framesync.h
+static uint64_t m_frameSyncOffset     = 0;  // Grid index of a frame less its number, as int64
+#endif
+#ifdef USE_DCP_CRYPTO
+static bool     m_cryptoSelfTest      = false;  // The DCP's AES and SHA-256 gave the known answers
+static float    m_cryptoRecordTime    = 0.0;    // µs to encrypt and hash a DCP_RECORD_SIZE record
+#endif
+static char     m_brokerListBuffer[BROKER_LIST_SIZE] = "";
+static const char *m_brokerList       = m_brokerListBuffer;  // "ip:port,..." in failover order
+static uint64_t m_activeBrokerNumber  = 1;  // 1-based slot of the active broker
+static uint64_t m_averagingPasses     = 0;  // Passes per frame; set from get_scan_config()
+static uint64_t m_framePeriod         = 0;  // ms; 0 = frames back to back
+static uint64_t m_adcOsr              = 0;  // ADC oversampling ratio
+static uint64_t m_dwellSamples        = 1;  // Samples averaged on each thermistor per pass
+static uint64_t m_frameBanks          = 1;  // Banks each frame is scanned and published in; 1 = whole frames
+static uint64_t m_tempInterval        = ADC_TEMP_INTERVAL_PASSES;  // Passes between ADC internal temperature conversions
+#ifdef USE_REF_TRACKING
+static uint64_t m_refInterval         = ADC_REF_INTERVAL_PASSES;   // Passes between ADC reference input conversions
+#endif
+static const char *m_acquisitionProfile = "";  // Name of the ADC profile in use, "Custom" for none
+static const char *m_spikeFilter      = "";  // Name of the spike filter in use (see filter_set_spike())
+static uint64_t m_channelMask         = 0;  // Enabled thermistors, bit n for thermistor n
+static uint64_t m_faultedChannels     = 0;  // Open or shorted thermistors, bit n for thermistor n
+static uint64_t m_quietInterval       = 1;  // Passes between scans of a quiet channel; 1 = adaptive sampling off
+static float    m_targetNoise         = 0;  // Target noise of a frame, °C RMS; 0 = fixed averaging passes
+static float    m_maxExcitationDuty   = 0;  // Most a thermistor may be excited over the duty window, %; 0 = no limit
+static float    m_dissipation         = 0;  // Thermistors' dissipation constant, mW/°C; 0 = no self-heating correction
+// Kalman filter noises of each kind, see thermistorMux_kalman.cpp, and the
+// variance of each thermistor's estimate, °C² (NaN for one not filtered),
+// published with the frames when m_publishVariance is set
+static char     m_kalmanNoiseBuffer[NUM_KALMAN_NOISES][KALMAN_NOISE_TEXT_SIZE] = {""};
+static const char *m_kalmanNoise[NUM_KALMAN_NOISES] = {
+    m_kalmanNoiseBuffer[KALMAN_PROCESS], m_kalmanNoiseBuffer[KALMAN_MEASUREMENT]
+};
+static bool     m_publishVariance     = false;
+static bool     m_driftCapture        = false;  // Set by the host to start a drift capture, cleared to fit it
+static char     m_driftModelBuffer[DRIFT_MODEL_TEXT_SIZE] = "-";
+static const char *m_driftModel       = m_driftModelBuffer;  // Die temperature drift model, see thermistorMux_drift.cpp
+static ChannelFloatArray m_estimateVariance = METRIC_ARRAY_INIT(float, NUMBER_OF_THERMISTORS);
+// Each frame's codes, sign extended and as converted (see thermistor_code_block()),
+// RAW_CODE_NULL for a channel disabled or faulted; published as m_rawCodesMode says
+static uint64_t m_rawCodesMode        = RAW_CODES_OFF;  // RawCodesMode
+static ChannelCountArray m_rawCodes   = METRIC_ARRAY_INIT(int32_t, NUMBER_OF_THERMISTORS);
+static uint64_t m_logLevel            = LOG_LEVEL_DEBUG;  // LOG_LEVEL_ERROR to LOG_LEVEL_DEBUG, see thermistorMux_log.h
+static bool     m_logBinaryTrace      = false;  // Serial log sends trace records instead of text
+static char     m_sampleScheduleBuffer[SAMPLE_SCHEDULE_SIZE] = "";
+static const char *m_sampleSchedule   = m_sampleScheduleBuffer;  // Passes between scans, per thermistor
+#ifdef USE_RAW_STREAM
+static char     m_streamTargetBuffer[STREAM_TARGET_SIZE] = "";
+static const char *m_streamTarget     = m_streamTargetBuffer;  // "ip:port" of the raw stream host; "" = off
+static bool     m_burstCapture        = false;  // Set by the host to start a burst on the raw stream, cleared when it ends
+static uint64_t m_burstChannels       = 1;  // Thermistors of the next burst, bit n for thermistor n
+static uint64_t m_burstOsr            = 0;  // ADC oversampling ratio of the next burst; 0 = the scan's
+static uint64_t m_burstDuration       = 1000;  // ms the next burst lasts
+#endif
+static bool     m_settlingSweep       = false;  // Set by the host to characterize the settling times, cleared when done
+static char     m_settlingTimesBuffer[SETTLING_TIMES_SIZE] = "";
+static const char *m_settlingTimes    = m_settlingTimesBuffer;  // µs between MOSFET switch and conversion, per thermistor
+static bool     m_selfTest            = false;  // Set by the host to run the performance self test, cleared with the results
+static char     m_selfTestRatesBuffer[SELF_TEST_RATES_SIZE] = "";
+static const char *m_selfTestRates    = m_selfTestRatesBuffer;  // Conversions/s per ADC of each profile, "name measured/nominal"
+static float    m_selfTestSpiRead     = NAN;  // µs an ADC register read-back takes
+static float    m_selfTestKernel      = NAN;  // Conversion kernel cycles per thermistor
+static float    m_selfTestEncode      = NAN;  // µs to build and encode a frame's NDATA
+static float    m_selfTestBroker      = NAN;  // ms for the loopback through the broker, NAN if it didn't come back
+static bool     m_selfTestWaiting     = false;  // The loopback is out
+static unsigned long m_selfTestSent   = 0;  // micros() when it went
+static char     m_sensorModelsBuffer[SENSOR_MODELS_TEXT_SIZE] = "";
+static const char *m_sensorModels     = m_sensorModelsBuffer;  // Thermistor models, see thermistorMux_sensor.cpp
+static char     m_channelSensorsBuffer[SENSOR_CHANNELS_TEXT_SIZE] = "";
+static const char *m_channelSensors   = m_channelSensorsBuffer;  // Model of each thermistor, "0,0,1,..."
+static char     m_newSensorModels[SENSOR_MODELS_TEXT_SIZE] = "";      // Set by NCMD, applied by run_node_commands()
+static char     m_newChannelSensors[SENSOR_CHANNELS_TEXT_SIZE] = "";
+static char     m_scanListBuffer[SCAN_LIST_TEXT_SIZE] = "-";
+static const char *m_scanList         = m_scanListBuffer;  // Scan order, see acquisition_set_scan_list(); "-" = by index
+static char     m_newScanList[SCAN_LIST_TEXT_SIZE] = "";      // Set by NCMD, applied by run_node_commands()
+// The node configuration in use as a blob, see thermistorMux_config.cpp
+typedef PB_BYTES_ARRAY_T(CONFIG_BLOB_SIZE) ConfigBlob;
+static ConfigBlob m_configuration     = {0, {0}};
+static uint64_t m_configurationHash   = 0;  // CRC32 of m_configuration, the same on nodes set up alike
+static ConfigBlob m_newConfiguration  = {0, {0}};  // Set by NCMD, applied by run_node_commands()
+// A calibration upload, see thermistorMux_calupload.cpp. The metric is always
+// published empty; the calibration metrics show the upload taking effect.
+static ConfigBlob m_calUpload         = {0, {0}};
+static PB_BYTES_ARRAY_T(CAL_UPLOAD_MAX_SIZE) m_newCalUpload = {0, {0}};  // Set by NCMD, applied by run_node_commands()
+static_assert(CAL_UPLOAD_MAX_SIZE + 64 <= COMMAND_STRINGS_SIZE && CAL_UPLOAD_MAX_SIZE + 128 <= MQTT_BUF_SIZE,
+              "the largest calibration upload doesn't fit in an NCMD");
+#ifdef USE_FIRMWARE_UPDATE
+// A firmware update, see thermistorMux_ota.cpp. The chunk metric is always
+// published empty; Node Control/Firmware Update shows each chunk taken.
+static char     m_firmwareUpdateBuffer[OTA_STATUS_TEXT_SIZE] = "idle";
+static const char *m_firmwareUpdate   = m_firmwareUpdateBuffer;
+static ConfigBlob m_firmwareChunk     = {0, {0}};
+static PB_BYTES_ARRAY_T(OTA_CHUNK_MAX_SIZE) m_newFirmwareChunk = {0, {0}};  // Set by NCMD, written by run_node_commands()
+static_assert(OTA_CHUNK_MAX_SIZE + 64 <= COMMAND_STRINGS_SIZE && OTA_CHUNK_MAX_SIZE + 128 <= MQTT_BUF_SIZE,
+              "the largest firmware chunk doesn't fit in an NCMD");
+#endif
+static uint64_t m_definitionsHash     = 0;  // Hash of the NBIRTH's metric definitions, see birth_definitions_hash()
+static uint64_t m_knownDefinitions    = 0;  // Definitions hash a host holds; matching NBIRTHs go out alias-only
+static float    m_frameRate           = 0;  // Frames converted per second over the last health interval
+static float    m_conversionRate      = 0;  // ADC samples read per second over the last health interval
+static uint64_t m_invalidData         = 0;  // Saturated ADC reads since start-up
+static uint64_t m_registerMismatches  = 0;  // ADC register check failures since start-up
+static uint64_t m_adcCrcErrors        = 0;  // ADCDATA reads that failed their CRC since start-up
+static uint64_t m_publishFailures     = 0;  // NDATA messages that couldn't be published
+static uint64_t m_brokerConnects      = 0;  // Broker connections made since start-up
+static uint64_t m_bdSeqIncrements     = 0;  // Birth/death sequence numbers taken since start-up
+static uint64_t m_sampleOverruns      = 0;  // Samples dropped because the sample ring was full
+static uint64_t m_frameOverruns       = 0;  // Frame starts missed because a frame ran past its period
+static uint64_t m_irqMissed           = 0;  // ADC data-ready interrupts given up waiting for since start-up
+static uint64_t m_irqLate             = 0;  // Data-ready interrupts past their deadline since start-up
+static uint64_t m_irqDuplicates       = 0;  // Data-ready interrupts with no conversion to read since start-up
+static uint64_t m_adcRecoveries       = 0;  // ADC re-initializations after a missed data-ready
+static uint64_t m_adcReconfigurations = 0;  // ADC configurations restored after a power-on reset or CRCCFG error
+static uint64_t m_watchdogRecoveries  = 0;  // Stalled check-ins the watchdog restarted since start-up
+static uint64_t m_linkLosses          = 0;  // Times the Ethernet link went down since start-up
+static uint64_t m_commandsBusy        = 0;  // Node commands refused as busy since start-up
+static uint64_t m_framesLost          = 0;  // Converted frames never published since start-up
+static uint64_t m_framesReplayed      = 0;  // Stored frames replayed since start-up
+static uint64_t m_framesResent        = 0;  // Published frames sent again for snapshots since start-up
+static float    m_irqLatency          = 0;  // Worst acquisition interrupt latency over the last health interval, us
+static float    m_framePhaseError     = NAN;  // Worst frame start error from its UTC grid point over the last health interval, us
+static uint64_t m_timeSinceSync       = (uint64_t) -1;  // Seconds since the last time sync, -1 before the first
+static float    m_historyFill         = 0;  // Store-and-forward history in use, %
+static float    m_cpuUtilization      = 0;  // Time the core wasn't asleep over the last health interval, %
+static float    m_peakExcitationDuty  = 0;  // Highest thermistor excitation duty over the duty window, %
+static uint64_t m_restingChannels     = 0;  // Thermistors resting over the duty limit, bit n for thermistor n
+#ifdef USE_FRAME_SYNC
+static uint64_t m_syncMissed          = 0;  // Frames a frame sync follower took itself, no edge coming
+#endif
+static uint64_t m_stackFree           = 0;  // Stack never used since start-up, bytes
+static uint64_t m_heapUsed            = 0;  // Heap allocated, bytes
+static uint64_t m_heapPeak            = 0;  // Most heap allocated at any check, bytes
+static uint64_t m_heapFree            = 0;  // Heap that can still be allocated, bytes
+#ifdef USE_SCAN_TRACE
+static bool     m_captureScanTrace    = false;  // Set by the host to start a scan timing capture
+static bool     m_dumpScanTrace       = false;  // Set by the host to dump the capture
+#endif
+#ifdef USE_PROFILER
+static bool     m_reportDiagnostics   = false;  // Set by the host to publish the phase profiles
+static char     m_diagnosticsBuffer[NUM_PROFILE_PHASES][DIAGNOSTICS_SIZE];
+static const char *m_diagnostics[NUM_PROFILE_PHASES] = {  // Run times of each profiled phase
+    m_diagnosticsBuffer[PROFILE_ACQUISITION], m_diagnosticsBuffer[PROFILE_CONVERSION],
+    m_diagnosticsBuffer[PROFILE_CALIBRATION], m_diagnosticsBuffer[PROFILE_LOG],
+    m_diagnosticsBuffer[PROFILE_ENCODE],      m_diagnosticsBuffer[PROFILE_PUBLISH]
+};
+static void publish_diagnostics();
+#endif
 
 // Alias numbers for each of the node metrics
 enum NodeMetricAlias {
@@ -138,101 +706,639 @@ enum NodeMetricAlias {
     NMA_CalibrationINW,
     NMA_CommsVersion,
     NMA_FirmwareVersion,
+    NMA_ResetCause,
+    NMA_BootTimeline,
     NMA_Units,
+    NMA_Deadband,
+    NMA_DeadbandPercent,
+    NMA_PredictiveDeadband,
+    NMA_HeartbeatInterval,
+    NMA_BatchFrames,
+    NMA_BatchInterval,
+    NMA_AdaptiveThrottle,
+    NMA_ThrottleLatency,
+    NMA_OutboundQueueDepth,
+    NMA_OutboundDrops,
+    NMA_OutboundRetransmits,
+    NMA_SendLatency,
+    NMA_PublishProfile,
+    NMA_SocketWritesPerPublish,
+    NMA_SocketWriteSize,
+    NMA_NetSockets,
+    NMA_NetSocketBuffer,
+    NMA_NetStackHeap,
+#ifdef USE_FRAME_SYNC
+    NMA_FrameSync,
+    NMA_FrameSyncOffset,
+#endif
+#ifdef USE_DCP_CRYPTO
+    NMA_CryptoSelfTest,
+    NMA_CryptoRecordTime,
+#endif
+    NMA_BrokerList,
+    NMA_BrokerFanOut,
+    NMA_ActiveBroker,
+#ifdef USE_RAW_STREAM
+    NMA_StreamTarget,
+    NMA_BurstCapture,
+    NMA_BurstChannels,
+    NMA_BurstOversampling,
+    NMA_BurstDuration,
+#endif
+    NMA_SettlingSweep,
+    NMA_SettlingTimes,
+    NMA_SelfTest,
+    NMA_SelfTestRates,
+    NMA_SelfTestSpiRead,
+    NMA_SelfTestKernel,
+    NMA_SelfTestEncode,
+    NMA_SelfTestBroker,
+    NMA_ScanList,
+    NMA_AveragingPasses,
+    NMA_FramePeriod,
+    NMA_ADCOversampling,
+    NMA_ChannelMask,
+    NMA_FaultedChannels,
+    NMA_QuietInterval,
+    NMA_TargetNoise,
+    NMA_MaxExcitationDuty,
+    NMA_DissipationConstant,
+    NMA_KalmanProcessNoise,
+    NMA_KalmanMeasurementNoise,
+    NMA_PublishEstimateVariance,
+    NMA_EstimateVariance,
+    NMA_RawCodesMode,
+    NMA_RawCodes,
+    NMA_DriftCapture,
+    NMA_DriftCompensation,
+    NMA_CalibrationUpload,
+    NMA_CalibrationStability,
+    NMA_CalibrationReady,
+#ifdef USE_FIRMWARE_UPDATE
+    NMA_FirmwareUpdate,
+    NMA_FirmwareChunk,
+#endif
+    NMA_SampleSchedule,
+    NMA_DwellSamples,
+    NMA_FrameBanks,
+    NMA_AcquisitionProfile,
+    NMA_SpikeFilter,
+    NMA_TempInterval,
+#ifdef USE_REF_TRACKING
+    NMA_RefInterval,
+#endif
+    NMA_SensorModels,
+    NMA_ChannelSensors,
+    NMA_Configuration,
+    NMA_ConfigurationHash,
+    NMA_DefinitionsHash,
+    NMA_KnownDefinitions,
+#ifdef USE_CHANNEL_STATS
+    NMA_StatsWindow,
+    NMA_StatsMin,
+    NMA_StatsMax,
+    NMA_StatsMean,
+    NMA_StatsStdDev,
+    NMA_StatsSamples,
+#endif
+    NMA_AlarmHighLimits,
+    NMA_AlarmLowLimits,
+    NMA_AlarmRateLimits,
+    NMA_AlarmHigh,
+    NMA_AlarmLow,
+    NMA_AlarmRate,
+    NMA_CompressionThreshold,
+#ifdef USE_SD_LOG
+    NMA_SDLogging,
+    NMA_SDLogFile,
+    NMA_SDLogDropped,
+#endif
+#ifdef USE_PROFILER
+    NMA_ReportDiagnostics,
+    NMA_DiagAcquisition,
+    NMA_DiagConversion,
+    NMA_DiagCalibration,
+    NMA_DiagLog,
+    NMA_DiagEncode,
+    NMA_DiagPublish,
+#endif
+    NMA_HealthFrameRate,
+    NMA_HealthConversionRate,
+    NMA_HealthInvalidData,
+    NMA_HealthRegisterMismatches,
+    NMA_HealthAdcCrcErrors,
+    NMA_HealthPublishFailures,
+    NMA_HealthBrokerConnects,
+    NMA_HealthBdSeqIncrements,
+    NMA_HealthSampleOverruns,
+    NMA_HealthFrameOverruns,
+    NMA_HealthIrqMissed,
+    NMA_HealthIrqLate,
+    NMA_HealthIrqDuplicates,
+    NMA_HealthAdcRecoveries,
+    NMA_HealthAdcReconfigurations,
+    NMA_HealthWatchdogRecoveries,
+    NMA_HealthLinkLosses,
+    NMA_HealthCommandsBusy,
+    NMA_HealthFramesLost,
+    NMA_HealthFramesReplayed,
+    NMA_HealthFramesResent,
+    NMA_HealthIrqLatency,
+    NMA_HealthFramePhaseError,
+    NMA_HealthTimeSinceSync,
+    NMA_HealthHistoryFill,
+    NMA_HealthCpuUtilization,
+    NMA_HealthPeakExcitationDuty,
+    NMA_HealthRestingChannels,
+#ifdef USE_FRAME_SYNC
+    NMA_HealthSyncMissed,
+#endif
+    NMA_DiagStackFree,
+    NMA_DiagHeapUsed,
+    NMA_DiagHeapPeak,
+    NMA_DiagHeapFree,
+#ifdef USE_SCAN_TRACE
+    NMA_CaptureScanTrace,
+    NMA_DumpScanTrace,
+#endif
+    NMA_CalibrationTemp3,
+    NMA_CalibrationTemp4,
+    NMA_CalibrationTemp5,
+    NMA_CalibrationTemp6,
+    NMA_CalibrationTemp7,
+    NMA_CalibrationTemp8,
+    NMA_HealthCalibrationNoise,
+#ifdef USE_CHANNEL_STATS
+    NMA_RollupQuery,
+#endif
+    NMA_SnapshotSince,
+    NMA_VirtualChannels,
+    NMA_LastValueInterval,
+    NMA_AlarmVirtualHigh,
+    NMA_AlarmVirtualLow,
+    NMA_AlarmVirtualRate,
+#ifdef USE_CHANNEL_TEMPLATE
+    NMA_ChannelTemplate,
+#endif
+    NMA_LogLevel,
+    NMA_LogBinaryTrace,
+#ifdef USE_ARRAY_NDATA
+    NMA_THERMISTORS,
+#elif !defined(USE_DEVICE_BANKS)
     NMA_THERMISTOR1,
-    NMA_THERMISTOR2,
-    NMA_THERMISTOR3,
-    NMA_THERMISTOR4,
-    NMA_THERMISTOR5,
-    NMA_THERMISTOR6,
-    NMA_THERMISTOR7,
-    NMA_THERMISTOR8,
-    NMA_THERMISTOR9,
-    NMA_THERMISTOR10,
-    NMA_THERMISTOR11,
-    NMA_THERMISTOR12,
-    NMA_THERMISTOR13,
-    NMA_THERMISTOR14,
-    NMA_THERMISTOR15,
-    NMA_THERMISTOR16,
-    NMA_THERMISTOR17,
-    NMA_THERMISTOR18,
-    NMA_THERMISTOR19,
-    NMA_THERMISTOR20,
-    NMA_THERMISTOR21,
-    NMA_THERMISTOR22,
-    NMA_THERMISTOR23,
-    NMA_THERMISTOR24,
-    NMA_THERMISTOR25,
-    NMA_THERMISTOR26,
-    NMA_THERMISTOR27,
-    NMA_THERMISTOR28,
-    NMA_THERMISTOR29,
-    NMA_THERMISTOR30,
-    NMA_THERMISTOR31,
-    NMA_THERMISTOR32,
+    NMA_LAST_THERMISTOR = NMA_THERMISTOR1 + NUMBER_OF_THERMISTORS - 1,
+#endif
+    NMA_VIRTUAL1,
+    NMA_LAST_VIRTUAL = NMA_VIRTUAL1 + MAX_VIRTUAL_CHANNELS - 1,
     NMA_ADC_Temperature,
+    NMA_FrameNumber,
     EndNodeMetricAlias
 };
 
+// The node metrics published with every frame have consecutive aliases, ending
+// with the virtual channels, the ADC temperature and the frame number
+#ifdef USE_ARRAY_NDATA
+#define NMA_FIRST_FRAME_METRIC  NMA_THERMISTORS
+#elif defined(USE_DEVICE_BANKS)
+#define NMA_FIRST_FRAME_METRIC  NMA_VIRTUAL1
+#else
+#define NMA_FIRST_FRAME_METRIC  NMA_THERMISTOR1
+#endif
+#define NUM_FRAME_METRICS       (NMA_FrameNumber - NMA_FIRST_FRAME_METRIC + 1)
+
+#ifdef USE_DEVICE_BANKS
+// Each bank's metrics take the next consecutive aliases, unique across the
+// node as Sparkplug requires: its thermistors, then its Device Control/Rebirth
+#define BANK_METRICS              (DEVICE_BANK_SIZE + 1)
+#define BANK_FIRST_ALIAS(bank)    (EndNodeMetricAlias + (bank) * BANK_METRICS)
+#define BANK_REBIRTH_ALIAS(bank)  (BANK_FIRST_ALIAS(bank) + DEVICE_BANK_SIZE)
+#define CHANNEL_ALIAS(channel)    (BANK_FIRST_ALIAS(DEVICE_BANK(channel)) + (channel) % DEVICE_BANK_SIZE)
+#else
+#define CHANNEL_ALIAS(channel)    (NMA_THERMISTOR1 + (channel))
+#endif
+
 // The bdseq metric for a single broker
 static MetricSpec bdseqMetricsTemplate[] = {
-    {"bdSeq", NMA_bdSeq, false, METRIC_DATA_TYPE_INT64, NULL, false, 0},
+    METRIC_SPEC("bdSeq", NMA_bdSeq, false, METRIC_DATA_TYPE_INT64, NULL),
 };
 
 // The bdseq metrics for all brokers
 static MetricSpec bdseqMetrics[NUM_BROKERS][NUM_ELEM(bdseqMetricsTemplate)];
 
-// All node metrics
-static MetricSpec NodeMetrics[] = {
-    {"Node Control/Reboot",                      NMA_Reboot,             true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeReboot,         false, 0},
-    {"Node Control/Rebirth",                     NMA_Rebirth,            true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeRebirth,        false, 0},
-    {"Node Control/Next Server",                 NMA_NextServer,         true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeNextServer,     false, 0},
-    {"Node Control/Calibration INW",             NMA_CalibrationINW,     true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrationINW, false, 0},
-    {"Node Control/Clear Cal Data",              NMA_ClearCal,           true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeClearCal,       false, 0},
-    {"Properties/Calibration Status",            NMA_CalibrationStatus,  true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrated,     false, 0},
-    {"Node Control/Calibration Temperature 1",   NMA_CalibrationTemp1,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp1,           false, 0},        
-    {"Node Control/Calibration Temperature 2",   NMA_CalibrationTemp2,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp2,           false, 0},    
-    {"Properties/Communications Version",        NMA_CommsVersion,       false, METRIC_DATA_TYPE_INT64,   &m_commsVersion,       false, 0},
-    {"Properties/Firmware Version",              NMA_FirmwareVersion,    false, METRIC_DATA_TYPE_STRING,  &m_firmwareVersion,    false, 0},
-    {"Properties/Units",                         NMA_Units,              false, METRIC_DATA_TYPE_STRING,  &m_units,              false, 0},
-    {"Inputs/THERMISTOR1",                       NMA_THERMISTOR1,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[0],      false, 0},
-    {"Inputs/THERMISTOR2",                       NMA_THERMISTOR2,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[1],      false, 0},
-    {"Inputs/THERMISTOR3",                       NMA_THERMISTOR3,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[2],      false, 0},
-    {"Inputs/THERMISTOR4",                       NMA_THERMISTOR4,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[3],      false, 0},
-    {"Inputs/THERMISTOR5",                       NMA_THERMISTOR5,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[4],      false, 0},
-    {"Inputs/THERMISTOR6",                       NMA_THERMISTOR6,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[5],      false, 0},
-    {"Inputs/THERMISTOR7",                       NMA_THERMISTOR7,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[6],      false, 0},
-    {"Inputs/THERMISTOR8",                       NMA_THERMISTOR8,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[7],      false, 0},
-    {"Inputs/THERMISTOR9",                       NMA_THERMISTOR9,        false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[8],      false, 0},
-    {"Inputs/THERMISTOR10",                      NMA_THERMISTOR10,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[9],      false, 0},
-    {"Inputs/THERMISTOR11",                      NMA_THERMISTOR11,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[10],     false, 0},
-    {"Inputs/THERMISTOR12",                      NMA_THERMISTOR12,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[11],     false, 0},
-    {"Inputs/THERMISTOR13",                      NMA_THERMISTOR13,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[12],     false, 0},
-    {"Inputs/THERMISTOR14",                      NMA_THERMISTOR14,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[13],     false, 0},
-    {"Inputs/THERMISTOR15",                      NMA_THERMISTOR15,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[14],     false, 0},
-    {"Inputs/THERMISTOR16",                      NMA_THERMISTOR16,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[15],     false, 0},
-    {"Inputs/THERMISTOR17",                      NMA_THERMISTOR17,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[16],     false, 0},
-    {"Inputs/THERMISTOR18",                      NMA_THERMISTOR18,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[17],     false, 0},
-    {"Inputs/THERMISTOR19",                      NMA_THERMISTOR19,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[18],     false, 0},
-    {"Inputs/THERMISTOR20",                      NMA_THERMISTOR20,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[19],     false, 0},
-    {"Inputs/THERMISTOR21",                      NMA_THERMISTOR21,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[20],     false, 0},
-    {"Inputs/THERMISTOR22",                      NMA_THERMISTOR22,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[21],     false, 0},
-    {"Inputs/THERMISTOR23",                      NMA_THERMISTOR23,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[22],     false, 0},
-    {"Inputs/THERMISTOR24",                      NMA_THERMISTOR24,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[23],     false, 0},
-    {"Inputs/THERMISTOR25",                      NMA_THERMISTOR25,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[24],     false, 0},
-    {"Inputs/THERMISTOR26",                      NMA_THERMISTOR26,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[25],     false, 0},
-    {"Inputs/THERMISTOR27",                      NMA_THERMISTOR27,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[26],     false, 0},
-    {"Inputs/THERMISTOR28",                      NMA_THERMISTOR28,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[27],     false, 0},
-    {"Inputs/THERMISTOR29",                      NMA_THERMISTOR29,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[28],     false, 0},
-    {"Inputs/THERMISTOR30",                      NMA_THERMISTOR30,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[29],     false, 0},
-    {"Inputs/THERMISTOR31",                      NMA_THERMISTOR31,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[30],     false, 0},
-    {"Inputs/THERMISTOR32",                      NMA_THERMISTOR32,       false, METRIC_DATA_TYPE_FLOAT,   &m_THERMISTOR[31],     false, 0},
-    {"Inputs/ADC Internal Temperature",          NMA_ADC_Temperature,    false, METRIC_DATA_TYPE_FLOAT,   &m_ADC_temperature,    false, 0},
+// The node's own variable types, on top of cf_sparkplug's
+constexpr bool metric_type_matches(uint32_t datatype, const ConfigBlob *){
+    return datatype == METRIC_DATA_TYPE_BYTES;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const ChannelFloatArray *){
+    return datatype == METRIC_DATA_TYPE_FLOAT_ARRAY;
+}
+constexpr bool metric_type_matches(uint32_t datatype, const ChannelCountArray *){
+    return datatype == METRIC_DATA_TYPE_INT32_ARRAY;
+}
+#ifdef USE_ARRAY_NDATA
+constexpr bool metric_type_matches(uint32_t datatype, const ThermistorArray *){
+    return datatype == THERMISTOR_ARRAY_DATA_TYPE;
+}
+#endif
+
+// A node metric row, checked at compile time against its variable's type
+template<typename T>
+constexpr MetricSpec node_metric(const char *name, unsigned int alias, bool writable,
+                                 uint32_t datatype, T *variable){
+    return metric_spec(name, alias, writable, datatype, variable);
+}
+
+// A node metric row sent in births alone, for a value that's fixed by the time
+// the node first births
+template<typename T>
+constexpr MetricSpec birth_metric(const char *name, unsigned int alias, uint32_t datatype, T *variable){
+    MetricSpec metric = node_metric(name, alias, false, datatype, variable);
+    metric.kind = METRIC_BIRTH_ONLY;
+    return metric;
+}
+
+// A frame metric row, updated with every frame
+template<typename T>
+constexpr MetricSpec frame_metric(const char *name, unsigned int alias, uint32_t datatype, T *variable){
+    MetricSpec metric = node_metric(name, alias, false, datatype, variable);
+    metric.kind = METRIC_STREAMING;
+    return metric;
+}
+
+// A thermistor metric row, with the properties its values need
+template<typename T>
+constexpr MetricSpec thermistor_metric(const char *name, unsigned int alias, uint32_t datatype, T *variable){
+    MetricSpec metric = frame_metric(name, alias, datatype, variable);
+    metric.properties = THERMISTOR_PROPERTIES;
+    return metric;
+}
+
+// The node metrics before the frame metrics
+static constexpr MetricSpec nodeControlMetrics[] = {
+    node_metric("Node Control/Reboot",                      NMA_Reboot,             true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeReboot),
+    node_metric("Node Control/Rebirth",                     NMA_Rebirth,            true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeRebirth),
+    node_metric("Node Control/Next Server",                 NMA_NextServer,         true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeNextServer),
+    node_metric("Node Control/Calibration INW",             NMA_CalibrationINW,     true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrationINW),
+    node_metric("Node Control/Clear Cal Data",              NMA_ClearCal,           true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeClearCal),
+    node_metric("Properties/Calibration Status",            NMA_CalibrationStatus,  true, METRIC_DATA_TYPE_BOOLEAN,  &m_nodeCalibrated),
+    node_metric("Node Control/Calibration Temperature 1",   NMA_CalibrationTemp1,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[0]),
+    node_metric("Node Control/Calibration Temperature 2",   NMA_CalibrationTemp2,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[1]),
+    birth_metric("Properties/Communications Version",       NMA_CommsVersion,       METRIC_DATA_TYPE_INT64,          &m_commsVersion),
+    birth_metric("Properties/Firmware Version",             NMA_FirmwareVersion,    METRIC_DATA_TYPE_STRING,         &m_firmwareVersion),
+    birth_metric("Properties/Reset Cause",                  NMA_ResetCause,         METRIC_DATA_TYPE_STRING,         &m_resetCause),
+    birth_metric("Properties/Boot Timeline",                NMA_BootTimeline,       METRIC_DATA_TYPE_STRING,         &m_bootTimeline),
+    birth_metric("Properties/Units",                        NMA_Units,              METRIC_DATA_TYPE_STRING,         &m_units),
+    node_metric("Node Control/Deadband",                    NMA_Deadband,           true, METRIC_DATA_TYPE_FLOAT,    &m_deadband),
+    node_metric("Node Control/Deadband Percent",            NMA_DeadbandPercent,    true, METRIC_DATA_TYPE_FLOAT,    &m_deadbandPercent),
+    node_metric("Node Control/Predictive Deadband",         NMA_PredictiveDeadband, true, METRIC_DATA_TYPE_BOOLEAN,  &m_predictiveDeadband),
+    node_metric("Node Control/Heartbeat Interval",          NMA_HeartbeatInterval,  true, METRIC_DATA_TYPE_INT64,    &m_heartbeatInterval),
+    node_metric("Node Control/Batch Frames",                NMA_BatchFrames,        true, METRIC_DATA_TYPE_INT64,    &m_batchFrames),
+    node_metric("Node Control/Batch Interval",              NMA_BatchInterval,      true, METRIC_DATA_TYPE_INT64,    &m_batchInterval),
+    node_metric("Node Control/Adaptive Throttle",           NMA_AdaptiveThrottle,   true, METRIC_DATA_TYPE_BOOLEAN,  &m_adaptiveThrottle),
+    node_metric("Node Control/Throttle Latency",            NMA_ThrottleLatency,    true, METRIC_DATA_TYPE_INT64,    &m_throttleLatency),
+    node_metric("Properties/Outbound Queue Depth",          NMA_OutboundQueueDepth, false, METRIC_DATA_TYPE_INT64,   &m_outboundQueueDepth),
+    node_metric("Properties/Outbound Drops",                NMA_OutboundDrops,      false, METRIC_DATA_TYPE_INT64,   &m_outboundDrops),
+    node_metric("Properties/Outbound Retransmits",          NMA_OutboundRetransmits, false, METRIC_DATA_TYPE_INT64,  &m_outboundRetransmits),
+    node_metric("Properties/Send Latency",                  NMA_SendLatency,        false, METRIC_DATA_TYPE_INT64,   &m_sendLatency),
+    node_metric("Properties/Publish Profile",               NMA_PublishProfile,     false, METRIC_DATA_TYPE_STRING,  &m_publishProfile),
+    node_metric("Properties/Socket Writes Per Publish",     NMA_SocketWritesPerPublish, false, METRIC_DATA_TYPE_FLOAT, &m_socketWritesPerPublish),
+    node_metric("Properties/Socket Write Size",             NMA_SocketWriteSize,    false, METRIC_DATA_TYPE_FLOAT,   &m_socketWriteSize),
+    birth_metric("Properties/Network Sockets",              NMA_NetSockets,         METRIC_DATA_TYPE_INT64,          &m_netSockets),
+    birth_metric("Properties/Socket Buffer Size",           NMA_NetSocketBuffer,    METRIC_DATA_TYPE_INT64,          &m_netSocketBuffer),
+    birth_metric("Properties/Network Stack Heap",           NMA_NetStackHeap,       METRIC_DATA_TYPE_INT64,          &m_netStackHeap),
+#ifdef USE_FRAME_SYNC
+    node_metric("Node Control/Frame Sync",                  NMA_FrameSync,          true, METRIC_DATA_TYPE_INT64,    &m_frameSync),
+    node_metric("Properties/Frame Sync Offset",             NMA_FrameSyncOffset,    false, METRIC_DATA_TYPE_INT64,   &m_frameSyncOffset),
+#endif
+#ifdef USE_DCP_CRYPTO
+    birth_metric("Properties/Crypto Self Test",             NMA_CryptoSelfTest,     METRIC_DATA_TYPE_BOOLEAN,        &m_cryptoSelfTest),
+    birth_metric("Properties/Crypto Record Time",           NMA_CryptoRecordTime,   METRIC_DATA_TYPE_FLOAT,          &m_cryptoRecordTime),
+#endif
+    node_metric("Node Control/Broker List",                 NMA_BrokerList,         true, METRIC_DATA_TYPE_STRING,   &m_brokerList),
+    node_metric("Node Control/Broker Fan Out",              NMA_BrokerFanOut,       true, METRIC_DATA_TYPE_BOOLEAN,  &m_brokerFanOut),
+    node_metric("Properties/Active Broker",                 NMA_ActiveBroker,       false, METRIC_DATA_TYPE_INT64,   &m_activeBrokerNumber),
+#ifdef USE_RAW_STREAM
+    node_metric("Node Control/Raw Stream Target",           NMA_StreamTarget,       true, METRIC_DATA_TYPE_STRING,   &m_streamTarget),
+    node_metric("Node Control/Burst Capture",               NMA_BurstCapture,       true, METRIC_DATA_TYPE_BOOLEAN,  &m_burstCapture),
+    node_metric("Node Control/Burst Channels",              NMA_BurstChannels,      true, METRIC_DATA_TYPE_INT64,    &m_burstChannels),
+    node_metric("Node Control/Burst Oversampling",          NMA_BurstOversampling,  true, METRIC_DATA_TYPE_INT64,    &m_burstOsr),
+    node_metric("Node Control/Burst Duration",              NMA_BurstDuration,      true, METRIC_DATA_TYPE_INT64,    &m_burstDuration),
+#endif
+    node_metric("Node Control/Settling Sweep",              NMA_SettlingSweep,      true, METRIC_DATA_TYPE_BOOLEAN,  &m_settlingSweep),
+    node_metric("Properties/Settling Times",                NMA_SettlingTimes,      false, METRIC_DATA_TYPE_STRING,  &m_settlingTimes),
+    node_metric("Node Control/Self Test",                   NMA_SelfTest,           true, METRIC_DATA_TYPE_BOOLEAN,  &m_selfTest),
+    node_metric("Self Test/Conversion Rates",               NMA_SelfTestRates,      false, METRIC_DATA_TYPE_STRING,  &m_selfTestRates),
+    node_metric("Self Test/SPI Read Time",                  NMA_SelfTestSpiRead,    false, METRIC_DATA_TYPE_FLOAT,   &m_selfTestSpiRead),
+    node_metric("Self Test/Kernel Cycles",                  NMA_SelfTestKernel,     false, METRIC_DATA_TYPE_FLOAT,   &m_selfTestKernel),
+    node_metric("Self Test/Encode Time",                    NMA_SelfTestEncode,     false, METRIC_DATA_TYPE_FLOAT,   &m_selfTestEncode),
+    node_metric("Self Test/Broker Round Trip",              NMA_SelfTestBroker,     false, METRIC_DATA_TYPE_FLOAT,   &m_selfTestBroker),
+    node_metric("Node Control/Scan List",                   NMA_ScanList,           true, METRIC_DATA_TYPE_STRING,   &m_scanList),
+    node_metric("Node Control/Averaging Passes",            NMA_AveragingPasses,    true, METRIC_DATA_TYPE_INT64,    &m_averagingPasses),
+    node_metric("Node Control/Frame Period",                NMA_FramePeriod,        true, METRIC_DATA_TYPE_INT64,    &m_framePeriod),
+    node_metric("Node Control/ADC Oversampling",            NMA_ADCOversampling,    true, METRIC_DATA_TYPE_INT64,    &m_adcOsr),
+    node_metric("Node Control/Channel Mask",                NMA_ChannelMask,        true, METRIC_DATA_TYPE_INT64,    &m_channelMask),
+    node_metric("Properties/Faulted Channels",              NMA_FaultedChannels,    false, METRIC_DATA_TYPE_INT64,   &m_faultedChannels),
+    node_metric("Node Control/Quiet Channel Interval",      NMA_QuietInterval,      true, METRIC_DATA_TYPE_INT64,    &m_quietInterval),
+    node_metric("Node Control/Target Noise",                NMA_TargetNoise,        true, METRIC_DATA_TYPE_FLOAT,    &m_targetNoise),
+    node_metric("Node Control/Max Excitation Duty",         NMA_MaxExcitationDuty,  true, METRIC_DATA_TYPE_FLOAT,    &m_maxExcitationDuty),
+    node_metric("Node Control/Dissipation Constant",        NMA_DissipationConstant, true, METRIC_DATA_TYPE_FLOAT,   &m_dissipation),
+    node_metric("Node Control/Kalman Process Noise",        NMA_KalmanProcessNoise, true, METRIC_DATA_TYPE_STRING,   &m_kalmanNoise[KALMAN_PROCESS]),
+    node_metric("Node Control/Kalman Measurement Noise",    NMA_KalmanMeasurementNoise, true, METRIC_DATA_TYPE_STRING, &m_kalmanNoise[KALMAN_MEASUREMENT]),
+    node_metric("Node Control/Publish Estimate Variance",   NMA_PublishEstimateVariance, true, METRIC_DATA_TYPE_BOOLEAN, &m_publishVariance),
+    node_metric("Inputs/Estimate Variance",                 NMA_EstimateVariance,   false, METRIC_DATA_TYPE_FLOAT_ARRAY, &m_estimateVariance),
+    node_metric("Node Control/Raw Codes",                   NMA_RawCodesMode,       true, METRIC_DATA_TYPE_INT64,    &m_rawCodesMode),
+    node_metric("Inputs/Raw Codes",                         NMA_RawCodes,           false, METRIC_DATA_TYPE_INT32_ARRAY, &m_rawCodes),
+    node_metric("Node Control/Drift Capture",               NMA_DriftCapture,       true, METRIC_DATA_TYPE_BOOLEAN,  &m_driftCapture),
+    node_metric("Node Control/Drift Compensation",          NMA_DriftCompensation,  true, METRIC_DATA_TYPE_STRING,   &m_driftModel),
+    node_metric("Node Control/Calibration Upload",          NMA_CalibrationUpload,  true, METRIC_DATA_TYPE_BYTES,    &m_calUpload),
+    node_metric("Node Control/Calibration Stability",       NMA_CalibrationStability, true, METRIC_DATA_TYPE_STRING, &m_calStability),
+    node_metric("Health/Calibration Ready",                 NMA_CalibrationReady,   false, METRIC_DATA_TYPE_INT64,   &m_calReady),
+#ifdef USE_FIRMWARE_UPDATE
+    node_metric("Node Control/Firmware Update",             NMA_FirmwareUpdate,     true, METRIC_DATA_TYPE_STRING,   &m_firmwareUpdate),
+    node_metric("Node Control/Firmware Chunk",              NMA_FirmwareChunk,      true, METRIC_DATA_TYPE_BYTES,    &m_firmwareChunk),
+#endif
+    node_metric("Properties/Sample Schedule",               NMA_SampleSchedule,     false, METRIC_DATA_TYPE_STRING,  &m_sampleSchedule),
+    node_metric("Node Control/Dwell Samples",               NMA_DwellSamples,       true, METRIC_DATA_TYPE_INT64,    &m_dwellSamples),
+    node_metric("Node Control/Frame Banks",                 NMA_FrameBanks,         true, METRIC_DATA_TYPE_INT64,    &m_frameBanks),
+    node_metric("Node Control/Acquisition Profile",         NMA_AcquisitionProfile, true, METRIC_DATA_TYPE_STRING,   &m_acquisitionProfile),
+    node_metric("Node Control/Spike Filter",                NMA_SpikeFilter,        true, METRIC_DATA_TYPE_STRING,   &m_spikeFilter),
+    node_metric("Node Control/ADC Temperature Interval",    NMA_TempInterval,       true, METRIC_DATA_TYPE_INT64,    &m_tempInterval),
+#ifdef USE_REF_TRACKING
+    node_metric("Node Control/ADC Reference Interval",      NMA_RefInterval,        true, METRIC_DATA_TYPE_INT64,    &m_refInterval),
+#endif
+    node_metric("Node Control/Sensor Models",               NMA_SensorModels,       true, METRIC_DATA_TYPE_STRING,   &m_sensorModels),
+    node_metric("Node Control/Channel Sensors",             NMA_ChannelSensors,     true, METRIC_DATA_TYPE_STRING,   &m_channelSensors),
+    node_metric("Node Control/Configuration",               NMA_Configuration,      true, METRIC_DATA_TYPE_BYTES,    &m_configuration),
+    node_metric("Properties/Configuration Hash",            NMA_ConfigurationHash,  false, METRIC_DATA_TYPE_INT64,   &m_configurationHash),
+    birth_metric("Properties/Definitions Hash",             NMA_DefinitionsHash,    METRIC_DATA_TYPE_INT64,          &m_definitionsHash),
+    node_metric("Node Control/Known Definitions",           NMA_KnownDefinitions,   true, METRIC_DATA_TYPE_INT64,    &m_knownDefinitions),
+#ifdef USE_CHANNEL_STATS
+    node_metric("Node Control/Statistics Window",           NMA_StatsWindow,        true, METRIC_DATA_TYPE_INT64,    &m_statsWindow),
+    node_metric("Statistics/Min",                           NMA_StatsMin,           false, METRIC_DATA_TYPE_FLOAT_ARRAY, &m_statsMin),
+    node_metric("Statistics/Max",                           NMA_StatsMax,           false, METRIC_DATA_TYPE_FLOAT_ARRAY, &m_statsMax),
+    node_metric("Statistics/Mean",                          NMA_StatsMean,          false, METRIC_DATA_TYPE_FLOAT_ARRAY, &m_statsMean),
+    node_metric("Statistics/Std Dev",                       NMA_StatsStdDev,        false, METRIC_DATA_TYPE_FLOAT_ARRAY, &m_statsStdDev),
+    node_metric("Statistics/Samples",                       NMA_StatsSamples,       false, METRIC_DATA_TYPE_INT32_ARRAY, &m_statsSamples),
+#endif
+    node_metric("Node Control/Alarm High Limits",           NMA_AlarmHighLimits,    true, METRIC_DATA_TYPE_STRING,   &m_alarmLimits[ALARM_HIGH]),
+    node_metric("Node Control/Alarm Low Limits",            NMA_AlarmLowLimits,     true, METRIC_DATA_TYPE_STRING,   &m_alarmLimits[ALARM_LOW]),
+    node_metric("Node Control/Alarm Rate Limits",           NMA_AlarmRateLimits,    true, METRIC_DATA_TYPE_STRING,   &m_alarmLimits[ALARM_RATE]),
+    node_metric("Alarms/High",                              NMA_AlarmHigh,          false, METRIC_DATA_TYPE_INT64,   &m_alarms[ALARM_HIGH]),
+    node_metric("Alarms/Low",                               NMA_AlarmLow,           false, METRIC_DATA_TYPE_INT64,   &m_alarms[ALARM_LOW]),
+    node_metric("Alarms/Rate",                              NMA_AlarmRate,          false, METRIC_DATA_TYPE_INT64,   &m_alarms[ALARM_RATE]),
+    node_metric("Node Control/Compression Threshold",       NMA_CompressionThreshold, true, METRIC_DATA_TYPE_INT64,  &m_compressionThreshold),
+#ifdef USE_SD_LOG
+    node_metric("Node Control/SD Logging",                  NMA_SDLogging,          true, METRIC_DATA_TYPE_BOOLEAN,  &m_sdLogging),
+    node_metric("Properties/SD Log File",                   NMA_SDLogFile,          false, METRIC_DATA_TYPE_STRING,  &m_sdLogFile),
+    node_metric("Properties/SD Log Dropped Frames",         NMA_SDLogDropped,       false, METRIC_DATA_TYPE_INT64,   &m_sdLogDropped),
+#endif
+#ifdef USE_PROFILER
+    node_metric("Node Control/Report Diagnostics",          NMA_ReportDiagnostics,  true, METRIC_DATA_TYPE_BOOLEAN,  &m_reportDiagnostics),
+    node_metric("Diagnostics/Acquisition",                  NMA_DiagAcquisition,    false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_ACQUISITION]),
+    node_metric("Diagnostics/Conversion",                   NMA_DiagConversion,     false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_CONVERSION]),
+    node_metric("Diagnostics/Calibration",                  NMA_DiagCalibration,    false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_CALIBRATION]),
+    node_metric("Diagnostics/Log",                          NMA_DiagLog,            false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_LOG]),
+    node_metric("Diagnostics/Encode",                       NMA_DiagEncode,         false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_ENCODE]),
+    node_metric("Diagnostics/Publish",                      NMA_DiagPublish,        false, METRIC_DATA_TYPE_STRING,  &m_diagnostics[PROFILE_PUBLISH]),
+#endif
+    node_metric("Health/Frame Rate",                        NMA_HealthFrameRate,    false, METRIC_DATA_TYPE_FLOAT,   &m_frameRate),
+    node_metric("Health/Conversion Rate",                   NMA_HealthConversionRate, false, METRIC_DATA_TYPE_FLOAT, &m_conversionRate),
+    node_metric("Health/Invalid ADC Data",                  NMA_HealthInvalidData,  false, METRIC_DATA_TYPE_INT64,   &m_invalidData),
+    node_metric("Health/ADC Register Mismatches",           NMA_HealthRegisterMismatches, false, METRIC_DATA_TYPE_INT64, &m_registerMismatches),
+    node_metric("Health/ADC CRC Errors",                    NMA_HealthAdcCrcErrors, false, METRIC_DATA_TYPE_INT64,   &m_adcCrcErrors),
+    node_metric("Health/Publish Failures",                  NMA_HealthPublishFailures, false, METRIC_DATA_TYPE_INT64, &m_publishFailures),
+    node_metric("Health/Broker Connects",                   NMA_HealthBrokerConnects, false, METRIC_DATA_TYPE_INT64, &m_brokerConnects),
+    node_metric("Health/bdSeq Increments",                  NMA_HealthBdSeqIncrements, false, METRIC_DATA_TYPE_INT64, &m_bdSeqIncrements),
+    node_metric("Health/Sample Overruns",                   NMA_HealthSampleOverruns, false, METRIC_DATA_TYPE_INT64, &m_sampleOverruns),
+    node_metric("Health/Frame Overruns",                    NMA_HealthFrameOverruns, false, METRIC_DATA_TYPE_INT64,  &m_frameOverruns),
+    node_metric("Health/Missed ADC Interrupts",             NMA_HealthIrqMissed,    false, METRIC_DATA_TYPE_INT64,   &m_irqMissed),
+    node_metric("Health/Late ADC Interrupts",               NMA_HealthIrqLate,      false, METRIC_DATA_TYPE_INT64,   &m_irqLate),
+    node_metric("Health/Duplicate ADC Interrupts",          NMA_HealthIrqDuplicates, false, METRIC_DATA_TYPE_INT64,  &m_irqDuplicates),
+    node_metric("Health/ADC Recoveries",                    NMA_HealthAdcRecoveries, false, METRIC_DATA_TYPE_INT64,  &m_adcRecoveries),
+    node_metric("Health/ADC Reconfigurations",              NMA_HealthAdcReconfigurations, false, METRIC_DATA_TYPE_INT64, &m_adcReconfigurations),
+    node_metric("Health/Watchdog Recoveries",               NMA_HealthWatchdogRecoveries, false, METRIC_DATA_TYPE_INT64, &m_watchdogRecoveries),
+    node_metric("Health/Link Losses",                       NMA_HealthLinkLosses,   false, METRIC_DATA_TYPE_INT64,   &m_linkLosses),
+    node_metric("Health/Commands Busy",                     NMA_HealthCommandsBusy, false, METRIC_DATA_TYPE_INT64,   &m_commandsBusy),
+    node_metric("Health/Frames Lost",                       NMA_HealthFramesLost,   false, METRIC_DATA_TYPE_INT64,   &m_framesLost),
+    node_metric("Health/Frames Replayed",                   NMA_HealthFramesReplayed, false, METRIC_DATA_TYPE_INT64, &m_framesReplayed),
+    node_metric("Health/Frames Resent",                     NMA_HealthFramesResent, false, METRIC_DATA_TYPE_INT64,   &m_framesResent),
+    node_metric("Health/Max Interrupt Latency",             NMA_HealthIrqLatency,   false, METRIC_DATA_TYPE_FLOAT,   &m_irqLatency),
+    node_metric("Health/Frame Phase Error",                 NMA_HealthFramePhaseError, false, METRIC_DATA_TYPE_FLOAT, &m_framePhaseError),
+    node_metric("Health/Seconds Since Time Sync",           NMA_HealthTimeSinceSync, false, METRIC_DATA_TYPE_INT64,  &m_timeSinceSync),
+    node_metric("Health/History Fill",                      NMA_HealthHistoryFill,  false, METRIC_DATA_TYPE_FLOAT,   &m_historyFill),
+    node_metric("Health/CPU Utilization",                   NMA_HealthCpuUtilization, false, METRIC_DATA_TYPE_FLOAT, &m_cpuUtilization),
+    node_metric("Health/Peak Excitation Duty",              NMA_HealthPeakExcitationDuty, false, METRIC_DATA_TYPE_FLOAT, &m_peakExcitationDuty),
+    node_metric("Health/Resting Channels",                  NMA_HealthRestingChannels, false, METRIC_DATA_TYPE_INT64, &m_restingChannels),
+#ifdef USE_FRAME_SYNC
+    node_metric("Health/Frame Sync Missed",                 NMA_HealthSyncMissed,   false, METRIC_DATA_TYPE_INT64,   &m_syncMissed),
+#endif
+    node_metric("Diagnostics/Stack Free",                   NMA_DiagStackFree,      false, METRIC_DATA_TYPE_INT64,   &m_stackFree),
+    node_metric("Diagnostics/Heap Used",                    NMA_DiagHeapUsed,       false, METRIC_DATA_TYPE_INT64,   &m_heapUsed),
+    node_metric("Diagnostics/Heap Peak",                    NMA_DiagHeapPeak,       false, METRIC_DATA_TYPE_INT64,   &m_heapPeak),
+    node_metric("Diagnostics/Heap Free",                    NMA_DiagHeapFree,       false, METRIC_DATA_TYPE_INT64,   &m_heapFree),
+#ifdef USE_SCAN_TRACE
+    node_metric("Node Control/Capture Scan Trace",          NMA_CaptureScanTrace,   true, METRIC_DATA_TYPE_BOOLEAN,  &m_captureScanTrace),
+    node_metric("Node Control/Dump Scan Trace",             NMA_DumpScanTrace,      true, METRIC_DATA_TYPE_BOOLEAN,  &m_dumpScanTrace),
+#endif
+    node_metric("Node Control/Calibration Temperature 3",   NMA_CalibrationTemp3,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[2]),
+    node_metric("Node Control/Calibration Temperature 4",   NMA_CalibrationTemp4,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[3]),
+    node_metric("Node Control/Calibration Temperature 5",   NMA_CalibrationTemp5,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[4]),
+    node_metric("Node Control/Calibration Temperature 6",   NMA_CalibrationTemp6,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[5]),
+    node_metric("Node Control/Calibration Temperature 7",   NMA_CalibrationTemp7,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[6]),
+    node_metric("Node Control/Calibration Temperature 8",   NMA_CalibrationTemp8,   true, METRIC_DATA_TYPE_FLOAT,    &m_calTemp[7]),
+    node_metric("Health/Calibration Noise",                 NMA_HealthCalibrationNoise, false, METRIC_DATA_TYPE_FLOAT, &m_calNoise),
+#ifdef USE_CHANNEL_STATS
+    node_metric("Node Control/Rollup Query",                NMA_RollupQuery,        true, METRIC_DATA_TYPE_STRING,   &m_rollupQuery),
+#endif
+    node_metric("Node Control/Snapshot Since",              NMA_SnapshotSince,      true, METRIC_DATA_TYPE_INT64,    &m_snapshotSince),
+    node_metric("Node Control/Virtual Channels",            NMA_VirtualChannels,    true, METRIC_DATA_TYPE_STRING,   &m_virtualChannels),
+    node_metric("Node Control/Last Value Interval",         NMA_LastValueInterval,  true, METRIC_DATA_TYPE_INT64,    &m_lastValueInterval),
+    node_metric("Alarms/Virtual High",                      NMA_AlarmVirtualHigh,   false, METRIC_DATA_TYPE_INT64,   &m_virtualAlarms[ALARM_HIGH]),
+    node_metric("Alarms/Virtual Low",                       NMA_AlarmVirtualLow,    false, METRIC_DATA_TYPE_INT64,   &m_virtualAlarms[ALARM_LOW]),
+    node_metric("Alarms/Virtual Rate",                      NMA_AlarmVirtualRate,   false, METRIC_DATA_TYPE_INT64,   &m_virtualAlarms[ALARM_RATE]),
+#ifdef USE_CHANNEL_TEMPLATE
+    node_metric("_types_/" CHANNEL_TEMPLATE_NAME,           NMA_ChannelTemplate,    false, METRIC_DATA_TYPE_TEMPLATE, &m_channelDefinition),
+#endif
+    node_metric("Node Control/Log Level",                   NMA_LogLevel,           true, METRIC_DATA_TYPE_INT64,    &m_logLevel),
+    node_metric("Node Control/Log Binary Trace",            NMA_LogBinaryTrace,     true, METRIC_DATA_TYPE_BOOLEAN,  &m_logBinaryTrace),
+};
+
+// Names of the per-thermistor metrics, "Inputs/THERMISTOR1" onwards
+#define CHANNEL_METRIC_PREFIX "Inputs/THERMISTOR"
+
+struct ChannelMetricNames {
+    char name[NUMBER_OF_THERMISTORS][sizeof(CHANNEL_METRIC_PREFIX) + 3];
+};
+
+// Names of the virtual channel metrics, "Inputs/VIRTUAL1" onwards
+#define VIRTUAL_METRIC_PREFIX "Inputs/VIRTUAL"
+
+struct VirtualMetricNames {
+    char name[MAX_VIRTUAL_CHANNELS][sizeof(VIRTUAL_METRIC_PREFIX) + 3];
+};
+
+// Write prefix followed by number into name
+constexpr void make_numbered_name(char *name, const char *prefix, int number){
+    int length = 0;
+    for(; *prefix != '\0'; prefix++)
+        name[length++] = *prefix;
+    if(number >= 100)
+        name[length++] = '0' + number / 100;
+    if(number >= 10)
+        name[length++] = '0' + (number / 10) % 10;
+    name[length++] = '0' + number % 10;
+}
+
+constexpr ChannelMetricNames make_channel_metric_names(){
+    ChannelMetricNames names = {};
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        make_numbered_name(names.name[channel], CHANNEL_METRIC_PREFIX, channel + 1);
+    return names;
+}
+
+constexpr VirtualMetricNames make_virtual_metric_names(){
+    VirtualMetricNames names = {};
+    for(int v = 0; v < MAX_VIRTUAL_CHANNELS; v++)
+        make_numbered_name(names.name[v], VIRTUAL_METRIC_PREFIX, v + 1);
+    return names;
+}
+
+static constexpr ChannelMetricNames channelMetricNames = make_channel_metric_names();
+static constexpr VirtualMetricNames virtualMetricNames = make_virtual_metric_names();
+
+// Every alias after bdSeq has exactly one node metric
+#define NUM_NODE_METRICS (EndNodeMetricAlias - NMA_Reboot)
+
+struct NodeMetricTable {
+    MetricSpec rows[NUM_NODE_METRICS];
+};
+
+// All node metrics: the fixed rows, then the frame metrics for
+// NUMBER_OF_THERMISTORS channels (unless they're in the banks), ending with the
+// virtual channels, the ADC temperature and the frame number
+constexpr NodeMetricTable make_node_metrics(){
+    NodeMetricTable table = {};
+    int row = 0;
+    for(const MetricSpec &metric : nodeControlMetrics)
+        table.rows[row++] = metric;
+#ifdef USE_ARRAY_NDATA
+    table.rows[row++] = thermistor_metric("Inputs/THERMISTORS", NMA_THERMISTORS,
+                                          THERMISTOR_ARRAY_DATA_TYPE, &m_THERMISTORS);
+#elif defined(USE_CHANNEL_TEMPLATE)
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        table.rows[row++] = frame_metric(channelMetricNames.name[channel], NMA_THERMISTOR1 + channel,
+                                         METRIC_DATA_TYPE_TEMPLATE, &m_channelInstance[channel]);
+#elif !defined(USE_DEVICE_BANKS)
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        table.rows[row++] = thermistor_metric(channelMetricNames.name[channel], NMA_THERMISTOR1 + channel,
+                                              THERMISTOR_DATA_TYPE, THERMISTOR_VARIABLE(channel));
+#endif
+    for(int v = 0; v < MAX_VIRTUAL_CHANNELS; v++)
+        table.rows[row++] = frame_metric(virtualMetricNames.name[v], NMA_VIRTUAL1 + v,
+                                         METRIC_DATA_TYPE_FLOAT, &Channels.virtual_frame[v]);
+    table.rows[row++] = frame_metric("Inputs/ADC Internal Temperature", NMA_ADC_Temperature,
+                                     METRIC_DATA_TYPE_FLOAT, &m_ADC_temperature);
+    table.rows[row++] = frame_metric("Inputs/Frame Number", NMA_FrameNumber,
+                                     METRIC_DATA_TYPE_INT64, &m_frameNumber);
+    return table;
+}
+
+// Each alias in [NMA_Reboot, EndNodeMetricAlias) is used by exactly one row
+constexpr bool node_metric_aliases_valid(const NodeMetricTable &table){
+    bool used[NUM_NODE_METRICS] = {};
+    for(const MetricSpec &metric : table.rows){
+        if(metric.alias < NMA_Reboot || metric.alias >= EndNodeMetricAlias || used[metric.alias - NMA_Reboot])
+            return false;
+        used[metric.alias - NMA_Reboot] = true;
+    }
+    return true;
+}
+
+constexpr bool metric_names_equal(const char *a, const char *b){
+    while(*a != '\0' && *a == *b){
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// Every row has a name of its own
+constexpr bool node_metric_names_valid(const NodeMetricTable &table){
+    for(int i = 0; i < NUM_NODE_METRICS; i++){
+        if(table.rows[i].name == nullptr || table.rows[i].name[0] == '\0')
+            return false;
+        for(int j = 0; j < i; j++)
+            if(metric_names_equal(table.rows[i].name, table.rows[j].name))
+                return false;
+    }
+    return true;
+}
+
+// Every row is bound to a variable
+constexpr bool node_metric_variables_valid(const NodeMetricTable &table){
+    for(const MetricSpec &metric : table.rows)
+        if(metric.variable == nullptr)
+            return false;
+    return true;
+}
+
+// The frame metrics, and only they, stream; a birth-only row can't be written
+constexpr bool node_metric_kinds_valid(const NodeMetricTable &table){
+    for(const MetricSpec &metric : table.rows){
+        bool frame = metric.alias >= NMA_FIRST_FRAME_METRIC && metric.alias < NMA_FIRST_FRAME_METRIC + NUM_FRAME_METRICS;
+        if(frame != (metric.kind == METRIC_STREAMING) || (metric.kind == METRIC_BIRTH_ONLY && metric.writable))
+            return false;
+    }
+    return true;
+}
+
+static constexpr NodeMetricTable nodeMetricTable = make_node_metrics();
+static_assert(node_metric_aliases_valid(nodeMetricTable), "node metric aliases must be unique and cover every NodeMetricAlias");
+static_assert(node_metric_names_valid(nodeMetricTable), "node metric names must be non-empty and unique");
+static_assert(node_metric_variables_valid(nodeMetricTable), "every node metric must be bound to a variable");
+static_assert(node_metric_kinds_valid(nodeMetricTable), "only the frame metrics may stream, and birth-only metrics can't be writable");
+
+// The published node metrics, starting from the table built above. Already
+// validated, so network_init() only indexes them.
+static NodeMetricTable m_nodeMetrics = nodeMetricTable;
+static MetricSpec (&NodeMetrics)[NUM_NODE_METRICS] = m_nodeMetrics.rows;
+
+#ifdef USE_DEVICE_BANKS
+struct BankMetricTable {
+    MetricSpec rows[NUM_DEVICE_BANKS][BANK_METRICS];
 };
 
-//Verify validity of this function
-void reset_teensy(){
+// Each bank's metrics: its thermistors in order, then its Device Control/Rebirth
+constexpr BankMetricTable make_bank_metrics(){
+    BankMetricTable table = {};
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        table.rows[DEVICE_BANK(channel)][channel % DEVICE_BANK_SIZE] =
+            frame_metric(channelMetricNames.name[channel], CHANNEL_ALIAS(channel),
+                         THERMISTOR_DATA_TYPE, &Channels.frame[channel]);
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+        table.rows[bank][DEVICE_BANK_SIZE] = node_metric("Device Control/Rebirth", BANK_REBIRTH_ALIAS(bank),
+                                                         true, METRIC_DATA_TYPE_BOOLEAN, &m_bankRebirth[bank]);
+    return table;
+}
+
+// The published metrics of each bank; network_init() checks and indexes them.
+static constexpr BankMetricTable bankMetricTable = make_bank_metrics();
+static BankMetricTable m_bankMetricTable = bankMetricTable;
+static MetricSpec (&BankMetrics)[NUM_DEVICE_BANKS][BANK_METRICS] = m_bankMetricTable.rows;
+
+// The metric table holding a thermistor's temperature
+#define CHANNEL_METRICS(channel)  ARRAY_AND_SIZE(BankMetrics[DEVICE_BANK(channel)])
+#else
+#define CHANNEL_METRICS(channel)  ARRAY_AND_SIZE(NodeMetrics)
+#endif
+
+static_assert(NUM_BROKERS <= WARMBOOT_MAX_BROKERS, "warm boot keeps too few bdSeq numbers");
+
+// Warm reboot: the birth/death sequence numbers, held frames and clock carry
+// over to the next boot (see thermistorMux_warmboot.cpp), and the cause shows in
+// its NBIRTH.  Also called from the watchdog's early warning interrupt.
+void reset_teensy(ResetCause cause){
+    warmboot_prepare(m_bdSeq, NUM_BROKERS, cause);
     WRITE_RESTART(0x5FA0004);
 }
 
@@ -240,43 +1346,173 @@ void reset_teensy(){
 // If the Test Bench device is not active then its DBIRTH, DDEATH and DDATA
 // messages are never published and incoming DCMD messages are ignored.
 
+// Returns true if node messages go to the specified broker.
+static bool broker_publishing(int br_idx){
+    return m_brokerFanOut || br_idx == m_activeBroker;
+}
+
+#ifdef USE_DEVICE_BANKS
+// The thermistors of a bank, as a channel mask
+static ChannelMask bank_channels(int bank){
+    return (ALL_CHANNELS_MASK >> (NUMBER_OF_THERMISTORS - DEVICE_BANK_SIZE)) << (bank * DEVICE_BANK_SIZE);
+}
+
+// Returns true if any of the bank's thermistors is enabled.  A bank with none
+// is dead: it has no DBIRTH and publishes nothing.
+static bool bank_enabled(int bank){
+    return (acquisition_channel_mask() & bank_channels(bank)) != 0;
+}
+
+// Publish the DBIRTH message of a bank, with all its metrics, to the specified
+// brokers.
+static void publish_bank_birth(int bank, PubSubClient *broker_array, int num_brokers){
+    if(!publish_birth(broker_array, num_brokers, bankTopics[bank].birth.name,
+                      NULL, ARRAY_AND_SIZE(BankMetrics[bank]))){
+        DebugPrintNoEOL("Failed to publish DBIRTH: ");
+        DebugPrint(sparkplug_error_text());
+    }
+}
+
+// Publish the DDEATH message of a bank to the brokers that node messages go to.
+static void publish_bank_death(int bank){
+    if(!publish_device_death(TARGET_BROKERS, bankTopics[bank].death.name) &&
+       sparkplug_error() != SPARKPLUG_OK){
+        DebugPrintNoEOL("Failed to publish DDEATH: ");
+        DebugPrint(sparkplug_error_text());
+    }
+}
+
+// A bank is born or dies when the channel mask changes which of its
+// thermistors are enabled; the banks that haven't changed, and the node, are
+// left as they are.
+static void publish_bank_changes(ChannelMask previous){
+    ChannelMask changed = previous ^ acquisition_channel_mask();
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++){
+        if((changed & bank_channels(bank)) == 0)
+            continue;
+        if(bank_enabled(bank))
+            publish_bank_birth(bank, TARGET_BROKERS);
+        else
+            publish_bank_death(bank);
+    }
+}
+#endif
+
+// Fill in a node configuration from the settings in use.
+static void capture_config(NodeConfig *config){
+    ScanConfig scan;
+    get_scan_config(&scan);
+    memset(config, 0, sizeof(*config));
+    config->deadband = m_deadband;
+    config->deadband_percent = m_deadbandPercent;
+    config->heartbeat_ms = (uint32_t) m_heartbeatInterval;
+    config->averaging_passes = scan.averaging_passes;
+    config->frame_period_ms = scan.frame_period_ms;
+    config->osr = scan.osr;
+    config->dwell_samples = scan.dwell_samples;
+    config->frame_banks = scan.frame_banks;
+    config->channel_mask = acquisition_channel_mask();
+    config->quiet_interval = quiet_interval();
+    config->temp_interval = acquisition_temp_interval();
+    config->spike_filter = filter_spike();
+#ifdef USE_CHANNEL_STATS
+    config->stats_window = stats_window();
+#else
+    config->stats_window = 0;
+#endif
+    config->compression_bytes = (uint32_t) payload_compression();
+#ifdef USE_REF_TRACKING
+    config->ref_interval = acquisition_ref_interval();
+#endif
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++)
+        config->settling_us[i] = (uint16_t) acquisition_settling_us(i);
+    acquisition_scan_list(config->scan_list);
+}
+
+// Load the configuration metrics from the settings in use.  Individual
+// metric writes change them too, so this is redone for every birth.
+static void load_configuration(){
+    NodeConfig config;
+    capture_config(&config);
+    m_configuration.size = config_encode(&config, m_configuration.bytes, sizeof(m_configuration.bytes));
+    m_configurationHash = config_hash(&config);
+}
+
 // Publish the NBIRTH message and the DBIRTH message for any devices, with all
-// metrics specified.
-void publish_births(){
+// metrics specified, to each broker that node messages go to.  If only_new is
+// true, only to those that have just connected.
+static void publish_births(bool only_new){
 
-    if (EEPROM.read(0) == 0x01) {
-        m_nodeCalibrated = true;
+    // The first births close the boot timeline
+    if(!boot_finished()){
+        boot_mark("NBIRTH");
+        boot_finish();
+        boot_format_timeline(m_bootTimelineBuffer, sizeof(m_bootTimelineBuffer));
     }
+    m_nodeCalibrated = cal_in_use();
+    load_configuration();
+    // Every broker's bdSeq metric has the same definition
+    m_definitionsHash = birth_definitions_hash(bdseqMetrics[0], ARRAY_AND_SIZE(NodeMetrics));
     for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-        // Create and publish the NBIRTH message containing the bdseq metric
-        // for this broker together with all the node metrics
-        set_up_nbirth_payload();
-        if(!add_metrics(true, ARRAY_AND_SIZE(bdseqMetrics[br_idx])) ||
-           !publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(),
-                            true, ARRAY_AND_SIZE(NodeMetrics))){
+        if(!broker_publishing(br_idx) || (only_new && m_link[br_idx].state != BROKER_BIRTH))
+            continue;
+        // Publish the NBIRTH message containing the bdseq metric for this
+        // broker together with all the node metrics, from the birth cache
+        // unless a metric has changed shape since the last one
+        if(!publish_birth(&m_broker[br_idx], 1, nodeBirthTopic.name,
+                          bdseqMetrics[br_idx], ARRAY_AND_SIZE(NodeMetrics))){
             DebugPrintNoEOL("Failed to publish NBIRTH: ");
-            DebugPrint(cf_sparkplug_error);
+            DebugPrint(sparkplug_error_text());
             // Continue anyway
         }
+#ifdef USE_DEVICE_BANKS
+        // Then the DBIRTH of each bank that's alive
+        for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+            if(bank_enabled(bank))
+                publish_bank_birth(bank, &m_broker[br_idx], 1);
+#endif
+        if(m_link[br_idx].state == BROKER_BIRTH){
+            m_link[br_idx].state = BROKER_ONLINE;
+            m_link[br_idx].backoff_ms = BROKER_BACKOFF_MIN_MS;
+            m_link[br_idx].attempts = 0;
+        }
     }
 }
 
-// Publish the NDATA message with any node metrics that have been updated.
-void publish_node_data(){
-    // Publish any updated metrics in the NDATA message
+// Publish a data message (NDATA or DDATA) with any of the metrics that have
+// been updated.
+static void publish_updated_metrics(const char *topic, MetricSpec *metrics, int num_metrics){
     set_up_next_payload();
-    if(!publish_metrics(ARRAY_AND_SIZE(m_broker), nodeDataTopic.c_str(), false,
-                        ARRAY_AND_SIZE(NodeMetrics))){
-        // An empty message means we aren't connected to any brokers, while the
-        // no metrics message means no metrics have changed since the last time
-        // we published - ignore both of these cases
-        if(strcmp(cf_sparkplug_error, ""          ) != 0 &&
-           strcmp(cf_sparkplug_error, "No metrics") != 0){
-            DebugPrintNoEOL("Failed to publish NDATA: ");
-            DebugPrint(cf_sparkplug_error);
+    uint32_t start = ARM_DWT_CYCCNT;
+    bool added = add_metrics(false, metrics, num_metrics);
+    uint32_t encode_cycles = ARM_DWT_CYCCNT - start;
+    if(!added || !publish_payload(TARGET_BROKERS, topic)){
+        // No error means we aren't connected to any brokers, while no metrics
+        // means none have changed since the last time we published - ignore
+        // both of these cases
+        if(sparkplug_error() != SPARKPLUG_OK && sparkplug_error() != SPARKPLUG_NO_METRICS){
+            DebugPrintNoEOL("Failed to publish ");
+            DebugPrintNoEOL(topic);
+            DebugPrintNoEOL(": ");
+            DebugPrint(sparkplug_error_text());
+            health_count(HEALTH_PUBLISH_FAILURES);
         }
         return;
     }
+    // Only messages that went out are profiled; most calls find nothing to send
+    PROFILE_RECORD(PROFILE_ENCODE, encode_cycles);
+    PROFILE_RECORD(PROFILE_PUBLISH, ARM_DWT_CYCCNT - start - encode_cycles);
+}
+
+// Publish the NDATA message with any node metrics that have been updated, and
+// the DDATA message of each bank with any of its metrics that have.
+void publish_node_data(){
+    publish_updated_metrics(nodeDataTopic.name, ARRAY_AND_SIZE(NodeMetrics));
+#ifdef USE_DEVICE_BANKS
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+        if(bank_enabled(bank))
+            publish_updated_metrics(bankTopics[bank].data.name, ARRAY_AND_SIZE(BankMetrics[bank]));
+#endif
 }
 
 /**
@@ -288,171 +1524,2673 @@ void publish_node_data(){
  */
 bool subscribeTopics(PubSubClient* broker){
     bool success = true;
-    if(!broker->subscribe(HOST_STATE_TOPIC))
-        success = false;
-    if(!broker->subscribe(nodeCmdTopic.c_str()))
-        success = false;
+    for(int slot = 0; slot < SUBSCRIPTION_SLOTS; slot++)
+        if(m_subscriptions[slot].topic != NULL && !broker->subscribe(m_subscriptions[slot].topic->name))
+            success = false;
     return success;
 }
 
-// Connect to the specified broker and send out initial messages.
-bool connect_to_broker(PubSubClient *broker, int br_idx){
+// Start connecting to the specified broker, with an NDEATH for the next
+// birth/death sequence number as our "will".
+static bool start_broker_connect(PubSubClient *broker, int br_idx){
     // Increment the birth/death sequence number before creating the NDEATH
     // message
     m_bdSeq[br_idx]++;
+    health_count(HEALTH_BDSEQ_INCREMENTS);
     if(!update_metric(ARRAY_AND_SIZE(bdseqMetrics[br_idx]), &m_bdSeq[br_idx]))
-        DebugPrint(cf_sparkplug_error);
+        DebugPrint(sparkplug_error_text());
 
     // Create the NDEATH message with its metrics
     set_up_ndeath_payload();
     if(!add_metrics(true, ARRAY_AND_SIZE(bdseqMetrics[br_idx]))){
-        DebugPrint(cf_sparkplug_error);
+        DebugPrint(sparkplug_error_text());
         DebugPrint("Failed to add metrics to NDEATH");
         m_bdSeq[br_idx]--;
         return false;
     }
 
-    // Connect to the broker, with the NDEATH message as our "will"
-    if(!connect(broker, node_id.c_str(), nodeDeathTopic.c_str())){
-        DebugPrint(cf_sparkplug_error);
+    // Send the CONNECT; poll_connect() picks up the broker's answer
+    if(!begin_connect(broker, node_id, nodeDeathTopic.name)){
+        DebugPrint(sparkplug_error_text());
         m_bdSeq[br_idx]--;
         return false;
     }
-
-    // Subscribe to the topics we're interested in
-    if(!subscribeTopics(broker)){
-        DebugPrint("Unable to subscribe to topics on broker");
-        // Disconnect gracefully from the broker
-        disconnect(broker, nodeDeathTopic.c_str());
-        return false;
-    }
-
-    // Success
     return true;
 }
 
-/***
- * @brief Returns the seconds since Jan 1, 1970 from the NTP object.
- *
- * @return unsigned long
-***/
-
-unsigned long get_current_time(void){
-    return ntp.getUTCEpochTime();
+// Go back to idle and schedule the next connect attempt.  The wait is picked
+// at random from the upper half of the current backoff so that nodes which
+// lost the same broker don't all come back at once, then the backoff doubles.
+static void broker_backoff(BrokerLink *link){
+    if(link->backoff_ms < BROKER_BACKOFF_MIN_MS)
+        link->backoff_ms = BROKER_BACKOFF_MIN_MS;
+    unsigned long wait = link->backoff_ms / 2 + random(link->backoff_ms / 2 + 1);
+    link->retry_at = millis() + wait;
+    link->backoff_ms *= 2;
+    if(link->backoff_ms > BROKER_BACKOFF_MAX_MS)
+        link->backoff_ms = BROKER_BACKOFF_MAX_MS;
+    link->state = BROKER_IDLE;
+    link->host_online = false;
 }
 
-/**
- * @brief Returns the milliseconds since Jan 1, 1970 from the NTP object.
- *
- * @return unsigned long long
-***/
+// Advance the connection state machine of the specified broker by one step,
+// without blocking other than for a TCP connect.  A connect attempt is only
+// started if can_attempt is true, and it is then cleared.  Returns true if
+// the broker is waiting for birth messages.
+static bool service_broker(int br_idx, bool *can_attempt){
+    BrokerLink *link = &m_link[br_idx];
+    PubSubClient *broker = &m_broker[br_idx];
 
-unsigned long long get_current_time_millis(void){
-    return ntp.getUTCEpochMillis();
-}
-// Check to see if a received message is a Node command (NCMD) message.  If it
-// is, handle it and return true, even if it's invalid; otherwise return false.
-bool process_node_cmd_message(char* topic, byte* payload, unsigned int len){
-    Serial.println("Processing Command.");
-    if(strcmp(topic, nodeCmdTopic.c_str()) != 0)
-        // This is not a Node command message
+    switch(link->state){
+    case BROKER_IDLE:
+        if(link->port == 0 || !*can_attempt || (long)(millis() - link->retry_at) < 0)
+            return false;
+        *can_attempt = false;
+        if(!start_broker_connect(broker, br_idx)){
+            link->attempts++;
+            broker_backoff(link);
+            return false;
+        }
+        link->state = BROKER_CONNECTING;
         return false;
 
-    // Decode the Sparkplug payload
-    sparkplugb_arduino_decoder decoder;
-    if(!decoder.decode(payload, len)){
-        // Invalid payload - don't do anything
-        decoder.free_payload();
-        DebugPrint("Unable to decode Node command payload");
-        // This was a Node command message
+    case BROKER_CONNECTING:
+        switch(poll_connect(broker)){
+        case 0:
+            return false;
+        case -1:
+            DebugPrint(sparkplug_error_text());
+            m_bdSeq[br_idx]--;
+            link->attempts++;
+            broker_backoff(link);
+            return false;
+        }
+        link->state = BROKER_SUBSCRIBING;
+        // Fall through
+
+    case BROKER_SUBSCRIBING:
+        // Subscribe to the topics we're interested in
+        if(!subscribeTopics(broker)){
+            DebugPrint("Unable to subscribe to topics on broker");
+            // Disconnect gracefully from the broker
+            disconnect(broker, nodeDeathTopic.name);
+            link->attempts++;
+            broker_backoff(link);
+            return false;
+        }
+        DebugPrintNoEOL("Connected to broker");
+        DebugPrint(br_idx+1);
+        health_count(HEALTH_BROKER_CONNECTS);
+        boot_mark("broker");
+        if(!broker_publishing(br_idx)){
+            link->state = BROKER_STANDBY;
+            return false;
+        }
+        link->state = BROKER_BIRTH;
+        return true;
+
+    case BROKER_BIRTH:
         return true;
+
+    case BROKER_ONLINE:
+    case BROKER_STANDBY:
+        if(broker->connected())
+            return false;
+        // Connection lost; start again from the shortest backoff
+        DebugPrintNoEOL("Lost connection to broker");
+        DebugPrint(br_idx+1);
+        link->backoff_ms = BROKER_BACKOFF_MIN_MS;
+        broker_backoff(link);
+        return false;
     }
+    return false;
+}
 
-    // Process the metrics
-    for(unsigned int idx = 0; idx < decoder.payload.metrics_count; idx++){
-        Metric *metric = &decoder.payload.metrics[idx];
-        MetricSpec *metric_spec = find_received_metric(ARRAY_AND_SIZE(NodeMetrics), metric);
-        if(metric_spec == NULL){
-            // Invalid metric - skip it
-            DebugPrintNoEOL("Unrecognized Node metric: ");
-            DebugPrint(cf_sparkplug_error);
+// Drop every broker connection without waiting for TCP to time out.
+static void close_broker_sockets(void){
+    for(int i = 0; i < NUM_BROKERS; ++i){
+        BrokerLink *link = &m_link[i];
+        if(link->state == BROKER_IDLE)
             continue;
+        // A connect that never completed gives its bdSeq back
+        if(link->state == BROKER_CONNECTING)
+            m_bdSeq[i]--;
+        enet[i].stop();
+        link->state = BROKER_IDLE;
+        link->host_online = false;
+    }
+}
+
+// Make every broker due for a connect straight away.
+static void retry_brokers_now(void){
+    for(int i = 0; i < NUM_BROKERS; ++i){
+        m_link[i].retry_at = millis();
+        m_link[i].backoff_ms = BROKER_BACKOFF_MIN_MS;
+        m_link[i].attempts = 0;
+    }
+}
+
+// Sample the Ethernet link and act on a change: going down drops every broker
+// connection without waiting for TCP to time out, and coming back makes every
+// broker due for a connect straight away.  Births then come from the birth
+// cache.  Returns true if the link is up.
+static bool check_link(void){
+    if(millis() - m_linkCheckedAt < LINK_POLL_INTERVAL_MS)
+        return m_linkUp;
+    m_linkCheckedAt = millis();
+    bool up = Ethernet.linkStatus() != LinkOFF;
+    if(up == m_linkUp)
+        return up;
+    m_linkUp = up;
+
+    if(!up){
+        DebugPrint("Ethernet link down");
+        health_count(HEALTH_LINK_LOSSES);
+        close_broker_sockets();
+        return false;
+    }
+
+    DebugPrint("Ethernet link up");
+    boot_mark("link up");
+    retry_brokers_now();
+    return true;
+}
+
+// Returns true if the specified broker is connected and subscribed, whether
+// or not it has had births.
+static bool broker_ready(int br_idx){
+    BrokerState state = m_link[br_idx].state;
+    return (state == BROKER_BIRTH || state == BROKER_ONLINE || state == BROKER_STANDBY) &&
+           m_broker[br_idx].connected();
+}
+
+// The watchdog's network recovery: close every broker socket, as if the link
+// had gone down, and connect again straight away.
+static void restart_broker_sockets(void){
+    close_broker_sockets();
+    retry_brokers_now();
+}
+
+// The watchdog's network check-in, once every connected broker's outbound
+// queue has gone down since the last call or is empty.  The queues of brokers
+// that aren't connected are the connection state machine's to deal with.
+static void check_in_network(void){
+    static unsigned int last_depth[NUM_BROKERS] = {0};
+    bool flowing = true;
+    for(int i = 0; i < NUM_BROKERS; ++i){
+        unsigned int depth = outbound_queue_depth(&m_broker[i]);
+        if(broker_ready(i) && depth > 0 && depth >= last_depth[i])
+            flowing = false;
+        last_depth[i] = depth;
+    }
+    if(flowing)
+        watchdog_checkin(WATCHDOG_NETWORK);
+}
+
+// Drop the connection to a broker node messages no longer go to, publishing
+// NDEATH there first.  It reconnects as a standby.
+static void demote_broker(int br_idx){
+    disconnect(&m_broker[br_idx], nodeDeathTopic.name);
+    m_link[br_idx].backoff_ms = BROKER_BACKOFF_MIN_MS;
+    broker_backoff(&m_link[br_idx]);
+    m_link[br_idx].retry_at = millis();
+}
+
+// Make the specified broker the active one.  Births are published to it on
+// the next check_brokers() if it is already connected.
+static void set_active_broker(int br_idx){
+    int previous = m_activeBroker;
+    m_activeBroker = br_idx;
+    if(previous != br_idx && !m_brokerFanOut && broker_ready(previous))
+        demote_broker(previous);
+    if(m_link[br_idx].state == BROKER_STANDBY)
+        m_link[br_idx].state = BROKER_BIRTH;
+
+    DebugPrintNoEOL("Active broker ");
+    DebugPrint(br_idx+1);
+    m_activeBrokerNumber = br_idx + 1;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_activeBrokerNumber))
+        DebugPrint(sparkplug_error_text());
+}
+
+// In active/standby mode, fail over to the next standby broker in the list if
+// the active broker has gone, the Primary Host has gone from it but is on a
+// standby, or a Next Server command was received.  A standby that the Primary
+// Host is on is preferred.  Returns true if a standby took over.
+static bool select_active_broker(){
+    if(m_brokerFanOut)
+        return false;
+    bool active_ready = broker_ready(m_activeBroker);
+    bool active_host = active_ready && m_link[m_activeBroker].host_online;
+    if(active_host && !m_nodeNextServer)
+        return false;
+
+    // Find the next ready standby in failover order, and the next one with
+    // the Primary Host on it
+    int next = -1;
+    int next_with_host = -1;
+    for(int n = 1; n < NUM_BROKERS; ++n){
+        int br_idx = (m_activeBroker + n) % NUM_BROKERS;
+        if(!broker_ready(br_idx))
+            continue;
+        if(next < 0)
+            next = br_idx;
+        if(next_with_host < 0 && m_link[br_idx].host_online)
+            next_with_host = br_idx;
+    }
+
+    int choice = -1;
+    if(next_with_host >= 0)
+        choice = next_with_host;
+    else if(!active_ready || m_nodeNextServer)
+        // Without the Primary Host anywhere, only move if we have to
+        choice = next;
+    if(choice < 0){
+        if(m_nodeNextServer)
+            DebugPrint("No standby broker for Next Server");
+        return false;
+    }
+    set_active_broker(choice);
+    return true;
+}
+
+// Switch between fan-out and active/standby.  Brokers that node messages no
+// longer go to get NDEATH and reconnect as standbys, and standbys that they now
+// go to get births.
+static void apply_broker_mode(){
+    for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
+        if(m_brokerFanOut && m_link[br_idx].state == BROKER_STANDBY)
+            m_link[br_idx].state = BROKER_BIRTH;
+        else if(!broker_publishing(br_idx) &&
+                (m_link[br_idx].state == BROKER_BIRTH || m_link[br_idx].state == BROKER_ONLINE))
+            demote_broker(br_idx);
+    }
+}
+
+// Format the broker list metric from the broker slots.
+static void format_broker_list(){
+    size_t len = 0;
+    m_brokerListBuffer[0] = '\0';
+    for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
+        BrokerLink *link = &m_link[br_idx];
+        if(link->port == 0)
+            continue;
+        len += snprintf(&m_brokerListBuffer[len], sizeof(m_brokerListBuffer) - len, "%s%u.%u.%u.%u:%u",
+                        len > 0 ? "," : "", link->ip[0], link->ip[1], link->ip[2], link->ip[3],
+                        link->port);
+        if(len >= sizeof(m_brokerListBuffer))
+            break;
+    }
+}
+
+// Set the server of a broker slot, dropping any connection to the old one.
+// A port of 0 leaves the slot unused.
+static void set_broker_server(int br_idx, IPAddress ip, uint16_t port){
+    BrokerLink *link = &m_link[br_idx];
+    if(link->ip == ip && link->port == port)
+        return;
+    if(broker_ready(br_idx))
+        disconnect(&m_broker[br_idx], nodeDeathTopic.name);
+    else
+        enet[br_idx].stop();
+    link->ip = ip;
+    link->port = port;
+    link->state = BROKER_IDLE;
+    link->retry_at = millis();
+    link->backoff_ms = 0;
+    link->attempts = 0;
+    link->host_online = false;
+    m_broker[br_idx].setServer(ip, port);
+#ifdef USE_MQTT5
+    // A new server gets another try at MQTT 5
+    m_broker[br_idx].setProtocolVersion(MQTT_VERSION_5);
+#endif
+}
+
+// Replace the broker list with a comma-separated list of "a.b.c.d[:port]"
+// servers in failover order.  Slots past the end of the list are left unused.
+// Returns false, leaving the list as it was, if the list is malformed or has
+// more servers than there are slots.
+static bool set_broker_list(const char *list){
+    IPAddress ips[NUM_BROKERS];
+    uint16_t ports[NUM_BROKERS] = {0};
+    int count = 0;
+    const char *pos = list;
+    while(*pos != '\0'){
+        if(count == NUM_BROKERS)
+            return false;
+        unsigned int a, b, c, d, port = MQTT_BROKER1_PORT;
+        int used = 0;
+        if(sscanf(pos, "%u.%u.%u.%u%n", &a, &b, &c, &d, &used) != 4)
+            return false;
+        pos += used;
+        if(*pos == ':'){
+            if(sscanf(pos, ":%u%n", &port, &used) != 1)
+                return false;
+            pos += used;
+        }
+        if(a > 255 || b > 255 || c > 255 || d > 255 || port == 0 || port > 65535)
+            return false;
+        if(*pos == ',')
+            pos++;
+        else if(*pos != '\0')
+            return false;
+        ips[count] = IPAddress(a, b, c, d);
+        ports[count] = port;
+        count++;
+    }
+    if(count == 0)
+        return false;
+
+    for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++)
+        set_broker_server(br_idx, ips[br_idx], ports[br_idx]);
+    format_broker_list();
+    if(m_link[m_activeBroker].port == 0)
+        set_active_broker(0);
+    return true;
+}
+
+#ifdef USE_RAW_STREAM
+// Start the raw sample stream to "ip:port", or stop it for "". Returns false for
+// a malformed target or if the stream couldn't be started.
+static bool set_stream_target(const char *target){
+    if(*target == '\0'){
+        stream_stop();
+        m_streamTargetBuffer[0] = '\0';
+        return true;
+    }
+    unsigned int a, b, c, d, port;
+    int used = 0;
+    if(sscanf(target, "%u.%u.%u.%u:%u%n", &a, &b, &c, &d, &port, &used) != 5 || target[used] != '\0')
+        return false;
+    if(a > 255 || b > 255 || c > 255 || d > 255 || port == 0 || port > 65535)
+        return false;
+    if(!stream_start(IPAddress(a, b, c, d), port)){
+        m_streamTargetBuffer[0] = '\0';
+        return false;
+    }
+    snprintf(m_streamTargetBuffer, sizeof(m_streamTargetBuffer), "%u.%u.%u.%u:%u", a, b, c, d, port);
+    return true;
+}
+#endif
+
+/***
+ * @brief Returns the seconds since Jan 1, 1970, or since boot until NTP has
+ * synced the time service.
+ *
+ * @return unsigned long
+***/
+
+unsigned long get_current_time(void){
+    return get_current_time_millis() / 1000;
+}
+
+/**
+ * @brief Returns the milliseconds since Jan 1, 1970, from the cycle counter time
+ * service once NTP has synced it, otherwise the milliseconds since boot.
+ *
+ * @return unsigned long long
+***/
+
+unsigned long long get_current_time_millis(void){
+    if(time_synced())
+        return time_now_utc_millis();
+    return millis();
+}
+// Returns true if we're connected to at least one broker that node messages
+// go to.
+static bool broker_connected(){
+    for(int i = 0; i < NUM_BROKERS; ++i)
+        if(broker_publishing(i) && m_broker[i].connected())
+            return true;
+    return false;
+}
+
+#ifdef USE_ARRAY_NDATA
+// Copy the values of the enabled channels into the bytes of an array metric,
+// in thermistor order.  Quantized, each is the zigzag varint of its difference
+// from the channel before (the first from 0), so neighbouring channels at much
+// the same temperature take a byte each.  Returns the bytes used.
+static size_t pack_enabled_channels(uint8_t *bytes, const ThermistorValue *values){
+    size_t len = 0;
+#ifdef USE_QUANTIZED_NDATA
+    int32_t last = 0;
+#endif
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++){
+        if(!acquisition_channel_enabled(channel))
+            continue;
+#ifdef USE_QUANTIZED_NDATA
+        int32_t value = thermistor_metric_value(values[channel]);
+        int32_t delta = value - last;
+        last = value;
+        uint32_t zigzag = ((uint32_t) delta << 1) ^ (uint32_t)(delta >> 31);
+        do{
+            bytes[len] = zigzag & 0x7F;
+            zigzag >>= 7;
+            if(zigzag != 0)
+                bytes[len] |= 0x80;
+            len++;
+        }while(zigzag != 0);
+#else
+        memcpy(&bytes[len], &values[channel], sizeof(ThermistorValue));
+        len += sizeof(ThermistorValue);
+#endif
+    }
+    return len;
+}
+#endif
+
+#ifdef USE_HOST_STATE_GATING
+// Returns true if the Primary Host is ONLINE on a connected broker that node
+// messages go to.
+static bool host_consuming(){
+    for(int i = 0; i < NUM_BROKERS; ++i)
+        if(broker_publishing(i) && m_broker[i].connected() && m_link[i].host_online)
+            return true;
+    return false;
+}
+#endif
+
+// Returns true while frames are being held at boot for the first time sync.
+static bool awaiting_time_sync(){
+    return !time_synced() && millis() < BOOT_SYNC_WAIT_MS;
+}
+
+// Returns true while frames have to be kept in the history rather than
+// published: no broker, no host consuming them, or no time sync yet.
+static bool holding_frames(){
+#ifdef USE_HOST_STATE_GATING
+    if(!host_consuming())
+        return true;
+#endif
+    return !broker_connected() || awaiting_time_sync();
+}
+
+// UTC milliseconds of stored frame i of a run. One taken before the time service
+// was synced is stamped from its cycle count now, or with the time since boot if
+// there still hasn't been a sync.
+static unsigned long long history_frame_time(const HistoryRun *run, unsigned int i){
+    if(run->timestamp[i] != 0)
+        return run->timestamp[i];
+    if(time_synced())
+        return time_cycles_to_utc_millis(run->cycles[i]);
+    return run->cycles[i] / (F_CPU_ACTUAL / 1000);
+}
+
+// Add the metrics of a run of stored frames to the module payload, a channel at
+// a time so each column is read in order, as historical values or as live ones
+// of a batch. slot is the position in the payload of the run's first frame.
+static bool add_history_run(const HistoryRun *run, unsigned int slot, bool historical = true){
+    bool (*add_stamped_metric)(MetricSpec *, int, unsigned int, void *, unsigned long long) =
+        historical ? add_historical_metric : add_sampled_metric;
+    unsigned long long timestamps[HISTORY_FRAMES_PER_PAYLOAD];
+    for(unsigned int i = 0; i < run->frames; i++)
+        timestamps[i] = history_frame_time(run, i);
+#ifndef USE_ARRAY_NDATA
+    // Only the packed arrays are kept by slot
+    (void)slot;
+#endif
+#ifdef USE_ARRAY_NDATA
+    for(unsigned int i = 0; i < run->frames; i++){
+        ThermistorValue frame[NUMBER_OF_THERMISTORS];
+        for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+            frame[channel] = run->thermistor[channel][i];
+        ThermistorArray *array = &m_historyArrays[slot + i];
+        array->size = pack_enabled_channels(array->bytes, frame);
+        if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_THERMISTORS,
+                               array, timestamps[i]))
+            return false;
+    }
+#elif defined(USE_CHANNEL_TEMPLATE)
+    // Each stored value goes as an instance with just its Value member; the
+    // member's value is copied into the payload as each one is added
+    MetricSpec value = m_channelDefinitionMembers[CM_Value];
+    MetricTemplate instance = {CHANNEL_TEMPLATE_NAME, &value, 1};
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        for(unsigned int i = 0; i < run->frames; i++){
+            value.variable = (void *) &run->thermistor[channel][i];
+            if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_THERMISTOR1 + channel,
+                                   &instance, timestamps[i]))
+                return false;
+        }
+#elif !defined(USE_DEVICE_BANKS)
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        for(unsigned int i = 0; i < run->frames; i++){
+            // Copied into the payload as it's added
+            ThermistorMetricValue value = thermistor_metric_value(run->thermistor[channel][i]);
+            if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_THERMISTOR1 + channel,
+                                   &value, timestamps[i]))
+                return false;
+        }
+#endif
+    // The banks' thermistors go in their own DDATA (see replay_bank_history()).
+    // The virtual channels are computed from the stored frames, as defined now.
+    float virtuals[HISTORY_FRAMES_PER_PAYLOAD][MAX_VIRTUAL_CHANNELS];
+    for(unsigned int i = 0; i < run->frames && virtual_count() > 0; i++){
+        ThermistorValue frame[NUMBER_OF_THERMISTORS];
+        for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+            frame[channel] = run->thermistor[channel][i];
+        virtual_evaluate_frame(frame, acquisition_channel_mask(), virtuals[i]);
+    }
+    for(int v = 0; v < virtual_count(); v++)
+        for(unsigned int i = 0; i < run->frames; i++)
+            if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_VIRTUAL1 + v,
+                                   &virtuals[i][v], timestamps[i]))
+                return false;
+    for(unsigned int i = 0; i < run->frames; i++)
+        if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_ADC_Temperature,
+                               (void *) &run->adc_temperature[i], timestamps[i]))
+            return false;
+    // Each frame's number, so the host can tell which frames it has
+    for(unsigned int i = 0; i < run->frames; i++)
+        if(!add_stamped_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_FrameNumber,
+                               (void *) &run->frame[i], timestamps[i]))
+            return false;
+    return true;
+}
+
+#ifdef USE_DEVICE_BANKS
+// Publish the bank's thermistors from the frames of the history from position
+// on as a DDATA message of historical metrics, a channel at a time.
+static bool replay_bank_history(int bank, uint32_t position, unsigned int frames){
+    set_up_next_payload();
+    unsigned int first = 0;
+    HistoryRun run;
+    while(first < frames && history_read(position + first, frames - first, &run) > 0){
+        for(int channel = bank * DEVICE_BANK_SIZE; channel < (bank + 1) * DEVICE_BANK_SIZE; channel++)
+            for(unsigned int i = 0; i < run.frames; i++)
+                if(!add_historical_metric(CHANNEL_METRICS(channel), CHANNEL_ALIAS(channel),
+                                          (void *) &run.thermistor[channel][i], history_frame_time(&run, i)))
+                    return false;
+        first += run.frames;
+    }
+    return publish_payload(TARGET_BROKERS, bankTopics[bank].data.name);
+}
+#endif
+
+// Replay the next batch of frames stored while no broker was connected, as an
+// NDATA message of historical metrics (and a DDATA message for each bank).
+// Frames are only discarded once they've been published.
+static void replay_history(){
+    static unsigned long last_replay = 0;
+    if(history_count() == 0 || holding_frames() || (millis() - last_replay) < HISTORY_REPLAY_INTERVAL_MS)
+        return;
+    last_replay = millis();
+
+    set_up_next_payload();
+    unsigned int frames = 0;
+    HistoryRun run;
+    while(frames < HISTORY_FRAMES_PER_PAYLOAD &&
+          history_peek(frames, HISTORY_FRAMES_PER_PAYLOAD - frames, &run) > 0){
+        if(!add_history_run(&run, frames)){
+            // Can't be encoded - drop the batch rather than retrying forever
+            DebugPrintNoEOL("Failed to replay history: ");
+            DebugPrint(sparkplug_error_text());
+            health_add(HEALTH_FRAMES_LOST, frames + run.frames);
+            history_discard(frames + run.frames);
+            return;
+        }
+        frames += run.frames;
+    }
+    if(!publish_payload(TARGET_BROKERS, nodeDataTopic.name)){
+        DebugPrintNoEOL("Failed to publish history: ");
+        DebugPrint(sparkplug_error_text());
+        return;
+    }
+#ifdef USE_DEVICE_BANKS
+    // The NDATA has gone, so the batch is discarded even if a bank's fails:
+    // retrying would repeat it
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+        if(bank_enabled(bank) && !replay_bank_history(bank, history_first_pending(), frames)){
+            DebugPrintNoEOL("Failed to publish bank history: ");
+            DebugPrint(sparkplug_error_text());
+        }
+#endif
+    health_add(HEALTH_FRAMES_REPLAYED, frames);
+    history_discard(frames);
+}
+
+// Send the next published frames of a snapshot request, as an NDATA message of
+// historical metrics like a replay (and a DDATA message for each bank).  Frames
+// waiting to be replayed go first, and the frames are sent at the replay rate,
+// so live frames keep priority.  Any overwritten since the request are skipped.
+static void replay_snapshot(){
+    static unsigned long last_replay = 0;
+    if(m_snapshotSince == 0 || history_count() > 0 || holding_frames() ||
+       (millis() - last_replay) < HISTORY_REPLAY_INTERVAL_MS)
+        return;
+    last_replay = millis();
+
+    if((int32_t)(m_snapshotNext - history_first_retained()) < 0)
+        m_snapshotNext = history_first_retained();
+    set_up_next_payload();
+    unsigned int frames = 0;
+    bool added = true;
+    HistoryRun run;
+    while(added && (int32_t)(m_snapshotEnd - m_snapshotNext - frames) > 0 && frames < HISTORY_FRAMES_PER_PAYLOAD){
+        unsigned int left = m_snapshotEnd - m_snapshotNext - frames;
+        if(left > HISTORY_FRAMES_PER_PAYLOAD - frames)
+            left = HISTORY_FRAMES_PER_PAYLOAD - frames;
+        if(history_read(m_snapshotNext + frames, left, &run) == 0)
+            break;
+        added = add_history_run(&run, frames);
+        frames += run.frames;
+    }
+    if(frames > 0){
+        if(added && !publish_payload(TARGET_BROKERS, nodeDataTopic.name)){
+            DebugPrintNoEOL("Failed to publish snapshot: ");
+            DebugPrint(sparkplug_error_text());
+            return;
+        }
+        if(!added){
+            // Can't be encoded - skip the batch rather than retrying forever
+            DebugPrintNoEOL("Failed to send snapshot: ");
+            DebugPrint(sparkplug_error_text());
+        }else{
+            health_add(HEALTH_FRAMES_RESENT, frames);
+        }
+#ifdef USE_DEVICE_BANKS
+        for(int bank = 0; added && bank < NUM_DEVICE_BANKS; bank++)
+            if(bank_enabled(bank) && !replay_bank_history(bank, m_snapshotNext, frames)){
+                DebugPrintNoEOL("Failed to publish bank snapshot: ");
+                DebugPrint(sparkplug_error_text());
+            }
+#endif
+        m_snapshotNext += frames;
+    }
+    if((int32_t)(m_snapshotEnd - m_snapshotNext) <= 0 || frames == 0){
+        m_snapshotSince = 0;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_snapshotSince))
+            DebugPrint(sparkplug_error_text());
+    }
+}
+
+// Publish the last value (see LAST_VALUE_INTERVAL_MS) once the interval has
+// passed since the one before, if a frame has been converted since: the frame
+// metrics and the banks' thermistors with their names and the times they were
+// last published, and the definitions hash, so a host can tell whether the
+// aliases of the births it holds still apply.
+static void publish_last_value(){
+    static unsigned long last_publish = 0;
+    static uint64_t last_frame = 0;
+    if(m_lastValueInterval == 0 || m_frameNumber == last_frame || holding_frames() ||
+       (last_publish != 0 && (millis() - last_publish) < m_lastValueInterval))
+        return;
+    last_publish = millis();
+    last_frame = m_frameNumber;
+
+    set_up_next_payload();
+    bool added = add_named_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_DefinitionsHash);
+    for(unsigned int alias = NMA_FIRST_FRAME_METRIC; added && alias < NMA_FIRST_FRAME_METRIC + NUM_FRAME_METRICS; alias++)
+        added = add_named_metric(ARRAY_AND_SIZE(NodeMetrics), alias);
+#ifdef USE_DEVICE_BANKS
+    for(int bank = 0; added && bank < NUM_DEVICE_BANKS; bank++)
+        for(int i = 0; added && bank_enabled(bank) && i < DEVICE_BANK_SIZE; i++)
+            added = add_named_metric(ARRAY_AND_SIZE(BankMetrics[bank]), BANK_FIRST_ALIAS(bank) + i);
+#endif
+    if(!added || !publish_retained_payload(TARGET_BROKERS, lastValueTopic.name)){
+        DebugPrintNoEOL("Failed to publish the last value: ");
+        DebugPrint(sparkplug_error_text());
+    }
+}
+
+#ifdef USE_CHANNEL_STATS
+// Start answering a rollup query, "<1s|1m|1h> <from> [<to>]": the buckets of
+// that resolution starting from from to to (by default now), UTC milliseconds.
+// A new query replaces the one running, and "" just ends it.  Returns false,
+// with no query running, if it's invalid.
+static bool start_rollup_query(const char *query){
+    m_rollupQueryBuffer[0] = '\0';
+    if(query[0] == '\0')
+        return true;
+    if(strlen(query) >= sizeof(m_rollupQueryBuffer))
+        return false;
+    static const char *const resolutions[NUM_ROLLUP_LEVELS] = {"1s", "1m", "1h"};
+    int level = 0;
+    while(level < NUM_ROLLUP_LEVELS && strncmp(query, resolutions[level], 2) != 0)
+        level++;
+    if(level >= NUM_ROLLUP_LEVELS || query[2] != ' ')
+        return false;
+    char *end;
+    unsigned long long from = strtoull(query + 3, &end, 10);
+    if(end == query + 3)
+        return false;
+    unsigned long long to = get_current_time_millis();
+    if(*end == ' '){
+        const char *pos = end + 1;
+        to = strtoull(pos, &end, 10);
+        if(end == pos)
+            return false;
+    }
+    if(*end != '\0' || from > to)
+        return false;
+    m_rollupLevel = (RollupLevel) level;
+    m_rollupFrom = from;
+    m_rollupTo = to;
+    strcpy(m_rollupQueryBuffer, query);
+    return true;
+}
+
+// Answer the running rollup query with its next buckets, as an NDATA message
+// of historical Statistics metrics each stamped with the start of its bucket.
+// The query is ended, and its metric cleared, once the last has gone.
+static void replay_rollups(){
+    static unsigned long last_replay = 0;
+    if(m_rollupQueryBuffer[0] == '\0' || holding_frames() || (millis() - last_replay) < HISTORY_REPLAY_INTERVAL_MS)
+        return;
+    last_replay = millis();
+
+    const RollupBucket *buckets[ROLLUP_BUCKETS_PER_PAYLOAD];
+    unsigned int found = rollup_find(m_rollupLevel, m_rollupFrom, m_rollupTo, buckets, ROLLUP_BUCKETS_PER_PAYLOAD);
+    if(found > 0){
+        set_up_next_payload();
+        bool added = true;
+        for(unsigned int i = 0; i < found && added; i++){
+            const RollupBucket *bucket = buckets[i];
+            RollupArrays *arrays = &m_rollupArrays[i];
+            memcpy(arrays->min.bytes, bucket->min, sizeof(bucket->min));
+            memcpy(arrays->max.bytes, bucket->max, sizeof(bucket->max));
+            memcpy(arrays->mean.bytes, bucket->mean, sizeof(bucket->mean));
+            int32_t *samples = (int32_t *) arrays->samples.bytes;
+            for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+                samples[channel] = (int32_t) bucket->count[channel];
+            arrays->min.size = arrays->max.size = arrays->mean.size = sizeof(bucket->min);
+            arrays->samples.size = sizeof(int32_t) * NUMBER_OF_THERMISTORS;
+            added = add_historical_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_StatsMin, &arrays->min, bucket->start) &&
+                    add_historical_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_StatsMax, &arrays->max, bucket->start) &&
+                    add_historical_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_StatsMean, &arrays->mean, bucket->start) &&
+                    add_historical_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_StatsSamples, &arrays->samples,
+                                          bucket->start);
+        }
+        if(!added || !publish_payload(TARGET_BROKERS, nodeDataTopic.name)){
+            DebugPrintNoEOL("Failed to publish rollups: ");
+            DebugPrint(sparkplug_error_text());
+            if(added)
+                return;
+            // Can't be encoded - give up on the query rather than retrying forever
+            found = 0;
+        }
+        else
+            m_rollupFrom = buckets[found - 1]->start + 1;
+    }
+    if(found < ROLLUP_BUCKETS_PER_PAYLOAD){
+        m_rollupQueryBuffer[0] = '\0';
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_rollupQuery))
+            DebugPrint(sparkplug_error_text());
+    }
+}
+#endif
+
+// Publish the frames collected for a batch as one NDATA message, every value
+// stamped with its own frame's time.
+static void publish_batch(){
+    if(m_batchCount == 0)
+        return;
+    PROFILE_SCOPE(PROFILE_PUBLISH);
+    HistoryRun run = {m_batchCount, m_batchTimestamp, m_batchCycles, {}, m_batchAdcTemperature, m_batchFrame};
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        run.thermistor[channel] = m_batchThermistor[channel];
+    m_batchCount = 0;
+    set_up_next_payload();
+    if((!add_history_run(&run, 0, false) || !publish_payload(TARGET_BROKERS, nodeDataTopic.name)) &&
+       sparkplug_error() != SPARKPLUG_OK){
+        DebugPrintNoEOL("Failed to publish batch: ");
+        DebugPrint(sparkplug_error_text());
+        health_count(HEALTH_PUBLISH_FAILURES);
+    }
+    // Kept in the history for snapshot requests
+    for(unsigned int i = 0; i < run.frames; i++){
+        ThermistorValue frame[NUMBER_OF_THERMISTORS];
+        for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+            frame[channel] = m_batchThermistor[channel][i];
+        history_retain(frame, m_batchAdcTemperature[i], m_batchTimestamp[i], m_batchCycles[i], m_batchFrame[i]);
+    }
+}
+
+// Move the frames collected for a batch into the history, for replay with the
+// frames after them.
+static void hold_batch(){
+    for(unsigned int i = 0; i < m_batchCount; i++){
+        ThermistorValue frame[NUMBER_OF_THERMISTORS];
+        for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+            frame[channel] = m_batchThermistor[channel][i];
+        history_store(frame, m_batchAdcTemperature[i], m_batchTimestamp[i], m_batchCycles[i], m_batchFrame[i]);
+    }
+    m_batchCount = 0;
+}
+
+// Frames per NDATA at the publish profile: at least THROTTLE_BATCH_FRAMES from
+// Batched on, as far as a payload holds.
+static uint64_t batch_frames(){
+    uint64_t frames = m_batchFrames;
+    if(throttle_profile() >= PUBLISH_BATCHED && frames < THROTTLE_BATCH_FRAMES)
+        frames = THROTTLE_BATCH_FRAMES < BATCH_MAX_FRAMES ? THROTTLE_BATCH_FRAMES : BATCH_MAX_FRAMES;
+    return frames;
+}
+
+// Add a frame to the batch, publishing the batch once it's full.
+static void batch_frame(const ThermistorValue *thermistor, float adc_temperature, unsigned long long timestamp,
+                        uint64_t cycles, uint64_t frame){
+    if(m_batchCount == 0)
+        m_batchStart = millis();
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        m_batchThermistor[channel][m_batchCount] = thermistor[channel];
+    m_batchAdcTemperature[m_batchCount] = adc_temperature;
+    m_batchTimestamp[m_batchCount] = timestamp;
+    m_batchCycles[m_batchCount] = cycles;
+    m_batchFrame[m_batchCount] = frame;
+    if(++m_batchCount >= batch_frames())
+        publish_batch();
+}
+
+// Publish a batch that has waited the batch interval, or that batching has
+// been turned off under; one that can't go now is held for replay.
+static void service_batch(){
+    if(m_batchCount == 0)
+        return;
+    if(holding_frames())
+        hold_batch();
+    else if(batch_frames() <= 1 || (millis() - m_batchStart) >= m_batchInterval)
+        publish_batch();
+}
+
+// Refresh the outbound queue and socket write metrics every
+// OUTBOUND_STATS_INTERVAL_MS, publishing them only if they've changed.
+static void update_outbound_stats(){
+    static unsigned long last_update = 0;
+    if((millis() - last_update) < OUTBOUND_STATS_INTERVAL_MS)
+        return;
+    last_update = millis();
+
+    uint64_t depth = 0;
+    uint64_t drops = 0;
+    uint64_t retransmits = 0;
+    for(int i = 0; i < NUM_BROKERS; ++i){
+        unsigned int peak = outbound_queue_peak(&m_broker[i]);
+        if(peak > depth)
+            depth = peak;
+        drops += outbound_dropped(&m_broker[i]);
+        retransmits += outbound_retransmitted(&m_broker[i]);
+    }
+    if(depth != m_outboundQueueDepth){
+        m_outboundQueueDepth = depth;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_outboundQueueDepth))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(drops != m_outboundDrops){
+        m_outboundDrops = drops;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_outboundDrops))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(retransmits != m_outboundRetransmits){
+        m_outboundRetransmits = retransmits;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_outboundRetransmits))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(m_sendLatencyPeak != m_sendLatency){
+        m_sendLatency = m_sendLatencyPeak;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sendLatency))
+            DebugPrint(sparkplug_error_text());
+    }
+    m_sendLatencyPeak = 0;
+
+    // Left as they were over an interval with nothing published
+    SocketWriteStats writes;
+    socket_write_stats(&writes);
+    if(writes.publishes > 0){
+        float per_publish = (float) writes.writes / writes.publishes;
+        float size = (float) writes.bytes / writes.writes;
+        if(per_publish != m_socketWritesPerPublish || size != m_socketWriteSize){
+            m_socketWritesPerPublish = per_publish;
+            m_socketWriteSize = size;
+            if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_SocketWritesPerPublish, 2, 0))
+                DebugPrint(sparkplug_error_text());
+        }
+    }
+}
+
+// Publish the profile publishing has stepped to.
+static void publish_profile_changed(){
+    if(m_publishProfile == throttle_profile_name(throttle_profile()))
+        return;
+    m_publishProfile = throttle_profile_name(throttle_profile());
+    DebugPrintNoEOL("Publish profile: ");
+    DebugPrint(m_publishProfile);
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_publishProfile))
+        DebugPrint(sparkplug_error_text());
+}
+
+#ifdef USE_FRAME_SYNC
+// Publish the frame sync offset when it changes: at the first frame taken
+// synced, and as this board or the driver misses frames.
+static void check_frame_sync(){
+    if(m_frameSyncOffset == (uint64_t) framesync_frame_offset())
+        return;
+    m_frameSyncOffset = (uint64_t) framesync_frame_offset();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_frameSyncOffset))
+        DebugPrint(sparkplug_error_text());
+}
+#endif
+
+// Finish a self test with the broker round trip, ms (NAN if the loopback didn't
+// come back), publishing the Self Test metrics and clearing the request.
+static void finish_self_test(float broker_ms){
+    m_selfTestWaiting = false;
+    m_selfTestBroker = broker_ms;
+    m_selfTest = false;
+    if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_SelfTest, NMA_SelfTestBroker - NMA_SelfTest + 1, 0))
+        DebugPrint(sparkplug_error_text());
+}
+
+/**
+ * @brief Takes a self test's results once its profiles are timed (see
+ * self_test_start()), times building and encoding the last frame's NDATA, and
+ * sends the loopback, a message to the node's own self test topic.  The
+ * results are published when it comes back through the broker, or after
+ * SELF_TEST_LOOPBACK_TIMEOUT_MS without it.
+ */
+void publish_self_test(const SelfTestResults *results){
+    selftest_format_rates(results, m_selfTestRatesBuffer, sizeof(m_selfTestRatesBuffer));
+    m_selfTestSpiRead = results->spi_read_us;
+    m_selfTestKernel = results->kernel_cycles;
+
+    // The last frame as a batch of one, the fastest of SELF_TEST_RUNS; encoded
+    // as it would be published, but not sent
+    static uint8_t buffer[SELF_TEST_ENCODE_SIZE];
+    unsigned long long timestamp = time_cycles_to_utc_millis(Channels.frame_cycles);
+    HistoryRun run = {1, &timestamp, &Channels.frame_cycles, {}, &m_ADC_temperature, &Channels.frame_number};
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        run.thermistor[channel] = &Channels.frame[channel];
+    uint32_t best = UINT32_MAX;
+    for(int i = 0; i < SELF_TEST_RUNS; i++){
+        uint32_t start = ARM_DWT_CYCCNT;
+        set_up_next_payload();
+        if(!add_history_run(&run, 0, false) || encode_payload(buffer, sizeof(buffer)) == 0){
+            DebugPrint(sparkplug_error_text());
+            best = UINT32_MAX;
+            break;
+        }
+        uint32_t cycles = ARM_DWT_CYCCNT - start;
+        if(cycles < best)
+            best = cycles;
+    }
+    m_selfTestEncode = best == UINT32_MAX ? NAN : best * 1e6f / F_CPU_ACTUAL;
+
+    // Without a seq, so the Sparkplug sequence has no gap for it
+    set_up_next_payload();
+    if(!add_named_metric(ARRAY_AND_SIZE(NodeMetrics), NMA_SelfTest) ||
+       !publish_unsequenced_payload(TARGET_BROKERS, selfTestTopic.name)){
+        DebugPrint("Self test loopback not sent");
+        finish_self_test(NAN);
+        return;
+    }
+    m_selfTestWaiting = true;
+    m_selfTestSent = micros();
+}
+
+// Handle a message on the self test topic: the loopback coming back, if it's
+// what publish_self_test() sent, the Self Test metric set true.
+static void process_self_test_loopback(const char *topic, byte *payload, unsigned int len){
+    if(!m_selfTestWaiting || strcmp(topic, selfTestTopic.name) != 0)
+        return;
+    static CommandPayload loopback;
+    MetricSpec *metric_spec = NULL;
+    if(decode_command_payload(payload, len, &loopback) && loopback.metrics_count == 1)
+        metric_spec = find_received_metric(ARRAY_AND_SIZE(NodeMetrics), &loopback.metrics[0]);
+    if(metric_spec == NULL || metric_spec->alias != NMA_SelfTest || !loopback.metrics[0].value.boolean_value){
+        DebugPrint("Self test loopback doesn't match what was sent");
+        return;
+    }
+    finish_self_test((micros() - m_selfTestSent) / 1000.0f);
+}
+
+// Give up on a loopback that hasn't come back.
+static void check_self_test(){
+    if(m_selfTestWaiting && (micros() - m_selfTestSent) >= SELF_TEST_LOOPBACK_TIMEOUT_MS * 1000UL){
+        DebugPrint("Self test loopback timed out");
+        finish_self_test(NAN);
+    }
+}
+
+// Check the outbound queues of the connected brokers for backpressure every
+// THROTTLE_CHECK_MS, stepping the publish profile with the worst of them.  A
+// broker that's down isn't pressure: its frames go to the history.
+static void check_throttle(){
+    static unsigned long last_check = 0;
+    static unsigned long last_dropped = 0;
+    if((millis() - last_check) < THROTTLE_CHECK_MS)
+        return;
+    last_check = millis();
+
+    ThrottleSample sample = {0, 0, 0};
+    unsigned long dropped = 0;
+    for(int i = 0; i < NUM_BROKERS; ++i){
+        unsigned long latency = outbound_latency(&m_broker[i]);
+        dropped += outbound_dropped(&m_broker[i]);
+        if(!m_broker[i].connected())
+            continue;
+        if(outbound_queue_depth(&m_broker[i]) > sample.depth)
+            sample.depth = outbound_queue_depth(&m_broker[i]);
+        if(latency > sample.latency_ms)
+            sample.latency_ms = latency;
+    }
+    sample.dropped = dropped - last_dropped;
+    last_dropped = dropped;
+    if(sample.latency_ms > m_sendLatencyPeak)
+        m_sendLatencyPeak = sample.latency_ms;
+    if(throttle_update(&sample))
+        publish_profile_changed();
+}
+
+// Publish every channel with the next frame, e.g. after the deadband changes.
+static void reset_deadband(){
+    for(int channel = 0; channel < DEADBAND_VIRTUAL(MAX_VIRTUAL_CHANNELS); channel++)
+        Channels.deadband_time[channel] = 0;
+}
+
+// Start every channel's prediction over, flat at the next value published; the
+// host does the same on an NBIRTH, or a change of Predictive Deadband.
+static void reset_prediction(){
+    for(int channel = 0; channel < DEADBAND_VIRTUAL(MAX_VIRTUAL_CHANNELS); channel++){
+        Channels.predict_time[channel] = 0;
+        Channels.predict_slope[channel] = 0;
+    }
+}
+
+// The value the host reconstructs for the channel at timestamp: the last one
+// published, extrapolated along the line from the one before with Predictive
+// Deadband set.
+static float predicted_value(int channel, unsigned long long timestamp){
+    float last = Channels.deadband_value[channel];
+    if(!m_predictiveDeadband || Channels.predict_time[channel] == 0)
+        return last;
+    return last + Channels.predict_slope[channel] * (float)(long long)(timestamp - Channels.predict_time[channel]);
+}
+
+// The absolute deadband at the publish profile: at least THROTTLE_DEADBAND
+// from Widened on.
+static float deadband(){
+    if(throttle_profile() >= PUBLISH_WIDENED && m_deadband < THROTTLE_DEADBAND)
+        return THROTTLE_DEADBAND;
+    return m_deadband;
+}
+
+// Report-by-exception is on if either deadband is set.
+static bool deadband_enabled(){
+    return deadband() > 0 || m_deadbandPercent > 0;
+}
+
+// Returns true if the channel (NUMBER_OF_THERMISTORS for the ADC temperature,
+// DEADBAND_VIRTUAL() for a virtual channel) must be published: it has moved outside the wider of the two deadbands since
+// it was last published, or from its prediction, or its heartbeat interval has expired.
+static bool outside_deadband(int channel, float value, unsigned long long timestamp){
+    float last = predicted_value(channel, timestamp);
+    if(Channels.deadband_time[channel] == 0 || isnan(value) != isnan(last))
+        return true;
+    if(m_heartbeatInterval != 0 && timestamp - Channels.deadband_time[channel] >= m_heartbeatInterval)
+        return true;
+    float threshold = fabsf(last) * m_deadbandPercent / 100;
+    if(deadband() > threshold)
+        threshold = deadband();
+    return fabsf(value - last) > threshold;
+}
+
+// Mark the channel's temperature as updated for the next NDATA: with channel
+// templates that's the Value member of its instance, besides the instance.
+static inline void mark_channel_value(int channel){
+#ifdef USE_CHANNEL_TEMPLATE
+    m_channelMembers[channel][CM_Value].updated = true;
+#else
+    (void)channel;
+#endif
+}
+
+// Record that the channel was published with the given value, and the
+// prediction's new slope, from the last value published. A null, or the first
+// value since the birth, predicts no change.
+static void deadband_published(int channel, float value, unsigned long long timestamp){
+    unsigned long long since = Channels.predict_time[channel];
+    float last = Channels.deadband_value[channel];
+    Channels.predict_slope[channel] = (since != 0 && timestamp > since && !isnan(value) && !isnan(last)) ?
+                                      (value - last) / (float)(timestamp - since) : 0;
+    Channels.predict_time[channel] = timestamp;
+    Channels.deadband_value[channel] = value;
+    Channels.deadband_time[channel] = timestamp;
+}
+
+// Mark only the frame metrics that are outside their deadband as updated.
+static void update_frame_metrics_by_exception(ThermistorValue* THERMISTOR_data, float ADC_temperature,
+                                              unsigned long long timestamp){
+    if(timestamp == 0)
+        timestamp = get_current_time_millis();
+
+    bool published = false;
+#ifdef USE_ARRAY_NDATA
+    // The thermistors share one metric, so publish them all if any has moved
+    bool publish = false;
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS && !publish; channel++)
+        publish = acquisition_channel_enabled(channel) &&
+                  outside_deadband(channel, thermistor_celsius(THERMISTOR_data[channel]), timestamp);
+    if(publish){
+        for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+            deadband_published(channel, thermistor_celsius(THERMISTOR_data[channel]), timestamp);
+        published = true;
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_THERMISTORS, 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+    }
+#else
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++){
+        // With frame banks only the bank just taken has new readings
+        if(!(Channels.frame_part & CHANNEL_BIT(channel)) ||
+           !outside_deadband(channel, thermistor_celsius(THERMISTOR_data[channel]), timestamp))
+            continue;
+        deadband_published(channel, thermistor_celsius(THERMISTOR_data[channel]), timestamp);
+        published = true;
+        mark_channel_value(channel);
+        if(!update_metric_range(CHANNEL_METRICS(channel), CHANNEL_ALIAS(channel), 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+    }
+#endif
+    for(int v = 0; v < virtual_count(); v++){
+        if(!outside_deadband(DEADBAND_VIRTUAL(v), Channels.virtual_frame[v], timestamp))
+            continue;
+        deadband_published(DEADBAND_VIRTUAL(v), Channels.virtual_frame[v], timestamp);
+        published = true;
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_VIRTUAL1 + v, 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(outside_deadband(NUMBER_OF_THERMISTORS, ADC_temperature, timestamp)){
+        deadband_published(NUMBER_OF_THERMISTORS, ADC_temperature, timestamp);
+        published = true;
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_ADC_Temperature, 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+    }
+    // Whatever goes out carries its frame's number; frames with nothing
+    // outside the deadband leave gaps in the numbers the host sees
+    if(published && !update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_FrameNumber, 1, timestamp))
+        DebugPrint(sparkplug_error_text());
+}
+
+// Commands that take too long to run inside the MQTT callback.  They are
+// validated and queued by process_node_cmd_message(), then run from
+// run_node_commands() between broker services, in the order of
+// node_command_priority().
+enum NodeCommandType {
+    NODE_CMD_CALIBRATE,
+    NODE_CMD_CLEAR_CAL,
+    NODE_CMD_CAL_UPLOAD,    // Apply m_newCalUpload
+#ifdef USE_FIRMWARE_UPDATE
+    NODE_CMD_FIRMWARE_CHUNK, // Write m_newFirmwareChunk to the staged image
+    NODE_CMD_FIRMWARE_APPLY, // Boot the verified image
+#endif
+    NODE_CMD_SCAN_CONFIG,   // Apply m_averagingPasses, m_framePeriod, m_adcOsr and m_dwellSamples
+    NODE_CMD_CHANNEL_MASK,  // Apply m_channelMask
+    NODE_CMD_ADC_PROFILE,   // Apply the acquisition profile in point
+    NODE_CMD_SENSOR_MODELS, // Apply m_newSensorModels
+    NODE_CMD_CHANNEL_SENSORS, // Apply m_newChannelSensors
+    NODE_CMD_SCAN_LIST,     // Apply m_newScanList
+    NODE_CMD_CONFIGURATION, // Apply m_newConfiguration
+#ifdef USE_RAW_STREAM
+    NODE_CMD_BURST,         // Start a burst with m_burstChannels, m_burstOsr and m_burstDuration if point, else end it
+#endif
+    NODE_CMD_SETTLING_SWEEP, // Start a settling sweep if point, else end it
+    NODE_CMD_SELF_TEST,     // Start a self test if point, else end it
+    NODE_CMD_VIRTUAL_CHANNELS // Apply m_newVirtualChannels
+};
+
+struct NodeCommand {
+    NodeCommandType type;
+    int point;          // NODE_CMD_CALIBRATE: reference point, 1 or 2; NODE_CMD_ADC_PROFILE: profile;
+                        // NODE_CMD_BURST, NODE_CMD_SETTLING_SWEEP, NODE_CMD_SELF_TEST: 1 to start, 0 to end
+    float ref_temp;     // NODE_CMD_CALIBRATE: reference temperature
+};
+
+static NodeCommand  m_nodeCommands[NODE_COMMAND_QUEUE_DEPTH];
+static unsigned int m_nodeCommandHead  = 0;     // Oldest queued command
+static unsigned int m_nodeCommandCount = 0;
+#define QUEUED_NODE_COMMAND(i)  m_nodeCommands[(m_nodeCommandHead + (i)) % NODE_COMMAND_QUEUE_DEPTH]
+
+// millis() when each command held off by COMMAND_HOLDOFF_MS last went out
+static unsigned long m_rebirthAt      = 0;
+static unsigned long m_calStatusAt    = 0;
+static unsigned long m_clearCalAt     = 0;
+static bool         m_calStatusRequested = false;   // Calibration Status asked for and not yet published
+
+// Queue a node command.  Returns false if the queue is full.
+static bool queue_node_command(NodeCommandType type, int point, float ref_temp){
+    if(m_nodeCommandCount >= NODE_COMMAND_QUEUE_DEPTH)
+        return false;
+    NodeCommand *command = &QUEUED_NODE_COMMAND(m_nodeCommandCount);
+    command->type = type;
+    command->point = point;
+    command->ref_temp = ref_temp;
+    m_nodeCommandCount++;
+    return true;
+}
+
+// The order queued commands run in, lowest first; those of the same priority
+// run in the order they came.  Scan engine restarts go first so acquisition is
+// back in its new setup soonest, then firmware chunks, then the calibration
+// commands, each of which can hold up what's behind it for ~0.5 s.  A
+// firmware apply reboots, so it waits for everything else.
+static int node_command_priority(NodeCommandType type){
+    switch(type){
+#ifdef USE_FIRMWARE_UPDATE
+    case NODE_CMD_FIRMWARE_CHUNK:
+        return 1;
+    case NODE_CMD_FIRMWARE_APPLY:
+        return 3;
+#endif
+    case NODE_CMD_CALIBRATE:
+    case NODE_CMD_CLEAR_CAL:
+    case NODE_CMD_CAL_UPLOAD:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Take the next command to run off the queue.  There must be one.
+static NodeCommand take_node_command(){
+    unsigned int next = 0;
+    for(unsigned int i = 1; i < m_nodeCommandCount; i++)
+        if(node_command_priority(QUEUED_NODE_COMMAND(i).type) < node_command_priority(QUEUED_NODE_COMMAND(next).type))
+            next = i;
+    NodeCommand command = QUEUED_NODE_COMMAND(next);
+    // Close the gap, keeping the rest in order
+    for(unsigned int i = next; i > 0; i--)
+        QUEUED_NODE_COMMAND(i) = QUEUED_NODE_COMMAND(i - 1);
+    m_nodeCommandHead = (m_nodeCommandHead + 1) % NODE_COMMAND_QUEUE_DEPTH;
+    m_nodeCommandCount--;
+    return command;
+}
+
+// Returns true until COMMAND_HOLDOFF_MS has passed since a command that went
+// out at the given millis().
+static bool command_held_off(unsigned long at){
+    return at != 0 && (long)(millis() - at) < COMMAND_HOLDOFF_MS;
+}
+
+// Refuse a node command the node is too busy for, echoing the metric it wrote
+// (if any) so the host sees the write didn't take.
+static void refuse_busy_command(const char *what, void *echo){
+    DebugPrintNoEOL(what);
+    DebugPrint(" refused, busy");
+    health_count(HEALTH_COMMANDS_BUSY);
+    if(echo != NULL && !update_metric(ARRAY_AND_SIZE(NodeMetrics), echo))
+        DebugPrint(sparkplug_error_text());
+}
+
+#ifdef USE_SD_LOG
+// Follow the SD log as files roll over, frames are dropped or the card fails.
+static void update_sd_log_metrics(){
+    if(m_sdLogging != sdlog_enabled()){
+        m_sdLogging = sdlog_enabled();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sdLogging))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(strcmp(m_sdLogFileBuffer, sdlog_file_name()) != 0){
+        snprintf(m_sdLogFileBuffer, sizeof(m_sdLogFileBuffer), "%s", sdlog_file_name());
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sdLogFile))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(m_sdLogDropped != sdlog_dropped()){
+        m_sdLogDropped = sdlog_dropped();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sdLogDropped))
+            DebugPrint(sparkplug_error_text());
+    }
+}
+#endif
+
+#ifdef USE_METRICS_HTTP
+// Render the Health and Diagnostics metrics, and the phase profiles, for the
+// HTTP scrape endpoint: "Health/Frame Rate" as thermistormux_health_frame_rate,
+// labelled with the node.  Skipped while a scrape is still reading the buffer.
+static void render_scrape_metrics(){
+    char *text = http_metrics_buffer();
+    if(text == NULL)
+        return;
+    size_t length = 0;
+    for(unsigned int alias = NMA_HealthFrameRate; alias <= NMA_DiagHeapFree; alias++){
+        MetricSpec *spec = find_metric_by_alias(ARRAY_AND_SIZE(NodeMetrics), alias);
+        if(spec == NULL || spec->disabled)
+            continue;
+        char name[64] = "thermistormux_";
+        size_t pos = strlen(name);
+        for(const char *c = spec->name; *c != '\0' && pos < sizeof(name) - 1; c++)
+            name[pos++] = isalnum((unsigned char)*c) ? tolower((unsigned char)*c) : '_';
+        name[pos] = '\0';
+        double value = (spec->datatype == METRIC_DATA_TYPE_FLOAT) ? *(float *)spec->variable
+                                                                  : (double)*(int64_t *)spec->variable;
+        int n = snprintf(&text[length], HTTP_METRICS_SIZE - length, "# TYPE %s gauge\n%s{node=\"%s\"} %.6g\n",
+                         name, name, node_id, value);
+        if(n < 0 || (size_t)n >= HTTP_METRICS_SIZE - length)
+            break;
+        length += n;
+    }
+#ifdef USE_PROFILER
+    int n = snprintf(&text[length], HTTP_METRICS_SIZE - length,
+                     "# TYPE thermistormux_phase_runs gauge\n# TYPE thermistormux_phase_us gauge\n");
+    if(n > 0 && (size_t)n < HTTP_METRICS_SIZE - length)
+        length += n;
+    for(int phase = 0; phase < NUM_PROFILE_PHASES; phase++){
+        ProfileStats stats;
+        if(!profile_stats(phase, &stats))
+            continue;
+        const char *phase_name = profile_phase_name(phase);
+        n = snprintf(&text[length], HTTP_METRICS_SIZE - length,
+                     "thermistormux_phase_runs{node=\"%s\",phase=\"%s\"} %lu\n"
+                     "thermistormux_phase_us{node=\"%s\",phase=\"%s\",stat=\"min\"} %lu\n"
+                     "thermistormux_phase_us{node=\"%s\",phase=\"%s\",stat=\"avg\"} %lu\n"
+                     "thermistormux_phase_us{node=\"%s\",phase=\"%s\",stat=\"p99\"} %lu\n"
+                     "thermistormux_phase_us{node=\"%s\",phase=\"%s\",stat=\"max\"} %lu\n",
+                     node_id, phase_name, stats.count, node_id, phase_name, (unsigned long)stats.min_us,
+                     node_id, phase_name, (unsigned long)stats.avg_us, node_id, phase_name,
+                     (unsigned long)stats.p99_us, node_id, phase_name, (unsigned long)stats.max_us);
+        if(n < 0 || (size_t)n >= HTTP_METRICS_SIZE - length)
+            break;
+        length += n;
+    }
+#endif
+    http_metrics_ready(length);
+}
+#endif
+
+// Refresh the Health and memory Diagnostics metrics every HEALTH_INTERVAL_MS and
+// publish them in an NDATA message of their own, all with one timestamp.  The
+// rates are averaged over the interval.
+static void update_health(){
+    static unsigned long last_update = 0;
+    static uint32_t last_frames = 0;
+    static uint32_t last_conversions = 0;
+    static uint64_t last_cycles = 0;
+    static uint64_t last_idle = 0;
+    unsigned long elapsed = millis() - last_update;
+    if(elapsed < HEALTH_INTERVAL_MS)
+        return;
+    last_update += elapsed;
+
+    uint32_t frames = health_counter(HEALTH_FRAMES);
+    uint32_t conversions = health_counter(HEALTH_CONVERSIONS);
+    m_frameRate = (frames - last_frames) * 1000.0f / elapsed;
+    m_conversionRate = (conversions - last_conversions) * 1000.0f / elapsed;
+    last_frames = frames;
+    last_conversions = conversions;
+    uint64_t cycles = time_cycles64();
+    uint64_t idle = scheduler_idle_cycles();
+    if(cycles > last_cycles)
+        m_cpuUtilization = 100.0f * (1.0f - (float)(idle - last_idle) / (cycles - last_cycles));
+    last_cycles = cycles;
+    last_idle = idle;
+    m_peakExcitationDuty = 100.0f * selfheat_peak_duty();
+    m_restingChannels = (uint64_t)selfheat_resting();
+#ifdef USE_FRAME_SYNC
+    m_syncMissed = health_counter(HEALTH_SYNC_MISSED);
+#endif
+    m_invalidData = health_counter(HEALTH_INVALID_DATA);
+    m_registerMismatches = health_counter(HEALTH_REGISTER_MISMATCHES);
+    m_adcCrcErrors = health_counter(HEALTH_ADC_CRC_ERRORS);
+    m_publishFailures = health_counter(HEALTH_PUBLISH_FAILURES);
+    m_brokerConnects = health_counter(HEALTH_BROKER_CONNECTS);
+    m_bdSeqIncrements = health_counter(HEALTH_BDSEQ_INCREMENTS);
+    m_sampleOverruns = acquisition_overruns();
+    m_frameOverruns = health_counter(HEALTH_FRAME_OVERRUNS);
+    m_irqMissed = health_counter(HEALTH_IRQ_MISSED);
+    m_irqLate = health_counter(HEALTH_IRQ_LATE);
+    m_irqDuplicates = health_counter(HEALTH_IRQ_DUPLICATES);
+    m_adcRecoveries = health_counter(HEALTH_ADC_RECOVERIES);
+    m_adcReconfigurations = health_counter(HEALTH_ADC_RECONFIGURATIONS);
+    m_watchdogRecoveries = health_counter(HEALTH_WATCHDOG_RECOVERIES);
+    m_linkLosses = health_counter(HEALTH_LINK_LOSSES);
+    m_commandsBusy = health_counter(HEALTH_COMMANDS_BUSY);
+    // Frames overwritten in a full history were never published either
+    m_framesLost = health_counter(HEALTH_FRAMES_LOST) + history_dropped();
+    m_framesReplayed = health_counter(HEALTH_FRAMES_REPLAYED);
+    m_framesResent = health_counter(HEALTH_FRAMES_RESENT);
+    m_irqLatency = (float)health_take_latency() / (F_CPU_ACTUAL / 1000000);
+    // A frame start's error from true UTC: how late it fired on the local
+    // clock, plus how far that clock was off its source at the last sync
+    uint32_t phase = health_take_phase();
+    m_framePhaseError = phase == UINT32_MAX ? NAN :
+                        (float)phase / (F_CPU_ACTUAL / 1000000) + fabsf((float)time_last_offset_us());
+    uint64_t since_sync = time_since_sync_ms();
+    m_timeSinceSync = since_sync == UINT64_MAX ? (uint64_t) -1 : since_sync / 1000;
+    m_historyFill = history_fill();
+    m_stackFree = memory_stack_free();
+    m_heapUsed = memory_heap_used();
+    m_heapPeak = memory_heap_peak();
+    m_heapFree = memory_heap_free();
+
+    if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_HealthFrameRate,
+                            NMA_DiagHeapFree - NMA_HealthFrameRate + 1, 0))
+        DebugPrint(sparkplug_error_text());
+#ifdef USE_SD_LOG
+    update_sd_log_metrics();
+#endif
+#ifdef USE_METRICS_HTTP
+    render_scrape_metrics();
+#endif
+    publish_node_data();
+}
+
+// Show whether a calibration is queued or running.
+static void set_calibration_inw(bool inw){
+    if(m_nodeCalibrationINW == inw)
+        return;
+    m_nodeCalibrationINW = inw;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrationINW))
+        DebugPrint(sparkplug_error_text());
+}
+
+// Mark the calibration metrics updated once the calibration data has changed,
+// or when a host asks for them, so the next NDATA carries the calibration
+// status, reference temperatures and noise without the rest of the node.
+static void publish_calibration_metrics(){
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrated) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrationINW) ||
+       !update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_CalibrationTemp1, 2, 0) ||
+       !update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_CalibrationTemp3,
+                            NMA_HealthCalibrationNoise - NMA_CalibrationTemp3 + 1, 0))
+        DebugPrint(sparkplug_error_text());
+}
+
+#ifdef USE_FIRMWARE_UPDATE
+// Mark the firmware update's status updated, as it changes and as each chunk
+// is taken or turned down, so the host knows where to carry on from.
+static void publish_firmware_update(){
+    ota_format_status(m_firmwareUpdateBuffer, sizeof(m_firmwareUpdateBuffer));
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_firmwareUpdate))
+        DebugPrint(sparkplug_error_text());
+}
+#endif
+
+// Calibration point (1 to CAL_MAX_POINTS) taken through the metric with the
+// specified alias.
+static int calibration_point(unsigned int alias){
+    if(alias == NMA_CalibrationTemp1)
+        return 1;
+    if(alias == NMA_CalibrationTemp2)
+        return 2;
+    return alias - NMA_CalibrationTemp3 + 3;
+}
+
+// Returns true if a command of the given type is queued.
+static bool command_queued(NodeCommandType type){
+    for(unsigned int i = 0; i < m_nodeCommandCount; i++)
+        if(QUEUED_NODE_COMMAND(i).type == type)
+            return true;
+    return false;
+}
+
+// Returns true if a calibration of the point to ref_temp is queued.
+static bool calibration_command_queued(int point, float ref_temp){
+    for(unsigned int i = 0; i < m_nodeCommandCount; i++){
+        const NodeCommand *command = &QUEUED_NODE_COMMAND(i);
+        if(command->type == NODE_CMD_CALIBRATE && command->point == point && command->ref_temp == ref_temp)
+            return true;
+    }
+    return false;
+}
+
+// Load the scan settings metrics from the settings in use.
+static void load_scan_config(){
+    ScanConfig config;
+    get_scan_config(&config);
+    m_averagingPasses = config.averaging_passes;
+    m_framePeriod = config.frame_period_ms;
+    m_adcOsr = config.osr;
+    m_dwellSamples = config.dwell_samples;
+    m_frameBanks = config.frame_banks;
+    const ADCProfile *profile = ADC_profile(ADC_profile_in_use());
+    m_acquisitionProfile = profile != NULL ? profile->name : "Custom";
+}
+
+// Format the adaptive sampling schedule: the passes between scans of each
+// thermistor, comma separated in thermistor order, "-" for a disabled one.
+static void load_sample_schedule(){
+    size_t pos = 0;
+    for(int i = 0; i < NUMBER_OF_THERMISTORS && pos < sizeof(m_sampleScheduleBuffer); i++){
+        const char *separator = i == 0 ? "" : ",";
+        if(acquisition_channel_enabled(i))
+            pos += snprintf(&m_sampleScheduleBuffer[pos], sizeof(m_sampleScheduleBuffer) - pos, "%s%u",
+                            separator, acquisition_channel_interval(i));
+        else
+            pos += snprintf(&m_sampleScheduleBuffer[pos], sizeof(m_sampleScheduleBuffer) - pos, "%s-",
+                            separator);
+    }
+}
+
+// Format the settling times: the µs each thermistor's MOSFET is switched in
+// before its conversion starts, comma separated in thermistor order.
+static void load_settling_times(){
+    size_t pos = 0;
+    for(int i = 0; i < NUMBER_OF_THERMISTORS && pos < sizeof(m_settlingTimesBuffer); i++)
+        pos += snprintf(&m_settlingTimesBuffer[pos], sizeof(m_settlingTimesBuffer) - pos, "%s%u",
+                        i == 0 ? "" : ",", acquisition_settling_us(i));
+}
+
+// Format the scan list in use, "-" for none.
+static void load_scan_list(){
+    ScanEntry list[MAX_SCAN_ENTRIES];
+    acquisition_scan_list(list);
+    acquisition_format_scan_list(list, m_scanListBuffer, sizeof(m_scanListBuffer));
+}
+
+/**
+ * @brief Publishes the scan settings after they change, with the next NDATA
+ * message.
+ */
+void publish_scan_config(){
+    load_scan_config();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_averagingPasses) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_framePeriod) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_adcOsr) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_dwellSamples) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_frameBanks) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_acquisitionProfile))
+        DebugPrint(sparkplug_error_text());
+}
+
+// Reload the sensor model metrics from the models in use.
+static void load_sensor_models(){
+    sensor_format_models(m_sensorModelsBuffer, sizeof(m_sensorModelsBuffer));
+    sensor_format_channels(m_channelSensorsBuffer, sizeof(m_channelSensorsBuffer));
+}
+
+// Leave the disabled channels, and the virtual channels not defined, out of the
+// payloads.  In array mode the array holds only the enabled channels, in
+// thermistor order.
+static void apply_channel_mask(){
+    m_channelMask = acquisition_channel_mask();
+#ifdef USE_ARRAY_NDATA
+    m_THERMISTORS.size = pack_enabled_channels(m_THERMISTORS.bytes, Channels.frame);
+#else
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        if(!set_metric_disabled(CHANNEL_METRICS(channel), CHANNEL_ALIAS(channel),
+                                !acquisition_channel_enabled(channel)))
+            DebugPrint(sparkplug_error_text());
+#endif
+    // Likewise the virtual channels not defined
+    for(int v = 0; v < MAX_VIRTUAL_CHANNELS; v++)
+        if(!set_metric_disabled(ARRAY_AND_SIZE(NodeMetrics), NMA_VIRTUAL1 + v, v >= virtual_count()))
+            DebugPrint(sparkplug_error_text());
+    reset_deadband();
+    reset_prediction();
+#ifdef USE_FROZEN_NDATA
+    // Fall back to encoding each NDATA message if the payload can't be frozen
+    if(!freeze_payload(ARRAY_AND_SIZE(NodeMetrics), NMA_FIRST_FRAME_METRIC,
+                       NUM_FRAME_METRICS))
+        DebugPrint(sparkplug_error_text());
+#endif
+}
+
+// Returns true if a calibration command is queued.
+static bool calibration_queued(){
+    return command_queued(NODE_CMD_CALIBRATE);
+}
+
+// Publish a new channel mask, which was previous: its payloads leave out the
+// disabled channels, and the host needs new births for them.
+static void publish_channel_mask(ChannelMask previous){
+    apply_channel_mask();
+    load_sample_schedule();
+#ifdef USE_DEVICE_BANKS
+    // Only the banks whose thermistors changed need new births
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_channelMask) ||
+       !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sampleSchedule))
+        DebugPrint(sparkplug_error_text());
+    publish_bank_changes(previous);
+#else
+    // The set of metrics has changed, so the host needs new births
+    (void)previous;
+    publish_births(false);
+#endif
+}
+
+// Put each setting of a node configuration in use.  Returns false at the
+// first one refused, with those before it applied.  The scan engine is only
+// restarted for scan settings or a channel mask that differ.
+static bool apply_config(const NodeConfig *config){
+    if(config->deadband < 0 || config->deadband_percent < 0 || config->channel_mask > ALL_CHANNELS_MASK ||
+       config->spike_filter >= NUM_SPIKE_FILTERS)
+        return false;
+    m_deadband = config->deadband;
+    m_deadbandPercent = config->deadband_percent;
+    m_heartbeatInterval = config->heartbeat_ms;
+    reset_deadband();
+    ScanConfig scan;
+    get_scan_config(&scan);
+    if(scan.averaging_passes != config->averaging_passes || scan.frame_period_ms != config->frame_period_ms ||
+       scan.osr != config->osr || scan.dwell_samples != config->dwell_samples ||
+       scan.frame_banks != config->frame_banks){
+        scan = {config->averaging_passes, config->frame_period_ms, config->osr, config->dwell_samples,
+                config->frame_banks};
+        if(!set_scan_config(&scan))
+            return false;
+    }
+    if((ChannelMask) config->channel_mask != acquisition_channel_mask() &&
+       !set_channel_mask((ChannelMask) config->channel_mask))
+        return false;
+    if(!set_quiet_interval(config->quiet_interval) || !acquisition_set_temp_interval(config->temp_interval))
+        return false;
+#ifdef USE_REF_TRACKING
+    if(!acquisition_set_ref_interval(config->ref_interval))
+        return false;
+#endif
+#ifdef USE_CHANNEL_STATS
+    // Setting the window starts a new one
+    if(config->stats_window != stats_window() && !stats_set_window(config->stats_window))
+        return false;
+#endif
+    if(!set_settling_times(config->settling_us) || !set_scan_list(config->scan_list))
+        return false;
+    filter_set_spike((SpikeFilter) config->spike_filter);
+    set_payload_compression(config->compression_bytes);
+    return true;
+}
+
+// Put a node configuration in use as a whole: if any setting is refused, the
+// settings in use before are put back.  Returns false if it was refused.
+static bool set_config(const NodeConfig *config){
+    NodeConfig previous;
+    capture_config(&previous);
+    if(apply_config(config))
+        return true;
+    apply_config(&previous);
+    return false;
+}
+
+// Reload the metrics of the settings a node configuration carries and mark
+// them updated, with any channel mask change, which was previous.
+static void publish_configuration(ChannelMask previous){
+    load_scan_config();
+    m_quietInterval = quiet_interval();
+    m_tempInterval = acquisition_temp_interval();
+#ifdef USE_REF_TRACKING
+    m_refInterval = acquisition_ref_interval();
+#endif
+    m_spikeFilter = filter_spike_name(filter_spike());
+#ifdef USE_CHANNEL_STATS
+    m_statsWindow = stats_window();
+#endif
+    m_compressionThreshold = payload_compression();
+    m_channelMask = acquisition_channel_mask();
+    load_settling_times();
+    load_scan_list();
+    load_configuration();
+    void *echoed[] = {
+        &m_deadband, &m_deadbandPercent, &m_heartbeatInterval, &m_averagingPasses, &m_framePeriod, &m_adcOsr,
+        &m_dwellSamples, &m_frameBanks, &m_acquisitionProfile, &m_quietInterval, &m_tempInterval, &m_spikeFilter,
+        &m_compressionThreshold, &m_settlingTimes, &m_scanList, &m_configuration, &m_configurationHash,
+#ifdef USE_CHANNEL_STATS
+        &m_statsWindow,
+#endif
+#ifdef USE_REF_TRACKING
+        &m_refInterval,
+#endif
+    };
+    for(unsigned int i = 0; i < NUM_ELEM(echoed); i++)
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), echoed[i]))
+            DebugPrint(sparkplug_error_text());
+    if(acquisition_channel_mask() != previous)
+        publish_channel_mask(previous);
+}
+
+/**
+ * @brief Runs the queued node commands.  A calibration capture is checked on
+ * each call while the scan collects its frames; nothing else is started until
+ * it finishes.
+ */
+void run_node_commands(void){
+    static bool sweeping = false;
+    // Calibration Status requests, all those held off answered by one
+    if(m_calStatusRequested && !command_held_off(m_calStatusAt)){
+        m_calStatusRequested = false;
+        m_calStatusAt = millis();
+        publish_calibration_metrics();
+    }
+
+    if(sweeping){
+        CalStep step = cal_step();
+        // Show each thermistor as it becomes ready, and none once it's over
+        if(cal_ready_channels() != m_calReady){
+            m_calReady = cal_ready_channels();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calReady))
+                DebugPrint(sparkplug_error_text());
+        }
+        if(step == CAL_RUNNING)
+            return;
+        sweeping = false;
+        // NaN for a point whose readings never settled, so a host can tell
+        m_calNoise = (step != CAL_FAILED) ? cal_noise() : NAN;
+        if(step == CAL_COMPLETE)
+            m_nodeCalibrated = true;
+        else if(step == CAL_POINT_DONE)
+            m_nodeCalibrated = false;
+        set_calibration_inw(calibration_queued());
+        publish_calibration_metrics();
+        return;
+    }
+
+#ifdef USE_RAW_STREAM
+    // A burst ends by itself
+    if(m_burstCapture && !burst_running()){
+        m_burstCapture = false;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_burstCapture))
+            DebugPrint(sparkplug_error_text());
+    }
+
+#endif
+    // So does a settling sweep, whose settling times are saved with the node
+    // configuration
+    if(m_settlingSweep && !settling_sweep_running()){
+        m_settlingSweep = false;
+        NodeConfig config;
+        capture_config(&config);
+        if(!config_save(&config))
+            DebugPrint("Settling times in use but not saved");
+        publish_configuration(acquisition_channel_mask());
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_settlingSweep))
+            DebugPrint(sparkplug_error_text());
+    }
+
+    if(m_nodeCommandCount == 0)
+        return;
+    NodeCommand command = take_node_command();
+
+    switch(command.type){
+    case NODE_CMD_CALIBRATE:
+        m_calTemp[command.point - 1] = command.ref_temp;
+        sweeping = cal_begin(command.ref_temp, command.point);
+        if(!sweeping){
+            DebugPrint("Unable to start calibration");
+            set_calibration_inw(calibration_queued());
+        }
+        break;
+
+    case NODE_CMD_CLEAR_CAL:
+        m_clearCalAt = millis();
+        if(clear_cal_data()) {
+            m_nodeCalibrated = false;
+            for(int point = 0; point < CAL_MAX_POINTS; point++)
+                m_calTemp[point] = 0.00;
+        }
+        publish_calibration_metrics();
+        DebugPrint("Calibration data has been permanently erased.");
+        break;
+
+    case NODE_CMD_CAL_UPLOAD: {
+        static CalData upload;
+        if(!calupload_decode(m_newCalUpload.bytes, m_newCalUpload.size, &upload)){
+            DebugPrint("Invalid calibration upload");
+        }
+        else{
+            // Points the upload doesn't make are gone with the rest
+            float previous[CAL_MAX_POINTS];
+            memcpy(previous, m_calTemp, sizeof(previous));
+            for(int point = 0; point < CAL_MAX_POINTS; point++)
+                m_calTemp[point] = 0.00;
+            if(set_cal_data(&upload)){
+                m_nodeCalibrated = cal_in_use();
+                DebugPrint("Calibration upload applied and saved.");
+            }
+            else{
+                memcpy(m_calTemp, previous, sizeof(previous));
+                DebugPrint("Calibration upload not applied: a calibration or burst is running, or it couldn't be saved");
+            }
+        }
+        publish_calibration_metrics();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calUpload))
+            DebugPrint(sparkplug_error_text());
+        break;
+    }
+
+#ifdef USE_FIRMWARE_UPDATE
+    case NODE_CMD_FIRMWARE_CHUNK:
+        if(!ota_chunk(m_newFirmwareChunk.bytes, m_newFirmwareChunk.size))
+            DebugPrint("Firmware chunk not taken");
+        publish_firmware_update();
+        break;
+
+    case NODE_CMD_FIRMWARE_APPLY:
+        // Like reset_teensy(), but booting the new image; only returns if
+        // there is none
+        warmboot_prepare(m_bdSeq, NUM_BROKERS, RESET_UPDATE);
+        if(!ota_apply())
+            DebugPrint("No verified firmware image to apply");
+        break;
+
+#endif
+    case NODE_CMD_SCAN_CONFIG:{
+        ScanConfig config = {(unsigned int)m_averagingPasses, (unsigned int)m_framePeriod, (uint32_t)m_adcOsr,
+                             (unsigned int)m_dwellSamples, (unsigned int)m_frameBanks};
+        if(m_averagingPasses > UINT_MAX || m_framePeriod > UINT_MAX || m_adcOsr > UINT32_MAX ||
+           m_dwellSamples > UINT_MAX || m_frameBanks > UINT_MAX ||
+           !set_scan_config(&config))
+            DebugPrint("Invalid scan settings, or a calibration is running");
+        // Echo the settings in use, whether or not they changed
+        publish_scan_config();
+        break;
+    }
+
+    case NODE_CMD_ADC_PROFILE:
+        if(!set_acquisition_profile(command.point))
+            DebugPrint("Invalid acquisition profile, or a calibration is running");
+        // Echo the profile and oversampling in use, whether or not they changed
+        publish_scan_config();
+        break;
+
+    case NODE_CMD_CHANNEL_MASK: {
+        ChannelMask previous = acquisition_channel_mask();
+        if(m_channelMask <= ALL_CHANNELS_MASK && set_channel_mask((ChannelMask)m_channelMask))
+            publish_channel_mask(previous);
+        else{
+            DebugPrint("Invalid channel mask, or a calibration is running");
+            m_channelMask = acquisition_channel_mask();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_channelMask))
+                DebugPrint(sparkplug_error_text());
+        }
+        break;
+    }
+
+    case NODE_CMD_SENSOR_MODELS:
+    case NODE_CMD_CHANNEL_SENSORS:
+        if(!(command.type == NODE_CMD_SENSOR_MODELS ? set_sensor_models(m_newSensorModels) :
+                                                      set_channel_sensors(m_newChannelSensors)))
+            DebugPrint("Invalid sensor models, or a calibration is running");
+        // Echo the models in use, whether or not they changed
+        load_sensor_models();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sensorModels) ||
+           !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_channelSensors))
+            DebugPrint(sparkplug_error_text());
+        break;
+
+    case NODE_CMD_VIRTUAL_CHANNELS:
+        // The set of metrics changes, so the host needs new births
+        if(virtual_set_channels(m_newVirtualChannels)){
+            alarm_reset_virtual();
+            apply_channel_mask();
+            publish_births(false);
+            publish_alarms();
+        }
+        else{
+            DebugPrintNoEOL("Invalid virtual channels: ");
+            DebugPrint(m_newVirtualChannels);
+        }
+        // Echo the channels in use, whether or not they changed
+        virtual_format_channels(m_virtualChannelsBuffer, sizeof(m_virtualChannelsBuffer));
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_virtualChannels))
+            DebugPrint(sparkplug_error_text());
+        break;
+
+    case NODE_CMD_SCAN_LIST: {
+        ScanEntry list[MAX_SCAN_ENTRIES];
+        if(!acquisition_parse_scan_list(m_newScanList, list) || !set_scan_list(list))
+            DebugPrint("Invalid scan list, or a calibration is running");
+        // Echo the list in use, whether or not it changed
+        load_scan_list();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_scanList))
+            DebugPrint(sparkplug_error_text());
+        break;
+    }
+
+    case NODE_CMD_CONFIGURATION: {
+        ChannelMask previous = acquisition_channel_mask();
+        NodeConfig config;
+        capture_config(&config);
+        if(!config_decode(m_newConfiguration.bytes, m_newConfiguration.size, &config) || !set_config(&config))
+            DebugPrint("Invalid node configuration, or a calibration or burst is running");
+        else{
+            // Saved as put in use, in one EEPROM write
+            capture_config(&config);
+            if(!config_save(&config))
+                DebugPrint("Node configuration applied but not saved");
+        }
+        // Echo the settings in use, whether or not they changed
+        publish_configuration(previous);
+        break;
+    }
+
+#ifdef USE_RAW_STREAM
+    case NODE_CMD_BURST:
+        if(command.point){
+            BurstConfig config = {(ChannelMask)m_burstChannels, (uint32_t)m_burstOsr, (unsigned int)m_burstDuration};
+            if(m_burstChannels > ALL_CHANNELS_MASK || m_burstOsr > UINT32_MAX || m_burstDuration > UINT_MAX ||
+               !burst_start(&config))
+                DebugPrint("Invalid burst settings, no raw stream, or a calibration or burst is running");
+        }
+        else
+            burst_stop();
+        // Echo whether a burst is running
+        m_burstCapture = burst_running();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_burstCapture))
+            DebugPrint(sparkplug_error_text());
+        break;
+
+#endif
+    case NODE_CMD_SETTLING_SWEEP:
+        if(command.point){
+            if(!settling_sweep_start())
+                DebugPrint("No thermistor to characterize, or a calibration, burst or sweep is running");
+        }
+        else
+            settling_sweep_stop();
+        // Echo whether a sweep is running
+        m_settlingSweep = settling_sweep_running();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_settlingSweep))
+            DebugPrint(sparkplug_error_text());
+        break;
+
+    case NODE_CMD_SELF_TEST:
+        if(command.point){
+            if(m_selfTestWaiting || !self_test_start())
+                DebugPrint("A calibration, burst, sweep or self test is running");
+        }
+        else
+            self_test_stop();
+        // Echo whether a test is running; publish_self_test() clears it with the results
+        m_selfTest = self_test_running() || m_selfTestWaiting;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_selfTest))
+            DebugPrint(sparkplug_error_text());
+        break;
+    }
+}
+
+// FNV-1a hash of a topic name
+static uint32_t topic_hash(const char *topic, size_t len){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (uint8_t)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Check whether an incoming topic, with its length and hash, is the named
+// topic.  The length and hash reject almost every other topic without
+// comparing the strings.
+static bool topic_is(const TopicName *name, const char *topic, size_t len, uint32_t hash){
+    return len == name->len && hash == name->hash && memcmp(topic, name->name, len) == 0;
+}
+
+// Fill in a topic name and its length and hash
+static void set_topic_name(TopicName *name, const char *topic){
+    name->len = snprintf(name->name, sizeof(name->name), "%s", topic);
+    name->hash = topic_hash(name->name, name->len);
+}
+
+// Fill in a node topic name for this node
+static void set_node_topic_name(TopicName *name, const char *type){
+    char topic[TOPIC_NAME_SIZE];
+    snprintf(topic, sizeof(topic), NODE_TOPIC("%s", "%s"), type, node_id);
+    set_topic_name(name, topic);
+}
+
+#ifdef USE_DEVICE_BANKS
+// Fill in a device topic name for one of this node's banks.  The bank number is
+// one digit (NUM_DEVICE_BANKS is at most 8), as DEVICE_ID_SIZE allows for.
+static void set_bank_topic_name(TopicName *name, const char *type, int bank){
+    char topic[TOPIC_NAME_SIZE];
+    snprintf(topic, sizeof(topic), DEVICE_TOPIC("%s", "%s", DEVICE_ID_PREFIX "%c"), type, node_id,
+             (char)('1' + bank));
+    set_topic_name(name, topic);
+}
+#endif
+
+// Add a topic to the subscriptions, or change its handler.
+static void add_subscription(const TopicName *topic, TopicHandler handler){
+    unsigned int slot = topic->hash & (SUBSCRIPTION_SLOTS - 1);
+    while(m_subscriptions[slot].topic != NULL && m_subscriptions[slot].topic != topic)
+        slot = (slot + 1) & (SUBSCRIPTION_SLOTS - 1);
+    if(m_subscriptions[slot].topic == NULL){
+        if(2 * (m_numSubscriptions + 1) > SUBSCRIPTION_SLOTS){
+            DebugPrint("Too many subscriptions, raise SUBSCRIPTION_SLOTS");
+            return;
+        }
+        m_numSubscriptions++;
+    }
+    m_subscriptions[slot].topic = topic;
+    m_subscriptions[slot].handler = handler;
+}
+
+// The subscription an incoming topic, with its length and hash, is for; NULL
+// if none.
+static const Subscription *find_subscription(const char *topic, size_t len, uint32_t hash){
+    unsigned int slot = hash & (SUBSCRIPTION_SLOTS - 1);
+    while(m_subscriptions[slot].topic != NULL){
+        if(topic_is(m_subscriptions[slot].topic, topic, len, hash))
+            return &m_subscriptions[slot];
+        slot = (slot + 1) & (SUBSCRIPTION_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Handle a Node command (NCMD) message.
+static void process_node_cmd_message(const char* topic, byte* payload, unsigned int len){
+    Serial.println("Processing Command.");
+
+    // Decode the Sparkplug payload into static storage, so commands never
+    // allocate
+    static CommandPayload command;
+    if(!decode_command_payload(payload, len, &command)){
+        // Invalid payload - don't do anything
+        DebugPrintNoEOL("Unable to decode Node command payload: ");
+        DebugPrint(sparkplug_error_text());
+        return;
+    }
+
+    // Process the metrics
+    for(unsigned int idx = 0; idx < command.metrics_count; idx++){
+        Metric *metric = &command.metrics[idx];
+        MetricSpec *metric_spec = find_received_metric(ARRAY_AND_SIZE(NodeMetrics), metric);
+        if(metric_spec == NULL){
+            // Invalid metric - skip it
+            DebugPrintNoEOL("Unrecognized Node metric: ");
+            DebugPrint(sparkplug_error_text());
+            continue;
+        }
+
+        // Now handle the metric
+        int64_t alias = metric_spec->alias;
+        switch(alias){
+        case NMA_Reboot:
+            if(metric->value.boolean_value){
+                DebugPrint("Reboot command received");
+                // Reboot immediately - don't attempt to process the rest of
+                // the message, publish data, send death certificate,
+                // disconnect from broker, or close network
+                reset_teensy(RESET_COMMAND);
+            }
+            break;
+
+        case NMA_Rebirth:
+            m_nodeRebirth = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeRebirth))
+                DebugPrint(sparkplug_error_text());
+            if(m_nodeRebirth){
+                // Publish birth messages again, with names: a host asking for
+                // a rebirth may not hold the definitions another confirmed
+                m_knownDefinitions = 0;
+                set_alias_only_births(0, NMA_DefinitionsHash);
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_knownDefinitions))
+                    DebugPrint(sparkplug_error_text());
+                DebugPrint("Node Rebirth command received");
+            }
+            break;
+
+        case NMA_KnownDefinitions:
+            // Takes effect at the next birth, and only while the definitions
+            // still hash to this; 0 names every metric again
+            if(metric->value.long_value > UINT32_MAX){
+                DebugPrint("Known definitions hash rejected");
+            }
+            else{
+                m_knownDefinitions = metric->value.long_value;
+                set_alias_only_births((uint32_t) m_knownDefinitions, NMA_DefinitionsHash);
+            }
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_knownDefinitions))
+                DebugPrint(sparkplug_error_text());
+            break;
+
+        case NMA_NextServer:
+            // Acted on by the next check_brokers() in active/standby mode
+            m_nodeNextServer = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeNextServer))
+                DebugPrint(sparkplug_error_text());
+            if(m_nodeNextServer)
+                DebugPrint("NextServer command received");
+            break;
+        case NMA_CalibrationStatus:
+            // Published by run_node_commands(), as it republishes every
+            // calibration metric
+            DebugPrint("Calibration status requested.");
+            m_calStatusRequested = true;
+            break;
+        case NMA_CalibrationTemp1:
+        case NMA_CalibrationTemp2:
+        case NMA_CalibrationTemp3:
+        case NMA_CalibrationTemp4:
+        case NMA_CalibrationTemp5:
+        case NMA_CalibrationTemp6:
+        case NMA_CalibrationTemp7:
+        case NMA_CalibrationTemp8:
+            // The sweep takes ~0.5 s, so it's run later by run_node_commands();
+            // the same calibration already queued takes repeats with it
+            if(isnan(metric->value.float_value)){
+                DebugPrint("Calibration command rejected");
+                break;
+            }
+            if(calibration_command_queued(calibration_point(alias), metric->value.float_value))
+                break;
+            if(!queue_node_command(NODE_CMD_CALIBRATE, calibration_point(alias), metric->value.float_value)){
+                refuse_busy_command("Calibration command", &m_calTemp[calibration_point(alias) - 1]);
+                break;
+            }
+            set_calibration_inw(true);
+            break;
+        case NMA_CalibrationINW:
+            // Read-only in effect: it shows whether a calibration is in work
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrationINW))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_Deadband:
+            m_deadband = metric->value.float_value > 0 ? metric->value.float_value : 0;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_deadband))
+                DebugPrint(sparkplug_error_text());
+            reset_deadband();
+            break;
+        case NMA_DeadbandPercent:
+            m_deadbandPercent = metric->value.float_value > 0 ? metric->value.float_value : 0;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_deadbandPercent))
+                DebugPrint(sparkplug_error_text());
+            reset_deadband();
+            break;
+        case NMA_PredictiveDeadband:
+            m_predictiveDeadband = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_predictiveDeadband))
+                DebugPrint(sparkplug_error_text());
+            reset_deadband();
+            reset_prediction();
+            break;
+        case NMA_HeartbeatInterval:
+            m_heartbeatInterval = metric->value.long_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_heartbeatInterval))
+                DebugPrint(sparkplug_error_text());
+            reset_deadband();
+            break;
+        case NMA_BatchFrames:
+            // Limited to what one payload holds; frames already collected go
+            // with the next poll if batching is turned off
+            m_batchFrames = metric->value.long_value;
+            if(m_batchFrames < 1)
+                m_batchFrames = 1;
+            else if(m_batchFrames > BATCH_MAX_FRAMES)
+                m_batchFrames = BATCH_MAX_FRAMES;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_batchFrames))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_AdaptiveThrottle:
+            // Off goes back to the configured profile at once
+            m_adaptiveThrottle = metric->value.boolean_value;
+            throttle_set_enabled(m_adaptiveThrottle);
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_adaptiveThrottle))
+                DebugPrint(sparkplug_error_text());
+            publish_profile_changed();
+            break;
+        case NMA_ThrottleLatency:
+            // From the next check; echo the limit in use
+            if(metric->value.long_value > THROTTLE_MAX_LATENCY_MS ||
+               !throttle_set_latency_limit((unsigned long) metric->value.long_value))
+                DebugPrint("Invalid throttle latency");
+            m_throttleLatency = throttle_latency_limit();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_throttleLatency))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_BatchInterval:
+            // Limited so a batch of slow frames still arrives in good time
+            m_batchInterval = metric->value.long_value;
+            if(m_batchInterval > BATCH_MAX_INTERVAL_MS)
+                m_batchInterval = BATCH_MAX_INTERVAL_MS;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_batchInterval))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_AveragingPasses:
+        case NMA_FramePeriod:
+        case NMA_ADCOversampling:
+        case NMA_DwellSamples:
+        case NMA_FrameBanks:
+            // Restarting the scan engine waits for a conversion, so it is done
+            // from run_node_commands(); one command applies all five settings
+            if(alias == NMA_AveragingPasses)
+                m_averagingPasses = metric->value.long_value;
+            else if(alias == NMA_FramePeriod)
+                m_framePeriod = metric->value.long_value;
+            else if(alias == NMA_DwellSamples)
+                m_dwellSamples = metric->value.long_value;
+            else if(alias == NMA_FrameBanks)
+                m_frameBanks = metric->value.long_value;
+            else
+                m_adcOsr = metric->value.long_value;
+            if(!command_queued(NODE_CMD_SCAN_CONFIG) && !queue_node_command(NODE_CMD_SCAN_CONFIG, 0, 0))
+                DebugPrint("Scan settings command rejected");
+            break;
+        case NMA_QuietInterval:
+            // Applied between passes, without stopping the scan engine
+            if(metric->value.long_value > UINT_MAX ||
+               !set_quiet_interval((unsigned int)metric->value.long_value))
+                DebugPrint("Invalid quiet channel interval");
+            // Echo the interval in use, whether or not it changed
+            m_quietInterval = quiet_interval();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_quietInterval))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_TargetNoise:
+            // From the next frame; the Averaging Passes metric follows the depth
+            if(!set_target_noise(metric->value.float_value))
+                DebugPrint("Invalid target noise");
+            m_targetNoise = target_noise();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_targetNoise))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_MaxExcitationDuty:
+            // From the next duty window bucket, set as %; echo the limit in use
+            if(!selfheat_set_max_duty(metric->value.float_value / 100.0f))
+                DebugPrint("Invalid excitation duty");
+            m_maxExcitationDuty = 100.0f * selfheat_max_duty();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_maxExcitationDuty))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_DissipationConstant:
+            // From the next frame
+            if(!selfheat_set_dissipation(metric->value.float_value))
+                DebugPrint("Invalid dissipation constant");
+            m_dissipation = selfheat_dissipation();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_dissipation))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_KalmanProcessNoise:
+        case NMA_KalmanMeasurementNoise:{
+            KalmanNoise kind = (KalmanNoise)(KALMAN_PROCESS + (alias - NMA_KalmanProcessNoise));
+            if(!kalman_set_noise(kind, metric->value.string_value)){
+                DebugPrintNoEOL("Invalid Kalman noise: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the noises in use
+            kalman_format_noise(kind, m_kalmanNoiseBuffer[kind], sizeof(m_kalmanNoiseBuffer[kind]));
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_kalmanNoise[kind]))
+                DebugPrint(sparkplug_error_text());
+            break;
+        }
+        case NMA_DriftCapture:
+            // Ending a capture fits it and puts the model in use
+            if(metric->value.boolean_value)
+                drift_capture_start();
+            else if(drift_capturing() && !drift_capture_finish())
+                DebugPrint("Drift capture not fitted");
+            m_driftCapture = drift_capturing();
+            drift_format_model(m_driftModelBuffer, sizeof(m_driftModelBuffer));
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_driftCapture) ||
+               !update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_driftModel))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_DriftCompensation:
+            if(!drift_set_model(metric->value.string_value)){
+                DebugPrintNoEOL("Invalid drift model: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the model in use
+            drift_format_model(m_driftModelBuffer, sizeof(m_driftModelBuffer));
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_driftModel))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_CalibrationStability:
+            if(!calcapture_set_stability(metric->value.string_value)){
+                DebugPrintNoEOL("Invalid calibration stability thresholds: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the thresholds in use
+            calcapture_format_stability(m_calStabilityBuffer, sizeof(m_calStabilityBuffer));
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calStability))
+                DebugPrint(sparkplug_error_text());
+            break;
+#ifdef USE_FIRMWARE_UPDATE
+        case NMA_FirmwareUpdate:
+            // "begin SIZE SHA256", "abort" or "apply"
+            if(strncmp(metric->value.string_value, "begin ", 6) == 0){
+                if(!ota_begin(metric->value.string_value + 6))
+                    DebugPrint("Invalid firmware update, or the image is too large");
+            }
+            else if(strcmp(metric->value.string_value, "abort") == 0)
+                ota_abort();
+            else if(strcmp(metric->value.string_value, "apply") != 0 || ota_state() != OTA_VERIFIED ||
+                    (!command_queued(NODE_CMD_FIRMWARE_APPLY) && !queue_node_command(NODE_CMD_FIRMWARE_APPLY, 0, 0))){
+                DebugPrintNoEOL("Firmware update command rejected: ");
+                DebugPrint(metric->value.string_value);
+            }
+            publish_firmware_update();
+            break;
+        case NMA_FirmwareChunk:
+            // Writing it waits for flash; the host sends the next chunk once
+            // the status shows this one taken
+            if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag ||
+               metric->value.bytes_value->size > sizeof(m_newFirmwareChunk.bytes) ||
+               command_queued(NODE_CMD_FIRMWARE_CHUNK) || !queue_node_command(NODE_CMD_FIRMWARE_CHUNK, 0, 0)){
+                DebugPrint("Firmware chunk rejected");
+                publish_firmware_update();
+                break;
+            }
+            m_newFirmwareChunk.size = metric->value.bytes_value->size;
+            memcpy(m_newFirmwareChunk.bytes, metric->value.bytes_value->bytes, m_newFirmwareChunk.size);
+            break;
+#endif
+        case NMA_CalibrationUpload:
+            // Saving it waits for EEPROM; a later upload before it runs
+            // replaces it
+            if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag ||
+               metric->value.bytes_value->size > sizeof(m_newCalUpload.bytes) ||
+               (!command_queued(NODE_CMD_CAL_UPLOAD) && !queue_node_command(NODE_CMD_CAL_UPLOAD, 0, 0))){
+                DebugPrint("Calibration upload rejected");
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calUpload))
+                    DebugPrint(sparkplug_error_text());
+                break;
+            }
+            m_newCalUpload.size = metric->value.bytes_value->size;
+            memcpy(m_newCalUpload.bytes, metric->value.bytes_value->bytes, m_newCalUpload.size);
+            break;
+        case NMA_PublishEstimateVariance:
+            m_publishVariance = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_publishVariance))
+                DebugPrint(sparkplug_error_text());
+            break;
+#ifdef USE_FRAME_SYNC
+        case NMA_FrameSync:
+            if(!framesync_set_role((int) metric->value.long_value))
+                DebugPrint("Invalid frame sync role");
+            m_frameSync = framesync_role();
+            m_frameSyncOffset = (uint64_t) framesync_frame_offset();
+            if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_FrameSync, 2, 0))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+        case NMA_RawCodesMode:
+            // From the next frame
+            if(metric->value.long_value > RAW_CODES_INSTEAD)
+                DebugPrint("Invalid raw codes mode");
+            else
+                m_rawCodesMode = metric->value.long_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_rawCodesMode))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_LogLevel:
+            if(metric->value.long_value > LOG_LEVEL_DEBUG)
+                DebugPrint("Invalid log level");
+            else
+                log_set_level((int) metric->value.long_value);
+            m_logLevel = log_level();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_logLevel))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_LogBinaryTrace:
+            // Anything queued as text is dropped on a switch
+            m_logBinaryTrace = metric->value.boolean_value;
+            log_set_binary(m_logBinaryTrace);
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_logBinaryTrace))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_AlarmHighLimits:
+        case NMA_AlarmLowLimits:
+        case NMA_AlarmRateLimits:{
+            AlarmKind kind = (AlarmKind)(ALARM_HIGH + (alias - NMA_AlarmHighLimits));
+            if(!alarm_set_limits(kind, metric->value.string_value)){
+                DebugPrintNoEOL("Invalid alarm limits: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the limits in use; setting them clears the alarms
+            alarm_format_limits(kind, m_alarmLimitsBuffer[kind], sizeof(m_alarmLimitsBuffer[kind]));
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_alarmLimits[kind]))
+                DebugPrint(sparkplug_error_text());
+            publish_alarms();
+            break;
         }
-
-        // Now handle the metric
-        int64_t alias = metric_spec->alias;
-        switch(alias){
-        case NMA_Reboot:
-            if(metric->value.boolean_value){
-                DebugPrint("Reboot command received");
-                // Reboot immediately - don't attempt to process the rest of
-                // the message, publish data, send death certificate,
-                // disconnect from broker, or close network
-                reset_teensy();
+#ifdef USE_CHANNEL_STATS
+        case NMA_RollupQuery:
+            if(!start_rollup_query(metric->value.string_value)){
+                DebugPrintNoEOL("Invalid rollup query: ");
+                DebugPrint(metric->value.string_value);
             }
+            // Echo the query being answered, "" if it was rejected
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_rollupQuery))
+                DebugPrint(sparkplug_error_text());
             break;
-
-        case NMA_Rebirth:
-            m_nodeRebirth = metric->value.boolean_value;
-            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeRebirth))
-                DebugPrint(cf_sparkplug_error);
-            if(m_nodeRebirth)
-                // Publish birth messages again
-                DebugPrint("Node Rebirth command received");
+#endif
+        case NMA_SnapshotSince:
+            // Just the frames published by now; a new request replaces the
+            // one running, and 0 ends it
+            m_snapshotSince = metric->value.long_value;
+            m_snapshotNext = history_find(m_snapshotSince);
+            m_snapshotEnd = history_first_pending();
+            if(m_snapshotSince == 0 || m_snapshotNext == m_snapshotEnd)
+                m_snapshotSince = 0;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_snapshotSince))
+                DebugPrint(sparkplug_error_text());
             break;
-
-        case NMA_NextServer:
-            //### The Next Server command is part of the Sparkplug spec, but it
-            //### has no real use here since we stay connected to all brokers.
-            //### Should we just ignore this command (and remove metric and flag)?
-            m_nodeNextServer = metric->value.boolean_value;
-            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeNextServer))
-                DebugPrint(cf_sparkplug_error);
-            if(m_nodeNextServer)
-                DebugPrint("NextServer command received");
+        case NMA_LastValueInterval:
+            // From the next one; 0 stops them, leaving the last one retained
+            m_lastValueInterval = metric->value.long_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_lastValueInterval))
+                DebugPrint(sparkplug_error_text());
             break;
-        case NMA_CalibrationStatus:
-            DebugPrint("Calibration status requested.");            
+        case NMA_CompressionThreshold:
+            // From the next payload published
+            if(metric->value.long_value > UINT_MAX)
+                DebugPrint("Invalid compression threshold");
+            else
+                set_payload_compression((size_t) metric->value.long_value);
+            m_compressionThreshold = payload_compression();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_compressionThreshold))
+                DebugPrint(sparkplug_error_text());
             break;
-        case NMA_CalibrationTemp1:
-            m_nodeCalibrationINW = metric->value.boolean_value;
-            m_calTemp1 = metric->value.float_value;
-            cal_thermistor(m_calTemp1, 1);
-            m_nodeCalibrated = false;
-            m_nodeCalibrationINW = true;
-            for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-                set_up_next_payload();
-                publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(), true, ARRAY_AND_SIZE(NodeMetrics));
-                m_nodeCalibrationINW = false; 
+#ifdef USE_SD_LOG
+        case NMA_SDLogging:
+            // The sdlog task opens or closes the file; a card failure turns
+            // logging back off, which the health update reports
+            sdlog_set_enabled(metric->value.boolean_value);
+            m_sdLogging = sdlog_enabled();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sdLogging))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+#ifdef USE_CHANNEL_STATS
+        case NMA_StatsWindow:
+            // Starts a new window
+            if(metric->value.long_value > UINT_MAX ||
+               !stats_set_window((unsigned int)metric->value.long_value))
+                DebugPrint("Invalid statistics window");
+            m_statsWindow = stats_window();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_statsWindow))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+        case NMA_TempInterval:
+            // Picked up by the scan engine at its next internal temperature conversion
+            if(metric->value.long_value > UINT_MAX ||
+               !acquisition_set_temp_interval((unsigned int)metric->value.long_value))
+                DebugPrint("Invalid ADC temperature interval");
+            m_tempInterval = acquisition_temp_interval();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_tempInterval))
+                DebugPrint(sparkplug_error_text());
+            break;
+#ifdef USE_REF_TRACKING
+        case NMA_RefInterval:
+            // Picked up by the scan engine at its next reference conversion
+            if(metric->value.long_value > UINT_MAX ||
+               !acquisition_set_ref_interval((unsigned int)metric->value.long_value))
+                DebugPrint("Invalid ADC reference interval");
+            m_refInterval = acquisition_ref_interval();
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_refInterval))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+#ifdef USE_PROFILER
+        case NMA_ReportDiagnostics:
+            if(metric->value.boolean_value)
+                publish_diagnostics();
+            // A one-shot request; always echo false
+            m_reportDiagnostics = false;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_reportDiagnostics))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+        case NMA_ChannelMask:
+            // Stopping the scan engine waits for a conversion
+            m_channelMask = metric->value.long_value;
+            if(!command_queued(NODE_CMD_CHANNEL_MASK) && !queue_node_command(NODE_CMD_CHANNEL_MASK, 0, 0))
+                DebugPrint("Channel mask command rejected");
+            break;
+        case NMA_SensorModels:
+        case NMA_ChannelSensors:{
+            // Restarting the scan engine waits for a conversion; a later write
+            // before it runs replaces the text
+            bool models = (alias == NMA_SensorModels);
+            char *text = models ? m_newSensorModels : m_newChannelSensors;
+            size_t size = models ? sizeof(m_newSensorModels) : sizeof(m_newChannelSensors);
+            NodeCommandType type = models ? NODE_CMD_SENSOR_MODELS : NODE_CMD_CHANNEL_SENSORS;
+            if(strlen(metric->value.string_value) >= size ||
+               (!command_queued(type) && !queue_node_command(type, 0, 0))){
+                DebugPrintNoEOL("Sensor models rejected: ");
+                DebugPrint(metric->value.string_value);
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), models ? &m_sensorModels : &m_channelSensors))
+                    DebugPrint(sparkplug_error_text());
+                break;
             }
+            strcpy(text, metric->value.string_value);
             break;
-        case NMA_CalibrationTemp2:
-            m_nodeCalibrationINW = metric->value.boolean_value;
-            m_calTemp2 = metric->value.float_value;
-            if (cal_thermistor(m_calTemp2, 2)) {
-                m_nodeCalibrated = true;
+        }
+        case NMA_VirtualChannels:
+            // The new births are published from run_node_commands(); a later
+            // write before it runs replaces the text
+            if(strlen(metric->value.string_value) >= sizeof(m_newVirtualChannels) ||
+               (!command_queued(NODE_CMD_VIRTUAL_CHANNELS) && !queue_node_command(NODE_CMD_VIRTUAL_CHANNELS, 0, 0))){
+                DebugPrintNoEOL("Virtual channels rejected: ");
+                DebugPrint(metric->value.string_value);
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_virtualChannels))
+                    DebugPrint(sparkplug_error_text());
+                break;
             }
-            for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-                set_up_next_payload();
-                publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(), true, ARRAY_AND_SIZE(NodeMetrics));
+            strcpy(m_newVirtualChannels, metric->value.string_value);
+            break;
+        case NMA_ScanList:
+            // Restarting the scan engine waits for a conversion; a later write
+            // before it runs replaces the text
+            if(strlen(metric->value.string_value) >= sizeof(m_newScanList) ||
+               (!command_queued(NODE_CMD_SCAN_LIST) && !queue_node_command(NODE_CMD_SCAN_LIST, 0, 0))){
+                DebugPrintNoEOL("Scan list rejected: ");
+                DebugPrint(metric->value.string_value);
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_scanList))
+                    DebugPrint(sparkplug_error_text());
+                break;
             }
+            strcpy(m_newScanList, metric->value.string_value);
             break;
-        case NMA_CalibrationINW:
-            m_nodeCalibrationINW = metric->value.boolean_value;
-            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeCalibrationINW))
-                DebugPrint(cf_sparkplug_error);
+        case NMA_Configuration:
+            // Restarting the scan engine waits for a conversion; a later write
+            // before it runs replaces the blob
+            if(metric->which_value != org_eclipse_tahu_protobuf_Payload_Metric_bytes_value_tag ||
+               metric->value.bytes_value->size > sizeof(m_newConfiguration.bytes) ||
+               (!command_queued(NODE_CMD_CONFIGURATION) && !queue_node_command(NODE_CMD_CONFIGURATION, 0, 0))){
+                DebugPrint("Node configuration rejected");
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_configuration))
+                    DebugPrint(sparkplug_error_text());
+                break;
+            }
+            m_newConfiguration.size = metric->value.bytes_value->size;
+            memcpy(m_newConfiguration.bytes, metric->value.bytes_value->bytes, m_newConfiguration.size);
             break;
-        case NMA_ClearCal:
-            if(clear_cal_data()) {
-                m_nodeCalibrated = false;
-                m_calTemp1 = 0.00;
-                m_calTemp2 = 0.00;
+        case NMA_AcquisitionProfile:{
+            // Restarting the scan engine waits for a conversion
+            int profile = find_ADC_profile(metric->value.string_value);
+            if(profile < 0 || !queue_node_command(NODE_CMD_ADC_PROFILE, profile, 0)){
+                DebugPrintNoEOL("Acquisition profile rejected: ");
+                DebugPrint(metric->value.string_value);
+                if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_acquisitionProfile))
+                    DebugPrint(sparkplug_error_text());
+            }
+            break;
+        }
+        case NMA_SpikeFilter:{
+            // Taken up from the next pass, with the frame's average going on
+            int spike = filter_find_spike(metric->value.string_value);
+            if(spike < 0){
+                DebugPrintNoEOL("Spike filter rejected: ");
+                DebugPrint(metric->value.string_value);
             }
-            for(int br_idx = 0; br_idx < NUM_BROKERS; br_idx++){
-                set_up_next_payload();
-                publish_metrics(&m_broker[br_idx], 1, nodeBirthTopic.c_str(), true, ARRAY_AND_SIZE(NodeMetrics));
+            else
+                filter_set_spike((SpikeFilter)spike);
+            m_spikeFilter = filter_spike_name(filter_spike());
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_spikeFilter))
+                DebugPrint(sparkplug_error_text());
+            break;
+        }
+        case NMA_BrokerList:
+            if(!set_broker_list(metric->value.string_value)){
+                DebugPrintNoEOL("Invalid broker list: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the list in use, whether or not it changed
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_brokerList))
+                DebugPrint(sparkplug_error_text());
+            break;
+#ifdef USE_RAW_STREAM
+        case NMA_StreamTarget:
+            if(!set_stream_target(metric->value.string_value)){
+                DebugPrintNoEOL("Unable to stream to: ");
+                DebugPrint(metric->value.string_value);
+            }
+            // Echo the target in use, "" if the stream is off
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_streamTarget))
+                DebugPrint(sparkplug_error_text());
+            break;
+        case NMA_BurstCapture:
+            // Stopping and restarting the scan engine waits for a conversion
+            if(!queue_node_command(NODE_CMD_BURST, metric->value.boolean_value ? 1 : 0, 0))
+                DebugPrint("Burst command rejected");
+            break;
+#endif
+        case NMA_SettlingSweep:
+            if(!queue_node_command(NODE_CMD_SETTLING_SWEEP, metric->value.boolean_value ? 1 : 0, 0))
+                DebugPrint("Settling sweep command rejected");
+            break;
+        case NMA_SelfTest:
+            if(!queue_node_command(NODE_CMD_SELF_TEST, metric->value.boolean_value ? 1 : 0, 0))
+                DebugPrint("Self test command rejected");
+            break;
+#ifdef USE_RAW_STREAM
+        case NMA_BurstChannels:
+        case NMA_BurstOversampling:
+        case NMA_BurstDuration:
+            // Checked when the next burst starts
+            if(alias == NMA_BurstChannels)
+                m_burstChannels = metric->value.long_value;
+            else if(alias == NMA_BurstOversampling)
+                m_burstOsr = metric->value.long_value;
+            else
+                m_burstDuration = metric->value.long_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), alias == NMA_BurstChannels ? (void *) &m_burstChannels :
+                              alias == NMA_BurstOversampling ? (void *) &m_burstOsr : (void *) &m_burstDuration))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+        case NMA_BrokerFanOut:
+            m_brokerFanOut = metric->value.boolean_value;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_brokerFanOut))
+                DebugPrint(sparkplug_error_text());
+            apply_broker_mode();
+            break;
+#ifdef USE_SCAN_TRACE
+        case NMA_CaptureScanTrace:
+        case NMA_DumpScanTrace:
+            // One-shot requests; the dump goes to the raw stream host if there
+            // is one, otherwise the serial port
+            if(metric->value.boolean_value){
+                if(alias == NMA_CaptureScanTrace)
+                    scan_trace_arm();
+                else if(!scan_trace_dump())
+                    DebugPrint("No scan trace captured");
             }
-            DebugPrint("Calibration data has been permanently erased.");            
+            m_captureScanTrace = false;
+            m_dumpScanTrace = false;
+            if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), alias == NMA_CaptureScanTrace ?
+                              (void *) &m_captureScanTrace : (void *) &m_dumpScanTrace))
+                DebugPrint(sparkplug_error_text());
+            break;
+#endif
+        case NMA_ClearCal:
+            // Queued behind any calibration so the two can't interleave; one
+            // already queued takes repeats with it
+            if(command_queued(NODE_CMD_CLEAR_CAL))
+                break;
+            if(command_held_off(m_clearCalAt) || !queue_node_command(NODE_CMD_CLEAR_CAL, 0, 0))
+                refuse_busy_command("Clear Cal Data command", &m_nodeClearCal);
             break;
         default:
             DebugPrintNoEOL("Unhandled Node metric alias: ");
@@ -460,12 +4198,68 @@ bool process_node_cmd_message(char* topic, byte* payload, unsigned int len){
             break;
         }
     }
+}
 
-    // Free the decoder memory
-    decoder.free_payload();
+#ifdef USE_DEVICE_BANKS
+// Handle a Device command (DCMD) message for one of the banks.  The only
+// writable bank metric is its Device Control/Rebirth, acted on by
+// check_brokers().
+static void process_bank_cmd_message(const char* topic, byte* payload, unsigned int len){
+    int bank = 0;
+    while(bank < NUM_DEVICE_BANKS && strcmp(topic, bankTopics[bank].cmd.name) != 0)
+        bank++;
+    if(bank == NUM_DEVICE_BANKS || !bank_enabled(bank))
+        return;
 
-    // This was a Node command message
-    return true;
+    static CommandPayload command;
+    if(!decode_command_payload(payload, len, &command)){
+        DebugPrintNoEOL("Unable to decode Device command payload: ");
+        DebugPrint(sparkplug_error_text());
+        return;
+    }
+    for(unsigned int idx = 0; idx < command.metrics_count; idx++){
+        Metric *metric = &command.metrics[idx];
+        MetricSpec *metric_spec = find_received_metric(ARRAY_AND_SIZE(BankMetrics[bank]), metric);
+        if(metric_spec == NULL){
+            DebugPrintNoEOL("Unrecognized Device metric: ");
+            DebugPrint(sparkplug_error_text());
+            continue;
+        }
+        if(metric_spec->alias != (unsigned) BANK_REBIRTH_ALIAS(bank)){
+            DebugPrintNoEOL("Unhandled Device metric alias: ");
+            DebugPrint(metric_spec->alias);
+            continue;
+        }
+        m_bankRebirth[bank] = metric->value.boolean_value;
+        if(!update_metric(ARRAY_AND_SIZE(BankMetrics[bank]), &m_bankRebirth[bank]))
+            DebugPrint(sparkplug_error_text());
+        if(m_bankRebirth[bank])
+            DebugPrint("Device Rebirth command received");
+    }
+}
+#endif
+
+// Handle a Primary Host state message.
+static void process_host_state(const char *topic, byte *payload, unsigned int len){
+    bool host_online = false;
+    process_host_state_message(topic, payload, len, &host_online);
+    // An error indicates the message was invalid
+    if(sparkplug_error() != SPARKPLUG_OK)
+        DebugPrint(sparkplug_error_text());
+    // Failover follows where the Primary Host is
+    if(m_loopingBroker >= 0)
+        m_link[m_loopingBroker].host_online = host_online;
+    if(host_online){
+        // Primary Host is connected to this broker
+        DebugPrint("Primary Host is ONLINE");
+        // With USE_HOST_STATE_GATING, check_brokers() publishes births and
+        // replays the frames held while it was away
+    }
+    else{
+        // Primary Host is not connected to this broker
+        DebugPrint("Primary Host is OFFLINE");
+        //### Enter safe state (not applicable for this module)
+    }
 }
 
 /**
@@ -494,27 +4288,12 @@ void callback_worker(char* topic, byte* payload, unsigned int len){
         return;
     }
 
-    // Determine message type
-    bool host_online = false;
-    if(process_host_state_message(topic, payload, len, &host_online)){
-        // A non-empty error indicates the message was invalid
-        if(strcmp(cf_sparkplug_error, "") != 0)
-            DebugPrint(cf_sparkplug_error);
-        if(host_online){
-            // Primary Host is connected to this broker
-            DebugPrint("Primary Host is ONLINE");
-            //### Should we publish births to let the Primary Host know we're
-            //### here, or wait for the Primary Host to send a Rebirth message?
-            //### After all, we might have received this message because *we*
-            //### just connected to the broker, not the Primary Host.
-        }
-        else{
-            // Primary Host is not connected to this broker
-            DebugPrint("Primary Host is OFFLINE");
-            //### Enter safe state (not applicable for this module)
-        }
-    }
-    else if(!process_node_cmd_message(topic, payload, len)) {
+    // Dispatch on the topic
+    size_t topic_len = strlen(topic);
+    const Subscription *subscription = find_subscription(topic, topic_len, topic_hash(topic, topic_len));
+    if(subscription != NULL)
+        subscription->handler(topic, payload, len);
+    else{
         // Unrecognized message
         char topic_short[40];
         snprintf(topic_short, sizeof(topic_short), "%s", topic);
@@ -524,49 +4303,338 @@ void callback_worker(char* topic, byte* payload, unsigned int len){
     }
 }
 
+#ifdef USE_FROZEN_NDATA
+// Returns true if any published value in the frame is sent as null.
+static bool frame_has_null(const ThermistorValue *THERMISTOR_data, float ADC_temperature){
+    if(isnan(ADC_temperature))
+        return true;
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++){
+        if(acquisition_channel_enabled(i) && thermistor_null(THERMISTOR_data[i]))
+            return true;
+    }
+    for(int v = 0; v < virtual_count(); v++){
+        if(isnan(Channels.virtual_frame[v]))
+            return true;
+    }
+    return false;
+}
+#endif
+
+// Copy the frame's codes into their metric, null for the channels not scanned.
+static void load_raw_codes(){
+    int32_t *codes = (int32_t *) m_rawCodes.bytes;
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        codes[channel] = acquisition_channel_enabled(channel) ? Channels.codes[channel] : RAW_CODE_NULL;
+}
+
+// Copy the variance of each thermistor's Kalman estimate into its metric.
+static void load_estimate_variance(){
+    float *variance = (float *) m_estimateVariance.bytes;
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++)
+        variance[channel] = kalman_variance(channel);
+}
+
+#ifndef USE_ARRAY_NDATA
+// Mark a frame bank's thermistors updated, with the metrics that end every
+// frame (virtual channels, ADC temperature and frame number), all with the
+// bank's timestamp.  The other banks' thermistors wait for their own.
+static void update_frame_part(ChannelMask part, unsigned long long timestamp){
+    for(ChannelMask left = part; left != 0; left &= left - 1){
+        int channel = channel_mask_first(left);
+        mark_channel_value(channel);
+        if(!update_metric_range(CHANNEL_METRICS(channel), CHANNEL_ALIAS(channel), 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_VIRTUAL1, NMA_FrameNumber - NMA_VIRTUAL1 + 1,
+                            timestamp))
+        DebugPrint(sparkplug_error_text());
+}
+#endif
+
 /**
- * @brief Publish metrics for THERMISTOR channels and temperature.  Note that we
- * publish this data even if it hasn't changed because the timestamp should
- * show when the data was last read, not when it last changed.
+ * @brief Publish metrics for THERMISTOR channels and temperature.  Note that by
+ * default we publish this data even if it hasn't changed because the timestamp
+ * should show when the data was last read, not when it last changed.  Setting
+ * the Deadband or Deadband Percent metric switches to report-by-exception:
+ * a channel is only published when it moves outside the deadband or its
+ * Heartbeat Interval expires. Predictive Deadband measures the deadband from
+ * the line through the channel's last two published values instead, so a
+ * channel on a steady ramp is only published when its rate changes.
  *
- * @param THERMISTOR_data an array of NUM_THERMISTOR_CHANNELS floats representing the averaged
- * THERMISTOR voltages
+ * @param THERMISTOR_data the NUMBER_OF_THERMISTORS averaged temperatures, in
+ * THERMISTOR_UNITS; normally Channels.frame, which the thermistor metrics read
+ * in place (any other buffer is copied there)
  * @param the average temperature reading
+ * Frames are held in the history until the first time sync after boot, for
+ * up to BOOT_SYNC_WAIT_MS, so the first ones carry UTC timestamps too.
+ *
+ * @param cycles time_cycles64() stamp of the frame's last sample
+ * @param frame the frame's number (Channels.frame_number); a jump from the
+ * last one counts the frames between as lost
+ *
+ * With Node Control/Frame Banks each bank's part of a frame comes here as a
+ * frame of its own (Channels.frame_part), and only that bank's thermistors go
+ * out.  Batches, the held history and snapshots carry whole frames: the last
+ * bank's part (Channels.frame_last) keeps the frame once, stamped as that
+ * part, and the parts before it aren't kept at all.
  */
-void publish_data(float* THERMISTOR_data, float ADC_temperature){
-    // Store new THERMISTOR data, converting from raw THERMISTOR values to user units
-    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++){
-        m_THERMISTOR[i] = THERMISTOR_data[i];
-        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_THERMISTOR[i]))
-            DebugPrint(cf_sparkplug_error);
+void publish_data(ThermistorValue* THERMISTOR_data, float ADC_temperature, uint64_t cycles, uint64_t frame){
+    // UTC milliseconds when the data was sampled; 0 until synced, for the current time
+    unsigned long long timestamp = time_cycles_to_utc_millis(cycles);
+    if(m_frameNumber != 0 && frame > m_frameNumber + 1)
+        health_add(HEALTH_FRAMES_LOST, (uint32_t)(frame - m_frameNumber - 1));
+    m_frameNumber = frame;
+    // Store new THERMISTOR data and ADC temperature
+#ifdef USE_ARRAY_NDATA
+    // Sparkplug arrays are packed little-endian, as is the Cortex-M7
+    m_THERMISTORS.size = pack_enabled_channels(m_THERMISTORS.bytes, THERMISTOR_data);
+#else
+    // The metrics already read the conversion's frame
+    if(THERMISTOR_data != Channels.frame)
+        memcpy(Channels.frame, THERMISTOR_data, sizeof(Channels.frame));
+#ifdef USE_QUANTIZED_NDATA
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++)
+        Channels.quantized[i] = thermistor_metric_value(THERMISTOR_data[i]);
+#endif
+#endif
+    m_ADC_temperature = ADC_temperature;
+    virtual_evaluate_frame(THERMISTOR_data, acquisition_channel_mask(), Channels.virtual_frame);
+    if(m_publishVariance && kalman_channels() != 0){
+        load_estimate_variance();
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_estimateVariance))
+            DebugPrint(sparkplug_error_text());
+    }
+    if(m_rawCodesMode != RAW_CODES_OFF){
+        load_raw_codes();
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_RawCodes, 1, timestamp))
+            DebugPrint(sparkplug_error_text());
     }
 
-    // Store new ADC temperature
-    m_ADC_temperature = ADC_temperature;
-    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_ADC_temperature))
-        DebugPrint(cf_sparkplug_error);
+    // A frame bank's part before the last has nothing of its own to keep:
+    // the history and batches take the frame whole, from the last part
+    bool keep = Channels.frame_last;
+
+    // Keep the frame for replay if it can't be published now, or can't be
+    // stamped yet
+    if(holding_frames()){
+        hold_batch();
+        if(keep)
+            history_store(THERMISTOR_data, ADC_temperature, timestamp, cycles, frame);
+        return;
+    }
+
+    // Backed up to the summary profile, only a frame now and then goes out
+    // live; the rest stay in the history for snapshot requests
+    if(!throttle_summary_due(millis())){
+        if(keep)
+            history_retain(THERMISTOR_data, ADC_temperature, timestamp, cycles, frame);
+        return;
+    }
+
+    if(deadband_enabled()){
+        if(keep)
+            history_retain(THERMISTOR_data, ADC_temperature, timestamp, cycles, frame);
+        update_frame_metrics_by_exception(THERMISTOR_data, ADC_temperature, timestamp);
+        return;
+    }
+
+    // Several frames to an NDATA, each value stamped with its frame's time
+    if(batch_frames() > 1){
+        if(keep)
+            batch_frame(THERMISTOR_data, ADC_temperature, timestamp, cycles, frame);
+        return;
+    }
+    // Kept in the history for snapshot requests
+    if(keep)
+        history_retain(THERMISTOR_data, ADC_temperature, timestamp, cycles, frame);
+
+    // The codes in place of the temperatures: only the ADC temperature and the
+    // frame number go with them
+    if(m_rawCodesMode == RAW_CODES_INSTEAD){
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_ADC_Temperature,
+                                NMA_FrameNumber - NMA_ADC_Temperature + 1, timestamp))
+            DebugPrint(sparkplug_error_text());
+        return;
+    }
+#ifdef USE_FROZEN_NDATA
+    // The payload layout never changes, so publish straight from the frozen
+    // encoding; not being connected to any broker isn't an error.  A frame
+    // with a faulted channel needs a null metric, which the frozen layout
+    // can't carry, the frozen layout has no raw codes, and it holds every
+    // thermistor rather than a frame bank's.
+    if(payload_frozen() && m_rawCodesMode == RAW_CODES_OFF && Channels.frame_part == ALL_CHANNELS_MASK &&
+       !frame_has_null(THERMISTOR_data, ADC_temperature)){
+        PROFILE_SCOPE(PROFILE_PUBLISH);
+        if(!publish_frozen_payload(TARGET_BROKERS, nodeDataTopic.name, timestamp) &&
+           sparkplug_error() != SPARKPLUG_OK){
+            DebugPrint(sparkplug_error_text());
+            health_count(HEALTH_PUBLISH_FAILURES);
+        }
+        return;
+    }
+#endif
+#ifdef USE_ARRAY_NDATA
+    // The array holds every thermistor, so it goes out once a frame, whole
+    if(!keep)
+        return;
+#else
+    if(Channels.frame_part != ALL_CHANNELS_MASK){
+        update_frame_part(Channels.frame_part, timestamp);
+        return;
+    }
+#endif
+    // Mark the frame metrics updated with one shared timestamp
+    for(int i = 0; i < NUMBER_OF_THERMISTORS; i++)
+        mark_channel_value(i);
+#ifdef USE_DEVICE_BANKS
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+        if(!update_metric_range(ARRAY_AND_SIZE(BankMetrics[bank]), BANK_FIRST_ALIAS(bank),
+                                DEVICE_BANK_SIZE, timestamp))
+            DebugPrint(sparkplug_error_text());
+#endif
+    if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_FIRST_FRAME_METRIC,
+                            NUM_FRAME_METRICS, timestamp))
+        DebugPrint(sparkplug_error_text());
+}
+/**
+ * @brief Publishes which thermistors are faulted (open or shorted), bit n for
+ * thermistor n.  Their temperatures are published as null meanwhile.
+ */
+void publish_channel_faults(ChannelMask faults){
+    if(faults == m_faultedChannels)
+        return;
+#ifdef USE_CHANNEL_TEMPLATE
+    // The Fault member of each channel that changed
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++){
+        bool faulted = (faults & CHANNEL_BIT(channel)) != 0;
+        if(faulted == Channels.faulted[channel])
+            continue;
+        Channels.faulted[channel] = faulted;
+        m_channelMembers[channel][CM_Fault].updated = true;
+        if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_THERMISTOR1 + channel, 1, 0))
+            DebugPrint(sparkplug_error_text());
+    }
+#endif
+    m_faultedChannels = faults;
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_faultedChannels))
+        DebugPrint(sparkplug_error_text());
+}
+#ifdef USE_PROFILER
+/**
+ * @brief Publishes the run times of every profiled phase since the last report
+ * as the Diagnostics metrics, then starts a new measurement window.  A phase
+ * that hasn't run reads "no runs".
+ */
+static void publish_diagnostics(){
+    for(int phase = 0; phase < NUM_PROFILE_PHASES; phase++){
+        ProfileStats stats;
+        if(profile_stats(phase, &stats))
+            snprintf(m_diagnosticsBuffer[phase], DIAGNOSTICS_SIZE,
+                     "runs %lu, min %lu, avg %lu, max %lu, p99 %lu us", stats.count,
+                     (unsigned long) stats.min_us, (unsigned long) stats.avg_us,
+                     (unsigned long) stats.max_us, (unsigned long) stats.p99_us);
+        else
+            snprintf(m_diagnosticsBuffer[phase], DIAGNOSTICS_SIZE, "no runs");
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_diagnostics[phase]))
+            DebugPrint(sparkplug_error_text());
+    }
+    profile_reset();
+}
+#endif
+#ifdef USE_CHANNEL_STATS
+// Copy the statistics of the last window into the Statistics metrics.
+static void load_channel_stats(){
+    float *min = (float *) m_statsMin.bytes;
+    float *max = (float *) m_statsMax.bytes;
+    float *mean = (float *) m_statsMean.bytes;
+    float *stddev = (float *) m_statsStdDev.bytes;
+    int32_t *samples = (int32_t *) m_statsSamples.bytes;
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++){
+        const ChannelStats *stats = stats_result(channel);
+        samples[channel] = (int32_t) stats->count;
+        min[channel] = stats->count > 0 ? stats->min : NAN;
+        max[channel] = stats->count > 0 ? stats->max : NAN;
+        mean[channel] = stats->count > 0 ? stats->mean : NAN;
+        stddev[channel] = stats->count > 0 ? stats->stddev : NAN;
+    }
+}
+
+/**
+ * @brief Publishes the statistics of a finished window, with the next NDATA
+ * message, stamped now.
+ */
+void publish_channel_stats(){
+    load_channel_stats();
+    if(!update_metric_range(ARRAY_AND_SIZE(NodeMetrics), NMA_StatsMin, NMA_StatsSamples - NMA_StatsMin + 1,
+                            get_current_time_millis()))
+        DebugPrint(sparkplug_error_text());
+}
+#endif
+/**
+ * @brief Publishes the channels in alarm in an NDATA message of their own
+ * straight away, rather than with the next frame.
+ */
+void publish_alarms(){
+    bool changed = false;
+    for(int kind = 0; kind < NUM_ALARM_KINDS; kind++){
+        if(m_alarms[kind] == alarm_mask((AlarmKind) kind))
+            continue;
+        m_alarms[kind] = alarm_mask((AlarmKind) kind);
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_alarms[kind]))
+            DebugPrint(sparkplug_error_text());
+        changed = true;
+    }
+    for(int kind = 0; kind < NUM_ALARM_KINDS; kind++){
+        if(m_virtualAlarms[kind] == alarm_virtual_mask((AlarmKind) kind))
+            continue;
+        m_virtualAlarms[kind] = alarm_virtual_mask((AlarmKind) kind);
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_virtualAlarms[kind]))
+            DebugPrint(sparkplug_error_text());
+        changed = true;
+    }
+    if(changed)
+        publish_node_data();
+}
+/**
+ * @brief Publishes the adaptive sampling schedule after it changes.
+ */
+void publish_sample_schedule(){
+    load_sample_schedule();
+    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_sampleSchedule))
+        DebugPrint(sparkplug_error_text());
 }
-void publish_refs(float ref_Low, float ref_High) {
-    m_calTemp1 = ref_Low;
-    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calTemp1))
-        DebugPrint(cf_sparkplug_error);
-    m_calTemp2 = ref_High;
-    if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calTemp2))
-        DebugPrint(cf_sparkplug_error);
+// Publishes the reference temperatures of the calibration points taken (bit n
+// of points for point n + 1).
+void publish_refs(const float *ref_temps, unsigned int points) {
+    for(int point = 0; point < CAL_MAX_POINTS; point++){
+        if(!(points & (1 << point)))
+            continue;
+        m_calTemp[point] = ref_temps[point];
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_calTemp[point]))
+            DebugPrint(sparkplug_error_text());
+    }
 }
 
 
 /**
- * @brief Updates the NTP object's state, which will periodically sync time
- * with the NTP server.
+ * @brief Services the PTP slave and the NTP client, which sync the time service
+ * with the PTP master or the NTP server.  NTP is only used while PTP isn't
+ * locked.  Never waits for either.
  *
- * @return true if a sync event occurred TODO: verify this
- * @return false if we failed to sync
+ * @return true if a sync event occurred
+ * @return false if no new response was received
  */
 
 bool update_ntp(void){
-    ntp.update();
-    return ntp.updated();
+    bool synced;
+#ifdef USE_PTP
+    synced = ptp_poll() || (!ptp_locked() && ntp_poll());
+#else
+    synced = ntp_poll();
+#endif
+    if(synced)
+        boot_mark("time sync");
+    return synced;
 }
 
 /**
@@ -574,12 +4642,32 @@ bool update_ntp(void){
  * read from the jumpers.
  */
 void generateNames(int hardware_id){
-    char dev_id = hardware_id + '0';
-    node_id.replace(NODE_ID_TOKEN, dev_id);
-    nodeBirthTopic.replace(NODE_ID_TOKEN, dev_id);
-    nodeDeathTopic.replace(NODE_ID_TOKEN, dev_id);
-    nodeDataTopic.replace(NODE_ID_TOKEN, dev_id);
-    nodeCmdTopic.replace(NODE_ID_TOKEN, dev_id);
+    snprintf(node_id, sizeof(node_id), NODE_ID_PREFIX "%d", hardware_id);
+    set_node_topic_name(&nodeBirthTopic, NBIRTH_MESSAGE_TYPE);
+    set_node_topic_name(&nodeDeathTopic, NDEATH_MESSAGE_TYPE);
+    set_node_topic_name(&nodeDataTopic,  NDATA_MESSAGE_TYPE);
+    set_node_topic_name(&nodeCmdTopic,   NCMD_MESSAGE_TYPE);
+    set_topic_name(&hostStateTopic, HOST_STATE_TOPIC);
+    char topic[TOPIC_NAME_SIZE];
+    snprintf(topic, sizeof(topic), GROUP_ID "/" LAST_VALUE_TOPIC_TYPE "/%s", node_id);
+    set_topic_name(&lastValueTopic, topic);
+    snprintf(topic, sizeof(topic), GROUP_ID "/" SELF_TEST_TOPIC_TYPE "/%s", node_id);
+    set_topic_name(&selfTestTopic, topic);
+    memset(m_subscriptions, 0, sizeof(m_subscriptions));
+    m_numSubscriptions = 0;
+    add_subscription(&hostStateTopic, process_host_state);
+    add_subscription(&nodeCmdTopic, process_node_cmd_message);
+    add_subscription(&selfTestTopic, process_self_test_loopback);
+#ifdef USE_DEVICE_BANKS
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++){
+        BankTopics *topics = &bankTopics[bank];
+        set_bank_topic_name(&topics->birth, DBIRTH_MESSAGE_TYPE, bank);
+        set_bank_topic_name(&topics->death, DDEATH_MESSAGE_TYPE, bank);
+        set_bank_topic_name(&topics->data,  DDATA_MESSAGE_TYPE,  bank);
+        set_bank_topic_name(&topics->cmd,   DCMD_MESSAGE_TYPE,   bank);
+        add_subscription(&topics->cmd, process_bank_cmd_message);
+    }
+#endif
 }
 
 /**
@@ -594,11 +4682,104 @@ void setup_bdseq_metrics(void){
         // Set the variable pointer for the metric
         set_metric_variable(ARRAY_AND_SIZE(bdseqMetrics[br_idx]), NMA_bdSeq, &m_bdSeq[br_idx]);
 
-        // Reset the sequence number so it starts at zero when incremented
-        m_bdSeq[br_idx] = (uint64_t) -1;
+        // Carry on from the last sequence number after a warm reboot, so the
+        // host matches the broker's NDEATH to the next NBIRTH. Otherwise reset
+        // it so it starts at zero when incremented.
+        if(!warmboot_bd_seq(br_idx, &m_bdSeq[br_idx]))
+            m_bdSeq[br_idx] = (uint64_t) -1;
+    }
+}
+
+#ifdef USE_CHANNEL_TEMPLATE
+/**
+ * @brief Point the members of each channel's template instance at its
+ * temperature and fault flag.
+ */
+static void setup_channel_templates(void){
+    for(int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++){
+        memcpy(m_channelMembers[channel], m_channelDefinitionMembers, sizeof(m_channelDefinitionMembers));
+        m_channelMembers[channel][CM_Value].variable = &Channels.frame[channel];
+        m_channelMembers[channel][CM_Fault].variable = &Channels.faulted[channel];
+        m_channelInstance[channel] = {CHANNEL_TEMPLATE_NAME, ARRAY_AND_SIZE(m_channelMembers[channel])};
     }
 }
 
+// Member metrics the template instances and definition add to an NBIRTH, and
+// the stored values add to a replay batch
+#define BIRTH_TEMPLATE_MEMBERS    (NUM_CHANNEL_MEMBERS * (NUMBER_OF_THERMISTORS + 1))
+#define HISTORY_TEMPLATE_MEMBERS  (HISTORY_FRAMES_PER_PAYLOAD * NUMBER_OF_THERMISTORS)
+#define NBIRTH_TEMPLATE_SIZE      (NUMBER_OF_THERMISTORS * sizeof(CHANNEL_TEMPLATE_NAME) + \
+                                   BIRTH_TEMPLATE_MEMBERS * NBIRTH_MEMBER_SIZE)
+#define NBIRTH_MEMBER_SIZE        16
+#else
+#define BIRTH_TEMPLATE_MEMBERS    0
+#define HISTORY_TEMPLATE_MEMBERS  0
+#define NBIRTH_TEMPLATE_SIZE      0
+#endif
+
+// Largest message an outbound queue has to hold: an NBIRTH of the whole metric
+// table, allowing each metric its name, fields and a short value, plus the
+// longest string and array values and any template members. Larger NDATA
+// messages are split to fit.
+#define NBIRTH_METRIC_SIZE  72
+#ifdef USE_PROFILER
+#define NBIRTH_DIAGNOSTICS_SIZE  sizeof(m_diagnosticsBuffer)
+#else
+#define NBIRTH_DIAGNOSTICS_SIZE  0
+#endif
+#ifdef USE_QUANTIZED_NDATA
+#define NBIRTH_PROPERTIES_SIZE  (NUMBER_OF_THERMISTORS * 80)
+#else
+#define NBIRTH_PROPERTIES_SIZE  0
+#endif
+#ifdef USE_RAW_STREAM
+#define NBIRTH_STREAM_SIZE      sizeof(m_streamTargetBuffer)
+#else
+#define NBIRTH_STREAM_SIZE      0
+#endif
+#ifdef USE_CHANNEL_STATS
+#define NBIRTH_STATS_SIZE       (sizeof(m_rollupQueryBuffer) + 5 * sizeof(m_statsMin))
+#else
+#define NBIRTH_STATS_SIZE       0
+#endif
+#ifdef USE_FIRMWARE_UPDATE
+#define NBIRTH_FIRMWARE_SIZE    sizeof(m_firmwareUpdateBuffer)
+#else
+#define NBIRTH_FIRMWARE_SIZE    0
+#endif
+#define NBIRTH_VALUES_SIZE  (sizeof(m_alarmLimitsBuffer) + sizeof(m_brokerListBuffer) + \
+                             sizeof(m_sampleScheduleBuffer) + sizeof(m_settlingTimesBuffer) + \
+                             sizeof(m_selfTestRatesBuffer) + sizeof(m_scanListBuffer) + \
+                             sizeof(m_sensorModelsBuffer) + sizeof(m_channelSensorsBuffer) + \
+                             sizeof(m_configuration) + \
+                             sizeof(m_kalmanNoiseBuffer) + sizeof(m_driftModelBuffer) + sizeof(m_calStabilityBuffer) + \
+                             sizeof(m_virtualChannelsBuffer) + \
+                             sizeof(ChannelFloatArray) + sizeof(ThermistorValue) * NUMBER_OF_THERMISTORS + \
+                             NBIRTH_STREAM_SIZE + NBIRTH_STATS_SIZE + NBIRTH_FIRMWARE_SIZE + \
+                             NBIRTH_DIAGNOSTICS_SIZE + NBIRTH_TEMPLATE_SIZE + NBIRTH_PROPERTIES_SIZE)
+#define OUTBOUND_MESSAGE_SIZE  (NUM_ELEM(NodeMetrics) * NBIRTH_METRIC_SIZE + NBIRTH_VALUES_SIZE)
+
+// Metrics each stored frame adds to the largest replay payload
+#ifdef USE_DEVICE_BANKS
+#define HISTORY_FRAME_METRICS  (DEVICE_BANK_SIZE > NUM_FRAME_METRICS ? DEVICE_BANK_SIZE : NUM_FRAME_METRICS)
+#else
+#define HISTORY_FRAME_METRICS  NUM_FRAME_METRICS
+#endif
+
+// Payload metrics for the largest payload: an NBIRTH of every node metric plus
+// bdSeq, or a batch of stored frames, whichever needs more
+constexpr unsigned int metric_arena_size(){
+    unsigned int birth = NUM_ELEM(bdseqMetrics[0]) + NUM_ELEM(NodeMetrics) + BIRTH_TEMPLATE_MEMBERS;
+    unsigned int history = HISTORY_FRAMES_PER_PAYLOAD * HISTORY_FRAME_METRICS + HISTORY_TEMPLATE_MEMBERS;
+    return birth > history ? birth : history;
+}
+
+// Fixed so nothing is allocated for them; in DTCM with the rest of .bss
+static Metric m_metricArena[metric_arena_size()];
+#ifdef USE_CHANNEL_STATS
+static_assert(ROLLUP_BUCKETS_PER_PAYLOAD * 4 <= metric_arena_size(), "A rollup query answer must fit the metric arena");
+#endif
+
 /**
  * @brief Initializes the network, sets up and checks the metric arrays, assigns
  * the IP and MAC addresses based on hardware ID jumpers, connects to NTP, and
@@ -607,23 +4788,82 @@ void setup_bdseq_metrics(void){
  * @return true on success
  * @return false if there's some failure
  */
-bool network_init(void){
+FLASHMEM bool network_init(void){
     // Set up the metrics arrays holding the node birth/death sequence numbers
     setup_bdseq_metrics();
+#ifdef USE_FRAME_SYNC
+    // Picked from the hardware ID by framesync_begin()
+    m_frameSync = framesync_role();
+#endif
+#ifdef USE_CHANNEL_TEMPLATE
+    setup_channel_templates();
+#endif
+#ifdef USE_QUANTIZED_NDATA
+    setup_thermistor_properties();
+#endif
 
-    // We need to send at least the node metrics plus bdseq
-    set_max_metrics(NUM_ELEM(bdseqMetrics[0]) + NUM_ELEM(NodeMetrics));
+    // Put the saved node configuration in use before the metrics are loaded
+    // from the settings
+    set_payload_compression(PAYLOAD_COMPRESSION_BYTES);
+    NodeConfig config;
+    capture_config(&config);
+    if(config_load(&config) && !set_config(&config))
+        DebugPrint("Saved node configuration refused; using the defaults");
+    m_compressionThreshold = payload_compression();
+
+    load_scan_config();
+    m_quietInterval = quiet_interval();
+    m_tempInterval = acquisition_temp_interval();
+    m_spikeFilter = filter_spike_name(filter_spike());
+#ifdef USE_REF_TRACKING
+    m_refInterval = acquisition_ref_interval();
+#endif
+    load_sample_schedule();
+    load_settling_times();
+    load_scan_list();
+    load_sensor_models();
+    load_configuration();
+#ifdef USE_CHANNEL_STATS
+    m_statsWindow = stats_window();
+    load_channel_stats();
+#endif
+    for(int kind = 0; kind < NUM_ALARM_KINDS; kind++)
+        alarm_format_limits((AlarmKind) kind, m_alarmLimitsBuffer[kind], sizeof(m_alarmLimitsBuffer[kind]));
+    for(int kind = 0; kind < NUM_KALMAN_NOISES; kind++)
+        kalman_format_noise((KalmanNoise) kind, m_kalmanNoiseBuffer[kind], sizeof(m_kalmanNoiseBuffer[kind]));
+    drift_format_model(m_driftModelBuffer, sizeof(m_driftModelBuffer));
+    calcapture_format_stability(m_calStabilityBuffer, sizeof(m_calStabilityBuffer));
+    virtual_format_channels(m_virtualChannelsBuffer, sizeof(m_virtualChannelsBuffer));
+    m_logLevel = log_level();
+    load_estimate_variance();
+    boot_mark("network config");
+
+    m_resetCause = watchdog_reset_cause_text();
+    watchdog_watch(WATCHDOG_NETWORK, NETWORK_STALL_MS, restart_broker_sockets);
+
+    // Payloads are built in the fixed metric arena
+    set_metric_storage(ARRAY_AND_SIZE(m_metricArena));
 
     // Check that the alias numbers in the metrics are valid and unique
     for(int i = 0; i < NUM_BROKERS; ++i)
         if(!check_metrics(ARRAY_AND_SIZE(bdseqMetrics[i]), NMA_bdSeq + 1)){
-            DebugPrint(cf_sparkplug_error);
+            DebugPrint(sparkplug_error_text());
             return false;
         }
-    if(!check_metrics(ARRAY_AND_SIZE(NodeMetrics     ), EndNodeMetricAlias     )){
-        DebugPrint(cf_sparkplug_error);
+    if(!index_metrics(ARRAY_AND_SIZE(NodeMetrics), EndNodeMetricAlias)){
+        DebugPrint(sparkplug_error_text());
         return false;
     }
+#ifdef USE_DEVICE_BANKS
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++)
+        if(!check_metrics(ARRAY_AND_SIZE(BankMetrics[bank]), BANK_FIRST_ALIAS(bank + 1))){
+            DebugPrint(sparkplug_error_text());
+            return false;
+        }
+#endif
+    // Leaves out the disabled channels and freezes the NDATA payload
+    apply_channel_mask();
+    boot_mark("metrics");
 
     // Point to our function for getting timestamps
     set_gettimestamp_callback(get_current_time_millis);
@@ -648,46 +4888,90 @@ bool network_init(void){
     //Generate the MQTT topic names
     generateNames(hardware_id);
 
+    // Different nodes pick different reconnect backoffs
+    randomSeed(ARM_DWT_CYCCNT ^ (hardware_id << 24));
+
+#ifdef USE_DCP_CRYPTO
+    // Measured once, before the births carry it
+    m_cryptoSelfTest = dcp_init() && dcp_self_test();
+    if(m_cryptoSelfTest)
+        m_cryptoRecordTime = dcp_record_us();
+    else
+        DebugPrint("DCP crypto self test failed");
+    boot_mark("crypto");
+#endif
+
+    Ethernet.setSocketNum(NET_SOCKETS);
+    Ethernet.setSocketSize(NET_SOCKET_BUFFER_SIZE);
+    Ethernet.setStackHeap(NET_STACK_HEAP_SIZE);
     Ethernet.begin(mac, ip, dns, gateway, subnet);
+    // Below the acquisition interrupts (see ETHERNET_IRQ_PRIORITY)
+    NVIC_SET_PRIORITY(IRQ_ENET, ETHERNET_IRQ_PRIORITY);
     if(Ethernet.hardwareStatus() == EthernetNoHardware){
         DebugPrint("Ethernet Shield is not connected");
         return false;
     }
-    if(Ethernet.linkStatus() == LinkOFF){
+    boot_mark("Ethernet");
+    m_linkUp = Ethernet.linkStatus() != LinkOFF;
+    m_linkCheckedAt = millis();
+    if(m_linkUp)
+        boot_mark("link up");
+    if(!m_linkUp){
         DebugPrint("Ethernet cable is unplugged");
-        // This is not a fatal error
+        // This is not a fatal error; check_brokers() connects once it's plugged in
     }
 
     DebugPrintNoEOL("My IP address: ");
     DebugPrint(ip);
 
-    // These should only get called once
-    ntp.setUpdateInterval(SECS_IN_HR);
-    ntp.begin();
-    if(!ntp.updated()){
-        DebugPrintNoEOL("Trying NTP update from ");
-        DebugPrintNoEOL(ntpIP);
-        DebugPrintNoEOL("... ");
-        ntp.forceUpdate();
-    }
-    if(ntp.updated()){
-        DebugPrintNoEOL("NTP updated.  Time is ");
-        DebugPrint(ntp.getFormattedTime());
-    }
-    else
-        DebugPrint("NTP not updated");
+    // The first sync happens from update_ntp(), so boot doesn't wait for the
+    // NTP server
+    if(!ntp_begin(ntpIP))
+        DebugPrint("Unable to open the NTP port");
+#ifdef USE_PTP
+    if(!ptp_begin(mac))
+        DebugPrint("Unable to join the PTP multicast group");
+#endif
+#ifdef USE_METRICS_HTTP
+    if(!http_begin())
+        DebugPrint("Unable to open the metrics HTTP port");
+#endif
 
-    for(int i = 0; i < NUM_BROKERS; ++i)
+    for(int i = 0; i < NUM_BROKERS; ++i){
         m_broker[i].setClient(enet[i]);
+#ifdef USE_OUTBOUND_QUEUE
+        // Publish without blocking loop() when the TCP window is full
+        if(!set_up_outbound_queue(&m_broker[i], &enet[i], OUTBOUND_MESSAGE_SIZE))
+            DebugPrint(sparkplug_error_text());
+#endif
+    }
+#ifdef USE_QOS1_DATA
+    // Delivery acked by the broker, with a few messages in flight at a time
+    set_outbound_qos(1);
+#endif
+#ifdef USE_COALESCE_DATA
+    // A queue that backs up holds only the latest data of each topic
+    set_outbound_policy(OUTBOUND_COALESCE);
+#endif
 
-    m_broker[0].setServer(IPAddress(MQTT_BROKER1), MQTT_BROKER1_PORT);
+    set_broker_server(0, IPAddress(MQTT_BROKER1), MQTT_BROKER1_PORT);
+#ifdef MQTT_BROKER2
+    set_broker_server(1, IPAddress(MQTT_BROKER2), MQTT_BROKER2_PORT);
+#endif
+#ifdef MQTT_BROKER3
+    set_broker_server(2, IPAddress(MQTT_BROKER3), MQTT_BROKER3_PORT);
+#endif
+    format_broker_list();
 
     for(int i = 0; i < NUM_BROKERS; ++i){
         m_broker[i].setCallback(callback_worker);
-        m_broker[i].setBufferSize(BIN_BUF_SIZE);
+        m_broker[i].setBufferSize(MQTT_BUF_SIZE);
+        m_broker[i].setSocketTimeout(BROKER_SOCKET_TIMEOUT_S);
+        enet[i].setConnectionTimeout(BROKER_CONNECT_BUDGET_MS);
     }
 
     // Network has been set up successfully
+    boot_mark("network");
     return true;
 }
 
@@ -698,41 +4982,69 @@ bool network_init(void){
  * should be called periodically.
  */
 void check_brokers(void){
-    // Try to connect to any brokers that aren't currently connected
+    // Move each broker's connection along; at most one connect attempt is
+    // started per call so the blocking TCP connects don't add up, and none
+    // while the Ethernet link is down
     bool new_connection = false;
-    for(int i = 0; i < NUM_BROKERS; ++i){
-        PubSubClient *broker = &m_broker[i];
-        if(!broker->connected()){
-            // Try to connect to the broker
-            if(!connect_to_broker(broker, i))
-                // Can't connect - ignore this broker
-                continue;
+    bool can_attempt = check_link();
+    for(int i = 0; i < NUM_BROKERS; ++i)
+        if(service_broker(i, &can_attempt))
             new_connection = true;
-            DebugPrintNoEOL("Connected to broker");
-            DebugPrint(i+1);
-        }
+
+    // Fail over to a standby if the active broker or the Primary Host on it
+    // has gone
+    if(select_active_broker())
+        new_connection = true;
+    // Reset the next server flag if it was set; a Next Server command arriving
+    // below is acted on by the next call
+    if(m_nodeNextServer){
+        if(m_brokerFanOut)
+            DebugPrint("Next Server ignored while fanning out");
+        m_nodeNextServer = false;
+        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeNextServer))
+            DebugPrint(sparkplug_error_text());
     }
 
     // If we made a new connection to a broker, publish our birth messages to
-    // all connected brokers.  Note that this must be done before handling any
-    // incoming messages.
+    // it.  Note that this must be done before handling any incoming messages.
     if(new_connection)
-        publish_births();
+        publish_births(true);
+
+    // Send whatever the outbound queues can without blocking
+    drain_outbound_queues();
 
     // Handle any incoming messages, as well as maintaining our connection to
-    // the brokers
+    // the brokers.  Not while a queued message is partly written, as loop()
+    // may send a ping.
     for(int i = 0; i < NUM_BROKERS; ++i){
         PubSubClient *broker = &m_broker[i];
-        if(broker->connected())
+        if(broker->connected() && !outbound_in_flight(broker)){
+            m_loopingBroker = i;
             broker->loop();
+            m_loopingBroker = -1;
+        }
     }
 
-    // Have we been asked to re-publish our birth messages?
-    bool rebirth = m_nodeRebirth;
+    // Have we been asked to re-publish our birth messages?  Asking again
+    // within COMMAND_HOLDOFF_MS of the last births waits for the holdoff, and
+    // any more asks in the meantime go with it.
+    if(new_connection)
+        m_rebirthAt = millis();
+    bool rebirth = m_nodeRebirth && (new_connection || !command_held_off(m_rebirthAt));
+#ifdef USE_HOST_STATE_GATING
+    // The Primary Host coming back gets births before the frames held for it
+    static bool host_was_consuming = false;
+    bool consuming = host_consuming();
+    if(consuming && !host_was_consuming)
+        rebirth = true;
+    host_was_consuming = consuming;
+#endif
     if(rebirth){
         // Don't publish birth messages if we just did that
-        if(!new_connection)
-            publish_births();
+        if(!new_connection){
+            publish_births(false);
+            m_rebirthAt = millis();
+        }
 
         // Reset the flags after publishing so that the birth message/s will
         // show which flags triggered them.  Note that an NDATA and/or DDATA
@@ -740,15 +5052,42 @@ void check_brokers(void){
         if(m_nodeRebirth){
             m_nodeRebirth = false;
             if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeRebirth))
-                DebugPrint(cf_sparkplug_error);
+                DebugPrint(sparkplug_error_text());
         }
     }
-    // Publish any Node data that has changed
-    publish_node_data();
-    // Reset the next server flag if it was set
-    if(m_nodeNextServer){
-        m_nodeNextServer = false;
-        if(!update_metric(ARRAY_AND_SIZE(NodeMetrics), &m_nodeNextServer))
-            DebugPrint(cf_sparkplug_error);
+#ifdef USE_DEVICE_BANKS
+    // Rebirth the banks that have been asked to, unless they've just been
+    // reborn with the node; the flag resets the same way
+    for(int bank = 0; bank < NUM_DEVICE_BANKS; bank++){
+        if(!m_bankRebirth[bank])
+            continue;
+        if(!rebirth && !new_connection)
+            publish_bank_birth(bank, TARGET_BROKERS);
+        m_bankRebirth[bank] = false;
+        if(!update_metric(ARRAY_AND_SIZE(BankMetrics[bank]), &m_bankRebirth[bank]))
+            DebugPrint(sparkplug_error_text());
     }
+#endif
+    // Publish any batch of frames that has waited long enough, ahead of the
+    // Node data that has changed
+    service_batch();
+    publish_node_data();
+    // Catch up on any frames stored while we were disconnected
+    replay_history();
+    // and answer any rollup query or snapshot request
+#ifdef USE_CHANNEL_STATS
+    replay_rollups();
+#endif
+    replay_snapshot();
+    publish_last_value();
+    check_throttle();
+    check_self_test();
+#ifdef USE_FRAME_SYNC
+    check_frame_sync();
+#endif
+    update_outbound_stats();
+    update_health();
+    // Start sending what was just published
+    drain_outbound_queues();
+    check_in_network();
 }
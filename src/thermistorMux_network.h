@@ -29,16 +29,39 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #ifndef THERMISTORMUX_NETWORK_H
 #define THERMISTORMUX_NETWORK_H
 
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_watchdog.h"
+#include "thermistorMux_selftest.h"
+
+// What Node Control/Raw Codes publishes each frame's codes as: not at all,
+// in Inputs/Raw Codes alongside the temperatures, or in place of them
+enum RawCodesMode {
+    RAW_CODES_OFF,
+    RAW_CODES_ALONGSIDE,
+    RAW_CODES_INSTEAD
+};
+
 // Public functions
 bool network_init();
 void check_brokers();
-void publish_data(float* thermistor_data, float ADC_temperature);
-void publish_refs(float ref_Low, float ref_High);
+void run_node_commands();
+void publish_data(ThermistorValue* thermistor_data, float ADC_temperature, uint64_t cycles, uint64_t frame);
+void publish_refs(const float *ref_temps, unsigned int points);
+void publish_channel_faults(ChannelMask faults);
+#ifdef USE_CHANNEL_STATS
+void publish_channel_stats();
+#endif
+void publish_alarms();
+void publish_sample_schedule();
+void publish_scan_config();
+void publish_self_test(const SelfTestResults *results);
 bool update_ntp();
 unsigned long get_current_time();
 unsigned long long get_current_time_millis();
 void decode_cal_data();
 void publish_calibration_status(bool);
+void reset_teensy(ResetCause cause);
 
 
 #endif
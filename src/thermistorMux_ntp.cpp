@@ -0,0 +1,252 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_ntp.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Non-blocking SNTP client. Each sync is a burst of requests; the reply
+ * with the shortest round trip is the least disturbed by network queuing and is
+ * the one used, and hands the time service a new reference; the time service
+ * measures the crystal's drift between references, so the sample clock keeps to
+ * well under a millisecond between syncs. ntp_poll() never waits for a reply;
+ * it sends requests when they're due and picks up any that have arrived.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-26
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_ntp.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_global.h"
+#include <NativeEthernet.h>
+
+#define NTP_PORT             123
+#define NTP_LOCAL_PORT       8123
+#define NTP_PACKET_SIZE      48
+#define NTP_UNIX_OFFSET      2208988800ULL   // Seconds from 1900 to 1970
+
+// Requests per sync, the gap between them and how long to wait for each reply
+#define NTP_BURST_SAMPLES    4
+#define NTP_BURST_SPACING_MS 2000
+#define NTP_REPLY_TIMEOUT_MS 500
+
+// Time between syncs. It starts short so the drift is measured soon after boot,
+// and doubles with each sync up to an hour.
+#define NTP_MIN_INTERVAL_MS  64000UL
+#define NTP_MAX_INTERVAL_MS  3600000UL
+#define NTP_RETRY_MS         16000UL
+
+// One request/reply exchange, reduced to the local cycle count at which the
+// reply arrived and the server's time at that moment
+struct NTPSample {
+    uint64_t cycles;
+    uint64_t utc_micros;
+    uint32_t round_trip_us;
+};
+
+static EthernetUDP m_udp;
+static IPAddress m_server;
+static bool m_started = false;
+
+static uint64_t m_request_cycles = 0;   // Sent time of the outstanding request, also its cookie
+static bool m_outstanding = false;
+static unsigned long m_sent_ms = 0;
+static unsigned long m_next_ms = 0;     // millis() at which the next request is due
+static unsigned long m_interval_ms = NTP_MIN_INTERVAL_MS;
+static int m_burst_sent = 0;
+static NTPSample m_best;                // Shortest round trip of the current burst
+static bool m_have_best = false;
+
+static NTPSample m_last_sync;           // Sample used for the previous sync
+static bool m_synced = false;
+
+
+/*
+Opens the local port. Requests start on the first ntp_poll().
+*/
+bool ntp_begin(IPAddress server) {
+    m_server = server;
+    m_started = (m_udp.begin(NTP_LOCAL_PORT) == 1);
+    m_next_ms = millis();
+    return m_started;
+}
+
+
+static void put_u64(uint8_t *buffer, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        buffer[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+
+static uint64_t get_u64(const uint8_t *buffer) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+
+/*
+Converts an NTP timestamp (seconds since 1900 in 32.32 fixed point) to UTC
+microseconds.
+*/
+static uint64_t ntp_to_utc_micros(uint64_t timestamp) {
+    uint64_t seconds = (timestamp >> 32) - NTP_UNIX_OFFSET;
+    uint64_t fraction = ((timestamp & 0xFFFFFFFF) * 1000000) >> 32;
+    return seconds * 1000000 + fraction;
+}
+
+
+static void send_request() {
+    uint8_t packet[NTP_PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x23;   // LI 0, version 4, mode 3 (client)
+    // The server echoes the transmit timestamp as the originate timestamp of
+    // its reply, which tells the reply to this request from stale ones
+    m_request_cycles = time_cycles64();
+    put_u64(&packet[40], m_request_cycles);
+    if (m_udp.beginPacket(m_server, NTP_PORT) != 1) {
+        return;
+    }
+    m_udp.write(packet, sizeof(packet));
+    if (m_udp.endPacket() != 1) {
+        return;
+    }
+    m_outstanding = true;
+    m_sent_ms = millis();
+}
+
+
+/*
+Reads any replies that have arrived. Returns true if the reply to the outstanding
+request was among them.
+*/
+static bool read_replies() {
+    int size;
+    while ((size = m_udp.parsePacket()) > 0) {
+        uint64_t arrival = time_cycles64();
+        uint8_t packet[NTP_PACKET_SIZE];
+        if (size < NTP_PACKET_SIZE || m_udp.read(packet, sizeof(packet)) != NTP_PACKET_SIZE) {
+            continue;
+        }
+        int leap = packet[0] >> 6;
+        int mode = packet[0] & 0x07;
+        int stratum = packet[1];
+        if (!m_outstanding || get_u64(&packet[24]) != m_request_cycles || mode != 4 ||
+            leap == 3 || stratum == 0 || stratum > 15) {
+            continue;   // Stale, or the server isn't synchronized
+        }
+        m_outstanding = false;
+
+        uint64_t server_receive = ntp_to_utc_micros(get_u64(&packet[32]));
+        uint64_t server_transmit = ntp_to_utc_micros(get_u64(&packet[40]));
+        int64_t local_us = (int64_t)((arrival - m_request_cycles) / (F_CPU_ACTUAL / 1000000));
+        int64_t round_trip = local_us - (int64_t)(server_transmit - server_receive);
+        if (round_trip < 0) {
+            round_trip = 0;
+        }
+        NTPSample sample = {arrival, server_transmit + round_trip / 2, (uint32_t)round_trip};
+        if (!m_have_best || sample.round_trip_us < m_best.round_trip_us) {
+            m_best = sample;
+            m_have_best = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+
+/*
+Disciplines the time service with the best sample of the finished burst.
+*/
+static bool finish_burst() {
+    m_burst_sent = 0;
+    if (!m_have_best) {
+        LogWarn("No reply from NTP server.");
+        m_next_ms = millis() + NTP_RETRY_MS;
+        return false;
+    }
+    m_have_best = false;
+
+    int64_t offset = time_discipline(m_best.cycles, m_best.utc_micros);
+    LogInfo("NTP sync: offset %lld us, round trip %lu us, drift %0.2f ppm",
+            (long long)offset, (unsigned long)m_best.round_trip_us, time_drift_ppm());
+    m_last_sync = m_best;
+    m_synced = true;
+
+    m_next_ms = millis() + m_interval_ms;
+    if (m_interval_ms < NTP_MAX_INTERVAL_MS) {
+        m_interval_ms = min(m_interval_ms * 2, NTP_MAX_INTERVAL_MS);
+    }
+    return true;
+}
+
+
+/*
+Sends NTP requests when they're due and collects the replies, without waiting
+for them. Call often: how soon a reply is picked up adds to its round trip.
+Returns true when a sync has just been applied.
+*/
+bool ntp_poll() {
+    if (!m_started) {
+        return false;
+    }
+    if (m_outstanding) {
+        if (!read_replies()) {
+            if ((millis() - m_sent_ms) < NTP_REPLY_TIMEOUT_MS) {
+                return false;
+            }
+            m_outstanding = false;
+        }
+        else if (!time_synced()) {
+            // First reply since boot: set the clock from it straight away so the
+            // frames held until then can be stamped; the burst refines it
+            time_discipline(m_best.cycles, m_best.utc_micros);
+            LogInfo("NTP time set, round trip %lu us", (unsigned long)m_best.round_trip_us);
+        }
+        // This request is done with, one way or the other
+        if (++m_burst_sent >= NTP_BURST_SAMPLES) {
+            return finish_burst();
+        }
+        m_next_ms = millis() + NTP_BURST_SPACING_MS;
+        return false;
+    }
+
+    // Discard anything unsolicited
+    read_replies();
+    if ((long)(millis() - m_next_ms) >= 0) {
+        send_request();
+        if (!m_outstanding) {
+            // Couldn't send; count it as a lost reply
+            if (++m_burst_sent >= NTP_BURST_SAMPLES) {
+                return finish_burst();
+            }
+            m_next_ms = millis() + NTP_BURST_SPACING_MS;
+        }
+    }
+    return false;
+}
+
+
+bool ntp_synced() {
+    return m_synced;
+}
+
+
+uint32_t ntp_round_trip_us() {
+    return m_synced ? m_last_sync.round_trip_us : 0;
+}
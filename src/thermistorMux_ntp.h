@@ -0,0 +1,36 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_ntp.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Non-blocking SNTP client definitions and function prototypes. Disciplines
+ * the sample time service (thermistorMux_time.h) from bursts of NTP requests.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-26
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_NTP_H
+#define THERMISTORMUX_NTP_H
+
+#include <stdint.h>
+#include <IPAddress.h>
+
+bool ntp_begin(IPAddress server);
+bool ntp_poll();
+bool ntp_synced();
+uint32_t ntp_round_trip_us();
+
+#endif
@@ -0,0 +1,295 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_ota.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Firmware update. The image is staged a sector at a time from the
+ * first whole sector after the running image up to the flash the EEPROM
+ * emulation (and the configuration journal, if built) keeps, then hashed on the
+ * DCP. Chunks are taken in order only; one already taken is ignored, so the
+ * host resends from the offset the status shows. Applying copies the staged
+ * image over the running one from RAM with interrupts off, lowest sector first:
+ * a sector is only overwritten once it has been read, as the staged image lies
+ * above the copy. The copy can't be undone, so a power loss during it leaves
+ * the node to be reloaded over USB.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_ota.h"
+
+#ifdef USE_FIRMWARE_UPDATE
+
+#include "thermistorMux_crc.h"
+#include "thermistorMux_dcp.h"
+#include "thermistorMux_journal.h"
+#include "thermistorMux_log.h"
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OTA_CHUNK_MAGIC     0x5746      // "FW"
+#define OTA_CHUNK_VERSION   1
+#define OTA_CHUNK_CRC       4
+#define OTA_PAGE_SIZE       256         // Most written at once
+
+// The Teensy 4.1's 8 MB of program flash. The top 256 KB hold the EEPROM
+// emulation and the recovery program; LittleFS takes its space below them.
+#define OTA_FLASH_SIZE      (8 * 1024 * 1024)
+#ifdef USE_CONFIG_JOURNAL
+#define OTA_FLASH_RESERVED  (256 * 1024 + JOURNAL_FLASH_BYTES)
+#else
+#define OTA_FLASH_RESERVED  (256 * 1024)
+#endif
+
+// A Teensy 4 image starts with the FlexSPI configuration block, and has its
+// image vector table 4 KB in
+#define OTA_IMAGE_MAGIC     0x42464346  // "FCFB"
+#define OTA_IVT_OFFSET      0x1000
+#define OTA_IVT_HEADER      0x402000D1
+
+// Where the FlexSPI maps the flash, and the running image's length, which the
+// linker gives as the address of _flashimagelen. The host build has its own.
+#ifndef FLASH_BASE_ADDRESS
+extern unsigned long _flashimagelen;
+#define FLASH_BASE_ADDRESS  0x60000000
+#define FLASH_IMAGE_LENGTH  ((uint32_t)&_flashimagelen)
+#endif
+
+// The core's flash routines, which run from RAM
+extern "C" void eepromemu_flash_write(void *addr, const void *data, uint32_t len);
+extern "C" void eepromemu_flash_erase_sector(void *addr);
+
+static OtaState m_state = OTA_IDLE;
+static uint32_t m_size = 0;                     // Bytes of the image
+static uint32_t m_received = 0;                 // Bytes taken, the offset of the next chunk
+static uint8_t m_hash[DCP_SHA256_SIZE];         // What the image must hash to
+static const char *m_reason = "";               // Why the update failed
+// The sector being filled; also the copy's buffer, so in DTCM
+static uint8_t m_sector[OTA_SECTOR_SIZE] __attribute__((aligned(32)));
+
+
+// First byte of the staging area, as an offset into the flash
+static uint32_t staging_offset() {
+    return (FLASH_IMAGE_LENGTH + 2 * OTA_SECTOR_SIZE - 1) / OTA_SECTOR_SIZE * OTA_SECTOR_SIZE;
+}
+
+
+/*
+Largest image that can be staged, bytes.
+*/
+uint32_t ota_capacity() {
+    uint32_t start = staging_offset();
+    return (start < OTA_FLASH_SIZE - OTA_FLASH_RESERVED) ? OTA_FLASH_SIZE - OTA_FLASH_RESERVED - start : 0;
+}
+
+
+static void fail(const char *reason) {
+    m_state = OTA_FAILED;
+    m_reason = reason;
+    LogWarn("Firmware update failed: %s.", reason);
+}
+
+
+/*
+Starts an update from "SIZE SHA256", the image's length in bytes and its
+SHA-256 in hex, dropping any image staged before. Returns false, changing
+nothing, if the text is malformed or the image too large.
+*/
+bool ota_begin(const char *text) {
+    unsigned long size;
+    char hex[2 * DCP_SHA256_SIZE + 1];
+    char extra;
+    if (sscanf(text, "%lu %64s %c", &size, hex, &extra) != 2 || strlen(hex) != 2 * DCP_SHA256_SIZE ||
+        size <= OTA_IVT_OFFSET || size > ota_capacity()) {
+        return false;
+    }
+    uint8_t hash[DCP_SHA256_SIZE];
+    for (int i = 0; i < DCP_SHA256_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(&hex[2 * i], "%2x", &byte) != 1) {
+            return false;
+        }
+        hash[i] = (uint8_t)byte;
+    }
+    memcpy(m_hash, hash, sizeof(m_hash));
+    m_size = size;
+    m_received = 0;
+    m_state = OTA_RECEIVING;
+    LogInfo("Firmware update of %lu bytes started.", size);
+    return true;
+}
+
+
+/*
+Drops the update, staged or not.
+*/
+void ota_abort() {
+    m_state = OTA_IDLE;
+    m_received = 0;
+}
+
+
+/*
+Erases a staging sector and writes m_sector to it, len bytes of it, a page at a
+time. Returns false if it doesn't read back.
+*/
+static bool write_sector(uint32_t index, uint32_t len) {
+    uint8_t *flash = (uint8_t *)(FLASH_BASE_ADDRESS + staging_offset() + index * OTA_SECTOR_SIZE);
+    eepromemu_flash_erase_sector(flash);
+    for (uint32_t page = 0; page < len; page += OTA_PAGE_SIZE) {
+        eepromemu_flash_write(&flash[page], &m_sector[page], (len - page < OTA_PAGE_SIZE) ? len - page : OTA_PAGE_SIZE);
+    }
+    arm_dcache_delete(flash, OTA_SECTOR_SIZE);
+    return memcmp(flash, m_sector, len) == 0;
+}
+
+
+// Checks the whole staged image: a Teensy 4 image, hashing to m_hash
+static void verify() {
+    const uint8_t *image = (const uint8_t *)(FLASH_BASE_ADDRESS + staging_offset());
+    uint32_t magic, ivt;
+    memcpy(&magic, image, sizeof(magic));
+    memcpy(&ivt, &image[OTA_IVT_OFFSET], sizeof(ivt));
+    if (magic != OTA_IMAGE_MAGIC || ivt != OTA_IVT_HEADER) {
+        fail("not a Teensy 4 image");
+        return;
+    }
+    uint8_t digest[DCP_SHA256_SIZE];
+    if (!dcp_sha256(image, m_size, digest)) {
+        fail("couldn't hash the image");
+        return;
+    }
+    if (memcmp(digest, m_hash, sizeof(digest)) != 0) {
+        fail("SHA-256 mismatch");
+        return;
+    }
+    m_state = OTA_VERIFIED;
+    LogInfo("Firmware update of %lu bytes verified.", (unsigned long)m_size);
+}
+
+
+/*
+Takes a chunk of the image. Returns false for a chunk that is malformed, fails
+its CRC, runs past the image or leaves a gap; the update goes on, for the host
+to resend from the offset the status shows. A chunk already taken is ignored.
+*/
+bool ota_chunk(const uint8_t *chunk, size_t size) {
+    if (m_state != OTA_RECEIVING || size <= OTA_CHUNK_HEADER + OTA_CHUNK_CRC || size > OTA_CHUNK_MAX_SIZE ||
+        chunk[0] != (OTA_CHUNK_MAGIC & 0xFF) || chunk[1] != (OTA_CHUNK_MAGIC >> 8) || chunk[2] != OTA_CHUNK_VERSION) {
+        return false;
+    }
+    uint32_t crc, offset;
+    memcpy(&crc, &chunk[size - OTA_CHUNK_CRC], sizeof(crc));
+    memcpy(&offset, &chunk[4], sizeof(offset));
+    uint32_t length = size - OTA_CHUNK_HEADER - OTA_CHUNK_CRC;
+    if (crc != crc32(chunk, size - OTA_CHUNK_CRC) || offset > m_received || length > m_size - offset) {
+        return false;
+    }
+    if (offset < m_received) {
+        return true;
+    }
+
+    const uint8_t *data = &chunk[OTA_CHUNK_HEADER];
+    while (length > 0) {
+        uint32_t fill = m_received % OTA_SECTOR_SIZE;
+        uint32_t part = (length < OTA_SECTOR_SIZE - fill) ? length : OTA_SECTOR_SIZE - fill;
+        memcpy(&m_sector[fill], data, part);
+        m_received += part;
+        data += part;
+        length -= part;
+        fill += part;
+        if ((fill == OTA_SECTOR_SIZE || m_received == m_size) &&
+            !write_sector((m_received - 1) / OTA_SECTOR_SIZE, fill)) {
+            fail("flash didn't write");
+            return false;
+        }
+    }
+    if (m_received == m_size) {
+        verify();
+    }
+    return true;
+}
+
+
+OtaState ota_state() {
+    return m_state;
+}
+
+
+/*
+Writes the update's progress as text: "idle", "receiving TAKEN/SIZE",
+"verified SIZE" or "failed: REASON".
+*/
+void ota_format_status(char *text, size_t size) {
+    switch (m_state) {
+    case OTA_IDLE:
+        snprintf(text, size, "idle");
+        break;
+    case OTA_RECEIVING:
+        snprintf(text, size, "receiving %lu/%lu", (unsigned long)m_received, (unsigned long)m_size);
+        break;
+    case OTA_VERIFIED:
+        snprintf(text, size, "verified %lu", (unsigned long)m_size);
+        break;
+    case OTA_FAILED:
+        snprintf(text, size, "failed: %s", m_reason);
+        break;
+    }
+}
+
+
+/*
+Copies size bytes of staged image from staged over the running image and
+resets. Nothing here may be in flash, the loop and the buffer included.
+*/
+FASTRUN static void copy_image(uintptr_t staged, uint32_t size) {
+    __disable_irq();
+    for (uint32_t offset = 0; offset < size; offset += OTA_SECTOR_SIZE) {
+        const volatile uint8_t *source = (const volatile uint8_t *)(staged + offset);
+        for (uint32_t i = 0; i < OTA_SECTOR_SIZE; i++) {
+            m_sector[i] = source[i];
+        }
+        uint8_t *flash = (uint8_t *)(FLASH_BASE_ADDRESS + offset);
+        eepromemu_flash_erase_sector(flash);
+        for (uint32_t page = 0; page < OTA_SECTOR_SIZE; page += OTA_PAGE_SIZE) {
+            eepromemu_flash_write(&flash[page], &m_sector[page], OTA_PAGE_SIZE);
+        }
+    }
+    SCB_AIRCR = 0x05FA0004;
+    // Waits out the reset. AIRCR reads back with its key reversed, so only on
+    // the host, where nothing resets, does this end.
+    while (SCB_AIRCR != 0x05FA0004) {
+    }
+}
+
+
+/*
+Replaces the running firmware with the verified image and resets; call
+warmboot_prepare() first for a warm boot. Returns false if no image is
+verified. The interrupts stay off until the reset.
+*/
+bool ota_apply() {
+    if (m_state != OTA_VERIFIED) {
+        return false;
+    }
+    LogInfo("Applying a firmware update of %lu bytes.", (unsigned long)m_size);
+    copy_image(FLASH_BASE_ADDRESS + staging_offset(), m_size);
+    return true;
+}
+
+#endif
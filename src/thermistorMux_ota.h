@@ -0,0 +1,61 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_ota.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Firmware update over the network. A new image is streamed in chunks
+ * (Node Control/Firmware Chunk) into the free program flash above the running
+ * image while the node goes on measuring and publishing, checked against the
+ * SHA-256 the host announced, then copied over the running image from RAM and
+ * booted warm (Node Control/Firmware Update), so the node is only down for the
+ * copy and one reboot.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_OTA_H
+#define THERMISTORMUX_OTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thermistorMux_global.h"
+
+// Flash erase sector; the staged image is written a sector at a time
+#define OTA_SECTOR_SIZE         4096
+// A chunk: magic uint16 0x5746 ("FW"), version uint8, reserved uint8, offset
+// uint32, up to OTA_CHUNK_MAX_DATA bytes of image, then a CRC32 of all before it
+#define OTA_CHUNK_HEADER        8
+#define OTA_CHUNK_MAX_DATA      1024
+#define OTA_CHUNK_MAX_SIZE      (OTA_CHUNK_HEADER + OTA_CHUNK_MAX_DATA + 4)
+#define OTA_STATUS_TEXT_SIZE    48
+
+enum OtaState {
+    OTA_IDLE,
+    OTA_RECEIVING,      // Taking chunks, in order
+    OTA_VERIFIED,       // Whole and matching its hash; ready to apply
+    OTA_FAILED
+};
+
+bool ota_begin(const char *text);
+void ota_abort();
+bool ota_chunk(const uint8_t *chunk, size_t size);
+OtaState ota_state();
+uint32_t ota_capacity();
+void ota_format_status(char *text, size_t size);
+bool ota_apply();
+
+#endif
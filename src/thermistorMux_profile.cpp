@@ -0,0 +1,142 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_profile.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Phase profiler. Each phase keeps its count, total, minimum and maximum
+ * and a log-linear histogram of its run times in cycles: four bins per octave,
+ * so any percentile read from it is within 25% of the true value.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_profile.h"
+
+#define CYCLES_PER_US (F_CPU_ACTUAL / 1000000)
+
+// Bins 0-3 hold 0-3 cycles; above that, four bins per power of 2 up to 2^32
+#define PROFILE_BINS 124
+
+struct PhaseProfile {
+    unsigned long count;
+    uint64_t total_cycles;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint32_t bins[PROFILE_BINS];
+};
+
+static PhaseProfile m_phases[NUM_PROFILE_PHASES];
+
+static const char *const m_phase_names[NUM_PROFILE_PHASES] = {
+    "Acquisition",
+    "Conversion",
+    "Calibration",
+    "Log",
+    "Encode",
+    "Publish"
+};
+
+
+/*
+Histogram bin of a run time: the octave of cycles and the two bits below its
+leading one.
+*/
+static inline int profile_bin(uint32_t cycles) {
+    if (cycles < 4) {
+        return cycles;
+    }
+    int octave = 31 - __builtin_clz(cycles);
+    return (octave - 1) * 4 + ((cycles >> (octave - 2)) & 3);
+}
+
+
+/*
+Largest run time, in cycles, that falls in a bin.
+*/
+static inline uint64_t profile_bin_top(int bin) {
+    if (bin < 4) {
+        return bin;
+    }
+    int octave = bin / 4 + 1;
+    return ((uint64_t)(5 + bin % 4) << (octave - 2)) - 1;
+}
+
+
+const char *profile_phase_name(int phase) {
+    if (phase < 0 || phase >= NUM_PROFILE_PHASES) {
+        return "";
+    }
+    return m_phase_names[phase];
+}
+
+
+/*
+Adds one run of phase that took cycles CPU cycles.
+*/
+void profile_record(int phase, uint32_t cycles) {
+    if (phase < 0 || phase >= NUM_PROFILE_PHASES) {
+        return;
+    }
+    PhaseProfile *profile = &m_phases[phase];
+    if (profile->count == 0 || cycles < profile->min_cycles) {
+        profile->min_cycles = cycles;
+    }
+    if (cycles > profile->max_cycles) {
+        profile->max_cycles = cycles;
+    }
+    profile->count++;
+    profile->total_cycles += cycles;
+    profile->bins[profile_bin(cycles)]++;
+}
+
+
+/*
+Fills stats with the run times of phase in microseconds. Returns false, leaving
+stats zeroed, if the phase hasn't run since the last reset.
+*/
+bool profile_stats(int phase, ProfileStats *stats) {
+    memset(stats, 0, sizeof(ProfileStats));
+    if (phase < 0 || phase >= NUM_PROFILE_PHASES || m_phases[phase].count == 0) {
+        return false;
+    }
+    const PhaseProfile *profile = &m_phases[phase];
+    stats->count = profile->count;
+    stats->min_us = profile->min_cycles / CYCLES_PER_US;
+    stats->avg_us = profile->total_cycles / profile->count / CYCLES_PER_US;
+    stats->max_us = profile->max_cycles / CYCLES_PER_US;
+
+    // First bin at which 99% of the runs are counted
+    unsigned long target = profile->count - profile->count / 100;
+    unsigned long seen = 0;
+    int bin = 0;
+    while (bin < PROFILE_BINS - 1 && (seen += profile->bins[bin]) < target) {
+        bin++;
+    }
+    uint64_t p99 = profile_bin_top(bin);
+    if (p99 > profile->max_cycles) {
+        p99 = profile->max_cycles;
+    }
+    stats->p99_us = p99 / CYCLES_PER_US;
+    return true;
+}
+
+
+/*
+Clears every phase's statistics, starting a new measurement window.
+*/
+void profile_reset() {
+    memset(m_phases, 0, sizeof(m_phases));
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_profile.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Phase profiler: times named phases of the firmware with the DWT cycle
+ * counter and keeps a histogram of each in fixed RAM, published on demand as the
+ * Diagnostics metrics.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_PROFILE_H
+#define THERMISTORMUX_PROFILE_H
+
+#include <Arduino.h>
+#include "thermistorMux_global.h"
+
+// Phases timed by the profiler
+enum ProfilePhase {
+    PROFILE_ACQUISITION,    // Pass reassembly, fault checks and filtering
+    PROFILE_CONVERSION,     // Codes to temperatures for a frame
+    PROFILE_CALIBRATION,    // Judging a calibration capture
+    PROFILE_LOG,            // Queued log output written to the serial port
+    PROFILE_ENCODE,         // Adding the updated metrics to an NDATA payload
+    PROFILE_PUBLISH,        // Encoding a payload and handing it to the brokers
+    NUM_PROFILE_PHASES
+};
+
+// Distribution of a phase's run times since the last profile_reset()
+struct ProfileStats {
+    unsigned long count;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t max_us;
+    uint32_t p99_us;        // Upper edge of the histogram bin holding the 99th percentile
+};
+
+const char *profile_phase_name(int phase);
+void profile_record(int phase, uint32_t cycles);
+bool profile_stats(int phase, ProfileStats *stats);
+void profile_reset();
+
+/*
+Times the rest of the enclosing block as one run of a phase. Only to be used from
+loop() context.
+*/
+class ProfileScope {
+public:
+    ProfileScope(ProfilePhase phase) : m_phase(phase), m_start(ARM_DWT_CYCCNT) {}
+    ~ProfileScope() { profile_record(m_phase, ARM_DWT_CYCCNT - m_start); }
+
+private:
+    ProfilePhase m_phase;
+    uint32_t m_start;
+};
+
+// PROFILE_SCOPE() times the rest of a block; PROFILE_RECORD() adds a run timed
+// by the caller, for phases that are only worth counting once they've done work
+#ifdef USE_PROFILER
+#define PROFILE_SCOPE( phase ) ProfileScope profile_scope_(phase)
+#define PROFILE_RECORD( phase, cycles ) profile_record((phase), (cycles))
+#else
+#define PROFILE_SCOPE( phase ) do { } while (0)
+#define PROFILE_RECORD( phase, cycles ) do { (void)(cycles); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,373 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_ptp.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief IEEE 1588 (PTPv2) slave-only ordinary clock over UDP/IPv4, using the
+ * end-to-end delay mechanism. The master is chosen from its Announce messages by
+ * the standard dataset comparison; each Sync, Follow_Up, Delay_Req, Delay_Resp
+ * exchange gives one (cycle count, master time) sample, and the sample with the
+ * shortest path delay out of every PTP_FILTER_SAMPLES disciplines the time service.
+ *
+ * NativeEthernet doesn't give access to the ENET MAC's 1588 packet timestamps, so
+ * packets are timestamped from the cycle counter as they are picked up. The delay
+ * filter discards the exchanges that were picked up late, which is what keeps the
+ * sync to the tens of microseconds rather than the polling period.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-26
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_ptp.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_global.h"
+#include <NativeEthernet.h>
+
+#define PTP_EVENT_PORT          319
+#define PTP_GENERAL_PORT        320
+#define PTP_MULTICAST           224, 0, 1, 129
+#define PTP_DOMAIN              0
+#define PTP_DEFAULT_UTC_OFFSET  37      // TAI - UTC, seconds, until Announce says otherwise
+
+// Exchanges per discipline of the time service
+#define PTP_FILTER_SAMPLES      8
+// Locked while the time service has been disciplined this recently
+#define PTP_LOCK_TIMEOUT_MS     30000
+// A master not heard from for this long is dropped
+#define PTP_MASTER_TIMEOUT_MS   10000
+// Longest wait for a Follow_Up or Delay_Resp
+#define PTP_REPLY_TIMEOUT_MS    1000
+
+// Message types
+#define PTP_SYNC                0x0
+#define PTP_DELAY_REQ           0x1
+#define PTP_FOLLOW_UP           0x8
+#define PTP_DELAY_RESP          0x9
+#define PTP_ANNOUNCE            0xB
+
+// Header layout
+#define PTP_HEADER_SIZE         34
+#define PTP_TIMESTAMP_SIZE      10
+#define PTP_PORT_ID_SIZE        10
+#define PTP_OFF_FLAGS           6
+#define PTP_OFF_CORRECTION      8
+#define PTP_OFF_SOURCE_PORT     20
+#define PTP_OFF_SEQUENCE        30
+#define PTP_OFF_BODY            34
+
+#define PTP_FLAG_TWO_STEP       0x02    // First flags byte
+#define PTP_FLAG_UTC_VALID      0x04    // Second flags byte
+#define PTP_FLAG_PTP_TIMESCALE  0x08    // Second flags byte
+
+// Announce fields
+#define PTP_OFF_UTC_OFFSET      44
+#define PTP_OFF_DATASET         47      // priority1 .. grandmasterIdentity
+#define PTP_DATASET_SIZE        14
+
+#define PTP_BUFFER_SIZE         64
+
+// One exchange, reduced to the local cycle count at which the Sync arrived and
+// the master's time at that moment
+struct PTPSample {
+    uint64_t cycles;
+    uint64_t utc_micros;
+    uint32_t delay_us;
+};
+
+static EthernetUDP m_event;
+static EthernetUDP m_general;
+static bool m_started = false;
+static uint8_t m_port_id[PTP_PORT_ID_SIZE];    // Our clockIdentity + port number 1
+
+// Master being followed
+static bool m_have_master = false;
+static uint8_t m_master_port[PTP_PORT_ID_SIZE];
+static uint8_t m_master_dataset[PTP_DATASET_SIZE];
+static unsigned long m_master_seen_ms = 0;
+static int64_t m_timescale_offset_us = (int64_t)PTP_DEFAULT_UTC_OFFSET * 1000000;
+
+// Exchange in progress
+enum PTPExchange {
+    PTP_IDLE,           // Waiting for a Sync
+    PTP_WAIT_FOLLOW_UP, // Two-step Sync received
+    PTP_WAIT_DELAY_RESP // Delay_Req sent
+};
+static PTPExchange m_exchange = PTP_IDLE;
+static unsigned long m_exchange_ms = 0;
+static uint16_t m_sync_seq = 0;
+static uint64_t m_t1_utc = 0;           // Master's Sync send time
+static int64_t m_sync_correction = 0;   // Two-step Sync's correction field
+static uint64_t m_t2_cycles = 0;        // Our Sync receive time
+static uint64_t m_t3_cycles = 0;        // Our Delay_Req send time
+static uint16_t m_request_seq = 0;
+
+// Filter window
+static PTPSample m_best;
+static int m_samples = 0;
+static bool m_disciplined = false;
+static unsigned long m_disciplined_ms = 0;
+static uint32_t m_delay_us = 0;
+
+
+/*
+Joins the PTP multicast group on the event and general ports. The clock identity
+is the EUI-64 built from mac.
+*/
+bool ptp_begin(const uint8_t *mac) {
+    uint8_t identity[8] = {mac[0], mac[1], mac[2], 0xFF, 0xFE, mac[3], mac[4], mac[5]};
+    memcpy(m_port_id, identity, sizeof(identity));
+    m_port_id[8] = 0;
+    m_port_id[9] = 1;
+    IPAddress group(PTP_MULTICAST);
+    m_started = m_event.beginMulticast(group, PTP_EVENT_PORT) == 1 &&
+                m_general.beginMulticast(group, PTP_GENERAL_PORT) == 1;
+    return m_started;
+}
+
+
+static uint16_t get_u16(const uint8_t *buffer) {
+    return ((uint16_t)buffer[0] << 8) | buffer[1];
+}
+
+
+static int64_t get_i64(const uint8_t *buffer) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | buffer[i];
+    }
+    return (int64_t)value;
+}
+
+
+/*
+Converts a PTP timestamp (48-bit seconds, 32-bit nanoseconds) plus a correction
+field (nanoseconds << 16) to UTC microseconds.
+*/
+static uint64_t ptp_to_utc_micros(const uint8_t *timestamp, int64_t correction) {
+    uint64_t seconds = 0;
+    for (int i = 0; i < 6; i++) {
+        seconds = (seconds << 8) | timestamp[i];
+    }
+    uint32_t nanoseconds = ((uint32_t)timestamp[6] << 24) | ((uint32_t)timestamp[7] << 16) |
+                           ((uint32_t)timestamp[8] << 8) | timestamp[9];
+    int64_t micros = (int64_t)(seconds * 1000000 + nanoseconds / 1000) + correction / 65536000;
+    return (uint64_t)(micros - m_timescale_offset_us);
+}
+
+
+static bool from_master(const uint8_t *packet) {
+    return m_have_master && memcmp(&packet[PTP_OFF_SOURCE_PORT], m_master_port, PTP_PORT_ID_SIZE) == 0;
+}
+
+
+/*
+Follows the master of an Announce if we have none, ours has gone quiet, or the
+new one is better by the dataset comparison (lower is better, byte for byte from
+priority1 to the grandmaster identity).
+*/
+static void handle_announce(const uint8_t *packet, int size) {
+    if (size < PTP_OFF_DATASET + PTP_DATASET_SIZE) {
+        return;
+    }
+    const uint8_t *dataset = &packet[PTP_OFF_DATASET];
+    if (!from_master(packet)) {
+        bool timed_out = (millis() - m_master_seen_ms) >= PTP_MASTER_TIMEOUT_MS;
+        if (m_have_master && !timed_out && memcmp(dataset, m_master_dataset, PTP_DATASET_SIZE) >= 0) {
+            return;
+        }
+        memcpy(m_master_port, &packet[PTP_OFF_SOURCE_PORT], PTP_PORT_ID_SIZE);
+        m_have_master = true;
+        m_exchange = PTP_IDLE;
+        m_samples = 0;
+        LogInfo("PTP master %02x%02x%02x%02x%02x%02x%02x%02x", m_master_port[0], m_master_port[1],
+                m_master_port[2], m_master_port[3], m_master_port[4], m_master_port[5],
+                m_master_port[6], m_master_port[7]);
+    }
+    memcpy(m_master_dataset, dataset, PTP_DATASET_SIZE);
+    m_master_seen_ms = millis();
+
+    uint8_t flags = packet[PTP_OFF_FLAGS + 1];
+    int64_t offset_s = 0;
+    if (flags & PTP_FLAG_PTP_TIMESCALE) {
+        // TAI; an arbitrary timescale is taken to be UTC already
+        offset_s = (flags & PTP_FLAG_UTC_VALID) ? (int16_t)get_u16(&packet[PTP_OFF_UTC_OFFSET])
+                                                : PTP_DEFAULT_UTC_OFFSET;
+    }
+    m_timescale_offset_us = offset_s * 1000000;
+}
+
+
+static void send_delay_request() {
+    uint8_t packet[PTP_HEADER_SIZE + PTP_TIMESTAMP_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PTP_DELAY_REQ;
+    packet[1] = 2;                      // PTPv2
+    packet[3] = sizeof(packet);
+    packet[4] = PTP_DOMAIN;
+    memcpy(&packet[PTP_OFF_SOURCE_PORT], m_port_id, PTP_PORT_ID_SIZE);
+    m_request_seq++;
+    packet[PTP_OFF_SEQUENCE] = m_request_seq >> 8;
+    packet[PTP_OFF_SEQUENCE + 1] = m_request_seq & 0xFF;
+    packet[32] = 0x01;                  // controlField: Delay_Req
+    packet[33] = 0x7F;                  // logMessageInterval: not applicable
+
+    m_exchange = PTP_IDLE;
+    if (m_event.beginPacket(IPAddress(PTP_MULTICAST), PTP_EVENT_PORT) != 1) {
+        return;
+    }
+    m_event.write(packet, sizeof(packet));
+    m_t3_cycles = time_cycles64();
+    if (m_event.endPacket() != 1) {
+        return;
+    }
+    m_exchange = PTP_WAIT_DELAY_RESP;
+    m_exchange_ms = millis();
+}
+
+
+/*
+Completes an exchange: the one-way delay is half the round trip less the time we
+held the Sync, and the master's time at the Sync's arrival is its send time plus
+that delay. Returns true if the time service was disciplined.
+*/
+static bool finish_exchange(uint64_t t4_utc) {
+    m_exchange = PTP_IDLE;
+    double held_us = (double)(m_t3_cycles - m_t2_cycles) * 1e6 / F_CPU_ACTUAL;
+    double round_trip_us = (double)(int64_t)(t4_utc - m_t1_utc) - held_us;
+    if (round_trip_us < 0) {
+        round_trip_us = 0;
+    }
+    PTPSample sample = {m_t2_cycles, m_t1_utc + (uint64_t)(round_trip_us / 2), (uint32_t)(round_trip_us / 2)};
+    if (m_samples == 0 || sample.delay_us < m_best.delay_us) {
+        m_best = sample;
+    }
+    if (++m_samples < PTP_FILTER_SAMPLES) {
+        return false;
+    }
+    m_samples = 0;
+    int64_t offset = time_discipline(m_best.cycles, m_best.utc_micros);
+    m_delay_us = m_best.delay_us;
+    m_disciplined = true;
+    m_disciplined_ms = millis();
+    LogDebug("PTP sync: offset %lld us, path delay %lu us, drift %0.2f ppm",
+             (long long)offset, (unsigned long)m_delay_us, time_drift_ppm());
+    return true;
+}
+
+
+static bool handle_packet(const uint8_t *packet, int size, uint64_t arrival) {
+    if (size < PTP_HEADER_SIZE || (packet[1] & 0x0F) != 2 || packet[4] != PTP_DOMAIN) {
+        return false;
+    }
+    int type = packet[0] & 0x0F;
+    if (type == PTP_ANNOUNCE) {
+        handle_announce(packet, size);
+        return false;
+    }
+    if (!from_master(packet) || size < PTP_OFF_BODY + PTP_TIMESTAMP_SIZE) {
+        return false;
+    }
+    uint16_t seq = get_u16(&packet[PTP_OFF_SEQUENCE]);
+    int64_t correction = get_i64(&packet[PTP_OFF_CORRECTION]);
+
+    switch (type) {
+    case PTP_SYNC:
+        if (m_exchange == PTP_WAIT_DELAY_RESP) {
+            return false;   // Finish the exchange in progress first
+        }
+        m_master_seen_ms = millis();
+        m_sync_seq = seq;
+        m_t2_cycles = arrival;
+        if (packet[PTP_OFF_FLAGS] & PTP_FLAG_TWO_STEP) {
+            // The precise send time follows; keep the Sync's correction
+            m_sync_correction = correction;
+            m_exchange = PTP_WAIT_FOLLOW_UP;
+            m_exchange_ms = millis();
+        }
+        else {
+            m_t1_utc = ptp_to_utc_micros(&packet[PTP_OFF_BODY], correction);
+            send_delay_request();
+        }
+        return false;
+
+    case PTP_FOLLOW_UP:
+        if (m_exchange != PTP_WAIT_FOLLOW_UP || seq != m_sync_seq) {
+            return false;
+        }
+        m_t1_utc = ptp_to_utc_micros(&packet[PTP_OFF_BODY], correction + m_sync_correction);
+        send_delay_request();
+        return false;
+
+    case PTP_DELAY_RESP:
+        if (m_exchange != PTP_WAIT_DELAY_RESP || seq != m_request_seq ||
+            size < PTP_OFF_BODY + PTP_TIMESTAMP_SIZE + PTP_PORT_ID_SIZE ||
+            memcmp(&packet[PTP_OFF_BODY + PTP_TIMESTAMP_SIZE], m_port_id, PTP_PORT_ID_SIZE) != 0) {
+            return false;
+        }
+        return finish_exchange(ptp_to_utc_micros(&packet[PTP_OFF_BODY], -correction));
+    }
+    return false;
+}
+
+
+static bool read_port(EthernetUDP *udp) {
+    bool disciplined = false;
+    int size;
+    while ((size = udp->parsePacket()) > 0) {
+        uint64_t arrival = time_cycles64();
+        uint8_t packet[PTP_BUFFER_SIZE];
+        int len = udp->read(packet, size < PTP_BUFFER_SIZE ? size : PTP_BUFFER_SIZE);
+        if (handle_packet(packet, len, arrival)) {
+            disciplined = true;
+        }
+    }
+    return disciplined;
+}
+
+
+/*
+Handles any PTP messages that have arrived, without waiting for any. Call often:
+how soon a Sync is picked up adds to its measured delay. Returns true when the
+time service has just been disciplined.
+*/
+bool ptp_poll() {
+    if (!m_started) {
+        return false;
+    }
+    if (m_exchange != PTP_IDLE && (millis() - m_exchange_ms) >= PTP_REPLY_TIMEOUT_MS) {
+        m_exchange = PTP_IDLE;
+    }
+    if (m_have_master && (millis() - m_master_seen_ms) >= PTP_MASTER_TIMEOUT_MS) {
+        LogWarn("PTP master lost.");
+        m_have_master = false;
+        m_samples = 0;
+    }
+    // Event port first, so a Sync is stamped before its Follow_Up is handled
+    bool disciplined = read_port(&m_event);
+    return read_port(&m_general) || disciplined;
+}
+
+
+/*
+True while PTP is disciplining the time service.
+*/
+bool ptp_locked() {
+    return m_disciplined && (millis() - m_disciplined_ms) < PTP_LOCK_TIMEOUT_MS;
+}
+
+
+uint32_t ptp_path_delay_us() {
+    return m_delay_us;
+}
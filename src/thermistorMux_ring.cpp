@@ -0,0 +1,89 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_ring.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Single-producer/single-consumer ring of raw ADC samples. The head index
+ * is only written by the producer (ADC interrupt) and the tail index only by the
+ * consumer (loop()), so no interrupt masking is needed on either side.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-18
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_ring.h"
+
+#define SAMPLE_RING_MASK (SAMPLE_RING_SIZE - 1)
+
+#if (SAMPLE_RING_SIZE & SAMPLE_RING_MASK) != 0
+    #error SAMPLE_RING_SIZE must be a power of 2.
+#endif
+
+static ADCSample m_samples[SAMPLE_RING_SIZE];
+// Free running indices; the difference is the number of samples held.
+static volatile uint32_t m_head = 0;    // Next slot to write, producer only
+static volatile uint32_t m_tail = 0;    // Next slot to read, consumer only
+static volatile unsigned long m_dropped = 0;
+
+
+/*
+Producer side. Returns false (and counts the sample as dropped) if the ring is full.
+*/
+bool sample_ring_push(const ADCSample *sample) {
+    uint32_t head = m_head;
+    if ((head - m_tail) >= SAMPLE_RING_SIZE) {
+        m_dropped++;
+        return false;
+    }
+    m_samples[head & SAMPLE_RING_MASK] = *sample;
+    // Sample must be in memory before the consumer can see the new head
+    __sync_synchronize();
+    m_head = head + 1;
+    return true;
+}
+
+
+/*
+Consumer side. Returns false if the ring is empty.
+*/
+bool sample_ring_pop(ADCSample *sample) {
+    uint32_t tail = m_tail;
+    if (tail == m_head) {
+        return false;
+    }
+    *sample = m_samples[tail & SAMPLE_RING_MASK];
+    // Finish reading the sample before handing the slot back to the producer
+    __sync_synchronize();
+    m_tail = tail + 1;
+    return true;
+}
+
+
+unsigned int sample_ring_count() {
+    return m_head - m_tail;
+}
+
+
+unsigned long sample_ring_dropped() {
+    return m_dropped;
+}
+
+
+/*
+Consumer side. Discards all samples currently held.
+*/
+void sample_ring_clear() {
+    m_tail = m_head;
+}
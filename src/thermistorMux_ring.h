@@ -0,0 +1,50 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_ring.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Single-producer/single-consumer ring of raw ADC samples. The ADC
+ * interrupt pushes, loop() pops; neither side ever blocks or takes a lock.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-18
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_RING_H
+#define THERMISTORMUX_RING_H
+
+#include <stdint.h>
+
+// Ring capacity in samples, must be a power of 2. 1024 samples is ~30 scan
+// passes, enough to ride out a broker reconnect without losing data.
+#define SAMPLE_RING_SIZE 1024
+
+// One raw ADC conversion
+struct ADCSample {
+    uint64_t cycles;    // time_cycles64() when the conversion was read
+    uint32_t raw_data;  // ADCDATA output, status byte + 24 data bits
+    uint8_t  channel;   // Scan slot; thermistor index or ADC_TEMP_SLOT
+    uint8_t  index;     // Position of the sample within its ADC's pass
+    uint8_t  adc;       // ADC that converted it
+    bool     last;      // Last sample of its ADC's pass
+};
+
+bool sample_ring_push(const ADCSample *sample);
+bool sample_ring_pop(ADCSample *sample);
+unsigned int sample_ring_count();
+unsigned long sample_ring_dropped();
+void sample_ring_clear();
+
+#endif
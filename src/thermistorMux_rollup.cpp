@@ -0,0 +1,190 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_rollup.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Cascading rollups. Each converted frame is added to the open second
+ * bucket's per-channel sum, count, min and max in constant time. When a frame
+ * falls in a later second the open bucket is finished into the second ring and
+ * merged into the open minute bucket, which is finished into the minute ring
+ * and merged into the open hour bucket the same way. Null readings are left
+ * out, and frames before the first time sync aren't added, as buckets are
+ * aligned to UTC.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_rollup.h"
+
+#ifdef USE_CHANNEL_STATS
+
+// The open bucket of a resolution
+struct RollupAccumulator {
+    unsigned long long start;
+    uint32_t frames;                            // 0 while nothing has been added
+    uint32_t count[NUMBER_OF_THERMISTORS];
+    double sum[NUMBER_OF_THERMISTORS];
+    float min[NUMBER_OF_THERMISTORS];
+    float max[NUMBER_OF_THERMISTORS];
+};
+
+static const unsigned long m_width_ms[NUM_ROLLUP_LEVELS] = {1000, 60000, 3600000};
+static const unsigned int m_size[NUM_ROLLUP_LEVELS] = {
+    ROLLUP_SECOND_BUCKETS, ROLLUP_MINUTE_BUCKETS, ROLLUP_HOUR_BUCKETS
+};
+
+// DMAMEM isn't zeroed at startup, but only the counts below need to be
+static DMAMEM RollupBucket m_seconds[ROLLUP_SECOND_BUCKETS];
+static DMAMEM RollupBucket m_minutes[ROLLUP_MINUTE_BUCKETS];
+static DMAMEM RollupBucket m_hours[ROLLUP_HOUR_BUCKETS];
+static RollupBucket * const m_ring[NUM_ROLLUP_LEVELS] = {m_seconds, m_minutes, m_hours};
+static uint32_t m_finished[NUM_ROLLUP_LEVELS] = {};     // Buckets ever finished; the newest is one before
+static RollupAccumulator m_open[NUM_ROLLUP_LEVELS] = {};
+
+
+/*
+Drops every bucket, open and finished.
+*/
+void rollup_reset() {
+    for (int level = 0; level < NUM_ROLLUP_LEVELS; level++) {
+        m_finished[level] = 0;
+        m_open[level].frames = 0;
+    }
+}
+
+
+/*
+Bucket width of a resolution, milliseconds.
+*/
+unsigned long rollup_width_ms(RollupLevel level) {
+    return m_width_ms[level];
+}
+
+
+/*
+Empties an accumulator and opens it at start.
+*/
+static void open_bucket(RollupAccumulator *open, unsigned long long start) {
+    open->start = start;
+    open->frames = 0;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        open->count[channel] = 0;
+        open->sum[channel] = 0;
+        open->min[channel] = INFINITY;
+        open->max[channel] = -INFINITY;
+    }
+}
+
+
+static void merge_bucket(int level, const RollupAccumulator *in);
+
+/*
+Finishes the open bucket of a level into its ring, overwriting the oldest once
+the ring is full, and merges it into the next level's.
+*/
+static void finish_bucket(int level) {
+    const RollupAccumulator *open = &m_open[level];
+    RollupBucket *bucket = &m_ring[level][m_finished[level] % m_size[level]];
+    bucket->start = open->start;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        uint32_t count = open->count[channel];
+        bucket->count[channel] = count;
+        bucket->mean[channel] = (count > 0) ? (float)(open->sum[channel] / count) : NAN;
+        bucket->min[channel] = (count > 0) ? open->min[channel] : NAN;
+        bucket->max[channel] = (count > 0) ? open->max[channel] : NAN;
+    }
+    m_finished[level]++;
+    if (level + 1 < NUM_ROLLUP_LEVELS) {
+        merge_bucket(level + 1, open);
+    }
+}
+
+
+/*
+Merges the readings of an accumulator into the open bucket of a level,
+finishing that bucket first if in starts outside it.
+*/
+static void merge_bucket(int level, const RollupAccumulator *in) {
+    RollupAccumulator *open = &m_open[level];
+    unsigned long long start = in->start - (in->start % m_width_ms[level]);
+    if (open->frames > 0 && open->start != start) {
+        finish_bucket(level);
+        open->frames = 0;
+    }
+    if (open->frames == 0) {
+        open_bucket(open, start);
+    }
+    open->frames += in->frames;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (in->count[channel] == 0) {
+            continue;
+        }
+        open->count[channel] += in->count[channel];
+        open->sum[channel] += in->sum[channel];
+        if (in->min[channel] < open->min[channel]) {
+            open->min[channel] = in->min[channel];
+        }
+        if (in->max[channel] > open->max[channel]) {
+            open->max[channel] = in->max[channel];
+        }
+    }
+}
+
+
+/*
+Adds the readings of channels from a converted frame, stamped with timestamp
+(UTC milliseconds, 0 if the time service hasn't synced yet), to the rollups.
+*/
+void rollup_add_frame(const ThermistorValue *temps, ChannelMask channels, unsigned long long timestamp) {
+    if (timestamp == 0) {
+        return;
+    }
+    // The frame as a bucket of its own
+    static RollupAccumulator frame;
+    open_bucket(&frame, timestamp);
+    frame.frames = 1;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (!(channels & CHANNEL_BIT(channel)) || thermistor_null(temps[channel])) {
+            continue;
+        }
+        float temp = thermistor_celsius(temps[channel]);
+        frame.count[channel] = 1;
+        frame.sum[channel] = temp;
+        frame.min[channel] = temp;
+        frame.max[channel] = temp;
+    }
+    merge_bucket(ROLLUP_SECOND, &frame);
+}
+
+
+/*
+Finds up to max_buckets finished buckets of a resolution that start in
+[from, to], oldest first. Returns the number found.
+*/
+unsigned int rollup_find(RollupLevel level, unsigned long long from, unsigned long long to,
+                         const RollupBucket **buckets, unsigned int max_buckets) {
+    uint32_t held = (m_finished[level] < m_size[level]) ? m_finished[level] : m_size[level];
+    unsigned int found = 0;
+    for (uint32_t i = m_finished[level] - held; i != m_finished[level] && found < max_buckets; i++) {
+        const RollupBucket *bucket = &m_ring[level][i % m_size[level]];
+        if (bucket->start >= from && bucket->start <= to) {
+            buckets[found++] = bucket;
+        }
+    }
+    return found;
+}
+
+#endif
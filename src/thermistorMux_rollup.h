@@ -0,0 +1,68 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_rollup.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Multi-resolution rollups of every thermistor: the mean, min and max
+ * over each second, minute and hour, kept in a ring per resolution for hosts
+ * that only want trends to query (Node Control/Rollup Query).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_ROLLUP_H
+#define THERMISTORMUX_ROLLUP_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Resolutions, finest first; each is built from the one before
+enum RollupLevel {
+    ROLLUP_SECOND,
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    NUM_ROLLUP_LEVELS
+};
+
+// Buckets kept at each resolution: a minute of seconds, an hour of minutes
+// and a day of hours by default, ~75 KB of DMAMEM with 32 channels
+#ifndef ROLLUP_SECOND_BUCKETS
+#define ROLLUP_SECOND_BUCKETS  60
+#endif
+#ifndef ROLLUP_MINUTE_BUCKETS
+#define ROLLUP_MINUTE_BUCKETS  60
+#endif
+#ifndef ROLLUP_HOUR_BUCKETS
+#define ROLLUP_HOUR_BUCKETS    24
+#endif
+
+// One finished bucket, °C. A channel with no readings in it (disabled or
+// faulted throughout) has a count of 0 and NAN for the rest.
+struct RollupBucket {
+    unsigned long long start;                   // UTC milliseconds
+    uint32_t count[NUMBER_OF_THERMISTORS];      // Readings in the bucket
+    float mean[NUMBER_OF_THERMISTORS];
+    float min[NUMBER_OF_THERMISTORS];
+    float max[NUMBER_OF_THERMISTORS];
+};
+
+void rollup_reset();
+void rollup_add_frame(const ThermistorValue *temps, ChannelMask channels, unsigned long long timestamp);
+unsigned long rollup_width_ms(RollupLevel level);
+unsigned int rollup_find(RollupLevel level, unsigned long long from, unsigned long long to,
+                         const RollupBucket **buckets, unsigned int max_buckets);
+
+#endif
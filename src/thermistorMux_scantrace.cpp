@@ -0,0 +1,172 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scantrace.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Scan timing trace capture and dump.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_scantrace.h"
+
+#ifdef USE_SCAN_TRACE
+
+#include "thermistorMux_stream.h"
+#include "thermistorMux_hardware.h"
+
+// Events per trace datagram, within a 1500 byte Ethernet MTU
+#define SCAN_TRACE_DATAGRAM_EVENTS  ((STREAM_MAX_DATAGRAM - SCAN_TRACE_HEADER_SIZE) / SCAN_TRACE_EVENT_SIZE)
+// Longest serial line, "trace,2047,4294967295,3,3,32\n"
+#define SCAN_TRACE_LINE_SIZE        40
+
+struct ScanTraceEvent {
+    uint32_t cycles;
+    uint8_t type;
+    uint8_t adc;
+    uint8_t slot;
+};
+
+static DMAMEM ScanTraceEvent m_events[SCAN_TRACE_EVENTS];
+static volatile bool m_capturing = false;
+static volatile uint32_t m_count = 0;       // Events reserved in the capture
+static bool m_dumping = false;
+static uint32_t m_dump_next = 0;            // Next event to dump
+static uint8_t m_datagram[STREAM_MAX_DATAGRAM];
+
+
+static void put_u16(uint8_t *buffer, uint16_t value) {
+    buffer[0] = value & 0xFF;
+    buffer[1] = value >> 8;
+}
+
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buffer[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+
+/*
+Starts a new capture, discarding the last one. It ends by itself once
+SCAN_TRACE_EVENTS events have been recorded.
+*/
+void scan_trace_arm() {
+    m_capturing = false;
+    m_dumping = false;
+    m_count = 0;
+    m_capturing = true;
+}
+
+
+bool scan_trace_capturing() {
+    return m_capturing;
+}
+
+
+/*
+Records one event stamped with the cycle counter. Safe from any interrupt; each
+event's slot is reserved with an exclusive load/store increment.
+*/
+void scan_trace_record(ScanTraceEventType type, int adc, int slot) {
+    if (!m_capturing) {
+        return;
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT;
+    uint32_t index = __atomic_fetch_add(&m_count, 1, __ATOMIC_RELAXED);
+    if (index >= SCAN_TRACE_EVENTS) {
+        m_capturing = false;
+        return;
+    }
+    ScanTraceEvent *event = &m_events[index];
+    event->cycles = cycles;
+    event->type = type;
+    event->adc = adc;
+    event->slot = slot;
+}
+
+
+/*
+Ends the capture and starts dumping it from scan_trace_poll(). Returns false if
+there is nothing captured.
+*/
+bool scan_trace_dump() {
+    m_capturing = false;
+    if (m_count == 0) {
+        return false;
+    }
+    if (m_count > SCAN_TRACE_EVENTS) {
+        m_count = SCAN_TRACE_EVENTS;
+    }
+    m_dump_next = 0;
+    m_dumping = true;
+    return true;
+}
+
+
+bool scan_trace_dumping() {
+    return m_dumping;
+}
+
+
+/*
+Sends the next part of a dump: one datagram to the raw stream host if the stream
+is set up, otherwise as many lines as the serial port takes without blocking.
+Call from loop().
+*/
+void scan_trace_poll() {
+    if (!m_dumping) {
+        return;
+    }
+    uint32_t total = m_count;
+    if (stream_enabled()) {
+        uint32_t events = min(total - m_dump_next, (uint32_t)SCAN_TRACE_DATAGRAM_EVENTS);
+        memcpy(m_datagram, "TMXT", 4);
+        m_datagram[4] = SCAN_TRACE_VERSION;
+        m_datagram[5] = get_hardware_id();
+        put_u16(&m_datagram[6], events);
+        put_u32(&m_datagram[8], m_dump_next);
+        put_u32(&m_datagram[12], total);
+        for (uint32_t i = 0; i < events; i++) {
+            const ScanTraceEvent *event = &m_events[m_dump_next + i];
+            uint8_t *out = &m_datagram[SCAN_TRACE_HEADER_SIZE + i * SCAN_TRACE_EVENT_SIZE];
+            put_u32(out, event->cycles);
+            out[4] = event->type;
+            out[5] = event->adc;
+            out[6] = event->slot;
+            out[7] = 0;
+        }
+        // A datagram that can't be sent is skipped; the event index shows the gap
+        stream_send(m_datagram, SCAN_TRACE_HEADER_SIZE + events * SCAN_TRACE_EVENT_SIZE);
+        m_dump_next += events;
+    }
+    else {
+        char line[SCAN_TRACE_LINE_SIZE];
+        while (m_dump_next < total && Serial.availableForWrite() >= SCAN_TRACE_LINE_SIZE) {
+            const ScanTraceEvent *event = &m_events[m_dump_next];
+            int length = snprintf(line, sizeof(line), "trace,%lu,%lu,%u,%u,%u\n", (unsigned long)m_dump_next,
+                                  (unsigned long)event->cycles, event->type, event->adc, event->slot);
+            Serial.write((const uint8_t *)line, length);
+            m_dump_next++;
+        }
+    }
+    if (m_dump_next >= total) {
+        m_dumping = false;
+    }
+}
+
+#endif
@@ -0,0 +1,76 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scantrace.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Scan timing trace. Once armed, the scan engine's interrupts record a
+ * cycle counter stamp for every data-ready edge, MOSFET switch-on, conversion
+ * start and completed readout until the ring is full. The capture is then
+ * dumped over the raw stream's UDP socket, or the serial port when no stream is
+ * set up, to measure scan-to-scan jitter and settling margins.
+ *
+ * Trace datagram layout (little-endian):
+ *   0  char[4]  "TMXT"
+ *   4  uint8    SCAN_TRACE_VERSION
+ *   5  uint8    node (hardware) ID
+ *   6  uint16   number of events
+ *   8  uint32   index in the capture of the first event
+ *   12 uint32   events in the whole capture
+ *   16 events, SCAN_TRACE_EVENT_SIZE bytes each:
+ *      0 uint32 ARM_DWT_CYCCNT
+ *      4 uint8  event (ScanTraceEventType)
+ *      5 uint8  ADC
+ *      6 uint8  scan slot (thermistor index, or NUMBER_OF_THERMISTORS for the ADC temperature)
+ *      7 uint8  0
+ * On the serial port each event is a line "trace,<index>,<cycles>,<event>,<adc>,<slot>".
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SCANTRACE_H
+#define THERMISTORMUX_SCANTRACE_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Events held by one capture
+#define SCAN_TRACE_EVENTS       2048
+
+#define SCAN_TRACE_VERSION      1
+#define SCAN_TRACE_HEADER_SIZE  16
+#define SCAN_TRACE_EVENT_SIZE   8
+
+enum ScanTraceEventType {
+    SCAN_TRACE_DATA_READY,          // Data-ready interrupt taken
+    SCAN_TRACE_MOSFET_ON,           // Slot's MOSFET switched on
+    SCAN_TRACE_CONVERSION_START,    // Conversion started by the firmware (in SCAN mode only the first)
+    SCAN_TRACE_READOUT_DONE         // Sample read out of ADCDATA and stored
+};
+
+void scan_trace_arm();
+bool scan_trace_capturing();
+void scan_trace_record(ScanTraceEventType type, int adc, int slot);
+bool scan_trace_dump();
+bool scan_trace_dumping();
+void scan_trace_poll();
+
+#ifdef USE_SCAN_TRACE
+#define SCAN_TRACE( type, adc, slot ) scan_trace_record((type), (adc), (slot))
+#else
+#define SCAN_TRACE( type, adc, slot ) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,230 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scheduler.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Cooperative run-to-completion task scheduler. Tasks run in the order they
+ * were added, each one to completion, so no task needs locking against another;
+ * only the ISRs preempt them. A task that needs to wait must return and be run
+ * again rather than block, which keeps command and broker latency bounded by the
+ * longest single task instead of the longest loop() iteration. When no task is
+ * ready the core sleeps in WFI until the next interrupt.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-25
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_scheduler.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_watchdog.h"
+
+#define CYCLES_PER_US (F_CPU_ACTUAL / 1000000)
+
+//Sleeps the core until an interrupt is pending, even with interrupts masked.
+//The host simulator supplies its own.
+#ifndef __WFI
+#define __WFI() asm volatile("wfi")
+#endif
+
+struct Task {
+    const char *name;
+    TaskFunction function;
+    uint32_t period_us;             // TASK_EVENT_ONLY for signalled tasks
+    uint32_t budget_us;             // Longest expected run, 0 for no limit
+    uint32_t next_run_us;           // micros() at which a periodic task is due
+    volatile bool signalled;
+    unsigned long runs;
+    unsigned long overruns;         // Runs that took longer than budget_us
+    uint32_t max_cycles;            // Longest run since the last report
+    uint64_t busy_cycles;           // Time spent in the task since the last report
+};
+
+static Task m_tasks[MAX_TASKS];
+static int m_num_tasks = 0;
+static uint32_t m_window_start = 0;    // ARM_DWT_CYCCNT at the last report
+static uint64_t m_idle_cycles = 0;     // Time spent asleep since start-up
+
+
+/*
+Adds a task to the end of the run order. period_us is how often a periodic task
+runs (0 for every scheduler pass) or TASK_EVENT_ONLY for a task that only runs
+after scheduler_signal(). Any task can also be signalled to run early. Returns the
+task handle, or -1 if the table is full.
+*/
+int scheduler_add_task(const char *name, TaskFunction function, uint32_t period_us,
+                       uint32_t budget_us) {
+    if (m_num_tasks >= MAX_TASKS || function == NULL) {
+        LogError("Can't add task %s.", name);
+        return -1;
+    }
+    Task *task = &m_tasks[m_num_tasks];
+    memset(task, 0, sizeof(Task));
+    task->name = name;
+    task->function = function;
+    task->period_us = period_us;
+    task->budget_us = budget_us;
+    task->next_run_us = micros();
+    if (m_num_tasks == 0) {
+        m_window_start = ARM_DWT_CYCCNT;
+    }
+    return m_num_tasks++;
+}
+
+
+/*
+Marks a task to run on the next scheduler pass. Safe to call from an ISR. A task
+signalled by one that runs before it in the table runs in the same pass.
+*/
+void scheduler_signal(int task) {
+    if (task < 0 || task >= m_num_tasks) {
+        return;
+    }
+    m_tasks[task].signalled = true;
+}
+
+
+/*
+Returns true if a periodic task's period has elapsed, and moves its next run on by
+one period. A task that has fallen more than a period behind is rescheduled from
+now rather than run repeatedly to catch up.
+*/
+static bool task_due(Task *task, uint32_t now) {
+    if (task->period_us == TASK_EVENT_ONLY || (int32_t)(now - task->next_run_us) < 0) {
+        return false;
+    }
+    task->next_run_us += task->period_us;
+    if ((int32_t)(now - task->next_run_us) >= 0) {
+        task->next_run_us = now + task->period_us;
+    }
+    return true;
+}
+
+
+/*
+Returns true if any task would run on a scheduler pass started now: one that has
+been signalled, runs every pass, or whose period has elapsed.
+*/
+static bool task_ready(uint32_t now) {
+    for (int i = 0; i < m_num_tasks; i++) {
+        Task *task = &m_tasks[i];
+        if (task->signalled || task->period_us == 0 ||
+            (task->period_us != TASK_EVENT_ONLY && (int32_t)(now - task->next_run_us) >= 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+Sleeps until the next interrupt if no task is ready. The check is made with
+interrupts masked so a signal from an ISR can't slip in before the WFI; a pending
+interrupt still wakes the core, and its handler runs once they are unmasked. The
+wake-ups are the ADC data-ready and DMA interrupts, the Ethernet interrupt, the
+interval timers and the 1 ms SysTick, so a periodic task is at most that late.
+*/
+static void idle() {
+    __disable_irq();
+    if (!task_ready(micros())) {
+        uint32_t start = ARM_DWT_CYCCNT;
+        __WFI();
+        m_idle_cycles += ARM_DWT_CYCCNT - start;
+    }
+    __enable_irq();
+}
+
+
+/*
+One scheduler pass, called from loop(). Runs every task that is due or signalled,
+in table order, services the watchdog, then sleeps if none is ready for the next
+pass.
+*/
+void scheduler_run() {
+    for (int i = 0; i < m_num_tasks; i++) {
+        Task *task = &m_tasks[i];
+        bool due = task_due(task, micros());
+        if (task->signalled) {
+            task->signalled = false;
+            due = true;
+        }
+        if (!due) {
+            continue;
+        }
+
+        uint32_t start = ARM_DWT_CYCCNT;
+        task->function();
+        uint32_t cycles = ARM_DWT_CYCCNT - start;
+
+        task->runs++;
+        task->busy_cycles += cycles;
+        if (cycles > task->max_cycles) {
+            task->max_cycles = cycles;
+        }
+        if (task->budget_us != 0 && cycles > task->budget_us * CYCLES_PER_US) {
+            task->overruns++;
+        }
+    }
+    watchdog_service();
+    idle();
+}
+
+
+/*
+Time the core has spent asleep in scheduler passes since start-up, in CPU cycles.
+Everything else, tasks, interrupts and the scheduler itself, is busy time.
+*/
+uint64_t scheduler_idle_cycles() {
+    return m_idle_cycles;
+}
+
+
+/*
+Fraction of the time since the last report spent running tasks.
+*/
+float scheduler_utilization() {
+    uint32_t elapsed = ARM_DWT_CYCCNT - m_window_start;
+    if (elapsed == 0) {
+        return 0;
+    }
+    uint64_t busy = 0;
+    for (int i = 0; i < m_num_tasks; i++) {
+        busy += m_tasks[i].busy_cycles;
+    }
+    return (float)busy / elapsed;
+}
+
+
+/*
+Logs the run count, share of the CPU, longest run and budget overruns of each task,
+then starts a new measurement window. Must be called more often than the cycle
+counter wraps (~7 s at 600 MHz) for the shares to be right.
+*/
+void scheduler_report() {
+    uint32_t elapsed = ARM_DWT_CYCCNT - m_window_start;
+    if (elapsed == 0) {
+        return;
+    }
+    LogInfo("Scheduler: %0.1f%% busy", scheduler_utilization() * 100);
+    for (int i = 0; i < m_num_tasks; i++) {
+        Task *task = &m_tasks[i];
+        LogInfo("  %-12s runs %lu, %0.2f%% CPU, max %lu us, %lu over %lu us budget", task->name,
+                task->runs, (float)task->busy_cycles * 100 / elapsed,
+                (unsigned long)(task->max_cycles / CYCLES_PER_US), task->overruns,
+                (unsigned long)task->budget_us);
+        task->max_cycles = 0;
+        task->busy_cycles = 0;
+    }
+    m_window_start = ARM_DWT_CYCCNT;
+}
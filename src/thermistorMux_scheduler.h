@@ -0,0 +1,47 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_scheduler.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Cooperative run-to-completion task scheduler definitions and function
+ * prototypes. loop() hands control to scheduler_run(), which runs each task that
+ * is due (periodic) or has been signalled (event), sleeps when none is, and keeps
+ * per-task and idle timing so CPU use can be read from one place.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-25
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SCHEDULER_H
+#define THERMISTORMUX_SCHEDULER_H
+
+#include <stdint.h>
+
+#define MAX_TASKS 16
+
+// Period for a task that only runs when signalled
+#define TASK_EVENT_ONLY 0xFFFFFFFF
+
+typedef void (*TaskFunction)(void);
+
+int scheduler_add_task(const char *name, TaskFunction function, uint32_t period_us,
+                       uint32_t budget_us);
+void scheduler_signal(int task);
+void scheduler_run();
+void scheduler_report();
+float scheduler_utilization();
+uint64_t scheduler_idle_cycles();
+
+#endif
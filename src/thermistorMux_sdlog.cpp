@@ -0,0 +1,334 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_sdlog.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief SD card frame log: segment ring, writer task and file rollover.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_sdlog.h"
+
+#ifdef USE_SD_LOG
+
+#include <SdFat.h>
+#include <string.h>
+#include "thermistorMux_crc.h"
+#include "thermistorMux_hardware.h"
+#include "thermistorMux_log.h"
+#include "thermistorMux_time.h"
+
+#define SDLOG_MAGIC_HEADER  "TMXH"
+#define SDLOG_MAGIC_DATA    "TMXD"
+#define SDLOG_MAGIC_INDEX   "TMXI"
+#define SDLOG_CRC_OFFSET    12
+// Highest log file number tried, TMX99999.BIN
+#define SDLOG_MAX_FILES     99999
+
+struct SdLogSegment {
+    uint16_t frames;
+    uint16_t used;                  // Bytes filled, header included
+    uint64_t first;
+    uint64_t last;
+    // Segment image; the header is filled in as it is written out
+    uint8_t data[SDLOG_SEGMENT_SIZE] __attribute__((aligned(32)));
+};
+
+// Filled by sdlog_add_frame() at m_fill, written out from m_write. Both run from
+// scheduler tasks, so need no locking.
+static DMAMEM SdLogSegment m_ring[SDLOG_RING_SEGMENTS];
+static unsigned int m_fill = 0;
+static unsigned int m_write = 0;
+static unsigned int m_full = 0;                 // Segments waiting to be written
+static DeltaCoder m_coder;                      // Coding state of the segment at m_fill
+static uint8_t m_index[SDLOG_SEGMENT_SIZE] __attribute__((aligned(32)));
+static unsigned int m_index_entries = 0;
+
+static SdFs m_sd;
+static FsFile m_file;
+static bool m_card_ready = false;
+static bool m_enabled = false;
+static uint32_t m_file_number = 0;
+static uint32_t m_segment = 0;                  // Next segment of the open file
+static char m_file_name[SDLOG_FILE_NAME_SIZE] = "";
+static uint32_t m_dropped = 0;
+
+
+/*
+Stamps a segment's header and CRC. The Teensy is little-endian, so fields are
+copied straight from the native types.
+*/
+static void seal_segment(uint8_t *segment, const char *magic, uint16_t count,
+                         uint64_t first, uint64_t last) {
+    const uint8_t columns = SLOTS_PER_PASS;
+    const uint8_t version = SDLOG_VERSION;
+    const uint32_t zero = 0;
+    memcpy(&segment[0], magic, 4);
+    memcpy(&segment[4], &m_segment, 4);
+    memcpy(&segment[8], &count, 2);
+    segment[10] = columns;
+    segment[11] = version;
+    memcpy(&segment[SDLOG_CRC_OFFSET], &zero, 4);
+    memcpy(&segment[16], &first, 8);
+    memcpy(&segment[24], &last, 8);
+    uint32_t crc = crc32(segment, SDLOG_SEGMENT_SIZE);
+    memcpy(&segment[SDLOG_CRC_OFFSET], &crc, 4);
+}
+
+
+/*
+Stops logging after a card failure, discarding the buffered frames.
+*/
+static void stop_logging() {
+    m_enabled = false;
+    // Written and empty segments have no frames
+    for (int i = 0; i < SDLOG_RING_SEGMENTS; i++) {
+        m_dropped += m_ring[i].frames;
+        m_ring[i].frames = 0;
+    }
+    m_fill = m_write = m_full = 0;
+}
+
+
+/*
+Writes one segment at the end of the open file. Closes the file and stops
+logging if the card fails.
+*/
+static bool write_segment(const uint8_t *segment) {
+    if (m_file.write(segment, SDLOG_SEGMENT_SIZE) != SDLOG_SEGMENT_SIZE) {
+        LogError("SD log write failed in %s, logging stopped.", m_file_name);
+        m_file.close();
+        m_card_ready = false;
+        stop_logging();
+        return false;
+    }
+    m_segment++;
+    return true;
+}
+
+
+/*
+Opens the next unused log file, pre-allocated to its full length so its clusters
+are contiguous, and writes its header segment.
+*/
+static bool open_log_file() {
+    if (!m_card_ready) {
+        if (!m_sd.begin(SdioConfig(FIFO_SDIO))) {
+            LogError("No SD card for the frame log.");
+            return false;
+        }
+        m_card_ready = true;
+    }
+    do {
+        if (++m_file_number > SDLOG_MAX_FILES) {
+            LogError("SD card has no free log file names.");
+            return false;
+        }
+        snprintf(m_file_name, sizeof(m_file_name), "TMX%05u.BIN", (unsigned int)m_file_number);
+    } while (m_sd.exists(m_file_name));
+
+    if (!m_file.open(&m_sd, m_file_name, O_RDWR | O_CREAT | O_EXCL)) {
+        LogError("Can't create SD log file %s.", m_file_name);
+        return false;
+    }
+    if (!m_file.preAllocate((uint64_t)SDLOG_FILE_SEGMENTS * SDLOG_SEGMENT_SIZE)) {
+        LogError("Can't pre-allocate SD log file %s; card full or fragmented.", m_file_name);
+        m_file.close();
+        m_sd.remove(m_file_name);
+        return false;
+    }
+    m_segment = 0;
+    m_index_entries = 0;
+
+    // The file header is built in the index buffer, which is free until the
+    // first index segment.
+    uint8_t *header = m_index;
+    memset(header, 0, SDLOG_SEGMENT_SIZE);
+    const uint32_t segment_size = SDLOG_SEGMENT_SIZE;
+    const uint16_t frames = 0;
+    const uint16_t interval = SDLOG_INDEX_INTERVAL;
+    const uint32_t file_segments = SDLOG_FILE_SEGMENTS;
+    memcpy(&header[32], &segment_size, 4);
+    memcpy(&header[36], &frames, 2);
+    memcpy(&header[38], &interval, 2);
+    header[40] = get_hardware_id();
+    strncpy((char *)&header[48], THERMISTOR_MUX_VERSION, 31);
+    memcpy(&header[80], &file_segments, 4);
+    seal_segment(header, SDLOG_MAGIC_HEADER, 0, 0, 0);
+    if (!write_segment(header)) {
+        return false;
+    }
+    LogInfo("SD log file %s opened.", m_file_name);
+    return true;
+}
+
+
+/*
+Trims the pre-allocated tail off the open file and closes it.
+*/
+static void close_log_file() {
+    if (!m_file.isOpen()) {
+        return;
+    }
+    m_file.truncate((uint64_t)m_segment * SDLOG_SEGMENT_SIZE);
+    m_file.close();
+    LogInfo("SD log file %s closed, %lu segments.", m_file_name, (unsigned long)m_segment);
+}
+
+
+/*
+Writes the next segment due: an index segment on each SDLOG_INDEX_INTERVAL
+boundary, otherwise the oldest full data segment. Rolls over to a new file
+when this one is full.
+*/
+static void write_next_segment() {
+    if (m_segment >= SDLOG_FILE_SEGMENTS) {
+        close_log_file();
+        if (!open_log_file()) {
+            stop_logging();
+            return;
+        }
+    }
+    if (m_segment % SDLOG_INDEX_INTERVAL == 0) {
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if (m_index_entries > 0) {
+            memcpy(&first, &m_index[SDLOG_HEADER_SIZE + 8], 8);
+            memcpy(&last, &m_index[SDLOG_HEADER_SIZE + (m_index_entries - 1) * SDLOG_INDEX_ENTRY_SIZE + 16], 8);
+        }
+        seal_segment(m_index, SDLOG_MAGIC_INDEX, m_index_entries, first, last);
+        m_index_entries = 0;
+        write_segment(m_index);
+        return;
+    }
+
+    SdLogSegment *segment = &m_ring[m_write];
+    if (m_index_entries == 0) {
+        memset(m_index, 0, SDLOG_SEGMENT_SIZE);
+    }
+    uint8_t *entry = &m_index[SDLOG_HEADER_SIZE + m_index_entries * SDLOG_INDEX_ENTRY_SIZE];
+    memcpy(&entry[0], &m_segment, 4);
+    memcpy(&entry[4], &segment->frames, 2);
+    memcpy(&entry[8], &segment->first, 8);
+    memcpy(&entry[16], &segment->last, 8);
+    seal_segment(segment->data, SDLOG_MAGIC_DATA, segment->frames, segment->first, segment->last);
+    if (!write_segment(segment->data)) {
+        return;
+    }
+    m_index_entries++;
+    segment->frames = 0;
+    m_write = (m_write + 1) % SDLOG_RING_SEGMENTS;
+    m_full--;
+}
+
+
+/*
+Starts logging to a new file, or stops after writing out what is buffered. The
+card work itself is done by sdlog_poll().
+*/
+void sdlog_set_enabled(bool enabled) {
+    if (enabled && !m_enabled && !m_file.isOpen()) {
+        // DMAMEM isn't zeroed at startup
+        for (int i = 0; i < SDLOG_RING_SEGMENTS; i++) {
+            m_ring[i].frames = 0;
+        }
+        m_fill = m_write = m_full = 0;
+    }
+    m_enabled = enabled;
+}
+
+
+bool sdlog_enabled() {
+    return m_enabled;
+}
+
+
+/*
+Copies one frame's averaged codes (SLOTS_PER_PASS of them) into the ring, timed
+by the cycle counter stamp of its last sample. The frame is dropped and counted
+if the card has fallen a whole ring behind.
+*/
+void sdlog_add_frame(const uint32_t *codes, uint64_t cycles) {
+    if (!m_enabled) {
+        return;
+    }
+    if (m_full == SDLOG_RING_SEGMENTS) {
+        m_dropped++;
+        return;
+    }
+    uint64_t time = time_cycles_to_utc_micros(cycles);
+    if (time == 0) {
+        time = (cycles / (F_CPU_ACTUAL / 1000000)) | SDLOG_LOCAL_TIME;
+    }
+    SdLogSegment *segment = &m_ring[m_fill];
+    if (segment->frames == 0) {
+        memset(segment->data, 0, SDLOG_SEGMENT_SIZE);
+        segment->first = time;
+        segment->used = SDLOG_HEADER_SIZE;
+        delta_reset(&m_coder, time);
+    }
+    segment->last = time;
+    uint8_t *out = &segment->data[segment->used];
+    size_t n = delta_put_time(&m_coder, out, time);
+    for (int slot = 0; slot < SLOTS_PER_PASS; slot++) {
+        n += delta_put_code(&m_coder, &out[n], slot, codes[slot]);
+    }
+    segment->used += n;
+    if (++segment->frames == UINT16_MAX || SDLOG_SEGMENT_SIZE - segment->used < SDLOG_MAX_FRAME_SIZE) {
+        m_fill = (m_fill + 1) % SDLOG_RING_SEGMENTS;
+        m_full++;
+    }
+}
+
+
+/*
+The sdlog task: opens or closes the log file as logging is turned on or off, and
+writes at most one segment per call.
+*/
+void sdlog_poll() {
+    if (m_enabled && !m_file.isOpen()) {
+        if (!open_log_file()) {
+            stop_logging();
+        }
+        return;
+    }
+    if (m_full > 0) {
+        write_next_segment();
+        return;
+    }
+    if (!m_enabled && m_file.isOpen()) {
+        // Write out the part-filled segment before closing
+        if (m_ring[m_fill].frames > 0) {
+            m_fill = (m_fill + 1) % SDLOG_RING_SEGMENTS;
+            m_full++;
+            return;
+        }
+        close_log_file();
+    }
+}
+
+
+const char *sdlog_file_name() {
+    return m_file.isOpen() ? m_file_name : "";
+}
+
+
+uint32_t sdlog_dropped() {
+    return m_dropped;
+}
+
+#endif
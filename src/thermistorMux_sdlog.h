@@ -0,0 +1,101 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_sdlog.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Binary log of the raw frames to the Teensy 4.1 SD card (USE_SD_LOG). Each
+ * frame's averaged ADC codes and timestamp are copied into a RAM ring of
+ * segments, and the sdlog task writes whole segments out to a pre-allocated,
+ * contiguous file, so the card only ever sees aligned multi-sector writes.
+ *
+ * A log file is a sequence of SDLOG_SEGMENT_SIZE byte segments (little-endian):
+ * a file header, then data segments, with an index segment at every multiple of
+ * SDLOG_INDEX_INTERVAL listing the data segments before it. Every segment
+ * starts with:
+ *   0  char[4]  "TMXH" (file header), "TMXD" (data) or "TMXI" (index)
+ *   4  uint32   segment number in the file
+ *   8  uint16   frames (data) or entries (index), 0 in the file header
+ *   10 uint8    columns of codes, SLOTS_PER_PASS
+ *   11 uint8    SDLOG_VERSION
+ *   12 uint32   CRC-32 of the whole segment, taken with this field zero
+ *   16 uint64   time of the first frame
+ *   24 uint64   time of the last frame
+ * Data segments hold frames from offset 32, delta coded (see
+ * thermistorMux_delta.h) from the segment's first time: per frame, a varint time
+ * as the change in step from the last frame, then a varint code per scan slot
+ * (the thermistors, then the ADC temperature) less that slot's last code in the
+ * segment. A segment takes frames while SDLOG_MAX_FRAME_SIZE bytes are left, so
+ * steady channels fit many more in than the SDLOG_MIN_FRAMES of varying ones.
+ * Frame times are UTC microseconds, or microseconds since boot with bit 63 set
+ * while the time service is unsynced. The file header body holds the segment
+ * size (uint32), frames per segment (0, as they vary) and index interval
+ * (uint16 each), node ID (uint8), what the columns hold (uint8, SDLOG_COLUMNS_*),
+ * the firmware version (char[32] at 48) and the file length in segments (uint32
+ * at 80). The node logs raw codes; ingest/ingest.cpp writes the same format on a
+ * host from the NDATA, in milli-degrees. Index entries are 24
+ * bytes: segment (uint32), frames (uint16), 0 (uint16), first and last time.
+ * Test_Environment/sdlog_reader.py reads the files.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SDLOG_H
+#define THERMISTORMUX_SDLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_delta.h"
+
+#define SDLOG_VERSION               2
+// Eight 512 byte sectors, written with one call
+#define SDLOG_SEGMENT_SIZE          4096
+#define SDLOG_HEADER_SIZE           32
+// Longest coding of a frame, and the fewest frames a data segment holds
+#define SDLOG_MAX_FRAME_SIZE        (DELTA_MAX_TIME_SIZE + SLOTS_PER_PASS * DELTA_MAX_CODE_SIZE)
+#define SDLOG_MIN_FRAMES            ((SDLOG_SEGMENT_SIZE - SDLOG_HEADER_SIZE) / SDLOG_MAX_FRAME_SIZE)
+// One index segment per this many segments (127 data segments)
+#define SDLOG_INDEX_INTERVAL        128
+#define SDLOG_INDEX_ENTRY_SIZE      24
+// Pre-allocated length of each file, 64 MB; logging goes on in the next file
+#define SDLOG_FILE_SEGMENTS         16384
+// Segments buffered in RAM while the card is busy
+#define SDLOG_RING_SEGMENTS         8
+// Bit 63 of a frame time: microseconds since boot rather than UTC
+#define SDLOG_LOCAL_TIME            (1ULL << 63)
+#define SDLOG_FILE_NAME_SIZE        20
+// What the columns of a file hold, byte 41 of its header
+#define SDLOG_COLUMNS_CODES         0       // Raw ADC codes
+#define SDLOG_COLUMNS_MDEG          1       // Signed milli-degrees, SDLOG_NO_VALUE where unknown
+#define SDLOG_NO_VALUE              INT32_MIN
+
+#if SDLOG_MIN_FRAMES < 1
+#error "Too many scan slots for one SD log segment."
+#endif
+
+#if (SDLOG_INDEX_INTERVAL - 1) * SDLOG_INDEX_ENTRY_SIZE > SDLOG_SEGMENT_SIZE - SDLOG_HEADER_SIZE
+#error "SD log index segment too small for SDLOG_INDEX_INTERVAL."
+#endif
+
+void sdlog_set_enabled(bool enabled);
+bool sdlog_enabled();
+void sdlog_add_frame(const uint32_t *codes, uint64_t cycles);
+void sdlog_poll();
+const char *sdlog_file_name();
+uint32_t sdlog_dropped();
+
+#endif
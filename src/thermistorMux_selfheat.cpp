@@ -0,0 +1,199 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_selfheat.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Excitation duty and self-heating. A thermistor only dissipates while
+ * its MOSFET is on; the scan engine books those times (see
+ * acquisition_excitation_cycles()), and every SELFHEAT_BUCKET_MS the time each
+ * thermistor was on is put in a bucket of a SELFHEAT_WINDOW_MS window. Its
+ * duty is the window's on time over the window's length.
+ * With a duty limit, a thermistor over it is put in the scan engine's rest mask,
+ * leaving it out of the passes, until its duty is back under
+ * SELFHEAT_RESUME_FRACTION of the limit. If that rests every thermistor an ADC
+ * scans, the caller holds the scan (see acquisition_resting()).
+ * With a dissipation constant K, each reading is corrected by its modeled rise,
+ * duty * P / K: the thermal time constant of a thermistor, seconds, is far
+ * longer than a pass, so it sees the average of the power P it dissipates while
+ * on, P = V (supply - V) / divider at its code.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_selfheat.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_time.h"
+#include "command_ADC.h"
+#include <Arduino.h>
+
+#define CYCLES_PER_US (F_CPU_ACTUAL / 1000000)
+
+// On time of each thermistor in each bucket of the window, and the buckets'
+// lengths, us: a bucket is under 2^32 us
+static uint32_t m_bucket_on_us[SELFHEAT_BUCKETS][NUMBER_OF_THERMISTORS];
+static uint32_t m_bucket_us[SELFHEAT_BUCKETS];
+static uint32_t m_window_on_us[NUMBER_OF_THERMISTORS];
+static uint32_t m_window_us = 0;
+static int m_bucket = 0;
+
+// acquisition_excitation_cycles() and time_cycles64() at the last update
+static uint32_t m_last_excitation[NUMBER_OF_THERMISTORS];
+static uint64_t m_last_cycles = 0;
+
+static float m_duty[NUMBER_OF_THERMISTORS];
+static float m_max_duty = 0;            // 0 = no limit
+static float m_dissipation = 0;         // W/°C; 0 = no correction
+static ChannelMask m_resting = 0;
+
+
+/*
+Moves the window on a bucket with the excitation since the last call, works out
+each thermistor's duty and rests those over the limit. Call every
+SELFHEAT_BUCKET_MS from loop(); a bucket longer than a cycle counter wrap (~7 s)
+comes out short.
+*/
+void selfheat_update() {
+    uint64_t now = time_cycles64();
+    if (m_last_cycles == 0) {
+        for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+            m_last_excitation[channel] = acquisition_excitation_cycles(channel);
+        }
+        m_last_cycles = now;
+        return;
+    }
+    m_bucket = (m_bucket + 1) % SELFHEAT_BUCKETS;
+    uint32_t length = (uint32_t)((now - m_last_cycles) / CYCLES_PER_US);
+    m_last_cycles = now;
+    m_window_us = m_window_us - m_bucket_us[m_bucket] + length;
+    m_bucket_us[m_bucket] = length;
+
+    ChannelMask resting = m_resting;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        uint32_t excitation = acquisition_excitation_cycles(channel);
+        uint32_t on_us = (excitation - m_last_excitation[channel]) / CYCLES_PER_US;
+        m_last_excitation[channel] = excitation;
+        if (on_us > length) {
+            on_us = length;
+        }
+        m_window_on_us[channel] = m_window_on_us[channel] - m_bucket_on_us[m_bucket][channel] + on_us;
+        m_bucket_on_us[m_bucket][channel] = on_us;
+        float duty = m_window_us > 0 ? (float)m_window_on_us[channel] / m_window_us : 0;
+        m_duty[channel] = duty;
+
+        ChannelMask bit = CHANNEL_BIT(channel);
+        if (m_max_duty <= 0) {
+            resting &= ~bit;
+        }
+        else if (duty > m_max_duty) {
+            resting |= bit;
+        }
+        else if (duty < m_max_duty * SELFHEAT_RESUME_FRACTION) {
+            resting &= ~bit;
+        }
+    }
+    if (resting != m_resting) {
+        m_resting = resting;
+        acquisition_set_rest_mask(resting);
+    }
+}
+
+
+/*
+Thermistor channel's excitation duty over the last window, 0 to 1.
+*/
+float selfheat_duty(int channel) {
+    if (channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return 0;
+    }
+    return m_duty[channel];
+}
+
+
+/*
+The highest excitation duty of any thermistor over the last window.
+*/
+float selfheat_peak_duty() {
+    float peak = 0;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (m_duty[channel] > peak) {
+            peak = m_duty[channel];
+        }
+    }
+    return peak;
+}
+
+
+/*
+Thermistors resting from excitation, bit n for thermistor n.
+*/
+ChannelMask selfheat_resting() {
+    return m_resting;
+}
+
+
+/*
+Limits each thermistor's excitation duty to duty (0 to 1), or with 0 lets it
+run. Takes effect from the next update. Returns false for an out of range
+value.
+*/
+bool selfheat_set_max_duty(float duty) {
+    if (!(duty >= 0 && duty <= 1)) {
+        return false;
+    }
+    m_max_duty = duty;
+    return true;
+}
+
+
+float selfheat_max_duty() {
+    return m_max_duty;
+}
+
+
+/*
+Corrects every reading by its modeled self-heating with the thermistors'
+dissipation constant, mW/°C (a bead thermistor in still air is around 1), or
+with 0 leaves them as they are. Returns false for an out of range value.
+*/
+bool selfheat_set_dissipation(float mw_per_c) {
+    if (!(mw_per_c >= 0 && mw_per_c <= SELFHEAT_MAX_DISSIPATION)) {
+        return false;
+    }
+    m_dissipation = mw_per_c / 1000;
+    return true;
+}
+
+
+float selfheat_dissipation() {
+    return m_dissipation * 1000;
+}
+
+
+bool selfheat_correcting() {
+    return m_dissipation > 0;
+}
+
+
+/*
+Modeled self-heating of thermistor channel, °C, for its averaged code raw_data
+and its duty: what to take off its reading. 0 without a dissipation constant.
+*/
+float selfheat_rise(int channel, uint32_t raw_data) {
+    if (m_dissipation <= 0 || channel < 0 || channel >= NUMBER_OF_THERMISTORS) {
+        return 0;
+    }
+    return (m_duty[channel] * channel_excitation_watts(channel, raw_data)) / m_dissipation;
+}
@@ -0,0 +1,56 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_selfheat.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Self-heating definitions and function prototypes. Each thermistor's
+ * excitation duty is tracked over a sliding window; one over the limit rests
+ * from the scan until it is back under, and the readings can be corrected by a
+ * modeled self-heating rise.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SELFHEAT_H
+#define THERMISTORMUX_SELFHEAT_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// The duty window, moved on a bucket at a time by selfheat_update()
+#define SELFHEAT_WINDOW_MS   10000
+#define SELFHEAT_BUCKETS     10
+#define SELFHEAT_BUCKET_MS   (SELFHEAT_WINDOW_MS / SELFHEAT_BUCKETS)
+
+// A resting thermistor is scanned again once its duty is under this part of the
+// limit, so it doesn't flip in and out of the scan every bucket
+#define SELFHEAT_RESUME_FRACTION  0.9f
+
+// Most a dissipation constant can be set to, mW/°C
+#define SELFHEAT_MAX_DISSIPATION  1000.0f
+
+void selfheat_update();
+float selfheat_duty(int channel);
+float selfheat_peak_duty();
+ChannelMask selfheat_resting();
+bool selfheat_set_max_duty(float duty);
+float selfheat_max_duty();
+bool selfheat_set_dissipation(float mw_per_c);
+float selfheat_dissipation();
+bool selfheat_correcting();
+float selfheat_rise(int channel, uint32_t raw_data);
+
+#endif
@@ -0,0 +1,102 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_selftest.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief The performance self test's timings of the SPI bus and the conversion
+ * kernel, and its results as text. The profile sweep is run by
+ * thermistor_Mux.cpp, the encode and broker timings by the network module.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_selftest.h"
+#include <Arduino.h>
+#include <math.h>
+#include <stdio.h>
+#include "command_ADC.h"
+
+// Results are summed in here so the compiler can't drop the work
+static volatile float m_sink;
+
+
+/*
+Microseconds an ADC's configuration register read-back (a command byte and 18
+register bytes) takes on the bus at ADC_SPI_clock(), the fastest of
+SELF_TEST_RUNS on each ADC. Needs the scan engine stopped, which would
+otherwise hold the bus.
+*/
+float selftest_spi_read_us() {
+    uint32_t best = UINT32_MAX;
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+        for (int run = 0; run < SELF_TEST_RUNS; run++) {
+            uint32_t start = ARM_DWT_CYCCNT;
+            ADC_device(adc)->verify_registers();
+            uint32_t cycles = ARM_DWT_CYCCNT - start;
+            if (cycles < best) {
+                best = cycles;
+            }
+        }
+    }
+    return best * 1e6f / F_CPU_ACTUAL;
+}
+
+
+/*
+Cycles convert_thermistor_block() takes per thermistor to convert codes (a
+frame's worth, e.g. the last frame's), with the calibration in use, the fastest
+of SELF_TEST_RUNS.
+*/
+float selftest_kernel_cycles(const uint32_t *codes) {
+    float temps[NUMBER_OF_THERMISTORS];
+    convert_thermistor_block(codes, temps, NUMBER_OF_THERMISTORS);     // Warm the caches
+    uint32_t best = UINT32_MAX;
+    for (int run = 0; run < SELF_TEST_RUNS; run++) {
+        uint32_t start = ARM_DWT_CYCCNT;
+        convert_thermistor_block(codes, temps, NUMBER_OF_THERMISTORS);
+        uint32_t cycles = ARM_DWT_CYCCNT - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    m_sink = temps[0];
+    return (float)best / NUMBER_OF_THERMISTORS;
+}
+
+
+/*
+Each profile's conversion rate as "name measured/nominal", comma separated,
+e.g. "60Hz 59.6/60.0, 50Hz 49.7/50.0"; "-" for a profile that didn't convert.
+*/
+void selftest_format_rates(const SelfTestResults *results, char *text, size_t size) {
+    size_t used = 0;
+    text[0] = '\0';
+    for (unsigned int n = 0; n < results->profiles && used < size; n++) {
+        const ADCProfile *profile = ADC_profile(n);
+        int length;
+        if (isnan(results->rate[n])) {
+            length = snprintf(&text[used], size - used, "%s%s -/%.1f", n > 0 ? ", " : "", profile->name,
+                              results->nominal[n]);
+        } else {
+            length = snprintf(&text[used], size - used, "%s%s %.1f/%.1f", n > 0 ? ", " : "", profile->name,
+                              results->rate[n], results->nominal[n]);
+        }
+        if (length < 0) {
+            break;
+        }
+        used += length;
+    }
+}
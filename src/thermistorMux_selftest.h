@@ -0,0 +1,67 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_selftest.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Performance self test definitions and function prototypes. Node
+ * Control/Self Test times, on the unit in the field, what sets how fast it
+ * can go: the conversion rate the scan reaches with each acquisition profile,
+ * an ADC register read over the SPI bus, the conversion kernel, encoding an
+ * NDATA, and a message's round trip through the broker. The results come
+ * back as the Self Test metrics.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SELFTEST_H
+#define THERMISTORMUX_SELFTEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Acquisition profiles timed, the first ones ADC_profile() has
+#define SELF_TEST_MAX_PROFILES      8
+// Each profile scans for at least this long, and for SELF_TEST_CONVERSIONS of
+// its conversions per ADC however long they take
+#define SELF_TEST_WINDOW_MS         1000
+#define SELF_TEST_CONVERSIONS       8
+// A profile whose first conversion doesn't come in this long, or that takes
+// this long for its conversions, is recorded as not converting
+#define SELF_TEST_PROFILE_TIMEOUT_MS 5000
+// Register reads, kernel runs and encodes timed; the fastest is kept, so
+// interrupts landing in one don't count
+#define SELF_TEST_RUNS              16
+// Longest wait for the broker to send the loopback message back
+#define SELF_TEST_LOOPBACK_TIMEOUT_MS 5000
+// "Fast 600.0/600.0, " per profile
+#define SELF_TEST_RATES_SIZE        (SELF_TEST_MAX_PROFILES * 24)
+
+struct SelfTestResults {
+    unsigned int profiles;                      // Profiles timed
+    float rate[SELF_TEST_MAX_PROFILES];         // Conversions per second per ADC while scanning, NAN if none came
+    float nominal[SELF_TEST_MAX_PROFILES];      // As the profile's conversion time alone gives
+    float spi_read_us;                          // Configuration register read-back, at ADC_SPI_clock()
+    float kernel_cycles;                        // convert_thermistor_block(), per thermistor
+    float encode_us;                            // A frame's NDATA, built and encoded
+    float broker_ms;                            // Loopback round trip, NAN if it didn't come back
+};
+
+float selftest_spi_read_us();
+float selftest_kernel_cycles(const uint32_t *codes);
+void selftest_format_rates(const SelfTestResults *results, char *text, size_t size);
+
+#endif
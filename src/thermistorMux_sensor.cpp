@@ -0,0 +1,296 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_sensor.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Sensor models. The models and each channel's choice among them are
+ * kept in EEPROM as one CRC32-checked record after the calibration slots, and
+ * handed to the conversion (see set_sensor_model() in command_ADC.cpp), which
+ * builds each model's lookup table as it is assigned.
+ *
+ * Models are written as text, separated by ';', one of
+ *      beta R_o B [divider [vref [supply]]]
+ *      sh R_o A B C [divider [vref [supply]]]
+ * with resistances in ohms and voltages in volts; omitted divider values are
+ * the board's. The channels are a ',' separated list of model numbers from 0,
+ * thermistor 1 first; channels left off use model 0. With no models set every
+ * channel uses the build's thermistor (thermistor_10K or thermistor_2K).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_sensor.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_log.h"
+#include <EEPROM.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SENSOR_MAGIC   0x4D53       // "SM"
+#define SENSOR_VERSION 1
+
+struct SensorRecord {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t channels;                       // NUMBER_OF_THERMISTORS when saved
+    uint8_t models;                         // Models set, 0 for the build's thermistor only
+    SensorModel model[SENSOR_MAX_MODELS];
+    uint8_t channel_model[NUMBER_OF_THERMISTORS];
+    uint32_t crc;                           // CRC32 of everything before it
+};
+
+#define SENSOR_EE_BASE CALSTORE_EE_END
+static_assert(sizeof(SensorRecord) <= SENSOR_EE_SIZE, "sensor record runs into the records after it");
+static_assert(SENSOR_EE_END <= E2END + 1, "sensor models don't fit in EEPROM");
+
+static SensorRecord m_record;           // The models and channels in use
+
+
+/*
+True if every channel uses a model the record has; model 0 always exists, as the
+build's thermistor when no models are set.
+*/
+static bool record_valid_channels(const SensorRecord *record) {
+    int models = (record->models > 0) ? record->models : 1;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (record->channel_model[channel] >= models) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool record_valid(const SensorRecord *record) {
+    if (record->magic != SENSOR_MAGIC || record->version != SENSOR_VERSION ||
+        record->channels != NUMBER_OF_THERMISTORS || record->models > SENSOR_MAX_MODELS ||
+        record->crc != crc32(record, offsetof(SensorRecord, crc))) {
+        return false;
+    }
+    for (int model = 0; model < record->models; model++) {
+        if (!sensor_model_valid(&record->model[model])) {
+            return false;
+        }
+    }
+    return record_valid_channels(record);
+}
+
+
+static void clear_record(SensorRecord *record) {
+    memset(record, 0, sizeof(*record));
+    record->magic = SENSOR_MAGIC;
+    record->version = SENSOR_VERSION;
+    record->channels = NUMBER_OF_THERMISTORS;
+}
+
+
+/*
+Hands the record's models and channels to the conversion. They were validated
+already, so none is refused.
+*/
+static void apply_record(const SensorRecord *record) {
+    for (int model = 0; model < SENSOR_MAX_MODELS; model++) {
+        set_sensor_model(model, (model < record->models) ? &record->model[model] : NULL);
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        set_channel_sensor(channel, record->channel_model[channel]);
+    }
+}
+
+
+static bool save_record(SensorRecord *record) {
+    record->crc = crc32(record, offsetof(SensorRecord, crc));
+    EEPROM.put(SENSOR_EE_BASE, *record);
+    SensorRecord check;
+    EEPROM.get(SENSOR_EE_BASE, check);
+    if (memcmp(&check, record, sizeof(check)) != 0) {
+        LogError("Sensor models didn't save to EEPROM.");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+Restores the sensor models saved by sensor_set_models() and
+sensor_set_channels(). Erased or corrupt EEPROM leaves every channel on the
+build's thermistor.
+*/
+void sensor_load() {
+    EEPROM.get(SENSOR_EE_BASE, m_record);
+    if (!record_valid(&m_record)) {
+        if (m_record.magic == SENSOR_MAGIC) {
+            LogWarn("Sensor models in EEPROM are corrupt; using the default thermistor.");
+        }
+        clear_record(&m_record);
+    }
+    apply_record(&m_record);
+}
+
+
+/*
+Parses one model, as in the file comment, into sensor.
+*/
+static bool parse_model(const char *text, SensorModel *sensor) {
+    const SensorModel *board = default_sensor_model();
+    char equation[6];
+    float values[7];
+    int used = 0;
+    int fields = sscanf(text, " %5s %f %f %f %f %f %f %f %n", equation, &values[0], &values[1], &values[2],
+                        &values[3], &values[4], &values[5], &values[6], &used);
+    if (fields < 3 || (used > 0 && text[used] != '\0')) {
+        return false;
+    }
+    int count = fields - 1;
+    int coefficients;
+    memset(sensor, 0, sizeof(*sensor));
+    sensor->nominal_ohms = values[0];
+    if (strcmp(equation, "beta") == 0) {
+        sensor->equation = SENSOR_BETA;
+        sensor->beta = values[1];
+        coefficients = 2;
+    }
+    else if (strcmp(equation, "sh") == 0 && count >= 4) {
+        sensor->equation = SENSOR_STEINHART_HART;
+        sensor->a = values[1];
+        sensor->b = values[2];
+        sensor->c = values[3];
+        coefficients = 4;
+    }
+    else {
+        return false;
+    }
+    if (count > coefficients + 3) {
+        return false;
+    }
+    sensor->divider_ohms = (count > coefficients) ? values[coefficients] : board->divider_ohms;
+    sensor->vref = (count > coefficients + 1) ? values[coefficients + 1] : board->vref;
+    sensor->supply = (count > coefficients + 2) ? values[coefficients + 2] : board->supply;
+    return sensor_model_valid(sensor);
+}
+
+
+/*
+Sets and saves the sensor models from text (see the file comment); "" goes back
+to the build's thermistor. Returns false, changing nothing, if a model is invalid
+or a channel uses a model that would no longer exist.
+*/
+bool sensor_set_models(const char *text) {
+    SensorRecord record = m_record;
+    record.models = 0;
+    memset(record.model, 0, sizeof(record.model));
+    char model_text[SENSOR_MODELS_TEXT_SIZE];
+    const char *pos = text;
+    while (*pos != '\0') {
+        const char *end = strchr(pos, ';');
+        size_t length = (end != NULL) ? (size_t)(end - pos) : strlen(pos);
+        if (record.models >= SENSOR_MAX_MODELS || length >= sizeof(model_text)) {
+            return false;
+        }
+        memcpy(model_text, pos, length);
+        model_text[length] = '\0';
+        if (!parse_model(model_text, &record.model[record.models])) {
+            return false;
+        }
+        record.models++;
+        pos += length + ((end != NULL) ? 1 : 0);
+    }
+    if (!record_valid_channels(&record)) {
+        return false;
+    }
+    m_record = record;
+    apply_record(&m_record);
+    return save_record(&m_record);
+}
+
+
+/*
+Sets and saves each channel's model from a ',' separated list (see the file
+comment); "" puts every channel on model 0. Returns false, changing nothing, for
+an unknown model or more entries than channels.
+*/
+bool sensor_set_channels(const char *text) {
+    SensorRecord record = m_record;
+    memset(record.channel_model, 0, sizeof(record.channel_model));
+    const char *pos = text;
+    int channel = 0;
+    while (*pos != '\0') {
+        unsigned int model;
+        int used = 0;
+        if (channel >= NUMBER_OF_THERMISTORS || sscanf(pos, " %u %n", &model, &used) != 1 || model > 255) {
+            return false;
+        }
+        record.channel_model[channel++] = (uint8_t)model;
+        pos += used;
+        if (*pos == ',') {
+            pos++;
+        }
+        else if (*pos != '\0') {
+            return false;
+        }
+    }
+    if (!record_valid_channels(&record)) {
+        return false;
+    }
+    m_record = record;
+    apply_record(&m_record);
+    return save_record(&m_record);
+}
+
+
+/*
+Writes the models in use as sensor_set_models() takes them.
+*/
+void sensor_format_models(char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int model = 0; model < m_record.models && length < size; model++) {
+        const SensorModel *sensor = &m_record.model[model];
+        const char *separator = (model > 0) ? ";" : "";
+        int written;
+        if (sensor->equation == SENSOR_BETA) {
+            written = snprintf(buffer + length, size - length, "%sbeta %.7g %.7g %.7g %.7g %.7g", separator,
+                               sensor->nominal_ohms, sensor->beta, sensor->divider_ohms, sensor->vref,
+                               sensor->supply);
+        }
+        else {
+            written = snprintf(buffer + length, size - length, "%ssh %.7g %.7g %.7g %.7g %.7g %.7g %.7g", separator,
+                               sensor->nominal_ohms, sensor->a, sensor->b, sensor->c, sensor->divider_ohms,
+                               sensor->vref, sensor->supply);
+        }
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+    }
+}
+
+
+/*
+Writes each channel's model as sensor_set_channels() takes them.
+*/
+void sensor_format_channels(char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS && length < size; channel++) {
+        int written = snprintf(buffer + length, size - length, (channel > 0) ? ",%u" : "%u",
+                               m_record.channel_model[channel]);
+        if (written < 0) {
+            break;
+        }
+        length += (size_t)written;
+    }
+}
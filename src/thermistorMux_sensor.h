@@ -0,0 +1,48 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_sensor.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Sensor model definitions and function prototypes. Each thermistor
+ * channel converts with one of up to SENSOR_MAX_MODELS thermistor descriptors,
+ * set by NCMD and kept in EEPROM.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SENSOR_H
+#define THERMISTORMUX_SENSOR_H
+
+#include <stddef.h>
+#include "thermistorMux_global.h"
+#include "command_ADC.h"
+#include "thermistorMux_calstore.h"
+
+// Longest text of sensor_format_models() and sensor_format_channels()
+#define SENSOR_MODELS_TEXT_SIZE   (SENSOR_MAX_MODELS * 128)
+#define SENSOR_CHANNELS_TEXT_SIZE (NUMBER_OF_THERMISTORS * 2)
+
+// EEPROM kept for the sensor record, after the calibration slots
+#define SENSOR_EE_SIZE  256
+#define SENSOR_EE_END   (CALSTORE_EE_END + SENSOR_EE_SIZE)
+
+void sensor_load();
+bool sensor_set_models(const char *text);
+bool sensor_set_channels(const char *text);
+void sensor_format_models(char *buffer, size_t size);
+void sensor_format_channels(char *buffer, size_t size);
+
+#endif
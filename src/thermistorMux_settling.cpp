@@ -0,0 +1,157 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+/**
+ * @file thermistorMux_settling.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Settling time characterization. A sweep runs one step per candidate
+ * delay, longest first: a block of passes at the candidate between two blocks
+ * at SETTLING_REFERENCE_US, each closing reference opening the next step. The
+ * candidate is compared with the mean of the references either side, so a
+ * steady drift of the temperatures cancels out. A channel's safe delay is the
+ * shortest candidate that it, and every longer one, read the same as the
+ * reference at.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_settling.h"
+#include <math.h>
+#include <string.h>
+#include "command_ADC.h"
+
+static_assert(SETTLING_STEPS <= 16, "steps don't fit the step masks");
+
+static const unsigned int m_candidates[SETTLING_STEPS] = SETTLING_CANDIDATES_US;
+
+// Mean and variance (Welford) of one block's uncalibrated temperatures
+struct BlockStats {
+    unsigned int count;
+    double mean;
+    double m2;
+};
+
+struct ChannelSettling {
+    BlockStats blocks[NUM_SETTLING_BLOCKS];
+    uint16_t judged;        // Steps with enough passes in both blocks, bit n for step n
+    uint16_t failed;        // Of those, steps whose candidate read off the reference
+};
+
+static ChannelSettling m_channels[NUMBER_OF_THERMISTORS];
+
+
+/*
+Forgets every step judged, for a new sweep.
+*/
+void settling_start() {
+    memset(m_channels, 0, sizeof(m_channels));
+}
+
+
+/*
+Delay tried at step (0 to SETTLING_STEPS - 1), microseconds.
+*/
+unsigned int settling_candidate_us(int step) {
+    return m_candidates[step];
+}
+
+
+static void add_value(BlockStats *block, double value) {
+    block->count++;
+    double delta = value - block->mean;
+    block->mean += delta / block->count;
+    block->m2 += delta * (value - block->mean);
+}
+
+
+/*
+Adds a pass of raw ADCDATA to a block of the step running, for the thermistors in channels (bit n for thermistor n). Saturated
+codes are left out.
+*/
+void settling_add_pass(const uint32_t *raw_data, ChannelMask channels, SettlingBlock block) {
+    float temps[NUMBER_OF_THERMISTORS];
+    convert_thermistor_block(raw_data, temps, NUMBER_OF_THERMISTORS);
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (!(channels & CHANNEL_BIT(channel))) {
+            continue;
+        }
+        float temp = temps[channel];
+        if (isnan(temp)) {
+            continue;
+        }
+        add_value(&m_channels[channel].blocks[block], temp);
+    }
+}
+
+
+// Squared standard error of a block's mean
+static double mean_variance(const BlockStats *block) {
+    return block->m2 / (block->count - 1) / block->count;
+}
+
+
+/*
+Judges step's candidate against the mean of its references for every channel
+with two or more passes in each of the three blocks. The closing reference
+becomes the next step's opening one.
+*/
+void settling_end_step(int step) {
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        ChannelSettling *settling = &m_channels[channel];
+        const BlockStats *before = &settling->blocks[SETTLING_BEFORE];
+        const BlockStats *candidate = &settling->blocks[SETTLING_CANDIDATE];
+        const BlockStats *after = &settling->blocks[SETTLING_AFTER];
+        if (before->count >= 2 && candidate->count >= 2 && after->count >= 2) {
+            double reference = (before->mean + after->mean) / 2;
+            double error = sqrt(mean_variance(candidate) + (mean_variance(before) + mean_variance(after)) / 4);
+            double limit = SETTLING_SIGMAS * error;
+            if (limit < SETTLING_TOLERANCE_C) {
+                limit = SETTLING_TOLERANCE_C;
+            }
+            settling->judged |= 1u << step;
+            if (fabs(candidate->mean - reference) > limit) {
+                settling->failed |= 1u << step;
+            }
+        }
+        settling->blocks[SETTLING_BEFORE] = settling->blocks[SETTLING_AFTER];
+        memset(&settling->blocks[SETTLING_CANDIDATE], 0, sizeof(BlockStats));
+        memset(&settling->blocks[SETTLING_AFTER], 0, sizeof(BlockStats));
+    }
+}
+
+
+/*
+Shortest delay a channel settles in, with SETTLING_MARGIN_PERCENT added; the
+reference delay if even the longest candidate read off it. Returns false,
+leaving us alone, if no step was judged for the channel.
+*/
+bool settling_result_us(int channel, unsigned int *us) {
+    const ChannelSettling *settling = &m_channels[channel];
+    if (settling->judged == 0) {
+        return false;
+    }
+    unsigned int safe = SETTLING_REFERENCE_US;
+    for (int step = 0; step < SETTLING_STEPS; step++) {
+        uint16_t bit = 1u << step;
+        if (!(settling->judged & bit) || (settling->failed & bit)) {
+            break;
+        }
+        safe = m_candidates[step];
+    }
+    safe += (safe * SETTLING_MARGIN_PERCENT + 99) / 100;
+    *us = safe < SETTLING_REFERENCE_US ? safe : SETTLING_REFERENCE_US;
+    return true;
+}
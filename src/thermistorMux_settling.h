@@ -0,0 +1,64 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_settling.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Settling time characterization definitions and function prototypes.
+ * Passes taken with a shortened delay between the MOSFET switch and the
+ * conversion start are compared, per channel, with passes taken just before and
+ * just after with a long-settled reference delay.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_SETTLING_H
+#define THERMISTORMUX_SETTLING_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Delay every candidate is compared against, microseconds: long enough for any
+// input the board's front end is meant to take
+#define SETTLING_REFERENCE_US   5000
+// Candidate delays, longest first. In SCAN mode the delay is also the scan
+// timer the sample handler runs in, so the shortest leaves it some time.
+#define SETTLING_CANDIDATES_US  {2000, 1500, 1000, 750, 500, 400, 300, 200, 150, 100, 50, 25}
+#define SETTLING_STEPS          12
+// Passes in each reference and each candidate block
+#define SETTLING_BLOCK_PASSES   8
+// A candidate is safe for a channel while its mean is within this of the
+// reference's, or within SETTLING_SIGMAS standard errors of their difference if
+// that's more, so noise alone doesn't fail it
+#define SETTLING_TOLERANCE_C    0.002f
+#define SETTLING_SIGMAS         4.0f
+// Added to the shortest safe candidate, percent
+#define SETTLING_MARGIN_PERCENT 25
+
+// The blocks of passes a step is judged on
+enum SettlingBlock {
+    SETTLING_BEFORE,        // Reference, shared with the step before
+    SETTLING_CANDIDATE,
+    SETTLING_AFTER,         // Reference, shared with the step after
+    NUM_SETTLING_BLOCKS
+};
+
+void settling_start();
+unsigned int settling_candidate_us(int step);
+void settling_add_pass(const uint32_t *raw_data, ChannelMask channels, SettlingBlock block);
+void settling_end_step(int step);
+bool settling_result_us(int channel, unsigned int *us);
+
+#endif
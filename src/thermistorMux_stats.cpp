@@ -0,0 +1,135 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stats.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel running statistics. Each converted frame updates every
+ * channel's count, min, max and Welford mean and variance in constant time;
+ * after stats_window() frames the results are kept for publishing and a new
+ * window starts. Null readings are left out.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_stats.h"
+
+#ifdef USE_CHANNEL_STATS
+
+// Running statistics of one channel over the current window
+struct RunningStats {
+    uint32_t count;
+    float min;
+    float max;
+    double mean;
+    double m2;          // Sum of squared differences from the mean
+};
+
+static unsigned int m_window = 0;       // Frames per window; 0 = off
+static unsigned int m_frames = 0;       // Frames in the current window
+static RunningStats m_running[NUMBER_OF_THERMISTORS];
+static ChannelStats m_result[NUMBER_OF_THERMISTORS] = {};
+
+
+/*
+Frames per statistics window; 0 when the statistics are off.
+*/
+unsigned int stats_window() {
+    return m_window;
+}
+
+
+/*
+Sets the frames per statistics window (1..STATS_MAX_WINDOW), or turns the
+statistics off with 0, and starts a new window. Returns false for an out of
+range value.
+*/
+bool stats_set_window(unsigned int frames) {
+    if (frames > STATS_MAX_WINDOW) {
+        return false;
+    }
+    m_window = frames;
+    stats_reset();
+    return true;
+}
+
+
+/*
+Drops the current window, e.g. when the scan settings change mid-window, and
+starts a new one.
+*/
+void stats_reset() {
+    m_frames = 0;
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        m_running[channel] = {0, INFINITY, -INFINITY, 0, 0};
+    }
+}
+
+
+/*
+Adds the readings of channels from a converted frame to the window. Returns
+true when it completes the window, with the results in stats_result() until the
+next window completes.
+*/
+bool stats_add_frame(const ThermistorValue *temps, ChannelMask channels) {
+    if (m_window == 0) {
+        return false;
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        if (!(channels & CHANNEL_BIT(channel)) || thermistor_null(temps[channel])) {
+            continue;
+        }
+        float temp = thermistor_celsius(temps[channel]);
+        RunningStats *stats = &m_running[channel];
+        stats->count++;
+        double delta = temp - stats->mean;
+        stats->mean += delta / stats->count;
+        stats->m2 += delta * (temp - stats->mean);
+        if (temp < stats->min) {
+            stats->min = temp;
+        }
+        if (temp > stats->max) {
+            stats->max = temp;
+        }
+    }
+    if (++m_frames < m_window) {
+        return false;
+    }
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        const RunningStats *stats = &m_running[channel];
+        ChannelStats *result = &m_result[channel];
+        result->count = stats->count;
+        if (stats->count == 0) {
+            result->min = result->max = result->mean = result->stddev = NAN;
+            continue;
+        }
+        result->min = stats->min;
+        result->max = stats->max;
+        result->mean = (float)stats->mean;
+        result->stddev = (stats->count > 1) ? (float)sqrt(stats->m2 / (stats->count - 1)) : 0;
+    }
+    stats_reset();
+    return true;
+}
+
+
+/*
+Statistics of channel over the last completed window.
+*/
+const ChannelStats * stats_result(int channel) {
+    return &m_result[channel];
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stats.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Per-channel running statistics over a window of frames, for the
+ * Statistics metric group.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_STATS_H
+#define THERMISTORMUX_STATS_H
+
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Longest statistics window, frames
+#define STATS_MAX_WINDOW  1000000
+
+// One channel's statistics over a finished window, °C. With no readings (the
+// channel was disabled or faulted throughout) count is 0 and the rest are NAN.
+struct ChannelStats {
+    uint32_t count;
+    float min;
+    float max;
+    float mean;
+    float stddev;
+};
+
+unsigned int stats_window();
+bool stats_set_window(unsigned int frames);
+void stats_reset();
+bool stats_add_frame(const ThermistorValue *temps, ChannelMask channels);
+const ChannelStats * stats_result(int channel);
+
+#endif
@@ -0,0 +1,219 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stream.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Raw sample UDP stream. Samples are packed into one buffer while the
+ * other waits to be sent, so the scan side never waits on the network; a sample
+ * that arrives while both are full is counted as dropped. Each datagram is
+ * delta coded on its own, so a lost one doesn't spoil the next.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-27
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_stream.h"
+
+#ifdef USE_RAW_STREAM
+
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_channels.h"
+#include "thermistorMux_hardware.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_global.h"
+#include <NativeEthernet.h>
+
+// Local port the datagrams are sent from
+#define STREAM_LOCAL_PORT   5001
+// A partly filled datagram is sent once its first sample is this old
+#define STREAM_FLUSH_MS     20
+
+struct StreamBuffer {
+    uint8_t data[STREAM_MAX_DATAGRAM];
+    unsigned int samples;
+    size_t used;                    // Bytes filled, header included
+    uint64_t first_cycles;
+    uint64_t first_utc_micros;
+    uint64_t first_frame;           // Frame the first sample goes into
+    unsigned long first_ms;
+};
+
+static EthernetUDP m_udp;
+static bool m_enabled = false;
+static IPAddress m_host;
+static uint16_t m_port = 0;
+
+static StreamBuffer m_buffer[2];
+static int m_filling = 0;           // Buffer samples are added to
+static DeltaCoder m_coder;          // Coding state of the filling buffer
+static bool m_ready = false;        // The other buffer is waiting to be sent
+static uint32_t m_seq = 0;
+static unsigned long m_dropped = 0;
+
+
+static void put_u16(uint8_t *buffer, uint16_t value) {
+    buffer[0] = value & 0xFF;
+    buffer[1] = value >> 8;
+}
+
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buffer[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+
+static void put_u64(uint8_t *buffer, uint64_t value) {
+    put_u32(buffer, (uint32_t)value);
+    put_u32(buffer + 4, (uint32_t)(value >> 32));
+}
+
+
+/*
+Starts streaming every sample to host:port. Returns false if no UDP socket
+could be opened.
+*/
+bool stream_start(IPAddress host, uint16_t port) {
+    stream_stop();
+    if (m_udp.begin(STREAM_LOCAL_PORT) != 1) {
+        return false;
+    }
+    m_host = host;
+    m_port = port;
+    m_buffer[0].samples = 0;
+    m_buffer[1].samples = 0;
+    m_filling = 0;
+    m_ready = false;
+    m_enabled = true;
+    acquisition_set_sample_hook(stream_sample);
+    return true;
+}
+
+
+void stream_stop() {
+    if (!m_enabled) {
+        return;
+    }
+    acquisition_set_sample_hook(NULL);
+    m_enabled = false;
+    m_udp.stop();
+}
+
+
+bool stream_enabled() {
+    return m_enabled;
+}
+
+
+/*
+Hands the filling buffer over to be sent, if the other one is free.
+*/
+static bool stream_swap() {
+    if (m_ready) {
+        return false;
+    }
+    m_ready = true;
+    m_filling ^= 1;
+    m_buffer[m_filling].samples = 0;
+    return true;
+}
+
+
+/*
+Adds one sample to the datagram being filled. Registered with the scan engine
+while streaming.
+*/
+void stream_sample(const ADCSample *sample) {
+    StreamBuffer *buffer = &m_buffer[m_filling];
+    if (buffer->samples > 0 && buffer->used + STREAM_MAX_SAMPLE_SIZE > STREAM_MAX_DATAGRAM && !stream_swap()) {
+        m_dropped++;
+        return;
+    }
+    buffer = &m_buffer[m_filling];
+    if (buffer->samples == 0) {
+        buffer->first_cycles = sample->cycles;
+        buffer->first_utc_micros = time_cycles_to_utc_micros(sample->cycles);
+        // The frame being taken is the one after the last converted
+        buffer->first_frame = Channels.frame_number + 1;
+        buffer->first_ms = millis();
+        buffer->used = STREAM_HEADER_SIZE;
+        delta_reset(&m_coder, 0);
+    }
+    uint64_t offset_us = (sample->cycles - buffer->first_cycles) / (F_CPU_ACTUAL / 1000000);
+    uint8_t *out = &buffer->data[buffer->used];
+    size_t n = 0;
+    out[n++] = sample->channel;
+    n += delta_put_code(&m_coder, &out[n], sample->channel, sample->raw_data & 0xFFFFFF);
+    n += delta_put_time(&m_coder, &out[n], offset_us);
+    buffer->used += n;
+    buffer->samples++;
+}
+
+
+/*
+Sends the datagram waiting to go out, and hands over a partly filled one once
+it has waited STREAM_FLUSH_MS. Sends at most one datagram per call.
+*/
+void stream_poll() {
+    if (!m_enabled) {
+        return;
+    }
+    StreamBuffer *filling = &m_buffer[m_filling];
+    if (!m_ready && filling->samples > 0 && (millis() - filling->first_ms) >= STREAM_FLUSH_MS) {
+        stream_swap();
+    }
+    if (!m_ready) {
+        return;
+    }
+
+    StreamBuffer *buffer = &m_buffer[m_filling ^ 1];
+    uint8_t *header = buffer->data;
+    memcpy(header, "TMXS", 4);
+    header[4] = STREAM_VERSION;
+    header[5] = get_hardware_id();
+    put_u16(&header[6], buffer->samples);
+    put_u32(&header[8], m_seq++);
+    put_u64(&header[12], buffer->first_utc_micros);
+    put_u32(&header[20], m_dropped);
+    put_u64(&header[24], buffer->first_frame);
+
+    // A datagram that can't be sent is lost; the sequence number shows the gap
+    if (m_udp.beginPacket(m_host, m_port) == 1) {
+        m_udp.write(buffer->data, buffer->used);
+        m_udp.endPacket();
+    }
+    m_ready = false;
+}
+
+
+/*
+Sends a datagram of another kind (e.g. a scan trace dump) to the stream host.
+Returns false if the stream isn't set up or the datagram couldn't be sent.
+*/
+bool stream_send(const uint8_t *data, size_t length) {
+    if (!m_enabled || m_udp.beginPacket(m_host, m_port) != 1) {
+        return false;
+    }
+    m_udp.write(data, length);
+    return m_udp.endPacket() == 1;
+}
+
+
+unsigned long stream_dropped() {
+    return m_dropped;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_stream.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Raw sample UDP stream definitions and function prototypes. Every
+ * conversion the scan engine hands to loop() is packed into UDP datagrams for
+ * diagnostic captures, separately from the averaged Sparkplug frames.
+ *
+ * Datagram layout (little-endian):
+ *   0  char[4]  "TMXS"
+ *   4  uint8    STREAM_VERSION
+ *   5  uint8    node (hardware) ID
+ *   6  uint16   number of samples
+ *   8  uint32   datagram sequence number
+ *   12 uint64   UTC microseconds of the first sample
+ *   20 uint32   samples dropped so far because the stream fell behind
+ *   24 uint64   number of the frame the first sample is taken for (see Inputs/Frame Number)
+ *   32 samples, delta coded (see thermistorMux_delta.h) from the first sample:
+ *      uint8    scan slot (thermistor index, or NUMBER_OF_THERMISTORS for the ADC temperature)
+ *      varint   24-bit ADC code, less the slot's last code in the datagram (0 for its first)
+ *      varint   microseconds after the first sample, as the change in step from the last sample
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-27
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_STREAM_H
+#define THERMISTORMUX_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <IPAddress.h>
+#include "thermistorMux_ring.h"
+#include "thermistorMux_delta.h"
+#include "thermistorMux_global.h"
+
+#define STREAM_VERSION      3
+#define STREAM_HEADER_SIZE  32
+// Longest coding of a sample
+#define STREAM_MAX_SAMPLE_SIZE  (1 + DELTA_MAX_CODE_SIZE + DELTA_MAX_TIME_SIZE)
+// Largest datagram that fits a 1500 byte Ethernet MTU unfragmented
+#define STREAM_MAX_DATAGRAM 1472
+
+bool stream_start(IPAddress host, uint16_t port);
+void stream_stop();
+bool stream_enabled();
+void stream_sample(const ADCSample *sample);
+void stream_poll();
+bool stream_send(const uint8_t *data, size_t length);
+unsigned long stream_dropped();
+
+#endif
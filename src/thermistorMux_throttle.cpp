@@ -0,0 +1,148 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_throttle.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Adaptive publish throttling. Publishing never waits on a broker (see
+ * the outbound queues in cf_sparkplug.cpp), so a broker that can't keep up
+ * shows as a queue that stays full, messages that wait long to get through and
+ * NDATA dropped. Rather than lose whichever frames the queue drops, the node
+ * sends less: each profile down batches more frames to a message, widens the
+ * deadband, and at the last sends a frame every THROTTLE_SUMMARY_MS, keeping
+ * the rest in the history for a host to fetch. Acquisition carries on as before
+ * at every profile.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_throttle.h"
+
+static const char *const PROFILE_NAMES[NUM_PUBLISH_PROFILES] = {
+    "Configured", "Batched", "Widened Deadband", "Summary"
+};
+
+static bool m_enabled = true;
+static unsigned long m_latency_limit = THROTTLE_DEFAULT_LATENCY_MS;
+static PublishProfile m_profile = PUBLISH_CONFIGURED;
+static unsigned int m_pressure_checks = 0;
+static unsigned int m_eased_checks = 0;
+
+// millis() of the last summary frame, and whether there's been one
+static unsigned long m_last_summary = 0;
+static bool m_summary_started = false;
+
+
+static void set_profile(PublishProfile profile) {
+    m_profile = profile;
+    m_pressure_checks = 0;
+    m_eased_checks = 0;
+    m_summary_started = false;
+}
+
+
+/*
+Takes a check of the outbound queues and steps the profile down after
+THROTTLE_PRESSURE_CHECKS in a row under pressure, or back up after
+THROTTLE_EASED_CHECKS in a row eased; a check that's neither holds it. Call
+every THROTTLE_CHECK_MS. Returns true if the profile changed.
+*/
+bool throttle_update(const ThrottleSample *sample) {
+    if (!m_enabled) {
+        return false;
+    }
+    bool pressure = sample->depth >= THROTTLE_PRESSURE_DEPTH || sample->latency_ms >= m_latency_limit ||
+                    sample->dropped > 0;
+    bool eased = sample->depth <= THROTTLE_EASED_DEPTH && sample->latency_ms < m_latency_limit / 2;
+    if (pressure) {
+        m_eased_checks = 0;
+        if (++m_pressure_checks >= THROTTLE_PRESSURE_CHECKS && m_profile < PUBLISH_SUMMARY) {
+            set_profile((PublishProfile)(m_profile + 1));
+            return true;
+        }
+    } else if (eased) {
+        m_pressure_checks = 0;
+        if (++m_eased_checks >= THROTTLE_EASED_CHECKS && m_profile > PUBLISH_CONFIGURED) {
+            set_profile((PublishProfile)(m_profile - 1));
+            return true;
+        }
+    } else {
+        m_pressure_checks = 0;
+        m_eased_checks = 0;
+    }
+    return false;
+}
+
+
+PublishProfile throttle_profile() {
+    return m_profile;
+}
+
+
+const char *throttle_profile_name(PublishProfile profile) {
+    return profile < NUM_PUBLISH_PROFILES ? PROFILE_NAMES[profile] : "Unknown";
+}
+
+
+/*
+Turns throttling on or off; off goes back to the configured profile at once.
+*/
+void throttle_set_enabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled) {
+        set_profile(PUBLISH_CONFIGURED);
+    }
+}
+
+
+bool throttle_enabled() {
+    return m_enabled;
+}
+
+
+/*
+Sets the send latency that counts as pressure, 1 to THROTTLE_MAX_LATENCY_MS.
+Returns false, leaving it as it was, if the value is out of range.
+*/
+bool throttle_set_latency_limit(unsigned long ms) {
+    if (ms == 0 || ms > THROTTLE_MAX_LATENCY_MS) {
+        return false;
+    }
+    m_latency_limit = ms;
+    return true;
+}
+
+
+unsigned long throttle_latency_limit() {
+    return m_latency_limit;
+}
+
+
+/*
+In the summary profile, returns true if a live frame is due to be published:
+the first since the profile was entered, then one every THROTTLE_SUMMARY_MS.
+Always true in the other profiles.
+*/
+bool throttle_summary_due(unsigned long now_ms) {
+    if (m_profile != PUBLISH_SUMMARY) {
+        return true;
+    }
+    if (m_summary_started && now_ms - m_last_summary < THROTTLE_SUMMARY_MS) {
+        return false;
+    }
+    m_summary_started = true;
+    m_last_summary = now_ms;
+    return true;
+}
@@ -0,0 +1,77 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_throttle.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Adaptive publish throttling definitions and function prototypes. The
+ * outbound queues' depth, send latency and drops are checked every
+ * THROTTLE_CHECK_MS; under backpressure the publish profile steps down from
+ * the configured one, and it steps back up once the pressure has eased.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_THROTTLE_H
+#define THERMISTORMUX_THROTTLE_H
+
+#include <stdint.h>
+
+// Publish profiles, lightest on the broker last.  Each keeps what the one
+// before it does.
+typedef enum
+{
+    PUBLISH_CONFIGURED,     // The configured batching and deadband
+    PUBLISH_BATCHED,        // Frames batched THROTTLE_BATCH_FRAMES at least to an NDATA
+    PUBLISH_WIDENED,        // Deadband at least THROTTLE_DEADBAND
+    PUBLISH_SUMMARY,        // One frame each THROTTLE_SUMMARY_MS; the rest kept in the history
+    NUM_PUBLISH_PROFILES
+} PublishProfile;
+
+#define THROTTLE_CHECK_MS           1000
+// Under pressure: this many messages queued for a broker, one waiting over the
+// latency limit, or a data message dropped; eased: at most THROTTLE_EASED_DEPTH
+// queued, none waiting over half the limit, none dropped
+#define THROTTLE_PRESSURE_DEPTH     3
+#define THROTTLE_EASED_DEPTH        1
+#define THROTTLE_DEFAULT_LATENCY_MS 500
+#define THROTTLE_MAX_LATENCY_MS     60000
+// Checks in a row under pressure before each step down, and eased before each
+// step back up, so a burst doesn't flip the profile
+#define THROTTLE_PRESSURE_CHECKS    2
+#define THROTTLE_EASED_CHECKS       10
+
+#define THROTTLE_BATCH_FRAMES       8
+#define THROTTLE_DEADBAND           0.1f    // °C
+#define THROTTLE_SUMMARY_MS         10000
+
+// The outbound queues over a check: the worst of the brokers
+typedef struct
+{
+    unsigned int  depth;        // Messages queued
+    unsigned long latency_ms;   // Longest send latency (see outbound_latency())
+    unsigned long dropped;      // Data messages dropped since the last check
+} ThrottleSample;
+
+bool throttle_update(const ThrottleSample *sample);
+PublishProfile throttle_profile();
+const char *throttle_profile_name(PublishProfile profile);
+void throttle_set_enabled(bool enabled);
+bool throttle_enabled();
+bool throttle_set_latency_limit(unsigned long ms);
+unsigned long throttle_latency_limit();
+bool throttle_summary_due(unsigned long now_ms);
+
+#endif
@@ -0,0 +1,252 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_time.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Sample time service. The 32 bit DWT cycle counter wraps every ~7 s at
+ * 600 MHz, so it is extended to 64 bits in software; time_cycles64() must run at
+ * least that often, which the ADC interrupt and loop() (through time_update())
+ * both guarantee. NTP syncs pin a (cycles, UTC) reference pair; conversions are
+ * then a subtraction and a multiply by the drift-corrected cycle period instead
+ * of an NTP client call.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-23
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_time.h"
+#include "thermistorMux_global.h"
+
+static uint32_t m_last_cycles = 0;      // Low word at the last extension
+static uint32_t m_cycles_high = 0;      // High word, counts DWT wraps
+
+static uint64_t m_ref_cycles = 0;       // Cycle count at the last NTP sync
+static uint64_t m_ref_utc_micros = 0;   // UTC at the last NTP sync
+static double m_micros_per_cycle = 1e6 / F_CPU_ACTUAL;  // Corrected for crystal drift
+static bool m_synced = false;
+static uint64_t m_sync_cycles = 0;      // Cycle count at the last sync; m_ref_cycles also moves on drift updates
+
+// Drift estimation. Each estimate compares the nominal cycle time against the
+// reference time elapsed since the anchor, so it doesn't depend on earlier
+// corrections; estimates are averaged with a weight that grows with the interval.
+#define DRIFT_MIN_INTERVAL_US   4000000.0   // Shorter intervals are too noisy to use
+#define DRIFT_TIME_CONSTANT_US  256000000.0
+#define DRIFT_MAX_PPM           200.0       // Beyond this it's a step in the reference
+static uint64_t m_anchor_cycles = 0;
+static uint64_t m_anchor_utc_micros = 0;
+static bool m_anchored = false;
+static double m_drift_ppm = 0;
+static bool m_have_drift = false;
+static int64_t m_last_offset_us = 0;    // What the last time_discipline() corrected
+
+
+/*
+Returns the DWT cycle counter extended to 64 bits. Safe to call from interrupt
+handlers and from loop().
+*/
+uint64_t time_cycles64() {
+#if defined(__arm__)
+    uint32_t primask;
+    __asm__ volatile("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+#endif
+    uint32_t cycles = ARM_DWT_CYCCNT;
+    if (cycles < m_last_cycles) {
+        m_cycles_high++;
+    }
+    m_last_cycles = cycles;
+    uint64_t cycles64 = ((uint64_t)m_cycles_high << 32) | cycles;
+#if defined(__arm__)
+    __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+#endif
+    return cycles64;
+}
+
+
+/*
+Keeps the 64 bit extension current while the scan engine is stopped. Call from loop().
+*/
+void time_update() {
+    time_cycles64();
+}
+
+
+/*
+Records that the cycle count cycles was at utc_micros, as the reference for cycle
+conversions.
+*/
+void time_set_reference(uint64_t cycles, uint64_t utc_micros) {
+    m_ref_cycles = cycles;
+    m_ref_utc_micros = utc_micros;
+    m_sync_cycles = cycles;
+    m_synced = true;
+}
+
+
+/*
+Picks the clock back up after a warm reboot: the current time, carried across the
+reset by the real time counter, and the drift estimate from before it. The
+reference is not an anchor, so time_discipline() starts measuring drift afresh
+from the next time source.
+*/
+void time_resume(uint64_t utc_micros, double drift_ppm) {
+    time_set_reference(time_cycles64(), utc_micros);
+    if (fabs(drift_ppm) < DRIFT_MAX_PPM) {
+        m_drift_ppm = drift_ppm;
+        m_have_drift = true;
+        time_set_drift(drift_ppm);
+    }
+}
+
+
+/*
+Records the current UTC time as the reference for cycle conversions.
+*/
+void time_sync_utc(uint64_t utc_millis) {
+    time_set_reference(time_cycles64(), utc_millis * 1000);
+}
+
+
+/*
+Sets the crystal's frequency error, in parts per million (positive when the CPU
+clock runs fast). The reference is first moved to now so that the conversion
+doesn't jump.
+*/
+void time_set_drift(double drift_ppm) {
+    if (m_synced) {
+        uint64_t now = time_cycles64();
+        m_ref_utc_micros = time_cycles_to_utc_micros(now);
+        m_ref_cycles = now;
+    }
+    m_micros_per_cycle = 1e6 / (F_CPU_ACTUAL * (1 + drift_ppm * 1e-6));
+}
+
+
+/*
+Disciplines the clock from a time source: records that the cycle count cycles was
+at utc_micros, updates the drift estimate from the interval since the last
+anchor, and makes this the new reference. Returns how far the clock had wandered
+from the source, in microseconds (positive when it was behind).
+*/
+int64_t time_discipline(uint64_t cycles, uint64_t utc_micros) {
+    int64_t offset = m_synced ? (int64_t)(utc_micros - time_cycles_to_utc_micros(cycles)) : 0;
+
+    if (m_anchored) {
+        double local_us = (double)(cycles - m_anchor_cycles) * 1e6 / F_CPU_ACTUAL;
+        double reference_us = (double)(int64_t)(utc_micros - m_anchor_utc_micros);
+        if (reference_us >= DRIFT_MIN_INTERVAL_US) {
+            double drift = (local_us / reference_us - 1) * 1e6;
+            if (fabs(drift) < DRIFT_MAX_PPM) {
+                double gain = reference_us / (reference_us + DRIFT_TIME_CONSTANT_US);
+                m_drift_ppm = m_have_drift ? m_drift_ppm + gain * (drift - m_drift_ppm) : drift;
+                m_have_drift = true;
+                time_set_drift(m_drift_ppm);
+            }
+            else {
+                LogWarn("Time reference stepped, drift estimate %0.1f ppm ignored.", drift);
+            }
+            m_anchor_cycles = cycles;
+            m_anchor_utc_micros = utc_micros;
+        }
+        else if (reference_us < 0) {
+            m_anchor_cycles = cycles;
+            m_anchor_utc_micros = utc_micros;
+        }
+    }
+    else {
+        m_anchor_cycles = cycles;
+        m_anchor_utc_micros = utc_micros;
+        m_anchored = true;
+    }
+
+    time_set_reference(cycles, utc_micros);
+    m_last_offset_us = offset;
+    return offset;
+}
+
+
+/*
+How far the clock had wandered from its time source when last disciplined,
+microseconds; 0 until it has been disciplined twice.
+*/
+int64_t time_last_offset_us() {
+    return m_last_offset_us;
+}
+
+
+double time_drift_ppm() {
+    return m_drift_ppm;
+}
+
+
+bool time_synced() {
+    return m_synced;
+}
+
+
+/*
+Milliseconds since the time service was last synced to a time source, or
+UINT64_MAX if it never has been.
+*/
+uint64_t time_since_sync_ms() {
+    if (!m_synced) {
+        return UINT64_MAX;
+    }
+    return (time_cycles64() - m_sync_cycles) / (F_CPU_ACTUAL / 1000);
+}
+
+
+/*
+Converts a time_cycles64() stamp to UTC microseconds. Returns 0 before the first
+NTP sync.
+*/
+uint64_t time_cycles_to_utc_micros(uint64_t cycles) {
+    if (!m_synced) {
+        return 0;
+    }
+    int64_t delta = (int64_t)(cycles - m_ref_cycles);
+    return m_ref_utc_micros + (int64_t)(delta * m_micros_per_cycle);
+}
+
+
+/*
+Converts a time_cycles64() stamp to UTC milliseconds. Returns 0 before the first
+NTP sync.
+*/
+uint64_t time_cycles_to_utc_millis(uint64_t cycles) {
+    return time_cycles_to_utc_micros(cycles) / 1000;
+}
+
+
+/*
+Converts UTC microseconds to the time_cycles64() count at which they occur. Returns
+0 before the first NTP sync.
+*/
+uint64_t time_utc_micros_to_cycles(uint64_t utc_micros) {
+    if (!m_synced) {
+        return 0;
+    }
+    int64_t delta = (int64_t)(utc_micros - m_ref_utc_micros);
+    return m_ref_cycles + (int64_t)(delta / m_micros_per_cycle);
+}
+
+
+uint64_t time_now_utc_micros() {
+    return time_cycles_to_utc_micros(time_cycles64());
+}
+
+
+uint64_t time_now_utc_millis() {
+    return time_cycles_to_utc_millis(time_cycles64());
+}
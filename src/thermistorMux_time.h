@@ -0,0 +1,48 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_time.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Sample time service. Samples are stamped with the ARM DWT cycle counter,
+ * extended to 64 bits, and mapped to UTC through the last NTP sync, corrected for
+ * the crystal drift measured between syncs.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-23
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_TIME_H
+#define THERMISTORMUX_TIME_H
+
+#include <stdint.h>
+
+uint64_t time_cycles64();
+void time_update();
+void time_set_reference(uint64_t cycles, uint64_t utc_micros);
+void time_resume(uint64_t utc_micros, double drift_ppm);
+void time_sync_utc(uint64_t utc_millis);
+void time_set_drift(double drift_ppm);
+int64_t time_discipline(uint64_t cycles, uint64_t utc_micros);
+int64_t time_last_offset_us();
+double time_drift_ppm();
+bool time_synced();
+uint64_t time_since_sync_ms();
+uint64_t time_cycles_to_utc_micros(uint64_t cycles);
+uint64_t time_cycles_to_utc_millis(uint64_t cycles);
+uint64_t time_utc_micros_to_cycles(uint64_t utc_micros);
+uint64_t time_now_utc_micros();
+uint64_t time_now_utc_millis();
+
+#endif
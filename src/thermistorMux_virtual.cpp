@@ -0,0 +1,224 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_virtual.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Virtual channels, each a weighted sum of a few thermistors. The
+ * weights form a sparse matrix, kept a row per virtual channel as its terms'
+ * thermistors and coefficients, so evaluating a frame is one sweep over the
+ * terms.
+ *
+ * Channels are written as a ';' separated list, virtual channel 1 first, each a
+ * sum of terms "[coefficient*]Tn" for thermistor n, e.g.
+ * "T1-T2;0.25*T1+0.25*T2+0.25*T3+0.25*T4"; "" for none. A virtual channel reads
+ * NAN while any of its thermistors is disabled or null. They aren't saved, as
+ * the EEPROM has no room left for them.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_virtual.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Coefficients beyond this can't be meant for a combination of temperatures
+#define VIRTUAL_MAX_COEFFICIENT  1000000.0f
+
+// The weights, a row per virtual channel: its terms are [m_start[v], m_start[v + 1])
+static int m_count = 0;
+static uint8_t m_start[MAX_VIRTUAL_CHANNELS + 1] = {0};
+static uint8_t m_channel[MAX_VIRTUAL_TERMS];
+static float m_coefficient[MAX_VIRTUAL_TERMS];
+static ChannelMask m_used[MAX_VIRTUAL_CHANNELS];    // Thermistors each one reads
+
+
+static const char *skip_spaces(const char *pos) {
+    while (*pos == ' ' || *pos == '\t') {
+        pos++;
+    }
+    return pos;
+}
+
+
+/*
+Parses one term at pos, "[coefficient*]Tn" after an optional sign (which the
+terms after the first need). Returns the text after it, or NULL if malformed.
+*/
+static const char *parse_term(const char *pos, bool first, uint8_t *channel, float *coefficient) {
+    float sign = 1;
+    pos = skip_spaces(pos);
+    if (*pos == '+' || *pos == '-') {
+        sign = (*pos == '-') ? -1 : 1;
+        pos = skip_spaces(pos + 1);
+    }
+    else if (!first) {
+        return NULL;
+    }
+    float value = 1;
+    if ((*pos >= '0' && *pos <= '9') || *pos == '.') {
+        char *end;
+        value = strtof(pos, &end);
+        pos = skip_spaces(end);
+        if (*pos != '*' || !(value <= VIRTUAL_MAX_COEFFICIENT)) {
+            return NULL;
+        }
+        pos = skip_spaces(pos + 1);
+    }
+    if (*pos != 'T' && *pos != 't') {
+        return NULL;
+    }
+    pos++;
+    if (*pos < '0' || *pos > '9') {
+        return NULL;
+    }
+    char *end;
+    long number = strtol(pos, &end, 10);
+    if (number < 1 || number > NUMBER_OF_THERMISTORS) {
+        return NULL;
+    }
+    *channel = (uint8_t)(number - 1);
+    *coefficient = sign * value;
+    return skip_spaces(end);
+}
+
+
+/*
+Puts the virtual channels of text (see the file comment) in use; "" removes them
+all. Returns false, changing nothing, for a malformed term, a thermistor that
+doesn't exist, or more channels or terms than there is room for.
+*/
+bool virtual_set_channels(const char *text) {
+    uint8_t start[MAX_VIRTUAL_CHANNELS + 1] = {0};
+    uint8_t channels[MAX_VIRTUAL_TERMS];
+    float coefficients[MAX_VIRTUAL_TERMS];
+    int count = 0;
+    int terms = 0;
+    const char *pos = skip_spaces(text);
+    while (*pos != '\0') {
+        if (count >= MAX_VIRTUAL_CHANNELS) {
+            return false;
+        }
+        bool first = true;
+        while (*pos != ';' && *pos != '\0') {
+            if (terms >= MAX_VIRTUAL_TERMS) {
+                return false;
+            }
+            pos = parse_term(pos, first, &channels[terms], &coefficients[terms]);
+            if (pos == NULL) {
+                return false;
+            }
+            terms++;
+            first = false;
+        }
+        if (first) {
+            return false;
+        }
+        start[++count] = (uint8_t)terms;
+        if (*pos == ';') {
+            pos++;
+        }
+    }
+    m_count = count;
+    memcpy(m_start, start, sizeof(start));
+    memcpy(m_channel, channels, terms * sizeof(channels[0]));
+    memcpy(m_coefficient, coefficients, terms * sizeof(coefficients[0]));
+    for (int v = 0; v < count; v++) {
+        m_used[v] = 0;
+        for (int term = m_start[v]; term < m_start[v + 1]; term++) {
+            m_used[v] |= CHANNEL_BIT(m_channel[term]);
+        }
+    }
+    return true;
+}
+
+
+/*
+Writes the virtual channels in use as virtual_set_channels() takes them.
+*/
+void virtual_format_channels(char *buffer, size_t size) {
+    size_t length = 0;
+    buffer[0] = '\0';
+    for (int v = 0; v < m_count; v++) {
+        for (int term = m_start[v]; term < m_start[v + 1] && length < size; term++) {
+            const char *separator = (term > m_start[v]) ? "+" : (v > 0) ? ";" : "";
+            float coefficient = m_coefficient[term];
+            int number = m_channel[term] + 1;
+            int written;
+            if (coefficient == 1) {
+                written = snprintf(buffer + length, size - length, "%sT%d", separator, number);
+            }
+            else if (coefficient == -1) {
+                written = snprintf(buffer + length, size - length, "%s-T%d",
+                                   (term > m_start[v]) ? "" : separator, number);
+            }
+            else {
+                written = snprintf(buffer + length, size - length, "%s%g*T%d",
+                                   (coefficient < 0 && term > m_start[v]) ? "" : separator, coefficient, number);
+            }
+            if (written < 0) {
+                return;
+            }
+            length += (size_t)written;
+        }
+    }
+}
+
+
+/*
+Number of virtual channels in use; 1 to the count are defined.
+*/
+int virtual_count() {
+    return m_count;
+}
+
+
+/*
+Evaluates every virtual channel from temps[i], thermistor i in °C, of the
+channels that were read: values[v] for virtual channel v + 1 of the
+MAX_VIRTUAL_CHANNELS, NAN for one not defined or reading a thermistor that
+wasn't read or is NAN.
+*/
+void virtual_evaluate(const float *temps, ChannelMask channels, float *values) {
+    for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+        float sum = NAN;
+        if (v < m_count && (m_used[v] & ~channels) == 0) {
+            sum = 0;
+            for (int term = m_start[v]; term < m_start[v + 1]; term++) {
+                sum += m_coefficient[term] * temps[m_channel[term]];
+            }
+        }
+        values[v] = sum;
+    }
+}
+
+
+/*
+Evaluates every virtual channel from a converted frame, in THERMISTOR_UNITS, as
+virtual_evaluate() does; null readings make their virtual channels NAN.
+*/
+void virtual_evaluate_frame(const ThermistorValue *frame, ChannelMask channels, float *values) {
+    for (int v = 0; v < MAX_VIRTUAL_CHANNELS; v++) {
+        float sum = NAN;
+        if (v < m_count && (m_used[v] & ~channels) == 0) {
+            sum = 0;
+            for (int term = m_start[v]; term < m_start[v + 1]; term++) {
+                sum += m_coefficient[term] * thermistor_celsius(frame[m_channel[term]]);
+            }
+        }
+        values[v] = sum;
+    }
+}
@@ -0,0 +1,47 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_virtual.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Virtual channels: linear combinations of the thermistors, such as a
+ * gradient (T1-T2) or a zone average, computed on the node with every frame and
+ * published as metrics of their own (Inputs/VIRTUAL1, ...).
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_VIRTUAL_H
+#define THERMISTORMUX_VIRTUAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thermistorMux_global.h"
+
+// Virtual channels, and terms across all of them
+#define MAX_VIRTUAL_CHANNELS  8
+#define MAX_VIRTUAL_TERMS     64
+
+// Longest text of virtual_format_channels(), "-0.123456*T64" per term with
+// its separator
+#define VIRTUAL_TEXT_SIZE  (MAX_VIRTUAL_TERMS * 16 + MAX_VIRTUAL_CHANNELS)
+
+bool virtual_set_channels(const char *text);
+void virtual_format_channels(char *buffer, size_t size);
+int virtual_count();
+void virtual_evaluate(const float *temps, ChannelMask channels, float *values);
+void virtual_evaluate_frame(const ThermistorValue *frame, ChannelMask channels, float *values);
+
+#endif
@@ -0,0 +1,168 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_warmboot.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Warm reboot. Before an intentional reset the birth/death sequence numbers
+ * and the clock are saved to a CRC-checked block in DMAMEM, which start-up
+ * doesn't clear, and the data cache is written back. The next boot resumes from
+ * the block if it is intact: the sequence numbers carry on, and UTC is carried
+ * over the reset by the SNVS real time counter, which keeps running. The block
+ * is only trusted once, right after warmboot_prepare(); a power cycle, crash or
+ * watchdog timeout boots cold. The block also says why the reboot was asked
+ * for, and how many watchdog reboots came before it in a row.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_warmboot.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_crc.h"
+#include "thermistorMux_global.h"
+#include "thermistorMux_history.h"
+#include <Arduino.h>
+#include <stddef.h>
+
+#define WARMBOOT_MAGIC      0x57524D42      // "WRMB"
+#define RTC_TICKS_PER_SEC   32768
+
+struct WarmBlock {
+    uint32_t magic;                         // WARMBOOT_MAGIC from warmboot_prepare() to the next boot
+    uint32_t size;                          // sizeof(WarmBlock), in case the firmware changed
+    uint64_t bd_seq[WARMBOOT_MAX_BROKERS];  // Last sequence number used on each broker
+    uint8_t brokers;
+    bool clock_synced;
+    uint64_t utc_micros;                    // UTC at the reset
+    uint64_t rtc_ticks;                     // SNVS real time counter at the reset
+    double drift_ppm;
+    uint8_t cause;                          // ResetCause of the reboot
+    uint8_t watchdog_reboots;               // Watchdog reboots in a row, this one included
+    uint32_t crc;                           // CRC32 of everything before it
+};
+
+static DMAMEM WarmBlock m_block;
+static bool m_resumed = false;
+
+
+/*
+The SNVS high power real time counter: 47 bits at 32768 Hz, running from the
+coin cell or VBAT domain through resets. The two halves are read until the high
+half is steady, so a carry between them doesn't tear the value.
+*/
+static uint64_t rtc_ticks() {
+    uint32_t high, low;
+    do {
+        high = SNVS_HPRTCMR;
+        low = SNVS_HPRTCLR;
+    } while (high != SNVS_HPRTCMR);
+    return ((uint64_t)(high & 0x7FFF) << 32) | low;
+}
+
+
+static bool block_valid(const WarmBlock *block) {
+    return block->magic == WARMBOOT_MAGIC && block->size == sizeof(WarmBlock) &&
+           block->brokers <= WARMBOOT_MAX_BROKERS && block->cause < NUM_RESET_CAUSES &&
+           block->crc == crc32(block, offsetof(WarmBlock, crc));
+}
+
+
+/*
+Checks for state left by warmboot_prepare(), at the start of setup(), and
+restores the clock from it. Returns true if this is a warm boot. The block is
+invalidated either way.
+*/
+bool warmboot_init() {
+    m_resumed = block_valid(&m_block);
+    m_block.magic = 0;
+    if (!m_resumed) {
+        return false;
+    }
+    if (m_block.clock_synced) {
+        uint64_t elapsed = rtc_ticks() - m_block.rtc_ticks;
+        time_resume(m_block.utc_micros + (elapsed * 1000000) / RTC_TICKS_PER_SEC, m_block.drift_ppm);
+    }
+    LogInfo("Warm boot, clock %s.", m_block.clock_synced ? "carried over" : "not synced");
+    return true;
+}
+
+
+bool warmboot_resumed() {
+    return m_resumed;
+}
+
+
+/*
+Last birth/death sequence number used on broker before the warm reboot. Returns
+false on a cold boot.
+*/
+bool warmboot_bd_seq(int broker, uint64_t *bd_seq) {
+    if (!m_resumed || broker >= m_block.brokers) {
+        return false;
+    }
+    *bd_seq = m_block.bd_seq[broker];
+    return true;
+}
+
+
+/*
+Why the warm reboot was asked for. Returns false on a cold boot.
+*/
+bool warmboot_cause(ResetCause *cause) {
+    if (!m_resumed) {
+        return false;
+    }
+    *cause = (ResetCause)m_block.cause;
+    return true;
+}
+
+
+/*
+Watchdog reboots in a row up to this boot: 0 unless it was one.
+*/
+unsigned int warmboot_watchdog_reboots() {
+    return m_resumed ? m_block.watchdog_reboots : 0;
+}
+
+
+static bool watchdog_cause(ResetCause cause) {
+    return cause == RESET_ACQUISITION_STALL || cause == RESET_NETWORK_STALL || cause == RESET_LOOP_STALL;
+}
+
+
+/*
+Saves the state the next boot resumes from. Call just before an intentional
+reset, with the last birth/death sequence number used on each broker and the
+reason for it. Safe to call from the watchdog's early warning interrupt.
+*/
+void warmboot_prepare(const uint64_t *bd_seq, int brokers, ResetCause cause) {
+    unsigned int reboots = watchdog_cause(cause) ? warmboot_watchdog_reboots() + 1 : 0;
+    memset(&m_block, 0, sizeof(m_block));
+    m_block.magic = WARMBOOT_MAGIC;
+    m_block.size = sizeof(WarmBlock);
+    m_block.brokers = (brokers < WARMBOOT_MAX_BROKERS) ? brokers : WARMBOOT_MAX_BROKERS;
+    memcpy(m_block.bd_seq, bd_seq, m_block.brokers * sizeof(uint64_t));
+    m_block.cause = (uint8_t)cause;
+    m_block.watchdog_reboots = (uint8_t)(reboots < UINT8_MAX ? reboots : UINT8_MAX);
+    m_block.clock_synced = time_synced();
+    if (m_block.clock_synced) {
+        m_block.rtc_ticks = rtc_ticks();
+        m_block.utc_micros = time_now_utc_micros();
+        m_block.drift_ppm = time_drift_ppm();
+    }
+    m_block.crc = crc32(&m_block, offsetof(WarmBlock, crc));
+    arm_dcache_flush(&m_block, sizeof(m_block));
+    history_prepare_reset();
+}
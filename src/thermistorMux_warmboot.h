@@ -0,0 +1,41 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_warmboot.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Warm reboot definitions and function prototypes. State that should
+ * outlive an NCMD reboot is kept in RAM that start-up doesn't clear.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_WARMBOOT_H
+#define THERMISTORMUX_WARMBOOT_H
+
+#include <stdint.h>
+#include "thermistorMux_watchdog.h"
+
+// Most brokers whose birth/death sequence numbers are kept
+#define WARMBOOT_MAX_BROKERS 4
+
+bool warmboot_init();
+bool warmboot_resumed();
+bool warmboot_bd_seq(int broker, uint64_t *bd_seq);
+bool warmboot_cause(ResetCause *cause);
+unsigned int warmboot_watchdog_reboots();
+void warmboot_prepare(const uint64_t *bd_seq, int brokers, ResetCause cause);
+
+#endif
@@ -0,0 +1,216 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_watchdog.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Watchdog with staged recovery. WDOG1 is serviced at the end of each
+ * scheduler pass, once every check-in has been seen within its timeout or has
+ * had its recovery started, so there are three stages:
+ *  - a check-in overdue by its timeout has its part of the firmware restarted
+ *    (the ADCs re-initialized, the broker sockets reopened);
+ *  - overdue by its timeout again, the node warm reboots, keeping its bdSeq
+ *    numbers, held frames and clock (see thermistorMux_warmboot.cpp);
+ *  - a scheduler pass that never ends, a stuck IRQ wait or a blocked socket
+ *    write, leaves the watchdog unserviced: its early warning interrupt warm
+ *    reboots WATCHDOG_WARNING_MS before the timeout, and if interrupts are
+ *    stuck too, the timeout resets the chip cold.
+ * After WATCHDOG_MAX_REBOOTS warm reboots in a row for stalls, a stall only
+ * gets its restarts, so a dead ADC doesn't keep the node rebooting. The cause
+ * of the last reset is kept for the birth certificate.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include "thermistorMux_watchdog.h"
+#include "thermistorMux_warmboot.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_global.h"
+#include <Arduino.h>
+
+// Time from the last service to the chip reset, and how long before it the
+// early warning interrupt comes, both in WDOG1's 0.5 s steps. The timeout has
+// to outlast the longest blocking call, a TCP connect.
+#define WATCHDOG_TIMEOUT_MS   8000
+#define WATCHDOG_WARNING_MS   1000
+#define WATCHDOG_STEP_MS      500
+
+// Warm reboots in a row for stalls before they are left to the restarts alone
+#define WATCHDOG_MAX_REBOOTS  3
+
+// Above every other interrupt, so the early warning can preempt a stuck handler
+#define WATCHDOG_IRQ_PRIORITY 0
+
+struct Checkin {
+    uint32_t timeout_ms;            // 0 while not watched
+    WatchdogRecovery recover;
+    uint32_t last_ms;               // millis() at the last check-in, or the last recovery
+    bool recovering;                // Restarted since the last check-in
+};
+
+static const char *const CheckinNames[NUM_WATCHDOG_CHECKINS] = {"acquisition", "network"};
+
+static const char *const ResetCauseNames[NUM_RESET_CAUSES] = {
+    "Power on",
+    "Reboot command",
+    "Firmware update",
+    "Watchdog: acquisition stalled",
+    "Watchdog: network stalled",
+    "Watchdog: loop stalled",
+    "Watchdog timeout",
+    "Lockup",
+    "Over temperature",
+    "Debugger",
+};
+
+static Checkin m_checkins[NUM_WATCHDOG_CHECKINS];
+static WatchdogReboot m_reboot = NULL;
+static ResetCause m_cause = RESET_POWER_ON;
+
+
+/*
+The cold reset cause from the reset controller's sticky status bits.
+*/
+static ResetCause cold_reset_cause(uint32_t status) {
+    if (status & SRC_SRSR_WDOG_RST_B) {
+        return RESET_WATCHDOG;
+    }
+    if (status & SRC_SRSR_TEMPSENSE_RST_B) {
+        return RESET_OVER_TEMPERATURE;
+    }
+    if (status & (SRC_SRSR_JTAG_RST_B | SRC_SRSR_JTAG_SW_RST)) {
+        return RESET_DEBUGGER;
+    }
+    if (status & SRC_SRSR_LOCKUP_SYSRESETREQ) {
+        return RESET_LOCKUP;
+    }
+    return RESET_POWER_ON;
+}
+
+
+/*
+Works out why the node booted, after warmboot_init(), and clears the reset
+controller's status for the next boot.
+*/
+void watchdog_init() {
+    uint32_t status = SRC_SRSR;
+    SRC_SRSR = status;
+    if (!warmboot_cause(&m_cause)) {
+        m_cause = cold_reset_cause(status);
+    }
+    LogInfo("Reset cause: %s.", ResetCauseNames[m_cause]);
+}
+
+
+/*
+Watches a check-in: if watchdog_checkin() isn't called for it for timeout_ms,
+recover is run, and after another timeout_ms the node reboots. Call before
+watchdog_start().
+*/
+void watchdog_watch(WatchdogCheckin checkin, uint32_t timeout_ms, WatchdogRecovery recover) {
+    Checkin *entry = &m_checkins[checkin];
+    entry->timeout_ms = timeout_ms;
+    entry->recover = recover;
+    entry->last_ms = millis();
+    entry->recovering = false;
+}
+
+
+static void service_hardware() {
+    WDOG1_WSR = 0x5555;
+    WDOG1_WSR = 0xAAAA;
+}
+
+
+/*
+The early warning: the scheduler has stopped servicing the watchdog, so reboot
+while interrupts still run.
+*/
+static void watchdog_isr() {
+    WDOG1_WICR |= WDOG_WICR_WTIS;
+    m_reboot(RESET_LOOP_STALL);
+}
+
+
+/*
+Starts the hardware watchdog, at the end of setup(); from now on
+watchdog_service() has to be called every scheduler pass. reboot is how the
+warm reboots are done. The timeout can't be stopped once started.
+*/
+void watchdog_start(WatchdogReboot reboot) {
+    m_reboot = reboot;
+    for (int i = 0; i < NUM_WATCHDOG_CHECKINS; i++) {
+        m_checkins[i].last_ms = millis();
+    }
+    CCM_CCGR3 |= CCM_CCGR3_WDOG1(CCM_CCGR_ON);
+    // The power-down counter would reset the chip 16 s after boot
+    WDOG1_WMCR = 0;
+    attachInterruptVector(IRQ_WDOG1, watchdog_isr);
+    NVIC_SET_PRIORITY(IRQ_WDOG1, WATCHDOG_IRQ_PRIORITY);
+    NVIC_ENABLE_IRQ(IRQ_WDOG1);
+    WDOG1_WICR = WDOG_WICR_WIE | WDOG_WICR_WTIS | WDOG_WICR_WICT(WATCHDOG_WARNING_MS / WATCHDOG_STEP_MS);
+    WDOG1_WCR = WDOG_WCR_WT(WATCHDOG_TIMEOUT_MS / WATCHDOG_STEP_MS - 1) | WDOG_WCR_WDA | WDOG_WCR_SRS |
+                WDOG_WCR_WDT | WDOG_WCR_WDE;
+    service_hardware();
+}
+
+
+/*
+Tells the watchdog a part of the firmware is making progress.
+*/
+void watchdog_checkin(WatchdogCheckin checkin) {
+    m_checkins[checkin].last_ms = millis();
+    m_checkins[checkin].recovering = false;
+}
+
+
+/*
+The scheduler's part, at the end of every pass: moves each overdue check-in on
+a stage, then services the hardware watchdog.
+*/
+void watchdog_service() {
+    if (m_reboot == NULL) {
+        return;
+    }
+    uint32_t now = millis();
+    for (int i = 0; i < NUM_WATCHDOG_CHECKINS; i++) {
+        Checkin *entry = &m_checkins[i];
+        if (entry->timeout_ms == 0 || now - entry->last_ms < entry->timeout_ms) {
+            continue;
+        }
+        if (entry->recovering && warmboot_watchdog_reboots() < WATCHDOG_MAX_REBOOTS) {
+            LogError("Watchdog: %s still stalled after its restart, rebooting.", CheckinNames[i]);
+            log_drain();
+            m_reboot(RESET_STALL(i));
+        }
+        LogError("Watchdog: %s stalled for %lu ms, restarting it.", CheckinNames[i],
+                 (unsigned long)(now - entry->last_ms));
+        health_count(HEALTH_WATCHDOG_RECOVERIES);
+        entry->recovering = true;
+        entry->recover();
+        entry->last_ms = millis();
+    }
+    service_hardware();
+}
+
+
+ResetCause watchdog_reset_cause() {
+    return m_cause;
+}
+
+
+const char *watchdog_reset_cause_text() {
+    return ResetCauseNames[m_cause];
+}
@@ -0,0 +1,70 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file thermistorMux_watchdog.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Watchdog definitions and function prototypes. The hardware watchdog is
+ * serviced by the scheduler, and the critical parts of the firmware check in
+ * with it as they make progress; one that stops is recovered in stages.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef THERMISTORMUX_WATCHDOG_H
+#define THERMISTORMUX_WATCHDOG_H
+
+#include <stdint.h>
+
+// The parts of the firmware that check in
+enum WatchdogCheckin {
+    WATCHDOG_ACQUISITION,       // ADC passes arriving, or the scan engine stopped on purpose
+    WATCHDOG_NETWORK,           // The brokers' outbound queues draining
+    NUM_WATCHDOG_CHECKINS
+};
+
+// Why the node last booted. The warm causes are kept over the reset by
+// thermistorMux_warmboot.cpp, the cold ones read from the reset controller.
+enum ResetCause {
+    RESET_POWER_ON,             // Power-up or the reset pin
+    RESET_COMMAND,              // Node Control/Reboot
+    RESET_UPDATE,               // Booting a firmware update
+    RESET_ACQUISITION_STALL,    // No ADC passes, even after the ADCs were re-initialized
+    RESET_NETWORK_STALL,        // Outbound messages stuck, even after the sockets were restarted
+    RESET_LOOP_STALL,           // The scheduler stopped; the watchdog's early warning rebooted
+    RESET_WATCHDOG,             // The watchdog timed out, interrupts being stuck too
+    RESET_LOCKUP,               // A core lockup, or a restart without warm boot state
+    RESET_OVER_TEMPERATURE,     // The die temperature sensor
+    RESET_DEBUGGER,             // JTAG
+    NUM_RESET_CAUSES
+};
+
+// A stalled check-in's warm reboot cause
+#define RESET_STALL(checkin)  ((ResetCause)(RESET_ACQUISITION_STALL + (checkin)))
+
+// Reboots with state kept (see reset_teensy()); doesn't return
+typedef void (*WatchdogReboot)(ResetCause cause);
+// Restarts a stalled part of the firmware
+typedef void (*WatchdogRecovery)(void);
+
+void watchdog_init();
+void watchdog_watch(WatchdogCheckin checkin, uint32_t timeout_ms, WatchdogRecovery recover);
+void watchdog_start(WatchdogReboot reboot);
+void watchdog_checkin(WatchdogCheckin checkin);
+void watchdog_service();
+ResetCause watchdog_reset_cause();
+const char *watchdog_reset_cause_text();
+
+#endif
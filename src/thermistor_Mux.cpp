@@ -28,6 +28,36 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #include "thermistorMux_hardware.h"
 #include "thermistorMux_global.h"
 #include "thermistor_Mux.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_filter.h"
+#include "thermistorMux_time.h"
+#include "thermistorMux_scheduler.h"
+#include "thermistorMux_stream.h"
+#include "thermistorMux_fault.h"
+#include "thermistorMux_profile.h"
+#include "thermistorMux_health.h"
+#include "thermistorMux_scantrace.h"
+#include "thermistorMux_memory.h"
+#include "thermistorMux_calcapture.h"
+#include "thermistorMux_calstore.h"
+#include "thermistorMux_sensor.h"
+#include "thermistorMux_alarm.h"
+#include "thermistorMux_sdlog.h"
+#include "thermistorMux_warmboot.h"
+#include "thermistorMux_history.h"
+#include "thermistorMux_channels.h"
+#include "thermistorMux_settling.h"
+#include "thermistorMux_kalman.h"
+#include "thermistorMux_drift.h"
+#include "thermistorMux_http.h"
+#include "thermistorMux_virtual.h"
+#include "thermistorMux_watchdog.h"
+#include "thermistorMux_boot.h"
+#include "thermistorMux_selfheat.h"
+#include "thermistorMux_framesync.h"
+#include "thermistorMux_selftest.h"
+#include "thermistorMux_stats.h"
+#include "thermistorMux_rollup.h"
 
 /*
 Questions:
@@ -37,249 +67,2036 @@ Questions:
 */
 
    
-#define CS 10
-#define INTERRUPT_PIN 23
+bool setup_successful = false;
+int mosfetRef;
+bool calibrated = false;
+//Calibration points taken, as saved in EEPROM (see thermistorMux_calstore.cpp).
+//Two or more points put the calibration in use.
+static CalData calData;
+
+
+
+//Default number of passes averaged into each published frame, and the most
+//that can be set through set_scan_config().
+#define AVERAGING_PASSES 5
+#define MAX_AVERAGING_PASSES 1000
+//Longest frame period that can be set, ms.
+#define MAX_FRAME_PERIOD_MS 3600000
+
+//Frames between read-backs of the ADC configuration registers (~1 minute).
+#define ADC_REGISTER_CHECK_FRAMES 20
+
+//Re-initializations of the ADCs tried after a missed data-ready until their
+//registers read back, ADC_RECOVERY_RETRY_MS apart (see recover_scan()).
+#define ADC_RECOVERY_ATTEMPTS 3
+#define ADC_RECOVERY_RETRY_MS 10
+
+//Longest the scan engine can run without a pass before the watchdog re-initializes
+//the ADCs, and then reboots (see thermistorMux_watchdog.cpp). A pass at the
+//slowest settings takes a few seconds.
+#define ACQUISITION_STALL_MS 10000
+
+//Task periods and time budgets, in microseconds. Acquisition, conversion and
+//publish run back to back in one scheduler pass when a frame completes.
+#define ACQUISITION_PERIOD_US   1000
+#define ACQUISITION_BUDGET_US   200
+#define CONVERSION_BUDGET_US    500
+#define PUBLISH_BUDGET_US       2000
+#define BROKER_PERIOD_US        5000
+#define BROKER_BUDGET_US        2000
+//Frequent, so NTP replies are timestamped promptly; idle polls are cheap.
+#define NTP_PERIOD_US           1000
+#define COMMAND_PERIOD_US       1000
+#define COMMAND_BUDGET_US       500
+#define NTP_BUDGET_US           500
+#ifdef USE_RAW_STREAM
+#define STREAM_PERIOD_US        1000
+#define STREAM_BUDGET_US        300
+#endif
+//A scrape is a few KB copied into the socket, a couple of polls' worth.
+#define HTTP_PERIOD_US          5000
+#define HTTP_BUDGET_US          200
+//Every millisecond rather than every pass, so the scheduler can sleep between them.
+#define LOG_PERIOD_US           1000
+#define LOG_BUDGET_US           200
+#define HOUSEKEEPING_PERIOD_US  1000000
+#define HOUSEKEEPING_BUDGET_US  100
+//Scans the painted stack, so kept infrequent.
+#define MEMORY_PERIOD_US        10000000
+#define MEMORY_BUDGET_US        1000
+//One 4 KB segment write per run; the card can stall for longer now and then.
+#define SDLOG_PERIOD_US         1000
+#define SDLOG_BUDGET_US         2000
+//With a frame period, the grid task arms the engine within this of a frame start and
+//the frame timer starts it; the timer interrupt busy-waits the last part of the lead.
+#define GRID_PERIOD_US          1000
+#define GRID_BUDGET_US          200
+#define GRID_ARM_US             1500
+//Moves the excitation duty window on a bucket (see thermistorMux_selfheat.cpp).
+#define SELFHEAT_PERIOD_US      (SELFHEAT_BUCKET_MS * 1000)
+#define SELFHEAT_BUDGET_US      100
+#define FRAME_TIMER_LEAD_US     5
+//Must stay under the ~7 s cycle counter wrap (see scheduler_report()).
+#define SCHEDULER_REPORT_PERIOD_US 5000000
+#ifdef USE_ADC_SELF_CAL
+//Between ADC self-calibrations, run from the housekeeping task (see run_ADC_self_cal()).
+#define ADC_SELF_CAL_PERIOD_MS  600000
+#endif
+
+//Averaging state, carried across loop() calls while passes arrive from the scan engine.
+//The passes themselves are filtered as raw codes (see thermistorMux_filter.cpp).
+static int avgCount = 0;
+static unsigned int averagingPasses = AVERAGING_PASSES;
+static unsigned int framePeriodMs = SCAN_GRID_MS;  //0 = frames back to back
+static float ADC_internal_temp = 0;
+static uint32_t pass_data[SLOTS_PER_PASS];
+static uint32_t frame_data[SLOTS_PER_PASS];
+static uint64_t pass_cycles = 0;
+//Thermistors sampled during the last frame; the others repeat their last value.
+static ChannelMask frameChannels = 0;
+//Frame banks (see acquisition_set_frame_banks()): each bank's passes are a frame of
+//their own, converted and published as soon as they are in, and the banks are
+//scanned in turn. frameChannels gathers the ones sampled over the whole frame.
+static unsigned int frameBanks = 1;  //1 = whole frames
+static unsigned int frameBank = 0;   //Bank being scanned
+static bool bankPending = false;     //Waiting for the engine to stop to start frameBank
+static bool bankLast = true;         //The part taken is the last of its frame
+static ChannelMask partChannels = 0; //Thermistors sampled during the part taken
+static ChannelMask framePart = ALL_CHANNELS_MASK;  //Thermistors of its bank
+static uint32_t passCount = 0;
+static int framesSinceRegisterCheck = 0;
+static uint32_t frameCount = 0;
+//Frame timer state: the armed start, when the timer is due to fire (for its
+//latency), and the last grid point a frame was started on.
+static IntervalTimer frameTimer;
+static volatile uint64_t frameStartCycles = 0;
+static volatile uint64_t frameTimerDueCycles = 0;
+static uint64_t lastFrameStart = 0;
+static bool lastFrameUtc = false;
+#ifdef USE_FRAME_SYNC
+//Frame sync follower: whether a frame is armed waiting for the line's edge, when
+//the edge is due, and when the last came (or was due, if it never did), 0 before
+//the first.
+static volatile bool syncArmed = false;
+static volatile uint64_t syncDueCycles = 0;
+static volatile uint64_t syncEdgeCycles = 0;
+#endif
+#ifdef USE_ADC_SELF_CAL
+static unsigned long lastSelfCalMs = 0;
+#endif
+static unsigned long lastOverruns = 0;
+static uint32_t lastReconfigurations = 0;
+//Continuous scan stopped while every thermistor an ADC scans is resting.
+static bool scanHeld = false;
+static int conversionTask = -1;
+static int publishTask = -1;
+
+//Adaptive sampling (see update_sample_schedule()). Change per pass is smoothed
+//over a few fresh frames.
+#define ADAPTIVE_STEP_C 0.01f
+#define ADAPTIVE_SMOOTHING 0.25f
+#define MAX_QUIET_INTERVAL 128
+static unsigned int quietInterval = 1;  //1 = adaptive sampling off
+//Adaptive averaging depth: with a target noise set, each frame averages the
+//fewest passes, a power of 2 up to MAX_ADAPTIVE_PASSES, that bring every
+//thermistor's noise down to it. Each reading is offset by NOISE_SLOPE_CODES to
+//find its °C per code. A frame only gets shallower once the noisiest thermistor
+//needs under NOISE_DEPTH_MARGIN of the shallower depth, so noise near a
+//boundary doesn't flip the depth every frame.
+#define MAX_ADAPTIVE_PASSES 512
+#define NOISE_SLOPE_CODES 256
+#define NOISE_DEPTH_MARGIN 0.8f
+static float targetNoise = 0;  //°C RMS; 0 = averagingPasses as set
+//The per-thermistor frame, pass and adaptive sampling state is in Channels (see
+//thermistorMux_channels.h).
+
+
+/*
+The first frame bank after bank with thermistors to scan; frameBanks if none is.
+*/
+static unsigned int bank_after(int bank) {
+  for (unsigned int next = bank + 1; next < frameBanks; next++) {
+    if (acquisition_bank_channels(next) != 0) {
+      return next;
+    }
+  }
+  return frameBanks;
+}
+
+
+/*
+Has the next frame start with its first bank. The engine is only moved onto it
+while stopped; start_scanning() selects it again otherwise.
+*/
+static void first_bank() {
+  bankPending = false;
+  bankLast = true;
+  frameBank = frameBanks > 1 ? bank_after(-1) : 0;
+  if (frameBank >= frameBanks) {
+    frameBank = 0;
+  }
+  acquisition_select_bank(frameBank);
+}
+
+
+/*
+Starts the engine on frameBank once the part before has all its passes in, so
+the bank is taken while that part is converted and published. The first bank
+of a frame waits for the grid task with a frame period.
+*/
+static void start_bank() {
+  if (acquisition_running()) {
+    bankPending = true;
+    return;
+  }
+  bankPending = false;
+  acquisition_select_bank(frameBank);
+  if (!bankLast || framePeriodMs == 0) {
+    acquisition_start_passes(averagingPasses);
+  }
+}
+
+
+/*
+Discards the partially averaged frame and all filter history.
+*/
+static void reset_frame() {
+  avgCount = 0;
+  filter_reset();
+#ifdef USE_CHANNEL_STATS
+  stats_reset();
+#endif
+  first_bank();
+}
+
+
+/*
+Starts the scan engine running continuously, or with a frame period lets the
+grid task start the next frame. Banked frames are scanned a bank at a time,
+each bank for its passes.
+*/
+static void start_scanning() {
+  frameTimer.end();
+#ifdef USE_FRAME_SYNC
+  syncArmed = false;
+  syncEdgeCycles = 0;
+#endif
+  acquisition_set_frame_banks(frameBanks);
+  first_bank();
+  if (framePeriodMs == 0) {
+    if (frameBanks > 1) {
+      acquisition_start_passes(averagingPasses);
+    } else {
+      acquisition_start();
+    }
+  }
+}
+
+
+/*
+Sets a channel's calibration to identity: one segment, temp = raw temp.
+*/
+static void set_identity_segments(CalSegments *cal) {
+  for (int s = 0; s < CAL_SEGMENTS; s++) {
+    cal->start[s] = INFINITY;
+    cal->gain[s] = 1.0;
+    cal->offset[s] = 0.0;
+  }
+  cal->start[0] = -INFINITY;
+}
+
+
+/*
+Builds each channel's piecewise-linear calibration from the points taken, in a
+new version of the conversion tables that replaces the one in use all at once
+(see conversion_begin_update()). The points are sorted by raw reading, and
+between neighbouring points
+  temp = (((raw temp - raw_a) * (ref_b - ref_a)) / (raw_b - raw_a)) + ref_a
+       = (gain * raw temp) + offset
+with the end segments extended beyond the outermost points. Falls back to
+identity if not calibrated, or for a channel with two equal raw readings.
+*/
+static void update_cal_coefficients() {
+  ConversionSet *next = conversion_begin_update();
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    CalSegments *cal = &next->cal[channel];
+    set_identity_segments(cal);
+    if (!calibrated) {
+      continue;
+    }
+    //Insertion sort of the taken points by raw reading
+    float raw[CAL_MAX_POINTS];
+    float ref[CAL_MAX_POINTS];
+    int points = 0;
+    for (int point = 0; point < CAL_MAX_POINTS; point++) {
+      if (!(calData.taken & (1 << point))) {
+        continue;
+      }
+      int i = points++;
+      while (i > 0 && raw[i - 1] > calData.raw[channel][point]) {
+        raw[i] = raw[i - 1];
+        ref[i] = ref[i - 1];
+        i--;
+      }
+      raw[i] = calData.raw[channel][point];
+      ref[i] = calData.ref[point];
+    }
+    bool valid = true;
+    for (int s = 0; s + 1 < points; s++) {
+      float raw_span = raw[s + 1] - raw[s];
+      if (!(raw_span > 0)) {
+        valid = false;
+        break;
+      }
+      cal->gain[s] = (ref[s + 1] - ref[s]) / raw_span;
+      cal->offset[s] = ref[s] - (cal->gain[s] * raw[s]);
+      if (s > 0) {
+        cal->start[s] = raw[s];
+      }
+    }
+    if (!valid) {
+      LogWarn("Thermistor %d calibration invalid, using raw temperature.", channel + 1);
+      set_identity_segments(cal);
+    }
+  }
+#ifdef USE_MILLIDEGREE_NDATA
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    fix_cal_segments(&next->cal[channel], &next->cal_fixed[channel]);
+  }
+#endif
+  conversion_publish(next);
+}
+
+
+/*
+ADC data-ready interrupt of ADC adc, handled by the scan engine while it is
+running and ignored otherwise.
+*/
+template <int adc>
+FASTRUN static void IRQ() {
+  if (acquisition_running()) {
+    acquisition_isr(adc);
+  }
+}
+
+static void (*const irqHandlers[MAX_ADCS])() = {IRQ<0>, IRQ<1>, IRQ<2>, IRQ<3>};
+
+
+/*
+Calibration capture state. While a reference point is taken the scan carries on
+as usual; each frame's uncalibrated temperatures are also collected (see
+thermistorMux_calcapture.cpp), and cal_step() commits the point once every
+enabled, unfaulted thermistor reads stably.
+*/
+static int calPoint = 0;              //Reference point being taken (1 to CAL_MAX_POINTS), 0 when idle
+static float calPointRef = 0;         //Its reference temperature
+static uint32_t calStart = 0;         //millis() when the capture began
+static int calDiscard = 0;            //Frames still to be let go before collecting
+static uint32_t calFrames = 0;        //Frames collected
+static uint32_t calFramesJudged = 0;  //Frames collected when cal_step() last judged them
+static int calStable = 0;             //Thermistors ready at that judgement (stable for the hold time)
+static ChannelMask calReady = 0;      //Which they are
+static float calNoise = 0;            //Largest standard deviation of the last point taken, °C
+static float calFrame[NUMBER_OF_THERMISTORS];
+
+//Frames right after cal_begin(), which may hold passes from before the command,
+//and the longest a capture may wait for the readings to settle.
+#define CAL_DISCARD_FRAMES 1
+#define CAL_CAPTURE_TIMEOUT_MS 600000
+
+//Burst capture state (see burst_start()): the scan settings it replaced, kept to
+//restore when it ends.
+#ifdef USE_RAW_STREAM
+static bool burstRunning = false;
+static unsigned long burstStart = 0;         //millis() when the burst began
+static unsigned int burstDurationMs = 0;
+static uint32_t burstSavedOsr = 0;
+static unsigned int burstSavedDwell = 1;
+#else
+//No raw stream to burst onto.
+static const bool burstRunning = false;
+#endif
+
+//Settling sweep state (see settling_sweep_start()): the block being taken, and
+//the settings the sweep replaced, kept to restore when it ends.
+static bool settlingRunning = false;
+static int settlingBlock = 0;                //0 to 2 * SETTLING_STEPS: references even, step n's candidate 2n + 1
+static unsigned int settlingPasses = 0;      //Passes added to the block
+static unsigned long settlingStart = 0;      //millis() when the sweep began
+static ChannelMask settlingChannels = 0;     //Thermistors being characterized
+static unsigned int settlingSavedDwell = 1;
+static uint16_t settlingSaved[NUMBER_OF_THERMISTORS];
+static ScanEntry settlingSavedList[MAX_SCAN_ENTRIES];
+
+//Longest a sweep may take before it is given up, settling times untouched
+#define SETTLING_TIMEOUT_MS 600000
+
+//Self test state (see self_test_start()): the profile being timed, and the ADC
+//settings the test replaced, kept to restore when it ends.
+static bool selfTestRunning = false;
+static unsigned int selfTestProfile = 0;
+static bool selfTestCounting = false;        //The profile's first conversion is in
+static uint32_t selfTestConversions = 0;     //HEALTH_CONVERSIONS when the profile started, or its first came
+static unsigned long selfTestStart = 0;      //millis() when the profile started
+static unsigned long selfTestWindow = 0;     //micros() of the profile's first conversion
+static int selfTestSavedProfile = 0;         //-1 for an oversampling ratio set on its own
+static uint32_t selfTestSavedOsr = 0;
+static unsigned int selfTestSavedPrescaler = 1;
+static SelfTestResults selfTestResults;
+
+//Channel enable mask, after the calibration data of older firmware. Erased EEPROM
+//(all 1s) enables every channel.
+#define CAL_EE_CHANNEL_MASK (1 + (2 * sizeof(float)) + (NUMBER_OF_THERMISTORS * 2 * sizeof(float)))
+//Acquisition profile index, after the channel mask. Erased EEPROM (0xFF) is the default profile.
+#define CAL_EE_ADC_PROFILE (CAL_EE_CHANNEL_MASK + sizeof(ChannelMask))
+#define DEFAULT_ADC_PROFILE 0
+
+
+/*
+True while a calibration sweep, a burst capture, a settling sweep or a self test has the scan
+engine, so its settings can't be changed.
+*/
+static bool scan_locked() {
+  return calPoint != 0 || burstRunning || settlingRunning || selfTestRunning;
+}
+
+
+/*
+Number of calibration points taken.
+*/
+static int cal_point_count() {
+  return __builtin_popcount(calData.taken);
+}
+
+
+/*
+Restores the calibration points saved by cal_step().
+*/
+static void load_cal_data() {
+  calstore_load(&calData);
+  calibrated = cal_point_count() >= 2;
+  if (calData.taken != 0) {
+    publish_refs(calData.ref, calData.taken);
+  }
+  update_cal_coefficients();
+}
+
+
+/*
+Erases every calibration point, in RAM and in EEPROM. Returns false if the
+erased calibration couldn't be saved; it is still gone until the next reset.
+*/
+bool clear_cal_data() {
+  memset(&calData, 0, sizeof(calData));
+  calibrated = false;
+  update_cal_coefficients();
+  return calstore_save(&calData);
+}
+
+
+/*
+Replaces every calibration point with data, e.g. an upload from the host (see
+calupload_decode()), saving it in one EEPROM write. Returns false, leaving the
+calibration in use, while a calibration sweep or burst has the scan or if it
+couldn't be saved.
+*/
+bool set_cal_data(const CalData *data) {
+  if (scan_locked() || !calstore_save(data)) {
+    return false;
+  }
+  calData = *data;
+  calibrated = cal_point_count() >= 2;
+  update_cal_coefficients();
+  publish_refs(calData.ref, calData.taken);
+  return true;
+}
+
+
+/*
+True once two or more calibration points are in use.
+*/
+bool cal_in_use() {
+  return calibrated;
+}
+
+
+/*
+Restores the channel enable mask saved by set_channel_mask().
+*/
+static void load_channel_mask() {
+  ChannelMask mask;
+  EEPROM.get(CAL_EE_CHANNEL_MASK, mask);
+  if (!acquisition_set_channel_mask(mask)) {
+    acquisition_set_channel_mask(ALL_CHANNELS_MASK);
+  }
+}
+
+
+/*
+Restores the acquisition profile saved by set_acquisition_profile(). Needs the
+ADC initialized.
+*/
+static void load_acquisition_profile() {
+  if (!set_ADC_profile(EEPROM.read(CAL_EE_ADC_PROFILE))) {
+    set_ADC_profile(DEFAULT_ADC_PROFILE);
+  }
+}
+
+
+/*
+Sets and saves the acquisition profile (ADC prescaler and oversampling ratio,
+see ADC_profile()), e.g. the mains rejection for the site's line frequency,
+restarting the scan engine with a fresh frame. Returns false, changing nothing,
+for an invalid profile or while a calibration sweep or a burst is running.
+*/
+bool set_acquisition_profile(int profile) {
+  if (scan_locked() || ADC_profile(profile) == NULL) {
+    return false;
+  }
+  acquisition_stop();
+  bool success = set_ADC_profile(profile);
+  if (success) {
+    EEPROM.write(CAL_EE_ADC_PROFILE, profile);
+    reset_frame();
+  }
+  start_scanning();
+  return success;
+}
+
+
+/*
+Sets and saves which thermistors are scanned and published (bit n for thermistor
+n), restarting the scan engine with a fresh frame. The mask is kept when the
+calibration data is cleared. Returns false, changing nothing, if no thermistor
+is enabled or a calibration sweep or a burst is running.
+*/
+bool set_channel_mask(ChannelMask mask) {
+  if (scan_locked()) {
+    return false;
+  }
+  acquisition_stop();
+  bool success = acquisition_set_channel_mask(mask);
+  if (success) {
+    EEPROM.put(CAL_EE_CHANNEL_MASK, acquisition_channel_mask());
+    fault_reset();
+    reset_frame();
+  }
+  start_scanning();
+  return success;
+}
+
+
+/*
+Sets and saves the thermistor models (see thermistorMux_sensor.cpp), restarting
+the scan engine with a fresh frame so none mixes old and new conversions. A
+channel's calibration was taken with its old model, so recalibrate after
+changing it. Returns false, changing nothing, for an invalid model or while a
+calibration sweep or a burst is running.
+*/
+bool set_sensor_models(const char *text) {
+  if (scan_locked()) {
+    return false;
+  }
+  acquisition_stop();
+  bool success = sensor_set_models(text);
+  if (success) {
+    fault_reset();
+    reset_frame();
+  }
+  start_scanning();
+  return success;
+}
+
+
+/*
+Sets and saves which model each thermistor converts with, as set_sensor_models().
+*/
+bool set_channel_sensors(const char *text) {
+  if (scan_locked()) {
+    return false;
+  }
+  acquisition_stop();
+  bool success = sensor_set_channels(text);
+  if (success) {
+    fault_reset();
+    reset_frame();
+  }
+  start_scanning();
+  return success;
+}
+
+
+/*
+Starts capturing reference point tempNum (1 to CAL_MAX_POINTS, in any order) at
+ref_temp, replacing that point if it was taken before once the capture commits.
+The scan keeps running and publishing throughout. Returns false if a capture is
+already running, a burst is, or tempNum is invalid.
+*/
+bool cal_begin(float ref_temp, int tempNum) {
+  if (scan_locked() || tempNum < 1 || tempNum > CAL_MAX_POINTS) {
+    return false;
+  }
+  LogInfo("Set temp is %0.2f, calibration point %d begun.", ref_temp, tempNum);
+  calcapture_start();
+  calPoint = tempNum;
+  calPointRef = ref_temp;
+  calStart = millis();
+  calDiscard = CAL_DISCARD_FRAMES;
+  calFrames = 0;
+  calFramesJudged = 0;
+  calStable = 0;
+  calReady = 0;
+  return true;
+}
+
+
+/*
+Hands a converted frame to the running capture, uncalibrated whatever calibration
+is in use. Faulted thermistors are left out.
+*/
+static void cal_capture_frame(ChannelMask faults) {
+  if (calDiscard > 0) {
+    calDiscard--;
+    return;
+  }
+  convert_thermistor_block(frame_data, calFrame, NUMBER_OF_THERMISTORS);
+  calcapture_add_frame(calFrame, frameChannels & ~faults, millis());
+  calFrames++;
+}
+
+
+static CalStep cal_finish(CalStep result) {
+  calPoint = 0;
+  calReady = 0;
+  return result;
+}
+
+
+/*
+Judges the capture once per new frame, without waiting on anything. Commits the
+point to EEPROM once every enabled, unfaulted thermistor has read stably for the
+hold time (see thermistorMux_calcapture.h); a disabled
+or faulted one keeps the reading it had for the point, if any. Returns
+CAL_RUNNING until the point is committed or the capture times out.
+*/
+CalStep cal_step() {
+  if (calPoint == 0) {
+    return CAL_IDLE;
+  }
+  ChannelMask required = acquisition_channel_mask() & ~fault_mask();
+  if ((millis() - calStart) >= CAL_CAPTURE_TIMEOUT_MS) {
+    LogError("Calibration point %d abandoned, %d of %d thermistors stable.", calPoint, calStable,
+             channel_mask_count(required));
+    return cal_finish(CAL_FAILED);
+  }
+  if (calFrames == calFramesJudged) {
+    return CAL_RUNNING;
+  }
+  calFramesJudged = calFrames;
+  PROFILE_SCOPE(PROFILE_CALIBRATION);
+
+  CalCaptureResult results[NUMBER_OF_THERMISTORS];
+  bool ready = required != 0;
+  calStable = 0;
+  calReady = 0;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    if (!(required & CHANNEL_BIT(channel))) {
+      continue;
+    }
+    if (calcapture_evaluate(channel, &results[channel]) && results[channel].ready) {
+      calStable++;
+      calReady |= CHANNEL_BIT(channel);
+    }
+    else {
+      ready = false;
+    }
+  }
+  if (!ready) {
+    return CAL_RUNNING;
+  }
+
+  int point = calPoint - 1;
+  calData.ref[point] = calPointRef;
+  calNoise = 0;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    if (!(required & CHANNEL_BIT(channel))) {
+      LogWarn("Thermistor %d not captured for calibration point %d.", channel + 1, calPoint);
+      continue;
+    }
+    const CalCaptureResult *result = &results[channel];
+    float stddev = sqrtf(result->variance);
+    if (stddev > calNoise) {
+      calNoise = stddev;
+    }
+    calData.raw[channel][point] = result->mean;
+    LogInfo("Read thermistor %d temp = %0.3f (std dev %0.4f, %u of %d frames kept) for calibration point %d",
+            channel + 1, result->mean, stddev, result->inliers, CALCAPTURE_WINDOW, calPoint);
+  }
+
+  calData.taken |= 1 << point;
+  //The readings are true at the die temperature the point was taken at
+  drift_set_reference(ADC_internal_temp);
+  if (!calstore_save(&calData)) {
+    LogError("Calibration point %d not saved; it is lost at the next reset.", calPoint);
+  }
+  if (cal_point_count() < 2) {
+    LogInfo("Cal data %d INW", calPoint);
+    return cal_finish(CAL_POINT_DONE);
+  }
+  calibrated = true;
+  update_cal_coefficients();
+  Serial.println("Calibration complete.");
+  return cal_finish(CAL_COMPLETE);
+}
+
+
+/*
+Thermistors ready (stable for the hold time) at the last judgement of the
+running capture, 0 while no capture is running.
+*/
+ChannelMask cal_ready_channels() {
+  return calReady;
+}
+
+
+/*
+Largest standard deviation of any thermistor's frames over the last calibration
+point taken, °C.
+*/
+float cal_noise() {
+  return calNoise;
+}
+
+
+/*
+Converts a pass and checks it against the alarm limits, publishing any alarm
+raised or cleared straight away.
+*/
+static void check_pass_alarms(ChannelMask channels) {
+  convert_thermistor_block_piecewise(pass_data, conversion_set()->cal, Channels.pass, NUMBER_OF_THERMISTORS);
+  channels &= ~fault_mask();
+  bool changed = alarm_check_pass(Channels.pass, channels, pass_cycles);
+  //The virtual channels from the same pass; a quiet channel not read this pass
+  //leaves those reading it unchecked
+  if (virtual_count() > 0) {
+    float values[MAX_VIRTUAL_CHANNELS];
+    virtual_evaluate(Channels.pass, channels, values);
+    changed |= alarm_check_virtual(values, pass_cycles);
+  }
+  if (changed) {
+    publish_alarms();
+  }
+}
+
+
+#ifdef USE_REF_TRACKING
+/*
+Scales the thermistor codes by each ADC's latest reference reading (see
+set_ADC_reference_code()).
+*/
+static void track_references() {
+  for (int adc = 0; adc < NUM_ADCS; adc++) {
+    set_ADC_reference_code(adc, acquisition_reference_code(adc));
+  }
+}
+#endif
+
+
+#ifdef USE_RAW_STREAM
+/*
+Starts a burst capture, to watch a few thermistors at the ADC's full rate during
+an event: the scan engine dwells on config->channels alone, each for
+MAX_DWELL_SAMPLES back to back conversions (continuous mode) per pass, at
+config->osr, and every conversion goes out on the raw stream. No frames are
+taken meanwhile. After config->duration_ms, or once the stream stops, the burst
+ends by itself and the scan resumes with its own settings and a fresh frame.
+Returns false, changing nothing, for an invalid config, without a raw stream, or
+while a calibration sweep or another burst is running.
+*/
+bool burst_start(const BurstConfig *config) {
+  ChannelMask channels = config->channels & ALL_CHANNELS_MASK;
+  if (scan_locked() || !stream_enabled() || channels == 0 ||
+      channel_mask_count(channels) > MAX_BURST_CHANNELS ||
+      config->duration_ms < 1 || config->duration_ms > MAX_BURST_MS) {
+    return false;
+  }
+  acquisition_stop();
+  burstSavedOsr = ADC_oversampling();
+  if (config->osr != 0 && config->osr != burstSavedOsr && !set_ADC_oversampling(config->osr)) {
+    start_scanning();
+    return false;
+  }
+  burstSavedDwell = acquisition_dwell_samples();
+  acquisition_set_dwell_samples(MAX_DWELL_SAMPLES);
+  acquisition_set_burst_channels(channels);
+  burstRunning = true;
+  burstStart = millis();
+  burstDurationMs = config->duration_ms;
+  LogInfo("Burst of %d thermistors at oversampling %lu for %u ms.", channel_mask_count(channels),
+          (unsigned long)ADC_oversampling(), burstDurationMs);
+  //Continuously, whatever the frame period
+  frameTimer.end();
+  acquisition_start();
+  return true;
+}
+
+
+/*
+Ends a burst capture early, or does nothing if none is running. Blocks for up
+to one conversion while the engine stops.
+*/
+void burst_stop() {
+  if (!burstRunning) {
+    return;
+  }
+  acquisition_stop();
+  acquisition_set_burst_channels(0);
+  acquisition_set_dwell_samples(burstSavedDwell);
+  if (ADC_oversampling() != burstSavedOsr) {
+    set_ADC_oversampling(burstSavedOsr);
+  }
+  burstRunning = false;
+  //The grid points the burst took aren't frame overruns.
+  lastFrameStart = 0;
+  reset_frame();
+  start_scanning();
+  LogInfo("Burst ended after %lu ms.", millis() - burstStart);
+}
+
+
+bool burst_running() {
+  return burstRunning;
+}
+
+
+/*
+Takes a burst's passes from the scan engine. The samples go out on the raw
+stream as they are taken (its sample hook); the passes themselves are dropped.
+*/
+static void burst_task() {
+  while (acquisition_get_pass(pass_data, &pass_cycles)) {
+  }
+  if (!stream_enabled() || (millis() - burstStart) >= burstDurationMs) {
+    burst_stop();
+  }
+}
+#endif
+
+
+/*
+Restarts the scan engine with every thermistor settling for us before its
+conversion, for the next block of a settling sweep. Blocks for up to one
+conversion while the engine stops.
+*/
+static void settling_block(unsigned int us) {
+  acquisition_stop();
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    acquisition_set_settling_us(channel, us);
+  }
+  settlingPasses = 0;
+  acquisition_start();
+}
+
+
+/*
+Starts a settling sweep, which finds, for each enabled and unfaulted thermistor,
+the shortest delay between its MOSFET switching in and its conversion starting
+that still reads what a long-settled conversion does (see
+thermistorMux_settling.cpp). The sweep scans every thermistor in blocks of
+passes, alternately at SETTLING_REFERENCE_US and at each step's candidate
+delay, starting and ending with a reference block. No frames
+are taken meanwhile. Once every step is done each thermistor scans with its own
+safe delay and the scan resumes with a fresh frame. Returns false, changing
+nothing, with no thermistor to characterize or while a calibration sweep, a
+burst or another settling sweep is running.
+*/
+bool settling_sweep_start() {
+  ChannelMask channels = acquisition_channel_mask() & ~fault_mask();
+  if (scan_locked() || channels == 0) {
+    return false;
+  }
+  acquisition_stop();
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    settlingSaved[channel] = acquisition_settling_us(channel);
+  }
+  //One conversion per slot, and every thermistor every pass
+  settlingSavedDwell = acquisition_dwell_samples();
+  acquisition_set_dwell_samples(1);
+  acquisition_scan_list(settlingSavedList);
+  acquisition_set_scan_list(NULL);
+  uint8_t everyPass[NUMBER_OF_THERMISTORS];
+  memset(everyPass, 1, sizeof(everyPass));
+  acquisition_set_channel_intervals(everyPass);
+  //Every thermistor in every block, whatever the frame banks
+  acquisition_set_frame_banks(1);
+  settling_start();
+  settlingChannels = channels;
+  settlingBlock = 0;
+  settlingRunning = true;
+  settlingStart = millis();
+  LogInfo("Settling sweep of %d thermistors, %d steps.", channel_mask_count(channels), SETTLING_STEPS);
+  //Continuously, whatever the frame period
+  frameTimer.end();
+  settling_block(SETTLING_REFERENCE_US);
+  return true;
+}
+
+
+/*
+Ends a settling sweep, giving each characterized thermistor its safe delay if
+complete, else putting back the delays from before the sweep, and resumes the
+scan.
+*/
+static void settling_finish(bool complete) {
+  acquisition_stop();
+  int characterized = 0;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    unsigned int us = settlingSaved[channel];
+    if (complete && (settlingChannels & CHANNEL_BIT(channel)) && settling_result_us(channel, &us)) {
+      LogInfo("Thermistor %d settles in %u us.", channel + 1, us);
+      characterized++;
+    }
+    acquisition_set_settling_us(channel, us);
+  }
+  acquisition_set_dwell_samples(settlingSavedDwell);
+  acquisition_set_scan_list(settlingSavedList);
+  acquisition_set_channel_intervals(Channels.interval);
+  settlingRunning = false;
+  //The grid points the sweep took aren't frame overruns.
+  lastFrameStart = 0;
+  reset_frame();
+  start_scanning();
+  if (complete) {
+    LogInfo("Settling sweep set %d thermistors after %lu ms.", characterized, millis() - settlingStart);
+  } else {
+    LogInfo("Settling sweep ended after %lu ms, settling times unchanged.", millis() - settlingStart);
+  }
+}
+
+
+/*
+Ends a settling sweep early, leaving the settling times as they were, or does
+nothing if none is running.
+*/
+void settling_sweep_stop() {
+  if (settlingRunning) {
+    settling_finish(false);
+  }
+}
+
+
+bool settling_sweep_running() {
+  return settlingRunning;
+}
+
+
+/*
+Adds a settling sweep's passes to the block being taken and moves on to the next
+block once it is full, judging a step once the reference after its candidate is
+in. The sweep ends after the last step's.
+*/
+static void settling_task() {
+  SettlingBlock block = settlingBlock == 0 ? SETTLING_BEFORE :
+                        (settlingBlock & 1) ? SETTLING_CANDIDATE : SETTLING_AFTER;
+  while (acquisition_get_pass(pass_data, &pass_cycles)) {
+    //Passes past a full block are left out, they were taken while it was judged
+    if (settlingPasses < SETTLING_BLOCK_PASSES) {
+      settling_add_pass(pass_data, acquisition_pass_channels() & settlingChannels & ~fault_mask(), block);
+      settlingPasses++;
+    }
+  }
+  if ((millis() - settlingStart) >= SETTLING_TIMEOUT_MS) {
+    LogError("Settling sweep timed out at step %d.", (settlingBlock + 1) / 2);
+    settling_finish(false);
+    return;
+  }
+  if (settlingPasses < SETTLING_BLOCK_PASSES) {
+    return;
+  }
+  if (block == SETTLING_AFTER) {
+    settling_end_step(settlingBlock / 2 - 1);
+  }
+  if (++settlingBlock > 2 * SETTLING_STEPS) {
+    settling_finish(true);
+    return;
+  }
+  settling_block((settlingBlock & 1) ? settling_candidate_us(settlingBlock / 2) : SETTLING_REFERENCE_US);
+}
+
+
+/*
+Restarts the scan engine with the next profile of a self test, all the ADCs
+set to it. Blocks for up to one conversion while the engine stops.
+*/
+static void self_test_profile() {
+  acquisition_stop();
+  set_ADC_profile(selfTestProfile);
+  selfTestResults.nominal[selfTestProfile] = 1e6f / ADC_device(0)->conversion_us(0);
+  selfTestResults.rate[selfTestProfile] = NAN;
+  selfTestCounting = false;
+  selfTestConversions = health_counter(HEALTH_CONVERSIONS);
+  selfTestStart = millis();
+  acquisition_start();
+}
+
+
+/*
+Starts a performance self test (see thermistorMux_selftest.h). The SPI bus and
+the conversion kernel are timed at once, with the scan engine stopped; then the
+scan runs continuously with each acquisition profile in turn, whatever the
+frame period, for its conversion rate. No frames are taken meanwhile. Once the
+last profile is timed the ADC settings are put back, the scan resumes with a
+fresh frame and the network module times the rest and publishes the results.
+Returns false, changing nothing, while a calibration sweep, a burst, a settling
+sweep or another self test is running.
+*/
+bool self_test_start() {
+  if (scan_locked()) {
+    return false;
+  }
+  acquisition_stop();
+  memset(&selfTestResults, 0, sizeof(selfTestResults));
+  selfTestResults.spi_read_us = selftest_spi_read_us();
+  selfTestResults.kernel_cycles = selftest_kernel_cycles(frame_data);
+  selfTestSavedProfile = ADC_profile_in_use();
+  selfTestSavedOsr = ADC_oversampling();
+  selfTestSavedPrescaler = ADC_device(0)->prescaler();
+  selfTestProfile = 0;
+  selfTestRunning = true;
+  //Every ADC converting throughout, whatever the frame banks
+  acquisition_set_frame_banks(1);
+  LogInfo("Self test started.");
+  frameTimer.end();
+  self_test_profile();
+  return true;
+}
+
+
+/*
+Ends a self test, putting back the ADC settings it replaced, and resumes the
+scan. A complete test's results go to the network module.
+*/
+static void self_test_finish(bool complete) {
+  acquisition_stop();
+  if (selfTestSavedProfile >= 0) {
+    set_ADC_profile(selfTestSavedProfile);
+  } else {
+    for (int adc = 0; adc < NUM_ADCS; adc++) {
+      ADC_device(adc)->set_prescaler(selfTestSavedPrescaler);
+    }
+    set_ADC_oversampling(selfTestSavedOsr);
+  }
+  selfTestRunning = false;
+  //The grid points the test took aren't frame overruns.
+  lastFrameStart = 0;
+  reset_frame();
+  start_scanning();
+  if (complete) {
+    selfTestResults.profiles = selfTestProfile;
+    LogInfo("Self test: SPI read %.1f us, kernel %.0f cycles/thermistor.", selfTestResults.spi_read_us,
+            selfTestResults.kernel_cycles);
+    publish_self_test(&selfTestResults);
+  } else {
+    LogInfo("Self test ended early.");
+  }
+}
+
+
+/*
+Ends a self test early, publishing nothing, or does nothing if none is running.
+*/
+void self_test_stop() {
+  if (selfTestRunning) {
+    self_test_finish(false);
+  }
+}
+
+
+bool self_test_running() {
+  return selfTestRunning;
+}
+
+
+/*
+Times the conversions of a self test's profile from its first, moving on to
+the next profile once the window is over, and ending the test after the last.
+The passes are thrown away.
+*/
+static void self_test_task() {
+  while (acquisition_get_pass(pass_data, &pass_cycles)) {
+  }
+  uint32_t conversions = health_counter(HEALTH_CONVERSIONS) - selfTestConversions;
+  if (!selfTestCounting) {
+    if (conversions > 0) {
+      selfTestCounting = true;
+      selfTestConversions += conversions;
+      selfTestWindow = micros();
+      return;
+    }
+    if ((millis() - selfTestStart) < SELF_TEST_PROFILE_TIMEOUT_MS) {
+      return;
+    }
+  } else {
+    unsigned long elapsed = micros() - selfTestWindow;
+    if (elapsed < SELF_TEST_WINDOW_MS * 1000UL ||
+        (conversions < SELF_TEST_CONVERSIONS * NUM_ADCS && (millis() - selfTestStart) < SELF_TEST_PROFILE_TIMEOUT_MS)) {
+      return;
+    }
+    selfTestResults.rate[selfTestProfile] = conversions * 1e6f / elapsed / NUM_ADCS;
+  }
+  if (++selfTestProfile >= SELF_TEST_MAX_PROFILES || ADC_profile(selfTestProfile) == NULL) {
+    self_test_finish(true);
+    return;
+  }
+  self_test_profile();
+}
+
+
+/*
+Sets every thermistor's delay between its MOSFET switching in and its
+conversion starting, us[n] for thermistor n, restarting the scan if any changed.
+Returns false, changing nothing, for a delay over MAX_SETTLE_US or while a
+calibration sweep, a burst or a settling sweep is running.
+*/
+bool set_settling_times(const uint16_t *us) {
+  bool changed = false;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    if (us[channel] > MAX_SETTLE_US) {
+      return false;
+    }
+    changed |= us[channel] != acquisition_settling_us(channel);
+  }
+  if (scan_locked()) {
+    return false;
+  }
+  if (!changed) {
+    return true;
+  }
+  acquisition_stop();
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    acquisition_set_settling_us(channel, us[channel]);
+  }
+  reset_frame();
+  start_scanning();
+  return true;
+}
+
 
 /*
-Array representing 32 Mosfets
-mosfet[0] = header pin 0; mosfet Q1
-mosfet[1] = header pin 1; mosfet Q2
-...
-mosfet[31] = header pin 22; mosfet Q32
+Sets the scan list (see acquisition_set_scan_list()), restarting the scan with
+a fresh frame if it changed. Returns false, changing nothing, for an invalid
+list or while a calibration sweep, a burst or a settling sweep is running.
 */
-static unsigned int mosfet[NUMBER_OF_THERMISTORS] = {0,1,2,3,4,5,6,7,8,9,24,25,26,27,28,29,30,31,
-                                  32,36,37,40,41,14,15,16,17,18,19,20,21,22};                                 
-static int irqFlag = 0;
-unsigned int eeAddr;
-bool setup_successful = false;
-int mosfetRef;
-bool calibrated = false;
-static float ref_Low = {0.00};
-static float ref_High = {0.00};
-static float raw_Low[NUMBER_OF_THERMISTORS] = {0.00};
-static float raw_High[NUMBER_OF_THERMISTORS] = {0.00};
+bool set_scan_list(const ScanEntry *list) {
+  ScanEntry current[MAX_SCAN_ENTRIES];
+  acquisition_scan_list(current);
+  unsigned int entries = 0;
+  while (entries < MAX_SCAN_ENTRIES && list[entries].repeat != 0) {
+    entries++;
+  }
+  bool changed = entries < MAX_SCAN_ENTRIES ? current[entries].repeat != 0 : false;
+  changed |= memcmp(current, list, entries * sizeof(ScanEntry)) != 0;
+  if (scan_locked()) {
+    return false;
+  }
+  if (!changed) {
+    return true;
+  }
+  acquisition_stop();
+  bool success = acquisition_set_scan_list(list);
+  if (success) {
+    reset_frame();
+  }
+  start_scanning();
+  return success;
+}
 
 
+/*
+Recovers the scan from a data-ready the scan engine waited too long for (see
+acquisition_missed_engines()), which would otherwise stall it until a power
+cycle: the ADCs are re-initialized, up to ADC_RECOVERY_ATTEMPTS times until
+their registers read back, and the scan restarts. A burst or a settling sweep
+carries on; otherwise the partial frame is dropped. If the ADCs still don't
+answer, the scan stalls again and the next recovery retries.
+*/
+static void recover_scan(uint32_t missed) {
+  acquisition_stop();
+  bool recovered = false;
+  for (int attempt = 0; attempt < ADC_RECOVERY_ATTEMPTS && !recovered; attempt++) {
+    if (attempt > 0) {
+      delay(ADC_RECOVERY_RETRY_MS);
+    }
+    recovered = initADC() && verify_ADC_registers();
+  }
+  health_count(HEALTH_ADC_RECOVERIES);
+  LogError("ADC data-ready missed (ADCs 0x%lx); %s.", (unsigned long)missed,
+           recovered ? "ADCs re-initialized" : "ADCs not answering, retrying");
+  if (burstRunning || settlingRunning || selfTestRunning) {
+    acquisition_start();
+    return;
+  }
+  lastFrameStart = 0;
+  reset_frame();
+  start_scanning();
+}
+
 
-void IRQ() {
-  irqFlag = 1;
+/*
+The watchdog's acquisition recovery: passes have stopped coming without the scan
+engine reporting a missed data-ready, so all the ADCs are re-initialized.
+*/
+static void restart_scan() {
+  recover_scan((1u << NUM_ADCS) - 1);
 }
 
 
-bool clear_cal_data() {
+/*
+Collects finished passes from the scan engine, checks them for open or shorted
+thermistors and alarms, and filters them. Once averagingPasses passes are in, takes the frame
+and hands it to the conversion task. With frame banks that is the bank's part of the
+frame, and the engine moves on to the next bank. Checks in with the watchdog for each
+pass, and while the engine is stopped or lent out.
+*/
+static void acquisition_task() {
+  PROFILE_SCOPE(PROFILE_ACQUISITION);
+  uint32_t missed = acquisition_missed_engines();
+  if (missed != 0) {
+    recover_scan(missed);
+    return;
+  }
+  if (!acquisition_running() || burstRunning || settlingRunning || selfTestRunning) {
+    watchdog_checkin(WATCHDOG_ACQUISITION);
+  }
+#ifdef USE_RAW_STREAM
+  if (burstRunning) {
+    burst_task();
+    return;
+  }
+#endif
+  if (settlingRunning) {
+    settling_task();
+    return;
+  }
+  if (selfTestRunning) {
+    self_test_task();
+    return;
+  }
+  if (bankPending) {
+    start_bank();
+  }
+  //Stopped before the ring is drained, so every pass it took is collected below
+  bool stopped = frameBanks > 1 && !bankPending && !acquisition_running();
+  while (acquisition_get_pass(pass_data, &pass_cycles)) {
+    ChannelMask channels = acquisition_pass_channels();
+    watchdog_checkin(WATCHDOG_ACQUISITION);
+#ifdef USE_REF_TRACKING
+    track_references();
+#endif
+    fault_check_pass(pass_data, channels);
+    if (alarm_enabled()) {
+      check_pass_alarms(channels);
+    }
+    filter_add_pass(pass_data, channels);
+    passCount++;
+    if (++avgCount >= (int)averagingPasses) {
+      avgCount = 0;
+      partChannels = filter_get_frame(frame_data);
+      frameChannels = bankLast ? partChannels : frameChannels | partChannels;
+      if (frameBanks > 1) {
+        framePart = acquisition_bank_channels(frameBank);
+        frameBank = bank_after(frameBank);
+        bankLast = frameBank >= frameBanks;
+        if (bankLast) {
+          frameBank = bank_after(-1);
+        }
+        start_bank();
+      } else {
+        framePart = ALL_CHANNELS_MASK;
+      }
+      //Leave any further passes in the ring until this frame has been converted.
+      scheduler_signal(conversionTask);
+      return;
+    }
+  }
+  if (stopped && avgCount != 0) {
+    //The bank stopped short of its passes (a pass was dropped); start the frame over.
+    reset_frame();
+    if (framePeriodMs == 0) {
+      acquisition_start_passes(averagingPasses);
+    }
+  }
+}
 
-  EEPROM.write(0, 0x00);
-  eeAddr = 1;
-  mosfetRef = 0;
-  int eeAddr_last = 0;
-
-  //Clear reference temperature values from EEPROM
-  EEPROM.write(eeAddr, 0x00);
-  eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'ref_Low'.
-  EEPROM.write(eeAddr, 0x00);
-  eeAddr += sizeof(ref_High); //Move address to the next byte after float 'ref_High'.
-
-  //Clear raw temperature values from EEPROM
-  while (eeAddr_last < (NUMBER_OF_THERMISTORS * 2)) {
-    EEPROM.write(eeAddr, 0x00);
-    eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'raw_Low'.
-    EEPROM.write(eeAddr, 0x00);
-    eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'raw_High'.
-    eeAddr_last = eeAddr_last + 2;
-    mosfetRef++;
-  }
-
-  //Clear calibration values from firmware.
-  ref_Low = {0.00};
-  ref_High = {0.00};
-  for( mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
-    raw_Low[mosfetRef] = {0.00};
-    raw_High[mosfetRef] = {0.00};
+
+/*
+Works out each thermistor's change per pass from its fresh frames and sets the
+adaptive schedule from it: a channel is scanned often enough to see about
+ADAPTIVE_STEP_C of change between its samples, but at least every quietInterval
+passes. Intervals are powers of 2 so noise doesn't reshuffle the schedule every
+frame.
+*/
+static void update_sample_schedule() {
+  bool changed = false;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    float temp = thermistor_celsius(Channels.frame[channel]);
+    if (!(frameChannels & CHANNEL_BIT(channel)) || isnan(temp)) {
+      continue;
+    }
+    uint32_t passes = passCount - Channels.fresh_pass[channel];
+    if (Channels.fresh_pass[channel] != 0 && passes > 0) {
+      float change = fabsf(temp - Channels.fresh_temp[channel]) / passes;
+      Channels.change[channel] += ADAPTIVE_SMOOTHING * (change - Channels.change[channel]);
+    }
+    Channels.fresh_temp[channel] = temp;
+    Channels.fresh_pass[channel] = passCount;
+
+    //With a target noise, still scanned often enough for the samples it needs
+    unsigned int longest = quietInterval;
+    if (targetNoise > 0 && Channels.depth[channel] > 0 && averagingPasses / Channels.depth[channel] < longest) {
+      longest = averagingPasses / Channels.depth[channel];
+    }
+    unsigned int interval = 1;
+    while (interval * 2 <= longest && Channels.change[channel] * interval * 2 <= ADAPTIVE_STEP_C) {
+      interval *= 2;
+    }
+    if (interval != Channels.interval[channel]) {
+      Channels.interval[channel] = interval;
+      changed = true;
+    }
+  }
+  if (changed) {
+    acquisition_set_channel_intervals(Channels.interval);
+    publish_sample_schedule();
   }
-  calibrated = false;
-  return true;
 }
 
 
-bool cal_thermistor(float ref_temp, int tempNum){
-    eeAddr = 1;
-    irqFlag = 0;
-    Serial.printf("Set temp is %0.2f, calibration begun.\n", ref_temp);
-    setThermistorMuxRead();
-    delay(1);
-    for(int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-        digitalWrite(mosfet[mosfetRef], HIGH);
-        start_conversion();
-        
-        while (irqFlag == 0) {
-          delay(1); //Wait for interrupt 
-        }
-        irqFlag = 0;
-
-        float raw_temp = read_ADCDATA();
-
-        if (tempNum == 1) {
-          ref_Low = ref_temp;
-          raw_Low[mosfetRef] = raw_temp; 
-          Serial.println("Cal data 1 INW");
-        } 
-        else if (tempNum == 2) {
-          ref_High = ref_temp;
-          raw_High[mosfetRef] = raw_temp;
-          Serial.println("Cal data 2 INW");
-          //raw_Low[mosfetRef] = (ref_High - ref_Low) / (raw_High[mosfetRef] - raw_Low[mosfetRef]);
-         // raw_High[mosfetRef] = raw_High[mosfetRef] - (raw_Low[mosfetRef] * ref_High); 
+/*
+Works out the samples each thermistor sampled in the frame needs to meet the
+target noise, from its noise per code (see filter_noise()) and its °C per code
+at its reading, and sets the averaging depth for the noisiest. Only the boxcar
+filter averages a frame's passes, so the depth is left alone with the others.
+*/
+static void update_averaging_depth() {
+  if (filter_type() != FILTER_BOXCAR) {
+    return;
+  }
+  uint32_t offset_data[NUMBER_OF_THERMISTORS];
+  float temps[NUMBER_OF_THERMISTORS];
+  float offset_temps[NUMBER_OF_THERMISTORS];
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    //Towards 0, so an offset code can't wrap past full scale
+    int32_t code = ((int32_t)(frame_data[channel] << 8)) >> 8;
+    offset_data[channel] = (uint32_t)(code > 0 ? code - NOISE_SLOPE_CODES : code + NOISE_SLOPE_CODES) & 0x00FFFFFF;
+  }
+  convert_thermistor_block(frame_data, temps, NUMBER_OF_THERMISTORS);
+  convert_thermistor_block(offset_data, offset_temps, NUMBER_OF_THERMISTORS);
 
-        }
-        digitalWrite(mosfet[mosfetRef], LOW);
-        
-        if (eeAddr == 1) {
-          EEPROM.put(eeAddr, ref_Low);
-          eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'f'.
-          EEPROM.put(eeAddr, ref_High);
-          eeAddr += sizeof(ref_High); //Move address to the next byte after float 'f'.
-        }
-        Serial.printf("Read thermistor temp = %0.2f Calculated cal value 1 = %0.2f, cal value 2 = %0.2f\n", raw_temp, raw_Low[mosfetRef], raw_High[mosfetRef]);
-        EEPROM.put(eeAddr, raw_Low[mosfetRef]);
-        eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'f'.
-        EEPROM.put(eeAddr, raw_High[mosfetRef]);
-        eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'f'.
-    }
-    Serial.println(eeAddr);
-    
-    if (tempNum == 2) {
-      EEPROM.write(0, 0x01);
-      calibrated = true;
-      Serial.println("Calibration complete.");
-      return true;
+  float needed = 1;
+  bool known = false;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    float noise = filter_noise(channel) * fabsf(offset_temps[channel] - temps[channel]) / NOISE_SLOPE_CODES;
+    if (!(frameChannels & CHANNEL_BIT(channel)) || isnan(noise)) {
+      continue;
     }
-    else {
-      return false;
+    float samples = (noise / targetNoise) * (noise / targetNoise);
+    Channels.depth[channel] = samples < MAX_ADAPTIVE_PASSES ? (uint16_t)ceilf(samples > 1 ? samples : 1) :
+                              MAX_ADAPTIVE_PASSES;
+    if (samples > needed) {
+      needed = samples;
     }
+    known = true;
+  }
+  if (!known) {
+    return;
+  }
+  unsigned int passes = 1;
+  while (passes < needed && passes < MAX_ADAPTIVE_PASSES) {
+    passes *= 2;
+  }
+  if (passes < averagingPasses && needed > passes * NOISE_DEPTH_MARGIN) {
+    passes = (passes * 2 < averagingPasses) ? passes * 2 : averagingPasses;
+  }
+  if (passes != averagingPasses) {
+    averagingPasses = passes;
+    publish_scan_config();
+  }
 }
 
 
-void setup() {
-  //MOSFET digital control I/O ports, set to output. All MOSFETS turned off (pins set to LOW).
-  for (int mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-    pinMode(mosfet[mosfetRef], OUTPUT);  
-    digitalWrite(mosfet[mosfetRef], LOW);
+/*
+Target noise of each thermistor in a frame, °C RMS; 0 when the averaging depth
+is as set.
+*/
+float target_noise() {
+  return targetNoise;
+}
+
+
+/*
+Adapts the averaging depth of each frame to the fewest passes that bring every
+thermistor's noise down to noise (°C RMS), or, with 0, leaves it as set through
+set_scan_config() (as last adapted, until then). Returns false for a negative
+value.
+*/
+bool set_target_noise(float noise) {
+  if (!(noise >= 0)) {
+    return false;
   }
-  //INW: figure out how to set skew
+  targetNoise = noise;
+  return true;
+}
 
-  /*
-  Enable global interrupts. 
-  Set up ADC interrupt feature on teensy pin 23. 
-  Upon recieving an interrupt from ADC(indicating new data is available in ADC),
-  IRQ flag is triggered.
-  */
-  pinMode(INTERRUPT_PIN, INPUT_PULLUP);
-  attachInterrupt(digitalPinToInterrupt(INTERRUPT_PIN), IRQ, FALLING);
-  sei();
 
-  setup_successful = hardwareID_init() && initTeensySPI() && initADC() && network_init();
-  
-  if(setup_successful){
-    Serial.println("Setup successful.");
-    check_brokers();
+/*
+Passes between scans of a quiet thermistor; 1 when adaptive sampling is off.
+*/
+unsigned int quiet_interval() {
+  return quietInterval;
+}
+
+
+/*
+Turns adaptive sampling on, scanning thermistors that barely change only every
+passes passes (2..MAX_QUIET_INTERVAL), or off with 1. Takes effect from the next
+pass without restarting the engine. Returns false for an out of range value.
+*/
+bool set_quiet_interval(unsigned int passes) {
+  if (passes < 1 || passes > MAX_QUIET_INTERVAL) {
+    return false;
   }
-  else {
-    Serial.println("Setup Failed.");
+  quietInterval = passes;
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    if (Channels.interval[channel] > passes) {
+      Channels.interval[channel] = passes;
+    }
   }
+  acquisition_set_channel_intervals(Channels.interval);
+  publish_sample_schedule();
+  return true;
+}
+
 
-  if (EEPROM.read(0) == 0x01) {
-    calibrated = true;
-    eeAddr = 1;
-    mosfetRef = 0;
-    int eeAddr_last = 0;
-    if (eeAddr == 1) {
-      EEPROM.get(eeAddr, ref_Low);
-      eeAddr += sizeof(ref_Low); //Move address to the next byte after float 'f'.
-      EEPROM.get(eeAddr, ref_High);
-      eeAddr += sizeof(ref_High); //Move address to the next byte after float 'f'.
+/*
+Converts the filter output to temperatures once per frame. Faulted thermistors
+read THERMISTOR_NULL and are published as null. With frame banks each bank's part
+is converted, filtered and published as a frame of its own, its own number and
+timestamp; what works on whole frames (the SD log, statistics, calibration and
+adaptive sampling) waits for the last.
+*/
+static void conversion_task() {
+  PROFILE_SCOPE(PROFILE_CONVERSION);
+  //Conversion and calibration in one pass; the calibration is identity while uncalibrated.
+  //Saturated thermistor codes are reported by the fault checks instead. The whole
+  //frame converts with the tables it started with, whatever changes meanwhile.
+  channels_frame_begin();
+  const ConversionSet *tables = conversion_pin();
+#ifdef USE_MILLIDEGREE_NDATA
+  convert_thermistor_block_mdeg(frame_data, tables->cal_fixed, Channels.frame, NUMBER_OF_THERMISTORS);
+#else
+  convert_thermistor_block_piecewise(frame_data, tables->cal, Channels.frame, NUMBER_OF_THERMISTORS);
+#endif
+  thermistor_code_block(frame_data, Channels.codes, NUMBER_OF_THERMISTORS);
+  if (convert_internal_block(&frame_data[ADC_TEMP_SLOT], &ADC_internal_temp, 1) > 0) {
+    LogWarn("Invalid internal ADC temperature data.");
+  }
+  ChannelMask faults = fault_mask();
+  if (drift_capturing() && calPoint == 0) {
+    drift_capture_frame(Channels.frame, partChannels & ~faults, ADC_internal_temp);
+  }
+  //The die temperature drift and the modeled self-heating, subtracted in the same
+  //pass over the channels; the drift captures take the readings as they are, but
+  //calibration is taken self-heating corrected, as the readings it calibrates are
+  float drift = (calPoint == 0 && !drift_capturing()) ? drift_correction(ADC_internal_temp) : 0;
+  bool selfheat = selfheat_correcting() && !drift_capturing();
+  for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+    if (faults & CHANNEL_BIT(channel)) {
+      Channels.frame[channel] = THERMISTOR_NULL;
+      Channels.codes[channel] = RAW_CODE_NULL;
     }
-    while (eeAddr_last < 64) {
-      EEPROM.get(eeAddr, raw_Low[mosfetRef]);
-      eeAddr += sizeof(raw_Low[mosfetRef]); //Move address to the next byte after float 'f'.
-      EEPROM.get(eeAddr, raw_High[mosfetRef]);
-      eeAddr += sizeof(raw_High[mosfetRef]); //Move address to the next byte after float 'f'.
-      eeAddr_last = eeAddr_last + 2;
-      mosfetRef++;
+    else if ((drift != 0 || selfheat) && !thermistor_null(Channels.frame[channel])) {
+      float rise = selfheat ? selfheat_rise(channel, frame_data[channel]) : 0;
+      Channels.frame[channel] = thermistor_value(thermistor_celsius(Channels.frame[channel]) - drift - rise);
+    }
+  }
+  conversion_unpin();
+  //Calibration captures the readings as they are
+  if (calPoint == 0) {
+    kalman_update(Channels.frame, partChannels, pass_cycles);
+  }
+  channels_frame_end(pass_cycles, framePart, bankLast);
+  publish_channel_faults(faults & acquisition_channel_mask());
+  if (!bankLast) {
+    scheduler_signal(publishTask);
+    return;
+  }
+#ifdef USE_FRAME_SYNC
+  //The next frame is armed GRID_ARM_US before it starts, after this one is converted.
+  framesync_note_frame(Channels.frame_number, frameStartCycles, framePeriodMs);
+#endif
+#ifdef USE_SD_LOG
+  sdlog_add_frame(frame_data, pass_cycles);
+#endif
+#ifdef USE_CHANNEL_STATS
+  if (stats_add_frame(Channels.frame, acquisition_channel_mask())) {
+    publish_channel_stats();
+  }
+  rollup_add_frame(Channels.frame, acquisition_channel_mask(), time_cycles_to_utc_millis(pass_cycles));
+#endif
+  if (calPoint != 0) {
+    cal_capture_frame(faults);
+  }
+  if (targetNoise > 0) {
+    update_averaging_depth();
+  }
+  if (quietInterval > 1) {
+    update_sample_schedule();
+  }
+  frameCount++;
+  health_count(HEALTH_FRAMES);
+  LogTrace(TRACE_FRAME_DONE, frameCount);
+
+  LogInfo("Internal ADC temperature: %0.2f °C", ADC_internal_temp);
+  for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
+    if (!acquisition_channel_enabled(mosfetRef)) {
+      continue;
     }
-    publish_refs(ref_Low, ref_High);
+    LogDebug("Thermistor %d %s temperature: %0.2f °C", mosfetRef + 1,
+             calibrated ? "calibrated" : "uncalibrated", thermistor_celsius(Channels.frame[mosfetRef]));
   }
+  scheduler_signal(publishTask);
 }
 
 
-void loop() {
-  int avgCount = 0;
-  float thermistor_temp[NUMBER_OF_THERMISTORS] = {0.00};
-  float ADC_internal_temp = 0;
+static void publish_task() {
+  uint32_t publishStart = ARM_DWT_CYCCNT;
+  //Only a complete frame goes out; the metrics read it in place
+  uint32_t frameSeq = Channels.frame_seq;
+  if (frameSeq & 1) {
+    LogWarn("Frame %lu is still being converted, not published.", (unsigned long)frameCount);
+  } else {
+    //Timestamp the frame with the read time of its last sample
+    publish_data(Channels.frame, ADC_internal_temp, Channels.frame_cycles, Channels.frame_number);
+    if (!channels_frame_complete(frameSeq)) {
+      LogWarn("Frame %lu changed while it was published.", (unsigned long)frameCount);
+    }
+  }
+  LogTrace(TRACE_FRAME_PUBLISHED, ARM_DWT_CYCCNT - publishStart);
 
-  check_brokers();
+  //The ADC configuration is shadowed rather than read back on every sample; check it
+  //occasionally and rewrite it if the device has lost it (e.g. a brown-out reset).
+  if (++framesSinceRegisterCheck >= ADC_REGISTER_CHECK_FRAMES) {
+    framesSinceRegisterCheck = 0;
+    if (!verify_ADC_registers()) {
+      acquisition_stop();
+      initADC();
+      start_scanning();
+    }
+  }
+}
 
 
-  //Cycle through mofets; setting digital control pin high, calls on 
-  //function that sets mux register to read thermistor inputs.
-  //Takes average of 5 data values for each mosfet & internal temp, then resets data buffers.
-  while(avgCount < 5) {
-    setThermistorMuxRead();
-    delay(1);
-    for(mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++) {
-      digitalWrite(mosfet[mosfetRef], HIGH);
-      start_conversion();
-      
-      while (irqFlag == 0) {
-        delay(1); //Wait for interrupt 
-      }
-      irqFlag = 0;
+/*
+Frame timer interrupt: starts the armed passes exactly on the frame start. How
+late it ran is noted as an interrupt latency, and how far past a UTC grid point
+the passes started as the frame phase.
+*/
+FASTRUN static void frame_isr() {
+  frameTimer.end();
+  uint64_t entry = time_cycles64();
+  if (entry > frameTimerDueCycles) {
+    health_note_latency((uint32_t)(entry - frameTimerDueCycles));
+  }
+  uint64_t fired;
+  while ((fired = time_cycles64()) < frameStartCycles) {
+  }
+#ifdef USE_FRAME_SYNC
+  framesync_pulse();
+#endif
+  acquisition_fire_passes();
+  if (lastFrameUtc) {
+    uint64_t late = fired - frameStartCycles;
+    health_note_phase(late < UINT32_MAX ? (uint32_t)late : UINT32_MAX - 1);
+  }
+}
 
-    if(thermistor_temp[mosfetRef] == 0.00) {
-        thermistor_temp[mosfetRef] = read_ADCDATA();
-      }
-      else {
-        thermistor_temp[mosfetRef] = (thermistor_temp[mosfetRef] + read_ADCDATA()) / (2); 
-      }
-      digitalWrite(mosfet[mosfetRef], LOW);
-    }
-    //Calls on function that sets mux register to read internal ADC temperature. 
-    setADCInternalTempRead();
-    delay(1);
-    start_conversion();
-    
-    while (irqFlag == 0) {
-      delay(1); //Wait for interrupt
-    }
-    irqFlag = 0;
 
-    if (ADC_internal_temp == 0) {
-      ADC_internal_temp = read_ADCDATA();
+#ifdef USE_FRAME_SYNC
+/*
+Frame sync line's rising edge, on a follower: starts the armed passes there and
+then, noting how long after the edge as the frame phase. The edge sets when the
+next is due either way; one while the frame before is still being taken is a
+frame overrun.
+*/
+FASTRUN static void sync_isr() {
+  uint64_t edge = time_cycles64();
+  syncEdgeCycles = edge;
+  if (!syncArmed) {
+    if (acquisition_running()) {
+      health_count(HEALTH_FRAME_OVERRUNS);
     }
-    else {
-      ADC_internal_temp = (ADC_internal_temp + read_ADCDATA()) / (2);
+    return;
+  }
+  frameTimer.end();
+  syncArmed = false;
+  frameStartCycles = edge;
+  acquisition_fire_passes();
+  health_note_phase((uint32_t)(time_cycles64() - edge));
+}
+
+
+/*
+Frame timer of a follower, the edge being later than the board clocks can
+account for: starts the frame on the follower's own count of the period instead,
+so the frames carry on in step while the line is cut, and counts the miss.
+*/
+FASTRUN static void sync_timeout_isr() {
+  frameTimer.end();
+  if (!syncArmed) {
+    return;
+  }
+  syncArmed = false;
+  syncEdgeCycles = syncDueCycles;
+  frameStartCycles = time_cycles64();
+  acquisition_fire_passes();
+  health_count(HEALTH_SYNC_MISSED);
+}
+
+
+/*
+The grid task of a frame sync follower once it has seen an edge: arms the
+engine GRID_ARM_US before the next is due, a frame period after the last, give
+or take FRAME_SYNC_DRIFT_PPM of the period either side, and leaves the start to
+sync_isr(), or to the frame timer if the edge doesn't come in that window.
+*/
+static void follow_sync() {
+  if (acquisition_running() || acquisition_resting()) {
+    return;
+  }
+  const uint64_t cycles_per_us = F_CPU_ACTUAL / 1000000;
+  const uint64_t period_us = (uint64_t)framePeriodMs * 1000;
+  const uint64_t window_us = FRAME_SYNC_WINDOW_US + (period_us * FRAME_SYNC_DRIFT_PPM) / 1000000;
+  uint64_t now = time_cycles64();
+  uint64_t due = syncEdgeCycles + (period_us * cycles_per_us);
+  if (now + ((GRID_ARM_US + window_us) * cycles_per_us) < due) {
+    return;
+  }
+  if (now > due) {
+    //The frame before ran past the edge; wait for the next one.
+    health_count(HEALTH_FRAME_OVERRUNS);
+    syncEdgeCycles = due;
+    return;
+  }
+  //Collect the last pass before starting the engine clears the ring.
+  acquisition_task();
+  //The frame's next bank was started
+  if (acquisition_running()) {
+    return;
+  }
+  if (avgCount != 0) {
+    reset_frame();
+  }
+  acquisition_arm_passes(averagingPasses);
+  noInterrupts();
+  syncDueCycles = due;
+  syncArmed = true;
+  interrupts();
+  uint64_t deadline = due + (window_us * cycles_per_us);
+  if (!frameTimer.begin(sync_timeout_isr, (unsigned int)((deadline - time_cycles64()) / cycles_per_us))) {
+    //No timer free: the edge has to come.
+    LogWarn("No frame timer for the frame sync timeout.");
+  }
+}
+#endif
+
+
+/*
+With a frame period, starts each frame's passes on the next multiple of the period
+of UTC, so frames from every synced node are taken together. Until the time
+service is synced the multiples are of the local clock instead. The engine is
+armed shortly before, so its first slots settle, and a one-shot timer starts the
+conversions on the frame start itself, whatever the loop is doing by then. Grid
+points passed while a frame was still being taken are counted as frame overruns.
+*/
+static void grid_task() {
+#ifdef USE_FRAME_SYNC
+  framesync_end_pulse();
+  //Until the first edge, a follower takes frames on its own grid.
+  if (framePeriodMs != 0 && framesync_role() == FRAME_SYNC_FOLLOW && syncEdgeCycles != 0) {
+    follow_sync();
+    return;
+  }
+#endif
+  if (framePeriodMs == 0 || acquisition_running()) {
+    return;
+  }
+  //Resting thermistors cool off over the grid points they miss.
+  if (acquisition_resting()) {
+    return;
+  }
+  //Collect the last pass before starting the engine clears the ring.
+  acquisition_task();
+  //The frame's next bank was started
+  if (acquisition_running()) {
+    return;
+  }
+  if (avgCount != 0) {
+    //The engine stopped short of a frame (a pass was dropped); start over.
+    reset_frame();
+  }
+  const uint64_t cycles_per_us = F_CPU_ACTUAL / 1000000;
+  const uint64_t period_us = (uint64_t)framePeriodMs * 1000;
+  bool utc = time_synced();
+  uint64_t now = utc ? time_now_utc_micros() : time_cycles64() / cycles_per_us;
+  uint64_t next = (now / period_us + 1) * period_us;
+  if (next - now > GRID_ARM_US) {
+    return;
+  }
+  if (lastFrameStart != 0 && utc == lastFrameUtc && next > lastFrameStart + period_us) {
+    for (uint64_t missed = (next - lastFrameStart) / period_us - 1; missed > 0; missed--) {
+      health_count(HEALTH_FRAME_OVERRUNS);
     }
-    avgCount++;
   }
+  lastFrameStart = next;
+  lastFrameUtc = utc;
+  frameStartCycles = utc ? time_utc_micros_to_cycles(next) : next * cycles_per_us;
+  acquisition_arm_passes(averagingPasses);
+  uint64_t cycles = time_cycles64();
+  uint64_t lead_cycles = FRAME_TIMER_LEAD_US * cycles_per_us;
+  unsigned int timer_us = frameStartCycles > cycles + lead_cycles ?
+                          (unsigned int)((frameStartCycles - cycles - lead_cycles) / cycles_per_us) : 0;
+  frameTimerDueCycles = cycles + timer_us * cycles_per_us;
+  if (timer_us == 0 || !frameTimer.begin(frame_isr, timer_us)) {
+    //Too close for the timer (or none free); start it from here.
+    frameTimerDueCycles = time_cycles64();
+    frame_isr();
+  }
+}
+
+
+/*
+Current averaging depth, frame period, ADC oversampling ratio, dwell samples and
+frame banks.
+*/
+void get_scan_config(ScanConfig *config) {
+  config->averaging_passes = averagingPasses;
+  config->frame_period_ms = framePeriodMs;
+  config->osr = ADC_oversampling();
+  config->dwell_samples = acquisition_dwell_samples();
+  config->frame_banks = frameBanks;
+}
+
+
+/*
+Applies a new averaging depth, frame period, ADC oversampling ratio, dwell
+samples and frame banks, restarting the scan engine with a fresh frame. Blocks
+for up to one conversion while the engine stops. Returns false, changing nothing,
+for an out of range or unsupported value (frame banks that don't divide every
+ADC's thermistors, or any with USE_ARRAY_NDATA, whose one thermistor metric
+can't carry a bank on its own) or while a calibration sweep or a burst is running.
+*/
+bool set_scan_config(const ScanConfig *config) {
+#ifdef USE_ARRAY_NDATA
+  const unsigned int maxBanks = 1;
+#else
+  const unsigned int maxBanks = MAX_FRAME_BANKS;
+#endif
+  if (scan_locked() ||
+      config->averaging_passes < 1 || config->averaging_passes > MAX_AVERAGING_PASSES ||
+      config->frame_period_ms > MAX_FRAME_PERIOD_MS ||
+      config->dwell_samples < 1 || config->dwell_samples > MAX_DWELL_SAMPLES ||
+      config->frame_banks < 1 || config->frame_banks > maxBanks) {
+    return false;
+  }
+  acquisition_stop();
+  if (!acquisition_set_frame_banks(config->frame_banks)) {
+    start_scanning();
+    return false;
+  }
+  if (config->osr != ADC_oversampling() && !set_ADC_oversampling(config->osr)) {
+    start_scanning();
+    return false;
+  }
+  averagingPasses = config->averaging_passes;
+  framePeriodMs = config->frame_period_ms;
+  frameBanks = config->frame_banks;
+  lastFrameStart = 0;
+  acquisition_set_dwell_samples(config->dwell_samples);
+  reset_frame();
+  start_scanning();
+  return true;
+}
+
+
+static void broker_task() {
+  check_brokers();
+}
+
+
+static void command_task() {
+  //Slow node commands (calibration) run here, one step at a time.
+  run_node_commands();
+}
+
+
+#ifdef USE_RAW_STREAM
+static void stream_task() {
+  //At most one raw stream datagram per call, so the MQTT side isn't held up.
+  stream_poll();
+#ifdef USE_SCAN_TRACE
+  scan_trace_poll();
+#endif
+}
+#endif
+
+
+#ifdef USE_METRICS_HTTP
+static void http_task() {
+  //Answers /metrics scrapes from the text update_health() last rendered.
+  http_poll();
+}
+#endif
+
+
+static void ntp_task() {
+  //Resync the sample time service whenever the NTP client updates
+  update_ntp();
+}
+
+
+static void log_task() {
+  PROFILE_SCOPE(PROFILE_LOG);
+  //Let queued log output go out as fast as the serial port takes it.
+  log_drain();
+}
+
+
+#ifdef USE_ADC_SELF_CAL
+/*
+Logs each ADC's offset and gain correction.
+*/
+static void log_ADC_self_cal() {
+  for (int adc = 0; adc < NUM_ADCS; adc++) {
+    Mcp3561 *device = ADC_device(adc);
+    LogInfo("ADC %d self-calibration: offset %ld codes, gain %0.1f ppm.", adc, (long)device->offset_cal(),
+            (device->gain_cal() - 1.0f) * 1e6f);
+  }
+}
+
+
+/*
+Self-calibrates the ADCs' offset and gain (see Mcp3561::self_calibrate()), so
+the converters' drift is corrected in the ADCs themselves. Stops the scan engine
+for the few dozen conversions it takes, which overruns the housekeeping budget,
+and restarts it with a fresh frame, as the codes step by the change in the
+correction.
+*/
+static void run_ADC_self_cal() {
+  acquisition_stop();
+  if (!self_calibrate_ADCs()) {
+    LogWarn("ADC self-calibration failed, keeping the last correction.");
+  }
+  log_ADC_self_cal();
+  reset_frame();
+  start_scanning();
+  lastSelfCalMs = millis();
+}
+#endif
+
+
+static void housekeeping_task() {
+  //Keeps the 64-bit sample clock extended across cycle counter wraps.
+  time_update();
+
+#ifdef USE_ADC_SELF_CAL
+  //Not during a calibration sweep, whose readings would see the step, or a burst.
+  if (setup_successful && !scan_locked() && (millis() - lastSelfCalMs) >= ADC_SELF_CAL_PERIOD_MS) {
+    run_ADC_self_cal();
+  }
+#endif
+
+  if (acquisition_overruns() != lastOverruns) {
+    lastOverruns = acquisition_overruns();
+    LogWarn("Sample ring overrun, %lu samples dropped.", lastOverruns);
+    LogTrace(TRACE_SAMPLES_DROPPED, lastOverruns);
+  }
+
+  //Restored from the ADC interrupt, so logged from here.
+  if (health_counter(HEALTH_ADC_RECONFIGURATIONS) != lastReconfigurations) {
+    lastReconfigurations = health_counter(HEALTH_ADC_RECONFIGURATIONS);
+    LogWarn("ADC configuration lost (power-on reset or CRC error) and restored, %lu times.",
+            (unsigned long)lastReconfigurations);
+  }
+}
 
-  Serial.printf("Internal ADC temperature: %0.2f °C\n", ADC_internal_temp);
 
-  if (calibrated == true) {
-    for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
-      thermistor_temp[mosfetRef] = (((thermistor_temp[mosfetRef] - raw_Low[mosfetRef]) * (ref_High - ref_Low)) / (raw_High[mosfetRef] - raw_Low[mosfetRef])) + ref_Low;
-      Serial.printf("Thermistor %d temperature: [((raw temp - %0.2f) * (%0.2f - %0.2f)) / (%0.2f - %0.2f)] + %0.2f =  %0.2f °C\n", 
-                    mosfetRef + 1, raw_Low[mosfetRef], ref_High, ref_Low, raw_High[mosfetRef], raw_Low[mosfetRef], ref_Low, thermistor_temp[mosfetRef]);
+/*
+Moves the excitation duty window on and rests the thermistors over the limit.
+Once every thermistor an ADC scans is resting, a continuous scan is stopped
+until one is back under; with a frame period the grid task holds off instead.
+*/
+static void selfheat_task() {
+  selfheat_update();
+  if (!setup_successful || framePeriodMs != 0 || scan_locked()) {
+    scanHeld = false;
+    return;
+  }
+  if (acquisition_resting()) {
+    if (!scanHeld && acquisition_running()) {
+      acquisition_stop();
+      reset_frame();
+      scanHeld = true;
     }
   }
-  else {
-    for (mosfetRef = 0; mosfetRef < NUMBER_OF_THERMISTORS; mosfetRef++){
-      Serial.printf("Thermistor uncalibrated temperature = %0.2f °C\n", thermistor_temp[mosfetRef]);
+  else if (scanHeld) {
+    scanHeld = false;
+    if (!acquisition_running()) {
+      start_scanning();
     }
   }
-  Serial.println();
-  publish_data(thermistor_temp, ADC_internal_temp);
 }
 
 
+#ifdef USE_SD_LOG
+static void sdlog_task() {
+  //Writes the logged frames out to the SD card a segment at a time.
+  sdlog_poll();
+}
+#endif
+
+
+static void memory_task() {
+  //Warns as soon as the stack or heap headroom runs low.
+  memory_check();
+}
+
+
+/*
+Registers the tasks in the order they run within a scheduler pass.
+*/
+static void setup_tasks() {
+  scheduler_add_task("acquisition", acquisition_task, ACQUISITION_PERIOD_US, ACQUISITION_BUDGET_US);
+  conversionTask = scheduler_add_task("conversion", conversion_task, TASK_EVENT_ONLY, CONVERSION_BUDGET_US);
+  publishTask = scheduler_add_task("publish", publish_task, TASK_EVENT_ONLY, PUBLISH_BUDGET_US);
+  scheduler_add_task("grid", grid_task, GRID_PERIOD_US, GRID_BUDGET_US);
+  scheduler_add_task("brokers", broker_task, BROKER_PERIOD_US, BROKER_BUDGET_US);
+  scheduler_add_task("commands", command_task, COMMAND_PERIOD_US, COMMAND_BUDGET_US);
+#ifdef USE_RAW_STREAM
+  scheduler_add_task("stream", stream_task, STREAM_PERIOD_US, STREAM_BUDGET_US);
+#endif
+  scheduler_add_task("ntp", ntp_task, NTP_PERIOD_US, NTP_BUDGET_US);
+#ifdef USE_METRICS_HTTP
+  scheduler_add_task("http", http_task, HTTP_PERIOD_US, HTTP_BUDGET_US);
+#endif
+  scheduler_add_task("log", log_task, LOG_PERIOD_US, LOG_BUDGET_US);
+  scheduler_add_task("housekeeping", housekeeping_task, HOUSEKEEPING_PERIOD_US, HOUSEKEEPING_BUDGET_US);
+  scheduler_add_task("self-heating", selfheat_task, SELFHEAT_PERIOD_US, SELFHEAT_BUDGET_US);
+  scheduler_add_task("memory", memory_task, MEMORY_PERIOD_US, MEMORY_BUDGET_US);
+#ifdef USE_SD_LOG
+  scheduler_add_task("sdlog", sdlog_task, SDLOG_PERIOD_US, SDLOG_BUDGET_US);
+#endif
+  scheduler_add_task("report", scheduler_report, SCHEDULER_REPORT_PERIOD_US, 0);
+}
+
+
+FLASHMEM void setup() {
+  //First, so the stack below setup()'s frame is painted before anything uses it.
+  memory_init();
+  boot_mark("memory");
+  //Before anything reads the clock, the history or the bdSeq numbers.
+  history_begin(warmboot_init());
+  //Reads the warm boot state, so straight after it.
+  watchdog_init();
+  boot_mark("warm boot");
+  //Frame numbers carry on from the frames held across a warm reboot.
+  Channels.frame_number = history_last_frame();
+  //MOSFET digital control I/O ports, set to output. All MOSFETS turned off (pins set to LOW).
+  acquisition_init();
+  //Before network_init(), which leaves the disabled channels out of the payloads.
+  load_channel_mask();
+  //Before the first frame is converted.
+  sensor_load();
+  alarm_load();
+  kalman_begin();
+  drift_load();
+  boot_mark("settings");
+  //INW: figure out how to set skew
+
+  /*
+  Enable global interrupts. 
+  Set up ADC interrupt feature on the ADC_IRQ_PINS.
+  Upon recieving an interrupt from ADC(indicating new data is available in ADC),
+  IRQ flag is triggered. Each ADC has its own data-ready pin and handler.
+  */
+  static const uint8_t irqPins[NUM_ADCS] = ADC_IRQ_PINS;
+  for (int adc = 0; adc < NUM_ADCS; adc++) {
+    pinMode(irqPins[adc], INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(irqPins[adc]), irqHandlers[adc], FALLING);
+  }
+  //The data-ready pins, the frame timer and the SPI DMA completions (the SPI
+  //library takes its channels as it needs them, so all of them) run at the
+  //acquisition priority; the settle timers are set by acquisition_init().
+  NVIC_SET_PRIORITY(IRQ_GPIO6789, ACQUISITION_IRQ_PRIORITY);
+  frameTimer.priority(ACQUISITION_IRQ_PRIORITY);
+  for (int channel = 0; channel < 16; channel++) {
+    NVIC_SET_PRIORITY(IRQ_DMA_CH0 + channel, ACQUISITION_IRQ_PRIORITY);
+  }
+  sei();
+
+  setup_successful = hardwareID_init();
+  boot_mark("hardware ID");
+#ifdef USE_FRAME_SYNC
+  //The hardware ID picks the driver of the line.
+  framesync_begin(get_hardware_id(), sync_isr);
+#endif
+  setup_successful = setup_successful && initTeensySPI() && initADC();
+  boot_mark("ADC init");
+  if (setup_successful) {
+    //Not fatal: the default clock is kept and the frames show the ADC isn't answering.
+    tune_ADC_SPI_clock();
+    boot_mark("ADC clock");
+    //Before network_init(), which publishes the ADC settings.
+    load_acquisition_profile();
+    boot_mark("ADC profile");
+#ifdef USE_ADC_SELF_CAL
+    //At the conversion settings in use, before the engine has started.
+    if (!self_calibrate_ADCs()) {
+      LogWarn("ADC self-calibration failed, converting uncorrected.");
+    }
+    log_ADC_self_cal();
+    lastSelfCalMs = millis();
+    boot_mark("ADC self cal");
+#endif
+  }
+  //Conversions now run from the ADC interrupt, so the ADCs are sampling while the
+  //network comes up. The passes wait in the ring for the scheduler tasks;
+  //frames are held until time is known (see publish_data()).
+  reset_frame();
+  start_scanning();
+  boot_mark("scan start");
+
+  //Doesn't wait for the link, the NTP server or the brokers: those come up from
+  //the scheduler tasks.
+  setup_successful = setup_successful && network_init();
+  
+  if(setup_successful){
+    Serial.println("Setup successful.");
+  }
+  else {
+    Serial.println("Setup Failed.");
+  }
 
+  load_cal_data();
+  boot_mark("calibration");
+  setup_tasks();
+  //Last, so nothing setup() waits for counts against the timeout.
+  watchdog_watch(WATCHDOG_ACQUISITION, ACQUISITION_STALL_MS, restart_scan);
+  watchdog_start(reset_teensy);
+  boot_mark("setup");
+}
 
 
+void loop() {
+  scheduler_run();
+}
@@ -29,8 +29,70 @@ this program. If not, see <https://www.gnu.org/licenses/>.
 #ifndef THERMISTOR_MUX_H
 #define THERMISTOR_MUX_H
 
-bool cal_thermistor(float set_temp, int tempNum);
+#include <stdint.h>
+#include "thermistorMux_global.h"
+#include "thermistorMux_acquisition.h"
+#include "thermistorMux_calstore.h"
+
+// Progress of a calibration capture, returned by cal_step()
+enum CalStep {
+  CAL_IDLE,         // No capture running
+  CAL_RUNNING,      // Capture in progress; call cal_step() again
+  CAL_POINT_DONE,   // Reference point stored; another is needed before calibration is used
+  CAL_COMPLETE,     // Reference point stored; two or more are, so calibration is in use
+  CAL_FAILED        // The readings never settled; capture abandoned
+};
+
+// Scan settings that can be changed while running, see set_scan_config()
+struct ScanConfig {
+  unsigned int averaging_passes;  // Passes filtered into each frame
+  unsigned int frame_period_ms;   // Frames start on multiples of this; 0 = back to back
+  uint32_t osr;                   // ADC oversampling ratio
+  unsigned int dwell_samples;     // Samples averaged on each thermistor per pass
+  unsigned int frame_banks;       // Banks each frame is scanned and published in; 1 = whole frames
+};
+
+#ifdef USE_RAW_STREAM
+// A burst capture, see burst_start()
+#define MAX_BURST_CHANNELS 4
+#define MAX_BURST_MS 60000
+struct BurstConfig {
+  ChannelMask channels;           // Thermistors dwelt on, at most MAX_BURST_CHANNELS
+  uint32_t osr;                   // ADC oversampling ratio for the burst; 0 keeps the scan's
+  unsigned int duration_ms;       // 1 to MAX_BURST_MS
+};
+#endif
+
+bool cal_begin(float set_temp, int tempNum);
+CalStep cal_step();
+ChannelMask cal_ready_channels();
+float cal_noise();
 bool clear_cal_data();
+bool set_cal_data(const CalData *data);
+bool cal_in_use();
+void get_scan_config(ScanConfig *config);
+bool set_scan_config(const ScanConfig *config);
+bool set_channel_mask(ChannelMask mask);
+bool set_sensor_models(const char *text);
+bool set_channel_sensors(const char *text);
+bool set_acquisition_profile(int profile);
+unsigned int quiet_interval();
+bool set_quiet_interval(unsigned int passes);
+float target_noise();
+bool set_target_noise(float noise);
+#ifdef USE_RAW_STREAM
+bool burst_start(const BurstConfig *config);
+void burst_stop();
+bool burst_running();
+#endif
+bool settling_sweep_start();
+void settling_sweep_stop();
+bool settling_sweep_running();
+bool self_test_start();
+void self_test_stop();
+bool self_test_running();
+bool set_settling_times(const uint16_t *us);
+bool set_scan_list(const ScanEntry *list);
 
 #endif
 
@@ -1,6 +1,22 @@
 #include <Arduino.h>
 #include <unity.h>
 #include <command_ADC.h>
+#include <cf_sparkplug.h>
+#include <cf_deflate.h>
+#include <thermistorMux_autorange.h>
+#include <thermistorMux_crc.h>
+#include <thermistorMux_filter.h>
+#include <thermistorMux_acquisition.h>
+#include <thermistorMux_channels.h>
+#include <thermistorMux_config.h>
+#include <thermistorMux_calupload.h>
+#include <thermistorMux_delta.h>
+#include <thermistorMux_settling.h>
+#include <thermistorMux_history.h>
+#include <thermistorMux_virtual.h>
+#include <thermistorMux_warmboot.h>
+#include <thermistorMux_network.h>
+#include <pb_encode.h>
 
 
 
@@ -11,10 +27,710 @@ void test_negative_inputs(uint32_t data) {
     TEST_ASSERT_EQUAL(x, convert_internal_temp(data));
 }
 
+void test_thermistor_block_matches_scalar() {
+    const uint32_t codes[4] = {0x00100000, 0x00300000, 0x00400000, 0x00600000};
+    float out[4];
+    TEST_ASSERT_EQUAL(0, convert_thermistor_block(codes, out, 4));
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_FLOAT_WITHIN(0.01, convert_thermistor_temp(codes[i]), out[i]);
+    }
+}
+
+void test_saturated_codes_are_faults() {
+    const uint32_t codes[2] = {0x007FFFFF, 0x00800000};
+    float out[2];
+    TEST_ASSERT_EQUAL(2, convert_thermistor_block(codes, out, 2));
+    TEST_ASSERT_TRUE(isnan(out[0]));
+    TEST_ASSERT_TRUE(isnan(out[1]));
+    TEST_ASSERT_EQUAL(THERMISTOR_OPEN, classify_thermistor_code(0, codes[0]));
+    TEST_ASSERT_EQUAL(THERMISTOR_SHORT, classify_thermistor_code(0, codes[1]));
+    TEST_ASSERT_EQUAL(THERMISTOR_OK, classify_thermistor_code(0, 0x00400000));
+}
+
+void test_piecewise_calibration_picks_segment() {
+    const uint32_t codes[2] = {0x00100000, 0x00600000};
+    float hot = convert_thermistor_temp(codes[0]);
+    float cold = convert_thermistor_temp(codes[1]);
+    CalSegments cal[2];
+    for (int c = 0; c < 2; c++) {
+        for (int s = 0; s < CAL_SEGMENTS; s++) {
+            cal[c].start[s] = INFINITY;
+            cal[c].gain[s] = 1.0;
+            cal[c].offset[s] = 0.0;
+        }
+        cal[c].start[0] = -INFINITY;
+        cal[c].start[1] = (hot + cold) / 2;
+        cal[c].offset[1] = 10.0;
+    }
+    float out[2];
+    TEST_ASSERT_EQUAL(0, convert_thermistor_block_piecewise(codes, cal, out, 2));
+    TEST_ASSERT_FLOAT_WITHIN(0.01, hot + 10.0, out[0]);
+    TEST_ASSERT_FLOAT_WITHIN(0.01, cold, out[1]);
+}
+
+void test_raw_code_block_matches_firmware() {
+    const uint32_t codes[6] = {0x00000100, 0x00100000, 0x00412345, 0x007FFFF0, 0x007FFFFF, 0x00800000};
+    float firmware[6];
+    int32_t raw[7];
+    float host[7];
+    static ThermistorConversion table;
+    make_thermistor_conversion(DEFAULT_SENSOR_MODEL, table);
+    TEST_ASSERT_EQUAL(2, convert_thermistor_block(codes, firmware, 6));
+    thermistor_code_block(codes, raw, 6);
+    raw[6] = RAW_CODE_NULL;
+    TEST_ASSERT_EQUAL(3, convert_code_block(&table, raw, host, 7));
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_FLOAT_WITHIN(0.0001, firmware[i], host[i]);
+    }
+    TEST_ASSERT_TRUE(isnan(host[4]));
+    TEST_ASSERT_TRUE(isnan(host[5]));
+    TEST_ASSERT_TRUE(isnan(host[6]));
+}
+
+#ifdef USE_MILLIDEGREE_NDATA
+void test_millidegree_block_matches_float() {
+    const uint32_t codes[3] = {0x00100000, 0x00412345, 0x007FFFFF};
+    CalSegments cal[3];
+    for (int c = 0; c < 3; c++) {
+        for (int s = 0; s < CAL_SEGMENTS; s++) {
+            cal[c].start[s] = INFINITY;
+            cal[c].gain[s] = 1.01;
+            cal[c].offset[s] = -0.25;
+        }
+        cal[c].start[0] = -INFINITY;
+    }
+    CalSegmentsFixed fixed[3];
+    for (int c = 0; c < 3; c++) {
+        fix_cal_segments(&cal[c], &fixed[c]);
+    }
+    float out[3];
+    int32_t mdeg[3];
+    TEST_ASSERT_EQUAL(1, convert_thermistor_block_piecewise(codes, cal, out, 3));
+    TEST_ASSERT_EQUAL(1, convert_thermistor_block_mdeg(codes, fixed, mdeg, 3));
+    TEST_ASSERT_INT32_WITHIN(1, lrintf(out[0] * 1000), mdeg[0]);
+    TEST_ASSERT_INT32_WITHIN(1, lrintf(out[1] * 1000), mdeg[1]);
+    TEST_ASSERT_EQUAL(THERMISTOR_NULL, mdeg[2]);
+}
+#endif
+
+void test_channel_sensor_model() {
+    const uint32_t codes[2] = {0x00300000, 0x00300000};
+    SensorModel sensor = *default_sensor_model();
+    sensor.nominal_ohms = 2200;
+    sensor.beta = 3930;
+    TEST_ASSERT_TRUE(set_sensor_model(1, &sensor));
+    TEST_ASSERT_TRUE(set_channel_sensor(1, 1));
+    float out[2];
+    TEST_ASSERT_EQUAL(0, convert_thermistor_block(codes, out, 2));
+    double ohms = 10000.0 * 0x00300000 / (8388608.0 - 0x00300000);
+    double expected = (1 / ((1 / 298.15) + (log(ohms / 2200) / 3930))) - 273.15;
+    TEST_ASSERT_FLOAT_WITHIN(0.01, convert_thermistor_temp(codes[0]), out[0]);
+    TEST_ASSERT_FLOAT_WITHIN(0.1, expected, out[1]);
+    set_channel_sensor(1, 0);
+    set_sensor_model(1, NULL);
+}
+
+// Exact equation of a model in double precision, the golden model of the
+// conversions (see benchmark/accuracy_conversions.cpp)
+static double golden_model_temp(const SensorModel &sensor, int32_t code) {
+    double a = sensor.a, b = sensor.b, c = sensor.c;
+    if (sensor.equation == SENSOR_BETA) {
+        a = (1 / 298.15) - (log((double)sensor.nominal_ohms) / sensor.beta);
+        b = 1.0 / sensor.beta;
+        c = 0;
+    }
+    double voltage = ((double)sensor.vref / 8388608.0) * code;
+    double ln_r = log((voltage * sensor.divider_ohms) / ((double)sensor.supply - voltage));
+    return (1 / (a + (b * ln_r) + (c * ln_r * ln_r * ln_r))) - 273.15;
+}
+
+void test_conversions_meet_error_budget() {
+    const struct {
+        SensorModel sensor;
+        double budget;
+    } models[3] = {
+        {{SENSOR_BETA, 10000, 3977, 0, 0, 0, 10000, 2.33f, 2.33f}, 0.01},
+        {{SENSOR_BETA, 2200, 3930, 0, 0, 0, 10000, 2.33f, 2.33f}, 0.1},
+        {{SENSOR_STEINHART_HART, 10000, 0, 1.129148e-3f, 2.34125e-4f, 8.76741e-8f, 10000, 2.33f, 2.33f}, 0.01},
+    };
+    CalSegments cal[4];
+    for (int c = 0; c < 4; c++) {
+        for (int s = 0; s < CAL_SEGMENTS; s++) {
+            cal[c].start[s] = INFINITY;
+            cal[c].gain[s] = 1.0;
+            cal[c].offset[s] = 0.0;
+        }
+        cal[c].start[0] = -INFINITY;
+        cal[c].gain[0] = 1.00375f;
+        cal[c].offset[0] = -0.1f;
+        cal[c].start[1] = 40.0f;
+        cal[c].gain[1] = 1.00625f;
+        cal[c].offset[1] = -0.2f;
+    }
+#ifdef USE_MILLIDEGREE_NDATA
+    CalSegmentsFixed fixed[4];
+    for (int c = 0; c < 4; c++) {
+        fix_cal_segments(&cal[c], &fixed[c]);
+    }
+#endif
+    for (int c = 0; c < 4; c++) {
+        set_channel_sensor(c, 1);
+    }
+    for (int m = 0; m < 3; m++) {
+        TEST_ASSERT_TRUE(set_sensor_model(1, &models[m].sensor));
+        double max_error = 0;
+        for (uint32_t code = 1; code < 0x007FFFFF - 4 * 211; code += 4 * 211) {
+            uint32_t codes[4];
+            double golden[4];
+            for (int c = 0; c < 4; c++) {
+                codes[c] = code + c * 211;
+                golden[c] = golden_model_temp(models[m].sensor, (int32_t)codes[c]);
+            }
+            float out[4];
+            float calibrated[4];
+            convert_thermistor_block(codes, out, 4);
+            convert_thermistor_block_piecewise(codes, cal, calibrated, 4);
+#ifdef USE_MILLIDEGREE_NDATA
+            int32_t mdeg[4];
+            convert_thermistor_block_mdeg(codes, fixed, mdeg, 4);
+#endif
+            for (int c = 0; c < 4; c++) {
+                if (!(golden[c] >= -40 && golden[c] <= 125)) {
+                    continue;
+                }
+                int s = (golden[c] >= 40) ? 1 : 0;
+                double golden_cal = (cal[c].gain[s] * golden[c]) + cal[c].offset[s];
+                max_error = fmax(max_error, fabs(out[c] - golden[c]));
+                max_error = fmax(max_error, fabs(calibrated[c] - golden_cal));
+#ifdef USE_MILLIDEGREE_NDATA
+                max_error = fmax(max_error, fabs((mdeg[c] / 1000.0) - golden_cal));
+#endif
+            }
+        }
+        TEST_ASSERT_TRUE(max_error <= models[m].budget);
+    }
+    for (int c = 0; c < 4; c++) {
+        set_channel_sensor(c, 0);
+    }
+    set_sensor_model(1, NULL);
+}
+
+void test_plain_payload_matches_nanopb() {
+    Metric metrics[4];
+    memset(metrics, 0, sizeof(metrics));
+    for (int i = 0; i < 4; i++) {
+        metrics[i].has_alias = true;
+        metrics[i].alias = 80 + i * 100;
+        metrics[i].has_timestamp = true;
+        metrics[i].timestamp = 1760000000000ULL + i;
+        metrics[i].has_datatype = true;
+        metrics[i].datatype = METRIC_DATA_TYPE_FLOAT;
+        metrics[i].which_value = org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+        metrics[i].value.float_value = 21.5f + i;
+    }
+    metrics[1].has_is_historical = true;
+    metrics[1].is_historical = true;
+    metrics[2].which_value = 0;
+    metrics[2].has_is_null = true;
+    metrics[2].is_null = true;
+    metrics[3].datatype = METRIC_DATA_TYPE_INT64;
+    metrics[3].which_value = org_eclipse_tahu_protobuf_Payload_Metric_long_value_tag;
+    metrics[3].value.long_value = 0x123456789ULL;
+    Payload payload = org_eclipse_tahu_protobuf_Payload_init_default;
+    payload.has_timestamp = true;
+    payload.timestamp = 1760000000123ULL;
+    payload.has_seq = true;
+    payload.seq = 200;
+    payload.metrics = metrics;
+    payload.metrics_count = 4;
+
+    uint8_t expected[256], plain[256];
+    pb_ostream_t ostream = pb_ostream_from_buffer(expected, sizeof(expected));
+    TEST_ASSERT_TRUE(pb_encode(&ostream, org_eclipse_tahu_protobuf_Payload_fields, &payload));
+    TEST_ASSERT_EQUAL(ostream.bytes_written, encode_plain_payload(&payload, plain, sizeof(plain)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, plain, ostream.bytes_written);
+
+    // A named metric isn't plain
+    metrics[0].name = (char *) "Inputs/THERMISTOR1";
+    TEST_ASSERT_EQUAL(0, encode_plain_payload(&payload, plain, sizeof(plain)));
+}
+
+void test_autorange_normalize() {
+    // x4 codes come back to x1, rounded, with the status byte kept
+    TEST_ASSERT_EQUAL_HEX32(0x13100000, autorange_normalize(0x13400000, 2));
+    TEST_ASSERT_EQUAL_HEX32(0x00000001, autorange_normalize(0x00000002, 2));
+    TEST_ASSERT_EQUAL_HEX32(0x00FFFFFF, autorange_normalize(0x00FFFFFC, 2));
+    // Saturated codes stay saturated
+    TEST_ASSERT_EQUAL_HEX32(0x007FFFFF, autorange_normalize(0x007FFFFF, 3));
+    TEST_ASSERT_EQUAL_HEX32(0x00800000, autorange_normalize(0x00800000, 3));
+}
+
+void test_crc16_ansi_check_value() {
+    // CRC-16 ANSI from 0x0000 (CRC-16/BUYPASS) of "123456789"
+    TEST_ASSERT_EQUAL_HEX16(0xFEE8, crc16_ansi((const uint8_t *)"123456789", 9));
+}
+
+void test_spike_filter_rejects_spike() {
+    // One spike among steady codes leaves the frame average alone
+    uint32_t pass[SLOTS_PER_PASS] = {0};
+    uint32_t frame[SLOTS_PER_PASS];
+    for (int spike = SPIKE_MEDIAN; spike <= SPIKE_HAMPEL; spike++) {
+        filter_configure(FILTER_BOXCAR, 1, 1.0f);
+        filter_set_spike((SpikeFilter)spike);
+        for (int n = 0; n < 8; n++) {
+            pass[0] = (n == 6) ? 0x00400000 : 1000 + (n & 1);
+            filter_add_pass(pass, CHANNEL_BIT(0));
+        }
+        filter_get_frame(frame);
+        TEST_ASSERT_UINT32_WITHIN(1, 1000, frame[0]);
+    }
+    filter_set_spike(SPIKE_OFF);
+}
+
+void test_config_blob_round_trip() {
+    // A blob carries every setting back; a partial one leaves the rest alone
+    NodeConfig config = {0.25f, 1.5f, 10000, 8, 100, 4096, 2, 0x0F, 4, 100, SPIKE_HAMPEL, 60, 512, 100};
+    config.settling_us[3] = 250;
+    config.frame_banks = 2;
+    uint8_t blob[CONFIG_BLOB_SIZE];
+    size_t size = config_encode(&config, blob, sizeof(blob));
+    TEST_ASSERT_TRUE(size > 0);
+    NodeConfig decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    TEST_ASSERT_TRUE(config_decode(blob, size, &decoded));
+    TEST_ASSERT_EQUAL(config.averaging_passes, decoded.averaging_passes);
+    TEST_ASSERT_EQUAL(config.channel_mask, decoded.channel_mask);
+    TEST_ASSERT_EQUAL(config.spike_filter, decoded.spike_filter);
+    TEST_ASSERT_FLOAT_WITHIN(0.0f, config.deadband, decoded.deadband);
+    TEST_ASSERT_EQUAL(250, decoded.settling_us[3]);
+    TEST_ASSERT_EQUAL(2, decoded.frame_banks);
+    TEST_ASSERT_EQUAL(config_hash(&config), config_hash(&decoded));
+
+    uint8_t partial[] = {0x4E, 0x43, 1, 6, CONFIG_AVERAGING_PASSES, 4, 16, 0, 0, 0, 0, 0, 0, 0};
+    uint32_t crc = crc32(partial, 10);
+    memcpy(&partial[10], &crc, sizeof(crc));
+    TEST_ASSERT_TRUE(config_decode(partial, sizeof(partial), &decoded));
+    TEST_ASSERT_EQUAL(16, decoded.averaging_passes);
+    TEST_ASSERT_EQUAL(config.frame_period_ms, decoded.frame_period_ms);
+
+    // Nothing changes for a blob that fails its CRC
+    partial[6] = 32;
+    TEST_ASSERT_FALSE(config_decode(partial, sizeof(partial), &decoded));
+    TEST_ASSERT_EQUAL(16, decoded.averaging_passes);
+}
+
+void test_scan_list_text_round_trip() {
+    // Defaults are left out of the text; malformed entries are refused
+    ScanEntry list[MAX_SCAN_ENTRIES];
+    TEST_ASSERT_TRUE(acquisition_parse_scan_list("1x3/2,2,5", list));
+    TEST_ASSERT_EQUAL(0, list[0].channel);
+    TEST_ASSERT_EQUAL(3, list[0].repeat);
+    TEST_ASSERT_EQUAL(2, list[0].samples);
+    TEST_ASSERT_EQUAL(1, list[1].repeat);
+    TEST_ASSERT_EQUAL(0, list[1].samples);
+    TEST_ASSERT_EQUAL(0, list[3].repeat);
+    char text[SCAN_LIST_TEXT_SIZE];
+    acquisition_format_scan_list(list, text, sizeof(text));
+    TEST_ASSERT_EQUAL_STRING("1x3/2,2,5", text);
+
+    TEST_ASSERT_TRUE(acquisition_parse_scan_list("-", list));
+    acquisition_format_scan_list(list, text, sizeof(text));
+    TEST_ASSERT_EQUAL_STRING("-", text);
+    TEST_ASSERT_FALSE(acquisition_parse_scan_list("0", list));
+    TEST_ASSERT_FALSE(acquisition_parse_scan_list("1x0", list));
+    TEST_ASSERT_FALSE(acquisition_parse_scan_list("1,", list));
+    TEST_ASSERT_FALSE(acquisition_parse_scan_list("1/17", list));
+}
+
+// Header, per channel values (the same for every thermistor but the second,
+// left uncalibrated) and CRC of a calibration upload
+static size_t make_cal_upload(uint8_t *blob, int form, int points, const float *lead, int leading,
+                              const float *values, int count) {
+    const uint8_t header[CAL_UPLOAD_HEADER] = {0x43, 0x55, 1, (uint8_t)form, NUMBER_OF_THERMISTORS,
+                                               (uint8_t)points, 0, 0};
+    memcpy(blob, header, sizeof(header));
+    size_t pos = sizeof(header);
+    memcpy(&blob[pos], lead, leading * sizeof(float));
+    pos += leading * sizeof(float);
+    for (int channel = 0; channel < NUMBER_OF_THERMISTORS; channel++) {
+        for (int i = 0; i < count; i++) {
+            float value = (channel == 1) ? NAN : values[i];
+            memcpy(&blob[pos], &value, sizeof(value));
+            pos += sizeof(value);
+        }
+    }
+    uint32_t crc = crc32(blob, pos);
+    memcpy(&blob[pos], &crc, sizeof(crc));
+    return pos + sizeof(crc);
+}
+
+void test_calibration_upload_forms() {
+    static uint8_t blob[CAL_UPLOAD_MAX_SIZE];
+    static CalData data;
+    const float gain_offset[2] = {1.01f, -0.5f};
+    size_t size = make_cal_upload(blob, CAL_UPLOAD_LINEAR, 2, NULL, 0, gain_offset, 2);
+    TEST_ASSERT_TRUE(calupload_decode(blob, size, &data));
+    TEST_ASSERT_EQUAL(0x03, data.taken);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, 100.5f / 1.01f, data.raw[0][1]);
+    TEST_ASSERT_FLOAT_WITHIN(0.0f, data.ref[1], data.raw[1][1]);
+
+    // Readings must rise with the references
+    const float falling[2] = {-1.0f, 0.0f};
+    size = make_cal_upload(blob, CAL_UPLOAD_LINEAR, 2, NULL, 0, falling, 2);
+    TEST_ASSERT_FALSE(calupload_decode(blob, size, &data));
+
+    // A Beta 3950 10K thermistor as Steinhart-Hart coefficients
+    const float range[2] = {0.0f, 70.0f};
+    const float abc[3] = {(float)((1 / 298.15) - (log(10000.0) / 3950)), 1.0f / 3950, 0.0f};
+    size = make_cal_upload(blob, CAL_UPLOAD_STEINHART_HART, 8, range, 2, abc, 3);
+    TEST_ASSERT_TRUE(calupload_decode(blob, size, &data));
+    TEST_ASSERT_EQUAL(0xFF, data.taken);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, 10.0f, data.ref[1]);
+    double ohms = 10000.0 * exp(3950 * ((1 / 283.15) - (1 / 298.15)));
+    TEST_ASSERT_FLOAT_WITHIN(0.01, channel_model_temp(0, ohms), data.raw[0][1]);
+
+    // Nothing is taken from an upload that fails its CRC
+    blob[CAL_UPLOAD_HEADER] ^= 1;
+    TEST_ASSERT_FALSE(calupload_decode(blob, size, &data));
+}
+
+void test_delta_coding_round_trip() {
+    // Steady frames code in a byte each; wrapping codes and time jumps come back exact
+    const uint32_t codes[] = {0x123456, 0x123458, 0x123455, 0xFFFFFF, 0x000001, 0x123456};
+    const uint64_t times[] = {1000000, 1010000, 1020000, 1030000, 1029000, (1ULL << 63) | 5};
+    uint8_t block[6 * (DELTA_MAX_TIME_SIZE + DELTA_MAX_CODE_SIZE)];
+    DeltaCoder coder;
+    delta_reset(&coder, times[0]);
+    size_t size = 0;
+    for (int i = 0; i < 6; i++) {
+        size_t n = delta_put_time(&coder, &block[size], times[i]);
+        n += delta_put_code(&coder, &block[size + n], 3, codes[i]);
+        if (i == 2) {
+            TEST_ASSERT_EQUAL(2, n);
+        }
+        size += n;
+    }
+    delta_reset(&coder, times[0]);
+    size_t pos = 0;
+    for (int i = 0; i < 6; i++) {
+        uint64_t time;
+        uint32_t code;
+        size_t n = delta_get_time(&coder, &block[pos], size - pos, &time);
+        TEST_ASSERT_TRUE(n > 0);
+        pos += n;
+        n = delta_get_code(&coder, &block[pos], size - pos, 3, &code);
+        TEST_ASSERT_TRUE(n > 0);
+        pos += n;
+        TEST_ASSERT_TRUE(time == times[i]);
+        TEST_ASSERT_EQUAL_HEX32(codes[i], code);
+    }
+    TEST_ASSERT_EQUAL(size, pos);
+    uint32_t code;
+    TEST_ASSERT_EQUAL(0, delta_get_code(&coder, block, 0, 3, &code));
+}
+
+void test_settling_sweep_result() {
+    // Thermistor 2 reads off the reference at 200 us and shorter; the steady drift
+    // both share doesn't fail a step, and thermistor 3 was never scanned
+    uint32_t pass[NUMBER_OF_THERMISTORS] = {0};
+    uint32_t code = 0x00400000;
+    settling_start();
+    for (int block = 0; block <= 2 * SETTLING_STEPS; block++) {
+        SettlingBlock kind = block == 0 ? SETTLING_BEFORE : (block & 1) ? SETTLING_CANDIDATE : SETTLING_AFTER;
+        bool unsettled = kind == SETTLING_CANDIDATE && settling_candidate_us(block / 2) <= 200;
+        for (int n = 0; n < SETTLING_BLOCK_PASSES; n++) {
+            code += 40;
+            pass[0] = code + (n & 1);
+            pass[1] = code + (n & 1) + (unsettled ? 2000 : 0);
+            settling_add_pass(pass, CHANNEL_BIT(0) | CHANNEL_BIT(1), kind);
+        }
+        if (kind == SETTLING_AFTER) {
+            settling_end_step(block / 2 - 1);
+        }
+    }
+    unsigned int us = 0;
+    TEST_ASSERT_TRUE(settling_result_us(0, &us));
+    TEST_ASSERT_EQUAL(25 + 7, us);
+    TEST_ASSERT_TRUE(settling_result_us(1, &us));
+    TEST_ASSERT_EQUAL(300 + 75, us);
+    TEST_ASSERT_FALSE(settling_result_us(2, &us));
+}
+
+// An NCMD of one String metric, Text, ending with value: its value field, if any
+static size_t text_command(uint8_t *out, const uint8_t *value, size_t value_len) {
+    static const uint8_t head[] = {0x0a, 4, 'T', 'e', 'x', 't', 0x20, METRIC_DATA_TYPE_STRING};
+    out[0] = 0x12;
+    out[1] = (uint8_t)(sizeof(head) + value_len);
+    memcpy(&out[2], head, sizeof(head));
+    memcpy(&out[2 + sizeof(head)], value, value_len);
+    return 2 + sizeof(head) + value_len;
+}
+
+void test_command_metric_needs_its_value() {
+    static const char *text = "";
+    MetricSpec metrics[] = {metric_spec("Text", 1, true, METRIC_DATA_TYPE_STRING, &text)};
+    static CommandPayload command;
+    uint8_t buffer[32];
+    // A string value is taken
+    static const uint8_t string_value[] = {0x7a, 2, 'h', 'i'};
+    TEST_ASSERT_TRUE(decode_command_payload(buffer, text_command(buffer, string_value, sizeof(string_value)), &command));
+    TEST_ASSERT_TRUE(find_received_metric(metrics, 1, &command.metrics[0]) == &metrics[0]);
+    TEST_ASSERT_EQUAL_STRING("hi", command.metrics[0].value.string_value);
+    // A null one has no string to read
+    static const uint8_t null_value[] = {0x38, 1};
+    TEST_ASSERT_TRUE(decode_command_payload(buffer, text_command(buffer, null_value, sizeof(null_value)), &command));
+    TEST_ASSERT_NULL(find_received_metric(metrics, 1, &command.metrics[0]));
+    TEST_ASSERT_EQUAL(SPARKPLUG_TYPE_MISMATCH, sparkplug_error());
+    // Nor does one sent as an int_value varint
+    static const uint8_t varint_value[] = {0x50, 42};
+    TEST_ASSERT_TRUE(decode_command_payload(buffer, text_command(buffer, varint_value, sizeof(varint_value)), &command));
+    TEST_ASSERT_NULL(find_received_metric(metrics, 1, &command.metrics[0]));
+    TEST_ASSERT_EQUAL(SPARKPLUG_TYPE_MISMATCH, sparkplug_error());
+}
+
+void test_history_keeps_frame_numbers() {
+    history_begin(false);
+    TEST_ASSERT_TRUE(history_last_frame() == 0);
+    ThermistorValue frame[NUMBER_OF_THERMISTORS] = {};
+    for (uint64_t number = 41; number <= 43; number++) {
+        history_store(frame, 25.0f, 0, number * 1000, number);
+    }
+    HistoryRun run;
+    TEST_ASSERT_EQUAL(3, history_peek(0, 8, &run));
+    TEST_ASSERT_TRUE(run.frame[0] == 41);
+    TEST_ASSERT_TRUE(run.frame[2] == 43);
+    TEST_ASSERT_TRUE(history_last_frame() == 43);
+    history_discard(3);
+    TEST_ASSERT_TRUE(history_last_frame() == 43);
+}
+
+void test_split_frame_is_kept_once() {
+    // Not connected, so publish_data() holds the frames in the history
+    history_begin(false);
+    const ChannelMask banks[2] = {0x00FF, ALL_CHANNELS_MASK & ~(ChannelMask)0x00FF};
+    for (int bank = 0; bank < 2; bank++) {
+        channels_frame_begin();
+        channels_frame_end((bank + 1) * 1000, banks[bank], bank == 1);
+        publish_data(Channels.frame, 25.0f, Channels.frame_cycles, Channels.frame_number);
+    }
+    TEST_ASSERT_EQUAL(1, history_count());
+    HistoryRun run;
+    TEST_ASSERT_EQUAL(1, history_peek(0, 8, &run));
+    TEST_ASSERT_TRUE(run.frame[0] == Channels.frame_number);
+    TEST_ASSERT_TRUE(run.cycles[0] == 2000);
+    history_discard(1);
+}
+
+// A network client already connected, answering the CONNECT with a CONNACK and
+// never with room to write, so everything published stays in the queue
+class BackedUpClient : public Client {
+public:
+    int connect(IPAddress ip, uint16_t port) { return 1; }
+    int connect(const char *host, uint16_t port) { return 1; }
+    size_t write(uint8_t b) { return 1; }
+    size_t write(const uint8_t *buf, size_t size) { return size; }
+    int availableForWrite() { return 0; }
+    int available() { return (int)(sizeof(connack) - pos); }
+    int read() { return available() > 0 ? connack[pos++] : -1; }
+    int read(uint8_t *buf, size_t size) {
+        size_t n = 0;
+        while (n < size && available() > 0) {
+            buf[n++] = connack[pos++];
+        }
+        return (int)n;
+    }
+    int peek() { return available() > 0 ? connack[pos] : -1; }
+    void flush() {}
+    void stop() {}
+    uint8_t connected() { return 1; }
+    operator bool() { return true; }
+private:
+    const uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00};
+    size_t pos = 0;
+};
+
+void test_outbound_queue_coalesces_data() {
+    static BackedUpClient client;
+    static PubSubClient broker(client);
+    TEST_ASSERT_TRUE(broker.connect("coalesce"));
+    TEST_ASSERT_TRUE(set_up_outbound_queue(&broker, &client, 1024));
+    TEST_ASSERT_TRUE(set_max_metrics(4));
+    static uint64_t value = 0;
+    MetricSpec metrics[] = {metric_spec("Value", 1, true, METRIC_DATA_TYPE_INT64, &value)};
+    const char *ndata = "spBv1.0/Test/NDATA/Node";
+    const char *ddata = "spBv1.0/Test/DDATA/Node/Device";
+    // Each NDATA replaces the one waiting, and a DDATA waits beside it
+    set_outbound_policy(OUTBOUND_COALESCE);
+    for (int i = 0; i < 3; i++) {
+        value = i;
+        set_up_next_payload();
+        TEST_ASSERT_TRUE(publish_metrics(&broker, 1, ndata, true, metrics, 1));
+    }
+    TEST_ASSERT_EQUAL(1, outbound_queue_depth(&broker));
+    TEST_ASSERT_EQUAL(2, outbound_dropped(&broker));
+    for (int i = 0; i < 2; i++) {
+        set_up_next_payload();
+        TEST_ASSERT_TRUE(publish_metrics(&broker, 1, ddata, true, metrics, 1));
+    }
+    TEST_ASSERT_EQUAL(2, outbound_queue_depth(&broker));
+    TEST_ASSERT_EQUAL(3, outbound_dropped(&broker));
+    // Dropping the oldest, they pile up until the queue is full
+    set_outbound_policy(OUTBOUND_DROP_OLDEST);
+    for (int i = 0; i < 3; i++) {
+        set_up_next_payload();
+        publish_metrics(&broker, 1, ndata, true, metrics, 1);
+    }
+    TEST_ASSERT_EQUAL(4, outbound_queue_depth(&broker));
+    TEST_ASSERT_EQUAL(4, outbound_dropped(&broker));
+}
+
+void test_virtual_channels_text_and_values() {
+    // Terms are kept as written, unit coefficients without a factor
+    TEST_ASSERT_TRUE(virtual_set_channels("T1 - T2; 0.25*T1+0.25*T2+0.5*t3;-2*T4"));
+    TEST_ASSERT_EQUAL(3, virtual_count());
+    char text[VIRTUAL_TEXT_SIZE];
+    virtual_format_channels(text, sizeof(text));
+    TEST_ASSERT_EQUAL_STRING("T1-T2;0.25*T1+0.25*T2+0.5*T3;-2*T4", text);
+
+    float temps[NUMBER_OF_THERMISTORS] = {};
+    temps[0] = 20;
+    temps[1] = 18;
+    temps[2] = 22;
+    temps[3] = 1.5f;
+    float values[MAX_VIRTUAL_CHANNELS];
+    virtual_evaluate(temps, ALL_CHANNELS_MASK, values);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 2, values[0]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 20.5f, values[1]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, -3, values[2]);
+    TEST_ASSERT_TRUE(isnan(values[3]));
+    // Only those reading a thermistor that wasn't read go NAN
+    virtual_evaluate(temps, ALL_CHANNELS_MASK & ~CHANNEL_BIT(1), values);
+    TEST_ASSERT_TRUE(isnan(values[0]) && isnan(values[1]));
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, -3, values[2]);
+
+    // A malformed list changes nothing
+    TEST_ASSERT_FALSE(virtual_set_channels("T1;;T2"));
+    TEST_ASSERT_FALSE(virtual_set_channels("T1 T2"));
+    TEST_ASSERT_FALSE(virtual_set_channels("2T1"));
+    TEST_ASSERT_FALSE(virtual_set_channels("T0"));
+    TEST_ASSERT_EQUAL(3, virtual_count());
+    TEST_ASSERT_TRUE(virtual_set_channels(""));
+    TEST_ASSERT_EQUAL(0, virtual_count());
+}
+
+void test_warm_boot_keeps_reset_cause() {
+    uint64_t bd_seq[2] = {7, 9};
+    warmboot_prepare(bd_seq, 2, RESET_NETWORK_STALL);
+    TEST_ASSERT_TRUE(warmboot_init());
+    ResetCause cause;
+    TEST_ASSERT_TRUE(warmboot_cause(&cause));
+    TEST_ASSERT_EQUAL(RESET_NETWORK_STALL, cause);
+    TEST_ASSERT_EQUAL(1, warmboot_watchdog_reboots());
+    // Watchdog reboots in a row add up; any other reboot starts the count again
+    warmboot_prepare(bd_seq, 2, RESET_LOOP_STALL);
+    TEST_ASSERT_TRUE(warmboot_init());
+    TEST_ASSERT_EQUAL(2, warmboot_watchdog_reboots());
+    warmboot_prepare(bd_seq, 2, RESET_COMMAND);
+    TEST_ASSERT_TRUE(warmboot_init());
+    TEST_ASSERT_EQUAL(0, warmboot_watchdog_reboots());
+    // The block is only trusted once
+    TEST_ASSERT_FALSE(warmboot_init());
+    TEST_ASSERT_FALSE(warmboot_cause(&cause));
+}
+
+void test_data_payload_decodes_compressed() {
+    // A payload DEFLATE'd into the compressed envelope decodes to its metrics,
+    // with the envelope's seq
+    Metric metrics[3];
+    memset(metrics, 0, sizeof(metrics));
+    for (int i = 0; i < 3; i++) {
+        metrics[i].has_alias = true;
+        metrics[i].alias = 100 + i;
+        metrics[i].has_timestamp = true;
+        metrics[i].timestamp = 1760000000000ULL;
+        metrics[i].which_value = org_eclipse_tahu_protobuf_Payload_Metric_float_value_tag;
+        metrics[i].value.float_value = 20.25f;
+    }
+    metrics[1].has_is_historical = true;
+    metrics[1].is_historical = true;
+    metrics[2].which_value = 0;
+    metrics[2].has_is_null = true;
+    metrics[2].is_null = true;
+    Payload payload = org_eclipse_tahu_protobuf_Payload_init_default;
+    payload.has_timestamp = true;
+    payload.timestamp = 1760000000123ULL;
+    payload.metrics = metrics;
+    payload.metrics_count = 3;
+    uint8_t plain[256], deflated[256], inflated[256], envelope[512];
+    pb_ostream_t ostream = pb_ostream_from_buffer(plain, sizeof(plain));
+    TEST_ASSERT_TRUE(pb_encode(&ostream, org_eclipse_tahu_protobuf_Payload_fields, &payload));
+    size_t deflated_len = deflate_compress(plain, ostream.bytes_written, deflated, sizeof(deflated));
+    TEST_ASSERT_TRUE(deflated_len > 0);
+    TEST_ASSERT_EQUAL(ostream.bytes_written, deflate_decompress(deflated, deflated_len, inflated, sizeof(inflated)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(plain, inflated, ostream.bytes_written);
+    deflated[deflated_len - 1] ^= 1;
+    TEST_ASSERT_EQUAL(0, deflate_decompress(deflated, deflated_len, inflated, sizeof(inflated)));
+    deflated[deflated_len - 1] ^= 1;
+
+    PB_BYTES_ARRAY_T(256) body;
+    body.size = deflated_len;
+    memcpy(body.bytes, deflated, deflated_len);
+    Metric algorithm;
+    memset(&algorithm, 0, sizeof(algorithm));
+    algorithm.name = (char *) "algorithm";
+    algorithm.which_value = org_eclipse_tahu_protobuf_Payload_Metric_string_value_tag;
+    algorithm.value.string_value = (char *) "DEFLATE";
+    Payload compressed = org_eclipse_tahu_protobuf_Payload_init_default;
+    compressed.has_seq = true;
+    compressed.seq = 7;
+    compressed.uuid = (char *) "SPBV1.0_COMPRESSED";
+    compressed.body = (pb_bytes_array_t *) &body;
+    compressed.metrics = &algorithm;
+    compressed.metrics_count = 1;
+    ostream = pb_ostream_from_buffer(envelope, sizeof(envelope));
+    TEST_ASSERT_TRUE(pb_encode(&ostream, org_eclipse_tahu_protobuf_Payload_fields, &compressed));
+
+    static DataPayload data;
+    TEST_ASSERT_TRUE(decode_data_payload(envelope, ostream.bytes_written, &data));
+    TEST_ASSERT_TRUE(data.compressed);
+    TEST_ASSERT_TRUE(data.has_seq && data.seq == 7);
+    TEST_ASSERT_TRUE(data.timestamp == payload.timestamp);
+    TEST_ASSERT_EQUAL(3, data.metrics_count);
+    TEST_ASSERT_EQUAL(101, data.metrics[1].alias);
+    TEST_ASSERT_TRUE(data.metrics[1].is_historical);
+    TEST_ASSERT_FLOAT_WITHIN(0, 20.25f, data.metrics[1].value.float_value);
+    TEST_ASSERT_TRUE(data.metrics[2].is_null);
+}
+
 void setup() {
 
     UNITY_BEGIN();    // IMPORTANT LINE!
-
+    RUN_TEST(test_thermistor_block_matches_scalar);
+    RUN_TEST(test_saturated_codes_are_faults);
+    RUN_TEST(test_piecewise_calibration_picks_segment);
+    RUN_TEST(test_raw_code_block_matches_firmware);
+    RUN_TEST(test_channel_sensor_model);
+    RUN_TEST(test_conversions_meet_error_budget);
+    RUN_TEST(test_plain_payload_matches_nanopb);
+    RUN_TEST(test_autorange_normalize);
+    RUN_TEST(test_crc16_ansi_check_value);
+    RUN_TEST(test_spike_filter_rejects_spike);
+    RUN_TEST(test_config_blob_round_trip);
+    RUN_TEST(test_scan_list_text_round_trip);
+    RUN_TEST(test_calibration_upload_forms);
+    RUN_TEST(test_delta_coding_round_trip);
+    RUN_TEST(test_settling_sweep_result);
+    RUN_TEST(test_data_payload_decodes_compressed);
+    RUN_TEST(test_command_metric_needs_its_value);
+    RUN_TEST(test_history_keeps_frame_numbers);
+    RUN_TEST(test_split_frame_is_kept_once);
+    RUN_TEST(test_outbound_queue_coalesces_data);
+    RUN_TEST(test_virtual_channels_text_and_values);
+    RUN_TEST(test_warm_boot_keeps_reset_cause);
+#ifdef USE_MILLIDEGREE_NDATA
+    RUN_TEST(test_millidegree_block_matches_float);
+#endif
+    UNITY_END();
 }
 
 void loop() {
@@ -0,0 +1,52 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file performance_limits.h
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Limits of the performance regression suite. A case over its limit
+ * fails the run. Cycles are 600 MHz cycles: DWT cycles on the board, host
+ * nanoseconds scaled on the workstation, which is why the native limits only
+ * catch gross regressions. Lower a limit when an optimization lands; raise one
+ * only with the reason in the commit message.
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#ifndef PERFORMANCE_LIMITS_H
+#define PERFORMANCE_LIMITS_H
+
+#include "thermistorMux_global.h"
+
+#ifndef NATIVE_BUILD
+// Teensy 4.1, cycles per operation
+#define LIMIT_THERMISTOR_TEMP_CYCLES    800     // convert_thermistor_temp(), a code
+#define LIMIT_THERMISTOR_BLOCK_CYCLES   120     // convert_thermistor_block_calibrated(), a code
+#define LIMIT_FRAME_CYCLES              (4000 + 400 * NUMBER_OF_THERMISTORS)    // A frame, codes to encoded NDATA
+#define LIMIT_NDATA_ENCODE_CYCLES       (1000 + 150 * NUMBER_OF_THERMISTORS)    // encode_payload() of the NDATA
+#else
+// Workstation, cycles per operation
+#define LIMIT_THERMISTOR_TEMP_CYCLES    100
+#define LIMIT_THERMISTOR_BLOCK_CYCLES   20
+#define LIMIT_FRAME_CYCLES              (1000 + 100 * NUMBER_OF_THERMISTORS)
+#define LIMIT_NDATA_ENCODE_CYCLES       (500 + 50 * NUMBER_OF_THERMISTORS)
+#endif
+
+// Encoded payload sizes, bytes, the same on every target: the suite's NDATA of
+// every thermistor, and its NBIRTH
+#define LIMIT_NDATA_BYTES               (40 + 18 * NUMBER_OF_THERMISTORS)
+#define LIMIT_NBIRTH_BYTES              (200 + 42 * NUMBER_OF_THERMISTORS)
+
+#endif
@@ -0,0 +1,259 @@
+/*******************************************************************************
+Copyright 2021
+Steward Observatory Engineering & Technical Services, University of Arizona
+This program is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <https://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+/**
+ * @file test_performance.cpp
+ * @author Nestor Garcia (Nestor212@email.arizona.edu)
+ * @brief Performance regression suite: the per-frame hot paths are timed as
+ * benchmark/benchmark_hot_paths.cpp times them, and each case fails if it is
+ * over its limit in performance_limits.h. Covers code conversion, a frame from
+ * codes to encoded NDATA, NDATA encoding, and the NDATA and NBIRTH sizes.
+ *
+ *     pio test -e teensy41_perf
+ *     pio test -e native_perf
+ * @version (see THERMISTOR_MUX_VERSION in thermistorMux_global.h)
+ * @date 2022-05-28
+ *
+ * @copyright Copyright (c) 2022
+ */
+
+#include <Arduino.h>
+#include <unity.h>
+#include <stdio.h>
+#include "command_ADC.h"
+#include "cf_sparkplug.h"
+#include "thermistorMux_global.h"
+#include "performance_limits.h"
+
+#define PERF_BATCHES    5       // Best batch is measured
+#define PERF_CALLS      200     // Calls of the case function per batch
+#define PERF_BUF_SIZE   4096    // Encoded payload buffer
+
+// The suite's metrics mirror the node's NDATA, as the benchmarks' do: a few
+// control metrics and a float per thermistor. Aliases are the array indices.
+enum PerfAlias {
+    PMA_Rebirth,
+    PMA_Deadband,
+    PMA_HeartbeatInterval,
+    PMA_FirmwareVersion,
+    PMA_THERMISTOR1,
+    PMA_End = PMA_THERMISTOR1 + NUMBER_OF_THERMISTORS
+};
+
+static bool m_rebirth = false;
+static float m_deadband = 0.05;
+static uint64_t m_heartbeat_interval = 1000;
+static const char *m_firmware_version = THERMISTOR_MUX_VERSION;
+static float m_temps[NUMBER_OF_THERMISTORS];
+static char m_names[NUMBER_OF_THERMISTORS][24];
+static MetricSpec m_metrics[PMA_End];
+
+static uint32_t m_codes[NUMBER_OF_THERMISTORS];
+static float m_gain[NUMBER_OF_THERMISTORS];
+static float m_offset[NUMBER_OF_THERMISTORS];
+
+static uint8_t m_buffer[PERF_BUF_SIZE];
+static size_t m_encoded_len = 0;
+static char m_message[96];
+
+// Results are summed in here so the compiler can't drop the work
+static volatile float m_sink;
+
+
+static unsigned long long perf_timestamp(void) {
+    return 1654000000000ULL;
+}
+
+
+/*
+Codes spread over the working range of the divider, with a calibration close to
+what a sweep produces, and the metrics registered as the network module does.
+*/
+static void set_up_suite() {
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        m_codes[i] = 0x00280000 + i * 0x00010000;
+        m_gain[i] = 1.0f + i * 0.0001f;
+        m_offset[i] = -0.05f + i * 0.002f;
+        m_temps[i] = convert_thermistor_temp(m_codes[i]);
+    }
+
+    m_metrics[PMA_Rebirth] = metric_spec("Node Control/Rebirth", PMA_Rebirth, true, METRIC_DATA_TYPE_BOOLEAN, &m_rebirth);
+    m_metrics[PMA_Deadband] = metric_spec("Node Control/Deadband", PMA_Deadband, true, METRIC_DATA_TYPE_FLOAT, &m_deadband);
+    m_metrics[PMA_HeartbeatInterval] = metric_spec("Node Control/Heartbeat Interval", PMA_HeartbeatInterval, true,
+                                                   METRIC_DATA_TYPE_INT64, &m_heartbeat_interval);
+    m_metrics[PMA_FirmwareVersion] = metric_spec("Properties/Firmware Version", PMA_FirmwareVersion, false,
+                                                 METRIC_DATA_TYPE_STRING, &m_firmware_version);
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        snprintf(m_names[i], sizeof(m_names[i]), "Inputs/THERMISTOR%d", i + 1);
+        m_metrics[PMA_THERMISTOR1 + i] = metric_spec(m_names[i], (unsigned int)(PMA_THERMISTOR1 + i), false,
+                                                     METRIC_DATA_TYPE_FLOAT, &m_temps[i]);
+    }
+    set_gettimestamp_callback(perf_timestamp);
+    set_max_metrics(PMA_End);
+}
+
+
+static void run_thermistor_temp() {
+    float sum = 0;
+    for (int i = 0; i < NUMBER_OF_THERMISTORS; i++) {
+        sum += convert_thermistor_temp(m_codes[i]);
+    }
+    m_sink = sum;
+}
+
+
+static void run_thermistor_block() {
+    convert_thermistor_block_calibrated(m_codes, m_gain, m_offset, m_temps, NUMBER_OF_THERMISTORS);
+    m_sink = m_temps[0];
+}
+
+
+/*
+The NDATA the network module builds from a frame: the thermistor block marked
+updated and collected into the payload.
+*/
+static void build_ndata() {
+    set_up_next_payload();
+    update_metric_range(m_metrics, PMA_End, PMA_THERMISTOR1, NUMBER_OF_THERMISTORS, 0);
+    add_metrics(false, m_metrics, PMA_End);
+}
+
+
+static void build_nbirth() {
+    set_up_nbirth_payload();
+    add_metrics(true, m_metrics, PMA_End);
+}
+
+
+static void run_encode() {
+    m_encoded_len = encode_payload(m_buffer, sizeof(m_buffer));
+}
+
+
+static void run_frame() {
+    run_thermistor_block();
+    build_ndata();
+    run_encode();
+}
+
+
+/*
+Times run() in PERF_BATCHES batches of PERF_CALLS calls and returns the cycles
+per operation of the fastest batch, rounded up. prepare() runs once, untimed.
+*/
+static uint32_t measure_cycles(void (*prepare)(void), void (*run)(void), unsigned int ops) {
+    if (prepare != NULL) {
+        prepare();
+    }
+    run();      // Warm the caches
+    uint32_t best = UINT32_MAX;
+    for (int batch = 0; batch < PERF_BATCHES; batch++) {
+        uint32_t start = ARM_DWT_CYCCNT;
+        for (int call = 0; call < PERF_CALLS; call++) {
+            run();
+        }
+        uint32_t cycles = ARM_DWT_CYCCNT - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    uint32_t per_call_ops = PERF_CALLS * ops;
+    return (best + per_call_ops - 1) / per_call_ops;
+}
+
+
+/*
+Fails the case if measured is over limit; either way the measurement is
+reported, so the run's output doubles as a record of the numbers.
+*/
+static void check_limit(const char *what, uint32_t measured, uint32_t limit) {
+    snprintf(m_message, sizeof(m_message), "%s: %lu (limit %lu)", what, (unsigned long)measured,
+             (unsigned long)limit);
+    TEST_MESSAGE(m_message);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32_MESSAGE(limit, measured, m_message);
+}
+
+
+void test_metrics_check() {
+    TEST_ASSERT_TRUE(check_metrics(m_metrics, PMA_End, PMA_End));
+}
+
+
+void test_thermistor_temp_cycles() {
+    check_limit("convert_thermistor_temp cycles/code",
+                measure_cycles(NULL, run_thermistor_temp, NUMBER_OF_THERMISTORS), LIMIT_THERMISTOR_TEMP_CYCLES);
+}
+
+
+void test_thermistor_block_cycles() {
+    check_limit("convert_thermistor_block_calibrated cycles/code",
+                measure_cycles(NULL, run_thermistor_block, NUMBER_OF_THERMISTORS), LIMIT_THERMISTOR_BLOCK_CYCLES);
+}
+
+
+void test_frame_cycles() {
+    check_limit("Frame to NDATA cycles", measure_cycles(NULL, run_frame, 1), LIMIT_FRAME_CYCLES);
+}
+
+
+void test_ndata_encode_cycles() {
+    check_limit("NDATA encode cycles", measure_cycles(build_ndata, run_encode, 1), LIMIT_NDATA_ENCODE_CYCLES);
+}
+
+
+void test_ndata_size() {
+    build_ndata();
+    run_encode();
+    TEST_ASSERT_TRUE(m_encoded_len > 0);
+    check_limit("NDATA bytes", (uint32_t)m_encoded_len, LIMIT_NDATA_BYTES);
+}
+
+
+void test_nbirth_size() {
+    build_nbirth();
+    run_encode();
+    TEST_ASSERT_TRUE(m_encoded_len > 0);
+    check_limit("NBIRTH bytes", (uint32_t)m_encoded_len, LIMIT_NBIRTH_BYTES);
+}
+
+
+static int run_suite() {
+    UNITY_BEGIN();
+    set_up_suite();
+    RUN_TEST(test_metrics_check);
+    RUN_TEST(test_thermistor_temp_cycles);
+    RUN_TEST(test_thermistor_block_cycles);
+    RUN_TEST(test_frame_cycles);
+    RUN_TEST(test_ndata_encode_cycles);
+    RUN_TEST(test_ndata_size);
+    RUN_TEST(test_nbirth_size);
+    return UNITY_END();
+}
+
+
+void setup() {
+    // Time for the serial monitor to attach
+    delay(2000);
+    run_suite();
+}
+
+
+void loop() {
+}
+
+
+#ifdef NATIVE_BUILD
+int main() {
+    return run_suite();
+}
+#endif